@@ -21,6 +21,6 @@ fi
 [ -f lodepng.o ] || "$CXX" lodepng.cpp -O3 -o lodepng.o -c
 
 "$CXX" -O3 -DFASTLL_ENABLE_NEON_INTRINSICS -fopenmp \
-  -I. lodepng.o \
-  "${DIR}"/fast_lossless.cc "${DIR}"/fast_lossless_main.cc \
+  -I. -I"${DIR}"/../.. lodepng.o \
+  "${DIR}"/../../lib/jxl/enc_fast_lossless.cc "${DIR}"/fast_lossless_main.cc \
   -o fast_lossless
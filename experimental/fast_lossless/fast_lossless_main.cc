@@ -10,10 +10,20 @@
 #include <chrono>
 #include <thread>
 
-#include "fast_lossless.h"
+#include "lib/jxl/enc_fast_lossless.h"
 #include "lodepng.h"
 #include "pam-input.h"
 
+namespace {
+void OpenMPRunner(void* /*runner_opaque*/, void* opaque,
+                  void fun(void*, size_t), size_t count) {
+#pragma omp parallel for
+  for (size_t i = 0; i < count; i++) {
+    fun(opaque, i);
+  }
+}
+}  // namespace
+
 int main(int argc, char** argv) {
   if (argc < 3) {
     fprintf(stderr, "Usage: %s in.png out.jxl [effort] [num_reps]\n", argv[0]);
@@ -51,8 +61,9 @@ int main(int argc, char** argv) {
   auto start = std::chrono::high_resolution_clock::now();
   for (size_t _ = 0; _ < num_reps; _++) {
     free(encoded);
-    encoded_size = FastLosslessEncode(png, width, stride, height, nb_chans,
-                                      bitdepth, effort, &encoded);
+    encoded_size = JxlFastLosslessEncode(
+        png, width, stride, height, nb_chans, bitdepth, effort,
+        /*frame_only=*/false, &encoded, nullptr, OpenMPRunner);
   }
   auto stop = std::chrono::high_resolution_clock::now();
   if (num_reps > 1) {
@@ -52,8 +52,8 @@ Status SetFromBytes(const Span<const uint8_t> bytes,
 Status SetFromFile(const std::string& pathname,
                    const extras::ColorHints& color_hints, CodecInOut* io,
                    ThreadPool* pool, extras::Codec* orig_codec) {
-  PaddedBytes encoded;
-  JXL_RETURN_IF_ERROR(ReadFile(pathname, &encoded));
+  FileContents encoded;
+  JXL_RETURN_IF_ERROR(encoded.Open(pathname));
   JXL_RETURN_IF_ERROR(SetFromBytes(Span<const uint8_t>(encoded), color_hints,
                                    io, pool, orig_codec));
   return true;
@@ -15,6 +15,7 @@
 #include "gtest/gtest.h"
 #include "lib/extras/dec/pgx.h"
 #include "lib/extras/dec/pnm.h"
+#include "lib/extras/enc/pnm.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/random.h"
 #include "lib/jxl/base/thread_pool_internal.h"
@@ -396,6 +397,144 @@ TEST(CodecTest, TestWideGamut) {
 
 TEST(CodecTest, TestPNM) { TestCodecPNM(); }
 
+// Writes the rows of a random image with PNMRowWriter, in segments of
+// scattered rows, and checks that the file matches EncodeImagePNM.
+void TestPNMRowWriter(const JxlPixelFormat& format) {
+  constexpr size_t kXSize = 37;
+  constexpr size_t kYSize = 23;
+  PackedPixelFile ppf;
+  ppf.info.xsize = kXSize;
+  ppf.info.ysize = kYSize;
+  ppf.info.num_color_channels = format.num_channels <= 2 ? 1 : 3;
+  ppf.info.alpha_bits = format.num_channels % 2 == 0 ? 8 : 0;
+  ppf.frames.emplace_back(kXSize, kYSize, format);
+  PackedImage& color = ppf.frames[0].color;
+  uint8_t* pixels = reinterpret_cast<uint8_t*>(color.pixels());
+  Rng rng(0);
+  for (size_t i = 0; i < color.pixels_size; i++) {
+    pixels[i] = rng.UniformU(0, 256);
+  }
+  if (format.data_type == JXL_TYPE_FLOAT) {
+    float* samples = reinterpret_cast<float*>(color.pixels());
+    for (size_t i = 0; i < color.pixels_size / sizeof(float); i++) {
+      samples[i] = rng.UniformF(0.0f, 1.0f);
+    }
+  }
+  std::vector<uint8_t> expected;
+  ASSERT_TRUE(EncodeImagePNM(ppf, color.BitsPerChannel(format.data_type),
+                             nullptr, 0, &expected));
+
+  FILE* file = tmpfile();
+  ASSERT_NE(nullptr, file);
+  PNMRowWriter writer;
+  ASSERT_TRUE(writer.Init(ppf.info, format, file));
+  const size_t pixel_size =
+      format.num_channels * PackedImage::BitsPerChannel(format.data_type) / 8;
+  // Odd rows in two segments, then even rows whole, from the bottom.
+  for (size_t y = 1; y < kYSize; y += 2) {
+    writer.AddPixels(10, y, kXSize - 10, pixels + y * color.stride +
+                                             10 * pixel_size);
+    writer.AddPixels(0, y, 10, pixels + y * color.stride);
+  }
+  for (size_t y = (kYSize - 1) / 2 * 2 + 2; y >= 2; y -= 2) {
+    writer.AddPixels(0, y - 2, kXSize, pixels + (y - 2) * color.stride);
+  }
+  ASSERT_TRUE(writer.Finalize());
+  // The rows wait for row 0, which comes last, unless they are written at
+  // their offset (PFM).
+  EXPECT_EQ(format.data_type == JXL_TYPE_FLOAT ? 1 : kYSize - 1,
+            writer.max_pending_rows());
+
+  std::vector<uint8_t> actual(expected.size() + 1);
+  rewind(file);
+  EXPECT_EQ(expected.size(), fread(actual.data(), 1, actual.size(), file));
+  actual.resize(expected.size());
+  fclose(file);
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(CodecTest, PNMRowWriter) {
+  TestPNMRowWriter({3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0});
+  TestPNMRowWriter({1, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0});
+  TestPNMRowWriter({4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0});
+  TestPNMRowWriter({3, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0});
+}
+
+// Reads a random image written by EncodeImagePNM with PNMRowReader, in strips
+// of rows, and checks that it matches DecodeImagePNM.
+void TestPNMRowReader(const JxlPixelFormat& format) {
+  constexpr size_t kXSize = 37;
+  constexpr size_t kYSize = 23;
+  PackedPixelFile ppf;
+  ppf.info.xsize = kXSize;
+  ppf.info.ysize = kYSize;
+  ppf.info.num_color_channels = format.num_channels <= 2 ? 1 : 3;
+  ppf.info.alpha_bits = format.num_channels % 2 == 0 ? 8 : 0;
+  ppf.frames.emplace_back(kXSize, kYSize, format);
+  PackedImage& color = ppf.frames[0].color;
+  Rng rng(0);
+  if (format.data_type == JXL_TYPE_FLOAT) {
+    float* samples = reinterpret_cast<float*>(color.pixels());
+    for (size_t i = 0; i < color.pixels_size / sizeof(float); i++) {
+      samples[i] = rng.UniformF(0.0f, 1.0f);
+    }
+  } else {
+    uint8_t* pixels = reinterpret_cast<uint8_t*>(color.pixels());
+    for (size_t i = 0; i < color.pixels_size; i++) {
+      pixels[i] = rng.UniformU(0, 256);
+    }
+  }
+  std::vector<uint8_t> encoded;
+  ASSERT_TRUE(EncodeImagePNM(ppf, color.BitsPerChannel(format.data_type),
+                             nullptr, 0, &encoded));
+  PackedPixelFile expected;
+  ASSERT_TRUE(DecodeImagePNM(Span<const uint8_t>(encoded), ColorHints(),
+                             SizeConstraints(), &expected));
+  const PackedImage& expected_color = expected.frames[0].color;
+
+  FILE* file = tmpfile();
+  ASSERT_NE(nullptr, file);
+  ASSERT_EQ(encoded.size(), fwrite(encoded.data(), 1, encoded.size(), file));
+  PNMRowReader reader;
+  PackedPixelFile actual;
+  ASSERT_TRUE(reader.Init(file, ColorHints(), SizeConstraints(), &actual));
+  EXPECT_EQ(kXSize, actual.info.xsize);
+  EXPECT_EQ(kYSize, actual.info.ysize);
+  EXPECT_EQ(expected.info.bits_per_sample, actual.info.bits_per_sample);
+  EXPECT_EQ(expected.info.num_color_channels, actual.info.num_color_channels);
+  EXPECT_EQ(expected.info.alpha_bits, actual.info.alpha_bits);
+  EXPECT_EQ(expected_color.format.num_channels, reader.format().num_channels);
+  EXPECT_EQ(expected_color.format.data_type, reader.format().data_type);
+  EXPECT_EQ(expected_color.format.endianness, reader.format().endianness);
+  EXPECT_TRUE(actual.frames.empty());
+
+  // Strips that do not divide the height, and one row read again.
+  const size_t row_size = expected_color.stride;
+  std::vector<uint8_t> strip(5 * row_size);
+  for (size_t y0 = 0; y0 < kYSize; y0 += 5) {
+    const size_t num_rows = std::min<size_t>(5, kYSize - y0);
+    ASSERT_TRUE(reader.ReadRows(y0, num_rows, strip.data(), strip.size()));
+    for (size_t y = y0; y < y0 + num_rows; y++) {
+      const size_t expected_y =
+          expected_color.flipped_y ? kYSize - 1 - y : y;
+      EXPECT_EQ(0, memcmp(strip.data() + (y - y0) * row_size,
+                          static_cast<const uint8_t*>(expected_color.pixels()) +
+                              expected_y * row_size,
+                          row_size))
+          << "y = " << y;
+    }
+  }
+  ASSERT_TRUE(reader.ReadRows(kYSize - 1, 1, strip.data(), row_size));
+  fclose(file);
+}
+
+TEST(CodecTest, PNMRowReader) {
+  TestPNMRowReader({3, JXL_TYPE_UINT8, JXL_BIG_ENDIAN, 0});
+  TestPNMRowReader({1, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0});
+  TestPNMRowReader({4, JXL_TYPE_UINT8, JXL_BIG_ENDIAN, 0});
+  TestPNMRowReader({3, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0});
+}
+
 }  // namespace
 }  // namespace extras
 }  // namespace jxl
@@ -280,8 +280,9 @@ constexpr uint32_t kId_gAMA = 0x414D4167;
 constexpr uint32_t kId_cHRM = 0x4D524863;
 constexpr uint32_t kId_eXIf = 0x66495865;
 
+// Where libpng writes the rows of the frame being decoded: straight into the
+// PackedImage of the frame.
 struct APNGFrame {
-  std::vector<uint8_t> pixels;
   std::vector<uint8_t*> rows;
   unsigned int w, h, delay_num, delay_den;
 };
@@ -315,7 +316,6 @@ void row_fn(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num,
   APNGFrame* frame = (APNGFrame*)png_get_progressive_ptr(png_ptr);
   JXL_CHECK(frame);
   JXL_CHECK(row_num < frame->rows.size());
-  JXL_CHECK(frame->rows[row_num] < frame->pixels.data() + frame->pixels.size());
   png_progressive_combine_row(png_ptr, frame->rows[row_num], new_row);
 }
 
@@ -409,8 +409,8 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
                        const SizeConstraints& constraints,
                        PackedPixelFile* ppf) {
   Reader r;
-  unsigned int id, j, w, h, w0, h0, x0, y0;
-  unsigned int delay_num, delay_den, dop, bop, rowbytes, imagesize;
+  unsigned int id, w, h, w0, h0, x0, y0;
+  unsigned int delay_num, delay_den, dop, bop;
   unsigned char sig[8];
   png_structp png_ptr = nullptr;
   png_infop info_ptr = nullptr;
@@ -422,7 +422,6 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
   APNGFrame frameRaw = {};
   uint32_t num_channels;
   JxlPixelFormat format;
-  unsigned int bytes_per_pixel = 0;
 
   struct FrameInfo {
     PackedImage data;
@@ -434,6 +433,24 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
   };
 
   std::vector<FrameInfo> frames;
+  // Whether the last of `frames` is still being decoded.
+  bool frame_started = false;
+  // Allocates the next frame and points libpng to its rows, once the pixel
+  // format is known. Returns false if the frame was already started.
+  const auto start_frame = [&]() {
+    if (frame_started) return false;
+    const uint32_t duration = delay_num * 1000 / delay_den;
+    frames.push_back(FrameInfo{PackedImage(w0, h0, format), duration, x0, w0,
+                               y0, h0, dop, bop});
+    PackedImage& image = frames.back().data;
+    frameRaw.rows.resize(h0);
+    uint8_t* const pixels = static_cast<uint8_t*>(image.pixels());
+    for (size_t y = 0; y < h0; ++y) {
+      frameRaw.rows[y] = pixels + image.stride * y;
+    }
+    frame_started = true;
+    return true;
+  };
 
   // Make sure png memory is released in any case.
   auto scope_guard = MakeScopeGuard([&]() {
@@ -494,15 +511,12 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
                    (id == kId_fcTL && (!hasInfo || isAnimated))) {
           if (hasInfo) {
             if (!processing_finish(png_ptr, info_ptr, &ppf->metadata)) {
-              // Allocates the frame buffer.
-              uint32_t duration = delay_num * 1000 / delay_den;
-              frames.push_back(FrameInfo{PackedImage(w0, h0, format), duration,
-                                         x0, w0, y0, h0, dop, bop});
-              auto& frame = frames.back().data;
-              for (size_t y = 0; y < h0; ++y) {
-                memcpy(static_cast<uint8_t*>(frame.pixels()) + frame.stride * y,
-                       frameRaw.rows[y], bytes_per_pixel * w0);
+              if (start_frame()) {
+                // The frame had no image data.
+                PackedImage& image = frames.back().data;
+                memset(image.pixels(), 0, image.pixels_size);
               }
+              frame_started = false;
             } else {
               break;
             }
@@ -594,19 +608,16 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
               /*endianness=*/JXL_BIG_ENDIAN,
               /*align=*/0,
           };
-          bytes_per_pixel =
-              num_channels * (format.data_type == JXL_TYPE_UINT16 ? 2 : 1);
-          rowbytes = w * bytes_per_pixel;
-          imagesize = h * rowbytes;
-          frameRaw.pixels.resize(imagesize);
-          frameRaw.rows.resize(h);
-          for (j = 0; j < h; j++)
-            frameRaw.rows[j] = frameRaw.pixels.data() + j * rowbytes;
+          // The default image is decoded at the size of the image, so it can
+          // only be the first frame if their sizes match.
+          if (w0 != w || h0 != h) break;
+          start_frame();
 
           if (processing_data(png_ptr, info_ptr, chunk.data(), chunk.size())) {
             break;
           }
         } else if (id == kId_fdAT && isAnimated) {
+          if (hasInfo) start_frame();
           png_save_uint_32(chunk.data() + 4, chunk.size() - 16);
           memcpy(chunk.data() + 8, "IDAT", 4);
           if (processing_data(png_ptr, info_ptr, chunk.data() + 4,
@@ -5,11 +5,18 @@
 
 #include "lib/extras/dec/exr.h"
 
+#include <ImfChannelList.h>
 #include <ImfChromaticitiesAttribute.h>
+#include <ImfFrameBuffer.h>
+#include <ImfHeader.h>
 #include <ImfIO.h>
-#include <ImfRgbaFile.h>
+#include <ImfInputFile.h>
 #include <ImfStandardAttributes.h>
+#include <ImfThreading.h>
 
+#include <algorithm>
+#include <cstddef>
+#include <thread>
 #include <vector>
 
 namespace jxl {
@@ -59,6 +66,22 @@ class InMemoryIStream : public OpenEXR::IStream {
   size_t pos_ = 0;
 };
 
+// Makes `input` read the R, G, B and optionally A channels as interleaved
+// half floats, with the pixel at (x, y) in the EXR coordinates at
+// base + x * pixel_size + y * stride.
+void SetHalfFrameBuffer(char* base, size_t pixel_size, size_t stride,
+                        bool has_alpha, OpenEXR::InputFile* input) {
+  OpenEXR::FrameBuffer frame_buffer;
+  const char* const kChannels[] = {"R", "G", "B", "A"};
+  for (size_t c = 0; c < (has_alpha ? 4 : 3); ++c) {
+    frame_buffer.insert(
+        kChannels[c], OpenEXR::Slice(OpenEXR::HALF,
+                                     base + c * kExrBitsPerSample / 8,
+                                     pixel_size, stride));
+  }
+  input->setFrameBuffer(frame_buffer);
+}
+
 }  // namespace
 
 Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
@@ -66,30 +89,40 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf) {
   InMemoryIStream is(bytes);
 
+  // OpenEXR decompresses the line buffers on its global thread pool, which has
+  // no threads unless a tool sized it, e.g. in EncodeImageEXR.
+  if (OpenEXR::globalThreadCount() == 0) {
+    OpenEXR::setGlobalThreadCount(
+        std::max(1u, std::thread::hardware_concurrency()));
+  }
+
 #ifdef __EXCEPTIONS
-  std::unique_ptr<OpenEXR::RgbaInputFile> input_ptr;
+  std::unique_ptr<OpenEXR::InputFile> input_ptr;
   try {
-    input_ptr.reset(new OpenEXR::RgbaInputFile(is));
+    input_ptr.reset(new OpenEXR::InputFile(is));
   } catch (...) {
     return JXL_FAILURE("OpenEXR failed to parse input");
   }
-  OpenEXR::RgbaInputFile& input = *input_ptr;
+  OpenEXR::InputFile& input = *input_ptr;
 #else
-  OpenEXR::RgbaInputFile input(is);
+  OpenEXR::InputFile input(is);
 #endif
 
-  if ((input.channels() & OpenEXR::RgbaChannels::WRITE_RGB) !=
-      OpenEXR::RgbaChannels::WRITE_RGB) {
+  const OpenEXR::ChannelList& channels = input.header().channels();
+  if (channels.findChannel("R") == nullptr ||
+      channels.findChannel("G") == nullptr ||
+      channels.findChannel("B") == nullptr) {
     return JXL_FAILURE("only RGB OpenEXR files are supported");
   }
-  const bool has_alpha = (input.channels() & OpenEXR::RgbaChannels::WRITE_A) ==
-                         OpenEXR::RgbaChannels::WRITE_A;
+  const bool has_alpha = channels.findChannel("A") != nullptr;
 
   const float intensity_target = OpenEXR::hasWhiteLuminance(input.header())
                                      ? OpenEXR::whiteLuminance(input.header())
                                      : kDefaultIntensityTarget;
 
-  auto image_size = input.displayWindow().size();
+  const Imath::Box2i& data_window = input.header().dataWindow();
+  const Imath::Box2i& display_window = input.header().displayWindow();
+  auto image_size = display_window.size();
   // Size is computed as max - min, but both bounds are inclusive.
   ++image_size.x;
   ++image_size.y;
@@ -110,42 +143,46 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
   // Allocates the frame buffer.
   ppf->frames.emplace_back(image_size.x, image_size.y, format);
   const auto& frame = ppf->frames.back();
-
-  const int row_size = input.dataWindow().size().x + 1;
-  // Number of rows to read at a time.
-  // https://www.openexr.com/documentation/ReadingAndWritingImageFiles.pdf
-  // recommends reading the whole file at once.
-  const int y_chunk_size = input.displayWindow().size().y + 1;
-  std::vector<OpenEXR::Rgba> input_rows(row_size * y_chunk_size);
-  for (int start_y =
-           std::max(input.dataWindow().min.y, input.displayWindow().min.y);
-       start_y <=
-       std::min(input.dataWindow().max.y, input.displayWindow().max.y);
-       start_y += y_chunk_size) {
-    // Inclusive.
-    const int end_y = std::min(
-        start_y + y_chunk_size - 1,
-        std::min(input.dataWindow().max.y, input.displayWindow().max.y));
-    input.setFrameBuffer(
-        input_rows.data() - input.dataWindow().min.x - start_y * row_size,
-        /*xStride=*/1, /*yStride=*/row_size);
-    input.readPixels(start_y, end_y);
-    for (int exr_y = start_y; exr_y <= end_y; ++exr_y) {
-      const int image_y = exr_y - input.displayWindow().min.y;
-      const OpenEXR::Rgba* const JXL_RESTRICT input_row =
-          &input_rows[(exr_y - start_y) * row_size];
-      uint8_t* row = static_cast<uint8_t*>(frame.color.pixels()) +
-                     frame.color.stride * image_y;
-      const uint32_t pixel_size =
-          (3 + (has_alpha ? 1 : 0)) * kExrBitsPerSample / 8;
-      for (int exr_x =
-               std::max(input.dataWindow().min.x, input.displayWindow().min.x);
-           exr_x <=
-           std::min(input.dataWindow().max.x, input.displayWindow().max.x);
-           ++exr_x) {
-        const int image_x = exr_x - input.displayWindow().min.x;
-        memcpy(row + image_x * pixel_size,
-               input_row + (exr_x - input.dataWindow().min.x), pixel_size);
+  char* const pixels = static_cast<char*>(frame.color.pixels());
+  // Signed, since the EXR coordinates can be negative.
+  const ptrdiff_t stride = frame.color.stride;
+  const ptrdiff_t pixel_size = format.num_channels * kExrBitsPerSample / 8;
+
+  // Inclusive bounds of the part of the data window that is displayed.
+  const int start_x = std::max(data_window.min.x, display_window.min.x);
+  const int end_x = std::min(data_window.max.x, display_window.max.x);
+  const int start_y = std::max(data_window.min.y, display_window.min.y);
+  const int end_y = std::min(data_window.max.y, display_window.max.y);
+  if (start_x <= end_x && start_y <= end_y) {
+    if (data_window.min.x >= display_window.min.x &&
+        data_window.max.x <= display_window.max.x) {
+      // The rows of the data window are inside the frame, so OpenEXR converts
+      // the pixels straight into it. This is the usual case, where both
+      // windows are the same.
+      SetHalfFrameBuffer(pixels - display_window.min.x * pixel_size -
+                             display_window.min.y * stride,
+                         pixel_size, stride, has_alpha, &input);
+      input.readPixels(start_y, end_y);
+    } else {
+      // Rows wider than the frame are read a few at a time into a scratch
+      // buffer, from which their displayed part is copied.
+      const ptrdiff_t row_size =
+          (data_window.max.x - data_window.min.x + 1) * pixel_size;
+      constexpr int kChunkRows = 64;
+      std::vector<char> rows(row_size * kChunkRows);
+      for (int chunk_y = start_y; chunk_y <= end_y; chunk_y += kChunkRows) {
+        const int chunk_end_y = std::min(chunk_y + kChunkRows - 1, end_y);
+        SetHalfFrameBuffer(rows.data() - data_window.min.x * pixel_size -
+                               chunk_y * row_size,
+                           pixel_size, row_size, has_alpha, &input);
+        input.readPixels(chunk_y, chunk_end_y);
+        for (int exr_y = chunk_y; exr_y <= chunk_end_y; ++exr_y) {
+          memcpy(pixels + (exr_y - display_window.min.y) * stride +
+                     (start_x - display_window.min.x) * pixel_size,
+                 rows.data() + (exr_y - chunk_y) * row_size +
+                     (start_x - data_window.min.x) * pixel_size,
+                 (end_x - start_x + 1) * pixel_size);
+        }
       }
     }
   }
@@ -302,38 +302,47 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
       }
     }
 
-    // Update the canvas by creating a copy first.
-    PackedImage new_canvas_image(canvas.color.xsize, canvas.color.ysize,
-                                 canvas.color.format);
-    memcpy(new_canvas_image.pixels(), canvas.color.pixels(),
-           new_canvas_image.pixels_size);
-    for (size_t y = 0, byte_index = 0; y < image_rect.ysize(); ++y) {
-      // Assumes format.align == 0. row points to the beginning of the y row in
-      // the image_rect.
-      PackedRgba* row = static_cast<PackedRgba*>(new_canvas_image.pixels()) +
-                        (y + image_rect.y0()) * new_canvas_image.xsize +
-                        image_rect.x0();
-      for (size_t x = 0; x < image_rect.xsize(); ++x, ++byte_index) {
-        const GifByteType byte = image.RasterBits[byte_index];
-        if (byte >= color_map->ColorCount) {
-          return JXL_FAILURE("GIF color is out of bounds");
-        }
+    // The frame is painted on the canvas only if it is read back from there,
+    // and instead of working on a copy of the whole canvas, only the pixels
+    // under the frame are saved if they must be restored afterwards.
+    const auto canvas_row = [&canvas](size_t y) {
+      // Assumes format.align == 0.
+      return static_cast<PackedRgba*>(canvas.color.pixels()) +
+             y * canvas.color.xsize;
+    };
+    std::vector<PackedRgba> saved_pixels;
+    if (replace && gcb.DisposalMode == DISPOSE_PREVIOUS) {
+      saved_pixels.resize(image_rect.xsize() * image_rect.ysize());
+      for (size_t y = 0; y < image_rect.ysize(); ++y) {
+        memcpy(saved_pixels.data() + y * image_rect.xsize(),
+               canvas_row(y + image_rect.y0()) + image_rect.x0(),
+               image_rect.xsize() * sizeof(PackedRgba));
+      }
+    }
+    if (replace || gcb.DisposalMode == DISPOSE_DO_NOT) {
+      for (size_t y = 0, byte_index = 0; y < image_rect.ysize(); ++y) {
+        PackedRgba* row = canvas_row(y + image_rect.y0()) + image_rect.x0();
+        for (size_t x = 0; x < image_rect.xsize(); ++x, ++byte_index) {
+          const GifByteType byte = image.RasterBits[byte_index];
+          if (byte >= color_map->ColorCount) {
+            return JXL_FAILURE("GIF color is out of bounds");
+          }
 
-        if (byte == gcb.TransparentColor) continue;
-        GifColorType color = color_map->Colors[byte];
-        row[x].r = color.Red;
-        row[x].g = color.Green;
-        row[x].b = color.Blue;
-        row[x].a = 255;
+          if (byte == gcb.TransparentColor) continue;
+          GifColorType color = color_map->Colors[byte];
+          row[x].r = color.Red;
+          row[x].g = color.Green;
+          row[x].b = color.Blue;
+          row[x].a = 255;
+        }
       }
     }
     const PackedImage& sub_frame_image = frame->color;
     if (replace) {
-      // Copy from the new canvas image to the subframe
+      // Copy from the canvas to the subframe
       for (size_t y = 0; y < total_rect.ysize(); ++y) {
         const PackedRgba* row_in =
-            static_cast<const PackedRgba*>(new_canvas_image.pixels()) +
-            (y + total_rect.y0()) * new_canvas_image.xsize + total_rect.x0();
+            canvas_row(y + total_rect.y0()) + total_rect.x0();
         PackedRgb* row_out = static_cast<PackedRgb*>(sub_frame_image.pixels()) +
                              y * sub_frame_image.xsize;
         for (size_t x = 0; x < sub_frame_image.xsize; ++x) {
@@ -350,7 +359,7 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
                          y * sub_frame_image.xsize;
         for (size_t x = 0; x < image_rect.xsize(); ++x, ++byte_index) {
           const GifByteType byte = image.RasterBits[byte_index];
-          if (byte > color_map->ColorCount) {
+          if (byte >= color_map->ColorCount) {
             return JXL_FAILURE("GIF color is out of bounds");
           }
           if (byte == gcb.TransparentColor) {
@@ -375,16 +384,25 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
 
     switch (gcb.DisposalMode) {
       case DISPOSE_DO_NOT:
-        canvas.color = std::move(new_canvas_image);
         break;
 
       case DISPOSE_BACKGROUND:
-        std::fill_n(static_cast<PackedRgba*>(canvas.color.pixels()),
-                    canvas.color.xsize * canvas.color.ysize, background_rgba);
+        // Only the area of the frame goes back to the background, as in the
+        // next frame, which replaces it together with its own area.
+        for (size_t y = 0; y < image_rect.ysize(); ++y) {
+          std::fill_n(canvas_row(y + image_rect.y0()) + image_rect.x0(),
+                      image_rect.xsize(), background_rgba);
+        }
         previous_rect_if_restore_to_background = image_rect;
         break;
 
       case DISPOSE_PREVIOUS:
+        for (size_t y = 0; y < image_rect.ysize() && !saved_pixels.empty();
+             ++y) {
+          memcpy(canvas_row(y + image_rect.y0()) + image_rect.x0(),
+                 saved_pixels.data() + y * image_rect.xsize(),
+                 image_rect.xsize() * sizeof(PackedRgba));
+        }
         break;
 
       case DISPOSAL_UNSPECIFIED:
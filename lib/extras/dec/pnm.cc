@@ -8,6 +8,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "lib/jxl/base/bits.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/status.h"
@@ -302,16 +305,12 @@ Span<const uint8_t> MakeSpan(const char* str) {
                              strlen(str));
 }
 
-}  // namespace
-
-Status DecodeImagePNM(const Span<const uint8_t> bytes,
-                      const ColorHints& color_hints,
-                      const SizeConstraints& constraints,
-                      PackedPixelFile* ppf) {
-  Parser parser(bytes);
-  HeaderPNM header = {};
-  const uint8_t* pos = nullptr;
-  if (!parser.ParseHeader(&header, &pos)) return false;
+// Checks the header and sets the image information of `ppf` and the pixel
+// format of its rows from it.
+Status SetInfoFromHeader(const HeaderPNM& header,
+                         const ColorHints& color_hints,
+                         const SizeConstraints& constraints,
+                         PackedPixelFile* ppf, JxlPixelFormat* format) {
   JXL_RETURN_IF_ERROR(
       VerifyDimensions(&constraints, header.xsize, header.ysize));
 
@@ -355,13 +354,30 @@ Status DecodeImagePNM(const Span<const uint8_t> bytes,
     }
   }
 
-  const JxlPixelFormat format{
+  *format = JxlPixelFormat{
       /*num_channels=*/ppf->info.num_color_channels +
           ppf->info.num_extra_channels,
       /*data_type=*/data_type,
       /*endianness=*/header.big_endian ? JXL_BIG_ENDIAN : JXL_LITTLE_ENDIAN,
       /*align=*/0,
   };
+  return true;
+}
+
+}  // namespace
+
+Status DecodeImagePNM(const Span<const uint8_t> bytes,
+                      const ColorHints& color_hints,
+                      const SizeConstraints& constraints,
+                      PackedPixelFile* ppf) {
+  Parser parser(bytes);
+  HeaderPNM header = {};
+  const uint8_t* pos = nullptr;
+  if (!parser.ParseHeader(&header, &pos)) return false;
+  JxlPixelFormat format;
+  JXL_RETURN_IF_ERROR(
+      SetInfoFromHeader(header, color_hints, constraints, ppf, &format));
+
   ppf->frames.clear();
   ppf->frames.emplace_back(header.xsize, header.ysize, format);
   auto* frame = &ppf->frames.back();
@@ -376,6 +392,87 @@ Status DecodeImagePNM(const Span<const uint8_t> bytes,
   return true;
 }
 
+constexpr size_t PNMRowReader::kMaxHeaderBytes;
+
+Status PNMRowReader::Init(FILE* file, const ColorHints& color_hints,
+                          const SizeConstraints& constraints,
+                          PackedPixelFile* ppf) {
+  file_ = file;
+  position_ = -1;
+  if (fseek(file_, 0, SEEK_END) != 0) return JXL_FAILURE("PNM: seek failed");
+  const long file_size = ftell(file_);
+  if (file_size < 0) return JXL_FAILURE("PNM: seek failed");
+  rewind(file_);
+  // Any valid header fits in the first bytes, unless it has very long
+  // comments.
+  std::vector<uint8_t> header_bytes(
+      std::min<size_t>(kMaxHeaderBytes, file_size));
+  // ParseHeader expects at least two bytes.
+  if (header_bytes.size() < 2) return false;
+  if (fread(header_bytes.data(), 1, header_bytes.size(), file_) !=
+      header_bytes.size()) {
+    return JXL_FAILURE("PNM: read failed");
+  }
+
+  Parser parser(Span<const uint8_t>(header_bytes.data(), header_bytes.size()));
+  HeaderPNM header = {};
+  const uint8_t* pos = nullptr;
+  if (!parser.ParseHeader(&header, &pos)) return false;
+  JXL_RETURN_IF_ERROR(
+      SetInfoFromHeader(header, color_hints, constraints, ppf, &format_));
+  ppf->frames.clear();
+
+  ysize_ = header.ysize;
+  row_size_ = header.xsize * format_.num_channels *
+              PackedImage::BitsPerChannel(format_.data_type) / kBitsPerByte;
+  data_offset_ = pos - header_bytes.data();
+  bottom_to_top_ = header.floating_point;  // PFMs are flipped
+  if (static_cast<uint64_t>(file_size - data_offset_) <
+      static_cast<uint64_t>(row_size_) * ysize_) {
+    return JXL_FAILURE("PNM file too small");
+  }
+  position_ = static_cast<long>(header_bytes.size());
+  return true;
+}
+
+Status PNMRowReader::ReadRows(size_t y0, size_t num_rows, void* buffer,
+                              size_t size) {
+  if (y0 > ysize_ || num_rows > ysize_ - y0) {
+    return JXL_FAILURE("PNM: rows out of range");
+  }
+  const size_t num_bytes = num_rows * row_size_;
+  if (size < num_bytes) return JXL_FAILURE("PNM: buffer too small");
+  // The strip is contiguous in the file in both orders, only reversed for
+  // bottom-to-top files.
+  const size_t first_row = bottom_to_top_ ? ysize_ - y0 - num_rows : y0;
+  const long offset = data_offset_ + static_cast<long>(first_row * row_size_);
+  // Sequential reads of top-to-bottom files do not seek.
+  if (offset != position_ && fseek(file_, offset, SEEK_SET) != 0) {
+    position_ = -1;
+    return JXL_FAILURE("PNM: seek failed");
+  }
+  if (fread(buffer, 1, num_bytes, file_) != num_bytes) {
+    position_ = -1;
+    return JXL_FAILURE("PNM: read failed");
+  }
+  position_ = offset + static_cast<long>(num_bytes);
+  if (bottom_to_top_) {
+    uint8_t* rows = static_cast<uint8_t*>(buffer);
+    for (size_t i = 0; i < num_rows / 2; i++) {
+      std::swap_ranges(rows + i * row_size_, rows + (i + 1) * row_size_,
+                       rows + (num_rows - 1 - i) * row_size_);
+    }
+  }
+  return true;
+}
+
+JXL_BOOL PNMRowReader::ReadRowsCallback(void* opaque, size_t y0,
+                                        size_t num_rows, void* buffer,
+                                        size_t size) {
+  PNMRowReader* reader = static_cast<PNMRowReader*>(opaque);
+  return reader->ReadRows(y0, num_rows, buffer, size) ? JXL_TRUE : JXL_FALSE;
+}
+
 void TestCodecPNM() {
   size_t u = 77777;  // Initialized to wrong value.
   double d = 77.77;
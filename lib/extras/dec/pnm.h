@@ -6,10 +6,11 @@
 #ifndef LIB_EXTRAS_DEC_PNM_H_
 #define LIB_EXTRAS_DEC_PNM_H_
 
-// Decodes PBM/PGM/PPM/PFM pixels in memory.
+// Decodes PBM/PGM/PPM/PFM pixels in memory or from a file.
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 // TODO(janwas): workaround for incorrect Win64 codegen (cause unknown)
 #include <hwy/highway.h>
@@ -30,6 +31,44 @@ namespace extras {
 Status DecodeImagePNM(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       const SizeConstraints& constraints, PackedPixelFile* ppf);
 
+// Reads the pixels of a PGM/PPM/PAM/PFM file a strip of rows at a time, so that
+// large images can be fed to the encoder with
+// JxlEncoderAddImageFrameFromRowSource without holding the file in memory.
+class PNMRowReader {
+ public:
+  // Parses the header of `file` and sets the image information and color
+  // encoding of `ppf`, but no frames. `file` must be seekable and outlive the
+  // reader.
+  Status Init(FILE* file, const ColorHints& color_hints,
+              const SizeConstraints& constraints, PackedPixelFile* ppf);
+
+  // The format of the rows returned by ReadRows.
+  const JxlPixelFormat& format() const { return format_; }
+
+  // Reads `num_rows` rows starting at row `y0` from the top of the image into
+  // `buffer` of `size` bytes, with consecutive rows `xsize * pixel size` bytes
+  // apart.
+  Status ReadRows(size_t y0, size_t num_rows, void* buffer, size_t size);
+
+  // JxlEncoderRowSourceFunc that reads from the PNMRowReader `opaque`.
+  static JXL_BOOL ReadRowsCallback(void* opaque, size_t y0, size_t num_rows,
+                                   void* buffer, size_t size);
+
+ private:
+  // Headers longer than this, e.g. with many comments, are not supported.
+  static constexpr size_t kMaxHeaderBytes = 1 << 16;
+
+  FILE* file_ = nullptr;
+  size_t ysize_ = 0;
+  size_t row_size_ = 0;
+  // Offset of the first row in the file.
+  long data_offset_ = 0;
+  bool bottom_to_top_ = false;
+  // Current offset in `file_`, or -1 if unknown.
+  long position_ = -1;
+  JxlPixelFormat format_ = {};
+};
+
 void TestCodecPNM();
 
 }  // namespace extras
@@ -8,7 +8,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "lib/extras/packed_image.h"
@@ -129,5 +131,112 @@ Status EncodeImagePNM(const PackedPixelFile& ppf, size_t bits_per_sample,
   return true;
 }
 
+Status PNMRowWriter::Init(const JxlBasicInfo& info,
+                          const JxlPixelFormat& format, FILE* file) {
+  if (format.num_channels < 1 || format.num_channels > 4) {
+    return JXL_FAILURE("PNM needs 1 to 4 channels");
+  }
+  size_t bits_per_sample;
+  if (format.data_type == JXL_TYPE_UINT8) {
+    bits_per_sample = 8;
+  } else if (format.data_type == JXL_TYPE_UINT16) {
+    bits_per_sample = 16;
+    if (format.endianness == JXL_LITTLE_ENDIAN ||
+        (format.endianness == JXL_NATIVE_ENDIAN && IsLittleEndian())) {
+      return JXL_FAILURE("PNM needs big-endian samples");
+    }
+  } else if (format.data_type == JXL_TYPE_FLOAT) {
+    bits_per_sample = 32;
+    if (format.num_channels == 2 || format.num_channels == 4) {
+      return JXL_FAILURE("PFM cannot have alpha");
+    }
+  } else {
+    return JXL_FAILURE("Unsupported data type for PNM");
+  }
+  // The pixels are already oriented, and described by `format` rather than
+  // by the original image.
+  PackedPixelFile ppf;
+  ppf.info.xsize = info.xsize;
+  ppf.info.ysize = info.ysize;
+  ppf.info.orientation = JXL_ORIENT_IDENTITY;
+  ppf.info.num_color_channels = format.num_channels <= 2 ? 1 : 3;
+  ppf.info.alpha_bits = format.num_channels % 2 == 0 ? bits_per_sample : 0;
+  const bool little_endian =
+      format.endianness == JXL_LITTLE_ENDIAN ||
+      (format.endianness == JXL_NATIVE_ENDIAN && IsLittleEndian());
+  char header[kMaxHeaderSize];
+  int header_size = 0;
+  JXL_RETURN_IF_ERROR(EncodeHeader(ppf, bits_per_sample, little_endian,
+                                   header, &header_size));
+  if (fwrite(header, 1, header_size, file) !=
+      static_cast<size_t>(header_size)) {
+    return JXL_FAILURE("Failed to write PNM header");
+  }
+
+  file_ = file;
+  xsize_ = info.xsize;
+  ysize_ = info.ysize;
+  pixel_size_ = format.num_channels * bits_per_sample / kBitsPerByte;
+  header_size_ = header_size;
+  bottom_to_top_ = format.data_type == JXL_TYPE_FLOAT;
+  return true;
+}
+
+bool PNMRowWriter::WriteRow(size_t y, const uint8_t* row) {
+  if (bottom_to_top_) {
+    const long offset =
+        header_size_ + static_cast<long>((ysize_ - 1 - y) * xsize_ *
+                                         pixel_size_);
+    if (fseek(file_, offset, SEEK_SET) != 0) return false;
+  }
+  num_written_rows_++;
+  return fwrite(row, pixel_size_, xsize_, file_) == xsize_;
+}
+
+void PNMRowWriter::AddPixels(size_t x, size_t y, size_t num_pixels,
+                             const void* pixels) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(pixels);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!ok_) return;
+  if (y >= ysize_ || x + num_pixels > xsize_) {
+    ok_ = false;
+    return;
+  }
+  // Whole rows that can be written right away are not copied.
+  if (x == 0 && num_pixels == xsize_ && (bottom_to_top_ || y == next_row_)) {
+    ok_ = WriteRow(y, bytes);
+    if (!bottom_to_top_) next_row_++;
+  } else {
+    PendingRow& row = pending_rows_[y];
+    if (row.bytes.empty()) row.bytes.resize(xsize_ * pixel_size_);
+    memcpy(row.bytes.data() + x * pixel_size_, bytes,
+           num_pixels * pixel_size_);
+    row.pixels_added += num_pixels;
+    max_pending_rows_ = std::max(max_pending_rows_, pending_rows_.size());
+    if (row.pixels_added == xsize_ && bottom_to_top_) {
+      ok_ = WriteRow(y, row.bytes.data());
+      pending_rows_.erase(y);
+    }
+  }
+  if (bottom_to_top_) return;
+  while (ok_ && !pending_rows_.empty() &&
+         pending_rows_.begin()->first == next_row_ &&
+         pending_rows_.begin()->second.pixels_added == xsize_) {
+    ok_ = WriteRow(next_row_, pending_rows_.begin()->second.bytes.data());
+    pending_rows_.erase(pending_rows_.begin());
+    next_row_++;
+  }
+}
+
+Status PNMRowWriter::Finalize() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!ok_) return JXL_FAILURE("Failed to write PNM rows");
+  if (num_written_rows_ != ysize_ || !pending_rows_.empty()) {
+    return JXL_FAILURE("Missing PNM rows");
+  }
+  if (fflush(file_) != 0) return JXL_FAILURE("Failed to flush PNM file");
+  return true;
+}
+
 }  // namespace extras
 }  // namespace jxl
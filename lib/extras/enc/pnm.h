@@ -11,6 +11,16 @@
 // TODO(janwas): workaround for incorrect Win64 codegen (cause unknown)
 #include <hwy/highway.h>
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "jxl/codestream_header.h"
+#include "jxl/types.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/padded_bytes.h"
@@ -26,6 +36,58 @@ Status EncodeImagePNM(const PackedPixelFile& ppf, size_t bits_per_sample,
                       ThreadPool* pool, size_t frame_index,
                       std::vector<uint8_t>* bytes);
 
+// Writes a PGM/PPM/PAM/PFM file from pixels that arrive as row segments in any
+// order and from any thread, such as those passed to the callback of
+// JxlDecoderSetImageOutCallback, so that the image is never held in memory as
+// a whole. Complete rows are written as soon as all the earlier rows are, or
+// at their offset for PFM, whose rows are stored bottom to top and which
+// therefore needs a seekable file.
+class PNMRowWriter {
+ public:
+  // Writes the header of an image of info.xsize x info.ysize pixels in
+  // `format`, which must be uint8, big-endian uint16 or native-endian float
+  // (PFM) with 1 to 4 channels; 2 and 4 channels are written as PAM. `file`
+  // must outlive the writer.
+  Status Init(const JxlBasicInfo& info, const JxlPixelFormat& format,
+              FILE* file);
+
+  // Stores `num_pixels` pixels of row `y` starting at column `x`, in the
+  // format passed to Init, and writes the rows that are now complete.
+  // Thread-safe.
+  void AddPixels(size_t x, size_t y, size_t num_pixels, const void* pixels);
+
+  // Checks that all the rows were added and written.
+  Status Finalize();
+
+  // The largest number of incomplete or not yet written rows held in memory.
+  size_t max_pending_rows() const { return max_pending_rows_; }
+
+ private:
+  struct PendingRow {
+    std::vector<uint8_t> bytes;
+    size_t pixels_added = 0;
+  };
+
+  // Requires mutex_.
+  bool WriteRow(size_t y, const uint8_t* row);
+
+  FILE* file_ = nullptr;
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  size_t pixel_size_ = 0;
+  // Offset of the first row in the file.
+  long header_size_ = 0;
+  bool bottom_to_top_ = false;
+
+  std::mutex mutex_;
+  std::map<size_t, PendingRow> pending_rows_;
+  // For top to bottom files, the next row to write.
+  size_t next_row_ = 0;
+  size_t num_written_rows_ = 0;
+  size_t max_pending_rows_ = 0;
+  bool ok_ = true;
+};
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -7,16 +7,22 @@
 
 #include <cmath>
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/extras/hlg.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
 #include "lib/jxl/enc_color_management.h"
+#include "lib/jxl/fast_math-inl.h"
 
+HWY_BEFORE_NAMESPACE();
 namespace jxl {
+namespace HWY_NAMESPACE {
 
-float GetHlgGamma(const float peak_luminance, const float surround_luminance) {
-  return 1.2f * std::pow(1.111f, std::log2(peak_luminance / 1000.f)) *
-         std::pow(0.98f, std::log2(surround_luminance / 5.f));
-}
+Status HlgOOTFFrame(ImageBundle* ib, const float gamma, ThreadPool* pool) {
+  HWY_FULL(float) df;
+  using V = decltype(Zero(df));
 
-Status HlgOOTF(ImageBundle* ib, const float gamma, ThreadPool* pool) {
   ColorEncoding linear_rec2020;
   linear_rec2020.SetColorSpace(ColorSpace::kRGB);
   linear_rec2020.primaries = Primaries::k2100;
@@ -27,30 +33,56 @@ Status HlgOOTF(ImageBundle* ib, const float gamma, ThreadPool* pool) {
 
   JXL_RETURN_IF_ERROR(RunOnPool(
       pool, 0, ib->ysize(), ThreadPool::NoInit,
-      [&](const int y, const int thread) {
-        float* const JXL_RESTRICT rows[3] = {ib->color()->PlaneRow(0, y),
-                                             ib->color()->PlaneRow(1, y),
-                                             ib->color()->PlaneRow(2, y)};
-        for (size_t x = 0; x < ib->xsize(); ++x) {
-          float& red = rows[0][x];
-          float& green = rows[1][x];
-          float& blue = rows[2][x];
-          const float luminance =
-              0.2627f * red + 0.6780f * green + 0.0593f * blue;
-          const float ratio = std::pow(luminance, gamma - 1);
-          if (std::isfinite(ratio)) {
-            red *= ratio;
-            green *= ratio;
-            blue *= ratio;
-          }
+      [&](const uint32_t y, size_t /* thread */) {
+        float* const JXL_RESTRICT row_r = ib->color()->PlaneRow(0, y);
+        float* const JXL_RESTRICT row_g = ib->color()->PlaneRow(1, y);
+        float* const JXL_RESTRICT row_b = ib->color()->PlaneRow(2, y);
+        for (size_t x = 0; x < ib->xsize(); x += Lanes(df)) {
+          V red = Load(df, row_r + x);
+          V green = Load(df, row_g + x);
+          V blue = Load(df, row_b + x);
+          const V luminance =
+              MulAdd(Set(df, 0.2627f), red,
+                     MulAdd(Set(df, 0.6780f), green, Set(df, 0.0593f) * blue));
+          // Pixels of zero or negative luminance, whose ratio would not be
+          // finite, are left unchanged.
+          const V ratio = IfThenElse(
+              luminance > Zero(df),
+              Min(FastPowf(df, luminance, Set(df, gamma - 1)), Set(df, 1e9f)),
+              Set(df, 1.0f));
+          Store(red * ratio, df, row_r + x);
+          Store(green * ratio, df, row_g + x);
+          Store(blue * ratio, df, row_b + x);
         }
       },
       "HlgOOTF"));
   return true;
 }
 
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+namespace {
+HWY_EXPORT(HlgOOTFFrame);
+}  // namespace
+
+float GetHlgGamma(const float peak_luminance, const float surround_luminance) {
+  return 1.2f * std::pow(1.111f, std::log2(peak_luminance / 1000.f)) *
+         std::pow(0.98f, std::log2(surround_luminance / 5.f));
+}
+
+Status HlgOOTF(ImageBundle* ib, const float gamma, ThreadPool* pool) {
+  return HWY_DYNAMIC_DISPATCH(HlgOOTFFrame)(ib, gamma, pool);
+}
+
 Status HlgInverseOOTF(ImageBundle* ib, const float gamma, ThreadPool* pool) {
   return HlgOOTF(ib, 1.f / gamma, pool);
 }
 
 }  // namespace jxl
+#endif
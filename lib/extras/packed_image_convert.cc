@@ -256,20 +256,15 @@ Status ConvertCodecInOutToPackedPixelFile(const CodecInOut& io,
             : ppf->info.bits_per_sample;
     packed_frame.name = frame.name;
     packed_frame.frame_info.name_length = frame.name.size();
-    // Color transform
-    ImageBundle ib = frame.Copy();
-    const ImageBundle* to_color_transform = &ib;
+    // Color transform. The frame is only copied if it is not already in
+    // c_desired, and the pixels are then written once, directly into the
+    // packed frame.
     ImageMetadata metadata = io.metadata.m;
     ImageBundle store(&metadata);
     const ImageBundle* transformed;
     // TODO(firsching): handle the transform here.
-    JXL_RETURN_IF_ERROR(TransformIfNeeded(*to_color_transform, c_desired,
-                                          GetJxlCms(), pool, &store,
-                                          &transformed));
-    size_t stride = ib.oriented_xsize() *
-                    (c_desired.Channels() * ppf->info.bits_per_sample) /
-                    kBitsPerByte;
-    PaddedBytes pixels(stride * ib.oriented_ysize());
+    JXL_RETURN_IF_ERROR(TransformIfNeeded(frame, c_desired, GetJxlCms(), pool,
+                                          &store, &transformed));
 
     JXL_RETURN_IF_ERROR(ConvertToExternal(
         *transformed, bits_per_sample, float_out, format.num_channels,
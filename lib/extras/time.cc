@@ -57,4 +57,25 @@ double Now() {
 #endif
 }
 
+double CpuTime() {
+#if JXL_OS_WIN
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel,
+                       &user)) {
+    return 0.0;
+  }
+  // In units of 100 ns.
+  const auto ticks = [](const FILETIME& t) {
+    return (uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime;
+  };
+  return (ticks(kernel) + ticks(user)) * 1E-7;
+#elif defined(CLOCK_PROCESS_CPUTIME_ID)
+  timespec t;
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t) != 0) return 0.0;
+  return t.tv_sec + t.tv_nsec * 1E-9;
+#else
+  return 0.0;
+#endif
+}
+
 }  // namespace jxl
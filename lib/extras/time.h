@@ -14,6 +14,11 @@ namespace jxl {
 // starting point - only suitable for computing elapsed time.
 double Now();
 
+// Returns the CPU time [seconds] used by all threads of the process since an
+// unspecified starting point, or 0 if unavailable on this OS. Only suitable
+// for computing the CPU time spent between two calls.
+double CpuTime();
+
 }  // namespace jxl
 
 #endif  // LIB_EXTRAS_TIME_H_
@@ -11,18 +11,17 @@
 #include <hwy/highway.h>
 
 #include "lib/jxl/enc_color_management.h"
-#include "lib/jxl/transfer_functions-inl.h"
+#include "lib/jxl/tone_mapping-inl.h"
 
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
 
+// Luminances of the Rec. 2020 primaries, in which the frames are mapped.
+constexpr float kRec2020Luminances[3] = {0.2627f, 0.6780f, 0.0593f};
+
 Status ToneMapFrame(const std::pair<float, float> display_nits,
                     ImageBundle* const ib, ThreadPool* const pool) {
-  // Perform tone mapping as described in Report ITU-R BT.2390-8, section 5.4
-  // (pp. 23-25).
-  // https://www.itu.int/pub/R-REP-BT.2390-8-2020
-
   HWY_FULL(float) df;
   using V = decltype(Zero(df));
 
@@ -34,40 +33,11 @@ Status ToneMapFrame(const std::pair<float, float> display_nits,
   JXL_RETURN_IF_ERROR(linear_rec2020.CreateICC());
   JXL_RETURN_IF_ERROR(ib->TransformTo(linear_rec2020, GetJxlCms(), pool));
 
-  const auto eotf_inv = [&df](const V luminance) -> V {
-    return TF_PQ().EncodedFromDisplay(df, luminance * Set(df, 1. / 10000));
-  };
-
-  const V pq_mastering_min =
-      eotf_inv(Set(df, ib->metadata()->tone_mapping.min_nits));
-  const V pq_mastering_max =
-      eotf_inv(Set(df, ib->metadata()->tone_mapping.intensity_target));
-  const V pq_mastering_range = pq_mastering_max - pq_mastering_min;
-  const V inv_pq_mastering_range =
-      Set(df, 1) / (pq_mastering_max - pq_mastering_min);
-  const V min_lum = (eotf_inv(Set(df, display_nits.first)) - pq_mastering_min) *
-                    inv_pq_mastering_range;
-  const V max_lum =
-      (eotf_inv(Set(df, display_nits.second)) - pq_mastering_min) *
-      inv_pq_mastering_range;
-  const V ks = MulAdd(Set(df, 1.5f), max_lum, Set(df, -0.5f));
-  const V b = min_lum;
-
-  const V inv_one_minus_ks = Set(df, 1) / Max(Set(df, 1e-6f), Set(df, 1) - ks);
-  const auto T = [ks, inv_one_minus_ks](const V a) {
-    return (a - ks) * inv_one_minus_ks;
-  };
-  const auto P = [&T, &df, ks, max_lum](const V b) {
-    const V t_b = T(b);
-    const V t_b_2 = t_b * t_b;
-    const V t_b_3 = t_b_2 * t_b;
-    return MulAdd(
-        MulAdd(Set(df, 2), t_b_3, MulAdd(Set(df, -3), t_b_2, Set(df, 1))), ks,
-        MulAdd(t_b_3 + MulAdd(Set(df, -2), t_b_2, t_b), Set(df, 1) - ks,
-               MulAdd(Set(df, -2), t_b_3, Set(df, 3) * t_b_2) * max_lum));
-  };
-
-  const V inv_max_display_nits = Set(df, 1 / display_nits.second);
+  const float intensity_target = ib->metadata()->IntensityTarget();
+  const Rec2390ToneMapper tone_mapper(
+      {ib->metadata()->tone_mapping.min_nits, intensity_target}, display_nits,
+      kRec2020Luminances, /*input_nits=*/intensity_target,
+      /*output_nits=*/display_nits.second);
 
   JXL_RETURN_IF_ERROR(RunOnPool(
       pool, 0, ib->ysize(), ThreadPool::NoInit,
@@ -79,35 +49,7 @@ Status ToneMapFrame(const std::pair<float, float> display_nits,
           V red = Load(df, row_r + x);
           V green = Load(df, row_g + x);
           V blue = Load(df, row_b + x);
-          const V luminance = Set(df, ib->metadata()->IntensityTarget()) *
-                              (MulAdd(Set(df, 0.2627f), red,
-                                      MulAdd(Set(df, 0.6780f), green,
-                                             Set(df, 0.0593f) * blue)));
-          const V normalized_pq =
-              Min(Set(df, 1.f), (eotf_inv(luminance) - pq_mastering_min) *
-                                    inv_pq_mastering_range);
-          const V e2 =
-              IfThenElse(normalized_pq < ks, normalized_pq, P(normalized_pq));
-          const V one_minus_e2 = Set(df, 1) - e2;
-          const V one_minus_e2_2 = one_minus_e2 * one_minus_e2;
-          const V one_minus_e2_4 = one_minus_e2_2 * one_minus_e2_2;
-          const V e3 = MulAdd(b, one_minus_e2_4, e2);
-          const V e4 = MulAdd(e3, pq_mastering_range, pq_mastering_min);
-          const V new_luminance =
-              Min(Set(df, display_nits.second),
-                  ZeroIfNegative(Set(df, 10000) *
-                                 TF_PQ().DisplayFromEncoded(df, e4)));
-
-          const V ratio = new_luminance / luminance;
-          const V normalizer =
-              Set(df, ib->metadata()->IntensityTarget()) * inv_max_display_nits;
-
-          for (V* const val : {&red, &green, &blue}) {
-            *val = IfThenElse(luminance <= Set(df, 1e-6f), new_luminance,
-                              *val * ratio) *
-                   normalizer;
-          }
-
+          tone_mapper.ToneMap(df, &red, &green, &blue);
           Store(red, df, row_r + x);
           Store(green, df, row_g + x);
           Store(blue, df, row_b + x);
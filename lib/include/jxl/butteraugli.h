@@ -38,6 +38,15 @@ typedef struct JxlButteraugliApiStruct JxlButteraugliApi;
  */
 typedef struct JxlButteraugliResultStruct JxlButteraugliResult;
 
+/**
+ * Opaque structure that holds an original image prepared for butteraugli
+ * comparisons with several distorted images.
+ *
+ * Allocated and initialized with JxlButteraugliReferenceCreate().
+ * Cleaned up and deallocated with JxlButteraugliReferenceDestroy().
+ */
+typedef struct JxlButteraugliReferenceStruct JxlButteraugliReference;
+
 /**
  * Deinitializes and frees JxlButteraugliResult instance.
  *
@@ -90,6 +99,20 @@ JXL_EXPORT void JxlButteraugliApiSetHFAsymmetry(JxlButteraugliApi* api,
 JXL_EXPORT void JxlButteraugliApiSetIntensityTarget(JxlButteraugliApi* api,
                                                     float v);
 
+/**
+ * Enables a faster, less precise mode of butteraugli, meant to rank changes
+ * of the same image rather than for absolute scores: the low-frequency bands
+ * are computed at half resolution and the 2x subsampled scale is skipped. The
+ * distance is then between 0.74 and 1.18 times that of the full metric for
+ * images whose differences are not dominated by coarse features.
+ *
+ * @param api api instance.
+ * @param fast JXL_TRUE for the fast mode, JXL_FALSE (default) for the full
+ * metric.
+ */
+JXL_EXPORT void JxlButteraugliApiSetFast(JxlButteraugliApi* api,
+                                         JXL_BOOL fast);
+
 /**
  * Deinitializes and frees JxlButteraugliApi instance.
  *
@@ -119,6 +142,52 @@ JXL_EXPORT JxlButteraugliResult* JxlButteraugliCompute(
     size_t size_orig, const JxlPixelFormat* pixel_format_dist,
     const void* buffer_dist, size_t size_dist);
 
+/**
+ * Prepares an original image for comparisons with
+ * JxlButteraugliReferenceCompare(). The options of @p api are those at the
+ * time of this call. The reference keeps using the parallel runner of
+ * @p api, which must outlive it.
+ *
+ * @param api api instance for the computations.
+ * @param xsize width of the original image.
+ * @param ysize height of the original image.
+ * @param pixel_format pixel format for original image.
+ * @param buffer pixel data for original image.
+ * @param size size of buffer in bytes.
+ * @return @c NULL if the reference can not be allocated or initialized.
+ * @return pointer to initialized reference otherwise.
+ */
+JXL_EXPORT JxlButteraugliReference* JxlButteraugliReferenceCreate(
+    const JxlButteraugliApi* api, uint32_t xsize, uint32_t ysize,
+    const JxlPixelFormat* pixel_format, const void* buffer, size_t size);
+
+/**
+ * Computes intermediary butteraugli result between the original image of
+ * @p reference and a distortion of the same size. The result is the same as
+ * that of JxlButteraugliCompute with the original image, but the
+ * computations that only depend on the original image are not repeated. The
+ * comparisons with one reference must not run concurrently.
+ *
+ * @param reference reference instance of the original image.
+ * @param pixel_format_dist pixel format for distortion.
+ * @param buffer_dist pixel data for distortion.
+ * @param size_dist size of buffer_dist in bytes.
+ * @return @c NULL if the results can not be computed or initialized.
+ * @return pointer to initialized and computed intermediary result.
+ */
+JXL_EXPORT JxlButteraugliResult* JxlButteraugliReferenceCompare(
+    const JxlButteraugliReference* reference,
+    const JxlPixelFormat* pixel_format_dist, const void* buffer_dist,
+    size_t size_dist);
+
+/**
+ * Deinitializes and frees JxlButteraugliReference instance.
+ *
+ * @param reference instance to be cleaned up and deallocated.
+ */
+JXL_EXPORT void JxlButteraugliReferenceDestroy(
+    JxlButteraugliReference* reference);
+
 /**
  * Computes butteraugli max distance based on an intermediary butteraugli
  * result.
@@ -55,6 +55,24 @@ struct JxlButteraugliResultDestroyStruct {
 typedef std::unique_ptr<JxlButteraugliResult, JxlButteraugliResultDestroyStruct>
     JxlButteraugliResultPtr;
 
+/// Struct to call JxlButteraugliReferenceDestroy from the
+/// JxlButteraugliReferencePtr unique_ptr.
+struct JxlButteraugliReferenceDestroyStruct {
+  /// Calls @ref JxlButteraugliReferenceDestroy() on the passed reference.
+  void operator()(JxlButteraugliReference* reference) {
+    JxlButteraugliReferenceDestroy(reference);
+  }
+};
+
+/// std::unique_ptr<> type that calls JxlButteraugliReferenceDestroy() when
+/// releasing the pointer.
+///
+/// Use this helper type from C++ sources to ensure the reference is destroyed
+/// and their internal resources released.
+typedef std::unique_ptr<JxlButteraugliReference,
+                        JxlButteraugliReferenceDestroyStruct>
+    JxlButteraugliReferencePtr;
+
 #endif  // JXL_BUTTERAUGLI_CXX_H_
 
 /// @}
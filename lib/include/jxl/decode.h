@@ -105,6 +105,18 @@ JXL_EXPORT JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager);
  */
 JXL_EXPORT void JxlDecoderReset(JxlDecoder* dec);
 
+/**
+ * Re-initializes a JxlDecoder instance like JxlDecoderReset, but keeps the
+ * internal buffers that don't depend on the image allocated for the next one,
+ * such as the per-thread group decoding buffers and the dequantization tables.
+ * This reduces the setup cost when decoding many small images with the same
+ * instance; the memory is kept until JxlDecoderReset or JxlDecoderDestroy is
+ * called. The decoded result is the same as after JxlDecoderReset.
+ *
+ * @param dec instance to be re-initialized.
+ */
+JXL_EXPORT void JxlDecoderResetKeepAllocations(JxlDecoder* dec);
+
 /**
  * Deinitializes and frees JxlDecoder instance.
  *
@@ -148,13 +160,9 @@ typedef enum {
    */
   JXL_DEC_NEED_PREVIEW_OUT_BUFFER = 3,
 
-  /** The decoder is able to decode a DC image and requests setting a DC output
-   * buffer using JxlDecoderSetDCOutBuffer. This occurs if JXL_DEC_DC_IMAGE is
-   * requested and it is possible to decode a DC image from the codestream and
-   * the DC out buffer was not yet set. This event re-occurs for new frames
-   * if there are multiple animation frames.
-   * DEPRECATED: the DC feature in this form will be removed. For progressive
-   * rendering, JxlDecoderFlushImage should be used.
+  /** Not returned: the DC image is only written to the buffer if one was set
+   * with JxlDecoderSetDCOutBuffer before JXL_DEC_DC_IMAGE.
+   * DEPRECATED: this status will be removed.
    */
   JXL_DEC_NEED_DC_OUT_BUFFER = 4,
 
@@ -222,15 +230,15 @@ typedef enum {
   JXL_DEC_FRAME = 0x400,
 
   /** Informative event by JxlDecoderProcessInput: DC image, 8x8 sub-sampled
-   * frame, decoded. It is not guaranteed that the decoder will always return DC
-   * separately, but when it does it will do so before outputting the full
-   * frame. JxlDecoderSetDCOutBuffer must be used after getting the basic
-   * image information to be able to get the DC pixels, if not this return
-   * status only indicates we're past this point in the codestream. This event
-   * occurs max once per frame and always later than JXL_DEC_FRAME_HEADER
-   * and other header events and earlier than full resolution pixel data.
-   * DEPRECATED: the DC feature in this form will be removed. For progressive
-   * rendering, JxlDecoderFlushImage should be used.
+   * frame, decoded. The pixels are written to the buffer set with
+   * JxlDecoderSetDCOutBuffer, if any, directly at the low resolution, which is
+   * much cheaper than JxlDecoderFlushImage for a first placeholder. This
+   * event occurs max once per displayed frame, always later than
+   * JXL_DEC_FRAME and earlier than JXL_DEC_FULL_IMAGE, and only if
+   * JXL_DEC_FULL_IMAGE is subscribed to as well. It does not occur for the
+   * frames that have no DC image of the whole canvas: frames that are not
+   * VarDCT, that are upsampled or chroma subsampled, or that are blended with
+   * previous frames.
    */
   JXL_DEC_DC_IMAGE = 0x800,
 
@@ -325,6 +333,10 @@ JXL_EXPORT void JxlDecoderRewind(JxlDecoder* dec);
  * JXL_DEC_FRAME and JXL_FULL_IMAGE, frames that are internal to the file format
  * but are not rendered as part of an animation, or are not the final still
  * frame of a still image, are not counted.
+ * If the file has a frame index box, which comes before the codestream, and
+ * coalescing is enabled, the decoder jumps to the last indexed frame before
+ * the frame skipped to, without parsing nor decoding the frames in between.
+ * The input up to that frame must still be passed to the decoder.
  * @param dec decoder object
  * @param amount the amount of frames to skip
  */
@@ -440,6 +452,21 @@ JxlDecoderSetKeepOrientation(JxlDecoder* dec, JXL_BOOL skip_reorientation);
 JXL_EXPORT JxlDecoderStatus
 JxlDecoderSetRenderSpotcolors(JxlDecoder* dec, JXL_BOOL render_spotcolors);
 
+/** Enables or disables outputting premultiplied alpha. By default, the color
+ * channels of the image out buffer or callback are not multiplied by alpha,
+ * and associated alpha stored in the codestream is undone. If premultiply is
+ * JXL_TRUE, the color channels of pixel formats with an alpha channel are
+ * output multiplied by alpha instead, which is done as part of writing the
+ * pixels and costs nothing if the alpha of the codestream is already
+ * associated (see JxlBasicInfo::alpha_premultiplied).
+ *
+ * @param dec decoder object
+ * @param premultiply JXL_TRUE to enable, JXL_FALSE to disable (default).
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetPremultiplyAlpha(JxlDecoder* dec,
+                                                          JXL_BOOL premultiply);
+
 /** Enables or disables coalescing of zero-duration frames. By default, frames
  * are returned with coalescing enabled, i.e. all frames have the image
  * dimensions, and are blended if needed. When coalescing is disabled, frames
@@ -456,6 +483,325 @@ JxlDecoderSetRenderSpotcolors(JxlDecoder* dec, JXL_BOOL render_spotcolors);
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec,
                                                     JXL_BOOL coalescing);
 
+/** Sets a rectangle of the image to decode. JXL_DEC_FULL_IMAGE then only
+ * outputs the pixels inside this rectangle: the image out buffer, the image
+ * out callback and the extra channel buffers all get the dimensions of the
+ * rectangle, see JxlDecoderImageOutBufferSize. Groups of the frame that don't
+ * affect the pixels in the rectangle are not decoded if this doesn't change
+ * the result, e.g. if the frame is not referenced by later frames, so that the
+ * cost of decoding a small region of a large image depends mostly on the size
+ * of the region.
+ *
+ * The coordinates are those of the output image, i.e. with the orientation
+ * applied unless JxlDecoderSetKeepOrientation is enabled. The rectangle only
+ * applies to frames while coalescing is enabled (the default), it does not
+ * apply to the preview image. If the rectangle is not inside the image,
+ * JxlDecoderProcessInput returns JXL_DEC_ERROR once the basic info is known.
+ *
+ * @param dec decoder object
+ * @param x0 left edge of the rectangle
+ * @param y0 top edge of the rectangle
+ * @param xsize width of the rectangle, must be non-zero
+ * @param ysize height of the rectangle, must be non-zero
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise, e.g. if
+ * decoding already started.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec,
+                                                    uint32_t x0, uint32_t y0,
+                                                    uint32_t xsize,
+                                                    uint32_t ysize);
+
+/** Sets a downsampling factor for the decoded frames, to get e.g. a thumbnail
+ * of the image faster. JXL_DEC_FULL_IMAGE then outputs the frames at
+ * ceil(xsize / factor) x ceil(ysize / factor) pixels: the image out buffer, the
+ * image out callback and the extra channel buffers all get these dimensions,
+ * see JxlDecoderImageOutBufferSize. Only the AC passes that the encoder marked
+ * as sufficient for this factor are decoded, for factor 8 only the DC of
+ * VarDCT frames is needed. If the image was not encoded progressively, all the
+ * passes are still decoded and only the output is downsampled.
+ *
+ * If a crop region is set with JxlDecoderSetCropRegion, its coordinates remain
+ * those of the full resolution image and the region is downsampled. Like the
+ * crop region, the downsampling only applies to frames while coalescing is
+ * enabled, it does not apply to the preview image or to JPEG reconstruction.
+ *
+ * @param dec decoder object
+ * @param factor downsampling factor, 1 (default), 2, 4 or 8
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise, e.g. if
+ * decoding already started or if the factor is not supported.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetDownsampling(JxlDecoder* dec,
+                                                      uint32_t factor);
+
+/** Sets the peak luminance, in nits, of the display the image is decoded for.
+ * The luminances of XYB encoded (lossy) images whose intensity target is
+ * higher are then tone mapped to this range, as described in Report ITU-R
+ * BT.2390-8, section 5.4, while converting the colors from XYB: this costs
+ * much less than tone mapping the output. The intensity_target of the basic
+ * info then reports the desired intensity target. Images that are not XYB
+ * encoded are not tone mapped.
+ *
+ * @param dec decoder object
+ * @param desired_intensity_target peak luminance of the display in nits, or
+ * 0 (default) to not tone map
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise, e.g. if
+ * decoding already started or if the value is negative.
+ */
+JXL_EXPORT JxlDecoderStatus
+JxlDecoderSetDesiredIntensityTarget(JxlDecoder* dec,
+                                    float desired_intensity_target);
+
+/** Makes the decoder write only the dirty rect of each frame, see
+ * JxlDecoderGetFrameDirtyRect, to the image out buffer and the extra channel
+ * buffers. The rest of the buffers is left untouched, so the caller must pass
+ * the same buffers for all frames, holding the previous frame: they are then a
+ * persistent canvas that the decoder updates in place. The first frame, and
+ * the first after skipped frames, are written in full.
+ *
+ * This only applies while coalescing is enabled and no crop region or
+ * downsampling is set, and not to the image out callbacks or the preview
+ * image, which still get whole frames.
+ *
+ * @param dec decoder object
+ * @param enabled JXL_TRUE to only write the dirty rects, JXL_FALSE (default)
+ * to write whole frames.
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise, e.g. if
+ * decoding already started.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetDirtyRectOutput(JxlDecoder* dec,
+                                                         JXL_BOOL enabled);
+
+/** Makes the decoder allocate its image and coefficient buffers from an arena
+ * on top of the memory manager passed to JxlDecoderCreate, instead of
+ * allocating and freeing each buffer with the memory manager. The arena gets
+ * large blocks from the memory manager and recycles a whole block at once when
+ * all the buffers carved from it are freed, which for the buffers used while
+ * decoding a frame happens when the frame is done. This reduces the number of
+ * calls to the memory manager when decoding animations or many images with the
+ * same instance. The blocks are kept until JxlDecoderReset or
+ * JxlDecoderDestroy is called.
+ *
+ * Whether or not the arena is used, the buffers allocated by the decoder go
+ * through the memory manager of the decoder, also when they are allocated by
+ * the threads of the parallel runner.
+ *
+ * @param dec decoder object
+ * @param enabled JXL_TRUE to use the arena, JXL_FALSE (default) to allocate
+ * directly with the memory manager.
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise, e.g. if
+ * decoding already started.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetFrameArena(JxlDecoder* dec,
+                                                    JXL_BOOL enabled);
+
+/** Outputs the memory in use by the decoder, and its peak, see
+ * JxlMemoryStats. This can be called at any time, also from another thread
+ * while JxlDecoderProcessInput runs.
+ *
+ * @param dec decoder object
+ * @param stats output for the memory stats.
+ */
+JXL_EXPORT void JxlDecoderGetMemoryStats(const JxlDecoder* dec,
+                                         JxlMemoryStats* stats);
+
+/** Sets a budget for the memory counted in JxlMemoryStats. When decoding
+ * makes the memory in use exceed the budget, JxlDecoderProcessInput returns
+ * JXL_DEC_ERROR and the decoder can no longer be used until it is reset.
+ * The budget is kept by JxlDecoderReset.
+ *
+ * @param dec decoder object
+ * @param max_bytes maximum number of bytes in use, or 0 (default) for no
+ * limit.
+ */
+JXL_EXPORT void JxlDecoderSetMemoryLimit(JxlDecoder* dec, uint64_t max_bytes);
+
+/** Work done by one stage of the rendering of the decoded frames on one thread
+ * of the parallel runner, as returned by JxlDecoderGetRenderStats.
+ */
+typedef struct {
+  /** Name of the stage, valid until the decoder is destroyed. */
+  const char* name;
+  /** Index of the thread of the parallel runner. */
+  uint32_t thread;
+  /** Wall-clock time spent in the stage. */
+  uint64_t nanoseconds;
+  /** Number of rows of pixels processed by the stage. */
+  uint64_t rows;
+  /** Approximate number of bytes of the buffers read and written by the
+   * stage. */
+  uint64_t bytes;
+} JxlRenderStageStats;
+
+/** Enables collecting, for each stage of the rendering of the decoded frames
+ * into output pixels (e.g. upsampling, filters, color conversion, writing to
+ * the output buffer) and each thread of the parallel runner, the time spent
+ * and the amount of data processed. The stats accumulate over all the frames
+ * of the image and are cleared by JxlDecoderRewind and JxlDecoderReset.
+ * Collecting them adds a small overhead to every row processed, so this is
+ * meant for profiling.
+ *
+ * @param dec decoder object
+ * @param enabled JXL_TRUE to collect the stats, JXL_FALSE (default) to not
+ * collect them.
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise, e.g. if
+ * decoding already started.
+ */
+JXL_EXPORT JxlDecoderStatus
+JxlDecoderSetCollectRenderStats(JxlDecoder* dec, JXL_BOOL enabled);
+
+/** Returns the number of entries of the render stats collected so far, see
+ * JxlDecoderSetCollectRenderStats. There is one entry for each stage and
+ * thread that processed at least one row, ordered by stage in pipeline order
+ * and then by thread.
+ *
+ * @param dec decoder object
+ * @return number of entries, 0 if the stats are not collected.
+ */
+JXL_EXPORT size_t JxlDecoderGetNumRenderStats(const JxlDecoder* dec);
+
+/** Outputs one entry of the render stats collected so far.
+ *
+ * @param dec decoder object
+ * @param index index of the entry, less than the value returned by
+ * JxlDecoderGetNumRenderStats.
+ * @param stats output for the entry.
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR if the index is out of
+ * range.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetRenderStats(
+    const JxlDecoder* dec, size_t index, JxlRenderStageStats* stats);
+
+/** Phases of decoding timed in JxlDecoderCounters.
+ */
+typedef enum {
+  /** Parsing the basic info, the color encoding and other image headers, and
+   * the header and table of contents of each frame.
+   */
+  JXL_DEC_PHASE_HEADERS = 0,
+  /** Decoding the global and per-group DC (low resolution) sections of the
+   * frames.
+   */
+  JXL_DEC_PHASE_DC = 1,
+  /** Decoding the global and per-group AC sections of the frames.
+   */
+  JXL_DEC_PHASE_AC = 2,
+  /** Rendering the decoded groups into pixels: filters, upsampling, color
+   * conversion, blending and writing to an output buffer or callback set
+   * before decoding.
+   */
+  JXL_DEC_PHASE_RENDER = 3,
+  /** Converting full frames to the output pixel format after decoding, and
+   * writing reconstructed JPEG files.
+   */
+  JXL_DEC_PHASE_OUTPUT = 4,
+} JxlDecoderPhase;
+
+/** Number of values of JxlDecoderPhase. */
+#define JXL_DEC_NUM_PHASES 5
+
+/** Counters of the work done by a decoder, as returned by
+ * JxlDecoderGetCounters.
+ */
+typedef struct {
+  /** Time spent in each phase, indexed by JxlDecoderPhase. The time of the
+   * phases run by the threads of the parallel runner is summed over the
+   * threads, so the total can exceed the elapsed time.
+   */
+  uint64_t nanoseconds[JXL_DEC_NUM_PHASES];
+  /** Number of input bytes consumed. */
+  uint64_t bytes_consumed;
+  /** Number of frames fully decoded, including frames that are not shown. */
+  uint64_t frames;
+  /** Number of DC groups decoded. */
+  uint64_t dc_groups;
+  /** Number of AC groups decoded; progressive frames decode some groups
+   * several times, one for each batch of passes received. */
+  uint64_t ac_groups;
+} JxlDecoderCounters;
+
+/** Outputs counters of the time spent in each phase of decoding and of the
+ * amount of data decoded, accumulated since the decoder was created or last
+ * rewound or reset. The counters are always collected; they are updated a few
+ * times per group and frame, which costs much less than 1% of the decoding
+ * time.
+ *
+ * @param dec decoder object
+ * @param counters output for the counters.
+ */
+JXL_EXPORT void JxlDecoderGetCounters(const JxlDecoder* dec,
+                                      JxlDecoderCounters* counters);
+
+/** Progress callback of a decoder, see JxlDecoderSetProgressCallback.
+ *
+ * @param opaque the pointer passed to JxlDecoderSetProgressCallback.
+ * @param num_done number of DC and AC groups whose decoding started so far.
+ * @param num_total number of DC and AC groups of the sections received so
+ * far. It grows as more input is processed and further frames are reached, so
+ * num_done / num_total is only a rough estimate of the progress of the current
+ * frame.
+ * @return JXL_TRUE to continue decoding, JXL_FALSE to abort it.
+ */
+typedef JXL_BOOL (*JxlDecoderProgressCallback)(void* opaque, uint64_t num_done,
+                                               uint64_t num_total);
+
+/** Sets a callback called before decoding each DC and AC group of the frames,
+ * so that long decodes can be followed and aborted. It is called by the
+ * threads of the parallel runner, one at a time, and should return quickly.
+ * Once it returns JXL_FALSE, it is not called anymore, the remaining groups are
+ * skipped and JxlDecoderProcessInput returns JXL_DEC_ERROR. The decoder can
+ * then be reused after JxlDecoderRewind, which keeps the callback, or
+ * JxlDecoderReset, which removes it. May not be called during
+ * JxlDecoderProcessInput.
+ *
+ * @param dec decoder object
+ * @param callback the callback, or NULL (default) for none.
+ * @param opaque pointer passed to the callback.
+ */
+JXL_EXPORT void JxlDecoderSetProgressCallback(
+    JxlDecoder* dec, JxlDecoderProgressCallback callback, void* opaque);
+
+/** Enables the fixed-point 16-bit inverse DCTs for VarDCT frames decoded to an
+ * 8-bit sRGB output buffer set with JxlDecoderSetImageOutBuffer, on the
+ * targets where they are available (currently ARM NEON). They are faster than
+ * the floating point ones, but slightly less precise: the decoded pixels may
+ * differ by a small amount from those decoded without this option. Other
+ * outputs and frames are decoded as usual.
+ *
+ * @param dec decoder object
+ * @param enabled JXL_TRUE to allow the integer inverse DCTs, JXL_FALSE
+ * (default) to always use the floating point ones.
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise, e.g. if
+ * decoding already started.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetFastIntegerIDCT(JxlDecoder* dec,
+                                                         JXL_BOOL enabled);
+
+/** Allows decoding up to the given number of frames ahead of the current one,
+ * so that the frames of an animation are decoded in parallel, one frame per
+ * thread of the parallel runner, instead of parallelizing over the groups of
+ * each frame only. This is faster for animations of many small frames.
+ *
+ * Only the runs of frames that are already fully in the input and that are
+ * independent of each other are decoded ahead: displayed frames that cover
+ * the whole canvas, replace instead of blending and are not saved for other
+ * frames. The frames are still output in order, and are the same as without
+ * this option. Frames are only decoded ahead when coalescing is enabled
+ * (default), JXL_DEC_FULL_IMAGE is subscribed to, and none of
+ * JXL_DEC_FRAME_PROGRESSION, JPEG reconstruction, a crop region,
+ * downsampling, frame skipping, premultiplied alpha, the integer inverse
+ * DCTs, the frame memory arena, render statistics, a CPU limit or section
+ * input is used. The YCbCr planar output callback cannot be set for a frame
+ * decoded ahead. The decoded frames are kept in memory until they are output.
+ *
+ * @param dec decoder object
+ * @param max_frames maximum number of frames decoded ahead of the current
+ * one, or 0 (default) to decode one frame at a time.
+ * @return JXL_DEC_SUCCESS if no error, JXL_DEC_ERROR otherwise, e.g. if
+ * decoding already started.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetFrameLookahead(JxlDecoder* dec,
+                                                        size_t max_frames);
+
 /**
  * Decodes JPEG XL file using the available bytes. Requires input has been
  * set with JxlDecoderSetInput. After JxlDecoderProcessInput, input can
@@ -501,6 +847,58 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec,
  */
 JXL_EXPORT JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec);
 
+/** A unit of work submitted by JxlDecoderProcessInputAsync.
+ *
+ * @param task_opaque the pointer passed along with the task.
+ */
+typedef void (*JxlDecoderTask)(void* task_opaque);
+
+/** Function of the application that runs task(task_opaque) exactly once,
+ * later and on any thread, e.g. by posting it to an executor or event loop.
+ * It must not wait for the task to finish.
+ *
+ * @param submit_opaque the pointer passed to JxlDecoderProcessInputAsync.
+ * @param task the task to run.
+ * @param task_opaque the pointer to pass to the task.
+ */
+typedef void (*JxlDecoderSubmitFunction)(void* submit_opaque,
+                                         JxlDecoderTask task,
+                                         void* task_opaque);
+
+/** Called when the work of JxlDecoderProcessInputAsync is done.
+ *
+ * @param opaque the pointer passed to JxlDecoderProcessInputAsync.
+ * @param status what JxlDecoderProcessInput would have returned, e.g.
+ * JXL_DEC_NEED_MORE_INPUT or an event.
+ */
+typedef void (*JxlDecoderDoneCallback)(void* opaque, JxlDecoderStatus status);
+
+/**
+ * Asynchronous variant of JxlDecoderProcessInput: instead of blocking the
+ * calling thread, submits the work to `submit` and returns. The submitted
+ * task does what JxlDecoderProcessInput does, on the thread that runs it and
+ * with the parallel runner of the decoder, then calls `done` on that thread
+ * with the resulting status.
+ *
+ * From the return of this function until `done` is called, no other function
+ * may be called on the decoder and the input and output buffers must stay
+ * valid. During `done`, the decoder can be used again as after a
+ * JxlDecoderProcessInput call, e.g. to set more input and call this function
+ * once more. Many decoders can so be multiplexed on one executor.
+ *
+ * @param dec decoder object
+ * @param submit function that runs the task later, must not be NULL.
+ * @param submit_opaque pointer passed to `submit`.
+ * @param done callback called with the status, must not be NULL.
+ * @param done_opaque pointer passed to `done`.
+ * @return JXL_DEC_SUCCESS if the work was submitted, JXL_DEC_ERROR if a
+ * function is NULL or the work of a previous call is not done yet; `done` is
+ * then not called.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderProcessInputAsync(
+    JxlDecoder* dec, JxlDecoderSubmitFunction submit, void* submit_opaque,
+    JxlDecoderDoneCallback done, void* done_opaque);
+
 /**
  * Sets input data for JxlDecoderProcessInput. The data is owned by the caller
  * and may be used by the decoder until JxlDecoderReleaseInput is called or
@@ -808,6 +1206,170 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameHeader(const JxlDecoder* dec,
 JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameName(const JxlDecoder* dec,
                                                    char* name, size_t size);
 
+/**
+ * Outputs the region of the current frame that differs from the previous
+ * displayed frame, in the coordinates of the output image: after the
+ * orientation, the crop region and the downsampling. It is found from the
+ * frame headers only, so it is available from JXL_DEC_FRAME on: it covers the
+ * layers of the frames blended into the current one, or the whole image if one
+ * of them does not start from the previous frame. The pixels outside of it are
+ * the same as in the previous frame, the pixels inside of it may be the same
+ * too. The rect is empty if the frame repeats the previous one, and covers the
+ * whole image for the first frame and the first after skipped frames.
+ *
+ * Only available while coalescing is enabled.
+ *
+ * @param dec decoder object
+ * @param x0 output for the left column of the rect
+ * @param y0 output for the top row of the rect
+ * @param xsize output for the width of the rect
+ * @param ysize output for the height of the rect
+ * @return JXL_DEC_SUCCESS if the value is available, JXL_DEC_ERROR if there is
+ * no current frame or coalescing is disabled.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameDirtyRect(const JxlDecoder* dec,
+                                                        uint32_t* x0,
+                                                        uint32_t* y0,
+                                                        uint32_t* xsize,
+                                                        uint32_t* ysize);
+
+/**
+ * Outputs the byte range of the current frame in the codestream: the offset
+ * of its frame header and the size of the frame, including its header, TOC
+ * and sections. Offsets count the bytes of the codestream only, without the
+ * boxes of the container format. This function can be called when
+ * JXL_DEC_FRAME occurred for the current frame.
+ *
+ * When JXL_DEC_FULL_IMAGE is not subscribed to, the decoder only parses the
+ * frame headers and TOCs and skips the sections without allocating any state
+ * for them, so that the frames of a file can be indexed cheaply with
+ * JXL_DEC_FRAME events and this function.
+ *
+ * @param dec decoder object
+ * @param offset output for the position of the frame in the codestream
+ * @param size output for the size of the frame in bytes
+ * @return JXL_DEC_SUCCESS if the value is available, JXL_DEC_ERROR if no
+ *    frame header is available.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameCodestreamRange(
+    const JxlDecoder* dec, uint64_t* offset, uint64_t* size);
+
+/** Kind of data in a section of a frame, see JxlFrameSection.
+ */
+typedef enum {
+  /** The global data of the frame, needed for all its groups. */
+  JXL_FRAME_SECTION_DC_GLOBAL = 0,
+
+  /** The DC, i.e. the 1:8 downscaled image, of a DC group. */
+  JXL_FRAME_SECTION_DC_GROUP = 1,
+
+  /** The global data of the AC, needed for all the AC groups. */
+  JXL_FRAME_SECTION_AC_GLOBAL = 2,
+
+  /** One pass of the AC of a group. */
+  JXL_FRAME_SECTION_AC_GROUP = 3,
+
+  /** All the data of a frame that has a single group and a single pass, and
+   * so a single section. */
+  JXL_FRAME_SECTION_ALL = 4,
+} JxlFrameSectionType;
+
+/** A section of the current frame, as listed by its TOC, see
+ * JxlDecoderGetFrameSection.
+ */
+typedef struct {
+  /** Kind of data in the section. */
+  JxlFrameSectionType type;
+  /** Index of the DC group or of the group, in raster order, for
+   * JXL_FRAME_SECTION_DC_GROUP and JXL_FRAME_SECTION_AC_GROUP, 0 otherwise. */
+  uint32_t group;
+  /** Pass of the AC of the group for JXL_FRAME_SECTION_AC_GROUP, 0 otherwise.
+   */
+  uint32_t pass;
+  /** Position of the section in the codestream, in the same units as
+   * JxlDecoderGetFrameCodestreamRange. */
+  uint64_t offset;
+  /** Size of the section in bytes. */
+  uint64_t size;
+  /** Rectangle of the frame, in pixels of the frame before its origin is
+   * applied, covered by the group or DC group. The whole frame for the other
+   * sections. */
+  uint32_t x0;
+  uint32_t y0;
+  uint32_t xsize;
+  uint32_t ysize;
+} JxlFrameSection;
+
+/**
+ * Outputs the number of sections of the current frame, see
+ * JxlDecoderGetFrameSection. This function can be called when JXL_DEC_FRAME
+ * occurred for the current frame.
+ *
+ * @param dec decoder object
+ * @param num output for the number of sections
+ * @return JXL_DEC_SUCCESS if the value is available, JXL_DEC_ERROR if no
+ *    frame header is available.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameNumSections(const JxlDecoder* dec,
+                                                          size_t* num);
+
+/**
+ * Outputs where a section of the current frame is in the codestream and
+ * which part of the frame it describes, as read from the TOC of the frame.
+ * This function can be called when JXL_DEC_FRAME occurred for the current
+ * frame.
+ *
+ * Together with JxlDecoderSetFrameSectionInput, this allows fetching only
+ * the sections needed for a region or a downsampled version of the frame,
+ * e.g. with HTTP range requests: the DC global, AC global and DC group
+ * sections, and the AC group sections of the groups around the region, for
+ * the passes needed for the downsampling factor. The filters of the frame use
+ * pixels of the neighbouring groups, so fetch the groups surrounding a region
+ * too.
+ *
+ * @param dec decoder object
+ * @param index index of the section, smaller than the number output by
+ *    JxlDecoderGetFrameNumSections. Sections are indexed in the order of the
+ *    frame data that they hold, which may differ from their order in the
+ *    codestream.
+ * @param section output for the section
+ * @return JXL_DEC_SUCCESS if the value is available, JXL_DEC_ERROR if no
+ *    frame header is available or the index is out of range.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameSection(const JxlDecoder* dec,
+                                                      size_t index,
+                                                      JxlFrameSection* section);
+
+/**
+ * Provides the bytes of a section of the current frame separately from the
+ * codestream input, so that the sections can be given in any order and
+ * without the bytes between them. This function can be called when
+ * JXL_DEC_FRAME occurred for the current frame and until JXL_DEC_FULL_IMAGE
+ * occurs for it. The next JxlDecoderProcessInput calls decode the sections
+ * given so far, and return JXL_DEC_NEED_MORE_INPUT while more sections are
+ * needed, either with this function or with the codestream input.
+ *
+ * The input set with JxlDecoderSetInput only needs to reach the end of the
+ * TOC of the frame: the decoder then returns JXL_DEC_FULL_IMAGE as soon as the
+ * sections needed for the output, e.g. for the crop region set with
+ * JxlDecoderSetCropRegion, were given. The bytes of the frame are needed in
+ * the codestream input to continue with the next frames after it.
+ *
+ * @param dec decoder object
+ * @param index index of the section, see JxlDecoderGetFrameSection
+ * @param data bytes of the section. They must remain valid until
+ *    JXL_DEC_FULL_IMAGE occurs for the frame, or the decoder is rewound,
+ *    reset or destroyed.
+ * @param size number of bytes, which must be the size of the section
+ * @return JXL_DEC_SUCCESS if the section was accepted, JXL_DEC_ERROR if no
+ *    frame header is available, the frame was already decoded, or the index
+ *    or size are invalid.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetFrameSectionInput(JxlDecoder* dec,
+                                                           size_t index,
+                                                           const uint8_t* data,
+                                                           size_t size);
+
 /**
  * Outputs the blend information for the current frame for a specific extra
  * channel. This function can be called when JXL_DEC_FRAME occurred for the
@@ -833,19 +1395,20 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderGetExtraChannelBlendInfo(
  * @param size output value, buffer size in bytes
  * @return JXL_DEC_SUCCESS on success, JXL_DEC_ERROR on error, such as
  *    information not available yet.
- *
- * DEPRECATED: the DC feature in this form will be removed. Use
- * JxlDecoderFlushImage for progressive rendering.
  */
-JXL_EXPORT JXL_DEPRECATED JxlDecoderStatus JxlDecoderDCOutBufferSize(
+JXL_EXPORT JxlDecoderStatus JxlDecoderDCOutBufferSize(
     const JxlDecoder* dec, const JxlPixelFormat* format, size_t* size);
 
 /**
  * Sets the buffer to write the lower resolution (8x8 sub-sampled) DC image
- * to. The size of the buffer must be at least as large as given by
- * JxlDecoderDCOutBufferSize. The buffer follows the format described by
- * JxlPixelFormat. The DC image has dimensions ceil(xsize / 8) * ceil(ysize /
- * 8). The buffer is owned by the caller.
+ * to at JXL_DEC_DC_IMAGE. The size of the buffer must be at least as large as
+ * given by JxlDecoderDCOutBufferSize. The buffer follows the format described
+ * by JxlPixelFormat. The DC image has dimensions ceil(xsize / 8) *
+ * ceil(ysize / 8), with the orientation applied like for the full image, and
+ * the color space of the image out buffer. It is the average of each 8x8
+ * block, without the filters of the full resolution image. The buffer is
+ * owned by the caller, and stays set for the DC images of the following
+ * frames. Requires JXL_DEC_DC_IMAGE to be subscribed to.
  *
  * @param dec decoder object
  * @param format format of pixels. Object owned by user and its contents are
@@ -854,11 +1417,8 @@ JXL_EXPORT JXL_DEPRECATED JxlDecoderStatus JxlDecoderDCOutBufferSize(
  * @param size size of buffer in bytes
  * @return JXL_DEC_SUCCESS on success, JXL_DEC_ERROR on error, such as
  * size too small.
- *
- * DEPRECATED: the DC feature in this form will be removed. Use
- * JxlDecoderFlushImage for progressive rendering.
  */
-JXL_EXPORT JXL_DEPRECATED JxlDecoderStatus JxlDecoderSetDCOutBuffer(
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetDCOutBuffer(
     JxlDecoder* dec, const JxlPixelFormat* format, void* buffer, size_t size);
 
 /**
@@ -898,6 +1458,31 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderImageOutBufferSize(
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetImageOutBuffer(
     JxlDecoder* dec, const JxlPixelFormat* format, void* buffer, size_t size);
 
+/**
+ * Sets the buffer to write the full resolution image to, like
+ * JxlDecoderSetImageOutBuffer, but with the rows starting @p stride bytes
+ * apart instead of as given by the align field of @p format. This allows
+ * decoding in place to a region of a larger image, such as a texture atlas or
+ * a video frame buffer: @p buffer then points to the first pixel of the region
+ * and @p stride is the row size of the larger image. The bytes between the end
+ * of a row and the start of the next one are left untouched.
+ *
+ * @param dec decoder object
+ * @param format format of the pixels, its align field is ignored. Object owned
+ * by user and its contents are copied internally.
+ * @param buffer buffer type to output the pixel data to
+ * @param size size of buffer in bytes, at least @p stride times the number of
+ * rows minus one, plus the size of one row of pixels
+ * @param stride distance in bytes between the starts of consecutive rows, at
+ * least the size of one row of pixels, or 0 to behave as
+ * JxlDecoderSetImageOutBuffer
+ * @return JXL_DEC_SUCCESS on success, JXL_DEC_ERROR on error, such as
+ * size or stride too small.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetImageOutBufferWithStride(
+    JxlDecoder* dec, const JxlPixelFormat* format, void* buffer, size_t size,
+    size_t stride);
+
 /**
  * Function type for JxlDecoderSetImageOutCallback.
  * @see JxlDecoderSetImageOutCallback for usage.
@@ -956,6 +1541,32 @@ typedef void (*JxlImageOutRunCallback)(void* run_opaque, size_t thread_id,
                                        size_t x, size_t y, size_t num_pixels,
                                        const void* pixels);
 
+/**
+ * Worker callback for @c JxlDecoderSetMultithreadedImageOutTileCallback.
+ *
+ * @see JxlDecoderSetMultithreadedImageOutTileCallback
+ *
+ * @param run_opaque user data returned by the @c init callback.
+ * @param thread_id number in `[0, num_threads)` identifying the thread of the
+ * current invocation of the callback.
+ * @param x horizontal position of the leftmost pixels of the tile.
+ * @param y vertical position of the top row of the tile.
+ * @param xsize width of the tile in pixels.
+ * @param ysize height of the tile in pixels. The number of pixels of the tile,
+ * @c xsize times @c ysize, is at most the @c num_pixels_per_thread that was
+ * passed to @c init.
+ * @param pixels pixel data of the rows of the tile, top to bottom, in the
+ * format passed to @c JxlDecoderSetMultithreadedImageOutTileCallback. The data
+ * pointed to remains owned by the caller and is only guaranteed to outlive the
+ * current callback invocation.
+ * @param stride distance in bytes between the starts of consecutive rows of @c
+ * pixels.
+ */
+typedef void (*JxlImageOutTileCallback)(void* run_opaque, size_t thread_id,
+                                        size_t x, size_t y, size_t xsize,
+                                        size_t ysize, const void* pixels,
+                                        size_t stride);
+
 /**
  * Destruction callback for @c JxlDecoderSetMultithreadedImageOutCallback,
  * called after all invocations of the @c run callback to perform any
@@ -1037,6 +1648,114 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
     JxlImageOutInitCallback init_callback, JxlImageOutRunCallback run_callback,
     JxlImageOutDestroyCallback destroy_callback, void* init_opaque);
 
+/** Similar to @c JxlDecoderSetMultithreadedImageOutCallback except that the
+ * pixels are given as rectangular tiles instead of partial scanlines, saving
+ * their reassembly for consumers such as GPU uploads or tiled file writers.
+ * Each tile is a rectangle of the image that the decoder rendered on one
+ * thread, such as a group of the frame after all rendering steps. The tiles
+ * of a frame do not overlap and together cover the whole image.
+ *
+ * The tiles have several rows only if the frame is rendered group by group,
+ * which requires JXL_TYPE_FLOAT output in native endianness with 3 or 4
+ * channels and neither a crop region nor downsampling, and that the
+ * orientation is either identity or kept with JxlDecoderSetKeepOrientation.
+ * Otherwise, each row is given as a tile of its own.
+ *
+ * @param dec decoder object
+ * @param format format of the pixels. Object owned by user; its contents are
+ * copied internally.
+ * @param init_callback initialization callback, whose @c num_pixels_per_thread
+ * is the maximum number of pixels of a tile.
+ * @param run_callback the callback function receiving tiles of pixel data.
+ * @param destroy_callback clean-up callback invoked after all calls to @c
+ * run_callback.
+ * @param init_opaque optional user data passed to @c init_callback, may be NULL
+ * (unlike the return value from @c init_callback which may only be NULL if
+ * initialization failed).
+ * @return JXL_DEC_SUCCESS on success, JXL_DEC_ERROR on error, such as @c
+ * JxlDecoderSetImageOutBuffer having already been called.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetMultithreadedImageOutTileCallback(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    JxlImageOutInitCallback init_callback, JxlImageOutTileCallback run_callback,
+    JxlImageOutDestroyCallback destroy_callback, void* init_opaque);
+
+/**
+ * Function type for JxlDecoderSetYCbCrPlanarOutCallback.
+ * @see JxlDecoderSetYCbCrPlanarOutCallback for usage.
+ *
+ * The callback may be called simultaneously by different threads when using a
+ * threaded parallel runner, on different pixels.
+ *
+ * @param opaque optional user data, as given to
+ * JxlDecoderSetYCbCrPlanarOutCallback.
+ * @param plane index of the plane of the pixel data: 0 for Y, 1 for Cb and 2
+ * for Cr.
+ * @param x horizontal position of leftmost sample of the pixel data, in the
+ * (possibly subsampled) coordinates of the plane.
+ * @param y vertical position of the pixel data, in the coordinates of the
+ * plane.
+ * @param num_pixels amount of samples included in the pixel data.
+ * @param pixels samples as a horizontal stripe, in the data type passed to
+ * JxlDecoderSetYCbCrPlanarOutCallback. The memory is not owned by the user,
+ * and is only valid during the time the callback is running.
+ */
+typedef void (*JxlImageOutPlaneCallback)(void* opaque, uint32_t plane,
+                                         size_t x, size_t y, size_t num_pixels,
+                                         const void* pixels);
+
+/**
+ * Sets a planar output callback for frames stored as YCbCr, such as
+ * recompressed JPEG images. This is an alternative to
+ * JxlDecoderSetImageOutBuffer and JxlDecoderSetImageOutCallback, which may not
+ * be used for the same frame.
+ * It must be set when the JXL_DEC_NEED_IMAGE_OUT_BUFFER event occurs, and
+ * applies only for the current frame.
+ *
+ * The Y, Cb and Cr planes are passed to the callback at their native
+ * subsampling, see JxlDecoderGetYCbCrPlaneShifts, without chroma upsampling nor
+ * conversion to RGB. Samples are full range as in JFIF, with Cb and Cr
+ * centered around 128 for JXL_TYPE_UINT8 or 0.5 for JXL_TYPE_FLOAT. No extra
+ * channels are output, and the planes are in the orientation of the codestream.
+ *
+ * This fails if the frame is not stored as YCbCr, if it needs rendering
+ * features other than the loop filters of a frame without chroma subsampling
+ * (as is the case for blending, patches, noise, splines or upsampling), if a
+ * crop region or downsampling is used, or if the image has a non-identity
+ * orientation and JxlDecoderSetKeepOrientation was not enabled.
+ *
+ * @param dec decoder object
+ * @param format format of the samples. Object owned by user; its contents are
+ * copied internally. num_channels must be 1 and data_type must be
+ * JXL_TYPE_UINT8 or JXL_TYPE_FLOAT, in native endianness.
+ * @param callback the callback function receiving partial rows of the planes.
+ * @param opaque optional user data, which will be passed on to the callback,
+ * may be NULL.
+ * @return JXL_DEC_SUCCESS on success, JXL_DEC_ERROR on error, such as an
+ * unsupported frame or JxlDecoderSetImageOutBuffer already set.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetYCbCrPlanarOutCallback(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    JxlImageOutPlaneCallback callback, void* opaque);
+
+/**
+ * Outputs the subsampling of a plane of the current frame, in the numbering
+ * of JxlDecoderSetYCbCrPlanarOutCallback. The plane has
+ * ceil(xsize / 2^shift_x) by ceil(ysize / 2^shift_y) samples, where xsize and
+ * ysize are the dimensions of the frame. Can be used after the JXL_DEC_FRAME
+ * event of a frame stored as YCbCr.
+ *
+ * @param dec decoder object
+ * @param plane index of the plane: 0 for Y, 1 for Cb and 2 for Cr.
+ * @param shift_x output value, log2 of the horizontal subsampling factor.
+ * @param shift_y output value, log2 of the vertical subsampling factor.
+ * @return JXL_DEC_SUCCESS on success, JXL_DEC_ERROR if no frame header is
+ * available, the frame is not stored as YCbCr, or the plane is invalid.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetYCbCrPlaneShifts(
+    const JxlDecoder* dec, uint32_t plane, uint32_t* shift_x,
+    uint32_t* shift_y);
+
 /**
  * Returns the minimum size in bytes of an extra channel pixel buffer for the
  * given format. This is the buffer for JxlDecoderSetExtraChannelBuffer.
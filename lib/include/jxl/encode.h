@@ -280,6 +280,9 @@ typedef enum {
    * a later frame is attempted to be indexed, JXL_ENC_ERROR will occur.
    * If non-keyframes, i.e., frames with cropping, blending or patches are
    * attempted to be indexed, JXL_ENC_ERROR will occur.
+   * The frame index box is written before the codestream, so if the first
+   * frame is indexed, no output is produced until the last frame, after
+   * JxlEncoderCloseFrames, has been processed.
    */
   JXL_ENC_FRAME_INDEX_BOX = 31,
 
@@ -290,6 +293,74 @@ typedef enum {
    */
   JXL_ENC_FRAME_SETTING_BROTLI_EFFORT = 32,
 
+  /** Reuse the MA tree learned for a frame of modular mode (or for the
+   * modular parts of VarDCT mode) when encoding later frames added with these
+   * frame settings, instead of learning a new tree for each frame. This speeds
+   * up encoding of sequences of similar frames, such as animations or slices,
+   * at some cost in density if the frames differ. Frames whose streams are
+   * quantized differently learn a new tree. 0 = learn a tree for each frame
+   * (default), 1 = reuse the tree learned for a previous frame.
+   */
+  JXL_ENC_FRAME_SETTING_MODULAR_REUSE_TREE = 33,
+
+  /** Use less memory for lossless JPEG recompression (JxlEncoderAddJPEGFrame)
+   * by converting and tokenizing the DCT coefficients group by group, so that
+   * only the parsed JPEG, the tokens and the JPEG reconstruction data are kept
+   * in memory, instead of also full-frame copies of the coefficients and a
+   * placeholder pixel buffer. The encoded output is the same. Must be set
+   * before JxlEncoderAddJPEGFrame is called.
+   * 0 = disabled (default), 1 = enabled.
+   */
+  JXL_ENC_FRAME_SETTING_JPEG_LOW_MEMORY = 34,
+
+  /** Use less memory for lossy encoding of pixels (VarDCT mode), by
+   * releasing the XYB image as soon as the coefficients are computed, the
+   * full-frame coefficients as soon as they are tokenized, and the tokens of
+   * each group as soon as its section is written, instead of keeping all of
+   * them until the frame is done. The encoded output is the same.
+   * 0 = disabled (default), 1 = enabled.
+   */
+  JXL_ENC_FRAME_SETTING_LOW_MEMORY = 35,
+
+  /** Wall-clock budget for encoding each frame, in milliseconds, counted from
+   * the start of its encoding in JxlEncoderProcessOutput. The encoder
+   * estimates the time of its optional stages from how long the previous ones
+   * took, and lowers their effort or skips them when they would not fit:
+   * patch detection, the AC strategy and other block heuristics, the
+   * butteraugli iterations and MA tree learning. The output is always a valid
+   * codestream, which only takes longer than the budget if encoding at the
+   * lowest effort of these stages does. The output depends on the timing, so
+   * it is not deterministic.
+   * -1 or 0 = no budget (default), otherwise the budget in milliseconds.
+   */
+  JXL_ENC_FRAME_SETTING_TIME_BUDGET = 36,
+
+  /** Choose how to encode each lossy frame from a quick analysis of its
+   * pixels, instead of using VarDCT with the default heuristics: modular mode
+   * for images with few colors, such as diagrams and logos, VarDCT with patch
+   * detection for screen content with large flat areas or repeated tiles, and
+   * VarDCT without patch detection for photographs. Setting
+   * JXL_ENC_FRAME_SETTING_MODULAR to 0 or 1 disables this choice, and setting
+   * JXL_ENC_FRAME_SETTING_PATCHES to 0 or 1 takes precedence over the patch
+   * detection it chooses. Ignored for lossless frames and JPEG recompression.
+   * 0 = disabled (default), 1 = enabled.
+   */
+  JXL_ENC_FRAME_SETTING_CLASSIFY_CONTENT = 37,
+
+  /** Maximum decoding cost of each frame, as estimated in
+   * JxlEncoderDecodeCost, in cycles per pixel. Before encoding a frame whose
+   * predicted cost is higher, the encoder disables its decoding tools one at a
+   * time, in order of decreasing cost compared to their benefit: the third
+   * iteration of the edge-preserving filter, noise synthesis, the second
+   * iteration, gaborish, the last iteration, patches, and finally the slower
+   * choices of JXL_ENC_FRAME_SETTING_DECODING_SPEED 4. These override their
+   * own settings. The limit is not guaranteed: the prediction is made before
+   * encoding, and the remaining cost, such as entropy decoding, cannot be
+   * disabled.
+   * -1 or 0 = no limit (default), otherwise the limit in cycles per pixel.
+   */
+  JXL_ENC_FRAME_SETTING_MAX_DECODE_CYCLES = 38,
+
   /** Enum value not to be used as an option. This value is added to force the
    * C compiler to have the enum to take a known size.
    */
@@ -338,10 +409,206 @@ JXL_EXPORT void JxlEncoderDestroy(JxlEncoder* enc);
  */
 JXL_EXPORT void JxlEncoderSetCms(JxlEncoder* enc, JxlCmsInterface cms);
 
+/**
+ * Outputs the memory in use by the encoder, and its peak, see JxlMemoryStats.
+ * This can be called at any time, also from another thread while the encoder
+ * is in use.
+ *
+ * @param enc encoder object.
+ * @param stats output for the memory stats.
+ */
+JXL_EXPORT void JxlEncoderGetMemoryStats(const JxlEncoder* enc,
+                                         JxlMemoryStats* stats);
+
+/**
+ * Sets a budget for the memory counted in JxlMemoryStats. When adding a frame
+ * or encoding makes the memory in use exceed the budget, the call returns
+ * JXL_ENC_ERROR. The budget is kept by JxlEncoderReset.
+ *
+ * @param enc encoder object.
+ * @param max_bytes maximum number of bytes in use, or 0 (default) for no
+ * limit.
+ */
+JXL_EXPORT void JxlEncoderSetMemoryLimit(JxlEncoder* enc, uint64_t max_bytes);
+
+/** Phases of encoding timed in JxlEncoderCounters.
+ */
+typedef enum {
+  /** Copying and converting the pixels passed to the functions adding frames.
+   */
+  JXL_ENC_PHASE_INPUT = 0,
+  /** Color transforms of the frames and, for lossy frames, the encoder
+   * heuristics, the DCTs and the tokenization of the coefficients, or the
+   * analysis of a JPEG file to recompress.
+   */
+  JXL_ENC_PHASE_TRANSFORM = 1,
+  /** Modular encoding of the frames, or of the parts of lossy frames using
+   * it: transforms, learning of the MA trees and tokenization.
+   */
+  JXL_ENC_PHASE_MODULAR = 2,
+  /** Entropy coding: building and clustering the histograms and writing the
+   * headers and sections of the frames.
+   */
+  JXL_ENC_PHASE_WRITE = 3,
+} JxlEncoderPhase;
+
+/** Number of values of JxlEncoderPhase. */
+#define JXL_ENC_NUM_PHASES 4
+
+/** Counters of the work done by an encoder, as returned by
+ * JxlEncoderGetCounters.
+ */
+typedef struct {
+  /** Elapsed time spent in each phase, indexed by JxlEncoderPhase, summed
+   * over the frames that are encoded in parallel. */
+  uint64_t nanoseconds[JXL_ENC_NUM_PHASES];
+  /** Number of frames encoded. */
+  uint64_t frames;
+  /** Number of AC groups (up to 256x256 pixel regions) encoded. */
+  uint64_t groups;
+  /** Number of bytes of the encoded frames, without the headers of the
+   * image and of the container. */
+  uint64_t bytes;
+} JxlEncoderCounters;
+
+/**
+ * Outputs counters of the time spent in each phase of encoding and of the
+ * amount of data encoded, accumulated since the encoder was created or last
+ * reset. The counters are always collected; they are updated a few times per
+ * frame, which costs much less than 1% of the encoding time. This can be
+ * called at any time, also from another thread while the encoder is in use.
+ *
+ * @param enc encoder object.
+ * @param counters output for the counters.
+ */
+JXL_EXPORT void JxlEncoderGetCounters(const JxlEncoder* enc,
+                                      JxlEncoderCounters* counters);
+
+/** Stages of decoding whose cost is estimated in JxlEncoderDecodeCost.
+ */
+typedef enum {
+  /** Entropy decoding of the sections, and the prediction of modular
+   * channels, including the extra channels of lossy frames.
+   */
+  JXL_ENC_DECODE_STAGE_ENTROPY = 0,
+  /** Dequantization and inverse DCTs, or the inverse modular transforms.
+   */
+  JXL_ENC_DECODE_STAGE_TRANSFORM = 1,
+  /** Gaborish smoothing.
+   */
+  JXL_ENC_DECODE_STAGE_GABORISH = 2,
+  /** Iterations of the edge-preserving filter.
+   */
+  JXL_ENC_DECODE_STAGE_EPF = 3,
+  /** Rendering of the patches.
+   */
+  JXL_ENC_DECODE_STAGE_PATCHES = 4,
+  /** Rendering of the splines.
+   */
+  JXL_ENC_DECODE_STAGE_SPLINES = 5,
+  /** Noise synthesis.
+   */
+  JXL_ENC_DECODE_STAGE_NOISE = 6,
+  /** Upsampling of frames encoded at a lower resolution.
+   */
+  JXL_ENC_DECODE_STAGE_UPSAMPLING = 7,
+  /** Conversion from XYB or YCbCr, and blending.
+   */
+  JXL_ENC_DECODE_STAGE_COLOR = 8,
+} JxlEncoderDecodeStage;
+
+/** Number of values of JxlEncoderDecodeStage. */
+#define JXL_ENC_NUM_DECODE_STAGES 9
+
+/** Estimated cost of decoding the encoded frames, as returned by
+ * JxlEncoderGetDecodeCost.
+ */
+typedef struct {
+  /** Rough number of cycles of a single-threaded decoder on a recent x86
+   * core spent in each stage, indexed by JxlEncoderDecodeStage, summed over
+   * the frames. The estimate is derived from the decoding tools enabled in
+   * the header of each frame and from its size; it is meant to compare
+   * encoding settings, not to predict decoding times. */
+  uint64_t cycles[JXL_ENC_NUM_DECODE_STAGES];
+  /** Number of pixels of the frames, to derive the cycles per pixel. */
+  uint64_t pixels;
+} JxlEncoderDecodeCost;
+
+/**
+ * Outputs the estimated cost of decoding the frames encoded since the encoder
+ * was created or last reset. The cost of a single frame is the difference
+ * between the values before and after encoding it. This can be called at any
+ * time, also from another thread while the encoder is in use.
+ *
+ * @param enc encoder object.
+ * @param cost output for the estimated cost.
+ */
+JXL_EXPORT void JxlEncoderGetDecodeCost(const JxlEncoder* enc,
+                                        JxlEncoderDecodeCost* cost);
+
+/**
+ * Progress callback of an encoder, see JxlEncoderSetProgressCallback.
+ *
+ * @param opaque the pointer passed to JxlEncoderSetProgressCallback.
+ * @param num_done number of units of work started so far, i.e. groups or
+ * tiles of a frame in one of the steps of encoding, or butteraugli iterations.
+ * @param num_total number of units of work of the steps started so far. It
+ * grows as the encoder reaches later steps and frames, so num_done / num_total
+ * is only a rough estimate of the progress of the current step.
+ * @return JXL_TRUE to continue encoding, JXL_FALSE to abort it.
+ */
+typedef JXL_BOOL (*JxlEncoderProgressCallback)(void* opaque, uint64_t num_done,
+                                               uint64_t num_total);
+
+/**
+ * Sets a callback called at the start of each task of the parallel loops over
+ * the groups of the frames being encoded, and of each butteraugli iteration,
+ * so that long encodes can be followed and aborted. It is called by the
+ * threads of the parallel runner, one at a time, and should return quickly.
+ * Once it returns JXL_FALSE, it is not called anymore, the remaining tasks are
+ * skipped and JxlEncoderProcessOutput returns JXL_ENC_ERROR. The encoder can
+ * then be reused after JxlEncoderReset, which keeps the callback. The frames
+ * encoded with the fast lossless mode of effort 1 are not followed. May not
+ * be called during JxlEncoderProcessOutput.
+ *
+ * @param enc encoder object.
+ * @param callback the callback, or NULL (default) for none.
+ * @param opaque pointer passed to the callback.
+ */
+JXL_EXPORT void JxlEncoderSetProgressCallback(
+    JxlEncoder* enc, JxlEncoderProgressCallback callback, void* opaque);
+
+/**
+ * Makes the encoder keep the large image buffers it frees, up to the given
+ * total size, and reuse them for later buffers of a similar size instead of
+ * allocating them again with the memory manager passed to JxlEncoderCreate.
+ * This avoids the cost of getting fresh memory from the system when encoding
+ * many images of similar dimensions with the same instance, with
+ * JxlEncoderReset in between. The kept buffers are not counted as in use in
+ * JxlMemoryStats. The pool is kept by JxlEncoderReset and freed by
+ * JxlEncoderDestroy. May be called at any time.
+ *
+ * @param enc encoder object.
+ * @param max_kept_bytes maximum total size of the kept buffers, or 0 (default)
+ * to free all kept buffers and stop pooling.
+ */
+JXL_EXPORT void JxlEncoderSetBufferPool(JxlEncoder* enc, size_t max_kept_bytes);
+
 /**
  * Set the parallel runner for multithreading. May only be set before starting
  * encoding.
  *
+ * Besides splitting each frame into groups, the runner is also used to encode
+ * several queued frames at once, one per thread, if they don't depend on each
+ * other: they are not blended onto earlier frames nor saved as reference
+ * frames. The frames are still output in the order they were added.
+ *
+ * The encoded bytes do not depend on the runner nor on its number of threads:
+ * the work is split the same way for any runner and the results of the
+ * threads are combined in a fixed order, so that the same input and frame
+ * settings always give the same codestream. The only exception is
+ * JXL_ENC_FRAME_SETTING_TIME_BUDGET, whose decisions depend on the timing.
+ *
  * @param enc encoder object.
  * @param parallel_runner function pointer to runner for multithreading. It may
  *        be NULL to use the default, single-threaded, runner. A multithreaded
@@ -383,6 +650,113 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderProcessOutput(JxlEncoder* enc,
                                                     uint8_t** next_out,
                                                     size_t* avail_out);
 
+/**
+ * Alternative to @ref JxlEncoderProcessOutput that hands out the encoded bytes
+ * without copying them into a caller-provided buffer. Each call returns the
+ * next chunk of output, such as a box header or the encoded bytes of a frame,
+ * as a pointer into memory owned by the encoder. The chunk stays valid until
+ * the next call of any encoder function with this encoder.
+ *
+ * Encoding of the added frames and boxes happens as needed during this call,
+ * with the same requirements regarding @ref JxlEncoderCloseInput as for @ref
+ * JxlEncoderProcessOutput. Both functions may be mixed: this function returns
+ * what is left of a chunk that was partially output by @ref
+ * JxlEncoderProcessOutput.
+ *
+ * @param enc encoder object.
+ * @param chunk set to the start of the returned chunk, or to NULL if there is
+ * no more output.
+ * @param size set to the size in bytes of the returned chunk, 0 if none.
+ * @return JXL_ENC_NEED_MORE_OUTPUT when a chunk was returned, and this function
+ * must be called again to get the next one.
+ * @return JXL_ENC_SUCCESS when encoding finished and all output was returned.
+ * @return JXL_ENC_ERROR when encoding failed, e.g. invalid input.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderProcessOutputChunk(JxlEncoder* enc,
+                                                         const uint8_t** chunk,
+                                                         size_t* size);
+
+/**
+ * Output callback of an encoder, see JxlEncoderSetOutputCallback.
+ *
+ * @param opaque the pointer passed to JxlEncoderSetOutputCallback.
+ * @param data the next bytes of the output, only valid during the call.
+ * @param size the number of bytes.
+ */
+typedef void (*JxlEncoderOutputCallback)(void* opaque, const uint8_t* data,
+                                         size_t size);
+
+/**
+ * Makes the encoder pass its output to a callback, in order, as soon as each
+ * part of it is final, instead of returning it from @ref
+ * JxlEncoderProcessOutput or @ref JxlEncoderProcessOutputChunk. These still
+ * do the encoding, but return no bytes: the output buffer given to @ref
+ * JxlEncoderProcessOutput is not used, and it returns JXL_ENC_SUCCESS once
+ * the added frames and boxes are encoded.
+ *
+ * This makes progressive frames available earlier: with
+ * JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, the DC of a frame is a separate frame
+ * of the codestream, which is passed to the callback as soon as it is
+ * encoded, while the AC of the frame is still being encoded, so that a
+ * receiver of a live stream can render a preview sooner. This does not apply
+ * when using a frame index box, which must precede the codestream and holds
+ * back all output until the last frame is encoded, unless the output can be
+ * patched, see @ref JxlEncoderSetOutputPatchCallback.
+ *
+ * It is called by the thread calling the encoder. May only be set before
+ * encoding starts, and is kept by JxlEncoderReset.
+ *
+ * @param enc encoder object.
+ * @param callback the callback, or NULL (default) to return the output from
+ * @ref JxlEncoderProcessOutput.
+ * @param opaque pointer passed to the callback.
+ * @return JXL_ENC_SUCCESS if the callback was set, JXL_ENC_ERROR if encoding
+ * already started.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderSetOutputCallback(
+    JxlEncoder* enc, JxlEncoderOutputCallback callback, void* opaque);
+
+/**
+ * Patch callback of an encoder, see JxlEncoderSetOutputPatchCallback.
+ *
+ * @param opaque the pointer passed to JxlEncoderSetOutputPatchCallback.
+ * @param offset position in the output of the first byte to overwrite.
+ * @param data the bytes replacing the output from offset on, only valid
+ * during the call.
+ * @param size the number of bytes, which were all passed to the output
+ * callback before.
+ */
+typedef void (*JxlEncoderOutputPatchCallback)(void* opaque, uint64_t offset,
+                                              const uint8_t* data,
+                                              size_t size);
+
+/**
+ * Lets the encoder overwrite output that it already passed to the callback of
+ * @ref JxlEncoderSetOutputCallback, for outputs that allow it such as files.
+ * The encoder then outputs placeholders for the parts that are only known
+ * later and patches them, instead of holding back all the output after them.
+ *
+ * This applies to the frame index box of JXL_ENC_FRAME_INDEX_BOX, which
+ * precedes the codestream but holds the positions of the frames in it: if all
+ * frames are added and closed with @ref JxlEncoderCloseFrames or @ref
+ * JxlEncoderCloseInput before the output starts, the space of the box is
+ * reserved and the frames are output as they are encoded, so that the encoder
+ * does not keep the whole encoded image. The part of the reserved space that
+ * the box does not need becomes a "free" box, which decoders skip.
+ *
+ * It has no effect without an output callback. It is called by the thread
+ * calling the encoder. May only be set before encoding starts, and is kept by
+ * JxlEncoderReset.
+ *
+ * @param enc encoder object.
+ * @param callback the callback, or NULL (default) to never patch the output.
+ * @param opaque pointer passed to the callback.
+ * @return JXL_ENC_SUCCESS if the callback was set, JXL_ENC_ERROR if encoding
+ * already started.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderSetOutputPatchCallback(
+    JxlEncoder* enc, JxlEncoderOutputPatchCallback callback, void* opaque);
+
 /**
  * Sets the frame information for this frame to the encoder. This includes
  * animation information such as frame duration to store in the frame header.
@@ -548,6 +922,97 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderAddImageFrame(
     const JxlEncoderFrameSettings* frame_settings,
     const JxlPixelFormat* pixel_format, const void* buffer, size_t size);
 
+/**
+ * Function type for @ref JxlEncoderAddImageFrameFromRowSource. The encoder
+ * calls it to fill a strip of rows of the frame, in increasing row order.
+ *
+ * @param opaque user data, as given to @ref
+ * JxlEncoderAddImageFrameFromRowSource.
+ * @param y0 index of the first row of the requested strip.
+ * @param num_rows number of rows in the requested strip.
+ * @param buffer buffer to write the pixels of the strip to, in the pixel
+ * format given to @ref JxlEncoderAddImageFrameFromRowSource. The first row of
+ * the strip is at the start of the buffer, and consecutive rows are spaced by
+ * the stride implied by the frame width, the pixel format and its align.
+ * @param size size of buffer in bytes.
+ * @return JXL_TRUE on success, JXL_FALSE to abort encoding of the frame.
+ */
+typedef JXL_BOOL (*JxlEncoderRowSourceFunc)(void* opaque, size_t y0,
+                                            size_t num_rows, void* buffer,
+                                            size_t size);
+
+/**
+ * Alternative to @ref JxlEncoderAddImageFrame that pulls the pixels of the
+ * next image to encode from a callback instead of one contiguous buffer. The
+ * same pixel formats and requirements as @ref JxlEncoderAddImageFrame apply.
+ *
+ * The callback is not called by this function: it is called from @ref
+ * JxlEncoderProcessOutput when the encoder reaches this frame, once per strip
+ * of rows, so the pixel source and opaque must stay valid until then. The
+ * encoder only keeps one strip of input pixels at a time, so the caller does
+ * not need to hold the whole frame in its pixel format in memory.
+ *
+ * @param frame_settings set of options and metadata for this frame. Also
+ * includes reference to the encoder object.
+ * @param pixel_format format for pixels. Object owned by the caller and its
+ * contents are copied internally.
+ * @param func callback that provides strips of rows of the frame.
+ * @param opaque user data passed to func.
+ * @return JXL_ENC_SUCCESS on success, JXL_ENC_ERROR on error
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderAddImageFrameFromRowSource(
+    const JxlEncoderFrameSettings* frame_settings,
+    const JxlPixelFormat* pixel_format, JxlEncoderRowSourceFunc func,
+    void* opaque);
+
+/**
+ * Planar YCbCr image for @ref JxlEncoderAddYCbCrPlanarFrame.
+ */
+typedef struct {
+  /** Data type of the samples: JXL_TYPE_UINT8 or JXL_TYPE_UINT16, in native
+   * endianness.
+   */
+  JxlDataType data_type;
+
+  /** Log2 of the horizontal subsampling of the chroma planes, 0 or 1. */
+  uint32_t chroma_shift_x;
+
+  /** Log2 of the vertical subsampling of the chroma planes, 0 or 1. For
+   * example, 4:2:0 has both shifts set to 1 and 4:2:2 only chroma_shift_x.
+   */
+  uint32_t chroma_shift_y;
+
+  /** First samples of the Y, Cb and Cr planes. The Y plane has the dimensions
+   * of the frame, and the chroma planes ceil(xsize / 2^chroma_shift_x) by
+   * ceil(ysize / 2^chroma_shift_y) samples.
+   */
+  const void* planes[3];
+
+  /** Distance in bytes between consecutive rows of each plane. */
+  size_t strides[3];
+} JxlYCbCrPlanarImage;
+
+/**
+ * Alternative to @ref JxlEncoderAddImageFrame for planar YCbCr input, as
+ * produced by video decoders. The samples are full-range YCbCr as defined by
+ * JFIF (BT.601 coefficients, chroma centered at 128 for 8-bit samples), of
+ * the nonlinear RGB that @ref JxlEncoderAddImageFrame would receive for an
+ * integer pixel format. The chroma planes are upsampled and converted in a
+ * single pass, without an intermediate interleaved RGB buffer.
+ *
+ * If the image has alpha, it is set to all-opaque; other extra channels need
+ * to be set by @ref JxlEncoderSetExtraChannelBuffer.
+ *
+ * @param frame_settings set of options and metadata for this frame. Also
+ * includes reference to the encoder object.
+ * @param image the planes of the frame. Object owned by the caller; the
+ * samples are converted before the function returns.
+ * @return JXL_ENC_SUCCESS on success, JXL_ENC_ERROR on error
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderAddYCbCrPlanarFrame(
+    const JxlEncoderFrameSettings* frame_settings,
+    const JxlYCbCrPlanarImage* image);
+
 /**
  * Sets the buffer to read pixels from for an extra channel at a given index.
  * The index must be smaller than the num_extra_channels in the associated
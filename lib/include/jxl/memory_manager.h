@@ -14,6 +14,7 @@
 #define JXL_MEMORY_MANAGER_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 #if defined(__cplusplus) || defined(c_plusplus)
 extern "C" {
@@ -63,6 +64,40 @@ typedef struct JxlMemoryManagerStruct {
   /* TODO(deymo): Add cache-aligned alloc/free functions here. */
 } JxlMemoryManager;
 
+/** What the memory counted in JxlMemoryStats is used for. */
+typedef enum {
+  /** Frames, reference frames and the buffers not in the other categories. */
+  JXL_MEMORY_IMAGES = 0,
+  /** Quantized or dequantized DCT coefficients. */
+  JXL_MEMORY_COEFFICIENTS = 1,
+  /** Buffers of the stages that render decoded frames into output pixels. */
+  JXL_MEMORY_PIPELINE = 2,
+  /** Copies of the input given to the encoder or decoder. */
+  JXL_MEMORY_INPUT = 3,
+} JxlMemoryCategory;
+
+/** Number of values of JxlMemoryCategory. */
+#define JXL_MEMORY_NUM_CATEGORIES 4
+
+/** Bytes of memory in use by an encoder or decoder, as returned by
+ * JxlDecoderGetMemoryStats and JxlEncoderGetMemoryStats. Only the large
+ * buffers (images, coefficients, render pipeline buffers and input copies) are
+ * counted, including the alignment overhead of each buffer; small bookkeeping
+ * allocations are not.
+ */
+typedef struct {
+  /** Bytes currently in use. */
+  uint64_t current_bytes;
+  /** Maximum of current_bytes since the instance was created. */
+  uint64_t peak_bytes;
+  /** Bytes currently in use, indexed by JxlMemoryCategory. */
+  uint64_t current_bytes_per_category[JXL_MEMORY_NUM_CATEGORIES];
+  /** Maximum of each entry of current_bytes_per_category, indexed by
+   * JxlMemoryCategory. The maxima may occur at different times, so they do
+   * not add up to peak_bytes. */
+  uint64_t peak_bytes_per_category[JXL_MEMORY_NUM_CATEGORIES];
+} JxlMemoryStats;
+
 #if defined(__cplusplus) || defined(c_plusplus)
 }
 #endif
@@ -0,0 +1,96 @@
+/* Copyright (c) the JPEG XL Project Authors. All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/** @addtogroup libjxl_threads
+ * @{
+ * @file shared_parallel_runner.h
+ * @brief implementation using std::thread of a ::JxlParallelRunner that is
+ * shared by many encoder and decoder instances.
+ */
+
+/** Implementation of JxlParallelRunner for processes that run many encoder or
+ * decoder instances at the same time, e.g. a server handling requests
+ * concurrently. A single pool with a fixed set of worker threads is created
+ * for the process, and each JxlEncoder or JxlDecoder gets its own tenant of
+ * the pool as runner. Unlike a single runner of @ref thread_parallel_runner.h
+ * shared by all instances, which would run one JxlParallelRunner call at a
+ * time, the pool accepts concurrent calls from different tenants and
+ * interleaves their tasks on its workers. Unlike one runner per instance, the
+ * number of threads doesn't grow with the number of instances.
+ *
+ * The workers pick tasks from the running calls in proportion to the priority
+ * of their tenants, so a tenant with priority 2 gets about twice the worker
+ * time of a tenant with priority 1 while both have tasks. The thread calling
+ * the runner also runs tasks of its own call, so that every call makes
+ * progress even when all the workers are busy. Only one concurrent
+ * JxlSharedParallelRunner call per tenant is allowed at a time.
+ */
+
+#ifndef JXL_SHARED_PARALLEL_RUNNER_H_
+#define JXL_SHARED_PARALLEL_RUNNER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jxl/jxl_threads_export.h"
+#include "jxl/memory_manager.h"
+#include "jxl/parallel_runner.h"
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+/** Parallel runner internally using std::thread. Use as JxlParallelRunner,
+ * with a tenant created by JxlSharedParallelRunnerCreateTenant as the opaque
+ * runner.
+ */
+JXL_THREADS_EXPORT JxlParallelRetCode JxlSharedParallelRunner(
+    void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
+    JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range);
+
+/** Creates the pool of worker threads shared by all its tenants. If
+ * num_worker_threads is zero, all tasks run on the calling threads.
+ */
+JXL_THREADS_EXPORT void* JxlSharedParallelRunnerCreate(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads);
+
+/** Destroys the pool created by JxlSharedParallelRunnerCreate. All its tenants
+ * must have been destroyed before.
+ */
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerDestroy(void* pool);
+
+/** Creates a tenant of the pool, to use as the opaque runner of
+ * JxlSharedParallelRunner for one encoder or decoder instance.
+ *
+ * @param pool pool created by JxlSharedParallelRunnerCreate.
+ * @param priority relative share of the worker time of this tenant, must be at
+ * least 1.
+ * @return the tenant, or NULL if the priority is invalid.
+ */
+JXL_THREADS_EXPORT void* JxlSharedParallelRunnerCreateTenant(
+    void* pool, uint32_t priority);
+
+/** Changes the priority of a tenant, see JxlSharedParallelRunnerCreateTenant.
+ * Takes effect for the next JxlSharedParallelRunner call of the tenant.
+ * Priorities below 1 are treated as 1.
+ */
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerSetTenantPriority(
+    void* tenant, uint32_t priority);
+
+/** Destroys a tenant created by JxlSharedParallelRunnerCreateTenant. No
+ * JxlSharedParallelRunner call may be running for it.
+ */
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerDestroyTenant(void* tenant);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* JXL_SHARED_PARALLEL_RUNNER_H_ */
+
+/** @}*/
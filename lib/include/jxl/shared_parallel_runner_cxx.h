@@ -0,0 +1,87 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/// @addtogroup libjxl_threads
+/// @{
+///
+/// @file shared_parallel_runner_cxx.h
+/// @ingroup libjxl_threads
+/// @brief C++ header-only helper for @ref shared_parallel_runner.h.
+///
+/// There's no binary library associated with the header since this is a header
+/// only library.
+
+#ifndef JXL_SHARED_PARALLEL_RUNNER_CXX_H_
+#define JXL_SHARED_PARALLEL_RUNNER_CXX_H_
+
+#include <memory>
+
+#include "jxl/shared_parallel_runner.h"
+
+#if !(defined(__cplusplus) || defined(c_plusplus))
+#error \
+    "This a C++ only header. Use jxl/shared_parallel_runner.h from C" \
+    "sources."
+#endif
+
+/// Struct to call JxlSharedParallelRunnerDestroy from the
+/// JxlSharedParallelRunnerPtr unique_ptr.
+struct JxlSharedParallelRunnerDestroyStruct {
+  /// Calls @ref JxlSharedParallelRunnerDestroy() on the passed pool.
+  void operator()(void* pool) { JxlSharedParallelRunnerDestroy(pool); }
+};
+
+/// std::unique_ptr<> type that calls JxlSharedParallelRunnerDestroy() when
+/// releasing the pool.
+typedef std::unique_ptr<void, JxlSharedParallelRunnerDestroyStruct>
+    JxlSharedParallelRunnerPtr;
+
+/// Struct to call JxlSharedParallelRunnerDestroyTenant from the
+/// JxlSharedParallelRunnerTenantPtr unique_ptr.
+struct JxlSharedParallelRunnerDestroyTenantStruct {
+  /// Calls @ref JxlSharedParallelRunnerDestroyTenant() on the passed tenant.
+  void operator()(void* tenant) {
+    JxlSharedParallelRunnerDestroyTenant(tenant);
+  }
+};
+
+/// std::unique_ptr<> type that calls JxlSharedParallelRunnerDestroyTenant()
+/// when releasing the tenant.
+typedef std::unique_ptr<void, JxlSharedParallelRunnerDestroyTenantStruct>
+    JxlSharedParallelRunnerTenantPtr;
+
+/// Creates a pool for JxlSharedParallelRunner into a
+/// JxlSharedParallelRunnerPtr. See @ref JxlSharedParallelRunnerCreate for
+/// details on the instance creation.
+///
+/// @param memory_manager custom allocator function. It may be NULL. The memory
+///        manager will be copied internally.
+/// @param num_worker_threads the number of worker threads to create.
+/// @return a @c NULL JxlSharedParallelRunnerPtr if the instance can not be
+/// allocated or initialized
+/// @return initialized JxlSharedParallelRunnerPtr instance otherwise.
+static inline JxlSharedParallelRunnerPtr JxlSharedParallelRunnerMake(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads) {
+  return JxlSharedParallelRunnerPtr(
+      JxlSharedParallelRunnerCreate(memory_manager, num_worker_threads));
+}
+
+/// Creates a tenant of the pool into a JxlSharedParallelRunnerTenantPtr. See
+/// @ref JxlSharedParallelRunnerCreateTenant for details.
+///
+/// @param pool pool created by JxlSharedParallelRunnerCreate.
+/// @param priority relative share of the worker time of this tenant.
+/// @return a @c NULL JxlSharedParallelRunnerTenantPtr if the priority is
+/// invalid
+/// @return initialized JxlSharedParallelRunnerTenantPtr instance otherwise.
+static inline JxlSharedParallelRunnerTenantPtr
+JxlSharedParallelRunnerMakeTenant(void* pool, uint32_t priority) {
+  return JxlSharedParallelRunnerTenantPtr(
+      JxlSharedParallelRunnerCreateTenant(pool, priority));
+}
+
+#endif  // JXL_SHARED_PARALLEL_RUNNER_CXX_H_
+
+/// @}
@@ -0,0 +1,113 @@
+/* Copyright (c) the JPEG XL Project Authors. All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/** @addtogroup libjxl_ssimulacra
+ * @{
+ * @file ssimulacra.h
+ * @brief SSIMULACRA API for JPEG XL.
+ */
+
+#ifndef JXL_SSIMULACRA_H_
+#define JXL_SSIMULACRA_H_
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+#include "jxl/jxl_export.h"
+#include "jxl/memory_manager.h"
+#include "jxl/parallel_runner.h"
+#include "jxl/types.h"
+
+/**
+ * Opaque structure that holds a SSIMULACRA API.
+ *
+ * Allocated and initialized with JxlSsimulacraApiCreate().
+ * Cleaned up and deallocated with JxlSsimulacraApiDestroy().
+ */
+typedef struct JxlSsimulacraApiStruct JxlSsimulacraApi;
+
+/**
+ * Creates an instance of JxlSsimulacraApi and initializes it.
+ *
+ * @p memory_manager will be used for all the library dynamic allocations made
+ * from this instance. The parameter may be NULL, in which case the default
+ * allocator will be used. See jxl/memory_manager.h for details.
+ *
+ * @param memory_manager custom allocator function. It may be NULL. The memory
+ *        manager will be copied internally.
+ * @return @c NULL if the instance can not be allocated or initialized
+ * @return pointer to initialized JxlSsimulacraApi otherwise
+ */
+JXL_EXPORT JxlSsimulacraApi* JxlSsimulacraApiCreate(
+    const JxlMemoryManager* memory_manager);
+
+/**
+ * Set the parallel runner for multithreading.
+ *
+ * @param api api instance.
+ * @param parallel_runner function pointer to runner for multithreading. A
+ * multithreaded runner should be set to reach fast performance.
+ * @param parallel_runner_opaque opaque pointer for parallel_runner.
+ */
+JXL_EXPORT void JxlSsimulacraApiSetParallelRunner(
+    JxlSsimulacraApi* api, JxlParallelRunner parallel_runner,
+    void* parallel_runner_opaque);
+
+/**
+ * Only uses the multi-scale SSIM, without the penalties for new edges and
+ * for blocking artifacts along rows and columns.
+ *
+ * @param api api instance.
+ * @param simple JXL_TRUE for the simple metric, JXL_FALSE (default) for the
+ * full one.
+ */
+JXL_EXPORT void JxlSsimulacraApiSetSimple(JxlSsimulacraApi* api,
+                                          JXL_BOOL simple);
+
+/**
+ * Deinitializes and frees JxlSsimulacraApi instance.
+ *
+ * @param api instance to be cleaned up and deallocated.
+ */
+JXL_EXPORT void JxlSsimulacraApiDestroy(JxlSsimulacraApi* api);
+
+/**
+ * Computes the SSIMULACRA score between an original image and a distortion.
+ * The score is between 0 for identical images and 1; images scoring below
+ * about 0.01 are usually indistinguishable, while above 0.1 the distortion is
+ * obvious.
+ *
+ * Like JxlButteraugliCompute, float pixels are interpreted as linear sRGB and
+ * integer ones as sRGB. Images with alpha are compared blended on black and on
+ * white backgrounds, and the worse score is returned.
+ *
+ * @param api api instance for this computation.
+ * @param xsize width of the compared images, at least 8.
+ * @param ysize height of the compared images, at least 8.
+ * @param pixel_format_orig pixel format for original image.
+ * @param buffer_orig pixel data for original image.
+ * @param size_orig size of buffer_orig in bytes.
+ * @param pixel_format_dist pixel format for distortion.
+ * @param buffer_dist pixel data for distortion.
+ * @param size_dist size of buffer_dist in bytes.
+ * @param score will be set to the score.
+ * @return JXL_FALSE if the images are too small or can not be read.
+ * @return JXL_TRUE otherwise.
+ */
+JXL_EXPORT JXL_BOOL JxlSsimulacraCompute(
+    const JxlSsimulacraApi* api, uint32_t xsize, uint32_t ysize,
+    const JxlPixelFormat* pixel_format_orig, const void* buffer_orig,
+    size_t size_orig, const JxlPixelFormat* pixel_format_dist,
+    const void* buffer_dist, size_t size_dist, float* score);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* JXL_SSIMULACRA_H_ */
+
+/** @}*/
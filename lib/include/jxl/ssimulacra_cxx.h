@@ -0,0 +1,43 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/// @addtogroup libjxl_ssimulacra
+/// @{
+///
+/// @file ssimulacra_cxx.h
+/// @brief C++ header-only helper for @ref ssimulacra.h.
+///
+/// There's no binary library associated with the header since this is a header
+/// only library.
+
+#ifndef JXL_SSIMULACRA_CXX_H_
+#define JXL_SSIMULACRA_CXX_H_
+
+#include <memory>
+
+#include "jxl/ssimulacra.h"
+
+#if !(defined(__cplusplus) || defined(c_plusplus))
+#error "This a C++ only header. Use jxl/ssimulacra.h from C sources."
+#endif
+
+/// Struct to call JxlSsimulacraApiDestroy from the JxlSsimulacraApiPtr
+/// unique_ptr.
+struct JxlSsimulacraApiDestroyStruct {
+  /// Calls @ref JxlSsimulacraApiDestroy() on the passed api.
+  void operator()(JxlSsimulacraApi* api) { JxlSsimulacraApiDestroy(api); }
+};
+
+/// std::unique_ptr<> type that calls JxlSsimulacraApiDestroy() when releasing
+/// the pointer.
+///
+/// Use this helper type from C++ sources to ensure the api is destroyed and
+/// their internal resources released.
+typedef std::unique_ptr<JxlSsimulacraApi, JxlSsimulacraApiDestroyStruct>
+    JxlSsimulacraApiPtr;
+
+#endif  // JXL_SSIMULACRA_CXX_H_
+
+/// @}
@@ -64,6 +64,76 @@ JXL_THREADS_EXPORT void JxlThreadParallelRunnerDestroy(void* runner_opaque);
  */
 JXL_THREADS_EXPORT size_t JxlThreadParallelRunnerDefaultNumWorkerThreads();
 
+/** Pins the worker threads of a runner to CPUs and groups them, e.g. by NUMA
+ * node. Each JxlThreadParallelRunner call then splits its range of tasks into
+ * contiguous parts, one per group in proportion to its number of workers,
+ * which the workers of the group run before helping the other groups. The
+ * library runs the successive loops over the groups of an image with the same
+ * task indices, and the operating system usually places memory on the node
+ * that first writes to it, so the buffers of each group mostly stay on the
+ * node that processes them.
+ *
+ * May not be called during a JxlThreadParallelRunner call.
+ *
+ * @param runner_opaque the runner created by JxlThreadParallelRunnerCreate.
+ * @param cpus the CPU of each of the num_worker_threads workers, or NULL to
+ * leave them unpinned.
+ * @param groups the group, smaller than num_worker_threads, of each worker, or
+ * NULL for a single group.
+ * @return 0 on success, -1 if pinning threads is not supported on this
+ * platform or a value is out of range. The groups are then unchanged; some
+ * workers may already have been pinned.
+ */
+JXL_THREADS_EXPORT JxlParallelRetCode JxlThreadParallelRunnerSetAffinity(
+    void* runner_opaque, const size_t* cpus, const size_t* groups);
+
+/** Calls JxlThreadParallelRunnerSetAffinity with the workers spread evenly
+ * over the CPUs that the process may use, grouped by NUMA node.
+ *
+ * @param runner_opaque the runner created by JxlThreadParallelRunnerCreate.
+ * @return 0 on success, -1 if the NUMA topology is not known, currently on
+ * other platforms than Linux.
+ */
+JXL_THREADS_EXPORT JxlParallelRetCode
+JxlThreadParallelRunnerSetNumaAffinity(void* runner_opaque);
+
+/** Sets how long the workers of a runner, and the thread calling it, spin
+ * before they sleep while they wait for each other. Spinning avoids the
+ * latency of waking up sleeping threads, tens of microseconds, in series of
+ * short JxlThreadParallelRunner calls, at the cost of CPU time while the
+ * runner is idle. The default is 20 microseconds if there are more CPUs than
+ * workers, 0 otherwise.
+ *
+ * May not be called during a JxlThreadParallelRunner call.
+ *
+ * @param runner_opaque the runner created by JxlThreadParallelRunnerCreate.
+ * @param nanoseconds the spin duration, 0 to always sleep right away.
+ */
+JXL_THREADS_EXPORT void JxlThreadParallelRunnerSetSpinDuration(
+    void* runner_opaque, uint64_t nanoseconds);
+
+/** Wake-up latency of the workers of a runner, see
+ * JxlThreadParallelRunnerGetWakeStats.
+ */
+typedef struct {
+  /** Number of times a worker started to work on a call. */
+  uint64_t num_wakeups;
+  /** Number of those when the worker was sleeping rather than spinning. */
+  uint64_t num_parked_wakeups;
+  /** Sum and maximum of the times between the start of a call and a worker
+   * starting to work on it, in nanoseconds. */
+  uint64_t total_nanoseconds;
+  uint64_t max_nanoseconds;
+} JxlThreadParallelRunnerWakeStats;
+
+/** Outputs the wake-up latency of the workers since the runner was created.
+ *
+ * @param runner_opaque the runner created by JxlThreadParallelRunnerCreate.
+ * @param stats output for the statistics.
+ */
+JXL_THREADS_EXPORT void JxlThreadParallelRunnerGetWakeStats(
+    const void* runner_opaque, JxlThreadParallelRunnerWakeStats* stats);
+
 #if defined(__cplusplus) || defined(c_plusplus)
 }
 #endif
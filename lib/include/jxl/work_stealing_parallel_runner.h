@@ -0,0 +1,71 @@
+/* Copyright (c) the JPEG XL Project Authors. All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/** @addtogroup libjxl_threads
+ * @{
+ * @file work_stealing_parallel_runner.h
+ * @brief implementation using std::thread of a work-stealing
+ * ::JxlParallelRunner.
+ */
+
+/** Implementation of JxlParallelRunner than can be used to enable
+ * multithreading when using the JPEG XL library. This uses std::thread
+ * internally and related synchronization functions. The number of threads
+ * created is fixed at construction time and the threads, including the calling
+ * thread, are re-used for every JxlWorkStealingParallelRunner call. Only one
+ * concurrent JxlWorkStealingParallelRunner call per instance is allowed at a
+ * time.
+ *
+ * Compared to the implementation in @ref thread_parallel_runner.h, which hands
+ * out tasks from a single shared counter, each thread here starts with its own
+ * part of the range and takes tasks from it in chunks that shrink as the part
+ * gets smaller. Threads that run out of work steal half of the remaining part
+ * of another thread. This reduces the contention on machines with many cores
+ * and keeps the threads busy when the tasks have uneven costs.
+ */
+
+#ifndef JXL_WORK_STEALING_PARALLEL_RUNNER_H_
+#define JXL_WORK_STEALING_PARALLEL_RUNNER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jxl/jxl_threads_export.h"
+#include "jxl/memory_manager.h"
+#include "jxl/parallel_runner.h"
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+/** Parallel runner internally using std::thread. Use as JxlParallelRunner.
+ */
+JXL_THREADS_EXPORT JxlParallelRetCode JxlWorkStealingParallelRunner(
+    void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
+    JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range);
+
+/** Creates the runner for JxlWorkStealingParallelRunner. Use as the opaque
+ * runner. The tasks run on num_worker_threads worker threads and on the
+ * calling thread; if num_worker_threads is zero, all tasks run on the calling
+ * thread.
+ */
+JXL_THREADS_EXPORT void* JxlWorkStealingParallelRunnerCreate(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads);
+
+/** Destroys the runner created by JxlWorkStealingParallelRunnerCreate.
+ */
+JXL_THREADS_EXPORT void JxlWorkStealingParallelRunnerDestroy(
+    void* runner_opaque);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* JXL_WORK_STEALING_PARALLEL_RUNNER_H_ */
+
+/** @}*/
@@ -48,6 +48,8 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/blending.h
   jxl/box_content_decoder.cc
   jxl/box_content_decoder.h
+  jxl/buffer_pool.cc
+  jxl/buffer_pool.h
   jxl/chroma_from_luma.cc
   jxl/chroma_from_luma.h
   jxl/codec_in_out.h
@@ -155,6 +157,8 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/loop_filter.h
   jxl/luminance.cc
   jxl/luminance.h
+  jxl/memory_arena.cc
+  jxl/memory_arena.h
   jxl/memory_manager_internal.cc
   jxl/memory_manager_internal.h
   jxl/modular/encoding/context_predict.h
@@ -179,6 +183,8 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/passes_state.cc
   jxl/passes_state.h
   jxl/patch_dictionary_internal.h
+  jxl/phase_counters.h
+  jxl/progress.h
   jxl/quant_weights.cc
   jxl/quant_weights.h
   jxl/quantizer-inl.h
@@ -190,6 +196,8 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/render_pipeline/render_pipeline.cc
   jxl/render_pipeline/render_pipeline.h
   jxl/render_pipeline/render_pipeline_stage.h
+  jxl/render_pipeline/render_pipeline_stats.cc
+  jxl/render_pipeline/render_pipeline_stats.h
   jxl/render_pipeline/simple_render_pipeline.cc
   jxl/render_pipeline/simple_render_pipeline.h
   jxl/render_pipeline/stage_blending.cc
@@ -210,6 +218,7 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/render_pipeline/stage_spot.h
   jxl/render_pipeline/stage_upsampling.cc
   jxl/render_pipeline/stage_upsampling.h
+  jxl/render_pipeline/stage_write-inl.h
   jxl/render_pipeline/stage_write.cc
   jxl/render_pipeline/stage_write.h
   jxl/render_pipeline/stage_xyb.cc
@@ -224,6 +233,7 @@ set(JPEGXL_INTERNAL_SOURCES_DEC
   jxl/splines.h
   jxl/toc.cc
   jxl/toc.h
+  jxl/tone_mapping-inl.h
   jxl/transfer_functions-inl.h
   jxl/transpose-inl.h
   jxl/xorshift128plus-inl.h
@@ -241,6 +251,8 @@ set(JPEGXL_INTERNAL_SOURCES_ENC
   jxl/enc_ac_strategy.h
   jxl/enc_adaptive_quantization.cc
   jxl/enc_adaptive_quantization.h
+  jxl/enc_animation.cc
+  jxl/enc_animation.h
   jxl/enc_ans.cc
   jxl/enc_ans.h
   jxl/enc_ans_params.h
@@ -262,17 +274,27 @@ set(JPEGXL_INTERNAL_SOURCES_ENC
   jxl/enc_color_management.h
   jxl/enc_comparator.cc
   jxl/enc_comparator.h
+  jxl/enc_content_classifier.cc
+  jxl/enc_content_classifier.h
   jxl/enc_context_map.cc
   jxl/enc_context_map.h
+  jxl/enc_deadline.cc
+  jxl/enc_deadline.h
+  jxl/enc_decode_cost.cc
+  jxl/enc_decode_cost.h
   jxl/enc_detect_dots.cc
   jxl/enc_detect_dots.h
   jxl/enc_dot_dictionary.cc
   jxl/enc_dot_dictionary.h
+  jxl/enc_downsample.cc
+  jxl/enc_downsample.h
   jxl/enc_entropy_coder.cc
   jxl/enc_entropy_coder.h
   jxl/enc_external_image.cc
   jxl/enc_external_image.h
   jxl/enc_fast_heuristics.cc
+  jxl/enc_fast_lossless.cc
+  jxl/enc_fast_lossless.h
   jxl/enc_file.cc
   jxl/enc_file.h
   jxl/enc_frame.cc
@@ -302,6 +324,8 @@ set(JPEGXL_INTERNAL_SOURCES_ENC
   jxl/enc_quant_weights.h
   jxl/enc_splines.cc
   jxl/enc_splines.h
+  jxl/enc_ssimulacra.cc
+  jxl/enc_ssimulacra.h
   jxl/enc_toc.cc
   jxl/enc_toc.h
   jxl/enc_transforms-inl.h
@@ -340,6 +364,7 @@ set(JPEGXL_INTERNAL_SOURCES_ENC
   jxl/optimize.h
   jxl/progressive_split.cc
   jxl/progressive_split.h
+  jxl/ssimulacra_wrapper.cc
 )
 
 set(JPEGXL_DEC_INTERNAL_LIBS
@@ -597,13 +622,19 @@ foreach(target IN ITEMS jxl jxl_dec)
   endif()
 endforeach()
 
-# Only install libjxl shared library. The libjxl_dec is not installed since it
-# contains symbols also in libjxl which would conflict if programs try to use
-# both.
+# Only install libjxl shared library by default. The libjxl_dec is not installed
+# since it contains symbols also in libjxl which would conflict if programs try
+# to use both.
 install(TARGETS jxl
   RUNTIME DESTINATION ${CMAKE_INSTALL_BINDIR}
   LIBRARY DESTINATION ${CMAKE_INSTALL_LIBDIR}
   ARCHIVE DESTINATION ${CMAKE_INSTALL_LIBDIR})
+if (JPEGXL_INSTALL_JXL_DEC)
+install(TARGETS jxl_dec
+  RUNTIME DESTINATION ${CMAKE_INSTALL_BINDIR}
+  LIBRARY DESTINATION ${CMAKE_INSTALL_LIBDIR}
+  ARCHIVE DESTINATION ${CMAKE_INSTALL_LIBDIR})
+endif()
 else()
 add_library(jxl ALIAS jxl-static)
 add_library(jxl_dec ALIAS jxl_dec-static)
@@ -9,103 +9,346 @@
 
 #include <algorithm>
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/alpha.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/jxl/rational_polynomial-inl.h"
+
+HWY_BEFORE_NAMESPACE();
 namespace jxl {
+namespace HWY_NAMESPACE {
 
-static float Clamp(float x) { return std::max(std::min(1.0f, x), 0.0f); }
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Vec;
 
-void PerformAlphaBlending(const AlphaBlendingInputLayer& bg,
-                          const AlphaBlendingInputLayer& fg,
-                          const AlphaBlendingOutput& out, size_t num_pixels,
-                          bool alpha_is_premultiplied, bool clamp) {
-  if (alpha_is_premultiplied) {
-    for (size_t x = 0; x < num_pixels; ++x) {
-      float fga = clamp ? Clamp(fg.a[x]) : fg.a[x];
-      out.r[x] = (fg.r[x] + bg.r[x] * (1.f - fga));
-      out.g[x] = (fg.g[x] + bg.g[x] * (1.f - fga));
-      out.b[x] = (fg.b[x] + bg.b[x] * (1.f - fga));
-      out.a[x] = (1.f - (1.f - fga) * (1.f - bg.a[x]));
-    }
+// Calls op(d, x) for full vectors of pixels, then for the remaining ones one
+// at a time, so that no pointer is accessed past num_pixels. The pointers may
+// be unaligned, and outputs may alias inputs of the same pixels.
+template <class Op>
+HWY_INLINE void ForEachPixel(size_t num_pixels, const Op& op) {
+  const HWY_FULL(float) d;
+  const HWY_CAPPED(float, 1) d1;
+  size_t x = 0;
+  for (; x + Lanes(d) <= num_pixels; x += Lanes(d)) {
+    op(d, x);
+  }
+  for (; x < num_pixels; ++x) {
+    op(d1, x);
+  }
+}
+
+template <class D>
+HWY_INLINE Vec<D> LoadClamped(D d, const float* p, bool clamp) {
+  const auto v = LoadU(d, p);
+  return clamp ? ZeroIfNegative(Min(v, Set(d, 1.0f))) : v;
+}
+
+// The reciprocal of the blended alpha, or 0 where it is not positive. One
+// Newton-Raphson step is precise enough for the blended colors.
+template <class D>
+HWY_INLINE Vec<D> ReciprocalOrZero(D d, const Vec<D> a) {
+  const auto rcp = FastDivision<float, Vec<D>>::ReciprocalNR(a);
+  return IfThenElseZero(a > Zero(d), rcp);
+}
+
+// Whether all alpha values are 1, or at least 1 if they are clamped. Blending
+// then only keeps the foreground, and premultiplying does nothing.
+bool IsOpaque(const float* a, size_t num_pixels, bool clamp) {
+  const HWY_FULL(float) d;
+  const auto one = Set(d, 1.0f);
+  size_t x = 0;
+  for (; x + Lanes(d) <= num_pixels; x += Lanes(d)) {
+    const auto alpha = LoadU(d, a + x);
+    if (!AllTrue(d, clamp ? alpha >= one : alpha == one)) return false;
+  }
+  for (; x < num_pixels; ++x) {
+    if (clamp ? !(a[x] >= 1.0f) : a[x] != 1.0f) return false;
+  }
+  return true;
+}
+
+void CopyPlane(const float* in, float* out, size_t num_pixels) {
+  if (in != out) memmove(out, in, num_pixels * sizeof(*out));
+}
+
+struct BlendPremultiplied {
+  template <class D>
+  HWY_INLINE void operator()(D d, size_t x) const {
+    const auto one = Set(d, 1.0f);
+    const auto inv_fga = one - LoadClamped(d, fg.a + x, clamp);
+    const auto bga = LoadU(d, bg.a + x);
+    StoreU(MulAdd(LoadU(d, bg.r + x), inv_fga, LoadU(d, fg.r + x)), d,
+           out.r + x);
+    StoreU(MulAdd(LoadU(d, bg.g + x), inv_fga, LoadU(d, fg.g + x)), d,
+           out.g + x);
+    StoreU(MulAdd(LoadU(d, bg.b + x), inv_fga, LoadU(d, fg.b + x)), d,
+           out.b + x);
+    StoreU(NegMulAdd(inv_fga, one - bga, one), d, out.a + x);
+  }
+
+  AlphaBlendingInputLayer bg;
+  AlphaBlendingInputLayer fg;
+  AlphaBlendingOutput out;
+  bool clamp;
+};
+
+struct BlendUnpremultiplied {
+  template <class D>
+  HWY_INLINE void operator()(D d, size_t x) const {
+    const auto one = Set(d, 1.0f);
+    const auto fga = LoadClamped(d, fg.a + x, clamp);
+    const auto bga = LoadU(d, bg.a + x);
+    const auto inv_fga = one - fga;
+    const auto new_a = NegMulAdd(inv_fga, one - bga, one);
+    const auto rnew_a = ReciprocalOrZero(d, new_a);
+    const auto bg_weight = bga * inv_fga;
+    StoreU(MulAdd(LoadU(d, fg.r + x), fga, LoadU(d, bg.r + x) * bg_weight) *
+               rnew_a,
+           d, out.r + x);
+    StoreU(MulAdd(LoadU(d, fg.g + x), fga, LoadU(d, bg.g + x) * bg_weight) *
+               rnew_a,
+           d, out.g + x);
+    StoreU(MulAdd(LoadU(d, fg.b + x), fga, LoadU(d, bg.b + x) * bg_weight) *
+               rnew_a,
+           d, out.b + x);
+    StoreU(new_a, d, out.a + x);
+  }
+
+  AlphaBlendingInputLayer bg;
+  AlphaBlendingInputLayer fg;
+  AlphaBlendingOutput out;
+  bool clamp;
+};
+
+void PerformAlphaBlendingLayers(const AlphaBlendingInputLayer& bg,
+                                const AlphaBlendingInputLayer& fg,
+                                const AlphaBlendingOutput& out,
+                                size_t num_pixels, bool alpha_is_premultiplied,
+                                bool clamp) {
+  if (IsOpaque(fg.a, num_pixels, clamp)) {
+    CopyPlane(fg.r, out.r, num_pixels);
+    CopyPlane(fg.g, out.g, num_pixels);
+    CopyPlane(fg.b, out.b, num_pixels);
+    std::fill(out.a, out.a + num_pixels, 1.0f);
+  } else if (alpha_is_premultiplied) {
+    ForEachPixel(num_pixels, BlendPremultiplied{bg, fg, out, clamp});
   } else {
-    for (size_t x = 0; x < num_pixels; ++x) {
-      float fga = clamp ? Clamp(fg.a[x]) : fg.a[x];
-      const float new_a = 1.f - (1.f - fga) * (1.f - bg.a[x]);
-      const float rnew_a = (new_a > 0 ? 1.f / new_a : 0.f);
-      out.r[x] = (fg.r[x] * fga + bg.r[x] * bg.a[x] * (1.f - fga)) * rnew_a;
-      out.g[x] = (fg.g[x] * fga + bg.g[x] * bg.a[x] * (1.f - fga)) * rnew_a;
-      out.b[x] = (fg.b[x] * fga + bg.b[x] * bg.a[x] * (1.f - fga)) * rnew_a;
-      out.a[x] = new_a;
-    }
+    ForEachPixel(num_pixels, BlendUnpremultiplied{bg, fg, out, clamp});
   }
 }
-void PerformAlphaBlending(const float* bg, const float* bga, const float* fg,
-                          const float* fga, float* out, size_t num_pixels,
-                          bool alpha_is_premultiplied, bool clamp) {
+
+struct BlendAlphaPlane {
+  template <class D>
+  HWY_INLINE void operator()(D d, size_t x) const {
+    const auto one = Set(d, 1.0f);
+    const auto inv_fga = one - LoadClamped(d, fga + x, clamp);
+    StoreU(NegMulAdd(inv_fga, one - LoadU(d, bga + x), one), d, out + x);
+  }
+
+  const float* bga;
+  const float* fga;
+  float* out;
+  bool clamp;
+};
+
+struct BlendPlanePremultiplied {
+  template <class D>
+  HWY_INLINE void operator()(D d, size_t x) const {
+    const auto inv_fga = Set(d, 1.0f) - LoadClamped(d, fga + x, clamp);
+    StoreU(MulAdd(LoadU(d, bg + x), inv_fga, LoadU(d, fg + x)), d, out + x);
+  }
+
+  const float* bg;
+  const float* fg;
+  const float* fga;
+  float* out;
+  bool clamp;
+};
+
+struct BlendPlaneUnpremultiplied {
+  template <class D>
+  HWY_INLINE void operator()(D d, size_t x) const {
+    const auto one = Set(d, 1.0f);
+    const auto fa = LoadClamped(d, fga + x, clamp);
+    const auto ba = LoadU(d, bga + x);
+    const auto inv_fa = one - fa;
+    const auto new_a = NegMulAdd(inv_fa, one - ba, one);
+    const auto blended =
+        MulAdd(LoadU(d, fg + x), fa, LoadU(d, bg + x) * (ba * inv_fa));
+    StoreU(blended * ReciprocalOrZero(d, new_a), d, out + x);
+  }
+
+  const float* bg;
+  const float* bga;
+  const float* fg;
+  const float* fga;
+  float* out;
+  bool clamp;
+};
+
+void PerformAlphaBlendingPlane(const float* bg, const float* bga,
+                               const float* fg, const float* fga, float* out,
+                               size_t num_pixels, bool alpha_is_premultiplied,
+                               bool clamp) {
+  // Unlike for the layers, the foreground alpha is clamped unless `clamp`.
+  const bool clamp_fga = !clamp;
   if (bg == bga && fg == fga) {
-    for (size_t x = 0; x < num_pixels; ++x) {
-      float fa = clamp ? fga[x] : std::min(std::max(0.0f, fga[x]), 1.0f);
-      out[x] = (1.f - (1.f - fa) * (1.f - bga[x]));
-    }
-  } else {
-    if (alpha_is_premultiplied) {
-      for (size_t x = 0; x < num_pixels; ++x) {
-        float fa = clamp ? fga[x] : Clamp(fga[x]);
-        out[x] = (fg[x] + bg[x] * (1.f - fa));
-      }
+    if (IsOpaque(fga, num_pixels, clamp_fga)) {
+      std::fill(out, out + num_pixels, 1.0f);
     } else {
-      for (size_t x = 0; x < num_pixels; ++x) {
-        float fa = clamp ? fga[x] : Clamp(fga[x]);
-        const float new_a = 1.f - (1.f - fa) * (1.f - bga[x]);
-        const float rnew_a = (new_a > 0 ? 1.f / new_a : 0.f);
-        out[x] = (fg[x] * fa + bg[x] * bga[x] * (1.f - fa)) * rnew_a;
-      }
+      ForEachPixel(num_pixels, BlendAlphaPlane{bga, fga, out, clamp_fga});
     }
+  } else if (IsOpaque(fga, num_pixels, clamp_fga)) {
+    CopyPlane(fg, out, num_pixels);
+  } else if (alpha_is_premultiplied) {
+    ForEachPixel(num_pixels,
+                 BlendPlanePremultiplied{bg, fg, fga, out, clamp_fga});
+  } else {
+    ForEachPixel(num_pixels,
+                 BlendPlaneUnpremultiplied{bg, bga, fg, fga, out, clamp_fga});
   }
 }
 
-void PerformAlphaWeightedAdd(const float* bg, const float* fg, const float* fga,
-                             float* out, size_t num_pixels, bool clamp) {
+struct AlphaWeightedAdd {
+  template <class D>
+  HWY_INLINE void operator()(D d, size_t x) const {
+    const auto fa = LoadClamped(d, fga + x, /*clamp=*/true);
+    StoreU(MulAdd(LoadU(d, fg + x), fa, LoadU(d, bg + x)), d, out + x);
+  }
+
+  const float* bg;
+  const float* fg;
+  const float* fga;
+  float* out;
+};
+
+void PerformAlphaWeightedAdd(const float* bg, const float* fg,
+                             const float* fga, float* out, size_t num_pixels,
+                             bool clamp) {
   if (fg == fga) {
     memcpy(out, bg, num_pixels * sizeof(*out));
   } else {
-    for (size_t x = 0; x < num_pixels; ++x) {
-      out[x] = bg[x] + fg[x] * Clamp(fga[x]);
-    }
+    ForEachPixel(num_pixels, AlphaWeightedAdd{bg, fg, fga, out});
   }
 }
 
+struct MulBlend {
+  template <class D>
+  HWY_INLINE void operator()(D d, size_t x) const {
+    StoreU(LoadU(d, bg + x) * LoadClamped(d, fg + x, clamp), d, out + x);
+  }
+
+  const float* bg;
+  const float* fg;
+  float* out;
+  bool clamp;
+};
+
 void PerformMulBlending(const float* bg, const float* fg, float* out,
                         size_t num_pixels, bool clamp) {
-  if (clamp) {
-    for (size_t x = 0; x < num_pixels; ++x) {
-      out[x] = bg[x] * Clamp(fg[x]);
-    }
-  } else {
-    for (size_t x = 0; x < num_pixels; ++x) {
-      out[x] = bg[x] * fg[x];
-    }
-  }
+  ForEachPixel(num_pixels, MulBlend{bg, fg, out, clamp});
 }
 
+struct Premultiply {
+  template <class D>
+  HWY_INLINE void operator()(D d, size_t x) const {
+    const auto multiplier = Max(Set(d, kSmallAlpha), LoadU(d, a + x));
+    StoreU(LoadU(d, r + x) * multiplier, d, r + x);
+    StoreU(LoadU(d, g + x) * multiplier, d, g + x);
+    StoreU(LoadU(d, b + x) * multiplier, d, b + x);
+  }
+
+  float* r;
+  float* g;
+  float* b;
+  const float* a;
+};
+
 void PremultiplyAlpha(float* JXL_RESTRICT r, float* JXL_RESTRICT g,
                       float* JXL_RESTRICT b, const float* JXL_RESTRICT a,
                       size_t num_pixels) {
-  for (size_t x = 0; x < num_pixels; ++x) {
-    const float multiplier = std::max(kSmallAlpha, a[x]);
-    r[x] *= multiplier;
-    g[x] *= multiplier;
-    b[x] *= multiplier;
+  if (IsOpaque(a, num_pixels, /*clamp=*/false)) return;
+  ForEachPixel(num_pixels, Premultiply{r, g, b, a});
+}
+
+struct Unpremultiply {
+  template <class D>
+  HWY_INLINE void operator()(D d, size_t x) const {
+    // An actual division, since the unpremultiplied colors are an output.
+    const auto multiplier =
+        Set(d, 1.0f) / Max(Set(d, kSmallAlpha), LoadU(d, a + x));
+    StoreU(LoadU(d, r + x) * multiplier, d, r + x);
+    StoreU(LoadU(d, g + x) * multiplier, d, g + x);
+    StoreU(LoadU(d, b + x) * multiplier, d, b + x);
   }
+
+  float* r;
+  float* g;
+  float* b;
+  const float* a;
+};
+
+void UnpremultiplyAlpha(float* JXL_RESTRICT r, float* JXL_RESTRICT g,
+                        float* JXL_RESTRICT b, const float* JXL_RESTRICT a,
+                        size_t num_pixels) {
+  if (IsOpaque(a, num_pixels, /*clamp=*/false)) return;
+  ForEachPixel(num_pixels, Unpremultiply{r, g, b, a});
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+HWY_EXPORT(PerformAlphaBlendingLayers);
+HWY_EXPORT(PerformAlphaBlendingPlane);
+HWY_EXPORT(PerformAlphaWeightedAdd);
+HWY_EXPORT(PerformMulBlending);
+HWY_EXPORT(PremultiplyAlpha);
+HWY_EXPORT(UnpremultiplyAlpha);
+
+void PerformAlphaBlending(const AlphaBlendingInputLayer& bg,
+                          const AlphaBlendingInputLayer& fg,
+                          const AlphaBlendingOutput& out, size_t num_pixels,
+                          bool alpha_is_premultiplied, bool clamp) {
+  HWY_DYNAMIC_DISPATCH(PerformAlphaBlendingLayers)
+  (bg, fg, out, num_pixels, alpha_is_premultiplied, clamp);
+}
+
+void PerformAlphaBlending(const float* bg, const float* bga, const float* fg,
+                          const float* fga, float* out, size_t num_pixels,
+                          bool alpha_is_premultiplied, bool clamp) {
+  HWY_DYNAMIC_DISPATCH(PerformAlphaBlendingPlane)
+  (bg, bga, fg, fga, out, num_pixels, alpha_is_premultiplied, clamp);
+}
+
+void PerformAlphaWeightedAdd(const float* bg, const float* fg, const float* fga,
+                             float* out, size_t num_pixels, bool clamp) {
+  HWY_DYNAMIC_DISPATCH(PerformAlphaWeightedAdd)
+  (bg, fg, fga, out, num_pixels, clamp);
+}
+
+void PerformMulBlending(const float* bg, const float* fg, float* out,
+                        size_t num_pixels, bool clamp) {
+  HWY_DYNAMIC_DISPATCH(PerformMulBlending)(bg, fg, out, num_pixels, clamp);
+}
+
+void PremultiplyAlpha(float* JXL_RESTRICT r, float* JXL_RESTRICT g,
+                      float* JXL_RESTRICT b, const float* JXL_RESTRICT a,
+                      size_t num_pixels) {
+  HWY_DYNAMIC_DISPATCH(PremultiplyAlpha)(r, g, b, a, num_pixels);
 }
 
 void UnpremultiplyAlpha(float* JXL_RESTRICT r, float* JXL_RESTRICT g,
                         float* JXL_RESTRICT b, const float* JXL_RESTRICT a,
                         size_t num_pixels) {
-  for (size_t x = 0; x < num_pixels; ++x) {
-    const float multiplier = 1.f / std::max(kSmallAlpha, a[x]);
-    r[x] *= multiplier;
-    g[x] *= multiplier;
-    b[x] *= multiplier;
-  }
+  HWY_DYNAMIC_DISPATCH(UnpremultiplyAlpha)(r, g, b, a, num_pixels);
 }
 
 }  // namespace jxl
+#endif  // HWY_ONCE
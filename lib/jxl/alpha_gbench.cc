@@ -0,0 +1,103 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <algorithm>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/jxl/alpha.h"
+#include "lib/jxl/base/random.h"
+
+namespace jxl {
+namespace {
+
+constexpr size_t kNumPixels = 1 << 12;
+
+// Planes of kNumPixels random values in [0, 1), the last one being used as
+// alpha.
+std::vector<std::vector<float>> RandomPlanes(size_t num_planes) {
+  Rng rng(0);
+  std::vector<std::vector<float>> planes(num_planes,
+                                         std::vector<float>(kNumPixels));
+  for (std::vector<float>& plane : planes) {
+    for (float& v : plane) v = rng.UniformF(0.0f, 1.0f);
+  }
+  return planes;
+}
+
+void BM_AlphaBlending(benchmark::State& state) {
+  const bool alpha_is_premultiplied = state.range(0);
+  std::vector<std::vector<float>> bg = RandomPlanes(4);
+  std::vector<std::vector<float>> fg = RandomPlanes(4);
+  std::vector<std::vector<float>> out = RandomPlanes(4);
+  for (auto _ : state) {
+    PerformAlphaBlending(
+        {bg[0].data(), bg[1].data(), bg[2].data(), bg[3].data()},
+        {fg[0].data(), fg[1].data(), fg[2].data(), fg[3].data()},
+        {out[0].data(), out[1].data(), out[2].data(), out[3].data()},
+        kNumPixels, alpha_is_premultiplied, /*clamp=*/true);
+    benchmark::DoNotOptimize(out[0].data());
+  }
+  state.SetItemsProcessed(kNumPixels * state.iterations());
+}
+
+// Blending an opaque foreground only copies it.
+void BM_AlphaBlendingOpaque(benchmark::State& state) {
+  std::vector<std::vector<float>> bg = RandomPlanes(4);
+  std::vector<std::vector<float>> fg = RandomPlanes(4);
+  std::vector<std::vector<float>> out = RandomPlanes(4);
+  std::fill(fg[3].begin(), fg[3].end(), 1.0f);
+  for (auto _ : state) {
+    PerformAlphaBlending(
+        {bg[0].data(), bg[1].data(), bg[2].data(), bg[3].data()},
+        {fg[0].data(), fg[1].data(), fg[2].data(), fg[3].data()},
+        {out[0].data(), out[1].data(), out[2].data(), out[3].data()},
+        kNumPixels, /*alpha_is_premultiplied=*/false, /*clamp=*/true);
+    benchmark::DoNotOptimize(out[0].data());
+  }
+  state.SetItemsProcessed(kNumPixels * state.iterations());
+}
+
+void BM_AlphaWeightedAdd(benchmark::State& state) {
+  std::vector<std::vector<float>> planes = RandomPlanes(4);
+  for (auto _ : state) {
+    PerformAlphaWeightedAdd(planes[0].data(), planes[1].data(),
+                            planes[3].data(), planes[2].data(), kNumPixels,
+                            /*clamp=*/true);
+    benchmark::DoNotOptimize(planes[2].data());
+  }
+  state.SetItemsProcessed(kNumPixels * state.iterations());
+}
+
+void BM_MulBlending(benchmark::State& state) {
+  std::vector<std::vector<float>> planes = RandomPlanes(3);
+  for (auto _ : state) {
+    PerformMulBlending(planes[0].data(), planes[1].data(), planes[2].data(),
+                       kNumPixels, /*clamp=*/true);
+    benchmark::DoNotOptimize(planes[2].data());
+  }
+  state.SetItemsProcessed(kNumPixels * state.iterations());
+}
+
+void BM_PremultiplyAndUnpremultiply(benchmark::State& state) {
+  std::vector<std::vector<float>> planes = RandomPlanes(4);
+  for (auto _ : state) {
+    PremultiplyAlpha(planes[0].data(), planes[1].data(), planes[2].data(),
+                     planes[3].data(), kNumPixels);
+    UnpremultiplyAlpha(planes[0].data(), planes[1].data(), planes[2].data(),
+                       planes[3].data(), kNumPixels);
+    benchmark::DoNotOptimize(planes[0].data());
+  }
+  state.SetItemsProcessed(kNumPixels * state.iterations());
+}
+
+BENCHMARK(BM_AlphaBlending)->Arg(0)->Arg(1);
+BENCHMARK(BM_AlphaBlendingOpaque);
+BENCHMARK(BM_AlphaWeightedAdd);
+BENCHMARK(BM_MulBlending);
+BENCHMARK(BM_PremultiplyAndUnpremultiply);
+
+}  // namespace
+}  // namespace jxl
@@ -6,6 +6,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -13,10 +14,12 @@
 #include "lib/jxl/aux_out_fwd.h"
 #include "lib/jxl/base/random.h"
 #include "lib/jxl/base/span.h"
+#include "lib/jxl/base/thread_pool_internal.h"
 #include "lib/jxl/dec_ans.h"
 #include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/enc_ans.h"
 #include "lib/jxl/enc_bit_writer.h"
+#include "lib/jxl/enc_cluster.h"
 
 namespace jxl {
 namespace {
@@ -274,5 +277,234 @@ TEST(ANSTest, TestCheckpointingPrefixLZ77) {
   TestCheckpointing(/*ans=*/false, /*lz77=*/true);
 }
 
+// Decoding several short prefix codes per lookup gives the same values as
+// reading them one at a time.
+TEST(ANSTest, ShortHuffmanValues) {
+  Rng rng(0);
+  std::vector<std::vector<Token>> input_values(1);
+  for (size_t i = 0; i < 100000; i++) {
+    // Mostly small values with short codes, some with long codes or extra
+    // bits.
+    uint32_t value = rng.UniformU(0, 16) == 0 ? rng.UniformU(0, 1000)
+                                              : rng.UniformU(0, 4);
+    input_values[0].push_back(Token(0, value));
+  }
+  const std::vector<Token> expected = input_values[0];
+
+  std::vector<uint8_t> context_map;
+  EntropyEncodingData codes;
+  HistogramParams params;
+  params.force_huffman = true;
+  params.lz77_method = HistogramParams::LZ77Method::kNone;
+  BitWriter writer;
+  BuildAndEncodeHistograms(params, 1, input_values, &codes, &context_map,
+                           &writer, 0, nullptr);
+  WriteTokens(input_values[0], codes, context_map, &writer, 0, nullptr);
+  writer.ZeroPadToByte();
+
+  BitReader br(writer.GetSpan());
+  Status status = true;
+  {
+    BitReaderScopedCloser bc(&br, &status);
+    std::vector<uint8_t> dec_context_map;
+    ANSCode decoded_codes;
+    ASSERT_TRUE(DecodeHistograms(&br, 1, &decoded_codes, &dec_context_map));
+    ANSSymbolReader reader(&decoded_codes, &br);
+    ASSERT_TRUE(reader.PrepareMultiSymbolTable(dec_context_map[0]));
+    size_t num_multi = 0;
+    for (size_t i = 0; i < expected.size();) {
+      uint32_t values[kMaxHuffmanMultiSymbols];
+      size_t n =
+          reader.ReadShortHuffmanValues(&br, expected.size() - i, values);
+      if (n == 0) {
+        values[0] = reader.ReadHybridUintClustered(dec_context_map[0], &br);
+        n = 1;
+      } else {
+        num_multi += n;
+      }
+      for (size_t j = 0; j < n; j++) {
+        ASSERT_EQ(expected[i + j].value, values[j]) << "i = " << i + j;
+      }
+      i += n;
+    }
+    EXPECT_GT(num_multi, expected.size() / 2);
+    ASSERT_TRUE(reader.CheckANSFinalState());
+  }
+  EXPECT_TRUE(status);
+}
+
+// Taking LZ77 copies a block at a time gives the same values as reading them
+// one by one, including copies that overlap their source.
+TEST(ANSTest, ReadCopiedValues) {
+  Rng rng(0);
+  std::vector<std::vector<Token>> input_values(1);
+  for (size_t i = 0; i < 300000; i++) {
+    const size_t period = i < 100000 ? 3 : i < 200000 ? 1000 : 5;
+    input_values[0].push_back(Token(0, i % period));
+    if (rng.UniformU(0, 100) == 0) input_values[0].back().value = 7;
+  }
+  const std::vector<Token> expected = input_values[0];
+
+  std::vector<uint8_t> context_map;
+  EntropyEncodingData codes;
+  HistogramParams params;
+  params.lz77_method = HistogramParams::LZ77Method::kLZ77;
+  BitWriter writer;
+  BuildAndEncodeHistograms(params, 1, input_values, &codes, &context_map,
+                           &writer, 0, nullptr);
+  WriteTokens(input_values[0], codes, context_map, &writer, 0, nullptr);
+  writer.ZeroPadToByte();
+
+  BitReader br(writer.GetSpan());
+  Status status = true;
+  {
+    BitReaderScopedCloser bc(&br, &status);
+    std::vector<uint8_t> dec_context_map;
+    ANSCode decoded_codes;
+    ASSERT_TRUE(DecodeHistograms(&br, 1, &decoded_codes, &dec_context_map));
+    ANSSymbolReader reader(&decoded_codes, &br);
+    ASSERT_TRUE(reader.UsesLZ77());
+    std::vector<uint32_t> values(expected.size());
+    size_t num_copied = 0;
+    for (size_t i = 0; i < expected.size();) {
+      // Vary the block size to cover copies split across calls.
+      const size_t max_values =
+          std::min<size_t>(expected.size() - i, 1 + i % 300);
+      size_t n = reader.ReadCopiedValues(max_values, &values[i]);
+      num_copied += n;
+      if (n == 0) {
+        values[i] = reader.ReadHybridUintClustered(dec_context_map[0], &br);
+        n = 1;
+      }
+      i += n;
+    }
+    for (size_t i = 0; i < expected.size(); i++) {
+      ASSERT_EQ(expected[i].value, values[i]) << "i = " << i;
+    }
+    EXPECT_GT(num_copied, expected.size() / 2);
+    ASSERT_TRUE(reader.CheckANSFinalState());
+  }
+  EXPECT_TRUE(status);
+}
+
+// Histograms repeated later in the stream are copied from the cache and decode
+// the same symbols.
+TEST(ANSTest, HistogramCache) {
+  Rng rng(0);
+  std::vector<std::vector<Token>> streams(2);
+  for (size_t i = 0; i < 1000; i++) {
+    streams[0].push_back(Token(rng.UniformU(0, 2), rng.UniformU(0, 10)));
+    streams[1].push_back(Token(rng.UniformU(0, 2), rng.UniformU(0, 300)));
+  }
+  // Each stream is written with its own histograms, which are identical for
+  // repeated streams.
+  BitWriter writer;
+  const size_t kOrder[] = {0, 0, 1, 0};
+  for (size_t i : kOrder) {
+    std::vector<std::vector<Token>> tokens = {streams[i]};
+    EntropyEncodingData code;
+    std::vector<uint8_t> context_map;
+    BuildAndEncodeHistograms(HistogramParams(), 2, tokens, &code, &context_map,
+                             &writer, 0, nullptr);
+    WriteTokens(tokens[0], code, context_map, &writer, 0, nullptr);
+  }
+  writer.ZeroPadToByte();
+
+  BitReader br(writer.GetSpan());
+  Status status = true;
+  {
+    BitReaderScopedCloser bc(&br, &status);
+    HistogramCache cache;
+    for (size_t i : kOrder) {
+      ANSCode code;
+      std::vector<uint8_t> context_map;
+      ASSERT_TRUE(cache.Decode(&br, 2, &code, &context_map));
+      ANSSymbolReader reader(&code, &br);
+      for (const Token& token : streams[i]) {
+        ASSERT_EQ(token.value,
+                  reader.ReadHybridUint(token.context, &br, context_map));
+      }
+      ASSERT_TRUE(reader.CheckANSFinalState());
+    }
+  }
+  EXPECT_TRUE(status);
+}
+
+// LZ77 on several streams gives the same output with and without a pool.
+TEST(ANSTest, LZ77WithPool) {
+  Rng rng(0);
+  std::vector<std::vector<Token>> input_values(16);
+  for (std::vector<Token>& stream : input_values) {
+    std::vector<Token> pattern;
+    for (size_t i = rng.UniformU(4, 64); i > 0; i--) {
+      pattern.push_back(Token(rng.UniformU(0, 2), rng.UniformU(0, 32)));
+    }
+    for (size_t i = rng.UniformU(0, 5000); i > 0; i--) {
+      stream.push_back(rng.Bernoulli(0.01f)
+                           ? Token(rng.UniformU(0, 2), rng.UniformU(0, 32))
+                           : pattern[i % pattern.size()]);
+    }
+  }
+  ThreadPoolInternal pool(4);
+  for (auto method : {HistogramParams::LZ77Method::kLZ77,
+                      HistogramParams::LZ77Method::kOptimal}) {
+    std::vector<uint8_t> bytes[2];
+    for (size_t use_pool = 0; use_pool < 2; use_pool++) {
+      HistogramParams params;
+      params.lz77_method = method;
+      params.pool = use_pool ? &pool : nullptr;
+      std::vector<uint8_t> context_map;
+      EntropyEncodingData codes;
+      BitWriter writer;
+      auto tokens = input_values;
+      BuildAndEncodeHistograms(params, 2, tokens, &codes, &context_map,
+                               &writer, 0, nullptr);
+      EXPECT_TRUE(codes.lz77.enabled);
+      for (const std::vector<Token>& stream : tokens) {
+        WriteTokens(stream, codes, context_map, &writer, 0, nullptr);
+      }
+      writer.ZeroPadToByte();
+      Span<const uint8_t> span = writer.GetSpan();
+      bytes[use_pool].assign(span.data(), span.data() + span.size());
+    }
+    EXPECT_EQ(bytes[0], bytes[1]);
+  }
+}
+
+// The clustering is the same with and without a thread pool.
+TEST(ANSTest, ClusterHistogramsWithPool) {
+  Rng rng(0);
+  std::vector<Histogram> histograms(1000);
+  for (Histogram& histo : histograms) {
+    // A few families of similar histograms, and some empty ones.
+    const size_t family = rng.UniformU(0, 8);
+    if (family == 0) continue;
+    for (size_t i = rng.UniformU(0, 200); i > 0; i--) {
+      histo.Add(family + rng.UniformU(0, 4 * family));
+    }
+  }
+  ThreadPoolInternal pool(4);
+  for (auto clustering : {HistogramParams::ClusteringType::kFastest,
+                          HistogramParams::ClusteringType::kFast,
+                          HistogramParams::ClusteringType::kBest}) {
+    HistogramParams params;
+    params.clustering = clustering;
+    std::vector<Histogram> clustered;
+    std::vector<uint32_t> symbols;
+    ClusterHistograms(params, histograms, histograms.size(), 64, &clustered,
+                      &symbols);
+    params.pool = &pool;
+    std::vector<Histogram> pool_clustered;
+    std::vector<uint32_t> pool_symbols;
+    ClusterHistograms(params, histograms, histograms.size(), 64,
+                      &pool_clustered, &pool_symbols);
+    EXPECT_EQ(symbols, pool_symbols);
+    ASSERT_EQ(clustered.size(), pool_clustered.size());
+    for (size_t i = 0; i < clustered.size(); i++) {
+      EXPECT_EQ(clustered[i].data_, pool_clustered[i].data_);
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jxl
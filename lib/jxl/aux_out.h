@@ -26,6 +26,8 @@
 #include "lib/jxl/color_management.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/dec_xyb.h"
+#include "lib/jxl/enc_content_classifier.h"
+#include "lib/jxl/enc_decode_cost.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_ops.h"
@@ -285,6 +287,14 @@ struct AuxOut {
 
   int num_butteraugli_iters = 0;
 
+  // Result of ClassifyContent for the last frame encoded with
+  // CompressParams::classify_content, if content_classified.
+  bool content_classified = false;
+  ContentClassification content;
+
+  // Estimated cost of decoding the last frame encoded.
+  DecodeCost decode_cost;
+
   // If not empty, additional debugging information (e.g. debug images) is
   // saved in files with this prefix.
   std::string debug_prefix;
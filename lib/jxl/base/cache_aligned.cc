@@ -30,6 +30,13 @@ namespace {
 struct AllocationHeader {
   void* allocated;
   size_t allocated_size;
+  // Free function and opaque of the memory manager that returned `allocated`,
+  // or nullptr if it came from malloc.
+  jpegxl_free_func free_func;
+  void* free_opaque;
+  // Stats that counted this allocation, or nullptr.
+  CacheAligned::Stats* stats;
+  CacheAligned::Category category;
   uint8_t left_padding[hwy::kMaxVectorSize];
 };
 #pragma pack(pop)
@@ -38,6 +45,20 @@ std::atomic<uint64_t> num_allocations{0};
 std::atomic<uint64_t> bytes_in_use{0};
 std::atomic<uint64_t> max_bytes_in_use{0};
 
+thread_local const JxlMemoryManager* current_memory_manager = nullptr;
+thread_local CacheAligned::Stats* current_stats = nullptr;
+thread_local CacheAligned::Category current_category =
+    CacheAligned::Category::kImages;
+
+// Raises `peak` to at least `value`.
+void UpdatePeak(std::atomic<uint64_t>* peak, uint64_t value) {
+  uint64_t expected = peak->load(std::memory_order_acquire);
+  while (expected < value &&
+         !peak->compare_exchange_weak(expected, value,
+                                      std::memory_order_acq_rel)) {
+  }
+}
+
 }  // namespace
 
 // Avoids linker errors in pre-C++17 builds.
@@ -45,6 +66,35 @@ constexpr size_t CacheAligned::kPointerSize;
 constexpr size_t CacheAligned::kCacheLineSize;
 constexpr size_t CacheAligned::kAlignment;
 constexpr size_t CacheAligned::kAlias;
+constexpr size_t CacheAligned::kNumCategories;
+
+CacheAligned::Stats::Stats()
+    : total_bytes(0), peak_total_bytes(0), limit(0), limit_exceeded(false) {
+  for (size_t i = 0; i < kNumCategories; i++) {
+    bytes[i].store(0, std::memory_order_relaxed);
+    peak_bytes[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void CacheAligned::Stats::Add(Category category, uint64_t num_bytes) {
+  const size_t i = static_cast<size_t>(category);
+  UpdatePeak(&peak_bytes[i],
+             bytes[i].fetch_add(num_bytes, std::memory_order_acq_rel) +
+                 num_bytes);
+  const uint64_t total =
+      total_bytes.fetch_add(num_bytes, std::memory_order_acq_rel) + num_bytes;
+  UpdatePeak(&peak_total_bytes, total);
+  const uint64_t max_bytes = limit.load(std::memory_order_relaxed);
+  if (max_bytes != 0 && total > max_bytes) {
+    limit_exceeded.store(true, std::memory_order_relaxed);
+  }
+}
+
+void CacheAligned::Stats::Remove(Category category, uint64_t num_bytes) {
+  const size_t i = static_cast<size_t>(category);
+  bytes[i].fetch_sub(num_bytes, std::memory_order_acq_rel);
+  total_bytes.fetch_sub(num_bytes, std::memory_order_acq_rel);
+}
 
 void CacheAligned::PrintStats() {
   fprintf(
@@ -84,7 +134,12 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
   const uintptr_t aligned = reinterpret_cast<uintptr_t>(allocated);
 #else
   const size_t allocated_size = kAlias + offset + payload_size;
-  void* allocated = malloc(allocated_size);
+  const JxlMemoryManager* memory_manager = current_memory_manager;
+  Stats* stats = current_stats;
+  void* allocated =
+      memory_manager
+          ? memory_manager->alloc(memory_manager->opaque, allocated_size)
+          : malloc(allocated_size);
   if (allocated == nullptr) return nullptr;
   // Always round up even if already aligned - we already asked for kAlias
   // extra bytes and there's no way to give them back.
@@ -129,6 +184,20 @@ void* CacheAligned::Allocate(const size_t payload_size, size_t offset) {
   AllocationHeader* header = reinterpret_cast<AllocationHeader*>(payload) - 1;
   header->allocated = allocated;
   header->allocated_size = allocated_size;
+#if JXL_USE_MMAP
+  header->free_func = nullptr;
+  header->free_opaque = nullptr;
+#else
+  header->free_func = memory_manager ? memory_manager->free : nullptr;
+  header->free_opaque = memory_manager ? memory_manager->opaque : nullptr;
+#endif
+#if JXL_USE_MMAP
+  header->stats = nullptr;
+#else
+  header->stats = stats;
+  if (stats != nullptr) stats->Add(current_category, allocated_size);
+#endif
+  header->category = current_category;
 
   return JXL_ASSUME_ALIGNED(reinterpret_cast<void*>(payload), 64);
 }
@@ -145,12 +214,50 @@ void CacheAligned::Free(const void* aligned_pointer) {
   // Subtract (2's complement negation).
   bytes_in_use.fetch_add(~header->allocated_size + 1,
                          std::memory_order_acq_rel);
+  if (header->stats != nullptr) {
+    header->stats->Remove(header->category, header->allocated_size);
+  }
 
 #if JXL_USE_MMAP
   munmap(header->allocated, header->allocated_size);
 #else
-  free(header->allocated);
+  if (header->free_func != nullptr) {
+    header->free_func(header->free_opaque, header->allocated);
+  } else {
+    free(header->allocated);
+  }
 #endif
 }
 
+const JxlMemoryManager* CacheAligned::CurrentMemoryManager() {
+  return current_memory_manager;
+}
+
+CacheAligned::Stats* CacheAligned::CurrentStats() { return current_stats; }
+
+CacheAligned::Category CacheAligned::CurrentCategory() {
+  return current_category;
+}
+
+CacheAligned::ScopedMemoryManager::ScopedMemoryManager(
+    const JxlMemoryManager* memory_manager, Stats* stats)
+    : previous_(current_memory_manager), previous_stats_(current_stats) {
+  current_memory_manager = memory_manager;
+  current_stats = stats;
+}
+
+CacheAligned::ScopedMemoryManager::~ScopedMemoryManager() {
+  current_memory_manager = previous_;
+  current_stats = previous_stats_;
+}
+
+CacheAligned::ScopedCategory::ScopedCategory(Category category)
+    : previous_(current_category) {
+  current_category = category;
+}
+
+CacheAligned::ScopedCategory::~ScopedCategory() {
+  current_category = previous_;
+}
+
 }  // namespace jxl
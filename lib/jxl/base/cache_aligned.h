@@ -11,8 +11,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <atomic>
 #include <memory>
 
+#include "jxl/memory_manager.h"
 #include "lib/jxl/base/compiler_specific.h"
 
 namespace jxl {
@@ -44,6 +46,80 @@ class CacheAligned {
   }
 
   static void Free(const void* aligned_pointer);
+
+  // What an allocation is used for, see Stats.
+  enum class Category : uint8_t {
+    kImages,
+    kCoefficients,
+    kPipeline,
+    kInput,
+  };
+  static constexpr size_t kNumCategories = 4;
+
+  // Bytes in use by the allocations made while the stats are current on the
+  // calling thread, per category and in total, and the peaks of those counts.
+  // Allocations are attributed to the stats and category that were current
+  // when they were made, also when freed later.
+  struct Stats {
+    Stats();
+    Stats(const Stats&) = delete;
+    Stats& operator=(const Stats&) = delete;
+
+    void Add(Category category, uint64_t bytes);
+    void Remove(Category category, uint64_t bytes);
+
+    std::atomic<uint64_t> bytes[kNumCategories];
+    std::atomic<uint64_t> peak_bytes[kNumCategories];
+    std::atomic<uint64_t> total_bytes;
+    std::atomic<uint64_t> peak_total_bytes;
+    // If non-zero, Add sets limit_exceeded once the total exceeds this many
+    // bytes. Allocations still succeed; callers check the flag between steps
+    // and fail the operation, since not all of them can handle null.
+    std::atomic<uint64_t> limit;
+    std::atomic<bool> limit_exceeded;
+  };
+
+  // Returns the memory manager used by Allocate on the calling thread, or
+  // nullptr if Allocate uses malloc.
+  static const JxlMemoryManager* CurrentMemoryManager();
+
+  // Returns the stats that Allocate on the calling thread counts into, or
+  // nullptr if none.
+  static Stats* CurrentStats();
+
+  // Returns the category of the allocations made on the calling thread.
+  static Category CurrentCategory();
+
+  // Makes Allocate on the calling thread use the given memory manager (or
+  // malloc if nullptr) and count into the given stats (if not nullptr) until
+  // the object goes out of scope. The manager and stats must outlive the
+  // allocations made with them. Free releases each allocation with the manager
+  // it came from, regardless of the current one.
+  class ScopedMemoryManager {
+   public:
+    explicit ScopedMemoryManager(const JxlMemoryManager* memory_manager,
+                                 Stats* stats = nullptr);
+    ~ScopedMemoryManager();
+    ScopedMemoryManager(const ScopedMemoryManager&) = delete;
+    ScopedMemoryManager& operator=(const ScopedMemoryManager&) = delete;
+
+   private:
+    const JxlMemoryManager* previous_;
+    Stats* previous_stats_;
+  };
+
+  // Attributes the allocations on the calling thread to the given category
+  // until the object goes out of scope. The default is kImages.
+  class ScopedCategory {
+   public:
+    explicit ScopedCategory(Category category);
+    ~ScopedCategory();
+    ScopedCategory(const ScopedCategory&) = delete;
+    ScopedCategory& operator=(const ScopedCategory&) = delete;
+
+   private:
+    Category previous_;
+  };
 };
 
 // Avoids the need for a function pointer (deleter) in CacheAlignedUniquePtr.
@@ -12,8 +12,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
 #include "jxl/parallel_runner.h"
 #include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/cache_aligned.h"
 #include "lib/jxl/base/status.h"
 #if JXL_COMPILER_MSVC
 // suppress warnings about the const & applied to function types
@@ -32,10 +37,15 @@ class ThreadPool {
   ThreadPool& operator&(const ThreadPool&) = delete;
 
   // Runs init_func(num_threads) followed by data_func(task, thread) on worker
-  // thread(s) for every task in [begin, end). init_func() must return a Status
+  // thread(s) for every task in [begin, end), or on the calling thread without
+  // calling the runner if there is only one. init_func() must return a Status
   // indicating whether the initialization succeeded.
   // "thread" is an integer smaller than num_threads.
-  // Not thread-safe - no two calls to Run may overlap.
+  // Not thread-safe - no two calls to Run may overlap, except that data_func
+  // may call Run again if the runner supports it, as ThreadParallelRunner
+  // does: the inner tasks then also run on the workers that are done with the
+  // outer ones. The inner data_func must not use the per-thread storage of
+  // the outer call, the thread indices overlap.
   // Subsequent calls will reuse the same threads.
   //
   // Precondition: begin <= end.
@@ -44,6 +54,13 @@ class ThreadPool {
              const DataFunc& data_func, const char* caller = "") {
     JXL_ASSERT(begin <= end);
     if (begin == end) return true;
+    // A single task, e.g. the only group of a small image, runs on the calling
+    // thread: waking up worker threads would cost more than the task itself.
+    if (end - begin == 1) {
+      if (!init_func(1)) return false;
+      data_func(begin, 0);
+      return true;
+    }
     RunCallState<InitFunc, DataFunc> call_state(init_func, data_func);
     // The runner_ uses the C convention and returns 0 in case of error, so we
     // convert it to a Status.
@@ -62,12 +79,19 @@ class ThreadPool {
   class RunCallState final {
    public:
     RunCallState(const InitFunc& init_func, const DataFunc& data_func)
-        : init_func_(init_func), data_func_(data_func) {}
+        : init_func_(init_func),
+          data_func_(data_func),
+          memory_manager_(CacheAligned::CurrentMemoryManager()),
+          stats_(CacheAligned::CurrentStats()),
+          category_(CacheAligned::CurrentCategory()) {}
 
     // JxlParallelRunInit interface.
     static int CallInitFunc(void* jpegxl_opaque, size_t num_threads) {
       const auto* self =
           static_cast<RunCallState<InitFunc, DataFunc>*>(jpegxl_opaque);
+      CacheAligned::ScopedMemoryManager scoped(self->memory_manager_,
+                                               self->stats_);
+      CacheAligned::ScopedCategory scoped_category(self->category_);
       // Returns -1 when the internal init function returns false Status to
       // indicate an error.
       return self->init_func_(num_threads) ? 0 : -1;
@@ -78,12 +102,20 @@ class ThreadPool {
                              size_t thread_id) {
       const auto* self =
           static_cast<RunCallState<InitFunc, DataFunc>*>(jpegxl_opaque);
+      // Allocations on the worker threads go to the memory manager, stats and
+      // category of the thread that called Run.
+      CacheAligned::ScopedMemoryManager scoped(self->memory_manager_,
+                                               self->stats_);
+      CacheAligned::ScopedCategory scoped_category(self->category_);
       return self->data_func_(value, thread_id);
     }
 
    private:
     const InitFunc& init_func_;
     const DataFunc& data_func_;
+    const JxlMemoryManager* memory_manager_;
+    CacheAligned::Stats* stats_;
+    CacheAligned::Category category_;
   };
 
   // Default JxlParallelRunner used when no runner is provided by the
@@ -109,6 +141,58 @@ Status RunOnPool(ThreadPool* pool, const uint32_t begin, const uint32_t end,
   }
 }
 
+// Runs node_func(node, thread) for the nodes [0, num_dependencies.size()) of
+// an acyclic dependency graph, each once all the nodes that list it in their
+// `dependents` are done. Unlike one RunOnPool per phase, a single call to the
+// runner covers the whole graph, so that the threads do not wait for the end
+// of a phase while the nodes that only depend on part of it could run.
+//
+// Each task of the call takes the next ready node, first waiting for one if
+// there is none. Since every task runs exactly one node, a task only waits
+// while other tasks still run the nodes it needs, which makes this safe with
+// any runner, including sequential ones. node_func must not fail: it records
+// its errors and returns, the dependents still run and can skip their work.
+template <class InitFunc, class NodeFunc>
+Status RunGraphOnPool(ThreadPool* pool, std::vector<uint32_t> num_dependencies,
+                      const std::vector<std::vector<uint32_t>>& dependents,
+                      const InitFunc& init_func, const NodeFunc& node_func,
+                      const char* caller) {
+  JXL_ASSERT(num_dependencies.size() == dependents.size());
+  const uint32_t num_nodes = num_dependencies.size();
+  std::mutex mutex;
+  std::condition_variable node_ready;
+  // Nodes in the order in which they became ready; the ones before next_ready
+  // are taken by a task.
+  std::vector<uint32_t> ready;
+  ready.reserve(num_nodes);
+  size_t next_ready = 0;
+  for (uint32_t node = 0; node < num_nodes; node++) {
+    if (num_dependencies[node] == 0) ready.push_back(node);
+  }
+  const auto run_next_node = [&](uint32_t /* task */, size_t thread) {
+    uint32_t node;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      node_ready.wait(lock, [&] { return next_ready < ready.size(); });
+      node = ready[next_ready++];
+    }
+    node_func(node, thread);
+    bool any_ready = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (uint32_t dependent : dependents[node]) {
+        JXL_DASSERT(num_dependencies[dependent] != 0);
+        if (--num_dependencies[dependent] == 0) {
+          ready.push_back(dependent);
+          any_ready = true;
+        }
+      }
+    }
+    if (any_ready) node_ready.notify_all();
+  };
+  return RunOnPool(pool, 0, num_nodes, init_func, run_next_node, caller);
+}
+
 }  // namespace jxl
 #if JXL_COMPILER_MSVC
 #pragma warning(default : 4180)
@@ -8,9 +8,16 @@
 
 // Helper functions for reading/writing files.
 
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include <list>
 #include <string>
 #include <vector>
@@ -146,6 +153,81 @@ static inline Status WriteFile(const ContainerType& bytes,
   return true;
 }
 
+// Read-only contents of a whole file. Regular files are memory-mapped, so that
+// the pages are read as the decoders reach them and the page cache holds the
+// only copy of large inputs. Falls back to ReadFile for "-" (stdin), pipes and
+// other files that cannot be mapped, and on Windows.
+class FileContents {
+ public:
+  FileContents() = default;
+  FileContents(const FileContents& other) = delete;
+  FileContents& operator=(const FileContents& other) = delete;
+
+  ~FileContents() { Unmap(); }
+
+  Status Open(const std::string& pathname) {
+    Unmap();
+    bytes_.clear();
+#ifndef _WIN32
+    if (pathname != "-" && Map(pathname)) return true;
+#endif
+    return ReadFile(pathname, &bytes_);
+  }
+
+  const uint8_t* data() const {
+    return mapped_ != nullptr ? mapped_ : bytes_.data();
+  }
+  size_t size() const {
+    return mapped_ != nullptr ? mapped_size_ : bytes_.size();
+  }
+  bool empty() const { return size() == 0; }
+
+  // Whether the contents are memory-mapped rather than read.
+  bool mapped() const { return mapped_ != nullptr; }
+
+ private:
+#ifndef _WIN32
+  // Returns false, and leaves the object empty, if `pathname` is not a
+  // non-empty regular file or cannot be mapped.
+  bool Map(const std::string& pathname) {
+    const int fd = open(pathname.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat s = {};
+    if (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) || s.st_size <= 0 ||
+        static_cast<uint64_t>(s.st_size) > SIZE_MAX) {
+      close(fd);
+      return false;
+    }
+    const size_t size = static_cast<size_t>(s.st_size);
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after closing its file.
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+#ifdef MADV_SEQUENTIAL
+    // The decoders mostly read their input front to back.
+    (void)madvise(addr, size, MADV_SEQUENTIAL);
+#endif
+    mapped_ = static_cast<const uint8_t*>(addr);
+    mapped_size_ = size;
+    return true;
+  }
+#endif
+
+  void Unmap() {
+#ifndef _WIN32
+    if (mapped_ != nullptr) {
+      munmap(const_cast<uint8_t*>(mapped_), mapped_size_);
+    }
+#endif
+    mapped_ = nullptr;
+    mapped_size_ = 0;
+  }
+
+  const uint8_t* mapped_ = nullptr;
+  size_t mapped_size_ = 0;
+  std::vector<uint8_t> bytes_;
+};
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_BASE_FILE_IO_H_
@@ -36,6 +36,21 @@ void PaddedBytes::IncreaseCapacityTo(size_t capacity) {
   std::swap(new_data, data_);
 }
 
+void PaddedBytes::shrink_to_fit() {
+  if (size_ == capacity_) return;
+  if (size_ == 0) {
+    data_.reset();
+    capacity_ = 0;
+    return;
+  }
+  CacheAlignedUniquePtr new_data = AllocateArray(size_ + 8);
+  if (new_data == nullptr) return;
+  memcpy(new_data.get(), data_.get(), size_);
+  new_data[size_] = 0;
+  capacity_ = size_;
+  std::swap(new_data, data_);
+}
+
 void PaddedBytes::assign(const uint8_t* new_begin, const uint8_t* new_end) {
   JXL_DASSERT(new_begin <= new_end);
   const size_t new_size = static_cast<size_t>(new_end - new_begin);
@@ -92,6 +92,11 @@ class PaddedBytes {
     size_ = (data() == nullptr) ? 0 : size;
   }
 
+  // Reallocates to free the capacity beyond size(). Keeps the first byte after
+  // the data zero-initialized, so that write_bits can still append. Keeps the
+  // memory if the reallocation fails.
+  void shrink_to_fit();
+
   // resize(size) plus explicit initialization of the new data with `value`.
   void resize(size_t size, uint8_t value) {
     size_t old_size = size_;
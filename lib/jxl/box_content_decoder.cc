@@ -11,19 +11,20 @@ namespace jxl {
 
 JxlBoxContentDecoder::JxlBoxContentDecoder() {}
 
-JxlBoxContentDecoder::~JxlBoxContentDecoder() {
+JxlBoxContentDecoder::~JxlBoxContentDecoder() { DestroyBrotliDecoder(); }
+
+void JxlBoxContentDecoder::DestroyBrotliDecoder() {
   if (brotli_dec) {
     BrotliDecoderDestroyInstance(brotli_dec);
+    brotli_dec = nullptr;
   }
 }
 
 void JxlBoxContentDecoder::StartBox(bool brob_decode, bool box_until_eof,
                                     size_t contents_size) {
-  if (brotli_dec) {
-    BrotliDecoderDestroyInstance(brotli_dec);
-    brotli_dec = nullptr;
-  }
+  DestroyBrotliDecoder();
   header_done_ = false;
+  done_ = false;
   brob_decode_ = brob_decode;
   box_until_eof_ = box_until_eof;
   remaining_ = box_until_eof ? 0 : contents_size;
@@ -34,6 +35,7 @@ JxlDecoderStatus JxlBoxContentDecoder::Process(const uint8_t* next_in,
                                                size_t avail_in, size_t box_pos,
                                                uint8_t** next_out,
                                                size_t* avail_out) {
+  if (done_) return JXL_DEC_SUCCESS;
   next_in += pos_ - box_pos;
   avail_in -= pos_ - box_pos;
 
@@ -62,6 +64,7 @@ JxlDecoderStatus JxlBoxContentDecoder::Process(const uint8_t* next_in,
     size_t consumed = next_in - next_in_before;
     size_t produced = *next_out - next_out_before;
     if (res == BROTLI_DECODER_RESULT_ERROR) {
+      DestroyBrotliDecoder();
       return JXL_DEC_ERROR;
     }
     msan::UnpoisonMemory(next_out_before, produced);
@@ -74,6 +77,10 @@ JxlDecoderStatus JxlBoxContentDecoder::Process(const uint8_t* next_in,
       return JXL_DEC_BOX_NEED_MORE_OUTPUT;
     }
     if (res == BROTLI_DECODER_RESULT_SUCCESS) {
+      // Release the window, which may be as large as the decompressed box,
+      // without waiting for the next box.
+      DestroyBrotliDecoder();
+      done_ = true;
       return JXL_DEC_SUCCESS;
     }
     // unknown Brotli result
@@ -94,6 +101,7 @@ JxlDecoderStatus JxlBoxContentDecoder::Process(const uint8_t* next_in,
 
     if (!box_until_eof_ && remaining_ > 0) return JXL_DEC_NEED_MORE_INPUT;
 
+    if (!box_until_eof_) done_ = true;
     return JXL_DEC_SUCCESS;
   }
 }
@@ -19,7 +19,9 @@ namespace jxl {
 
 /** Outputs the contents of a box in a streaming fashion, either directly, or
  * optionally decoding with Brotli, in case of a brob box. The input must be
- * the contents of a box, excluding the box header.
+ * the contents of a box, excluding the box header. The Brotli decoder is only
+ * created once decompressed output is requested, and destroyed as soon as the
+ * Brotli stream ends, so boxes that are not output cost no decompression.
  */
 class JxlBoxContentDecoder {
  public:
@@ -31,14 +33,18 @@ class JxlBoxContentDecoder {
   // Outputs decoded bytes from the box, decoding with brotli if needed.
   // box_pos is the position in the box content which next_in points to.
   // Returns success, whether more input or output bytes are needed, or error.
+  // Once it returned success, it does so again without reading the input.
   JxlDecoderStatus Process(const uint8_t* next_in, size_t avail_in,
                            size_t box_pos, uint8_t** next_out,
                            size_t* avail_out);
 
  private:
-  BrotliDecoderState* brotli_dec;
+  void DestroyBrotliDecoder();
+
+  BrotliDecoderState* brotli_dec = nullptr;
 
   bool header_done_;
+  bool done_;
   bool brob_decode_;
   bool box_until_eof_;
   size_t remaining_;
@@ -0,0 +1,117 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/buffer_pool.h"
+
+#include <stdint.h>
+
+#include <limits>
+
+#include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/status.h"
+
+namespace jxl {
+
+// Avoids linker errors in pre-C++17 builds.
+constexpr size_t BufferPool::kMinPooledSize;
+constexpr size_t BufferPool::kBucketsPerOctave;
+
+// Each allocation is preceded by its bucket size (zero if not pooled), padded
+// to keep the allocation 16-byte aligned.
+const size_t BufferPool::kPrefixSize = 16;
+
+BufferPool::BufferPool(const JxlMemoryManager& parent, size_t max_kept_bytes)
+    : parent_(parent), max_kept_bytes_(max_kept_bytes) {
+  JXL_ASSERT(parent_.alloc != nullptr && parent_.free != nullptr);
+  static_assert(sizeof(size_t) <= 16, "Prefix too small");
+  memory_manager_.opaque = this;
+  memory_manager_.alloc = &BufferPool::Alloc;
+  memory_manager_.free = &BufferPool::Free;
+}
+
+BufferPool::~BufferPool() { ReleaseUnused(); }
+
+void* BufferPool::Alloc(void* opaque, size_t size) {
+  return static_cast<BufferPool*>(opaque)->Allocate(size);
+}
+
+void BufferPool::Free(void* opaque, void* address) {
+  static_cast<BufferPool*>(opaque)->Release(address);
+}
+
+size_t BufferPool::BucketSize(size_t size) {
+  if (size < kMinPooledSize) return 0;
+  // Rounds up to a multiple of 1 / kBucketsPerOctave of the power of two below
+  // the size.
+  const size_t step = (size_t{1} << FloorLog2Nonzero(size)) / kBucketsPerOctave;
+  return (size + step - 1) & ~(step - 1);
+}
+
+void* BufferPool::Allocate(size_t size) {
+  // Avoids overflow of the sizes below.
+  if (size > std::numeric_limits<size_t>::max() / 2) return nullptr;
+  const size_t bucket = BucketSize(size);
+  uint8_t* prefix = nullptr;
+  if (bucket != 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = kept_.find(bucket);
+    if (it != kept_.end() && !it->second.empty()) {
+      prefix = static_cast<uint8_t*>(it->second.back());
+      it->second.pop_back();
+      kept_bytes_ -= bucket;
+    }
+  }
+  if (prefix == nullptr) {
+    prefix = static_cast<uint8_t*>(parent_.alloc(
+        parent_.opaque, kPrefixSize + (bucket != 0 ? bucket : size)));
+    if (prefix == nullptr) return nullptr;
+  }
+  *reinterpret_cast<size_t*>(prefix) = bucket;
+  return prefix + kPrefixSize;
+}
+
+void BufferPool::Release(void* address) {
+  if (address == nullptr) return;
+  uint8_t* prefix = static_cast<uint8_t*>(address) - kPrefixSize;
+  const size_t bucket = *reinterpret_cast<size_t*>(prefix);
+  if (bucket != 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (kept_bytes_ + bucket <= max_kept_bytes_) {
+      kept_[bucket].push_back(prefix);
+      kept_bytes_ += bucket;
+      return;
+    }
+  }
+  parent_.free(parent_.opaque, prefix);
+}
+
+void BufferPool::ReleaseUnused() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& bucket : kept_) {
+    for (void* prefix : bucket.second) parent_.free(parent_.opaque, prefix);
+  }
+  kept_.clear();
+  kept_bytes_ = 0;
+}
+
+void BufferPool::SetMaxKeptBytes(size_t max_kept_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_kept_bytes_ = max_kept_bytes;
+  // Frees the largest buffers first.
+  for (auto it = kept_.rbegin(); it != kept_.rend(); ++it) {
+    while (kept_bytes_ > max_kept_bytes_ && !it->second.empty()) {
+      parent_.free(parent_.opaque, it->second.back());
+      it->second.pop_back();
+      kept_bytes_ -= it->first;
+    }
+  }
+}
+
+size_t BufferPool::KeptBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return kept_bytes_;
+}
+
+}  // namespace jxl
@@ -0,0 +1,80 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_BUFFER_POOL_H_
+#define LIB_JXL_BUFFER_POOL_H_
+
+// Pool of freed buffers, reused for later allocations of a similar size.
+
+#include <stddef.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "jxl/memory_manager.h"
+
+namespace jxl {
+
+// Memory manager that keeps the large buffers freed through it, bucketed by
+// size, and hands them out again to allocations of the same bucket instead of
+// getting new memory from a parent memory manager. This avoids the page
+// faults and zeroing of fresh memory when the same-sized image temporaries are
+// allocated over and over, e.g. when encoding many similar images with the same
+// instance. Small allocations go straight to the parent. Thread safe; the pool
+// must outlive all the allocations made with it.
+class BufferPool {
+ public:
+  // Allocations smaller than this are not pooled.
+  static constexpr size_t kMinPooledSize = 1 << 16;
+  // Each power of two range of sizes is split into this many buckets, so that
+  // at most 1 / kBucketsPerOctave of a pooled buffer is unused.
+  static constexpr size_t kBucketsPerOctave = 8;
+
+  // The parent memory manager is copied, it must have non-null functions. At
+  // most max_kept_bytes of freed buffers are kept; further ones are returned
+  // to the parent.
+  BufferPool(const JxlMemoryManager& parent, size_t max_kept_bytes);
+  ~BufferPool();
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // Memory manager allocating from this pool.
+  const JxlMemoryManager* memory_manager() const { return &memory_manager_; }
+
+  // Returns the kept buffers to the parent.
+  void ReleaseUnused();
+
+  // Changes the limit on the size of the kept buffers, returning the ones
+  // exceeding it to the parent.
+  void SetMaxKeptBytes(size_t max_kept_bytes);
+
+  // Total size of the kept buffers, for tests.
+  size_t KeptBytes() const;
+
+  // Size of the buffers of the bucket of allocations of the given size.
+  static size_t BucketSize(size_t size);
+
+ private:
+  static const size_t kPrefixSize;
+
+  static void* Alloc(void* opaque, size_t size);
+  static void Free(void* opaque, void* address);
+
+  void* Allocate(size_t size);
+  void Release(void* address);
+
+  JxlMemoryManager parent_;
+  JxlMemoryManager memory_manager_;
+  mutable std::mutex mutex_;
+  size_t max_kept_bytes_;
+  // Kept buffers (including the prefix) by bucket size.
+  std::map<size_t, std::vector<void*>> kept_;
+  size_t kept_bytes_ = 0;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_BUFFER_POOL_H_
@@ -0,0 +1,128 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/buffer_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "lib/jxl/base/cache_aligned.h"
+#include "lib/jxl/image.h"
+
+namespace jxl {
+namespace {
+
+struct Counters {
+  std::atomic<size_t> allocs{0};
+  std::atomic<size_t> frees{0};
+};
+
+JxlMemoryManager CountingMemoryManager(Counters* counters) {
+  JxlMemoryManager memory_manager;
+  memory_manager.opaque = counters;
+  memory_manager.alloc = [](void* opaque, size_t size) {
+    static_cast<Counters*>(opaque)->allocs++;
+    return malloc(size);
+  };
+  memory_manager.free = [](void* opaque, void* address) {
+    static_cast<Counters*>(opaque)->frees++;
+    free(address);
+  };
+  return memory_manager;
+}
+
+TEST(BufferPoolTest, TestBucketSize) {
+  EXPECT_EQ(0u, BufferPool::BucketSize(BufferPool::kMinPooledSize - 1));
+  for (size_t size = BufferPool::kMinPooledSize; size < (1 << 24);
+       size = size * 9 / 8 + 1) {
+    const size_t bucket = BufferPool::BucketSize(size);
+    EXPECT_GE(bucket, size);
+    EXPECT_LE(bucket, size + size / BufferPool::kBucketsPerOctave);
+    EXPECT_EQ(bucket, BufferPool::BucketSize(bucket));
+  }
+}
+
+TEST(BufferPoolTest, TestReuse) {
+  Counters counters;
+  {
+    BufferPool pool(CountingMemoryManager(&counters), 1 << 30);
+    const JxlMemoryManager* mm = pool.memory_manager();
+    for (size_t round = 0; round < 10; round++) {
+      std::vector<void*> buffers;
+      for (size_t i = 0; i < 20; i++) {
+        // Slightly different sizes every round, in the same buckets.
+        const size_t size = (100000 << (i % 5)) + round;
+        void* buffer = mm->alloc(mm->opaque, size);
+        ASSERT_NE(nullptr, buffer);
+        EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(buffer) % 16);
+        memset(buffer, round, size);
+        buffers.push_back(buffer);
+      }
+      // Small buffers are not pooled.
+      void* small = mm->alloc(mm->opaque, 100);
+      ASSERT_NE(nullptr, small);
+      mm->free(mm->opaque, small);
+      for (void* buffer : buffers) mm->free(mm->opaque, buffer);
+    }
+    EXPECT_EQ(20u + 10u, counters.allocs.load());
+    EXPECT_EQ(10u, counters.frees.load());
+    EXPECT_NE(0u, pool.KeptBytes());
+    pool.ReleaseUnused();
+    EXPECT_EQ(0u, pool.KeptBytes());
+  }
+  EXPECT_EQ(counters.allocs.load(), counters.frees.load());
+}
+
+TEST(BufferPoolTest, TestMaxKeptBytes) {
+  Counters counters;
+  {
+    const size_t size = 4 * BufferPool::kMinPooledSize;
+    BufferPool pool(CountingMemoryManager(&counters), 3 * size);
+    const JxlMemoryManager* mm = pool.memory_manager();
+    std::vector<void*> buffers;
+    for (size_t i = 0; i < 5; i++) {
+      buffers.push_back(mm->alloc(mm->opaque, size));
+      ASSERT_NE(nullptr, buffers.back());
+    }
+    for (void* buffer : buffers) mm->free(mm->opaque, buffer);
+    EXPECT_EQ(3 * size, pool.KeptBytes());
+    EXPECT_EQ(2u, counters.frees.load());
+    pool.SetMaxKeptBytes(size);
+    EXPECT_EQ(size, pool.KeptBytes());
+    EXPECT_EQ(4u, counters.frees.load());
+  }
+  EXPECT_EQ(counters.allocs.load(), counters.frees.load());
+}
+
+// Images allocated and freed concurrently on many threads.
+TEST(BufferPoolTest, TestThreads) {
+  Counters counters;
+  {
+    BufferPool pool(CountingMemoryManager(&counters), 1 << 30);
+    const size_t kNumThreads = 8;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kNumThreads; t++) {
+      threads.emplace_back([&pool, t]() {
+        CacheAligned::ScopedMemoryManager scoped(pool.memory_manager());
+        for (size_t i = 0; i < 50; i++) {
+          ImageF image(256, 300);
+          image.Row(0)[0] = i;
+        }
+      });
+    }
+    for (std::thread& thread : threads) thread.join();
+    // At most one live image per thread.
+    EXPECT_LE(counters.allocs.load(), kNumThreads);
+  }
+  EXPECT_EQ(counters.allocs.load(), counters.frees.load());
+}
+
+}  // namespace
+}  // namespace jxl
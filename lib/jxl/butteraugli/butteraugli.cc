@@ -221,16 +221,70 @@ void ConvolutionWithTranspose(const ImageF& in,
   }
 }
 
+// Kernels at least this large, i.e. sigma above ~3, are approximated with
+// the recursive Gaussian, whose cost does not depend on the kernel size.
+constexpr size_t kMinRecursiveBlurKernelSize = 15;
+
+// Standard deviation of the truncated kernel; the recursive Gaussian of this
+// sigma spreads about as much as the kernel.
+double KernelSigma(const std::vector<float>& kernel) {
+  const int offset = kernel.size() / 2;
+  double sum = 0.0;
+  double sum_squares = 0.0;
+  for (int i = 0; i < static_cast<int>(kernel.size()); ++i) {
+    sum += kernel[i];
+    sum_squares += kernel[i] * static_cast<double>((i - offset) * (i - offset));
+  }
+  return std::sqrt(sum_squares / sum);
+}
+
+// Returns the inverse of the sum of the weights of the recursive Gaussian
+// inside [0, size) at each position, to renormalize its zero-padded borders.
+ImageF InverseBorderWeights(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
+                            size_t size) {
+  ImageF ones(size, 1);
+  FillImage(1.0f, &ones);
+  ImageF weights(size, 1);
+  FastGaussian1D(rg, ones.ConstRow(0), size, weights.Row(0));
+  float* BUTTERAUGLI_RESTRICT row = weights.Row(0);
+  for (size_t i = 0; i < size; ++i) {
+    row[i] = 1.0f / row[i];
+  }
+  return weights;
+}
+
+// Same as the separable convolution with `kernel`, whose borders are
+// renormalized by the weights inside the image, using the recursive Gaussian.
+// Since it is separable, so are the weights of the zero-padded borders: they
+// are divided out with one row and one column of weights.
+void RecursiveBlur(const ImageF& in, const std::vector<float>& kernel,
+                   BlurTemp* temp, ImageF* out) {
+  PROFILER_FUNC;
+  const hwy::AlignedUniquePtr<RecursiveGaussian>& rg =
+      temp->GetRecursiveGaussian(KernelSigma(kernel));
+  FastGaussian(rg, in, /*pool=*/nullptr, temp->Get(in), out);
+  const ImageF inv_weights_x = InverseBorderWeights(rg, in.xsize());
+  const ImageF inv_weights_y = InverseBorderWeights(rg, in.ysize());
+  const float* BUTTERAUGLI_RESTRICT row_weights_x = inv_weights_x.ConstRow(0);
+  const float* BUTTERAUGLI_RESTRICT row_weights_y = inv_weights_y.ConstRow(0);
+  for (size_t y = 0; y < out->ysize(); ++y) {
+    float* BUTTERAUGLI_RESTRICT row_out = out->Row(y);
+    for (size_t x = 0; x < out->xsize(); ++x) {
+      row_out[x] *= row_weights_x[x] * row_weights_y[y];
+    }
+  }
+}
+
 // A blur somewhat similar to a 2D Gaussian blur.
 // See: https://en.wikipedia.org/wiki/Gaussian_blur
 //
-// This is a bottleneck because the sigma can be quite large (>7). We can use
-// gauss_blur.cc (runtime independent of sigma, closer to a 4*sigma truncated
-// Gaussian and our 2.25 in ComputeKernel), but its boundary conditions are
-// zero-valued. This leads to noticeable differences at the edges of diffmaps.
-// We retain a special case for 5x5 kernels (even faster than gauss_blur),
-// optionally use gauss_blur followed by fixup of the borders for large images,
-// or fall back to the previous truncated FIR followed by a transpose.
+// This is a bottleneck because the sigma can be quite large (>7). We retain a
+// special case for 5x5 kernels (even faster than gauss_blur), use gauss_blur
+// (runtime independent of sigma) with renormalized borders for large kernels,
+// and fall back to the truncated FIR followed by a transpose otherwise. The
+// sigma of gauss_blur matches the spread of the FIR truncated at 2.25 sigma
+// (see ComputeKernel) rather than its nominal sigma, which keeps the scores
+// close to those of the FIR.
 void Blur(const ImageF& in, float sigma, const ButteraugliParams& params,
           BlurTemp* temp, ImageF* out) {
   std::vector<float> kernel = ComputeKernel(sigma);
@@ -252,12 +306,66 @@ void Blur(const ImageF& in, float sigma, const ButteraugliParams& params,
     Separable5(in, Rect(in), weights, /*pool=*/nullptr, out);
     return;
   }
+  // The horizontal pass of the recursive Gaussian writes to a temporary
+  // image, so in may alias out.
+  if (kernel.size() >= kMinRecursiveBlurKernelSize) {
+    RecursiveBlur(in, kernel, temp, out);
+    return;
+  }
 
   ImageF* JXL_RESTRICT temp_t = temp->GetTransposed(in);
   ConvolutionWithTranspose(in, kernel, temp_t);
   ConvolutionWithTranspose(*temp_t, kernel, out);
 }
 
+// Same as Blur at half resolution, for the smooth low-frequency band of the
+// fast mode: `in` is averaged in 2x2 blocks, blurred with half the sigma and
+// upsampled bilinearly into `out`, which may alias `in`.
+void BlurHalfResolution(const ImageF& in, float sigma,
+                        const ButteraugliParams& params, ImageF* out) {
+  PROFILER_FUNC;
+  const size_t xsize = in.xsize();
+  const size_t ysize = in.ysize();
+  const size_t sub_xsize = (xsize + 1) / 2;
+  const size_t sub_ysize = (ysize + 1) / 2;
+  ImageF sub(sub_xsize, sub_ysize);
+  for (size_t y = 0; y < sub_ysize; ++y) {
+    const float* BUTTERAUGLI_RESTRICT row0 = in.ConstRow(2 * y);
+    const float* BUTTERAUGLI_RESTRICT row1 =
+        in.ConstRow(std::min(2 * y + 1, ysize - 1));
+    float* BUTTERAUGLI_RESTRICT row_sub = sub.Row(y);
+    for (size_t x = 0; x < sub_xsize; ++x) {
+      const size_t x1 = std::min(2 * x + 1, xsize - 1);
+      row_sub[x] = 0.25f * (row0[2 * x] + row0[x1] + row1[2 * x] + row1[x1]);
+    }
+  }
+  BlurTemp sub_temp;
+  Blur(sub, 0.5f * sigma, params, &sub_temp, &sub);
+
+  // The center of the subsampled pixel i is at 2 * i + 0.5, so output pixel
+  // x interpolates between (x - 1) / 2 and (x + 1) / 2 with weights 1/4 and
+  // 3/4, clamped at the borders.
+  const auto lo = [](size_t x) { return x == 0 ? 0 : (x - 1) / 2; };
+  const auto hi = [](size_t x, size_t sub_size) {
+    return std::min((x + 1) / 2, sub_size - 1);
+  };
+  const auto weight_hi = [](size_t x) { return x % 2 == 0 ? 0.75f : 0.25f; };
+  for (size_t y = 0; y < ysize; ++y) {
+    const float* BUTTERAUGLI_RESTRICT row_lo = sub.ConstRow(lo(y));
+    const float* BUTTERAUGLI_RESTRICT row_hi = sub.ConstRow(hi(y, sub_ysize));
+    const float wy = weight_hi(y);
+    float* BUTTERAUGLI_RESTRICT row_out = out->Row(y);
+    for (size_t x = 0; x < xsize; ++x) {
+      const size_t x_lo = lo(x);
+      const size_t x_hi = hi(x, sub_xsize);
+      const float wx = weight_hi(x);
+      const float top = row_lo[x_lo] + wx * (row_lo[x_hi] - row_lo[x_lo]);
+      const float bottom = row_hi[x_lo] + wx * (row_hi[x_hi] - row_hi[x_lo]);
+      row_out[x] = top + wy * (bottom - top);
+    }
+  }
+}
+
 // Allows PaddedMaltaUnit to call either function via overloading.
 struct MaltaTagLF {};
 struct MaltaTag {};
@@ -364,7 +472,11 @@ static void SeparateFrequencies(size_t xsize, size_t ysize,
   ps.lf = Image3F(xyb.xsize(), xyb.ysize());
   ps.mf = Image3F(xyb.xsize(), xyb.ysize());
   for (int i = 0; i < 3; ++i) {
-    Blur(xyb.Plane(i), kSigmaLf, params, blur_temp, &ps.lf.Plane(i));
+    if (params.fast) {
+      BlurHalfResolution(xyb.Plane(i), kSigmaLf, params, &ps.lf.Plane(i));
+    } else {
+      Blur(xyb.Plane(i), kSigmaLf, params, blur_temp, &ps.lf.Plane(i));
+    }
 
     // ... and keep everything else in mf.
     for (size_t y = 0; y < ysize; ++y) {
@@ -1602,9 +1714,42 @@ ButteraugliComparator::ButteraugliComparator(const Image3F& rgb0,
   // Awful recursive construction of samples of different resolution.
   // This is an after-thought and possibly somewhat parallel in
   // functionality with the PsychoImage multi-resolution approach.
+  // The fast mode skips it.
+  if (params.fast) return;
   sub_.reset(new ButteraugliComparator(SubSample2x(rgb0), params));
 }
 
+constexpr size_t ButteraugliComparator::kDiffmapSupport;
+
+ButteraugliComparator::ButteraugliComparator(
+    const ButteraugliComparator& parent, const Rect& rect, bool with_sub)
+    : xsize_(rect.xsize()),
+      ysize_(rect.ysize()),
+      params_(parent.params_),
+      temp_(xsize_, ysize_) {
+  if (xsize_ < 8 || ysize_ < 8) {
+    return;
+  }
+  for (size_t i = 0; i < 2; ++i) {
+    pi0_.uhf[i] = CopyImage(rect, parent.pi0_.uhf[i]);
+    pi0_.hf[i] = CopyImage(rect, parent.pi0_.hf[i]);
+  }
+  pi0_.mf = Image3F(xsize_, ysize_);
+  CopyImageTo(rect, parent.pi0_.mf, &pi0_.mf);
+  pi0_.lf = Image3F(xsize_, ysize_);
+  CopyImageTo(rect, parent.pi0_.lf, &pi0_.lf);
+  if (with_sub && parent.sub_) {
+    // The origin of rect is even, so the 2x2 blocks of the crop are the same
+    // as those of the full image.
+    JXL_DASSERT(rect.x0() % 2 == 0 && rect.y0() % 2 == 0);
+    const Rect sub_rect(rect.x0() / 2, rect.y0() / 2, (xsize_ + 1) / 2,
+                        (ysize_ + 1) / 2, parent.sub_->xsize_,
+                        parent.sub_->ysize_);
+    sub_.reset(
+        new ButteraugliComparator(*parent.sub_, sub_rect, /*with_sub=*/false));
+  }
+}
+
 void ButteraugliComparator::Mask(ImageF* BUTTERAUGLI_RESTRICT mask) const {
   HWY_DYNAMIC_DISPATCH(MaskPsychoImage)
   (pi0_, pi0_, xsize_, ysize_, params_, Temp(), &blur_temp_, mask, nullptr);
@@ -1634,6 +1779,41 @@ void ButteraugliComparator::Diffmap(const Image3F& rgb1, ImageF& result) const {
   }
 }
 
+void ButteraugliComparator::DiffmapInRect(const Image3F& rgb1,
+                                          const Rect& rect,
+                                          ImageF* diffmap) const {
+  PROFILER_FUNC;
+  JXL_ASSERT(rgb1.xsize() == xsize_ && rgb1.ysize() == ysize_);
+  JXL_ASSERT(SameSize(rgb1, *diffmap));
+  JXL_ASSERT(rect.IsInside(*diffmap));
+  // The chain of blurs of OpsinDynamicsImage and SeparateFrequencies, the
+  // Malta filter and the blur and erosion of the masking add up to about 52
+  // pixels, the recursive Gaussians of the large blurs reaching further than
+  // the truncated kernels, which the subsampled comparator doubles.
+  const size_t kBorder = kDiffmapSupport;
+  if (rect.xsize() == 0 || rect.ysize() == 0) {
+    return;
+  }
+  // Even offsets keep the 2x2 blocks of the subsampled comparator aligned.
+  const size_t x0 =
+      rect.x0() < kBorder ? 0 : (rect.x0() - kBorder) & ~size_t{1};
+  const size_t y0 =
+      rect.y0() < kBorder ? 0 : (rect.y0() - kBorder) & ~size_t{1};
+  const Rect padded(x0, y0, rect.x0() + rect.xsize() + kBorder - x0,
+                    rect.y0() + rect.ysize() + kBorder - y0, xsize_, ysize_);
+  if (padded.xsize() == xsize_ && padded.ysize() == ysize_) {
+    Diffmap(rgb1, *diffmap);
+    return;
+  }
+  ButteraugliComparator crop(*this, padded, /*with_sub=*/true);
+  Image3F crop_rgb1(padded.xsize(), padded.ysize());
+  CopyImageTo(padded, rgb1, &crop_rgb1);
+  ImageF crop_diffmap(padded.xsize(), padded.ysize());
+  crop.Diffmap(crop_rgb1, crop_diffmap);
+  CopyImageTo(Rect(rect.x0() - x0, rect.y0() - y0, rect.xsize(), rect.ysize()),
+              crop_diffmap, rect, diffmap);
+}
+
 void ButteraugliComparator::DiffmapOpsinDynamicsImage(const Image3F& xyb1,
                                                       ImageF& result) const {
   PROFILER_FUNC;
@@ -1816,11 +1996,52 @@ bool ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
     }
     return ok;
   }
+  if (params.band_ysize != 0) {
+    ButteraugliDiffmapInBands(rgb0, rgb1, params, params.band_ysize, diffmap);
+    return true;
+  }
   ButteraugliComparator butteraugli(rgb0, params);
   butteraugli.Diffmap(rgb1, diffmap);
   return true;
 }
 
+void ButteraugliDiffmapInBands(const Image3F& rgb0, const Image3F& rgb1,
+                               const ButteraugliParams& params,
+                               size_t band_ysize, ImageF& diffmap) {
+  PROFILER_FUNC;
+  JXL_ASSERT(SameSize(rgb0, rgb1));
+  const size_t xsize = rgb0.xsize();
+  const size_t ysize = rgb0.ysize();
+  const size_t kBorder = ButteraugliComparator::kDiffmapSupport;
+  // Smaller bands would mostly compute their borders.
+  band_ysize = std::max<size_t>(band_ysize, 64);
+  if (xsize < 8 || band_ysize + 2 * kBorder >= ysize) {
+    ButteraugliComparator butteraugli(rgb0, params);
+    butteraugli.Diffmap(rgb1, diffmap);
+    return;
+  }
+  diffmap = ImageF(xsize, ysize);
+  for (size_t y0 = 0; y0 < ysize; y0 += band_ysize) {
+    const Rect band(0, y0, xsize, band_ysize, xsize, ysize);
+    // An even offset keeps the 2x2 blocks of the subsampled comparator
+    // aligned with those of the full image.
+    const size_t padded_y0 = y0 < kBorder ? 0 : (y0 - kBorder) & ~size_t{1};
+    const Rect padded(0, padded_y0, xsize,
+                      y0 + band.ysize() + kBorder - padded_y0, xsize, ysize);
+    Image3F band0(xsize, padded.ysize());
+    CopyImageTo(padded, rgb0, &band0);
+    Image3F band1(xsize, padded.ysize());
+    CopyImageTo(padded, rgb1, &band1);
+    ImageF band_diffmap;
+    {
+      ButteraugliComparator butteraugli(band0, params);
+      butteraugli.Diffmap(band1, band_diffmap);
+    }
+    CopyImageTo(Rect(0, y0 - padded_y0, xsize, band.ysize()), band_diffmap,
+                band, &diffmap);
+  }
+}
+
 bool ButteraugliInterface(const Image3F& rgb0, const Image3F& rgb1,
                           float hf_asymmetry, float xmul, ImageF& diffmap,
                           double& diffvalue) {
@@ -16,10 +16,12 @@
 #include <atomic>
 #include <cmath>
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/common.h"
+#include "lib/jxl/gauss_blur.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_ops.h"
 
@@ -41,6 +43,19 @@ struct ButteraugliParams {
 
   // Number of nits that correspond to 1.0f input values.
   float intensity_target = 80.0f;
+
+  // If nonzero, ButteraugliDiffmap and JxlButteraugliComparator compute the
+  // diffmap in horizontal bands of this many rows to bound their memory use
+  // on large images, see ButteraugliDiffmapInBands.
+  size_t band_ysize = 0;
+
+  // Faster and less precise, for ranking changes of the same image rather
+  // than for absolute scores: the low-frequency bands are blurred at half
+  // resolution and the 2x subsampled scale is not added. Since the full
+  // metric mixes that scale into 0.85 of the full resolution diffmap, the
+  // distance is between 0.74 and 1.18 times the full metric while the
+  // subsampled diffmap is not larger than the full resolution one.
+  bool fast = false;
 };
 
 // ButteraugliInterface defines the public interface for butteraugli.
@@ -139,8 +154,9 @@ struct PsychoImage {
   Image3F lf;     // XYB
 };
 
-// Blur needs a transposed image.
-// Hold it here and only allocate on demand to reduce memory usage.
+// Blur needs a transposed image, or a temporary image of the same size for
+// the recursive Gaussian of large kernels.
+// Hold them here and only allocate on demand to reduce memory usage.
 struct BlurTemp {
   ImageF *GetTransposed(const ImageF &in) {
     if (transposed_temp.xsize() == 0) {
@@ -149,7 +165,27 @@ struct BlurTemp {
     return &transposed_temp;
   }
 
+  ImageF *Get(const ImageF &in) {
+    if (temp.xsize() == 0) {
+      temp = ImageF(in.xsize(), in.ysize());
+    }
+    return &temp;
+  }
+
+  // Returns the recursive Gaussian of `sigma`, computed on first use.
+  const hwy::AlignedUniquePtr<RecursiveGaussian> &GetRecursiveGaussian(
+      double sigma) {
+    for (const auto &rg : recursive_gaussians) {
+      if (rg.first == sigma) return rg.second;
+    }
+    recursive_gaussians.emplace_back(sigma, CreateRecursiveGaussian(sigma));
+    return recursive_gaussians.back().second;
+  }
+
   ImageF transposed_temp;
+  ImageF temp;
+  std::vector<std::pair<double, hwy::AlignedUniquePtr<RecursiveGaussian>>>
+      recursive_gaussians;
 };
 
 class ButteraugliComparator {
@@ -172,7 +208,24 @@ class ButteraugliComparator {
 
   void Mask(ImageF *BUTTERAUGLI_RESTRICT mask) const;
 
+  // Distance from a pixel of the distorted image to the furthest pixel of the
+  // diffmap it affects.
+  static constexpr size_t kDiffmapSupport = 112;
+
+  // Recomputes the butteraugli map between the original image and rgb1 only
+  // in rect, the other pixels of diffmap are not modified. rgb1 is only read
+  // in rect extended by kDiffmapSupport, and the reference side is cropped
+  // from this comparator instead of being recomputed, so this is much faster
+  // than Diffmap for small rects.
+  void DiffmapInRect(const Image3F &rgb1, const Rect &rect,
+                     ImageF *diffmap) const;
+
  private:
+  // Comparator of the rect of the reference image of parent, made from a crop
+  // of its psycho images. Has no subsampled comparator unless with_sub.
+  ButteraugliComparator(const ButteraugliComparator &parent, const Rect &rect,
+                        bool with_sub);
+
   Image3F *Temp() const;
   void ReleaseTemp() const;
 
@@ -197,6 +250,14 @@ bool ButteraugliDiffmap(const Image3F &rgb0, const Image3F &rgb1,
 bool ButteraugliDiffmap(const Image3F &rgb0, const Image3F &rgb1,
                         const ButteraugliParams &params, ImageF &diffmap);
 
+// Same result as ButteraugliComparator(rgb0, params).Diffmap(rgb1, diffmap),
+// but the image is processed in bands of band_ysize rows, each extended by
+// ButteraugliComparator::kDiffmapSupport rows above and below, so that only
+// the intermediate images of one band are held at a time.
+void ButteraugliDiffmapInBands(const Image3F &rgb0, const Image3F &rgb1,
+                               const ButteraugliParams &params,
+                               size_t band_ysize, ImageF &diffmap);
+
 double ButteraugliScoreFromDiffmap(const ImageF &diffmap,
                                    const ButteraugliParams *params = nullptr);
 
@@ -5,8 +5,15 @@
 
 #include "jxl/butteraugli.h"
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
 #include "gtest/gtest.h"
 #include "jxl/butteraugli_cxx.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/butteraugli/butteraugli.h"
+#include "lib/jxl/image.h"
 #include "lib/jxl/test_utils.h"
 
 TEST(ButteraugliTest, Lossless) {
@@ -100,3 +107,156 @@ TEST(ButteraugliTest, Api) {
 
   EXPECT_NE(distance1, distance2);
 }
+
+// Comparisons with a reference give the same results as JxlButteraugliCompute
+// with the original image, with and without alpha.
+TEST(ButteraugliTest, Reference) {
+  uint32_t xsize = 171;
+  uint32_t ysize = 219;
+  for (uint32_t num_channels : {3, 4}) {
+    std::vector<uint8_t> orig_pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, num_channels, 0);
+    JxlPixelFormat pixel_format = {num_channels, JXL_TYPE_UINT16,
+                                   JXL_BIG_ENDIAN, 0};
+
+    JxlButteraugliApiPtr api(JxlButteraugliApiCreate(nullptr));
+    JxlButteraugliReferencePtr reference(JxlButteraugliReferenceCreate(
+        api.get(), xsize, ysize, &pixel_format, orig_pixels.data(),
+        orig_pixels.size()));
+    ASSERT_NE(nullptr, reference.get());
+    for (size_t i = 0; i < 3; i++) {
+      std::vector<uint8_t> dist_pixels = orig_pixels;
+      dist_pixels[2 * i * num_channels * (xsize + 1)] += 64 * i;
+      JxlButteraugliResultPtr expected(JxlButteraugliCompute(
+          api.get(), xsize, ysize, &pixel_format, orig_pixels.data(),
+          orig_pixels.size(), &pixel_format, dist_pixels.data(),
+          dist_pixels.size()));
+      JxlButteraugliResultPtr result(JxlButteraugliReferenceCompare(
+          reference.get(), &pixel_format, dist_pixels.data(),
+          dist_pixels.size()));
+      ASSERT_NE(nullptr, result.get());
+      EXPECT_EQ(JxlButteraugliResultGetDistance(expected.get(), 8.0),
+                JxlButteraugliResultGetDistance(result.get(), 8.0));
+      EXPECT_EQ(JxlButteraugliResultGetMaxDistance(expected.get()),
+                JxlButteraugliResultGetMaxDistance(result.get()));
+      EXPECT_EQ(i == 0,
+                JxlButteraugliResultGetDistance(result.get(), 8.0) == 0.0);
+    }
+  }
+}
+
+// The fast mode stays within its documented bounds of the full metric for
+// fine distortions.
+TEST(ButteraugliTest, Fast) {
+  uint32_t xsize = 171;
+  uint32_t ysize = 219;
+  std::vector<uint8_t> orig_pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  std::vector<uint8_t> dist_pixels = orig_pixels;
+  jxl::Rng rng(0);
+  // Big endian uint16 samples: perturb the high bytes by at most 2.
+  for (size_t i = 0; i < dist_pixels.size(); i += 2) {
+    const int value = dist_pixels[i] + static_cast<int>(rng.UniformU(0, 5)) - 2;
+    dist_pixels[i] = std::min(std::max(value, 0), 255);
+  }
+
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  JxlButteraugliApiPtr api(JxlButteraugliApiCreate(nullptr));
+  JxlButteraugliResultPtr result(JxlButteraugliCompute(
+      api.get(), xsize, ysize, &pixel_format, orig_pixels.data(),
+      orig_pixels.size(), &pixel_format, dist_pixels.data(),
+      dist_pixels.size()));
+  const double distance = JxlButteraugliResultGetDistance(result.get(), 8.0);
+
+  JxlButteraugliApiSetFast(api.get(), JXL_TRUE);
+  result.reset(JxlButteraugliCompute(api.get(), xsize, ysize, &pixel_format,
+                                     orig_pixels.data(), orig_pixels.size(),
+                                     &pixel_format, dist_pixels.data(),
+                                     dist_pixels.size()));
+  const double fast_distance =
+      JxlButteraugliResultGetDistance(result.get(), 8.0);
+
+  EXPECT_NE(distance, fast_distance);
+  EXPECT_GE(fast_distance, 0.74 * distance);
+  EXPECT_LE(fast_distance, 1.18 * distance);
+}
+
+// Recomputing the diffmap only around a changed area gives the same result as
+// a full comparison.
+TEST(ButteraugliTest, DiffmapInRect) {
+  const size_t xsize = 400;
+  const size_t ysize = 300;
+  jxl::Rng rng(0);
+  jxl::Image3F orig(xsize, ysize);
+  jxl::Image3F distorted(xsize, ysize);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < ysize; y++) {
+      for (size_t x = 0; x < xsize; x++) {
+        float v = 0.5f + 0.3f * std::sin(0.05f * x + 0.03f * y + c);
+        orig.PlaneRow(c, y)[x] = v;
+        distorted.PlaneRow(c, y)[x] = v + rng.UniformF(-0.02f, 0.02f);
+      }
+    }
+  }
+  jxl::ButteraugliParams params;
+  jxl::ButteraugliComparator comparator(orig, params);
+  jxl::ImageF diffmap;
+  comparator.Diffmap(distorted, diffmap);
+
+  const jxl::Rect changed(200, 120, 16, 16);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < changed.ysize(); y++) {
+      float* row = changed.PlaneRow(&distorted, c, y);
+      for (size_t x = 0; x < changed.xsize(); x++) row[x] += 0.1f;
+    }
+  }
+  const size_t support = jxl::ButteraugliComparator::kDiffmapSupport;
+  const jxl::Rect affected(changed.x0() - support, changed.y0() - support,
+                           changed.xsize() + 2 * support,
+                           changed.ysize() + 2 * support, xsize, ysize);
+  comparator.DiffmapInRect(distorted, affected, &diffmap);
+
+  jxl::ImageF expected;
+  comparator.Diffmap(distorted, expected);
+  for (size_t y = 0; y < ysize; y++) {
+    for (size_t x = 0; x < xsize; x++) {
+      ASSERT_NEAR(expected.Row(y)[x], diffmap.Row(y)[x], 1e-3f)
+          << "x " << x << " y " << y;
+    }
+  }
+}
+
+// Computing the diffmap in bands gives the same result as a full comparison.
+TEST(ButteraugliTest, DiffmapInBands) {
+  const size_t xsize = 200;
+  const size_t ysize = 700;
+  jxl::Rng rng(0);
+  jxl::Image3F orig(xsize, ysize);
+  jxl::Image3F distorted(xsize, ysize);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < ysize; y++) {
+      for (size_t x = 0; x < xsize; x++) {
+        float v = 0.5f + 0.3f * std::sin(0.04f * x + 0.07f * y + c);
+        orig.PlaneRow(c, y)[x] = v;
+        distorted.PlaneRow(c, y)[x] = v + rng.UniformF(-0.05f, 0.05f);
+      }
+    }
+  }
+  jxl::ButteraugliParams params;
+  jxl::ImageF expected;
+  jxl::ButteraugliComparator(orig, params).Diffmap(distorted, expected);
+  for (size_t band_ysize : {64, 100}) {
+    jxl::ImageF diffmap;
+    jxl::ButteraugliDiffmapInBands(orig, distorted, params, band_ysize,
+                                   diffmap);
+    ASSERT_EQ(xsize, diffmap.xsize());
+    ASSERT_EQ(ysize, diffmap.ysize());
+    for (size_t y = 0; y < ysize; y++) {
+      for (size_t x = 0; x < xsize; x++) {
+        ASSERT_NEAR(expected.Row(y)[x], diffmap.Row(y)[x], 1e-3f)
+            << "band_ysize " << band_ysize << " x " << x << " y " << y;
+      }
+    }
+  }
+}
@@ -7,7 +7,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <atomic>
+#include <memory>
+#include <utility>
 
 #include "jxl/butteraugli.h"
 #include "jxl/parallel_runner.h"
@@ -18,7 +21,9 @@
 #include "lib/jxl/enc_butteraugli_comparator.h"
 #include "lib/jxl/enc_butteraugli_pnorm.h"
 #include "lib/jxl/enc_color_management.h"
+#include "lib/jxl/enc_comparator.h"
 #include "lib/jxl/enc_external_image.h"
+#include "lib/jxl/enc_image_bundle.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/memory_manager_internal.h"
 
@@ -72,11 +77,32 @@ struct JxlButteraugliApiStruct {
   // Number of nits that correspond to 1.0f input values.
   float intensity_target = jxl::kDefaultIntensityTarget;
 
+  // See ButteraugliParams::fast.
+  bool fast = false;
+
   JxlCmsInterface cms;
   JxlMemoryManager memory_manager;
   std::unique_ptr<jxl::ThreadPool> thread_pool{nullptr};
 };
 
+namespace {
+
+// Reads the pixels into `ib`, whose metadata must be set from pixel_format.
+bool LoadImageBundle(const JxlButteraugliApi* api, uint32_t xsize,
+                     uint32_t ysize, const JxlPixelFormat* pixel_format,
+                     const void* buffer, size_t size, jxl::ImageBundle* ib) {
+  jxl::ColorEncoding c_current;
+  if (pixel_format->data_type == JXL_TYPE_FLOAT) {
+    c_current = jxl::ColorEncoding::LinearSRGB(pixel_format->num_channels < 3);
+  } else {
+    c_current = jxl::ColorEncoding::SRGB(pixel_format->num_channels < 3);
+  }
+  return jxl::BufferToImageBundle(*pixel_format, xsize, ysize, buffer, size,
+                                  api->thread_pool.get(), c_current, ib);
+}
+
+}  // namespace
+
 JxlButteraugliApi* JxlButteraugliApiCreate(
     const JxlMemoryManager* memory_manager) {
   JxlMemoryManager local_memory_manager;
@@ -108,6 +134,10 @@ void JxlButteraugliApiSetIntensityTarget(JxlButteraugliApi* api, float v) {
   api->intensity_target = v;
 }
 
+void JxlButteraugliApiSetFast(JxlButteraugliApi* api, JXL_BOOL fast) {
+  api->fast = fast;
+}
+
 void JxlButteraugliApiDestroy(JxlButteraugliApi* api) {
   if (api) {
     JxlMemoryManager local_memory_manager = api->memory_manager;
@@ -125,31 +155,16 @@ JxlButteraugliResult* JxlButteraugliCompute(
   jxl::ImageMetadata orig_metadata;
   SetMetadataFromPixelFormat(pixel_format_orig, &orig_metadata);
   jxl::ImageBundle orig_ib(&orig_metadata);
-  jxl::ColorEncoding c_current;
-  if (pixel_format_orig->data_type == JXL_TYPE_FLOAT) {
-    c_current =
-        jxl::ColorEncoding::LinearSRGB(pixel_format_orig->num_channels < 3);
-  } else {
-    c_current = jxl::ColorEncoding::SRGB(pixel_format_orig->num_channels < 3);
-  }
-  if (!jxl::BufferToImageBundle(*pixel_format_orig, xsize, ysize, buffer_orig,
-                                size_orig, api->thread_pool.get(), c_current,
-                                &orig_ib)) {
+  if (!LoadImageBundle(api, xsize, ysize, pixel_format_orig, buffer_orig,
+                       size_orig, &orig_ib)) {
     return nullptr;
   }
 
   jxl::ImageMetadata dist_metadata;
   SetMetadataFromPixelFormat(pixel_format_dist, &dist_metadata);
   jxl::ImageBundle dist_ib(&dist_metadata);
-  if (pixel_format_dist->data_type == JXL_TYPE_FLOAT) {
-    c_current =
-        jxl::ColorEncoding::LinearSRGB(pixel_format_dist->num_channels < 3);
-  } else {
-    c_current = jxl::ColorEncoding::SRGB(pixel_format_dist->num_channels < 3);
-  }
-  if (!jxl::BufferToImageBundle(*pixel_format_dist, xsize, ysize, buffer_dist,
-                                size_dist, api->thread_pool.get(), c_current,
-                                &dist_ib)) {
+  if (!LoadImageBundle(api, xsize, ysize, pixel_format_dist, buffer_dist,
+                       size_dist, &dist_ib)) {
     return nullptr;
   }
 
@@ -162,12 +177,142 @@ JxlButteraugliResult* JxlButteraugliCompute(
   result->params.hf_asymmetry = api->hf_asymmetry;
   result->params.xmul = api->xmul;
   result->params.intensity_target = api->intensity_target;
+  result->params.fast = api->fast;
   jxl::ButteraugliDistance(orig_ib, dist_ib, result->params, api->cms,
                            &result->distmap, api->thread_pool.get());
 
   return result;
 }
 
+struct JxlButteraugliReferenceStruct {
+  JxlMemoryManager memory_manager;
+
+  const JxlButteraugliApi* api;
+  jxl::ButteraugliParams params;
+  uint32_t xsize;
+  uint32_t ysize;
+  bool has_alpha;
+  // The original image blended on black and on white backgrounds, as in
+  // jxl::ComputeScore, or only the first one if it has no alpha.
+  std::unique_ptr<jxl::JxlButteraugliComparator> comparators[2];
+};
+
+JxlButteraugliReference* JxlButteraugliReferenceCreate(
+    const JxlButteraugliApi* api, uint32_t xsize, uint32_t ysize,
+    const JxlPixelFormat* pixel_format, const void* buffer, size_t size) {
+  jxl::ImageMetadata metadata;
+  SetMetadataFromPixelFormat(pixel_format, &metadata);
+  jxl::ImageBundle ib(&metadata);
+  if (!LoadImageBundle(api, xsize, ysize, pixel_format, buffer, size, &ib)) {
+    return nullptr;
+  }
+  jxl::ImageMetadata linear_metadata = metadata;
+  jxl::ImageBundle store(&linear_metadata);
+  const jxl::ImageBundle* linear;
+  if (!jxl::TransformIfNeeded(ib, jxl::ColorEncoding::LinearSRGB(ib.IsGray()),
+                              api->cms, api->thread_pool.get(), &store,
+                              &linear)) {
+    return nullptr;
+  }
+
+  void* alloc = jxl::MemoryManagerAlloc(&api->memory_manager,
+                                        sizeof(JxlButteraugliReference));
+  if (!alloc) return nullptr;
+  // Placement new constructor on allocated memory
+  JxlButteraugliReference* reference = new (alloc) JxlButteraugliReference();
+  reference->memory_manager = api->memory_manager;
+  reference->api = api;
+  reference->params.hf_asymmetry = api->hf_asymmetry;
+  reference->params.xmul = api->xmul;
+  reference->params.intensity_target = api->intensity_target;
+  reference->params.fast = api->fast;
+  reference->xsize = xsize;
+  reference->ysize = ysize;
+  reference->has_alpha = ib.HasAlpha();
+  for (size_t i = 0; i < (reference->has_alpha ? 2 : 1); i++) {
+    jxl::ImageBundle blended = linear->Copy();
+    jxl::AlphaBlend(/*background_linear=*/i, &blended);
+    reference->comparators[i] = jxl::make_unique<jxl::JxlButteraugliComparator>(
+        reference->params, api->cms);
+    if (!reference->comparators[i]->SetReferenceImage(blended)) {
+      JxlButteraugliReferenceDestroy(reference);
+      return nullptr;
+    }
+  }
+  return reference;
+}
+
+JxlButteraugliResult* JxlButteraugliReferenceCompare(
+    const JxlButteraugliReference* reference,
+    const JxlPixelFormat* pixel_format_dist, const void* buffer_dist,
+    size_t size_dist) {
+  const JxlButteraugliApi* api = reference->api;
+  jxl::ImageMetadata metadata;
+  SetMetadataFromPixelFormat(pixel_format_dist, &metadata);
+  jxl::ImageBundle ib(&metadata);
+  if (!LoadImageBundle(api, reference->xsize, reference->ysize,
+                       pixel_format_dist, buffer_dist, size_dist, &ib)) {
+    return nullptr;
+  }
+  jxl::ImageMetadata linear_metadata = metadata;
+  jxl::ImageBundle store(&linear_metadata);
+  const jxl::ImageBundle* linear;
+  if (!jxl::TransformIfNeeded(ib, jxl::ColorEncoding::LinearSRGB(ib.IsGray()),
+                              api->cms, api->thread_pool.get(), &store,
+                              &linear)) {
+    return nullptr;
+  }
+
+  jxl::ImageF distmap;
+  if (!reference->has_alpha && !ib.HasAlpha()) {
+    if (!reference->comparators[0]->CompareWith(*linear, &distmap,
+                                                /*score=*/nullptr)) {
+      return nullptr;
+    }
+  } else {
+    // The distmap is the max of those on black and white backgrounds.
+    for (size_t i = 0; i < 2; i++) {
+      jxl::ImageBundle blended = linear->Copy();
+      jxl::AlphaBlend(/*background_linear=*/i, &blended);
+      jxl::ImageF background_distmap;
+      if (!reference->comparators[reference->has_alpha ? i : 0]->CompareWith(
+              blended, &background_distmap, /*score=*/nullptr)) {
+        return nullptr;
+      }
+      if (i == 0) {
+        distmap = std::move(background_distmap);
+        continue;
+      }
+      for (size_t y = 0; y < distmap.ysize(); ++y) {
+        const float* JXL_RESTRICT row_in = background_distmap.ConstRow(y);
+        float* JXL_RESTRICT row_out = distmap.Row(y);
+        for (size_t x = 0; x < distmap.xsize(); ++x) {
+          row_out[x] = std::max(row_out[x], row_in[x]);
+        }
+      }
+    }
+  }
+
+  void* alloc = jxl::MemoryManagerAlloc(&reference->memory_manager,
+                                        sizeof(JxlButteraugliResult));
+  if (!alloc) return nullptr;
+  // Placement new constructor on allocated memory
+  JxlButteraugliResult* result = new (alloc) JxlButteraugliResult();
+  result->memory_manager = reference->memory_manager;
+  result->params = reference->params;
+  result->distmap = std::move(distmap);
+  return result;
+}
+
+void JxlButteraugliReferenceDestroy(JxlButteraugliReference* reference) {
+  if (reference) {
+    JxlMemoryManager local_memory_manager = reference->memory_manager;
+    // Call destructor directly since custom free function is used.
+    reference->~JxlButteraugliReference();
+    jxl::MemoryManagerFree(&local_memory_manager, reference);
+  }
+}
+
 float JxlButteraugliResultGetDistance(const JxlButteraugliResult* result,
                                       float pnorm) {
   return static_cast<float>(
@@ -55,7 +55,7 @@ Status ReadPermutation(size_t skip, size_t size, coeff_order_t* order,
     }
   }
   if (order == nullptr) return true;
-  DecodeLehmerCode(lehmer.data(), temp.data(), size, order);
+  DecodeLehmerCode(lehmer.data(), temp.data(), size, skip, end, order);
   return true;
 }
 
@@ -12,6 +12,7 @@
 #include <new>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -256,6 +257,56 @@ TEST_F(ColorManagementTest, P3HlgTo2020Hlg) {
                           FloatNear(0.1183, 1e-4)));
 }
 
+TEST_F(ColorManagementTest, LinearP3ToLinearSRGB) {
+  ColorEncoding linear_p3;
+  linear_p3.SetColorSpace(ColorSpace::kRGB);
+  linear_p3.white_point = WhitePoint::kD65;
+  linear_p3.primaries = Primaries::kP3;
+  linear_p3.tf.SetTransferFunction(TransferFunction::kLinear);
+  ASSERT_TRUE(linear_p3.CreateICC());
+
+  ColorSpaceTransform transform(GetJxlCms());
+  ASSERT_TRUE(transform.Init(linear_p3, ColorEncoding::LinearSRGB(),
+                             kDefaultIntensityTarget, 1, 1));
+  const float p3_values[3] = {1., 0., 0.};
+  float srgb_values[3];
+  ASSERT_TRUE(transform.Run(0, p3_values, srgb_values));
+  EXPECT_THAT(srgb_values,
+              ElementsAre(FloatNear(1.2249, 1e-3), FloatNear(-0.0420, 1e-3),
+                          FloatNear(-0.0197, 1e-3)));
+}
+
+// Matrix-based conversions of fewer pixels than passed to Init, which are not
+// a whole number of vectors.
+TEST_F(ColorManagementTest, P3RoundTripPartialRow) {
+  ColorEncoding p3;
+  p3.SetColorSpace(ColorSpace::kRGB);
+  p3.white_point = WhitePoint::kD65;
+  p3.primaries = Primaries::kP3;
+  p3.tf.SetTransferFunction(TransferFunction::kSRGB);
+  ASSERT_TRUE(p3.CreateICC());
+
+  constexpr size_t kXsize = 64;
+  constexpr size_t kNumPixels = 37;
+  ColorSpaceTransform to_srgb(GetJxlCms());
+  ColorSpaceTransform from_srgb(GetJxlCms());
+  ASSERT_TRUE(to_srgb.Init(p3, ColorEncoding::SRGB(), kDefaultIntensityTarget,
+                           kXsize, 1));
+  ASSERT_TRUE(from_srgb.Init(ColorEncoding::SRGB(), p3,
+                             kDefaultIntensityTarget, kXsize, 1));
+  std::vector<float> in(3 * kNumPixels);
+  for (size_t i = 0; i < in.size(); i++) {
+    in[i] = 0.2f + 0.6f * i / in.size();
+  }
+  std::vector<float> srgb(3 * kNumPixels);
+  std::vector<float> out(3 * kNumPixels);
+  ASSERT_TRUE(to_srgb.Run(0, in.data(), srgb.data(), kNumPixels));
+  ASSERT_TRUE(from_srgb.Run(0, srgb.data(), out.data(), kNumPixels));
+  for (size_t i = 0; i < in.size(); i++) {
+    EXPECT_NEAR(in[i], out[i], 1e-4) << "i=" << i;
+  }
+}
+
 TEST_F(ColorManagementTest, HlgOotf) {
   ColorEncoding p3_hlg;
   p3_hlg.SetColorSpace(ColorSpace::kRGB);
@@ -317,5 +368,42 @@ TEST_F(ColorManagementTest, HlgOotf) {
   EXPECT_THAT(linear_grayscale_value, FloatNear(0.203, 1e-3));
 }
 
+// Transforms between the same profiles share their prepared color transform,
+// including when they are created concurrently, and after it was evicted by
+// transforms between many other profiles.
+TEST_F(ColorManagementTest, SharedTransforms) {
+  PaddedBytes icc = ReadTestData("jxl/color_management/sRGB-D2700.icc");
+  ColorEncoding sRGB_D2700;
+  ASSERT_TRUE(sRGB_D2700.SetICC(std::move(icc)));
+  const float sRGB_D2700_values[3] = {0.863, 0.737, 0.490};
+  const auto check_d2700_to_srgb = [&]() {
+    ColorSpaceTransform transform(GetJxlCms());
+    ASSERT_TRUE(transform.Init(sRGB_D2700, ColorEncoding::SRGB(),
+                               kDefaultIntensityTarget, 1, 1));
+    float sRGB_values[3];
+    ASSERT_TRUE(transform.Run(0, sRGB_D2700_values, sRGB_values));
+    EXPECT_THAT(sRGB_values,
+                ElementsAre(FloatNear(0.914, 1e-3), FloatNear(0.745, 1e-3),
+                            FloatNear(0.601, 1e-3)));
+  };
+
+  ThreadPoolInternal pool(4);
+  EXPECT_TRUE(RunOnPool(
+      &pool, 0, 32, ThreadPool::NoInit,
+      [&](const uint32_t /*task*/, size_t /*thread*/) {
+        check_d2700_to_srgb();
+      },
+      "SharedTransforms"));
+
+  for (const test::ColorEncodingDescriptor& desc : test::AllEncodings()) {
+    ColorEncoding c = ColorEncodingFromDescriptor(desc);
+    if (c.IsGray() || !c.CreateICC()) continue;
+    ColorSpaceTransform transform(GetJxlCms());
+    ASSERT_TRUE(transform.Init(c, ColorEncoding::SRGB(),
+                               kDefaultIntensityTarget, 1, 1));
+  }
+  check_d2700_to_srgb();
+}
+
 }  // namespace
 }  // namespace jxl
@@ -38,6 +38,7 @@
 #include "lib/jxl/dec_cache.h"
 #include "lib/jxl/entropy_coder.h"
 #include "lib/jxl/image.h"
+#include "lib/jxl/image_ops.h"
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
@@ -128,13 +129,71 @@ JXL_INLINE void ComputePixel(
   Store(out, d, out_rows[2] + x);
 }
 
+// Smooths the pixels [x0, x1) of row y of dc into smoothed. Pixels on the
+// border of the image are copied unchanged.
+void SmoothDCRow(const float* dc_factors, const Image3F& dc, size_t y,
+                 size_t x0, size_t x1, Image3F* smoothed) {
+  const size_t xsize = dc.xsize();
+  const size_t ysize = dc.ysize();
+  float* JXL_RESTRICT rows_out[3] = {
+      smoothed->PlaneRow(0, y),
+      smoothed->PlaneRow(1, y),
+      smoothed->PlaneRow(2, y),
+  };
+  if (y == 0 || y == ysize - 1) {
+    for (size_t c = 0; c < 3; c++) {
+      memcpy(rows_out[c] + x0, dc.ConstPlaneRow(c, y) + x0,
+             (x1 - x0) * sizeof(float));
+    }
+    return;
+  }
+  const float* JXL_RESTRICT rows_top[3]{
+      dc.ConstPlaneRow(0, y - 1),
+      dc.ConstPlaneRow(1, y - 1),
+      dc.ConstPlaneRow(2, y - 1),
+  };
+  const float* JXL_RESTRICT rows[3] = {
+      dc.ConstPlaneRow(0, y),
+      dc.ConstPlaneRow(1, y),
+      dc.ConstPlaneRow(2, y),
+  };
+  const float* JXL_RESTRICT rows_bottom[3] = {
+      dc.ConstPlaneRow(0, y + 1),
+      dc.ConstPlaneRow(1, y + 1),
+      dc.ConstPlaneRow(2, y + 1),
+  };
+  for (size_t x : {size_t(0), xsize - 1}) {
+    if (x < x0 || x >= x1) continue;
+    for (size_t c = 0; c < 3; c++) {
+      rows_out[c][x] = rows[c][x];
+    }
+  }
+
+  size_t x = std::max<size_t>(x0, 1);
+  const size_t end = std::min(x1, xsize - 1);
+  // First pixels, up to the first aligned vector.
+  const size_t N = Lanes(D());
+  for (; x < std::min(RoundUpTo(x, N), end); x++) {
+    ComputePixel<DScalar>(dc_factors, rows_top, rows, rows_bottom, rows_out,
+                          x);
+  }
+  // Full vectors.
+  for (; x + N <= end; x += N) {
+    ComputePixel<D>(dc_factors, rows_top, rows, rows_bottom, rows_out, x);
+  }
+  // Last pixels.
+  for (; x < end; x++) {
+    ComputePixel<DScalar>(dc_factors, rows_top, rows, rows_bottom, rows_out,
+                          x);
+  }
+}
+
 void AdaptiveDCSmoothing(const float* dc_factors, Image3F* dc,
                          ThreadPool* pool) {
   const size_t xsize = dc->xsize();
   const size_t ysize = dc->ysize();
   if (ysize <= 2 || xsize <= 2) return;
 
-  // TODO(veluca): use tile-based processing?
   // TODO(veluca): decide if changes to the y channel should be propagated to
   // the x and b channels through color correlation.
   JXL_ASSERT(w1 + w2 < 0.25f);
@@ -142,62 +201,26 @@ void AdaptiveDCSmoothing(const float* dc_factors, Image3F* dc,
   PROFILER_FUNC;
 
   Image3F smoothed(xsize, ysize);
-  // Fill in borders that the loop below will not. First and last are unused.
-  for (size_t c = 0; c < 3; c++) {
-    for (size_t y : {size_t(0), ysize - 1}) {
-      memcpy(smoothed.PlaneRow(c, y), dc->PlaneRow(c, y),
-             xsize * sizeof(float));
-    }
-  }
   auto process_row = [&](const uint32_t y, size_t /*thread*/) {
-    const float* JXL_RESTRICT rows_top[3]{
-        dc->ConstPlaneRow(0, y - 1),
-        dc->ConstPlaneRow(1, y - 1),
-        dc->ConstPlaneRow(2, y - 1),
-    };
-    const float* JXL_RESTRICT rows[3] = {
-        dc->ConstPlaneRow(0, y),
-        dc->ConstPlaneRow(1, y),
-        dc->ConstPlaneRow(2, y),
-    };
-    const float* JXL_RESTRICT rows_bottom[3] = {
-        dc->ConstPlaneRow(0, y + 1),
-        dc->ConstPlaneRow(1, y + 1),
-        dc->ConstPlaneRow(2, y + 1),
-    };
-    float* JXL_RESTRICT rows_out[3] = {
-        smoothed.PlaneRow(0, y),
-        smoothed.PlaneRow(1, y),
-        smoothed.PlaneRow(2, y),
-    };
-    for (size_t x : {size_t(0), xsize - 1}) {
-      for (size_t c = 0; c < 3; c++) {
-        rows_out[c][x] = rows[c][x];
-      }
-    }
-
-    size_t x = 1;
-    // First pixels
-    const size_t N = Lanes(D());
-    for (; x < std::min(N, xsize - 1); x++) {
-      ComputePixel<DScalar>(dc_factors, rows_top, rows, rows_bottom, rows_out,
-                            x);
-    }
-    // Full vectors.
-    for (; x + N <= xsize - 1; x += N) {
-      ComputePixel<D>(dc_factors, rows_top, rows, rows_bottom, rows_out, x);
-    }
-    // Last pixels.
-    for (; x < xsize - 1; x++) {
-      ComputePixel<DScalar>(dc_factors, rows_top, rows, rows_bottom, rows_out,
-                            x);
-    }
+    SmoothDCRow(dc_factors, *dc, y, 0, xsize, &smoothed);
   };
-  JXL_CHECK(RunOnPool(pool, 1, ysize - 1, ThreadPool::NoInit, process_row,
+  JXL_CHECK(RunOnPool(pool, 0, ysize, ThreadPool::NoInit, process_row,
                       "DCSmoothingRow"));
   dc->Swap(smoothed);
 }
 
+void AdaptiveDCSmoothingRect(const float* dc_factors, const Image3F& dc,
+                             const Rect& rect, Image3F* smoothed) {
+  if (dc.ysize() <= 2 || dc.xsize() <= 2) {
+    CopyImageTo(rect, dc, rect, smoothed);
+    return;
+  }
+  for (size_t y = rect.y0(); y < rect.y0() + rect.ysize(); y++) {
+    SmoothDCRow(dc_factors, dc, y, rect.x0(), rect.x0() + rect.xsize(),
+                smoothed);
+  }
+}
+
 // DC dequantization.
 void DequantDC(const Rect& r, Image3F* dc, ImageB* quant_dc, const Image& in,
                const float* dc_factors, float mul, const float* cfl_factors,
@@ -300,6 +323,13 @@ void AdaptiveDCSmoothing(const float* dc_factors, Image3F* dc,
   return HWY_DYNAMIC_DISPATCH(AdaptiveDCSmoothing)(dc_factors, dc, pool);
 }
 
+HWY_EXPORT(AdaptiveDCSmoothingRect);
+void AdaptiveDCSmoothingRect(const float* dc_factors, const Image3F& dc,
+                             const Rect& rect, Image3F* smoothed) {
+  return HWY_DYNAMIC_DISPATCH(AdaptiveDCSmoothingRect)(dc_factors, dc, rect,
+                                                       smoothed);
+}
+
 void DequantDC(const Rect& r, Image3F* dc, ImageB* quant_dc, const Image& in,
                const float* dc_factors, float mul, const float* cfl_factors,
                YCbCrChromaSubsampling chroma_subsampling,
@@ -24,6 +24,13 @@ namespace jxl {
 void AdaptiveDCSmoothing(const float* dc_factors, Image3F* dc,
                          ThreadPool* pool);
 
+// Same smoothing for the pixels of `rect` only, reading dc up to one pixel
+// around it and writing the result to the same rect of smoothed, which has the
+// size of dc. Smoothing all the rects of a partition of dc gives the same
+// result as AdaptiveDCSmoothing.
+void AdaptiveDCSmoothingRect(const float* dc_factors, const Image3F& dc,
+                             const Rect& rect, Image3F* smoothed);
+
 void DequantDC(const Rect& r, Image3F* dc, ImageB* quant_dc, const Image& in,
                const float* dc_factors, float mul, const float* cfl_factors,
                YCbCrChromaSubsampling chroma_subsampling,
@@ -0,0 +1,46 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/compressed_dc.h"
+
+#include <algorithm>
+
+#include "gtest/gtest.h"
+#include "lib/jxl/base/thread_pool_internal.h"
+#include "lib/jxl/image.h"
+#include "lib/jxl/image_ops.h"
+#include "lib/jxl/image_test_utils.h"
+
+namespace jxl {
+namespace {
+
+// Smoothing the tiles of a partition of the DC image one at a time gives the
+// same result as smoothing the whole image.
+TEST(CompressedDCTest, SmoothingByRectMatchesFullImage) {
+  const float dc_factors[3] = {0.01f, 0.05f, 0.02f};
+  for (size_t xsize : {2, 3, 37, 100}) {
+    for (size_t ysize : {2, 5, 70}) {
+      Image3F dc(xsize, ysize);
+      RandomFillImage(&dc, 0.0f, 0.5f);
+      Image3F expected = CopyImage(dc);
+      ThreadPoolInternal pool(4);
+      AdaptiveDCSmoothing(dc_factors, &expected, &pool);
+
+      Image3F smoothed(xsize, ysize);
+      const size_t kTileX = 13;
+      const size_t kTileY = 9;
+      for (size_t y = 0; y < ysize; y += kTileY) {
+        for (size_t x = 0; x < xsize; x += kTileX) {
+          const Rect rect(x, y, kTileX, kTileY, xsize, ysize);
+          AdaptiveDCSmoothingRect(dc_factors, dc, rect, &smoothed);
+        }
+      }
+      VerifyRelativeError(expected, smoothed, 1e-6f, 1e-6f);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace jxl
@@ -5,6 +5,9 @@
 
 #include "lib/jxl/base/data_parallel.h"
 
+#include <atomic>
+#include <vector>
+
 #include "gtest/gtest.h"
 #include "lib/jxl/base/thread_pool_internal.h"
 #include "lib/jxl/test_utils.h"
@@ -86,4 +89,79 @@ TEST_F(DataParallelTest, RunnerNotCalledOnEmptyRange) {
   EXPECT_EQ(0, runner_called_);
 }
 
+TEST_F(DataParallelTest, RunnerNotCalledOnSingleTask) {
+  runner_return_ = -1;  // FakeRunner return value.
+  size_t init_threads = 0;
+  uint32_t num_tasks = 0;
+  EXPECT_TRUE(pool_.Run(
+      42, 43,
+      [&init_threads](size_t num_threads) {
+        init_threads = num_threads;
+        return true;
+      },
+      [&num_tasks](uint32_t task, size_t thread) {
+        EXPECT_EQ(42u, task);
+        EXPECT_EQ(0u, thread);
+        num_tasks++;
+      }));
+  EXPECT_EQ(1u, init_threads);
+  EXPECT_EQ(1u, num_tasks);
+  EXPECT_FALSE(pool_.Run(
+      42, 43, [](size_t /* num_threads */) { return false; },
+      [&num_tasks](uint32_t /* task */, size_t /* thread */) { num_tasks++; }));
+  EXPECT_EQ(1u, num_tasks);
+  EXPECT_EQ(0, runner_called_);
+}
+
+// A graph like the one of the frame decoder: many independent nodes, then one
+// that needs all of them, then many that need the middle one.
+void TestGraph(ThreadPool* pool) {
+  const uint32_t kNumFirst = 20;
+  const uint32_t kMiddle = kNumFirst;
+  const uint32_t kNumNodes = 2 * kNumFirst + 1;
+  std::vector<uint32_t> num_dependencies(kNumNodes, 1);
+  std::vector<std::vector<uint32_t>> dependents(kNumNodes);
+  num_dependencies[kMiddle] = kNumFirst;
+  for (uint32_t node = 0; node < kMiddle; node++) {
+    num_dependencies[node] = 0;
+    dependents[node].push_back(kMiddle);
+  }
+  for (uint32_t node = kMiddle + 1; node < kNumNodes; node++) {
+    dependents[kMiddle].push_back(node);
+  }
+
+  std::vector<std::atomic<int>> done(kNumNodes);
+  for (auto& d : done) d.store(0);
+  std::atomic<uint32_t> num_first_done{0};
+  std::atomic<bool> order_ok{true};
+  size_t num_threads = 0;
+  ASSERT_TRUE(RunGraphOnPool(
+      pool, num_dependencies, dependents,
+      [&num_threads](size_t n) {
+        num_threads = n;
+        return true;
+      },
+      [&](uint32_t node, size_t thread) {
+        if (thread >= num_threads) order_ok = false;
+        if (node == kMiddle && num_first_done.load() != kNumFirst) {
+          order_ok = false;
+        }
+        if (node > kMiddle && done[kMiddle].load() == 0) order_ok = false;
+        if (node < kMiddle) num_first_done++;
+        done[node]++;
+      },
+      "TestGraph"));
+  EXPECT_TRUE(order_ok);
+  for (uint32_t node = 0; node < kNumNodes; node++) {
+    EXPECT_EQ(1, done[node].load()) << node;
+  }
+}
+
+TEST_F(DataParallelTest, GraphSequential) { TestGraph(nullptr); }
+
+TEST_F(DataParallelTest, GraphThreads) {
+  ThreadPoolInternal pool(4);
+  for (size_t i = 0; i < 20; i++) TestGraph(&pool);
+}
+
 }  // namespace jxl
@@ -6,7 +6,9 @@
 #include "lib/jxl/dec_ans.h"
 
 #include <stdint.h>
+#include <string.h>
 
+#include <algorithm>
 #include <vector>
 
 #include "lib/jxl/ans_common.h"
@@ -182,6 +184,46 @@ Status ReadHistogram(int precision_bits, std::vector<int>* counts,
   return true;
 }
 
+// Copies the tables of `from`, which is not copyable because of the alias
+// tables.
+void CopyANSCode(const ANSCode& from, ANSCode* to) {
+  if (from.use_prefix_code) {
+    to->alias_tables.reset();
+  } else {
+    const size_t size = from.uint_config.size() * (1 << from.log_alpha_size) *
+                        sizeof(AliasTable::Entry);
+    to->alias_tables = AllocateArray(size);
+    memcpy(to->alias_tables.get(), from.alias_tables.get(), size);
+  }
+  to->huffman_data = from.huffman_data;
+  to->uint_config = from.uint_config;
+  to->degenerate_symbols = from.degenerate_symbols;
+  to->use_prefix_code = from.use_prefix_code;
+  to->log_alpha_size = from.log_alpha_size;
+  to->lz77 = from.lz77;
+  to->max_num_bits = from.max_num_bits;
+}
+
+// Calls visit(chunk) for the num_bits bits of br starting at bit `start`, in
+// chunks of up to chunk_bits bits, until it returns false. Returns whether all
+// the chunks were visited.
+template <typename Visitor>
+bool ForEachChunk(const BitReader& br, size_t start, size_t num_bits,
+                  size_t chunk_bits, const Visitor& visit) {
+  BitReader reader(Span<const uint8_t>(br.FirstByte(), br.TotalBytes()));
+  reader.SkipBits(start);
+  bool all_visited = true;
+  for (size_t pos = 0; pos < num_bits; pos += chunk_bits) {
+    const size_t n = std::min(chunk_bits, num_bits - pos);
+    if (!visit(static_cast<uint32_t>(reader.ReadBits(n)))) {
+      all_visited = false;
+      break;
+    }
+  }
+  (void)reader.Close();
+  return all_visited;
+}
+
 }  // namespace
 
 Status DecodeANSCodes(const size_t num_histograms,
@@ -371,4 +413,51 @@ Status DecodeHistograms(BitReader* br, size_t num_contexts, ANSCode* code,
   return true;
 }
 
+Status HistogramCache::Decode(BitReader* br, size_t num_contexts,
+                              ANSCode* code, std::vector<uint8_t>* context_map,
+                              bool disallow_lz77) {
+  const size_t start = br->TotalBitsConsumed();
+  const size_t total_bits = br->TotalBytes() * kBitsPerByte;
+  for (size_t i = entries_.size(); i-- > 0;) {
+    const Entry& entry = entries_[i];
+    if (entry.num_contexts != num_contexts ||
+        entry.disallow_lz77 != disallow_lz77 ||
+        start + entry.num_bits > total_bits) {
+      continue;
+    }
+    size_t chunk_idx = 0;
+    if (!ForEachChunk(*br, start, entry.num_bits, kChunkBits,
+                      [&](uint32_t chunk) {
+                        return chunk == entry.chunks[chunk_idx++];
+                      })) {
+      continue;
+    }
+    CopyANSCode(entry.code, code);
+    *context_map = entry.context_map;
+    br->SkipBits(entry.num_bits);
+    std::rotate(entries_.begin() + i, entries_.begin() + i + 1,
+                entries_.end());
+    return true;
+  }
+
+  JXL_RETURN_IF_ERROR(
+      DecodeHistograms(br, num_contexts, code, context_map, disallow_lz77));
+  const size_t end = br->TotalBitsConsumed();
+  // Histograms that run past the end of the section are not worth keeping.
+  if (end > total_bits) return true;
+  Entry entry;
+  entry.num_contexts = num_contexts;
+  entry.disallow_lz77 = disallow_lz77;
+  entry.num_bits = end - start;
+  ForEachChunk(*br, start, entry.num_bits, kChunkBits, [&](uint32_t chunk) {
+    entry.chunks.push_back(chunk);
+    return true;
+  });
+  CopyANSCode(*code, &entry.code);
+  entry.context_map = *context_map;
+  if (entries_.size() == kMaxEntries) entries_.erase(entries_.begin());
+  entries_.push_back(std::move(entry));
+  return true;
+}
+
 }  // namespace jxl
@@ -12,6 +12,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <cstring>
 #include <vector>
 
@@ -148,6 +149,12 @@ struct ANSCode {
   void UpdateMaxNumBits(size_t ctx, size_t symbol);
 };
 
+// Reads the symbols of one entropy-coded stream. The bitstream has a single
+// ANS state (or bit position, for prefix codes) per stream, so the symbols of
+// a stream form one dependency chain. Independent streams are the sections of
+// the frame (DC, AC metadata and AC groups, one AC stream per pass), which are
+// decoded in parallel on the thread pool; the passes of an AC group share a
+// loop in GetBlockFromBitstream::LoadBlock.
 class ANSSymbolReader {
  public:
   // Invalid symbol reader, to be overwritten.
@@ -301,17 +308,56 @@ class ANSSymbolReader {
     return true;
   }
 
-  // Takes a *clustered* idx.
-  size_t ReadHybridUintClustered(size_t ctx, BitReader* JXL_RESTRICT br) {
-    if (JXL_UNLIKELY(num_to_copy_ > 0)) {
-      size_t ret = lz77_window_[(copy_pos_++) & kWindowMask];
-      num_to_copy_--;
-      lz77_window_[(num_decoded_++) & kWindowMask] = ret;
-      return ret;
+  // Prepares ReadShortHuffmanValues for the *clustered* context ctx, for
+  // sections where every symbol is read with that context. Returns false if
+  // the reader does not use prefix codes.
+  bool PrepareMultiSymbolTable(size_t ctx) {
+    if (!use_prefix_code_) return false;
+    // Tokens below split_token are their own value; LZ77 tokens are excluded.
+    uint32_t max_symbol = std::min<uint32_t>(configs[ctx].split_token,
+                                             lz77_threshold_);
+    max_symbol = std::min<uint32_t>(max_symbol, 256);
+    huffman_data_[ctx].BuildMultiSymbolTable(max_symbol, &multi_table_);
+    return true;
+  }
+
+  // Decodes up to max_values values of the context of the last successful
+  // PrepareMultiSymbolTable with a single table lookup, if the next symbols
+  // have short codes and no extra bits. Returns the number of values, 0 if
+  // the next symbol has to be read with the other functions. Bypasses the
+  // LZ77 window: only valid if !UsesLZ77() or HuffRleOnly().
+  JXL_INLINE size_t ReadShortHuffmanValues(BitReader* JXL_RESTRICT br,
+                                           size_t max_values,
+                                           uint32_t* JXL_RESTRICT values) {
+    JXL_DASSERT(multi_table_.size() == (1u << kHuffmanMultiTableBits));
+    br->Refill();
+    const HuffmanMultiCode& code =
+        multi_table_[br->PeekBits(kHuffmanMultiTableBits)];
+    const size_t n = std::min<size_t>(code.num_symbols, max_values);
+    if (n == 0) return 0;
+    br->Consume(code.bits[n - 1]);
+    for (size_t i = 0; i < n; i++) values[i] = code.symbols[i];
+    return n;
+  }
+
+  // Takes a *clustered* idx. With uses_lz77 == false the LZ77 checks are
+  // compiled out, which is only valid if !UsesLZ77(); hot loops can pick the
+  // instantiation once per section.
+  template <bool uses_lz77>
+  JXL_INLINE size_t ReadHybridUintClusteredInlined(size_t ctx,
+                                                   BitReader* JXL_RESTRICT br) {
+    JXL_DASSERT(uses_lz77 || !UsesLZ77());
+    if (uses_lz77) {
+      if (JXL_UNLIKELY(num_to_copy_ > 0)) {
+        size_t ret = lz77_window_[(copy_pos_++) & kWindowMask];
+        num_to_copy_--;
+        lz77_window_[(num_decoded_++) & kWindowMask] = ret;
+        return ret;
+      }
     }
     br->Refill();  // covers ReadSymbolWithoutRefill + PeekBits
     size_t token = ReadSymbolWithoutRefill(ctx, br);
-    if (JXL_UNLIKELY(token >= lz77_threshold_)) {
+    if (uses_lz77 && JXL_UNLIKELY(token >= lz77_threshold_)) {
       num_to_copy_ =
           ReadHybridUintConfig(lz77_length_uint_, token - lz77_threshold_, br) +
           lz77_min_length_;
@@ -342,10 +388,44 @@ class ANSSymbolReader {
       return ReadHybridUintClustered(ctx, br);  // will trigger a copy.
     }
     size_t ret = ReadHybridUintConfig(configs[ctx], token, br);
-    if (lz77_window_) lz77_window_[(num_decoded_++) & kWindowMask] = ret;
+    if (uses_lz77 && lz77_window_) {
+      lz77_window_[(num_decoded_++) & kWindowMask] = ret;
+    }
     return ret;
   }
 
+  // If an LZ77 copy is in progress, writes up to max_values of its remaining
+  // values (what the next ReadHybridUintClustered calls would return) to
+  // values and returns their number; returns 0 otherwise. Copies are done a
+  // block at a time, bounded by the distance and the end of the window.
+  size_t ReadCopiedValues(size_t max_values, uint32_t* JXL_RESTRICT values) {
+    const size_t n = std::min<size_t>(num_to_copy_, max_values);
+    // With distance 0, the source is the destination: the window was zeroed.
+    const size_t distance = num_decoded_ - copy_pos_;
+    const size_t max_chunk = distance == 0 ? kWindowSize : distance;
+    for (size_t done = 0; done < n;) {
+      const size_t src = copy_pos_ & kWindowMask;
+      const size_t dst = num_decoded_ & kWindowMask;
+      const size_t chunk =
+          std::min(std::min(n - done, max_chunk),
+                   std::min(kWindowSize - src, kWindowSize - dst));
+      memcpy(values + done, lz77_window_ + src, chunk * sizeof(*values));
+      memcpy(lz77_window_ + dst, values + done, chunk * sizeof(*values));
+      copy_pos_ += chunk;
+      num_decoded_ += chunk;
+      done += chunk;
+    }
+    num_to_copy_ -= n;
+    return n;
+  }
+
+  // Takes a *clustered* idx.
+  size_t ReadHybridUintClustered(size_t ctx, BitReader* JXL_RESTRICT br) {
+    return ReadHybridUintClusteredInlined</*uses_lz77=*/true>(ctx, br);
+  }
+
+  bool UsesLZ77() const { return lz77_window_ != nullptr; }
+
   JXL_INLINE size_t ReadHybridUint(size_t ctx, BitReader* JXL_RESTRICT br,
                                    const std::vector<uint8_t>& context_map) {
     return ReadHybridUintClustered(context_map[ctx], br);
@@ -446,12 +526,43 @@ class ANSSymbolReader {
   HybridUintConfig lz77_length_uint_;
   uint32_t special_distances_[kNumSpecialDistances]{};
   uint32_t num_special_distances_{};
+
+  // See PrepareMultiSymbolTable.
+  std::vector<HuffmanMultiCode> multi_table_;
 };
 
 Status DecodeHistograms(BitReader* br, size_t num_contexts, ANSCode* code,
                         std::vector<uint8_t>* context_map,
                         bool disallow_lz77 = false);
 
+// Keeps the results of DecodeHistograms for the last few histogram bitstreams,
+// so that frames of an animation that repeat the histograms of a previous
+// frame copy the decoded tables instead of building them again.
+class HistogramCache {
+ public:
+  // Same as DecodeHistograms. Entries are keyed by the arguments and the
+  // first bits of the histograms, and reused only if all their bits match.
+  Status Decode(BitReader* br, size_t num_contexts, ANSCode* code,
+                std::vector<uint8_t>* context_map, bool disallow_lz77 = false);
+
+ private:
+  static constexpr size_t kMaxEntries = 4;
+  // Bits are stored in chunks of up to kChunkBits.
+  static constexpr size_t kChunkBits = 32;
+
+  struct Entry {
+    size_t num_contexts;
+    bool disallow_lz77;
+    size_t num_bits;
+    std::vector<uint32_t> chunks;
+    ANSCode code;
+    std::vector<uint8_t> context_map;
+  };
+
+  // The most recently used entry is the last one.
+  std::vector<Entry> entries_;
+};
+
 // Exposed for tests.
 Status DecodeUintConfigs(size_t log_alpha_size,
                          std::vector<HybridUintConfig>* uint_config,
@@ -0,0 +1,243 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/extras/codec.h"
+#include "lib/jxl/base/padded_bytes.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/codec_in_out.h"
+#include "lib/jxl/common.h"
+#include "lib/jxl/dec_ans.h"
+#include "lib/jxl/dec_bit_reader.h"
+#include "lib/jxl/enc_ans.h"
+#include "lib/jxl/enc_bit_writer.h"
+#include "lib/jxl/modular/encoding/enc_encoding.h"
+#include "lib/jxl/modular/encoding/encoding.h"
+#include "lib/jxl/modular/modular_image.h"
+#include "lib/jxl/modular/options.h"
+#include "lib/jxl/testdata.h"
+
+namespace jxl {
+namespace {
+
+// Benchmarks of the entropy decoder alone: ANSSymbolReader with ANS or prefix
+// codes, with and without LZ77, and the modular channel decoder with trees of
+// different shapes. The items per second are decoded symbols per second, i.e.
+// tokens before LZ77 for the token streams and samples for modular.
+
+// A crop of flower.png with 8-bit integer channels, the typical input of the
+// modular decoder.
+std::vector<ImageI> FlowerChannels(size_t size) {
+  static const CodecInOut* flower = [] {
+    CodecInOut* io = new CodecInOut;
+    const PaddedBytes bytes = ReadTestData("jxl/flower/flower.png");
+    JXL_CHECK(SetFromBytes(Span<const uint8_t>(bytes), io));
+    return io;
+  }();
+  const Image3F& color = flower->Main().color();
+  JXL_CHECK(size <= color.xsize() && size <= color.ysize());
+  std::vector<ImageI> channels;
+  for (size_t c = 0; c < 3; c++) {
+    ImageI channel(size, size);
+    for (size_t y = 0; y < size; y++) {
+      const float* JXL_RESTRICT row_in = color.ConstPlaneRow(c, y);
+      int32_t* JXL_RESTRICT row_out = channel.Row(y);
+      for (size_t x = 0; x < size; x++) {
+        row_out[x] = static_cast<int32_t>(
+            std::round(Clamp1(row_in[x], 0.0f, 1.0f) * 255.0f));
+      }
+    }
+    channels.push_back(std::move(channel));
+  }
+  return channels;
+}
+
+constexpr size_t kNumContexts = 12;
+
+// Unpredictable tokens from a geometric-like distribution per context, so that
+// most are coded by the token alone and a few have raw bits.
+std::vector<Token> RandomTokens(size_t num) {
+  Rng rng(0);
+  std::vector<Token> tokens;
+  tokens.reserve(num);
+  for (size_t i = 0; i < num; i++) {
+    const uint32_t context = rng.UniformU(0, kNumContexts);
+    const float scale = 1.0f + context;
+    const float u = rng.UniformF(1e-6f, 1.0f);
+    tokens.emplace_back(context,
+                        static_cast<uint32_t>(-std::log(u) * scale * scale));
+  }
+  return tokens;
+}
+
+// Gradient-predicted residuals of flower.png, with the channel and a bucket of
+// the local activity as context, like a simple modular tree would produce.
+std::vector<Token> ImageTokens() {
+  const std::vector<ImageI> channels = FlowerChannels(1024);
+  std::vector<Token> tokens;
+  for (size_t c = 0; c < channels.size(); c++) {
+    const ImageI& channel = channels[c];
+    for (size_t y = 1; y < channel.ysize(); y++) {
+      const int32_t* JXL_RESTRICT row = channel.ConstRow(y);
+      const int32_t* JXL_RESTRICT row_top = channel.ConstRow(y - 1);
+      for (size_t x = 1; x < channel.xsize(); x++) {
+        const int32_t left = row[x - 1];
+        const int32_t top = row_top[x];
+        const int32_t topleft = row_top[x - 1];
+        const int32_t gradient = std::min(
+            std::max(left, top), std::max(std::min(left, top),
+                                          left + top - topleft));
+        const uint32_t activity = CeilLog2Nonzero(
+            static_cast<uint32_t>(std::abs(left - topleft) +
+                                  std::abs(top - topleft) + 1));
+        const uint32_t context = c * 4 + std::min<uint32_t>(activity / 2, 3);
+        tokens.emplace_back(context, PackSigned(row[x] - gradient));
+      }
+    }
+  }
+  return tokens;
+}
+
+enum class TokenStream { kRandom, kImage };
+enum class EntropyCoder { kANS, kHuffman };
+
+void BM_DecodeTokens(benchmark::State& state, TokenStream stream,
+                     EntropyCoder coder,
+                     HistogramParams::LZ77Method lz77_method) {
+  std::vector<std::vector<Token>> tokens(1);
+  tokens[0] =
+      stream == TokenStream::kRandom ? RandomTokens(1 << 20) : ImageTokens();
+  const size_t num_tokens = tokens[0].size();
+  // The decoder gets the context of each symbol from elsewhere, e.g. the tree.
+  std::vector<uint8_t> contexts(num_tokens);
+  for (size_t i = 0; i < num_tokens; i++) {
+    contexts[i] = tokens[0][i].context;
+  }
+
+  HistogramParams params;
+  params.force_huffman = coder == EntropyCoder::kHuffman;
+  params.lz77_method = lz77_method;
+  BitWriter writer;
+  EntropyEncodingData codes;
+  std::vector<uint8_t> context_map;
+  // Replaces the tokens with LZ77 ones if LZ77 is used.
+  BuildAndEncodeHistograms(params, kNumContexts, tokens, &codes, &context_map,
+                           &writer, 0, nullptr);
+  const size_t histograms_bits = writer.BitsWritten();
+  WriteTokens(tokens[0], codes, context_map, &writer, 0, nullptr);
+  writer.ZeroPadToByte();
+  const Span<const uint8_t> encoded = writer.GetSpan();
+
+  ANSCode code;
+  std::vector<uint8_t> dec_context_map;
+  {
+    BitReader br(encoded);
+    JXL_CHECK(DecodeHistograms(&br, kNumContexts, &code, &dec_context_map));
+    JXL_CHECK(br.TotalBitsConsumed() == histograms_bits);
+    JXL_CHECK(br.Close());
+  }
+
+  uint32_t checksum = 0;
+  for (auto _ : state) {
+    BitReader br(encoded);
+    br.SkipBits(histograms_bits);
+    ANSSymbolReader reader(&code, &br);
+    for (size_t i = 0; i < num_tokens; i++) {
+      checksum += reader.ReadHybridUint(contexts[i], &br, dec_context_map);
+    }
+    JXL_CHECK(reader.CheckANSFinalState());
+    JXL_CHECK(br.Close());
+  }
+  benchmark::DoNotOptimize(checksum);
+  state.SetItemsProcessed(state.iterations() * num_tokens);
+  state.counters["bits_per_symbol"] =
+      8.0 * encoded.size() / static_cast<double>(num_tokens);
+}
+
+// Decodes a crop of flower.png, without transforms, coded with a tree learned
+// for the given predictor. `splitting_threshold` is the minimum gain of a
+// split; higher values give smaller trees.
+void BM_DecodeModular(benchmark::State& state, Predictor predictor,
+                      float splitting_threshold) {
+  const size_t size = state.range(0);
+  std::vector<ImageI> channels = FlowerChannels(size);
+  Image image(size, size, /*bitdepth=*/8, channels.size());
+  for (size_t c = 0; c < channels.size(); c++) {
+    image.channel[c].plane = std::move(channels[c]);
+  }
+  ModularOptions options;
+  options.predictor = predictor;
+  options.splitting_heuristics_node_threshold = splitting_threshold;
+  BitWriter writer;
+  JXL_CHECK(ModularGenericCompress(image, options, &writer));
+  writer.ZeroPadToByte();
+  const Span<const uint8_t> encoded = writer.GetSpan();
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    Image decoded(size, size, /*bitdepth=*/8, image.channel.size());
+    ModularOptions dec_options = options;
+    state.ResumeTiming();
+    BitReader br(encoded);
+    JXL_CHECK(ModularGenericDecompress(&br, decoded, /*header=*/nullptr,
+                                       /*group_id=*/0, &dec_options));
+    JXL_CHECK(br.Close());
+    benchmark::DoNotOptimize(decoded.channel[0].plane.Row(0));
+  }
+  state.SetItemsProcessed(state.iterations() * size * size *
+                          image.channel.size());
+  state.counters["bits_per_symbol"] =
+      8.0 * encoded.size() / (size * size * image.channel.size());
+}
+
+using LZ77Method = HistogramParams::LZ77Method;
+
+BENCHMARK_CAPTURE(BM_DecodeTokens, RandomANS, TokenStream::kRandom,
+                  EntropyCoder::kANS, LZ77Method::kNone);
+BENCHMARK_CAPTURE(BM_DecodeTokens, RandomHuffman, TokenStream::kRandom,
+                  EntropyCoder::kHuffman, LZ77Method::kNone);
+BENCHMARK_CAPTURE(BM_DecodeTokens, ImageANS, TokenStream::kImage,
+                  EntropyCoder::kANS, LZ77Method::kNone);
+BENCHMARK_CAPTURE(BM_DecodeTokens, ImageHuffman, TokenStream::kImage,
+                  EntropyCoder::kHuffman, LZ77Method::kNone);
+BENCHMARK_CAPTURE(BM_DecodeTokens, ImageANSRLE, TokenStream::kImage,
+                  EntropyCoder::kANS, LZ77Method::kRLE);
+BENCHMARK_CAPTURE(BM_DecodeTokens, ImageANSLZ77, TokenStream::kImage,
+                  EntropyCoder::kANS, LZ77Method::kLZ77);
+BENCHMARK_CAPTURE(BM_DecodeTokens, ImageHuffmanLZ77, TokenStream::kImage,
+                  EntropyCoder::kHuffman, LZ77Method::kLZ77);
+
+// A single leaf, a small tree and a default-sized one, with the predictors
+// that have specialized decoding paths.
+BENCHMARK_CAPTURE(BM_DecodeModular, ZeroSingleLeaf, Predictor::Zero, 1e30f)
+    ->Arg(256)
+    ->Arg(1024);
+BENCHMARK_CAPTURE(BM_DecodeModular, GradientSmallTree, Predictor::Gradient,
+                  10000.0f)
+    ->Arg(256)
+    ->Arg(1024);
+BENCHMARK_CAPTURE(BM_DecodeModular, GradientTree, Predictor::Gradient, 96.0f)
+    ->Arg(256)
+    ->Arg(1024);
+BENCHMARK_CAPTURE(BM_DecodeModular, WeightedTree, Predictor::Weighted, 96.0f)
+    ->Arg(256)
+    ->Arg(1024);
+// Trees with a predictor per leaf, which take the generic path.
+BENCHMARK_CAPTURE(BM_DecodeModular, VariableTree, Predictor::Variable, 96.0f)
+    ->Arg(256)
+    ->Arg(1024);
+
+}  // namespace
+}  // namespace jxl
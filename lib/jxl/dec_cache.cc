@@ -21,6 +21,19 @@
 
 namespace jxl {
 
+std::unique_ptr<ACImage> PassesDecoderState::NewGroupCoefficients() const {
+  CacheAligned::ScopedCategory scoped_category(
+      CacheAligned::Category::kCoefficients);
+  std::unique_ptr<ACImage> coefficients;
+  if (coefficients_type == ACType::k16) {
+    coefficients = make_unique<ACImageT<int16_t>>(kGroupDim * kGroupDim, 1);
+  } else {
+    coefficients = make_unique<ACImageT<int32_t>>(kGroupDim * kGroupDim, 1);
+  }
+  coefficients->ZeroFill();
+  return coefficients;
+}
+
 Status PassesDecoderState::PreparePipeline(ImageBundle* decoded,
                                            PipelineOptions options) {
   const FrameHeader& frame_header = shared->frame_header;
@@ -39,14 +52,43 @@ Status PassesDecoderState::PreparePipeline(ImageBundle* decoded,
   if (options.use_slow_render_pipeline) {
     builder.UseSimpleImplementation();
   }
+  if (options.render_stats != nullptr) {
+    builder.SetStats(options.render_stats);
+  }
 
-  if (!frame_header.chroma_subsampling.Is444()) {
+  // The uint8 buffer and the pixel callback only receive the first alpha
+  // channel, and the planar callback none; the ImageBundle keeps them all.
+  const std::vector<ExtraChannelInfo>& extra_channel_info =
+      frame_header.nonserialized_metadata->m.extra_channel_info;
+  const bool keeps_extra_channels =
+      (rgb_output == nullptr && !pixel_callback.IsPresent() &&
+       !ycbcr_planar_callback.IsPresent()) ||
+      frame_header.CanBeReferenced() ||
+      (options.coalescing && NeedsBlending(this)) ||
+      (frame_header.flags & FrameHeader::kPatches) != 0;
+  extra_channel_needed.assign(extra_channel_info.size(), true);
+  if (!keeps_extra_channels) {
+    bool seen_alpha = false;
+    for (size_t ec = 0; ec < extra_channel_info.size(); ec++) {
+      const ExtraChannelInfo& eci = extra_channel_info[ec];
+      const bool output_alpha = eci.type == ExtraChannel::kAlpha &&
+                                !seen_alpha &&
+                                !ycbcr_planar_callback.IsPresent();
+      seen_alpha |= eci.type == ExtraChannel::kAlpha;
+      extra_channel_needed[ec] =
+          output_alpha ||
+          (options.render_spotcolors && eci.type == ExtraChannel::kSpotColor);
+    }
+  }
+
+  // Planar output keeps the chroma channels at their native resolution.
+  if (!frame_header.chroma_subsampling.Is444() &&
+      !ycbcr_planar_callback.IsPresent()) {
     for (size_t c = 0; c < 3; c++) {
-      if (frame_header.chroma_subsampling.HShift(c) != 0) {
-        builder.AddStage(GetChromaUpsamplingStage(c, /*horizontal=*/true));
-      }
-      if (frame_header.chroma_subsampling.VShift(c) != 0) {
-        builder.AddStage(GetChromaUpsamplingStage(c, /*horizontal=*/false));
+      const bool horizontal = frame_header.chroma_subsampling.HShift(c) != 0;
+      const bool vertical = frame_header.chroma_subsampling.VShift(c) != 0;
+      if (horizontal || vertical) {
+        builder.AddStage(GetChromaUpsamplingStage(c, horizontal, vertical));
       }
     }
   }
@@ -68,6 +110,28 @@ Status PassesDecoderState::PreparePipeline(ImageBundle* decoded,
     }
   }
 
+  if (ycbcr_planar_callback.IsPresent()) {
+    // FrameDecoder::CanOutputYCbCrPlanes ensures that no other stage is needed
+    // and that the loop filters only run on 4:4:4 frames. The chroma planes
+    // are written by kInOut stages, so that each of them is processed at its
+    // own resolution; the luma plane, which is never subsampled, comes last.
+    const YCbCrChromaSubsampling& cs = frame_header.chroma_subsampling;
+    JXL_ASSERT(cs.HShift(1) == 0 && cs.VShift(1) == 0);
+    // Channels are stored as Cb, Y, Cr; planes are numbered Y, Cb, Cr.
+    static constexpr size_t kPlaneChannel[3] = {1, 0, 2};
+    for (uint32_t plane : {1u, 2u, 0u}) {
+      const size_t c = kPlaneChannel[plane];
+      builder.AddStage(GetWriteToPlanarCallbackStage(
+          ycbcr_planar_callback, c, plane,
+          DivCeil(shared->frame_dim.xsize_upsampled, 1 << cs.HShift(c)),
+          DivCeil(shared->frame_dim.ysize_upsampled, 1 << cs.VShift(c)),
+          /*in_out=*/plane != 0));
+    }
+    render_pipeline = std::move(builder).Finalize(shared->frame_dim,
+                                                  std::move(render_pipeline));
+    return render_pipeline->IsInitialized();
+  }
+
   bool late_ec_upsample = frame_header.upsampling != 1;
   for (auto ecups : frame_header.extra_channel_upsampling) {
     if (ecups != frame_header.upsampling) {
@@ -80,7 +144,8 @@ Status PassesDecoderState::PreparePipeline(ImageBundle* decoded,
   if (!late_ec_upsample) {
     for (size_t ec = 0; ec < frame_header.extra_channel_upsampling.size();
          ec++) {
-      if (frame_header.extra_channel_upsampling[ec] != 1) {
+      if (frame_header.extra_channel_upsampling[ec] != 1 &&
+          extra_channel_needed[ec]) {
         builder.AddStage(GetUpsamplingStage(
             frame_header.nonserialized_metadata->transform_data, 3 + ec,
             CeilLog2Nonzero(frame_header.extra_channel_upsampling[ec])));
@@ -100,6 +165,7 @@ Status PassesDecoderState::PreparePipeline(ImageBundle* decoded,
         3 +
         (late_ec_upsample ? frame_header.extra_channel_upsampling.size() : 0);
     for (size_t c = 0; c < nb_channels; c++) {
+      if (c >= 3 && !extra_channel_needed[c - 3]) continue;
       builder.AddStage(GetUpsamplingStage(
           frame_header.nonserialized_metadata->transform_data, c,
           CeilLog2Nonzero(frame_header.upsampling)));
@@ -142,6 +208,7 @@ Status PassesDecoderState::PreparePipeline(ImageBundle* decoded,
 
   if (fast_xyb_srgb8_conversion) {
     JXL_ASSERT(!NeedsBlending(this));
+    JXL_ASSERT(!options.premultiply_alpha);
     JXL_ASSERT(!frame_header.CanBeReferenced() ||
                frame_header.save_before_color_transform);
     JXL_ASSERT(!options.render_spotcolors ||
@@ -150,25 +217,51 @@ Status PassesDecoderState::PreparePipeline(ImageBundle* decoded,
                                             height, rgb_output_is_rgba,
                                             has_alpha, alpha_c));
   } else {
-    if (frame_header.color_transform == ColorTransform::kYCbCr) {
+    const bool blending = options.coalescing && NeedsBlending(this);
+    const bool save_after_color_transform =
+        options.coalescing && frame_header.CanBeReferenced() &&
+        !frame_header.save_before_color_transform;
+    const bool render_spotcolors =
+        options.render_spotcolors &&
+        frame_header.nonserialized_metadata->m.Find(ExtraChannel::kSpotColor);
+    // If no stage needs the float output of the color transform, the
+    // conversion from XYB or YCbCr is done by the stage writing to the uint8
+    // buffer.
+    const bool premultiply =
+        options.premultiply_alpha && has_alpha && rgb_output_is_rgba;
+    const bool fuse_color_transform_with_output =
+        !pixel_callback.IsPresent() && rgb_output && !blending &&
+        !save_after_color_transform && !render_spotcolors && !premultiply;
+    const bool fuse_xyb_with_output =
+        frame_header.color_transform == ColorTransform::kXYB &&
+        fuse_color_transform_with_output;
+    const bool fuse_ycbcr_with_output =
+        frame_header.color_transform == ColorTransform::kYCbCr &&
+        fuse_color_transform_with_output;
+
+    if (frame_header.color_transform == ColorTransform::kYCbCr &&
+        !fuse_ycbcr_with_output) {
       builder.AddStage(GetYCbCrStage());
-    } else if (frame_header.color_transform == ColorTransform::kXYB) {
-      builder.AddStage(GetXYBStage(output_encoding_info));
+    } else if (frame_header.color_transform == ColorTransform::kXYB &&
+               !fuse_xyb_with_output) {
+      // The spot colors and premultiplication are also computed from the
+      // encoded values, in which the uint8 rounding hides any approximation.
+      const bool integer_output = !pixel_callback.IsPresent() && rgb_output &&
+                                  !blending && !save_after_color_transform;
+      builder.AddStage(GetXYBStage(output_encoding_info, integer_output));
     }  // Nothing to do for kNone.
 
-    if (options.coalescing && NeedsBlending(this)) {
+    if (blending) {
       builder.AddStage(
           GetBlendingStage(this, output_encoding_info.color_encoding));
     }
 
-    if (options.coalescing && frame_header.CanBeReferenced() &&
-        !frame_header.save_before_color_transform) {
+    if (save_after_color_transform) {
       builder.AddStage(GetWriteToImageBundleStage(
           &frame_storage_for_referencing, output_encoding_info.color_encoding));
     }
 
-    if (options.render_spotcolors &&
-        frame_header.nonserialized_metadata->m.Find(ExtraChannel::kSpotColor)) {
+    if (render_spotcolors) {
       for (size_t i = 0; i < decoded->metadata()->extra_channel_info.size();
            i++) {
         // Don't use Find() because there may be multiple spot color channels.
@@ -181,19 +274,31 @@ Status PassesDecoderState::PreparePipeline(ImageBundle* decoded,
     }
 
     if (pixel_callback.IsPresent()) {
-      builder.AddStage(GetWriteToPixelCallbackStage(pixel_callback, width,
-                                                    height, rgb_output_is_rgba,
-                                                    has_alpha, alpha_c));
+      builder.AddStage(GetWriteToPixelCallbackStage(
+          pixel_callback, width, height, rgb_output_is_rgba, has_alpha, alpha_c,
+          premultiply));
+    } else if (fuse_xyb_with_output) {
+      builder.AddStage(GetXYBWriteToU8Stage(output_encoding_info, rgb_output,
+                                            rgb_stride, height,
+                                            rgb_output_is_rgba, has_alpha,
+                                            alpha_c));
+    } else if (fuse_ycbcr_with_output) {
+      builder.AddStage(GetYCbCrWriteToU8Stage(rgb_output, rgb_stride, height,
+                                              rgb_output_is_rgba, has_alpha,
+                                              alpha_c));
     } else if (rgb_output) {
       builder.AddStage(GetWriteToU8Stage(rgb_output, rgb_stride, height,
                                          rgb_output_is_rgba, has_alpha,
-                                         alpha_c));
+                                         alpha_c, premultiply));
     } else {
       builder.AddStage(GetWriteToImageBundleStage(
           decoded, output_encoding_info.color_encoding));
     }
   }
-  render_pipeline = std::move(builder).Finalize(shared->frame_dim);
+  // Frames of animations usually have the same dimensions and stages, so the
+  // buffers of the pipeline of the previous frame can be reused.
+  render_pipeline = std::move(builder).Finalize(shared->frame_dim,
+                                                std::move(render_pipeline));
   return render_pipeline->IsInitialized();
 }
 
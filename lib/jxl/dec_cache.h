@@ -16,6 +16,7 @@
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/convolve.h"
+#include "lib/jxl/dec_ans.h"
 #include "lib/jxl/dec_group_border.h"
 #include "lib/jxl/dec_noise.h"
 #include "lib/jxl/image.h"
@@ -43,18 +44,133 @@ struct PixelCallback {
 #endif
   }
 
-  bool IsPresent() const { return run != nullptr; }
+  // Same, but with a callback receiving rectangles of pixels.
+  static PixelCallback Tiles(JxlImageOutInitCallback init,
+                             JxlImageOutTileCallback run_tile,
+                             JxlImageOutDestroyCallback destroy,
+                             void* init_opaque) {
+    PixelCallback callback;
+    callback.init = init;
+    callback.run_tile = run_tile;
+    callback.destroy = destroy;
+    callback.init_opaque = init_opaque;
+    return callback;
+  }
+
+  bool IsPresent() const { return run != nullptr || run_tile != nullptr; }
+  bool HasTiles() const { return run_tile != nullptr; }
 
   void* Init(size_t num_threads, size_t num_pixels) const {
     return init(init_opaque, num_threads, num_pixels);
   }
 
+  // Gives a row of `num_pixels` pixels to either callback, as a tile of one
+  // row of `row_bytes` bytes for the tile callback.
+  void RunRow(void* run_opaque, size_t thread, size_t x, size_t y,
+              size_t num_pixels, const void* pixels, size_t row_bytes) const {
+    if (run != nullptr) {
+      run(run_opaque, thread, x, y, num_pixels, pixels);
+    } else {
+      run_tile(run_opaque, thread, x, y, num_pixels, 1, pixels, row_bytes);
+    }
+  }
+
   JxlImageOutInitCallback init = nullptr;
   JxlImageOutRunCallback run = nullptr;
+  JxlImageOutTileCallback run_tile = nullptr;
   JxlImageOutDestroyCallback destroy = nullptr;
   void* init_opaque = nullptr;
 };
 
+// Receives the Y, Cb and Cr planes of a YCbCr frame at their native
+// subsampling, see JxlDecoderSetYCbCrPlanarOutCallback.
+struct PlanarCallback {
+  PlanarCallback() = default;
+  PlanarCallback(JxlImageOutPlaneCallback callback, void* opaque,
+                 JxlDataType data_type)
+      : callback(callback), opaque(opaque), data_type(data_type) {}
+
+  bool IsPresent() const { return callback != nullptr; }
+
+  JxlImageOutPlaneCallback callback = nullptr;
+  void* opaque = nullptr;
+  // Either JXL_TYPE_UINT8 or JXL_TYPE_FLOAT.
+  JxlDataType data_type = JXL_TYPE_FLOAT;
+};
+
+// Temp images required for decoding a single group. Reduces memory allocations
+// for large images because we only initialize min(#threads, #groups) instances.
+struct GroupDecCache {
+  void InitOnce(size_t num_passes, size_t used_acs) {
+    PROFILER_FUNC;
+
+    for (size_t i = 0; i < num_passes; i++) {
+      if (num_nzeroes[i].xsize() == 0) {
+        // Allocate enough for a whole group - partial groups on the
+        // right/bottom border just use a subset. The valid size is passed via
+        // Rect.
+
+        num_nzeroes[i] = Image3I(kGroupDimInBlocks, kGroupDimInBlocks);
+      }
+    }
+    size_t max_block_area = 0;
+
+    for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
+      AcStrategy acs = AcStrategy::FromRawStrategy(o);
+      if ((used_acs & (1 << o)) == 0) continue;
+      size_t area =
+          acs.covered_blocks_x() * acs.covered_blocks_y() * kDCTBlockSize;
+      max_block_area = std::max(area, max_block_area);
+    }
+
+    if (max_block_area > max_block_area_) {
+      max_block_area_ = max_block_area;
+      // We need 3x float blocks for dequantized coefficients and 1x for scratch
+      // space for transforms.
+      float_memory_ = hwy::AllocateAligned<float>(max_block_area_ * 4);
+      // We need 3x int32 or int16 blocks for quantized coefficients.
+      int32_memory_ = hwy::AllocateAligned<int32_t>(max_block_area_ * 3);
+      int16_memory_ = hwy::AllocateAligned<int16_t>(max_block_area_ * 3);
+    }
+
+    dec_group_block = float_memory_.get();
+    scratch_space = dec_group_block + max_block_area_ * 3;
+    dec_group_qblock = int32_memory_.get();
+    dec_group_qblock16 = int16_memory_.get();
+  }
+
+  void InitDCBufferOnce() {
+    if (dc_buffer.xsize() == 0) {
+      dc_buffer = ImageF(kGroupDimInBlocks + kRenderPipelineXOffset * 2,
+                         kGroupDimInBlocks + 4);
+    }
+  }
+
+  // Scratch space used by DecGroupImpl().
+  float* dec_group_block;
+  int32_t* dec_group_qblock;
+  int16_t* dec_group_qblock16;
+
+  // For TransformToPixels.
+  float* scratch_space;
+  // Note that scratch_space is never used at the same time as dec_group_qblock.
+  // Moreover, only one of dec_group_qblock16 is ever used. The integer inverse
+  // DCTs use dec_group_qblock16 as scratch space.
+  // TODO(veluca): figure out if we can save allocations.
+
+  // AC decoding
+  Image3I num_nzeroes[kMaxNumPasses];
+
+  // Buffer for DC upsampling.
+  ImageF dc_buffer;
+
+ private:
+  hwy::AlignedFreeUniquePtr<float[]> float_memory_;
+  hwy::AlignedFreeUniquePtr<int32_t[]> int32_memory_;
+  hwy::AlignedFreeUniquePtr<int16_t[]> int16_memory_;
+  size_t max_block_area_ = 0;
+};
+
 // Per-frame decoder state. All the images here should be accessed through a
 // group rect (either with block units or pixel units).
 struct PassesDecoderState {
@@ -68,6 +184,8 @@ struct PassesDecoderState {
   // For ANS decoding.
   std::vector<ANSCode> code;
   std::vector<std::vector<uint8_t>> context_map;
+  // Kept across frames, see HistogramCache.
+  HistogramCache histogram_cache;
 
   // Multiplier to be applied to the quant matrices of the x channel.
   float x_dm_multiplier;
@@ -86,6 +204,14 @@ struct PassesDecoderState {
   // Whether to use int16 float-XYB-to-uint8-srgb conversion.
   bool fast_xyb_srgb8_conversion;
 
+  // Whether to use the int16 inverse DCTs, on targets that have them.
+  bool use_integer_idct;
+
+  // Whether the integer modular image is written directly to rgb_output,
+  // bypassing the render pipeline, since none of its stages would change the
+  // pixels (see FrameDecoder::CanWriteModularToRGB8).
+  bool lossless_modular_rgb8_output;
+
   // If true, rgb_output or callback output is RGBA using 4 instead of 3 bytes
   // per pixel.
   bool rgb_output_is_rgba;
@@ -93,6 +219,16 @@ struct PassesDecoderState {
   // Callback for line-by-line output.
   PixelCallback pixel_callback;
 
+  // If present, the YCbCr planes are written to this callback instead, without
+  // chroma upsampling nor conversion to RGB.
+  PlanarCallback ycbcr_planar_callback;
+
+  // For each extra channel, whether the output, the blending, the spot color
+  // rendering or the storage of the frame for referencing uses it. The other
+  // ones are not rendered, and their pipeline input is zero-filled instead of
+  // converted from the modular image. Set by PreparePipeline.
+  std::vector<bool> extra_channel_needed;
+
   // Buffer of upsampling * kApplyImageFeaturesTileDim ones.
   std::vector<float> opaque_alpha;
   // One row per thread
@@ -105,8 +241,16 @@ struct PassesDecoderState {
   // Keep track of the transform types used.
   std::atomic<uint32_t> used_acs{0};
 
-  // Storage for coefficients if in "accumulate" mode.
-  std::unique_ptr<ACImage> coefficients = make_unique<ACImageT<int32_t>>(0, 0);
+  // Type of the quantized AC coefficients of the current frame.
+  ACType coefficients_type = ACType::k32;
+  // Storage for the coefficients of each group if in "accumulate" mode, i.e.
+  // for frames with more than one pass, and empty otherwise. The storage of a
+  // group is allocated when its first pass is decoded and released once the
+  // group is drawn with all passes, so only the groups in flight use memory.
+  std::vector<std::unique_ptr<ACImage>> group_coefficients;
+
+  // Returns zero-filled storage for the coefficients of one group.
+  std::unique_ptr<ACImage> NewGroupCoefficients() const;
 
   // Rendering pipeline.
   std::unique_ptr<RenderPipeline> render_pipeline;
@@ -114,10 +258,19 @@ struct PassesDecoderState {
   // Storage for the current frame if it can be referenced by future frames.
   ImageBundle frame_storage_for_referencing;
 
+  // Temp images for decoding groups, one per thread (or task, see
+  // FrameDecoder::PrepareStorage). Kept across frames, as they only depend on
+  // the group size.
+  std::vector<GroupDecCache> group_dec_caches;
+
   struct PipelineOptions {
     bool use_slow_render_pipeline;
     bool coalescing;
     bool render_spotcolors;
+    // Whether the color channels of the RGBA output are multiplied by a
+    // non-premultiplied alpha channel.
+    bool premultiply_alpha = false;
+    RenderPipelineStats* render_stats = nullptr;
   };
 
   Status PreparePipeline(ImageBundle* decoded, PipelineOptions options);
@@ -135,6 +288,9 @@ struct PassesDecoderState {
     rgb_output = nullptr;
     rgb_output_is_rgba = false;
     fast_xyb_srgb8_conversion = false;
+    use_integer_idct = false;
+    lossless_modular_rgb8_output = false;
+    ycbcr_planar_callback = PlanarCallback();
     used_acs = 0;
 
     upsampler8x = GetUpsamplingStage(shared->metadata->transform_data, 0, 3);
@@ -169,78 +325,6 @@ struct PassesDecoderState {
   void ComputeSigma(const Rect& block_rect, PassesDecoderState* state);
 };
 
-// Temp images required for decoding a single group. Reduces memory allocations
-// for large images because we only initialize min(#threads, #groups) instances.
-struct GroupDecCache {
-  void InitOnce(size_t num_passes, size_t used_acs) {
-    PROFILER_FUNC;
-
-    for (size_t i = 0; i < num_passes; i++) {
-      if (num_nzeroes[i].xsize() == 0) {
-        // Allocate enough for a whole group - partial groups on the
-        // right/bottom border just use a subset. The valid size is passed via
-        // Rect.
-
-        num_nzeroes[i] = Image3I(kGroupDimInBlocks, kGroupDimInBlocks);
-      }
-    }
-    size_t max_block_area = 0;
-
-    for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
-      AcStrategy acs = AcStrategy::FromRawStrategy(o);
-      if ((used_acs & (1 << o)) == 0) continue;
-      size_t area =
-          acs.covered_blocks_x() * acs.covered_blocks_y() * kDCTBlockSize;
-      max_block_area = std::max(area, max_block_area);
-    }
-
-    if (max_block_area > max_block_area_) {
-      max_block_area_ = max_block_area;
-      // We need 3x float blocks for dequantized coefficients and 1x for scratch
-      // space for transforms.
-      float_memory_ = hwy::AllocateAligned<float>(max_block_area_ * 4);
-      // We need 3x int32 or int16 blocks for quantized coefficients.
-      int32_memory_ = hwy::AllocateAligned<int32_t>(max_block_area_ * 3);
-      int16_memory_ = hwy::AllocateAligned<int16_t>(max_block_area_ * 3);
-    }
-
-    dec_group_block = float_memory_.get();
-    scratch_space = dec_group_block + max_block_area_ * 3;
-    dec_group_qblock = int32_memory_.get();
-    dec_group_qblock16 = int16_memory_.get();
-  }
-
-  void InitDCBufferOnce() {
-    if (dc_buffer.xsize() == 0) {
-      dc_buffer = ImageF(kGroupDimInBlocks + kRenderPipelineXOffset * 2,
-                         kGroupDimInBlocks + 4);
-    }
-  }
-
-  // Scratch space used by DecGroupImpl().
-  float* dec_group_block;
-  int32_t* dec_group_qblock;
-  int16_t* dec_group_qblock16;
-
-  // For TransformToPixels.
-  float* scratch_space;
-  // Note that scratch_space is never used at the same time as dec_group_qblock.
-  // Moreover, only one of dec_group_qblock16 is ever used.
-  // TODO(veluca): figure out if we can save allocations.
-
-  // AC decoding
-  Image3I num_nzeroes[kMaxNumPasses];
-
-  // Buffer for DC upsampling.
-  ImageF dc_buffer;
-
- private:
-  hwy::AlignedFreeUniquePtr<float[]> float_memory_;
-  hwy::AlignedFreeUniquePtr<int32_t[]> int32_memory_;
-  hwy::AlignedFreeUniquePtr<int16_t[]> int16_memory_;
-  size_t max_block_area_ = 0;
-};
-
 }  // namespace jxl
 
 #endif  // LIB_JXL_DEC_CACHE_H_
@@ -5,6 +5,8 @@
 
 #include "lib/jxl/dec_context_map.h"
 
+#include <string.h>
+
 #include <algorithm>
 #include <vector>
 
@@ -19,8 +21,7 @@ namespace {
 
 void MoveToFront(uint8_t* v, uint8_t index) {
   uint8_t value = v[index];
-  uint8_t i = index;
-  for (; i; --i) v[i] = v[i - 1];
+  memmove(v + 1, v, index);
   v[0] = value;
 }
 
@@ -25,56 +25,117 @@
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/color_management.h"
 #include "lib/jxl/common.h"
-#include "lib/jxl/sanitizers.h"
 #include "lib/jxl/transfer_functions-inl.h"
 
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
 
-// TODO(jon): check if this can be replaced by a FloatToU16 function
-void FloatToU32(const float* in, uint32_t* out, size_t num, float mul,
-                size_t bits_per_sample) {
-  const HWY_FULL(float) d;
-  const hwy::HWY_NAMESPACE::Rebind<uint32_t, decltype(d)> du;
-
-  // Unpoison accessing partially-uninitialized vectors with memory sanitizer.
-  // This is because we run NearestInt() on the vector, which triggers msan even
-  // it it safe to do so since the values are not mixed between lanes.
-  const size_t num_round_up = RoundUpTo(num, Lanes(d));
-  msan::UnpoisonMemory(in + num, sizeof(in[0]) * (num_round_up - num));
-
-  const auto one = Set(d, 1.0f);
-  const auto scale = Set(d, mul);
-  for (size_t x = 0; x < num; x += Lanes(d)) {
-    auto v = Load(d, in + x);
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+
+// Each storer converts the Lanes(d) floats of v to samples and stores them
+// from out on, byte swapped if swap.
+
+struct StoreU8 {
+  template <class DF, class V>
+  void operator()(DF df, V v, float mul, bool /*swap*/, uint8_t* out) const {
+    const Rebind<uint8_t, DF> du8;
     // Clamp turns NaN to 'min'.
-    v = Clamp(v, Zero(d), one);
-    auto i = NearestInt(v * scale);
-    Store(BitCast(du, i), du, out + x);
+    v = Clamp(v, Zero(df), Set(df, 1.0f));
+    StoreU(DemoteTo(du8, NearestInt(v * Set(df, mul))), du8, out);
+  }
+};
+
+struct StoreU16 {
+  template <class DF, class V>
+  void operator()(DF df, V v, float mul, bool swap, uint8_t* out) const {
+    const Rebind<uint16_t, DF> du16;
+    v = Clamp(v, Zero(df), Set(df, 1.0f));
+    auto u = DemoteTo(du16, NearestInt(v * Set(df, mul)));
+    if (swap) u = ShiftLeft<8>(u) | ShiftRight<8>(u);
+    StoreU(u, du16, reinterpret_cast<uint16_t*>(out));
+  }
+};
+
+struct StoreF16 {
+  template <class DF, class V>
+  void operator()(DF df, V v, float /*mul*/, bool swap, uint8_t* out) const {
+    const Rebind<hwy::float16_t, DF> df16;
+    StoreU(DemoteTo(df16, v), df16, reinterpret_cast<hwy::float16_t*>(out));
+    if (swap) {
+      for (size_t i = 0; i < Lanes(df) * 2; i += 2) {
+        std::swap(out[i], out[i + 1]);
+      }
+    }
+  }
+};
+
+struct StoreF32 {
+  template <class DF, class V>
+  void operator()(DF df, V v, float /*mul*/, bool swap, uint8_t* out) const {
+    const Rebind<uint32_t, DF> du;
+    auto u = BitCast(du, v);
+    if (swap) {
+      const auto mask = Set(du, 0xFF00FF00u);
+      u = (ShiftLeft<8>(u) & mask) | (ShiftRight<8>(u) & ShiftRight<8>(mask));
+      u = ShiftLeft<16>(u) | ShiftRight<16>(u);
+    }
+    StoreU(u, du, reinterpret_cast<uint32_t*>(out));
+  }
+};
+
+template <class Storer>
+void StoreSamples(const Storer& store, const float* in, size_t num,
+                  size_t bytes_per_sample, float mul, bool swap,
+                  uint8_t* out) {
+  const HWY_FULL(float) df;
+  const HWY_CAPPED(float, 1) d1;
+  size_t x = 0;
+  for (; x + Lanes(df) <= num; x += Lanes(df)) {
+    store(df, LoadU(df, in + x), mul, swap, out + x * bytes_per_sample);
+  }
+  for (; x < num; ++x) {
+    store(d1, LoadU(d1, in + x), mul, swap, out + x * bytes_per_sample);
   }
-
-  // Poison back the output.
-  msan::PoisonMemory(out + num, sizeof(out[0]) * (num_round_up - num));
 }
 
-void FloatToF16(const float* in, hwy::float16_t* out, size_t num) {
-  const HWY_FULL(float) d;
-  const hwy::HWY_NAMESPACE::Rebind<hwy::float16_t, decltype(d)> du;
-
-  // Unpoison accessing partially-uninitialized vectors with memory sanitizer.
-  // This is because we run DemoteTo() on the vector which triggers msan.
-  const size_t num_round_up = RoundUpTo(num, Lanes(d));
-  msan::UnpoisonMemory(in + num, sizeof(in[0]) * (num_round_up - num));
-
-  for (size_t x = 0; x < num; x += Lanes(d)) {
-    auto v = Load(d, in + x);
-    auto v16 = DemoteTo(du, v);
-    Store(v16, du, out + x);
+// Converts num floats to consecutive samples of the output type. Integer
+// samples are scaled from the [0, 1] range and clamped.
+void FloatToSamples(const float* in, size_t num, size_t bits_per_sample,
+                    bool float_out, bool little_endian, uint8_t* out) {
+  const bool swap = little_endian != IsLittleEndian();
+  if (float_out) {
+    if (bits_per_sample == 16) {
+      StoreSamples(StoreF16(), in, num, 2, 1.0f, swap, out);
+    } else {
+      StoreSamples(StoreF32(), in, num, 4, 1.0f, swap, out);
+    }
+    return;
+  }
+  const float mul = (1ull << bits_per_sample) - 1;
+  if (bits_per_sample <= 8) {
+    StoreSamples(StoreU8(), in, num, 1, mul, swap, out);
+  } else {
+    StoreSamples(StoreU16(), in, num, 2, mul, swap, out);
   }
+}
 
-  // Poison back the output.
-  msan::PoisonMemory(out + num, sizeof(out[0]) * (num_round_up - num));
+// Writes the num products of in and alpha to out.
+void PremultiplyRow(const float* JXL_RESTRICT in,
+                    const float* JXL_RESTRICT alpha, size_t num,
+                    float* JXL_RESTRICT out) {
+  const HWY_FULL(float) df;
+  const HWY_CAPPED(float, 1) d1;
+  size_t x = 0;
+  for (; x + Lanes(df) <= num; x += Lanes(df)) {
+    StoreU(LoadU(df, in + x) * LoadU(df, alpha + x), df, out + x);
+  }
+  for (; x < num; ++x) {
+    StoreU(LoadU(d1, in + x) * LoadU(d1, alpha + x), d1, out + x);
+  }
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -85,160 +146,41 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 
 namespace jxl {
-namespace {
 
-// Stores a float in big endian
-void StoreBEFloat(float value, uint8_t* p) {
-  uint32_t u;
-  memcpy(&u, &value, 4);
-  StoreBE32(u, p);
-}
-
-// Stores a float in little endian
-void StoreLEFloat(float value, uint8_t* p) {
-  uint32_t u;
-  memcpy(&u, &value, 4);
-  StoreLE32(u, p);
-}
-
-// The orientation may not be identity.
-// TODO(lode): SIMDify where possible
-template <typename T>
-Status UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
-                       Plane<T>& out, jxl::ThreadPool* pool) {
-  const size_t xsize = image.xsize();
-  const size_t ysize = image.ysize();
-
-  if (undo_orientation == Orientation::kFlipHorizontal) {
-    out = Plane<T>(xsize, ysize);
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-        [&](const uint32_t task, size_t /*thread*/) {
-          const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
-          T* JXL_RESTRICT row_out = out.Row(y);
-          for (size_t x = 0; x < xsize; ++x) {
-            row_out[xsize - x - 1] = row_in[x];
-          }
-        },
-        "UndoOrientation"));
-  } else if (undo_orientation == Orientation::kRotate180) {
-    out = Plane<T>(xsize, ysize);
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-        [&](const uint32_t task, size_t /*thread*/) {
-          const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
-          T* JXL_RESTRICT row_out = out.Row(ysize - y - 1);
-          for (size_t x = 0; x < xsize; ++x) {
-            row_out[xsize - x - 1] = row_in[x];
-          }
-        },
-        "UndoOrientation"));
-  } else if (undo_orientation == Orientation::kFlipVertical) {
-    out = Plane<T>(xsize, ysize);
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-        [&](const uint32_t task, size_t /*thread*/) {
-          const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
-          T* JXL_RESTRICT row_out = out.Row(ysize - y - 1);
-          for (size_t x = 0; x < xsize; ++x) {
-            row_out[x] = row_in[x];
-          }
-        },
-        "UndoOrientation"));
-  } else if (undo_orientation == Orientation::kTranspose) {
-    out = Plane<T>(ysize, xsize);
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-        [&](const uint32_t task, size_t /*thread*/) {
-          const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
-          for (size_t x = 0; x < xsize; ++x) {
-            out.Row(x)[y] = row_in[x];
-          }
-        },
-        "UndoOrientation"));
-  } else if (undo_orientation == Orientation::kRotate90) {
-    out = Plane<T>(ysize, xsize);
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-        [&](const uint32_t task, size_t /*thread*/) {
-          const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
-          for (size_t x = 0; x < xsize; ++x) {
-            out.Row(x)[ysize - y - 1] = row_in[x];
-          }
-        },
-        "UndoOrientation"));
-  } else if (undo_orientation == Orientation::kAntiTranspose) {
-    out = Plane<T>(ysize, xsize);
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-        [&](const uint32_t task, size_t /*thread*/) {
-          const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
-          for (size_t x = 0; x < xsize; ++x) {
-            out.Row(xsize - x - 1)[ysize - y - 1] = row_in[x];
-          }
-        },
-        "UndoOrientation"));
-  } else if (undo_orientation == Orientation::kRotate270) {
-    out = Plane<T>(ysize, xsize);
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-        [&](const uint32_t task, size_t /*thread*/) {
-          const int64_t y = task;
-          const T* JXL_RESTRICT row_in = image.Row(y);
-          for (size_t x = 0; x < xsize; ++x) {
-            out.Row(xsize - x - 1)[y] = row_in[x];
-          }
-        },
-        "UndoOrientation"));
-  }
-  return true;
-}
-}  // namespace
-
-HWY_EXPORT(FloatToU32);
-HWY_EXPORT(FloatToF16);
+HWY_EXPORT(FloatToSamples);
+HWY_EXPORT(PremultiplyRow);
 
 namespace {
 
-using StoreFuncType = void(uint32_t value, uint8_t* dest);
-template <StoreFuncType StoreFunc>
-void StoreUintRow(uint32_t* JXL_RESTRICT* rows_u32, size_t num_channels,
-                  size_t xsize, size_t bytes_per_sample,
-                  uint8_t* JXL_RESTRICT out) {
+template <size_t kBytes>
+void InterleaveSamples(const uint8_t* const* rows, size_t num_channels,
+                       size_t xsize, uint8_t* JXL_RESTRICT out) {
   for (size_t x = 0; x < xsize; ++x) {
     for (size_t c = 0; c < num_channels; c++) {
-      StoreFunc(rows_u32[c][x],
-                out + (num_channels * x + c) * bytes_per_sample);
+      memcpy(out + (num_channels * x + c) * kBytes, rows[c] + x * kBytes,
+             kBytes);
     }
   }
 }
 
-template <void(StoreFunc)(float, uint8_t*)>
-void StoreFloatRow(const float* JXL_RESTRICT* rows_in, size_t num_channels,
-                   size_t xsize, uint8_t* JXL_RESTRICT out) {
-  for (size_t x = 0; x < xsize; ++x) {
-    for (size_t c = 0; c < num_channels; c++) {
-      StoreFunc(rows_in[c][x], out + (num_channels * x + c) * sizeof(float));
-    }
-  }
-}
-
-void JXL_INLINE Store8(uint32_t value, uint8_t* dest) { *dest = value & 0xff; }
-
 // Maximum number of channels for the ConvertChannelsToExternal function.
 const size_t kConvertMaxChannels = 4;
 
+// Number of output rows per task when the orientation transposes the image,
+// so that each task reads neighboring input columns together.
+const size_t kTransposedRowsPerTask = 8;
+
 // Converts a list of channels to an interleaved image, applying transformations
 // when needed.
 // The input channels are given as a (non-const!) array of channel pointers and
 // interleaved in that order.
 //
+// undo_orientation is applied while reading the channels, without an extra
+// pass over the image.
+//
+// If premultiply_alpha, the last channel is alpha and the other channels are
+// multiplied by it before being converted.
+//
 // Note: if a pointer in channels[] is nullptr, a 1.0 value will be used
 // instead. This is useful for handling when a user requests an alpha channel
 // from an image that doesn't have one. The first channel in the list may not
@@ -249,9 +191,12 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
                                  jxl::ThreadPool* pool, void* out_image,
                                  size_t out_size,
                                  const PixelCallback& out_callback,
-                                 jxl::Orientation undo_orientation) {
+                                 jxl::Orientation undo_orientation,
+                                 bool premultiply_alpha) {
   JXL_DASSERT(num_channels != 0 && num_channels <= kConvertMaxChannels);
   JXL_DASSERT(channels[0] != nullptr);
+  JXL_DASSERT(!premultiply_alpha ||
+              (num_channels > 1 && channels[num_channels - 1] != nullptr));
   JXL_CHECK(float_out ? bits_per_sample == 16 || bits_per_sample == 32
                       : bits_per_sample > 0 && bits_per_sample <= 16);
   if (!!out_image == out_callback.IsPresent()) {
@@ -262,39 +207,19 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
   const size_t bytes_per_channel = DivCeil(bits_per_sample, jxl::kBitsPerByte);
   const size_t bytes_per_pixel = num_channels * bytes_per_channel;
 
-  std::vector<std::vector<uint8_t>> row_out_callback;
-  const auto FreeCallbackOpaque = [&out_callback](void* p) {
-    out_callback.destroy(p);
-  };
-  std::unique_ptr<void, decltype(FreeCallbackOpaque)> out_run_opaque(
-      nullptr, FreeCallbackOpaque);
-  auto InitOutCallback = [&](size_t num_threads) -> Status {
-    if (out_callback.IsPresent()) {
-      out_run_opaque.reset(out_callback.Init(num_threads, stride));
-      JXL_RETURN_IF_ERROR(out_run_opaque != nullptr);
-      row_out_callback.resize(num_threads);
-      for (size_t i = 0; i < num_threads; ++i) {
-        row_out_callback[i].resize(stride);
-      }
-    }
-    return true;
-  };
-
-  // Channels used to store the transformed original channels if needed.
-  ImageF temp_channels[kConvertMaxChannels];
-  if (undo_orientation != Orientation::kIdentity) {
-    for (size_t c = 0; c < num_channels; ++c) {
-      if (channels[c]) {
-        JXL_RETURN_IF_ERROR(UndoOrientation(undo_orientation, *channels[c],
-                                            temp_channels[c], pool));
-        channels[c] = &(temp_channels[c]);
-      }
-    }
-  }
-
-  // First channel may not be nullptr.
-  size_t xsize = channels[0]->xsize();
-  size_t ysize = channels[0]->ysize();
+  // Output pixel (x, y) is input pixel (x, y) for orientations up to 4, and
+  // input pixel (y, x) for the others, after mirroring the input columns if
+  // flip_x and its rows if flip_y. First channel may not be nullptr.
+  const uint32_t orientation = static_cast<uint32_t>(undo_orientation);
+  const bool transposed = orientation > 4;
+  const bool flip_x = orientation == 2 || orientation == 3 ||
+                      orientation == 7 || orientation == 8;
+  const bool flip_y = orientation == 3 || orientation == 4 ||
+                      orientation == 6 || orientation == 7;
+  const size_t in_xsize = channels[0]->xsize();
+  const size_t in_ysize = channels[0]->ysize();
+  const size_t xsize = transposed ? in_ysize : in_xsize;
+  const size_t ysize = transposed ? in_xsize : in_ysize;
   if (stride < bytes_per_pixel * xsize) {
     return JXL_FAILURE("stride is smaller than scanline width in bytes: %" PRIuS
                        " vs %" PRIuS,
@@ -320,128 +245,127 @@ Status ConvertChannelsToExternal(const ImageF* channels[], size_t num_channels,
     }
   }
 
-  if (float_out) {
-    if (bits_per_sample == 16) {
-      bool swap_endianness = little_endian != IsLittleEndian();
-      Plane<hwy::float16_t> f16_cache;
-      JXL_RETURN_IF_ERROR(RunOnPool(
-          pool, 0, static_cast<uint32_t>(ysize),
-          [&](size_t num_threads) {
-            f16_cache =
-                Plane<hwy::float16_t>(xsize, num_channels * num_threads);
-            return InitOutCallback(num_threads);
-          },
-          [&](const uint32_t task, const size_t thread) {
-            const int64_t y = task;
-            const float* JXL_RESTRICT row_in[kConvertMaxChannels];
-            for (size_t c = 0; c < num_channels; c++) {
-              row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
-            }
-            hwy::float16_t* JXL_RESTRICT row_f16[kConvertMaxChannels];
-            for (size_t c = 0; c < num_channels; c++) {
-              row_f16[c] = f16_cache.Row(c + thread * num_channels);
-              HWY_DYNAMIC_DISPATCH(FloatToF16)
-              (row_in[c], row_f16[c], xsize);
-            }
-            uint8_t* row_out =
-                out_callback.IsPresent()
-                    ? row_out_callback[thread].data()
-                    : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
-            // interleave the one scanline
-            hwy::float16_t* row_f16_out =
-                reinterpret_cast<hwy::float16_t*>(row_out);
-            for (size_t x = 0; x < xsize; x++) {
-              for (size_t c = 0; c < num_channels; c++) {
-                row_f16_out[x * num_channels + c] = row_f16[c][x];
-              }
-            }
-            if (swap_endianness) {
-              size_t size = xsize * num_channels * 2;
-              for (size_t i = 0; i < size; i += 2) {
-                std::swap(row_out[i + 0], row_out[i + 1]);
+  const size_t rows_per_task = transposed ? kTransposedRowsPerTask : 1;
+  const size_t num_tasks = DivCeil(ysize, rows_per_task);
+  const bool reorder = transposed || flip_x;
+
+  std::vector<std::vector<uint8_t>> row_out_callback;
+  const auto FreeCallbackOpaque = [&out_callback](void* p) {
+    out_callback.destroy(p);
+  };
+  std::unique_ptr<void, decltype(FreeCallbackOpaque)> out_run_opaque(
+      nullptr, FreeCallbackOpaque);
+  // Per-thread rows: the reordered input rows of each channel, if needed, the
+  // premultiplied color rows, if needed, and the converted samples of each
+  // channel before interleaving.
+  ImageF float_cache;
+  ImageF premul_cache;
+  ImageB sample_cache;
+  auto init = [&](size_t num_threads) -> Status {
+    if (out_callback.IsPresent()) {
+      out_run_opaque.reset(out_callback.Init(num_threads, stride));
+      JXL_RETURN_IF_ERROR(out_run_opaque != nullptr);
+      row_out_callback.resize(num_threads);
+      for (size_t i = 0; i < num_threads; ++i) {
+        row_out_callback[i].resize(stride);
+      }
+    }
+    if (reorder) {
+      float_cache = ImageF(xsize, num_channels * rows_per_task * num_threads);
+    }
+    if (premultiply_alpha) {
+      premul_cache = ImageF(xsize, (num_channels - 1) * num_threads);
+    }
+    if (num_channels > 1) {
+      sample_cache =
+          ImageB(xsize * bytes_per_channel, num_channels * num_threads);
+    }
+    return true;
+  };
+
+  return RunOnPool(
+      pool, 0, static_cast<uint32_t>(num_tasks), init,
+      [&](const uint32_t task, const size_t thread) {
+        const size_t y0 = task * rows_per_task;
+        const size_t num_rows = std::min(rows_per_task, ysize - y0);
+        const auto cache_row = [&](size_t c, size_t i) {
+          return float_cache.Row((thread * num_channels + c) * rows_per_task +
+                                 i);
+        };
+        if (transposed) {
+          // Gather the input columns of all rows of this task at once.
+          for (size_t c = 0; c < num_channels; c++) {
+            if (!channels[c]) continue;
+            for (size_t x = 0; x < xsize; ++x) {
+              const float* JXL_RESTRICT row_in =
+                  channels[c]->Row(flip_y ? in_ysize - 1 - x : x);
+              for (size_t i = 0; i < num_rows; ++i) {
+                const size_t in_x = flip_x ? in_xsize - 1 - (y0 + i) : y0 + i;
+                cache_row(c, i)[x] = row_in[in_x];
               }
             }
-            if (out_callback.IsPresent()) {
-              out_callback.run(out_run_opaque.get(), thread, 0, y, xsize,
-                               row_out);
-            }
-          },
-          "ConvertF16"));
-    } else if (bits_per_sample == 32) {
-      JXL_RETURN_IF_ERROR(RunOnPool(
-          pool, 0, static_cast<uint32_t>(ysize),
-          [&](size_t num_threads) { return InitOutCallback(num_threads); },
-          [&](const uint32_t task, const size_t thread) {
-            const int64_t y = task;
-            uint8_t* row_out =
-                out_callback.IsPresent()
-                    ? row_out_callback[thread].data()
-                    : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
-            const float* JXL_RESTRICT row_in[kConvertMaxChannels];
-            for (size_t c = 0; c < num_channels; c++) {
-              row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
-            }
-            if (little_endian) {
-              StoreFloatRow<StoreLEFloat>(row_in, num_channels, xsize, row_out);
+          }
+        }
+        for (size_t i = 0; i < num_rows; ++i) {
+          const size_t y = y0 + i;
+          const float* JXL_RESTRICT row_in[kConvertMaxChannels];
+          for (size_t c = 0; c < num_channels; c++) {
+            if (!channels[c]) {
+              row_in[c] = ones.Row(0);
+            } else if (transposed) {
+              row_in[c] = cache_row(c, i);
             } else {
-              StoreFloatRow<StoreBEFloat>(row_in, num_channels, xsize, row_out);
+              row_in[c] = channels[c]->Row(flip_y ? ysize - 1 - y : y);
+              if (flip_x) {
+                float* JXL_RESTRICT row_flipped = cache_row(c, i);
+                for (size_t x = 0; x < xsize; ++x) {
+                  row_flipped[x] = row_in[c][xsize - 1 - x];
+                }
+                row_in[c] = row_flipped;
+              }
             }
-            if (out_callback.IsPresent()) {
-              out_callback.run(out_run_opaque.get(), thread, 0, y, xsize,
-                               row_out);
+          }
+          if (premultiply_alpha) {
+            const float* row_alpha = row_in[num_channels - 1];
+            for (size_t c = 0; c + 1 < num_channels; c++) {
+              float* row = premul_cache.Row(thread * (num_channels - 1) + c);
+              HWY_DYNAMIC_DISPATCH(PremultiplyRow)
+              (row_in[c], row_alpha, xsize, row);
+              row_in[c] = row;
             }
-          },
-          "ConvertFloat"));
-    } else {
-      return JXL_FAILURE("float other than 16-bit and 32-bit not supported");
-    }
-  } else {
-    // Multiplier to convert from floating point 0-1 range to the integer
-    // range.
-    float mul = (1ull << bits_per_sample) - 1;
-    Plane<uint32_t> u32_cache;
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize),
-        [&](size_t num_threads) {
-          u32_cache = Plane<uint32_t>(xsize, num_channels * num_threads);
-          return InitOutCallback(num_threads);
-        },
-        [&](const uint32_t task, const size_t thread) {
-          const int64_t y = task;
+          }
           uint8_t* row_out =
               out_callback.IsPresent()
                   ? row_out_callback[thread].data()
                   : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
-          const float* JXL_RESTRICT row_in[kConvertMaxChannels];
-          for (size_t c = 0; c < num_channels; c++) {
-            row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
-          }
-          uint32_t* JXL_RESTRICT row_u32[kConvertMaxChannels];
-          for (size_t c = 0; c < num_channels; c++) {
-            row_u32[c] = u32_cache.Row(c + thread * num_channels);
-            // row_u32[] is a per-thread temporary row storage, this isn't
-            // intended to be initialized on a previous run.
-            msan::PoisonMemory(row_u32[c], xsize * sizeof(row_u32[c][0]));
-            HWY_DYNAMIC_DISPATCH(FloatToU32)
-            (row_in[c], row_u32[c], xsize, mul, bits_per_sample);
-          }
-          if (bits_per_sample <= 8) {
-            StoreUintRow<Store8>(row_u32, num_channels, xsize, 1, row_out);
+          if (num_channels == 1) {
+            HWY_DYNAMIC_DISPATCH(FloatToSamples)
+            (row_in[0], xsize, bits_per_sample, float_out, little_endian,
+             row_out);
           } else {
-            if (little_endian) {
-              StoreUintRow<StoreLE16>(row_u32, num_channels, xsize, 2, row_out);
+            const uint8_t* row_samples[kConvertMaxChannels];
+            for (size_t c = 0; c < num_channels; c++) {
+              uint8_t* row = sample_cache.Row(thread * num_channels + c);
+              HWY_DYNAMIC_DISPATCH(FloatToSamples)
+              (row_in[c], xsize, bits_per_sample, float_out, little_endian,
+               row);
+              row_samples[c] = row;
+            }
+            if (bytes_per_channel == 1) {
+              InterleaveSamples<1>(row_samples, num_channels, xsize, row_out);
+            } else if (bytes_per_channel == 2) {
+              InterleaveSamples<2>(row_samples, num_channels, xsize, row_out);
             } else {
-              StoreUintRow<StoreBE16>(row_u32, num_channels, xsize, 2, row_out);
+              InterleaveSamples<4>(row_samples, num_channels, xsize, row_out);
             }
           }
           if (out_callback.IsPresent()) {
-            out_callback.run(out_run_opaque.get(), thread, 0, y, xsize,
-                             row_out);
+            out_callback.RunRow(out_run_opaque.get(), thread, 0, y, xsize,
+                                row_out, stride);
           }
-        },
-        "ConvertUint"));
-  }
-  return true;
+        }
+      },
+      "ConvertToExternal");
 }
 
 }  // namespace
@@ -451,14 +375,20 @@ Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
                          JxlEndianness endianness, size_t stride,
                          jxl::ThreadPool* pool, void* out_image,
                          size_t out_size, const PixelCallback& out_callback,
-                         jxl::Orientation undo_orientation) {
+                         jxl::Orientation undo_orientation,
+                         bool premultiply_alpha) {
   bool want_alpha = num_channels == 2 || num_channels == 4;
   size_t color_channels = num_channels <= 2 ? 1 : 3;
+  const bool alpha_is_premultiplied =
+      ib.HasAlpha() && ib.AlphaIsPremultiplied();
+  // Premultiplied output is only produced along with the alpha channel.
+  const bool want_premultiplied =
+      premultiply_alpha && want_alpha && ib.HasAlpha();
 
   const Image3F* color = &ib.color();
   // Undo premultiplied alpha.
   Image3F unpremul;
-  if (ib.AlphaIsPremultiplied() && ib.HasAlpha()) {
+  if (alpha_is_premultiplied && !want_premultiplied) {
     unpremul = Image3F(color->xsize(), color->ysize());
     CopyImageTo(*color, &unpremul);
     for (size_t y = 0; y < unpremul.ysize(); y++) {
@@ -481,7 +411,8 @@ Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
 
   return ConvertChannelsToExternal(
       channels, num_channels, bits_per_sample, float_out, endianness, stride,
-      pool, out_image, out_size, out_callback, undo_orientation);
+      pool, out_image, out_size, out_callback, undo_orientation,
+      want_premultiplied && !alpha_is_premultiplied);
 }
 
 Status ConvertToExternal(const jxl::ImageF& channel, size_t bits_per_sample,
@@ -491,9 +422,10 @@ Status ConvertToExternal(const jxl::ImageF& channel, size_t bits_per_sample,
                          jxl::Orientation undo_orientation) {
   const ImageF* channels[1];
   channels[0] = &channel;
-  return ConvertChannelsToExternal(channels, 1, bits_per_sample, float_out,
-                                   endianness, stride, pool, out_image,
-                                   out_size, out_callback, undo_orientation);
+  return ConvertChannelsToExternal(
+      channels, 1, bits_per_sample, float_out, endianness, stride, pool,
+      out_image, out_size, out_callback, undo_orientation,
+      /*premultiply_alpha=*/false);
 }
 
 }  // namespace jxl
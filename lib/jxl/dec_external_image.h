@@ -33,12 +33,16 @@ namespace jxl {
 // undo_orientation is an EXIF orientation to undo. Depending on the
 // orientation, the output xsize and ysize are swapped compared to input
 // xsize and ysize.
+// premultiply_alpha: if true and an alpha channel is output, the color channels
+// are output multiplied by alpha, otherwise they are output with associated
+// alpha undone.
 Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
                          bool float_out, size_t num_channels,
                          JxlEndianness endianness, size_t stride_out,
                          jxl::ThreadPool* thread_pool, void* out_image,
                          size_t out_size, const PixelCallback& out_callback,
-                         jxl::Orientation undo_orientation);
+                         jxl::Orientation undo_orientation,
+                         bool premultiply_alpha = false);
 
 // Converts single-channel image to interleaved void* pixel buffer with the
 // given format, with a single channel.
@@ -50,6 +50,8 @@
 #include "lib/jxl/passes_state.h"
 #include "lib/jxl/quant_weights.h"
 #include "lib/jxl/quantizer.h"
+#include "lib/jxl/render_pipeline/stage_xyb.h"
+#include "lib/jxl/render_pipeline/stage_ycbcr.h"
 #include "lib/jxl/sanitizers.h"
 #include "lib/jxl/splines.h"
 #include "lib/jxl/toc.h"
@@ -75,6 +77,21 @@ Status DecodeGlobalDCInfo(BitReader* reader, bool is_jpeg,
   state->shared_storage.ac_strategy.FillInvalid();
   return true;
 }
+
+// Calls f(id) for the DC group dc_group_id and each of its neighbours.
+template <typename F>
+void ForEachDCGroupAround(const FrameDimensions& frame_dim, size_t dc_group_id,
+                          const F& f) {
+  const size_t gx = dc_group_id % frame_dim.xsize_dc_groups;
+  const size_t gy = dc_group_id / frame_dim.xsize_dc_groups;
+  const size_t x1 = std::min(gx + 2, frame_dim.xsize_dc_groups);
+  const size_t y1 = std::min(gy + 2, frame_dim.ysize_dc_groups);
+  for (size_t y = gy == 0 ? 0 : gy - 1; y < y1; y++) {
+    for (size_t x = gx == 0 ? 0 : gx - 1; x < x1; x++) {
+      f(y * frame_dim.xsize_dc_groups + x);
+    }
+  }
+}
 }  // namespace
 
 Status DecodeFrameHeader(BitReader* JXL_RESTRICT reader,
@@ -125,30 +142,16 @@ Status DecodeFrame(const DecompressParams& dparams,
 
   // Handling of progressive decoding.
   const FrameHeader& frame_header = frame_decoder.GetFrameHeader();
-  {
-    size_t max_passes = dparams.max_passes;
-    size_t max_downsampling = std::max(
-        dparams.max_downsampling >> (frame_header.dc_level * 3), size_t(1));
-    // TODO(veluca): deal with downsamplings >= 8.
-    if (max_downsampling >= 8) {
-      max_passes = 0;
-    } else {
-      for (uint32_t i = 0; i < frame_header.passes.num_downsample; ++i) {
-        if (max_downsampling >= frame_header.passes.downsample[i] &&
-            max_passes > frame_header.passes.last_pass[i]) {
-          max_passes = frame_header.passes.last_pass[i] + 1;
-        }
-      }
-    }
-    // Do not use downsampling for kReferenceOnly frames.
-    if (frame_header.frame_type == FrameType::kReferenceOnly) {
-      max_passes = frame_header.passes.num_passes;
-    }
-    max_passes = std::min<size_t>(max_passes, frame_header.passes.num_passes);
-    frame_decoder.SetMaxPasses(max_passes);
+  size_t max_passes =
+      frame_decoder.NumPassesForDownsampling(dparams.max_downsampling);
+  // Do not limit the passes for kReferenceOnly frames.
+  if (frame_header.frame_type != FrameType::kReferenceOnly) {
+    max_passes = std::min<size_t>(max_passes, dparams.max_passes);
   }
+  frame_decoder.SetMaxPasses(max_passes);
   frame_decoder.SetRenderSpotcolors(dparams.render_spotcolors);
   frame_decoder.SetCoalescing(dparams.coalescing);
+  frame_decoder.SetRenderPipelineStats(dparams.render_stats);
 
   size_t processed_bytes = reader->TotalBitsConsumed() / kBitsPerByte;
 
@@ -220,6 +223,7 @@ Status FrameDecoder::InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
                                bool allow_partial_dc_global,
                                bool output_needed) {
   PROFILER_FUNC;
+  ScopedPhaseTimer timer(Timer(DecoderCounters::kHeaders));
   decoded_ = decoded;
   JXL_ASSERT(is_finalized_);
 
@@ -227,7 +231,7 @@ Status FrameDecoder::InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
   allow_partial_dc_global_ = allow_partial_dc_global;
 
   // Reset the dequantization matrices to their default values.
-  dec_state_->shared_storage.matrices = DequantMatrices();
+  dec_state_->shared_storage.matrices.ResetToDefault();
 
   frame_header_.nonserialized_is_preview = is_preview;
   size_t pos = br->TotalBitsConsumed() / kBitsPerByte;
@@ -344,18 +348,40 @@ Status FrameDecoder::InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
   num_sections_done_ = 0;
   decoded_dc_groups_.clear();
   decoded_dc_groups_.resize(frame_dim_.num_dc_groups);
+  smooth_dc_per_group_ =
+      frame_header_.encoding == FrameEncoding::kVarDCT &&
+      !(frame_header_.flags & FrameHeader::kSkipAdaptiveDCSmoothing) &&
+      !(frame_header_.flags & FrameHeader::kUseDcFrame) &&
+      frame_dim_.num_dc_groups > 1;
+  dc_smoothed_ = Image3F();
+  dc_smoothing_pending_ = std::vector<std::atomic<uint32_t>>(
+      smooth_dc_per_group_ ? frame_dim_.num_dc_groups : 0);
+  if (smooth_dc_per_group_) {
+    const Image3F& dc = dec_state_->shared_storage.dc_storage;
+    dc_smoothed_ = Image3F(dc.xsize(), dc.ysize());
+    for (size_t g = 0; g < frame_dim_.num_dc_groups; g++) {
+      uint32_t num_around = 0;
+      ForEachDCGroupAround(frame_dim_, g, [&](size_t) { num_around++; });
+      dc_smoothing_pending_[g].store(num_around);
+    }
+  }
   decoded_passes_per_ac_group_.clear();
   decoded_passes_per_ac_group_.resize(frame_dim_.num_groups, 0);
+  skipped_ac_groups_.clear();
+  skipped_ac_groups_.resize(frame_dim_.num_groups, 0);
   processed_section_.clear();
   processed_section_.resize(section_offsets_.size());
   max_passes_ = frame_header_.passes.num_passes;
   num_renders_ = 0;
+  flushed_passes_per_ac_group_.clear();
+  flushed_ac_global_ = false;
   allocated_ = false;
   return true;
 }
 
 Status FrameDecoder::ProcessDCGlobal(BitReader* br) {
   PROFILER_FUNC;
+  ScopedPhaseTimer timer(Timer(DecoderCounters::kDC));
   PassesSharedState& shared = dec_state_->shared_storage;
   if (shared.frame_header.flags & FrameHeader::kPatches) {
     bool uses_extra_channels = false;
@@ -398,7 +424,8 @@ Status FrameDecoder::ProcessDCGlobal(BitReader* br) {
         dec_state_->shared->cmap));
   }
   Status dec_status = modular_frame_decoder_.DecodeGlobalInfo(
-      br, frame_header_, allow_partial_dc_global_);
+      br, frame_header_, allow_partial_dc_global_,
+      &dec_state_->histogram_cache);
   if (dec_status.IsFatalError()) return dec_status;
   if (dec_status) {
     decoded_dc_global_ = true;
@@ -420,7 +447,8 @@ Status FrameDecoder::ProcessDCGroup(size_t dc_group_id, BitReader* br) {
                    frame_dim_.dc_group_dim, frame_dim_.dc_group_dim);
   JXL_RETURN_IF_ERROR(modular_frame_decoder_.DecodeGroup(
       mrect, br, 3, 1000, ModularStreamId::ModularDC(dc_group_id),
-      /*zerofill=*/false, nullptr, nullptr, nullptr, allow_partial_frames_));
+      /*zerofill=*/false, nullptr, nullptr, nullptr, allow_partial_frames_,
+      /*pool=*/nullptr));
   if (frame_header_.encoding == FrameEncoding::kVarDCT) {
     JXL_RETURN_IF_ERROR(
         modular_frame_decoder_.DecodeAcMetadata(dc_group_id, br, dec_state_));
@@ -428,15 +456,29 @@ Status FrameDecoder::ProcessDCGroup(size_t dc_group_id, BitReader* br) {
     FillImage(kInvSigmaNum / lf.epf_sigma_for_modular, &dec_state_->sigma);
   }
   decoded_dc_groups_[dc_group_id] = uint8_t{true};
+  if (smooth_dc_per_group_) {
+    ForEachDCGroupAround(frame_dim_, dc_group_id, [this](size_t g) {
+      if (dc_smoothing_pending_[g].fetch_sub(1) == 1) {
+        AdaptiveDCSmoothingRect(dec_state_->shared->quantizer.MulDC(),
+                                dec_state_->shared_storage.dc_storage,
+                                dec_state_->shared->DCGroupRect(g),
+                                &dc_smoothed_);
+      }
+    });
+  }
   return true;
 }
 
 void FrameDecoder::FinalizeDC() {
   // Do Adaptive DC smoothing if enabled. This *must* happen between all the
   // ProcessDCGroup and ProcessACGroup.
-  if (frame_header_.encoding == FrameEncoding::kVarDCT &&
-      !(frame_header_.flags & FrameHeader::kSkipAdaptiveDCSmoothing) &&
-      !(frame_header_.flags & FrameHeader::kUseDcFrame)) {
+  if (smooth_dc_per_group_) {
+    // All the DC groups are decoded, so ProcessDCGroup smoothed all of them.
+    dec_state_->shared_storage.dc_storage.Swap(dc_smoothed_);
+    dc_smoothed_ = Image3F();
+  } else if (frame_header_.encoding == FrameEncoding::kVarDCT &&
+             !(frame_header_.flags & FrameHeader::kSkipAdaptiveDCSmoothing) &&
+             !(frame_header_.flags & FrameHeader::kUseDcFrame)) {
     AdaptiveDCSmoothing(dec_state_->shared->quantizer.MulDC(),
                         &dec_state_->shared_storage.dc_storage, pool_);
   }
@@ -455,6 +497,7 @@ Status FrameDecoder::AllocateOutput() {
 
 Status FrameDecoder::ProcessACGlobal(BitReader* br) {
   JXL_CHECK(finalized_dc_);
+  ScopedPhaseTimer timer(Timer(DecoderCounters::kAC));
 
   // Decode AC group.
   if (frame_header_.encoding == FrameEncoding::kVarDCT) {
@@ -483,7 +526,7 @@ Status FrameDecoder::ProcessACGlobal(BitReader* br) {
       size_t num_contexts =
           dec_state_->shared->num_histograms *
           dec_state_->shared_storage.block_ctx_map.NumACContexts();
-      JXL_RETURN_IF_ERROR(DecodeHistograms(
+      JXL_RETURN_IF_ERROR(dec_state_->histogram_cache.Decode(
           br, num_contexts, &dec_state_->code[i], &dec_state_->context_map[i]));
       // Add extra values to enable the cheat in hot loop of DecodeACVarBlock.
       dec_state_->context_map[i].resize(
@@ -497,16 +540,12 @@ Status FrameDecoder::ProcessACGlobal(BitReader* br) {
     // TODO(veluca): figure out the exact limit - 16 should still work with
     // 16-bit buffers, but we are excluding it for safety.
     bool use_16_bit = max_num_bits_ac < 16 && !decoded_->IsJPEG();
-    bool store = frame_header_.passes.num_passes > 1;
-    size_t xs = store ? kGroupDim * kGroupDim : 0;
-    size_t ys = store ? frame_dim_.num_groups : 0;
-    if (use_16_bit) {
-      dec_state_->coefficients = make_unique<ACImageT<int16_t>>(xs, ys);
-    } else {
-      dec_state_->coefficients = make_unique<ACImageT<int32_t>>(xs, ys);
-    }
-    if (store) {
-      dec_state_->coefficients->ZeroFill();
+    dec_state_->coefficients_type = use_16_bit ? ACType::k16 : ACType::k32;
+    // The groups get their storage when their first pass arrives, see
+    // DecodeGroup.
+    dec_state_->group_coefficients.clear();
+    if (frame_header_.passes.num_passes > 1) {
+      dec_state_->group_coefficients.resize(frame_dim_.num_groups);
     }
   }
 
@@ -548,15 +587,55 @@ Status FrameDecoder::ProcessACGlobal(BitReader* br) {
       }
     }
   }
+  ComputeSkippedGroups();
   decoded_ac_global_ = true;
   return true;
 }
 
+void FrameDecoder::ComputeSkippedGroups() {
+  if (!has_crop_region_ || use_slow_rendering_pipeline_ ||
+      decoded_->IsJPEG() ||
+      frame_header_.frame_type != FrameType::kRegularFrame ||
+      frame_header_.CanBeReferenced() ||
+      modular_frame_decoder_.UsesFullImage()) {
+    return;
+  }
+  // Larger than the border, in frame pixels, that the render pipeline stages
+  // need around a pixel, so that the pixels of skipped groups never reach the
+  // crop region. Note that the simple render pipeline, which waits for all the
+  // groups, is not used here.
+  constexpr int64_t kCropBorder = 32;
+  const int64_t upsampling = frame_header_.upsampling;
+  const int64_t group_dim = frame_dim_.group_dim * upsampling;
+  const int64_t border = kCropBorder * upsampling;
+  int64_t frame_x0 = 0;
+  int64_t frame_y0 = 0;
+  if (frame_header_.custom_size_or_origin) {
+    frame_x0 = frame_header_.frame_origin.x0;
+    frame_y0 = frame_header_.frame_origin.y0;
+  }
+  const int64_t crop_x0 = crop_region_.x0();
+  const int64_t crop_y0 = crop_region_.y0();
+  const int64_t crop_x1 = crop_x0 + crop_region_.xsize();
+  const int64_t crop_y1 = crop_y0 + crop_region_.ysize();
+  for (size_t g = 0; g < frame_dim_.num_groups; g++) {
+    const int64_t gx = g % frame_dim_.xsize_groups;
+    const int64_t gy = g / frame_dim_.xsize_groups;
+    const int64_t x0 = frame_x0 + gx * group_dim - border;
+    const int64_t y0 = frame_y0 + gy * group_dim - border;
+    const int64_t x1 = x0 + group_dim + 2 * border;
+    const int64_t y1 = y0 + group_dim + 2 * border;
+    skipped_ac_groups_[g] =
+        x1 <= crop_x0 || x0 >= crop_x1 || y1 <= crop_y0 || y0 >= crop_y1;
+  }
+}
+
 Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
                                     BitReader* JXL_RESTRICT* br,
                                     size_t num_passes, size_t thread,
                                     bool force_draw, bool dc_only) {
   PROFILER_ZONE("process_group");
+  ScopedPhaseTimer ac_timer(Timer(DecoderCounters::kAC));
   size_t group_dim = frame_dim_.group_dim;
   const size_t gx = ac_group_id % frame_dim_.xsize_groups;
   const size_t gy = ac_group_id / frame_dim_.xsize_groups;
@@ -565,14 +644,18 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
 
   RenderPipelineInput render_pipeline_input =
       dec_state_->render_pipeline->GetInputBuffers(ac_group_id, thread);
+  // The only group of a frame runs on the calling thread rather than in a task
+  // of the pool, see ThreadPool::Run, so the modular decoder can use the pool.
+  ThreadPool* modular_pool = frame_dim_.num_groups == 1 ? pool_ : nullptr;
 
   bool should_run_pipeline = true;
 
   if (frame_header_.encoding == FrameEncoding::kVarDCT) {
-    group_dec_caches_[thread].InitOnce(frame_header_.passes.num_passes,
-                                       dec_state_->used_acs);
+    GroupDecCache* group_dec_cache = &dec_state_->group_dec_caches[thread];
+    group_dec_cache->InitOnce(frame_header_.passes.num_passes,
+                              dec_state_->used_acs);
     JXL_RETURN_IF_ERROR(DecodeGroup(br, num_passes, ac_group_id, dec_state_,
-                                    &group_dec_caches_[thread], thread,
+                                    group_dec_cache, thread,
                                     render_pipeline_input, decoded_,
                                     decoded_passes_per_ac_group_[ac_group_id],
                                     force_draw, dc_only, &should_run_pipeline));
@@ -589,16 +672,23 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
           mrect, br[i - decoded_passes_per_ac_group_[ac_group_id]], minShift,
           maxShift, ModularStreamId::ModularAC(ac_group_id, i),
           /*zerofill=*/false, dec_state_, &render_pipeline_input, decoded_,
-          allow_partial_frames_));
+          allow_partial_frames_, modular_pool));
     } else if (i >= decoded_passes_per_ac_group_[ac_group_id] + num_passes &&
                force_draw) {
       JXL_RETURN_IF_ERROR(modular_frame_decoder_.DecodeGroup(
           mrect, nullptr, minShift, maxShift,
           ModularStreamId::ModularAC(ac_group_id, i), /*zerofill=*/true,
-          dec_state_, &render_pipeline_input, decoded_, allow_partial_frames_));
+          dec_state_, &render_pipeline_input, decoded_, allow_partial_frames_,
+          modular_pool));
     }
   }
   decoded_passes_per_ac_group_[ac_group_id] += num_passes;
+  if (!dec_state_->group_coefficients.empty() &&
+      decoded_passes_per_ac_group_[ac_group_id] ==
+          frame_header_.passes.num_passes) {
+    // The group was drawn with all passes and is not drawn again.
+    dec_state_->group_coefficients[ac_group_id].reset();
+  }
 
   if ((frame_header_.flags & FrameHeader::kNoise) != 0) {
     PROFILER_ZONE("GenerateNoise");
@@ -628,7 +718,9 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
   }
 
   if (!modular_frame_decoder_.UsesFullImage() && !decoded_->IsJPEG() &&
-      should_run_pipeline) {
+      should_run_pipeline && !dec_state_->lossless_modular_rgb8_output) {
+    ac_timer.Stop();
+    ScopedPhaseTimer render_timer(Timer(DecoderCounters::kRender));
     render_pipeline_input.Done();
   }
   return true;
@@ -636,12 +728,12 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
 
 void FrameDecoder::MarkSections(const SectionInfo* sections, size_t num,
                                 SectionStatus* section_status) {
-  num_sections_done_ = num;
   for (size_t i = 0; i < num; i++) {
     if (section_status[i] == SectionStatus::kSkipped ||
         section_status[i] == SectionStatus::kPartial) {
       processed_section_[sections[i].id] = false;
-      num_sections_done_--;
+    } else if (section_status[i] == SectionStatus::kDone) {
+      num_sections_done_++;
     }
   }
 }
@@ -719,34 +811,182 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
     }
   }
 
+  std::atomic<bool> has_dc_error{false};
   std::atomic<bool> has_error{false};
+  const auto decode_dc_group = [&](size_t i) {
+    if (dc_group_sec[i] == num) return;
+    if (!PollProgress(progress_)) return;
+    ScopedPhaseTimer timer(Timer(DecoderCounters::kDC));
+    if (!ProcessDCGroup(i, sections[dc_group_sec[i]].br)) {
+      has_dc_error = true;
+    } else {
+      section_status[dc_group_sec[i]] = SectionStatus::kDone;
+      if (counters_ != nullptr) counters_->dc_groups++;
+    }
+  };
+  const auto finalize_dc = [&]() -> Status {
+    PassesDecoderState::PipelineOptions pipeline_options;
+    pipeline_options.use_slow_render_pipeline = use_slow_rendering_pipeline_;
+    pipeline_options.coalescing = coalescing_;
+    pipeline_options.render_spotcolors = render_spotcolors_;
+    pipeline_options.premultiply_alpha = PremultipliesOutput();
+    pipeline_options.render_stats = render_stats_;
+    {
+      ScopedPhaseTimer timer(Timer(DecoderCounters::kRender));
+      JXL_RETURN_IF_ERROR(
+          dec_state_->PreparePipeline(decoded_, pipeline_options));
+    }
+    {
+      ScopedPhaseTimer timer(Timer(DecoderCounters::kDC));
+      FinalizeDC();
+    }
+    return AllocateOutput();
+  };
+  const auto prepare_ac_groups = [&]() {
+    // Mark all the AC groups that we received as not complete yet.
+    for (size_t i = 0; i < ac_group_sec.size(); i++) {
+      if (num_ac_passes[i] == 0 && !modular_frame_decoder_.UsesFullImage()) {
+        continue;
+      }
+      if (skipped_ac_groups_[i]) continue;
+      dec_state_->render_pipeline->ClearDone(i);
+    }
+
+    size_t num_tasks = 0;
+    for (size_t g = 0; g < ac_group_sec.size(); g++) {
+      if (num_ac_passes[g] != 0 && !skipped_ac_groups_[g]) num_tasks++;
+    }
+    AddProgressWork(progress_, num_tasks);
+  };
+  const auto decode_ac_group = [&](size_t g, size_t thread) {
+    if (num_ac_passes[g] == 0) {  // no new AC pass, nothing to do.
+      return;
+    }
+    size_t first_pass = decoded_passes_per_ac_group_[g];
+    if (skipped_ac_groups_[g]) {
+      for (size_t i = 0; i < num_ac_passes[g]; i++) {
+        section_status[ac_group_sec[g][first_pass + i]] = SectionStatus::kDone;
+      }
+      decoded_passes_per_ac_group_[g] += num_ac_passes[g];
+      return;
+    }
+    if (!PollProgress(progress_)) return;
+    BitReader* JXL_RESTRICT readers[kMaxNumPasses];
+    for (size_t i = 0; i < num_ac_passes[g]; i++) {
+      JXL_ASSERT(ac_group_sec[g][first_pass + i] != num);
+      readers[i] = sections[ac_group_sec[g][first_pass + i]].br;
+    }
+    if (!ProcessACGroup(g, readers, num_ac_passes[g],
+                        GetStorageLocation(thread, g),
+                        /*force_draw=*/false, /*dc_only=*/false)) {
+      has_error = true;
+    } else {
+      for (size_t i = 0; i < num_ac_passes[g]; i++) {
+        section_status[ac_group_sec[g][first_pass + i]] = SectionStatus::kDone;
+      }
+      if (counters_ != nullptr) counters_->ac_groups++;
+    }
+  };
+
+  // When the remaining DC groups and the AC global section are all here, the
+  // DC groups, the step between DC and AC and the AC groups run as one
+  // dependency graph, so that the threads that finish their DC groups early
+  // go on with the AC groups instead of waiting for the slowest DC group, and
+  // only the step in between is serial. The AC groups cannot start before all
+  // the DC groups: the AC strategies used by any group decide the dequant
+  // tables and coefficient orders of ProcessACGlobal. With a single DC group,
+  // FinalizeDC runs the DC smoothing on the pool itself, and with
+  // pause_at_progressive_ the DC may be returned before the AC.
+  bool decode_as_graph = decoded_dc_global_ && !finalized_dc_ &&
+                         !single_section && !pause_at_progressive_ &&
+                         ac_global_sec != num && frame_dim_.num_dc_groups > 1;
+  for (size_t i = 0; i < dc_group_sec.size(); i++) {
+    if (dc_group_sec[i] == num && !decoded_dc_groups_[i]) {
+      decode_as_graph = false;
+    }
+  }
+  if (decode_as_graph) {
+    // Nodes: the DC groups to decode, then the DC finalization and AC global
+    // section, then the AC groups with new passes.
+    std::vector<size_t> dc_groups;
+    for (size_t i = 0; i < dc_group_sec.size(); i++) {
+      if (dc_group_sec[i] != num) dc_groups.push_back(i);
+    }
+    std::vector<size_t> ac_groups;
+    for (size_t g = 0; g < ac_group_sec.size(); g++) {
+      if (num_ac_passes[g] != 0) ac_groups.push_back(g);
+    }
+    const uint32_t ac_global_node = dc_groups.size();
+    const size_t num_nodes = dc_groups.size() + 1 + ac_groups.size();
+    std::vector<uint32_t> num_dependencies(num_nodes, 0);
+    std::vector<std::vector<uint32_t>> dependents(num_nodes);
+    num_dependencies[ac_global_node] = dc_groups.size();
+    for (uint32_t node = 0; node < ac_global_node; node++) {
+      dependents[node].push_back(ac_global_node);
+    }
+    for (uint32_t node = ac_global_node + 1; node < num_nodes; node++) {
+      num_dependencies[node] = 1;
+      dependents[ac_global_node].push_back(node);
+    }
+
+    AddProgressWork(progress_, dc_groups.size());
+    size_t num_threads = 0;
+    Status ac_global_status = true;
+    // Written by the AC global node before the AC group nodes start.
+    bool ac_groups_ready = false;
+    JXL_RETURN_IF_ERROR(RunGraphOnPool(
+        pool_, std::move(num_dependencies), dependents,
+        [&num_threads](size_t n) {
+          num_threads = n;
+          return true;
+        },
+        [&](uint32_t node, size_t thread) {
+          if (node < ac_global_node) {
+            decode_dc_group(dc_groups[node]);
+          } else if (node == ac_global_node) {
+            // Not all the DC groups are decoded after an error or an abort.
+            const bool aborted = progress_ != nullptr && progress_->Aborted();
+            if (has_dc_error || aborted) return;
+            ac_global_status = [&]() -> Status {
+              JXL_RETURN_IF_ERROR(finalize_dc());
+              JXL_RETURN_IF_ERROR(ProcessACGlobal(sections[ac_global_sec].br));
+              section_status[ac_global_sec] = SectionStatus::kDone;
+              prepare_ac_groups();
+              return PrepareStorage(num_threads,
+                                    decoded_passes_per_ac_group_.size());
+            }();
+            ac_groups_ready = static_cast<bool>(ac_global_status);
+          } else if (ac_groups_ready) {
+            decode_ac_group(ac_groups[node - ac_global_node - 1], thread);
+          }
+        },
+        "DecodeGroups"));
+    if (has_dc_error) return JXL_FAILURE("Error in DC group");
+    JXL_RETURN_IF_ERROR(CheckProgress(progress_));
+    JXL_RETURN_IF_ERROR(ac_global_status);
+    if (has_error) return JXL_FAILURE("Error in AC group");
+    MarkSections(sections, num, section_status);
+    return true;
+  }
+
   if (decoded_dc_global_) {
+    AddProgressWork(progress_,
+                    dc_group_sec.size() -
+                        std::count(dc_group_sec.begin(), dc_group_sec.end(),
+                                   num));
     JXL_RETURN_IF_ERROR(RunOnPool(
         pool_, 0, dc_group_sec.size(), ThreadPool::NoInit,
-        [this, &dc_group_sec, &num, &sections, &section_status, &has_error](
-            size_t i, size_t thread) {
-          if (dc_group_sec[i] != num) {
-            if (!ProcessDCGroup(i, sections[dc_group_sec[i]].br)) {
-              has_error = true;
-            } else {
-              section_status[dc_group_sec[i]] = SectionStatus::kDone;
-            }
-          }
+        [&decode_dc_group](size_t i, size_t /* thread */) {
+          decode_dc_group(i);
         },
         "DecodeDCGroup"));
   }
-  if (has_error) return JXL_FAILURE("Error in DC group");
+  if (has_dc_error) return JXL_FAILURE("Error in DC group");
+  JXL_RETURN_IF_ERROR(CheckProgress(progress_));
 
   if (*std::min_element(decoded_dc_groups_.begin(), decoded_dc_groups_.end()) &&
       !finalized_dc_) {
-    PassesDecoderState::PipelineOptions pipeline_options;
-    pipeline_options.use_slow_render_pipeline = use_slow_rendering_pipeline_;
-    pipeline_options.coalescing = coalescing_;
-    pipeline_options.render_spotcolors = render_spotcolors_;
-    JXL_RETURN_IF_ERROR(
-        dec_state_->PreparePipeline(decoded_, pipeline_options));
-    FinalizeDC();
-    JXL_RETURN_IF_ERROR(AllocateOutput());
+    JXL_RETURN_IF_ERROR(finalize_dc());
     if (pause_at_progressive_ && !single_section) {
       bool can_return_dc = true;
       if (single_section) {
@@ -783,46 +1023,17 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
   }
 
   if (decoded_ac_global_) {
-    // Mark all the AC groups that we received as not complete yet.
-    for (size_t i = 0; i < ac_group_sec.size(); i++) {
-      if (num_ac_passes[i] == 0 && !modular_frame_decoder_.UsesFullImage()) {
-        continue;
-      }
-      dec_state_->render_pipeline->ClearDone(i);
-    }
-
+    prepare_ac_groups();
     JXL_RETURN_IF_ERROR(RunOnPool(
         pool_, 0, ac_group_sec.size(),
         [this](size_t num_threads) {
           return PrepareStorage(num_threads,
                                 decoded_passes_per_ac_group_.size());
         },
-        [this, &ac_group_sec, &num_ac_passes, &num, &sections, &section_status,
-         &has_error](size_t g, size_t thread) {
-          if (num_ac_passes[g] == 0) {  // no new AC pass, nothing to do.
-            return;
-          }
-          (void)num;
-          size_t first_pass = decoded_passes_per_ac_group_[g];
-          BitReader* JXL_RESTRICT readers[kMaxNumPasses];
-          for (size_t i = 0; i < num_ac_passes[g]; i++) {
-            JXL_ASSERT(ac_group_sec[g][first_pass + i] != num);
-            readers[i] = sections[ac_group_sec[g][first_pass + i]].br;
-          }
-          if (!ProcessACGroup(g, readers, num_ac_passes[g],
-                              GetStorageLocation(thread, g),
-                              /*force_draw=*/false, /*dc_only=*/false)) {
-            has_error = true;
-          } else {
-            for (size_t i = 0; i < num_ac_passes[g]; i++) {
-              section_status[ac_group_sec[g][first_pass + i]] =
-                  SectionStatus::kDone;
-            }
-          }
-        },
-        "DecodeGroup"));
+        decode_ac_group, "DecodeGroup"));
   }
   if (has_error) return JXL_FAILURE("Error in AC group");
+  JXL_RETURN_IF_ERROR(CheckProgress(progress_));
 
   MarkSections(sections, num, section_status);
   return true;
@@ -854,11 +1065,28 @@ Status FrameDecoder::Flush() {
   uint32_t completely_decoded_ac_pass = *std::min_element(
       decoded_passes_per_ac_group_.begin(), decoded_passes_per_ac_group_.end());
   if (completely_decoded_ac_pass < frame_header_.passes.num_passes) {
-    // We don't have all AC yet: force a draw of all the missing areas.
-    // Mark all sections as not complete.
+    // We don't have all AC yet: force a draw of the missing areas. The output
+    // still holds the groups drawn by the previous Flush, so only those that
+    // got new passes since then are drawn again; the low-memory render
+    // pipeline renders the borders between them and the others from the
+    // borders it kept. The simple render pipeline only renders once every
+    // group is drawn, and all groups change when the AC global section
+    // arrives.
+    const bool draw_all = flushed_passes_per_ac_group_.empty() ||
+                          use_slow_rendering_pipeline_ ||
+                          flushed_ac_global_ != decoded_ac_global_;
+    std::vector<uint8_t> draw(decoded_passes_per_ac_group_.size());
     for (size_t i = 0; i < decoded_passes_per_ac_group_.size(); i++) {
-      if (decoded_passes_per_ac_group_[i] == frame_header_.passes.num_passes)
+      if (decoded_passes_per_ac_group_[i] == frame_header_.passes.num_passes ||
+          skipped_ac_groups_[i]) {
         continue;
+      }
+      if (!draw_all && decoded_passes_per_ac_group_[i] ==
+                           flushed_passes_per_ac_group_[i]) {
+        continue;
+      }
+      draw[i] = 1;
+      // Mark the section as not complete.
       dec_state_->render_pipeline->ClearDone(i);
     }
     std::atomic<bool> has_error{false};
@@ -868,10 +1096,9 @@ Status FrameDecoder::Flush() {
           return PrepareStorage(num_threads,
                                 decoded_passes_per_ac_group_.size());
         },
-        [this, &has_error](const uint32_t g, size_t thread) {
-          if (decoded_passes_per_ac_group_[g] ==
-              frame_header_.passes.num_passes) {
-            // This group was drawn already, nothing to do.
+        [this, &draw, &has_error](const uint32_t g, size_t thread) {
+          if (!draw[g]) {
+            // This group was drawn already or is not needed, nothing to do.
             return;
           }
           BitReader* JXL_RESTRICT readers[kMaxNumPasses] = {};
@@ -884,9 +1111,12 @@ Status FrameDecoder::Flush() {
     if (has_error) {
       return JXL_FAILURE("Drawing groups failed");
     }
+    flushed_passes_per_ac_group_ = decoded_passes_per_ac_group_;
+    flushed_ac_global_ = decoded_ac_global_;
   }
 
   // undo global modular transforms and copy int pixel buffers to float ones
+  ScopedPhaseTimer timer(Timer(DecoderCounters::kRender));
   JXL_RETURN_IF_ERROR(modular_frame_decoder_.FinalizeDecoding(
       dec_state_, pool_, decoded_, is_finalized_));
 
@@ -894,6 +1124,34 @@ Status FrameDecoder::Flush() {
   return true;
 }
 
+Status FrameDecoder::GetDCImage(ImageBundle* dc) const {
+  JXL_ASSERT(HasDecodedDC() && HasDCImage());
+  Image3F color(frame_dim_.xsize_blocks, frame_dim_.ysize_blocks);
+  CopyImageTo(Rect(color), *dec_state_->shared->dc, Rect(color), &color);
+  // The same color transform as the render pipeline, without the 8x
+  // upsampling of the DC that it does for progressive rendering.
+  std::unique_ptr<RenderPipelineStage> stage;
+  if (frame_header_.color_transform == ColorTransform::kXYB) {
+    stage = GetXYBStage(dec_state_->output_encoding_info);
+  } else if (frame_header_.color_transform == ColorTransform::kYCbCr) {
+    stage = GetYCbCrStage();
+  }
+  if (stage) {
+    RenderPipelineStage::RowInfo rows(3, std::vector<float*>(1));
+    for (size_t y = 0; y < color.ysize(); y++) {
+      for (size_t c = 0; c < 3; c++) {
+        rows[c][0] = color.PlaneRow(c, y) - kRenderPipelineXOffset;
+      }
+      // Arguments set to 0 are not used by these in-place stages.
+      stage->ProcessRow(rows, rows, /*xextra=*/0, color.xsize(), 0, y,
+                        /*thread_id=*/0);
+    }
+  }
+  dc->SetFromImage(std::move(color),
+                   dec_state_->output_encoding_info.color_encoding);
+  return true;
+}
+
 int FrameDecoder::SavedAs(const FrameHeader& header) {
   if (header.frame_type == FrameType::kDCFrame) {
     // bits 16, 32, 64, 128 for DC level
@@ -906,14 +1164,102 @@ int FrameDecoder::SavedAs(const FrameHeader& header) {
   return 0;
 }
 
+bool FrameDecoder::CanOutputYCbCrPlanes() const {
+  if (frame_header_.color_transform != ColorTransform::kYCbCr) return false;
+  constexpr uint64_t kImageFeatures =
+      FrameHeader::kNoise | FrameHeader::kPatches | FrameHeader::kSplines;
+  if ((frame_header_.flags & kImageFeatures) != 0 ||
+      frame_header_.upsampling != 1 || frame_header_.dc_level != 0 ||
+      frame_header_.CanBeReferenced() ||
+      frame_header_.frame_type != FrameType::kRegularFrame) {
+    return false;
+  }
+  if (coalescing_ && NeedsBlending(dec_state_)) return false;
+  const YCbCrChromaSubsampling& cs = frame_header_.chroma_subsampling;
+  if (cs.HShift(1) != 0 || cs.VShift(1) != 0) return false;
+  // The loop filters would see the chroma planes at different resolutions.
+  if (!cs.Is444() && (frame_header_.loop_filter.gab ||
+                      frame_header_.loop_filter.epf_iters != 0)) {
+    return false;
+  }
+  return true;
+}
+
+bool FrameDecoder::CanWriteModularToRGB8() const {
+  const ImageMetadata& metadata = *decoded_->metadata();
+  if (frame_header_.encoding != FrameEncoding::kModular ||
+      frame_header_.color_transform != ColorTransform::kNone ||
+      metadata.bit_depth.floating_point_sample ||
+      metadata.bit_depth.bits_per_sample != 8) {
+    return false;
+  }
+  // No stage of the render pipeline may be needed.
+  constexpr uint64_t kImageFeatures =
+      FrameHeader::kNoise | FrameHeader::kPatches | FrameHeader::kSplines;
+  if ((frame_header_.flags & kImageFeatures) != 0 ||
+      frame_header_.upsampling != 1 ||
+      !frame_header_.chroma_subsampling.Is444() ||
+      frame_header_.loop_filter.gab ||
+      frame_header_.loop_filter.epf_iters != 0 || frame_header_.dc_level != 0 ||
+      frame_header_.CanBeReferenced() ||
+      frame_header_.frame_type != FrameType::kRegularFrame) {
+    return false;
+  }
+  // The frame must replace the whole image.
+  if (frame_header_.custom_size_or_origin ||
+      frame_header_.blending_info.mode != BlendMode::kReplace) {
+    return false;
+  }
+  for (const BlendingInfo& info : frame_header_.extra_channel_blending_info) {
+    if (info.mode != BlendMode::kReplace) return false;
+  }
+  for (size_t upsampling : frame_header_.extra_channel_upsampling) {
+    if (upsampling != 1) return false;
+  }
+  for (const ExtraChannelInfo& eci : metadata.extra_channel_info) {
+    if (eci.type == ExtraChannel::kSpotColor && render_spotcolors_) {
+      return false;
+    }
+  }
+  // Only the first alpha channel is written to the output.
+  const ExtraChannelInfo* alpha = metadata.Find(ExtraChannel::kAlpha);
+  if (alpha != nullptr && (alpha->bit_depth.floating_point_sample ||
+                           alpha->bit_depth.bits_per_sample != 8)) {
+    return false;
+  }
+  return !PremultipliesOutput();
+}
+
+size_t FrameDecoder::NumPassesForDownsampling(size_t downsampling) const {
+  // Do not use downsampling for kReferenceOnly frames.
+  if (frame_header_.frame_type == FrameType::kReferenceOnly) {
+    return frame_header_.passes.num_passes;
+  }
+  size_t max_downsampling =
+      std::max(downsampling >> (frame_header_.dc_level * 3), size_t(1));
+  // TODO(veluca): deal with downsamplings >= 8.
+  if (max_downsampling >= 8) return 0;
+  size_t max_passes = frame_header_.passes.num_passes;
+  for (uint32_t i = 0; i < frame_header_.passes.num_downsample; ++i) {
+    if (max_downsampling >= frame_header_.passes.downsample[i] &&
+        max_passes > frame_header_.passes.last_pass[i]) {
+      max_passes = frame_header_.passes.last_pass[i] + 1;
+    }
+  }
+  return max_passes;
+}
+
 bool FrameDecoder::HasEverything() const {
   if (!decoded_dc_global_) return false;
   if (!decoded_ac_global_) return false;
   for (auto& have_dc_group : decoded_dc_groups_) {
     if (!have_dc_group) return false;
   }
-  for (auto& nb_passes : decoded_passes_per_ac_group_) {
-    if (nb_passes < max_passes_) return false;
+  for (size_t g = 0; g < decoded_passes_per_ac_group_.size(); g++) {
+    if (decoded_passes_per_ac_group_[g] < max_passes_ &&
+        !skipped_ac_groups_[g]) {
+      return false;
+    }
   }
   return true;
 }
@@ -8,6 +8,9 @@
 
 #include <stdint.h>
 
+#include <atomic>
+#include <vector>
+
 #include "jxl/decode.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
@@ -23,6 +26,8 @@
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/headers.h"
 #include "lib/jxl/image_bundle.h"
+#include "lib/jxl/phase_counters.h"
+#include "lib/jxl/progress.h"
 
 namespace jxl {
 
@@ -63,6 +68,24 @@ class FrameDecoder {
   }
   void SetRenderSpotcolors(bool rsc) { render_spotcolors_ = rsc; }
   void SetCoalescing(bool c) { coalescing_ = c; }
+  // Multiplies the color channels of the RGBA output buffer or callback by a
+  // non-premultiplied alpha channel.
+  void SetPremultiplyAlpha(bool p) { premultiply_alpha_ = p; }
+  // Allows the int16 inverse DCTs, where available, when decoding to an RGB8
+  // output buffer in sRGB.
+  void SetAllowIntegerIDCT(bool allow) { allow_integer_idct_ = allow; }
+  // Records the time spent and data processed by each render pipeline stage
+  // into stats, which must outlive the frame decoding, if not null.
+  void SetRenderPipelineStats(RenderPipelineStats* stats) {
+    render_stats_ = stats;
+  }
+  // Adds the time spent in each phase and the number of decoded groups to
+  // counters, which must outlive the frame decoding, if not null.
+  void SetCounters(DecoderCounters* counters) { counters_ = counters; }
+  // Polls progress before decoding each DC and AC group, and fails
+  // ProcessSections if it asks to abort. It must outlive the frame decoding,
+  // if not null.
+  void SetProgress(ProgressMonitor* progress) { progress_ = progress; }
 
   // Read FrameHeader and table of contents from the given BitReader.
   // Also checks frame dimensions for their limits, and sets the output
@@ -94,10 +117,13 @@ class FrameDecoder {
   // `section_status` should point to `num` elements, and will be filled with
   // information about whether each section was processed or not.
   // A section is a part of the encoded file that is indexed by the TOC.
+  // Sections that were processed correctly in an earlier call don't need to be
+  // passed again.
   Status ProcessSections(const SectionInfo* sections, size_t num,
                          SectionStatus* section_status);
 
-  // Flushes all the data decoded so far to pixels.
+  // Flushes all the data decoded so far to pixels. After the first call, only
+  // the groups that got new data since the previous call are drawn again.
   Status Flush();
 
   // Runs final operations once a frame data is decoded.
@@ -126,14 +152,42 @@ class FrameDecoder {
   const std::vector<uint32_t>& SectionSizes() const { return section_sizes_; }
   size_t NumSections() const { return section_sizes_.size(); }
 
-  // TODO(veluca): remove once we remove --downsampling flag.
+  // Limits the decoding to the first max_passes AC passes, the sections of
+  // later passes are skipped. Must be called after InitFrame.
   void SetMaxPasses(size_t max_passes) { max_passes_ = max_passes; }
+  // Returns the number of AC passes that are needed to render this frame at
+  // 1/downsampling of its resolution, for downsampling 1, 2, 4 or 8.
+  size_t NumPassesForDownsampling(size_t downsampling) const;
   const FrameHeader& GetFrameHeader() const { return frame_header_; }
 
   // Returns whether a DC image has been decoded, accessible at low resolution
   // at passes.shared_storage.dc_storage
   bool HasDecodedDC() const { return finalized_dc_; }
-  bool HasDecodedAll() const { return NumSections() == num_sections_done_; }
+  // Whether GetDCImage can output the DC of this frame: it must be a VarDCT
+  // frame without upsampling or chroma subsampling.
+  bool HasDCImage() const {
+    return frame_header_.encoding == FrameEncoding::kVarDCT &&
+           frame_header_.upsampling == 1 &&
+           frame_header_.chroma_subsampling.Is444();
+  }
+  // Outputs the DC decoded so far, one pixel per 8x8 block, converted to the
+  // color space of the decoded frame like the full resolution pixels but
+  // without their filters. Requires HasDecodedDC and HasDCImage.
+  Status GetDCImage(ImageBundle* dc) const;
+  // Also true if all the passes allowed by SetMaxPasses were decoded, without
+  // the sections of the AC groups skipped because of SetCropRegion.
+  bool HasDecodedAll() const {
+    return NumSections() == num_sections_done_ || HasEverything();
+  }
+
+  // Indicates that only the pixels inside rect, in image coordinates, will be
+  // used. AC groups that don't affect them are then not decoded, if the frame
+  // is not needed by later frames and skipping them can't affect rect. Must be
+  // called before ProcessSections.
+  void SetCropRegion(const Rect& rect) {
+    crop_region_ = rect;
+    has_crop_region_ = true;
+  }
 
   // If enabled, ProcessSections will stop and return true when the DC
   // sections have been processed, instead of starting the AC sections. This
@@ -162,13 +216,19 @@ class FrameDecoder {
     dec_state_->rgb_stride = stride;
     JXL_ASSERT(!dec_state_->pixel_callback.IsPresent());
 #if !JXL_HIGH_PRECISION
-    if (decoded_->metadata()->xyb_encoded &&
+    if (decoded_->metadata()->xyb_encoded && !PremultipliesOutput() &&
         dec_state_->output_encoding_info.color_encoding.IsSRGB() &&
         dec_state_->output_encoding_info.all_default_opsin &&
+        !dec_state_->output_encoding_info.ToneMapsXYB() &&
         HasFastXYBTosRGB8() && frame_header_.needs_color_transform()) {
       dec_state_->fast_xyb_srgb8_conversion = true;
     }
+    if (allow_integer_idct_ &&
+        dec_state_->output_encoding_info.color_encoding.IsSRGB()) {
+      dec_state_->use_integer_idct = true;
+    }
 #endif
+    dec_state_->lossless_modular_rgb8_output = CanWriteModularToRGB8();
   }
 
   // Same as MaybeSetRGB8OutputBuffer, but with a float callback. This is not
@@ -190,6 +250,23 @@ class FrameDecoder {
     JXL_ASSERT(dec_state_->rgb_output == nullptr);
   }
 
+  // Sets a callback receiving the Y, Cb and Cr planes of a YCbCr frame at their
+  // native subsampling, skipping chroma upsampling and the conversion to RGB.
+  // Returns false, without setting the callback, if the frame cannot be
+  // rendered this way (see CanOutputYCbCrPlanes). No other output may be set.
+  //
+  // @param undo_orientation: as for MaybeSetRGB8OutputBuffer; the planes are
+  // always in the orientation of the codestream.
+  bool SetYCbCrPlanarCallback(const PlanarCallback& planar_callback,
+                              bool undo_orientation) const {
+    if (!CanDoLowMemoryPath(undo_orientation)) return false;
+    if (!CanOutputYCbCrPlanes()) return false;
+    JXL_ASSERT(dec_state_->rgb_output == nullptr);
+    JXL_ASSERT(!dec_state_->pixel_callback.IsPresent());
+    dec_state_->ycbcr_planar_callback = planar_callback;
+    return true;
+  }
+
   // Returns true if the rgb output buffer passed by MaybeSetRGB8OutputBuffer
   // has been/will be populated by Flush() / FinalizeFrame(), or if a pixel
   // callback has been used.
@@ -217,8 +294,8 @@ class FrameDecoder {
   // than the value of `num_tasks` passed here.
   Status PrepareStorage(size_t num_threads, size_t num_tasks) {
     size_t storage_size = std::min(num_threads, num_tasks);
-    if (storage_size > group_dec_caches_.size()) {
-      group_dec_caches_.resize(storage_size);
+    if (storage_size > dec_state_->group_dec_caches.size()) {
+      dec_state_->group_dec_caches.resize(storage_size);
     }
     use_task_id_ = num_threads > num_tasks;
     if (dec_state_->render_pipeline) {
@@ -241,6 +318,25 @@ class FrameDecoder {
   // premultiplied, then low memory options can be used
   // (uint8 output buffer or float pixel callback).
   // TODO(veluca): reduce this set of restrictions.
+  // Whether the pixels of the frame are the 8-bit integers of its modular
+  // image, so that they can be written to the RGB8 output buffer without
+  // going through the float render pipeline.
+  bool CanWriteModularToRGB8() const;
+
+  // Whether the render pipeline of the frame can stop at the YCbCr planes:
+  // no stage other than chroma upsampling and the YCbCr to RGB conversion
+  // may be needed, and the luma channel must not be subsampled.
+  bool CanOutputYCbCrPlanes() const;
+
+  // Whether the color channels written to the RGBA output buffer or callback
+  // must be multiplied by the alpha channel.
+  bool PremultipliesOutput() const {
+    const ExtraChannelInfo* alpha = decoded_->metadata()->Find(
+        ExtraChannel::kAlpha);
+    return premultiply_alpha_ && dec_state_->rgb_output_is_rgba &&
+           alpha != nullptr && !alpha->alpha_associated;
+  }
+
   bool CanDoLowMemoryPath(bool undo_orientation) const {
     return !(undo_orientation &&
              decoded_->metadata()->GetOrientation() != Orientation::kIdentity);
@@ -260,10 +356,35 @@ class FrameDecoder {
   bool allow_partial_dc_global_;
   bool render_spotcolors_ = true;
   bool coalescing_ = true;
+  bool premultiply_alpha_ = false;
+  bool allow_integer_idct_ = false;
+  RenderPipelineStats* render_stats_ = nullptr;
+  DecoderCounters* counters_ = nullptr;
+  ProgressMonitor* progress_ = nullptr;
+
+  // Counter for ScopedPhaseTimer, null if there are no counters.
+  std::atomic<uint64_t>* Timer(DecoderCounters::Phase phase) const {
+    return counters_ != nullptr ? counters_->Timer(phase) : nullptr;
+  }
+
+  // Marks the AC groups that don't need to be decoded due to the crop region.
+  void ComputeSkippedGroups();
 
   std::vector<uint8_t> processed_section_;
   std::vector<uint8_t> decoded_passes_per_ac_group_;
+  // AC groups that are not decoded nor rendered: their passes are counted as
+  // decoded as soon as their sections are given to ProcessSections, and their
+  // sections are not needed for HasDecodedAll.
+  std::vector<uint8_t> skipped_ac_groups_;
+  bool has_crop_region_ = false;
+  Rect crop_region_;
   std::vector<uint8_t> decoded_dc_groups_;
+  // With several DC groups, adaptive DC smoothing of a DC group into
+  // dc_smoothed_ is done by the last of the group and its neighbours to be
+  // decoded; dc_smoothing_pending_ counts the ones not decoded yet.
+  bool smooth_dc_per_group_ = false;
+  Image3F dc_smoothed_;
+  std::vector<std::atomic<uint32_t>> dc_smoothing_pending_;
   bool decoded_dc_global_;
   bool decoded_ac_global_;
   bool HasEverything() const;
@@ -271,10 +392,12 @@ class FrameDecoder {
   size_t num_sections_done_ = 0;
   bool is_finalized_ = true;
   size_t num_renders_ = 0;
+  // Passes of each AC group, and whether the AC global section was decoded, as
+  // of the previous Flush.
+  std::vector<uint8_t> flushed_passes_per_ac_group_;
+  bool flushed_ac_global_ = false;
   bool allocated_ = false;
 
-  std::vector<GroupDecCache> group_dec_caches_;
-
   // Frame size limits.
   const SizeConstraints* constraints_ = nullptr;
 
@@ -35,6 +35,7 @@
 #include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/entropy_coder.h"
 #include "lib/jxl/epf.h"
+#include "lib/jxl/fast_dct-inl.h"
 #include "lib/jxl/opsin_params.h"
 #include "lib/jxl/quant_weights.h"
 #include "lib/jxl/quantizer-inl.h"
@@ -48,9 +49,11 @@ namespace jxl {
 class GetBlock {
  public:
   virtual void StartRow(size_t by) = 0;
+  // Adds the coefficients of the block to `block`. Sets *has_ac to false only
+  // if none of the added coefficients are non-zero.
   virtual Status LoadBlock(size_t bx, size_t by, const AcStrategy& acs,
                            size_t size, size_t log2_covered_blocks,
-                           ACPtr block[3], ACType ac_type) = 0;
+                           ACPtr block[3], ACType ac_type, bool* has_ac) = 0;
   virtual ~GetBlock() {}
 };
 
@@ -131,14 +134,15 @@ void DequantLane(Vec<D> scaled_dequant_x, Vec<D> scaled_dequant_y,
 }
 
 template <ACType ac_type>
-void DequantBlock(const AcStrategy& acs, float inv_global_scale, int quant,
-                  float x_dm_multiplier, float b_dm_multiplier, Vec<D> x_cc_mul,
-                  Vec<D> b_cc_mul, size_t kind, size_t size,
-                  const Quantizer& quantizer, size_t covered_blocks,
-                  const size_t* sbx,
-                  const float* JXL_RESTRICT* JXL_RESTRICT dc_row,
-                  size_t dc_stride, const float* JXL_RESTRICT biases,
-                  ACPtr qblock[3], float* JXL_RESTRICT block) {
+HWY_INLINE void DequantBlock(const AcStrategy& acs, float inv_global_scale,
+                             int quant, float x_dm_multiplier,
+                             float b_dm_multiplier, Vec<D> x_cc_mul,
+                             Vec<D> b_cc_mul, size_t kind, size_t size,
+                             const Quantizer& quantizer, size_t covered_blocks,
+                             const size_t* sbx,
+                             const float* JXL_RESTRICT* JXL_RESTRICT dc_row,
+                             size_t dc_stride, const float* JXL_RESTRICT biases,
+                             ACPtr qblock[3], float* JXL_RESTRICT block) {
   PROFILER_FUNC;
 
   const auto scaled_dequant_s = inv_global_scale / quant;
@@ -155,15 +159,192 @@ void DequantBlock(const AcStrategy& acs, float inv_global_scale, int quant,
                          qblock, block);
   }
   for (size_t c = 0; c < 3; c++) {
-    LowestFrequenciesFromDC(acs.Strategy(), dc_row[c] + sbx[c], dc_stride,
-                            block + c * size);
+    LowestFrequenciesFromDCInline(acs.Strategy(), dc_row[c] + sbx[c],
+                                  dc_stride, block + c * size);
   }
 }
 
+#if HWY_TARGET == HWY_NEON
+// Same as ComputeScaledIDCT<ROWS, COLS>, but converts the coefficients to
+// int16 and uses the fixed-point inverse DCT, with as many fractional bits as
+// allow outputs in [-2, 2].
+template <size_t ROWS, size_t COLS>
+void IntegerIDCT(const float* JXL_RESTRICT coefficients,
+                 float* JXL_RESTRICT pixels, size_t pixels_stride,
+                 int16_t* JXL_RESTRICT scratch_space) {
+  constexpr size_t kRowBits = FastIDCTIntegerBits(FastDCTTag<ROWS>());
+  constexpr size_t kColBits = FastIDCTIntegerBits(FastDCTTag<COLS>());
+  constexpr size_t kIntegerBits = kRowBits > kColBits ? kRowBits : kColBits;
+  static_assert(kIntegerBits <= 14, "Not enough range for [-2, 2] outputs");
+  constexpr size_t kSize = ROWS * COLS;
+  constexpr float kScale = 1 << (14 - kIntegerBits);
+  int16_t* JXL_RESTRICT from = scratch_space;
+  int16_t* JXL_RESTRICT to = scratch_space + kSize;
+  const auto scale = Set(d, kScale);
+  for (size_t k = 0; k < kSize; k += Lanes(d)) {
+    const auto in = NearestInt(Load(d, coefficients + k) * scale);
+    Store(DemoteTo(di16, in), di16, from + k);
+  }
+  ComputeFastScaledIDCT<ROWS, COLS>()(from, to, COLS,
+                                      scratch_space + 2 * kSize);
+  const auto inv_scale = Set(d, 1.0f / kScale);
+  for (size_t y = 0; y < ROWS; y++) {
+    for (size_t x = 0; x < COLS; x += Lanes(d)) {
+      const auto out = PromoteTo(di, Load(di16, to + y * COLS + x));
+      Store(ConvertTo(d, out) * inv_scale, d, pixels + y * pixels_stride + x);
+    }
+  }
+}
+
+// Integer version of TransformToPixels for the DCT strategies with at least 8
+// rows and columns. Returns false for the other strategies, which are left
+// to TransformToPixels. scratch_space must have room for 3 blocks.
+bool IntegerTransformToPixels(AcStrategy::Type strategy,
+                              const float* JXL_RESTRICT coefficients,
+                              float* JXL_RESTRICT pixels, size_t pixels_stride,
+                              int16_t* JXL_RESTRICT scratch_space) {
+  using Type = AcStrategy::Type;
+  switch (strategy) {
+    case Type::DCT:
+      IntegerIDCT<8, 8>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT16X16:
+      IntegerIDCT<16, 16>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT16X8:
+      IntegerIDCT<16, 8>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT8X16:
+      IntegerIDCT<8, 16>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT32X8:
+      IntegerIDCT<32, 8>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT8X32:
+      IntegerIDCT<8, 32>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT32X16:
+      IntegerIDCT<32, 16>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT16X32:
+      IntegerIDCT<16, 32>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT32X32:
+      IntegerIDCT<32, 32>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT64X32:
+      IntegerIDCT<64, 32>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT32X64:
+      IntegerIDCT<32, 64>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT64X64:
+      IntegerIDCT<64, 64>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT128X64:
+      IntegerIDCT<128, 64>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT64X128:
+      IntegerIDCT<64, 128>(coefficients, pixels, pixels_stride, scratch_space);
+      return true;
+    case Type::DCT128X128:
+      IntegerIDCT<128, 128>(coefficients, pixels, pixels_stride,
+                            scratch_space);
+      return true;
+    case Type::DCT256X128:
+      IntegerIDCT<256, 128>(coefficients, pixels, pixels_stride,
+                            scratch_space);
+      return true;
+    case Type::DCT128X256:
+      IntegerIDCT<128, 256>(coefficients, pixels, pixels_stride,
+                            scratch_space);
+      return true;
+    case Type::DCT256X256:
+      IntegerIDCT<256, 256>(coefficients, pixels, pixels_stride,
+                            scratch_space);
+      return true;
+    default:
+      return false;
+  }
+}
+#endif
+
+// Dequantizes the block (including CfL and the lowest frequencies from DC) and
+// transforms it to pixels at idct_pos. Channels with a null idct_pos are not
+// transformed. There is one instance per AC strategy, so that the block size,
+// the dequantization loop bounds and the choice of transforms are all known at
+// compile time.
+template <size_t kRawStrategy>
+void DequantAndTransformToPixels(
+    ACType ac_type, float inv_global_scale, int quant, float x_dm_multiplier,
+    float b_dm_multiplier, Vec<D> x_cc_mul, Vec<D> b_cc_mul,
+    const Quantizer& quantizer, const size_t* sbx,
+    const float* JXL_RESTRICT* JXL_RESTRICT dc_row, size_t dc_stride,
+    const float* JXL_RESTRICT biases, ACPtr qblock[3],
+    float* JXL_RESTRICT* idct_pos, const size_t* idct_stride,
+    bool use_integer_idct, GroupDecCache* JXL_RESTRICT group_dec_cache) {
+  constexpr AcStrategy::Type kStrategy =
+      static_cast<AcStrategy::Type>(kRawStrategy);
+  const AcStrategy acs = AcStrategy::FromRawStrategy(kStrategy);
+  const size_t covered_blocks = acs.covered_blocks_x() * acs.covered_blocks_y();
+  const size_t size = covered_blocks * kDCTBlockSize;
+  float* JXL_RESTRICT block = group_dec_cache->dec_group_block;
+  if (ac_type == ACType::k16) {
+    DequantBlock<ACType::k16>(acs, inv_global_scale, quant, x_dm_multiplier,
+                              b_dm_multiplier, x_cc_mul, b_cc_mul, kRawStrategy,
+                              size, quantizer, covered_blocks, sbx, dc_row,
+                              dc_stride, biases, qblock, block);
+  } else {
+    DequantBlock<ACType::k32>(acs, inv_global_scale, quant, x_dm_multiplier,
+                              b_dm_multiplier, x_cc_mul, b_cc_mul, kRawStrategy,
+                              size, quantizer, covered_blocks, sbx, dc_row,
+                              dc_stride, biases, qblock, block);
+  }
+  (void)use_integer_idct;
+  for (size_t c : {1, 0, 2}) {
+    if (idct_pos[c] == nullptr) continue;
+#if HWY_TARGET == HWY_NEON
+    if (use_integer_idct &&
+        IntegerTransformToPixels(kStrategy, block + c * size, idct_pos[c],
+                                 idct_stride[c],
+                                 group_dec_cache->dec_group_qblock16)) {
+      continue;
+    }
+#endif
+    TransformToPixelsInline(kStrategy, block + c * size, idct_pos[c],
+                            idct_stride[c], group_dec_cache->scratch_space);
+  }
+}
+
+using DequantAndTransformToPixelsFn = decltype(&DequantAndTransformToPixels<0>);
+
+// Indexed by raw strategy.
+constexpr DequantAndTransformToPixelsFn kDequantAndTransformToPixels[] = {
+    &DequantAndTransformToPixels<0>,  &DequantAndTransformToPixels<1>,
+    &DequantAndTransformToPixels<2>,  &DequantAndTransformToPixels<3>,
+    &DequantAndTransformToPixels<4>,  &DequantAndTransformToPixels<5>,
+    &DequantAndTransformToPixels<6>,  &DequantAndTransformToPixels<7>,
+    &DequantAndTransformToPixels<8>,  &DequantAndTransformToPixels<9>,
+    &DequantAndTransformToPixels<10>, &DequantAndTransformToPixels<11>,
+    &DequantAndTransformToPixels<12>, &DequantAndTransformToPixels<13>,
+    &DequantAndTransformToPixels<14>, &DequantAndTransformToPixels<15>,
+    &DequantAndTransformToPixels<16>, &DequantAndTransformToPixels<17>,
+    &DequantAndTransformToPixels<18>, &DequantAndTransformToPixels<19>,
+    &DequantAndTransformToPixels<20>, &DequantAndTransformToPixels<21>,
+    &DequantAndTransformToPixels<22>, &DequantAndTransformToPixels<23>,
+    &DequantAndTransformToPixels<24>, &DequantAndTransformToPixels<25>,
+    &DequantAndTransformToPixels<26>,
+};
+static_assert(sizeof(kDequantAndTransformToPixels) /
+                      sizeof(*kDequantAndTransformToPixels) ==
+                  AcStrategy::kNumValidStrategies,
+              "Update kDequantAndTransformToPixels");
+
 Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
                        GroupDecCache* JXL_RESTRICT group_dec_cache,
                        PassesDecoderState* JXL_RESTRICT dec_state,
                        size_t thread, size_t group_idx,
+                       ACImage* JXL_RESTRICT coefficients,
                        RenderPipelineInput& render_pipeline_input,
                        ImageBundle* decoded, DrawMode draw) {
   // TODO(veluca): investigate cache usage in this function.
@@ -188,12 +369,10 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
 
   HWY_ALIGN int32_t scaled_qtable[64 * 3];
 
-  ACType ac_type = dec_state->coefficients->Type();
-  auto dequant_block = ac_type == ACType::k16 ? DequantBlock<ACType::k16>
-                                              : DequantBlock<ACType::k32>;
+  ACType ac_type = dec_state->coefficients_type;
   // Whether or not coefficients should be stored for future usage, and/or read
   // from past usage.
-  bool accumulate = !dec_state->coefficients->IsEmpty();
+  bool accumulate = coefficients != nullptr;
   // Offset of the current block in the group.
   size_t offset = 0;
 
@@ -310,7 +489,7 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
         ACPtr qblock[3];
         if (accumulate) {
           for (size_t c = 0; c < 3; c++) {
-            qblock[c] = dec_state->coefficients->PlaneRow(c, group_idx, offset);
+            qblock[c] = coefficients->PlaneRow(c, 0, offset);
           }
         } else {
           // No point in reading from bitstream without accumulating and not
@@ -330,8 +509,9 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
             }
           }
         }
+        bool has_ac;
         JXL_RETURN_IF_ERROR(get_block->LoadBlock(
-            bx, by, acs, size, log2_covered_blocks, qblock, ac_type));
+            bx, by, acs, size, log2_covered_blocks, qblock, ac_type, &has_ac));
         offset += size;
         if (draw == kDontDraw) {
           bx += llf_x;
@@ -394,26 +574,34 @@ Status DecodeGroupImpl(GetBlock* JXL_RESTRICT get_block,
                 Clamp1<float>(dc_rows[c][sbx[c]] - dcoff[c], -2047, 2047);
           }
         } else {
-          HWY_ALIGN float* const block = group_dec_cache->dec_group_block;
-          // Dequantize and add predictions.
-          dequant_block(
-              acs, inv_global_scale, row_quant[bx], dec_state->x_dm_multiplier,
-              dec_state->b_dm_multiplier, x_cc_mul, b_cc_mul, acs.RawStrategy(),
-              size, dec_state->shared->quantizer,
-              acs.covered_blocks_y() * acs.covered_blocks_x(), sbx, dc_rows,
-              dc_stride,
-              dec_state->output_encoding_info.opsin_params.quant_biases, qblock,
-              block);
-
-          for (size_t c : {1, 0, 2}) {
-            if ((sbx[c] << hshift[c] != bx) || (sby[c] << vshift[c] != by)) {
-              continue;
+          float* JXL_RESTRICT idct_pos[3];
+          for (size_t c = 0; c < 3; c++) {
+            idct_pos[c] = nullptr;
+            if ((sbx[c] << hshift[c] == bx) && (sby[c] << vshift[c] == by)) {
+              idct_pos[c] = idct_row[c] + sbx[c] * kBlockDim;
+            }
+          }
+          if (!accumulate && !has_ac &&
+              acs.Strategy() == AcStrategy::Type::DCT) {
+            // Only the DC is non-zero, so the IDCT is constant.
+            for (size_t c = 0; c < 3; c++) {
+              if (idct_pos[c] == nullptr) continue;
+              const float dc = dc_rows[c][sbx[c]];
+              for (size_t iy = 0; iy < kBlockDim; iy++) {
+                std::fill_n(idct_pos[c] + iy * idct_stride[c], kBlockDim, dc);
+              }
             }
-            // IDCT
-            float* JXL_RESTRICT idct_pos = idct_row[c] + sbx[c] * kBlockDim;
-            TransformToPixels(acs.Strategy(), block + c * size, idct_pos,
-                              idct_stride[c], group_dec_cache->scratch_space);
+            bx += llf_x;
+            continue;
           }
+          // Dequantize, add predictions and IDCT.
+          kDequantAndTransformToPixels[acs.RawStrategy()](
+              ac_type, inv_global_scale, row_quant[bx],
+              dec_state->x_dm_multiplier, dec_state->b_dm_multiplier, x_cc_mul,
+              b_cc_mul, dec_state->shared->quantizer, sbx, dc_rows, dc_stride,
+              dec_state->output_encoding_info.opsin_params.quant_biases, qblock,
+              idct_pos, idct_stride, dec_state->use_integer_idct,
+              group_dec_cache);
         }
         bx += llf_x;
       }
@@ -435,7 +623,7 @@ namespace jxl {
 namespace {
 // Decode quantized AC coefficients of DCT blocks.
 // LLF components in the output block will not be modified.
-template <ACType ac_type>
+template <ACType ac_type, bool uses_lz77>
 Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
                         int32_t* JXL_RESTRICT row_nzeros,
                         const int32_t* JXL_RESTRICT row_nzeros_top,
@@ -463,7 +651,8 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
   const int32_t nzero_ctx =
       block_ctx_map.NonZeroContext(predicted_nzeros, block_ctx) + ctx_offset;
 
-  size_t nzeros = decoder->ReadHybridUint(nzero_ctx, br, context_map);
+  size_t nzeros = decoder->ReadHybridUintClusteredInlined<uses_lz77>(
+      context_map[nzero_ctx], br);
   if (nzeros + covered_blocks > size) {
     return JXL_FAILURE("Invalid AC: nzeros too large");
   }
@@ -485,7 +674,9 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
       const size_t ctx =
           histo_offset + ZeroDensityContext(nzeros, k, covered_blocks,
                                             log2_covered_blocks, prev);
-      const size_t u_coeff = decoder->ReadHybridUint(ctx, br, context_map);
+      const size_t u_coeff =
+          decoder->ReadHybridUintClusteredInlined<uses_lz77>(context_map[ctx],
+                                                             br);
       // Hand-rolled version of UnpackSigned, shifting before the conversion to
       // signed integer to avoid undefined behavior of shifting negative
       // numbers.
@@ -532,11 +723,15 @@ struct GetBlockFromBitstream : public GetBlock {
   }
 
   Status LoadBlock(size_t bx, size_t by, const AcStrategy& acs, size_t size,
-                   size_t log2_covered_blocks, ACPtr block[3],
-                   ACType ac_type) override {
-    auto decode_ac_varblock = ac_type == ACType::k16
-                                  ? DecodeACVarBlock<ACType::k16>
-                                  : DecodeACVarBlock<ACType::k32>;
+                   size_t log2_covered_blocks, ACPtr block[3], ACType ac_type,
+                   bool* has_ac) override {
+    *has_ac = false;
+    auto decode_ac_varblock =
+        ac_type == ACType::k16
+            ? (uses_lz77 ? DecodeACVarBlock<ACType::k16, true>
+                         : DecodeACVarBlock<ACType::k16, false>)
+            : (uses_lz77 ? DecodeACVarBlock<ACType::k32, true>
+                         : DecodeACVarBlock<ACType::k32, false>);
     for (size_t c : {1, 0, 2}) {
       size_t sbx = bx >> hshift[c];
       size_t sby = by >> vshift[c];
@@ -551,6 +746,7 @@ struct GetBlockFromBitstream : public GetBlock {
             &coeff_orders[pass * coeff_order_size], readers[pass],
             &decoders[pass], context_map[pass], quant_dc_row, qf_row,
             *block_ctx_map, block[c], shift_for_pass[pass]));
+        *has_ac |= row_nzeros[pass][c][sbx] != 0;
       }
     }
     return true;
@@ -592,6 +788,11 @@ struct GetBlockFromBitstream : public GetBlock {
       decoders[pass] =
           ANSSymbolReader(&dec_state->code[pass + first_pass], readers[pass]);
     }
+    // The LZ77 checks can only be skipped if no pass uses LZ77.
+    uses_lz77 = false;
+    for (size_t pass = 0; pass < num_passes; pass++) {
+      uses_lz77 |= decoders[pass].UsesLZ77();
+    }
     nzeros_stride = group_dec_cache->num_nzeroes[0].PixelsPerRow();
     for (size_t i = 0; i < num_passes; i++) {
       JXL_ASSERT(
@@ -609,6 +810,7 @@ struct GetBlockFromBitstream : public GetBlock {
   BitReader* JXL_RESTRICT* JXL_RESTRICT readers;
   size_t num_passes;
   size_t ctx_offset[kMaxNumPasses];
+  bool uses_lz77 = false;
   size_t nzeros_stride;
   int32_t* JXL_RESTRICT row_nzeros[kMaxNumPasses][3];
   const int32_t* JXL_RESTRICT row_nzeros_top[kMaxNumPasses][3];
@@ -626,9 +828,10 @@ struct GetBlockFromEncoder : public GetBlock {
   void StartRow(size_t by) override {}
 
   Status LoadBlock(size_t bx, size_t by, const AcStrategy& acs, size_t size,
-                   size_t log2_covered_blocks, ACPtr block[3],
-                   ACType ac_type) override {
+                   size_t log2_covered_blocks, ACPtr block[3], ACType ac_type,
+                   bool* has_ac) override {
     JXL_DASSERT(ac_type == ACType::k32);
+    *has_ac = true;
     for (size_t c = 0; c < 3; c++) {
       // for each pass
       for (size_t i = 0; i < quantized_ac->size(); i++) {
@@ -760,8 +963,26 @@ Status DecodeGroup(BitReader* JXL_RESTRICT* JXL_RESTRICT readers,
                      dec_state->shared->BlockGroupRect(group_idx),
                      group_dec_cache, dec_state, first_pass));
 
+  // Frames with several passes accumulate the coefficients of each group in
+  // storage allocated when the first pass of the group arrives. Drawing a
+  // group before any pass arrived needs no storage, its AC is all zero, and
+  // neither does decoding all of its passes at once, which accumulates them
+  // in the block being dequantized.
+  const bool all_passes =
+      first_pass == 0 &&
+      num_passes == dec_state->shared->frame_header.passes.num_passes;
+  ACImage* coefficients = nullptr;
+  if (!dec_state->group_coefficients.empty() && !all_passes) {
+    std::unique_ptr<ACImage>& storage =
+        dec_state->group_coefficients[group_idx];
+    if (!storage && num_passes > 0) {
+      storage = dec_state->NewGroupCoefficients();
+    }
+    coefficients = storage.get();
+  }
+
   JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(DecodeGroupImpl)(
-      &get_block, group_dec_cache, dec_state, thread, group_idx,
+      &get_block, group_dec_cache, dec_state, thread, group_idx, coefficients,
       render_pipeline_input, decoded, draw));
 
   for (size_t pass = 0; pass < num_passes; pass++) {
@@ -790,7 +1011,7 @@ Status DecodeGroupForRoundtrip(const std::vector<std::unique_ptr<ACImage>>& ac,
 
   return HWY_DYNAMIC_DISPATCH(DecodeGroupImpl)(
       &get_block, group_dec_cache, dec_state, thread, group_idx,
-      render_pipeline_input, decoded, kDraw);
+      /*coefficients=*/nullptr, render_pipeline_input, decoded, kDraw);
 }
 
 }  // namespace jxl
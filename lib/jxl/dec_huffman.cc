@@ -11,6 +11,7 @@
 
 #include "lib/jxl/ans_params.h"
 #include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/status.h"
 #include "lib/jxl/huffman_table.h"
 
 namespace jxl {
@@ -252,4 +253,28 @@ uint16_t HuffmanDecodingData::ReadSymbol(BitReader* br) const {
   return table->value;
 }
 
+void HuffmanDecodingData::BuildMultiSymbolTable(
+    uint32_t max_symbol, std::vector<HuffmanMultiCode>* table) const {
+  JXL_DASSERT(max_symbol <= 256);
+  table->resize(1u << kHuffmanMultiTableBits);
+  for (size_t i = 0; i < table->size(); i++) {
+    HuffmanMultiCode& entry = (*table)[i];
+    entry.num_symbols = 0;
+    size_t pos = 0;
+    while (entry.num_symbols < kMaxHuffmanMultiSymbols) {
+      // The bits past the end of i are zero, which is fine for codes that
+      // end before them.
+      const HuffmanCode& code =
+          table_[(i >> pos) & ((1u << kHuffmanTableBits) - 1)];
+      if (code.bits > kHuffmanTableBits) break;  // second level
+      if (pos + code.bits > kHuffmanMultiTableBits) break;
+      if (code.value >= max_symbol) break;
+      pos += code.bits;
+      entry.bits[entry.num_symbols] = pos;
+      entry.symbols[entry.num_symbols] = code.value;
+      entry.num_symbols++;
+    }
+  }
+}
+
 }  // namespace jxl
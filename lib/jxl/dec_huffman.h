@@ -16,6 +16,18 @@ namespace jxl {
 
 static constexpr size_t kHuffmanTableBits = 8u;
 
+// Multi-symbol lookup: the next kHuffmanMultiTableBits bits of the stream
+// index the decoding of up to kMaxHuffmanMultiSymbols consecutive short codes.
+static constexpr size_t kHuffmanMultiTableBits = 10u;
+static constexpr size_t kMaxHuffmanMultiSymbols = 4u;
+
+struct HuffmanMultiCode {
+  uint8_t num_symbols;
+  // bits[i] is the total length of the codes of symbols 0..i.
+  uint8_t bits[kMaxHuffmanMultiSymbols];
+  uint8_t symbols[kMaxHuffmanMultiSymbols];
+};
+
 struct HuffmanDecodingData {
   // Decodes the Huffman code lengths from the bit-stream and fills in the
   // pre-allocated table with the corresponding 2-level Huffman decoding table.
@@ -24,6 +36,14 @@ struct HuffmanDecodingData {
 
   uint16_t ReadSymbol(BitReader* br) const;
 
+  // Fills `table` with 1 << kHuffmanMultiTableBits entries giving, for each
+  // value of the next bits of the stream, the longest run (up to
+  // kMaxHuffmanMultiSymbols) of symbols below max_symbol whose codes fit in
+  // those bits. Entries with num_symbols == 0 need ReadSymbol. max_symbol
+  // must be at most 256.
+  void BuildMultiSymbolTable(uint32_t max_symbol,
+                             std::vector<HuffmanMultiCode>* table) const;
+
   std::vector<HuffmanCode> table_;
 };
 
@@ -23,6 +23,7 @@
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/compressed_dc.h"
 #include "lib/jxl/epf.h"
+#include "lib/jxl/image_ops.h"
 #include "lib/jxl/modular/encoding/encoding.h"
 #include "lib/jxl/modular/modular_image.h"
 #include "lib/jxl/modular/transform/transform.h"
@@ -151,7 +152,8 @@ void int_to_float(const pixel_type* const JXL_RESTRICT row_in,
 
 Status ModularFrameDecoder::DecodeGlobalInfo(BitReader* reader,
                                              const FrameHeader& frame_header,
-                                             bool allow_truncated_group) {
+                                             bool allow_truncated_group,
+                                             HistogramCache* histogram_cache) {
   bool decode_color = frame_header.encoding == FrameEncoding::kModular;
   const auto& metadata = frame_header.nonserialized_metadata->m;
   bool is_gray = metadata.color_encoding.IsGray();
@@ -170,8 +172,8 @@ Status ModularFrameDecoder::DecodeGlobalInfo(BitReader* reader,
                    1024 + frame_dim.xsize * frame_dim.ysize *
                               (nb_chans + nb_extra) / 16);
       JXL_RETURN_IF_ERROR(DecodeTree(reader, &tree, tree_size_limit));
-      JXL_RETURN_IF_ERROR(
-          DecodeHistograms(reader, (tree.size() + 1) / 2, &code, &context_map));
+      JXL_RETURN_IF_ERROR(histogram_cache->Decode(
+          reader, (tree.size() + 1) / 2, &code, &context_map));
     }
   }
   if (!do_color) nb_chans = 0;
@@ -265,7 +267,7 @@ Status ModularFrameDecoder::DecodeGroup(
     const Rect& rect, BitReader* reader, int minShift, int maxShift,
     const ModularStreamId& stream, bool zerofill, PassesDecoderState* dec_state,
     RenderPipelineInput* render_pipeline_input, ImageBundle* output,
-    bool allow_truncated) {
+    bool allow_truncated, ThreadPool* pool) {
   JXL_DASSERT(stream.kind == ModularStreamId::kModularDC ||
               stream.kind == ModularStreamId::kModularAC);
   const size_t xsize = rect.xsize();
@@ -315,9 +317,13 @@ Status ModularFrameDecoder::DecodeGroup(
   if (!use_full_image) {
     JXL_ASSERT(render_pipeline_input);
     for (auto t : global_transform) {
-      JXL_RETURN_IF_ERROR(t.Inverse(gi, global_header.wp_header));
+      JXL_RETURN_IF_ERROR(t.Inverse(gi, global_header.wp_header, pool));
+    }
+    if (dec_state->lossless_modular_rgb8_output) {
+      return ModularImageToRGB8(gi, dec_state, Rect(0, 0, gi.w, gi.h),
+                                rect.x0(), rect.y0());
     }
-    JXL_RETURN_IF_ERROR(ModularImageToDecodedRect(gi, dec_state, nullptr,
+    JXL_RETURN_IF_ERROR(ModularImageToDecodedRect(gi, dec_state, pool,
                                                   *render_pipeline_input,
                                                   Rect(0, 0, gi.w, gi.h)));
     return true;
@@ -590,7 +596,15 @@ Status ModularFrameDecoder::ModularImageToDecodedRect(
     }
   }
   size_t num_extra_channels = metadata->m.num_extra_channels;
+  JXL_DASSERT(dec_state->extra_channel_needed.size() == num_extra_channels);
   for (size_t ec = 0; ec < num_extra_channels; ec++, c++) {
+    if (!dec_state->extra_channel_needed[ec]) {
+      // The pipeline does not upsample it, so the input may be larger than
+      // the modular channel.
+      const auto& buffer = render_pipeline_input.GetBuffer(3 + ec);
+      ZeroFillPlane(buffer.first, buffer.second);
+      continue;
+    }
     const ExtraChannelInfo& eci = metadata->m.extra_channel_info[ec];
     int bits = eci.bit_depth.bits_per_sample;
     int exp_bits = eci.bit_depth.exponent_bits_per_sample;
@@ -625,6 +639,82 @@ Status ModularFrameDecoder::ModularImageToDecodedRect(
   return true;
 }
 
+Status ModularFrameDecoder::ModularImageToRGB8(const Image& gi,
+                                               PassesDecoderState* dec_state,
+                                               const Rect& modular_rect,
+                                               size_t x0, size_t y0) {
+  const auto* metadata = dec_state->shared->frame_header.nonserialized_metadata;
+  JXL_CHECK(gi.transform.empty());
+  // Gray images are written as RGB with equal channels.
+  const size_t num_color = metadata->m.color_encoding.IsGray() ? 1 : 3;
+  const Channel* channels[4] = {};
+  for (size_t c = 0; c < 3; c++) {
+    if (c >= num_color) {
+      channels[c] = channels[0];
+      continue;
+    }
+    if (c >= gi.channel.size()) return JXL_FAILURE("Missing color channel");
+    channels[c] = &gi.channel[c];
+  }
+  const std::vector<ExtraChannelInfo>& extra_channels =
+      metadata->m.extra_channel_info;
+  for (size_t ec = 0; ec < extra_channels.size(); ec++) {
+    if (extra_channels[ec].type == ExtraChannel::kAlpha) {
+      if (num_color + ec >= gi.channel.size()) {
+        return JXL_FAILURE("Missing alpha channel");
+      }
+      channels[3] = &gi.channel[num_color + ec];
+      break;
+    }
+  }
+  const Rect rect = modular_rect.Crop(channels[0]->plane);
+  for (const Channel* ch : channels) {
+    if (ch == nullptr) continue;
+    if (ch->hshift != 0 || ch->vshift != 0 ||
+        modular_rect.Crop(ch->plane).xsize() != rect.xsize() ||
+        modular_rect.Crop(ch->plane).ysize() != rect.ysize()) {
+      return JXL_FAILURE("Unexpected channel dimensions");
+    }
+  }
+
+  const size_t bytes = dec_state->rgb_output_is_rgba ? 4 : 3;
+  const size_t ysize = std::min(rect.ysize(), metadata->ysize() - y0);
+  const auto to_u8 = [](pixel_type v) {
+    return static_cast<uint8_t>(std::min(std::max(v, 0), 255));
+  };
+  for (size_t y = 0; y < ysize; y++) {
+    const pixel_type* JXL_RESTRICT row_r = rect.ConstRow(channels[0]->plane, y);
+    const pixel_type* JXL_RESTRICT row_g = rect.ConstRow(channels[1]->plane, y);
+    const pixel_type* JXL_RESTRICT row_b = rect.ConstRow(channels[2]->plane, y);
+    uint8_t* JXL_RESTRICT row_out =
+        dec_state->rgb_output + (y0 + y) * dec_state->rgb_stride + bytes * x0;
+    if (bytes == 3) {
+      for (size_t x = 0; x < rect.xsize(); x++) {
+        row_out[3 * x + 0] = to_u8(row_r[x]);
+        row_out[3 * x + 1] = to_u8(row_g[x]);
+        row_out[3 * x + 2] = to_u8(row_b[x]);
+      }
+    } else if (channels[3] != nullptr) {
+      const pixel_type* JXL_RESTRICT row_a =
+          rect.ConstRow(channels[3]->plane, y);
+      for (size_t x = 0; x < rect.xsize(); x++) {
+        row_out[4 * x + 0] = to_u8(row_r[x]);
+        row_out[4 * x + 1] = to_u8(row_g[x]);
+        row_out[4 * x + 2] = to_u8(row_b[x]);
+        row_out[4 * x + 3] = to_u8(row_a[x]);
+      }
+    } else {
+      for (size_t x = 0; x < rect.xsize(); x++) {
+        row_out[4 * x + 0] = to_u8(row_r[x]);
+        row_out[4 * x + 1] = to_u8(row_g[x]);
+        row_out[4 * x + 2] = to_u8(row_b[x]);
+        row_out[4 * x + 3] = 255;
+      }
+    }
+  }
+  return true;
+}
+
 Status ModularFrameDecoder::FinalizeDecoding(PassesDecoderState* dec_state,
                                              jxl::ThreadPool* pool,
                                              ImageBundle* output,
@@ -645,8 +735,25 @@ Status ModularFrameDecoder::FinalizeDecoding(PassesDecoderState* dec_state,
   if (gi.error) return JXL_FAILURE("Undoing transforms failed");
 
   std::atomic<bool> has_error{false};
+  if (dec_state->lossless_modular_rgb8_output) {
+    JXL_RETURN_IF_ERROR(RunOnPool(
+        pool, 0, dec_state->shared->frame_dim.num_groups, ThreadPool::NoInit,
+        [&](const uint32_t group, size_t /* thread */) {
+          const Rect rect = dec_state->shared->GroupRect(group);
+          if (!ModularImageToRGB8(gi, dec_state, rect, rect.x0(), rect.y0())) {
+            has_error = true;
+          }
+        },
+        "ModularToRGB8"));
+    if (has_error) return JXL_FAILURE("Error writing the RGB8 output");
+    return true;
+  }
+  // A single group runs on the calling thread, see ThreadPool::Run, and can
+  // then use the pool for its rows.
+  const size_t num_groups = dec_state->shared->frame_dim.num_groups;
+  ThreadPool* group_pool = num_groups == 1 ? pool : nullptr;
   JXL_RETURN_IF_ERROR(RunOnPool(
-      pool, 0, dec_state->shared->frame_dim.num_groups,
+      pool, 0, num_groups,
       [&](size_t num_threads) {
         return dec_state->render_pipeline->PrepareForThreads(
             num_threads,
@@ -656,7 +763,7 @@ Status ModularFrameDecoder::FinalizeDecoding(PassesDecoderState* dec_state,
       [&](const uint32_t group, size_t thread_id) {
         RenderPipelineInput input =
             dec_state->render_pipeline->GetInputBuffers(group, thread_id);
-        if (!ModularImageToDecodedRect(gi, dec_state, nullptr, input,
+        if (!ModularImageToDecodedRect(gi, dec_state, group_pool, input,
                                        dec_state->shared->GroupRect(group))) {
           has_error = true;
           return;
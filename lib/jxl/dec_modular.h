@@ -87,13 +87,19 @@ struct ModularStreamId {
 class ModularFrameDecoder {
  public:
   void Init(const FrameDimensions& frame_dim) { this->frame_dim = frame_dim; }
+  // The histograms of the global tree go through histogram_cache.
   Status DecodeGlobalInfo(BitReader* reader, const FrameHeader& frame_header,
-                          bool allow_truncated_group);
+                          bool allow_truncated_group,
+                          HistogramCache* histogram_cache);
+  // The entropy decoding of a group is serial; `pool`, if not null, is used
+  // for the global transforms pushed to the group and the conversion to the
+  // render pipeline input, so it must not be called from a task of `pool`.
   Status DecodeGroup(const Rect& rect, BitReader* reader, int minShift,
                      int maxShift, const ModularStreamId& stream, bool zerofill,
                      PassesDecoderState* dec_state,
                      RenderPipelineInput* render_pipeline_input,
-                     ImageBundle* output, bool allow_truncated);
+                     ImageBundle* output, bool allow_truncated,
+                     ThreadPool* pool);
   // Decodes a VarDCT DC group (`group_id`) from the given `reader`.
   Status DecodeVarDCTDC(size_t group_id, BitReader* reader,
                         PassesDecoderState* dec_state);
@@ -121,6 +127,12 @@ class ModularFrameDecoder {
                                    jxl::ThreadPool* pool,
                                    RenderPipelineInput& render_pipeline_input,
                                    Rect modular_rect);
+  // Writes `modular_rect` of the color and alpha channels of `gi` as integers
+  // to the RGB8 output buffer of `dec_state`, at (x0, y0), instead of passing
+  // them to the render pipeline as floats. Only used if
+  // dec_state->lossless_modular_rgb8_output is set.
+  Status ModularImageToRGB8(const Image& gi, PassesDecoderState* dec_state,
+                            const Rect& modular_rect, size_t x0, size_t y0);
 
   Image full_image;
   std::vector<Transform> global_transform;
@@ -14,6 +14,7 @@
 #include <limits>
 
 #include "lib/jxl/base/override.h"
+#include "lib/jxl/render_pipeline/render_pipeline_stats.h"
 
 namespace jxl {
 
@@ -45,6 +46,10 @@ struct DecompressParams {
   // Internal test-only setting: whether or not to use the slow rendering
   // pipeline.
   bool use_slow_render_pipeline = false;
+
+  // If not null, the time spent and data processed by each render pipeline
+  // stage are added to it.
+  RenderPipelineStats* render_stats = nullptr;
 };
 
 }  // namespace jxl
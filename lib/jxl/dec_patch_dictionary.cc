@@ -172,24 +172,46 @@ int PatchDictionary::GetReferences() const {
 void PatchDictionary::ComputePatchCache() {
   patch_starts_.clear();
   sorted_patches_.clear();
+  num_cells_x_ = 0;
   if (positions_.empty()) return;
-  std::vector<std::pair<size_t, size_t>> sorted_patches_y;
+  size_t xsize = 0;
+  size_t ysize = 0;
+  size_t patch_rows = 0;
+  for (const PatchPosition& pos : positions_) {
+    xsize = std::max(xsize, pos.x + pos.ref_pos.xsize);
+    ysize = std::max(ysize, pos.y + pos.ref_pos.ysize);
+    patch_rows += pos.ref_pos.ysize;
+  }
+  // Limit the number of cells so that the index size stays proportional to
+  // the number of patch rows also for very wide frames with few patches.
+  num_cells_x_ = std::max<size_t>(
+      1, std::min(DivCeil(xsize, kMinPatchCellDim),
+                  1 + patch_rows / std::max<size_t>(1, ysize)));
+  cell_dim_ = std::max<size_t>(1, DivCeil(xsize, num_cells_x_));
+  std::vector<std::pair<size_t, size_t>> sorted_patches_cell;
   for (size_t i = 0; i < positions_.size(); i++) {
     const PatchPosition& pos = positions_[i];
+    if (pos.ref_pos.xsize == 0) continue;
+    const size_t cx0 = pos.x / cell_dim_;
+    const size_t cx1 = (pos.x + pos.ref_pos.xsize - 1) / cell_dim_;
     for (size_t y = pos.y; y < pos.y + pos.ref_pos.ysize; y++) {
-      sorted_patches_y.emplace_back(y, i);
+      for (size_t cx = cx0; cx <= cx1; cx++) {
+        sorted_patches_cell.emplace_back(y * num_cells_x_ + cx, i);
+      }
     }
   }
+  if (sorted_patches_cell.empty()) return;
   // The relative order of patches that affect the same pixels is preserved.
   // This is important for patches that have a blend mode different from kAdd.
-  std::sort(sorted_patches_y.begin(), sorted_patches_y.end());
-  patch_starts_.resize(sorted_patches_y.back().first + 2,
-                       sorted_patches_y.size());
-  sorted_patches_.resize(sorted_patches_y.size());
-  for (size_t i = 0; i < sorted_patches_y.size(); i++) {
-    sorted_patches_[i] = sorted_patches_y[i].second;
-    patch_starts_[sorted_patches_y[i].first] =
-        std::min(patch_starts_[sorted_patches_y[i].first], i);
+  std::sort(sorted_patches_cell.begin(), sorted_patches_cell.end());
+  const size_t num_rows = sorted_patches_cell.back().first / num_cells_x_ + 1;
+  patch_starts_.resize(num_rows * num_cells_x_ + 1,
+                       sorted_patches_cell.size());
+  sorted_patches_.resize(sorted_patches_cell.size());
+  for (size_t i = 0; i < sorted_patches_cell.size(); i++) {
+    sorted_patches_[i] = sorted_patches_cell[i].second;
+    patch_starts_[sorted_patches_cell[i].first] =
+        std::min(patch_starts_[sorted_patches_cell[i].first], i);
   }
   for (size_t i = patch_starts_.size() - 1; i > 0; i--) {
     patch_starts_[i - 1] = std::min(patch_starts_[i], patch_starts_[i - 1]);
@@ -203,20 +225,14 @@ void PatchDictionary::AddOneRow(float* const* inout, size_t y, size_t x0,
   if (patch_starts_.empty()) return;
   size_t num_ec = shared_->metadata->m.num_extra_channels;
   std::vector<const float*> fg_ptrs(3 + num_ec);
-  if (y + 1 >= patch_starts_.size()) return;
-  for (size_t id = patch_starts_[y]; id < patch_starts_[y + 1]; id++) {
-    const PatchPosition& pos = positions_[sorted_patches_[id]];
+  ForEachPatchInRow(y, x0, x0 + xsize, [&](const PatchPosition& pos,
+                                           size_t patch_x0, size_t patch_x1) {
     size_t by = pos.y;
     size_t bx = pos.x;
-    size_t patch_xsize = pos.ref_pos.xsize;
     JXL_DASSERT(y >= by);
     JXL_DASSERT(y < by + pos.ref_pos.ysize);
     size_t iy = y - by;
     size_t ref = pos.ref_pos.ref;
-    if (bx >= x0 + xsize) continue;
-    if (bx + patch_xsize < x0) continue;
-    size_t patch_x0 = std::max(bx, x0);
-    size_t patch_x1 = std::min(bx + patch_xsize, x0 + xsize);
     for (size_t c = 0; c < 3; c++) {
       fg_ptrs[c] = shared_->reference_frames[ref].frame->color()->ConstPlaneRow(
                        c, pos.ref_pos.y0 + iy) +
@@ -232,6 +248,6 @@ void PatchDictionary::AddOneRow(float* const* inout, size_t y, size_t x0,
                     patch_x1 - patch_x0, pos.blending[0],
                     pos.blending.data() + 1,
                     shared_->metadata->m.extra_channel_info);
-  }
+  });
 }
 }  // namespace jxl
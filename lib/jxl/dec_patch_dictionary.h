@@ -12,6 +12,7 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <tuple>
 #include <vector>
 
@@ -136,18 +137,46 @@ class PatchDictionary {
   const PassesSharedState* shared_;
   std::vector<PatchPosition> positions_;
 
-  // Patch occurrences sorted by y.
+  // Minimum width of the columns of cells in which patches are indexed, so
+  // that a row segment only visits the patches that intersect it.
+  static constexpr size_t kMinPatchCellDim = kGroupDim;
+  // Number of cells in a row of the index and their width.
+  size_t num_cells_x_ = 0;
+  size_t cell_dim_ = kMinPatchCellDim;
+  // Patch occurrences sorted by y and cell column.
   std::vector<size_t> sorted_patches_;
-  // Index of the first patch for each y value.
+  // Index of the first patch for each cell, the cell at column cx of row y
+  // being at y * num_cells_x_ + cx.
   std::vector<size_t> patch_starts_;
 
-  // Patch IDs in position [patch_starts_[y], patch_start_[y+1]) of
+  // Patch IDs in position [patch_starts_[cell], patch_start_[cell+1]) of
   // sorted_patches_ are all the patches that intersect the horizontal line at
-  // y.
+  // y within that cell.
   // The relative order of patches that affect the same pixels is the same -
   // important when applying patches is noncommutative.
 
-  // Compute patches_by_y_ after updating positions_.
+  // Calls f(pos, px0, px1) for each patch that intersects [x0, x1) on row y,
+  // once per cell it covers, with [px0, px1) the part of the patch in that
+  // cell. Every pixel is visited in the same patch order as in positions_.
+  template <typename F>
+  void ForEachPatchInRow(size_t y, size_t x0, size_t x1, const F& f) const {
+    if ((y + 1) * num_cells_x_ >= patch_starts_.size()) return;
+    const size_t row = y * num_cells_x_;
+    for (size_t cx = x0 / cell_dim_; cx < num_cells_x_ && cx * cell_dim_ < x1;
+         cx++) {
+      const size_t cell_x0 = std::max(x0, cx * cell_dim_);
+      const size_t cell_x1 = std::min(x1, (cx + 1) * cell_dim_);
+      for (size_t id = patch_starts_[row + cx];
+           id < patch_starts_[row + cx + 1]; id++) {
+        const PatchPosition& pos = positions_[sorted_patches_[id]];
+        const size_t px0 = std::max(pos.x, cell_x0);
+        const size_t px1 = std::min(pos.x + pos.ref_pos.xsize, cell_x1);
+        if (px0 < px1) f(pos, px0, px1);
+      }
+    }
+  }
+
+  // Compute the patch index after updating positions_.
   void ComputePatchCache();
 };
 
@@ -449,7 +449,9 @@ void AFVTransformToPixels(const float* JXL_RESTRICT coefficients,
       scratch_space);
 }
 
-HWY_MAYBE_UNUSED void TransformToPixels(const AcStrategy::Type strategy,
+// Same as TransformToPixels, but always inlined, so that calls with a constant
+// strategy only keep the transform of that strategy.
+HWY_INLINE void TransformToPixelsInline(const AcStrategy::Type strategy,
                                         float* JXL_RESTRICT coefficients,
                                         float* JXL_RESTRICT pixels,
                                         size_t pixels_stride,
@@ -713,7 +715,17 @@ HWY_MAYBE_UNUSED void TransformToPixels(const AcStrategy::Type strategy,
   }
 }
 
-HWY_MAYBE_UNUSED void LowestFrequenciesFromDC(const AcStrategy::Type strategy,
+HWY_MAYBE_UNUSED void TransformToPixels(const AcStrategy::Type strategy,
+                                        float* JXL_RESTRICT coefficients,
+                                        float* JXL_RESTRICT pixels,
+                                        size_t pixels_stride,
+                                        float* scratch_space) {
+  TransformToPixelsInline(strategy, coefficients, pixels, pixels_stride,
+                          scratch_space);
+}
+
+// Same as LowestFrequenciesFromDC, but always inlined.
+HWY_INLINE void LowestFrequenciesFromDCInline(const AcStrategy::Type strategy,
                                               const float* dc, size_t dc_stride,
                                               float* llf) {
   using Type = AcStrategy::Type;
@@ -841,6 +853,12 @@ HWY_MAYBE_UNUSED void LowestFrequenciesFromDC(const AcStrategy::Type strategy,
   };
 }
 
+HWY_MAYBE_UNUSED void LowestFrequenciesFromDC(const AcStrategy::Type strategy,
+                                              const float* dc, size_t dc_stride,
+                                              float* llf) {
+  LowestFrequenciesFromDCInline(strategy, dc, dc_stride, llf);
+}
+
 }  // namespace
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
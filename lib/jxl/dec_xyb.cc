@@ -202,6 +202,8 @@ Status OutputEncodingInfo::Set(const CodecMetadata& metadata,
   float inverse_matrix[9];
   memcpy(inverse_matrix, im.inverse_matrix, sizeof(inverse_matrix));
   intensity_target = metadata.m.IntensityTarget();
+  orig_intensity_target = intensity_target;
+  orig_min_nits = metadata.m.tone_mapping.min_nits;
   if (metadata.m.xyb_encoded) {
     const auto& orig_color_encoding = metadata.m.color_encoding;
     color_encoding = default_enc;
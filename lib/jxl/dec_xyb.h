@@ -46,6 +46,20 @@ struct OutputEncodingInfo {
   float luminances[3] = {0.2126, 0.7152, 0.0722};
   // Also used for the HLG inverse OOTF.
   float intensity_target;
+  // Peak luminance, in nits, of the display to tone map XYB images to, or 0
+  // to not tone map them, see JxlDecoderSetDesiredIntensityTarget. Set before
+  // calling Set().
+  float desired_intensity_target = 0;
+  // Luminance range of the image, from the metadata.
+  float orig_intensity_target;
+  float orig_min_nits;
+
+  // Whether the conversion from XYB maps the luminances of the image to
+  // desired_intensity_target.
+  bool ToneMapsXYB() const {
+    return desired_intensity_target > 0 &&
+           desired_intensity_target < orig_intensity_target;
+  }
 };
 
 // Converts `inout` (not padded) from opsin to linear sRGB in-place. Called from
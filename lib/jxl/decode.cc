@@ -5,7 +5,13 @@
 
 #include "jxl/decode.h"
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <numeric>
+
 #include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/cache_aligned.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/box_content_decoder.h"
@@ -17,8 +23,13 @@
 #include "lib/jxl/headers.h"
 #include "lib/jxl/icc_codec.h"
 #include "lib/jxl/image_bundle.h"
+#include "lib/jxl/image_ops.h"
 #include "lib/jxl/loop_filter.h"
+#include "lib/jxl/memory_arena.h"
 #include "lib/jxl/memory_manager_internal.h"
+#include "lib/jxl/phase_counters.h"
+#include "lib/jxl/progress.h"
+#include "lib/jxl/render_pipeline/render_pipeline_stats.h"
 #include "lib/jxl/sanitizers.h"
 #include "lib/jxl/toc.h"
 
@@ -180,6 +191,7 @@ enum class BoxStage : uint32_t {
   kCodestream,  // Handling codestream box contents, or non-container stream
   kPartialCodestream,  // Handling the extra header of partial codestream box
   kJpegRecon,          // Handling jpeg reconstruction box
+  kFrameIndex,         // Handling frame index box
 };
 
 enum class JpegReconStage : uint32_t {
@@ -225,33 +237,77 @@ struct Sections {
       }
     }
 
+    // The sections in the order in which they are complete and in which they
+    // start in the frame data, which differ from the order of their ids if
+    // the TOC is permuted. With these, each call only looks at the sections
+    // whose state changed, instead of all of them, which matters when the
+    // input of a frame of many groups arrives in many small pieces.
+    by_end_.resize(frame_dec_->NumSections());
+    std::iota(by_end_.begin(), by_end_.end(), 0);
+    by_offset_ = by_end_;
+    std::stable_sort(by_end_.begin(), by_end_.end(),
+                     [&](size_t a, size_t b) {
+                       return offsets[a] + sizes[a] < offsets[b] + sizes[b];
+                     });
+    std::stable_sort(
+        by_offset_.begin(), by_offset_.end(),
+        [&](size_t a, size_t b) { return offsets[a] < offsets[b]; });
+
     return JXL_DEC_SUCCESS;
   }
 
-  // Sets the input data for the frame. The frame pointer must point to the
-  // beginning of the frame, size is the amount of bytes gotten so far and
-  // should increase with next calls until the full frame is loaded.
-  // TODO(lode): allow caller to provide only later chunks of memory when
-  // earlier sections are fully processed already.
-  void SetInput(const uint8_t* frame, size_t size) {
+  // Sets the input data for the frame. The data pointer must point to the
+  // byte at position begin in the frame, and end is the position in the frame
+  // up to which bytes were gotten so far in data. more has the frame bytes
+  // that follow end, which may be stored elsewhere, e.g. the payload of the
+  // next jxlp box still in the user input. end + more.size() should increase
+  // with next calls until the full frame is loaded, and begin must not be
+  // beyond FirstPendingPosition(). external has an entry per section, with the
+  // bytes of the sections that were given separately of the frame data, or a
+  // null data pointer for the others, and external_added the ids of the
+  // sections of external given since the previous call.
+  void SetInput(const uint8_t* data, size_t begin, size_t end,
+                jxl::Span<const uint8_t> more,
+                const std::vector<jxl::Span<const uint8_t>>& external,
+                const std::vector<size_t>& external_added) {
     const auto& offsets = frame_dec_->SectionOffsets();
     const auto& sizes = frame_dec_->SectionSizes();
 
-    for (size_t i = 0; i < frame_dec_->NumSections(); i++) {
-      if (section_received[i]) continue;
-      if (!OutOfBounds(sections_begin_, offsets[i], sizes[i], size)) {
-        section_received[i] = 1;
-        section_info.emplace_back(jxl::FrameDecoder::SectionInfo{nullptr, i});
-        section_status.emplace_back();
+    for (size_t id : external_added) Receive(id);
+    for (; next_by_end_ < by_end_.size(); next_by_end_++) {
+      const size_t id = by_end_[next_by_end_];
+      if (OutOfBounds(sections_begin_, offsets[id], sizes[id],
+                      end + more.size())) {
+        break;
       }
+      Receive(id);
     }
-    // Reset all the bitreaders, because the address of the frame pointer may
-    // change, even if it always represents the same frame start.
+    // Reset all the bitreaders, because the address of the frame data may
+    // change, even if it always represents the same frame.
     for (size_t i = 0; i < section_info.size(); i++) {
       size_t id = section_info[i].id;
       JXL_ASSERT(section_info[i].br == nullptr);
-      section_info[i].br = new jxl::BitReader(jxl::Span<const uint8_t>(
-          frame + sections_begin_ + offsets[id], sizes[id]));
+      if (external[id].data() != nullptr) {
+        section_info[i].br = new jxl::BitReader(external[id]);
+        continue;
+      }
+      const size_t start = sections_begin_ + offsets[id];
+      JXL_ASSERT(start >= begin);
+      const uint8_t* bytes;
+      if (start + sizes[id] <= end) {
+        bytes = data + start - begin;
+      } else if (start >= end) {
+        bytes = more.data() + start - end;
+      } else {
+        // Only the sections across the boundary of the two inputs are
+        // copied.
+        stitched_.emplace_back(data + start - begin, data + end - begin);
+        stitched_.back().insert(stitched_.back().end(), more.data(),
+                                more.data() + start + sizes[id] - end);
+        bytes = stitched_.back().data();
+      }
+      section_info[i].br =
+          new jxl::BitReader(jxl::Span<const uint8_t>(bytes, sizes[id]));
     }
   }
 
@@ -268,6 +324,7 @@ struct Sections {
       delete section_info[i].br;
       section_info[i].br = nullptr;
     }
+    stitched_.clear();
     if (out_of_bounds) {
       // If any bit reader indicates out of bounds, it's an error, not just
       // needing more input, since we ensure only bit readers containing
@@ -277,6 +334,48 @@ struct Sections {
     return JXL_DEC_SUCCESS;
   }
 
+  // Forgets the sections that ProcessSections has finished with, so that they
+  // are not passed to it again and their input bytes are no longer needed.
+  void RemoveDoneSections() {
+    size_t num_pending = 0;
+    for (size_t i = 0; i < section_info.size(); i++) {
+      if (section_status[i] == jxl::FrameDecoder::kDone ||
+          section_status[i] == jxl::FrameDecoder::kDuplicate) {
+        continue;
+      }
+      section_info[num_pending] = section_info[i];
+      section_status[num_pending] = section_status[i];
+      num_pending++;
+    }
+    section_info.resize(num_pending);
+    section_status.resize(num_pending);
+  }
+
+  // Returns the position in the frame before which all input bytes belong to
+  // sections that were already processed, or the frame size if all of them
+  // were. Sections given separately of the frame data are not counted.
+  size_t FirstPendingPosition(
+      const std::vector<jxl::Span<const uint8_t>>& external) {
+    const auto& offsets = frame_dec_->SectionOffsets();
+    size_t first = frame_size_;
+    // Sections are never unreceived, so the ones skipped here stay skipped.
+    while (next_by_offset_ < by_offset_.size() &&
+           section_received[by_offset_[next_by_offset_]]) {
+      next_by_offset_++;
+    }
+    if (next_by_offset_ < by_offset_.size()) {
+      first = sections_begin_ + offsets[by_offset_[next_by_offset_]];
+    }
+    for (size_t i = 0; i < section_info.size(); i++) {
+      size_t id = section_info[i].id;
+      if (external[id].data() != nullptr) continue;
+      first = std::min(first, sections_begin_ + offsets[id]);
+    }
+    return first;
+  }
+
+  bool HasReceivedSections() const { return num_received_ != 0; }
+
   // Not managed by us.
   jxl::FrameDecoder* frame_dec_;
 
@@ -286,6 +385,26 @@ struct Sections {
   std::vector<jxl::FrameDecoder::SectionInfo> section_info;
   std::vector<jxl::FrameDecoder::SectionStatus> section_status;
   std::vector<char> section_received;
+
+ private:
+  // Adds section `id` to the ones passed to ProcessSections, once.
+  void Receive(size_t id) {
+    if (section_received[id]) return;
+    section_received[id] = 1;
+    num_received_++;
+    section_info.emplace_back(jxl::FrameDecoder::SectionInfo{nullptr, id});
+    section_status.emplace_back();
+  }
+
+  std::vector<size_t> by_end_;
+  std::vector<size_t> by_offset_;
+  // All the sections before these positions in by_end_ and by_offset_ were
+  // received.
+  size_t next_by_end_ = 0;
+  size_t next_by_offset_ = 0;
+  size_t num_received_ = 0;
+  // Sections of SetInput joined from its two inputs, until CloseInput.
+  std::deque<std::vector<uint8_t>> stitched_;
 };
 
 /*
@@ -365,6 +484,62 @@ std::vector<size_t> GetFrameDependencies(size_t index,
   return result;
 }
 
+// Frame listed in the frame index box, decoding can start at it.
+struct FrameIndexEntry {
+  // Offset of the frame from the start of the codestream.
+  uint64_t codestream_offset;
+  // External index of the frame.
+  size_t frame;
+};
+
+// Frame index boxes must be in the input as a whole to be parsed, larger ones
+// are skipped.
+constexpr size_t kMaxFrameIndexBoxSize = 1 << 24;
+
+// Reads a variable length integer of the frame index box: 7 bits per byte
+// starting with the lowest ones, the high bit is set if more follow.
+bool ReadFrameIndexVarint(const uint8_t* data, size_t size, size_t* pos,
+                          uint64_t* value) {
+  *value = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    if (*pos >= size) return false;
+    const uint8_t byte = data[(*pos)++];
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+// Parses the contents of a frame index box ("jxli"). Returns false, with an
+// empty index, if they are invalid.
+bool ParseFrameIndexBox(const uint8_t* data, size_t size,
+                        std::vector<FrameIndexEntry>* index) {
+  index->clear();
+  size_t pos = 0;
+  uint64_t num_frames;
+  if (!ReadFrameIndexVarint(data, size, &pos, &num_frames)) return false;
+  // The tick unit, which seeking by frame doesn't need.
+  pos += 8;
+  if (pos > size) return false;
+  uint64_t offset = 0;
+  uint64_t frame = 0;
+  for (uint64_t i = 0; i < num_frames; i++) {
+    uint64_t delta, ticks, num_displayed;
+    if (!ReadFrameIndexVarint(data, size, &pos, &delta) ||
+        !ReadFrameIndexVarint(data, size, &pos, &ticks) ||
+        !ReadFrameIndexVarint(data, size, &pos, &num_displayed) ||
+        offset + delta < offset || frame + num_displayed < frame ||
+        (i != 0 && delta == 0)) {
+      index->clear();
+      return false;
+    }
+    offset += delta;
+    index->push_back({offset, static_cast<size_t>(frame)});
+    frame += num_displayed;
+  }
+  return true;
+}
+
 // Parameters for user-requested extra channel output.
 struct ExtraChannelOutput {
   JxlPixelFormat format;
@@ -372,6 +547,15 @@ struct ExtraChannelOutput {
   size_t buffer_size;
 };
 
+// A frame decoded ahead of the current one, see JxlDecoderSetFrameLookahead.
+struct FrameDecodedAhead {
+  // Offset of the frame from the start of the codestream.
+  size_t frame_start;
+  std::unique_ptr<jxl::ImageBundle> ib;
+  // If false, the frame is decoded again as usual, which reports the error.
+  bool ok;
+};
+
 }  // namespace
 
 // NOLINTNEXTLINE(clang-analyzer-optin.performance.Padding)
@@ -379,6 +563,13 @@ struct JxlDecoderStruct {
   JxlDecoderStruct() = default;
 
   JxlMemoryManager memory_manager;
+  // Counts the buffers allocated while decoding. Declared before everything
+  // that may own such buffers, since they refer to it until freed.
+  jxl::CacheAligned::Stats memory_stats;
+  // Created by the first JxlDecoderSetFrameArena call and kept until the
+  // decoder is destroyed, since buffers kept across resets may come from it.
+  // Declared before everything that may own such buffers.
+  std::unique_ptr<jxl::MemoryArena> frame_arena;
   std::unique_ptr<jxl::ThreadPool> thread_pool;
 
   DecoderStage stage;
@@ -419,6 +610,24 @@ struct JxlDecoderStruct {
   // Set to true right after a JXL_DEC_BOX event only.
   bool box_event;
   bool decompress_boxes;
+  bool use_frame_arena;
+  bool collect_render_stats;
+  jxl::RenderPipelineStats render_stats;
+  // Mutable since the conversion to the output format, timed in it, is done
+  // by functions taking a const decoder.
+  mutable jxl::DecoderCounters counters;
+  jxl::ProgressMonitor progress;
+  // Set from a JxlDecoderProcessInputAsync call until its done callback.
+  std::atomic<bool> async_pending{false};
+  JxlDecoderDoneCallback async_done;
+  void* async_done_opaque;
+  bool fast_integer_idct;
+  // Maximum number of frames decoded ahead of the current one.
+  size_t frame_lookahead;
+  // The frames decoded ahead, in codestream order, that are not output yet.
+  std::deque<FrameDecodedAhead> frames_decoded_ahead;
+  // The current frame was decoded ahead: only its output is left to do.
+  bool frame_decoded_ahead;
 
   bool box_out_buffer_set;
   // Whether the out buffer is set for the current box, if the user did not yet
@@ -438,6 +647,20 @@ struct JxlDecoderStruct {
   bool keep_orientation;
   bool render_spotcolors;
   bool coalescing;
+  bool premultiply_alpha;
+  // Region of interest in oriented output coordinates, see
+  // JxlDecoderSetCropRegion.
+  bool crop_set;
+  size_t crop_x0;
+  size_t crop_y0;
+  size_t crop_xsize;
+  size_t crop_ysize;
+  // See JxlDecoderSetDownsampling.
+  size_t downsampling;
+  // See JxlDecoderSetDirtyRectOutput.
+  bool dirty_rect_output;
+  // See JxlDecoderSetDesiredIntensityTarget, 0 if not set.
+  float desired_intensity_target;
 
   // Bitfield, for which informative events (JXL_DEC_BASIC_INFO, etc...) the
   // decoder returns a status. By default, do not return for any of the events,
@@ -458,13 +681,20 @@ struct JxlDecoderStruct {
   // Idem for the image buffer.
   bool image_out_buffer_set;
 
-  // Owned by the caller, buffers for DC image and full resolution images
+  // Owned by the caller, buffers for the preview, DC image and full
+  // resolution images. The DC buffer stays set for the following frames.
   void* preview_out_buffer;
+  void* dc_out_buffer;
   void* image_out_buffer;
   JxlImageOutInitCallback image_out_init_callback;
   JxlImageOutRunCallback image_out_run_callback;
+  // Set instead of image_out_run_callback by
+  // JxlDecoderSetMultithreadedImageOutTileCallback.
+  JxlImageOutTileCallback image_out_tile_callback;
   JxlImageOutDestroyCallback image_out_destroy_callback;
   void* image_out_init_opaque;
+  // Set instead of the above by JxlDecoderSetYCbCrPlanarOutCallback.
+  JxlImageOutPlaneCallback image_out_plane_callback;
   struct SimpleImageOutCallback {
     JxlImageOutCallback callback;
     void* opaque;
@@ -472,9 +702,14 @@ struct JxlDecoderStruct {
   SimpleImageOutCallback simple_image_out_callback;
 
   size_t preview_out_size;
+  size_t dc_out_size;
   size_t image_out_size;
+  // Row stride of image_out_buffer given with
+  // JxlDecoderSetImageOutBufferWithStride, or 0 to derive it from the format.
+  size_t image_out_stride;
 
   JxlPixelFormat preview_out_format;
+  JxlPixelFormat dc_out_format;
   JxlPixelFormat image_out_format;
 
   // For extra channels. Empty if no extra channels are requested, and they are
@@ -501,6 +736,18 @@ struct JxlDecoderStruct {
   // the codestream.
   size_t frame_start;
   size_t frame_size;
+  // TOC of the current frame, in section id order: offsets of the sections
+  // from frame_sections_begin, the size of the frame header and TOC, and their
+  // sizes.
+  std::vector<uint64_t> frame_section_offsets;
+  std::vector<uint32_t> frame_section_sizes;
+  size_t frame_sections_begin;
+  // Sections of the current frame given with JxlDecoderSetFrameSectionInput,
+  // one entry per section, with null data for the sections not given, their
+  // number, and the ids of the ones not yet passed to the Sections.
+  std::vector<jxl::Span<const uint8_t>> frame_section_input;
+  size_t num_frame_section_inputs;
+  std::vector<size_t> frame_section_input_added;
   FrameStage frame_stage;
   // The currently processed frame is the last of the current composite still,
   // and so must be returned as pixels
@@ -514,6 +761,19 @@ struct JxlDecoderStruct {
   // skipping_frame will be enabled only for the next frame.
   bool skipping_frame;
 
+  // Region of the canvas, in the coordinates of the decoded, not yet oriented,
+  // image, that changed between the previous displayed frame and the current
+  // one, see JxlDecoderGetFrameDirtyRect.
+  jxl::Rect dirty_rect;
+  // The frames of the current still have started to accumulate in dirty_rect.
+  bool dirty_rect_in_still;
+  // The previous displayed frame was decoded, rather than skipped, so that the
+  // next one can be described by its changes from it.
+  bool dirty_rect_has_previous;
+  // Bitfield of the reference frame slots that hold the canvas as it is after
+  // the last decoded frame.
+  uint32_t canvas_slots;
+
   // Amount of internal frames and external frames started. External frames are
   // user-visible frames, internal frames includes all external frames and
   // also invisible frames such as patches, blending-only and dc_level frames.
@@ -537,17 +797,29 @@ struct JxlDecoderStruct {
   // vector, it must be treated as a required frame.
   std::vector<char> frame_required;
 
+  // Frames listed in the frame index box, in codestream order. Kept across
+  // rewinds, since the box may come after the codestream.
+  std::vector<FrameIndexEntry> frame_index;
+  // Whether skipping frames jumped to a frame of frame_index. The internal
+  // frame indices are then unknown, so the frame dependencies above are
+  // cleared and not tracked until the next rewind.
+  bool frame_index_seeked;
+
   // Codestream input data is stored here, when the decoder takes in and stores
   // the user input bytes. If the decoder does not do that (e.g. in one-shot
-  // case), this field is unused.
-  // TODO(lode): avoid needing this field once the C++ decoder doesn't need
-  // all bytes at once, to save memory. Find alternative to std::vector doubling
-  // strategy to prevent some memory usage.
+  // case), this field is unused. Bytes that are no longer needed, such as
+  // those of earlier frames and of already processed sections of the current
+  // frame, are pruned from the beginning, see PruneCodestreamCopy.
   std::vector<uint8_t> codestream_copy;
   // Position in the actual codestream, which codestream_copy.begin() points to.
   // Non-zero once earlier parts of the codestream vector have been erased.
-  // TODO(lode): use this variable to allow pruning codestream_copy
   size_t codestream_pos;
+  // Capacity of codestream_copy counted as input in memory_stats.
+  size_t codestream_copy_counted = 0;
+  // While JxlDecoderProcessCodestream decodes the sections of a frame, the
+  // codestream bytes that follow codestream_copy, read in place from the user
+  // input instead of being appended to the copy. Empty otherwise.
+  jxl::Span<const uint8_t> codestream_chunk;
 
   BoxStage box_stage;
 
@@ -633,9 +905,14 @@ JxlDecoderStatus JxlDecoderDefaultPixelFormat(const JxlDecoder* dec,
   return JXL_DEC_SUCCESS;
 }
 
-// Resets the state that must be reset for both Rewind and Reset
-void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
+// Resets the state that must be reset for both Rewind and Reset. With
+// keep_allocations, the buffers of the decoder state that don't carry
+// information about the previous image are moved to the new state instead of
+// being freed.
+void JxlDecoderRewindDecodingState(JxlDecoder* dec,
+                                   bool keep_allocations = false) {
   dec->stage = DecoderStage::kInited;
+  dec->memory_stats.limit_exceeded.store(false, std::memory_order_relaxed);
   dec->got_signature = false;
   dec->first_codestream_seen = false;
   dec->last_codestream_seen = false;
@@ -677,54 +954,124 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->preview_out_buffer_set = false;
   dec->image_out_buffer_set = false;
   dec->preview_out_buffer = nullptr;
+  dec->dc_out_buffer = nullptr;
   dec->image_out_buffer = nullptr;
   dec->image_out_init_callback = nullptr;
   dec->image_out_run_callback = nullptr;
+  dec->image_out_tile_callback = nullptr;
   dec->image_out_destroy_callback = nullptr;
   dec->image_out_init_opaque = nullptr;
+  dec->image_out_plane_callback = nullptr;
   dec->preview_out_size = 0;
+  dec->dc_out_size = 0;
   dec->image_out_size = 0;
+  dec->image_out_stride = 0;
   dec->extra_channel_output.clear();
   dec->dec_pixels = 0;
   dec->next_in = 0;
   dec->avail_in = 0;
   dec->input_closed = false;
 
-  dec->passes_state.reset(nullptr);
+  if (keep_allocations && dec->passes_state) {
+    std::unique_ptr<jxl::PassesDecoderState> old_state =
+        std::move(dec->passes_state);
+    dec->passes_state.reset(new jxl::PassesDecoderState());
+    dec->passes_state->group_dec_caches =
+        std::move(old_state->group_dec_caches);
+    jxl::PassesSharedState& shared = dec->passes_state->shared_storage;
+    shared.matrices = std::move(old_state->shared_storage.matrices);
+    shared.matrices.ResetToDefault();
+    shared.coeff_orders = std::move(old_state->shared_storage.coeff_orders);
+    dec->passes_state->histogram_cache =
+        std::move(old_state->histogram_cache);
+  } else {
+    dec->passes_state.reset(nullptr);
+  }
   dec->frame_dec.reset(nullptr);
   dec->sections.reset(nullptr);
   dec->frame_dec_in_progress = false;
+  dec->frames_decoded_ahead.clear();
+  dec->frame_decoded_ahead = false;
 
   dec->ib.reset();
   dec->metadata = jxl::CodecMetadata();
   dec->frame_header.reset(new jxl::FrameHeader(&dec->metadata));
 
   dec->codestream_copy.clear();
+  dec->codestream_pos = 0;
+  dec->codestream_chunk = jxl::Span<const uint8_t>();
 
   dec->frame_stage = FrameStage::kHeader;
   dec->frame_start = 0;
   dec->frame_size = 0;
+  dec->frame_section_offsets.clear();
+  dec->frame_section_sizes.clear();
+  dec->frame_sections_begin = 0;
+  dec->frame_section_input.clear();
+  dec->num_frame_section_inputs = 0;
+  dec->frame_section_input_added.clear();
   dec->is_last_of_still = false;
   dec->is_last_total = false;
   dec->skip_frames = 0;
   dec->skipping_frame = false;
+  dec->dirty_rect = jxl::Rect();
+  dec->dirty_rect_in_still = false;
+  dec->dirty_rect_has_previous = false;
+  dec->canvas_slots = 0;
   dec->internal_frames = 0;
   dec->external_frames = 0;
+  dec->frame_index_seeked = false;
+  dec->render_stats.Clear();
+  dec->counters.Clear();
+  dec->progress.Reset();
 }
 
-void JxlDecoderReset(JxlDecoder* dec) {
-  JxlDecoderRewindDecodingState(dec);
-
+namespace {
+void ResetSettings(JxlDecoder* dec) {
   dec->thread_pool.reset();
+  dec->progress.SetCallback(nullptr, nullptr);
   dec->keep_orientation = false;
   dec->render_spotcolors = true;
   dec->coalescing = true;
+  dec->premultiply_alpha = false;
+  dec->crop_set = false;
+  dec->crop_x0 = 0;
+  dec->crop_y0 = 0;
+  dec->crop_xsize = 0;
+  dec->crop_ysize = 0;
+  dec->downsampling = 1;
+  dec->dirty_rect_output = false;
+  dec->desired_intensity_target = 0;
   dec->orig_events_wanted = 0;
   dec->frame_references.clear();
   dec->frame_saved_as.clear();
   dec->frame_external_to_internal.clear();
   dec->frame_required.clear();
+  dec->frame_index.clear();
   dec->decompress_boxes = false;
+  dec->use_frame_arena = false;
+  dec->collect_render_stats = false;
+  dec->fast_integer_idct = false;
+  dec->frame_lookahead = 0;
+}
+
+// Memory manager for the image and coefficient buffers allocated while
+// decoding, or nullptr for the default allocator.
+const JxlMemoryManager* BufferMemoryManager(const JxlDecoder* dec) {
+  if (dec->use_frame_arena) return dec->frame_arena->memory_manager();
+  return jxl::MemoryManagerForBuffers(&dec->memory_manager);
+}
+}  // namespace
+
+void JxlDecoderReset(JxlDecoder* dec) {
+  JxlDecoderRewindDecodingState(dec);
+  ResetSettings(dec);
+  if (dec->frame_arena) dec->frame_arena->ReleaseUnused();
+}
+
+void JxlDecoderResetKeepAllocations(JxlDecoder* dec) {
+  JxlDecoderRewindDecodingState(dec, /*keep_allocations=*/true);
+  ResetSettings(dec);
 }
 
 JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager) {
@@ -840,6 +1187,15 @@ JxlDecoderStatus JxlDecoderSetRenderSpotcolors(JxlDecoder* dec,
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetPremultiplyAlpha(JxlDecoder* dec,
+                                               JXL_BOOL premultiply) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set premultiply option before starting");
+  }
+  dec->premultiply_alpha = !!premultiply;
+  return JXL_DEC_SUCCESS;
+}
+
 JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec, JXL_BOOL coalescing) {
   if (dec->stage != DecoderStage::kInited) {
     return JXL_API_ERROR("Must set coalescing option before starting");
@@ -848,7 +1204,305 @@ JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec, JXL_BOOL coalescing) {
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetFrameArena(JxlDecoder* dec, JXL_BOOL enabled) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set frame arena option before starting");
+  }
+  if (enabled && !dec->frame_arena) {
+    dec->frame_arena.reset(new jxl::MemoryArena(dec->memory_manager));
+  }
+  dec->use_frame_arena = !!enabled;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetCollectRenderStats(JxlDecoder* dec,
+                                                JXL_BOOL enabled) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set render stats option before starting");
+  }
+  dec->collect_render_stats = !!enabled;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetFastIntegerIDCT(JxlDecoder* dec,
+                                              JXL_BOOL enabled) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set integer IDCT option before starting");
+  }
+  dec->fast_integer_idct = !!enabled;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetDirtyRectOutput(JxlDecoder* dec,
+                                              JXL_BOOL enabled) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set dirty rect output option before starting");
+  }
+  dec->dirty_rect_output = !!enabled;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetFrameLookahead(JxlDecoder* dec,
+                                             size_t max_frames) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set frame lookahead before starting");
+  }
+  dec->frame_lookahead = max_frames;
+  return JXL_DEC_SUCCESS;
+}
+
+void JxlDecoderSetProgressCallback(JxlDecoder* dec,
+                                   JxlDecoderProgressCallback callback,
+                                   void* opaque) {
+  dec->progress.SetCallback(callback, opaque);
+}
+
+namespace {
+// Calls f(stage, thread) for every stage and thread with nonzero render stats,
+// stops when f returns false.
+template <typename F>
+void ForEachRenderStats(const jxl::RenderPipelineStats& stats, const F& f) {
+  for (size_t stage = 0; stage < stats.NumStages(); stage++) {
+    for (size_t thread = 0; thread < stats.NumThreads(); thread++) {
+      if (stats.Get(stage, thread).rows == 0) continue;
+      if (!f(stage, thread)) return;
+    }
+  }
+}
+}  // namespace
+
+size_t JxlDecoderGetNumRenderStats(const JxlDecoder* dec) {
+  size_t num = 0;
+  ForEachRenderStats(dec->render_stats, [&num](size_t, size_t) {
+    num++;
+    return true;
+  });
+  return num;
+}
+
+JxlDecoderStatus JxlDecoderGetRenderStats(const JxlDecoder* dec, size_t index,
+                                          JxlRenderStageStats* stats) {
+  const jxl::RenderPipelineStats& render_stats = dec->render_stats;
+  bool found = false;
+  ForEachRenderStats(render_stats, [&](size_t stage, size_t thread) {
+    if (index-- != 0) return true;
+    const jxl::RenderPipelineStats::Counters& c =
+        render_stats.Get(stage, thread);
+    stats->name = render_stats.Name(stage);
+    stats->thread = thread;
+    stats->nanoseconds = c.nanoseconds;
+    stats->rows = c.rows;
+    stats->bytes = c.bytes;
+    found = true;
+    return false;
+  });
+  if (!found) return JXL_API_ERROR("Render stats index out of range");
+  return JXL_DEC_SUCCESS;
+}
+
+void JxlDecoderGetCounters(const JxlDecoder* dec,
+                           JxlDecoderCounters* counters) {
+  static_assert(JXL_DEC_NUM_PHASES == jxl::DecoderCounters::kNumPhases,
+                "Phases of the API and of DecoderCounters differ");
+  const jxl::DecoderCounters& c = dec->counters;
+  for (size_t i = 0; i < JXL_DEC_NUM_PHASES; i++) {
+    counters->nanoseconds[i] = c.nanoseconds[i].load(std::memory_order_relaxed);
+  }
+  counters->bytes_consumed = dec->file_pos;
+  counters->frames = c.frames.load(std::memory_order_relaxed);
+  counters->dc_groups = c.dc_groups.load(std::memory_order_relaxed);
+  counters->ac_groups = c.ac_groups.load(std::memory_order_relaxed);
+}
+
+JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec, uint32_t x0,
+                                         uint32_t y0, uint32_t xsize,
+                                         uint32_t ysize) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set crop region before starting");
+  }
+  if (xsize == 0 || ysize == 0) {
+    return JXL_API_ERROR("Crop region must not be empty");
+  }
+  dec->crop_set = true;
+  dec->crop_x0 = x0;
+  dec->crop_y0 = y0;
+  dec->crop_xsize = xsize;
+  dec->crop_ysize = ysize;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetDownsampling(JxlDecoder* dec, uint32_t factor) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set downsampling before starting");
+  }
+  if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+    return JXL_API_ERROR("Downsampling factor must be 1, 2, 4 or 8");
+  }
+  dec->downsampling = factor;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetDesiredIntensityTarget(
+    JxlDecoder* dec, float desired_intensity_target) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set desired intensity target before starting");
+  }
+  if (!(desired_intensity_target >= 0)) {
+    return JXL_API_ERROR("Desired intensity target must not be negative");
+  }
+  dec->desired_intensity_target = desired_intensity_target;
+  return JXL_DEC_SUCCESS;
+}
+
 namespace {
+// Whether the output of the current frame is restricted to the crop region.
+bool UseCropRegion(const JxlDecoder* dec) {
+  return dec->crop_set && dec->coalescing &&
+         !dec->frame_header->nonserialized_is_preview;
+}
+
+// Whether the current frame is output downsampled.
+bool UseDownsampling(const JxlDecoder* dec) {
+  return dec->downsampling > 1 && dec->coalescing &&
+         !dec->frame_header->nonserialized_is_preview;
+}
+
+// Returns the crop region in the coordinates of the decoded, not yet oriented,
+// image.
+jxl::Rect StoredCropRect(const JxlDecoder* dec) {
+  const size_t xsize = dec->metadata.xsize();
+  const size_t ysize = dec->metadata.ysize();
+  const size_t ox0 = dec->crop_x0;
+  const size_t oy0 = dec->crop_y0;
+  const size_t oxs = dec->crop_xsize;
+  const size_t oys = dec->crop_ysize;
+  const jxl::Orientation orientation = dec->keep_orientation
+                                           ? jxl::Orientation::kIdentity
+                                           : dec->metadata.m.GetOrientation();
+  switch (orientation) {
+    case jxl::Orientation::kIdentity:
+      return jxl::Rect(ox0, oy0, oxs, oys);
+    case jxl::Orientation::kFlipHorizontal:
+      return jxl::Rect(xsize - ox0 - oxs, oy0, oxs, oys);
+    case jxl::Orientation::kRotate180:
+      return jxl::Rect(xsize - ox0 - oxs, ysize - oy0 - oys, oxs, oys);
+    case jxl::Orientation::kFlipVertical:
+      return jxl::Rect(ox0, ysize - oy0 - oys, oxs, oys);
+    case jxl::Orientation::kTranspose:
+      return jxl::Rect(oy0, ox0, oys, oxs);
+    case jxl::Orientation::kRotate90:
+      return jxl::Rect(oy0, ysize - ox0 - oxs, oys, oxs);
+    case jxl::Orientation::kAntiTranspose:
+      return jxl::Rect(xsize - oy0 - oys, ysize - ox0 - oxs, oys, oxs);
+    case jxl::Orientation::kRotate270:
+      return jxl::Rect(xsize - oy0 - oys, ox0, oys, oxs);
+  }
+  return jxl::Rect(ox0, oy0, oxs, oys);
+}
+
+// Returns the rect of the oriented output, as set with
+// JxlDecoderSetKeepOrientation, that covers `rect` of the decoded, not yet
+// oriented, image. The inverse of StoredCropRect.
+jxl::Rect OrientedRect(const JxlDecoder* dec, const jxl::Rect& rect) {
+  const size_t xsize = dec->metadata.xsize();
+  const size_t ysize = dec->metadata.ysize();
+  const size_t x0 = rect.x0();
+  const size_t y0 = rect.y0();
+  const size_t xs = rect.xsize();
+  const size_t ys = rect.ysize();
+  const jxl::Orientation orientation = dec->keep_orientation
+                                           ? jxl::Orientation::kIdentity
+                                           : dec->metadata.m.GetOrientation();
+  switch (orientation) {
+    case jxl::Orientation::kIdentity:
+      return rect;
+    case jxl::Orientation::kFlipHorizontal:
+      return jxl::Rect(xsize - x0 - xs, y0, xs, ys);
+    case jxl::Orientation::kRotate180:
+      return jxl::Rect(xsize - x0 - xs, ysize - y0 - ys, xs, ys);
+    case jxl::Orientation::kFlipVertical:
+      return jxl::Rect(x0, ysize - y0 - ys, xs, ys);
+    case jxl::Orientation::kTranspose:
+      return jxl::Rect(y0, x0, ys, xs);
+    case jxl::Orientation::kRotate90:
+      return jxl::Rect(ysize - y0 - ys, x0, ys, xs);
+    case jxl::Orientation::kAntiTranspose:
+      return jxl::Rect(ysize - y0 - ys, xsize - x0 - xs, ys, xs);
+    case jxl::Orientation::kRotate270:
+      return jxl::Rect(y0, xsize - x0 - xs, ys, xs);
+  }
+  return rect;
+}
+
+// Whether only the dirty rect of the current frame is written to the output
+// buffers, see JxlDecoderSetDirtyRectOutput.
+bool UseDirtyRectOutput(const JxlDecoder* dec) {
+  return dec->dirty_rect_output && dec->coalescing &&
+         !dec->frame_header->nonserialized_is_preview && !UseCropRegion(dec) &&
+         !UseDownsampling(dec);
+}
+
+// Returns the smallest rect that contains both rects, empty rects being
+// ignored.
+jxl::Rect RectUnion(const jxl::Rect& a, const jxl::Rect& b) {
+  if (a.xsize() == 0 || a.ysize() == 0) return b;
+  if (b.xsize() == 0 || b.ysize() == 0) return a;
+  const size_t x0 = std::min(a.x0(), b.x0());
+  const size_t y0 = std::min(a.y0(), b.y0());
+  return jxl::Rect(x0, y0, std::max(a.x1(), b.x1()) - x0,
+                   std::max(a.y1(), b.y1()) - y0);
+}
+
+// Adds the region of the canvas changed by the frame whose header was just
+// parsed to dirty_rect. Only the frame headers are needed: a frame changes its
+// own layer, if it is blended onto the canvas as it is after the previous
+// frame, or the whole canvas otherwise.
+void UpdateDirtyRect(JxlDecoder* dec) {
+  const jxl::FrameHeader& frame_header = *dec->frame_header;
+  const jxl::Rect canvas(0, 0, dec->metadata.xsize(), dec->metadata.ysize());
+  if (!dec->dirty_rect_in_still) {
+    dec->dirty_rect = dec->dirty_rect_has_previous ? jxl::Rect() : canvas;
+    dec->dirty_rect_in_still = true;
+  }
+  const uint32_t save_slot = 1u << frame_header.save_as_reference;
+  if (frame_header.frame_type == jxl::FrameType::kRegularFrame ||
+      frame_header.frame_type == jxl::FrameType::kSkipProgressive) {
+    jxl::Rect layer = canvas;
+    if (frame_header.custom_size_or_origin) {
+      const jxl::FrameDimensions frame_dim = frame_header.ToFrameDimensions();
+      const jxl::RectT<int64_t> clipped =
+          jxl::RectT<int64_t>(frame_header.frame_origin.x0,
+                              frame_header.frame_origin.y0,
+                              frame_dim.xsize_upsampled,
+                              frame_dim.ysize_upsampled)
+              .Intersection(jxl::RectT<int64_t>(0, 0, canvas.xsize(),
+                                                canvas.ysize()));
+      layer = jxl::Rect(clipped.x0(), clipped.y0(), clipped.xsize(),
+                        clipped.ysize());
+    }
+    bool on_canvas =
+        (dec->canvas_slots >> frame_header.blending_info.source) & 1;
+    for (const jxl::BlendingInfo& info :
+         frame_header.extra_channel_blending_info) {
+      on_canvas = on_canvas && ((dec->canvas_slots >> info.source) & 1);
+    }
+    dec->dirty_rect =
+        on_canvas ? RectUnion(dec->dirty_rect, layer) : canvas;
+    // The frame is saved after blending, as the whole canvas, unless it is
+    // saved before its color transform.
+    dec->canvas_slots = (frame_header.CanBeReferenced() &&
+                         !frame_header.save_before_color_transform)
+                            ? save_slot
+                            : 0;
+  } else if (frame_header.frame_type == jxl::FrameType::kReferenceOnly) {
+    dec->canvas_slots &= ~save_slot;
+  }
+  if (dec->is_last_of_still) {
+    dec->dirty_rect_in_still = false;
+    dec->dirty_rect_has_previous = !dec->skipping_frame;
+  }
+}
+
 // helper function to get the dimensions of the current image buffer
 void GetCurrentDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize,
                           bool oriented) {
@@ -867,6 +1521,15 @@ void GetCurrentDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize,
         static_cast<int>(dec->metadata.m.GetOrientation()) > 4) {
       std::swap(xsize, ysize);
     }
+  } else if (oriented) {
+    if (UseCropRegion(dec)) {
+      xsize = dec->crop_xsize;
+      ysize = dec->crop_ysize;
+    }
+    if (UseDownsampling(dec)) {
+      xsize = jxl::DivCeil(xsize, dec->downsampling);
+      ysize = jxl::DivCeil(ysize, dec->downsampling);
+    }
   }
 }
 }  // namespace
@@ -874,25 +1537,18 @@ void GetCurrentDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize,
 namespace jxl {
 namespace {
 
-template <class T>
-bool CanRead(Span<const uint8_t> data, BitReader* reader, T* JXL_RESTRICT t) {
-  // Use a copy of the bit reader because CanRead advances bits.
-  BitReader reader2(data);
-  reader2.SkipBits(reader->TotalBitsConsumed());
-  bool result = Bundle::CanRead(&reader2, t);
-  JXL_ASSERT(reader2.Close());
-  return result;
-}
-
 // Returns JXL_DEC_SUCCESS if the full bundle was successfully read, status
-// indicating either error or need more input otherwise.
+// indicating either error or need more input otherwise. The fields are read
+// once: like Bundle::CanRead, Bundle::Read stops with kNotEnoughBytes at the
+// first field beyond the input, so a separate check beforehand would only
+// parse the bundle twice.
 template <class T>
-JxlDecoderStatus ReadBundle(Span<const uint8_t> data, BitReader* reader,
-                            T* JXL_RESTRICT t) {
-  if (!CanRead(data, reader, t)) {
+JxlDecoderStatus ReadBundle(BitReader* reader, T* JXL_RESTRICT t) {
+  const Status status = Bundle::Read(reader, t);
+  if (status.code() == StatusCode::kNotEnoughBytes) {
     return JXL_DEC_NEED_MORE_INPUT;
   }
-  if (!Bundle::Read(reader, t)) {
+  if (!status) {
     return JXL_DEC_ERROR;
   }
   return JXL_DEC_SUCCESS;
@@ -921,6 +1577,8 @@ std::unique_ptr<BitReader, std::function<void(BitReader*)>> GetBitReader(
 
 JxlDecoderStatus JxlDecoderReadBasicInfo(JxlDecoder* dec, const uint8_t* in,
                                          size_t size) {
+  jxl::ScopedPhaseTimer timer(
+      dec->counters.Timer(jxl::DecoderCounters::kHeaders));
   size_t pos = 0;
 
   // Check and skip the codestream signature
@@ -939,10 +1597,10 @@ JxlDecoderStatus JxlDecoderReadBasicInfo(JxlDecoder* dec, const uint8_t* in,
 
   Span<const uint8_t> span(in + pos, size - pos);
   auto reader = GetBitReader(span);
-  JXL_API_RETURN_IF_ERROR(ReadBundle(span, reader.get(), &dec->metadata.size));
+  JXL_API_RETURN_IF_ERROR(ReadBundle(reader.get(), &dec->metadata.size));
 
   dec->metadata.m.nonserialized_only_parse_basic_info = true;
-  JXL_API_RETURN_IF_ERROR(ReadBundle(span, reader.get(), &dec->metadata.m));
+  JXL_API_RETURN_IF_ERROR(ReadBundle(reader.get(), &dec->metadata.m));
   dec->metadata.m.nonserialized_only_parse_basic_info = false;
   dec->got_basic_info = true;
   dec->basic_info_size_hint = 0;
@@ -958,6 +1616,8 @@ JxlDecoderStatus JxlDecoderReadBasicInfo(JxlDecoder* dec, const uint8_t* in,
 // Reads all codestream headers (but not frame headers)
 JxlDecoderStatus JxlDecoderReadAllHeaders(JxlDecoder* dec, const uint8_t* in,
                                           size_t size) {
+  jxl::ScopedPhaseTimer timer(
+      dec->counters.Timer(jxl::DecoderCounters::kHeaders));
   size_t pos = 0;
 
   // Check and skip the codestream signature
@@ -977,17 +1637,17 @@ JxlDecoderStatus JxlDecoderReadAllHeaders(JxlDecoder* dec, const uint8_t* in,
     reader->SkipBits(dec->header_except_icc_bits);
   } else {
     SizeHeader dummy_size_header;
-    JXL_API_RETURN_IF_ERROR(ReadBundle(span, reader.get(), &dummy_size_header));
+    JXL_API_RETURN_IF_ERROR(ReadBundle(reader.get(), &dummy_size_header));
 
     // We already decoded the metadata to dec->metadata.m, no reason to
     // overwrite it, use a dummy metadata instead.
     ImageMetadata dummy_metadata;
-    JXL_API_RETURN_IF_ERROR(ReadBundle(span, reader.get(), &dummy_metadata));
+    JXL_API_RETURN_IF_ERROR(ReadBundle(reader.get(), &dummy_metadata));
 
     dec->metadata.transform_data.nonserialized_xyb_encoded =
         dec->metadata.m.xyb_encoded;
     JXL_API_RETURN_IF_ERROR(
-        ReadBundle(span, reader.get(), &dec->metadata.transform_data));
+        ReadBundle(reader.get(), &dec->metadata.transform_data));
   }
 
   dec->header_except_icc_bits = reader->TotalBitsConsumed();
@@ -1035,6 +1695,8 @@ JxlDecoderStatus JxlDecoderReadAllHeaders(JxlDecoder* dec, const uint8_t* in,
   dec->default_enc =
       ColorEncoding::LinearSRGB(dec->metadata.m.color_encoding.IsGray());
 
+  dec->passes_state->output_encoding_info.desired_intensity_target =
+      dec->desired_intensity_target;
   JXL_API_RETURN_IF_ERROR(dec->passes_state->output_encoding_info.Set(
       dec->metadata, dec->default_enc));
 
@@ -1052,20 +1714,38 @@ static size_t GetStride(const JxlDecoder* dec, const JxlPixelFormat& format) {
   return stride;
 }
 
+static size_t GetImageOutStride(const JxlDecoder* dec) {
+  return dec->image_out_stride != 0 ? dec->image_out_stride
+                                    : GetStride(dec, dec->image_out_format);
+}
+
+static PixelCallback GetImageOutCallback(const JxlDecoder* dec) {
+  if (dec->image_out_tile_callback != nullptr) {
+    return PixelCallback::Tiles(
+        dec->image_out_init_callback, dec->image_out_tile_callback,
+        dec->image_out_destroy_callback, dec->image_out_init_opaque);
+  }
+  return PixelCallback{dec->image_out_init_callback,
+                       dec->image_out_run_callback,
+                       dec->image_out_destroy_callback,
+                       dec->image_out_init_opaque};
+}
+
 // Internal wrapper around jxl::ConvertToExternal which converts the stride,
 // format and orientation and allows to choose whether to get all RGB(A)
 // channels or alternatively get a single extra channel.
 // If want_extra_channel, a valid index to a single extra channel must be
 // given, the output must be single-channel, and format.num_channels is ignored
-// and treated as if it is 1.
+// and treated as if it is 1. The rows of `out_image` are `stride` bytes apart.
 static JxlDecoderStatus ConvertImageInternal(
     const JxlDecoder* dec, const jxl::ImageBundle& frame,
     const JxlPixelFormat& format, bool want_extra_channel,
     size_t extra_channel_index, void* out_image, size_t out_size,
-    const PixelCallback& out_callback) {
+    size_t stride, const PixelCallback& out_callback) {
+  jxl::ScopedPhaseTimer timer(
+      dec->counters.Timer(jxl::DecoderCounters::kOutput));
   // TODO(lode): handle mismatch of RGB/grayscale color profiles and pixel data
   // color/grayscale format
-  const size_t stride = GetStride(dec, format);
 
   bool float_format = format.data_type == JXL_TYPE_FLOAT ||
                       format.data_type == JXL_TYPE_FLOAT16;
@@ -1074,8 +1754,70 @@ static JxlDecoderStatus ConvertImageInternal(
                                           ? jxl::Orientation::kIdentity
                                           : dec->metadata.m.GetOrientation();
 
+  const bool dirty_rect_only = UseDirtyRectOutput(dec) &&
+                               !out_callback.IsPresent() &&
+                               !SameSize(dec->dirty_rect, frame);
+  if (dirty_rect_only) {
+    // The rest of the output buffer already holds the previous frame: only the
+    // dirty rect is converted, to its place in the buffer.
+    if (dec->dirty_rect.xsize() == 0 || dec->dirty_rect.ysize() == 0) {
+      return JXL_DEC_SUCCESS;
+    }
+    const jxl::Rect oriented = OrientedRect(dec, dec->dirty_rect);
+    const size_t num_channels = want_extra_channel ? 1 : format.num_channels;
+    const size_t offset =
+        oriented.y0() * stride + oriented.x0() * num_channels *
+                                    BitsPerChannel(format.data_type) /
+                                    jxl::kBitsPerByte;
+    if (offset >= out_size) return JXL_API_ERROR("output buffer too small");
+    out_image = reinterpret_cast<uint8_t*>(out_image) + offset;
+    out_size -= offset;
+  }
+
   jxl::Status status(true);
-  if (want_extra_channel) {
+  if (UseCropRegion(dec) || UseDownsampling(dec) || dirty_rect_only) {
+    // Only the crop region, the dirty rect and/or a downsampled image is
+    // output: convert a copy instead, the orientation is undone on the copy as
+    // usual.
+    jxl::Rect rect(0, 0, dec->metadata.xsize(), dec->metadata.ysize());
+    if (dirty_rect_only) {
+      rect = dec->dirty_rect;
+    } else if (UseCropRegion(dec)) {
+      rect = StoredCropRect(dec);
+    }
+    const size_t factor = UseDownsampling(dec) ? dec->downsampling : 1;
+    const auto copy_plane = [&rect, factor](const jxl::ImageF& plane) {
+      jxl::ImageF copy = jxl::CopyImage(rect, plane);
+      if (factor > 1) jxl::DownsampleImage(&copy, factor);
+      return copy;
+    };
+    if (want_extra_channel) {
+      JXL_ASSERT(extra_channel_index < frame.extra_channels().size());
+      const jxl::ImageF& ec = frame.extra_channels()[extra_channel_index];
+      status = jxl::ConvertToExternal(
+          copy_plane(ec), BitsPerChannel(format.data_type), float_format,
+          format.endianness, stride, dec->thread_pool.get(), out_image,
+          out_size, out_callback, undo_orientation);
+    } else {
+      jxl::ImageBundle cropped(&dec->metadata.m);
+      jxl::Image3F color(rect.xsize(), rect.ysize());
+      jxl::CopyImageTo(rect, frame.color(), jxl::Rect(color), &color);
+      if (factor > 1) jxl::DownsampleImage(&color, factor);
+      cropped.SetFromImage(std::move(color), frame.c_current());
+      std::vector<jxl::ImageF> extra_channels;
+      for (const jxl::ImageF& ec : frame.extra_channels()) {
+        extra_channels.emplace_back(copy_plane(ec));
+      }
+      if (!extra_channels.empty()) {
+        cropped.SetExtraChannels(std::move(extra_channels));
+      }
+      status = jxl::ConvertToExternal(
+          cropped, BitsPerChannel(format.data_type), float_format,
+          format.num_channels, format.endianness, stride,
+          dec->thread_pool.get(), out_image, out_size, out_callback,
+          undo_orientation, dec->premultiply_alpha);
+    }
+  } else if (want_extra_channel) {
     JXL_ASSERT(extra_channel_index < frame.extra_channels().size());
     status = jxl::ConvertToExternal(frame.extra_channels()[extra_channel_index],
                                     BitsPerChannel(format.data_type),
@@ -1086,20 +1828,26 @@ static JxlDecoderStatus ConvertImageInternal(
     status = jxl::ConvertToExternal(
         frame, BitsPerChannel(format.data_type), float_format,
         format.num_channels, format.endianness, stride, dec->thread_pool.get(),
-        out_image, out_size, out_callback, undo_orientation);
+        out_image, out_size, out_callback, undo_orientation,
+        dec->premultiply_alpha);
   }
 
   return status ? JXL_DEC_SUCCESS : JXL_DEC_ERROR;
 }
 
-// Parses the FrameHeader and the total frame_size, given the initial bytes
-// of the frame up to and including the TOC.
-// TODO(lode): merge this with FrameDecoder
-JxlDecoderStatus ParseFrameHeader(JxlDecoder* dec,
-                                  jxl::FrameHeader* frame_header,
-                                  const uint8_t* in, size_t size, size_t pos,
-                                  bool is_preview, size_t* frame_size,
-                                  int* saved_as) {
+// Reads the frame header and TOC at `pos`, and outputs the size of the whole
+// frame, the offsets and sizes of its sections and the size of its header
+// and TOC.
+JxlDecoderStatus ReadFrameHeaderAndTOC(JxlDecoder* dec,
+                                       jxl::FrameHeader* frame_header,
+                                       const uint8_t* in, size_t size,
+                                       size_t pos, bool is_preview,
+                                       size_t* frame_size,
+                                       std::vector<uint64_t>* group_offsets,
+                                       std::vector<uint32_t>* group_sizes,
+                                       size_t* header_size) {
+  jxl::ScopedPhaseTimer timer(
+      dec->counters.Timer(jxl::DecoderCounters::kHeaders));
   if (pos >= size) {
     return JXL_DEC_NEED_MORE_INPUT;
   }
@@ -1133,10 +1881,8 @@ JxlDecoderStatus ParseFrameHeader(JxlDecoder* dec,
       NumTocEntries(frame_dim.num_groups, frame_dim.num_dc_groups,
                     frame_header->passes.num_passes, has_ac_global);
 
-  std::vector<uint64_t> group_offsets;
-  std::vector<uint32_t> group_sizes;
-  status = ReadGroupOffsets(toc_entries, reader.get(), &group_offsets,
-                            &group_sizes, &groups_total_size);
+  status = ReadGroupOffsets(toc_entries, reader.get(), group_offsets,
+                            group_sizes, &groups_total_size);
 
   // TODO(lode): we're actually relying on AllReadsWithinBounds() here
   // instead of on status.code(), change the internal TOC C++ code to
@@ -1150,8 +1896,35 @@ JxlDecoderStatus ParseFrameHeader(JxlDecoder* dec,
 
   JXL_DASSERT((reader->TotalBitsConsumed() % kBitsPerByte) == 0);
   JXL_API_RETURN_IF_ERROR(reader->JumpToByteBoundary());
-  size_t header_size = (reader->TotalBitsConsumed() >> 3);
-  *frame_size = header_size + groups_total_size;
+  *header_size = (reader->TotalBitsConsumed() >> 3);
+  *frame_size = *header_size + groups_total_size;
+  return JXL_DEC_SUCCESS;
+}
+
+// Parses the FrameHeader and the total frame_size, given the initial bytes
+// of the frame up to and including the TOC.
+// TODO(lode): merge this with FrameDecoder
+JxlDecoderStatus ParseFrameHeader(JxlDecoder* dec,
+                                  jxl::FrameHeader* frame_header,
+                                  const uint8_t* in, size_t size, size_t pos,
+                                  bool is_preview, size_t* frame_size,
+                                  int* saved_as) {
+  std::vector<uint64_t> group_offsets;
+  std::vector<uint32_t> group_sizes;
+  size_t header_size;
+  JxlDecoderStatus status = ReadFrameHeaderAndTOC(
+      dec, frame_header, in, size, pos, is_preview, frame_size, &group_offsets,
+      &group_sizes, &header_size);
+  if (status != JXL_DEC_SUCCESS) return status;
+
+  if (!is_preview) {
+    dec->frame_section_input.assign(group_sizes.size(), Span<const uint8_t>());
+    dec->num_frame_section_inputs = 0;
+    dec->frame_section_input_added.clear();
+    dec->frame_section_offsets = std::move(group_offsets);
+    dec->frame_section_sizes = std::move(group_sizes);
+    dec->frame_sections_begin = header_size;
+  }
 
   if (saved_as != nullptr) {
     *saved_as = FrameDecoder::SavedAs(*frame_header);
@@ -1160,9 +1933,220 @@ JxlDecoderStatus ParseFrameHeader(JxlDecoder* dec,
   return JXL_DEC_SUCCESS;
 }
 
+// When skipping frames, continues at the last frame listed in the frame index
+// box that is not beyond the frame skipped to, instead of going through all the
+// frames before it. Must be called before parsing a frame header.
+void SeekWithFrameIndex(JxlDecoder* dec) {
+  // The indexed frames start a displayed frame, so without coalescing the
+  // external index of the frames after them would be unknown.
+  if (dec->skip_frames == 0 || !dec->coalescing) return;
+  const size_t target = dec->external_frames + dec->skip_frames;
+  const FrameIndexEntry* seek_to = nullptr;
+  for (const FrameIndexEntry& entry : dec->frame_index) {
+    if (entry.frame > target) break;
+    if (entry.frame >= dec->external_frames &&
+        entry.codestream_offset > dec->frame_start) {
+      seek_to = &entry;
+    }
+  }
+  if (!seek_to) return;
+  const size_t num_skipped = seek_to->frame - dec->external_frames;
+  dec->skip_frames -= num_skipped;
+  dec->external_frames = seek_to->frame;
+  // Only a lower bound: frames that are not displayed are not counted.
+  dec->internal_frames += num_skipped;
+  dec->frame_start = seek_to->codestream_offset;
+  dec->passes_state->visible_frame_index = seek_to->frame;
+  dec->passes_state->nonvisible_frame_index = 0;
+  dec->frame_index_seeked = true;
+  dec->dirty_rect_in_still = false;
+  dec->dirty_rect_has_previous = false;
+  dec->canvas_slots = 0;
+  dec->frame_references.clear();
+  dec->frame_saved_as.clear();
+  dec->frame_external_to_internal.clear();
+  dec->frame_required.clear();
+}
+
+// Whether the DC of the current frame is the DC of the displayed image, and
+// can be output at low resolution for JXL_DEC_DC_IMAGE.
+bool HasDCImage(const JxlDecoder* dec) {
+  const FrameHeader& frame_header = *dec->frame_header;
+  return dec->is_last_of_still && !dec->skipping_frame &&
+         frame_header.frame_type == FrameType::kRegularFrame &&
+         !frame_header.custom_size_or_origin &&
+         frame_header.blending_info.mode == BlendMode::kReplace &&
+         dec->frame_dec->HasDCImage();
+}
+
+// Writes the DC of the current frame to the buffer set with
+// JxlDecoderSetDCOutBuffer, if any.
+JxlDecoderStatus OutputDCImage(JxlDecoder* dec) {
+  if (!dec->dc_out_buffer) return JXL_DEC_SUCCESS;
+  jxl::ScopedPhaseTimer timer(
+      dec->counters.Timer(jxl::DecoderCounters::kOutput));
+  jxl::ImageBundle dc(&dec->metadata.m);
+  JXL_API_RETURN_IF_ERROR(dec->frame_dec->GetDCImage(&dc));
+  const JxlPixelFormat& format = dec->dc_out_format;
+  const size_t xsize = jxl::DivCeil(
+      dec->metadata.oriented_xsize(dec->keep_orientation), jxl::kBlockDim);
+  size_t stride = jxl::DivCeil(
+      xsize * format.num_channels * BitsPerChannel(format.data_type),
+      jxl::kBitsPerByte);
+  if (format.align > 1) {
+    stride = jxl::DivCeil(stride, format.align) * format.align;
+  }
+  const jxl::Orientation undo_orientation =
+      dec->keep_orientation ? jxl::Orientation::kIdentity
+                            : dec->metadata.m.GetOrientation();
+  const bool float_format = format.data_type == JXL_TYPE_FLOAT ||
+                            format.data_type == JXL_TYPE_FLOAT16;
+  if (!jxl::ConvertToExternal(
+          dc, BitsPerChannel(format.data_type), float_format,
+          format.num_channels, format.endianness, stride,
+          dec->thread_pool.get(), dec->dc_out_buffer, dec->dc_out_size,
+          /*out_callback=*/{}, undo_orientation)) {
+    return JXL_API_ERROR("failed to output the DC image");
+  }
+  return JXL_DEC_SUCCESS;
+}
+
+// Whether the decoder settings allow decoding frames ahead: only full coalesced
+// frames are output, and the frame decoder options that DecodeFrame does not
+// have are off.
+bool CanDecodeAhead(const JxlDecoder* dec) {
+  if (dec->frame_lookahead == 0 || !dec->coalescing) return false;
+  if (!(dec->events_wanted & JXL_DEC_FULL_IMAGE)) return false;
+  if (dec->orig_events_wanted &
+      (JXL_DEC_FRAME_PROGRESSION | JXL_DEC_JPEG_RECONSTRUCTION)) {
+    return false;
+  }
+  if (UseCropRegion(dec) || UseDownsampling(dec)) return false;
+  if (dec->skip_frames != 0 || dec->cpu_limit_base != 0) return false;
+  if (dec->premultiply_alpha || dec->fast_integer_idct ||
+      dec->collect_render_stats || dec->use_frame_arena) {
+    return false;
+  }
+  return dec->num_frame_section_inputs == 0;
+}
+
+// Whether a frame can be decoded independently of the frames before and after
+// it: a displayed full-canvas frame that neither blends with nor is saved for
+// other frames.
+bool IsIndependentFrame(const FrameHeader& frame_header) {
+  if (frame_header.frame_type != FrameType::kRegularFrame) return false;
+  if (frame_header.CanBeReferenced() || frame_header.custom_size_or_origin) {
+    return false;
+  }
+  if (!frame_header.is_last && frame_header.animation_frame.duration == 0) {
+    return false;
+  }
+  if (frame_header.flags &
+      (FrameHeader::kPatches | FrameHeader::kUseDcFrame)) {
+    return false;
+  }
+  if (frame_header.blending_info.mode != BlendMode::kReplace) return false;
+  for (const BlendingInfo& info : frame_header.extra_channel_blending_info) {
+    if (info.mode != BlendMode::kReplace) return false;
+  }
+  return true;
+}
+
+// Decodes the frame at `span` into `ahead` independently of the decoder's
+// frame decoder, as the `i`-th displayed frame from the current one.
+void DecodeFrameAhead(const JxlDecoder* dec, Span<const uint8_t> span,
+                      size_t i, FrameDecodedAhead* ahead) {
+  jxl::DecompressParams dparams;
+  dparams.render_spotcolors = dec->render_spotcolors;
+  dparams.coalescing = true;
+  PassesDecoderState dec_state;
+  dec_state.output_encoding_info = dec->passes_state->output_encoding_info;
+  dec_state.visible_frame_index = dec->passes_state->visible_frame_index + i;
+  ahead->ib.reset(new jxl::ImageBundle(&dec->metadata.m));
+  auto reader = GetBitReader(span);
+  ahead->ok = !!DecodeFrame(dparams, &dec_state, /*pool=*/nullptr,
+                            reader.get(), ahead->ib.get(), dec->metadata,
+                            /*constraints=*/nullptr, /*is_preview=*/false);
+}
+
+// If the current frame and the ones after it are independent and already in
+// the input, decodes up to 1 + frame_lookahead of them at once, one frame per
+// thread of the parallel runner. Their ImageBundles are then output in order
+// without decoding them again. Must be called at the TOC of the current frame.
+void DecodeFramesAhead(JxlDecoder* dec, const uint8_t* in, size_t size) {
+  JXL_DASSERT(dec->frames_decoded_ahead.empty());
+  if (!CanDecodeAhead(dec) || !IsIndependentFrame(*dec->frame_header)) return;
+  std::vector<size_t> frame_starts;
+  std::vector<size_t> frame_sizes;
+  size_t frame_start = dec->frame_start;
+  size_t frame_size = dec->frame_size;
+  bool is_last = dec->frame_header->is_last;
+  for (;;) {
+    const size_t pos = frame_start - dec->codestream_pos;
+    if (OutOfBounds(pos, frame_size, size)) break;
+    frame_starts.push_back(frame_start);
+    frame_sizes.push_back(frame_size);
+    if (is_last || frame_starts.size() > dec->frame_lookahead) break;
+    frame_start += frame_size;
+    FrameHeader frame_header(&dec->metadata);
+    std::vector<uint64_t> group_offsets;
+    std::vector<uint32_t> group_sizes;
+    size_t header_size;
+    if (ReadFrameHeaderAndTOC(dec, &frame_header, in, size,
+                              frame_start - dec->codestream_pos,
+                              /*is_preview=*/false, &frame_size,
+                              &group_offsets, &group_sizes,
+                              &header_size) != JXL_DEC_SUCCESS ||
+        !IsIndependentFrame(frame_header)) {
+      break;
+    }
+    is_last = frame_header.is_last;
+  }
+  if (frame_starts.size() < 2) return;
+
+  dec->frames_decoded_ahead.resize(frame_starts.size());
+  const auto decode_frame = [&](const uint32_t i, size_t /*thread*/) {
+    FrameDecodedAhead* ahead = &dec->frames_decoded_ahead[i];
+    ahead->frame_start = frame_starts[i];
+    const size_t pos = frame_starts[i] - dec->codestream_pos;
+    DecodeFrameAhead(dec, Span<const uint8_t>(in + pos, frame_sizes[i]), i,
+                     ahead);
+  };
+  if (!RunOnPool(dec->thread_pool.get(), 0, frame_starts.size(),
+                 ThreadPool::NoInit, decode_frame, "DecodeFramesAhead")) {
+    dec->frames_decoded_ahead.clear();
+  }
+}
+
+// Makes the current frame use the ImageBundle decoded ahead for it by
+// DecodeFramesAhead, if any. Returns whether it did.
+bool UseFrameDecodedAhead(JxlDecoder* dec) {
+  std::deque<FrameDecodedAhead>& ahead = dec->frames_decoded_ahead;
+  while (!ahead.empty() && ahead.front().frame_start < dec->frame_start) {
+    ahead.pop_front();
+  }
+  if (ahead.empty() || ahead.front().frame_start != dec->frame_start) {
+    return false;
+  }
+  FrameDecodedAhead front = std::move(ahead.front());
+  ahead.pop_front();
+  // Decoding the frame again as usual reports the error.
+  if (!front.ok) return false;
+  // Same as FrameDecoder::FinalizeFrame, for a frame that was displayed and
+  // not saved.
+  ++dec->passes_state->visible_frame_index;
+  dec->passes_state->nonvisible_frame_index = 0;
+  dec->ib = std::move(front.ib);
+  dec->sections.reset();
+  dec->frame_dec.reset();
+  if (!dec->frame_index_seeked) {
+    dec->frame_references[dec->internal_frames - 1] = 0;
+  }
+  dec->counters.frames++;
+  return true;
+}
+
 // TODO(eustas): no CodecInOut -> no image size reinforcement -> possible OOM.
-// TODO(lode): allow this function to indicate bytes of in that have already
-// been processed and no longer need to be stored in codestream_copy.
 JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
                                              size_t size) {
   // If no parallel runner is set, use the default
@@ -1176,6 +2160,14 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
   if (!dec->got_basic_info) {
     JxlDecoderStatus status = JxlDecoderReadBasicInfo(dec, in, size);
     if (status != JXL_DEC_SUCCESS) return status;
+    if (dec->crop_set) {
+      const size_t xsize = dec->metadata.oriented_xsize(dec->keep_orientation);
+      const size_t ysize = dec->metadata.oriented_ysize(dec->keep_orientation);
+      if (dec->crop_x0 >= xsize || dec->crop_xsize > xsize - dec->crop_x0 ||
+          dec->crop_y0 >= ysize || dec->crop_ysize > ysize - dec->crop_y0) {
+        return JXL_API_ERROR("Crop region is outside of the image");
+      }
+    }
   }
 
   if (dec->events_wanted & JXL_DEC_BASIC_INFO) {
@@ -1220,7 +2212,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       // Want to decode the preview, not just skip the frame
       bool want_preview = (dec->events_wanted & JXL_DEC_PREVIEW_IMAGE);
       size_t frame_size;
-      size_t pos = dec->frame_start;
+      size_t pos = dec->frame_start - dec->codestream_pos;
       dec->frame_header.reset(new FrameHeader(&dec->metadata));
       JxlDecoderStatus status = ParseFrameHeader(
           dec, dec->frame_header.get(), in, size, pos, true, &frame_size,
@@ -1234,14 +2226,15 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
         return JXL_DEC_NEED_PREVIEW_OUT_BUFFER;
       }
 
-      jxl::Span<const uint8_t> compressed(in + dec->frame_start,
-                                          size - dec->frame_start);
+      jxl::Span<const uint8_t> compressed(in + pos, size - pos);
       auto reader = GetBitReader(compressed);
       jxl::DecompressParams dparams;
       dparams.render_spotcolors = dec->render_spotcolors;
       dparams.coalescing = true;
       jxl::ImageBundle ib(&dec->metadata.m);
       PassesDecoderState preview_dec_state;
+      preview_dec_state.output_encoding_info.desired_intensity_target =
+          dec->desired_intensity_target;
       JXL_API_RETURN_IF_ERROR(preview_dec_state.output_encoding_info.Set(
           dec->metadata,
           ColorEncoding::LinearSRGB(dec->metadata.m.color_encoding.IsGray())));
@@ -1261,7 +2254,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
           JxlDecoderStatus status = ConvertImageInternal(
               dec, ib, dec->preview_out_format, /*want_extra_channel=*/false,
               /*extra_channel_index=*/0, dec->preview_out_buffer,
-              dec->preview_out_size,
+              dec->preview_out_size, GetStride(dec, dec->preview_out_format),
               /*out_callback=*/{});
           if (status != JXL_DEC_SUCCESS) return status;
         }
@@ -1289,6 +2282,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
         return JXL_API_ERROR(
             "cannot decode a next frame after JPEG reconstruction frame");
       }
+      SeekWithFrameIndex(dec);
       size_t pos = dec->frame_start - dec->codestream_pos;
       if (pos >= size) {
         return JXL_DEC_NEED_MORE_INPUT;
@@ -1325,14 +2319,17 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       } else {
         dec->skipping_frame = false;
       }
+      UpdateDirtyRect(dec);
 
-      if (external_frame_index >= dec->frame_external_to_internal.size()) {
+      if (!dec->frame_index_seeked &&
+          external_frame_index >= dec->frame_external_to_internal.size()) {
         dec->frame_external_to_internal.push_back(internal_frame_index);
         JXL_ASSERT(dec->frame_external_to_internal.size() ==
                    external_frame_index + 1);
       }
 
-      if (internal_frame_index >= dec->frame_saved_as.size()) {
+      if (!dec->frame_index_seeked &&
+          internal_frame_index >= dec->frame_saved_as.size()) {
         dec->frame_saved_as.push_back(saved_as);
         JXL_ASSERT(dec->frame_saved_as.size() == internal_frame_index + 1);
 
@@ -1374,6 +2371,15 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       }
     }
 
+    if (dec->frame_stage == FrameStage::kTOC &&
+        !(dec->events_wanted & JXL_DEC_FULL_IMAGE)) {
+      // Pixels are not needed: ParseFrameHeader already read the TOC, so the
+      // sections are skipped without setting up a frame decoder.
+      dec->frame_stage = FrameStage::kHeader;
+      dec->frame_start += dec->frame_size;
+      continue;
+    }
+
     if (dec->frame_stage == FrameStage::kTOC) {
       size_t pos = dec->frame_start - dec->codestream_pos;
       if (pos >= size) {
@@ -1385,6 +2391,14 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       if (!dec->passes_state) {
         dec->passes_state.reset(new jxl::PassesDecoderState());
       }
+      if (dec->frames_decoded_ahead.empty()) {
+        DecodeFramesAhead(dec, in, size);
+      }
+      dec->frame_decoded_ahead = UseFrameDecodedAhead(dec);
+      if (dec->frame_decoded_ahead) {
+        dec->frame_stage = FrameStage::kFull;
+        continue;
+      }
       if (!dec->ib) {
         dec->ib.reset(new jxl::ImageBundle(&dec->metadata.m));
       }
@@ -1394,6 +2408,16 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
           /*use_slow_rendering_pipeline=*/false));
       dec->frame_dec->SetRenderSpotcolors(dec->render_spotcolors);
       dec->frame_dec->SetCoalescing(dec->coalescing);
+      dec->frame_dec->SetPremultiplyAlpha(dec->premultiply_alpha);
+      dec->frame_dec->SetAllowIntegerIDCT(dec->fast_integer_idct);
+      if (dec->collect_render_stats) {
+        dec->frame_dec->SetRenderPipelineStats(&dec->render_stats);
+      }
+      dec->frame_dec->SetCounters(&dec->counters);
+      dec->frame_dec->SetProgress(&dec->progress);
+      if (UseCropRegion(dec)) {
+        dec->frame_dec->SetCropRegion(StoredCropRect(dec));
+      }
       if (dec->events_wanted & JXL_DEC_FRAME_PROGRESSION) {
         dec->frame_dec->SetPauseAtProgressive();
       }
@@ -1408,6 +2432,11 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
           /*allow_partial_frames=*/true, /*allow_partial_dc_global=*/false,
           /*output_needed=*/dec->events_wanted & JXL_DEC_FULL_IMAGE);
       if (!status) JXL_API_RETURN_IF_ERROR(status);
+      if (UseDownsampling(dec) && !dec->ib->IsJPEG() &&
+          dec->frame_header->frame_type != FrameType::kReferenceOnly) {
+        dec->frame_dec->SetMaxPasses(
+            dec->frame_dec->NumPassesForDownsampling(dec->downsampling));
+      }
 
       size_t sections_begin =
           DivCeil(reader->TotalBitsConsumed(), kBitsPerByte);
@@ -1442,15 +2471,19 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
           }
         }
       }
+      if (dec->frame_decoded_ahead) dec->frame_stage = FrameStage::kFullOutput;
+    }
 
+    if (dec->frame_stage == FrameStage::kFull) {
       if (dec->image_out_buffer_set && !!dec->image_out_buffer &&
           dec->image_out_format.data_type == JXL_TYPE_UINT8 &&
           dec->image_out_format.num_channels >= 3 &&
-          dec->extra_channel_output.empty()) {
+          dec->extra_channel_output.empty() && !UseCropRegion(dec) &&
+          !UseDownsampling(dec) && !UseDirtyRectOutput(dec)) {
         bool is_rgba = dec->image_out_format.num_channels == 4;
         dec->frame_dec->MaybeSetRGB8OutputBuffer(
             reinterpret_cast<uint8_t*>(dec->image_out_buffer),
-            GetStride(dec, dec->image_out_format), is_rgba,
+            GetImageOutStride(dec), is_rgba,
             !dec->keep_orientation);
       }
 
@@ -1463,23 +2496,43 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       // TODO(lode): Support more formats than just native endian float32 for
       // the low-memory callback path
       if (dec->image_out_buffer_set && !!dec->image_out_init_callback &&
-          !!dec->image_out_run_callback &&
           dec->image_out_format.data_type == JXL_TYPE_FLOAT &&
           dec->image_out_format.num_channels >= 3 && !swap_endianness &&
-          dec->frame_dec_in_progress) {
+          dec->frame_dec_in_progress && !UseCropRegion(dec) &&
+          !UseDownsampling(dec)) {
         bool is_rgba = dec->image_out_format.num_channels == 4;
         dec->frame_dec->MaybeSetFloatCallback(
-            PixelCallback{
-                dec->image_out_init_callback, dec->image_out_run_callback,
-                dec->image_out_destroy_callback, dec->image_out_init_opaque},
-            is_rgba, !dec->keep_orientation);
+            GetImageOutCallback(dec), is_rgba, !dec->keep_orientation);
       }
 
-      size_t pos = dec->frame_start - dec->codestream_pos;
-      if (pos >= size) {
+      // The beginning of the frame may already have been pruned from the
+      // input, up to the first section that is still needed.
+      size_t begin = 0;
+      if (dec->codestream_pos > dec->frame_start) {
+        begin = dec->codestream_pos - dec->frame_start;
+      }
+      size_t pos = dec->frame_start + begin - dec->codestream_pos;
+      // Sections given with JxlDecoderSetFrameSectionInput can be processed
+      // before the frame data reaches them.
+      const Span<const uint8_t> chunk = dec->codestream_chunk;
+      if (pos >= size + chunk.size() && dec->num_frame_section_inputs == 0) {
         return JXL_DEC_NEED_MORE_INPUT;
       }
-      dec->sections->SetInput(in + pos, size - pos);
+      const uint8_t* data = in + std::min(pos, size);
+      size_t avail = pos < size ? size - pos : 0;
+      Span<const uint8_t> more = chunk;
+      if (pos > size) {
+        // The frame data resumes in the chunk read in place.
+        if (pos < size + chunk.size()) {
+          data = chunk.data() + pos - size;
+          avail = size + chunk.size() - pos;
+        }
+        more = Span<const uint8_t>();
+      }
+      dec->sections->SetInput(data, begin, begin + avail, more,
+                              dec->frame_section_input,
+                              dec->frame_section_input_added);
+      dec->frame_section_input_added.clear();
 
       if (dec->cpu_limit_base != 0) {
         FrameDimensions frame_dim = dec->frame_header->ToFrameDimensions();
@@ -1502,15 +2555,23 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       if (status.IsFatalError()) {
         return JXL_API_ERROR("decoding frame failed");
       }
-
-      // TODO(lode): allow next_in to move forward if sections from the
-      // beginning of the stream have been processed
+      dec->sections->RemoveDoneSections();
 
       bool all_sections_done = !!status && dec->frame_dec->HasDecodedAll();
 
       bool got_dc_only =
           !!status && !all_sections_done && dec->frame_dec->HasDecodedDC();
 
+      if ((dec->events_wanted & JXL_DEC_DC_IMAGE) && !!status &&
+          dec->frame_dec->HasDecodedDC()) {
+        dec->events_wanted &= ~JXL_DEC_DC_IMAGE;
+        if (HasDCImage(dec)) {
+          JxlDecoderStatus dc_status = OutputDCImage(dec);
+          if (dc_status != JXL_DEC_SUCCESS) return dc_status;
+          return JXL_DEC_DC_IMAGE;
+        }
+      }
+
       if ((dec->events_wanted & JXL_DEC_FRAME_PROGRESSION) && got_dc_only) {
         dec->events_wanted &= ~JXL_DEC_FRAME_PROGRESSION;
         return JXL_DEC_FRAME_PROGRESSION;
@@ -1522,14 +2583,17 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
       }
 
       size_t internal_index = dec->internal_frames - 1;
-      JXL_ASSERT(dec->frame_references.size() > internal_index);
-      // Always fill this in, even if it was already written, it could be that
-      // this frame was skipped before and set to 255, while only now we know
-      // the true value.
-      dec->frame_references[internal_index] = dec->frame_dec->References();
+      if (!dec->frame_index_seeked) {
+        JXL_ASSERT(dec->frame_references.size() > internal_index);
+        // Always fill this in, even if it was already written, it could be
+        // that this frame was skipped before and set to 255, while only now we
+        // know the true value.
+        dec->frame_references[internal_index] = dec->frame_dec->References();
+      }
       if (!dec->frame_dec->FinalizeFrame()) {
         return JXL_API_ERROR("decoding frame failed");
       }
+      dec->counters.frames++;
       // Copy exif/xmp metadata from their boxes into the jpeg_data, if
       // JPEG reconstruction is requested.
       if (dec->jpeg_decoder.IsOutputSet() && dec->ib->jpeg_data != nullptr) {
@@ -1552,27 +2616,28 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
         // from orig_events_wanted, in case there is a next frame.
         dec->events_wanted |=
             (dec->orig_events_wanted &
-             (JXL_DEC_FULL_IMAGE | JXL_DEC_FRAME | JXL_DEC_FRAME_PROGRESSION));
+             (JXL_DEC_FULL_IMAGE | JXL_DEC_FRAME | JXL_DEC_FRAME_PROGRESSION |
+              JXL_DEC_DC_IMAGE));
 
         // If no output buffer was set, we merely return the JXL_DEC_FULL_IMAGE
         // status without outputting pixels.
         if (dec->jpeg_decoder.IsOutputSet() && dec->ib->jpeg_data != nullptr) {
           output_jpeg_reconstruction = true;
         } else if (return_full_image && dec->image_out_buffer_set) {
-          if (!dec->frame_dec->HasRGBBuffer()) {
+          const bool has_rgb_buffer =
+              dec->frame_dec && dec->frame_dec->HasRGBBuffer();
+          if (!has_rgb_buffer && !dec->image_out_plane_callback) {
             // Copy pixels if desired.
             JxlDecoderStatus status = ConvertImageInternal(
                 dec, *dec->ib, dec->image_out_format,
                 /*want_extra_channel=*/false,
                 /*extra_channel_index=*/0, dec->image_out_buffer,
-                dec->image_out_size,
-                PixelCallback{dec->image_out_init_callback,
-                              dec->image_out_run_callback,
-                              dec->image_out_destroy_callback,
-                              dec->image_out_init_opaque});
+                dec->image_out_size, GetImageOutStride(dec),
+                GetImageOutCallback(dec));
             if (status != JXL_DEC_SUCCESS) return status;
           }
           dec->image_out_buffer_set = false;
+          dec->image_out_plane_callback = nullptr;
 
           bool has_ec = !dec->ib->extra_channels().empty();
           for (size_t i = 0; i < dec->extra_channel_output.size(); ++i) {
@@ -1588,7 +2653,8 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
             JxlDecoderStatus status = ConvertImageInternal(
                 dec, *dec->ib, *format,
                 /*want_extra_channel=*/true, /*extra_channel_index=*/i, buffer,
-                dec->extra_channel_output[i].buffer_size, /*out_callback=*/{});
+                dec->extra_channel_output[i].buffer_size,
+                GetStride(dec, *format), /*out_callback=*/{});
             if (status != JXL_DEC_SUCCESS) return status;
           }
 
@@ -1618,6 +2684,91 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec, const uint8_t* in,
   return JXL_DEC_SUCCESS;
 }
 
+// Returns the position in the codestream before which
+// JxlDecoderProcessCodestream no longer needs the bytes: everything before the
+// current frame, and the sections of it that were already processed. This is
+// zero before all headers are decoded, since those are parsed from the start
+// of the codestream.
+size_t FirstNeededPosition(JxlDecoder* dec) {
+  if (!dec->got_all_headers || !dec->got_preview_image) return 0;
+  size_t needed = dec->frame_start;
+  if (dec->frame_stage == FrameStage::kFull && dec->sections) {
+    needed += dec->sections->FirstPendingPosition(dec->frame_section_input);
+  }
+  return needed;
+}
+
+// Erases the bytes from the beginning of codestream_copy that are no longer
+// needed, see FirstNeededPosition.
+void PruneCodestreamCopy(JxlDecoder* dec) {
+  size_t needed = FirstNeededPosition(dec);
+  if (needed <= dec->codestream_pos) return;
+  size_t erase = std::min(needed - dec->codestream_pos,
+                          dec->codestream_copy.size());
+  dec->codestream_copy.erase(dec->codestream_copy.begin(),
+                             dec->codestream_copy.begin() + erase);
+  dec->codestream_pos += erase;
+}
+
+// Updates the input bytes of the memory stats after codestream_copy grew,
+// since the vector does not allocate through CacheAligned.
+void CountCodestreamCopy(JxlDecoder* dec) {
+  const size_t capacity = dec->codestream_copy.capacity();
+  if (capacity == dec->codestream_copy_counted) return;
+  dec->memory_stats.Remove(CacheAligned::Category::kInput,
+                           dec->codestream_copy_counted);
+  dec->memory_stats.Add(CacheAligned::Category::kInput, capacity);
+  dec->codestream_copy_counted = capacity;
+}
+
+// Consumes the next `size` bytes of input, which follow the ones of
+// codestream_copy in the codestream, keeping in the copy those that are still
+// needed. If the copy is empty, the bytes before FirstNeededPosition are
+// skipped rather than copied.
+void KeepCodestreamInput(JxlDecoder* dec, size_t size) {
+  if (dec->codestream_copy.empty()) {
+    size_t needed = FirstNeededPosition(dec);
+    size_t skip = needed > dec->codestream_pos
+                      ? std::min(needed - dec->codestream_pos, size)
+                      : 0;
+    dec->codestream_pos += skip;
+    dec->AdvanceInput(skip);
+    size -= skip;
+  }
+  dec->codestream_copy.insert(dec->codestream_copy.end(), dec->next_in,
+                              dec->next_in + size);
+  CountCodestreamCopy(dec);
+  dec->AdvanceInput(size);
+}
+
+// Whether JxlDecoderProcessCodestream reads the next codestream input in
+// place as codestream_chunk, rather than appended to codestream_copy: this is
+// the case while the sections of a frame are decoded, which do not need to be
+// contiguous with the bytes kept from earlier inputs or boxes.
+bool ReadsCodestreamChunk(const JxlDecoder* dec) {
+  return !dec->codestream_copy.empty() && dec->got_all_headers &&
+         dec->got_preview_image && dec->frame_stage == FrameStage::kFull &&
+         dec->sections;
+}
+
+// Consumes the `size` bytes of input that JxlDecoderProcessCodestream read in
+// place as codestream_chunk. If the bytes kept in codestream_copy are no
+// longer needed, only skips the input up to FirstNeededPosition: the rest of
+// it is then read in place as the start of the codestream data. Otherwise
+// keeps the input in the copy.
+void ConsumeCodestreamChunk(JxlDecoder* dec, size_t size) {
+  dec->codestream_chunk = Span<const uint8_t>();
+  PruneCodestreamCopy(dec);
+  if (!dec->codestream_copy.empty()) {
+    KeepCodestreamInput(dec, size);
+    return;
+  }
+  size_t needed = FirstNeededPosition(dec);
+  size_t skip = std::min(needed - dec->codestream_pos, size);
+  dec->codestream_pos += skip;
+  dec->AdvanceInput(skip);
+}
+
 }  // namespace
 }  // namespace jxl
 
@@ -1790,8 +2941,11 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
 
     if (dec->recon_output_jpeg == JpegReconStage::kOutputting &&
         !dec->JbrdNeedMoreBoxes()) {
+      jxl::ScopedPhaseTimer timer(
+          dec->counters.Timer(jxl::DecoderCounters::kOutput));
       JxlDecoderStatus status =
-          dec->jpeg_decoder.WriteOutput(*dec->ib->jpeg_data);
+          dec->jpeg_decoder.WriteOutput(*dec->ib->jpeg_data,
+                                        dec->thread_pool.get());
       if (status != JXL_DEC_SUCCESS) return status;
       dec->recon_output_jpeg = JpegReconStage::kFinished;
       dec->ib.reset();
@@ -1923,6 +3077,10 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
               "multiple JPEG reconstruction boxes not supported");
         }
         dec->box_stage = BoxStage::kJpegRecon;
+      } else if (memcmp(dec->box_type, "jxli", 4) == 0 &&
+                 !dec->box_contents_unbounded &&
+                 dec->box_contents_size <= kMaxFrameIndexBoxSize) {
+        dec->box_stage = BoxStage::kFrameIndex;
       } else {
         dec->box_stage = BoxStage::kSkip;
       }
@@ -1967,11 +3125,18 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
       }
 
       bool have_copy = !dec->codestream_copy.empty();
-      if (have_copy) {
-        // TODO(lode): prune the codestream_copy vector if the codestream
-        // decoder no longer needs data from previous frames.
+      const size_t chunk_size = avail_codestream;
+      const bool use_chunk = jxl::ReadsCodestreamChunk(dec);
+      if (use_chunk) {
+        // The sections in this input, e.g. the payload of the next jxlp box,
+        // are decoded without stitching it to the bytes kept so far.
+        dec->codestream_chunk =
+            jxl::Span<const uint8_t>(dec->next_in, avail_codestream);
+        avail_codestream = dec->codestream_copy.size();
+      } else if (have_copy) {
         dec->codestream_copy.insert(dec->codestream_copy.end(), dec->next_in,
                                     dec->next_in + avail_codestream);
+        jxl::CountCodestreamCopy(dec);
         dec->AdvanceInput(avail_codestream);
         avail_codestream = dec->codestream_copy.size();
       }
@@ -1981,17 +3146,22 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
 
       JxlDecoderStatus status =
           jxl::JxlDecoderProcessCodestream(dec, codestream, avail_codestream);
+      if (use_chunk) {
+        jxl::ConsumeCodestreamChunk(dec, chunk_size);
+        if (status == JXL_DEC_NEED_MORE_INPUT && chunk_size != 0) {
+          // The next frame header may be in the input that was only read as
+          // sections, try again with it in place or appended to the copy.
+          continue;
+        }
+      }
       if (status == JXL_DEC_FULL_IMAGE) {
         if (dec->recon_output_jpeg != JpegReconStage::kNone) {
           continue;
         }
       }
       if (status == JXL_DEC_NEED_MORE_INPUT) {
-        if (!have_copy) {
-          dec->codestream_copy.insert(dec->codestream_copy.end(), dec->next_in,
-                                      dec->next_in + avail_codestream);
-          dec->AdvanceInput(avail_codestream);
-        }
+        if (!have_copy) jxl::KeepCodestreamInput(dec, avail_codestream);
+        jxl::PruneCodestreamCopy(dec);
 
         if (dec->file_pos == dec->box_contents_end) {
           dec->box_stage = BoxStage::kHeader;
@@ -2078,6 +3248,13 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
         // If anything else, return the result.
         return recon_result;
       }
+    } else if (dec->box_stage == BoxStage::kFrameIndex) {
+      // The box is parsed at once, leaving the input to the skip stage.
+      const size_t remaining = dec->box_contents_end - dec->file_pos;
+      if (dec->avail_in < remaining) return JXL_DEC_NEED_MORE_INPUT;
+      // An invalid index is ignored, it is only used for seeking.
+      (void)ParseFrameIndexBox(dec->next_in, remaining, &dec->frame_index);
+      dec->box_stage = BoxStage::kSkip;
     } else if (dec->box_stage == BoxStage::kSkip) {
       if (dec->box_contents_unbounded) {
         if (dec->input_closed) {
@@ -2116,7 +3293,8 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
   return JXL_DEC_SUCCESS;
 }
 
-JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
+namespace {
+JxlDecoderStatus ProcessInput(JxlDecoder* dec) {
   if (dec->stage == DecoderStage::kInited) {
     dec->stage = DecoderStage::kStarted;
   }
@@ -2171,6 +3349,77 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
 
   return status;
 }
+}  // namespace
+
+namespace {
+JxlDecoderStatus ProcessInputWithMemoryLimit(JxlDecoder* dec) {
+  jxl::CacheAligned::ScopedMemoryManager scoped_memory_manager(
+      BufferMemoryManager(dec), &dec->memory_stats);
+  const JxlDecoderStatus status = ProcessInput(dec);
+  if (dec->memory_stats.limit_exceeded.load(std::memory_order_relaxed)) {
+    dec->stage = DecoderStage::kError;
+    return JXL_API_ERROR("memory limit exceeded");
+  }
+  return status;
+}
+
+// JxlDecoderTask of JxlDecoderProcessInputAsync.
+void ProcessInputTask(void* task_opaque) {
+  JxlDecoder* dec = static_cast<JxlDecoder*>(task_opaque);
+  const JxlDecoderStatus status = ProcessInputWithMemoryLimit(dec);
+  const JxlDecoderDoneCallback done = dec->async_done;
+  void* done_opaque = dec->async_done_opaque;
+  // Cleared first, so that the callback can submit the next call.
+  dec->async_pending.store(false, std::memory_order_release);
+  done(done_opaque, status);
+}
+}  // namespace
+
+JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
+  if (dec->async_pending.load(std::memory_order_acquire)) {
+    return JXL_API_ERROR("JxlDecoderProcessInputAsync is not done yet");
+  }
+  return ProcessInputWithMemoryLimit(dec);
+}
+
+JxlDecoderStatus JxlDecoderProcessInputAsync(JxlDecoder* dec,
+                                             JxlDecoderSubmitFunction submit,
+                                             void* submit_opaque,
+                                             JxlDecoderDoneCallback done,
+                                             void* done_opaque) {
+  if (submit == nullptr || done == nullptr) {
+    return JXL_API_ERROR("submit and done functions are required");
+  }
+  bool pending = false;
+  if (!dec->async_pending.compare_exchange_strong(pending, true,
+                                                  std::memory_order_acq_rel)) {
+    return JXL_API_ERROR("JxlDecoderProcessInputAsync is not done yet");
+  }
+  dec->async_done = done;
+  dec->async_done_opaque = done_opaque;
+  submit(submit_opaque, &ProcessInputTask, dec);
+  return JXL_DEC_SUCCESS;
+}
+
+// The categories of CacheAligned are those of JxlMemoryCategory, in order.
+static_assert(jxl::CacheAligned::kNumCategories == JXL_MEMORY_NUM_CATEGORIES,
+              "memory categories must match");
+
+void JxlDecoderGetMemoryStats(const JxlDecoder* dec, JxlMemoryStats* stats) {
+  const jxl::CacheAligned::Stats& s = dec->memory_stats;
+  stats->current_bytes = s.total_bytes.load(std::memory_order_relaxed);
+  stats->peak_bytes = s.peak_total_bytes.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < JXL_MEMORY_NUM_CATEGORIES; i++) {
+    stats->current_bytes_per_category[i] =
+        s.bytes[i].load(std::memory_order_relaxed);
+    stats->peak_bytes_per_category[i] =
+        s.peak_bytes[i].load(std::memory_order_relaxed);
+  }
+}
+
+void JxlDecoderSetMemoryLimit(JxlDecoder* dec, uint64_t max_bytes) {
+  dec->memory_stats.limit.store(max_bytes, std::memory_order_relaxed);
+}
 
 // To ensure ABI forward-compatibility, this struct has a constant size.
 static_assert(sizeof(JxlBasicInfo) == 204,
@@ -2203,6 +3452,10 @@ JxlDecoderStatus JxlDecoderGetBasicInfo(const JxlDecoder* dec,
     }
 
     info->intensity_target = meta.IntensityTarget();
+    if (meta.xyb_encoded && dec->desired_intensity_target > 0 &&
+        dec->desired_intensity_target < info->intensity_target) {
+      info->intensity_target = dec->desired_intensity_target;
+    }
     info->min_nits = meta.tone_mapping.min_nits;
     info->relative_to_max_display = meta.tone_mapping.relative_to_max_display;
     info->linear_below = meta.tone_mapping.linear_below;
@@ -2415,8 +3668,10 @@ JxlDecoderStatus PrepareSizeCheck(const JxlDecoder* dec,
 }  // namespace
 
 JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec) {
+  jxl::CacheAligned::ScopedMemoryManager scoped_memory_manager(
+      BufferMemoryManager(dec), &dec->memory_stats);
   if (!dec->image_out_buffer) return JXL_DEC_ERROR;
-  if (!dec->sections || dec->sections->section_info.empty()) {
+  if (!dec->sections || !dec->sections->HasReceivedSections()) {
     return JXL_DEC_ERROR;
   }
   if (!dec->frame_dec || !dec->frame_dec_in_progress) {
@@ -2451,7 +3706,7 @@ JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec) {
       dec, *dec->ib, dec->image_out_format,
       /*want_extra_channel=*/false,
       /*extra_channel_index=*/0, dec->image_out_buffer, dec->image_out_size,
-      /*out_callback=*/{});
+      jxl::GetImageOutStride(dec), /*out_callback=*/{});
   dec->ib->ShrinkTo(xsize, ysize);
   if (status != JXL_DEC_SUCCESS) return status;
   return JXL_DEC_SUCCESS;
@@ -2529,7 +3784,25 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderDCOutBufferSize(
 
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetDCOutBuffer(
     JxlDecoder* dec, const JxlPixelFormat* format, void* buffer, size_t size) {
-  // No buffer set: this feature is deprecated
+  if (!(dec->orig_events_wanted & JXL_DEC_DC_IMAGE)) {
+    return JXL_API_ERROR("No DC out buffer needed without JXL_DEC_DC_IMAGE");
+  }
+  if (format->num_channels < 3 && !dec->metadata.m.color_encoding.IsGray()) {
+    return JXL_API_ERROR("Grayscale output not possible for color image");
+  }
+
+  size_t min_size;
+  // This also checks whether the format is valid and supported and basic info
+  // is available.
+  JxlDecoderStatus status = JxlDecoderDCOutBufferSize(dec, format, &min_size);
+  if (status != JXL_DEC_SUCCESS) return status;
+
+  if (size < min_size) return JXL_DEC_ERROR;
+
+  dec->dc_out_buffer = buffer;
+  dec->dc_out_size = size;
+  dec->dc_out_format = *format;
+
   return JXL_DEC_SUCCESS;
 }
 
@@ -2556,10 +3829,18 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderImageOutBufferSize(
 JxlDecoderStatus JxlDecoderSetImageOutBuffer(JxlDecoder* dec,
                                              const JxlPixelFormat* format,
                                              void* buffer, size_t size) {
+  return JxlDecoderSetImageOutBufferWithStride(dec, format, buffer, size,
+                                               /*stride=*/0);
+}
+
+JxlDecoderStatus JxlDecoderSetImageOutBufferWithStride(
+    JxlDecoder* dec, const JxlPixelFormat* format, void* buffer, size_t size,
+    size_t stride) {
   if (!dec->got_basic_info || !(dec->orig_events_wanted & JXL_DEC_FULL_IMAGE)) {
     return JXL_API_ERROR("No image out buffer needed at this time");
   }
-  if (dec->image_out_buffer_set && !!dec->image_out_run_callback) {
+  if (dec->image_out_buffer_set && (!!dec->image_out_init_callback ||
+                                    !!dec->image_out_plane_callback)) {
     return JXL_API_ERROR(
         "Cannot change from image out callback to image out buffer");
   }
@@ -2573,11 +3854,24 @@ JxlDecoderStatus JxlDecoderSetImageOutBuffer(JxlDecoder* dec,
       JxlDecoderImageOutBufferSize(dec, format, &min_size);
   if (status != JXL_DEC_SUCCESS) return status;
 
+  if (stride != 0) {
+    // The last row only needs the bytes of its pixels.
+    JxlPixelFormat unaligned = *format;
+    unaligned.align = 0;
+    status = JxlDecoderImageOutBufferSize(dec, &unaligned, &min_size);
+    if (status != JXL_DEC_SUCCESS) return status;
+    size_t xsize, ysize;
+    GetCurrentDimensions(dec, xsize, ysize, true);
+    const size_t row_size = min_size / ysize;
+    if (stride < row_size) return JXL_API_ERROR("stride smaller than a row");
+    min_size = stride * (ysize - 1) + row_size;
+  }
   if (size < min_size) return JXL_DEC_ERROR;
 
   dec->image_out_buffer_set = true;
   dec->image_out_buffer = buffer;
   dec->image_out_size = size;
+  dec->image_out_stride = stride;
   dec->image_out_format = *format;
 
   return JXL_DEC_SUCCESS;
@@ -2666,16 +3960,25 @@ JxlDecoderStatus JxlDecoderSetImageOutCallback(JxlDecoder* dec,
       /*destroy_callback=*/destroy_callback, &dec->simple_image_out_callback);
 }
 
-JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
+namespace {
+
+// Sets either `run_callback` or `tile_callback`, the other one being null.
+JxlDecoderStatus SetImageOutCallbacks(
     JxlDecoder* dec, const JxlPixelFormat* format,
     JxlImageOutInitCallback init_callback, JxlImageOutRunCallback run_callback,
+    JxlImageOutTileCallback tile_callback,
     JxlImageOutDestroyCallback destroy_callback, void* init_opaque) {
   if (dec->image_out_buffer_set && !!dec->image_out_buffer) {
     return JXL_API_ERROR(
         "Cannot change from image out buffer to image out callback");
   }
+  if (dec->image_out_buffer_set && !!dec->image_out_plane_callback) {
+    return JXL_API_ERROR(
+        "Cannot change from planar out callback to image out callback");
+  }
 
-  if (init_callback == nullptr || run_callback == nullptr ||
+  if (init_callback == nullptr ||
+      (run_callback == nullptr && tile_callback == nullptr) ||
       destroy_callback == nullptr) {
     return JXL_API_ERROR("All callbacks are required");
   }
@@ -2688,6 +3991,7 @@ JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
   dec->image_out_buffer_set = true;
   dec->image_out_init_callback = init_callback;
   dec->image_out_run_callback = run_callback;
+  dec->image_out_tile_callback = tile_callback;
   dec->image_out_destroy_callback = destroy_callback;
   dec->image_out_init_opaque = init_opaque;
   dec->image_out_format = *format;
@@ -2695,6 +3999,90 @@ JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
   return JXL_DEC_SUCCESS;
 }
 
+}  // namespace
+
+JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    JxlImageOutInitCallback init_callback, JxlImageOutRunCallback run_callback,
+    JxlImageOutDestroyCallback destroy_callback, void* init_opaque) {
+  if (run_callback == nullptr) {
+    return JXL_API_ERROR("All callbacks are required");
+  }
+  return SetImageOutCallbacks(dec, format, init_callback, run_callback,
+                              /*tile_callback=*/nullptr, destroy_callback,
+                              init_opaque);
+}
+
+JxlDecoderStatus JxlDecoderSetMultithreadedImageOutTileCallback(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    JxlImageOutInitCallback init_callback, JxlImageOutTileCallback run_callback,
+    JxlImageOutDestroyCallback destroy_callback, void* init_opaque) {
+  if (run_callback == nullptr) {
+    return JXL_API_ERROR("All callbacks are required");
+  }
+  return SetImageOutCallbacks(dec, format, init_callback,
+                              /*run_callback=*/nullptr, run_callback,
+                              destroy_callback, init_opaque);
+}
+
+JxlDecoderStatus JxlDecoderSetYCbCrPlanarOutCallback(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    JxlImageOutPlaneCallback callback, void* opaque) {
+  if (dec->frame_stage != FrameStage::kFull || !dec->frame_dec_in_progress) {
+    return JXL_API_ERROR("No image out buffer needed at this time");
+  }
+  if (dec->image_out_buffer_set) {
+    return JXL_API_ERROR("Image out buffer or callback already set");
+  }
+  if (callback == nullptr) {
+    return JXL_API_ERROR("Planar out callback is required");
+  }
+  if (format->num_channels != 1 || (format->data_type != JXL_TYPE_UINT8 &&
+                                    format->data_type != JXL_TYPE_FLOAT)) {
+    return JXL_API_ERROR("Planar output must be one channel uint8 or float");
+  }
+  if (format->data_type == JXL_TYPE_FLOAT &&
+      format->endianness != JXL_NATIVE_ENDIAN &&
+      (format->endianness == JXL_LITTLE_ENDIAN) != IsLittleEndian()) {
+    return JXL_API_ERROR("Planar float output must be native endian");
+  }
+  if (UseCropRegion(dec) || UseDownsampling(dec)) {
+    return JXL_API_ERROR(
+        "Planar output is not supported with crop region or downsampling");
+  }
+  if (!dec->frame_dec->SetYCbCrPlanarCallback(
+          jxl::PlanarCallback(callback, opaque, format->data_type),
+          !dec->keep_orientation)) {
+    return JXL_API_ERROR("Frame cannot be output as YCbCr planes");
+  }
+
+  dec->image_out_buffer_set = true;
+  dec->image_out_plane_callback = callback;
+  dec->image_out_format = *format;
+
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderGetYCbCrPlaneShifts(const JxlDecoder* dec,
+                                               uint32_t plane,
+                                               uint32_t* shift_x,
+                                               uint32_t* shift_y) {
+  if (!dec->frame_header || dec->frame_stage == FrameStage::kHeader) {
+    return JXL_API_ERROR("no frame header available");
+  }
+  if (dec->frame_header->color_transform != jxl::ColorTransform::kYCbCr) {
+    return JXL_API_ERROR("Frame is not stored as YCbCr");
+  }
+  if (plane >= 3) return JXL_API_ERROR("Invalid plane index");
+  // Channels are stored as Cb, Y, Cr; planes are numbered Y, Cb, Cr.
+  static const size_t kPlaneChannel[3] = {1, 0, 2};
+  const jxl::YCbCrChromaSubsampling& cs =
+      dec->frame_header->chroma_subsampling;
+  *shift_x = cs.HShift(kPlaneChannel[plane]);
+  *shift_y = cs.VShift(kPlaneChannel[plane]);
+  return JXL_DEC_SUCCESS;
+}
+
 JxlDecoderStatus JxlDecoderGetFrameHeader(const JxlDecoder* dec,
                                           JxlFrameHeader* header) {
   if (!dec->frame_header || dec->frame_stage == FrameStage::kHeader) {
@@ -2757,6 +4145,40 @@ JxlDecoderStatus JxlDecoderGetFrameHeader(const JxlDecoder* dec,
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderGetFrameDirtyRect(const JxlDecoder* dec,
+                                             uint32_t* x0, uint32_t* y0,
+                                             uint32_t* xsize,
+                                             uint32_t* ysize) {
+  if (!dec->frame_header || dec->frame_stage == FrameStage::kHeader) {
+    return JXL_API_ERROR("no frame header available");
+  }
+  if (!dec->coalescing) {
+    return JXL_API_ERROR("dirty rect is only available with coalescing");
+  }
+  jxl::Rect rect = OrientedRect(dec, dec->dirty_rect);
+  if (UseCropRegion(dec)) {
+    const jxl::Rect crop(dec->crop_x0, dec->crop_y0, dec->crop_xsize,
+                         dec->crop_ysize);
+    rect = rect.Intersection(crop);
+    rect = rect.xsize() == 0 || rect.ysize() == 0
+               ? jxl::Rect()
+               : jxl::Rect(rect.x0() - crop.x0(), rect.y0() - crop.y0(),
+                           rect.xsize(), rect.ysize());
+  }
+  if (UseDownsampling(dec) && rect.xsize() != 0 && rect.ysize() != 0) {
+    const size_t factor = dec->downsampling;
+    const size_t rx0 = rect.x0() / factor;
+    const size_t ry0 = rect.y0() / factor;
+    rect = jxl::Rect(rx0, ry0, jxl::DivCeil(rect.x1(), factor) - rx0,
+                     jxl::DivCeil(rect.y1(), factor) - ry0);
+  }
+  *x0 = rect.x0();
+  *y0 = rect.y0();
+  *xsize = rect.xsize();
+  *ysize = rect.ysize();
+  return JXL_DEC_SUCCESS;
+}
+
 JxlDecoderStatus JxlDecoderGetExtraChannelBlendInfo(const JxlDecoder* dec,
                                                     size_t index,
                                                     JxlBlendInfo* blend_info) {
@@ -2792,6 +4214,104 @@ JxlDecoderStatus JxlDecoderGetFrameName(const JxlDecoder* dec, char* name,
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderGetFrameCodestreamRange(const JxlDecoder* dec,
+                                                   uint64_t* offset,
+                                                   uint64_t* size) {
+  if (!dec->frame_header || dec->frame_stage == FrameStage::kHeader) {
+    return JXL_API_ERROR("no frame header available");
+  }
+  *offset = dec->frame_start;
+  *size = dec->frame_size;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderGetFrameNumSections(const JxlDecoder* dec,
+                                               size_t* num) {
+  if (!dec->frame_header || dec->frame_stage == FrameStage::kHeader) {
+    return JXL_API_ERROR("no frame header available");
+  }
+  *num = dec->frame_section_sizes.size();
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderGetFrameSection(const JxlDecoder* dec, size_t index,
+                                           JxlFrameSection* section) {
+  if (!dec->frame_header || dec->frame_stage == FrameStage::kHeader) {
+    return JXL_API_ERROR("no frame header available");
+  }
+  if (index >= dec->frame_section_sizes.size()) {
+    return JXL_API_ERROR("invalid section index");
+  }
+  const jxl::FrameDimensions frame_dim = dec->frame_header->ToFrameDimensions();
+  section->group = 0;
+  section->pass = 0;
+  section->offset = dec->frame_start + dec->frame_sections_begin +
+                    dec->frame_section_offsets[index];
+  section->size = dec->frame_section_sizes[index];
+  // Size in pixels of the groups of the section and number of them per row,
+  // group_dim is 0 for the sections that cover the whole frame.
+  size_t group_dim = 0;
+  size_t xsize_groups = 1;
+  const size_t ac_global_index = frame_dim.num_dc_groups + 1;
+  if (dec->frame_section_sizes.size() == 1) {
+    section->type = JXL_FRAME_SECTION_ALL;
+  } else if (index == 0) {
+    section->type = JXL_FRAME_SECTION_DC_GLOBAL;
+  } else if (index < ac_global_index) {
+    section->type = JXL_FRAME_SECTION_DC_GROUP;
+    section->group = index - 1;
+    group_dim = frame_dim.dc_group_dim;
+    xsize_groups = frame_dim.xsize_dc_groups;
+  } else if (index == ac_global_index) {
+    section->type = JXL_FRAME_SECTION_AC_GLOBAL;
+  } else {
+    const size_t ac_index = index - ac_global_index - 1;
+    section->type = JXL_FRAME_SECTION_AC_GROUP;
+    section->group = ac_index % frame_dim.num_groups;
+    section->pass = ac_index / frame_dim.num_groups;
+    group_dim = frame_dim.group_dim;
+    xsize_groups = frame_dim.xsize_groups;
+  }
+  const size_t xsize = frame_dim.xsize_upsampled;
+  const size_t ysize = frame_dim.ysize_upsampled;
+  if (group_dim == 0) {
+    section->x0 = 0;
+    section->y0 = 0;
+    section->xsize = xsize;
+    section->ysize = ysize;
+    return JXL_DEC_SUCCESS;
+  }
+  const size_t dim = group_dim * dec->frame_header->upsampling;
+  const size_t x0 = section->group % xsize_groups * dim;
+  const size_t y0 = section->group / xsize_groups * dim;
+  section->x0 = x0;
+  section->y0 = y0;
+  section->xsize = x0 < xsize ? std::min(dim, xsize - x0) : 0;
+  section->ysize = y0 < ysize ? std::min(dim, ysize - y0) : 0;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetFrameSectionInput(JxlDecoder* dec, size_t index,
+                                                const uint8_t* data,
+                                                size_t size) {
+  if (!dec->frame_header || (dec->frame_stage != FrameStage::kTOC &&
+                             dec->frame_stage != FrameStage::kFull)) {
+    return JXL_API_ERROR("no frame being decoded");
+  }
+  if (index >= dec->frame_section_sizes.size()) {
+    return JXL_API_ERROR("invalid section index");
+  }
+  if (data == nullptr || size != dec->frame_section_sizes[index]) {
+    return JXL_API_ERROR("section input does not match the TOC");
+  }
+  if (dec->frame_section_input[index].data() == nullptr) {
+    dec->num_frame_section_inputs++;
+    dec->frame_section_input_added.push_back(index);
+  }
+  dec->frame_section_input[index] = jxl::Span<const uint8_t>(data, size);
+  return JXL_DEC_SUCCESS;
+}
+
 JxlDecoderStatus JxlDecoderSetPreferredColorProfile(
     JxlDecoder* dec, const JxlColorEncoding* color_encoding) {
   if (!dec->got_all_headers) {
@@ -2811,6 +4331,8 @@ JxlDecoderStatus JxlDecoderSetPreferredColorProfile(
 
   JXL_API_RETURN_IF_ERROR(ConvertExternalToInternalColorEncoding(
       *color_encoding, &dec->default_enc));
+  dec->passes_state->output_encoding_info.desired_intensity_target =
+      dec->desired_intensity_target;
   JXL_API_RETURN_IF_ERROR(dec->passes_state->output_encoding_info.Set(
       dec->metadata, dec->default_enc));
   return JXL_DEC_SUCCESS;
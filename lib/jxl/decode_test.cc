@@ -8,6 +8,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <sstream>
 #include <string>
 #include <utility>
@@ -24,6 +27,7 @@
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/dec_external_image.h"
+#include "lib/jxl/enc_animation.h"
 #include "lib/jxl/enc_butteraugli_comparator.h"
 #include "lib/jxl/enc_color_management.h"
 #include "lib/jxl/enc_external_image.h"
@@ -1837,6 +1841,129 @@ void TestPartialStream(bool reconstructible_jpeg) {
 // should return JXL_DEC_NEED_MORE_INPUT, not error.
 TEST(DecodeTest, PixelPartialTest) { TestPartialStream(false); }
 
+// A frame of many groups, with a permuted TOC, given in small pieces decodes
+// like it does from the whole file.
+TEST(DecodeTest, PartialStreamPermutedSectionsTest) {
+  const size_t xsize = 700, ysize = 600;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  cparams.centerfirst = true;
+  jxl::PaddedBytes data = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  const std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      jxl::Span<const uint8_t>(data.data(), data.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+
+  for (size_t increment : {97, 1000}) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    std::vector<uint8_t> decoded(expected.size());
+    size_t total_size = 0;
+    size_t avail_in = 0;
+    for (;;) {
+      const uint8_t* next_in = data.data() + total_size - avail_in;
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetInput(dec.get(), next_in, avail_in));
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+      avail_in = JxlDecoderReleaseInput(dec.get());
+      if (status == JXL_DEC_NEED_MORE_INPUT) {
+        ASSERT_LT(total_size, data.size());
+        const size_t step = std::min(increment, data.size() - total_size);
+        total_size += step;
+        avail_in += step;
+      } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetImageOutBuffer(dec.get(), &format,
+                                              decoded.data(), decoded.size()));
+      } else {
+        ASSERT_EQ(JXL_DEC_FULL_IMAGE, status);
+        break;
+      }
+    }
+    EXPECT_EQ(expected, decoded) << "increment " << increment;
+  }
+}
+
+// A codestream split in many jxlp boxes decodes like the codestream, without
+// keeping a copy of the box payloads in the decoder.
+TEST(DecodeTest, PartialCodestreamBoxesInPlaceTest) {
+  const size_t xsize = 700, ysize = 600;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes codestream = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  const std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      jxl::Span<const uint8_t>(codestream.data(), codestream.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+
+  const uint8_t header[] = {0,    0,    0,    0xc,  0x4a, 0x58, 0x4c, 0x20,
+                            0xd,  0xa,  0x87, 0xa,  0,    0,    0,    0x14,
+                            0x66, 0x74, 0x79, 0x70, 0x6a, 0x78, 0x6c, 0x20,
+                            0,    0,    0,    0,    0x6a, 0x78, 0x6c, 0x20};
+  const size_t kPartSize = 1000;
+  jxl::PaddedBytes data;
+  data.append(header, header + sizeof(header));
+  for (size_t pos = 0, index = 0; pos < codestream.size();
+       pos += kPartSize, index++) {
+    size_t part_size = std::min(kPartSize, codestream.size() - pos);
+    bool last = pos + part_size == codestream.size();
+    AppendU32BE(part_size + 12, &data);
+    data.push_back('j');
+    data.push_back('x');
+    data.push_back('l');
+    data.push_back('p');
+    AppendU32BE(index | (last ? 0x80000000 : 0), &data);
+    data.append(codestream.data() + pos, codestream.data() + pos + part_size);
+  }
+
+  // An increment of 0 gives the whole file at once.
+  for (size_t increment : {0, 97, 4000}) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    std::vector<uint8_t> decoded(expected.size());
+    size_t total_size = increment == 0 ? data.size() : 0;
+    size_t avail_in = total_size;
+    for (;;) {
+      const uint8_t* next_in = data.data() + total_size - avail_in;
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetInput(dec.get(), next_in, avail_in));
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+      avail_in = JxlDecoderReleaseInput(dec.get());
+      if (status == JXL_DEC_NEED_MORE_INPUT) {
+        ASSERT_LT(total_size, data.size());
+        const size_t step = std::min(increment, data.size() - total_size);
+        total_size += step;
+        avail_in += step;
+      } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetImageOutBuffer(dec.get(), &format,
+                                              decoded.data(), decoded.size()));
+      } else {
+        ASSERT_EQ(JXL_DEC_FULL_IMAGE, status);
+        break;
+      }
+    }
+    EXPECT_EQ(expected, decoded) << "increment " << increment;
+    JxlMemoryStats stats;
+    JxlDecoderGetMemoryStats(dec.get(), &stats);
+    // Only the bytes of sections or headers across inputs are kept, at most
+    // about those of the largest group.
+    EXPECT_LT(stats.peak_bytes_per_category[JXL_MEMORY_INPUT],
+              codestream.size() / 2)
+        << "increment " << increment;
+  }
+}
+
 #if JPEGXL_ENABLE_JPEG
 // Tests the return status when trying to decode JPEG bytes on incomplete file.
 TEST(DecodeTest, JXL_TRANSCODE_JPEG_TEST(JPEGPartialTest)) {
@@ -1865,9 +1992,84 @@ TEST(DecodeTest, DCNotGettableTest) {
 
   EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
 
-  // Since the image is only 1x1 pixel, there is only 1 group, the decoder is
-  // unable to get DC size from this, and will not return the DC at all. Since
-  // no full image is requested either, it is expected to return success.
+  // The DC is only returned while decoding the frame, and since no full image
+  // is requested, the frame is skipped and it is expected to return success.
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+
+  JxlDecoderDestroy(dec);
+}
+
+TEST(DecodeTest, DCImageTest) {
+  // Multiple groups, and partial blocks at the right and bottom edges.
+  size_t xsize = 300, ysize = 260;
+  // Smooth, so that the DC is close to the averages of the 8x8 blocks.
+  std::vector<uint8_t> pixels(xsize * ysize * 6);
+  for (size_t y = 0; y < ysize; y++) {
+    for (size_t x = 0; x < xsize; x++) {
+      const uint16_t rgb[3] = {static_cast<uint16_t>(x * 65535 / (xsize - 1)),
+                               static_cast<uint16_t>(y * 65535 / (ysize - 1)),
+                               32768};
+      for (size_t c = 0; c < 3; c++) {
+        pixels[(y * xsize + x) * 6 + c * 2] = rgb[c] >> 8;
+        pixels[(y * xsize + x) * 6 + c * 2 + 1] = rgb[c] & 255;
+      }
+    }
+  }
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes data = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false, false);
+
+  const size_t dc_xsize = jxl::DivCeil(xsize, 8);
+  const size_t dc_ysize = jxl::DivCeil(ysize, 8);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> expected(dc_xsize * dc_ysize * 3);
+  for (size_t by = 0; by < dc_ysize; by++) {
+    for (size_t bx = 0; bx < dc_xsize; bx++) {
+      for (size_t c = 0; c < 3; c++) {
+        double sum = 0;
+        size_t n = 0;
+        for (size_t y = by * 8; y < std::min(by * 8 + 8, ysize); y++) {
+          for (size_t x = bx * 8; x < std::min(bx * 8 + 8, xsize); x++) {
+            const size_t i = (y * xsize + x) * 6 + c * 2;
+            sum += (pixels[i] << 8) | pixels[i + 1];
+            n++;
+          }
+        }
+        expected[(by * dc_xsize + bx) * 3 + c] =
+            static_cast<uint8_t>(sum / n / 257 + 0.5);
+      }
+    }
+  }
+
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO |
+                                               JXL_DEC_DC_IMAGE |
+                                               JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, data.data(), data.size()));
+  JxlDecoderCloseInput(dec);
+  EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+
+  size_t dc_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderDCOutBufferSize(dec, &format, &dc_size));
+  EXPECT_EQ(expected.size(), dc_size);
+  std::vector<uint8_t> dc(dc_size);
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderSetDCOutBuffer(dec, &format, dc.data(), dc.size() - 1));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetDCOutBuffer(dec, &format, dc.data(), dc.size()));
+  std::vector<uint8_t> image(xsize * ysize * 3);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                 dec, &format, image.data(), image.size()));
+
+  // The DC is output before the full image, at low resolution.
+  EXPECT_EQ(JXL_DEC_DC_IMAGE, JxlDecoderProcessInput(dec));
+  EXPECT_LE(jxl::test::ComparePixels(dc.data(), expected.data(), dc_xsize,
+                                     dc_ysize, format, format, 10.0),
+            dc_xsize * dc_ysize / 50);
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
   EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
 
   JxlDecoderDestroy(dec);
@@ -1986,6 +2188,154 @@ TEST(DecodeTest, AlignTest) {
   }
 }
 
+// Decodes into a region of a larger buffer, leaving the rest unchanged.
+TEST(DecodeTest, StrideTest) {
+  size_t xsize = 123, ysize = 77;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  JxlPixelFormat format_orig = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  jxl::CompressParams cparams;
+  cparams.SetLossless();  // Lossless to verify pixels exactly after roundtrip.
+  cparams.speed_tier = jxl::SpeedTier::kThunder;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 4,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false, false);
+
+  // 8-bit RGB is written directly by the render pipeline, 16-bit RGBA is
+  // converted after decoding.
+  for (JxlPixelFormat format :
+       {JxlPixelFormat{3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0},
+        JxlPixelFormat{4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0}}) {
+    const size_t bytes_per_pixel =
+        format.num_channels * jxl::test::GetDataBits(format.data_type) /
+        jxl::kBitsPerByte;
+    const size_t row_size = xsize * bytes_per_pixel;
+    const size_t stride = 200 * bytes_per_pixel;
+    const size_t offset = 5 * stride + 30 * bytes_per_pixel;
+    std::vector<uint8_t> atlas(offset + stride * ysize, 0xA5);
+
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(
+                  dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    const size_t min_size = stride * (ysize - 1) + row_size;
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetImageOutBufferWithStride(
+                                 dec, &format, atlas.data() + offset,
+                                 min_size - 1, stride));
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetImageOutBufferWithStride(
+                                 dec, &format, atlas.data() + offset,
+                                 min_size, row_size - 1));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBufferWithStride(
+                                   dec, &format, atlas.data() + offset,
+                                   min_size, stride));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    JxlDecoderDestroy(dec);
+
+    std::vector<uint8_t> pixels2(row_size * ysize);
+    for (size_t y = 0; y < ysize; ++y) {
+      memcpy(pixels2.data() + y * row_size, atlas.data() + offset + y * stride,
+             row_size);
+    }
+    EXPECT_EQ(0u, jxl::test::ComparePixels(pixels.data(), pixels2.data(), xsize,
+                                           ysize, format_orig, format));
+    for (size_t i = 0; i < atlas.size(); ++i) {
+      const bool inside = i >= offset && (i - offset) % stride < row_size &&
+                          (i - offset) / stride < ysize;
+      if (!inside) {
+        ASSERT_EQ(0xA5, atlas[i]) << i;
+      }
+    }
+  }
+}
+
+namespace {
+
+struct TileOutput {
+  std::vector<float> pixels;
+  std::vector<uint8_t> coverage;
+  size_t xsize;
+  size_t max_pixels = 0;
+  std::atomic<size_t> max_tile_ysize{0};
+  std::atomic<bool> too_large{false};
+};
+
+void* InitTileOutput(void* opaque, size_t num_threads, size_t num_pixels) {
+  static_cast<TileOutput*>(opaque)->max_pixels = num_pixels;
+  return opaque;
+}
+
+void RunTileOutput(void* opaque, size_t thread_id, size_t x, size_t y,
+                   size_t xsize, size_t ysize, const void* pixels,
+                   size_t stride) {
+  TileOutput* output = static_cast<TileOutput*>(opaque);
+  if (xsize * ysize > output->max_pixels) output->too_large = true;
+  size_t max_ysize = output->max_tile_ysize.load();
+  while (ysize > max_ysize &&
+         !output->max_tile_ysize.compare_exchange_weak(max_ysize, ysize)) {
+  }
+  for (size_t iy = 0; iy < ysize; iy++) {
+    const float* row = reinterpret_cast<const float*>(
+        static_cast<const uint8_t*>(pixels) + iy * stride);
+    const size_t pos = (y + iy) * output->xsize + x;
+    memcpy(output->pixels.data() + pos * 4, row, xsize * 4 * sizeof(float));
+    for (size_t ix = 0; ix < xsize; ix++) output->coverage[pos + ix]++;
+  }
+}
+
+void DestroyTileOutput(void* opaque) {}
+
+}  // namespace
+
+TEST(DecodeTest, TileCallbackTest) {
+  size_t xsize = 300, ysize = 270;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::CompressParams cparams;
+  cparams.SetLossless();
+  cparams.speed_tier = jxl::SpeedTier::kThunder;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 4,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false, false);
+
+  JxlPixelFormat format = {4, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      jxl::Span<const uint8_t>(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+
+  TileOutput output;
+  output.pixels.resize(xsize * ysize * 4);
+  output.coverage.resize(xsize * ysize);
+  output.xsize = xsize;
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  auto runner = JxlThreadParallelRunnerMake(nullptr, 4);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                        runner.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetMultithreadedImageOutTileCallback(
+                dec.get(), &format, InitTileOutput, RunTileOutput,
+                DestroyTileOutput, &output));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+
+  EXPECT_FALSE(output.too_large);
+  // The frame is rendered group by group.
+  EXPECT_GT(output.max_tile_ysize.load(), 1u);
+  for (size_t i = 0; i < output.coverage.size(); i++) {
+    ASSERT_EQ(1, output.coverage[i]) << i;
+  }
+  ASSERT_EQ(expected.size(), output.pixels.size() * sizeof(float));
+  EXPECT_EQ(0, memcmp(expected.data(), output.pixels.data(), expected.size()));
+}
+
 TEST(DecodeTest, AnimationTest) {
   size_t xsize = 123, ysize = 77;
   static const size_t num_frames = 2;
@@ -2042,51 +2392,380 @@ TEST(DecodeTest, AnimationTest) {
             JxlDecoderSetParallelRunner(dec, JxlThreadParallelRunner, runner));
 
   EXPECT_EQ(JXL_DEC_SUCCESS,
-            JxlDecoderSubscribeEvents(
-                dec, JXL_DEC_BASIC_INFO | JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
-  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec, next_in, avail_in));
-
-  EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
-  size_t buffer_size;
+            JxlDecoderSubscribeEvents(
+                dec, JXL_DEC_BASIC_INFO | JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec, next_in, avail_in));
+
+  EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+  JxlBasicInfo info;
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetBasicInfo(dec, &info));
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    std::vector<uint8_t> pixels(buffer_size);
+
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+
+    JxlFrameHeader frame_header;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec, &frame_header));
+    EXPECT_EQ(frame_durations[i], frame_header.duration);
+    EXPECT_EQ(0u, frame_header.name_length);
+    // For now, test with empty name, there's currently no easy way to encode
+    // a jxl file with a frame name because ImageBundle doesn't have a
+    // jxl::FrameHeader to set the name in. We can test the null termination
+    // character though.
+    char name;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameName(dec, &name, 1));
+    EXPECT_EQ(0, name);
+
+    EXPECT_EQ(i + 1 == num_frames, frame_header.is_last);
+
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, pixels.data(), pixels.size()));
+
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(0u, jxl::test::ComparePixels(frames[i].data(), pixels.data(),
+                                           xsize, ysize, format, format));
+  }
+
+  // After all frames were decoded, JxlDecoderProcessInput should return
+  // success to indicate all is done.
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+
+  JxlThreadParallelRunnerDestroy(runner);
+  JxlDecoderDestroy(dec);
+}
+
+// The frames decoded ahead in parallel are output in order and unchanged.
+TEST(DecodeTest, FrameLookaheadTest) {
+  size_t xsize = 67, ysize = 45;
+  static const size_t num_frames = 5;
+  std::vector<uint8_t> frames[num_frames];
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  jxl::CodecInOut io;
+  io.SetSize(xsize, ysize);
+  io.metadata.m.SetUintSamples(16);
+  io.metadata.m.color_encoding = jxl::ColorEncoding::SRGB(false);
+  io.metadata.m.have_animation = true;
+  io.frames.clear();
+  io.frames.reserve(num_frames);
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    frames[i] = jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    jxl::ImageBundle bundle(&io.metadata.m);
+    EXPECT_TRUE(ConvertFromExternal(
+        jxl::Span<const uint8_t>(frames[i].data(), frames[i].size()), xsize,
+        ysize, jxl::ColorEncoding::SRGB(/*is_gray=*/false), /*channels=*/3,
+        /*alpha_is_premultiplied=*/false, /*bits_per_sample=*/16,
+        JXL_BIG_ENDIAN, /*flipped_y=*/false, /*pool=*/nullptr, &bundle,
+        /*float_in=*/false, /*align=*/0));
+    bundle.duration = 1;
+    io.frames.push_back(std::move(bundle));
+  }
+
+  jxl::CompressParams cparams;
+  cparams.SetLossless();  // Lossless to verify pixels exactly after roundtrip.
+  cparams.speed_tier = jxl::SpeedTier::kThunder;
+  jxl::AuxOut aux_out;
+  jxl::PaddedBytes compressed;
+  jxl::PassesEncoderState enc_state;
+  EXPECT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed,
+                              jxl::GetJxlCms(), &aux_out, nullptr));
+
+  JxlDecoder* dec = JxlDecoderCreate(NULL);
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetParallelRunner(
+                                 dec, JxlThreadParallelRunner, runner.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetFrameLookahead(dec, 3));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(
+                dec, JXL_DEC_BASIC_INFO | JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  JxlDecoderCloseInput(dec);
+
+  EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+  // Too late once decoding started.
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetFrameLookahead(dec, 1));
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    std::vector<uint8_t> pixels(buffer_size);
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+    JxlFrameHeader frame_header;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec, &frame_header));
+    EXPECT_EQ(i + 1 == num_frames, frame_header.is_last);
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, pixels.data(), pixels.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(0u, jxl::test::ComparePixels(frames[i].data(), pixels.data(),
+                                           xsize, ysize, format, format));
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+
+  JxlDecoderDestroy(dec);
+}
+
+TEST(DecodeTest, DirtyRectTest) {
+  const size_t xsize = 80, ysize = 60;
+  static const size_t num_frames = 3;
+  // Frame 1 changes a small region of frame 0, frame 2 changes everything.
+  const auto value = [](size_t x, size_t y, size_t c, size_t i) -> uint8_t {
+    if (i == 1 && c == 1 && x >= 30 && x < 41 && y >= 20 && y < 26) return 0;
+    if (i == 1) i = 0;
+    return (x * 7 + y * 13 + c * 31 + i * 101) % 256;
+  };
+  jxl::CodecInOut io;
+  io.metadata.m.SetUintSamples(8);
+  io.metadata.m.color_encoding = jxl::ColorEncoding::SRGB();
+  io.metadata.m.have_animation = true;
+  io.SetSize(xsize, ysize);
+  io.frames.clear();
+  for (size_t i = 0; i < num_frames; ++i) {
+    jxl::Image3F color(xsize, ysize);
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t y = 0; y < ysize; ++y) {
+        float* JXL_RESTRICT row = color.PlaneRow(c, y);
+        for (size_t x = 0; x < xsize; ++x) row[x] = value(x, y, c, i) / 255.0f;
+      }
+    }
+    jxl::ImageBundle bundle(&io.metadata.m);
+    bundle.SetFromImage(std::move(color), io.metadata.m.color_encoding);
+    bundle.duration = 1;
+    io.frames.push_back(std::move(bundle));
+  }
+  ASSERT_TRUE(jxl::CropAnimationFrames(&io));
+
+  jxl::CompressParams cparams;
+  cparams.SetLossless();
+  cparams.speed_tier = jxl::SpeedTier::kThunder;
+  jxl::AuxOut aux_out;
+  jxl::PaddedBytes compressed;
+  jxl::PassesEncoderState enc_state;
+  EXPECT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed,
+                              jxl::GetJxlCms(), &aux_out, nullptr));
+
+  JxlDecoder* dec = JxlDecoderCreate(NULL);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetDirtyRectOutput(dec, JXL_TRUE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  JxlDecoderCloseInput(dec);
+
+  const JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> canvas(xsize * ysize * 3, 0);
+  const uint32_t expected_rects[num_frames][4] = {
+      {0, 0, xsize, ysize}, {30, 20, 11, 6}, {0, 0, xsize, ysize}};
+  for (size_t i = 0; i < num_frames; ++i) {
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+    uint32_t rect[4];
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderGetFrameDirtyRect(dec, &rect[0], &rect[1], &rect[2],
+                                          &rect[3]));
+    for (size_t k = 0; k < 4; ++k) EXPECT_EQ(expected_rects[i][k], rect[k]);
+    // Outside of the dirty rect, the canvas is not written to.
+    if (i == 1) canvas[0] = 1;
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, canvas.data(), canvas.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        for (size_t c = 0; c < 3; ++c) {
+          const size_t pos = (y * xsize + x) * 3 + c;
+          const uint8_t expected = i == 1 && pos == 0 ? 1 : value(x, y, c, i);
+          ASSERT_EQ(expected, canvas[pos]) << i << " " << x << " " << y;
+        }
+      }
+    }
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+
+  JxlDecoderDestroy(dec);
+}
+
+// Without JXL_DEC_FULL_IMAGE, the frames are only indexed: their headers and
+// byte ranges are reported and the ranges cover the whole codestream.
+TEST(DecodeTest, FrameCodestreamRangeTest) {
+  size_t xsize = 90, ysize = 50;
+  static const size_t num_frames = 3;
+
+  jxl::CodecInOut io;
+  io.SetSize(xsize, ysize);
+  io.metadata.m.SetUintSamples(16);
+  io.metadata.m.color_encoding = jxl::ColorEncoding::SRGB(false);
+  io.metadata.m.have_animation = true;
+  io.frames.clear();
+  io.frames.reserve(num_frames);
+
+  for (size_t i = 0; i < num_frames; ++i) {
+    std::vector<uint8_t> frame =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    jxl::ImageBundle bundle(&io.metadata.m);
+    EXPECT_TRUE(ConvertFromExternal(
+        jxl::Span<const uint8_t>(frame.data(), frame.size()), xsize, ysize,
+        jxl::ColorEncoding::SRGB(/*is_gray=*/false), /*channels=*/3,
+        /*alpha_is_premultiplied=*/false, /*bits_per_sample=*/16,
+        JXL_BIG_ENDIAN, /*flipped_y=*/false, /*pool=*/nullptr, &bundle,
+        /*float_in=*/false, /*align=*/0));
+    bundle.duration = 10 + i;
+    io.frames.push_back(std::move(bundle));
+  }
+
+  jxl::CompressParams cparams;
+  cparams.speed_tier = jxl::SpeedTier::kThunder;
+  jxl::AuxOut aux_out;
+  jxl::PaddedBytes compressed;
+  jxl::PassesEncoderState enc_state;
+  EXPECT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed,
+                              jxl::GetJxlCms(), &aux_out, nullptr));
+
+  JxlDecoder* dec = JxlDecoderCreate(NULL);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO | JXL_DEC_FRAME));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+
+  uint64_t offset = 0, size = 0;
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderGetFrameCodestreamRange(dec, &offset, &size));
+  uint64_t end = 0;
+  for (size_t i = 0; i < num_frames; ++i) {
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+    JxlFrameHeader frame_header;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec, &frame_header));
+    EXPECT_EQ(10 + i, frame_header.duration);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderGetFrameCodestreamRange(dec, &offset, &size));
+    // The first frame starts after the image headers.
+    if (i == 0) {
+      EXPECT_GT(offset, 0u);
+    } else {
+      EXPECT_EQ(end, offset);
+    }
+    EXPECT_GT(size, 0u);
+    end = offset + size;
+  }
+  EXPECT_EQ(compressed.size(), end);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+
+  JxlDecoderDestroy(dec);
+}
+
+// The sections listed by the TOC are given separately and in reverse order,
+// and with a crop region only those that the region needs are given.
+TEST(DecodeTest, FrameSectionInputTest) {
+  size_t xsize = 1024, ysize = 256;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const size_t bytes_per_pixel = 6;
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  std::vector<uint8_t> full = jxl::DecodeWithAPI(
+      dec, span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+  ASSERT_EQ(xsize * ysize * bytes_per_pixel, full.size());
+  JxlDecoderReset(dec);
+
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSubscribeEvents(dec, JXL_DEC_FRAME));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+  uint64_t frame_offset = 0, frame_size = 0;
   EXPECT_EQ(JXL_DEC_SUCCESS,
-            JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
-  JxlBasicInfo info;
-  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetBasicInfo(dec, &info));
-
-  for (size_t i = 0; i < num_frames; ++i) {
-    std::vector<uint8_t> pixels(buffer_size);
+            JxlDecoderGetFrameCodestreamRange(dec, &frame_offset, &frame_size));
+  size_t num_sections = 0;
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameNumSections(dec, &num_sections));
+  // DC global, one DC group, AC global and 4 groups of 256x256 pixels.
+  ASSERT_EQ(7u, num_sections);
+  std::vector<JxlFrameSection> sections(num_sections);
+  uint64_t sections_begin = compressed.size();
+  uint64_t total_size = 0;
+  for (size_t i = 0; i < num_sections; i++) {
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameSection(dec, i, &sections[i]));
+    sections_begin = std::min(sections_begin, sections[i].offset);
+    total_size += sections[i].size;
+  }
+  EXPECT_EQ(frame_offset + frame_size, sections_begin + total_size);
+  EXPECT_EQ(JXL_FRAME_SECTION_DC_GLOBAL, sections[0].type);
+  EXPECT_EQ(JXL_FRAME_SECTION_DC_GROUP, sections[1].type);
+  EXPECT_EQ(JXL_FRAME_SECTION_AC_GLOBAL, sections[2].type);
+  for (size_t g = 0; g < 4; g++) {
+    EXPECT_EQ(JXL_FRAME_SECTION_AC_GROUP, sections[3 + g].type);
+    EXPECT_EQ(g, sections[3 + g].group);
+    EXPECT_EQ(0u, sections[3 + g].pass);
+    EXPECT_EQ(256 * g, sections[3 + g].x0);
+    EXPECT_EQ(0u, sections[3 + g].y0);
+    EXPECT_EQ(256u, sections[3 + g].xsize);
+    EXPECT_EQ(256u, sections[3 + g].ysize);
+  }
+  JxlFrameSection section;
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderGetFrameSection(dec, num_sections, &section));
 
+  for (bool crop : {false, true}) {
+    JxlDecoderReset(dec);
+    const size_t cxsize = crop ? 64 : xsize;
+    const size_t cysize = crop ? 64 : ysize;
+    if (crop) {
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetCropRegion(dec, 0, 0, cxsize, cysize));
+    }
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSubscribeEvents(
+                                   dec, JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+    // The codestream input ends with the TOC.
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), sections_begin));
     EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
-
-    JxlFrameHeader frame_header;
-    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec, &frame_header));
-    EXPECT_EQ(frame_durations[i], frame_header.duration);
-    EXPECT_EQ(0u, frame_header.name_length);
-    // For now, test with empty name, there's currently no easy way to encode
-    // a jxl file with a frame name because ImageBundle doesn't have a
-    // jxl::FrameHeader to set the name in. We can test the null termination
-    // character though.
-    char name;
-    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameName(dec, &name, 1));
-    EXPECT_EQ(0, name);
-
-    EXPECT_EQ(i + 1 == num_frames, frame_header.is_last);
-
+    EXPECT_EQ(JXL_DEC_ERROR,
+              JxlDecoderSetFrameSectionInput(dec, 0,
+                                             compressed.data() +
+                                                 sections[0].offset,
+                                             sections[0].size + 1));
+    for (size_t i = num_sections; i-- > 0;) {
+      // The last two groups are far enough from the crop region.
+      if (crop && sections[i].type == JXL_FRAME_SECTION_AC_GROUP &&
+          sections[i].group >= 2) {
+        continue;
+      }
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetFrameSectionInput(
+                    dec, i, compressed.data() + sections[i].offset,
+                    sections[i].size));
+    }
     EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
-
-    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
-                                   dec, &format, pixels.data(), pixels.size()));
-
+    size_t buffer_size;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+    ASSERT_EQ(cxsize * cysize * bytes_per_pixel, buffer_size);
+    std::vector<uint8_t> pixels_out(buffer_size);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec, &format, pixels_out.data(),
+                                          pixels_out.size()));
     EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
-    EXPECT_EQ(0u, jxl::test::ComparePixels(frames[i].data(), pixels.data(),
-                                           xsize, ysize, format, format));
+    for (size_t y = 0; y < cysize; y++) {
+      ASSERT_EQ(0, memcmp(full.data() + y * xsize * bytes_per_pixel,
+                          pixels_out.data() + y * cxsize * bytes_per_pixel,
+                          cxsize * bytes_per_pixel))
+          << "crop " << crop << " row " << y;
+    }
   }
-
-  // After all frames were decoded, JxlDecoderProcessInput should return
-  // success to indicate all is done.
-  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
-
-  JxlThreadParallelRunnerDestroy(runner);
   JxlDecoderDestroy(dec);
 }
 
@@ -3084,23 +3763,799 @@ TEST(DecodeTest, OrientedCroppedFrameTest) {
       }
     }
 
-    EXPECT_EQ(0u, jxl::test::ComparePixels(frames[0].data(), frames[4].data(),
-                                           oxsize, oysize, format, format));
+    EXPECT_EQ(0u, jxl::test::ComparePixels(frames[0].data(), frames[4].data(),
+                                           oxsize, oysize, format, format));
+  };
+
+  for (bool keep_orientation : {true, false}) {
+    for (uint32_t orientation = 1; orientation <= 8; orientation++) {
+      for (uint32_t resampling : {1, 2, 4, 8}) {
+        SCOPED_TRACE(testing::Message()
+                     << "keep_orientation: " << keep_orientation << ", "
+                     << "orientation: " << orientation << ", "
+                     << "resampling: " << resampling);
+        test(keep_orientation, orientation, resampling);
+      }
+    }
+  }
+}
+
+TEST(DecodeTest, CropRegionTest) {
+  size_t xsize = 700, ysize = 520;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const size_t bytes_per_pixel = 6;
+  for (JxlOrientation orientation :
+       {JXL_ORIENT_IDENTITY, JXL_ORIENT_ROTATE_90_CW, JXL_ORIENT_TRANSPOSE}) {
+    jxl::CompressParams cparams;
+    jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+        cparams, kCSBF_None, orientation, /*add_preview=*/false,
+        /*add_intrinsic_size=*/false);
+    jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    std::vector<uint8_t> full = jxl::DecodeWithAPI(
+        dec, span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    JxlDecoderReset(dec);
+
+    const bool transposed = orientation > JXL_ORIENT_FLIP_VERTICAL;
+    const size_t oxsize = transposed ? ysize : xsize;
+    ASSERT_EQ(xsize * ysize * bytes_per_pixel, full.size());
+
+    const size_t x0 = 300, y0 = 270, cxsize = 97, cysize = 43;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetCropRegion(dec, x0, y0, cxsize, cysize));
+    std::vector<uint8_t> cropped = jxl::DecodeWithAPI(
+        dec, span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    ASSERT_EQ(cxsize * cysize * bytes_per_pixel, cropped.size());
+    for (size_t y = 0; y < cysize; y++) {
+      const uint8_t* row_full =
+          full.data() + ((y0 + y) * oxsize + x0) * bytes_per_pixel;
+      const uint8_t* row_cropped =
+          cropped.data() + y * cxsize * bytes_per_pixel;
+      ASSERT_EQ(0, memcmp(row_full, row_cropped, cxsize * bytes_per_pixel))
+          << "orientation " << orientation << " row " << y;
+    }
+    JxlDecoderReset(dec);
+
+    // A region outside of the image is rejected once the size is known.
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetCropRegion(dec, oxsize - 10, 0,
+                                                       /*xsize=*/20,
+                                                       /*ysize=*/20));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderProcessInput(dec));
+    JxlDecoderDestroy(dec);
+  }
+}
+
+TEST(DecodeTest, DownsamplingTest) {
+  size_t xsize = 300, ysize = 213;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_NATIVE_ENDIAN, 0};
+  for (bool progressive : {false, true}) {
+    jxl::CompressParams cparams;
+    cparams.progressive_mode = progressive;
+    jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+        cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+        /*add_intrinsic_size=*/false);
+    jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    std::vector<uint8_t> full = jxl::DecodeWithAPI(
+        dec, span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    ASSERT_EQ(xsize * ysize * 6, full.size());
+    const uint16_t* full16 = reinterpret_cast<const uint16_t*>(full.data());
+
+    for (size_t factor : {2, 4, 8}) {
+      JxlDecoderReset(dec);
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetDownsampling(dec, factor));
+      std::vector<uint8_t> small = jxl::DecodeWithAPI(
+          dec, span, format, /*use_callback=*/false,
+          /*set_buffer_early=*/false, /*use_resizable_runner=*/false);
+      const size_t small_xsize = jxl::DivCeil(xsize, factor);
+      const size_t small_ysize = jxl::DivCeil(ysize, factor);
+      ASSERT_EQ(small_xsize * small_ysize * 6, small.size());
+      const uint16_t* small16 = reinterpret_cast<const uint16_t*>(small.data());
+
+      // Compare with a box downsampling of the full resolution image.
+      double total_diff = 0;
+      for (size_t y = 0; y < small_ysize; y++) {
+        for (size_t x = 0; x < small_xsize; x++) {
+          for (size_t c = 0; c < 3; c++) {
+            double sum = 0;
+            size_t count = 0;
+            for (size_t iy = y * factor; iy < std::min(ysize, (y + 1) * factor);
+                 iy++) {
+              for (size_t ix = x * factor;
+                   ix < std::min(xsize, (x + 1) * factor); ix++) {
+                sum += full16[(iy * xsize + ix) * 3 + c];
+                count++;
+              }
+            }
+            total_diff += std::abs(sum / count -
+                                   small16[(y * small_xsize + x) * 3 + c]);
+          }
+        }
+      }
+      double mean_diff = total_diff / (small_xsize * small_ysize * 3);
+      EXPECT_LT(mean_diff, 1500) << "factor " << factor;
+    }
+
+    // Unsupported factors are rejected.
+    JxlDecoderReset(dec);
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetDownsampling(dec, 3));
+    JxlDecoderDestroy(dec);
+  }
+}
+
+// Decoding after JxlDecoderResetKeepAllocations gives the same result as with
+// a new decoder, also when the images differ in size and settings.
+TEST(DecodeTest, ResetKeepAllocationsTest) {
+  JxlPixelFormat format = {4, JXL_TYPE_UINT16, JXL_NATIVE_ENDIAN, 0};
+  JxlDecoder* reused = JxlDecoderCreate(nullptr);
+  for (size_t i = 0; i < 4; i++) {
+    size_t xsize = 100 + 157 * i, ysize = 300 - 61 * i;
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 4, i);
+    jxl::CompressParams cparams;
+    if (i == 1) cparams.SetLossless();
+    if (i == 2) cparams.progressive_mode = true;
+    jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 4,
+        cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+        /*add_intrinsic_size=*/false);
+    jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+        dec, span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    JxlDecoderDestroy(dec);
+
+    std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+        reused, span, format, /*use_callback=*/false,
+        /*set_buffer_early=*/false, /*use_resizable_runner=*/false);
+    JxlDecoderResetKeepAllocations(reused);
+    EXPECT_EQ(xsize * ysize * 8, decoded.size());
+    EXPECT_TRUE(expected == decoded) << "image " << i;
+  }
+  JxlDecoderDestroy(reused);
+}
+
+TEST(DecodeTest, CustomAllocBuffersTest) {
+  struct CalledCounters {
+    std::atomic<size_t> allocs{0};
+    std::atomic<size_t> frees{0};
+    std::atomic<size_t> max_size{0};
+  };
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 4,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+  JxlPixelFormat format = {4, JXL_TYPE_UINT16, JXL_NATIVE_ENDIAN, 0};
+
+  JxlDecoder* default_dec = JxlDecoderCreate(nullptr);
+  std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      default_dec, span, format, /*use_callback=*/false,
+      /*set_buffer_early=*/false, /*use_resizable_runner=*/false);
+  JxlDecoderDestroy(default_dec);
+
+  for (bool use_arena : {false, true}) {
+    CalledCounters counters;
+    JxlMemoryManager mm;
+    mm.opaque = &counters;
+    mm.alloc = [](void* opaque, size_t size) {
+      CalledCounters* counters = reinterpret_cast<CalledCounters*>(opaque);
+      counters->allocs++;
+      size_t max_size = counters->max_size.load();
+      while (max_size < size &&
+             !counters->max_size.compare_exchange_weak(max_size, size)) {
+      }
+      return malloc(size);
+    };
+    mm.free = [](void* opaque, void* address) {
+      reinterpret_cast<CalledCounters*>(opaque)->frees++;
+      free(address);
+    };
+    JxlDecoder* dec = JxlDecoderCreate(&mm);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetFrameArena(dec, use_arena));
+    for (size_t i = 0; i < 3; i++) {
+      std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+          dec, span, format, /*use_callback=*/false,
+          /*set_buffer_early=*/false, /*use_resizable_runner=*/i == 1);
+      JxlDecoderResetKeepAllocations(dec);
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetFrameArena(dec, use_arena));
+      EXPECT_TRUE(expected == decoded);
+    }
+    // The image buffers went through the memory manager.
+    EXPECT_LE(xsize * ysize * sizeof(float), counters.max_size.load());
+    JxlDecoderDestroy(dec);
+    EXPECT_EQ(counters.allocs.load(), counters.frees.load());
+  }
+}
+
+TEST(DecodeTest, MemoryStatsTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 4,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+  JxlPixelFormat format = {4, JXL_TYPE_UINT16, JXL_NATIVE_ENDIAN, 0};
+
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  JxlMemoryStats stats;
+  JxlDecoderGetMemoryStats(dec, &stats);
+  EXPECT_EQ(0u, stats.peak_bytes);
+  std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+      dec, span, format, /*use_callback=*/false,
+      /*set_buffer_early=*/false, /*use_resizable_runner=*/false);
+  EXPECT_EQ(xsize * ysize * 8, decoded.size());
+  JxlDecoderGetMemoryStats(dec, &stats);
+  EXPECT_LT(0u, stats.peak_bytes_per_category[JXL_MEMORY_COEFFICIENTS]);
+  EXPECT_LT(0u, stats.peak_bytes_per_category[JXL_MEMORY_PIPELINE]);
+  EXPECT_LE(stats.current_bytes, stats.peak_bytes);
+  for (size_t i = 0; i < JXL_MEMORY_NUM_CATEGORIES; i++) {
+    EXPECT_LE(stats.current_bytes_per_category[i],
+              stats.peak_bytes_per_category[i]);
+    EXPECT_LE(stats.peak_bytes_per_category[i], stats.peak_bytes);
+  }
+  JxlDecoderDestroy(dec);
+
+  // With a budget below the peak, decoding fails instead.
+  dec = JxlDecoderCreate(nullptr);
+  JxlDecoderSetMemoryLimit(dec, stats.peak_bytes / 2);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  JxlDecoderCloseInput(dec);
+  std::vector<uint8_t> out(xsize * ysize * 8);
+  JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+  if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, out.data(), out.size()));
+    status = JxlDecoderProcessInput(dec);
+  }
+  EXPECT_EQ(JXL_DEC_ERROR, status);
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderProcessInput(dec));
+  JxlDecoderDestroy(dec);
+}
+
+TEST(DecodeTest, CountersTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  JxlDecoderCounters counters;
+  JxlDecoderGetCounters(dec, &counters);
+  EXPECT_EQ(0u, counters.frames);
+  EXPECT_EQ(0u, counters.bytes_consumed);
+  std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+      dec, span, format, /*use_callback=*/false,
+      /*set_buffer_early=*/false, /*use_resizable_runner=*/false);
+  EXPECT_EQ(xsize * ysize * 3, decoded.size());
+  JxlDecoderGetCounters(dec, &counters);
+  EXPECT_EQ(1u, counters.frames);
+  EXPECT_EQ(1u, counters.dc_groups);
+  EXPECT_EQ(2u, counters.ac_groups);
+  EXPECT_LT(0u, counters.bytes_consumed);
+  EXPECT_LE(counters.bytes_consumed, compressed.size());
+  EXPECT_LT(0u, counters.nanoseconds[JXL_DEC_PHASE_HEADERS]);
+  EXPECT_LT(0u, counters.nanoseconds[JXL_DEC_PHASE_DC]);
+  EXPECT_LT(0u, counters.nanoseconds[JXL_DEC_PHASE_AC]);
+  EXPECT_LT(0u, counters.nanoseconds[JXL_DEC_PHASE_RENDER]);
+
+  JxlDecoderReset(dec);
+  JxlDecoderGetCounters(dec, &counters);
+  EXPECT_EQ(0u, counters.frames);
+  for (size_t i = 0; i < JXL_DEC_NUM_PHASES; i++) {
+    EXPECT_EQ(0u, counters.nanoseconds[i]);
+  }
+  JxlDecoderDestroy(dec);
+}
+
+namespace {
+struct ProgressCallbackState {
+  uint64_t abort_at = 0;
+  uint64_t num_calls = 0;
+  uint64_t num_done = 0;
+  uint64_t num_total = 0;
+};
+
+JXL_BOOL ProgressCallback(void* opaque, uint64_t num_done,
+                          uint64_t num_total) {
+  ProgressCallbackState* state = static_cast<ProgressCallbackState*>(opaque);
+  state->num_calls++;
+  state->num_done = num_done;
+  state->num_total = num_total;
+  return num_done != state->abort_at;
+}
+}  // namespace
+
+TEST(DecodeTest, ProgressCallbackTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+
+  // One DC group, then two AC groups: aborts at the first AC group.
+  ProgressCallbackState state;
+  state.abort_at = 2;
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  JxlDecoderSetProgressCallback(dec, ProgressCallback, &state);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+  JxlDecoderCloseInput(dec);
+  std::vector<uint8_t> out(xsize * ysize * 3);
+  JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+  if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, out.data(), out.size()));
+    status = JxlDecoderProcessInput(dec);
+  }
+  EXPECT_EQ(JXL_DEC_ERROR, status);
+  EXPECT_EQ(2u, state.num_calls);
+  EXPECT_EQ(3u, state.num_total);
+  JxlDecoderCounters counters;
+  JxlDecoderGetCounters(dec, &counters);
+  EXPECT_EQ(0u, counters.frames);
+
+  // The rewound decoder decodes the whole image, with the same callback.
+  JxlDecoderRewind(dec);
+  state = ProgressCallbackState();
+  std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+      dec, span, format, /*use_callback=*/false,
+      /*set_buffer_early=*/false, /*use_resizable_runner=*/false);
+  EXPECT_EQ(xsize * ysize * 3, decoded.size());
+  EXPECT_EQ(3u, state.num_calls);
+  EXPECT_EQ(3u, state.num_done);
+  EXPECT_EQ(3u, state.num_total);
+  JxlDecoderDestroy(dec);
+}
+
+// Executor of JxlDecoderProcessInputAsync that queues the tasks, to run them
+// later on the test thread.
+struct AsyncTaskQueue {
+  std::vector<std::pair<JxlDecoderTask, void*>> tasks;
+  size_t num_done = 0;
+  JxlDecoderStatus status = JXL_DEC_ERROR;
+};
+
+void SubmitToQueue(void* opaque, JxlDecoderTask task, void* task_opaque) {
+  static_cast<AsyncTaskQueue*>(opaque)->tasks.emplace_back(task, task_opaque);
+}
+
+void AsyncDone(void* opaque, JxlDecoderStatus status) {
+  AsyncTaskQueue* queue = static_cast<AsyncTaskQueue*>(opaque);
+  queue->num_done++;
+  queue->status = status;
+}
+
+TEST(DecodeTest, ProcessInputAsyncTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+  // Half of the input first, to get a JXL_DEC_NEED_MORE_INPUT.
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec, compressed.data(), compressed.size() / 2));
+  std::vector<uint8_t> out(xsize * ysize * 3);
+  AsyncTaskQueue queue;
+  bool needed_more_input = false;
+  for (size_t i = 0; i < 10; i++) {
+    ASSERT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderProcessInputAsync(dec, SubmitToQueue, &queue,
+                                          AsyncDone, &queue));
+    // Nothing runs before the executor runs the task.
+    ASSERT_EQ(1u, queue.tasks.size());
+    EXPECT_EQ(i, queue.num_done);
+    EXPECT_EQ(JXL_DEC_ERROR,
+              JxlDecoderProcessInputAsync(dec, SubmitToQueue, &queue,
+                                          AsyncDone, &queue));
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderProcessInput(dec));
+    const std::pair<JxlDecoderTask, void*> task = queue.tasks[0];
+    queue.tasks.clear();
+    task.first(task.second);
+    EXPECT_EQ(i + 1, queue.num_done);
+
+    if (queue.status == JXL_DEC_NEED_MORE_INPUT) {
+      needed_more_input = true;
+      size_t remaining = JxlDecoderReleaseInput(dec);
+      size_t offset = compressed.size() / 2 - remaining;
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetInput(dec, compressed.data() + offset,
+                                   compressed.size() - offset));
+      JxlDecoderCloseInput(dec);
+    } else if (queue.status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                     dec, &format, out.data(), out.size()));
+    } else if (queue.status != JXL_DEC_FULL_IMAGE) {
+      break;
+    }
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, queue.status);
+  EXPECT_TRUE(needed_more_input);
+  EXPECT_EQ(expected, out);
+  JxlDecoderDestroy(dec);
+}
+
+// The coefficients of each group of a progressive frame are only kept until
+// the group is drawn with all passes.
+TEST(DecodeTest, ProgressiveCoefficientsReleasedTest) {
+  size_t xsize = 600, ysize = 400;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  cparams.progressive_mode = true;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_NATIVE_ENDIAN, 0};
+
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+      dec, span, format, /*use_callback=*/false,
+      /*set_buffer_early=*/false, /*use_resizable_runner=*/false);
+  EXPECT_EQ(xsize * ysize * 6, decoded.size());
+  JxlMemoryStats stats;
+  JxlDecoderGetMemoryStats(dec, &stats);
+  EXPECT_LT(0u, stats.peak_bytes_per_category[JXL_MEMORY_COEFFICIENTS]);
+  EXPECT_EQ(0u, stats.current_bytes_per_category[JXL_MEMORY_COEFFICIENTS]);
+  JxlDecoderDestroy(dec);
+}
+
+// The uint8 output of XYB images is converted from XYB and written in one
+// render pipeline stage, check that it matches the float output.
+TEST(DecodeTest, XYBToUint8MatchesFloatTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 4,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+  for (uint32_t num_channels : {3, 4}) {
+    JxlPixelFormat format_u8 = {num_channels, JXL_TYPE_UINT8,
+                                JXL_NATIVE_ENDIAN, 0};
+    JxlPixelFormat format_f = {num_channels, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN,
+                               0};
+    std::vector<uint8_t> decoded_u8 = jxl::DecodeWithAPI(
+        span, format_u8, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    std::vector<uint8_t> decoded_f = jxl::DecodeWithAPI(
+        span, format_f, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    size_t num_samples = xsize * ysize * num_channels;
+    ASSERT_EQ(num_samples, decoded_u8.size());
+    ASSERT_EQ(num_samples * sizeof(float), decoded_f.size());
+    int max_diff = 0;
+    for (size_t i = 0; i < num_samples; i++) {
+      float value;
+      memcpy(&value, decoded_f.data() + i * sizeof(float), sizeof(float));
+      int expected = static_cast<int>(
+          std::round(std::min(std::max(value, 0.0f), 1.0f) * 255.0f));
+      max_diff = std::max(max_diff, std::abs(expected - decoded_u8[i]));
+    }
+    EXPECT_LE(max_diff, 1) << "num_channels " << num_channels;
+  }
+}
+
+// The uint8 output interpolates the transfer function in a table, check that
+// it matches the float output for the tabulated curves.
+TEST(DecodeTest, XYBToUint8TransferFunctionsTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  for (jxl::TransferFunction tf :
+       {jxl::TransferFunction::kSRGB, jxl::TransferFunction::kPQ,
+        jxl::TransferFunction::kHLG, jxl::TransferFunction::k709}) {
+    jxl::ColorEncoding color_encoding = jxl::ColorEncoding::SRGB();
+    color_encoding.tf.SetTransferFunction(tf);
+    ASSERT_TRUE(color_encoding.CreateICC());
+    jxl::CodecInOut io;
+    io.SetSize(xsize, ysize);
+    io.metadata.m.SetUintSamples(16);
+    io.metadata.m.color_encoding = color_encoding;
+    jxl::ThreadPool pool(nullptr, nullptr);
+    ASSERT_TRUE(ConvertFromExternal(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+        color_encoding, /*channels=*/3, /*alpha_is_premultiplied=*/false,
+        /*bits_per_sample=*/16, JXL_BIG_ENDIAN, /*flipped_y=*/false, &pool,
+        &io.Main(), /*float_in=*/false, /*align=*/0));
+    jxl::CompressParams cparams;
+    jxl::PaddedBytes compressed;
+    jxl::PassesEncoderState enc_state;
+    ASSERT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed,
+                                jxl::GetJxlCms(), /*aux_out=*/nullptr, &pool));
+    jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+    JxlPixelFormat format_u8 = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+    JxlPixelFormat format_f = {3, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+    std::vector<uint8_t> decoded_u8 = jxl::DecodeWithAPI(
+        span, format_u8, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    std::vector<uint8_t> decoded_f = jxl::DecodeWithAPI(
+        span, format_f, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    size_t num_samples = xsize * ysize * 3;
+    ASSERT_EQ(num_samples, decoded_u8.size());
+    ASSERT_EQ(num_samples * sizeof(float), decoded_f.size());
+    int max_diff = 0;
+    for (size_t i = 0; i < num_samples; i++) {
+      float value;
+      memcpy(&value, decoded_f.data() + i * sizeof(float), sizeof(float));
+      int expected = static_cast<int>(
+          std::round(std::min(std::max(value, 0.0f), 1.0f) * 255.0f));
+      max_diff = std::max(max_diff, std::abs(expected - decoded_u8[i]));
+    }
+    EXPECT_LE(max_diff, 1) << "tf " << static_cast<int>(tf);
+  }
+}
+
+// Tone mapping to a desired intensity target lowers the peak of an HDR image
+// to that of the display.
+TEST(DecodeTest, DesiredIntensityTargetTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::ColorEncoding color_encoding = jxl::ColorEncoding::SRGB();
+  color_encoding.tf.SetTransferFunction(jxl::TransferFunction::kPQ);
+  ASSERT_TRUE(color_encoding.CreateICC());
+  jxl::CodecInOut io;
+  io.SetSize(xsize, ysize);
+  io.metadata.m.SetUintSamples(16);
+  io.metadata.m.color_encoding = color_encoding;
+  io.metadata.m.SetIntensityTarget(4000);
+  jxl::ThreadPool pool(nullptr, nullptr);
+  ASSERT_TRUE(ConvertFromExternal(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+      color_encoding, /*channels=*/3, /*alpha_is_premultiplied=*/false,
+      /*bits_per_sample=*/16, JXL_BIG_ENDIAN, /*flipped_y=*/false, &pool,
+      &io.Main(), /*float_in=*/false, /*align=*/0));
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed;
+  jxl::PassesEncoderState enc_state;
+  ASSERT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed,
+                              jxl::GetJxlCms(), /*aux_out=*/nullptr, &pool));
+
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  // Returns the maximum luminance of the decoded pixels, in nits.
+  const auto decode_max_nits = [&](float desired_intensity_target,
+                                   float* intensity_target) {
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetDesiredIntensityTarget(dec, -1));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetDesiredIntensityTarget(
+                                   dec, desired_intensity_target));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(
+                  dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+    JxlBasicInfo info;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetBasicInfo(dec, &info));
+    *intensity_target = info.intensity_target;
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetDesiredIntensityTarget(dec, 100));
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    std::vector<float> decoded(xsize * ysize * 3);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec, &format, decoded.data(),
+                                          decoded.size() * sizeof(float)));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    JxlDecoderDestroy(dec);
+    // PQ EOTF, in nits.
+    const auto nits = [](float e) {
+      const double xp = std::pow(std::max(e, 0.0f), 4096.0 / (2523 * 128));
+      const double num = std::max(xp - 3424.0 / 4096, 0.0);
+      const double den = 2413.0 / 128 - xp * 2392.0 / 128;
+      return 10000 * std::pow(num / den, 16384.0 / 2610);
+    };
+    double max_nits = 0;
+    for (size_t i = 0; i < decoded.size(); i += 3) {
+      max_nits = std::max(max_nits, 0.2126 * nits(decoded[i]) +
+                                        0.7152 * nits(decoded[i + 1]) +
+                                        0.0722 * nits(decoded[i + 2]));
+    }
+    return max_nits;
   };
 
-  for (bool keep_orientation : {true, false}) {
-    for (uint32_t orientation = 1; orientation <= 8; orientation++) {
-      for (uint32_t resampling : {1, 2, 4, 8}) {
-        SCOPED_TRACE(testing::Message()
-                     << "keep_orientation: " << keep_orientation << ", "
-                     << "orientation: " << orientation << ", "
-                     << "resampling: " << resampling);
-        test(keep_orientation, orientation, resampling);
-      }
+  float intensity_target;
+  const double max_nits = decode_max_nits(0, &intensity_target);
+  EXPECT_EQ(4000, intensity_target);
+  EXPECT_GT(max_nits, 2000);
+  EXPECT_LE(decode_max_nits(1000, &intensity_target), 1020);
+  EXPECT_EQ(1000, intensity_target);
+  // Images are not tone mapped to brighter displays.
+  EXPECT_EQ(max_nits, decode_max_nits(10000, &intensity_target));
+  EXPECT_EQ(4000, intensity_target);
+}
+
+// The premultiplied output, written by the render pipeline or converted from
+// the decoded image, is the straight output multiplied by alpha.
+TEST(DecodeTest, PremultiplyAlphaTest) {
+  size_t xsize = 300, ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 4,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+  JxlPixelFormat format_f = {4, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  JxlPixelFormat format_u8 = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> straight = jxl::DecodeWithAPI(
+      span, format_f, /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false);
+  size_t num_pixels = xsize * ysize;
+  ASSERT_EQ(num_pixels * 4 * sizeof(float), straight.size());
+  std::vector<float> expected(num_pixels * 4);
+  memcpy(expected.data(), straight.data(), straight.size());
+  for (size_t i = 0; i < num_pixels; i++) {
+    for (size_t c = 0; c < 3; c++) expected[i * 4 + c] *= expected[i * 4 + 3];
+  }
+
+  for (bool use_callback : {false, true}) {
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetPremultiplyAlpha(dec, JXL_TRUE));
+    std::vector<uint8_t> decoded_f = jxl::DecodeWithAPI(
+        dec, span, format_f, use_callback, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    JxlDecoderReset(dec);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetPremultiplyAlpha(dec, JXL_TRUE));
+    std::vector<uint8_t> decoded_u8 = jxl::DecodeWithAPI(
+        dec, span, format_u8, use_callback, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false);
+    JxlDecoderDestroy(dec);
+    ASSERT_EQ(straight.size(), decoded_f.size());
+    ASSERT_EQ(num_pixels * 4, decoded_u8.size());
+    float max_diff_f = 0;
+    int max_diff_u8 = 0;
+    for (size_t i = 0; i < num_pixels * 4; i++) {
+      float value;
+      memcpy(&value, decoded_f.data() + i * sizeof(float), sizeof(float));
+      max_diff_f = std::max(max_diff_f, std::abs(value - expected[i]));
+      int expected_u8 = static_cast<int>(
+          std::round(std::min(std::max(expected[i], 0.0f), 1.0f) * 255.0f));
+      max_diff_u8 =
+          std::max(max_diff_u8, std::abs(expected_u8 - decoded_u8[i]));
+    }
+    EXPECT_LE(max_diff_f, 1e-5f) << "use_callback " << use_callback;
+    EXPECT_LE(max_diff_u8, 1) << "use_callback " << use_callback;
+  }
+}
+
+// Lossless 8-bit modular frames are written straight to an RGB8 output buffer,
+// check that this path gives back the original samples.
+TEST(DecodeTest, LosslessUint8Test) {
+  size_t xsize = 300, ysize = 200;
+  for (uint32_t orig_channels : {1, 3, 4}) {
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, orig_channels, 0);
+    // Make every 16-bit sample an exact multiple of 257, i.e. 8-bit.
+    for (size_t i = 1; i < pixels.size(); i += 2) pixels[i] = pixels[i - 1];
+    jxl::CodecInOut io;
+    io.SetSize(xsize, ysize);
+    jxl::ColorEncoding color_encoding =
+        jxl::ColorEncoding::SRGB(/*is_gray=*/orig_channels == 1);
+    io.metadata.m.SetUintSamples(8);
+    if (orig_channels == 4) io.metadata.m.SetAlphaBits(8);
+    io.metadata.m.color_encoding = color_encoding;
+    EXPECT_TRUE(ConvertFromExternal(
+        jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+        color_encoding, orig_channels, /*alpha_is_premultiplied=*/false,
+        /*bits_per_sample=*/16, JXL_BIG_ENDIAN, /*flipped_y=*/false, nullptr,
+        &io.Main(), /*float_in=*/false, /*align=*/0));
+    jxl::CompressParams cparams;
+    cparams.SetLossless();
+    jxl::PassesEncoderState enc_state;
+    jxl::PaddedBytes compressed;
+    EXPECT_TRUE(EncodeFile(cparams, &io, &enc_state, &compressed,
+                           jxl::GetJxlCms(), nullptr, nullptr));
+    jxl::Span<const uint8_t> span(compressed.data(), compressed.size());
+    JxlPixelFormat format_orig = {orig_channels, JXL_TYPE_UINT16,
+                                  JXL_BIG_ENDIAN, 0};
+    for (uint32_t num_channels : {3, 4}) {
+      JxlPixelFormat format = {num_channels, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN,
+                               0};
+      std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+          span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+          /*use_resizable_runner=*/false);
+      ASSERT_EQ(xsize * ysize * num_channels, decoded.size());
+      EXPECT_EQ(0u, jxl::test::ComparePixels(pixels.data(), decoded.data(),
+                                             xsize, ysize, format_orig, format))
+          << "orig_channels " << orig_channels << " num_channels "
+          << num_channels;
     }
   }
 }
 
+TEST(DecodeTest, RenderStatsTest) {
+  size_t xsize = 300, ysize = 200;
+  uint32_t num_channels = 3;
+  std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, num_channels, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes data = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+      num_channels, cparams, kCSBF_None, JXL_ORIENT_IDENTITY,
+      /*add_preview=*/false, /*add_intrinsic_size=*/false);
+  JxlPixelFormat format = {num_channels, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> pixels2(xsize * ysize * num_channels);
+
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  EXPECT_EQ(0u, JxlDecoderGetNumRenderStats(dec));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetCollectRenderStats(dec, JXL_TRUE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec, data.data(), data.size()));
+  JxlDecoderCloseInput(dec);
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetCollectRenderStats(dec, JXL_FALSE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                 dec, &format, pixels2.data(), pixels2.size()));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+
+  size_t num_stats = JxlDecoderGetNumRenderStats(dec);
+  EXPECT_NE(0u, num_stats);
+  uint64_t total_rows = 0;
+  for (size_t i = 0; i < num_stats; i++) {
+    JxlRenderStageStats stats;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetRenderStats(dec, i, &stats));
+    EXPECT_NE(nullptr, stats.name);
+    EXPECT_NE(0u, stats.rows);
+    EXPECT_NE(0u, stats.bytes);
+    total_rows += stats.rows;
+  }
+  // Every row of the image goes at least through the output stage.
+  EXPECT_GE(total_rows, ysize);
+  JxlRenderStageStats stats;
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderGetRenderStats(dec, num_stats, &stats));
+
+  JxlDecoderRewind(dec);
+  EXPECT_EQ(0u, JxlDecoderGetNumRenderStats(dec));
+  JxlDecoderDestroy(dec);
+}
+
 TEST(DecodeTest, FlushTest) {
   // Size large enough for multiple groups, required to have progressive
   // stages
@@ -3392,6 +4847,76 @@ TEST(DecodeTest, FlushTestLosslessProgressiveAlpha) {
   JxlDecoderDestroy(dec);
 }
 
+// Flushing after each chunk of input only draws the groups that got new data
+// again, with the same result as a single flush of the same input.
+TEST(DecodeTest, FlushTestIncremental) {
+  size_t xsize = 600, ysize = 500;
+  uint32_t num_channels = 3;
+  std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, num_channels, 0);
+  jxl::CompressParams cparams;
+  cparams.progressive_mode = true;
+  jxl::PaddedBytes data = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize,
+      num_channels, cparams, kCSBF_None, JXL_ORIENT_IDENTITY, false, false);
+  JxlPixelFormat format = {num_channels, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  // Gives the input from `*consumed` up to `end` to `dec` and flushes it to
+  // `buffer`. Returns whether the flush was done.
+  const auto feed_and_flush = [&](JxlDecoder* dec, size_t* consumed,
+                                  size_t end, std::vector<uint8_t>* buffer) {
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, data.data() + *consumed,
+                                 end - *consumed));
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+      if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetImageOutBuffer(dec, &format, buffer->data(),
+                                              buffer->size()));
+        continue;
+      }
+      EXPECT_EQ(JXL_DEC_NEED_MORE_INPUT, status);
+      break;
+    }
+    const bool flushed = JxlDecoderFlushImage(dec) == JXL_DEC_SUCCESS;
+    *consumed = end - JxlDecoderReleaseInput(dec);
+    return flushed;
+  };
+
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+  std::vector<uint8_t> incremental(pixels.size());
+  size_t consumed = 0;
+  size_t num_flushes = 0;
+  for (size_t k = 1; k < 10; k++) {
+    const size_t end = data.size() * k / 10;
+    if (!feed_and_flush(dec, &consumed, end, &incremental)) continue;
+    num_flushes++;
+
+    JxlDecoder* fresh = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(fresh, JXL_DEC_FULL_IMAGE));
+    std::vector<uint8_t> expected(pixels.size());
+    size_t fresh_consumed = 0;
+    EXPECT_TRUE(feed_and_flush(fresh, &fresh_consumed, end, &expected));
+    JxlDecoderDestroy(fresh);
+    EXPECT_EQ(0u, jxl::test::ComparePixels(expected.data(), incremental.data(),
+                                           xsize, ysize, format, format));
+  }
+  EXPECT_GE(num_flushes, 2u);
+
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec, data.data() + consumed,
+                                                data.size() - consumed));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+  EXPECT_LE(jxl::test::ComparePixels(incremental.data(), pixels.data(), xsize,
+                                     ysize, format, format, 2560.0),
+            50000u);
+
+  JxlDecoderDestroy(dec);
+}
+
 TEST(DecodeTest, ProgressiveEventTest) {
   for (int single_group = 0; single_group <= 1; ++single_group) {
     for (int lossless = 0; lossless <= 1; ++lossless) {
@@ -3541,6 +5066,31 @@ void VerifyJPEGReconstruction(const jxl::PaddedBytes& container,
   used = reconstructed_buffer.size() - JxlDecoderReleaseJPEGBuffer(dec.get());
   ASSERT_EQ(used, jpeg_bytes.size());
   EXPECT_EQ(0, memcmp(reconstructed_buffer.data(), jpeg_bytes.data(), used));
+
+  // The output continues where it stopped, so it can be taken in small chunks
+  // written to a fixed buffer.
+  dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(
+                dec.get(), JXL_DEC_JPEG_RECONSTRUCTION | JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), container.data(), container.size());
+  EXPECT_EQ(JXL_DEC_JPEG_RECONSTRUCTION, JxlDecoderProcessInput(dec.get()));
+  std::vector<uint8_t> chunk(17);
+  std::vector<uint8_t> reconstructed;
+  for (;;) {
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetJPEGBuffer(dec.get(), chunk.data(),
+                                                       chunk.size()));
+    process_result = JxlDecoderProcessInput(dec.get());
+    size_t chunk_used = chunk.size() - JxlDecoderReleaseJPEGBuffer(dec.get());
+    reconstructed.insert(reconstructed.end(), chunk.begin(),
+                         chunk.begin() + chunk_used);
+    if (process_result != JXL_DEC_JPEG_NEED_MORE_OUTPUT) break;
+    EXPECT_EQ(chunk.size(), chunk_used);
+  }
+  ASSERT_EQ(JXL_DEC_FULL_IMAGE, process_result);
+  ASSERT_EQ(reconstructed.size(), jpeg_bytes.size());
+  EXPECT_EQ(0, memcmp(reconstructed.data(), jpeg_bytes.data(),
+                      reconstructed.size()));
 }
 
 #if JPEGXL_ENABLE_JPEG
@@ -3604,6 +5154,141 @@ TEST(DecodeTest, JXL_TRANSCODE_JPEG_TEST(JPEGReconstructionMetadataTest)) {
   VerifyJPEGReconstruction(jxl, jpeg);
 }
 
+struct YCbCrPlanes {
+  size_t xsize[3];
+  std::vector<float> samples[3];
+  std::vector<uint8_t> visits[3];
+};
+
+TEST(DecodeTest, JXL_TRANSCODE_JPEG_TEST(YCbCrPlanarOutputTest)) {
+  const std::string jpeg_path = "jxl/flower/flower.png.im_q85_420.jpg";
+  const jxl::PaddedBytes orig = jxl::ReadTestData(jpeg_path);
+  jxl::CodecInOut orig_io;
+  ASSERT_TRUE(
+      jxl::jpeg::DecodeImageJPG(jxl::Span<const uint8_t>(orig), &orig_io));
+  orig_io.metadata.m.xyb_encoded = false;
+  jxl::BitWriter writer;
+  ASSERT_TRUE(WriteHeaders(&orig_io.metadata, &writer, nullptr));
+  writer.ZeroPadToByte();
+  jxl::PassesEncoderState enc_state;
+  jxl::CompressParams cparams;
+  cparams.color_transform = jxl::ColorTransform::kNone;
+  ASSERT_TRUE(jxl::EncodeFrame(cparams, jxl::FrameInfo{}, &orig_io.metadata,
+                               orig_io.Main(), &enc_state, jxl::GetJxlCms(),
+                               /*pool=*/nullptr, &writer,
+                               /*aux_out=*/nullptr));
+  jxl::PaddedBytes codestream = std::move(writer).TakeBytes();
+  const size_t xsize = orig_io.xsize();
+  const size_t ysize = orig_io.ysize();
+
+  // Reference: the same frame converted to RGB.
+  JxlPixelFormat rgb_format = {3, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  std::vector<float> rgb(xsize * ysize * 3);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), codestream.data(), codestream.size());
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &rgb_format, rgb.data(),
+                                        rgb.size() * sizeof(float)));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+
+  YCbCrPlanes planes;
+  JxlPixelFormat format = {1, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(),
+                                      JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), codestream.data(), codestream.size());
+  EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec.get()));
+  for (uint32_t plane = 0; plane < 3; plane++) {
+    uint32_t shift_x, shift_y;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetYCbCrPlaneShifts(
+                                   dec.get(), plane, &shift_x, &shift_y));
+    // The test image is 4:2:0.
+    EXPECT_EQ(plane == 0 ? 0u : 1u, shift_x);
+    EXPECT_EQ(plane == 0 ? 0u : 1u, shift_y);
+    planes.xsize[plane] = jxl::DivCeil(xsize, 1 << shift_x);
+    size_t plane_ysize = jxl::DivCeil(ysize, 1 << shift_y);
+    planes.samples[plane].resize(planes.xsize[plane] * plane_ysize);
+    planes.visits[plane].resize(planes.xsize[plane] * plane_ysize);
+  }
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetYCbCrPlanarOutCallback(
+                dec.get(), &format,
+                [](void* opaque, uint32_t plane, size_t x, size_t y,
+                   size_t num_pixels, const void* pixels) {
+                  YCbCrPlanes* planes = static_cast<YCbCrPlanes*>(opaque);
+                  ASSERT_LT(plane, 3u);
+                  ASSERT_LE(x + num_pixels, planes->xsize[plane]);
+                  size_t pos = y * planes->xsize[plane] + x;
+                  ASSERT_LE(pos + num_pixels, planes->samples[plane].size());
+                  memcpy(planes->samples[plane].data() + pos, pixels,
+                         num_pixels * sizeof(float));
+                  for (size_t i = 0; i < num_pixels; i++) {
+                    planes->visits[plane][pos + i]++;
+                  }
+                },
+                &planes));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+
+  for (uint32_t plane = 0; plane < 3; plane++) {
+    for (uint8_t visits : planes.visits[plane]) {
+      ASSERT_EQ(1, visits);
+    }
+  }
+  // The luma of the RGB output only depends on the Y plane, and the average
+  // of the chroma is preserved by upsampling.
+  double y_error = 0;
+  double sum_cb = 0, sum_cr = 0;
+  for (size_t i = 0; i < xsize * ysize; i++) {
+    const float r = rgb[3 * i], g = rgb[3 * i + 1], b = rgb[3 * i + 2];
+    const float y = 0.299f * r + 0.587f * g + 0.114f * b;
+    y_error += std::abs(y - planes.samples[0][i]);
+    sum_cb += (b - y) / 1.772f;
+    sum_cr += (r - y) / 1.402f;
+  }
+  EXPECT_LT(y_error / (xsize * ysize), 1e-3);
+  double plane_cb = 0, plane_cr = 0;
+  for (size_t i = 0; i < planes.samples[1].size(); i++) {
+    plane_cb += planes.samples[1][i] - 0.5f;
+    plane_cr += planes.samples[2][i] - 0.5f;
+  }
+  EXPECT_NEAR(sum_cb / (xsize * ysize), plane_cb / planes.samples[1].size(),
+              1e-2);
+  EXPECT_NEAR(sum_cr / (xsize * ysize), plane_cr / planes.samples[2].size(),
+              1e-2);
+}
+
+TEST(DecodeTest, YCbCrPlanarOutputUnsupportedTest) {
+  size_t xsize = 64, ysize = 64;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::CompressParams cparams;
+  jxl::PaddedBytes compressed = jxl::CreateTestJXLCodestream(
+      jxl::Span<const uint8_t>(pixels.data(), pixels.size()), xsize, ysize, 3,
+      cparams, kCSBF_None, JXL_ORIENT_IDENTITY, /*add_preview=*/false,
+      /*add_intrinsic_size=*/false);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(),
+                                      JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec.get()));
+  uint32_t shift_x, shift_y;
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderGetYCbCrPlaneShifts(dec.get(), 0, &shift_x, &shift_y));
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  JxlPixelFormat format = {1, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  // The frame is XYB, not YCbCr.
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderSetYCbCrPlanarOutCallback(
+                dec.get(), &format,
+                [](void*, uint32_t, size_t, size_t, size_t, const void*) {},
+                nullptr));
+}
+
 TEST(DecodeTest, ContinueFinalNonEssentialBoxTest) {
   size_t xsize = 80, ysize = 90;
   std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
@@ -4183,6 +5868,88 @@ TEST(DecodeTest, SpotColorTest) {
   }
 }
 
+// A downsampled spot color channel is only upsampled if it is rendered: the
+// uint8 output does not include it otherwise.
+TEST(DecodeTest, UnusedExtraChannelTest) {
+  jxl::CodecInOut io;
+  size_t xsize = 55, ysize = 257;
+  io.metadata.m.color_encoding = jxl::ColorEncoding::LinearSRGB();
+  jxl::Image3F main(xsize, ysize);
+  jxl::ImageF spot(xsize, ysize);
+  jxl::ZeroFillImage(&main);
+  for (size_t y = 0; y < ysize; y++) {
+    float* JXL_RESTRICT rowm = main.PlaneRow(1, y);
+    float* JXL_RESTRICT rows = spot.Row(y);
+    for (size_t x = 0; x < xsize; x++) {
+      rowm[x] = (x + y) * (1.f / 255.f);
+      rows[x] = ((x ^ y) & 255) * (1.f / 255.f);
+    }
+  }
+  io.SetFromImage(std::move(main), jxl::ColorEncoding::LinearSRGB());
+  jxl::ExtraChannelInfo info;
+  info.bit_depth.bits_per_sample = 8;
+  info.dim_shift = 0;
+  info.type = jxl::ExtraChannel::kSpotColor;
+  info.spot_color[0] = 0.5f;
+  info.spot_color[1] = 0.2f;
+  info.spot_color[2] = 1.f;
+  info.spot_color[3] = 0.5f;
+  io.metadata.m.extra_channel_info.push_back(info);
+  std::vector<jxl::ImageF> ec;
+  ec.push_back(std::move(spot));
+  io.frames[0].SetExtraChannels(std::move(ec));
+
+  jxl::CompressParams cparams;
+  cparams.speed_tier = jxl::SpeedTier::kLightning;
+  cparams.modular_mode = true;
+  cparams.color_transform = jxl::ColorTransform::kNone;
+  cparams.butteraugli_distance = 0.f;
+  cparams.ec_resampling = 2;
+
+  jxl::PaddedBytes compressed;
+  jxl::PassesEncoderState enc_state;
+  EXPECT_TRUE(jxl::EncodeFile(cparams, &io, &enc_state, &compressed,
+                              jxl::GetJxlCms(), nullptr, nullptr));
+
+  for (size_t render_spot = 0; render_spot < 2; render_spot++) {
+    JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+    std::vector<uint8_t> image(xsize * ysize * 3);
+
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetRenderSpotcolors(
+                                   dec, render_spot ? JXL_TRUE : JXL_FALSE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetCollectRenderStats(dec, JXL_TRUE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    JxlDecoderCloseInput(dec);
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, image.data(), image.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+
+    bool upsampled = false;
+    for (size_t i = 0; i < JxlDecoderGetNumRenderStats(dec); i++) {
+      JxlRenderStageStats stats;
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetRenderStats(dec, i, &stats));
+      if (std::string(stats.name) == "Upsample") upsampled = true;
+    }
+    EXPECT_EQ(render_spot != 0, upsampled);
+    JxlDecoderDestroy(dec);
+
+    if (render_spot) continue;
+    for (size_t y = 0; y < ysize; y++) {
+      const uint8_t* JXL_RESTRICT rowm = image.data() + xsize * 3 * y;
+      for (size_t x = 0; x < xsize; x++) {
+        EXPECT_EQ(rowm[x * 3 + 0], 0);
+        EXPECT_EQ(rowm[x * 3 + 1], (x + y > 255 ? 255 : x + y));
+        EXPECT_EQ(rowm[x * 3 + 2], 0);
+      }
+    }
+  }
+}
+
 TEST(DecodeTest, CloseInput) {
   std::vector<uint8_t> partial_file = {0xff};
 
@@ -17,6 +17,7 @@
 #include <vector>
 
 #include "jxl/decode.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"  // JPEGXL_ENABLE_TRANSCODE_JPEG
 #include "lib/jxl/image_bundle.h"
@@ -56,6 +57,7 @@ class JxlToJpegDecoder {
   void StartBox(bool box_until_eof, size_t contents_size) {
     // A new box implies that we clear the buffer.
     buffer_.clear();
+    serialization_state_.reset();
     inside_box_ = true;
     if (box_until_eof) {
       box_until_eof_ = true;
@@ -114,27 +116,29 @@ class JxlToJpegDecoder {
     return true;
   }
 
-  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& jpeg_data) {
-    // Copy JPEG bytestream if desired.
-    uint8_t* tmp_next_out = next_out_;
-    size_t tmp_avail_size = avail_size_;
-    auto write = [&tmp_next_out, &tmp_avail_size](const uint8_t* buf,
-                                                  size_t len) {
-      size_t to_write = std::min<size_t>(tmp_avail_size, len);
-      if (to_write != 0) memcpy(tmp_next_out, buf, to_write);
-      tmp_next_out += to_write;
-      tmp_avail_size -= to_write;
+  // Writes the JPEG bytestream to the output buffer. Returns
+  // JXL_DEC_JPEG_NEED_MORE_OUTPUT if it is full, the next call then continues
+  // where this one stopped. jpeg_data must be the same for all the calls.
+  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& jpeg_data,
+                               ThreadPool* pool) {
+    if (!serialization_state_) {
+      serialization_state_.reset(new jpeg::SerializationState());
+      serialization_state_->pool = pool;
+    }
+    auto write = [this](const uint8_t* buf, size_t len) {
+      size_t to_write = std::min<size_t>(avail_size_, len);
+      if (to_write != 0) memcpy(next_out_, buf, to_write);
+      next_out_ += to_write;
+      avail_size_ -= to_write;
       return to_write;
     };
-    Status write_result = jpeg::WriteJpeg(jpeg_data, write);
-    if (!write_result) {
-      if (tmp_avail_size == 0) {
-        return JXL_DEC_JPEG_NEED_MORE_OUTPUT;
-      }
-      return JXL_DEC_ERROR;
+    Status write_result =
+        jpeg::ContinueWriteJpeg(jpeg_data, write, serialization_state_.get());
+    if (!write_result) return JXL_DEC_ERROR;
+    if (serialization_state_->stage != jpeg::SerializationState::DONE) {
+      return JXL_DEC_JPEG_NEED_MORE_OUTPUT;
     }
-    next_out_ = tmp_next_out;
-    avail_size_ = tmp_avail_size;
+    serialization_state_.reset();
     return JXL_DEC_SUCCESS;
   }
 
@@ -160,6 +164,9 @@ class JxlToJpegDecoder {
   uint8_t* next_out_ = nullptr;
   // Available bytes to write JPEG reconstruction to.
   size_t avail_size_ = 0;
+
+  // Progress of WriteOutput, kept while the output buffer is full.
+  std::unique_ptr<jpeg::SerializationState> serialization_state_;
 };
 
 #else
@@ -205,7 +212,8 @@ class JxlToJpegDecoder {
     return JXL_DEC_ERROR;
   }
 
-  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& /* jpeg_data */) {
+  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& /* jpeg_data */,
+                               ThreadPool* /* pool */) {
     return JXL_DEC_SUCCESS;
   }
 };
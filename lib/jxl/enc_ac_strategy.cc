@@ -11,6 +11,8 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <limits>
+#include <utility>
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/enc_ac_strategy.cc"
@@ -30,6 +32,7 @@
 #include "lib/jxl/enc_transforms-inl.h"
 #include "lib/jxl/entropy_coder.h"
 #include "lib/jxl/fast_math-inl.h"
+#include "lib/jxl/image_ops.h"
 
 // Some of the floating point constants in this file and in other
 // files in the libjxl project have been obtained using the
@@ -451,6 +454,7 @@ uint8_t FindBest8x8Transform(size_t x, size_t y, int encoding_speed_tier,
                              const ACSConfig& config,
                              const float* JXL_RESTRICT cmap_factors,
                              AcStrategyImage* JXL_RESTRICT ac_strategy,
+                             PassesEncoderState* JXL_RESTRICT enc_state,
                              float* block, float* scratch_space,
                              uint32_t* quantized, float* entropy_out) {
   struct TransformTry8x8 {
@@ -523,6 +527,9 @@ uint8_t FindBest8x8Transform(size_t x, size_t y, int encoding_speed_tier,
   };
   double best = 1e30;
   uint8_t best_tx = kTransforms8x8[0].type;
+  // The coefficients of the best transform so far are kept after the ones of
+  // the current candidate.
+  float* best_block = block + 3 * kDCTBlockSize;
   for (auto tx : kTransforms8x8) {
     if (tx.encoding_speed_tier_max_limit < encoding_speed_tier) {
       continue;
@@ -534,8 +541,11 @@ uint8_t FindBest8x8Transform(size_t x, size_t y, int encoding_speed_tier,
     if (entropy < best) {
       best_tx = tx.type;
       best = entropy;
+      std::swap(block, best_block);
     }
   }
+  StoreSearchedCoefficients(AcStrategy::FromRawStrategy(best_tx), x / 8, y / 8,
+                            best_block, enc_state);
   *entropy_out = best;
   return best_tx;
 }
@@ -547,6 +557,7 @@ void TryMergeAcs(AcStrategy::Type acs_raw, size_t bx, size_t by, size_t cx,
                  size_t cy, const ACSConfig& config,
                  const float* JXL_RESTRICT cmap_factors,
                  AcStrategyImage* JXL_RESTRICT ac_strategy,
+                 PassesEncoderState* JXL_RESTRICT enc_state,
                  const float entropy_mul, const uint8_t candidate_priority,
                  uint8_t* priority, float* JXL_RESTRICT entropy_estimate,
                  float* block, float* scratch_space, uint32_t* quantized) {
@@ -576,6 +587,7 @@ void TryMergeAcs(AcStrategy::Type acs_raw, size_t bx, size_t by, size_t cx,
     }
   }
   ac_strategy->Set(bx + cx, by + cy, acs_raw);
+  StoreSearchedCoefficients(acs, bx + cx, by + cy, block, enc_state);
   entropy_estimate[cy * 8 + cx] = entropy_candidate;
 }
 
@@ -631,7 +643,8 @@ AcStrategy::Type AcsHorizontalSplit(size_t blocks) {
 void FindBestFirstLevelDivisionForSquare(
     size_t blocks, bool allow_square_transform, size_t bx, size_t by, size_t cx,
     size_t cy, const ACSConfig& config, const float* JXL_RESTRICT cmap_factors,
-    AcStrategyImage* JXL_RESTRICT ac_strategy, const float entropy_mul_JXK,
+    AcStrategyImage* JXL_RESTRICT ac_strategy,
+    PassesEncoderState* JXL_RESTRICT enc_state, const float entropy_mul_JXK,
     const float entropy_mul_JXJ, float* JXL_RESTRICT entropy_estimate,
     float* block, float* scratch_space, uint32_t* quantized) {
   // We denote J for the larger dimension here, and K for the smaller.
@@ -680,19 +693,28 @@ void FindBestFirstLevelDivisionForSquare(
   float entropy_KXJ_top = std::numeric_limits<float>::max();
   float entropy_KXJ_bottom = std::numeric_limits<float>::max();
   float entropy_JXJ = std::numeric_limits<float>::max();
+  // Each candidate gets its own part of `block`, so that the coefficients of
+  // the selected ones are still there after the decision.
+  const size_t size_JXK = 3 * blocks * blocks_half * kDCTBlockSize;
+  float* block_JXK_left = block;
+  float* block_JXK_right = block_JXK_left + size_JXK;
+  float* block_KXJ_top = block_JXK_right + size_JXK;
+  float* block_KXJ_bottom = block_KXJ_top + size_JXK;
+  float* block_JXJ = block_KXJ_bottom + size_JXK;
   if (allow_JXK) {
     if (row0[bx + cx + 0].RawStrategy() != acs_rawJXK) {
       entropy_JXK_left =
           entropy_mul_JXK *
           EstimateEntropy(acsJXK, (bx + cx + 0) * 8, (by + cy + 0) * 8, config,
-                          cmap_factors, block, scratch_space, quantized);
+                          cmap_factors, block_JXK_left, scratch_space,
+                          quantized);
     }
     if (row0[bx + cx + blocks_half].RawStrategy() != acs_rawJXK) {
       entropy_JXK_right =
           entropy_mul_JXK * EstimateEntropy(acsJXK, (bx + cx + blocks_half) * 8,
                                             (by + cy + 0) * 8, config,
-                                            cmap_factors, block, scratch_space,
-                                            quantized);
+                                            cmap_factors, block_JXK_right,
+                                            scratch_space, quantized);
     }
   }
   if (allow_KXJ) {
@@ -700,14 +722,15 @@ void FindBestFirstLevelDivisionForSquare(
       entropy_KXJ_top =
           entropy_mul_JXK *
           EstimateEntropy(acsKXJ, (bx + cx + 0) * 8, (by + cy + 0) * 8, config,
-                          cmap_factors, block, scratch_space, quantized);
+                          cmap_factors, block_KXJ_top, scratch_space,
+                          quantized);
     }
     if (row1[bx + cx].RawStrategy() != acs_rawKXJ) {
       entropy_KXJ_bottom =
           entropy_mul_JXK * EstimateEntropy(acsKXJ, (bx + cx + 0) * 8,
                                             (by + cy + blocks_half) * 8, config,
-                                            cmap_factors, block, scratch_space,
-                                            quantized);
+                                            cmap_factors, block_KXJ_bottom,
+                                            scratch_space, quantized);
     }
   }
   if (allow_square_transform) {
@@ -716,7 +739,7 @@ void FindBestFirstLevelDivisionForSquare(
     // exploring 16x32 and 32x16.
     entropy_JXJ = entropy_mul_JXJ * EstimateEntropy(acsJXJ, (bx + cx + 0) * 8,
                                                     (by + cy + 0) * 8, config,
-                                                    cmap_factors, block,
+                                                    cmap_factors, block_JXJ,
                                                     scratch_space, quantized);
   }
 
@@ -728,26 +751,35 @@ void FindBestFirstLevelDivisionForSquare(
                   std::min(entropy_KXJ_bottom, entropy[1][0] + entropy[1][1]);
   if (entropy_JXJ < costJxN && entropy_JXJ < costNxJ) {
     ac_strategy->Set(bx + cx, by + cy, acs_rawJXJ);
+    StoreSearchedCoefficients(acsJXJ, bx + cx, by + cy, block_JXJ, enc_state);
     SetEntropyForTransform(cx, cy, acs_rawJXJ, entropy_JXJ, entropy_estimate);
   } else if (costJxN < costNxJ) {
     if (entropy_JXK_left < entropy[0][0] + entropy[1][0]) {
       ac_strategy->Set(bx + cx, by + cy, acs_rawJXK);
+      StoreSearchedCoefficients(acsJXK, bx + cx, by + cy, block_JXK_left,
+                                enc_state);
       SetEntropyForTransform(cx, cy, acs_rawJXK, entropy_JXK_left,
                              entropy_estimate);
     }
     if (entropy_JXK_right < entropy[0][1] + entropy[1][1]) {
       ac_strategy->Set(bx + cx + blocks_half, by + cy, acs_rawJXK);
+      StoreSearchedCoefficients(acsJXK, bx + cx + blocks_half, by + cy,
+                                block_JXK_right, enc_state);
       SetEntropyForTransform(cx + blocks_half, cy, acs_rawJXK,
                              entropy_JXK_right, entropy_estimate);
     }
   } else {
     if (entropy_KXJ_top < entropy[0][0] + entropy[0][1]) {
       ac_strategy->Set(bx + cx, by + cy, acs_rawKXJ);
+      StoreSearchedCoefficients(acsKXJ, bx + cx, by + cy, block_KXJ_top,
+                                enc_state);
       SetEntropyForTransform(cx, cy, acs_rawKXJ, entropy_KXJ_top,
                              entropy_estimate);
     }
     if (entropy_KXJ_bottom < entropy[1][0] + entropy[1][1]) {
       ac_strategy->Set(bx + cx, by + cy + blocks_half, acs_rawKXJ);
+      StoreSearchedCoefficients(acsKXJ, bx + cx, by + cy + blocks_half,
+                                block_KXJ_bottom, enc_state);
       SetEntropyForTransform(cx, cy + blocks_half, acs_rawKXJ,
                              entropy_KXJ_bottom, entropy_estimate);
     }
@@ -805,8 +837,8 @@ void ProcessRectACS(PassesEncoderState* JXL_RESTRICT enc_state,
       float entropy = 0.0;
       const uint8_t best_of_8x8s = FindBest8x8Transform(
           8 * (bx + ix), 8 * (by + iy), static_cast<int>(cparams.speed_tier),
-          config, cmap_factors, ac_strategy, block, scratch_space, quantized,
-          &entropy);
+          config, cmap_factors, ac_strategy, enc_state, block, scratch_space,
+          quantized, &entropy);
       ac_strategy->Set(bx + ix, by + iy,
                        static_cast<AcStrategy::Type>(best_of_8x8s));
       entropy_estimate[iy * 8 + ix] = entropy * mul8x8;
@@ -899,8 +931,8 @@ void ProcessRectACS(PassesEncoderState* JXL_RESTRICT enc_state,
             if ((cy | cx) % 8 == 0) {
               FindBestFirstLevelDivisionForSquare(
                   8, true, bx, by, cx, cy, config, cmap_factors, ac_strategy,
-                  tx.entropy_mul, entropy_mul64X64, entropy_estimate, block,
-                  scratch_space, quantized);
+                  enc_state, tx.entropy_mul, entropy_mul64X64,
+                  entropy_estimate, block, scratch_space, quantized);
             }
             continue;
           } else if (tx.type == AcStrategy::Type::DCT32X16) {
@@ -924,7 +956,7 @@ void ProcessRectACS(PassesEncoderState* JXL_RESTRICT enc_state,
             if ((cy | cx) % 4 == 0) {
               FindBestFirstLevelDivisionForSquare(
                   4, enable_32x32, bx, by, cx, cy, config, cmap_factors,
-                  ac_strategy, tx.entropy_mul, entropy_mul32X32,
+                  ac_strategy, enc_state, tx.entropy_mul, entropy_mul32X32,
                   entropy_estimate, block, scratch_space, quantized);
             }
             continue;
@@ -947,8 +979,8 @@ void ProcessRectACS(PassesEncoderState* JXL_RESTRICT enc_state,
             if ((cy | cx) % 2 == 0) {
               FindBestFirstLevelDivisionForSquare(
                   2, true, bx, by, cx, cy, config, cmap_factors, ac_strategy,
-                  tx.entropy_mul, entropy_mul16X16, entropy_estimate, block,
-                  scratch_space, quantized);
+                  enc_state, tx.entropy_mul, entropy_mul16X16,
+                  entropy_estimate, block, scratch_space, quantized);
             }
             continue;
           } else if (tx.type == AcStrategy::Type::DCT16X8) {
@@ -970,8 +1002,8 @@ void ProcessRectACS(PassesEncoderState* JXL_RESTRICT enc_state,
         // and column will get their DCT16X8s and DCT8X16s through the
         // normal integral transform merging process.
         TryMergeAcs(tx.type, bx, by, cx, cy, config, cmap_factors, ac_strategy,
-                    tx.entropy_mul, tx.priority, &priority[0], entropy_estimate,
-                    block, scratch_space, quantized);
+                    enc_state, tx.entropy_mul, tx.priority, &priority[0],
+                    entropy_estimate, block, scratch_space, quantized);
       }
     }
   }
@@ -985,8 +1017,8 @@ void ProcessRectACS(PassesEncoderState* JXL_RESTRICT enc_state,
       for (size_t cx = 1 - (ii == 2); cx + 1 < rect.xsize(); cx += 2) {
         FindBestFirstLevelDivisionForSquare(
             2, true, bx, by, cx, cy, config, cmap_factors, ac_strategy,
-            entropy_mul16X8, entropy_mul16X16, entropy_estimate, block,
-            scratch_space, quantized);
+            enc_state, entropy_mul16X8, entropy_mul16X16, entropy_estimate,
+            block, scratch_space, quantized);
       }
     }
   }
@@ -1055,6 +1087,20 @@ void AcStrategyHeuristics::Init(const Image3F& src,
              enc_state->shared.frame_dim.xsize_blocks);
   JXL_ASSERT(enc_state->shared.ac_strategy.ysize() ==
              enc_state->shared.frame_dim.ysize_blocks);
+
+  if (cparams.speed_tier <= SpeedTier::kHare) {
+    const FrameDimensions& frame_dim = enc_state->shared.frame_dim;
+    enc_state->searched_coeffs =
+        Image3F(frame_dim.xsize_blocks * kBlockDim,
+                frame_dim.ysize_blocks * kBlockDim);
+    enc_state->searched_strategy =
+        ImageB(frame_dim.xsize_blocks, frame_dim.ysize_blocks);
+    FillImage(PassesEncoderState::kNoSearchedStrategy,
+              &enc_state->searched_strategy);
+  } else {
+    enc_state->searched_coeffs = Image3F();
+    enc_state->searched_strategy = ImageB();
+  }
 }
 
 void AcStrategyHeuristics::ProcessRect(const Rect& rect) {
@@ -1065,6 +1111,20 @@ void AcStrategyHeuristics::ProcessRect(const Rect& rect) {
     enc_state->shared.ac_strategy.FillDCT8(rect);
     return;
   }
+  // Unimportant areas also skip the search.
+  if (cparams.importance_map != nullptr) {
+    float max_importance = -std::numeric_limits<float>::infinity();
+    for (size_t y = 0; y < rect.ysize(); y++) {
+      const float* JXL_RESTRICT row = rect.ConstRow(*cparams.importance_map, y);
+      for (size_t x = 0; x < rect.xsize(); x++) {
+        max_importance = std::max(max_importance, row[x]);
+      }
+    }
+    if (max_importance < cparams.importance_threshold) {
+      enc_state->shared.ac_strategy.FillDCT8(rect);
+      return;
+    }
+  }
   HWY_DYNAMIC_DISPATCH(ProcessRectACS)
   (enc_state, config, rect);
 }
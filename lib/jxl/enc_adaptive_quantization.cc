@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <algorithm>
 #include <cmath>
@@ -35,6 +36,7 @@
 #include "lib/jxl/dec_group.h"
 #include "lib/jxl/enc_butteraugli_comparator.h"
 #include "lib/jxl/enc_cache.h"
+#include "lib/jxl/enc_deadline.h"
 #include "lib/jxl/enc_group.h"
 #include "lib/jxl/enc_modular.h"
 #include "lib/jxl/enc_params.h"
@@ -429,6 +431,10 @@ void FuzzyErosion(const Rect& from_rect, const ImageF& from,
   }
 }
 
+// Computes the quant field one kEncTileDim tile at a time. The only
+// full-frame images are the block-resolution outputs; the pixel differences
+// and the pre-erosion map of a tile and its 4-pixel border live in per-thread
+// scratch buffers.
 struct AdaptiveQuantizationImpl {
   void Init(const Image3F& xyb) {
     JXL_DASSERT(xyb.xsize() % kBlockDim == 0);
@@ -660,14 +666,17 @@ void DumpHeatmaps(const AuxOut* aux_out, float ba_target,
               ButteraugliFuzzyInverse(0.5));
 }
 
+// The rows of tiles are computed in parallel: a block that covers several rows
+// only writes the entries of the rows below that no other block writes.
 ImageF TileDistMap(const ImageF& distmap, int tile_size, int margin,
-                   const AcStrategyImage& ac_strategy) {
+                   const AcStrategyImage& ac_strategy, ThreadPool* pool) {
   PROFILER_FUNC;
   const int tile_xsize = (distmap.xsize() + tile_size - 1) / tile_size;
   const int tile_ysize = (distmap.ysize() + tile_size - 1) / tile_size;
   ImageF tile_distmap(tile_xsize, tile_ysize);
   size_t distmap_stride = tile_distmap.PixelsPerRow();
-  for (int tile_y = 0; tile_y < tile_ysize; ++tile_y) {
+  const auto process_row = [&](const uint32_t task, size_t /* thread */) {
+    const int tile_y = task;
     AcStrategyRow ac_strategy_row = ac_strategy.ConstRow(tile_y);
     float* JXL_RESTRICT dist_row = tile_distmap.Row(tile_y);
     for (int tile_x = 0; tile_x < tile_xsize; ++tile_x) {
@@ -722,10 +731,74 @@ ImageF TileDistMap(const ImageF& distmap, int tile_size, int margin,
         }
       }
     }
-  }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, tile_ysize, ThreadPool::NoInit, process_row,
+                      "TileDistMap"));
   return tile_distmap;
 }
 
+// Returns rects covering the diffmap pixels affected by the 64x64 tiles where
+// a and b differ: vertically adjacent rows of tiles with changes are merged
+// into one rect spanning all their changed tiles. Returns the whole image if
+// recomputing the rects would not be cheaper than a full comparison.
+std::vector<Rect> ChangedRects(const Image3F& a, const Image3F& b) {
+  JXL_ASSERT(SameSize(a, b));
+  constexpr size_t kTileDim = 64;
+  const size_t kSupport = ButteraugliComparator::kDiffmapSupport;
+  const size_t xsize_tiles = DivCeil(a.xsize(), kTileDim);
+  const size_t ysize_tiles = DivCeil(a.ysize(), kTileDim);
+  std::vector<Rect> rects;
+  size_t cost = 0;
+  size_t run_y0 = 0, run_x0 = 0, run_x1 = 0;
+  bool in_run = false;
+  const auto end_run = [&](size_t ty) {
+    const size_t x0 = run_x0 * kTileDim;
+    const size_t y0 = run_y0 * kTileDim;
+    const size_t x0_ext = x0 < kSupport ? 0 : x0 - kSupport;
+    const size_t y0_ext = y0 < kSupport ? 0 : y0 - kSupport;
+    Rect rect(x0_ext, y0_ext, run_x1 * kTileDim + kSupport - x0_ext,
+              ty * kTileDim + kSupport - y0_ext, a.xsize(), a.ysize());
+    // DiffmapInRect reads the distorted image in the border around rect.
+    cost += (rect.xsize() + 2 * kSupport) * (rect.ysize() + 2 * kSupport);
+    rects.push_back(rect);
+    in_run = false;
+  };
+  for (size_t ty = 0; ty < ysize_tiles; ty++) {
+    size_t tx0 = xsize_tiles, tx1 = 0;
+    for (size_t tx = 0; tx < xsize_tiles; tx++) {
+      const Rect tile(tx * kTileDim, ty * kTileDim, kTileDim, kTileDim,
+                      a.xsize(), a.ysize());
+      bool changed = false;
+      for (size_t c = 0; c < 3 && !changed; c++) {
+        for (size_t y = 0; y < tile.ysize() && !changed; y++) {
+          changed = memcmp(tile.ConstPlaneRow(a, c, y),
+                           tile.ConstPlaneRow(b, c, y),
+                           tile.xsize() * sizeof(float)) != 0;
+        }
+      }
+      if (!changed) continue;
+      tx0 = std::min(tx0, tx);
+      tx1 = tx + 1;
+    }
+    if (tx0 >= tx1) {
+      if (in_run) end_run(ty);
+      continue;
+    }
+    if (in_run) {
+      run_x0 = std::min(run_x0, tx0);
+      run_x1 = std::max(run_x1, tx1);
+    } else {
+      run_y0 = ty;
+      run_x0 = tx0;
+      run_x1 = tx1;
+      in_run = true;
+    }
+  }
+  if (in_run) end_run(ysize_tiles);
+  if (cost >= a.xsize() * a.ysize()) return {Rect(a)};
+  return rects;
+}
+
 constexpr float kDcQuantPow = 0.57f;
 static const float kDcQuant = 1.12f;
 static const float kAcQuant = 0.8294f;
@@ -769,6 +842,9 @@ void FindBestQuantization(const ImageBundle& linear, const Image3F& opsin,
   if (fabs(params.intensity_target - 255.0f) < 1e-3) {
     params.intensity_target = 80.0f;
   }
+  // The search only compares the changes of the quant field, which the fast
+  // mode ranks well enough. The slowest speed keeps the full metric.
+  if (cparams.speed_tier == SpeedTier::kKitten) params.fast = true;
   JxlButteraugliComparator comparator(params, cms);
   JXL_CHECK(comparator.SetReferenceImage(linear));
   bool lower_is_better =
@@ -777,6 +853,9 @@ void FindBestQuantization(const ImageBundle& linear, const Image3F& opsin,
   AdjustQuantField(enc_state->shared.ac_strategy, Rect(quant_field),
                    &quant_field);
   ImageF tile_distmap;
+  // The diffmap and decoded image of the previous iteration.
+  ImageF diffmap;
+  Image3F prev_linear;
   ImageF initial_quant_field = CopyImage(quant_field);
 
   float initial_qf_min, initial_qf_max;
@@ -812,19 +891,45 @@ void FindBestQuantization(const ImageBundle& linear, const Image3F& opsin,
     ImageBundle dec_linear = RoundtripImage(opsin, enc_state, cms, pool);
     PROFILER_ZONE("enc Butteraugli");
     float score;
-    ImageF diffmap;
-    JXL_CHECK(comparator.CompareWith(dec_linear, &diffmap, &score));
+    if (i == 0) {
+      JXL_CHECK(comparator.CompareWith(dec_linear, &diffmap, &score));
+    } else {
+      // Only the tiles whose decoded pixels changed since the previous
+      // iteration are compared again.
+      JXL_CHECK(comparator.CompareWithRects(
+          dec_linear, ChangedRects(prev_linear, *dec_linear.color()),
+          &diffmap, &score));
+    }
+    prev_linear = CopyImage(*dec_linear.color());
+    ImageF scaled_diffmap;
+    const ImageF* cur_diffmap = &diffmap;
     if (!lower_is_better) {
       score = -score;
-      diffmap = ScaleImage(-1.0f, diffmap);
+      scaled_diffmap = ScaleImage(-1.0f, diffmap);
+      cur_diffmap = &scaled_diffmap;
     }
-    tile_distmap = TileDistMap(diffmap, 8, 0, enc_state->shared.ac_strategy);
+    tile_distmap =
+        TileDistMap(*cur_diffmap, 8, 0, enc_state->shared.ac_strategy, pool);
     if (WantDebugOutput(aux_out)) {
       aux_out->DumpImage(("dec" + ToString(i)).c_str(), *dec_linear.color());
       DumpHeatmaps(aux_out, butteraugli_target, quant_field, tile_distmap,
-                   diffmap);
+                   *cur_diffmap);
     }
     if (aux_out != nullptr) ++aux_out->num_butteraugli_iters;
+    // Stops at the last evaluated quant field if another iteration would
+    // not fit in the time budget.
+    bool out_of_time = false;
+    if (cparams.deadline != nullptr) {
+      const size_t num_pixels = opsin.xsize() * opsin.ysize();
+      cparams.deadline->Done(EncoderDeadline::kButteraugliIteration,
+                             num_pixels);
+      out_of_time = !cparams.deadline->HasTimeFor(
+          EncoderDeadline::kButteraugliIteration, num_pixels);
+    }
+    // Also stops there if the progress callback asks to abort, which fails
+    // the encoding after the heuristics.
+    AddProgressWork(enc_state->progress, 1);
+    const bool aborted = !PollProgress(enc_state->progress);
     if (FLAGS_log_search_state) {
       float minval, maxval;
       ImageMinMax(quant_field, &minval, &maxval);
@@ -837,7 +942,7 @@ void FindBestQuantization(const ImageBundle& linear, const Image3F& opsin,
       }
     }
 
-    if (i == iters) break;
+    if (i == iters || out_of_time || aborted) break;
 
     double kPow[8] = {
         0.2, 0.2, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
@@ -872,11 +977,18 @@ void FindBestQuantization(const ImageBundle& linear, const Image3F& opsin,
         cur_pow = 0;
       }
     }
+    // Blocks below the importance threshold keep their quant field, so that
+    // their tiles are not compared again by the next iterations.
+    const ImageF* importance = cparams.importance_map;
+    const float threshold = cparams.importance_threshold;
     if (cur_pow == 0.0) {
       for (size_t y = 0; y < quant_field.ysize(); ++y) {
         const float* const JXL_RESTRICT row_dist = tile_distmap.Row(y);
+        const float* const JXL_RESTRICT row_imp =
+            importance ? importance->ConstRow(y) : nullptr;
         float* const JXL_RESTRICT row_q = quant_field.Row(y);
         for (size_t x = 0; x < quant_field.xsize(); ++x) {
+          if (row_imp && row_imp[x] < threshold) continue;
           const float diff = row_dist[x] / butteraugli_target;
           if (diff > 1.0f) {
             float old = row_q[x];
@@ -894,8 +1006,11 @@ void FindBestQuantization(const ImageBundle& linear, const Image3F& opsin,
     } else {
       for (size_t y = 0; y < quant_field.ysize(); ++y) {
         const float* const JXL_RESTRICT row_dist = tile_distmap.Row(y);
+        const float* const JXL_RESTRICT row_imp =
+            importance ? importance->ConstRow(y) : nullptr;
         float* const JXL_RESTRICT row_q = quant_field.Row(y);
         for (size_t x = 0; x < quant_field.xsize(); ++x) {
+          if (row_imp && row_imp[x] < threshold) continue;
           const float diff = row_dist[x] / butteraugli_target;
           if (diff <= 1.0f) {
             row_q[x] *= std::pow(diff, cur_pow);
@@ -1054,6 +1169,16 @@ void FindBestQuantizer(const ImageBundle* linear, const Image3F& opsin,
     PROFILER_ZONE("enc find best maxerr");
     FindBestQuantizationMaxError(opsin, enc_state, cms, pool, aux_out);
   } else if (cparams.speed_tier <= SpeedTier::kKitten) {
+    // The first iteration only compares the initial quant field, so the
+    // search needs time for two.
+    const EncoderDeadline* deadline = cparams.deadline.get();
+    const size_t num_pixels = opsin.xsize() * opsin.ysize();
+    if (deadline != nullptr &&
+        2 * deadline->EstimatedSeconds(EncoderDeadline::kButteraugliIteration,
+                                       num_pixels) >
+            deadline->AvailableSeconds(num_pixels)) {
+      return;
+    }
     // Normal encoding to a butteraugli score.
     PROFILER_ZONE("enc find best2");
     FindBestQuantization(*linear, opsin, enc_state, cms, pool, aux_out);
@@ -1081,8 +1206,13 @@ ImageBundle RoundtripImage(const Image3F& opsin, PassesEncoderState* enc_state,
   std::unique_ptr<ModularFrameEncoder> modular_frame_encoder =
       jxl::make_unique<ModularFrameEncoder>(enc_state->shared.frame_header,
                                             enc_state->cparams);
+  // Not polled, since an abort must not fail the JXL_CHECK below;
+  // FindBestQuantization polls once per roundtrip instead.
+  ProgressMonitor* progress = enc_state->progress;
+  enc_state->progress = nullptr;
   JXL_CHECK(InitializePassesEncoder(opsin, cms, pool, enc_state,
                                     modular_frame_encoder.get(), nullptr));
+  enc_state->progress = progress;
   JXL_CHECK(dec_state->Init());
   JXL_CHECK(dec_state->InitForAC(pool));
 
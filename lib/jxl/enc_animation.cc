@@ -0,0 +1,133 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_animation.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "lib/jxl/image.h"
+#include "lib/jxl/image_bundle.h"
+#include "lib/jxl/image_ops.h"
+
+namespace jxl {
+
+namespace {
+
+bool IsFullCanvasReplace(const ImageBundle& ib, const CodecInOut& io) {
+  return !ib.IsJPEG() && !ib.blend && ib.origin.x0 == 0 && ib.origin.y0 == 0 &&
+         ib.xsize() == io.xsize() && ib.ysize() == io.ysize();
+}
+
+// Returns the smallest rect of the pixels of `ib` that differ from `prev`, of
+// the same size, or an empty rect if they are identical.
+Rect ChangedRect(const ImageBundle& ib, const ImageBundle& prev) {
+  const size_t xsize = ib.xsize();
+  const size_t ysize = ib.ysize();
+  std::vector<const ImageF*> planes;
+  std::vector<const ImageF*> prev_planes;
+  for (size_t c = 0; c < 3; c++) {
+    planes.push_back(&ib.color().Plane(c));
+    prev_planes.push_back(&prev.color().Plane(c));
+  }
+  for (size_t i = 0; i < ib.extra_channels().size(); i++) {
+    planes.push_back(&ib.extra_channels()[i]);
+    prev_planes.push_back(&prev.extra_channels()[i]);
+  }
+  // Bounds of the differences, x0 >= x1 while none were found.
+  size_t x0 = xsize;
+  size_t x1 = 0;
+  size_t y0 = ysize;
+  size_t y1 = 0;
+  for (size_t y = 0; y < ysize; y++) {
+    for (size_t i = 0; i < planes.size(); i++) {
+      const float* JXL_RESTRICT row = planes[i]->ConstRow(y);
+      const float* JXL_RESTRICT prev_row = prev_planes[i]->ConstRow(y);
+      size_t begin = 0;
+      while (begin < xsize && row[begin] == prev_row[begin]) begin++;
+      if (begin == xsize) continue;
+      size_t end = xsize;
+      while (row[end - 1] == prev_row[end - 1]) end--;
+      x0 = std::min(x0, begin);
+      x1 = std::max(x1, end);
+      y0 = std::min(y0, y);
+      y1 = y + 1;
+    }
+  }
+  if (x0 >= x1) return Rect();
+  return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+ImageBundle CropFrame(const ImageBundle& ib, const Rect& rect) {
+  ImageBundle cropped(ib.metadata());
+  Image3F color(rect.xsize(), rect.ysize());
+  CopyImageTo(rect, ib.color(), &color);
+  cropped.SetFromImage(std::move(color), ib.c_current());
+  if (ib.HasExtraChannels()) {
+    std::vector<ImageF> extra_channels;
+    for (const ImageF& plane : ib.extra_channels()) {
+      extra_channels.emplace_back(CopyImage(rect, plane));
+    }
+    cropped.SetExtraChannels(std::move(extra_channels));
+  }
+  cropped.origin.x0 = rect.x0();
+  cropped.origin.y0 = rect.y0();
+  cropped.duration = ib.duration;
+  cropped.timecode = ib.timecode;
+  cropped.use_for_next_frame = ib.use_for_next_frame;
+  cropped.blend = false;
+  cropped.blendmode = ib.blendmode;
+  cropped.name = ib.name;
+  return cropped;
+}
+
+}  // namespace
+
+Status CropAnimationFrames(CodecInOut* io) {
+  if (!io->metadata.m.have_animation || io->frames.size() < 2) return true;
+  const bool can_merge = !io->metadata.m.animation.have_timecodes;
+  std::vector<ImageBundle> frames;
+  frames.push_back(std::move(io->frames[0]));
+  // The pixels shown after the last kept frame, which all have the full canvas
+  // size, or nullptr if they are not known.
+  ImageBundle prev = IsFullCanvasReplace(frames[0], *io)
+                         ? frames[0].Copy()
+                         : ImageBundle();
+  for (size_t i = 1; i < io->frames.size(); i++) {
+    ImageBundle& ib = io->frames[i];
+    if (!prev.HasColor() || !IsFullCanvasReplace(ib, *io)) {
+      prev = ImageBundle();
+      frames.push_back(std::move(ib));
+      continue;
+    }
+    const Rect rect = ChangedRect(ib, prev);
+    ImageBundle& last = frames.back();
+    if (rect.xsize() == 0 && can_merge && ib.name.empty() &&
+        last.name.empty()) {
+      last.duration += ib.duration;
+      last.use_for_next_frame |= ib.use_for_next_frame;
+      continue;
+    }
+    const bool whole_frame =
+        rect.xsize() == ib.xsize() && rect.ysize() == ib.ysize();
+    if (rect.xsize() == 0 || whole_frame) {
+      // Only rects smaller than the frame save anything; an unchanged frame
+      // that can't be merged still gets encoded.
+      prev = ib.Copy();
+      frames.push_back(std::move(ib));
+      continue;
+    }
+    last.use_for_next_frame = true;
+    frames.push_back(CropFrame(ib, rect));
+    prev = std::move(ib);
+  }
+  io->frames = std::move(frames);
+  return true;
+}
+
+}  // namespace jxl
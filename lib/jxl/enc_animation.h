@@ -0,0 +1,31 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_ANIMATION_H_
+#define LIB_JXL_ENC_ANIMATION_H_
+
+// Reduction of animations to the parts that change from frame to frame.
+
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/codec_in_out.h"
+
+namespace jxl {
+
+// In an animation, replaces each frame that covers the whole canvas without
+// blending by the smallest crop that holds its differences from the previous
+// frame, to be placed over that frame, which is then saved as the reference
+// frame for it. Frames identical to the previous one are removed and their
+// duration added to it, unless the frames have timecodes or names. Frames that
+// are already cropped or blended, or follow such a frame, are kept as they
+// are, as are JPEG frames.
+//
+// This is meant for screen recordings and the like, converted from formats
+// such as GIF or APNG that already give the full canvas of every frame: much
+// less has to be encoded, and blended when decoding.
+Status CropAnimationFrames(CodecInOut* io);
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_ENC_ANIMATION_H_
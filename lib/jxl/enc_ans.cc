@@ -21,6 +21,7 @@
 #include "lib/jxl/aux_out.h"
 #include "lib/jxl/aux_out_fwd.h"
 #include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/dec_ans.h"
 #include "lib/jxl/enc_cluster.h"
 #include "lib/jxl/enc_context_map.h"
@@ -686,6 +687,13 @@ class HistogramBuilder {
     histograms_[histo_idx].Add(symbol);
   }
 
+  void AddHistograms(const std::vector<Histogram>& histograms) {
+    JXL_DASSERT(histograms.size() == histograms_.size());
+    for (size_t i = 0; i < histograms.size(); i++) {
+      histograms_[i].AddHistogram(histograms[i]);
+    }
+  }
+
   // NOTE: `layer` is only for clustered_entropy; caller does ReclaimAndCharge.
   size_t BuildAndStoreEntropyCodes(
       const HistogramParams& params,
@@ -697,7 +705,23 @@ class HistogramBuilder {
     std::vector<Histogram> clustered_histograms(histograms_);
     context_map->resize(histograms_.size());
     if (histograms_.size() > 1) {
-      if (!ans_fuzzer_friendly_) {
+      if (!ans_fuzzer_friendly_ &&
+          params.context_map.size() == histograms_.size()) {
+        *context_map = params.context_map;
+        size_t num_clusters = 0;
+        for (uint8_t histo : *context_map) {
+          num_clusters = std::max<size_t>(num_clusters, histo + 1);
+        }
+        clustered_histograms.clear();
+        clustered_histograms.resize(num_clusters);
+        for (size_t c = 0; c < histograms_.size(); ++c) {
+          clustered_histograms[(*context_map)[c]].AddHistogram(histograms_[c]);
+        }
+        // Clusters may get no symbols in this image.
+        for (Histogram& histo : clustered_histograms) {
+          if (histo.data_.empty()) histo.data_.resize(Histogram::kRounding);
+        }
+      } else if (!ans_fuzzer_friendly_) {
         std::vector<uint32_t> histogram_symbols;
         ClusterHistograms(params, histograms_, histograms_.size(),
                           kClustersLimit, &clustered_histograms,
@@ -961,7 +985,8 @@ struct HashChain {
   std::unordered_map<int, int> special_dist_table_;
   size_t num_special_distances_ = 0;
 
-  uint32_t maxchainlength = 256;  // window_size_ to allow all
+  // Number of candidates visited per position, window_size_ to allow all.
+  uint32_t maxchainlength = 256;
 
   HashChain(const Token* data, size_t size, size_t window_size,
             size_t min_length, size_t max_length, size_t distance_multiplier)
@@ -1209,19 +1234,21 @@ void ApplyLZ77_LZ77(const HistogramParams& params, size_t num_contexts,
                     std::vector<std::vector<Token>>& tokens_lz77) {
   // TODO(veluca): tune heuristics here.
   SymbolCostEstimator sce(num_contexts, params.force_huffman, tokens, lz77);
-  float bit_decrease = 0;
   size_t total_symbols = 0;
+  for (const auto& in : tokens) total_symbols += in.size();
   tokens_lz77.resize(tokens.size());
-  HybridUintConfig uint_config;
-  std::vector<float> sym_cost;
-  for (size_t stream = 0; stream < tokens.size(); stream++) {
+  // The streams are independent; their bit decreases are summed in order at
+  // the end, so that the result does not depend on the number of threads.
+  std::vector<float> stream_bit_decrease(tokens.size());
+  const auto process_stream = [&](const uint32_t stream, size_t /* thread */) {
+    HybridUintConfig uint_config;
+    float& bit_decrease = stream_bit_decrease[stream];
     size_t distance_multiplier =
         params.image_widths.size() > stream ? params.image_widths[stream] : 0;
     const auto& in = tokens[stream];
     auto& out = tokens_lz77[stream];
-    total_symbols += in.size();
     // Cumulative sum of bit costs.
-    sym_cost.resize(in.size() + 1);
+    std::vector<float> sym_cost(in.size() + 1);
     for (size_t i = 0; i < in.size(); i++) {
       uint32_t tok, nbits, unused_bits;
       uint_config.Encode(in[i].value, &tok, &nbits, &unused_bits);
@@ -1242,6 +1269,7 @@ void ApplyLZ77_LZ77(const HistogramParams& params, size_t num_contexts,
 
     HashChain chain(in.data(), in.size(), window_size, min_length, max_length,
                     distance_multiplier);
+    chain.maxchainlength = params.lz77_max_chain_length;
     size_t len, dist_symbol;
 
     const size_t max_lazy_match_len = 256;  // 0 to disable lazy matching
@@ -1300,6 +1328,12 @@ void ApplyLZ77_LZ77(const HistogramParams& params, size_t num_contexts,
         // Literal, already pushed
       }
     }
+  };
+  JXL_CHECK(RunOnPool(params.pool, 0, tokens.size(), ThreadPool::NoInit,
+                      process_stream, "ApplyLZ77"));
+  float bit_decrease = 0;
+  for (float stream_decrease : stream_bit_decrease) {
+    bit_decrease += stream_decrease;
   }
 
   if (bit_decrease > total_symbols * 0.2 + 16) {
@@ -1319,16 +1353,15 @@ void ApplyLZ77_Optimal(const HistogramParams& params, size_t num_contexts,
   SymbolCostEstimator sce(num_contexts + 1, params.force_huffman,
                           tokens_for_cost_estimate, lz77);
   tokens_lz77.resize(tokens.size());
-  HybridUintConfig uint_config;
-  std::vector<float> sym_cost;
-  std::vector<uint32_t> dist_symbols;
-  for (size_t stream = 0; stream < tokens.size(); stream++) {
+  const auto process_stream = [&](const uint32_t stream, size_t /* thread */) {
+    HybridUintConfig uint_config;
+    std::vector<uint32_t> dist_symbols;
     size_t distance_multiplier =
         params.image_widths.size() > stream ? params.image_widths[stream] : 0;
     const auto& in = tokens[stream];
     auto& out = tokens_lz77[stream];
     // Cumulative sum of bit costs.
-    sym_cost.resize(in.size() + 1);
+    std::vector<float> sym_cost(in.size() + 1);
     for (size_t i = 0; i < in.size(); i++) {
       uint32_t tok, nbits, unused_bits;
       uint_config.Encode(in[i].value, &tok, &nbits, &unused_bits);
@@ -1349,6 +1382,7 @@ void ApplyLZ77_Optimal(const HistogramParams& params, size_t num_contexts,
 
     HashChain chain(in.data(), in.size(), window_size, min_length, max_length,
                     distance_multiplier);
+    chain.maxchainlength = params.lz77_max_chain_length;
 
     struct MatchInfo {
       uint32_t len;
@@ -1436,7 +1470,9 @@ void ApplyLZ77_Optimal(const HistogramParams& params, size_t num_contexts,
       pos -= prefix_costs[pos].len;
     }
     std::reverse(out.begin(), out.end());
-  }
+  };
+  JXL_CHECK(RunOnPool(params.pool, 0, tokens.size(), ThreadPool::NoInit,
+                      process_stream, "ApplyLZ77Optimal"));
 }
 
 void ApplyLZ77(const HistogramParams& params, size_t num_contexts,
@@ -1517,7 +1553,20 @@ size_t BuildAndEncodeHistograms(const HistogramParams& params,
   if (ans_fuzzer_friendly_) {
     uint_config = HybridUintConfig(10, 0, 0);
   }
-  for (size_t i = 0; i < tokens.size(); ++i) {
+  const bool default_uint_config =
+      params.uint_method != HistogramParams::HybridUintMethod::kContextMap &&
+      params.uint_method != HistogramParams::HybridUintMethod::k000 &&
+      !ans_fuzzer_friendly_;
+  const bool use_counted_histograms =
+      params.histograms != nullptr && default_uint_config &&
+      !codes->lz77.enabled && params.histograms->size() == num_contexts;
+  if (use_counted_histograms) {
+    builder.AddHistograms(*params.histograms);
+    for (const Histogram& histo : *params.histograms) {
+      total_tokens += histo.total_count_;
+    }
+  }
+  for (size_t i = 0; i < tokens.size() && !use_counted_histograms; ++i) {
     if (codes->lz77.enabled) {
       for (size_t j = 0; j < tokens[i].size(); ++j) {
         const Token& token = tokens[i][j];
@@ -11,10 +11,15 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <vector>
+
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/enc_params.h"
 
 namespace jxl {
 
+struct Histogram;
+
 struct HistogramParams {
   enum class ClusteringType {
     kFastest,  // Only 4 clusters.
@@ -67,8 +72,21 @@ struct HistogramParams {
   LZ77Method lz77_method = LZ77Method::kRLE;
   ANSHistogramStrategy ans_histogram_strategy = ANSHistogramStrategy::kPrecise;
   std::vector<size_t> image_widths;
+  // If it has one entry per context, this clustering of the contexts is used
+  // instead of computing a new one, e.g. to reuse the context map of a
+  // previous frame that has the same contexts.
+  std::vector<uint8_t> context_map;
   size_t max_histograms = ~0;
   bool force_huffman = false;
+  // Maximum number of earlier positions that the LZ77 match finder compares
+  // with each position. Lower values are faster and find fewer matches.
+  uint32_t lz77_max_chain_length = 256;
+  // If not null, the histograms of the tokens per context with the default
+  // HybridUintConfig, which are then not counted again if LZ77 is not used.
+  const std::vector<Histogram>* histograms = nullptr;
+  // Pool for the histogram clustering and the LZ77 match search. Must not be
+  // set when already running on it.
+  ThreadPool* pool = nullptr;
 };
 
 }  // namespace jxl
@@ -136,7 +136,23 @@ void ProcessTile(const Image3F& opsin, PassesEncoderState* enc_state,
       compute_laplacian_scalar(x);
     }
   }
-  HWY_CAPPED(float, 4) df4;
+  // Sums of 4 rows of laplacian_sqrsum, starting at column `x0`, so that the
+  // 4x4 boxes below only add 4 values each.
+  float* JXL_RESTRICT column_sums = temp_image->column_sums.Row(0);
+  const auto sum_columns = [&](const float* JXL_RESTRICT rows_in[4],
+                               size_t x0, size_t num) {
+    for (size_t x = 0; x < num; x += Lanes(df)) {
+      auto sum = LoadU(df, rows_in[0] + x0 + x);
+      sum += LoadU(df, rows_in[1] + x0 + x);
+      sum += LoadU(df, rows_in[2] + x0 + x);
+      sum += LoadU(df, rows_in[3] + x0 + x);
+      Store(sum, df, column_sums + x);
+    }
+  };
+  const auto box_sum = [&](size_t x) {
+    return (column_sums[x] + column_sums[x + 1]) +
+           (column_sums[x + 2] + column_sums[x + 3]);
+  };
   // Calculate the L2 of the 3x3 Laplacian in 4x4 blocks within the area
   // of the integral transform. Sample them within the integral transform
   // with two offsets (0,0) and (-2, -2) pixels (sqrsum_00 and sqrsum_22,
@@ -149,15 +165,10 @@ void ProcessTile(const Image3F& opsin, PassesEncoderState* enc_state,
     for (size_t iy = 0; iy < 4; iy++) {
       rows_in[iy] = laplacian_sqrsum.ConstRow(y * 4 + iy + 2);
     }
+    sum_columns(rows_in, 2, (bx1 - bx0) * N);
     float* JXL_RESTRICT row_out = sqrsum_00_row + y * sqrsum_00_stride;
     for (size_t x = 0; x < (bx1 - bx0) * 2; x++) {
-      auto sum = Zero(df4);
-      for (size_t iy = 0; iy < 4; iy++) {
-        for (size_t ix = 0; ix < 4; ix += Lanes(df4)) {
-          sum += LoadU(df4, rows_in[iy] + x * 4 + ix + 2);
-        }
-      }
-      row_out[x] = GetLane(Sqrt(SumOfLanes(df4, sum))) * (1.0f / 4.0f);
+      row_out[x] = std::sqrt(box_sum(x * 4)) * (1.0f / 4.0f);
     }
   }
   // Indexing iy and ix is a bit tricky as we include a 2 pixel border
@@ -172,6 +183,7 @@ void ProcessTile(const Image3F& opsin, PassesEncoderState* enc_state,
     for (size_t iy = 0; iy < 4; iy++) {
       rows_in[iy] = laplacian_sqrsum.ConstRow(y * 4 + iy);
     }
+    sum_columns(rows_in, 0, (bx1 - bx0) * N + 4);
     float* JXL_RESTRICT row_out = sqrsum_22_row + y * sqrsum_22_stride;
     // ignore pixels outside the image.
     // Y coordinates are relative to by0*8+y*4.
@@ -187,13 +199,7 @@ void ProcessTile(const Image3F& opsin, PassesEncoderState* enc_state,
                       ? x * 4 + 4
                       : opsin.xsize() - bx0 * 8 + 2;
       if (ex - sx == 4 && ey - sy == 4) {
-        auto sum = Zero(df4);
-        for (size_t iy = 0; iy < 4; iy++) {
-          for (size_t ix = 0; ix < 4; ix += Lanes(df4)) {
-            sum += Load(df4, rows_in[iy] + sx + ix);
-          }
-        }
-        row_out[x] = GetLane(Sqrt(SumOfLanes(df4, sum))) * (1.0f / 4.0f);
+        row_out[x] = std::sqrt(box_sum(sx)) * (1.0f / 4.0f);
       } else {
         float sum = 0;
         for (size_t iy = sy; iy < ey; iy++) {
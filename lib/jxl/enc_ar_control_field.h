@@ -24,11 +24,13 @@ struct ArControlFieldHeuristics {
       laplacian_sqrsum = ImageF(kEncTileDim + 4, kEncTileDim + 4);
       sqrsum_00 = ImageF(kEncTileDim / 4, kEncTileDim / 4);
       sqrsum_22 = ImageF(kEncTileDim / 4 + 1, kEncTileDim / 4 + 1);
+      column_sums = ImageF(kEncTileDim + 4, 1);
     }
 
     ImageF laplacian_sqrsum;
     ImageF sqrsum_00;
     ImageF sqrsum_22;
+    ImageF column_sums;
   };
 
   void PrepareForThreads(size_t num_threads) {
@@ -60,6 +60,13 @@ struct BitWriter {
     return std::move(storage_);
   }
 
+  // Frees the storage beyond the bits written, such as the rest of the
+  // allotments, which are upper bounds. Must not be within an allotment.
+  void ShrinkToFit() {
+    JXL_ASSERT(current_allotment_ == nullptr);
+    storage_.shrink_to_fit();
+  }
+
   // Must be byte-aligned before calling.
   void AppendByteAligned(const Span<const uint8_t>& span);
   // NOTE: no allotment needed, the other BitWriters have already been charged.
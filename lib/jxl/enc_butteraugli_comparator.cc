@@ -26,8 +26,14 @@ Status JxlButteraugliComparator::SetReferenceImage(const ImageBundle& ref) {
     return false;
   }
 
-  comparator_.reset(
-      new ButteraugliComparator(ref_linear_srgb->color(), params_));
+  if (params_.band_ysize != 0) {
+    // The bands are compared with their own comparators in CompareWith.
+    comparator_.reset();
+    reference_ = CopyImage(ref_linear_srgb->color());
+  } else {
+    comparator_.reset(
+        new ButteraugliComparator(ref_linear_srgb->color(), params_));
+  }
   xsize_ = ref.xsize();
   ysize_ = ref.ysize();
   return true;
@@ -35,7 +41,7 @@ Status JxlButteraugliComparator::SetReferenceImage(const ImageBundle& ref) {
 
 Status JxlButteraugliComparator::CompareWith(const ImageBundle& actual,
                                              ImageF* diffmap, float* score) {
-  if (!comparator_) {
+  if (!comparator_ && reference_.xsize() == 0) {
     return JXL_FAILURE("Must set reference image first");
   }
   if (xsize_ != actual.xsize() || ysize_ != actual.ysize()) {
@@ -52,7 +58,12 @@ Status JxlButteraugliComparator::CompareWith(const ImageBundle& actual,
   }
 
   ImageF temp_diffmap(xsize_, ysize_);
-  comparator_->Diffmap(actual_linear_srgb->color(), temp_diffmap);
+  if (comparator_) {
+    comparator_->Diffmap(actual_linear_srgb->color(), temp_diffmap);
+  } else {
+    ButteraugliDiffmapInBands(reference_, actual_linear_srgb->color(),
+                              params_, params_.band_ysize, temp_diffmap);
+  }
 
   if (score != nullptr) {
     *score = ButteraugliScoreFromDiffmap(temp_diffmap, &params_);
@@ -64,6 +75,37 @@ Status JxlButteraugliComparator::CompareWith(const ImageBundle& actual,
   return true;
 }
 
+Status JxlButteraugliComparator::CompareWithRects(
+    const ImageBundle& actual, const std::vector<Rect>& rects, ImageF* diffmap,
+    float* score) {
+  if (!comparator_) {
+    return CompareWith(actual, diffmap, score);
+  }
+  if (xsize_ != actual.xsize() || ysize_ != actual.ysize() ||
+      xsize_ != diffmap->xsize() || ysize_ != diffmap->ysize()) {
+    return JXL_FAILURE("Images must have same size");
+  }
+
+  const ImageBundle* actual_linear_srgb;
+  ImageMetadata metadata = *actual.metadata();
+  ImageBundle store(&metadata);
+  if (!TransformIfNeeded(actual, ColorEncoding::LinearSRGB(actual.IsGray()),
+                         cms_,
+                         /*pool=*/nullptr, &store, &actual_linear_srgb)) {
+    return false;
+  }
+
+  for (const Rect& rect : rects) {
+    comparator_->DiffmapInRect(actual_linear_srgb->color(), rect, diffmap);
+  }
+
+  if (score != nullptr) {
+    *score = ButteraugliScoreFromDiffmap(*diffmap, &params_);
+  }
+
+  return true;
+}
+
 float JxlButteraugliComparator::GoodQualityScore() const {
   return ButteraugliFuzzyInverse(1.5);
 }
@@ -9,6 +9,7 @@
 #include <stddef.h>
 
 #include <memory>
+#include <vector>
 
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
@@ -30,6 +31,13 @@ class JxlButteraugliComparator : public Comparator {
   Status CompareWith(const ImageBundle& actual, ImageF* diffmap,
                      float* score) override;
 
+  // Same as CompareWith, but only recomputes diffmap in rects. diffmap must
+  // hold the result of a previous comparison with an image that only differs
+  // from actual in rects. Recomputes the whole diffmap in banded mode.
+  Status CompareWithRects(const ImageBundle& actual,
+                          const std::vector<Rect>& rects, ImageF* diffmap,
+                          float* score);
+
   float GoodQualityScore() const override;
   float BadQualityScore() const override;
 
@@ -37,6 +45,9 @@ class JxlButteraugliComparator : public Comparator {
   ButteraugliParams params_;
   JxlCmsInterface cms_;
   std::unique_ptr<ButteraugliComparator> comparator_;
+  // Linear sRGB reference image, only kept instead of comparator_ if
+  // params_.band_ysize is set.
+  Image3F reference_;
   size_t xsize_ = 0;
   size_t ysize_ = 0;
 };
@@ -7,6 +7,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <type_traits>
 
@@ -16,6 +17,7 @@
 #include "lib/jxl/base/padded_bytes.h"
 #include "lib/jxl/base/profiler.h"
 #include "lib/jxl/base/span.h"
+#include "lib/jxl/chroma_from_luma.h"
 #include "lib/jxl/color_encoding_internal.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/compressed_dc.h"
@@ -50,6 +52,8 @@ Status InitializePassesEncoder(const Image3F& opsin, const JxlCmsInterface& cms,
       std::pow(1.25f, shared.frame_header.b_qm_scale - 2.0f);
 
   if (enc_state->coeffs.size() < shared.frame_header.passes.num_passes) {
+    CacheAligned::ScopedCategory scoped_category(
+        CacheAligned::Category::kCoefficients);
     enc_state->coeffs.reserve(shared.frame_header.passes.num_passes);
     for (size_t i = enc_state->coeffs.size();
          i < shared.frame_header.passes.num_passes; i++) {
@@ -63,12 +67,24 @@ Status InitializePassesEncoder(const Image3F& opsin, const JxlCmsInterface& cms,
   }
 
   Image3F dc(shared.frame_dim.xsize_blocks, shared.frame_dim.ysize_blocks);
+  // Each group is split into strips of rows of color tiles, so that images
+  // with fewer groups than threads still use all of them.
+  constexpr size_t kStripRows = kColorTileDimInBlocks;
+  const size_t strips_per_group =
+      DivCeil(shared.frame_dim.group_dim / kBlockDim, kStripRows);
+  const size_t num_tasks = shared.frame_dim.num_groups * strips_per_group;
+  AddProgressWork(enc_state->progress, num_tasks);
   JXL_RETURN_IF_ERROR(RunOnPool(
-      pool, 0, shared.frame_dim.num_groups, ThreadPool::NoInit,
-      [&](size_t group_idx, size_t _) {
-        ComputeCoefficients(group_idx, enc_state, opsin, &dc);
+      pool, 0, num_tasks, ThreadPool::NoInit,
+      [&](size_t task, size_t _) {
+        if (!PollProgress(enc_state->progress)) return;
+        const size_t group_idx = task / strips_per_group;
+        const size_t by0 = (task % strips_per_group) * kStripRows;
+        ComputeCoefficients(group_idx, by0, by0 + kStripRows, enc_state, opsin,
+                            &dc);
       },
       "Compute coeffs"));
+  JXL_RETURN_IF_ERROR(CheckProgress(enc_state->progress));
 
   if (shared.frame_header.flags & FrameHeader::kUseDcFrame) {
     CompressParams cparams = enc_state->cparams;
@@ -79,6 +95,8 @@ Status InitializePassesEncoder(const Image3F& opsin, const JxlCmsInterface& cms,
     cparams.dots = Override::kOff;
     cparams.noise = Override::kOff;
     cparams.patches = Override::kOff;
+    cparams.importance_map = nullptr;
+    cparams.classify_content = false;
     cparams.gaborish = Override::kOff;
     cparams.epf = 0;
     cparams.max_error_mode = true;
@@ -193,6 +211,59 @@ Status InitializePassesEncoder(const Image3F& opsin, const JxlCmsInterface& cms,
   return true;
 }
 
+constexpr uint8_t PassesEncoderState::kNoSearchedStrategy;
+
+void StoreSearchedCoefficients(const AcStrategy& acs, size_t bx, size_t by,
+                               const float* JXL_RESTRICT coeffs,
+                               PassesEncoderState* enc_state) {
+  ImageB& strategy = enc_state->searched_strategy;
+  if (strategy.xsize() == 0) return;
+  const size_t xblocks = acs.covered_blocks_x();
+  const size_t num_blocks = xblocks * acs.covered_blocks_y();
+  const size_t size = num_blocks * kDCTBlockSize;
+  for (size_t i = 0; i < num_blocks; i++) {
+    const size_t x = bx + i % xblocks;
+    const size_t y = by + i / xblocks;
+    strategy.Row(y)[x] = PassesEncoderState::kNoSearchedStrategy;
+    for (size_t c = 0; c < 3; c++) {
+      const float* JXL_RESTRICT from = coeffs + c * size + i * kDCTBlockSize;
+      for (size_t iy = 0; iy < kBlockDim; iy++) {
+        memcpy(enc_state->searched_coeffs.PlaneRow(c, y * kBlockDim + iy) +
+                   x * kBlockDim,
+               from + iy * kBlockDim, kBlockDim * sizeof(float));
+      }
+    }
+  }
+  strategy.Row(by)[bx] = acs.RawStrategy();
+}
+
+bool LoadSearchedCoefficients(const AcStrategy& acs, size_t bx, size_t by,
+                              const PassesEncoderState& enc_state,
+                              float* JXL_RESTRICT coeffs) {
+  const ImageB& strategy = enc_state.searched_strategy;
+  if (strategy.xsize() == 0 ||
+      strategy.ConstRow(by)[bx] != acs.RawStrategy()) {
+    return false;
+  }
+  const size_t xblocks = acs.covered_blocks_x();
+  const size_t num_blocks = xblocks * acs.covered_blocks_y();
+  const size_t size = num_blocks * kDCTBlockSize;
+  for (size_t i = 0; i < num_blocks; i++) {
+    const size_t x = bx + i % xblocks;
+    const size_t y = by + i / xblocks;
+    for (size_t c = 0; c < 3; c++) {
+      float* JXL_RESTRICT to = coeffs + c * size + i * kDCTBlockSize;
+      for (size_t iy = 0; iy < kBlockDim; iy++) {
+        memcpy(to + iy * kBlockDim,
+               enc_state.searched_coeffs.ConstPlaneRow(
+                   c, y * kBlockDim + iy) + x * kBlockDim,
+               kBlockDim * sizeof(float));
+      }
+    }
+  }
+  return true;
+}
+
 void EncCache::InitOnce() {
   PROFILER_FUNC;
 
@@ -9,23 +9,28 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <functional>
 #include <vector>
 
 #include "lib/jxl/ac_strategy.h"
 #include "lib/jxl/aux_out.h"
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/padded_bytes.h"
 #include "lib/jxl/chroma_from_luma.h"
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/coeff_order_fwd.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/dct_util.h"
 #include "lib/jxl/enc_ans.h"
+#include "lib/jxl/enc_cluster.h"
 #include "lib/jxl/enc_heuristics.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/passes_state.h"
+#include "lib/jxl/phase_counters.h"
+#include "lib/jxl/progress.h"
 #include "lib/jxl/progressive_split.h"
 #include "lib/jxl/quant_weights.h"
 #include "lib/jxl/quantizer.h"
@@ -39,19 +44,64 @@ struct PassesEncoderState {
   ImageF initial_quant_field;    // Invalid in Falcon mode.
   ImageF initial_quant_masking;  // Invalid in Falcon mode.
 
+  // Coefficients of the transforms selected by the AC strategy search, so
+  // that ComputeCoefficients does not have to compute them again. The
+  // coefficients of a transform are stored in the pixels of the blocks it
+  // covers, 64 per block, and `searched_strategy` holds the raw strategy they
+  // are for at its first block and kNoSearchedStrategy elsewhere. Invalid if
+  // the search did not run.
+  Image3F searched_coeffs;
+  ImageB searched_strategy;
+  static constexpr uint8_t kNoSearchedStrategy = 0xFF;
+
   // Per-pass DCT coefficients for the image. One row per group.
   std::vector<std::unique_ptr<ACImage>> coeffs;
 
   // Raw data for special (reference+DC) frames.
   std::vector<std::unique_ptr<BitWriter>> special_frames;
 
+  // If set, EncodeFrame passes the special frames to it as soon as the DC
+  // frame is encoded, instead of writing them before the frame at the end:
+  // they are final while the AC of the frame is still being encoded, and can
+  // already be sent. Not set for the frames encoded as part of another one.
+  std::function<Status(PaddedBytes&&)> special_frames_done;
+
   // For splitting into passes.
   ProgressiveSplitter progressive_splitter;
 
   CompressParams cparams;
 
+  // If not null, EncodeFrame adds the time spent in each phase to it. Not set
+  // for the states of the frames encoded as part of another one, whose time
+  // is counted in the phase of the outer frame that needs them.
+  EncoderCounters* counters = nullptr;
+  // If not null, the parallel loops over the groups of EncodeFrame poll it,
+  // and EncodeFrame fails if it asks to abort. Not set for the states of the
+  // frames encoded as part of another one either.
+  ProgressMonitor* progress = nullptr;
+
+  // Results of the analysis of a frame that do not depend on the distance.
+  struct FrameAnalysis {
+    // The frame they were computed for, only compared by address.
+    const ImageBundle* source = nullptr;
+    // The frame after ToXYB, not yet padded.
+    Image3F xyb;
+    // Linear sRGB copy of the frame for the butteraugli search, empty if the
+    // speed tier does not need it.
+    Image3F linear;
+  };
+  // If set, EncodeFrame keeps the analysis of each frame in `analyses`, and
+  // reuses it for the later encodes of the same frame with this state. Only
+  // for encoding the same unmodified images several times with parameters
+  // that differ in the distance, see EncodeFileAtDistances.
+  bool reuse_analysis = false;
+  std::vector<FrameAnalysis> analyses;
+
   struct PassData {
     std::vector<std::vector<Token>> ac_tokens;
+    // Histograms of ac_tokens per context with the default HybridUintConfig,
+    // counted during tokenization.
+    std::vector<Histogram> ac_histograms;
     std::vector<uint8_t> context_map;
     EntropyEncodingData codes;
   };
@@ -79,6 +129,19 @@ Status InitializePassesEncoder(const Image3F& opsin, const JxlCmsInterface& cms,
                                ModularFrameEncoder* modular_frame_encoder,
                                AuxOut* aux_out);
 
+// Saves the coefficients of `acs` at block (bx, by), in the layout of
+// TransformFromPixels for the three channels one after the other, as the ones
+// of the selected transform.
+void StoreSearchedCoefficients(const AcStrategy& acs, size_t bx, size_t by,
+                               const float* JXL_RESTRICT coeffs,
+                               PassesEncoderState* enc_state);
+
+// Copies the coefficients saved by StoreSearchedCoefficients for `acs` at
+// block (bx, by) to `coeffs`. Returns false if there are none.
+bool LoadSearchedCoefficients(const AcStrategy& acs, size_t bx, size_t by,
+                              const PassesEncoderState& enc_state,
+                              float* JXL_RESTRICT coeffs);
+
 // Working area for ComputeCoefficients (per-group!)
 struct EncCache {
   // Allocates memory when first called, shrinks images to current group size.
@@ -86,6 +149,8 @@ struct EncCache {
 
   // TokenizeCoefficients
   Image3I num_nzeroes;
+  // Histograms of the tokens of this thread, per pass.
+  std::vector<std::vector<Histogram>> ac_histograms;
 };
 
 }  // namespace jxl
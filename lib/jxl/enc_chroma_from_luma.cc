@@ -26,6 +26,7 @@
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/dec_transforms-inl.h"
+#include "lib/jxl/enc_cache.h"
 #include "lib/jxl/enc_transforms-inl.h"
 #include "lib/jxl/entropy_coder.h"
 #include "lib/jxl/image_ops.h"
@@ -103,6 +104,21 @@ struct CFLFunction {
   float distance_mul;
 };
 
+// Least-squares fit of the color residual (m / kDefaultColorFactor * x +
+// base * m - s), plus distance_mul * x^2 * num, from the moments sum(m * m)
+// and sum(m * s) of the num values.
+int32_t BestMultiplierFromMoments(float mm, float ms, size_t num, float base,
+                                  float distance_mul) {
+  if (num == 0) {
+    return 0;
+  }
+  static constexpr float kInvColorFactor = 1.0f / kDefaultColorFactor;
+  const float ca = kInvColorFactor * kInvColorFactor * mm;
+  const float cb = kInvColorFactor * (base * mm - ms);
+  const float x = -cb / (ca + num * distance_mul * 0.5f);
+  return std::max(-128.0f, std::min(127.0f, roundf(x)));
+}
+
 int32_t FindBestMultiplier(const float* values_m, const float* values_s,
                            size_t num, float base, float distance_mul,
                            bool fast) {
@@ -111,21 +127,16 @@ int32_t FindBestMultiplier(const float* values_m, const float* values_s,
   }
   float x;
   if (fast) {
-    static constexpr float kInvColorFactor = 1.0f / kDefaultColorFactor;
-    auto ca = Zero(df);
-    auto cb = Zero(df);
-    const auto inv_color_factor = Set(df, kInvColorFactor);
-    const auto base_v = Set(df, base);
+    auto mm = Zero(df);
+    auto ms = Zero(df);
     for (size_t i = 0; i < num; i += Lanes(df)) {
-      // color residual = ax + b
-      const auto a = inv_color_factor * Load(df, values_m + i);
-      const auto b = base_v * Load(df, values_m + i) - Load(df, values_s + i);
-      ca = MulAdd(a, a, ca);
-      cb = MulAdd(a, b, cb);
+      const auto m = Load(df, values_m + i);
+      mm = MulAdd(m, m, mm);
+      ms = MulAdd(m, Load(df, values_s + i), ms);
     }
-    // + distance_mul * x^2 * num
-    x = -GetLane(SumOfLanes(df, cb)) /
-        (GetLane(SumOfLanes(df, ca)) + num * distance_mul * 0.5f);
+    return BestMultiplierFromMoments(GetLane(SumOfLanes(df, mm)),
+                                     GetLane(SumOfLanes(df, ms)), num, base,
+                                     distance_mul);
   } else {
     constexpr float eps = 1;
     constexpr float kClamp = 20.0f;
@@ -177,8 +188,9 @@ void ComputeDC(const ImageF& dc_values, bool fast, int* dc_x, int* dc_b) {
 
 void ComputeTile(const Image3F& opsin, const DequantMatrices& dequant,
                  const AcStrategyImage* ac_strategy, const Quantizer* quantizer,
-                 const Rect& r, bool fast, bool use_dct8, ImageSB* map_x,
-                 ImageSB* map_b, ImageF* dc_values, float* mem) {
+                 const PassesEncoderState* enc_state, const Rect& r, bool fast,
+                 bool use_dct8, ImageSB* map_x, ImageSB* map_b,
+                 ImageF* dc_values, float* mem) {
   static_assert(kEncTileDimInBlocks == kColorTileDimInBlocks,
                 "Invalid color tile dim");
   size_t xsize_blocks = opsin.xsize() / kBlockDim;
@@ -201,16 +213,14 @@ void ComputeTile(const Image3F& opsin, const DequantMatrices& dequant,
   float* JXL_RESTRICT dc_values_b = dc_values->Row(3);
 
   // All are aligned.
-  float* HWY_RESTRICT block_y = mem;
-  float* HWY_RESTRICT block_x = block_y + AcStrategy::kMaxCoeffArea;
-  float* HWY_RESTRICT block_b = block_x + AcStrategy::kMaxCoeffArea;
-  float* HWY_RESTRICT coeffs_yx = block_b + AcStrategy::kMaxCoeffArea;
+  float* HWY_RESTRICT blocks = mem;
+  float* HWY_RESTRICT coeffs_yx = blocks + 3 * AcStrategy::kMaxCoeffArea;
   float* HWY_RESTRICT coeffs_x = coeffs_yx + kColorTileDim * kColorTileDim;
   float* HWY_RESTRICT coeffs_yb = coeffs_x + kColorTileDim * kColorTileDim;
   float* HWY_RESTRICT coeffs_b = coeffs_yb + kColorTileDim * kColorTileDim;
   float* HWY_RESTRICT scratch_space = coeffs_b + kColorTileDim * kColorTileDim;
   JXL_DASSERT(scratch_space + 2 * AcStrategy::kMaxCoeffArea ==
-              block_y + CfLHeuristics::kItemsPerThread);
+              blocks + CfLHeuristics::kItemsPerThread);
 
   // Small (~256 bytes each)
   HWY_ALIGN_MAX float
@@ -220,6 +230,11 @@ void ComputeTile(const Image3F& opsin, const DequantMatrices& dequant,
   HWY_ALIGN_MAX float
       dc_b[AcStrategy::kMaxCoeffBlocks * AcStrategy::kMaxCoeffBlocks] = {};
   size_t num_ac = 0;
+  // In fast mode, only the moments of the coefficients are needed.
+  auto mm_x = Zero(df);
+  auto ms_x = Zero(df);
+  auto mm_b = Zero(df);
+  auto ms_b = Zero(df);
 
   for (size_t y = y0; y < y1; ++y) {
     const float* JXL_RESTRICT row_y = opsin.ConstPlaneRow(1, y * kBlockDim);
@@ -233,14 +248,25 @@ void ComputeTile(const Image3F& opsin, const DequantMatrices& dequant,
                            : ac_strategy->ConstRow(y)[x];
       if (!acs.IsFirstBlock()) continue;
       size_t xs = acs.covered_blocks_x();
-      TransformFromPixels(acs.Strategy(), row_y + x * kBlockDim, stride,
-                          block_y, scratch_space);
+      float* HWY_RESTRICT block_x = blocks;
+      float* HWY_RESTRICT block_y = blocks + AcStrategy::kMaxCoeffArea;
+      float* HWY_RESTRICT block_b = blocks + 2 * AcStrategy::kMaxCoeffArea;
+      // The AC strategy search may already have transformed this block.
+      if (!use_dct8 && enc_state != nullptr &&
+          LoadSearchedCoefficients(acs, x, y, *enc_state, blocks)) {
+        const size_t size = acs.covered_blocks_y() * xs * kDCTBlockSize;
+        block_y = blocks + size;
+        block_b = blocks + 2 * size;
+      } else {
+        TransformFromPixels(acs.Strategy(), row_x + x * kBlockDim, stride,
+                            block_x, scratch_space);
+        TransformFromPixels(acs.Strategy(), row_y + x * kBlockDim, stride,
+                            block_y, scratch_space);
+        TransformFromPixels(acs.Strategy(), row_b + x * kBlockDim, stride,
+                            block_b, scratch_space);
+      }
       DCFromLowestFrequencies(acs.Strategy(), block_y, dc_y, xs);
-      TransformFromPixels(acs.Strategy(), row_x + x * kBlockDim, stride,
-                          block_x, scratch_space);
       DCFromLowestFrequencies(acs.Strategy(), block_x, dc_x, xs);
-      TransformFromPixels(acs.Strategy(), row_b + x * kBlockDim, stride,
-                          block_b, scratch_space);
       DCFromLowestFrequencies(acs.Strategy(), block_b, dc_b, xs);
       const float* const JXL_RESTRICT qm_x =
           dequant.InvMatrix(acs.Strategy(), 0);
@@ -294,15 +320,35 @@ void ComputeTile(const Image3F& opsin, const DequantMatrices& dequant,
         const auto b_b = Load(df, block_b + i);
         const auto qqm_x = qv * Load(df, qm_x + i);
         const auto qqm_b = qv * Load(df, qm_b + i);
-        Store(b_y * qqm_x, df, coeffs_yx + num_ac);
-        Store(b_x * qqm_x, df, coeffs_x + num_ac);
-        Store(b_y * qqm_b, df, coeffs_yb + num_ac);
-        Store(b_b * qqm_b, df, coeffs_b + num_ac);
+        const auto m_x = b_y * qqm_x;
+        const auto s_x = b_x * qqm_x;
+        const auto m_b = b_y * qqm_b;
+        const auto s_b = b_b * qqm_b;
+        if (fast) {
+          mm_x = MulAdd(m_x, m_x, mm_x);
+          ms_x = MulAdd(m_x, s_x, ms_x);
+          mm_b = MulAdd(m_b, m_b, mm_b);
+          ms_b = MulAdd(m_b, s_b, ms_b);
+        } else {
+          Store(m_x, df, coeffs_yx + num_ac);
+          Store(s_x, df, coeffs_x + num_ac);
+          Store(m_b, df, coeffs_yb + num_ac);
+          Store(s_b, df, coeffs_b + num_ac);
+        }
         num_ac += Lanes(df);
       }
     }
   }
   JXL_CHECK(num_ac % Lanes(df) == 0);
+  if (fast) {
+    row_out_x[tx] = BestMultiplierFromMoments(
+        GetLane(SumOfLanes(df, mm_x)), GetLane(SumOfLanes(df, ms_x)), num_ac,
+        0.0f, kDistanceMultiplierAC);
+    row_out_b[tx] = BestMultiplierFromMoments(
+        GetLane(SumOfLanes(df, mm_b)), GetLane(SumOfLanes(df, ms_b)), num_ac,
+        kYToBRatio, kDistanceMultiplierAC);
+    return;
+  }
   row_out_x[tx] = FindBestMultiplier(coeffs_yx, coeffs_x, num_ac, 0.0f,
                                      kDistanceMultiplierAC, fast);
   row_out_b[tx] = FindBestMultiplier(coeffs_yb, coeffs_b, num_ac, kYToBRatio,
@@ -331,12 +377,14 @@ void CfLHeuristics::Init(const Image3F& opsin) {
 void CfLHeuristics::ComputeTile(const Rect& r, const Image3F& opsin,
                                 const DequantMatrices& dequant,
                                 const AcStrategyImage* ac_strategy,
-                                const Quantizer* quantizer, bool fast,
+                                const Quantizer* quantizer,
+                                const PassesEncoderState* enc_state, bool fast,
                                 size_t thread, ColorCorrelationMap* cmap) {
   bool use_dct8 = ac_strategy == nullptr;
   HWY_DYNAMIC_DISPATCH(ComputeTile)
-  (opsin, dequant, ac_strategy, quantizer, r, fast, use_dct8, &cmap->ytox_map,
-   &cmap->ytob_map, &dc_values, mem.get() + thread * kItemsPerThread);
+  (opsin, dequant, ac_strategy, quantizer, enc_state, r, fast, use_dct8,
+   &cmap->ytox_map, &cmap->ytob_map, &dc_values,
+   mem.get() + thread * kItemsPerThread);
 }
 
 void CfLHeuristics::ComputeDC(bool fast, ColorCorrelationMap* cmap) {
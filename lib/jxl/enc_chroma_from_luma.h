@@ -34,6 +34,8 @@
 
 namespace jxl {
 
+struct PassesEncoderState;
+
 void ColorCorrelationMapEncodeDC(ColorCorrelationMap* map, BitWriter* writer,
                                  size_t layer, AuxOut* aux_out);
 
@@ -47,8 +49,9 @@ struct CfLHeuristics {
   void ComputeTile(const Rect& r, const Image3F& opsin,
                    const DequantMatrices& dequant,
                    const AcStrategyImage* ac_strategy,
-                   const Quantizer* quantizer, bool fast, size_t thread,
-                   ColorCorrelationMap* cmap);
+                   const Quantizer* quantizer,
+                   const PassesEncoderState* enc_state, bool fast,
+                   size_t thread, ColorCorrelationMap* cmap);
 
   void ComputeDC(bool fast, ColorCorrelationMap* cmap);
 
@@ -7,6 +7,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <functional>
 #include <limits>
 #include <map>
 #include <memory>
@@ -20,7 +21,9 @@
 #include <hwy/highway.h>
 
 #include "lib/jxl/ac_context.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/profiler.h"
+#include "lib/jxl/base/status.h"
 #include "lib/jxl/fast_math-inl.h"
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
@@ -78,15 +81,32 @@ float HistogramDistance(const Histogram& a, const Histogram& b) {
 // First step of a k-means clustering with a fancy distance metric.
 void FastClusterHistograms(const std::vector<Histogram>& in,
                            const size_t num_contexts_in, size_t max_histograms,
-                           float min_distance, std::vector<Histogram>* out,
+                           float min_distance, ThreadPool* pool,
+                           std::vector<Histogram>* out,
                            std::vector<uint32_t>* histogram_symbols) {
   PROFILER_FUNC;
+  // Contexts are processed in chunks on the pool, each one independently of
+  // the others, so that the result does not depend on the number of threads.
+  constexpr size_t kContextsPerTask = 64;
+  if (num_contexts_in < 2 * kContextsPerTask) pool = nullptr;
+  const auto run_on_contexts = [&](size_t num,
+                                   const std::function<void(size_t)>& func) {
+    JXL_CHECK(RunOnPool(
+        pool, 0, DivCeil(num, kContextsPerTask), ThreadPool::NoInit,
+        [&](const uint32_t task, size_t /* thread */) {
+          const size_t end = std::min(num, (task + 1) * kContextsPerTask);
+          for (size_t i = task * kContextsPerTask; i < end; i++) func(i);
+        },
+        "ClusterContexts"));
+  };
+  run_on_contexts(num_contexts_in, [&](size_t i) {
+    if (in[i].total_count_ != 0) HistogramEntropy(in[i]);
+  });
   size_t largest_idx = 0;
   std::vector<uint32_t> nonempty_histograms;
   nonempty_histograms.reserve(in.size());
   for (size_t i = 0; i < num_contexts_in; i++) {
     if (in[i].total_count_ == 0) continue;
-    HistogramEntropy(in[i]);
     if (in[i].total_count_ > in[largest_idx].total_count_) {
       largest_idx = i;
     }
@@ -112,10 +132,12 @@ void FastClusterHistograms(const std::vector<Histogram>& in,
   while (out->size() < max_histograms && out->size() < num_contexts) {
     (*histogram_symbols)[nonempty_histograms[largest_idx]] = out->size();
     out->push_back(in[nonempty_histograms[largest_idx]]);
-    largest_idx = 0;
-    for (size_t i = 0; i < num_contexts; i++) {
+    run_on_contexts(num_contexts, [&](size_t i) {
       dists[i] = std::min(
           HistogramDistance(in[nonempty_histograms[i]], out->back()), dists[i]);
+    });
+    largest_idx = 0;
+    for (size_t i = 0; i < num_contexts; i++) {
       // Avoid repeating histograms
       if ((*histogram_symbols)[nonempty_histograms[i]] != max_histograms) {
         continue;
@@ -200,20 +222,26 @@ void ClusterHistograms(const HistogramParams params,
   max_histograms = std::min(max_histograms, params.max_histograms);
   if (params.clustering == HistogramParams::ClusteringType::kFastest) {
     HWY_DYNAMIC_DISPATCH(FastClusterHistograms)
-    (in, num_contexts, 4, kMinDistanceForDistinctFast, out, histogram_symbols);
+    (in, num_contexts, 4, kMinDistanceForDistinctFast, params.pool, out,
+     histogram_symbols);
   } else if (params.clustering == HistogramParams::ClusteringType::kFast) {
     HWY_DYNAMIC_DISPATCH(FastClusterHistograms)
-    (in, num_contexts, max_histograms, kMinDistanceForDistinctFast, out,
-     histogram_symbols);
+    (in, num_contexts, max_histograms, kMinDistanceForDistinctFast,
+     params.pool, out, histogram_symbols);
   } else {
     PROFILER_FUNC;
     HWY_DYNAMIC_DISPATCH(FastClusterHistograms)
-    (in, num_contexts, max_histograms, kMinDistanceForDistinctBest, out,
-     histogram_symbols);
-    for (size_t i = 0; i < out->size(); i++) {
-      (*out)[i].entropy_ =
-          ANSPopulationCost((*out)[i].data_.data(), (*out)[i].data_.size());
-    }
+    (in, num_contexts, max_histograms, kMinDistanceForDistinctBest,
+     params.pool, out, histogram_symbols);
+    // With few clusters, the pool costs more than it saves.
+    ThreadPool* pool = out->size() >= 16 ? params.pool : nullptr;
+    JXL_CHECK(RunOnPool(
+        pool, 0, out->size(), ThreadPool::NoInit,
+        [&](const uint32_t i, size_t /* thread */) {
+          (*out)[i].entropy_ =
+              ANSPopulationCost((*out)[i].data_.data(), (*out)[i].data_.size());
+        },
+        "ClusterEntropy"));
     uint32_t next_version = 2;
     std::vector<uint32_t> version(out->size(), 1);
     std::vector<uint32_t> renumbering(out->size());
@@ -236,21 +264,37 @@ void ClusterHistograms(const HistogramParams params,
       }
     };
 
-    // Create list of all pairs by increasing merging cost.
+    // Cost of merging clusters i and j, negative if it is advantageous.
+    const auto merge_cost = [out](uint32_t i, uint32_t j) {
+      Histogram histo;
+      histo.AddHistogram((*out)[i]);
+      histo.AddHistogram((*out)[j]);
+      return ANSPopulationCost(histo.data_.data(), histo.data_.size()) -
+             (*out)[i].entropy_ - (*out)[j].entropy_;
+    };
+
+    // Create list of all pairs by increasing merging cost. The costs are
+    // computed on the pool, one row of pairs per task; the queue order only
+    // depends on the pairs themselves.
     std::priority_queue<HistogramPair> pairs_to_merge;
-    for (uint32_t i = 0; i < out->size(); i++) {
-      for (uint32_t j = i + 1; j < out->size(); j++) {
-        Histogram histo;
-        histo.AddHistogram((*out)[i]);
-        histo.AddHistogram((*out)[j]);
-        float cost = ANSPopulationCost(histo.data_.data(), histo.data_.size()) -
-                     (*out)[i].entropy_ - (*out)[j].entropy_;
-        // Avoid enqueueing pairs that are not advantageous to merge.
-        if (cost >= 0) continue;
-        pairs_to_merge.push(
-            HistogramPair{cost, i, j, std::max(version[i], version[j])});
-      }
+    std::vector<std::vector<HistogramPair>> row_pairs(out->size());
+    JXL_CHECK(RunOnPool(
+        pool, 0, out->size(), ThreadPool::NoInit,
+        [&](const uint32_t i, size_t /* thread */) {
+          for (uint32_t j = i + 1; j < out->size(); j++) {
+            float cost = merge_cost(i, j);
+            // Avoid enqueueing pairs that are not advantageous to merge.
+            if (cost >= 0) continue;
+            row_pairs[i].push_back(
+                HistogramPair{cost, i, j, std::max(version[i], version[j])});
+          }
+        },
+        "ClusterPairs"));
+    for (const std::vector<HistogramPair>& row : row_pairs) {
+      for (const HistogramPair& pair : row) pairs_to_merge.push(pair);
     }
+    row_pairs.clear();
+    std::vector<float> costs(out->size());
 
     // Merge the best pair to merge, add new pairs that get formed as a
     // consequence.
@@ -273,14 +317,17 @@ void ClusterHistograms(const HistogramParams params,
       }
       version[second] = 0;
       version[first] = next_version++;
+      JXL_CHECK(RunOnPool(
+          pool, 0, out->size(), ThreadPool::NoInit,
+          [&](const uint32_t j, size_t /* thread */) {
+            if (j == first || version[j] == 0) return;
+            costs[j] = merge_cost(first, j);
+          },
+          "ClusterMerge"));
       for (uint32_t j = 0; j < out->size(); j++) {
         if (j == first) continue;
         if (version[j] == 0) continue;
-        Histogram histo;
-        histo.AddHistogram((*out)[first]);
-        histo.AddHistogram((*out)[j]);
-        float cost = ANSPopulationCost(histo.data_.data(), histo.data_.size()) -
-                     (*out)[first].entropy_ - (*out)[j].entropy_;
+        float cost = costs[j];
         // Avoid enqueueing pairs that are not advantageous to merge.
         if (cost >= 0) continue;
         pairs_to_merge.push(
@@ -20,6 +20,7 @@
 #include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/enc_ans.h"
 #include "lib/jxl/enc_bit_writer.h"
+#include "lib/jxl/enc_coeff_order.h"
 #include "lib/jxl/entropy_coder.h"
 #include "lib/jxl/lehmer_code.h"
 #include "lib/jxl/modular/encoding/encoding.h"
@@ -30,7 +31,9 @@ namespace jxl {
 std::pair<uint32_t, uint32_t> ComputeUsedOrders(
     const SpeedTier speed, const AcStrategyImage& ac_strategy,
     const Rect& rect) {
-  // Only uses DCT8 = 0, so bitfield = 1.
+  // Only uses DCT8 = 0, so bitfield = 1. The fastest tier keeps its default
+  // order, which saves counting the zeros of all the coefficients.
+  if (speed >= SpeedTier::kLightning) return {1, 0};
   if (speed >= SpeedTier::kFalcon) return {1, 1};
 
   uint32_t ret = 0;
@@ -59,6 +62,20 @@ void ComputeCoeffOrder(SpeedTier speed, const ACImage& acs,
                        const AcStrategyImage& ac_strategy,
                        const FrameDimensions& frame_dim, uint32_t& used_orders,
                        uint16_t used_acs, coeff_order_t* JXL_RESTRICT order) {
+  const auto get_group_rows = [&acs](size_t group_index, ConstACPtr rows[3]) {
+    for (size_t c = 0; c < 3; c++) {
+      rows[c] = acs.PlaneRow(c, group_index, 0);
+    }
+    return acs.Type();
+  };
+  ComputeCoeffOrder(speed, get_group_rows, ac_strategy, frame_dim, used_orders,
+                    used_acs, order);
+}
+
+void ComputeCoeffOrder(SpeedTier speed, const GetACGroupRows& get_group_rows,
+                       const AcStrategyImage& ac_strategy,
+                       const FrameDimensions& frame_dim, uint32_t& used_orders,
+                       uint16_t used_acs, coeff_order_t* JXL_RESTRICT order) {
   std::vector<int32_t> num_zeros(kCoeffOrderMaxSize);
   // If compressing at high speed and only using 8x8 DCTs, only consider a
   // subset of blocks.
@@ -96,10 +113,7 @@ void ComputeCoeffOrder(SpeedTier speed, const ACImage& acs,
                       kGroupDimInBlocks, kGroupDimInBlocks,
                       frame_dim.xsize_blocks, frame_dim.ysize_blocks);
       ConstACPtr rows[3];
-      ACType type = acs.Type();
-      for (size_t c = 0; c < 3; c++) {
-        rows[c] = acs.PlaneRow(c, group_index, 0);
-      }
+      ACType type = get_group_rows(group_index, rows);
       size_t ac_offset = 0;
 
       // TODO(veluca): SIMDfy.
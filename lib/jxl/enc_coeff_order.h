@@ -9,6 +9,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <functional>
+
 #include "lib/jxl/ac_strategy.h"
 #include "lib/jxl/aux_out_fwd.h"
 #include "lib/jxl/base/compiler_specific.h"
@@ -36,6 +38,20 @@ void ComputeCoeffOrder(SpeedTier speed, const ACImage& acs,
                        const FrameDimensions& frame_dim, uint32_t& used_orders,
                        uint16_t used_acs, coeff_order_t* JXL_RESTRICT order);
 
+// Sets rows[c] to the AC coefficients of channel c of the given group, laid
+// out as in ACImage::PlaneRow(c, group_index, 0), and returns their type. The
+// rows only need to stay valid until the next call.
+using GetACGroupRows =
+    std::function<ACType(size_t group_index, ConstACPtr rows[3])>;
+
+// Same as above, but obtains the coefficients of each group (in increasing
+// group order) from get_group_rows, which can compute them on the fly instead
+// of keeping the coefficients of the whole frame in memory.
+void ComputeCoeffOrder(SpeedTier speed, const GetACGroupRows& get_group_rows,
+                       const AcStrategyImage& ac_strategy,
+                       const FrameDimensions& frame_dim, uint32_t& used_orders,
+                       uint16_t used_acs, coeff_order_t* JXL_RESTRICT order);
+
 void EncodeCoeffOrders(uint16_t used_orders,
                        const coeff_order_t* JXL_RESTRICT order,
                        BitWriter* writer, size_t layer,
@@ -17,9 +17,12 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/enc_color_management.cc"
@@ -49,12 +52,21 @@
 
 namespace jxl {
 namespace {
-struct JxlCms {
+// The part of a JxlCms that only depends on the input and output profiles.
+// It is not modified after its creation, so that it can be shared by the
+// JxlCms of all the conversions between the same profiles, including
+// concurrent ones (see JxlCmsTransformCache).
+struct JxlCmsTransform {
 #if JPEGXL_ENABLE_SKCMS
+  // The profiles point into these.
   PaddedBytes icc_src, icc_dst;
   skcms_ICCProfile profile_src, profile_dst;
 #else
-  void* lcms_transform;
+  ~JxlCmsTransform() {
+    if (lcms_transform != nullptr) cmsDeleteTransform(lcms_transform);
+  }
+
+  void* lcms_transform = nullptr;
 #endif
 
   // These fields are used when the HLG OOTF or inverse OOTF must be applied.
@@ -65,14 +77,25 @@ struct JxlCms {
 
   size_t channels_src;
   size_t channels_dst;
-  ImageF buf_src;
-  ImageF buf_dst;
-  float intensity_target;
   bool skip_lcms = false;
+  // If skip_lcms, whether the linear RGB samples are multiplied by matrix
+  // instead of copied, for conversions between matrix-based profiles.
+  bool apply_matrix = false;
+  // Destination from source linear RGB, row-major.
+  std::array<float, 9> matrix;
   ExtraTF preprocess = ExtraTF::kNone;
   ExtraTF postprocess = ExtraTF::kNone;
 };
 
+struct JxlCms {
+  std::shared_ptr<const JxlCmsTransform> transform;
+  ImageF buf_src;
+  ImageF buf_dst;
+  // Three rows per thread for the planar samples of ApplyMatrix.
+  ImageF buf_planar;
+  float intensity_target;
+};
+
 Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
                     bool forward);
 }  // namespace
@@ -91,7 +114,7 @@ const size_t kX = 0;  // pixel index, multiplied by 3 for RGB
 // xform_src = UndoGammaCompression(buf_src).
 Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
                        size_t buf_size) {
-  switch (t->preprocess) {
+  switch (t->transform->preprocess) {
     case ExtraTF::kNone:
       JXL_DASSERT(false);  // unreachable
       break;
@@ -121,7 +144,7 @@ Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
         xform_src[i] = static_cast<float>(
             TF_HLG().DisplayFromEncoded(static_cast<double>(buf_src[i])));
       }
-      if (t->apply_hlg_ootf) {
+      if (t->transform->apply_hlg_ootf) {
         JXL_RETURN_IF_ERROR(
             ApplyHlgOotf(t, xform_src, buf_size, /*forward=*/true));
       }
@@ -132,26 +155,35 @@ Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
 #endif
       break;
 
-    case ExtraTF::kSRGB:
+    case ExtraTF::kSRGB: {
+      // Also used for matrix-based conversions of unpadded buffers, hence
+      // the remainder is converted one sample at a time.
       HWY_FULL(float) df;
-      for (size_t i = 0; i < buf_size; i += Lanes(df)) {
+      HWY_CAPPED(float, 1) d1;
+      size_t i = 0;
+      for (; i + Lanes(df) <= buf_size; i += Lanes(df)) {
         const auto val = Load(df, buf_src + i);
         const auto result = TF_SRGB().DisplayFromEncoded(val);
         Store(result, df, xform_src + i);
       }
+      for (; i < buf_size; ++i) {
+        const auto val = Load(d1, buf_src + i);
+        Store(TF_SRGB().DisplayFromEncoded(val), d1, xform_src + i);
+      }
 #if JXL_CMS_VERBOSE >= 2
       printf("pre in %.4f %.4f %.4f undoSRGB %.4f %.4f %.4f\n", buf_src[3 * kX],
              buf_src[3 * kX + 1], buf_src[3 * kX + 2], xform_src[3 * kX],
              xform_src[3 * kX + 1], xform_src[3 * kX + 2]);
 #endif
       break;
+    }
   }
   return true;
 }
 
 // Applies gamma compression in-place.
 Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
-  switch (t->postprocess) {
+  switch (t->transform->postprocess) {
     case ExtraTF::kNone:
       JXL_DASSERT(false);  // unreachable
       break;
@@ -172,7 +204,7 @@ Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
       break;
     }
     case ExtraTF::kHLG:
-      if (t->apply_hlg_ootf) {
+      if (t->transform->apply_hlg_ootf) {
         JXL_RETURN_IF_ERROR(
             ApplyHlgOotf(t, buf_dst, buf_size, /*forward=*/false));
       }
@@ -185,39 +217,86 @@ Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
              buf_dst[3 * kX + 1], buf_dst[3 * kX + 2]);
 #endif
       break;
-    case ExtraTF::kSRGB:
+    case ExtraTF::kSRGB: {
       HWY_FULL(float) df;
-      for (size_t i = 0; i < buf_size; i += Lanes(df)) {
+      HWY_CAPPED(float, 1) d1;
+      size_t i = 0;
+      for (; i + Lanes(df) <= buf_size; i += Lanes(df)) {
         const auto val = Load(df, buf_dst + i);
-        const auto result =
-            TF_SRGB().EncodedFromDisplay(HWY_FULL(float)(), val);
+        const auto result = TF_SRGB().EncodedFromDisplay(df, val);
         Store(result, df, buf_dst + i);
       }
+      for (; i < buf_size; ++i) {
+        const auto val = Load(d1, buf_dst + i);
+        Store(TF_SRGB().EncodedFromDisplay(d1, val), d1, buf_dst + i);
+      }
 #if JXL_CMS_VERBOSE >= 2
       printf("after SRGB enc %.4f %.4f %.4f\n", buf_dst[3 * kX],
              buf_dst[3 * kX + 1], buf_dst[3 * kX + 2]);
 #endif
       break;
+    }
   }
   return true;
 }
 
+// Converts xsize interleaved linear RGB pixels from xform_src to buf_dst, which
+// may be equal, with the matrix of the transform. The pixels are converted in
+// the planar rows of the thread, to multiply whole vectors of each channel.
+void ApplyMatrix(JxlCms* t, const size_t thread, const float* xform_src,
+                 float* buf_dst, size_t xsize) {
+  float* JXL_RESTRICT row0 = t->buf_planar.Row(3 * thread);
+  float* JXL_RESTRICT row1 = t->buf_planar.Row(3 * thread + 1);
+  float* JXL_RESTRICT row2 = t->buf_planar.Row(3 * thread + 2);
+  for (size_t x = 0; x < xsize; ++x) {
+    row0[x] = xform_src[3 * x];
+    row1[x] = xform_src[3 * x + 1];
+    row2[x] = xform_src[3 * x + 2];
+  }
+  const std::array<float, 9>& m = t->transform->matrix;
+  const HWY_FULL(float) df;
+  const auto m00 = Set(df, m[0]);
+  const auto m01 = Set(df, m[1]);
+  const auto m02 = Set(df, m[2]);
+  const auto m10 = Set(df, m[3]);
+  const auto m11 = Set(df, m[4]);
+  const auto m12 = Set(df, m[5]);
+  const auto m20 = Set(df, m[6]);
+  const auto m21 = Set(df, m[7]);
+  const auto m22 = Set(df, m[8]);
+  // The rows of an image are padded to a whole number of vectors.
+  for (size_t x = 0; x < xsize; x += Lanes(df)) {
+    const auto v0 = Load(df, row0 + x);
+    const auto v1 = Load(df, row1 + x);
+    const auto v2 = Load(df, row2 + x);
+    Store(MulAdd(m00, v0, MulAdd(m01, v1, m02 * v2)), df, row0 + x);
+    Store(MulAdd(m10, v0, MulAdd(m11, v1, m12 * v2)), df, row1 + x);
+    Store(MulAdd(m20, v0, MulAdd(m21, v1, m22 * v2)), df, row2 + x);
+  }
+  for (size_t x = 0; x < xsize; ++x) {
+    buf_dst[3 * x] = row0[x];
+    buf_dst[3 * x + 1] = row1[x];
+    buf_dst[3 * x + 2] = row2[x];
+  }
+}
+
 Status DoColorSpaceTransform(void* cms_data, const size_t thread,
                              const float* buf_src, float* buf_dst,
                              size_t xsize) {
   // No lock needed.
   JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
+  const JxlCmsTransform& transform = *t->transform;
 
   const float* xform_src = buf_src;  // Read-only.
-  if (t->preprocess != ExtraTF::kNone) {
+  if (transform.preprocess != ExtraTF::kNone) {
     float* mutable_xform_src = t->buf_src.Row(thread);  // Writable buffer.
     JXL_RETURN_IF_ERROR(BeforeTransform(t, buf_src, mutable_xform_src,
-                                        xsize * t->channels_src));
+                                        xsize * transform.channels_src));
     xform_src = mutable_xform_src;
   }
 
 #if JPEGXL_ENABLE_SKCMS
-  if (t->channels_src == 1 && !t->skip_lcms) {
+  if (transform.channels_src == 1 && !transform.skip_lcms) {
     // Expand from 1 to 3 channels, starting from the end in case
     // xform_src == t->buf_src.Row(thread).
     float* mutable_xform_src = t->buf_src.Row(thread);
@@ -229,7 +308,7 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
     xform_src = mutable_xform_src;
   }
 #else
-  if (t->channels_src == 4 && !t->skip_lcms) {
+  if (transform.channels_src == 4 && !transform.skip_lcms) {
     // LCMS does CMYK in a weird way: 0 = white, 100 = max ink
     float* mutable_xform_src = t->buf_src.Row(thread);
     for (size_t x = 0; x < xsize * 4; ++x) {
@@ -246,32 +325,35 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
   const float in2 = xform_src[3 * kX + 2];
 #endif
 
-  if (t->skip_lcms) {
-    if (buf_dst != xform_src) {
-      memcpy(buf_dst, xform_src, xsize * t->channels_src * sizeof(*buf_dst));
+  if (transform.skip_lcms) {
+    if (transform.apply_matrix) {
+      ApplyMatrix(t, thread, xform_src, buf_dst, xsize);
+    } else if (buf_dst != xform_src) {
+      memcpy(buf_dst, xform_src,
+             xsize * transform.channels_src * sizeof(*buf_dst));
     }  // else: in-place, no need to copy
   } else {
 #if JPEGXL_ENABLE_SKCMS
-    JXL_CHECK(
-        skcms_Transform(xform_src,
-                        (t->channels_src == 4 ? skcms_PixelFormat_RGBA_ffff
-                                              : skcms_PixelFormat_RGB_fff),
-                        skcms_AlphaFormat_Opaque, &t->profile_src, buf_dst,
-                        skcms_PixelFormat_RGB_fff, skcms_AlphaFormat_Opaque,
-                        &t->profile_dst, xsize));
+    JXL_CHECK(skcms_Transform(
+        xform_src,
+        (transform.channels_src == 4 ? skcms_PixelFormat_RGBA_ffff
+                                     : skcms_PixelFormat_RGB_fff),
+        skcms_AlphaFormat_Opaque, &transform.profile_src, buf_dst,
+        skcms_PixelFormat_RGB_fff, skcms_AlphaFormat_Opaque,
+        &transform.profile_dst, xsize));
 #else   // JPEGXL_ENABLE_SKCMS
-    cmsDoTransform(t->lcms_transform, xform_src, buf_dst,
+    cmsDoTransform(transform.lcms_transform, xform_src, buf_dst,
                    static_cast<cmsUInt32Number>(xsize));
 #endif  // JPEGXL_ENABLE_SKCMS
   }
 #if JXL_CMS_VERBOSE >= 2
   printf("xform skip%d: %.4f %.4f %.4f (%p) -> (%p) %.4f %.4f %.4f\n",
-         t->skip_lcms, in0, in1, in2, xform_src, buf_dst, buf_dst[3 * kX],
-         buf_dst[3 * kX + 1], buf_dst[3 * kX + 2]);
+         transform.skip_lcms, in0, in1, in2, xform_src, buf_dst,
+         buf_dst[3 * kX], buf_dst[3 * kX + 1], buf_dst[3 * kX + 2]);
 #endif
 
 #if JPEGXL_ENABLE_SKCMS
-  if (t->channels_dst == 1 && !t->skip_lcms) {
+  if (transform.channels_dst == 1 && !transform.skip_lcms) {
     // Contract back from 3 to 1 channel, this time forward.
     float* grayscale_buf_dst = t->buf_dst.Row(thread);
     for (size_t x = 0; x < xsize; ++x) {
@@ -281,8 +363,9 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
   }
 #endif
 
-  if (t->postprocess != ExtraTF::kNone) {
-    JXL_RETURN_IF_ERROR(AfterTransform(t, buf_dst, xsize * t->channels_dst));
+  if (transform.postprocess != ExtraTF::kNone) {
+    JXL_RETURN_IF_ERROR(
+        AfterTransform(t, buf_dst, xsize * transform.channels_dst));
   }
   return true;
 }
@@ -349,11 +432,6 @@ struct ProfileDeleter {
 };
 using Profile = std::unique_ptr<void, ProfileDeleter>;
 
-struct TransformDeleter {
-  void operator()(void* p) { cmsDeleteTransform(p); }
-};
-using Transform = std::unique_ptr<void, TransformDeleter>;
-
 struct CurveDeleter {
   void operator()(cmsToneCurve* p) { cmsFreeToneCurve(p); }
 };
@@ -760,7 +838,8 @@ Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
   float gamma = 1.2f * std::pow(1.111f, std::log2(t->intensity_target * 1e-3f));
   if (!forward) gamma = 1.f / gamma;
 
-  switch (t->hlg_ootf_num_channels) {
+  const std::array<float, 3>& luminances = t->transform->hlg_ootf_luminances;
+  switch (t->transform->hlg_ootf_num_channels) {
     case 1:
       for (size_t x = 0; x < xsize; ++x) {
         buf[x] = std::pow(buf[x], gamma);
@@ -769,9 +848,9 @@ Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
 
     case 3:
       for (size_t x = 0; x < xsize; x += 3) {
-        const float luminance = buf[x] * t->hlg_ootf_luminances[0] +
-                                buf[x + 1] * t->hlg_ootf_luminances[1] +
-                                buf[x + 2] * t->hlg_ootf_luminances[2];
+        const float luminance = buf[x] * luminances[0] +
+                                buf[x + 1] * luminances[1] +
+                                buf[x + 2] * luminances[2];
         const float ratio = std::pow(luminance, gamma - 1);
         if (std::isfinite(ratio)) {
           buf[x] *= ratio;
@@ -800,7 +879,7 @@ Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
 
     default:
       return JXL_FAILURE("HLG OOTF not implemented for %" PRIuS " channels",
-                         t->hlg_ootf_num_channels);
+                         t->transform->hlg_ootf_num_channels);
   }
   return true;
 }
@@ -906,16 +985,43 @@ namespace {
 void JxlCmsDestroy(void* cms_data) {
   if (cms_data == nullptr) return;
   JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
-#if !JPEGXL_ENABLE_SKCMS
-  TransformDeleter()(t->lcms_transform);
-#endif
   delete t;
 }
 
-void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
-                 const JxlColorProfile* input, const JxlColorProfile* output,
-                 float intensity_target) {
-  auto t = jxl::make_unique<JxlCms>();
+// Whether c is a matrix-based RGB profile described by its fields, with a
+// linear or sRGB transfer function, which BeforeTransform / AfterTransform
+// evaluate without the CMS.
+bool IsAnalyticRGB(const ColorEncoding& c) {
+  return !c.WantICC() && !c.IsCMYK() && c.GetColorSpace() == ColorSpace::kRGB &&
+         (c.tf.IsLinear() || c.tf.IsSRGB());
+}
+
+// Computes the matrix from c_src to c_dst linear RGB samples, through XYZ D50
+// as the ICC profiles created from these encodings do.
+Status LinearRGBMatrix(const ColorEncoding& c_src, const ColorEncoding& c_dst,
+                       std::array<float, 9>* matrix) {
+  const PrimariesCIExy p_src = c_src.GetPrimaries();
+  const CIExy w_src = c_src.GetWhitePoint();
+  float xyz_from_src[9];
+  JXL_RETURN_IF_ERROR(PrimariesToXYZD50(p_src.r.x, p_src.r.y, p_src.g.x,
+                                        p_src.g.y, p_src.b.x, p_src.b.y,
+                                        w_src.x, w_src.y, xyz_from_src));
+  const PrimariesCIExy p_dst = c_dst.GetPrimaries();
+  const CIExy w_dst = c_dst.GetWhitePoint();
+  float dst_from_xyz[9];
+  JXL_RETURN_IF_ERROR(PrimariesToXYZD50(p_dst.r.x, p_dst.r.y, p_dst.g.x,
+                                        p_dst.g.y, p_dst.b.x, p_dst.b.y,
+                                        w_dst.x, w_dst.y, dst_from_xyz));
+  JXL_RETURN_IF_ERROR(Inv3x3Matrix(dst_from_xyz));
+  MatMul(dst_from_xyz, xyz_from_src, 3, 3, 3, matrix->data());
+  return true;
+}
+
+// Prepares the transform from the input to the output profile, or returns
+// nullptr on error.
+std::shared_ptr<const JxlCmsTransform> CreateTransform(
+    const JxlColorProfile* input, const JxlColorProfile* output) {
+  auto t = std::make_shared<JxlCmsTransform>();
   PaddedBytes icc_src, icc_dst;
   icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
   ColorEncoding c_src;
@@ -934,11 +1040,14 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
 #endif
 
 #if JPEGXL_ENABLE_SKCMS
-  if (!DecodeProfile(input->icc.data, input->icc.size, &t->profile_src)) {
+  // The transform may outlive the profiles, decode copies of them.
+  t->icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
+  t->icc_dst.assign(output->icc.data, output->icc.data + output->icc.size);
+  if (!DecodeProfile(t->icc_src.data(), t->icc_src.size(), &t->profile_src)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: skcms failed to parse input ICC");
     return nullptr;
   }
-  if (!DecodeProfile(output->icc.data, output->icc.size, &t->profile_dst)) {
+  if (!DecodeProfile(t->icc_dst.data(), t->icc_dst.size(), &t->profile_dst)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: skcms failed to parse output ICC");
     return nullptr;
   }
@@ -1069,8 +1178,30 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
     t->skip_lcms = true;
   }
 
+  // Conversions between matrix-based profiles, the most common ones, only
+  // need the transfer functions and a matrix, which are all vectorized.
+  // Absolute colorimetric conversions are left to the CMS, as they do not
+  // adapt the white point.
+  if (!t->skip_lcms && IsAnalyticRGB(c_src) && IsAnalyticRGB(c_dst) &&
+      c_dst.rendering_intent != RenderingIntent::kAbsolute &&
+      LinearRGBMatrix(c_src, c_dst, &t->matrix)) {
+#if JXL_CMS_VERBOSE
+    printf("Matrix-based profiles, skipping CMS\n");
+#endif
+    if (c_src.tf.IsSRGB()) {
+      JXL_DASSERT(t->preprocess == ExtraTF::kNone);
+      t->preprocess = ExtraTF::kSRGB;
+    }
+    if (c_dst.tf.IsSRGB()) {
+      JXL_DASSERT(t->postprocess == ExtraTF::kNone);
+      t->postprocess = ExtraTF::kSRGB;
+    }
+    t->skip_lcms = true;
+    t->apply_matrix = true;
+  }
+
 #if JPEGXL_ENABLE_SKCMS
-  if (!skcms_MakeUsableAsDestination(&t->profile_dst)) {
+  if (!t->skip_lcms && !skcms_MakeUsableAsDestination(&t->profile_dst)) {
     JXL_NOTIFY_ERROR(
         "Failed to make %s usable as a color transform destination",
         Description(c_dst).c_str());
@@ -1084,28 +1215,134 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   JXL_CHECK(channels_src == channels_dst ||
             (channels_src == 4 && channels_dst == 3));
 #if JXL_CMS_VERBOSE
-  printf("Channels: %" PRIuS "; Threads: %" PRIuS "\n", channels_src,
-         num_threads);
+  printf("Channels: %" PRIuS "\n", channels_src);
 #endif
 
 #if !JPEGXL_ENABLE_SKCMS
-  // Type includes color space (XYZ vs RGB), so can be different.
-  const uint32_t type_src = Type32(c_src, channels_src == 4);
-  const uint32_t type_dst = Type32(c_dst, false);
-  const uint32_t intent = static_cast<uint32_t>(c_dst.rendering_intent);
-  // Use cmsFLAGS_NOCACHE to disable the 1-pixel cache and make calling
-  // cmsDoTransform() thread-safe.
-  const uint32_t flags = cmsFLAGS_NOCACHE | cmsFLAGS_BLACKPOINTCOMPENSATION |
-                         cmsFLAGS_HIGHRESPRECALC;
-  t->lcms_transform =
-      cmsCreateTransformTHR(context, profile_src.get(), type_src,
-                            profile_dst.get(), type_dst, intent, flags);
-  if (t->lcms_transform == nullptr) {
-    JXL_NOTIFY_ERROR("Failed to create transform");
-    return nullptr;
+  if (!t->skip_lcms) {
+    // Type includes color space (XYZ vs RGB), so can be different.
+    const uint32_t type_src = Type32(c_src, channels_src == 4);
+    const uint32_t type_dst = Type32(c_dst, false);
+    const uint32_t intent = static_cast<uint32_t>(c_dst.rendering_intent);
+    // Use cmsFLAGS_NOCACHE to disable the 1-pixel cache and make calling
+    // cmsDoTransform() thread-safe.
+    const uint32_t flags = cmsFLAGS_NOCACHE | cmsFLAGS_BLACKPOINTCOMPENSATION |
+                           cmsFLAGS_HIGHRESPRECALC;
+    t->lcms_transform =
+        cmsCreateTransformTHR(context, profile_src.get(), type_src,
+                              profile_dst.get(), type_dst, intent, flags);
+    if (t->lcms_transform == nullptr) {
+      JXL_NOTIFY_ERROR("Failed to create transform");
+      return nullptr;
+    }
   }
 #endif  // !JPEGXL_ENABLE_SKCMS
 
+  t->channels_src = channels_src;
+  t->channels_dst = channels_dst;
+  return t;
+}
+
+// Process-wide cache of the most recently used transforms, so that converting
+// many images between the same few pairs of profiles only prepares each
+// transform once. Transforms are keyed by the bytes of both ICC profiles, which
+// include the rendering intent, and are shared by all the threads.
+class JxlCmsTransformCache {
+ public:
+  // Never destroyed, so that it can be used until the process exits.
+  static JxlCmsTransformCache* Get() {
+    static JxlCmsTransformCache* cache = new JxlCmsTransformCache();
+    return cache;
+  }
+
+  // Returns the cached transform from input to output, creating and caching
+  // it first if needed, or nullptr on error.
+  std::shared_ptr<const JxlCmsTransform> GetOrCreate(
+      const JxlColorProfile* input, const JxlColorProfile* output) {
+    const uint64_t hash =
+        Hash(input->icc.data, input->icc.size,
+             Hash(output->icc.data, output->icc.size, kHashSeed));
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = Find(hash, input, output);
+      if (it != entries_.end()) {
+        // Move the entry to the front, as the most recently used.
+        entries_.splice(entries_.begin(), entries_, it);
+        return it->transform;
+      }
+    }
+    // Other threads may use the cache while the transform is created, at the
+    // risk of creating the same transform more than once.
+    std::shared_ptr<const JxlCmsTransform> transform =
+        CreateTransform(input, output);
+    if (transform == nullptr) return nullptr;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (Find(hash, input, output) == entries_.end()) {
+      Entry entry;
+      entry.hash = hash;
+      entry.icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
+      entry.icc_dst.assign(output->icc.data,
+                           output->icc.data + output->icc.size);
+      entry.transform = transform;
+      entries_.push_front(std::move(entry));
+      if (entries_.size() > kCapacity) entries_.pop_back();
+    }
+    return transform;
+  }
+
+ private:
+  // Number of transforms kept, enough for the few pairs of profiles that are
+  // usually involved.
+  static constexpr size_t kCapacity = 16;
+  static constexpr uint64_t kHashSeed = 0xcbf29ce484222325ull;
+
+  struct Entry {
+    uint64_t hash;
+    std::vector<uint8_t> icc_src;
+    std::vector<uint8_t> icc_dst;
+    std::shared_ptr<const JxlCmsTransform> transform;
+  };
+  using Entries = std::list<Entry>;
+
+  // FNV-1a hash of the size bytes from data on, starting from hash.
+  static uint64_t Hash(const uint8_t* data, size_t size, uint64_t hash) {
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+  }
+
+  static bool Equals(const std::vector<uint8_t>& bytes, const uint8_t* data,
+                     size_t size) {
+    return bytes.size() == size &&
+           (size == 0 || memcmp(bytes.data(), data, size) == 0);
+  }
+
+  Entries::iterator Find(uint64_t hash, const JxlColorProfile* input,
+                         const JxlColorProfile* output) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->hash == hash &&
+          Equals(it->icc_src, input->icc.data, input->icc.size) &&
+          Equals(it->icc_dst, output->icc.data, output->icc.size)) {
+        return it;
+      }
+    }
+    return entries_.end();
+  }
+
+  std::mutex mutex_;
+  // Most recently used first.
+  Entries entries_;
+};
+
+void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
+                 const JxlColorProfile* input, const JxlColorProfile* output,
+                 float intensity_target) {
+  auto t = jxl::make_unique<JxlCms>();
+  t->transform = JxlCmsTransformCache::Get()->GetOrCreate(input, output);
+  if (t->transform == nullptr) return nullptr;
+  const JxlCmsTransform& transform = *t->transform;
+
   // Ideally LCMS would convert directly from External to Image3. However,
   // cmsDoTransformLineStride only accepts 32-bit BytesPerPlaneIn, whereas our
   // planes can be more than 4 GiB apart. Hence, transform inputs/outputs must
@@ -1114,17 +1351,19 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   // buffers. To avoid separate allocations, we use the rows of an image.
   // Because LCMS apparently also cannot handle <= 16 bit inputs and 32-bit
   // outputs (or vice versa), we use floating point input/output.
-  t->channels_src = channels_src;
-  t->channels_dst = channels_dst;
 #if JPEGXL_ENABLE_SKCMS
   // SkiaCMS doesn't support grayscale float buffers, so we create space for RGB
   // float buffers anyway.
-  t->buf_src = ImageF(xsize * (channels_src == 4 ? 4 : 3), num_threads);
+  t->buf_src =
+      ImageF(xsize * (transform.channels_src == 4 ? 4 : 3), num_threads);
   t->buf_dst = ImageF(xsize * 3, num_threads);
 #else
-  t->buf_src = ImageF(xsize * channels_src, num_threads);
-  t->buf_dst = ImageF(xsize * channels_dst, num_threads);
+  t->buf_src = ImageF(xsize * transform.channels_src, num_threads);
+  t->buf_dst = ImageF(xsize * transform.channels_dst, num_threads);
 #endif
+  if (transform.apply_matrix) {
+    t->buf_planar = ImageF(xsize, 3 * num_threads);
+  }
   t->intensity_target = intensity_target;
   return t.release();
 }
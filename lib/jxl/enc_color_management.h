@@ -74,6 +74,14 @@ class ColorSpaceTransform {
     return cms_.run(cms_data_, thread, buf_src, buf_dst, xsize_);
   }
 
+  // Converts the first xsize pixels of the buffers, for callers that fill
+  // them with less than the xsize passed to Init, e.g. the last of a batch.
+  Status Run(const size_t thread, const float* buf_src, float* buf_dst,
+             size_t xsize) {
+    JXL_DASSERT(xsize <= xsize_);
+    return cms_.run(cms_data_, thread, buf_src, buf_dst, xsize);
+  }
+
  private:
   JxlCmsInterface cms_;
   void* cms_data_ = nullptr;
@@ -60,16 +60,6 @@ const Image3F* AlphaBlend(const ImageBundle& ib, const Image3F& linear,
   return copy;
 }
 
-void AlphaBlend(float background_linear, ImageBundle* io_linear_srgb) {
-  // No alpha => all opaque.
-  if (!io_linear_srgb->HasAlpha()) return;
-
-  for (size_t c = 0; c < 3; ++c) {
-    AlphaBlend(*io_linear_srgb->color(), c, background_linear,
-               *io_linear_srgb->alpha(), io_linear_srgb->color());
-  }
-}
-
 float ComputeScoreImpl(const ImageBundle& rgb0, const ImageBundle& rgb1,
                        Comparator* comparator, ImageF* distmap) {
   JXL_CHECK(comparator->SetReferenceImage(rgb0));
@@ -80,6 +70,16 @@ float ComputeScoreImpl(const ImageBundle& rgb0, const ImageBundle& rgb1,
 
 }  // namespace
 
+void AlphaBlend(float background_linear, ImageBundle* io_linear_srgb) {
+  // No alpha => all opaque.
+  if (!io_linear_srgb->HasAlpha()) return;
+
+  for (size_t c = 0; c < 3; ++c) {
+    AlphaBlend(*io_linear_srgb->color(), c, background_linear,
+               *io_linear_srgb->alpha(), io_linear_srgb->color());
+  }
+}
+
 float ComputeScore(const ImageBundle& rgb0, const ImageBundle& rgb1,
                    Comparator* comparator, const JxlCmsInterface& cms,
                    ImageF* diffmap, ThreadPool* pool) {
@@ -41,6 +41,10 @@ class Comparator {
   virtual float BadQualityScore() const = 0;
 };
 
+// Blends the linear sRGB image, if it has alpha, on a gray background of the
+// given linear intensity, like ComputeScore does before the comparisons.
+void AlphaBlend(float background_linear, ImageBundle* io_linear_srgb);
+
 // Computes the score given images in any RGB color model, optionally with
 // alpha channel.
 float ComputeScore(const ImageBundle& rgb0, const ImageBundle& rgb1,
@@ -0,0 +1,158 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_content_classifier.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+#include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/common.h"
+
+namespace jxl {
+
+namespace {
+
+// Bands of kTileDim rows are sampled so that about this many pixels are
+// analyzed.
+constexpr size_t kMaxSampledPixels = 1 << 20;
+constexpr size_t kTileDim = 8;
+// Bounds the memory of the repeated tile search.
+constexpr size_t kMaxTileHashes = 1 << 16;
+
+constexpr int kSmoothDiff = 8;
+constexpr int kEdgeDiff = 48;
+
+// Few colors: at most the palette limit, and at least this many pixels per
+// color, so that small photographs are not mistaken for palette images.
+constexpr size_t kMinPixelsPerColor = 16;
+// Screen content: at least this fraction of flat differences or of repeated
+// tiles.
+constexpr float kMinFlat = 0.3f;
+constexpr float kMinRepeatedTiles = 0.05f;
+
+uint32_t QuantizedColor(const Image3F& color, size_t x, size_t y) {
+  uint32_t packed = 0;
+  for (size_t c = 0; c < 3; c++) {
+    const float v = color.ConstPlaneRow(c, y)[x];
+    const float clamped = std::min(std::max(v, 0.0f), 1.0f);
+    packed |= static_cast<uint32_t>(clamped * 255.0f + 0.5f) << (8 * c);
+  }
+  return packed;
+}
+
+int MaxChannelDiff(uint32_t a, uint32_t b) {
+  int diff = 0;
+  for (size_t c = 0; c < 3; c++) {
+    const int va = (a >> (8 * c)) & 0xFF;
+    const int vb = (b >> (8 * c)) & 0xFF;
+    diff = std::max(diff, abs(va - vb));
+  }
+  return diff;
+}
+
+float Clamp01(float v) { return std::min(std::max(v, 0.0f), 1.0f); }
+
+}  // namespace
+
+ContentClassification ClassifyContent(const ImageBundle& ib,
+                                      size_t max_palette_colors) {
+  const Image3F& color = ib.color();
+  const size_t xsize = color.xsize();
+  const size_t ysize = color.ysize();
+  const size_t num_bands = DivCeil(ysize, kTileDim);
+  const size_t band_pixels = xsize * kTileDim;
+  const size_t band_step = std::max<size_t>(
+      1, DivCeil(num_bands * band_pixels, kMaxSampledPixels));
+
+  ContentStats stats;
+  std::unordered_set<uint32_t> colors;
+  std::unordered_set<uint64_t> tile_hashes;
+  size_t num_diffs = 0, num_flat = 0, num_smooth = 0, num_edges = 0;
+  size_t num_tiles = 0, num_repeated = 0;
+  std::vector<uint32_t> band(band_pixels);
+  for (size_t b = 0; b < num_bands; b += band_step) {
+    const size_t y0 = b * kTileDim;
+    const size_t rows = std::min(kTileDim, ysize - y0);
+    for (size_t iy = 0; iy < rows; iy++) {
+      uint32_t* JXL_RESTRICT row = band.data() + iy * xsize;
+      for (size_t x = 0; x < xsize; x++) {
+        row[x] = QuantizedColor(color, x, y0 + iy);
+        if (colors.size() <= max_palette_colors) colors.insert(row[x]);
+        const auto add_diff = [&](uint32_t neighbour) {
+          const int diff = MaxChannelDiff(row[x], neighbour);
+          num_diffs++;
+          if (diff == 0) {
+            num_flat++;
+          } else if (diff <= kSmoothDiff) {
+            num_smooth++;
+          } else if (diff > kEdgeDiff) {
+            num_edges++;
+          }
+        };
+        if (x > 0) add_diff(row[x - 1]);
+        if (iy > 0) add_diff(row[x - xsize]);
+      }
+    }
+    stats.num_pixels += rows * xsize;
+    if (rows < kTileDim) continue;
+    for (size_t x0 = 0; x0 + kTileDim <= xsize; x0 += kTileDim) {
+      uint64_t hash = 0xcbf29ce484222325ull;
+      bool constant = true;
+      for (size_t iy = 0; iy < kTileDim; iy++) {
+        const uint32_t* row = band.data() + iy * xsize + x0;
+        for (size_t ix = 0; ix < kTileDim; ix++) {
+          constant &= row[ix] == band[x0];
+          hash = (hash ^ row[ix]) * 0x100000001b3ull;
+        }
+      }
+      if (constant) continue;
+      num_tiles++;
+      if (tile_hashes.count(hash)) {
+        num_repeated++;
+      } else if (tile_hashes.size() < kMaxTileHashes) {
+        tile_hashes.insert(hash);
+      }
+    }
+  }
+
+  stats.num_colors = colors.size();
+  if (num_diffs != 0) {
+    stats.flat = static_cast<float>(num_flat) / num_diffs;
+    stats.smooth = static_cast<float>(num_smooth) / num_diffs;
+    stats.edges = static_cast<float>(num_edges) / num_diffs;
+  }
+  if (num_tiles != 0) {
+    stats.repeated_tiles = static_cast<float>(num_repeated) / num_tiles;
+  }
+
+  ContentClassification result;
+  result.stats = stats;
+  if (stats.num_colors <= max_palette_colors &&
+      stats.num_colors * kMinPixelsPerColor <= stats.num_pixels) {
+    result.content_class = ContentClass::kFewColors;
+    result.confidence =
+        1.0f - 0.5f * stats.num_colors / (max_palette_colors + 1);
+  } else if (stats.flat >= kMinFlat ||
+             stats.repeated_tiles >= kMinRepeatedTiles) {
+    result.content_class = ContentClass::kScreenContent;
+    const float margin = std::max((stats.flat - kMinFlat) / kMinFlat,
+                                  (stats.repeated_tiles - kMinRepeatedTiles) /
+                                      kMinRepeatedTiles);
+    result.confidence = 0.5f + 0.5f * Clamp01(margin);
+  } else {
+    result.content_class = ContentClass::kPhoto;
+    const float margin = std::min((kMinFlat - stats.flat) / kMinFlat,
+                                  (kMinRepeatedTiles - stats.repeated_tiles) /
+                                      kMinRepeatedTiles);
+    result.confidence = 0.5f + 0.5f * Clamp01(margin);
+  }
+  return result;
+}
+
+}  // namespace jxl
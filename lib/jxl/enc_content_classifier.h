@@ -0,0 +1,65 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_CONTENT_CLASSIFIER_H_
+#define LIB_JXL_ENC_CONTENT_CLASSIFIER_H_
+
+// Quick analysis of the pixels of a frame to choose how to encode it, see
+// CompressParams::classify_content, instead of encoding it in several ways
+// and keeping the smallest result.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/jxl/image_bundle.h"
+
+namespace jxl {
+
+enum class ContentClass : uint32_t {
+  // Natural images such as photographs: VarDCT, without searching for
+  // patches.
+  kPhoto,
+  // Many colors but large flat areas or repeated tiles, such as screenshots
+  // and text over a flat background: VarDCT with patches.
+  kScreenContent,
+  // Few colors compared to the number of pixels, such as diagrams, logos and
+  // pixel art: modular, whose palette transform represents them exactly.
+  kFewColors,
+};
+
+// Statistics of the sampled pixels, quantized to 8 bits per channel.
+struct ContentStats {
+  size_t num_pixels = 0;
+  // Number of distinct colors, counted up to one more than the palette limit
+  // passed to ClassifyContent.
+  size_t num_colors = 0;
+  // Fractions of the differences with the left and top neighbours (maximum
+  // over the channels) that are zero, small (at most 8) and large (more than
+  // 48).
+  float flat = 0.0f;
+  float smooth = 0.0f;
+  float edges = 0.0f;
+  // Fraction of the non-constant 8x8 tiles that are identical to another tile
+  // seen before.
+  float repeated_tiles = 0.0f;
+};
+
+struct ContentClassification {
+  ContentClass content_class = ContentClass::kPhoto;
+  // How clearly the statistics are on that side of the thresholds, in
+  // [0.5, 1].
+  float confidence = 0.0f;
+  ContentStats stats;
+};
+
+// Classifies the color channels of `ib`, sampling bands of rows of large
+// images. `max_palette_colors` is the number of colors up to which modular
+// mode would use a palette. Costs far less than the encoding itself.
+ContentClassification ClassifyContent(const ImageBundle& ib,
+                                      size_t max_palette_colors);
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_ENC_CONTENT_CLASSIFIER_H_
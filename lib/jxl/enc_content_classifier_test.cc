@@ -0,0 +1,122 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_content_classifier.h"
+
+#include <math.h>
+
+#include <utility>
+
+#include "gtest/gtest.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/color_encoding_internal.h"
+#include "lib/jxl/image_metadata.h"
+
+namespace jxl {
+namespace {
+
+constexpr size_t kPaletteColors = 1 << 10;
+
+// Smooth variations with a little noise, as in photographs.
+Image3F PhotoImage(size_t xsize, size_t ysize) {
+  Rng rng(0);
+  Image3F image(xsize, ysize);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < ysize; y++) {
+      float* JXL_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; x++) {
+        row[x] = 0.5f + 0.3f * sinf(x / (17.0f + c)) * cosf(y / 23.0f) +
+                 rng.UniformF(-0.03f, 0.03f);
+      }
+    }
+  }
+  return image;
+}
+
+ContentClassification Classify(Image3F&& image) {
+  ImageMetadata metadata;
+  ImageBundle ib(&metadata);
+  ib.SetFromImage(std::move(image), ColorEncoding::SRGB());
+  return ClassifyContent(ib, kPaletteColors);
+}
+
+TEST(EncContentClassifierTest, Photo) {
+  const ContentClassification result = Classify(PhotoImage(256, 256));
+  EXPECT_EQ(ContentClass::kPhoto, result.content_class);
+  EXPECT_EQ(256u * 256u, result.stats.num_pixels);
+  EXPECT_EQ(kPaletteColors + 1, result.stats.num_colors);
+  EXPECT_LT(result.stats.flat, 0.3f);
+  EXPECT_GE(result.confidence, 0.5f);
+  EXPECT_LE(result.confidence, 1.0f);
+}
+
+TEST(EncContentClassifierTest, FewColors) {
+  Image3F image(256, 256);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < image.ysize(); y++) {
+      float* JXL_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < image.xsize(); x++) {
+        const size_t index = ((x / 16) + (y / 16) * (c + 1)) % 4;
+        row[x] = index / 3.0f;
+      }
+    }
+  }
+  const ContentClassification result = Classify(std::move(image));
+  EXPECT_EQ(ContentClass::kFewColors, result.content_class);
+  EXPECT_LE(result.stats.num_colors, 64u);
+  EXPECT_GT(result.confidence, 0.9f);
+}
+
+TEST(EncContentClassifierTest, ScreenContent) {
+  // A photograph in a window over a flat background.
+  Image3F image = PhotoImage(256, 256);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < image.ysize(); y++) {
+      float* JXL_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < image.xsize() / 2; x++) row[x] = 1.0f;
+    }
+  }
+  const ContentClassification result = Classify(std::move(image));
+  EXPECT_EQ(ContentClass::kScreenContent, result.content_class);
+  EXPECT_GE(result.stats.flat, 0.3f);
+}
+
+TEST(EncContentClassifierTest, RepeatedTiles) {
+  // The same glyphs, with many colors each, over a noisy background.
+  Rng rng(1);
+  Image3F glyphs(64, 8);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < glyphs.ysize(); y++) {
+      float* JXL_RESTRICT row = glyphs.PlaneRow(c, y);
+      for (size_t x = 0; x < glyphs.xsize(); x++) row[x] = rng.UniformF(0, 1);
+    }
+  }
+  Image3F image = PhotoImage(256, 256);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < image.ysize(); y += 32) {
+      for (size_t iy = 0; iy < glyphs.ysize(); iy++) {
+        float* JXL_RESTRICT row = image.PlaneRow(c, y + iy);
+        const float* JXL_RESTRICT glyph_row = glyphs.ConstPlaneRow(c, iy);
+        for (size_t x = 0; x < image.xsize(); x++) {
+          row[x] = glyph_row[x % glyphs.xsize()];
+        }
+      }
+    }
+  }
+  const ContentClassification result = Classify(std::move(image));
+  EXPECT_EQ(ContentClass::kScreenContent, result.content_class);
+  EXPECT_LT(result.stats.flat, 0.3f);
+  EXPECT_GE(result.stats.repeated_tiles, 0.05f);
+}
+
+TEST(EncContentClassifierTest, SamplesLargeImages) {
+  const ContentClassification result = Classify(PhotoImage(2048, 2048));
+  EXPECT_EQ(ContentClass::kPhoto, result.content_class);
+  EXPECT_LE(result.stats.num_pixels, 1u << 20);
+  EXPECT_GE(result.stats.num_pixels, 1u << 19);
+}
+
+}  // namespace
+}  // namespace jxl
@@ -0,0 +1,89 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_deadline.h"
+
+#include <algorithm>
+
+namespace jxl {
+
+namespace {
+
+// Approximate single-core cost of each stage, in nanoseconds per pixel of the
+// frame. Only their ratios matter once a stage has been timed.
+double NominalNanosecondsPerPixel(EncoderDeadline::Stage stage,
+                                  SpeedTier speed_tier) {
+  switch (stage) {
+    case EncoderDeadline::kColorTransform:
+      return 10.0;
+    case EncoderDeadline::kPatches:
+      return 60.0;
+    case EncoderDeadline::kAcStrategy:
+      if (speed_tier <= SpeedTier::kSquirrel) return 450.0;
+      if (speed_tier <= SpeedTier::kWombat) return 300.0;
+      if (speed_tier <= SpeedTier::kHare) return 150.0;
+      if (speed_tier <= SpeedTier::kCheetah) return 50.0;
+      return 15.0;
+    case EncoderDeadline::kButteraugliIteration:
+      return 400.0;
+    case EncoderDeadline::kTreeLearning:
+      return 250.0;
+    case EncoderDeadline::kEntropyCoding:
+      return 100.0;
+  }
+  return 0.0;
+}
+
+}  // namespace
+
+EncoderDeadline::EncoderDeadline(double seconds)
+    : start_(std::chrono::steady_clock::now()), budget_seconds_(seconds) {}
+
+double EncoderDeadline::ElapsedSeconds() const {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start_)
+      .count();
+}
+
+void EncoderDeadline::Done(Stage stage, size_t pixels, SpeedTier speed_tier) {
+  nominal_done_seconds_ +=
+      NominalNanosecondsPerPixel(stage, speed_tier) * 1e-9 * pixels;
+}
+
+double EncoderDeadline::Slowdown() const {
+  if (nominal_done_seconds_ <= 0.0) return 1.0;
+  // Bounded so that one badly timed stage, e.g. one that waited for the
+  // thread pool to start, does not skew all the later decisions.
+  return std::min(std::max(ElapsedSeconds() / nominal_done_seconds_, 0.01),
+                  100.0);
+}
+
+double EncoderDeadline::EstimatedSeconds(Stage stage, size_t pixels,
+                                         SpeedTier speed_tier) const {
+  return NominalNanosecondsPerPixel(stage, speed_tier) * 1e-9 * pixels *
+         Slowdown();
+}
+
+double EncoderDeadline::AvailableSeconds(size_t pixels) const {
+  return budget_seconds_ - ElapsedSeconds() -
+         EstimatedSeconds(kEntropyCoding, pixels);
+}
+
+SpeedTier EncoderDeadline::AcStrategySpeedTier(SpeedTier speed_tier,
+                                               size_t pixels) const {
+  const double available = AvailableSeconds(pixels);
+  if (EstimatedSeconds(kAcStrategy, pixels, speed_tier) <= available) {
+    return speed_tier;
+  }
+  const SpeedTier kTiers[] = {SpeedTier::kWombat, SpeedTier::kHare,
+                              SpeedTier::kCheetah};
+  for (SpeedTier tier : kTiers) {
+    if (tier <= speed_tier) continue;
+    if (EstimatedSeconds(kAcStrategy, pixels, tier) <= available) return tier;
+  }
+  return std::max(speed_tier, SpeedTier::kFalcon);
+}
+
+}  // namespace jxl
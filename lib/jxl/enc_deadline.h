@@ -0,0 +1,84 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_DEADLINE_H_
+#define LIB_JXL_ENC_DEADLINE_H_
+
+// Wall-clock budget for encoding a frame, see
+// JXL_ENC_FRAME_SETTING_TIME_BUDGET.
+
+#include <stddef.h>
+
+#include <chrono>
+
+#include "lib/jxl/enc_params.h"
+
+namespace jxl {
+
+// The optional stages of the encoder check the remaining budget before they
+// start and lower their effort, or are skipped, if their estimated time does
+// not fit. The estimates are nominal single-core costs per pixel, scaled by
+// how long the stages done so far took compared to their own nominal cost, so
+// that they adapt to the machine and the number of threads.
+//
+// Some time is always kept for the entropy coding and writing of the frame,
+// which cannot be skipped. The budget is therefore only exceeded if the
+// mandatory stages alone do not fit.
+//
+// Not thread-safe: only used by the thread that calls EncodeFrame.
+class EncoderDeadline {
+ public:
+  enum Stage {
+    kColorTransform,
+    kPatches,
+    // The block-level heuristics: AC strategy, chroma from luma and the
+    // adaptive reconstruction field. Their cost depends on the speed tier.
+    kAcStrategy,
+    kButteraugliIteration,
+    // At the default ModularOptions::nb_repeats.
+    kTreeLearning,
+    // Tokenization, entropy coding and writing of the frame, always done.
+    kEntropyCoding,
+  };
+
+  // Starts a budget of `seconds` now.
+  explicit EncoderDeadline(double seconds);
+
+  double ElapsedSeconds() const;
+
+  // Records that `stage` ran on `pixels` pixels at `speed_tier`, which
+  // calibrates the estimates of the later stages.
+  void Done(Stage stage, size_t pixels,
+            SpeedTier speed_tier = SpeedTier::kSquirrel);
+
+  double EstimatedSeconds(Stage stage, size_t pixels,
+                          SpeedTier speed_tier = SpeedTier::kSquirrel) const;
+
+  // Seconds left for optional stages after keeping the time of the entropy
+  // coding of a frame of `pixels` pixels. Can be negative.
+  double AvailableSeconds(size_t pixels) const;
+
+  bool HasTimeFor(Stage stage, size_t pixels,
+                  SpeedTier speed_tier = SpeedTier::kSquirrel) const {
+    return EstimatedSeconds(stage, pixels, speed_tier) <=
+           AvailableSeconds(pixels);
+  }
+
+  // Returns the slowest speed tier, not slower than `speed_tier`, whose block
+  // heuristics fit in the budget, or kFalcon if none does.
+  SpeedTier AcStrategySpeedTier(SpeedTier speed_tier, size_t pixels) const;
+
+ private:
+  // Ratio of the elapsed time to the nominal cost of the stages done so far.
+  double Slowdown() const;
+
+  std::chrono::steady_clock::time_point start_;
+  double budget_seconds_;
+  double nominal_done_seconds_ = 0.0;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_ENC_DEADLINE_H_
@@ -0,0 +1,176 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_decode_cost.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "lib/jxl/common.h"
+#include "lib/jxl/image_metadata.h"
+#include "lib/jxl/phase_counters.h"
+
+namespace jxl {
+
+static_assert(DecodeCost::kNumStages == EncoderCounters::kNumDecodeStages,
+              "EncoderCounters must have a counter per stage");
+
+namespace {
+
+// Costs in cycles, per bit of the encoding or per pixel, and per channel for
+// the modular and upsampling ones. Measured roughly on the stages of the
+// render pipeline; the ratios between them matter more than their values.
+constexpr float kCyclesPerBit = 6.0f;
+constexpr float kModularSampleCycles = 12.0f;
+constexpr float kModularTransformCycles = 3.0f;
+constexpr float kVarDCTCycles = 20.0f;
+// Merging the coefficients of each additional pass.
+constexpr float kPassCycles = 2.0f;
+constexpr float kGaborishCycles = 6.0f;
+// Per EPF iteration, starting from the last one, which runs for any
+// epf_iters > 0.
+constexpr float kEPFCycles[3] = {6.0f, 12.0f, 14.0f};
+constexpr float kPatchesCycles = 3.0f;
+constexpr float kSplinesCycles = 8.0f;
+constexpr float kNoiseCycles = 10.0f;
+// Per output sample, for the upsampling by 2, 4 and 8.
+constexpr float kUpsamplingCycles[3] = {3.5f, 4.0f, 4.5f};
+constexpr float kXYBCycles = 5.0f;
+constexpr float kYCbCrCycles = 2.0f;
+constexpr float kBlendingCycles = 1.0f;
+
+// Predicted sizes of frames, in bits per pixel of the color channels. Lossy
+// ones are fitted to photographs at distances 1 to 8.
+constexpr float kLosslessBitsPerPixel = 12.0f;
+constexpr float kLossyBitsPerPixel = 1.8f;
+constexpr float kLossyBitsExponent = -0.8f;
+
+float UpsamplingCycles(size_t upsampling) {
+  if (upsampling <= 1) return 0.0f;
+  return kUpsamplingCycles[upsampling == 2 ? 0 : upsampling == 4 ? 1 : 2];
+}
+
+}  // namespace
+
+DecodeCost EstimateDecodeCost(const FrameHeader& frame_header,
+                              size_t num_bits) {
+  DecodeCost cost;
+  const FrameDimensions frame_dim = frame_header.ToFrameDimensions();
+  const float num_pixels = static_cast<float>(frame_dim.xsize_upsampled) *
+                           frame_dim.ysize_upsampled;
+  if (num_pixels == 0) return cost;
+  // Fraction of the decoded pixels that are coded before upsampling.
+  const float coded = static_cast<float>(frame_dim.xsize) * frame_dim.ysize /
+                      num_pixels;
+  const bool xyb = frame_header.color_transform == ColorTransform::kXYB;
+  const ImageMetadata* metadata =
+      frame_header.nonserialized_metadata != nullptr
+          ? &frame_header.nonserialized_metadata->m
+          : nullptr;
+  const size_t num_color =
+      metadata != nullptr && metadata->color_encoding.IsGray() && !xyb ? 1 : 3;
+  const size_t num_extra =
+      metadata != nullptr ? metadata->num_extra_channels : 0;
+  float* JXL_RESTRICT cycles = cost.cycles_per_pixel;
+
+  // Extra channels are always modular.
+  float extra_samples = 0.0f;
+  float extra_upsampling = 0.0f;
+  for (size_t i = 0; i < num_extra; i++) {
+    const size_t ups = i < frame_header.extra_channel_upsampling.size()
+                           ? frame_header.extra_channel_upsampling[i]
+                           : 1;
+    extra_samples += 1.0f / (ups * ups);
+    extra_upsampling += UpsamplingCycles(ups);
+  }
+  float modular_samples = extra_samples;
+  if (frame_header.encoding == FrameEncoding::kModular) {
+    modular_samples += num_color * coded;
+  } else {
+    cycles[DecodeCost::kTransform] += kVarDCTCycles * coded;
+    cycles[DecodeCost::kEntropy] +=
+        kPassCycles * coded * (frame_header.passes.num_passes - 1);
+  }
+  cycles[DecodeCost::kEntropy] +=
+      kCyclesPerBit * num_bits / num_pixels +
+      kModularSampleCycles * modular_samples;
+  cycles[DecodeCost::kTransform] += kModularTransformCycles * modular_samples;
+
+  if (frame_header.loop_filter.gab) {
+    cycles[DecodeCost::kGaborish] = kGaborishCycles * coded;
+  }
+  const size_t epf_iters = std::min<size_t>(frame_header.loop_filter.epf_iters,
+                                            3);
+  for (size_t i = 0; i < epf_iters; i++) {
+    cycles[DecodeCost::kEPF] += kEPFCycles[i] * coded;
+  }
+
+  if (frame_header.flags & FrameHeader::kPatches) {
+    cycles[DecodeCost::kPatches] = kPatchesCycles;
+  }
+  if (frame_header.flags & FrameHeader::kSplines) {
+    cycles[DecodeCost::kSplines] = kSplinesCycles;
+  }
+  if (frame_header.flags & FrameHeader::kNoise) {
+    cycles[DecodeCost::kNoise] = kNoiseCycles;
+  }
+
+  cycles[DecodeCost::kUpsampling] =
+      num_color * UpsamplingCycles(frame_header.upsampling) + extra_upsampling;
+
+  if (xyb) {
+    cycles[DecodeCost::kColor] = kXYBCycles;
+  } else if (frame_header.color_transform == ColorTransform::kYCbCr) {
+    cycles[DecodeCost::kColor] = kYCbCrCycles;
+  }
+  if (frame_header.blending_info.mode != BlendMode::kReplace) {
+    cycles[DecodeCost::kColor] += kBlendingCycles * (num_color + num_extra);
+  }
+  return cost;
+}
+
+DecodeCost PredictDecodeCost(const CompressParams& cparams,
+                             const FrameHeader& frame_header) {
+  FrameHeader predicted = frame_header;
+  if (cparams.patches != Override::kOff) {
+    predicted.flags |= FrameHeader::kPatches;
+  }
+  const FrameDimensions frame_dim = frame_header.ToFrameDimensions();
+  const float bits_per_pixel =
+      cparams.butteraugli_distance == 0.0f
+          ? kLosslessBitsPerPixel
+          : kLossyBitsPerPixel *
+                std::pow(cparams.butteraugli_distance, kLossyBitsExponent);
+  const size_t num_bits = static_cast<size_t>(
+      bits_per_pixel * frame_dim.xsize * frame_dim.ysize);
+  return EstimateDecodeCost(predicted, num_bits);
+}
+
+bool ReduceDecodeCost(const FrameHeader& frame_header,
+                      CompressParams* cparams) {
+  const LoopFilter& loop_filter = frame_header.loop_filter;
+  if (loop_filter.epf_iters > 2) {
+    cparams->epf = 2;
+  } else if (frame_header.flags & FrameHeader::kNoise) {
+    cparams->noise = Override::kOff;
+    cparams->photon_noise_iso = 0;
+    cparams->manual_noise.clear();
+  } else if (loop_filter.epf_iters == 2) {
+    cparams->epf = 1;
+  } else if (loop_filter.gab) {
+    cparams->gaborish = Override::kOff;
+  } else if (loop_filter.epf_iters == 1) {
+    cparams->epf = 0;
+  } else if (cparams->patches != Override::kOff) {
+    cparams->patches = Override::kOff;
+  } else if (cparams->decoding_speed_tier < 4) {
+    cparams->decoding_speed_tier = 4;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace jxl
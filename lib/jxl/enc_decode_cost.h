@@ -0,0 +1,69 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_DECODE_COST_H_
+#define LIB_JXL_ENC_DECODE_COST_H_
+
+// Estimate of the cost of decoding a frame, from the decoding tools its header
+// enables and its size, see JxlEncoderDecodeCost. Also used to keep frames
+// within CompressParams::max_decode_cycles.
+
+#include <stddef.h>
+
+#include "lib/jxl/enc_params.h"
+#include "lib/jxl/frame_header.h"
+
+namespace jxl {
+
+// Estimated cost of decoding a frame, per stage of the decoder.
+struct DecodeCost {
+  // Same order as JxlEncoderDecodeStage.
+  enum Stage {
+    kEntropy,
+    kTransform,
+    kGaborish,
+    kEPF,
+    kPatches,
+    kSplines,
+    kNoise,
+    kUpsampling,
+    kColor,
+    kNumStages
+  };
+
+  float Total() const {
+    float total = 0.0f;
+    for (float c : cycles_per_pixel) total += c;
+    return total;
+  }
+
+  // Rough number of cycles of a single-threaded decoder on a recent x86 core,
+  // per pixel of the decoded frame. Meant to compare encoding settings, not to
+  // predict decoding times.
+  float cycles_per_pixel[kNumStages] = {};
+};
+
+// Estimates the cost of decoding a frame with this header, whose encoding is
+// `num_bits` long.
+DecodeCost EstimateDecodeCost(const FrameHeader& frame_header,
+                              size_t num_bits);
+
+// Estimates the cost of decoding a frame with this header before encoding it
+// with `cparams`: the size is predicted from the distance, and patches are
+// assumed unless disabled.
+DecodeCost PredictDecodeCost(const CompressParams& cparams,
+                             const FrameHeader& frame_header);
+
+// Changes `cparams` to disable the next decoding tool enabled in
+// `frame_header`, in order of decreasing cost compared to their benefit: the
+// third EPF iteration, noise, the second EPF iteration, gaborish, the last
+// EPF iteration, patches and finally the slower choices of decoding speed tier
+// 4. Returns false if nothing is left to disable.
+bool ReduceDecodeCost(const FrameHeader& frame_header,
+                      CompressParams* cparams);
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_ENC_DECODE_COST_H_
@@ -0,0 +1,140 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_decode_cost.h"
+
+#include "gtest/gtest.h"
+#include "lib/jxl/base/override.h"
+#include "lib/jxl/image_metadata.h"
+
+namespace jxl {
+namespace {
+
+class EncDecodeCostTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(metadata_.size.Set(256, 256));
+    metadata_.m.xyb_encoded = true;
+  }
+
+  FrameHeader MakeHeader() const {
+    FrameHeader frame_header(&metadata_);
+    frame_header.loop_filter.gab = false;
+    frame_header.loop_filter.epf_iters = 0;
+    return frame_header;
+  }
+
+  CodecMetadata metadata_;
+};
+
+TEST_F(EncDecodeCostTest, Stages) {
+  const FrameHeader frame_header = MakeHeader();
+  const DecodeCost cost = EstimateDecodeCost(frame_header, 256 * 256);
+  EXPECT_GT(cost.cycles_per_pixel[DecodeCost::kEntropy], 0.0f);
+  EXPECT_GT(cost.cycles_per_pixel[DecodeCost::kTransform], 0.0f);
+  EXPECT_GT(cost.cycles_per_pixel[DecodeCost::kColor], 0.0f);
+  for (DecodeCost::Stage stage :
+       {DecodeCost::kGaborish, DecodeCost::kEPF, DecodeCost::kPatches,
+        DecodeCost::kSplines, DecodeCost::kNoise, DecodeCost::kUpsampling}) {
+    EXPECT_EQ(0.0f, cost.cycles_per_pixel[stage]);
+  }
+
+  // More bits cost more entropy decoding.
+  EXPECT_GT(EstimateDecodeCost(frame_header, 8 * 256 * 256).Total(),
+            cost.Total());
+
+  FrameHeader with_tools = frame_header;
+  with_tools.loop_filter.gab = true;
+  with_tools.flags = FrameHeader::kPatches | FrameHeader::kSplines |
+                     FrameHeader::kNoise;
+  with_tools.upsampling = 2;
+  const DecodeCost tools_cost = EstimateDecodeCost(with_tools, 256 * 256);
+  for (DecodeCost::Stage stage :
+       {DecodeCost::kGaborish, DecodeCost::kPatches, DecodeCost::kSplines,
+        DecodeCost::kNoise, DecodeCost::kUpsampling}) {
+    EXPECT_GT(tools_cost.cycles_per_pixel[stage], 0.0f);
+  }
+}
+
+TEST_F(EncDecodeCostTest, EPFIterations) {
+  FrameHeader frame_header = MakeHeader();
+  float previous = 0.0f;
+  for (uint32_t epf_iters = 1; epf_iters <= 3; epf_iters++) {
+    frame_header.loop_filter.epf_iters = epf_iters;
+    const float epf = EstimateDecodeCost(frame_header, 256 * 256)
+                          .cycles_per_pixel[DecodeCost::kEPF];
+    EXPECT_GT(epf, previous);
+    previous = epf;
+  }
+}
+
+TEST_F(EncDecodeCostTest, ModularExtraChannels) {
+  FrameHeader frame_header = MakeHeader();
+  frame_header.encoding = FrameEncoding::kModular;
+  const float without = EstimateDecodeCost(frame_header, 256 * 256).Total();
+  metadata_.m.num_extra_channels = 1;
+  metadata_.m.extra_channel_info.resize(1);
+  frame_header.extra_channel_upsampling.resize(1, 1);
+  EXPECT_GT(EstimateDecodeCost(frame_header, 256 * 256).Total(), without);
+}
+
+TEST_F(EncDecodeCostTest, PredictAssumesPatches) {
+  const FrameHeader frame_header = MakeHeader();
+  CompressParams cparams;
+  EXPECT_GT(PredictDecodeCost(cparams, frame_header)
+                .cycles_per_pixel[DecodeCost::kPatches],
+            0.0f);
+  cparams.patches = Override::kOff;
+  EXPECT_EQ(0.0f, PredictDecodeCost(cparams, frame_header)
+                      .cycles_per_pixel[DecodeCost::kPatches]);
+  // Lower distances predict larger frames.
+  const float entropy = PredictDecodeCost(cparams, frame_header)
+                            .cycles_per_pixel[DecodeCost::kEntropy];
+  cparams.butteraugli_distance = 0.5f;
+  EXPECT_GT(PredictDecodeCost(cparams, frame_header)
+                .cycles_per_pixel[DecodeCost::kEntropy],
+            entropy);
+}
+
+TEST_F(EncDecodeCostTest, ReduceOrder) {
+  FrameHeader frame_header = MakeHeader();
+  frame_header.loop_filter.gab = true;
+  frame_header.loop_filter.epf_iters = 3;
+  frame_header.flags = FrameHeader::kNoise;
+  CompressParams cparams;
+  cparams.photon_noise_iso = 3200;
+
+  ASSERT_TRUE(ReduceDecodeCost(frame_header, &cparams));
+  EXPECT_EQ(2, cparams.epf);
+  frame_header.loop_filter.epf_iters = 2;
+
+  ASSERT_TRUE(ReduceDecodeCost(frame_header, &cparams));
+  EXPECT_EQ(Override::kOff, cparams.noise);
+  EXPECT_EQ(0.0f, cparams.photon_noise_iso);
+  frame_header.flags = 0;
+
+  ASSERT_TRUE(ReduceDecodeCost(frame_header, &cparams));
+  EXPECT_EQ(1, cparams.epf);
+  frame_header.loop_filter.epf_iters = 1;
+
+  ASSERT_TRUE(ReduceDecodeCost(frame_header, &cparams));
+  EXPECT_EQ(Override::kOff, cparams.gaborish);
+  frame_header.loop_filter.gab = false;
+
+  ASSERT_TRUE(ReduceDecodeCost(frame_header, &cparams));
+  EXPECT_EQ(0, cparams.epf);
+  frame_header.loop_filter.epf_iters = 0;
+
+  ASSERT_TRUE(ReduceDecodeCost(frame_header, &cparams));
+  EXPECT_EQ(Override::kOff, cparams.patches);
+
+  ASSERT_TRUE(ReduceDecodeCost(frame_header, &cparams));
+  EXPECT_EQ(4u, cparams.decoding_speed_tier);
+
+  EXPECT_FALSE(ReduceDecodeCost(frame_header, &cparams));
+}
+
+}  // namespace
+}  // namespace jxl
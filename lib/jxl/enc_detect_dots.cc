@@ -11,6 +11,7 @@
 #include <array>
 #include <cmath>
 #include <cstdio>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -184,33 +185,41 @@ Pixel operator+(const Pixel& a, const Pixel& b) {
 // Maximum area in pixels of a ellipse
 const size_t kMaxCCSize = 1000;
 
-// Extracts a connected component from a Binary image where seed is part
-// of the component
-bool ExtractComponent(ImageF* img, std::vector<Pixel>* pixels,
-                      const Pixel& seed, double threshold) {
-  PROFILER_FUNC;
-  static const std::vector<Pixel> neighbors{{1, -1}, {1, 0},   {1, 1},  {0, -1},
-                                            {0, 1},  {-1, -1}, {-1, 1}, {1, 0}};
-  std::vector<Pixel> q{seed};
-  while (!q.empty()) {
-    Pixel current = q.back();
-    q.pop_back();
-    pixels->push_back(current);
-    if (pixels->size() > kMaxCCSize) return false;
-    for (const Pixel& delta : neighbors) {
-      Pixel child = current + delta;
-      if (child.x >= 0 && static_cast<size_t>(child.x) < img->xsize() &&
-          child.y >= 0 && static_cast<size_t>(child.y) < img->ysize()) {
-        float* value = &img->Row(child.y)[child.x];
-        if (*value > threshold) {
-          *value = 0.0;
-          q.push_back(child);
-        }
-      }
+// Rows of the bands that are labelled in parallel by FindCC.
+constexpr size_t kLabelBandRows = 64;
+
+constexpr uint32_t kNoLabel = ~uint32_t{0};
+
+// Union-find forest over the pixel indices y * xsize + x, in which every tree
+// is rooted at the first of its pixels in raster order.
+class PixelForest {
+ public:
+  explicit PixelForest(size_t num_pixels) : parent_(num_pixels, kNoLabel) {}
+
+  bool Contains(uint32_t index) const { return parent_[index] != kNoLabel; }
+  void Add(uint32_t index) { parent_[index] = index; }
+
+  uint32_t Find(uint32_t index) {
+    while (parent_[index] != index) {
+      parent_[index] = parent_[parent_[index]];
+      index = parent_[index];
     }
+    return index;
   }
-  return true;
-}
+
+  void Union(uint32_t a, uint32_t b) {
+    a = Find(a);
+    b = Find(b);
+    if (a < b) {
+      parent_[b] = a;
+    } else if (b < a) {
+      parent_[a] = b;
+    }
+  }
+
+ private:
+  std::vector<uint32_t> parent_;
+};
 
 inline bool PointInRect(const Rect& r, const Pixel& p) {
   return (static_cast<size_t>(p.x) >= r.x0() &&
@@ -291,45 +300,132 @@ Rect BoundingRectangle(const std::vector<Pixel>& pixels) {
   return Rect(low_x, low_y, high_x - low_x + 1, high_y - low_y + 1);
 }
 
+// Returns the 8-connected components of the pixels with an energy above t_low
+// that contain a pixel above t_high, ordered by the first of those in raster
+// order. The bands of kLabelBandRows rows are labelled in parallel and then
+// joined along their borders.
 std::vector<ConnectedComponent> FindCC(const ImageF& energy, double t_low,
                                        double t_high, uint32_t maxWindow,
-                                       double minScore) {
+                                       double minScore, ThreadPool* pool) {
   PROFILER_FUNC;
   const int kExtraRect = 4;
-  ImageF img = CopyImage(energy);
-  std::vector<ConnectedComponent> ans;
-  for (size_t y = 0; y < img.ysize(); y++) {
-    float* JXL_RESTRICT row = img.Row(y);
-    for (size_t x = 0; x < img.xsize(); x++) {
-      if (row[x] > t_high) {
-        std::vector<Pixel> pixels;
-        row[x] = 0.0;
-        bool success = ExtractComponent(
-            &img, &pixels, Pixel{static_cast<int>(x), static_cast<int>(y)},
-            t_low);
-        if (!success) continue;
-#if JXL_DEBUG_DOT_DETECT
-        for (size_t i = 0; i < pixels.size(); i++) {
-          fprintf(stderr, "(%d,%d) ", pixels[i].x, pixels[i].y);
-        }
-        fprintf(stderr, "\n");
-#endif  // JXL_DEBUG_DOT_DETECT
-        Rect bounds = BoundingRectangle(pixels);
-        if (bounds.xsize() < maxWindow && bounds.ysize() < maxWindow) {
-          ConnectedComponent cc{bounds, std::move(pixels)};
-          cc.CompStats(energy, kExtraRect);
-          if (cc.score < minScore) continue;
-          JXL_DEBUG(JXL_DEBUG_DOT_DETECT,
-                    "cc mode: (%d,%d), max: %f, bgMean: %f bgVar: "
-                    "%f bound:(%" PRIuS ",%" PRIuS ",%" PRIuS ",%" PRIuS ")\n",
-                    cc.mode.x, cc.mode.y, cc.maxEnergy, cc.meanEnergy,
-                    cc.varEnergy, cc.bounds.x0(), cc.bounds.y0(),
-                    cc.bounds.xsize(), cc.bounds.ysize());
-          ans.push_back(cc);
+  const size_t xsize = energy.xsize();
+  const size_t ysize = energy.ysize();
+  PixelForest forest(xsize * ysize);
+  const size_t num_bands = DivCeil(ysize, kLabelBandRows);
+  // Pixels above t_low of each band, in raster order.
+  std::vector<std::vector<uint32_t>> band_pixels(num_bands);
+  JXL_CHECK(RunOnPool(
+      pool, 0, num_bands, ThreadPool::NoInit,
+      [&](const uint32_t band, size_t /*thread*/) {
+        const size_t y0 = band * kLabelBandRows;
+        const size_t y1 = std::min(y0 + kLabelBandRows, ysize);
+        for (size_t y = y0; y < y1; y++) {
+          const float* JXL_RESTRICT row = energy.ConstRow(y);
+          for (size_t x = 0; x < xsize; x++) {
+            if (row[x] <= t_low) continue;
+            const uint32_t index = y * xsize + x;
+            forest.Add(index);
+            band_pixels[band].push_back(index);
+            // Only the neighbors already visited in this band.
+            if (x > 0 && forest.Contains(index - 1)) {
+              forest.Union(index, index - 1);
+            }
+            if (y == y0) continue;
+            const uint32_t up = index - xsize;
+            if (x > 0 && forest.Contains(up - 1)) forest.Union(index, up - 1);
+            if (forest.Contains(up)) forest.Union(index, up);
+            if (x + 1 < xsize && forest.Contains(up + 1)) {
+              forest.Union(index, up + 1);
+            }
+          }
         }
+      },
+      "LabelDots"));
+  for (size_t band = 1; band < num_bands; band++) {
+    const uint32_t end = (band * kLabelBandRows + 1) * xsize;
+    for (const uint32_t index : band_pixels[band]) {
+      if (index >= end) break;
+      const size_t x = index % xsize;
+      const uint32_t up = index - xsize;
+      if (x > 0 && forest.Contains(up - 1)) forest.Union(index, up - 1);
+      if (forest.Contains(up)) forest.Union(index, up);
+      if (x + 1 < xsize && forest.Contains(up + 1)) {
+        forest.Union(index, up + 1);
       }
     }
   }
+
+  struct Candidate {
+    uint32_t first_seed = kNoLabel;
+    std::vector<Pixel> pixels;
+  };
+  std::vector<Candidate> candidates;
+  // Roots come first in raster order, before the other pixels of their tree.
+  std::unordered_map<uint32_t, size_t> root_candidates;
+  for (const std::vector<uint32_t>& pixels : band_pixels) {
+    for (const uint32_t index : pixels) {
+      const uint32_t root = forest.Find(index);
+      if (root == index) {
+        root_candidates[root] = candidates.size();
+        candidates.emplace_back();
+      }
+      Candidate& candidate = candidates[root_candidates[root]];
+      const Pixel pixel{static_cast<int>(index % xsize),
+                        static_cast<int>(index / xsize)};
+      if (candidate.first_seed == kNoLabel &&
+          energy.ConstRow(pixel.y)[pixel.x] > t_high) {
+        candidate.first_seed = index;
+      }
+      // The larger components are discarded.
+      if (candidate.pixels.size() <= kMaxCCSize) {
+        candidate.pixels.push_back(pixel);
+      }
+    }
+  }
+  std::vector<const Candidate*> seeded;
+  for (const Candidate& candidate : candidates) {
+    if (candidate.first_seed == kNoLabel) continue;
+    if (candidate.pixels.size() > kMaxCCSize) continue;
+    seeded.push_back(&candidate);
+  }
+  std::sort(seeded.begin(), seeded.end(),
+            [](const Candidate* a, const Candidate* b) {
+              return a->first_seed < b->first_seed;
+            });
+
+  std::vector<ConnectedComponent> ccs;
+  for (const Candidate* candidate : seeded) {
+#if JXL_DEBUG_DOT_DETECT
+    for (const Pixel& pixel : candidate->pixels) {
+      fprintf(stderr, "(%d,%d) ", pixel.x, pixel.y);
+    }
+    fprintf(stderr, "\n");
+#endif  // JXL_DEBUG_DOT_DETECT
+    Rect bounds = BoundingRectangle(candidate->pixels);
+    if (bounds.xsize() < maxWindow && bounds.ysize() < maxWindow) {
+      std::vector<Pixel> pixels = candidate->pixels;
+      ccs.emplace_back(bounds, std::move(pixels));
+    }
+  }
+  JXL_CHECK(RunOnPool(
+      pool, 0, ccs.size(), ThreadPool::NoInit,
+      [&](const uint32_t i, size_t /*thread*/) {
+        ccs[i].CompStats(energy, kExtraRect);
+      },
+      "DotsCompStats"));
+
+  std::vector<ConnectedComponent> ans;
+  for (ConnectedComponent& cc : ccs) {
+    if (cc.score < minScore) continue;
+    JXL_DEBUG(JXL_DEBUG_DOT_DETECT,
+              "cc mode: (%d,%d), max: %f, bgMean: %f bgVar: "
+              "%f bound:(%" PRIuS ",%" PRIuS ",%" PRIuS ",%" PRIuS ")\n",
+              cc.mode.x, cc.mode.y, cc.maxEnergy, cc.meanEnergy, cc.varEnergy,
+              cc.bounds.x0(), cc.bounds.y0(), cc.bounds.xsize(),
+              cc.bounds.ysize());
+    ans.push_back(std::move(cc));
+  }
   return ans;
 }
 
@@ -550,8 +646,9 @@ std::vector<PatchInfo> DetectGaussianEllipses(
   aux.DumpXybImage("smooth", smooth);
   aux.DumpPlaneNormalized("energy", energy);
 #endif  // JXL_DEBUG_DOT_DETECT
-  std::vector<ConnectedComponent> components = FindCC(
-      energy, params.t_low, params.t_high, params.maxWinSize, params.minScore);
+  std::vector<ConnectedComponent> components =
+      FindCC(energy, params.t_low, params.t_high, params.maxWinSize,
+             params.minScore, pool);
   size_t numCC =
       std::min(params.maxCC, (components.size() * params.percCC) / 100);
   if (components.size() > numCC) {
@@ -562,8 +659,16 @@ std::vector<PatchInfo> DetectGaussianEllipses(
         });
     components.erase(components.begin() + numCC, components.end());
   }
-  for (const auto& cc : components) {
-    GaussianEllipse ellipse = FitGaussian(cc, energy, opsin, smooth);
+  std::vector<GaussianEllipse> ellipses(components.size());
+  JXL_CHECK(RunOnPool(
+      pool, 0, components.size(), ThreadPool::NoInit,
+      [&](const uint32_t i, size_t /*thread*/) {
+        ellipses[i] = FitGaussian(components[i], energy, opsin, smooth);
+      },
+      "FitGaussian"));
+  for (size_t i = 0; i < components.size(); i++) {
+    const ConnectedComponent& cc = components[i];
+    const GaussianEllipse& ellipse = ellipses[i];
     if (ellipse.x < 0.0 ||
         std::ceil(ellipse.x) >= static_cast<double>(opsin.xsize()) ||
         ellipse.y < 0.0 ||
@@ -0,0 +1,520 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_downsample.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/common.h"
+#include "lib/jxl/image_ops.h"
+
+namespace jxl {
+namespace {
+
+void StoreMin2(const float v, float& min1, float& min2) {
+  if (v < min2) {
+    if (v < min1) {
+      min2 = min1;
+      min1 = v;
+    } else {
+      min2 = v;
+    }
+  }
+}
+
+void CreateMask(const ImageF& image, ImageF& mask, ThreadPool* pool) {
+  const auto process_row = [&](const uint32_t y, size_t /*thread*/) {
+    auto* row_n = y > 0 ? image.Row(y - 1) : image.Row(y);
+    auto* row_in = image.Row(y);
+    auto* row_s = y + 1 < image.ysize() ? image.Row(y + 1) : image.Row(y);
+    auto* row_out = mask.Row(y);
+    for (size_t x = 0; x < image.xsize(); x++) {
+      // Center, west, east, north, south values and their absolute difference
+      float c = row_in[x];
+      float w = x > 0 ? row_in[x - 1] : row_in[x];
+      float e = x + 1 < image.xsize() ? row_in[x + 1] : row_in[x];
+      float n = row_n[x];
+      float s = row_s[x];
+      float dw = std::abs(c - w);
+      float de = std::abs(c - e);
+      float dn = std::abs(c - n);
+      float ds = std::abs(c - s);
+      float min = std::numeric_limits<float>::max();
+      float min2 = std::numeric_limits<float>::max();
+      StoreMin2(dw, min, min2);
+      StoreMin2(de, min, min2);
+      StoreMin2(dn, min, min2);
+      StoreMin2(ds, min, min2);
+      row_out[x] = min2;
+    }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, image.ysize(), ThreadPool::NoInit, process_row,
+                      "CreateMask"));
+}
+
+// Splits the rows of `input`, shifted left by `offset` pixels, into their
+// even and odd pixels: row y of planes[p] has input pixel 2 * i + p - offset
+// at position i. Outside of the image, the pixels are those of the border if
+// `replicate`, or zero otherwise. This turns the taps of a kernel applied at
+// every other pixel into contiguous reads.
+void Deinterleave(const ImageF& input, int64_t offset, bool replicate,
+                  ImageF* planes[2], ThreadPool* pool) {
+  const int64_t xsize = input.xsize();
+  const auto process_row = [&](const uint32_t y, size_t /*thread*/) {
+    const float* JXL_RESTRICT row_in = input.ConstRow(y);
+    for (int64_t p = 0; p < 2; p++) {
+      float* JXL_RESTRICT row_out = planes[p]->Row(y);
+      for (int64_t i = 0; i < static_cast<int64_t>(planes[p]->xsize()); i++) {
+        int64_t x = 2 * i + p - offset;
+        if (x >= 0 && x < xsize) {
+          row_out[i] = row_in[x];
+        } else if (replicate) {
+          row_out[i] = row_in[x < 0 ? 0 : xsize - 1];
+        } else {
+          row_out[i] = 0.0f;
+        }
+      }
+    }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, input.ysize(), ThreadPool::NoInit, process_row,
+                      "Deinterleave"));
+}
+
+// Downsamples the image by a factor of 2 with a kernel that's sharper than
+// the standard 2x2 box kernel used by DownsampleImage.
+// The kernel is optimized against the result of the 2x2 upsampling kernel used
+// by the decoder. Ringing is slightly reduced by clamping the values of the
+// resulting pixels within certain bounds of a small region in the original
+// image.
+void DownsampleImage2_Sharper(const ImageF& input, ImageF* output,
+                              ThreadPool* pool) {
+  const int64_t kernelx = 12;
+  const int64_t kernely = 12;
+
+  static const float kernel[144] = {
+      -0.000314256996835, -0.000314256996835, -0.000897597057705,
+      -0.000562751488849, -0.000176807273646, 0.001864627368902,
+      0.001864627368902,  -0.000176807273646, -0.000562751488849,
+      -0.000897597057705, -0.000314256996835, -0.000314256996835,
+      -0.000314256996835, -0.001527942804748, -0.000121760530512,
+      0.000191123989093,  0.010193185932466,  0.058637519197110,
+      0.058637519197110,  0.010193185932466,  0.000191123989093,
+      -0.000121760530512, -0.001527942804748, -0.000314256996835,
+      -0.000897597057705, -0.000121760530512, 0.000946363683751,
+      0.007113577630288,  0.000437956841058,  -0.000372823835211,
+      -0.000372823835211, 0.000437956841058,  0.007113577630288,
+      0.000946363683751,  -0.000121760530512, -0.000897597057705,
+      -0.000562751488849, 0.000191123989093,  0.007113577630288,
+      0.044592622228814,  0.000222278879007,  -0.162864473015945,
+      -0.162864473015945, 0.000222278879007,  0.044592622228814,
+      0.007113577630288,  0.000191123989093,  -0.000562751488849,
+      -0.000176807273646, 0.010193185932466,  0.000437956841058,
+      0.000222278879007,  -0.000913092543974, -0.017071696107902,
+      -0.017071696107902, -0.000913092543974, 0.000222278879007,
+      0.000437956841058,  0.010193185932466,  -0.000176807273646,
+      0.001864627368902,  0.058637519197110,  -0.000372823835211,
+      -0.162864473015945, -0.017071696107902, 0.414660099370354,
+      0.414660099370354,  -0.017071696107902, -0.162864473015945,
+      -0.000372823835211, 0.058637519197110,  0.001864627368902,
+      0.001864627368902,  0.058637519197110,  -0.000372823835211,
+      -0.162864473015945, -0.017071696107902, 0.414660099370354,
+      0.414660099370354,  -0.017071696107902, -0.162864473015945,
+      -0.000372823835211, 0.058637519197110,  0.001864627368902,
+      -0.000176807273646, 0.010193185932466,  0.000437956841058,
+      0.000222278879007,  -0.000913092543974, -0.017071696107902,
+      -0.017071696107902, -0.000913092543974, 0.000222278879007,
+      0.000437956841058,  0.010193185932466,  -0.000176807273646,
+      -0.000562751488849, 0.000191123989093,  0.007113577630288,
+      0.044592622228814,  0.000222278879007,  -0.162864473015945,
+      -0.162864473015945, 0.000222278879007,  0.044592622228814,
+      0.007113577630288,  0.000191123989093,  -0.000562751488849,
+      -0.000897597057705, -0.000121760530512, 0.000946363683751,
+      0.007113577630288,  0.000437956841058,  -0.000372823835211,
+      -0.000372823835211, 0.000437956841058,  0.007113577630288,
+      0.000946363683751,  -0.000121760530512, -0.000897597057705,
+      -0.000314256996835, -0.001527942804748, -0.000121760530512,
+      0.000191123989093,  0.010193185932466,  0.058637519197110,
+      0.058637519197110,  0.010193185932466,  0.000191123989093,
+      -0.000121760530512, -0.001527942804748, -0.000314256996835,
+      -0.000314256996835, -0.000314256996835, -0.000897597057705,
+      -0.000562751488849, -0.000176807273646, 0.001864627368902,
+      0.001864627368902,  -0.000176807273646, -0.000562751488849,
+      -0.000897597057705, -0.000314256996835, -0.000314256996835};
+
+  int64_t ysize = input.ysize();
+  const size_t xsize2 = output->xsize();
+
+  ImageF box_downsample = CopyImage(input);
+  DownsampleImage(&box_downsample, 2);
+
+  ImageF mask(box_downsample.xsize(), box_downsample.ysize());
+  CreateMask(box_downsample, mask, pool);
+
+  // Tap kx of output pixel x is at x + kx / 2 in planes[kx & 1].
+  ImageF even(xsize2 + kernelx / 2, ysize);
+  ImageF odd(xsize2 + kernelx / 2, ysize);
+  ImageF* planes[2] = {&even, &odd};
+  Deinterleave(input, (kernelx - 1) / 2, /*replicate=*/true, planes, pool);
+
+  const auto process_row = [&](const uint32_t y, size_t /*thread*/) {
+    float* JXL_RESTRICT row_out = output->Row(y);
+    const float* row_in[2][kernely];
+    const float* row_mask = mask.Row(y);
+    // get the rows in the support
+    for (size_t ky = 0; ky < kernely; ky++) {
+      int64_t iy = y * 2 + ky - (kernely - 1) / 2;
+      if (iy < 0) iy = 0;
+      if (iy >= ysize) iy = ysize - 1;
+      row_in[0][ky] = even.ConstRow(iy);
+      row_in[1][ky] = odd.ConstRow(iy);
+    }
+
+    std::fill(row_out, row_out + xsize2, 0.0f);
+    for (int64_t ky = 0; ky < kernely; ky++) {
+      for (int64_t kx = 0; kx < kernelx; kx++) {
+        const float* JXL_RESTRICT row = row_in[kx & 1][ky] + kx / 2;
+        const float k = kernel[ky * kernelx + kx];
+        for (size_t x = 0; x < xsize2; x++) {
+          row_out[x] += row[x] * k;
+        }
+      }
+    }
+
+    for (size_t x = 0; x < xsize2; x++) {
+      // get min and max values of the original image in the support
+      float min = std::numeric_limits<float>::max();
+      float max = std::numeric_limits<float>::min();
+      // kernelx - R and kernely - R are the radius of a rectangular region in
+      // which the values of a pixel are bounded to reduce ringing.
+      static constexpr int64_t R = 5;
+      for (int64_t ky = R; ky + R < kernely; ky++) {
+        for (int64_t kx = R; kx + R < kernelx; kx++) {
+          const float v = row_in[kx & 1][ky][x + kx / 2];
+          min = std::min<float>(min, v);
+          max = std::max<float>(max, v);
+        }
+      }
+
+      // Clamp the pixel within the value  of a small area to prevent ringning.
+      // The mask determines how much to clamp, clamp more to reduce more
+      // ringing in smooth areas, clamp less in noisy areas to get more
+      // sharpness. Higher mask_multiplier gives less clamping, so less
+      // ringing reduction.
+      const constexpr float mask_multiplier = 1;
+      float a = row_mask[x] * mask_multiplier;
+      float clip_min = min - a;
+      float clip_max = max + a;
+      row_out[x] = std::min(std::max(row_out[x], clip_min), clip_max);
+    }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, output->ysize(), ThreadPool::NoInit,
+                      process_row, "DownsampleImage2_Sharper"));
+}
+
+// The default upsampling kernels used by Upsampler in the decoder.
+static const constexpr int64_t kSize = 5;
+
+static const float kernel00[25] = {
+    -0.01716200f, -0.03452303f, -0.04022174f, -0.02921014f, -0.00624645f,
+    -0.03452303f, 0.14111091f,  0.28896755f,  0.00278718f,  -0.01610267f,
+    -0.04022174f, 0.28896755f,  0.56661550f,  0.03777607f,  -0.01986694f,
+    -0.02921014f, 0.00278718f,  0.03777607f,  -0.03144731f, -0.01185068f,
+    -0.00624645f, -0.01610267f, -0.01986694f, -0.01185068f, -0.00213539f,
+};
+static const float kernel01[25] = {
+    -0.00624645f, -0.01610267f, -0.01986694f, -0.01185068f, -0.00213539f,
+    -0.02921014f, 0.00278718f,  0.03777607f,  -0.03144731f, -0.01185068f,
+    -0.04022174f, 0.28896755f,  0.56661550f,  0.03777607f,  -0.01986694f,
+    -0.03452303f, 0.14111091f,  0.28896755f,  0.00278718f,  -0.01610267f,
+    -0.01716200f, -0.03452303f, -0.04022174f, -0.02921014f, -0.00624645f,
+};
+static const float kernel10[25] = {
+    -0.00624645f, -0.02921014f, -0.04022174f, -0.03452303f, -0.01716200f,
+    -0.01610267f, 0.00278718f,  0.28896755f,  0.14111091f,  -0.03452303f,
+    -0.01986694f, 0.03777607f,  0.56661550f,  0.28896755f,  -0.04022174f,
+    -0.01185068f, -0.03144731f, 0.03777607f,  0.00278718f,  -0.02921014f,
+    -0.00213539f, -0.01185068f, -0.01986694f, -0.01610267f, -0.00624645f,
+};
+static const float kernel11[25] = {
+    -0.00213539f, -0.01185068f, -0.01986694f, -0.01610267f, -0.00624645f,
+    -0.01185068f, -0.03144731f, 0.03777607f,  0.00278718f,  -0.02921014f,
+    -0.01986694f, 0.03777607f,  0.56661550f,  0.28896755f,  -0.04022174f,
+    -0.01610267f, 0.00278718f,  0.28896755f,  0.14111091f,  -0.03452303f,
+    -0.00624645f, -0.02921014f, -0.04022174f, -0.03452303f, -0.01716200f,
+};
+
+// Does exactly the same as the Upsampler in dec_upsampler for 2x2 pixels, with
+// default CustomTransformData.
+// TODO(lode): use Upsampler instead. However, it requires pre-initialization
+// and padding on the left side of the image which requires refactoring the
+// other code using this.
+void UpsampleImage(const ImageF& input, ImageF* output, ThreadPool* pool) {
+  const int64_t xsize2 = input.xsize();
+  const int64_t ysize2 = input.ysize();
+  const size_t xsize = output->xsize();
+
+  // Input pixel x2 - kSize / 2 + kx, with replicated borders, is at x2 + kx.
+  ImageF padded(xsize2 + kSize - 1, ysize2);
+  const auto pad_row = [&](const uint32_t y, size_t /*thread*/) {
+    const float* JXL_RESTRICT row_in = input.ConstRow(y);
+    float* JXL_RESTRICT row_out = padded.Row(y);
+    for (int64_t i = 0; i < xsize2 + kSize - 1; i++) {
+      int64_t xi = i - kSize / 2;
+      if (xi < 0) xi = 0;
+      if (xi >= xsize2) xi = xsize2 - 1;
+      row_out[i] = row_in[xi];
+    }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, ysize2, ThreadPool::NoInit, pad_row,
+                      "PadUpsampleInput"));
+
+  // Sums of the even and odd pixels of the row, and bounds of their supports.
+  ImageF scratch;
+  const auto init_scratch = [&](size_t num_threads) {
+    scratch = ImageF(xsize2, 4 * num_threads);
+    return true;
+  };
+  const auto process_row = [&](const uint32_t y, size_t thread) {
+    const int64_t y2 = y / 2;
+    const float* rows[kSize];
+    for (int64_t ky = 0; ky < kSize; ky++) {
+      int64_t yi = y2 - kSize / 2 + ky;
+      if (yi < 0) yi = 0;
+      if (yi >= ysize2) yi = ysize2 - 1;
+      rows[ky] = padded.ConstRow(yi);
+    }
+    const float* kernels[2] = {(y & 1) ? kernel01 : kernel00,
+                               (y & 1) ? kernel11 : kernel10};
+    float* JXL_RESTRICT sums[2] = {scratch.Row(4 * thread),
+                                   scratch.Row(4 * thread + 1)};
+    float* JXL_RESTRICT min = scratch.Row(4 * thread + 2);
+    float* JXL_RESTRICT max = scratch.Row(4 * thread + 3);
+    for (size_t p = 0; p < 2; p++) {
+      std::fill(sums[p], sums[p] + xsize2, 0.0f);
+    }
+    // get min and max values of the original image in the support
+    std::fill(min, min + xsize2, std::numeric_limits<float>::max());
+    std::fill(max, max + xsize2, std::numeric_limits<float>::min());
+
+    for (int64_t ky = 0; ky < kSize; ky++) {
+      for (int64_t kx = 0; kx < kSize; kx++) {
+        const float* JXL_RESTRICT row = rows[ky] + kx;
+        for (size_t p = 0; p < 2; p++) {
+          const float k = kernels[p][ky * kSize + kx];
+          for (int64_t x2 = 0; x2 < xsize2; x2++) {
+            sums[p][x2] += row[x2] * k;
+          }
+        }
+        for (int64_t x2 = 0; x2 < xsize2; x2++) {
+          min[x2] = std::min<float>(min[x2], row[x2]);
+          max[x2] = std::max<float>(max[x2], row[x2]);
+        }
+      }
+    }
+
+    float* JXL_RESTRICT row_out = output->Row(y);
+    for (size_t x = 0; x < xsize; x++) {
+      const size_t x2 = x / 2;
+      row_out[x] = std::min(std::max(sums[x & 1][x2], min[x2]), max[x2]);
+    }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, output->ysize(), init_scratch, process_row,
+                      "UpsampleImage"));
+}
+
+// Apply the derivative of the Upsampler to the input, reversing the effect of
+// its coefficients (ignoring the clamping). The output image is 2x2 times
+// smaller than the input.
+void AntiUpsample(const ImageF& input, ImageF* d, ThreadPool* pool) {
+  const int64_t ysize = input.ysize();
+  const size_t xsize2 = d->xsize();
+
+  // The derivative of output pixel x to input pixel x2 is nonzero for x in
+  // [2 * x2 - k0, 2 * x2 + k1], which is at x2 + dx / 2 in planes[dx & 1],
+  // with dx = x - 2 * x2 + k0. Pixels outside of the image contribute zero.
+  const int64_t k0 = kSize - 1;
+  const int64_t k1 = kSize;
+  ImageF even(xsize2 + k0, ysize);
+  ImageF odd(xsize2 + k0, ysize);
+  ImageF* planes[2] = {&even, &odd};
+  Deinterleave(input, k0, /*replicate=*/false, planes, pool);
+
+  // The kernel of output pixel x, y of the Upsampler, by y & 1 and x & 1.
+  const float* kernels[2][2] = {{kernel00, kernel10}, {kernel01, kernel11}};
+
+  const auto process_row = [&](const uint32_t y2, size_t /*thread*/) {
+    float* JXL_RESTRICT row = d->Row(y2);
+    std::fill(row, row + xsize2, 0.0f);
+    int64_t y0 = static_cast<int64_t>(y2) * 2 - k0;
+    if (y0 < 0) y0 = 0;
+    int64_t y1 = static_cast<int64_t>(y2) * 2 + k1 + 1;
+    if (y1 > ysize) y1 = ysize;
+    for (int64_t y = y0; y < y1; ++y) {
+      const int64_t ky = y2 - y / 2 + kSize / 2;
+      for (int64_t dx = 0; dx < k0 + k1 + 1; ++dx) {
+        // Input pixel x has x / 2 == x2 - kSize / 2 + dx / 2.
+        const int64_t kx = kSize - 1 - dx / 2;
+        const float deriv = kernels[y & 1][dx & 1][ky * kSize + kx];
+        const float* JXL_RESTRICT row_in = planes[dx & 1]->ConstRow(y) + dx / 2;
+        for (size_t x2 = 0; x2 < xsize2; ++x2) {
+          row[x2] += deriv * row_in[x2];
+        }
+      }
+    }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, d->ysize(), ThreadPool::NoInit, process_row,
+                      "AntiUpsample"));
+}
+
+void ReduceRinging(const ImageF& initial, const ImageF& mask, ImageF& down,
+                   ThreadPool* pool) {
+  int64_t xsize2 = down.xsize();
+  int64_t ysize2 = down.ysize();
+
+  const auto process_row = [&](const uint32_t y, size_t /*thread*/) {
+    const float* row_mask = mask.Row(y);
+    float* row_out = down.Row(y);
+    for (size_t x = 0; x < down.xsize(); x++) {
+      float v = down.Row(y)[x];
+      float min = initial.Row(y)[x];
+      float max = initial.Row(y)[x];
+      for (int64_t yi = -1; yi < 2; yi++) {
+        for (int64_t xi = -1; xi < 2; xi++) {
+          int64_t x2 = (int64_t)x + xi;
+          int64_t y2 = (int64_t)y + yi;
+          if (x2 < 0 || y2 < 0 || x2 >= (int64_t)xsize2 ||
+              y2 >= (int64_t)ysize2)
+            continue;
+          min = std::min<float>(min, initial.Row(y2)[x2]);
+          max = std::max<float>(max, initial.Row(y2)[x2]);
+        }
+      }
+
+      row_out[x] = v;
+
+      // Clamp the pixel within the value  of a small area to prevent ringning.
+      // The mask determines how much to clamp, clamp more to reduce more
+      // ringing in smooth areas, clamp less in noisy areas to get more
+      // sharpness. Higher mask_multiplier gives less clamping, so less
+      // ringing reduction.
+      const constexpr float mask_multiplier = 2;
+      float a = row_mask[x] * mask_multiplier;
+      float clip_min = min - a;
+      float clip_max = max + a;
+      if (row_out[x] < clip_min) row_out[x] = clip_min;
+      if (row_out[x] > clip_max) row_out[x] = clip_max;
+    }
+  };
+  JXL_CHECK(RunOnPool(pool, 0, ysize2, ThreadPool::NoInit, process_row,
+                      "ReduceRinging"));
+}
+
+void DownsampleImage2_Iterative(const ImageF& orig, ImageF* output,
+                                ThreadPool* pool) {
+  int64_t xsize = orig.xsize();
+  int64_t ysize = orig.ysize();
+  int64_t xsize2 = DivCeil(orig.xsize(), 2);
+  int64_t ysize2 = DivCeil(orig.ysize(), 2);
+
+  ImageF box_downsample = CopyImage(orig);
+  DownsampleImage(&box_downsample, 2);
+  ImageF mask(box_downsample.xsize(), box_downsample.ysize());
+  CreateMask(box_downsample, mask, pool);
+
+  output->ShrinkTo(xsize2, ysize2);
+
+  // Initial result image using the sharper downsampling.
+  ImageF initial(xsize2, ysize2);
+  DownsampleImage2_Sharper(orig, &initial, pool);
+
+  ImageF down = CopyImage(initial);
+  ImageF up(xsize, ysize);
+  ImageF corr2(xsize2, ysize2);
+
+  // In the weights map, relatively higher values will allow less ringing but
+  // also less sharpness. With all constant values, it optimizes equally
+  // everywhere. Even in this case, the weights2 computed from
+  // this is still used and differs at the borders of the image.
+  // TODO(lode): Make use of the weights field for anti-ringing and clamping,
+  // the values are all set to 1 for now, but it is intended to be used for
+  // reducing ringing based on the mask, and taking clamping into account.
+  // While they are all 1, the correction is not multiplied by them.
+  ImageF weights(xsize, ysize);
+  FillImage(1.0f, &weights);
+  ImageF weights2(xsize2, ysize2);
+  AntiUpsample(weights, &weights2, pool);
+
+  // Turns `up` into the correction of the original image.
+  const auto subtract_row = [&](const uint32_t y, size_t /*thread*/) {
+    const float* JXL_RESTRICT row_orig = orig.ConstRow(y);
+    float* JXL_RESTRICT row_up = up.Row(y);
+    for (int64_t x = 0; x < xsize; ++x) {
+      row_up[x] = row_orig[x] - row_up[x];
+    }
+  };
+  const auto correct_row = [&](const uint32_t y, size_t /*thread*/) {
+    const float* JXL_RESTRICT row_corr = corr2.ConstRow(y);
+    const float* JXL_RESTRICT row_weights = weights2.ConstRow(y);
+    float* JXL_RESTRICT row_down = down.Row(y);
+    for (int64_t x = 0; x < xsize2; ++x) {
+      row_down[x] += row_corr[x] / row_weights[x];
+    }
+  };
+
+  const size_t num_it = 3;
+  for (size_t it = 0; it < num_it; ++it) {
+    UpsampleImage(down, &up, pool);
+    JXL_CHECK(RunOnPool(pool, 0, ysize, ThreadPool::NoInit, subtract_row,
+                        "DownsampleCorrection"));
+    AntiUpsample(up, &corr2, pool);
+    JXL_CHECK(RunOnPool(pool, 0, ysize2, ThreadPool::NoInit, correct_row,
+                        "DownsampleCorrect"));
+  }
+
+  ReduceRinging(initial, mask, down, pool);
+
+  // can't just use CopyImage, because the output image was prepared with
+  // padding.
+  for (size_t y = 0; y < down.ysize(); y++) {
+    const float* JXL_RESTRICT row_in = down.ConstRow(y);
+    std::copy(row_in, row_in + down.xsize(), output->Row(y));
+  }
+}
+
+// Returns an image of half the size, rounded up, with kBlockDim pixels of
+// extra capacity to avoid a reallocation when padding.
+Image3F AllocateDownsampled(const Image3F& opsin) {
+  Image3F downsampled(DivCeil(opsin.xsize(), 2) + kBlockDim,
+                      DivCeil(opsin.ysize(), 2) + kBlockDim);
+  downsampled.ShrinkTo(downsampled.xsize() - kBlockDim,
+                       downsampled.ysize() - kBlockDim);
+  return downsampled;
+}
+
+}  // namespace
+
+void DownsampleImage2_Sharper(Image3F* opsin, ThreadPool* pool) {
+  Image3F downsampled = AllocateDownsampled(*opsin);
+  for (size_t c = 0; c < 3; c++) {
+    DownsampleImage2_Sharper(opsin->Plane(c), &downsampled.Plane(c), pool);
+  }
+  *opsin = std::move(downsampled);
+}
+
+void DownsampleImage2_Iterative(Image3F* opsin, ThreadPool* pool) {
+  Image3F downsampled = AllocateDownsampled(*opsin);
+  for (size_t c = 0; c < 3; c++) {
+    DownsampleImage2_Iterative(opsin->Plane(c), &downsampled.Plane(c), pool);
+  }
+  *opsin = std::move(downsampled);
+}
+
+}  // namespace jxl
@@ -0,0 +1,29 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_DOWNSAMPLE_H_
+#define LIB_JXL_ENC_DOWNSAMPLE_H_
+
+// 2x downsampling of the XYB image for resampling == 2, tuned to the default
+// 2x upsampling kernel of the decoder.
+
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/image.h"
+
+namespace jxl {
+
+// Downsamples the planes by 2 with a 12x12 kernel that is sharper than the
+// 2x2 box, clamped to a small neighbourhood of each pixel against ringing.
+// The result has kBlockDim pixels of extra capacity for padding.
+void DownsampleImage2_Sharper(Image3F* opsin, ThreadPool* pool);
+
+// Downsamples the planes by 2, starting from DownsampleImage2_Sharper and
+// refining the result for a few iterations so that its upsampling by the
+// decoder gets closer to the original. Slower than DownsampleImage2_Sharper.
+void DownsampleImage2_Iterative(Image3F* opsin, ThreadPool* pool);
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_ENC_DOWNSAMPLE_H_
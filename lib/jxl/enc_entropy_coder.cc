@@ -156,13 +156,29 @@ void TokenizeCoefficients(const coeff_order_t* JXL_RESTRICT orders,
                           Image3I* JXL_RESTRICT tmp_num_nzeroes,
                           std::vector<Token>* JXL_RESTRICT output,
                           const ImageB& qdc, const ImageI& qf,
-                          const BlockCtxMap& block_ctx_map) {
+                          const BlockCtxMap& block_ctx_map,
+                          std::vector<Histogram>* histograms) {
   const size_t xsize_blocks = rect.xsize();
   const size_t ysize_blocks = rect.ysize();
 
   // TODO(user): update the estimate: usually less coefficients are used.
   output->reserve(output->size() +
                   3 * xsize_blocks * ysize_blocks * kDCTBlockSize);
+  if (histograms != nullptr &&
+      histograms->size() < block_ctx_map.NumACContexts()) {
+    histograms->resize(block_ctx_map.NumACContexts());
+  }
+  const HybridUintConfig uint_config;
+  // Counts the tokens of a block while they are still in cache.
+  const auto add_to_histograms = [&](size_t begin) {
+    if (histograms == nullptr) return;
+    for (size_t i = begin; i < output->size(); i++) {
+      const Token& token = (*output)[i];
+      uint32_t tok, nbits, bits;
+      uint_config.Encode(token.value, &tok, &nbits, &bits);
+      (*histograms)[token.context].Add(tok);
+    }
+  };
 
   size_t offset[3] = {};
   const size_t nzeros_stride = tmp_num_nzeroes->PixelsPerRow();
@@ -220,6 +236,7 @@ void TokenizeCoefficients(const coeff_order_t* JXL_RESTRICT orders,
         const int32_t nzero_ctx =
             block_ctx_map.NonZeroContext(predicted_nzeros, block_ctx);
 
+        const size_t block_begin = output->size();
         output->emplace_back(nzero_ctx, nzeros);
         const size_t histo_offset =
             block_ctx_map.ZeroDensityContextsOffset(block_ctx);
@@ -236,6 +253,7 @@ void TokenizeCoefficients(const coeff_order_t* JXL_RESTRICT orders,
           nzeros -= prev;
         }
         JXL_DASSERT(nzeros == 0);
+        add_to_histograms(block_begin);
         offset[c] += size;
       }
     }
@@ -258,10 +276,11 @@ void TokenizeCoefficients(const coeff_order_t* JXL_RESTRICT orders,
                           Image3I* JXL_RESTRICT tmp_num_nzeroes,
                           std::vector<Token>* JXL_RESTRICT output,
                           const ImageB& qdc, const ImageI& qf,
-                          const BlockCtxMap& block_ctx_map) {
+                          const BlockCtxMap& block_ctx_map,
+                          std::vector<Histogram>* histograms) {
   return HWY_DYNAMIC_DISPATCH(TokenizeCoefficients)(
       orders, rect, ac_rows, ac_strategy, cs, tmp_num_nzeroes, output, qdc, qf,
-      block_ctx_map);
+      block_ctx_map, histograms);
 }
 
 }  // namespace jxl
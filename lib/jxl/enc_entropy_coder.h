@@ -19,6 +19,7 @@
 #include "lib/jxl/ac_context.h"  // BlockCtxMap
 #include "lib/jxl/ac_strategy.h"
 #include "lib/jxl/enc_ans.h"
+#include "lib/jxl/enc_cluster.h"
 #include "lib/jxl/field_encodings.h"
 #include "lib/jxl/frame_header.h"  // YCbCrChromaSubsampling
 #include "lib/jxl/image.h"
@@ -31,6 +32,8 @@ namespace jxl {
 // Generate DCT NxN quantized AC values tokens.
 // Only the subset "rect" [in units of blocks] within all images.
 // See also DecodeACVarBlock.
+// If `histograms` is not null, the tokens are also added to the histogram of
+// their context, with the default HybridUintConfig.
 void TokenizeCoefficients(const coeff_order_t* JXL_RESTRICT orders,
                           const Rect& rect,
                           const int32_t* JXL_RESTRICT* JXL_RESTRICT ac_rows,
@@ -39,7 +42,8 @@ void TokenizeCoefficients(const coeff_order_t* JXL_RESTRICT orders,
                           Image3I* JXL_RESTRICT tmp_num_nzeroes,
                           std::vector<Token>* JXL_RESTRICT output,
                           const ImageB& qdc, const ImageI& qf,
-                          const BlockCtxMap& block_ctx_map);
+                          const BlockCtxMap& block_ctx_map,
+                          std::vector<Histogram>* histograms);
 
 }  // namespace jxl
 
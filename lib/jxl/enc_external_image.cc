@@ -13,6 +13,11 @@
 #include <utility>
 #include <vector>
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/enc_external_image.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
 #include "jxl/types.h"
 #include "lib/jxl/alpha.h"
 #include "lib/jxl/base/byte_order.h"
@@ -20,69 +25,202 @@
 #include "lib/jxl/color_management.h"
 #include "lib/jxl/common.h"
 
+HWY_BEFORE_NAMESPACE();
 namespace jxl {
-namespace {
-
-// Based on highway scalar implementation, for testing
-float LoadFloat16(uint16_t bits16) {
-  const uint32_t sign = bits16 >> 15;
-  const uint32_t biased_exp = (bits16 >> 10) & 0x1F;
-  const uint32_t mantissa = bits16 & 0x3FF;
-
-  // Subnormal or zero
-  if (biased_exp == 0) {
-    const float subnormal = (1.0f / 16384) * (mantissa * (1.0f / 1024));
-    return sign ? -subnormal : subnormal;
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Vec;
+
+// Each loader returns Lanes(d) consecutive samples starting at in as floats.
+// swap is true if the byte order of the samples differs from the host.
+
+struct LoadU8 {
+  template <class DF>
+  Vec<DF> operator()(DF df, const uint8_t* in, bool /*swap*/) const {
+    const Rebind<int32_t, DF> di;
+    const Rebind<uint8_t, DF> du8;
+    return ConvertTo(df, PromoteTo(di, LoadU(du8, in)));
   }
-
-  // Normalized: convert the representation directly (faster than ldexp/tables).
-  const uint32_t biased_exp32 = biased_exp + (127 - 15);
-  const uint32_t mantissa32 = mantissa << (23 - 10);
-  const uint32_t bits32 = (sign << 31) | (biased_exp32 << 23) | mantissa32;
-
-  float result;
-  memcpy(&result, &bits32, 4);
-  return result;
+};
+
+template <class DF>
+Vec<Rebind<uint32_t, DF>> LoadU16AsU32(DF /*df*/, const uint8_t* in,
+                                       bool swap) {
+  const Rebind<uint32_t, DF> du;
+  const Rebind<uint16_t, DF> du16;
+  auto v = LoadU(du16, reinterpret_cast<const uint16_t*>(in));
+  if (swap) v = ShiftLeft<8>(v) | ShiftRight<8>(v);
+  return PromoteTo(du, v);
 }
 
-float LoadLEFloat16(const uint8_t* p) {
-  uint16_t bits16 = LoadLE16(p);
-  return LoadFloat16(bits16);
+struct LoadU16 {
+  template <class DF>
+  Vec<DF> operator()(DF df, const uint8_t* in, bool swap) const {
+    const Rebind<int32_t, DF> di;
+    return ConvertTo(df, BitCast(di, LoadU16AsU32(df, in, swap)));
+  }
+};
+
+struct LoadF16 {
+  template <class DF>
+  Vec<DF> operator()(DF df, const uint8_t* in, bool swap) const {
+    const Rebind<uint32_t, DF> du;
+    const auto bits = LoadU16AsU32(df, in, swap);
+    const auto sign = ShiftLeft<16>(bits & Set(du, 0x8000));
+    // Moving exponent and mantissa into place and rescaling by 2^(127 - 15)
+    // handles subnormals as well, and matches LoadFloat16 for Inf and NaN.
+    const auto magnitude =
+        BitCast(df, ShiftLeft<13>(bits & Set(du, 0x7FFF))) *
+        Set(df, 5.192296858534828e+33f);
+    return Or(magnitude, BitCast(df, sign));
+  }
+};
+
+struct LoadF32 {
+  template <class DF>
+  Vec<DF> operator()(DF df, const uint8_t* in, bool swap) const {
+    const Rebind<uint32_t, DF> du;
+    auto v = LoadU(du, reinterpret_cast<const uint32_t*>(in));
+    if (swap) {
+      const auto mask = Set(du, 0xFF00FF00u);
+      v = (ShiftLeft<8>(v) & mask) | (ShiftRight<8>(v) & ShiftRight<8>(mask));
+      v = ShiftLeft<16>(v) | ShiftRight<16>(v);
+    }
+    return BitCast(df, v);
+  }
+};
+
+template <class Loader>
+void LoadSamples(const Loader& load, const uint8_t* in, size_t num,
+                 size_t bytes_per_sample, bool swap, float mul,
+                 float* JXL_RESTRICT out) {
+  const HWY_FULL(float) df;
+  const HWY_CAPPED(float, 1) d1;
+  const auto vmul = Set(df, mul);
+  size_t x = 0;
+  for (; x + Lanes(df) <= num; x += Lanes(df)) {
+    Store(load(df, in + x * bytes_per_sample, swap) * vmul, df, out + x);
+  }
+  for (; x < num; ++x) {
+    Store(load(d1, in + x * bytes_per_sample, swap) * Set(d1, mul), d1,
+          out + x);
+  }
 }
 
-float LoadBEFloat16(const uint8_t* p) {
-  uint16_t bits16 = LoadBE16(p);
-  return LoadFloat16(bits16);
+// Converts num consecutive samples at in to floats; integers are scaled to
+// the [0, 1] range.
+void ConvertSamples(const uint8_t* in, size_t num, size_t bits_per_sample,
+                    bool float_in, bool little_endian,
+                    float* JXL_RESTRICT out) {
+  const bool swap = little_endian != IsLittleEndian();
+  if (float_in) {
+    if (bits_per_sample == 16) {
+      LoadSamples(LoadF16(), in, num, 2, swap, 1.0f, out);
+    } else {
+      LoadSamples(LoadF32(), in, num, 4, swap, 1.0f, out);
+    }
+    return;
+  }
+  const float mul = 1. / ((1ull << bits_per_sample) - 1);
+  if (bits_per_sample <= 8) {
+    LoadSamples(LoadU8(), in, num, 1, swap, mul, out);
+  } else {
+    LoadSamples(LoadU16(), in, num, 2, swap, mul, out);
+  }
 }
 
-// Loads a float in big endian
-float LoadBEFloat(const uint8_t* p) {
-  float value;
-  const uint32_t u = LoadBE32(p);
-  memcpy(&value, &u, 4);
-  return value;
+// Returns 0.75 * a + 0.25 * b, the weights of the chroma upsampling of the
+// decoder, for num samples.
+void BlendChromaRows(const float* JXL_RESTRICT a, const float* JXL_RESTRICT b,
+                     size_t num, float* JXL_RESTRICT out) {
+  const HWY_FULL(float) df;
+  const HWY_CAPPED(float, 1) d1;
+  size_t x = 0;
+  for (; x + Lanes(df) <= num; x += Lanes(df)) {
+    const auto va = Load(df, a + x);
+    Store(MulAdd(Set(df, 0.25f), Load(df, b + x) - va, va), df, out + x);
+  }
+  for (; x < num; ++x) {
+    const auto va = Load(d1, a + x);
+    Store(MulAdd(Set(d1, 0.25f), Load(d1, b + x) - va, va), d1, out + x);
+  }
 }
 
-// Loads a float in little endian
-float LoadLEFloat(const uint8_t* p) {
-  float value;
-  const uint32_t u = LoadLE32(p);
-  memcpy(&value, &u, 4);
-  return value;
+// Full-range BT.601 as defined by JFIF, the inverse of RgbToYcbcr. The output
+// rows may alias the input rows.
+template <class DF>
+void YCbCrToRGB(DF df, const float* row_y, const float* row_cb,
+                const float* row_cr, size_t x, float chroma_offset,
+                float* row_r, float* row_g, float* row_b) {
+  const auto y = Load(df, row_y + x);
+  const auto cb = Load(df, row_cb + x) - Set(df, chroma_offset);
+  const auto cr = Load(df, row_cr + x) - Set(df, chroma_offset);
+  const auto r = MulAdd(Set(df, 1.402f), cr, y);
+  const auto g = MulAdd(Set(df, -0.299f * 1.402f / 0.587f), cr,
+                        MulAdd(Set(df, -0.114f * 1.772f / 0.587f), cb, y));
+  const auto b = MulAdd(Set(df, 1.772f), cb, y);
+  Store(r, df, row_r + x);
+  Store(g, df, row_g + x);
+  Store(b, df, row_b + x);
 }
 
-typedef uint32_t(LoadFuncType)(const uint8_t* p);
-template <LoadFuncType LoadFunc>
-void JXL_INLINE LoadFloatRow(float* JXL_RESTRICT row_out, const uint8_t* in,
-                             float mul, size_t xsize, size_t bytes_per_pixel) {
-  size_t i = 0;
-  for (size_t x = 0; x < xsize; ++x) {
-    row_out[x] = mul * LoadFunc(in + i);
-    i += bytes_per_pixel;
+void YCbCrRowToRGB(const float* row_y, const float* row_cb,
+                   const float* row_cr, size_t xsize, float chroma_offset,
+                   float* row_r, float* row_g, float* row_b) {
+  const HWY_FULL(float) df;
+  const HWY_CAPPED(float, 1) d1;
+  size_t x = 0;
+  for (; x + Lanes(df) <= xsize; x += Lanes(df)) {
+    YCbCrToRGB(df, row_y, row_cb, row_cr, x, chroma_offset, row_r, row_g,
+               row_b);
+  }
+  for (; x < xsize; ++x) {
+    YCbCrToRGB(d1, row_y, row_cb, row_cr, x, chroma_offset, row_r, row_g,
+               row_b);
   }
 }
 
-uint32_t JXL_INLINE Load8(const uint8_t* p) { return *p; }
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+
+namespace jxl {
+
+HWY_EXPORT(ConvertSamples);
+HWY_EXPORT(BlendChromaRows);
+HWY_EXPORT(YCbCrRowToRGB);
+
+namespace {
+
+// Converts one interleaved row of xsize pixels with the given number of
+// channels to planar rows. rows_out[c] may be nullptr to skip channel c.
+// buffer must hold xsize * channels floats unless channels is 1.
+void ConvertInterleavedRow(const uint8_t* in, size_t xsize, size_t channels,
+                           size_t bits_per_sample, bool float_in,
+                           bool little_endian, float* JXL_RESTRICT buffer,
+                           float* const* rows_out) {
+  if (channels == 1) {
+    HWY_DYNAMIC_DISPATCH(ConvertSamples)
+    (in, xsize, bits_per_sample, float_in, little_endian, rows_out[0]);
+    return;
+  }
+  HWY_DYNAMIC_DISPATCH(ConvertSamples)
+  (in, xsize * channels, bits_per_sample, float_in, little_endian, buffer);
+  for (size_t c = 0; c < channels; ++c) {
+    float* JXL_RESTRICT row_out = rows_out[c];
+    if (row_out == nullptr) continue;
+    for (size_t x = 0; x < xsize; ++x) {
+      row_out[x] = buffer[x * channels + c];
+    }
+  }
+}
 
 Status PixelFormatToExternal(const JxlPixelFormat& pixel_format,
                              size_t* bitdepth, bool* float_in) {
@@ -134,62 +272,16 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
       (endianness == JXL_NATIVE_ENDIAN && IsLittleEndian());
 
   const uint8_t* const in = bytes.data();
-  if (float_in) {
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-        [&](const uint32_t task, size_t /*thread*/) {
-          const size_t y = task;
-          size_t i = row_size * task;
-          float* JXL_RESTRICT row_out = channel->Row(y);
-          if (bits_per_sample == 16) {
-            if (little_endian) {
-              for (size_t x = 0; x < xsize; ++x) {
-                row_out[x] = LoadLEFloat16(in + i);
-                i += bytes_per_pixel;
-              }
-            } else {
-              for (size_t x = 0; x < xsize; ++x) {
-                row_out[x] = LoadBEFloat16(in + i);
-                i += bytes_per_pixel;
-              }
-            }
-          } else {
-            if (little_endian) {
-              for (size_t x = 0; x < xsize; ++x) {
-                row_out[x] = LoadLEFloat(in + i);
-                i += bytes_per_pixel;
-              }
-            } else {
-              for (size_t x = 0; x < xsize; ++x) {
-                row_out[x] = LoadBEFloat(in + i);
-                i += bytes_per_pixel;
-              }
-            }
-          }
-        },
-        "ConvertExtraChannelFloat"));
-  } else {
-    float mul = 1. / ((1ull << bits_per_sample) - 1);
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-        [&](const uint32_t task, size_t /*thread*/) {
-          const size_t y = task;
-          size_t i = row_size * task;
-          float* JXL_RESTRICT row_out = channel->Row(y);
-          if (bits_per_sample <= 8) {
-            LoadFloatRow<Load8>(row_out, in + i, mul, xsize, bytes_per_pixel);
-          } else {
-            if (little_endian) {
-              LoadFloatRow<LoadLE16>(row_out, in + i, mul, xsize,
-                                     bytes_per_pixel);
-            } else {
-              LoadFloatRow<LoadBE16>(row_out, in + i, mul, xsize,
-                                     bytes_per_pixel);
-            }
-          }
-        },
-        "ConvertExtraChannelUint"));
-  }
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t y = task;
+        float* row_out = channel->Row(y);
+        ConvertInterleavedRow(in + row_size * y, xsize, /*channels=*/1,
+                              bits_per_sample, float_in, little_endian,
+                              /*buffer=*/nullptr, &row_out);
+      },
+      "ConvertExtraChannel"));
 
   return true;
 }
@@ -209,6 +301,9 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
                        " color channels, received only %" PRIuS " channels",
                        color_channels, channels);
   }
+  if (channels > 4) {
+    return JXL_FAILURE("Too many channels: %" PRIuS, channels);
+  }
 
   const size_t bytes_per_channel = DivCeil(bits_per_sample, jxl::kBitsPerByte);
   const size_t bytes_per_pixel = channels * bytes_per_channel;
@@ -242,144 +337,41 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
   const uint8_t* const in = bytes.data();
 
   Image3F color(xsize, ysize);
-
-  const auto get_y = [flipped_y, ysize](const size_t y) {
-    return flipped_y ? ysize - 1 - y : y;
-  };
-
-  if (float_in) {
-    for (size_t c = 0; c < color_channels; ++c) {
-      JXL_RETURN_IF_ERROR(RunOnPool(
-          pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-          [&](const uint32_t task, size_t /*thread*/) {
-            const size_t y = get_y(task);
-            size_t i =
-                row_size * task + (c * bits_per_sample / jxl::kBitsPerByte);
-            float* JXL_RESTRICT row_out = color.PlaneRow(c, y);
-            if (bits_per_sample == 16) {
-              if (little_endian) {
-                for (size_t x = 0; x < xsize; ++x) {
-                  row_out[x] = LoadLEFloat16(in + i);
-                  i += bytes_per_pixel;
-                }
-              } else {
-                for (size_t x = 0; x < xsize; ++x) {
-                  row_out[x] = LoadBEFloat16(in + i);
-                  i += bytes_per_pixel;
-                }
-              }
-            } else {
-              if (little_endian) {
-                for (size_t x = 0; x < xsize; ++x) {
-                  row_out[x] = LoadLEFloat(in + i);
-                  i += bytes_per_pixel;
-                }
-              } else {
-                for (size_t x = 0; x < xsize; ++x) {
-                  row_out[x] = LoadBEFloat(in + i);
-                  i += bytes_per_pixel;
-                }
-              }
-            }
-          },
-          "ConvertRGBFloat"));
-    }
-  } else {
-    // Multiplier to convert from the integer range to floating point 0-1 range.
-    float mul = 1. / ((1ull << bits_per_sample) - 1);
-    for (size_t c = 0; c < color_channels; ++c) {
-      JXL_RETURN_IF_ERROR(RunOnPool(
-          pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-          [&](const uint32_t task, size_t /*thread*/) {
-            const size_t y = get_y(task);
-            size_t i = row_size * task + c * bytes_per_channel;
-            float* JXL_RESTRICT row_out = color.PlaneRow(c, y);
-            if (bits_per_sample <= 8) {
-              LoadFloatRow<Load8>(row_out, in + i, mul, xsize, bytes_per_pixel);
-            } else {
-              if (little_endian) {
-                LoadFloatRow<LoadLE16>(row_out, in + i, mul, xsize,
-                                       bytes_per_pixel);
-              } else {
-                LoadFloatRow<LoadBE16>(row_out, in + i, mul, xsize,
-                                       bytes_per_pixel);
-              }
-            }
-          },
-          "ConvertRGBUint"));
-    }
-  }
-
-  if (color_channels == 1) {
-    CopyImageTo(color.Plane(0), &color.Plane(1));
-    CopyImageTo(color.Plane(0), &color.Plane(2));
-  }
-
-  ib->SetFromImage(std::move(color), c_current);
-
   // Passing an interleaved image with an alpha channel to an image that doesn't
   // have alpha channel just discards the passed alpha channel.
-  if (has_alpha && ib->HasAlpha()) {
-    ImageF alpha(xsize, ysize);
-
-    if (float_in) {
-      JXL_RETURN_IF_ERROR(RunOnPool(
-          pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-          [&](const uint32_t task, size_t /*thread*/) {
-            const size_t y = get_y(task);
-            size_t i = row_size * task +
-                       ((channels - 1) * bits_per_sample / jxl::kBitsPerByte);
-            float* JXL_RESTRICT row_out = alpha.Row(y);
-            if (bits_per_sample == 16) {
-              if (little_endian) {
-                for (size_t x = 0; x < xsize; ++x) {
-                  row_out[x] = LoadLEFloat16(in + i);
-                  i += bytes_per_pixel;
-                }
-              } else {
-                for (size_t x = 0; x < xsize; ++x) {
-                  row_out[x] = LoadBEFloat16(in + i);
-                  i += bytes_per_pixel;
-                }
-              }
-            } else {
-              if (little_endian) {
-                for (size_t x = 0; x < xsize; ++x) {
-                  row_out[x] = LoadLEFloat(in + i);
-                  i += bytes_per_pixel;
-                }
-              } else {
-                for (size_t x = 0; x < xsize; ++x) {
-                  row_out[x] = LoadBEFloat(in + i);
-                  i += bytes_per_pixel;
-                }
-              }
-            }
-          },
-          "ConvertAlphaFloat"));
-    } else {
-      float mul = 1. / ((1ull << bits_per_sample) - 1);
-      JXL_RETURN_IF_ERROR(RunOnPool(
-          pool, 0, static_cast<uint32_t>(ysize), ThreadPool::NoInit,
-          [&](const uint32_t task, size_t /*thread*/) {
-            const size_t y = get_y(task);
-            size_t i = row_size * task + (channels - 1) * bytes_per_channel;
-            float* JXL_RESTRICT row_out = alpha.Row(y);
-            if (bits_per_sample <= 8) {
-              LoadFloatRow<Load8>(row_out, in + i, mul, xsize, bytes_per_pixel);
-            } else {
-              if (little_endian) {
-                LoadFloatRow<LoadLE16>(row_out, in + i, mul, xsize,
-                                       bytes_per_pixel);
-              } else {
-                LoadFloatRow<LoadBE16>(row_out, in + i, mul, xsize,
-                                       bytes_per_pixel);
-              }
-            }
-          },
-          "ConvertAlphaUint"));
-    }
+  const bool want_alpha = has_alpha && ib->HasAlpha();
+  ImageF alpha;
+  if (want_alpha) alpha = ImageF(xsize, ysize);
+
+  // Each thread converts whole interleaved rows into its row of the buffer,
+  // which is then split into the planes.
+  ImageF buffers;
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, static_cast<uint32_t>(ysize),
+      [&](const size_t num_threads) {
+        if (channels > 1) buffers = ImageF(xsize * channels, num_threads);
+        return true;
+      },
+      [&](const uint32_t task, size_t thread) {
+        const size_t y = flipped_y ? ysize - 1 - task : task;
+        float* rows_out[4] = {};
+        for (size_t c = 0; c < color_channels; ++c) {
+          rows_out[c] = color.PlaneRow(c, y);
+        }
+        if (want_alpha) rows_out[channels - 1] = alpha.Row(y);
+        ConvertInterleavedRow(in + row_size * task, xsize, channels,
+                              bits_per_sample, float_in, little_endian,
+                              channels > 1 ? buffers.Row(thread) : nullptr,
+                              rows_out);
+        if (color_channels == 1) {
+          memcpy(color.PlaneRow(1, y), rows_out[0], xsize * sizeof(float));
+          memcpy(color.PlaneRow(2, y), rows_out[0], xsize * sizeof(float));
+        }
+      },
+      "ConvertFromExternal"));
 
+  ib->SetFromImage(std::move(color), c_current);
+  if (want_alpha) {
     ib->SetAlpha(std::move(alpha), alpha_is_premultiplied);
   } else if (!has_alpha && ib->HasAlpha()) {
     // if alpha is not passed, but it is expected, then assume
@@ -429,4 +421,187 @@ Status BufferToImageBundle(const JxlPixelFormat& pixel_format, uint32_t xsize,
   return true;
 }
 
+size_t ExternalRowStride(const JxlPixelFormat& pixel_format, size_t xsize) {
+  size_t bitdepth;
+  bool float_in;
+  if (!PixelFormatToExternal(pixel_format, &bitdepth, &float_in)) return 0;
+  const size_t row_size =
+      xsize * pixel_format.num_channels * DivCeil(bitdepth, kBitsPerByte);
+  const size_t align = pixel_format.align;
+  return align > 1 ? DivCeil(row_size, align) * align : row_size;
+}
+
+void InitImageBundleForRows(const JxlPixelFormat& pixel_format, size_t xsize,
+                            size_t ysize, const jxl::ColorEncoding& c_current,
+                            jxl::ImageBundle* ib) {
+  ib->SetFromImage(Image3F(xsize, ysize), c_current);
+  if (ib->HasAlpha()) {
+    ImageF alpha(xsize, ysize);
+    if (pixel_format.num_channels != 2 && pixel_format.num_channels != 4) {
+      FillImage(1.0f, &alpha);
+    }
+    ib->SetAlpha(std::move(alpha), /*alpha_is_premultiplied=*/false);
+  }
+}
+
+Status BufferToImageBundleRows(const JxlPixelFormat& pixel_format, size_t y0,
+                               size_t num_rows, const void* buffer, size_t size,
+                               jxl::ThreadPool* pool, jxl::ImageBundle* ib) {
+  size_t bitdepth;
+  bool float_in;
+  JXL_RETURN_IF_ERROR(
+      PixelFormatToExternal(pixel_format, &bitdepth, &float_in));
+  const size_t xsize = ib->xsize();
+  const size_t ysize = ib->ysize();
+  if (num_rows == 0 || y0 + num_rows > ysize) {
+    return JXL_FAILURE("Invalid row range");
+  }
+  const size_t channels = pixel_format.num_channels;
+  const size_t color_channels = ib->c_current().Channels();
+  if (channels < color_channels) {
+    return JXL_FAILURE("Expected %" PRIuS
+                       " color channels, received only %" PRIuS " channels",
+                       color_channels, channels);
+  }
+  if (channels > 4) {
+    return JXL_FAILURE("Too many channels: %" PRIuS, channels);
+  }
+  const size_t bytes_per_channel = DivCeil(bitdepth, kBitsPerByte);
+  const size_t bytes_per_pixel = channels * bytes_per_channel;
+  const size_t row_size = ExternalRowStride(pixel_format, xsize);
+  if (size < row_size * (num_rows - 1) + xsize * bytes_per_pixel) {
+    return JXL_FAILURE("Buffer size is too small for %" PRIuS " rows",
+                       num_rows);
+  }
+  const bool little_endian =
+      pixel_format.endianness == JXL_LITTLE_ENDIAN ||
+      (pixel_format.endianness == JXL_NATIVE_ENDIAN && IsLittleEndian());
+  const bool has_alpha = (channels == 2 || channels == 4) && ib->HasAlpha();
+  const uint8_t* const in = static_cast<const uint8_t*>(buffer);
+  Image3F* color = ib->color();
+  ImageF* alpha = has_alpha ? ib->alpha() : nullptr;
+
+  ImageF buffers;
+  return RunOnPool(
+      pool, 0, static_cast<uint32_t>(num_rows),
+      [&](const size_t num_threads) {
+        if (channels > 1) buffers = ImageF(xsize * channels, num_threads);
+        return true;
+      },
+      [&](const uint32_t task, size_t thread) {
+        const size_t y = y0 + task;
+        float* rows_out[4] = {};
+        for (size_t c = 0; c < color_channels; ++c) {
+          rows_out[c] = color->PlaneRow(c, y);
+        }
+        if (alpha) rows_out[channels - 1] = alpha->Row(y);
+        ConvertInterleavedRow(in + row_size * task, xsize, channels, bitdepth,
+                              float_in, little_endian,
+                              channels > 1 ? buffers.Row(thread) : nullptr,
+                              rows_out);
+        if (color_channels == 1) {
+          memcpy(color->PlaneRow(1, y), rows_out[0], xsize * sizeof(float));
+          memcpy(color->PlaneRow(2, y), rows_out[0], xsize * sizeof(float));
+        }
+      },
+      "ConvertRows");
+}
+
+Status ConvertFromYCbCrPlanes(const uint8_t* const planes[3],
+                              const size_t strides[3], size_t bits_per_sample,
+                              size_t chroma_shift_x, size_t chroma_shift_y,
+                              size_t xsize, size_t ysize,
+                              const ColorEncoding& c_current, ThreadPool* pool,
+                              ImageBundle* ib) {
+  if (bits_per_sample != 8 && bits_per_sample != 16) {
+    return JXL_FAILURE("YCbCr samples must have 8 or 16 bits");
+  }
+  if (chroma_shift_x > 1 || chroma_shift_y > 1) {
+    return JXL_FAILURE("Unsupported chroma subsampling");
+  }
+  if (xsize == 0 || ysize == 0) return JXL_FAILURE("Empty image");
+  if (c_current.Channels() != 3) {
+    return JXL_FAILURE("YCbCr input requires a color image");
+  }
+  const size_t bytes_per_sample = bits_per_sample / kBitsPerByte;
+  const size_t cxsize = DivCeil(xsize, size_t{1} << chroma_shift_x);
+  const size_t cysize = DivCeil(ysize, size_t{1} << chroma_shift_y);
+  for (size_t c = 0; c < 3; ++c) {
+    const size_t plane_xsize = c == 0 ? xsize : cxsize;
+    if (planes[c] == nullptr || strides[c] < plane_xsize * bytes_per_sample) {
+      return JXL_FAILURE("Invalid plane %" PRIuS, c);
+    }
+  }
+  const float chroma_offset =
+      (1u << (bits_per_sample - 1)) / ((1u << bits_per_sample) - 1.0f);
+  const bool little_endian = IsLittleEndian();
+
+  Image3F color(xsize, ysize);
+  // Per thread, for each chroma plane: the chroma row of the output row, its
+  // vertical neighbour and their blend.
+  ImageF buffers;
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, static_cast<uint32_t>(ysize),
+      [&](const size_t num_threads) {
+        buffers = ImageF(cxsize, 6 * num_threads);
+        return true;
+      },
+      [&](const uint32_t task, size_t thread) {
+        const size_t y = task;
+        float* row_r = color.PlaneRow(0, y);
+        float* row_g = color.PlaneRow(1, y);
+        float* row_b = color.PlaneRow(2, y);
+        // Y, Cb and Cr are converted into R, B and G, then transformed in
+        // place.
+        HWY_DYNAMIC_DISPATCH(ConvertSamples)
+        (planes[0] + strides[0] * y, xsize, bits_per_sample,
+         /*float_in=*/false, little_endian, row_r);
+        float* const chroma_out[2] = {row_b, row_g};
+        const size_t cy = y >> chroma_shift_y;
+        const size_t neighbour_cy = (y & 1) ? std::min(cy + 1, cysize - 1)
+                                            : (cy == 0 ? 0 : cy - 1);
+        for (size_t c = 1; c < 3; ++c) {
+          const size_t buffer_y = 6 * thread + 3 * (c - 1);
+          float* row = buffers.Row(buffer_y);
+          HWY_DYNAMIC_DISPATCH(ConvertSamples)
+          (planes[c] + strides[c] * cy, cxsize, bits_per_sample,
+           /*float_in=*/false, little_endian, row);
+          if (chroma_shift_y != 0) {
+            float* neighbour = buffers.Row(buffer_y + 1);
+            float* blend = buffers.Row(buffer_y + 2);
+            HWY_DYNAMIC_DISPATCH(ConvertSamples)
+            (planes[c] + strides[c] * neighbour_cy, cxsize, bits_per_sample,
+             /*float_in=*/false, little_endian, neighbour);
+            HWY_DYNAMIC_DISPATCH(BlendChromaRows)
+            (row, neighbour, cxsize, blend);
+            row = blend;
+          }
+          float* JXL_RESTRICT row_out = chroma_out[c - 1];
+          if (chroma_shift_x == 0) {
+            memcpy(row_out, row, xsize * sizeof(float));
+            continue;
+          }
+          for (size_t x = 0; x < xsize; ++x) {
+            const size_t cx = x >> 1;
+            const size_t neighbour_cx = (x & 1) ? std::min(cx + 1, cxsize - 1)
+                                                : (cx == 0 ? 0 : cx - 1);
+            row_out[x] = 0.75f * row[cx] + 0.25f * row[neighbour_cx];
+          }
+        }
+        HWY_DYNAMIC_DISPATCH(YCbCrRowToRGB)
+        (row_r, row_b, row_g, xsize, chroma_offset, row_r, row_g, row_b);
+      },
+      "ConvertFromYCbCr"));
+
+  ib->SetFromImage(std::move(color), c_current);
+  if (ib->HasAlpha()) {
+    ImageF alpha(xsize, ysize);
+    FillImage(1.0f, &alpha);
+    ib->SetAlpha(std::move(alpha), /*alpha_is_premultiplied=*/false);
+  }
+  ib->VerifyMetadata();
+  return true;
+}
+
 }  // namespace jxl
+#endif  // HWY_ONCE
@@ -43,6 +43,38 @@ Status BufferToImageBundle(const JxlPixelFormat& pixel_format, uint32_t xsize,
                            const jxl::ColorEncoding& c_current,
                            jxl::ImageBundle* ib);
 
+// Allocates the color (and, if the metadata has one, alpha) planes of ib for a
+// frame of the given size, to be filled in later by BufferToImageBundleRows.
+// Alpha is initialized to opaque in case the pixel format does not carry it.
+void InitImageBundleForRows(const JxlPixelFormat& pixel_format, size_t xsize,
+                            size_t ysize, const jxl::ColorEncoding& c_current,
+                            jxl::ImageBundle* ib);
+
+// Converts a strip of num_rows interleaved rows, which will be stored at rows
+// [y0, y0 + num_rows) of ib, into the planes allocated by
+// InitImageBundleForRows. The buffer only holds the rows of the strip, with the
+// stride implied by pixel_format.
+Status BufferToImageBundleRows(const JxlPixelFormat& pixel_format, size_t y0,
+                               size_t num_rows, const void* buffer, size_t size,
+                               jxl::ThreadPool* pool, jxl::ImageBundle* ib);
+
+// Converts planes of full-range YCbCr samples as defined by JFIF, in the order
+// Y, Cb, Cr, to the nonlinear RGB of c_current in ib, in a single pass. The
+// chroma planes have DivCeil(xsize, 1 << chroma_shift_x) by
+// DivCeil(ysize, 1 << chroma_shift_y) samples and are upsampled with the
+// weights the decoder uses for subsampled frames. Samples are unsigned
+// integers of 8 or 16 bits in native byte order; strides are in bytes.
+Status ConvertFromYCbCrPlanes(const uint8_t* const planes[3],
+                              const size_t strides[3], size_t bits_per_sample,
+                              size_t chroma_shift_x, size_t chroma_shift_y,
+                              size_t xsize, size_t ysize,
+                              const ColorEncoding& c_current, ThreadPool* pool,
+                              ImageBundle* ib);
+
+// Returns the stride in bytes of a row of xsize pixels in pixel_format, or 0
+// if the pixel format is not supported.
+size_t ExternalRowStride(const JxlPixelFormat& pixel_format, size_t xsize);
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_ENC_EXTERNAL_IMAGE_H_
@@ -5,10 +5,15 @@
 
 #include "lib/jxl/enc_external_image.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <array>
 #include <new>
+#include <vector>
 
 #include "gtest/gtest.h"
+#include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/thread_pool_internal.h"
@@ -65,5 +70,129 @@ TEST(ExternalImageTest, AlphaMissing) {
   EXPECT_FALSE(ib.HasAlpha());
 }
 
+// Converts an RGBA image whose width is not a multiple of the vector size from
+// each sample type and byte order.
+TEST(ExternalImageTest, SampleTypes) {
+  const size_t xsize = 13;
+  const size_t ysize = 3;
+  const size_t num_samples = xsize * ysize * 4;
+  // 1, -2, the smallest subnormal and the largest finite float16 value.
+  const uint16_t f16_bits[4] = {0x3C00, 0xC000, 0x0001, 0x7BFF};
+  const float f16_values[4] = {1.0f, -2.0f, 5.9604645e-8f, 65504.0f};
+  const float u16_mul = 1. / 65535;
+
+  for (int type = 0; type < 4; ++type) {
+    const bool float_in = type >= 2;
+    const size_t bits_per_sample = type == 3 ? 32 : 16;
+    const JxlEndianness endianness =
+        type % 2 == 0 ? JXL_BIG_ENDIAN : JXL_LITTLE_ENDIAN;
+    std::vector<uint8_t> buf(num_samples * bits_per_sample / 8);
+    std::vector<float> expected(num_samples);
+    for (size_t i = 0; i < num_samples; ++i) {
+      if (type == 0) {
+        StoreBE16(i * 300, &buf[2 * i]);
+        expected[i] = (i * 300) * u16_mul;
+      } else if (type == 1) {
+        StoreLE16(i + 1, &buf[2 * i]);
+        expected[i] = (i + 1) * u16_mul;
+      } else if (type == 2) {
+        StoreBE16(f16_bits[i % 4], &buf[2 * i]);
+        expected[i] = f16_values[i % 4];
+      } else {
+        const float value = i * -0.75f;
+        uint32_t value_bits;
+        memcpy(&value_bits, &value, 4);
+        StoreLE32(value_bits, &buf[4 * i]);
+        expected[i] = value;
+      }
+    }
+
+    ImageMetadata im;
+    im.SetAlphaBits(16);
+    ImageBundle ib(&im);
+    ThreadPoolInternal pool(4);
+    ASSERT_TRUE(ConvertFromExternal(
+        Span<const uint8_t>(buf.data(), buf.size()), xsize, ysize,
+        /*c_current=*/ColorEncoding::SRGB(), /*channels=*/4,
+        /*alpha_is_premultiplied=*/false, bits_per_sample, endianness,
+        /*flipped_y=*/false, &pool, &ib, float_in, /*align=*/0));
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        const size_t i = (y * xsize + x) * 4;
+        for (size_t c = 0; c < 3; ++c) {
+          EXPECT_EQ(expected[i + c], ib.color()->PlaneRow(c, y)[x])
+              << "type " << type << " x " << x << " y " << y << " c " << c;
+        }
+        EXPECT_EQ(expected[i + 3], ib.alpha()->Row(y)[x])
+            << "type " << type << " x " << x << " y " << y;
+      }
+    }
+  }
+}
+
+TEST(ExternalImageTest, YCbCrPlanes) {
+  const size_t xsize = 13;
+  const size_t ysize = 7;
+  // 4:2:0, with padding at the end of the rows.
+  const size_t cxsize = 7;
+  const size_t cysize = 4;
+  const size_t strides[3] = {xsize + 3, cxsize + 1, cxsize + 1};
+  std::vector<uint8_t> planes[3];
+  planes[0].resize(strides[0] * ysize);
+  for (size_t c = 1; c < 3; ++c) planes[c].resize(strides[c] * cysize);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      planes[0][y * strides[0] + x] = 20 + 15 * x + 3 * y;
+    }
+  }
+  for (size_t c = 1; c < 3; ++c) {
+    for (size_t y = 0; y < cysize; ++y) {
+      for (size_t x = 0; x < cxsize; ++x) {
+        planes[c][y * strides[c] + x] = 50 * c + 11 * x + 17 * y;
+      }
+    }
+  }
+  // Chroma upsampling with the weights of the decoder, mirrored at the edges.
+  const auto upsampled = [&](size_t c, size_t x, size_t y) {
+    const size_t cx = x / 2;
+    const size_t ncx =
+        (x & 1) ? std::min(cx + 1, cxsize - 1) : (cx == 0 ? 0 : cx - 1);
+    const size_t cy = y / 2;
+    const size_t ncy =
+        (y & 1) ? std::min(cy + 1, cysize - 1) : (cy == 0 ? 0 : cy - 1);
+    const auto sample = [&](size_t sx, size_t sy) {
+      return planes[c][sy * strides[c] + sx] / 255.0f;
+    };
+    const float row = 0.75f * sample(cx, cy) + 0.25f * sample(ncx, cy);
+    const float nrow = 0.75f * sample(cx, ncy) + 0.25f * sample(ncx, ncy);
+    return 0.75f * row + 0.25f * nrow - 128.0f / 255;
+  };
+
+  ImageMetadata im;
+  ImageBundle ib(&im);
+  ThreadPoolInternal pool(4);
+  const uint8_t* plane_ptrs[3] = {planes[0].data(), planes[1].data(),
+                                  planes[2].data()};
+  ASSERT_TRUE(ConvertFromYCbCrPlanes(plane_ptrs, strides, /*bits=*/8,
+                                     /*chroma_shift_x=*/1,
+                                     /*chroma_shift_y=*/1, xsize, ysize,
+                                     ColorEncoding::SRGB(), &pool, &ib));
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      const float luma = planes[0][y * strides[0] + x] / 255.0f;
+      const float cb = upsampled(1, x, y);
+      const float cr = upsampled(2, x, y);
+      const float expected[3] = {
+          luma + 1.402f * cr,
+          luma - 0.114f * 1.772f / 0.587f * cb - 0.299f * 1.402f / 0.587f * cr,
+          luma + 1.772f * cb};
+      for (size_t c = 0; c < 3; ++c) {
+        EXPECT_NEAR(expected[c], ib.color()->PlaneRow(c, y)[x], 1e-5)
+            << "x " << x << " y " << y << " c " << c;
+      }
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jxl
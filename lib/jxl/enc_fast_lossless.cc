@@ -3,7 +3,7 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
-#include "fast_lossless.h"
+#include "lib/jxl/enc_fast_lossless.h"
 
 #include <assert.h>
 #include <stdint.h>
@@ -16,10 +16,23 @@
 #include <queue>
 #include <vector>
 
-#if (!defined(__BYTE_ORDER__) || (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__))
-#error "system not known to be little endian"
+#ifdef FASTLL_ENABLE_AVX2_INTRINSICS
+#include <immintrin.h>
+#endif
+#ifdef FASTLL_ENABLE_NEON_INTRINSICS
+#include <arm_neon.h>
+#endif
+
+// The bit writer and the pixel loads below assume a little endian system. On
+// other systems, JxlFastLosslessEncode fails and callers use another encoder.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define FASTLL_LITTLE_ENDIAN 1
+#else
+#define FASTLL_LITTLE_ENDIAN 0
 #endif
 
+namespace {
+
 struct BitWriter {
   void Allocate(size_t maximum_bit_size) {
     assert(data == nullptr);
@@ -143,7 +156,7 @@ struct PrefixCode {
   static void ComputeCodeLengths(uint64_t* freqs, size_t n, size_t limit,
                                  uint8_t* nbits) {
     if (n <= 1) return;
-    assert(n <= (1 << limit));
+    assert(n <= (size_t{1} << limit));
     assert(n <= 32);
     int parent[64] = {};
     int height[64] = {};
@@ -173,7 +186,7 @@ struct PrefixCode {
       bool is_ok = true;
       for (size_t i = num_nodes - 1; i-- > 0;) {
         height[i] = height[parent[i]] + 1;
-        is_ok &= height[i] <= limit;
+        is_ok &= height[i] <= static_cast<int>(limit);
       }
       if (is_ok) {
         num_nodes = 0;
@@ -296,23 +309,11 @@ void AppendWriter(BitWriter* dest, const BitWriter* src) {
   dest->Write(src->bits_in_buffer, src->buffer);
 }
 
-void AssembleFrame(size_t width, size_t height, size_t nb_chans,
-                   size_t bitdepth,
-                   const std::vector<std::array<BitWriter, 4>>& group_data,
-                   BitWriter* output) {
-  size_t total_size_groups = 0;
-  std::vector<size_t> group_sizes(group_data.size());
-  for (size_t i = 0; i < group_data.size(); i++) {
-    size_t sz = 0;
-    for (size_t j = 0; j < nb_chans; j++) {
-      const auto& writer = group_data[i][j];
-      sz += writer.bytes_written * 8 + writer.bits_in_buffer;
-    }
-    sz = (sz + 7) / 8;
-    group_sizes[i] = sz;
-    total_size_groups += sz * 8;
-  }
-  output->Allocate(1000 + group_data.size() * 32 + total_size_groups);
+// Writes the signature and the image headers of an sRGB or grayscale image,
+// with an optional alpha channel.
+void WriteImageHeader(size_t width, size_t height, size_t nb_chans,
+                      size_t bitdepth, BitWriter* output) {
+  bool have_alpha = (nb_chans == 2 || nb_chans == 4);
 
   // Signature
   output->Write(16, 0x0AFF);
@@ -359,7 +360,6 @@ void AssembleFrame(size_t width, size_t height, size_t nb_chans,
     output->Write(6, bitdepth - 1);
   }
   output->Write(1, 1);  // 16-bit-buffer sufficient
-  bool have_alpha = (nb_chans == 2 || nb_chans == 4);
   if (have_alpha) {
     output->Write(2, 0b01);  // One extra channel
     output->Write(1, 1);     // ... all_default (ie. 8-bit alpha)
@@ -385,6 +385,38 @@ void AssembleFrame(size_t width, size_t height, size_t nb_chans,
 
   // No ICC, no preview. Frame should start at byte boundery.
   output->ZeroPadToByte();
+}
+
+// Returns the size in bytes of each section.
+std::vector<size_t> GroupSizes(
+    size_t nb_chans, const std::vector<std::array<BitWriter, 4>>& group_data) {
+  std::vector<size_t> group_sizes(group_data.size());
+  for (size_t i = 0; i < group_data.size(); i++) {
+    size_t sz = 0;
+    for (size_t j = 0; j < nb_chans; j++) {
+      const auto& writer = group_data[i][j];
+      sz += writer.bytes_written * 8 + writer.bits_in_buffer;
+    }
+    group_sizes[i] = (sz + 7) / 8;
+  }
+  return group_sizes;
+}
+
+// Maximum size in bits of what WriteFrameStart writes for `num_groups`
+// sections.
+size_t MaxFrameStartBits(size_t num_groups) { return 1000 + num_groups * 32; }
+
+// Writes the image headers unless frame_only, the frame header and the TOC of
+// the sections of `group_sizes` bytes.
+void WriteFrameStart(size_t width, size_t height, size_t nb_chans,
+                     size_t bitdepth, bool frame_only,
+                     const std::vector<size_t>& group_sizes,
+                     BitWriter* output) {
+  bool have_alpha = (nb_chans == 2 || nb_chans == 4);
+
+  if (!frame_only) {
+    WriteImageHeader(width, height, nb_chans, bitdepth, output);
+  }
 
   auto wsz_fh = [output](size_t size) {
     if (size < (1 << 8)) {
@@ -438,7 +470,7 @@ void AssembleFrame(size_t width, size_t height, size_t nb_chans,
 
   output->Write(1, 0);      // No TOC permutation
   output->ZeroPadToByte();  // TOC is byte-aligned.
-  for (size_t i = 0; i < group_data.size(); i++) {
+  for (size_t i = 0; i < group_sizes.size(); i++) {
     size_t sz = group_sizes[i];
     if (sz < (1 << 10)) {
       output->Write(2, 0b00);
@@ -455,6 +487,19 @@ void AssembleFrame(size_t width, size_t height, size_t nb_chans,
     }
   }
   output->ZeroPadToByte();  // Groups are byte-aligned.
+}
+
+void AssembleFrame(size_t width, size_t height, size_t nb_chans,
+                   size_t bitdepth, bool frame_only,
+                   const std::vector<std::array<BitWriter, 4>>& group_data,
+                   BitWriter* output) {
+  std::vector<size_t> group_sizes = GroupSizes(nb_chans, group_data);
+  size_t total_size_groups = 0;
+  for (size_t sz : group_sizes) total_size_groups += sz * 8;
+  output->Allocate(MaxFrameStartBits(group_data.size()) + total_size_groups);
+
+  WriteFrameStart(width, height, nb_chans, bitdepth, frame_only, group_sizes,
+                  output);
 
   for (size_t i = 0; i < group_data.size(); i++) {
     for (size_t j = 0; j < nb_chans; j++) {
@@ -464,6 +509,36 @@ void AssembleFrame(size_t width, size_t height, size_t nb_chans,
   }
 }
 
+// Same as AssembleFrame, but passes the output to write_output one section at
+// a time instead of copying it all together, and frees each section once it
+// is written. Returns the size of the output.
+size_t WriteFrame(size_t width, size_t height, size_t nb_chans,
+                  size_t bitdepth, bool frame_only,
+                  std::vector<std::array<BitWriter, 4>>* group_data,
+                  void* output_opaque,
+                  JxlFastLosslessOutputFunc* write_output) {
+  std::vector<size_t> group_sizes = GroupSizes(nb_chans, *group_data);
+  BitWriter start;
+  start.Allocate(MaxFrameStartBits(group_data->size()));
+  WriteFrameStart(width, height, nb_chans, bitdepth, frame_only, group_sizes,
+                  &start);
+  write_output(output_opaque, start.data.get(), start.bytes_written);
+  size_t total_size = start.bytes_written;
+
+  for (size_t i = 0; i < group_data->size(); i++) {
+    BitWriter section;
+    section.Allocate(group_sizes[i] * 8);
+    for (size_t j = 0; j < nb_chans; j++) {
+      AppendWriter(&section, &(*group_data)[i][j]);
+      (*group_data)[i][j] = BitWriter();
+    }
+    section.ZeroPadToByte();
+    write_output(output_opaque, section.data.get(), section.bytes_written);
+    total_size += section.bytes_written;
+  }
+  return total_size;
+}
+
 void PrepareDCGlobalCommon(bool is_single_group, size_t width, size_t height,
                            const PrefixCode& code, BitWriter* output) {
   output->Allocate(100000 + (is_single_group ? width * height * 16 : 0));
@@ -545,7 +620,38 @@ void EncodeHybridUint404_Mul16(uint32_t value, uint32_t* token_div16,
 }
 
 #ifdef FASTLL_ENABLE_AVX2_INTRINSICS
-#include <immintrin.h>
+// Writes the 4 codes of `bits`, of up to 64 bits each.
+void WriteBits64(__m256i nbits, __m256i bits, BitWriter& output) {
+  alignas(32) uint64_t nbits_simd[4] = {};
+  alignas(32) uint64_t bits_simd[4] = {};
+
+  _mm256_store_si256((__m256i*)nbits_simd, nbits);
+  _mm256_store_si256((__m256i*)bits_simd, bits);
+
+  // Manually merge the buffer bits with the SIMD bits.
+  // Necessary because Write() is only guaranteed to work with <=56 bits.
+  // Trying to SIMD-fy this code results in slower speed (and definitely less
+  // clarity).
+  for (size_t i = 0; i < 4; i++) {
+    output.buffer |= bits_simd[i] << output.bits_in_buffer;
+    memcpy(output.data.get() + output.bytes_written, &output.buffer, 8);
+    // If >> 64, next_buffer is unused.
+    uint64_t next_buffer = bits_simd[i] >> (64 - output.bits_in_buffer);
+    output.bits_in_buffer += nbits_simd[i];
+    // This `if` seems to be faster than using ternaries.
+    if (output.bits_in_buffer >= 64) {
+      output.buffer = next_buffer;
+      output.bits_in_buffer -= 64;
+      output.bytes_written += 8;
+    }
+  }
+  memcpy(output.data.get() + output.bytes_written, &output.buffer, 8);
+  size_t bytes_in_buffer = output.bits_in_buffer / 8;
+  output.bits_in_buffer -= bytes_in_buffer * 8;
+  output.buffer >>= bytes_in_buffer * 8;
+  output.bytes_written += bytes_in_buffer;
+}
+
 void EncodeChunk(const uint16_t* residuals, const PrefixCode& prefix_code,
                  BitWriter& output) {
   static_assert(kChunkSize == 16, "Chunk size must be 16");
@@ -635,42 +741,56 @@ void EncodeChunk(const uint16_t* residuals, const PrefixCode& prefix_code,
   nbits = _mm256_add_epi64(nbits_hi32, nbits_lo32);
   bits = _mm256_or_si256(_mm256_sllv_epi64(bits_hi32, nbits_lo32), bits_lo32);
 
-  alignas(32) uint64_t nbits_simd[4] = {};
-  alignas(32) uint64_t bits_simd[4] = {};
+  WriteBits64(nbits, bits, output);
+}
 
-  _mm256_store_si256((__m256i*)nbits_simd, nbits);
-  _mm256_store_si256((__m256i*)bits_simd, bits);
+// Same as EncodeChunk, for 8 residuals of up to 14 bits, as those of samples
+// of up to 12 bits, in 32-bit lanes.
+void EncodeChunk32(const uint16_t* residuals, const PrefixCode& prefix_code,
+                   BitWriter& output) {
+  auto value = _mm256_cvtepu16_epi32(_mm_load_si128((__m128i*)residuals));
+
+  // The exponent of the value as a float is 126 + token for non-zero values,
+  // and 0 for zero.
+  auto exponent = _mm256_srli_epi32(
+      _mm256_castps_si256(_mm256_cvtepi32_ps(value)), 23);
+  auto zero = _mm256_setzero_si256();
+  auto token = _mm256_max_epi32(
+      _mm256_sub_epi32(exponent, _mm256_set1_epi32(126)), zero);
+  auto nbits =
+      _mm256_max_epi32(_mm256_sub_epi32(token, _mm256_set1_epi32(1)), zero);
+  // Clears the leading bit, if any.
+  auto bits = _mm256_andnot_si256(
+      _mm256_sllv_epi32(_mm256_set1_epi32(1), nbits), value);
+
+  // Only the lowest byte of each lane indexes the tables.
+  auto token_masked = _mm256_or_si256(token, _mm256_set1_epi32(0xFFFFFF00));
+  auto huff_nbits =
+      _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+                              _mm_load_si128((__m128i*)prefix_code.raw_nbits)),
+                          token_masked);
+  auto huff_bits =
+      _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+                              _mm_load_si128((__m128i*)prefix_code.raw_bits)),
+                          token_masked);
 
-  // Manually merge the buffer bits with the SIMD bits.
-  // Necessary because Write() is only guaranteed to work with <=56 bits.
-  // Trying to SIMD-fy this code results in slower speed (and definitely less
-  // clarity).
-  {
-    for (size_t i = 0; i < 4; i++) {
-      output.buffer |= bits_simd[i] << output.bits_in_buffer;
-      memcpy(output.data.get() + output.bytes_written, &output.buffer, 8);
-      // If >> 64, next_buffer is unused.
-      uint64_t next_buffer = bits_simd[i] >> (64 - output.bits_in_buffer);
-      output.bits_in_buffer += nbits_simd[i];
-      // This `if` seems to be faster than using ternaries.
-      if (output.bits_in_buffer >= 64) {
-        output.buffer = next_buffer;
-        output.bits_in_buffer -= 64;
-        output.bytes_written += 8;
-      }
-    }
-    memcpy(output.data.get() + output.bytes_written, &output.buffer, 8);
-    size_t bytes_in_buffer = output.bits_in_buffer / 8;
-    output.bits_in_buffer -= bytes_in_buffer * 8;
-    output.buffer >>= bytes_in_buffer * 8;
-    output.bytes_written += bytes_in_buffer;
-  }
+  nbits = _mm256_add_epi32(nbits, huff_nbits);
+  bits = _mm256_or_si256(_mm256_sllv_epi32(bits, huff_nbits), huff_bits);
+
+  // Merge 32 -> 64 bit lanes.
+  auto nbits_hi32 = _mm256_srli_epi64(nbits, 32);
+  auto nbits_lo32 = _mm256_and_si256(nbits, _mm256_set1_epi64x(0xFFFFFFFF));
+  auto bits_hi32 = _mm256_srli_epi64(bits, 32);
+  auto bits_lo32 = _mm256_and_si256(bits, _mm256_set1_epi64x(0xFFFFFFFF));
+
+  nbits = _mm256_add_epi64(nbits_hi32, nbits_lo32);
+  bits = _mm256_or_si256(_mm256_sllv_epi64(bits_hi32, nbits_lo32), bits_lo32);
+
+  WriteBits64(nbits, bits, output);
 }
 #endif
 
 #ifdef FASTLL_ENABLE_NEON_INTRINSICS
-#include <arm_neon.h>
-
 void EncodeChunk(const uint16_t* residuals, const PrefixCode& code,
                  BitWriter& output) {
   uint16x8_t res = vld1q_u16(residuals);
@@ -706,6 +826,43 @@ void EncodeChunk(const uint16_t* residuals, const PrefixCode& code,
     output.bytes_written += bytes_in_buffer;
   }
 }
+
+// Same as EncodeChunk, for 8 residuals of up to 14 bits, as those of samples
+// of up to 12 bits, in 32-bit lanes.
+void EncodeChunk32(const uint16_t* residuals, const PrefixCode& code,
+                   BitWriter& output) {
+  uint16x8_t res = vld1q_u16(residuals);
+  uint8x16_t raw_bits = vld1q_u8(code.raw_bits);
+  uint8x16_t raw_nbits = vld1q_u8(code.raw_nbits);
+  for (uint32x4_t value : {vmovl_u16(vget_low_u16(res)),
+                           vmovl_u16(vget_high_u16(res))}) {
+    uint32x4_t token = vsubq_u32(vdupq_n_u32(32), vclzq_u32(value));
+    uint32x4_t nbits = vqsubq_u32(token, vdupq_n_u32(1));
+    // Clears the leading bit, if any.
+    uint32x4_t bits = vbicq_u32(
+        value, vshlq_u32(vdupq_n_u32(1), vreinterpretq_s32_u32(nbits)));
+    uint8x16_t token_bytes = vreinterpretq_u8_u32(token);
+    uint32x4_t huff_bits =
+        vandq_u32(vdupq_n_u32(0xFF),
+                  vreinterpretq_u32_u8(vqtbl1q_u8(raw_bits, token_bytes)));
+    uint32x4_t huff_nbits =
+        vandq_u32(vdupq_n_u32(0xFF),
+                  vreinterpretq_u32_u8(vqtbl1q_u8(raw_nbits, token_bytes)));
+    bits = vorrq_u32(vshlq_u32(bits, vreinterpretq_s32_u32(huff_nbits)),
+                     huff_bits);
+    nbits = vaddq_u32(nbits, huff_nbits);
+
+    for (size_t i = 0; i < 4; i++) {
+      output.buffer |= static_cast<uint64_t>(bits[i]) << output.bits_in_buffer;
+      memcpy(output.data.get() + output.bytes_written, &output.buffer, 8);
+      output.bits_in_buffer += nbits[i];
+      size_t bytes_in_buffer = output.bits_in_buffer / 8;
+      output.bits_in_buffer -= bytes_in_buffer * 8;
+      output.buffer >>= bytes_in_buffer * 8;
+      output.bytes_written += bytes_in_buffer;
+    }
+  }
+}
 #endif
 
 template <size_t bytedepth>
@@ -726,16 +883,20 @@ struct ChunkEncoder {
 #if defined(FASTLL_ENABLE_AVX2_INTRINSICS) && FASTLL_ENABLE_AVX2_INTRINSICS
     if (bytedepth == 1) {
       EncodeChunk(residuals, *code, *output);
-      return;
+    } else {
+      EncodeChunk32(residuals, *code, *output);
+      EncodeChunk32(residuals + 8, *code, *output);
     }
+    return;
 #elif defined(FASTLL_ENABLE_NEON_INTRINSICS) && FASTLL_ENABLE_NEON_INTRINSICS
-    if (bytedepth == 1) {
-      EncodeChunk(residuals, *code, *output);
-      if (kChunkSize > 8) {
-        EncodeChunk(residuals + 8, *code, *output);
+    for (size_t i = 0; i < kChunkSize; i += 8) {
+      if (bytedepth == 1) {
+        EncodeChunk(residuals + i, *code, *output);
+      } else {
+        EncodeChunk32(residuals + i, *code, *output);
       }
-      return;
     }
+    return;
 #endif
     for (size_t ix = 0; ix < kChunkSize; ix++) {
       unsigned token, nbits, bits;
@@ -1088,7 +1249,7 @@ void PrepareDCGlobalPalette(bool is_single_group, size_t width, size_t height,
   encoder.code = &code;
   int16_t p[4][32 + 1024] = {};
   uint8_t prgba[4];
-  int i = 0;
+  size_t i = 0;
   int have_zero = 0;
   if (palette[pcolors_real - 1] == 0) have_zero = 1;
   for (; i < pcolors; i++) {
@@ -1118,10 +1279,66 @@ void PrepareDCGlobalPalette(bool is_single_group, size_t width, size_t height,
   }
 }
 
+// Samples the middle (effort * 2) rows of every group of the `ys` rows at
+// rgba, which are a row of groups.
+template <size_t nb_chans, size_t bytedepth>
+void SampleGroupRow(const unsigned char* rgba, size_t width, size_t stride,
+                    size_t ys, int effort, bool palette, const int16_t* lookup,
+                    uint64_t* raw_counts, uint64_t* lz77_counts) {
+  size_t num_groups_x = (width + 255) / 256;
+  int y_max = ys;
+  int y_begin = std::max<int>(0, y_max - 2 * effort) / 2;
+  int y_count = std::min<int>(2 * effort * y_max / 256, y_max - y_begin - 1);
+  for (size_t xg = 0; xg < num_groups_x; xg++) {
+    int x_max =
+        std::min<size_t>(width - xg * 256, 256) / kChunkSize * kChunkSize;
+    CollectSamples<nb_chans, bytedepth>(rgba, xg * 256, y_begin, x_max, stride,
+                                        y_count, raw_counts, lz77_counts,
+                                        palette, lookup);
+  }
+}
+
+// Weights the sampled counts over fixed ones, which give a code to all the
+// tokens that samples of bitdepth bits can produce.
+void AddBaseCounts(size_t bitdepth, bool doing_ycocg, uint64_t* raw_counts,
+                   uint64_t* lz77_counts) {
+  uint64_t base_raw_counts[16] = {3843, 852, 1270, 1214, 1014, 727, 481, 300,
+                                  159,  51,  5,    1,    1,    1,   1,   1};
+
+  for (size_t i = bitdepth + 2 + (doing_ycocg ? 1 : 0); i < 16; i++) {
+    base_raw_counts[i] = 0;
+  }
+  uint64_t base_lz77_counts[17] = {
+      // short runs will be sampled, but long ones won't.
+      // near full-group run is quite common (e.g. all-opaque alpha)
+      18, 12, 9, 11, 15, 2, 2, 1, 1, 1, 1, 2, 300, 0, 0, 0, 0};
+
+  for (size_t i = 0; i < 16; i++) {
+    raw_counts[i] = (raw_counts[i] << 8) + base_raw_counts[i];
+  }
+  for (size_t i = 0; i < 17; i++) {
+    lz77_counts[i] = (lz77_counts[i] << 8) + base_lz77_counts[i];
+  }
+}
+
+// Runs func(i) for all i in [0, count), on the runner if there is one.
+template <typename Func>
+void RunOnRunner(void* runner_opaque, JxlFastLosslessRunner* runner,
+                 size_t count, Func& func) {
+  if (runner == nullptr) {
+    for (size_t i = 0; i < count; i++) func(i);
+    return;
+  }
+  runner(
+      runner_opaque, &func,
+      [](void* opaque, size_t i) { (*static_cast<Func*>(opaque))(i); }, count);
+}
+
 template <size_t nb_chans, size_t bytedepth>
 size_t LLEnc(const unsigned char* rgba, size_t width, size_t stride,
-             size_t height, size_t bitdepth, int effort,
-             unsigned char** output) {
+             size_t height, size_t bitdepth, int effort, bool frame_only,
+             unsigned char** output, void* runner_opaque,
+             JxlFastLosslessRunner* runner) {
   size_t bytes_per_sample = (bitdepth > 8 ? 2 : 1);
   assert(bytedepth == bytes_per_sample);
   assert(width != 0);
@@ -1184,7 +1401,7 @@ size_t LLEnc(const unsigned char* rgba, size_t width, size_t stride,
     if (palette[0] == 1) palette[0] = 0;
     bool have_color = false;
     uint8_t minG = 255, maxG = 0;
-    for (int k = 0; k < kHashSize; k++) {
+    for (size_t k = 0; k < kHashSize; k++) {
       if (palette[k] == 0) continue;
       uint8_t p[4];
       memcpy(p, &palette[k], 4);
@@ -1235,37 +1452,15 @@ size_t LLEnc(const unsigned char* rgba, size_t width, size_t stride,
   uint64_t raw_counts[16] = {};
   uint64_t lz77_counts[17] = {};
 
-  // sample the middle (effort * 2) rows of every group
-  for (size_t g = 0; g < num_groups_y * num_groups_x; g++) {
-    size_t xg = g % num_groups_x;
-    size_t yg = g / num_groups_x;
-    int y_offset = yg * 256;
-    int y_max = std::min<size_t>(height - yg * 256, 256);
-    int y_begin = y_offset + std::max<int>(0, y_max - 2 * effort) / 2;
-    int y_count =
-        std::min<int>(2 * effort * y_max / 256, y_offset + y_max - y_begin - 1);
-    int x_max =
-        std::min<size_t>(width - xg * 256, 256) / kChunkSize * kChunkSize;
-    CollectSamples<nb_chans, bytedepth>(rgba, xg * 256, y_begin, x_max, stride,
-                                        y_count, raw_counts, lz77_counts,
-                                        !collided, lookup);
+  for (size_t yg = 0; yg < num_groups_y; yg++) {
+    SampleGroupRow<nb_chans, bytedepth>(
+        rgba + yg * 256 * stride, width, stride,
+        std::min<size_t>(height - yg * 256, 256), effort, !collided, lookup,
+        raw_counts, lz77_counts);
   }
 
-  uint64_t base_raw_counts[16] = {3843, 852, 1270, 1214, 1014, 727, 481, 300,
-                                  159,  51,  5,    1,    1,    1,   1,   1};
-
   bool doing_ycocg = nb_chans > 2 && collided;
-  for (size_t i = bitdepth + 2 + (doing_ycocg ? 1 : 0); i < 16; i++) {
-    base_raw_counts[i] = 0;
-  }
-  uint64_t base_lz77_counts[17] = {
-      // short runs will be sampled, but long ones won't.
-      // near full-group run is quite common (e.g. all-opaque alpha)
-      18, 12, 9, 11, 15, 2, 2, 1, 1, 1, 1, 2, 300, 0, 0, 0, 0};
-
-  for (size_t i = 0; i < 16; i++) {
-    raw_counts[i] = (raw_counts[i] << 8) + base_raw_counts[i];
-  }
+  AddBaseCounts(bitdepth, doing_ycocg, raw_counts, lz77_counts);
   if (!collided) {
     unsigned token, nbits, bits;
     EncodeHybridUint000(PackSigned(pcolors - 1), &token, &nbits, &bits);
@@ -1276,9 +1471,6 @@ size_t LLEnc(const unsigned char* rgba, size_t width, size_t stride,
     // code
     for (size_t i = token + 1; i < 10; i++) raw_counts[i] = 1;
   }
-  for (size_t i = 0; i < 17; i++) {
-    lz77_counts[i] = (lz77_counts[i] << 8) + base_lz77_counts[i];
-  }
   alignas(32) PrefixCode hcode(raw_counts, lz77_counts);
 
   BitWriter writer;
@@ -1297,8 +1489,7 @@ size_t LLEnc(const unsigned char* rgba, size_t width, size_t stride,
     PrepareDCGlobalPalette(onegroup, width, height, hcode, palette, pcolors,
                            &group_data[0][0]);
   }
-#pragma omp parallel for
-  for (size_t g = 0; g < num_groups_y * num_groups_x; g++) {
+  auto encode_group = [&](size_t g) {
     size_t xg = g % num_groups_x;
     size_t yg = g / num_groups_x;
     size_t group_id =
@@ -1316,47 +1507,170 @@ size_t LLEnc(const unsigned char* rgba, size_t width, size_t stride,
       WriteACSectionPalette<nb_chans>(rgba, x0, y0, xs, ys, stride, onegroup,
                                       hcode, lookup, gd[0]);
     }
-  }
+  };
+  RunOnRunner(runner_opaque, runner, num_groups_y * num_groups_x,
+              encode_group);
 
-  AssembleFrame(width, height, nb_chans, bitdepth, group_data, &writer);
+  AssembleFrame(width, height, nb_chans, bitdepth, frame_only, group_data,
+                &writer);
 
   *output = writer.data.release();
   return writer.bytes_written;
 }
 
-size_t FastLosslessEncode(const unsigned char* rgba, size_t width,
-                          size_t stride, size_t height, size_t nb_chans,
-                          size_t bitdepth, int effort, unsigned char** output) {
-  assert(bitdepth <= 12);
-  assert(bitdepth > 0);
-  assert(nb_chans <= 4);
-  assert(nb_chans != 0);
+template <size_t nb_chans, size_t bytedepth>
+size_t LLEncRows(size_t width, size_t height, size_t bitdepth, int effort,
+                 bool frame_only, void* rows_opaque,
+                 JxlFastLosslessGetRows* get_rows, void* output_opaque,
+                 JxlFastLosslessOutputFunc* write_output, void* runner_opaque,
+                 JxlFastLosslessRunner* runner) {
+  size_t num_groups_x = (width + 255) / 256;
+  size_t num_groups_y = (height + 255) / 256;
+  size_t num_dc_groups_x = (width + 2047) / 2048;
+  size_t num_dc_groups_y = (height + 2047) / 2048;
+
+  bool onegroup = num_groups_x == 1 && num_groups_y == 1;
+  size_t num_groups = onegroup ? 1
+                               : (2 + num_dc_groups_x * num_dc_groups_y +
+                                  num_groups_x * num_groups_y);
+  std::vector<std::array<BitWriter, 4>> group_data(num_groups);
+
+  size_t stride = 0;
+  size_t ys = std::min<size_t>(height, 256);
+  const unsigned char* rgba = get_rows(rows_opaque, 0, ys, &stride);
+  if (rgba == nullptr) return 0;
+  assert(stride >= nb_chans * bytedepth * width);
+
+  // The code must be known before the first group is encoded, so it only
+  // comes from the samples of the first row of groups.
+  uint64_t raw_counts[16] = {};
+  uint64_t lz77_counts[17] = {};
+  SampleGroupRow<nb_chans, bytedepth>(rgba, width, stride, ys, effort,
+                                      /*palette=*/false, /*lookup=*/nullptr,
+                                      raw_counts, lz77_counts);
+  AddBaseCounts(bitdepth, /*doing_ycocg=*/nb_chans > 2, raw_counts,
+                lz77_counts);
+  alignas(32) PrefixCode hcode(raw_counts, lz77_counts);
+  PrepareDCGlobal(onegroup, width, height, nb_chans, bitdepth, hcode,
+                  &group_data[0][0]);
+
+  for (size_t yg = 0; yg < num_groups_y; yg++) {
+    if (yg != 0) {
+      ys = std::min<size_t>(height - yg * 256, 256);
+      rgba = get_rows(rows_opaque, yg * 256, ys, &stride);
+      if (rgba == nullptr) return 0;
+      assert(stride >= nb_chans * bytedepth * width);
+    }
+    auto encode_group = [&](size_t xg) {
+      size_t group_id =
+          onegroup ? 0
+                   : (2 + num_dc_groups_x * num_dc_groups_y +
+                      yg * num_groups_x + xg);
+      size_t xs = std::min<size_t>(width - xg * 256, 256);
+      WriteACSection<nb_chans, bytedepth>(rgba, xg * 256, 0, xs, ys, stride,
+                                          onegroup, hcode,
+                                          group_data[group_id]);
+    };
+    RunOnRunner(runner_opaque, runner, num_groups_x, encode_group);
+  }
+
+  return WriteFrame(width, height, nb_chans, bitdepth, frame_only, &group_data,
+                    output_opaque, write_output);
+}
+
+}  // namespace
+
+size_t JxlFastLosslessEncode(const unsigned char* rgba, size_t width,
+                             size_t stride, size_t height, size_t nb_chans,
+                             size_t bitdepth, int effort, bool frame_only,
+                             unsigned char** output, void* runner_opaque,
+                             JxlFastLosslessRunner* runner) {
+  *output = nullptr;
+  if (!FASTLL_LITTLE_ENDIAN || bitdepth == 0 || bitdepth > 12 ||
+      nb_chans == 0 || nb_chans > 4 || width == 0 || height == 0) {
+    return 0;
+  }
+  const bool frame = frame_only;
   if (bitdepth <= 8) {
     if (nb_chans == 1) {
-      return LLEnc<1, 1>(rgba, width, stride, height, bitdepth, effort, output);
+      return LLEnc<1, 1>(rgba, width, stride, height, bitdepth, effort, frame,
+                         output, runner_opaque, runner);
     }
     if (nb_chans == 2) {
-      return LLEnc<2, 1>(rgba, width, stride, height, bitdepth, effort, output);
+      return LLEnc<2, 1>(rgba, width, stride, height, bitdepth, effort, frame,
+                         output, runner_opaque, runner);
     }
     if (nb_chans == 3) {
-      return LLEnc<3, 1>(rgba, width, stride, height, bitdepth, effort, output);
+      return LLEnc<3, 1>(rgba, width, stride, height, bitdepth, effort, frame,
+                         output, runner_opaque, runner);
     }
-    if (nb_chans == 4) {
-      return LLEnc<4, 1>(rgba, width, stride, height, bitdepth, effort, output);
-    }
-  } else {
+    return LLEnc<4, 1>(rgba, width, stride, height, bitdepth, effort, frame,
+                       output, runner_opaque, runner);
+  }
+  if (nb_chans == 1) {
+    return LLEnc<1, 2>(rgba, width, stride, height, bitdepth, effort, frame,
+                       output, runner_opaque, runner);
+  }
+  if (nb_chans == 2) {
+    return LLEnc<2, 2>(rgba, width, stride, height, bitdepth, effort, frame,
+                       output, runner_opaque, runner);
+  }
+  if (nb_chans == 3) {
+    return LLEnc<3, 2>(rgba, width, stride, height, bitdepth, effort, frame,
+                       output, runner_opaque, runner);
+  }
+  return LLEnc<4, 2>(rgba, width, stride, height, bitdepth, effort, frame,
+                     output, runner_opaque, runner);
+}
+
+size_t JxlFastLosslessEncodeRows(size_t width, size_t height, size_t nb_chans,
+                                 size_t bitdepth, int effort, bool frame_only,
+                                 void* rows_opaque,
+                                 JxlFastLosslessGetRows* get_rows,
+                                 void* output_opaque,
+                                 JxlFastLosslessOutputFunc* write_output,
+                                 void* runner_opaque,
+                                 JxlFastLosslessRunner* runner) {
+  if (!FASTLL_LITTLE_ENDIAN || bitdepth == 0 || bitdepth > 12 ||
+      nb_chans == 0 || nb_chans > 4 || width == 0 || height == 0) {
+    return 0;
+  }
+  if (bitdepth <= 8) {
     if (nb_chans == 1) {
-      return LLEnc<1, 2>(rgba, width, stride, height, bitdepth, effort, output);
+      return LLEncRows<1, 1>(width, height, bitdepth, effort, frame_only,
+                             rows_opaque, get_rows, output_opaque,
+                             write_output, runner_opaque, runner);
     }
     if (nb_chans == 2) {
-      return LLEnc<2, 2>(rgba, width, stride, height, bitdepth, effort, output);
+      return LLEncRows<2, 1>(width, height, bitdepth, effort, frame_only,
+                             rows_opaque, get_rows, output_opaque,
+                             write_output, runner_opaque, runner);
     }
     if (nb_chans == 3) {
-      return LLEnc<3, 2>(rgba, width, stride, height, bitdepth, effort, output);
-    }
-    if (nb_chans == 4) {
-      return LLEnc<4, 2>(rgba, width, stride, height, bitdepth, effort, output);
+      return LLEncRows<3, 1>(width, height, bitdepth, effort, frame_only,
+                             rows_opaque, get_rows, output_opaque,
+                             write_output, runner_opaque, runner);
     }
+    return LLEncRows<4, 1>(width, height, bitdepth, effort, frame_only,
+                           rows_opaque, get_rows, output_opaque,
+                           write_output, runner_opaque, runner);
+  }
+  if (nb_chans == 1) {
+    return LLEncRows<1, 2>(width, height, bitdepth, effort, frame_only,
+                           rows_opaque, get_rows, output_opaque,
+                           write_output, runner_opaque, runner);
+  }
+  if (nb_chans == 2) {
+    return LLEncRows<2, 2>(width, height, bitdepth, effort, frame_only,
+                           rows_opaque, get_rows, output_opaque,
+                           write_output, runner_opaque, runner);
+  }
+  if (nb_chans == 3) {
+    return LLEncRows<3, 2>(width, height, bitdepth, effort, frame_only,
+                           rows_opaque, get_rows, output_opaque,
+                           write_output, runner_opaque, runner);
   }
-  return 0;
+  return LLEncRows<4, 2>(width, height, bitdepth, effort, frame_only,
+                         rows_opaque, get_rows, output_opaque,
+                         write_output, runner_opaque, runner);
 }
@@ -0,0 +1,66 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_FAST_LOSSLESS_H_
+#define LIB_JXL_ENC_FAST_LOSSLESS_H_
+
+// Very fast lossless encoder for 8 to 12 bit images, with a fixed modular
+// configuration. It does not depend on the rest of the library, so that it can
+// also be built standalone (see experimental/fast_lossless).
+
+#include <stddef.h>
+
+// Runs fun(opaque, i) for all i in [0, count), possibly in parallel and in any
+// order, and returns when all calls are done.
+typedef void(JxlFastLosslessRunner)(void* runner_opaque, void* opaque,
+                                    void fun(void*, size_t), size_t count);
+
+// Encodes interleaved rgba, with nb_chans channels of bitdepth bits each,
+// stored as one byte per sample if bitdepth <= 8 and as two little endian
+// bytes per sample otherwise. Returns the size of *output, which is allocated
+// with malloc and must be freed by the caller, or 0 if the image is not
+// supported.
+// If frame_only, only the frame (marked as the last one) is written, without
+// signature and image headers: the caller must write image headers with
+// matching metadata, i.e. no XYB and at most one extra channel which is an
+// alpha channel with the same bit depth, present iff nb_chans is 2 or 4.
+// If runner is null, groups are encoded sequentially.
+size_t JxlFastLosslessEncode(const unsigned char* rgba, size_t width,
+                             size_t row_stride, size_t height, size_t nb_chans,
+                             size_t bitdepth, int effort, bool frame_only,
+                             unsigned char** output, void* runner_opaque,
+                             JxlFastLosslessRunner* runner);
+
+// Returns the `num_rows` rows of the image starting at row y0, in the layout of
+// the rgba argument of JxlFastLosslessEncode, and sets *row_stride. The rows
+// must stay valid until the next call. Returning null stops the encoding.
+typedef const unsigned char*(JxlFastLosslessGetRows)(void* rows_opaque,
+                                                      size_t y0,
+                                                      size_t num_rows,
+                                                      size_t* row_stride);
+
+// Receives the next `size` bytes of the output.
+typedef void(JxlFastLosslessOutputFunc)(void* output_opaque,
+                                        const unsigned char* data,
+                                        size_t size);
+
+// Same as JxlFastLosslessEncode, but gets the image 256 rows at a time, in
+// order, from get_rows, and passes the output to write_output one section at
+// a time. Only the encoded sections are kept in memory, not the image: they
+// are written once all rows were encoded, since the table of contents that
+// precedes them holds their sizes. Palettes are not tried, and the prefix code
+// only comes from the first 256 rows. Returns the size of the output, or 0,
+// without writing any, if the image is not supported or get_rows returned
+// null.
+size_t JxlFastLosslessEncodeRows(size_t width, size_t height, size_t nb_chans,
+                                 size_t bitdepth, int effort, bool frame_only,
+                                 void* rows_opaque,
+                                 JxlFastLosslessGetRows* get_rows,
+                                 void* output_opaque,
+                                 JxlFastLosslessOutputFunc* write_output,
+                                 void* runner_opaque,
+                                 JxlFastLosslessRunner* runner);
+
+#endif  // LIB_JXL_ENC_FAST_LOSSLESS_H_
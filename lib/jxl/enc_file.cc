@@ -7,10 +7,13 @@
 
 #include <stddef.h>
 
+#include <algorithm>
+#include <cmath>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/alpha.h"
 #include "lib/jxl/aux_out.h"
 #include "lib/jxl/aux_out_fwd.h"
 #include "lib/jxl/base/compiler_specific.h"
@@ -23,6 +26,7 @@
 #include "lib/jxl/exif.h"
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/headers.h"
+#include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 
 namespace jxl {
@@ -89,6 +93,86 @@ Status PrepareCodecMetadataFromIO(const CompressParams& cparams,
   return true;
 }
 
+// Weights of the input pixels covered by each output pixel when area-averaging
+// `in_size` pixels down to `out_size`.
+struct AreaTaps {
+  AreaTaps(size_t in_size, size_t out_size) {
+    const double scale = static_cast<double>(in_size) / out_size;
+    for (size_t i = 0; i < out_size; i++) {
+      const double start = i * scale;
+      const double end = std::min<double>((i + 1) * scale, in_size);
+      const size_t first = static_cast<size_t>(start);
+      size_t last = static_cast<size_t>(std::ceil(end));
+      last = std::min(std::max(last, first + 1), in_size);
+      begin.push_back(first);
+      offset.push_back(weights.size());
+      for (size_t j = first; j < last; j++) {
+        const double covered = std::min<double>(end, j + 1) -
+                               std::max<double>(start, j);
+        weights.push_back(static_cast<float>(covered / scale));
+      }
+    }
+    offset.push_back(weights.size());
+  }
+
+  float Apply(const float* JXL_RESTRICT in, size_t stride, size_t i) const {
+    const float* JXL_RESTRICT w = weights.data() + offset[i];
+    const size_t num = offset[i + 1] - offset[i];
+    in += begin[i] * stride;
+    float sum = 0.0f;
+    for (size_t j = 0; j < num; j++) sum += w[j] * in[j * stride];
+    return sum;
+  }
+
+  std::vector<size_t> begin;
+  std::vector<size_t> offset;
+  std::vector<float> weights;
+};
+
+ImageF AreaDownsample(const ImageF& in, const AreaTaps& xtaps,
+                      const AreaTaps& ytaps, ThreadPool* pool) {
+  const size_t xsize = xtaps.begin.size();
+  const size_t ysize = ytaps.begin.size();
+  ImageF tmp(xsize, in.ysize());
+  JXL_CHECK(RunOnPool(
+      pool, 0, in.ysize(), ThreadPool::NoInit,
+      [&](const uint32_t y, size_t /* thread */) {
+        const float* JXL_RESTRICT row_in = in.ConstRow(y);
+        float* JXL_RESTRICT row_out = tmp.Row(y);
+        for (size_t x = 0; x < xsize; x++) {
+          row_out[x] = xtaps.Apply(row_in, 1, x);
+        }
+      },
+      "AreaDownsampleX"));
+  ImageF out(xsize, ysize);
+  const size_t stride = tmp.PixelsPerRow();
+  JXL_CHECK(RunOnPool(
+      pool, 0, ysize, ThreadPool::NoInit,
+      [&](const uint32_t y, size_t /* thread */) {
+        const float* JXL_RESTRICT row_in = tmp.ConstRow(0);
+        float* JXL_RESTRICT row_out = out.Row(y);
+        for (size_t x = 0; x < xsize; x++) {
+          row_out[x] = ytaps.Apply(row_in + x, stride, y);
+        }
+      },
+      "AreaDownsampleY"));
+  return out;
+}
+
+void MultiplyAlpha(Image3F* color, const ImageF& alpha, bool premultiply) {
+  for (size_t y = 0; y < color->ysize(); y++) {
+    if (premultiply) {
+      PremultiplyAlpha(color->PlaneRow(0, y), color->PlaneRow(1, y),
+                       color->PlaneRow(2, y), alpha.ConstRow(y),
+                       color->xsize());
+    } else {
+      UnpremultiplyAlpha(color->PlaneRow(0, y), color->PlaneRow(1, y),
+                         color->PlaneRow(2, y), alpha.ConstRow(y),
+                         color->xsize());
+    }
+  }
+}
+
 }  // namespace
 
 Status EncodePreview(const CompressParams& cparams, const ImageBundle& ib,
@@ -234,4 +318,98 @@ Status EncodeFile(const CompressParams& params, const CodecInOut* io,
   return true;
 }
 
+Status EncodeFileAtDistances(const CompressParams& params,
+                             const CodecInOut* io,
+                             const std::vector<float>& distances,
+                             std::vector<PaddedBytes>* compressed,
+                             const JxlCmsInterface& cms, ThreadPool* pool) {
+  PassesEncoderState passes_enc_state;
+  passes_enc_state.reuse_analysis = true;
+  compressed->resize(distances.size());
+  for (size_t i = 0; i < distances.size(); i++) {
+    CompressParams cparams = params;
+    cparams.butteraugli_distance = distances[i];
+    JXL_RETURN_IF_ERROR(EncodeFile(cparams, io, &passes_enc_state,
+                                   &(*compressed)[i], cms,
+                                   /*aux_out=*/nullptr, pool));
+  }
+  return true;
+}
+
+Status EncodeFileAtSizes(const CompressParams& params, const CodecInOut* io,
+                         const std::vector<size_t>& xsizes,
+                         std::vector<PaddedBytes>* compressed,
+                         const JxlCmsInterface& cms, ThreadPool* pool) {
+  if (io->frames.size() != 1) {
+    return JXL_FAILURE("Only single frames can be encoded at several sizes");
+  }
+  for (size_t i = 0; i < xsizes.size(); i++) {
+    if (xsizes[i] == 0 || xsizes[i] > io->xsize() ||
+        (i != 0 && xsizes[i] > xsizes[i - 1])) {
+      return JXL_FAILURE("Invalid sequence of sizes");
+    }
+  }
+  compressed->resize(xsizes.size());
+
+  const ImageBundle& ib = io->Main();
+  const ColorEncoding& c_linear = ColorEncoding::LinearSRGB(ib.IsGray());
+  const ExtraChannelInfo* alpha_info =
+      io->metadata.m.Find(ExtraChannel::kAlpha);
+  const bool premultiply = alpha_info && !alpha_info->alpha_associated;
+  const size_t alpha_index =
+      alpha_info ? alpha_info - io->metadata.m.extra_channel_info.data() : 0;
+  // Linear (and premultiplied) pixels of the previous size.
+  Image3F color;
+  std::vector<ImageF> extra;
+  for (size_t i = 0; i < xsizes.size(); i++) {
+    if (xsizes[i] == io->xsize()) {
+      PassesEncoderState passes_enc_state;
+      JXL_RETURN_IF_ERROR(EncodeFile(params, io, &passes_enc_state,
+                                     &(*compressed)[i], cms,
+                                     /*aux_out=*/nullptr, pool));
+      continue;
+    }
+    if (color.xsize() == 0) {
+      JXL_RETURN_IF_ERROR(ib.CopyTo(Rect(ib), c_linear, cms, &color, pool));
+      for (const ImageF& plane : ib.extra_channels()) {
+        extra.push_back(CopyImage(plane));
+      }
+      if (premultiply) MultiplyAlpha(&color, extra[alpha_index], true);
+    }
+    const size_t xsize = xsizes[i];
+    const size_t ysize = std::max<size_t>(
+        1, (io->ysize() * xsize + io->xsize() / 2) / io->xsize());
+    const AreaTaps xtaps(color.xsize(), xsize);
+    const AreaTaps ytaps(color.ysize(), ysize);
+    Image3F smaller(xsize, ysize);
+    for (size_t c = 0; c < 3; c++) {
+      smaller.Plane(c) = AreaDownsample(color.Plane(c), xtaps, ytaps, pool);
+    }
+    color = std::move(smaller);
+    for (ImageF& plane : extra) {
+      plane = AreaDownsample(plane, xtaps, ytaps, pool);
+    }
+
+    CodecInOut level;
+    level.metadata = io->metadata;
+    level.metadata.m.have_preview = false;
+    level.blobs = io->blobs;
+    Image3F level_color = CopyImage(color);
+    std::vector<ImageF> level_extra;
+    for (const ImageF& plane : extra) level_extra.push_back(CopyImage(plane));
+    if (premultiply) {
+      MultiplyAlpha(&level_color, level_extra[alpha_index], false);
+    }
+    level.SetFromImage(std::move(level_color), c_linear);
+    if (!level_extra.empty()) {
+      level.Main().SetExtraChannels(std::move(level_extra));
+    }
+    PassesEncoderState passes_enc_state;
+    JXL_RETURN_IF_ERROR(EncodeFile(params, &level, &passes_enc_state,
+                                   &(*compressed)[i], cms,
+                                   /*aux_out=*/nullptr, pool));
+  }
+  return true;
+}
+
 }  // namespace jxl
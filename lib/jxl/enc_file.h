@@ -8,6 +8,8 @@
 
 // Facade for JXL encoding.
 
+#include <vector>
+
 #include "lib/jxl/aux_out.h"
 #include "lib/jxl/aux_out_fwd.h"
 #include "lib/jxl/base/data_parallel.h"
@@ -38,6 +40,28 @@ Status EncodeFile(const CompressParams& params, const CodecInOut* io,
 
 // Backwards-compatible interface. Don't use in new code.
 // TODO(deymo): Remove this function once we migrate users to C encoder API.
+// Encodes `io` with `params` once for each of `distances`, into `compressed`.
+// The analysis of the frames that does not depend on the distance, currently
+// the conversion to XYB and the linear copy for the butteraugli search, is
+// only done for the first distance, see PassesEncoderState::reuse_analysis.
+Status EncodeFileAtDistances(const CompressParams& params,
+                             const CodecInOut* io,
+                             const std::vector<float>& distances,
+                             std::vector<PaddedBytes>* compressed,
+                             const JxlCmsInterface& cms,
+                             ThreadPool* pool = nullptr);
+
+// Encodes the single frame of `io` once for each of `xsizes`, into
+// `compressed`. The widths must be non-increasing and at most that of `io`;
+// the heights keep the aspect ratio. The pixels are converted to linear sRGB
+// once, and each smaller size is area-averaged from the previous one in there,
+// with premultiplied alpha. Sizes equal to that of `io` encode `io` itself.
+Status EncodeFileAtSizes(const CompressParams& params, const CodecInOut* io,
+                         const std::vector<size_t>& xsizes,
+                         std::vector<PaddedBytes>* compressed,
+                         const JxlCmsInterface& cms,
+                         ThreadPool* pool = nullptr);
+
 struct FrameEncCache {};
 JXL_INLINE Status EncodeFile(const CompressParams& params, const CodecInOut* io,
                              FrameEncCache* /* unused */,
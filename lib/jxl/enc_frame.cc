@@ -7,6 +7,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <algorithm>
 #include <array>
@@ -43,6 +44,9 @@
 #include "lib/jxl/enc_chroma_from_luma.h"
 #include "lib/jxl/enc_coeff_order.h"
 #include "lib/jxl/enc_context_map.h"
+#include "lib/jxl/enc_content_classifier.h"
+#include "lib/jxl/enc_decode_cost.h"
+#include "lib/jxl/enc_deadline.h"
 #include "lib/jxl/enc_entropy_coder.h"
 #include "lib/jxl/enc_group.h"
 #include "lib/jxl/enc_modular.h"
@@ -477,6 +481,17 @@ void SimplifyInvisible(Image3F* image, const ImageF& alpha, bool lossless) {
   }
 }
 
+// Returns the analysis of `ib` kept in `enc_state`, or a new empty one to fill.
+PassesEncoderState::FrameAnalysis* GetFrameAnalysis(
+    const ImageBundle& ib, PassesEncoderState* enc_state) {
+  for (PassesEncoderState::FrameAnalysis& analysis : enc_state->analyses) {
+    if (analysis.source == &ib) return &analysis;
+  }
+  enc_state->analyses.emplace_back();
+  enc_state->analyses.back().source = &ib;
+  return &enc_state->analyses.back();
+}
+
 }  // namespace
 
 class LossyFrameEncoder {
@@ -522,9 +537,27 @@ class LossyFrameEncoder {
     JXL_RETURN_IF_ERROR(enc_state_->heuristics->LossyFrameHeuristics(
         enc_state_, modular_frame_encoder, linear, opsin, cms_, pool_,
         aux_out_));
+    // The butteraugli iterations stop early instead of failing on an abort.
+    JXL_RETURN_IF_ERROR(CheckProgress(enc_state_->progress));
 
     JXL_RETURN_IF_ERROR(InitializePassesEncoder(
         *opsin, cms, pool_, enc_state_, modular_frame_encoder, aux_out_));
+    if (enc_state_->special_frames_done &&
+        (shared.frame_header.flags & FrameHeader::kUseDcFrame)) {
+      BitWriter special_frames;
+      special_frames.AppendByteAligned(enc_state_->special_frames);
+      enc_state_->special_frames.clear();
+      JXL_RETURN_IF_ERROR(enc_state_->special_frames_done(
+          std::move(special_frames).TakeBytes()));
+    }
+    // The coefficients of the AC strategy search are not needed anymore.
+    enc_state_->searched_coeffs = Image3F();
+    enc_state_->searched_strategy = ImageB();
+    if (enc_state_->cparams.low_memory) {
+      // Neither is the XYB image: the modular part of VarDCT frames does not
+      // read the color channels.
+      *opsin = Image3F();
+    }
 
     enc_state_->passes.resize(enc_state_->progressive_splitter.GetNumPasses());
     for (PassesEncoderState::PassData& pass : enc_state_->passes) {
@@ -536,10 +569,15 @@ class LossyFrameEncoder {
 
     const auto tokenize_group_init = [&](const size_t num_threads) {
       group_caches_.resize(num_threads);
+      for (EncCache& cache : group_caches_) {
+        cache.ac_histograms.clear();
+        cache.ac_histograms.resize(enc_state_->passes.size());
+      }
       return true;
     };
     const auto tokenize_group = [&](const uint32_t group_index,
                                     const size_t thread) {
+      if (!PollProgress(enc_state_->progress)) return;
       // Tokenize coefficients.
       const Rect rect = shared.BlockGroupRect(group_index);
       for (size_t idx_pass = 0; idx_pass < enc_state_->passes.size();
@@ -558,12 +596,20 @@ class LossyFrameEncoder {
             &group_caches_[thread].num_nzeroes,
             &enc_state_->passes[idx_pass].ac_tokens[group_index],
             enc_state_->shared.quant_dc, enc_state_->shared.raw_quant_field,
-            enc_state_->shared.block_ctx_map);
+            enc_state_->shared.block_ctx_map,
+            &group_caches_[thread].ac_histograms[idx_pass]);
       }
     };
+    AddProgressWork(enc_state_->progress, shared.frame_dim.num_groups);
     JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, shared.frame_dim.num_groups,
                                   tokenize_group_init, tokenize_group,
                                   "TokenizeGroup"));
+    JXL_RETURN_IF_ERROR(CheckProgress(enc_state_->progress));
+    MergeTokenHistograms();
+    if (enc_state_->cparams.low_memory) {
+      // Everything after this point works on the tokens.
+      enc_state_->coeffs.clear();
+    }
 
     *frame_header = shared.frame_header;
     return true;
@@ -590,10 +636,6 @@ class LossyFrameEncoder {
     shared.ac_strategy.FillDCT8();
     FillImage(uint8_t(0), &shared.epf_sharpness);
 
-    enc_state_->coeffs.clear();
-    enc_state_->coeffs.emplace_back(make_unique<ACImageT<int32_t>>(
-        kGroupDim * kGroupDim, frame_dim.num_groups));
-
     // convert JPEG quantization table to a Quantizer object
     float dcquantization[3];
     std::vector<QuantEncoding> qe(DequantMatrices::kNum,
@@ -738,7 +780,6 @@ class LossyFrameEncoder {
     }
     if (!frame_header->chroma_subsampling.Is444()) {
       ZeroFillImage(&dc);
-      enc_state_->coeffs[0]->ZeroFill();
     }
     // JPEG DC is from -1024 to 1023.
     std::vector<size_t> dc_counts[3] = {};
@@ -748,7 +789,6 @@ class LossyFrameEncoder {
     size_t total_dc[3] = {};
     for (size_t c : {1, 0, 2}) {
       if (jpeg_data.components.size() == 1 && c != 1) {
-        enc_state_->coeffs[0]->ZeroFillPlane(c);
         ZeroFillImage(&dc.Plane(c));
         // Ensure no division by 0.
         dc_counts[c][1024] = 1;
@@ -757,68 +797,122 @@ class LossyFrameEncoder {
       }
       size_t hshift = frame_header->chroma_subsampling.HShift(c);
       size_t vshift = frame_header->chroma_subsampling.VShift(c);
+      for (size_t by = 0; by < ysize_blocks; ++by) {
+        if ((by >> vshift) << vshift != by) continue;
+        const int16_t* JXL_RESTRICT inputjpeg = jpeg_row(c, by >> vshift);
+        float* JXL_RESTRICT fdc = dc.PlaneRow(c, by >> vshift);
+        for (size_t bx = 0; bx < xsize_blocks; ++bx) {
+          if ((bx >> hshift) << hshift != bx) continue;
+          size_t base = (bx >> hshift) * kDCTBlockSize;
+          int idc;
+          if (DCzero) {
+            idc = inputjpeg[base];
+          } else {
+            idc = inputjpeg[base] + 1024 / qt[c * 64];
+          }
+          dc_counts[c][std::min(static_cast<uint32_t>(idc + 1024),
+                                uint32_t(2047))]++;
+          total_dc[c]++;
+          fdc[bx >> hshift] = idc * dcquantization_r[c];
+        }
+      }
+    }
+
+    // Writes the AC coefficients of channel c of a group, in the layout of
+    // ACImage::PlaneRow(c, group_index, 0), to ac.
+    const auto convert_group_ac = [&](size_t c, size_t group_index,
+                                      int32_t* JXL_RESTRICT ac) {
+      const bool is_empty = jpeg_data.components.size() == 1 && c != 1;
+      if (is_empty || !frame_header->chroma_subsampling.Is444()) {
+        memset(ac, 0, kGroupDim * kGroupDim * sizeof(*ac));
+      }
+      if (is_empty) return;
+      size_t hshift = frame_header->chroma_subsampling.HShift(c);
+      size_t vshift = frame_header->chroma_subsampling.VShift(c);
       ImageSB& map = (c == 0 ? shared.cmap.ytox_map : shared.cmap.ytob_map);
-      for (size_t group_index = 0; group_index < frame_dim.num_groups;
-           group_index++) {
-        const size_t gx = group_index % frame_dim.xsize_groups;
-        const size_t gy = group_index / frame_dim.xsize_groups;
-        size_t offset = 0;
-        int32_t* JXL_RESTRICT ac =
-            enc_state_->coeffs[0]->PlaneRow(c, group_index, 0).ptr32;
-        for (size_t by = gy * kGroupDimInBlocks;
-             by < ysize_blocks && by < (gy + 1) * kGroupDimInBlocks; ++by) {
-          if ((by >> vshift) << vshift != by) continue;
-          const int16_t* JXL_RESTRICT inputjpeg = jpeg_row(c, by >> vshift);
-          const int16_t* JXL_RESTRICT inputjpegY = jpeg_row(1, by);
-          float* JXL_RESTRICT fdc = dc.PlaneRow(c, by >> vshift);
-          const int8_t* JXL_RESTRICT cm =
-              map.ConstRow(by / kColorTileDimInBlocks);
-          for (size_t bx = gx * kGroupDimInBlocks;
-               bx < xsize_blocks && bx < (gx + 1) * kGroupDimInBlocks; ++bx) {
-            if ((bx >> hshift) << hshift != bx) continue;
-            size_t base = (bx >> hshift) * kDCTBlockSize;
-            int idc;
-            if (DCzero) {
-              idc = inputjpeg[base];
-            } else {
-              idc = inputjpeg[base] + 1024 / qt[c * 64];
-            }
-            dc_counts[c][std::min(static_cast<uint32_t>(idc + 1024),
-                                  uint32_t(2047))]++;
-            total_dc[c]++;
-            fdc[bx >> hshift] = idc * dcquantization_r[c];
-            if (c == 1 || !enc_state_->cparams.force_cfl_jpeg_recompression ||
-                !frame_header->chroma_subsampling.Is444()) {
-              for (size_t y = 0; y < 8; y++) {
-                for (size_t x = 0; x < 8; x++) {
-                  ac[offset + y * 8 + x] = inputjpeg[base + x * 8 + y];
-                }
+      const size_t gx = group_index % frame_dim.xsize_groups;
+      const size_t gy = group_index / frame_dim.xsize_groups;
+      size_t offset = 0;
+      for (size_t by = gy * kGroupDimInBlocks;
+           by < ysize_blocks && by < (gy + 1) * kGroupDimInBlocks; ++by) {
+        if ((by >> vshift) << vshift != by) continue;
+        const int16_t* JXL_RESTRICT inputjpeg = jpeg_row(c, by >> vshift);
+        const int16_t* JXL_RESTRICT inputjpegY = jpeg_row(1, by);
+        const int8_t* JXL_RESTRICT cm =
+            map.ConstRow(by / kColorTileDimInBlocks);
+        for (size_t bx = gx * kGroupDimInBlocks;
+             bx < xsize_blocks && bx < (gx + 1) * kGroupDimInBlocks; ++bx) {
+          if ((bx >> hshift) << hshift != bx) continue;
+          size_t base = (bx >> hshift) * kDCTBlockSize;
+          if (c == 1 || !enc_state_->cparams.force_cfl_jpeg_recompression ||
+              !frame_header->chroma_subsampling.Is444()) {
+            for (size_t y = 0; y < 8; y++) {
+              for (size_t x = 0; x < 8; x++) {
+                ac[offset + y * 8 + x] = inputjpeg[base + x * 8 + y];
               }
-            } else {
-              const int32_t scale =
-                  shared.cmap.RatioJPEG(cm[bx / kColorTileDimInBlocks]);
-
-              for (size_t y = 0; y < 8; y++) {
-                for (size_t x = 0; x < 8; x++) {
-                  int Y = inputjpegY[kDCTBlockSize * bx + x * 8 + y];
-                  int QChroma = inputjpeg[kDCTBlockSize * bx + x * 8 + y];
-                  // Fixed-point multiply of CfL scale with quant table ratio
-                  // first, and Y value second.
-                  int coeff_scale = (scale * scaled_qtable[64 * c + y * 8 + x] +
-                                     (1 << (kCFLFixedPointPrecision - 1))) >>
-                                    kCFLFixedPointPrecision;
-                  int cfl_factor = (Y * coeff_scale +
-                                    (1 << (kCFLFixedPointPrecision - 1))) >>
-                                   kCFLFixedPointPrecision;
-                  int QCR = QChroma - cfl_factor;
-                  ac[offset + y * 8 + x] = QCR;
-                }
+            }
+          } else {
+            const int32_t scale =
+                shared.cmap.RatioJPEG(cm[bx / kColorTileDimInBlocks]);
+
+            for (size_t y = 0; y < 8; y++) {
+              for (size_t x = 0; x < 8; x++) {
+                int Y = inputjpegY[kDCTBlockSize * bx + x * 8 + y];
+                int QChroma = inputjpeg[kDCTBlockSize * bx + x * 8 + y];
+                // Fixed-point multiply of CfL scale with quant table ratio
+                // first, and Y value second.
+                int coeff_scale = (scale * scaled_qtable[64 * c + y * 8 + x] +
+                                   (1 << (kCFLFixedPointPrecision - 1))) >>
+                                  kCFLFixedPointPrecision;
+                int cfl_factor = (Y * coeff_scale +
+                                  (1 << (kCFLFixedPointPrecision - 1))) >>
+                                 kCFLFixedPointPrecision;
+                int QCR = QChroma - cfl_factor;
+                ac[offset + y * 8 + x] = QCR;
               }
             }
-            offset += 64;
           }
+          offset += 64;
         }
       }
+    };
+
+    // In low-memory mode the AC coefficients of each group are converted
+    // again whenever they are needed, into per-thread storage for a single
+    // group, instead of being stored for the whole frame.
+    const bool low_memory = enc_state_->cparams.jpeg_low_memory;
+    enc_state_->coeffs.clear();
+    if (!low_memory) {
+      CacheAligned::ScopedCategory scoped_category(
+          CacheAligned::Category::kCoefficients);
+      enc_state_->coeffs.emplace_back(make_unique<ACImageT<int32_t>>(
+          kGroupDim * kGroupDim, frame_dim.num_groups));
+      const auto convert_group = [&](const uint32_t group_index,
+                                     size_t /* thread */) {
+        for (size_t c = 0; c < 3; c++) {
+          convert_group_ac(
+              c, group_index,
+              enc_state_->coeffs[0]->PlaneRow(c, group_index, 0).ptr32);
+        }
+      };
+      JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, frame_dim.num_groups,
+                                    ThreadPool::NoInit, convert_group,
+                                    "ConvertJPEGCoefficients"));
+    }
+    std::vector<std::unique_ptr<ACImageT<int32_t>>> group_coeffs;
+    const auto convert_to_group_coeffs = [&](size_t group_index,
+                                             size_t thread) {
+      ACImageT<int32_t>* coeffs = group_coeffs[thread].get();
+      for (size_t c = 0; c < 3; c++) {
+        convert_group_ac(c, group_index, coeffs->PlaneRow(c, 0, 0).ptr32);
+      }
+      return coeffs;
+    };
+    if (low_memory) {
+      CacheAligned::ScopedCategory scoped_category(
+          CacheAligned::Category::kCoefficients);
+      group_coeffs.emplace_back(
+          make_unique<ACImageT<int32_t>>(kGroupDim * kGroupDim, 1));
     }
 
     auto& dct = enc_state_->shared.block_ctx_map.dc_thresholds;
@@ -884,24 +978,54 @@ class LossyFrameEncoder {
     JXL_CHECK(enc_state_->passes.size() ==
               1);  // skipping coeff splitting so need to have only one pass
 
-    ComputeAllCoeffOrders(frame_dim);
+    if (low_memory) {
+      const GetACGroupRows get_group_rows = [&](size_t group_index,
+                                                ConstACPtr rows[3]) {
+        const ACImageT<int32_t>* coeffs =
+            convert_to_group_coeffs(group_index, /*thread=*/0);
+        for (size_t c = 0; c < 3; c++) {
+          rows[c] = coeffs->PlaneRow(c, 0, 0);
+        }
+        return ACType::k32;
+      };
+      ComputeAllCoeffOrders(frame_dim, &get_group_rows);
+    } else {
+      ComputeAllCoeffOrders(frame_dim);
+    }
     shared.num_histograms = 1;
 
     const auto tokenize_group_init = [&](const size_t num_threads) {
       group_caches_.resize(num_threads);
+      for (EncCache& cache : group_caches_) {
+        cache.ac_histograms.clear();
+        cache.ac_histograms.resize(enc_state_->passes.size());
+      }
+      if (low_memory) {
+        CacheAligned::ScopedCategory scoped_category(
+            CacheAligned::Category::kCoefficients);
+        while (group_coeffs.size() < num_threads) {
+          group_coeffs.emplace_back(
+              make_unique<ACImageT<int32_t>>(kGroupDim * kGroupDim, 1));
+        }
+      }
       return true;
     };
     const auto tokenize_group = [&](const uint32_t group_index,
                                     const size_t thread) {
+      if (!PollProgress(enc_state_->progress)) return;
       // Tokenize coefficients.
       const Rect rect = shared.BlockGroupRect(group_index);
       for (size_t idx_pass = 0; idx_pass < enc_state_->passes.size();
            idx_pass++) {
-        JXL_ASSERT(enc_state_->coeffs[idx_pass]->Type() == ACType::k32);
+        const ACImage* coeffs =
+            low_memory ? convert_to_group_coeffs(group_index, thread)
+                       : enc_state_->coeffs[idx_pass].get();
+        const size_t row = low_memory ? 0 : group_index;
+        JXL_ASSERT(coeffs->Type() == ACType::k32);
         const int32_t* JXL_RESTRICT ac_rows[3] = {
-            enc_state_->coeffs[idx_pass]->PlaneRow(0, group_index, 0).ptr32,
-            enc_state_->coeffs[idx_pass]->PlaneRow(1, group_index, 0).ptr32,
-            enc_state_->coeffs[idx_pass]->PlaneRow(2, group_index, 0).ptr32,
+            coeffs->PlaneRow(0, row, 0).ptr32,
+            coeffs->PlaneRow(1, row, 0).ptr32,
+            coeffs->PlaneRow(2, row, 0).ptr32,
         };
         // Ensure group cache is initialized.
         group_caches_[thread].InitOnce();
@@ -911,12 +1035,16 @@ class LossyFrameEncoder {
             &group_caches_[thread].num_nzeroes,
             &enc_state_->passes[idx_pass].ac_tokens[group_index],
             enc_state_->shared.quant_dc, enc_state_->shared.raw_quant_field,
-            enc_state_->shared.block_ctx_map);
+            enc_state_->shared.block_ctx_map,
+            &group_caches_[thread].ac_histograms[idx_pass]);
       }
     };
+    AddProgressWork(enc_state_->progress, shared.frame_dim.num_groups);
     JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, shared.frame_dim.num_groups,
                                   tokenize_group_init, tokenize_group,
                                   "TokenizeGroup"));
+    JXL_RETURN_IF_ERROR(CheckProgress(enc_state_->progress));
+    MergeTokenHistograms();
     *frame_header = shared.frame_header;
     doing_jpeg_recompression = true;
     return true;
@@ -974,6 +1102,11 @@ class LossyFrameEncoder {
       if (enc_state_->cparams.decoding_speed_tier >= 1) {
         hist_params.max_histograms = 6;
       }
+      hist_params.pool = pool_;
+      // Tokens were only assigned to per-group histograms by ClusterGroups.
+      if (enc_state_->shared.num_histograms == 1) {
+        hist_params.histograms = &enc_state_->passes[i].ac_histograms;
+      }
       BuildAndEncodeHistograms(
           hist_params,
           enc_state_->shared.num_histograms *
@@ -987,17 +1120,43 @@ class LossyFrameEncoder {
 
   Status EncodeACGroup(size_t pass, size_t group_index, BitWriter* group_code,
                        AuxOut* local_aux_out) {
-    return EncodeGroupTokenizedCoefficients(
+    JXL_RETURN_IF_ERROR(EncodeGroupTokenizedCoefficients(
         group_index, pass, enc_state_->histogram_idx[group_index], *enc_state_,
-        group_code, local_aux_out);
+        group_code, local_aux_out));
+    if (enc_state_->cparams.low_memory) {
+      std::vector<Token>().swap(
+          enc_state_->passes[pass].ac_tokens[group_index]);
+    }
+    return true;
   }
 
   PassesEncoderState* State() { return enc_state_; }
 
  private:
-  void ComputeAllCoeffOrders(const FrameDimensions& frame_dim) {
+  // Sums the token histograms of all the threads into the ones of the passes.
+  void MergeTokenHistograms() {
+    for (size_t i = 0; i < enc_state_->passes.size(); i++) {
+      std::vector<Histogram>& histograms =
+          enc_state_->passes[i].ac_histograms;
+      histograms.clear();
+      histograms.resize(enc_state_->shared.block_ctx_map.NumACContexts());
+      for (EncCache& cache : group_caches_) {
+        const std::vector<Histogram>& thread_histograms =
+            cache.ac_histograms[i];
+        for (size_t c = 0; c < thread_histograms.size(); c++) {
+          histograms[c].AddHistogram(thread_histograms[c]);
+        }
+        cache.ac_histograms[i].clear();
+      }
+    }
+  }
+
+  // If get_group_rows is not null, it provides the coefficients of the (only)
+  // pass instead of enc_state_->coeffs.
+  void ComputeAllCoeffOrders(const FrameDimensions& frame_dim,
+                             const GetACGroupRows* get_group_rows = nullptr) {
     PROFILER_FUNC;
-    // No coefficient reordering in Falcon or faster.
+    // Only the DCT8 order is customized in Falcon, and none in Lightning.
     auto used_orders_info = ComputeUsedOrders(
         enc_state_->cparams.speed_tier, enc_state_->shared.ac_strategy,
         Rect(enc_state_->shared.raw_quant_field));
@@ -1007,12 +1166,22 @@ class LossyFrameEncoder {
         used_orders_info.second);
     for (size_t i = 0; i < enc_state_->progressive_splitter.GetNumPasses();
          i++) {
-      ComputeCoeffOrder(
-          enc_state_->cparams.speed_tier, *enc_state_->coeffs[i],
-          enc_state_->shared.ac_strategy, frame_dim, enc_state_->used_orders[i],
-          used_orders_info.first,
+      coeff_order_t* order =
           &enc_state_->shared
-               .coeff_orders[i * enc_state_->shared.coeff_order_size]);
+               .coeff_orders[i * enc_state_->shared.coeff_order_size];
+      if (get_group_rows != nullptr) {
+        JXL_ASSERT(i == 0);
+        ComputeCoeffOrder(enc_state_->cparams.speed_tier, *get_group_rows,
+                          enc_state_->shared.ac_strategy, frame_dim,
+                          enc_state_->used_orders[i], used_orders_info.first,
+                          order);
+      } else {
+        ComputeCoeffOrder(enc_state_->cparams.speed_tier,
+                          *enc_state_->coeffs[i],
+                          enc_state_->shared.ac_strategy, frame_dim,
+                          enc_state_->used_orders[i], used_orders_info.first,
+                          order);
+      }
     }
   }
 
@@ -1070,13 +1239,18 @@ Status EncodeFrame(const CompressParams& cparams_orig,
                    const FrameInfo& frame_info, const CodecMetadata* metadata,
                    const ImageBundle& ib, PassesEncoderState* passes_enc_state,
                    const JxlCmsInterface& cms, ThreadPool* pool,
-                   BitWriter* writer, AuxOut* aux_out) {
+                   BitWriter* writer, AuxOut* aux_out,
+                   std::vector<PaddedBytes>* sections) {
   ib.VerifyMetadata();
 
   passes_enc_state->special_frames.clear();
 
   CompressParams cparams = cparams_orig;
   JXL_RETURN_IF_ERROR(ParamsPostInit(&cparams));
+  // Special frames encoded for this one, e.g. DC frames, share its deadline.
+  if (cparams.time_budget > 0 && cparams.deadline == nullptr) {
+    cparams.deadline = std::make_shared<EncoderDeadline>(cparams.time_budget);
+  }
 
   if (cparams.progressive_dc < 0) {
     if (cparams.progressive_dc != -1) {
@@ -1113,6 +1287,23 @@ Status EncodeFrame(const CompressParams& cparams_orig,
 
   if (ib.xsize() == 0 || ib.ysize() == 0) return JXL_FAILURE("Empty image");
 
+  if (cparams.classify_content && !ib.IsJPEG() && !cparams.modular_mode &&
+      !cparams.explicit_vardct && cparams.butteraugli_distance > 0) {
+    const ContentClassification content =
+        ClassifyContent(ib, std::max(0, cparams.palette_colors));
+    if (content.content_class == ContentClass::kFewColors) {
+      cparams.modular_mode = true;
+    } else if (cparams.patches == Override::kDefault) {
+      cparams.patches = content.content_class == ContentClass::kScreenContent
+                            ? Override::kOn
+                            : Override::kOff;
+    }
+    if (aux_out != nullptr) {
+      aux_out->content_classified = true;
+      aux_out->content = content;
+    }
+  }
+
   // Assert that this metadata is correctly set up for the compression params,
   // this should have been done by enc_file.cc
   JXL_ASSERT(metadata->m.xyb_encoded ==
@@ -1122,6 +1313,16 @@ Status EncodeFrame(const CompressParams& cparams_orig,
   JXL_RETURN_IF_ERROR(MakeFrameHeader(cparams,
                                       passes_enc_state->progressive_splitter,
                                       frame_info, ib, frame_header.get()));
+  if (cparams.max_decode_cycles > 0) {
+    while (PredictDecodeCost(cparams, *frame_header).Total() >
+               cparams.max_decode_cycles &&
+           ReduceDecodeCost(*frame_header, &cparams)) {
+      frame_header = jxl::make_unique<FrameHeader>(metadata);
+      JXL_RETURN_IF_ERROR(MakeFrameHeader(
+          cparams, passes_enc_state->progressive_splitter, frame_info, ib,
+          frame_header.get()));
+    }
+  }
   // Check that if the codestream header says xyb_encoded, the color_transform
   // matches the requirement. This is checked from the cparams here, even though
   // optimally we'd be able to check this against what has actually been written
@@ -1143,6 +1344,11 @@ Status EncodeFrame(const CompressParams& cparams_orig,
   }
 
   FrameDimensions frame_dim = frame_header->ToFrameDimensions();
+  if (cparams.importance_map != nullptr &&
+      (cparams.importance_map->xsize() != frame_dim.xsize_blocks ||
+       cparams.importance_map->ysize() != frame_dim.ysize_blocks)) {
+    return JXL_FAILURE("Importance map does not match the frame blocks");
+  }
 
   const size_t num_groups = frame_dim.num_groups;
 
@@ -1192,12 +1398,19 @@ Status EncodeFrame(const CompressParams& cparams_orig,
   passes_enc_state->shared.image_features.patches.SetPassesSharedState(
       &passes_enc_state->shared);
 
+  EncoderCounters* counters = passes_enc_state->counters;
+  ProgressMonitor* progress = passes_enc_state->progress;
+  const auto timer_for = [counters](EncoderCounters::Phase phase) {
+    return counters != nullptr ? counters->Timer(phase) : nullptr;
+  };
+  ScopedPhaseTimer transform_timer(timer_for(EncoderCounters::kTransform));
   if (ib.IsJPEG()) {
     JXL_RETURN_IF_ERROR(lossy_frame_encoder.ComputeJPEGTranscodingData(
         *ib.jpeg_data, modular_frame_encoder.get(), frame_header.get()));
   } else if (!lossy_frame_encoder.State()->heuristics->HandlesColorConversion(
                  cparams, ib) ||
-             frame_header->encoding != FrameEncoding::kVarDCT) {
+             frame_header->encoding != FrameEncoding::kVarDCT ||
+             passes_enc_state->reuse_analysis) {
     // Allocating a large enough image avoids a copy when padding.
     opsin =
         Image3F(RoundUpToBlockDim(ib.xsize()), RoundUpToBlockDim(ib.ysize()));
@@ -1212,8 +1425,29 @@ Status EncodeFrame(const CompressParams& cparams_orig,
       // linear_storage would only be used by the Butteraugli loop (passing
       // linear sRGB avoids a color conversion there). Otherwise, don't
       // fill it to reduce memory usage.
-      ib_or_linear =
-          ToXYB(ib, pool, &opsin, cms, want_linear ? &linear_storage : nullptr);
+      PassesEncoderState::FrameAnalysis* analysis =
+          passes_enc_state->reuse_analysis
+              ? GetFrameAnalysis(ib, passes_enc_state)
+              : nullptr;
+      if (analysis != nullptr && SameSize(analysis->xyb, opsin) &&
+          (!want_linear || SameSize(analysis->linear, opsin))) {
+        CopyImageTo(analysis->xyb, &opsin);
+        if (want_linear) {
+          linear_storage.SetFromImage(CopyImage(analysis->linear), c_linear);
+          ib_or_linear = &linear_storage;
+        }
+      } else {
+        ib_or_linear = ToXYB(ib, pool, &opsin, cms,
+                             want_linear ? &linear_storage : nullptr);
+        if (cparams.deadline != nullptr) {
+          cparams.deadline->Done(EncoderDeadline::kColorTransform,
+                                 ib.xsize() * ib.ysize());
+        }
+        if (analysis != nullptr) {
+          analysis->xyb = CopyImage(opsin);
+          if (want_linear) analysis->linear = CopyImage(ib_or_linear->color());
+        }
+      }
     } else {  // RGB or YCbCr: don't do anything (forward YCbCr is not
               // implemented, this is only used when the input is already in
               // YCbCr)
@@ -1259,12 +1493,24 @@ Status EncodeFrame(const CompressParams& cparams_orig,
       DownsampleImage(&extra_channels_storage.back(), cparams.ec_resampling);
     }
   }
+  transform_timer.Stop();
   // needs to happen *AFTER* VarDCT-ComputeEncodingData.
-  JXL_RETURN_IF_ERROR(modular_frame_encoder->ComputeEncodingData(
-      *frame_header, *ib.metadata(), &opsin, *extra_channels,
-      lossy_frame_encoder.State(), cms, pool, aux_out,
-      /* do_color=*/frame_header->encoding == FrameEncoding::kModular));
+  {
+    ScopedPhaseTimer modular_timer(timer_for(EncoderCounters::kModular));
+    JXL_RETURN_IF_ERROR(modular_frame_encoder->ComputeEncodingData(
+        *frame_header, *ib.metadata(), &opsin, *extra_channels,
+        lossy_frame_encoder.State(), cms, pool, aux_out,
+        /* do_color=*/frame_header->encoding == FrameEncoding::kModular));
+  }
+  ScopedPhaseTimer write_timer(timer_for(EncoderCounters::kWrite));
+  if (cparams.low_memory) {
+    // Only the encoded data of the frame is needed from here on.
+    opsin = Image3F();  // Already released for VarDCT.
+    linear_storage = ImageBundle(metadata_linear.get());
+    extra_channels_storage.clear();
+  }
 
+  const size_t start_bits = writer->BitsWritten();
   writer->AppendByteAligned(lossy_frame_encoder.State()->special_frames);
   frame_header->UpdateFlag(
       lossy_frame_encoder.State()->shared.image_features.patches.HasAny(),
@@ -1327,12 +1573,13 @@ Status EncodeFrame(const CompressParams& cparams_orig,
         lossy_frame_encoder.EncodeGlobalDCInfo(*frame_header, get_output(0)));
   }
   JXL_RETURN_IF_ERROR(
-      modular_frame_encoder->EncodeGlobalInfo(get_output(0), aux_out));
+      modular_frame_encoder->EncodeGlobalInfo(get_output(0), aux_out, pool));
   JXL_RETURN_IF_ERROR(modular_frame_encoder->EncodeStream(
       get_output(0), aux_out, kLayerModularGlobal, ModularStreamId::Global()));
 
   const auto process_dc_group = [&](const uint32_t group_index,
                                     const size_t thread) {
+    if (!PollProgress(progress)) return;
     AuxOut* my_aux_out = aux_out ? &aux_outs[thread] : nullptr;
     BitWriter* output = get_output(group_index + 1);
     if (frame_header->encoding == FrameEncoding::kVarDCT &&
@@ -1361,10 +1608,14 @@ Status EncodeFrame(const CompressParams& cparams_orig,
           output, my_aux_out, kLayerControlFields,
           ModularStreamId::ACMetadata(group_index)));
     }
+    // The finished sections are held until the whole frame is encoded.
+    if (!is_small_image) output->ShrinkToFit();
   };
+  AddProgressWork(progress, frame_dim.num_dc_groups);
   JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, frame_dim.num_dc_groups,
                                 resize_aux_outs, process_dc_group,
                                 "EncodeDCGroup"));
+  JXL_RETURN_IF_ERROR(CheckProgress(progress));
 
   if (frame_header->encoding == FrameEncoding::kVarDCT) {
     JXL_RETURN_IF_ERROR(lossy_frame_encoder.EncodeGlobalACInfo(
@@ -1374,6 +1625,7 @@ Status EncodeFrame(const CompressParams& cparams_orig,
   std::atomic<int> num_errors{0};
   const auto process_group = [&](const uint32_t group_index,
                                  const size_t thread) {
+    if (!PollProgress(progress)) return;
     AuxOut* my_aux_out = aux_out ? &aux_outs[thread] : nullptr;
 
     for (size_t i = 0; i < num_passes; i++) {
@@ -1391,14 +1643,18 @@ Status EncodeFrame(const CompressParams& cparams_orig,
         num_errors.fetch_add(1, std::memory_order_relaxed);
         return;
       }
+      if (!is_small_image) ac_group_code(i, group_index)->ShrinkToFit();
     }
   };
+  AddProgressWork(progress, num_groups);
   JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_groups, resize_aux_outs,
                                 process_group, "EncodeGroupCoefficients"));
 
   // Resizing aux_outs to 0 also Assimilates the array.
   static_cast<void>(resize_aux_outs(0));
   JXL_RETURN_IF_ERROR(num_errors.load(std::memory_order_relaxed) == 0);
+  JXL_RETURN_IF_ERROR(CheckProgress(progress));
+  if (counters != nullptr) counters->groups += num_groups;
 
   for (BitWriter& bw : group_codes) {
     bw.ZeroPadToByte();  // end of group.
@@ -1482,6 +1738,28 @@ Status EncodeFrame(const CompressParams& cparams_orig,
 
   JXL_RETURN_IF_ERROR(
       WriteGroupOffsets(group_codes, permutation_ptr, writer, aux_out));
+  size_t frame_bits = writer->BitsWritten() - start_bits;
+  for (const BitWriter& bw : group_codes) frame_bits += bw.BitsWritten();
+  const DecodeCost decode_cost = EstimateDecodeCost(*frame_header, frame_bits);
+  if (aux_out != nullptr) aux_out->decode_cost = decode_cost;
+  if (counters != nullptr) {
+    const uint64_t num_pixels =
+        static_cast<uint64_t>(frame_dim.xsize_upsampled) *
+        frame_dim.ysize_upsampled;
+    for (size_t i = 0; i < DecodeCost::kNumStages; i++) {
+      counters->decode_cycles[i] += static_cast<uint64_t>(std::llround(
+          static_cast<double>(decode_cost.cycles_per_pixel[i]) * num_pixels));
+    }
+    counters->decode_pixels += num_pixels;
+  }
+  if (sections != nullptr) {
+    // The sections are byte-aligned, so the frame ends with them.
+    for (BitWriter& bw : group_codes) {
+      if (bw.BitsWritten() == 0) continue;
+      sections->emplace_back(std::move(bw).TakeBytes());
+    }
+    return true;
+  }
   writer->AppendByteAligned(group_codes);
   writer->ZeroPadToByte();  // end of frame.
 
@@ -9,6 +9,7 @@
 #include "lib/jxl/aux_out.h"
 #include "lib/jxl/aux_out_fwd.h"
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/padded_bytes.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/enc_cache.h"
@@ -66,12 +67,15 @@ Status ParamsPostInit(CompressParams* p);
 // Encodes a single frame (including its header) into a byte stream.  Groups may
 // be processed in parallel by `pool`. metadata is the ImageMetadata encoded in
 // the codestream, and must be used for the FrameHeaders, do not use
-// ib.metadata.
+// ib.metadata. If `sections` is not null, the sections after the TOC may be
+// moved to it in codestream order instead of being copied to `writer`: the
+// frame is then the bytes of `writer` followed by those of `sections`.
 Status EncodeFrame(const CompressParams& cparams_orig,
                    const FrameInfo& frame_info, const CodecMetadata* metadata,
                    const ImageBundle& ib, PassesEncoderState* passes_enc_state,
                    const JxlCmsInterface& cms, ThreadPool* pool,
-                   BitWriter* writer, AuxOut* aux_out);
+                   BitWriter* writer, AuxOut* aux_out,
+                   std::vector<PaddedBytes>* sections = nullptr);
 
 }  // namespace jxl
 
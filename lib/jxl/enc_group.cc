@@ -5,6 +5,7 @@
 
 #include "lib/jxl/enc_group.h"
 
+#include <algorithm>
 #include <utility>
 
 #include "hwy/aligned_allocator.h"
@@ -94,33 +95,68 @@ void QuantizeBlockAC(const Quantizer& quantizer, const bool error_diffusion,
     return;
   }
 
+  HWY_CAPPED(float, kBlockDim) df;
+  HWY_CAPPED(int32_t, kBlockDim) di;
+  using V = decltype(Zero(df));
+  const size_t half_x = xsize * kBlockDim / 2;
+
 retry:
   int hfNonZeros[4] = {};
   float hfError[4] = {};
   float hfMaxError[4] = {};
   size_t hfMaxErrorIx[4] = {};
-  for (size_t y = 0; y < ysize * kBlockDim; y++) {
-    for (size_t x = 0; x < xsize * kBlockDim; x++) {
-      const size_t pos = y * kBlockDim * xsize + x;
-      if (x < xsize && y < ysize) {
-        // Ensure block is initialized
-        block_out[pos] = 0;
-        continue;
-      }
-      const size_t hfix = (static_cast<size_t>(y >= ysize * kBlockDim / 2) * 2 +
-                           static_cast<size_t>(x >= xsize * kBlockDim / 2));
-      const float val = block_in[pos] * (qm[pos] * qac * qm_multiplier);
-      float v = (std::abs(val) < thres[hfix]) ? 0 : rintf(val);
-      const float error = std::abs(val) - std::abs(v);
-      hfError[hfix] += error * error;
-      if (hfMaxError[hfix] < error) {
-        hfMaxError[hfix] = error;
-        hfMaxErrorIx[hfix] = pos;
-      }
-      if (v != 0.0f) {
-        hfNonZeros[hfix] += std::abs(v);
+  {
+    // Per quadrant and lane: sums of the squared errors and of the absolute
+    // quantized values, and largest error with its position.
+    V error_sum[4], nonzero_sum[4], max_error[4], max_error_pos[4];
+    for (size_t i = 0; i < 4; ++i) {
+      error_sum[i] = nonzero_sum[i] = max_error[i] = max_error_pos[i] =
+          Zero(df);
+    }
+    const auto qac_v = Set(df, qac);
+    const auto qm_multiplier_v = Set(df, qm_multiplier);
+    for (size_t y = 0; y < ysize * kBlockDim; y++) {
+      const size_t yfix = static_cast<size_t>(y >= ysize * kBlockDim / 2) * 2;
+      const auto thr_left = Set(df, thres[yfix]);
+      const auto thr_right = Set(df, thres[yfix + 1]);
+      // The lowest frequencies, left of xsize in the first ysize rows, are
+      // left for the DC.
+      const auto hf_begin = Set(df, y < ysize ? xsize : 0.0f);
+      const size_t off = y * kBlockDim * xsize;
+      for (size_t x = 0; x < xsize * kBlockDim; x += Lanes(df)) {
+        const size_t pos = off + x;
+        const auto lane_x = Iota(df, x);
+        const auto left = lane_x < Set(df, half_x);
+        const auto thr = IfThenElse(left, thr_left, thr_right);
+        const auto val = Load(df, block_in + pos) *
+                         (Load(df, qm + pos) * qac_v * qm_multiplier_v);
+        const auto v = IfThenZeroElse(Abs(val) < thr, Round(val));
+        const auto hf = lane_x >= hf_begin;
+        Store(ConvertTo(di, IfThenElseZero(hf, v)), di, block_out + pos);
+        const auto error = Abs(val) - Abs(v);
+        const auto lane_pos = Iota(df, pos);
+        for (size_t right = 0; right < 2; right++) {
+          const auto in_quadrant = And(hf, right ? Not(left) : left);
+          if (AllFalse(df, in_quadrant)) continue;
+          const size_t i = yfix + right;
+          error_sum[i] += IfThenElseZero(in_quadrant, error * error);
+          nonzero_sum[i] += IfThenElseZero(in_quadrant, Abs(v));
+          const auto larger = And(in_quadrant, error > max_error[i]);
+          max_error[i] = IfThenElse(larger, error, max_error[i]);
+          max_error_pos[i] = IfThenElse(larger, lane_pos, max_error_pos[i]);
+        }
       }
-      block_out[pos] = static_cast<int32_t>(rintf(v));
+    }
+    for (size_t i = 0; i < 4; ++i) {
+      hfError[i] = GetLane(SumOfLanes(df, error_sum[i]));
+      hfNonZeros[i] =
+          static_cast<int>(GetLane(SumOfLanes(df, nonzero_sum[i])));
+      hfMaxError[i] = GetLane(MaxOfLanes(df, max_error[i]));
+      // The first position with the largest error, as in scanning order.
+      const auto is_max = max_error[i] == Set(df, hfMaxError[i]);
+      hfMaxErrorIx[i] = static_cast<size_t>(GetLane(
+          MinOfLanes(df, IfThenElse(is_max, max_error_pos[i],
+                                    Set(df, AcStrategy::kMaxCoeffArea)))));
     }
   }
   if (c != 1) return;
@@ -178,8 +214,9 @@ void QuantizeRoundtripYBlockAC(const Quantizer& quantizer,
   }
 }
 
-void ComputeCoefficients(size_t group_idx, PassesEncoderState* enc_state,
-                         const Image3F& opsin, Image3F* dc) {
+void ComputeCoefficients(size_t group_idx, size_t by0, size_t by1,
+                         PassesEncoderState* enc_state, const Image3F& opsin,
+                         Image3F* dc) {
   PROFILER_FUNC;
   const Rect block_group_rect = enc_state->shared.BlockGroupRect(group_idx);
   const Rect group_rect = enc_state->shared.GroupRect(group_idx);
@@ -222,9 +259,21 @@ void ComputeCoefficients(size_t group_idx, PassesEncoderState* enc_state,
     HWY_ALIGN float* coeffs_in = fmem.get();
     HWY_ALIGN int32_t* quantized = mem.get();
 
+    // The coefficients of the group are stored in the order of the blocks,
+    // so those of row by0 come after the ones of all the blocks above it.
     size_t offset = 0;
+    for (size_t by = 0; by < by0; ++by) {
+      AcStrategyRow ac_strategy_row =
+          enc_state->shared.ac_strategy.ConstRow(block_group_rect, by);
+      for (size_t bx = 0; bx < xsize_blocks; ++bx) {
+        const AcStrategy acs = ac_strategy_row[bx];
+        if (!acs.IsFirstBlock()) continue;
+        offset +=
+            kDCTBlockSize * acs.covered_blocks_x() * acs.covered_blocks_y();
+      }
+    }
 
-    for (size_t by = 0; by < ysize_blocks; ++by) {
+    for (size_t by = by0; by < std::min(by1, ysize_blocks); ++by) {
       const int32_t* JXL_RESTRICT row_quant_ac =
           block_group_rect.ConstRow(full_quant_field, by);
       size_t ty = by / kColorTileDimInBlocks;
@@ -263,10 +312,18 @@ void ComputeCoefficients(size_t group_idx, PassesEncoderState* enc_state,
 
           size_t size = kDCTBlockSize * xblocks * yblocks;
 
+          // DCT all channels, unless the AC strategy search already did.
+          const bool have_coeffs = LoadSearchedCoefficients(
+              acs, block_group_rect.x0() + bx, block_group_rect.y0() + by,
+              *enc_state, coeffs_in);
+
           // DCT Y channel, roundtrip-quantize it and set DC.
           const int32_t quant_ac = row_quant_ac[bx];
-          TransformFromPixels(acs.Strategy(), opsin_rows[1] + bx * kBlockDim,
-                              opsin_stride, coeffs_in + size, scratch_space);
+          if (!have_coeffs) {
+            TransformFromPixels(acs.Strategy(),
+                                opsin_rows[1] + bx * kBlockDim, opsin_stride,
+                                coeffs_in + size, scratch_space);
+          }
           DCFromLowestFrequencies(acs.Strategy(), coeffs_in + size,
                                   dc_rows[1] + bx, dc_stride);
           QuantizeRoundtripYBlockAC(
@@ -276,6 +333,7 @@ void ComputeCoefficients(size_t group_idx, PassesEncoderState* enc_state,
 
           // DCT X and B channels
           for (size_t c : {0, 2}) {
+            if (have_coeffs) continue;
             TransformFromPixels(acs.Strategy(), opsin_rows[c] + bx * kBlockDim,
                                 opsin_stride, coeffs_in + c * size,
                                 scratch_space);
@@ -320,10 +378,11 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jxl {
 HWY_EXPORT(ComputeCoefficients);
-void ComputeCoefficients(size_t group_idx, PassesEncoderState* enc_state,
-                         const Image3F& opsin, Image3F* dc) {
-  return HWY_DYNAMIC_DISPATCH(ComputeCoefficients)(group_idx, enc_state, opsin,
-                                                   dc);
+void ComputeCoefficients(size_t group_idx, size_t by0, size_t by1,
+                         PassesEncoderState* enc_state, const Image3F& opsin,
+                         Image3F* dc) {
+  return HWY_DYNAMIC_DISPATCH(ComputeCoefficients)(group_idx, by0, by1,
+                                                   enc_state, opsin, dc);
 }
 
 Status EncodeGroupTokenizedCoefficients(size_t group_idx, size_t pass_idx,
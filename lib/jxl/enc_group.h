@@ -16,9 +16,12 @@
 
 namespace jxl {
 
-// Fills DC
-void ComputeCoefficients(size_t group_idx, PassesEncoderState* enc_state,
-                         const Image3F& opsin, Image3F* dc);
+// Computes the quantized coefficients, and fills DC, of the blocks that start
+// in the rows [by0, by1) of blocks of the group. Different rows of the same
+// group can be computed concurrently.
+void ComputeCoefficients(size_t group_idx, size_t by0, size_t by1,
+                         PassesEncoderState* enc_state, const Image3F& opsin,
+                         Image3F* dc);
 
 Status EncodeGroupTokenizedCoefficients(size_t group_idx, size_t pass_idx,
                                         size_t histogram_idx,
@@ -5,6 +5,9 @@
 
 #include "lib/jxl/enc_image_bundle.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <limits>
 #include <utility>
 
@@ -36,72 +39,93 @@ Status CopyToT(const ImageMetadata* metadata, const ImageBundle* ib,
   } else {
     out->ShrinkTo(rect.xsize(), rect.ysize());
   }
+  // Short rows are converted in batches of several rows, which amortizes the
+  // per-call overhead of the CMS.
+  const size_t xsize = rect.xsize();
+  const size_t ysize = rect.ysize();
+  constexpr size_t kPixelsPerTask = 4096;
+  const size_t rows_per_task = std::max<size_t>(
+      1, std::min(ysize, DivCeil(kPixelsPerTask, std::max<size_t>(xsize, 1))));
   std::atomic<bool> ok{true};
   JXL_RETURN_IF_ERROR(RunOnPool(
-      pool, 0, rect.ysize(),
+      pool, 0, DivCeil(ysize, rows_per_task),
       [&](const size_t num_threads) {
         return c_transform.Init(ib->c_current(), c_desired,
-                                metadata->IntensityTarget(), rect.xsize(),
-                                num_threads);
+                                metadata->IntensityTarget(),
+                                xsize * rows_per_task, num_threads);
       },
-      [&](const uint32_t y, const size_t thread) {
+      [&](const uint32_t task, const size_t thread) {
+        const size_t y0 = task * rows_per_task;
+        const size_t num_rows = std::min(rows_per_task, ysize - y0);
         float* mutable_src_buf = c_transform.BufSrc(thread);
-        const float* src_buf = mutable_src_buf;
         // Interleave input.
-        if (is_gray) {
-          src_buf = rect.ConstPlaneRow(ib->color(), 0, y);
-        } else if (ib->c_current().IsCMYK()) {
-          if (!ib->HasBlack()) {
-            ok.store(false);
-            return;
-          }
-          const float* JXL_RESTRICT row_in0 =
-              rect.ConstPlaneRow(ib->color(), 0, y);
-          const float* JXL_RESTRICT row_in1 =
-              rect.ConstPlaneRow(ib->color(), 1, y);
-          const float* JXL_RESTRICT row_in2 =
-              rect.ConstPlaneRow(ib->color(), 2, y);
-          const float* JXL_RESTRICT row_in3 = rect.ConstRow(ib->black(), y);
-          for (size_t x = 0; x < rect.xsize(); x++) {
-            // CMYK convention in JXL: 0 = max ink, 1 = white
-            mutable_src_buf[4 * x + 0] = row_in0[x];
-            mutable_src_buf[4 * x + 1] = row_in1[x];
-            mutable_src_buf[4 * x + 2] = row_in2[x];
-            mutable_src_buf[4 * x + 3] = row_in3[x];
-          }
-        } else {
-          const float* JXL_RESTRICT row_in0 =
-              rect.ConstPlaneRow(ib->color(), 0, y);
-          const float* JXL_RESTRICT row_in1 =
-              rect.ConstPlaneRow(ib->color(), 1, y);
-          const float* JXL_RESTRICT row_in2 =
-              rect.ConstPlaneRow(ib->color(), 2, y);
-          for (size_t x = 0; x < rect.xsize(); x++) {
-            mutable_src_buf[3 * x + 0] = row_in0[x];
-            mutable_src_buf[3 * x + 1] = row_in1[x];
-            mutable_src_buf[3 * x + 2] = row_in2[x];
+        if (ib->c_current().IsCMYK() && !ib->HasBlack()) {
+          ok.store(false);
+          return;
+        }
+        for (size_t i = 0; i < num_rows; i++) {
+          const size_t y = y0 + i;
+          if (is_gray) {
+            memcpy(mutable_src_buf + i * xsize,
+                   rect.ConstPlaneRow(ib->color(), 0, y),
+                   xsize * sizeof(float));
+          } else if (ib->c_current().IsCMYK()) {
+            float* JXL_RESTRICT row_buf = mutable_src_buf + 4 * i * xsize;
+            const float* JXL_RESTRICT row_in0 =
+                rect.ConstPlaneRow(ib->color(), 0, y);
+            const float* JXL_RESTRICT row_in1 =
+                rect.ConstPlaneRow(ib->color(), 1, y);
+            const float* JXL_RESTRICT row_in2 =
+                rect.ConstPlaneRow(ib->color(), 2, y);
+            const float* JXL_RESTRICT row_in3 = rect.ConstRow(ib->black(), y);
+            for (size_t x = 0; x < xsize; x++) {
+              // CMYK convention in JXL: 0 = max ink, 1 = white
+              row_buf[4 * x + 0] = row_in0[x];
+              row_buf[4 * x + 1] = row_in1[x];
+              row_buf[4 * x + 2] = row_in2[x];
+              row_buf[4 * x + 3] = row_in3[x];
+            }
+          } else {
+            float* JXL_RESTRICT row_buf = mutable_src_buf + 3 * i * xsize;
+            const float* JXL_RESTRICT row_in0 =
+                rect.ConstPlaneRow(ib->color(), 0, y);
+            const float* JXL_RESTRICT row_in1 =
+                rect.ConstPlaneRow(ib->color(), 1, y);
+            const float* JXL_RESTRICT row_in2 =
+                rect.ConstPlaneRow(ib->color(), 2, y);
+            for (size_t x = 0; x < xsize; x++) {
+              row_buf[3 * x + 0] = row_in0[x];
+              row_buf[3 * x + 1] = row_in1[x];
+              row_buf[3 * x + 2] = row_in2[x];
+            }
           }
         }
         float* JXL_RESTRICT dst_buf = c_transform.BufDst(thread);
-        if (!c_transform.Run(thread, src_buf, dst_buf)) {
+        if (!c_transform.Run(thread, mutable_src_buf, dst_buf,
+                             xsize * num_rows)) {
           ok.store(false);
           return;
         }
-        float* JXL_RESTRICT row_out0 = out->PlaneRow(0, y);
-        float* JXL_RESTRICT row_out1 = out->PlaneRow(1, y);
-        float* JXL_RESTRICT row_out2 = out->PlaneRow(2, y);
         // De-interleave output and convert type.
-        if (is_gray) {
-          for (size_t x = 0; x < rect.xsize(); x++) {
-            row_out0[x] = dst_buf[x];
-            row_out1[x] = dst_buf[x];
-            row_out2[x] = dst_buf[x];
-          }
-        } else {
-          for (size_t x = 0; x < rect.xsize(); x++) {
-            row_out0[x] = dst_buf[3 * x + 0];
-            row_out1[x] = dst_buf[3 * x + 1];
-            row_out2[x] = dst_buf[3 * x + 2];
+        for (size_t i = 0; i < num_rows; i++) {
+          const size_t y = y0 + i;
+          float* JXL_RESTRICT row_out0 = out->PlaneRow(0, y);
+          float* JXL_RESTRICT row_out1 = out->PlaneRow(1, y);
+          float* JXL_RESTRICT row_out2 = out->PlaneRow(2, y);
+          if (is_gray) {
+            const float* JXL_RESTRICT row_buf = dst_buf + i * xsize;
+            for (size_t x = 0; x < xsize; x++) {
+              row_out0[x] = row_buf[x];
+              row_out1[x] = row_buf[x];
+              row_out2[x] = row_buf[x];
+            }
+          } else {
+            const float* JXL_RESTRICT row_buf = dst_buf + 3 * i * xsize;
+            for (size_t x = 0; x < xsize; x++) {
+              row_out0[x] = row_buf[3 * x + 0];
+              row_out1[x] = row_buf[3 * x + 1];
+              row_out2[x] = row_buf[3 * x + 2];
+            }
           }
         }
       },
@@ -8,7 +8,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cmath>
 #include <limits>
 #include <queue>
 #include <utility>
@@ -23,11 +26,13 @@
 #include "lib/jxl/dec_ans.h"
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/enc_cluster.h"
+#include "lib/jxl/enc_deadline.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/enc_patch_dictionary.h"
 #include "lib/jxl/enc_quant_weights.h"
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/gaborish.h"
+#include "lib/jxl/image_ops.h"
 #include "lib/jxl/modular/encoding/context_predict.h"
 #include "lib/jxl/modular/encoding/enc_debug_tree.h"
 #include "lib/jxl/modular/encoding/enc_encoding.h"
@@ -35,6 +40,7 @@
 #include "lib/jxl/modular/encoding/ma_common.h"
 #include "lib/jxl/modular/modular_image.h"
 #include "lib/jxl/modular/options.h"
+#include "lib/jxl/modular/transform/enc_rct.h"
 #include "lib/jxl/modular/transform/enc_transform.h"
 #include "lib/jxl/toc.h"
 
@@ -179,6 +185,37 @@ Tree PredefinedTree(ModularOptions::TreeKind tree_kind, size_t total_pixels) {
   return {};
 }
 
+// Histogram of the static prefix code, see CompressParams::static_codes, over
+// the tokens of the default HybridUintConfig for the residuals of the gradient
+// predictor. Mixes two geometric distributions of the packed residuals, for
+// smooth and for detailed areas, with a uniform one over the tokens so that
+// any residual can be encoded.
+Histogram StaticGradientHistogram() {
+  // Split exponent 4 and 2 msb in token: enough for the 32 bit residuals.
+  constexpr size_t kNumTokens = 16 + 28 * 4;
+  constexpr double kTotal = 1 << 20;
+  const auto geometric_mass = [](double mean, double lo, double hi) {
+    const double r = mean / (mean + 1);
+    return std::pow(r, lo) - std::pow(r, hi + 1);
+  };
+  Histogram histogram;
+  histogram.data_.resize(kNumTokens);
+  for (size_t token = 0; token < kNumTokens; token++) {
+    double lo = token, hi = token;
+    if (token >= 16) {
+      const size_t n = 4 + (token - 16) / 4;
+      lo = std::ldexp(4 + (token - 16) % 4, n - 2);
+      hi = lo + std::ldexp(1, n - 2) - 1;
+    }
+    const double mass = 0.6 * geometric_mass(8, lo, hi) +
+                        0.3 * geometric_mass(64, lo, hi) + 0.1 / kNumTokens;
+    histogram.data_[token] =
+        std::max<ANSHistBin>(1, static_cast<ANSHistBin>(mass * kTotal));
+    histogram.total_count_ += histogram.data_[token];
+  }
+  return histogram;
+}
+
 // Merges the trees in `trees` using nodes that decide on stream_id, as defined
 // by `tree_splits`.
 void MergeTrees(const std::vector<Tree>& trees,
@@ -223,6 +260,26 @@ void QuantizeChannel(Channel& ch, const int q) {
   }
 }
 
+// Extra channels of VarDCT frames with at most this many distinct values, such
+// as binary alpha masks, are encoded losslessly with a fixed tree.
+constexpr size_t kMaxFewValues = 16;
+
+bool HasFewValues(const Channel& ch) {
+  std::vector<pixel_type> values;
+  for (size_t y = 0; y < ch.h; y++) {
+    const pixel_type* JXL_RESTRICT row = ch.Row(y);
+    for (size_t x = 0; x < ch.w; x++) {
+      if (x > 0 && row[x] == row[x - 1]) continue;
+      if (std::find(values.begin(), values.end(), row[x]) != values.end()) {
+        continue;
+      }
+      if (values.size() == kMaxFewValues) return false;
+      values.push_back(row[x]);
+    }
+  }
+  return true;
+}
+
 // convert binary32 float that corresponds to custom [bits]-bit float (with
 // [exp_bits] exponent bits) to a [bits]-bit integer representation that should
 // fit in pixel_type
@@ -470,6 +527,7 @@ Status ModularFrameEncoder::ComputeEncodingData(
     PassesEncoderState* JXL_RESTRICT enc_state, const JxlCmsInterface& cms,
     ThreadPool* pool, AuxOut* aux_out, bool do_color) {
   const FrameDimensions& frame_dim = enc_state->shared.frame_dim;
+  progress = enc_state->progress;
 
   if (do_color && frame_header.loop_filter.gab) {
     GaborishInverse(color, 0.9908511000000001f, pool);
@@ -632,6 +690,23 @@ Status ModularFrameEncoder::ComputeEncodingData(
         "level)",
         cparams.level, max_bitdepth, level_max_bitdepth);
 
+  // Extra channels with few values in VarDCT frames are typically alpha
+  // masks, for which squeezing and quantizing creates visible artifacts and
+  // learning a tree can take longer than the heuristics on the color
+  // channels. They are rather kept lossless and use a fixed tree, which also
+  // lets the trees of the VarDCT streams be learned alone.
+  bool few_values = !do_color && !cparams.modular_mode &&
+                    cparams.butteraugli_distance > 0 &&
+                    cparams.speed_tier > SpeedTier::kKitten &&
+                    !gi.channel.empty();
+  for (size_t i = 0; few_values && i < gi.channel.size(); i++) {
+    few_values = HasFewValues(gi.channel[i]);
+  }
+  if (few_values) {
+    cparams.butteraugli_distance = 0;
+    cparams.responsive = 0;
+  }
+
   // Set options and apply transformations
 
   if (cparams.butteraugli_distance > 0) {
@@ -832,7 +907,12 @@ Status ModularFrameEncoder::ComputeEncodingData(
   };
   std::vector<GroupParams> stream_params;
 
-  stream_options[0] = cparams.options;
+  ModularOptions modular_options = cparams.options;
+  if (few_values) {
+    modular_options.predictor = Predictor::Gradient;
+    modular_options.tree_kind = ModularOptions::TreeKind::kGradientFixedDC;
+  }
+  stream_options[0] = modular_options;
 
   // DC
   for (size_t group_id = 0; group_id < frame_dim.num_dc_groups; group_id++) {
@@ -868,15 +948,24 @@ Status ModularFrameEncoder::ComputeEncodingData(
   }
   gi_channel.resize(stream_images.size());
 
+  AddProgressWork(progress, stream_params.size());
   JXL_RETURN_IF_ERROR(RunOnPool(
       pool, 0, stream_params.size(), ThreadPool::NoInit,
       [&](const uint32_t i, size_t /* thread */) {
-        stream_options[stream_params[i].id.ID(frame_dim)] = cparams.options;
+        if (!PollProgress(progress)) return;
+        stream_options[stream_params[i].id.ID(frame_dim)] = modular_options;
         JXL_CHECK(PrepareStreamParams(
             stream_params[i].rect, cparams, stream_params[i].minShift,
             stream_params[i].maxShift, stream_params[i].id, do_color));
       },
       "ChooseParams"));
+  JXL_RETURN_IF_ERROR(CheckProgress(progress));
+  std::vector<size_t> stream_ids;
+  stream_ids.reserve(stream_params.size());
+  for (const GroupParams& params : stream_params) {
+    stream_ids.push_back(params.id.ID(frame_dim));
+  }
+  JXL_RETURN_IF_ERROR(ChooseRCTsAndWPModes(stream_ids, do_color, pool));
   {
     // Clear out channels that have been copied to groups.
     Image& full_image = stream_images[0];
@@ -953,6 +1042,22 @@ Status ModularFrameEncoder::ComputeEncodingData(
                          enc_state->heuristics.get(), aux_out);
 }
 
+bool ModularTreeCache::Matches(
+    size_t num_streams,
+    const std::vector<ModularMultiplierInfo>& multiplier_info) const {
+  if (tree.empty() || num_streams != this->num_streams ||
+      multiplier_info.size() != this->multiplier_info.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < multiplier_info.size(); i++) {
+    if (multiplier_info[i].range != this->multiplier_info[i].range ||
+        multiplier_info[i].multiplier != this->multiplier_info[i].multiplier) {
+      return false;
+    }
+  }
+  return true;
+}
+
 Status ModularFrameEncoder::PrepareEncoding(ThreadPool* pool,
                                             const FrameDimensions& frame_dim,
                                             EncoderHeuristics* heuristics,
@@ -964,8 +1069,15 @@ Status ModularFrameEncoder::PrepareEncoding(ThreadPool* pool,
   stream_headers.resize(num_streams);
   tokens.resize(num_streams);
 
+  ModularTreeCache* tree_cache = cparams.modular_tree_cache.get();
   if (heuristics->CustomFixedTreeLossless(frame_dim, &tree)) {
     // Using a fixed tree.
+  } else if ((cparams.speed_tier < SpeedTier::kFalcon || quality != 100 ||
+              !cparams.modular_mode) &&
+             tree_cache && tree_cache->Matches(num_streams, multiplier_info)) {
+    // Using the tree learned for a previous frame.
+    tree = tree_cache->tree;
+    use_tree_cache = true;
   } else if (cparams.speed_tier < SpeedTier::kFalcon || quality != 100 ||
              !cparams.modular_mode) {
     // Avoid creating a tree with leaves that don't correspond to any pixels.
@@ -988,76 +1100,117 @@ Status ModularFrameEncoder::PrepareEncoding(ThreadPool* pool,
     if (useful_splits.empty()) return true;
     useful_splits.push_back(tree_splits.back());
 
+    // Learns from fewer samples if the usual ones would not fit in the time
+    // budget. The estimate of kTreeLearning is for the default nb_repeats.
+    EncoderDeadline* deadline = cparams.deadline.get();
+    const size_t num_pixels = frame_dim.xsize * frame_dim.ysize;
+    constexpr float kDefaultNbRepeats = 0.5f;
+    constexpr float kMinNbRepeats = 0.01f;
+    if (deadline != nullptr) {
+      const float max_nb_repeats = std::max<double>(
+          kMinNbRepeats,
+          kDefaultNbRepeats * deadline->AvailableSeconds(num_pixels) /
+              deadline->EstimatedSeconds(EncoderDeadline::kTreeLearning,
+                                         num_pixels));
+      for (ModularOptions& options : stream_options) {
+        options.nb_repeats = std::min(options.nb_repeats, max_nb_repeats);
+      }
+    }
+
     std::atomic_flag invalid_force_wp = ATOMIC_FLAG_INIT;
 
     std::vector<Tree> trees(useful_splits.size() - 1);
-    JXL_RETURN_IF_ERROR(RunOnPool(
-        pool, 0, useful_splits.size() - 1, ThreadPool::NoInit,
-        [&](const uint32_t chunk, size_t /* thread */) {
-          // TODO(veluca): parallelize more.
-          size_t total_pixels = 0;
-          uint32_t start = useful_splits[chunk];
-          uint32_t stop = useful_splits[chunk + 1];
-          uint32_t max_c = 0;
-          if (stream_options[start].tree_kind !=
-              ModularOptions::TreeKind::kLearn) {
-            for (size_t i = start; i < stop; i++) {
-              for (const Channel& ch : stream_images[i].channel) {
-                total_pixels += ch.w * ch.h;
-              }
-            }
-            trees[chunk] =
-                PredefinedTree(stream_options[start].tree_kind, total_pixels);
-            return;
-          }
-          TreeSamples tree_samples;
-          if (!tree_samples.SetPredictor(stream_options[start].predictor,
-                                         stream_options[start].wp_tree_mode)) {
-            invalid_force_wp.test_and_set(std::memory_order_acq_rel);
-            return;
-          }
-          if (!tree_samples.SetProperties(
-                  stream_options[start].splitting_heuristics_properties,
-                  stream_options[start].wp_tree_mode)) {
-            invalid_force_wp.test_and_set(std::memory_order_acq_rel);
-            return;
-          }
-          std::vector<pixel_type> pixel_samples;
-          std::vector<pixel_type> diff_samples;
-          std::vector<uint32_t> group_pixel_count;
-          std::vector<uint32_t> channel_pixel_count;
-          for (size_t i = start; i < stop; i++) {
-            max_c = std::max<uint32_t>(stream_images[i].channel.size(), max_c);
-            CollectPixelSamples(stream_images[i], stream_options[i], i,
-                                group_pixel_count, channel_pixel_count,
-                                pixel_samples, diff_samples);
-          }
-          StaticPropRange range;
-          range[0] = {{0, max_c}};
-          range[1] = {{start, stop}};
-          auto local_multiplier_info = multiplier_info;
-
-          tree_samples.PreQuantizeProperties(
-              range, local_multiplier_info, group_pixel_count,
-              channel_pixel_count, pixel_samples, diff_samples,
-              stream_options[start].max_property_values);
-          for (size_t i = start; i < stop; i++) {
-            JXL_CHECK(ModularGenericCompress(
-                stream_images[i], stream_options[i], /*writer=*/nullptr,
-                /*aux_out=*/nullptr, 0, i, &tree_samples, &total_pixels));
+    // tree_pool is used for learning the tree itself, and must be null when
+    // called from a task of pool.
+    const auto learn_tree = [&](const uint32_t chunk, ThreadPool* tree_pool) {
+      size_t total_pixels = 0;
+      uint32_t start = useful_splits[chunk];
+      uint32_t stop = useful_splits[chunk + 1];
+      uint32_t max_c = 0;
+      if (stream_options[start].tree_kind !=
+          ModularOptions::TreeKind::kLearn) {
+        for (size_t i = start; i < stop; i++) {
+          for (const Channel& ch : stream_images[i].channel) {
+            total_pixels += ch.w * ch.h;
           }
+        }
+        trees[chunk] =
+            PredefinedTree(stream_options[start].tree_kind, total_pixels);
+        return;
+      }
+      TreeSamples tree_samples;
+      if (!tree_samples.SetPredictor(stream_options[start].predictor,
+                                     stream_options[start].wp_tree_mode)) {
+        invalid_force_wp.test_and_set(std::memory_order_acq_rel);
+        return;
+      }
+      if (!tree_samples.SetProperties(
+              stream_options[start].splitting_heuristics_properties,
+              stream_options[start].wp_tree_mode)) {
+        invalid_force_wp.test_and_set(std::memory_order_acq_rel);
+        return;
+      }
+      std::vector<pixel_type> pixel_samples;
+      std::vector<pixel_type> diff_samples;
+      std::vector<uint32_t> group_pixel_count;
+      std::vector<uint32_t> channel_pixel_count;
+      for (size_t i = start; i < stop; i++) {
+        max_c = std::max<uint32_t>(stream_images[i].channel.size(), max_c);
+        CollectPixelSamples(stream_images[i], stream_options[i], i,
+                            group_pixel_count, channel_pixel_count,
+                            pixel_samples, diff_samples);
+      }
+      StaticPropRange range;
+      range[0] = {{0, max_c}};
+      range[1] = {{start, stop}};
+      auto local_multiplier_info = multiplier_info;
+
+      tree_samples.PreQuantizeProperties(
+          range, local_multiplier_info, group_pixel_count,
+          channel_pixel_count, pixel_samples, diff_samples,
+          stream_options[start].max_property_values);
+      for (size_t i = start; i < stop; i++) {
+        JXL_CHECK(ModularGenericCompress(
+            stream_images[i], stream_options[i], /*writer=*/nullptr,
+            /*aux_out=*/nullptr, 0, i, &tree_samples, &total_pixels));
+      }
 
-          // TODO(veluca): parallelize more.
-          trees[chunk] =
-              LearnTree(std::move(tree_samples), total_pixels,
-                        stream_options[start], local_multiplier_info, range);
-        },
-        "LearnTrees"));
+      trees[chunk] = LearnTree(std::move(tree_samples), total_pixels,
+                               stream_options[start], local_multiplier_info,
+                               range, tree_pool);
+    };
+    if (useful_splits.size() == 2) {
+      learn_tree(0, pool);
+    } else {
+      AddProgressWork(progress, useful_splits.size() - 1);
+      JXL_RETURN_IF_ERROR(RunOnPool(
+          pool, 0, useful_splits.size() - 1, ThreadPool::NoInit,
+          [&](const uint32_t chunk, size_t /* thread */) {
+            if (!PollProgress(progress)) return;
+            learn_tree(chunk, /*tree_pool=*/nullptr);
+          },
+          "LearnTrees"));
+      // Before merging the trees, some of which were not learned.
+      JXL_RETURN_IF_ERROR(CheckProgress(progress));
+    }
     if (invalid_force_wp.test_and_set(std::memory_order_acq_rel)) {
       return JXL_FAILURE("PrepareEncoding: force_no_wp with {Weighted}");
     }
     tree.clear();
     MergeTrees(trees, useful_splits, 0, useful_splits.size() - 1, &tree);
+    if (deadline != nullptr) {
+      deadline->Done(EncoderDeadline::kTreeLearning,
+                     static_cast<size_t>(num_pixels *
+                                         stream_options[0].nb_repeats /
+                                         kDefaultNbRepeats));
+    }
+    if (tree_cache) {
+      tree_cache->tree = tree;
+      tree_cache->num_streams = num_streams;
+      tree_cache->multiplier_info = multiplier_info;
+      tree_cache->context_map.clear();
+      use_tree_cache = true;
+    }
   } else {
     // Fixed tree.
     size_t total_pixels = 0;
@@ -1066,9 +1219,15 @@ Status ModularFrameEncoder::PrepareEncoding(ThreadPool* pool,
         total_pixels += ch.w * ch.h;
       }
     }
+    // The static code has a single histogram, so only the predictor of the
+    // tree matters.
+    use_static_codes =
+        cparams.speed_tier >= SpeedTier::kThunder && multiplier_info.empty() &&
+        ApplyOverride(cparams.static_codes,
+                      cparams.speed_tier >= SpeedTier::kLightning);
     if (cparams.speed_tier <= SpeedTier::kFalcon) {
       tree = PredefinedTree(ModularOptions::TreeKind::kWPFixedDC, total_pixels);
-    } else if (cparams.speed_tier <= SpeedTier::kThunder) {
+    } else if (cparams.speed_tier <= SpeedTier::kThunder && !use_static_codes) {
       tree = PredefinedTree(ModularOptions::TreeKind::kGradientFixedDC,
                             total_pixels);
     } else {
@@ -1085,11 +1244,15 @@ Status ModularFrameEncoder::PrepareEncoding(ThreadPool* pool,
   if (WantDebugOutput(aux_out)) {
     PrintTree(tree, aux_out->debug_prefix + "/global_tree");
   }
+  // The streams are tokenized while they are written.
+  if (use_static_codes) return true;
 
   image_widths.resize(num_streams);
+  AddProgressWork(progress, num_streams);
   JXL_RETURN_IF_ERROR(RunOnPool(
       pool, 0, num_streams, ThreadPool::NoInit,
       [&](const uint32_t stream_id, size_t /* thread */) {
+        if (!PollProgress(progress)) return;
         AuxOut my_aux_out;
         if (aux_out) {
           my_aux_out.dump_image = aux_out->dump_image;
@@ -1106,11 +1269,12 @@ Status ModularFrameEncoder::PrepareEncoding(ThreadPool* pool,
             /*widths=*/&image_widths[stream_id]));
       },
       "ComputeTokens"));
-  return true;
+  return CheckProgress(progress);
 }
 
 Status ModularFrameEncoder::EncodeGlobalInfo(BitWriter* writer,
-                                             AuxOut* aux_out) {
+                                             AuxOut* aux_out,
+                                             ThreadPool* pool) {
   BitWriter::Allotment allotment(writer, 1);
   // If we are using brotli, or not using modular mode.
   if (tree_tokens.empty() || tree_tokens[0].empty()) {
@@ -1162,14 +1326,36 @@ Status ModularFrameEncoder::EncodeGlobalInfo(BitWriter* writer,
     params.uint_method = HistogramParams::HybridUintMethod::k000;
     params.force_huffman = true;
   }
+  params.pool = pool;
   BuildAndEncodeHistograms(params, kNumTreeContexts, tree_tokens, &code,
                            &context_map, writer, kLayerModularTree, aux_out);
   WriteTokens(tree_tokens[0], code, context_map, writer, kLayerModularTree,
               aux_out);
+  if (use_static_codes) {
+    HistogramParams static_params;
+    static_params.lz77_method = HistogramParams::LZ77Method::kNone;
+    static_params.uint_method = HistogramParams::HybridUintMethod::kNone;
+    static_params.force_huffman = true;
+    const size_t num_contexts = (tree.size() + 1) / 2;
+    const std::vector<Histogram> histograms(num_contexts,
+                                            StaticGradientHistogram());
+    static_params.histograms = &histograms;
+    // All the contexts share the static histogram.
+    static_params.context_map.resize(num_contexts, 0);
+    std::vector<std::vector<Token>> no_tokens;
+    BuildAndEncodeHistograms(static_params, num_contexts, no_tokens, &code,
+                             &context_map, writer, kLayerModularGlobal,
+                             aux_out);
+    return true;
+  }
   params.image_widths = image_widths;
+  ModularTreeCache* tree_cache =
+      use_tree_cache ? cparams.modular_tree_cache.get() : nullptr;
+  if (tree_cache) params.context_map = tree_cache->context_map;
   // Write histograms.
   BuildAndEncodeHistograms(params, (tree.size() + 1) / 2, tokens, &code,
                            &context_map, writer, kLayerModularGlobal, aux_out);
+  if (tree_cache) tree_cache->context_map = context_map;
   return true;
 }
 
@@ -1180,6 +1366,12 @@ Status ModularFrameEncoder::EncodeStream(BitWriter* writer, AuxOut* aux_out,
   if (stream_images[stream_id].channel.empty()) {
     return true;  // Image with no channels, header never gets decoded.
   }
+  if (use_static_codes) {
+    return ModularStreamingCompress(stream_images[stream_id],
+                                    stream_options[stream_id], tree, code,
+                                    context_map, writer, aux_out, layer,
+                                    stream_id);
+  }
   JXL_RETURN_IF_ERROR(
       Bundle::Write(stream_headers[stream_id], writer, layer, aux_out));
   WriteTokens(tokens[stream_id], code, context_map, writer, layer, aux_out);
@@ -1187,7 +1379,20 @@ Status ModularFrameEncoder::EncodeStream(BitWriter* writer, AuxOut* aux_out,
 }
 
 namespace {
-float EstimateWPCost(const Image& img, size_t i) {
+// Some slack for the rounding of the entropy estimates when comparing a partial
+// cost with the cost of another candidate.
+constexpr float kMaxCostSlack = 1.001f;
+
+// Returns whether an estimate that reached `cost` certainly ends up above
+// `max_cost`, which may be lowered concurrently by other candidates.
+bool ExceedsCost(float cost, const std::atomic<float>& max_cost) {
+  return cost > max_cost.load(std::memory_order_relaxed) * kMaxCostSlack;
+}
+
+// Estimated cost of encoding `img` with the weighted predictor in mode `i`, or
+// infinity as soon as it is known to exceed `max_cost`.
+float EstimateWPCost(const Image& img, size_t i,
+                     const std::atomic<float>& max_cost) {
   size_t extra_bits = 0;
   float histo_cost = 0;
   HybridUintConfig config;
@@ -1227,6 +1432,9 @@ float EstimateWPCost(const Image& img, size_t i) {
         extra_bits += nbits;
         wp_state.UpdateErrors(r[x], x, y, ch.w);
       }
+      if (ExceedsCost(histo_cost + extra_bits, max_cost)) {
+        return std::numeric_limits<float>::infinity();
+      }
     }
     for (size_t h = 0; h < nc; h++) {
       histo_cost += histo[h].ShannonEntropy();
@@ -1236,7 +1444,9 @@ float EstimateWPCost(const Image& img, size_t i) {
   return histo_cost + extra_bits;
 }
 
-float EstimateCost(const Image& img) {
+// Estimated cost of encoding the channels of `img` with the gradient
+// predictor, or infinity as soon as it is known to exceed `max_cost`.
+float EstimateCost(const Image& img, const std::atomic<float>& max_cost) {
   // TODO(veluca): consider SIMDfication of this code.
   size_t extra_bits = 0;
   float histo_cost = 0;
@@ -1265,6 +1475,9 @@ float EstimateCost(const Image& img) {
         histo[ctx].Add(token);
         extra_bits += nbits;
       }
+      if (ExceedsCost(histo_cost + extra_bits, max_cost)) {
+        return std::numeric_limits<float>::infinity();
+      }
     }
     for (size_t h = 0; h < nc; h++) {
       histo_cost += histo[h].ShannonEntropy();
@@ -1274,6 +1487,22 @@ float EstimateCost(const Image& img) {
   return histo_cost + extra_bits;
 }
 
+void UpdateMinCost(float cost, std::atomic<float>* min_cost) {
+  float current = min_cost->load(std::memory_order_relaxed);
+  while (cost < current && !min_cost->compare_exchange_weak(
+                               current, cost, std::memory_order_relaxed)) {
+  }
+}
+
+// RCTs to try for lossless images, starting with do-nothing and YCoCg. These
+// should be 19 actually different transforms; the remaining ones are
+// equivalent to one of these modulo channel reordering (which only matters in
+// the case of MA-with-prev-channels-properties) and/or sign (e.g. RmG vs GmR)
+constexpr size_t kRCTCandidates[] = {
+    0 * 7 + 0, 0 * 7 + 6, 0 * 7 + 5, 1 * 7 + 3, 3 * 7 + 5, 5 * 7 + 5, 1 * 7 + 5,
+    2 * 7 + 5, 1 * 7 + 1, 0 * 7 + 4, 1 * 7 + 2, 2 * 7 + 1, 2 * 7 + 2, 2 * 7 + 3,
+    4 * 7 + 4, 4 * 7 + 5, 0 * 7 + 2, 0 * 7 + 1, 0 * 7 + 3};
+
 }  // namespace
 
 Status ModularFrameEncoder::PrepareStreamParams(const Rect& rect,
@@ -1373,23 +1602,51 @@ Status ModularFrameEncoder::PrepareStreamParams(const Rect& rect,
     }
   }
 
+  return true;
+}
+
+Status ModularFrameEncoder::ChooseRCTsAndWPModes(
+    const std::vector<size_t>& stream_ids, bool do_color, ThreadPool* pool) {
+  // The candidates of all the streams are evaluated in a single pool pass, so
+  // that images with few groups also use all the threads. The evaluation of a
+  // candidate stops as soon as it is known to cost more than the best one of
+  // its stream found so far; the candidates are dispatched in the order of
+  // their likelihood of being the best, which makes this happen early.
+  struct Trial {
+    size_t stream;  // Index in stream_ids.
+    size_t candidate;
+  };
+  std::vector<Trial> trials;
+  std::vector<float> costs;
+  std::vector<std::atomic<float>> best_costs(stream_ids.size());
+  const auto reset_costs = [&]() {
+    costs.assign(trials.size(), std::numeric_limits<float>::infinity());
+    for (std::atomic<float>& cost : best_costs) {
+      cost.store(std::numeric_limits<float>::infinity());
+    }
+  };
+  // Returns the cheapest candidate of each stream, the first one in case of a
+  // tie, or `none` if the stream has no candidates.
+  const auto best_candidates = [&](size_t none) {
+    std::vector<size_t> best(stream_ids.size(), none);
+    std::vector<float> best_cost(stream_ids.size(),
+                                 std::numeric_limits<float>::max());
+    for (size_t i = 0; i < trials.size(); i++) {
+      if (costs[i] < best_cost[trials[i].stream]) {
+        best_cost[trials[i].stream] = costs[i];
+        best[trials[i].stream] = trials[i].candidate;
+      }
+    }
+    return best;
+  };
+
   // lossless and no specific color transform specified: try Nothing, YCoCg,
   // and 17 RCTs
+  size_t nb_rcts_to_try = 0;
   if (cparams.color_transform == ColorTransform::kNone &&
       cparams.IsLossless() && cparams.colorspace < 0 &&
-      gi.channel.size() - gi.nb_meta_channels >= 3 &&
-      cparams.responsive == false && do_color &&
-      cparams.speed_tier <= SpeedTier::kHare) {
-    Transform sg(TransformId::kRCT);
-    sg.begin_c = gi.nb_meta_channels;
-    size_t nb_rcts_to_try = 0;
+      cparams.responsive == false && do_color) {
     switch (cparams.speed_tier) {
-      case SpeedTier::kLightning:
-      case SpeedTier::kThunder:
-      case SpeedTier::kFalcon:
-      case SpeedTier::kCheetah:
-        nb_rcts_to_try = 0;  // Just do global YCoCg
-        break;
       case SpeedTier::kHare:
         nb_rcts_to_try = 4;
         break;
@@ -1405,57 +1662,101 @@ Status ModularFrameEncoder::PrepareStreamParams(const Rect& rect,
       case SpeedTier::kTortoise:
         nb_rcts_to_try = 19;
         break;
+      default:
+        nb_rcts_to_try = 0;  // Just do global YCoCg
+        break;
     }
-    float best_cost = std::numeric_limits<float>::max();
-    size_t best_rct = 0;
-    // These should be 19 actually different transforms; the remaining ones
-    // are equivalent to one of these (note that the first two are do-nothing
-    // and YCoCg) modulo channel reordering (which only matters in the case of
-    // MA-with-prev-channels-properties) and/or sign (e.g. RmG vs GmR)
-    for (int i : {0 * 7 + 0, 0 * 7 + 6, 0 * 7 + 5, 1 * 7 + 3, 3 * 7 + 5,
-                  5 * 7 + 5, 1 * 7 + 5, 2 * 7 + 5, 1 * 7 + 1, 0 * 7 + 4,
-                  1 * 7 + 2, 2 * 7 + 1, 2 * 7 + 2, 2 * 7 + 3, 4 * 7 + 4,
-                  4 * 7 + 5, 0 * 7 + 2, 0 * 7 + 1, 0 * 7 + 3}) {
-      if (nb_rcts_to_try == 0) break;
-      sg.rct_type = i;
-      nb_rcts_to_try--;
-      if (do_transform(gi, sg, weighted::Header())) {
-        float cost = EstimateCost(gi);
-        if (cost < best_cost) {
-          best_rct = i;
-          best_cost = cost;
-        }
-        Transform t = gi.transform.back();
-        JXL_RETURN_IF_ERROR(t.Inverse(gi, weighted::Header(), nullptr));
-        gi.transform.pop_back();
-      }
+  }
+  for (size_t i = 0; i < stream_ids.size(); i++) {
+    const Image& gi = stream_images[stream_ids[i]];
+    if (gi.channel.size() - gi.nb_meta_channels < 3 ||
+        !CheckEqualChannels(gi, gi.nb_meta_channels,
+                            gi.nb_meta_channels + 2)) {
+      continue;
+    }
+    // Doing nothing is only chosen if the RCTs can't be applied.
+    for (size_t candidate = 1; candidate < nb_rcts_to_try; candidate++) {
+      trials.push_back({i, candidate});
     }
-    // Apply the best RCT to the image for future encoding.
-    sg.rct_type = best_rct;
-    do_transform(gi, sg, weighted::Header());
-  } else {
-    // No need to try anything, just use the default options.
   }
+  reset_costs();
+  std::vector<Image> rct_images;
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, trials.size(),
+      [&](size_t num_threads) {
+        rct_images.resize(num_threads);
+        return true;
+      },
+      [&](const uint32_t task, size_t thread) {
+        const Trial& trial = trials[task];
+        const Image& gi = stream_images[stream_ids[trial.stream]];
+        const Channel& first = gi.channel[gi.nb_meta_channels];
+        Image& rct_image = rct_images[thread];
+        if (rct_image.channel.size() != 3 || rct_image.w != first.w ||
+            rct_image.h != first.h) {
+          rct_image = Image(first.w, first.h, gi.bitdepth, 3);
+        }
+        for (size_t c = 0; c < 3; c++) {
+          CopyImageTo(gi.channel[gi.nb_meta_channels + c].plane,
+                      &rct_image.channel[c].plane);
+        }
+        JXL_CHECK(FwdRCT(rct_image, 0, kRCTCandidates[trial.candidate],
+                         /*pool=*/nullptr));
+        // The other channels cost the same for all the candidates.
+        costs[task] = EstimateCost(rct_image, best_costs[trial.stream]);
+        UpdateMinCost(costs[task], &best_costs[trial.stream]);
+      },
+      "TryRCTs"));
+  std::vector<size_t> best_rcts = best_candidates(0);
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, stream_ids.size(), ThreadPool::NoInit,
+      [&](const uint32_t i, size_t /* thread */) {
+        if (best_rcts[i] == 0) return;
+        Image& gi = stream_images[stream_ids[i]];
+        // Apply the best RCT to the image for future encoding.
+        Transform sg(TransformId::kRCT);
+        sg.begin_c = gi.nb_meta_channels;
+        sg.rct_type = kRCTCandidates[best_rcts[i]];
+        do_transform(gi, sg, weighted::Header());
+      },
+      "ApplyRCTs"));
+
   size_t nb_wp_modes = 1;
   if (cparams.speed_tier <= SpeedTier::kTortoise) {
     nb_wp_modes = 5;
   } else if (cparams.speed_tier <= SpeedTier::kKitten) {
     nb_wp_modes = 2;
   }
-  if (nb_wp_modes > 1 &&
-      (stream_options[stream_id].predictor == Predictor::Weighted ||
-       stream_options[stream_id].predictor == Predictor::Best ||
-       stream_options[stream_id].predictor == Predictor::Variable)) {
-    float best_cost = std::numeric_limits<float>::max();
-    stream_options[stream_id].wp_mode = 0;
-    for (size_t i = 0; i < nb_wp_modes; i++) {
-      float cost = EstimateWPCost(gi, i);
-      if (cost < best_cost) {
-        best_cost = cost;
-        stream_options[stream_id].wp_mode = i;
+  trials.clear();
+  for (size_t i = 0; i < stream_ids.size(); i++) {
+    const size_t stream_id = stream_ids[i];
+    if (stream_id > 0 && stream_images[stream_id].channel.empty()) continue;
+    const Predictor predictor = stream_options[stream_id].predictor;
+    if (nb_wp_modes > 1 &&
+        (predictor == Predictor::Weighted || predictor == Predictor::Best ||
+         predictor == Predictor::Variable)) {
+      for (size_t mode = 0; mode < nb_wp_modes; mode++) {
+        trials.push_back({i, mode});
       }
     }
   }
+  reset_costs();
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, trials.size(), ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /* thread */) {
+        const Trial& trial = trials[task];
+        costs[task] = EstimateWPCost(stream_images[stream_ids[trial.stream]],
+                                     trial.candidate, best_costs[trial.stream]);
+        UpdateMinCost(costs[task], &best_costs[trial.stream]);
+      },
+      "TryWPModes"));
+  const size_t kNoWPMode = nb_wp_modes;
+  std::vector<size_t> best_wp_modes = best_candidates(kNoWPMode);
+  for (size_t i = 0; i < stream_ids.size(); i++) {
+    if (best_wp_modes[i] != kNoWPMode) {
+      stream_options[stream_ids[i]].wp_mode = best_wp_modes[i];
+    }
+  }
   return true;
 }
 
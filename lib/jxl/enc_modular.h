@@ -18,9 +18,28 @@
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/modular/encoding/encoding.h"
 #include "lib/jxl/modular/modular_image.h"
+#include "lib/jxl/progress.h"
 
 namespace jxl {
 
+// MA tree learned for a frame together with the clustering of its contexts.
+// Shared between frames through CompressParams::modular_tree_cache, so that
+// the encoders of later frames with similar content only have to tokenize
+// their image ("learn once, tokenize many").
+struct ModularTreeCache {
+  // Whether the tree can be used to encode a frame with the given streams. The
+  // multipliers of the tree leaves depend on the quantization of the streams.
+  bool Matches(size_t num_streams,
+               const std::vector<ModularMultiplierInfo>& multiplier_info) const;
+
+  Tree tree;
+  size_t num_streams = 0;
+  std::vector<ModularMultiplierInfo> multiplier_info;
+  // Context map of the last frame encoded with the tree; empty if none was
+  // encoded yet.
+  std::vector<uint8_t> context_map;
+};
+
 class ModularFrameEncoder {
  public:
   ModularFrameEncoder(const FrameHeader& frame_header,
@@ -33,7 +52,8 @@ class ModularFrameEncoder {
                              const JxlCmsInterface& cms, ThreadPool* pool,
                              AuxOut* aux_out, bool do_color);
   // Encodes global info (tree + histograms) in the `writer`.
-  Status EncodeGlobalInfo(BitWriter* writer, AuxOut* aux_out);
+  Status EncodeGlobalInfo(BitWriter* writer, AuxOut* aux_out,
+                          ThreadPool* pool);
   // Encodes a specific modular image (identified by `stream`) in the `writer`,
   // assigning bits to the provided `layer`.
   Status EncodeStream(BitWriter* writer, AuxOut* aux_out, size_t layer,
@@ -69,6 +89,10 @@ class ModularFrameEncoder {
   Status PrepareStreamParams(const Rect& rect, const CompressParams& cparams,
                              int minShift, int maxShift,
                              const ModularStreamId& stream, bool do_color);
+  // Chooses the RCT and the weighted predictor mode of each of the streams,
+  // by estimating the cost of the candidates allowed by the speed tier.
+  Status ChooseRCTsAndWPModes(const std::vector<size_t>& stream_ids,
+                              bool do_color, ThreadPool* pool);
   std::vector<Image> stream_images;
   std::vector<ModularOptions> stream_options;
 
@@ -86,6 +110,14 @@ class ModularFrameEncoder {
   std::vector<std::vector<uint32_t>> gi_channel;
   std::vector<size_t> image_widths;
   Predictor delta_pred = Predictor::Average4;
+  // Whether `tree` is the one in cparams.modular_tree_cache.
+  bool use_tree_cache = false;
+  // Whether `code` is the static one of CompressParams::static_codes, with
+  // which EncodeStream tokenizes the streams itself.
+  bool use_static_codes = false;
+  // Of the state passed to ComputeEncodingData, polled by the loops over the
+  // streams.
+  ProgressMonitor* progress = nullptr;
 };
 
 }  // namespace jxl
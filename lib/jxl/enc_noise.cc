@@ -10,10 +10,13 @@
 #include <stdlib.h>
 
 #include <algorithm>
+#include <limits>
 #include <numeric>
 #include <utility>
+#include <vector>
 
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/chroma_from_luma.h"
 #include "lib/jxl/convolve.h"
 #include "lib/jxl/image_ops.h"
@@ -71,6 +74,9 @@ class NoiseHistogram {
   NoiseHistogram() { std::fill(bins, bins + kBins, 0); }
 
   void Increment(const float x) { bins[Index(x)] += 1; }
+  void Add(const NoiseHistogram& other) {
+    for (size_t i = 0; i < kBins; i++) bins[i] += other.bins[i];
+  }
   int Get(const float x) const { return bins[Index(x)]; }
   int Bin(const size_t bin) const { return bins[bin]; }
 
@@ -122,21 +128,45 @@ class NoiseHistogram {
   uint32_t bins[kBins];
 };
 
+// Only the patches (bx, by) with (bx + by) % patch_ratio == 0 are scored,
+// which spreads the samples evenly over the rows and columns. The others get
+// an infinite score, above any threshold.
+bool IsSampledPatch(const size_t bx, const size_t by,
+                    const size_t patch_ratio) {
+  return (bx + by) % patch_ratio == 0;
+}
+
 std::vector<float> GetSADScoresForPatches(const Image3F& opsin,
                                           const size_t block_s,
                                           const size_t num_bin,
+                                          const size_t patch_ratio,
+                                          ThreadPool* pool,
                                           NoiseHistogram* sad_histogram) {
-  std::vector<float> sad_scores(
-      (opsin.ysize() / block_s) * (opsin.xsize() / block_s), 0.0f);
-
-  int block_index = 0;
-
-  for (size_t y = 0; y + block_s <= opsin.ysize(); y += block_s) {
-    for (size_t x = 0; x + block_s <= opsin.xsize(); x += block_s) {
-      float sad_sc = GetScoreSumsOfAbsoluteDifferences(opsin, x, y, block_s);
-      sad_scores[block_index++] = sad_sc;
-      sad_histogram->Increment(sad_sc * num_bin);
-    }
+  const size_t xblocks = opsin.xsize() / block_s;
+  const size_t yblocks = opsin.ysize() / block_s;
+  std::vector<float> sad_scores(xblocks * yblocks,
+                                std::numeric_limits<float>::infinity());
+
+  // One histogram per thread, summed at the end.
+  std::vector<NoiseHistogram> histograms;
+  JXL_CHECK(RunOnPool(
+      pool, 0, yblocks,
+      [&](const size_t num_threads) {
+        histograms.resize(num_threads);
+        return true;
+      },
+      [&](const uint32_t by, const size_t thread) {
+        for (size_t bx = 0; bx < xblocks; bx++) {
+          if (!IsSampledPatch(bx, by, patch_ratio)) continue;
+          float sad_sc = GetScoreSumsOfAbsoluteDifferences(
+              opsin, bx * block_s, by * block_s, block_s);
+          sad_scores[by * xblocks + bx] = sad_sc;
+          histograms[thread].Increment(sad_sc * num_bin);
+        }
+      },
+      "NoiseSAD"));
+  for (const NoiseHistogram& histogram : histograms) {
+    sad_histogram->Add(histogram);
   }
   return sad_scores;
 }
@@ -231,11 +261,10 @@ void OptimizeNoiseParameters(const std::vector<NoiseLevel>& noise_level,
   }
 }
 
-std::vector<NoiseLevel> GetNoiseLevel(
-    const Image3F& opsin, const std::vector<float>& texture_strength,
-    const float threshold, const size_t block_s) {
-  std::vector<NoiseLevel> noise_level_per_intensity;
-
+// The noise model is built based on channel 0.5 * (X+Y) as we notice that it
+// is similar to the model 0.5 * (Y-X)
+NoiseLevel GetPatchNoiseLevel(const Image3F& opsin, const size_t x,
+                              const size_t y, const size_t block_s) {
   const int filt_size = 1;
   static const float kLaplFilter[filt_size * 2 + 1][filt_size * 2 + 1] = {
       {-0.25f, -1.0f, -0.25f},
@@ -243,80 +272,95 @@ std::vector<NoiseLevel> GetNoiseLevel(
       {-0.25f, -1.0f, -0.25f},
   };
 
-  // The noise model is built based on channel 0.5 * (X+Y) as we notice that it
-  // is similar to the model 0.5 * (Y-X)
-  size_t patch_index = 0;
-
-  for (size_t y = 0; y + block_s <= opsin.ysize(); y += block_s) {
-    for (size_t x = 0; x + block_s <= opsin.xsize(); x += block_s) {
-      if (texture_strength[patch_index] <= threshold) {
-        // Calculate mean value
-        float mean_int = 0;
-        for (size_t y_bl = 0; y_bl < block_s; ++y_bl) {
-          for (size_t x_bl = 0; x_bl < block_s; ++x_bl) {
-            mean_int += 0.5f * (opsin.PlaneRow(1, y + y_bl)[x + x_bl] +
-                                opsin.PlaneRow(0, y + y_bl)[x + x_bl]);
+  // Calculate mean value
+  float mean_int = 0;
+  for (size_t y_bl = 0; y_bl < block_s; ++y_bl) {
+    for (size_t x_bl = 0; x_bl < block_s; ++x_bl) {
+      mean_int += 0.5f * (opsin.PlaneRow(1, y + y_bl)[x + x_bl] +
+                          opsin.PlaneRow(0, y + y_bl)[x + x_bl]);
+    }
+  }
+  mean_int /= block_s * block_s;
+
+  // Calculate Noise level
+  float noise_level = 0;
+  size_t count = 0;
+  for (size_t y_bl = 0; y_bl < block_s; ++y_bl) {
+    for (size_t x_bl = 0; x_bl < block_s; ++x_bl) {
+      float filtered_value = 0;
+      for (int y_f = -1 * filt_size; y_f <= filt_size; ++y_f) {
+        if ((static_cast<ssize_t>(y_bl) + y_f) >= 0 && (y_bl + y_f) < block_s) {
+          for (int x_f = -1 * filt_size; x_f <= filt_size; ++x_f) {
+            if ((static_cast<ssize_t>(x_bl) + x_f) >= 0 &&
+                (x_bl + x_f) < block_s) {
+              filtered_value +=
+                  0.5f *
+                  (opsin.PlaneRow(1, y + y_bl + y_f)[x + x_bl + x_f] +
+                   opsin.PlaneRow(0, y + y_bl + y_f)[x + x_bl + x_f]) *
+                  kLaplFilter[y_f + filt_size][x_f + filt_size];
+            } else {
+              filtered_value +=
+                  0.5f *
+                  (opsin.PlaneRow(1, y + y_bl + y_f)[x + x_bl - x_f] +
+                   opsin.PlaneRow(0, y + y_bl + y_f)[x + x_bl - x_f]) *
+                  kLaplFilter[y_f + filt_size][x_f + filt_size];
+            }
           }
-        }
-        mean_int /= block_s * block_s;
-
-        // Calculate Noise level
-        float noise_level = 0;
-        size_t count = 0;
-        for (size_t y_bl = 0; y_bl < block_s; ++y_bl) {
-          for (size_t x_bl = 0; x_bl < block_s; ++x_bl) {
-            float filtered_value = 0;
-            for (int y_f = -1 * filt_size; y_f <= filt_size; ++y_f) {
-              if ((static_cast<ssize_t>(y_bl) + y_f) >= 0 &&
-                  (y_bl + y_f) < block_s) {
-                for (int x_f = -1 * filt_size; x_f <= filt_size; ++x_f) {
-                  if ((static_cast<ssize_t>(x_bl) + x_f) >= 0 &&
-                      (x_bl + x_f) < block_s) {
-                    filtered_value +=
-                        0.5f *
-                        (opsin.PlaneRow(1, y + y_bl + y_f)[x + x_bl + x_f] +
-                         opsin.PlaneRow(0, y + y_bl + y_f)[x + x_bl + x_f]) *
-                        kLaplFilter[y_f + filt_size][x_f + filt_size];
-                  } else {
-                    filtered_value +=
-                        0.5f *
-                        (opsin.PlaneRow(1, y + y_bl + y_f)[x + x_bl - x_f] +
-                         opsin.PlaneRow(0, y + y_bl + y_f)[x + x_bl - x_f]) *
-                        kLaplFilter[y_f + filt_size][x_f + filt_size];
-                  }
-                }
-              } else {
-                for (int x_f = -1 * filt_size; x_f <= filt_size; ++x_f) {
-                  if ((static_cast<ssize_t>(x_bl) + x_f) >= 0 &&
-                      (x_bl + x_f) < block_s) {
-                    filtered_value +=
-                        0.5f *
-                        (opsin.PlaneRow(1, y + y_bl - y_f)[x + x_bl + x_f] +
-                         opsin.PlaneRow(0, y + y_bl - y_f)[x + x_bl + x_f]) *
-                        kLaplFilter[y_f + filt_size][x_f + filt_size];
-                  } else {
-                    filtered_value +=
-                        0.5f *
-                        (opsin.PlaneRow(1, y + y_bl - y_f)[x + x_bl - x_f] +
-                         opsin.PlaneRow(0, y + y_bl - y_f)[x + x_bl - x_f]) *
-                        kLaplFilter[y_f + filt_size][x_f + filt_size];
-                  }
-                }
-              }
+        } else {
+          for (int x_f = -1 * filt_size; x_f <= filt_size; ++x_f) {
+            if ((static_cast<ssize_t>(x_bl) + x_f) >= 0 &&
+                (x_bl + x_f) < block_s) {
+              filtered_value +=
+                  0.5f *
+                  (opsin.PlaneRow(1, y + y_bl - y_f)[x + x_bl + x_f] +
+                   opsin.PlaneRow(0, y + y_bl - y_f)[x + x_bl + x_f]) *
+                  kLaplFilter[y_f + filt_size][x_f + filt_size];
+            } else {
+              filtered_value +=
+                  0.5f *
+                  (opsin.PlaneRow(1, y + y_bl - y_f)[x + x_bl - x_f] +
+                   opsin.PlaneRow(0, y + y_bl - y_f)[x + x_bl - x_f]) *
+                  kLaplFilter[y_f + filt_size][x_f + filt_size];
             }
-            noise_level += std::abs(filtered_value);
-            ++count;
           }
         }
-        noise_level /= count;
-        NoiseLevel nl;
-        nl.intensity = mean_int;
-        nl.noise_level = noise_level;
-        noise_level_per_intensity.push_back(nl);
       }
-      ++patch_index;
+      noise_level += std::abs(filtered_value);
+      ++count;
     }
   }
+  noise_level /= count;
+  NoiseLevel nl;
+  nl.intensity = mean_int;
+  nl.noise_level = noise_level;
+  return nl;
+}
+
+std::vector<NoiseLevel> GetNoiseLevel(
+    const Image3F& opsin, const std::vector<float>& texture_strength,
+    const float threshold, const size_t block_s, ThreadPool* pool) {
+  const size_t xblocks = opsin.xsize() / block_s;
+  const size_t yblocks = opsin.ysize() / block_s;
+  // Gathered per row of patches and concatenated in order, so that the result
+  // does not depend on the number of threads.
+  std::vector<std::vector<NoiseLevel>> row_levels(yblocks);
+  JXL_CHECK(RunOnPool(
+      pool, 0, yblocks, ThreadPool::NoInit,
+      [&](const uint32_t by, size_t /* thread */) {
+        for (size_t bx = 0; bx < xblocks; bx++) {
+          if (texture_strength[by * xblocks + bx] <= threshold) {
+            row_levels[by].push_back(GetPatchNoiseLevel(
+                opsin, bx * block_s, by * block_s, block_s));
+          }
+        }
+      },
+      "NoiseLevel"));
+
+  std::vector<NoiseLevel> noise_level_per_intensity;
+  for (const std::vector<NoiseLevel>& levels : row_levels) {
+    noise_level_per_intensity.insert(noise_level_per_intensity.end(),
+                                     levels.begin(), levels.end());
+  }
   return noise_level_per_intensity;
 }
 
@@ -330,7 +374,8 @@ void EncodeFloatParam(float val, float precision, BitWriter* writer) {
 }  // namespace
 
 Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
-                         float quality_coef) {
+                         float quality_coef, size_t patch_ratio,
+                         ThreadPool* pool) {
   // The size of a patch in decoder might be different from encoder's patch
   // size.
   // For encoder: the patch size should be big enough to estimate
@@ -338,9 +383,14 @@ Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
   //              to be able to estimate intensity value of the patch
   const size_t block_s = 8;
   const size_t kNumBin = 256;
+  if (patch_ratio == 0) {
+    const size_t num_patches =
+        (opsin.xsize() / block_s) * (opsin.ysize() / block_s);
+    patch_ratio = std::max<size_t>(1, num_patches / kNoiseSampledPatches);
+  }
   NoiseHistogram sad_histogram;
-  std::vector<float> sad_scores =
-      GetSADScoresForPatches(opsin, block_s, kNumBin, &sad_histogram);
+  std::vector<float> sad_scores = GetSADScoresForPatches(
+      opsin, block_s, kNumBin, patch_ratio, pool, &sad_histogram);
   float sad_threshold = GetSADThreshold(sad_histogram, kNumBin);
   // If threshold is too large, the image has a strong pattern. This pattern
   // fools our model and it will add too much noise. Therefore, we do not add
@@ -350,7 +400,11 @@ Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
     return false;
   }
   std::vector<NoiseLevel> nl =
-      GetNoiseLevel(opsin, sad_scores, sad_threshold, block_s);
+      GetNoiseLevel(opsin, sad_scores, sad_threshold, block_s, pool);
+  if (nl.empty()) {
+    noise_params->Clear();
+    return false;
+  }
 
   OptimizeNoiseParameters(nl, noise_params);
   for (float& i : noise_params->lut) {
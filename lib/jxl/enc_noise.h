@@ -11,6 +11,7 @@
 #include <stddef.h>
 
 #include "lib/jxl/aux_out_fwd.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/image.h"
@@ -18,10 +19,17 @@
 
 namespace jxl {
 
+// Number of 8x8 patches the estimation looks at by default; larger images
+// are sampled.
+constexpr size_t kNoiseSampledPatches = 1 << 16;
+
 // Get parameters of the noise for NoiseParams model
 // Returns whether a valid noise model (with HasAny()) is set.
+// Only one in `patch_ratio` patches is analyzed, or, if it is 0, enough for
+// about kNoiseSampledPatches of them.
 Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
-                         float quality_coef);
+                         float quality_coef, size_t patch_ratio = 0,
+                         ThreadPool* pool = nullptr);
 
 // Does not write anything if `noise_params` are empty. Otherwise, caller must
 // set FrameHeader.flags.kNoise.
@@ -11,6 +11,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <memory>
 #include <string>
 
 #include "lib/jxl/base/override.h"
@@ -21,6 +22,9 @@
 
 namespace jxl {
 
+class EncoderDeadline;
+struct ModularTreeCache;
+
 enum class SpeedTier {
   // Turns on FindBestQuantizationHQ loop. Equivalent to "guetzli" mode.
   kTortoise = 1,
@@ -192,6 +196,14 @@ struct CompressParams {
   // Saliency-map (owned by caller).
   ImageF* saliency_map = nullptr;
 
+  // Importance map (owned by caller), one value per 8x8 block of the frame
+  // after resampling. If set, the AC strategy search and the butteraugli
+  // iterations only spend effort on blocks whose importance is at least
+  // `importance_threshold`: the others use DCT8 (unless their 64x64 area has
+  // an important block) and keep their initial quantization.
+  const ImageF* importance_map = nullptr;
+  float importance_threshold = 0.5f;
+
   // Input and output file name. Will be used to provide pluggable saliency
   // extractor with paths.
   const char* file_in = nullptr;
@@ -210,10 +222,27 @@ struct CompressParams {
   // allowing reconstruction of the original JPEG.
   bool force_cfl_jpeg_recompression = true;
 
+  // When doing JPEG recompression, convert and tokenize the coefficients one
+  // group at a time instead of first converting the whole frame, and do not
+  // allocate a placeholder pixel image for the JPEG frame. Produces the same
+  // output with a much lower peak memory usage.
+  bool jpeg_low_memory = false;
+
+  // When encoding pixels with VarDCT, release the buffers of each encoding
+  // step as soon as the next step no longer needs them: the XYB image once
+  // the coefficients are computed, the coefficients once tokenized, and the
+  // tokens of each group once its section is written. Produces the same
+  // output; later frames allocate their buffers again instead of reusing them.
+  bool low_memory = false;
+
   // Set the noise to what it would approximately be if shooting at the nominal
   // exposure for a given ISO setting on a 35mm camera.
   float photon_noise_iso = 0;
 
+  // Without photon_noise_iso, the noise is estimated from one in this many
+  // 8x8 patches of the image. 0 samples large images, see GetNoiseParameter.
+  size_t noise_patch_ratio = 0;
+
   // modular mode options below
   ModularOptions options;
   int responsive = -1;
@@ -226,6 +255,35 @@ struct CompressParams {
   float channel_colors_percent = 80.f;
   int palette_colors = 1 << 10;  // up to 10-bit palette is probably worthwhile
   bool lossy_palette = false;
+  // Whether lossless modular frames at speed tier kThunder or faster use a
+  // built-in static prefix code instead of one built from the histograms of
+  // their tokens, so that the tokens of each group are written as they are
+  // computed instead of being kept for the whole frame. On by default at
+  // kLightning.
+  Override static_codes = Override::kDefault;
+  // If set, the MA tree and context clustering learned for a frame are
+  // stored here, and reused instead of learning new ones for later frames
+  // encoded with (copies of) these params, as long as they are compatible. See
+  // enc_modular.h.
+  std::shared_ptr<ModularTreeCache> modular_tree_cache;
+
+  // Wall-clock budget for encoding each frame, in seconds, or 0 for none.
+  // EncodeFrame starts `deadline` from it, which the copies of these params
+  // used by the stages of that frame share. See enc_deadline.h.
+  double time_budget = 0.0;
+  std::shared_ptr<EncoderDeadline> deadline;
+
+  // If set, EncodeFrame chooses between modular and VarDCT with or without
+  // patches for lossy frames by classifying their pixels first, unless
+  // modular_mode or explicit_vardct is set. See enc_content_classifier.h.
+  bool classify_content = false;
+  // Set if VarDCT was chosen explicitly, which classify_content then keeps.
+  bool explicit_vardct = false;
+
+  // If positive, EncodeFrame disables decoding tools of the frames until their
+  // predicted decoding cost is at most this many cycles per pixel, see
+  // enc_decode_cost.h.
+  float max_decode_cycles = 0.0f;
 
   // Returns whether these params are lossless as defined by SetLossless();
   bool IsLossless() const {
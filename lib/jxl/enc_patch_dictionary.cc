@@ -10,8 +10,10 @@
 #include <sys/types.h>
 
 #include <algorithm>
+#include <memory>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -115,18 +117,15 @@ void PatchDictionaryEncoder::SubtractFrom(const PatchDictionary& pdic,
                                           Image3F* opsin) {
   // TODO(veluca): this can likely be optimized knowing it runs on full images.
   for (size_t y = 0; y < opsin->ysize(); y++) {
-    if (y + 1 >= pdic.patch_starts_.size()) continue;
     float* JXL_RESTRICT rows[3] = {
         opsin->PlaneRow(0, y),
         opsin->PlaneRow(1, y),
         opsin->PlaneRow(2, y),
     };
-    for (size_t id = pdic.patch_starts_[y]; id < pdic.patch_starts_[y + 1];
-         id++) {
-      const PatchPosition& pos = pdic.positions_[pdic.sorted_patches_[id]];
+    pdic.ForEachPatchInRow(y, 0, opsin->xsize(), [&](const PatchPosition& pos,
+                                                      size_t px0, size_t px1) {
       size_t by = pos.y;
       size_t bx = pos.x;
-      size_t xsize = pos.ref_pos.xsize;
       JXL_DASSERT(y >= by);
       JXL_DASSERT(y < by + pos.ref_pos.ysize);
       size_t iy = y - by;
@@ -142,7 +141,7 @@ void PatchDictionaryEncoder::SubtractFrom(const PatchDictionary& pdic,
               2, pos.ref_pos.y0 + iy) +
               pos.ref_pos.x0,
       };
-      for (size_t ix = 0; ix < xsize; ix++) {
+      for (size_t ix = px0 - bx; ix < px1 - bx; ix++) {
         for (size_t c = 0; c < 3; c++) {
           if (pos.blending[0].mode == PatchBlendMode::kAdd) {
             rows[c][bx + ix] -= ref_rows[c][ix];
@@ -156,7 +155,7 @@ void PatchDictionaryEncoder::SubtractFrom(const PatchDictionary& pdic,
           }
         }
       }
-    }
+    });
   }
 }
 
@@ -398,10 +397,19 @@ std::vector<PatchInfo> FindTextLikePatches(
   constexpr int kMinPeak = 2;
   constexpr int kHasSimilarRadius = 2;
 
-  std::vector<PatchInfo> info;
+  // Bounding box of a small CC outside the "similar enough" areas, and the
+  // background color around it.
+  struct PatchCandidate {
+    size_t min_x, max_x, min_y, max_y;
+    std::pair<uint32_t, uint32_t> reference;
+  };
+  std::vector<PatchCandidate> candidates;
+  // Pixels of each candidate, only kept for debug output.
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> candidate_ccs;
 
-  // Find small CC outside the "similar enough" areas, compute bounding boxes,
-  // and run heuristics to exclude some patches.
+  // Find small CC outside the "similar enough" areas and compute bounding
+  // boxes. The flood fill crosses group boundaries, so it stays sequential;
+  // the per-candidate work below runs on the pool.
   ImageB visited(opsin.xsize(), opsin.ysize());
   ZeroFillImage(&visited);
   uint8_t* JXL_RESTRICT visited_row = visited.Row(0);
@@ -462,84 +470,123 @@ std::vector<PatchInfo> FindTextLikePatches(
           max_y - min_y >= kMaxPatchSize) {
         continue;
       }
-      size_t bpos = background_stride * reference.second + reference.first;
-      float ref[3] = {background_rows[0][bpos], background_rows[1][bpos],
-                      background_rows[2][bpos]};
-      bool has_similar = false;
-      for (size_t iy = std::max<int>(
-               static_cast<int32_t>(min_y) - kHasSimilarRadius, 0);
-           iy < std::min(max_y + kHasSimilarRadius + 1, opsin.ysize()); iy++) {
-        for (size_t ix = std::max<int>(
-                 static_cast<int32_t>(min_x) - kHasSimilarRadius, 0);
-             ix < std::min(max_x + kHasSimilarRadius + 1, opsin.xsize());
-             ix++) {
-          size_t opos = opsin_stride * iy + ix;
-          float px[3] = {opsin_rows[0][opos], opsin_rows[1][opos],
-                         opsin_rows[2][opos]};
-          if (pci.is_similar_v(ref, px, kHasSimilarThreshold)) {
-            has_similar = true;
-          }
+      candidates.push_back({min_x, max_x, min_y, max_y, reference});
+      if (paint_ccs) candidate_ccs.push_back(cc);
+    }
+  }
+
+  // Runs the heuristics that exclude some candidates, quantizes the others and
+  // hashes their pixels for the duplicate search.
+  std::vector<std::unique_ptr<PatchInfo>> found(candidates.size());
+  std::vector<uint64_t> hashes(candidates.size());
+  const auto extract_patch = [&](const uint32_t i, size_t /* thread */) {
+    const PatchCandidate& cand = candidates[i];
+    size_t bpos =
+        background_stride * cand.reference.second + cand.reference.first;
+    float ref[3] = {background_rows[0][bpos], background_rows[1][bpos],
+                    background_rows[2][bpos]};
+    bool has_similar = false;
+    for (size_t iy = std::max<int>(
+             static_cast<int32_t>(cand.min_y) - kHasSimilarRadius, 0);
+         !has_similar &&
+         iy < std::min(cand.max_y + kHasSimilarRadius + 1, opsin.ysize());
+         iy++) {
+      for (size_t ix = std::max<int>(
+               static_cast<int32_t>(cand.min_x) - kHasSimilarRadius, 0);
+           ix < std::min(cand.max_x + kHasSimilarRadius + 1, opsin.xsize());
+           ix++) {
+        size_t opos = opsin_stride * iy + ix;
+        float px[3] = {opsin_rows[0][opos], opsin_rows[1][opos],
+                       opsin_rows[2][opos]};
+        if (pci.is_similar_v(ref, px, kHasSimilarThreshold)) {
+          has_similar = true;
+          break;
         }
       }
-      if (!has_similar) continue;
-      info.emplace_back();
-      info.back().second.emplace_back(min_x, min_y);
-      QuantizedPatch& patch = info.back().first;
-      patch.xsize = max_x - min_x + 1;
-      patch.ysize = max_y - min_y + 1;
-      int max_value = 0;
-      for (size_t c : {1, 0, 2}) {
-        for (size_t iy = min_y; iy <= max_y; iy++) {
-          for (size_t ix = min_x; ix <= max_x; ix++) {
-            size_t offset = (iy - min_y) * patch.xsize + ix - min_x;
-            patch.fpixels[c][offset] =
-                opsin_rows[c][iy * opsin_stride + ix] - ref[c];
-            int val = pci.Quantize(patch.fpixels[c][offset], c);
-            patch.pixels[c][offset] = val;
-            if (std::abs(val) > max_value) max_value = std::abs(val);
-          }
+    }
+    if (!has_similar) return;
+    std::unique_ptr<PatchInfo> info(new PatchInfo());
+    info->second.emplace_back(cand.min_x, cand.min_y);
+    QuantizedPatch& patch = info->first;
+    patch.xsize = cand.max_x - cand.min_x + 1;
+    patch.ysize = cand.max_y - cand.min_y + 1;
+    int max_value = 0;
+    for (size_t c : {1, 0, 2}) {
+      for (size_t iy = cand.min_y; iy <= cand.max_y; iy++) {
+        for (size_t ix = cand.min_x; ix <= cand.max_x; ix++) {
+          size_t offset = (iy - cand.min_y) * patch.xsize + ix - cand.min_x;
+          patch.fpixels[c][offset] =
+              opsin_rows[c][iy * opsin_stride + ix] - ref[c];
+          int val = pci.Quantize(patch.fpixels[c][offset], c);
+          patch.pixels[c][offset] = val;
+          if (std::abs(val) > max_value) max_value = std::abs(val);
         }
       }
-      if (max_value < kMinPeak) {
-        info.pop_back();
-        continue;
-      }
-      if (paint_ccs) {
-        float cc_color = rng.UniformF(0.5, 1.0);
-        for (std::pair<uint32_t, uint32_t> p : cc) {
-          ccs.Row(p.second)[p.first] = cc_color;
-        }
+    }
+    if (max_value < kMinPeak) return;
+    uint64_t hash = patch.xsize * 0x9E3779B97F4A7C15ull + patch.ysize;
+    for (size_t c = 0; c < 3; c++) {
+      for (size_t j = 0; j < patch.xsize * patch.ysize; j++) {
+        hash = (hash ^ static_cast<uint8_t>(patch.pixels[c][j])) *
+               0x9E3779B97F4A7C15ull;
       }
     }
-  }
+    hashes[i] = hash;
+    found[i] = std::move(info);
+  };
+  JXL_CHECK(RunOnPool(pool, 0, candidates.size(), ThreadPool::NoInit,
+                      extract_patch, "ExtractPatches"));
 
   if (paint_ccs) {
     JXL_ASSERT(WantDebugOutput(aux_out));
+    for (size_t i = 0; i < candidates.size(); i++) {
+      if (!found[i]) continue;
+      float cc_color = rng.UniformF(0.5, 1.0);
+      for (std::pair<uint32_t, uint32_t> p : candidate_ccs[i]) {
+        ccs.Row(p.second)[p.first] = cc_color;
+      }
+    }
     aux_out->DumpPlaneNormalized("ccs", ccs);
   }
-  if (info.empty()) {
-    return {};
-  }
 
-  // Remove duplicates.
+  // Merge the occurrences of identical patches. Candidates are bucketed by
+  // hash, so each one is only compared to the few patches sharing its hash.
   constexpr size_t kMinPatchOccurences = 2;
-  std::sort(info.begin(), info.end());
-  size_t unique = 0;
-  for (size_t i = 1; i < info.size(); i++) {
-    if (info[i].first == info[unique].first) {
-      info[unique].second.insert(info[unique].second.end(),
-                                 info[i].second.begin(), info[i].second.end());
-    } else {
-      if (info[unique].second.size() >= kMinPatchOccurences) {
-        unique++;
+  std::vector<std::unique_ptr<PatchInfo>> unique_info;
+  std::unordered_map<uint64_t, std::vector<size_t>> patches_by_hash;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    if (!found[i]) continue;
+    std::vector<size_t>& bucket = patches_by_hash[hashes[i]];
+    bool is_duplicate = false;
+    for (size_t j : bucket) {
+      if (unique_info[j]->first == found[i]->first) {
+        unique_info[j]->second.push_back(found[i]->second[0]);
+        is_duplicate = true;
+        break;
       }
-      info[unique] = info[i];
     }
+    if (is_duplicate) {
+      found[i].reset();
+      continue;
+    }
+    bucket.push_back(unique_info.size());
+    unique_info.push_back(std::move(found[i]));
   }
-  if (info[unique].second.size() >= kMinPatchOccurences) {
-    unique++;
+  std::vector<PatchInfo> info;
+  for (std::unique_ptr<PatchInfo>& patch : unique_info) {
+    if (patch->second.size() >= kMinPatchOccurences) {
+      info.push_back(std::move(*patch));
+    }
+    patch.reset();
+  }
+  if (info.empty()) {
+    return {};
   }
-  info.resize(unique);
+  // Keep the order of the patches independent of the hash function.
+  std::sort(info.begin(), info.end(),
+            [](const PatchInfo& a, const PatchInfo& b) {
+              return a.first < b.first;
+            });
 
   size_t max_patch_size = 0;
 
@@ -710,6 +757,8 @@ void FindBestPatchDictionary(const Image3F& opsin,
   CompressParams cparams = state->cparams;
   // Recursive application of patches could create very weird issues.
   cparams.patches = Override::kOff;
+  // The importance map is for the blocks of the main frame.
+  cparams.importance_map = nullptr;
 
   RoundtripPatchFrame(&reference_frame, state, 0, cparams, cms, pool, true);
 
@@ -0,0 +1,472 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_ssimulacra.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/enc_ssimulacra.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/jxl/base/profiler.h"
+#include "lib/jxl/color_encoding_internal.h"
+#include "lib/jxl/fast_math-inl.h"
+#include "lib/jxl/gauss_blur.h"
+#include "lib/jxl/image_ops.h"
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+constexpr float kC1 = 0.0001f;
+constexpr float kC2 = 0.0004f;
+constexpr int kNumScales = 6;
+
+// Cube root of positive values: one Newton step refines the approximation,
+// whose relative error of 3e-5 would otherwise show in the SSIM of flat areas.
+template <class DF, class V>
+V CubeRoot(const DF df, V x) {
+  const V third = Set(df, 1.0f / 3);
+  const V y = FastPowf(df, x, third);
+  return MulAdd(Set(df, 2.0f), y, x / (y * y)) * third;
+}
+
+// Whole vectors of the rows are processed, so the pixels of the padding at the
+// end of the rows are also written but never read back as results.
+void Rgb2Lab(const Image3F& in, ThreadPool* pool, Image3F* out) {
+  JXL_CHECK(RunOnPool(
+      pool, 0, in.ysize(), ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t y = task;
+        const HWY_FULL(float) d;
+        const auto epsilon = Set(d, 0.00885645167903563081f);
+        const auto s = Set(d, 0.13793103448275862068f);
+        const auto k = Set(d, 7.78703703703703703703f);
+        const float* JXL_RESTRICT row_in0 = in.ConstPlaneRow(0, y);
+        const float* JXL_RESTRICT row_in1 = in.ConstPlaneRow(1, y);
+        const float* JXL_RESTRICT row_in2 = in.ConstPlaneRow(2, y);
+        float* JXL_RESTRICT row_out0 = out->PlaneRow(0, y);
+        float* JXL_RESTRICT row_out1 = out->PlaneRow(1, y);
+        float* JXL_RESTRICT row_out2 = out->PlaneRow(2, y);
+        for (size_t x = 0; x < in.xsize(); x += Lanes(d)) {
+          const auto r = Load(d, row_in0 + x);
+          const auto g = Load(d, row_in1 + x);
+          const auto b = Load(d, row_in2 + x);
+          const auto fx =
+              MulAdd(Set(d, 0.43393624408206207259f), r,
+                     MulAdd(Set(d, 0.37619779063650710152f), g,
+                            Set(d, 0.18983429773803261441f) * b));
+          const auto fy = MulAdd(Set(d, 0.2126729f), r,
+                                 MulAdd(Set(d, 0.7151522f), g,
+                                        Set(d, 0.0721750f) * b));
+          const auto fz =
+              MulAdd(Set(d, 0.01775381083562901744f), r,
+                     MulAdd(Set(d, 0.10945087235996326905f), g,
+                            Set(d, 0.87263921028466483011f) * b));
+          const auto X =
+              IfThenElse(fx > epsilon, CubeRoot(d, fx) - s, k * fx);
+          const auto Y =
+              IfThenElse(fy > epsilon, CubeRoot(d, fy) - s, k * fy);
+          const auto Z =
+              IfThenElse(fz > epsilon, CubeRoot(d, fz) - s, k * fz);
+          Store(Set(d, 1.16f) * Y, d, row_out0 + x);
+          Store(MulAdd(Set(d, 2.27272727272727272727f), X - Y,
+                       Set(d, 0.39181818181818181818f)),
+                d, row_out1 + x);
+          Store(MulAdd(Set(d, 0.90909090909090909090f), Y - Z,
+                       Set(d, 0.49045454545454545454f)),
+                d, row_out2 + x);
+        }
+      },
+      "SsimulacraLab"));
+}
+
+Image3F Downsample(const Image3F& in, size_t fx, size_t fy, ThreadPool* pool) {
+  const size_t out_xsize = (in.xsize() + fx - 1) / fx;
+  const size_t out_ysize = (in.ysize() + fy - 1) / fy;
+  Image3F out(out_xsize, out_ysize);
+  const float normalize = 1.0f / (fx * fy);
+  JXL_CHECK(RunOnPool(
+      pool, 0, out_ysize, ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t oy = task;
+        for (size_t c = 0; c < 3; ++c) {
+          float* JXL_RESTRICT row_out = out.PlaneRow(c, oy);
+          for (size_t ox = 0; ox < out_xsize; ++ox) {
+            float sum = 0.0f;
+            for (size_t iy = 0; iy < fy; ++iy) {
+              const size_t y = std::min(oy * fy + iy, in.ysize() - 1);
+              const float* JXL_RESTRICT row_in = in.ConstPlaneRow(c, y);
+              for (size_t ix = 0; ix < fx; ++ix) {
+                sum += row_in[std::min(ox * fx + ix, in.xsize() - 1)];
+              }
+            }
+            row_out[ox] = sum * normalize;
+          }
+        }
+      },
+      "SsimulacraDownsample"));
+  return out;
+}
+
+void Multiply(const Image3F& a, const Image3F& b, ThreadPool* pool,
+              Image3F* mul) {
+  JXL_CHECK(RunOnPool(
+      pool, 0, a.ysize(), ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t y = task;
+        const HWY_FULL(float) d;
+        for (size_t c = 0; c < 3; ++c) {
+          const float* JXL_RESTRICT in1 = a.ConstPlaneRow(c, y);
+          const float* JXL_RESTRICT in2 = b.ConstPlaneRow(c, y);
+          float* JXL_RESTRICT out = mul->PlaneRow(c, y);
+          for (size_t x = 0; x < a.xsize(); x += Lanes(d)) {
+            Store(Load(d, in1 + x) * Load(d, in2 + x), d, out + x);
+          }
+        }
+      },
+      "SsimulacraMultiply"));
+}
+
+// Sum of the first xsize values of row.
+double RowSum(const float* JXL_RESTRICT row, size_t xsize) {
+  const HWY_FULL(float) d;
+  auto sum = Zero(d);
+  size_t x = 0;
+  for (; x + Lanes(d) <= xsize; x += Lanes(d)) {
+    sum += Load(d, row + x);
+  }
+  double result = GetLane(SumOfLanes(d, sum));
+  for (; x < xsize; ++x) result += row[x];
+  return result;
+}
+
+// Averages of the planes from the sums of their rows, which are added in order
+// so that the result does not depend on the number of threads.
+void PlaneAverages(const std::vector<double>& row_sums, size_t xsize,
+                   size_t ysize, double* plane_averages) {
+  for (size_t c = 0; c < 3; ++c) {
+    double sum = 0.0;
+    for (size_t y = 0; y < ysize; ++y) sum += row_sums[c * ysize + y];
+    plane_averages[c] = sum / (xsize * ysize);
+  }
+}
+
+void RowColAvgP2(const ImageF& in, double* rp2, double* cp2) {
+  std::vector<double> ravg(in.ysize());
+  std::vector<double> cavg(in.xsize());
+  for (size_t y = 0; y < in.ysize(); ++y) {
+    const float* JXL_RESTRICT row = in.ConstRow(y);
+    for (size_t x = 0; x < in.xsize(); ++x) {
+      const float val = row[x];
+      ravg[y] += val;
+      cavg[x] += val;
+    }
+  }
+  std::sort(ravg.begin(), ravg.end());
+  std::sort(cavg.begin(), cavg.end());
+  *rp2 = ravg[ravg.size() / 50] / in.xsize();
+  *cp2 = cavg[cavg.size() / 50] / in.ysize();
+}
+
+void EdgeDiffMap(const Image3F& img1, const Image3F& mu1, const Image3F& img2,
+                 const Image3F& mu2, ThreadPool* pool, Image3F* out,
+                 double* plane_averages) {
+  const size_t xsize = img1.xsize();
+  const size_t ysize = img1.ysize();
+  std::vector<double> row_sums(3 * ysize);
+  JXL_CHECK(RunOnPool(
+      pool, 0, ysize, ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t y = task;
+        const HWY_FULL(float) d;
+        for (size_t c = 0; c < 3; ++c) {
+          const float* JXL_RESTRICT row1 = img1.ConstPlaneRow(c, y);
+          const float* JXL_RESTRICT row2 = img2.ConstPlaneRow(c, y);
+          const float* JXL_RESTRICT rowm1 = mu1.ConstPlaneRow(c, y);
+          const float* JXL_RESTRICT rowm2 = mu2.ConstPlaneRow(c, y);
+          float* JXL_RESTRICT row_out = out->PlaneRow(c, y);
+          for (size_t x = 0; x < xsize; x += Lanes(d)) {
+            const auto edgediff = ZeroIfNegative(
+                Abs(Load(d, row2 + x) - Load(d, rowm2 + x)) -
+                Abs(Load(d, row1 + x) - Load(d, rowm1 + x)));
+            Store(Set(d, 1.0f) - edgediff, d, row_out + x);
+          }
+          row_sums[c * ysize + y] = RowSum(row_out, xsize);
+        }
+      },
+      "SsimulacraEdgeDiff"));
+  PlaneAverages(row_sums, xsize, ysize, plane_averages);
+}
+
+// Temporary storage for Gaussian blur, reused for multiple images.
+class Blur {
+ public:
+  Blur(const size_t xsize, const size_t ysize, ThreadPool* pool)
+      : rg_(CreateRecursiveGaussian(1.5)), temp_(xsize, ysize), pool_(pool) {}
+
+  void operator()(const ImageF& in, ImageF* JXL_RESTRICT out) {
+    FastGaussian(rg_, in, pool_, &temp_, out);
+  }
+
+  Image3F operator()(const Image3F& in) {
+    Image3F out(in.xsize(), in.ysize());
+    operator()(in.Plane(0), &out.Plane(0));
+    operator()(in.Plane(1), &out.Plane(1));
+    operator()(in.Plane(2), &out.Plane(2));
+    return out;
+  }
+
+  // Allows reusing across scales.
+  void ShrinkTo(const size_t xsize, const size_t ysize) {
+    temp_.ShrinkTo(xsize, ysize);
+  }
+
+ private:
+  hwy::AlignedUniquePtr<RecursiveGaussian> rg_;
+  ImageF temp_;
+  ThreadPool* pool_;
+};
+
+void SSIMMap(const Image3F& m1, const Image3F& m2, const Image3F& s11,
+             const Image3F& s22, const Image3F& s12, ThreadPool* pool,
+             Image3F* out, double* plane_averages) {
+  const size_t xsize = out->xsize();
+  const size_t ysize = out->ysize();
+  std::vector<double> row_sums(3 * ysize);
+  JXL_CHECK(RunOnPool(
+      pool, 0, ysize, ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        const size_t y = task;
+        const HWY_FULL(float) d;
+        const auto c1 = Set(d, kC1);
+        const auto c2 = Set(d, kC2);
+        const auto two = Set(d, 2.0f);
+        for (size_t c = 0; c < 3; ++c) {
+          const float* JXL_RESTRICT row_m1 = m1.ConstPlaneRow(c, y);
+          const float* JXL_RESTRICT row_m2 = m2.ConstPlaneRow(c, y);
+          const float* JXL_RESTRICT row_s11 = s11.ConstPlaneRow(c, y);
+          const float* JXL_RESTRICT row_s22 = s22.ConstPlaneRow(c, y);
+          const float* JXL_RESTRICT row_s12 = s12.ConstPlaneRow(c, y);
+          float* JXL_RESTRICT row_out = out->PlaneRow(c, y);
+          for (size_t x = 0; x < xsize; x += Lanes(d)) {
+            const auto mu1 = Load(d, row_m1 + x);
+            const auto mu2 = Load(d, row_m2 + x);
+            const auto mu11 = mu1 * mu1;
+            const auto mu22 = mu2 * mu2;
+            const auto mu12 = mu1 * mu2;
+            const auto nom_m = MulAdd(two, mu12, c1);
+            const auto nom_s = MulAdd(two, Load(d, row_s12 + x) - mu12, c2);
+            const auto denom_m = mu11 + mu22 + c1;
+            const auto denom_s = (Load(d, row_s11 + x) - mu11) +
+                                 (Load(d, row_s22 + x) - mu22) + c2;
+            Store((nom_m * nom_s) / (denom_m * denom_s), d, row_out + x);
+          }
+          row_sums[c * ysize + y] = RowSum(row_out, xsize);
+        }
+      },
+      "SsimulacraSSIMMap"));
+  PlaneAverages(row_sums, xsize, ysize, plane_averages);
+}
+
+Ssimulacra ComputeSsimulacra(const Image3F& orig, const Image3F& distorted,
+                             bool simple, ThreadPool* pool, ImageF* diffmap) {
+  PROFILER_FUNC;
+  JXL_ASSERT(SameSize(orig, distorted));
+  Ssimulacra ssimulacra;
+
+  ssimulacra.simple = simple;
+  Image3F img1(orig.xsize(), orig.ysize());
+  Image3F img2(orig.xsize(), orig.ysize());
+  Rgb2Lab(orig, pool, &img1);
+  Rgb2Lab(distorted, pool, &img2);
+
+  Image3F mul(orig.xsize(), orig.ysize());
+  Blur blur(img1.xsize(), img1.ysize(), pool);
+
+  for (int scale = 0; scale < kNumScales; scale++) {
+    if (img1.xsize() < 8 || img1.ysize() < 8) {
+      break;
+    }
+    if (scale) {
+      img1 = Downsample(img1, 2, 2, pool);
+      img2 = Downsample(img2, 2, 2, pool);
+    }
+    mul.ShrinkTo(img1.xsize(), img2.ysize());
+    blur.ShrinkTo(img1.xsize(), img2.ysize());
+
+    Multiply(img1, img1, pool, &mul);
+    Image3F sigma1_sq = blur(mul);
+
+    Multiply(img2, img2, pool, &mul);
+    Image3F sigma2_sq = blur(mul);
+
+    Multiply(img1, img2, pool, &mul);
+    Image3F sigma12 = blur(mul);
+
+    Image3F mu1 = blur(img1);
+    Image3F mu2 = blur(img2);
+    // Reuse mul as "ssim_map".
+    SsimulacraScale sscale;
+    SSIMMap(mu1, mu2, sigma1_sq, sigma2_sq, sigma12, pool, &mul,
+            sscale.avg_ssim);
+
+    if (scale == 0 && diffmap != nullptr) {
+      *diffmap = ImageF(mul.xsize(), mul.ysize());
+      for (size_t y = 0; y < mul.ysize(); ++y) {
+        const float* JXL_RESTRICT row_ssim = mul.ConstPlaneRow(0, y);
+        float* JXL_RESTRICT row_out = diffmap->Row(y);
+        for (size_t x = 0; x < mul.xsize(); ++x) {
+          row_out[x] = 1.0f - row_ssim[x];
+        }
+      }
+    }
+
+    const Image3F ssim_map = Downsample(mul, 4, 4, pool);
+    for (size_t c = 0; c < 3; c++) {
+      float minval, maxval;
+      ImageMinMax(ssim_map.Plane(c), &minval, &maxval);
+      sscale.min_ssim[c] = static_cast<double>(minval);
+    }
+    ssimulacra.scales.push_back(sscale);
+
+    if (scale == 0 && !simple) {
+      Image3F* edgediff = &sigma1_sq;  // reuse
+      EdgeDiffMap(img1, mu1, img2, mu2, pool, edgediff,
+                  ssimulacra.avg_edgediff);
+      for (size_t c = 0; c < 3; c++) {
+        RowColAvgP2(ssim_map.Plane(c), &ssimulacra.row_p2[0][c],
+                    &ssimulacra.col_p2[0][c]);
+        RowColAvgP2(edgediff->Plane(c), &ssimulacra.row_p2[1][c],
+                    &ssimulacra.col_p2[1][c]);
+      }
+    }
+  }
+  return ssimulacra;
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+namespace {
+
+constexpr size_t kNumScoreScales = 6;
+// Premultiplied by chroma weight 0.2
+const double kScaleWeights[kNumScoreScales][3] = {
+    {0.04480, 0.00300, 0.00300}, {0.28560, 0.00896, 0.00896},
+    {0.30010, 0.05712, 0.05712}, {0.23630, 0.06002, 0.06002},
+    {0.13330, 0.06726, 0.06726}, {0.10000, 0.05000, 0.05000},
+};
+// Premultiplied by min weights 0.1, 0.005, 0.005
+const double kMinScaleWeights[kNumScoreScales][3] = {
+    {0.02000, 0.00005, 0.00005}, {0.03000, 0.00025, 0.00025},
+    {0.02500, 0.00100, 0.00100}, {0.02000, 0.00150, 0.00150},
+    {0.01200, 0.00175, 0.00175}, {0.00500, 0.00175, 0.00175},
+};
+const double kEdgeWeight[3] = {1.5, 0.1, 0.1};
+const double kGridWeight[3] = {1.0, 0.1, 0.1};
+
+inline void PrintItem(const char* name, int scale, const double* vals,
+                      const double* w) {
+  printf("scale %d %s = [%.10f %.10f %.10f]  w = [%.5f %.5f %.5f]\n", scale,
+         name, vals[0], vals[1], vals[2], w[0], w[1], w[2]);
+}
+
+}  // namespace
+
+double Ssimulacra::Score() const {
+  double ssim = 0.0;
+  double ssim_max = 0.0;
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t scale = 0; scale < scales.size(); ++scale) {
+      ssim += kScaleWeights[scale][c] * scales[scale].avg_ssim[c];
+      ssim_max += kScaleWeights[scale][c];
+      ssim += kMinScaleWeights[scale][c] * scales[scale].min_ssim[c];
+      ssim_max += kMinScaleWeights[scale][c];
+    }
+    if (!simple) {
+      ssim += kEdgeWeight[c] * avg_edgediff[c];
+      ssim_max += kEdgeWeight[c];
+      ssim += kGridWeight[c] *
+              (row_p2[0][c] + row_p2[1][c] + col_p2[0][c] + col_p2[1][c]);
+      ssim_max += 4.0 * kGridWeight[c];
+    }
+  }
+  double dssim = ssim_max / ssim - 1.0;
+  return std::min(1.0, std::max(0.0, dssim));
+}
+
+void Ssimulacra::PrintDetails() const {
+  for (size_t s = 0; s < scales.size(); ++s) {
+    if (s < kNumScoreScales) {
+      PrintItem("avg ssim", s, scales[s].avg_ssim, kScaleWeights[s]);
+      PrintItem("min ssim", s, scales[s].min_ssim, kMinScaleWeights[s]);
+    }
+    if (s == 0 && !simple) {
+      PrintItem("avg edif", s, avg_edgediff, kEdgeWeight);
+      PrintItem("rp2 ssim", s, &row_p2[0][0], kGridWeight);
+      PrintItem("cp2 ssim", s, &col_p2[0][0], kGridWeight);
+      PrintItem("rp2 edif", s, &row_p2[1][0], kGridWeight);
+      PrintItem("cp2 edif", s, &col_p2[1][0], kGridWeight);
+    }
+  }
+}
+
+HWY_EXPORT(ComputeSsimulacra);
+Ssimulacra ComputeSsimulacra(const Image3F& orig, const Image3F& distorted,
+                             bool simple, ThreadPool* pool, ImageF* diffmap) {
+  return HWY_DYNAMIC_DISPATCH(ComputeSsimulacra)(orig, distorted, simple,
+                                                 pool, diffmap);
+}
+
+Status SsimulacraComparator::SetReferenceImage(const ImageBundle& ref) {
+  if (ref.xsize() < 8 || ref.ysize() < 8) {
+    return JXL_FAILURE("SSIMULACRA needs images of at least 8x8 pixels");
+  }
+  reference_ = CopyImage(ref.color());
+  return true;
+}
+
+Status SsimulacraComparator::CompareWith(const ImageBundle& actual,
+                                         ImageF* diffmap, float* score) {
+  if (reference_.xsize() == 0) {
+    return JXL_FAILURE("Must set reference image first");
+  }
+  if (reference_.xsize() != actual.xsize() ||
+      reference_.ysize() != actual.ysize()) {
+    return JXL_FAILURE("Images must have same size");
+  }
+  const Ssimulacra ssimulacra =
+      ComputeSsimulacra(reference_, actual.color(), simple_, pool_, diffmap);
+  if (score != nullptr) *score = ssimulacra.Score();
+  return true;
+}
+
+// Thresholds of the SSIMULACRA documentation: images scoring below 0.01 are
+// usually indistinguishable, above 0.1 the distortion is obvious.
+float SsimulacraComparator::GoodQualityScore() const { return 0.01f; }
+
+float SsimulacraComparator::BadQualityScore() const { return 0.1f; }
+
+float SsimulacraDistance(const ImageBundle& orig, const ImageBundle& distorted,
+                         const JxlCmsInterface& cms, bool simple,
+                         ThreadPool* pool) {
+  SsimulacraComparator comparator(simple, pool);
+  return ComputeScore(orig, distorted, &comparator, cms, /*diffmap=*/nullptr,
+                      pool);
+}
+
+}  // namespace jxl
+#endif
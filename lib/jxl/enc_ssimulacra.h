@@ -0,0 +1,80 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_SSIMULACRA_H_
+#define LIB_JXL_ENC_SSIMULACRA_H_
+
+// SSIMULACRA (Structural SIMilarity Unveiling Local And Compression Related
+// Artifacts), a multi-scale SSIM in the Lab color space with penalties for
+// new edges and for blocking artifacts along rows and columns.
+// https://github.com/cloudinary/ssimulacra
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/enc_comparator.h"
+#include "lib/jxl/image.h"
+#include "lib/jxl/image_bundle.h"
+
+namespace jxl {
+
+struct SsimulacraScale {
+  double avg_ssim[3];
+  double min_ssim[3];
+};
+
+struct Ssimulacra {
+  std::vector<SsimulacraScale> scales;
+  double avg_edgediff[3];
+  double row_p2[2][3];
+  double col_p2[2][3];
+  bool simple;
+
+  // Dissimilarity in [0, 1], 0 for identical images.
+  double Score() const;
+  void PrintDetails() const;
+};
+
+// Compares images in linear sRGB of the same size, at least 8x8 pixels. If
+// `simple`, only uses the multi-scale SSIM, without the edge and blocking
+// penalties. If `diffmap` is not null, it receives the SSIM dissimilarity of
+// the lightness at full resolution.
+Ssimulacra ComputeSsimulacra(const Image3F& orig, const Image3F& distorted,
+                             bool simple, ThreadPool* pool = nullptr,
+                             ImageF* diffmap = nullptr);
+
+class SsimulacraComparator : public Comparator {
+ public:
+  // The comparisons run on `pool`, which must outlive the comparator.
+  explicit SsimulacraComparator(bool simple, ThreadPool* pool = nullptr)
+      : simple_(simple), pool_(pool) {}
+
+  Status SetReferenceImage(const ImageBundle& ref) override;
+
+  // The diffmap, if requested, is that of ComputeSsimulacra.
+  Status CompareWith(const ImageBundle& actual, ImageF* diffmap,
+                     float* score) override;
+
+  float GoodQualityScore() const override;
+  float BadQualityScore() const override;
+
+ private:
+  bool simple_;
+  ThreadPool* pool_;
+  Image3F reference_;
+};
+
+// Returns the SSIMULACRA score of the images, in any color space and
+// optionally with alpha. They must have at least 8x8 pixels.
+float SsimulacraDistance(const ImageBundle& orig, const ImageBundle& distorted,
+                         const JxlCmsInterface& cms, bool simple = false,
+                         ThreadPool* pool = nullptr);
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_ENC_SSIMULACRA_H_
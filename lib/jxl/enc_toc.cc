@@ -5,9 +5,11 @@
 
 #include "lib/jxl/enc_toc.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "lib/jxl/aux_out_fwd.h"
+#include "lib/jxl/base/span.h"
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/coeff_order_fwd.h"
 #include "lib/jxl/common.h"
@@ -17,14 +19,17 @@
 #include "lib/jxl/toc.h"
 
 namespace jxl {
-Status WriteGroupOffsets(const std::vector<BitWriter>& group_codes,
-                         const std::vector<coeff_order_t>* permutation,
-                         BitWriter* JXL_RESTRICT writer, AuxOut* aux_out) {
-  BitWriter::Allotment allotment(writer, MaxBits(group_codes.size()));
-  if (permutation && !group_codes.empty()) {
-    // Don't write a permutation at all for an empty group_codes.
+namespace {
+
+// `sizes` are the byte sizes of the sections in the order they are stored.
+Status WriteToc(const std::vector<size_t>& sizes,
+                const std::vector<coeff_order_t>* permutation,
+                BitWriter* JXL_RESTRICT writer, AuxOut* aux_out) {
+  BitWriter::Allotment allotment(writer, MaxBits(sizes.size()));
+  if (permutation && !sizes.empty()) {
+    // Don't write a permutation at all if there are no sections.
     writer->Write(1, 1);  // permutation
-    JXL_DASSERT(permutation->size() == group_codes.size());
+    JXL_DASSERT(permutation->size() == sizes.size());
     EncodePermutation(permutation->data(), /*skip=*/0, permutation->size(),
                       writer, /* layer= */ 0, aux_out);
 
@@ -33,9 +38,7 @@ Status WriteGroupOffsets(const std::vector<BitWriter>& group_codes,
   }
   writer->ZeroPadToByte();  // before TOC entries
 
-  for (size_t i = 0; i < group_codes.size(); i++) {
-    JXL_ASSERT(group_codes[i].BitsWritten() % kBitsPerByte == 0);
-    const size_t group_size = group_codes[i].BitsWritten() / kBitsPerByte;
+  for (size_t group_size : sizes) {
     JXL_RETURN_IF_ERROR(U32Coder::Write(kTocDist, group_size, writer));
   }
   writer->ZeroPadToByte();  // before first group
@@ -43,4 +46,42 @@ Status WriteGroupOffsets(const std::vector<BitWriter>& group_codes,
   return true;
 }
 
+}  // namespace
+
+Status WriteGroupOffsets(const std::vector<BitWriter>& group_codes,
+                         const std::vector<coeff_order_t>* permutation,
+                         BitWriter* JXL_RESTRICT writer, AuxOut* aux_out) {
+  std::vector<size_t> sizes(group_codes.size());
+  for (size_t i = 0; i < group_codes.size(); i++) {
+    JXL_ASSERT(group_codes[i].BitsWritten() % kBitsPerByte == 0);
+    sizes[i] = group_codes[i].BitsWritten() / kBitsPerByte;
+  }
+  return WriteToc(sizes, permutation, writer, aux_out);
+}
+
+Status WriteSectionsWithToc(const std::vector<PaddedBytes>& sections,
+                            const std::vector<coeff_order_t>* permutation,
+                            BitWriter* JXL_RESTRICT writer, AuxOut* aux_out) {
+  if (permutation && permutation->size() != sections.size()) {
+    return JXL_FAILURE("Invalid section permutation");
+  }
+  // Section i is stored at position permutation[i].
+  std::vector<const PaddedBytes*> stored(sections.size());
+  for (size_t i = 0; i < sections.size(); i++) {
+    const size_t pos = permutation ? (*permutation)[i] : i;
+    if (pos >= sections.size() || stored[pos] != nullptr) {
+      return JXL_FAILURE("Invalid section permutation");
+    }
+    stored[pos] = &sections[i];
+  }
+  std::vector<size_t> sizes(sections.size());
+  for (size_t i = 0; i < sections.size(); i++) sizes[i] = stored[i]->size();
+  JXL_RETURN_IF_ERROR(WriteToc(sizes, permutation, writer, aux_out));
+  for (const PaddedBytes* section : stored) {
+    writer->AppendByteAligned(Span<const uint8_t>(*section));
+  }
+  writer->ZeroPadToByte();  // end of frame.
+  return true;
+}
+
 }  // namespace jxl
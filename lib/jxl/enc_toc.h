@@ -13,6 +13,7 @@
 
 #include "lib/jxl/aux_out.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/padded_bytes.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_bit_writer.h"
 
@@ -24,6 +25,14 @@ Status WriteGroupOffsets(const std::vector<BitWriter>& group_codes,
                          const std::vector<coeff_order_t>* permutation,
                          BitWriter* JXL_RESTRICT writer, AuxOut* aux_out);
 
+// Writes the TOC of a frame followed by its sections, after the frame header
+// in `writer`. `sections` are in the order of their ids, and are stored in the
+// order given by `permutation` (see WriteGroupOffsets). This allows sections
+// that were encoded separately, e.g. by EncodeFrame, to be stitched together.
+Status WriteSectionsWithToc(const std::vector<PaddedBytes>& sections,
+                            const std::vector<coeff_order_t>* permutation,
+                            BitWriter* JXL_RESTRICT writer, AuxOut* aux_out);
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_ENC_TOC_H_
@@ -6,7 +6,9 @@
 #include "lib/jxl/enc_xyb.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
+#include <vector>
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/enc_xyb.cc"
@@ -21,8 +23,10 @@
 #include "lib/jxl/color_encoding_internal.h"
 #include "lib/jxl/color_management.h"
 #include "lib/jxl/enc_bit_writer.h"
+#include "lib/jxl/enc_color_management.h"
 #include "lib/jxl/enc_image_bundle.h"
 #include "lib/jxl/fields.h"
+#include "lib/jxl/gaborish.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/opsin_params.h"
@@ -159,6 +163,22 @@ V LinearFromSRGB(V encoded) {
   return TF_SRGB().DisplayFromEncoded(encoded);
 }
 
+// Pre-broadcasted constants for LinearRGBToXYB.
+void ComputePremulAbsorb(float intensity_target,
+                         float* JXL_RESTRICT premul_absorb) {
+  const HWY_FULL(float) d;
+  const size_t N = Lanes(d);
+  for (size_t i = 0; i < 9; ++i) {
+    const auto absorb =
+        Set(d, kOpsinAbsorbanceMatrix[i] * (intensity_target / 255.0f));
+    Store(absorb, d, premul_absorb + i * N);
+  }
+  for (size_t i = 0; i < 3; ++i) {
+    const auto neg_bias_cbrt = Set(d, -cbrtf(kOpsinAbsorbanceBias[i]));
+    Store(neg_bias_cbrt, d, premul_absorb + (9 + i) * N);
+  }
+}
+
 Status LinearSRGBToXYB(const Image3F& linear,
                        const float* JXL_RESTRICT premul_absorb,
                        ThreadPool* pool, Image3F* JXL_RESTRICT xyb) {
@@ -253,6 +273,85 @@ Status SRGBToXYBAndLinear(const Image3F& srgb,
       "SRGBToXYBAndLinear");
 }
 
+// Transforms each row to linear sRGB into a per-thread buffer and from there
+// to XYB, so that neither a copy of the input nor the linear image is stored.
+Status TransformToXYB(const ImageBundle& in,
+                      const ColorEncoding& c_linear_srgb,
+                      const float* JXL_RESTRICT premul_absorb,
+                      const JxlCmsInterface& cms, ThreadPool* pool,
+                      Image3F* JXL_RESTRICT xyb) {
+  const size_t xsize = in.xsize();
+  const bool is_gray = in.IsGray();
+  const Image3F& color = in.color();
+  ColorSpaceTransform c_transform(cms);
+  std::vector<Image3F> linear_rows;
+  std::atomic<bool> ok{true};
+
+  const HWY_FULL(float) d;
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, static_cast<uint32_t>(in.ysize()),
+      [&](const size_t num_threads) {
+        linear_rows.clear();
+        linear_rows.reserve(num_threads);
+        for (size_t i = 0; i < num_threads; i++) {
+          linear_rows.emplace_back(xsize, 1);
+        }
+        return c_transform.Init(in.c_current(), c_linear_srgb,
+                                in.metadata()->IntensityTarget(), xsize,
+                                num_threads);
+      },
+      [&](const uint32_t task, size_t thread) {
+        const size_t y = static_cast<size_t>(task);
+        const float* src_buf = color.ConstPlaneRow(0, y);
+        if (!is_gray) {
+          float* JXL_RESTRICT mutable_src_buf = c_transform.BufSrc(thread);
+          const float* JXL_RESTRICT row_in0 = color.ConstPlaneRow(0, y);
+          const float* JXL_RESTRICT row_in1 = color.ConstPlaneRow(1, y);
+          const float* JXL_RESTRICT row_in2 = color.ConstPlaneRow(2, y);
+          for (size_t x = 0; x < xsize; x++) {
+            mutable_src_buf[3 * x + 0] = row_in0[x];
+            mutable_src_buf[3 * x + 1] = row_in1[x];
+            mutable_src_buf[3 * x + 2] = row_in2[x];
+          }
+          src_buf = mutable_src_buf;
+        }
+        float* JXL_RESTRICT dst_buf = c_transform.BufDst(thread);
+        if (!c_transform.Run(thread, src_buf, dst_buf)) {
+          ok.store(false);
+          return;
+        }
+
+        float* JXL_RESTRICT row_linear0 = linear_rows[thread].PlaneRow(0, 0);
+        float* JXL_RESTRICT row_linear1 = linear_rows[thread].PlaneRow(1, 0);
+        float* JXL_RESTRICT row_linear2 = linear_rows[thread].PlaneRow(2, 0);
+        if (is_gray) {
+          for (size_t x = 0; x < xsize; x++) {
+            row_linear0[x] = row_linear1[x] = row_linear2[x] = dst_buf[x];
+          }
+        } else {
+          for (size_t x = 0; x < xsize; x++) {
+            row_linear0[x] = dst_buf[3 * x + 0];
+            row_linear1[x] = dst_buf[3 * x + 1];
+            row_linear2[x] = dst_buf[3 * x + 2];
+          }
+        }
+
+        float* JXL_RESTRICT row_xyb0 = xyb->PlaneRow(0, y);
+        float* JXL_RESTRICT row_xyb1 = xyb->PlaneRow(1, y);
+        float* JXL_RESTRICT row_xyb2 = xyb->PlaneRow(2, y);
+        for (size_t x = 0; x < xsize; x += Lanes(d)) {
+          const auto in_r = Load(d, row_linear0 + x);
+          const auto in_g = Load(d, row_linear1 + x);
+          const auto in_b = Load(d, row_linear2 + x);
+          LinearRGBToXYB(in_r, in_g, in_b, premul_absorb, row_xyb0 + x,
+                         row_xyb1 + x, row_xyb2 + x);
+        }
+      },
+      "TransformToXYB"));
+  if (!ok.load()) return JXL_FAILURE("Colorspace transform failed");
+  return true;
+}
+
 // This is different from Butteraugli's OpsinDynamicsImage() in the sense that
 // it does not contain a sensitivity multiplier based on the blurred image.
 const ImageBundle* ToXYB(const ImageBundle& in, ThreadPool* pool,
@@ -265,18 +364,8 @@ const ImageBundle* ToXYB(const ImageBundle& in, ThreadPool* pool,
   JXL_ASSERT(SameSize(in, *xyb));
 
   const HWY_FULL(float) d;
-  // Pre-broadcasted constants
   HWY_ALIGN float premul_absorb[MaxLanes(d) * 12];
-  const size_t N = Lanes(d);
-  for (size_t i = 0; i < 9; ++i) {
-    const auto absorb = Set(d, kOpsinAbsorbanceMatrix[i] *
-                                   (in.metadata()->IntensityTarget() / 255.0f));
-    Store(absorb, d, premul_absorb + i * N);
-  }
-  for (size_t i = 0; i < 3; ++i) {
-    const auto neg_bias_cbrt = Set(d, -cbrtf(kOpsinAbsorbanceBias[i]));
-    Store(neg_bias_cbrt, d, premul_absorb + (9 + i) * N);
-  }
+  ComputePremulAbsorb(in.metadata()->IntensityTarget(), premul_absorb);
 
   const bool want_linear = linear != nullptr;
 
@@ -309,7 +398,13 @@ const ImageBundle* ToXYB(const ImageBundle& in, ThreadPool* pool,
     return linear;
   }
 
-  // General case: not sRGB, need color transform.
+  // General case: not sRGB, need color transform. CMYK inputs also need the
+  // black channel, which TransformIfNeeded takes care of.
+  if (!want_linear && !in.HasBlack()) {
+    JXL_CHECK(TransformToXYB(in, c_linear_srgb, premul_absorb, cms, pool, xyb));
+    return &in;
+  }
+
   ImageBundle linear_storage;  // Local storage only used if !want_linear.
 
   ImageBundle* linear_storage_ptr;
@@ -334,6 +429,175 @@ const ImageBundle* ToXYB(const ImageBundle& in, ThreadPool* pool,
   return want_linear ? linear : &in;
 }
 
+// Weighted sum of 1x5 pixels around x with [wx2 wx1 wx0 wx1 wx2], mirrored at
+// the borders like Symmetric5.
+float GaborishSumBorder(const float* JXL_RESTRICT row, const int64_t x,
+                        const size_t xsize, const float wx0, const float wx1,
+                        const float wx2) {
+  const float sum_2 = wx2 * (row[Mirror(x - 2, xsize)] +
+                             row[Mirror(x + 2, xsize)]);
+  const float sum_1 = wx1 * (row[Mirror(x - 1, xsize)] +
+                             row[Mirror(x + 1, xsize)]);
+  const float sum_0 = wx0 * row[x];
+  return sum_2 + sum_1 + sum_0;
+}
+
+template <class V>
+V GaborishSum(const float* JXL_RESTRICT row, const size_t x, const V wx0,
+              const V wx1, const V wx2) {
+  const HWY_FULL(float) d;
+  const float* JXL_RESTRICT center = row + x;
+  const auto sum_2 = wx2 * (LoadU(d, center - 2) + LoadU(d, center + 2));
+  const auto sum_1 = wx1 * (LoadU(d, center - 1) + LoadU(d, center + 1));
+  const auto sum_0 = wx0 * Load(d, center);
+  return sum_2 + sum_1 + sum_0;
+}
+
+// Computes one output row of GaborishInverse from the five input rows around
+// it (already mirrored vertically), in the same order of operations as
+// Symmetric5.
+void GaborishRow(const float* JXL_RESTRICT rows[5], const size_t xsize,
+                 const WeightsSymmetric5& weights, float* JXL_RESTRICT out) {
+  const HWY_FULL(float) d;
+  const size_t N = Lanes(d);
+  const auto border = [&](const int64_t x) {
+    float sum0 = GaborishSumBorder(rows[2], x, xsize, weights.c[0],
+                                   weights.r[0], weights.R[0]);
+    sum0 += GaborishSumBorder(rows[0], x, xsize, weights.R[0], weights.L[0],
+                              weights.D[0]);
+    float sum1 = GaborishSumBorder(rows[4], x, xsize, weights.R[0],
+                                   weights.L[0], weights.D[0]);
+    sum0 += GaborishSumBorder(rows[1], x, xsize, weights.r[0], weights.d[0],
+                              weights.L[0]);
+    sum1 += GaborishSumBorder(rows[3], x, xsize, weights.r[0], weights.d[0],
+                              weights.L[0]);
+    return sum0 + sum1;
+  };
+  const auto w0 = LoadDup128(d, weights.c);
+  const auto w1 = LoadDup128(d, weights.r);
+  const auto w2 = LoadDup128(d, weights.R);
+  const auto w4 = LoadDup128(d, weights.d);
+  const auto w5 = LoadDup128(d, weights.L);
+  const auto w8 = LoadDup128(d, weights.D);
+
+  const size_t kRadius = 2;
+  size_t x = 0;
+  for (; x < std::min(RoundUpTo(kRadius, N), xsize); ++x) {
+    out[x] = border(x);
+  }
+  for (; x + N + kRadius <= xsize; x += N) {
+    auto sum0 = GaborishSum(rows[2], x, w0, w1, w2);
+    sum0 += GaborishSum(rows[0], x, w2, w5, w8);
+    auto sum1 = GaborishSum(rows[4], x, w2, w5, w8);
+    sum0 += GaborishSum(rows[1], x, w1, w4, w5);
+    sum1 += GaborishSum(rows[3], x, w1, w4, w5);
+    Store(sum0 + sum1, d, out + x);
+  }
+  for (; x < xsize; ++x) {
+    out[x] = border(x);
+  }
+}
+
+void ToXYBAndGaborishInverse(const ImageBundle& in, float mul,
+                             ThreadPool* pool, Image3F* JXL_RESTRICT xyb,
+                             const JxlCmsInterface& cms) {
+  PROFILER_FUNC;
+  JXL_ASSERT(SameSize(in, *xyb));
+
+  const ColorEncoding& c_linear_srgb = ColorEncoding::LinearSRGB(in.IsGray());
+  const bool is_linear = c_linear_srgb.SameColorEncoding(in.c_current());
+  if (!is_linear && !in.IsSRGB()) {
+    // The color transform needs its own per-thread buffers; the extra pass
+    // over the image is small compared to it.
+    (void)jxl::ToXYB(in, pool, xyb, cms, /*linear=*/nullptr);
+    PadImageToBlockMultipleInPlace(xyb);
+    GaborishInverse(xyb, mul, pool);
+    return;
+  }
+
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul_absorb[MaxLanes(d) * 12];
+  ComputePremulAbsorb(in.metadata()->IntensityTarget(), premul_absorb);
+  const WeightsSymmetric5 weights = GaborishInverseWeights(mul);
+
+  const Image3F& color = in.color();
+  const size_t xsize_orig = in.xsize();
+  const size_t ysize_orig = in.ysize();
+  const size_t xsize = RoundUpToBlockDim(xsize_orig);
+  const size_t ysize = RoundUpToBlockDim(ysize_orig);
+  xyb->ShrinkTo(xsize, ysize);
+
+  // Each strip of output rows converts the rows it needs, including two rows
+  // of context above and below, into a per-thread buffer and convolves them
+  // into the output. The context rows are converted twice, but the image is
+  // read and written only once.
+  constexpr size_t kStripRows = 32;
+  const size_t num_strips = DivCeil(ysize, kStripRows);
+  std::vector<Image3F> strips;
+
+  const auto convert_row = [&](const size_t y, float* JXL_RESTRICT row_xyb0,
+                               float* JXL_RESTRICT row_xyb1,
+                               float* JXL_RESTRICT row_xyb2) {
+    const float* JXL_RESTRICT row_in0 = color.ConstPlaneRow(0, y);
+    const float* JXL_RESTRICT row_in1 = color.ConstPlaneRow(1, y);
+    const float* JXL_RESTRICT row_in2 = color.ConstPlaneRow(2, y);
+    for (size_t x = 0; x < xsize_orig; x += Lanes(d)) {
+      auto in_r = Load(d, row_in0 + x);
+      auto in_g = Load(d, row_in1 + x);
+      auto in_b = Load(d, row_in2 + x);
+      if (!is_linear) {
+        in_r = LinearFromSRGB(in_r);
+        in_g = LinearFromSRGB(in_g);
+        in_b = LinearFromSRGB(in_b);
+      }
+      LinearRGBToXYB(in_r, in_g, in_b, premul_absorb, row_xyb0 + x,
+                     row_xyb1 + x, row_xyb2 + x);
+    }
+  };
+
+  JXL_CHECK(RunOnPool(
+      pool, 0, static_cast<uint32_t>(num_strips),
+      [&](const size_t num_threads) {
+        strips.clear();
+        strips.reserve(num_threads);
+        for (size_t i = 0; i < num_threads; i++) {
+          strips.emplace_back(xsize, kStripRows + 4);
+        }
+        return true;
+      },
+      [&](const uint32_t task, size_t thread) {
+        const int64_t y0 = static_cast<int64_t>(task) * kStripRows;
+        const int64_t y1 = std::min<int64_t>(y0 + kStripRows, ysize);
+        Image3F& strip = strips[thread];
+        // Row i of the strip holds row y0 - 2 + i of the padded XYB image.
+        for (int64_t y = y0 - 2; y < y1 + 2; y++) {
+          float* JXL_RESTRICT rows[3];
+          for (size_t c = 0; c < 3; c++) {
+            rows[c] = strip.PlaneRow(c, y - y0 + 2);
+          }
+          // Rows below the image are padded with its last row.
+          const size_t y_in =
+              std::min<size_t>(Mirror(y, ysize), ysize_orig - 1);
+          convert_row(y_in, rows[0], rows[1], rows[2]);
+          for (size_t c = 0; c < 3; c++) {
+            for (size_t x = xsize_orig; x < xsize; x++) {
+              rows[c][x] = rows[c][xsize_orig - 1];
+            }
+          }
+        }
+        for (int64_t y = y0; y < y1; y++) {
+          for (size_t c = 0; c < 3; c++) {
+            const float* JXL_RESTRICT rows[5];
+            for (size_t i = 0; i < 5; i++) {
+              rows[i] = strip.ConstPlaneRow(c, y - y0 + i);
+            }
+            GaborishRow(rows, xsize, weights, xyb->PlaneRow(c, y));
+          }
+        }
+      },
+      "ToXYBAndGaborishInverse"));
+}
+
 // Transform RGB to YCbCr.
 // Could be performed in-place (i.e. Y, Cb and Cr could alias R, B and B).
 Status RgbToYcbcr(const ImageF& r_plane, const ImageF& g_plane,
@@ -409,6 +673,14 @@ const ImageBundle* ToXYB(const ImageBundle& in, ThreadPool* pool,
   return HWY_DYNAMIC_DISPATCH(ToXYB)(in, pool, xyb, cms, linear_storage);
 }
 
+HWY_EXPORT(ToXYBAndGaborishInverse);
+void ToXYBAndGaborishInverse(const ImageBundle& in, float mul,
+                             ThreadPool* pool, Image3F* JXL_RESTRICT xyb,
+                             const JxlCmsInterface& cms) {
+  return HWY_DYNAMIC_DISPATCH(ToXYBAndGaborishInverse)(in, mul, pool, xyb,
+                                                      cms);
+}
+
 HWY_EXPORT(RgbToYcbcr);
 Status RgbToYcbcr(const ImageF& r_plane, const ImageF& g_plane,
                   const ImageF& b_plane, ImageF* y_plane, ImageF* cb_plane,
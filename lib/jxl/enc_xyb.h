@@ -27,6 +27,14 @@ const ImageBundle* ToXYB(const ImageBundle& in, ThreadPool* pool,
                          Image3F* JXL_RESTRICT xyb, const JxlCmsInterface& cms,
                          ImageBundle* JXL_RESTRICT linear = nullptr);
 
+// Same as ToXYB without `linear`, followed by PadImageToBlockMultipleInPlace
+// and GaborishInverse with `mul`, but for sRGB and linear sRGB inputs without
+// an intermediate pass over the whole image. `xyb` must have been allocated
+// with the padded size and shrunk to the size of `in`.
+void ToXYBAndGaborishInverse(const ImageBundle& in, float mul,
+                             ThreadPool* pool, Image3F* JXL_RESTRICT xyb,
+                             const JxlCmsInterface& cms);
+
 // Bt.601 to match JPEG/JFIF. Outputs _signed_ YCbCr values suitable for DCT,
 // see F.1.1.3 of T.81 (because our data type is float, there is no need to add
 // a bias to make the values unsigned).
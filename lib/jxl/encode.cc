@@ -10,16 +10,23 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstring>
+#include <functional>
+#include <memory>
 
 #include "jxl/codestream_header.h"
 #include "jxl/types.h"
 #include "lib/jxl/aux_out.h"
+#include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/cache_aligned.h"
+#include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/codec_in_out.h"
 #include "lib/jxl/enc_color_management.h"
 #include "lib/jxl/enc_external_image.h"
+#include "lib/jxl/enc_fast_lossless.h"
 #include "lib/jxl/enc_file.h"
 #include "lib/jxl/enc_icc_codec.h"
+#include "lib/jxl/enc_modular.h"
 #include "lib/jxl/encode_internal.h"
 #include "lib/jxl/jpeg/enc_jpeg_data.h"
 #include "lib/jxl/sanitizers.h"
@@ -53,9 +60,145 @@ void AppendJxlpBoxCounter(uint32_t counter, bool last, T* output) {
   }
 }
 
-void QueueFrame(
+// Appends value as the variable length integer of the frame index box: 7 bits
+// per byte starting with the lowest ones, the high bit is set if more follow.
+void AppendFrameIndexVarint(uint64_t value, jxl::PaddedBytes* output) {
+  while (value >= 0x80) {
+    output->push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  output->push_back(value);
+}
+
+// Appends the frame index box ("jxli") of the frames to be indexed, where a
+// tick lasts tick_num / tick_den seconds. An indexed frame is left out if a
+// later frame is blended onto a reference slot that was saved before it, since
+// decoding can't start there.
+void AppendFrameIndexBox(const jxl::JxlEncoderFrameIndexBox& index,
+                         uint32_t tick_num, uint32_t tick_den,
+                         jxl::PaddedBytes* output) {
+  const std::vector<jxl::JxlEncoderFrameIndexBox::Entry>& entries =
+      index.entries;
+  const size_t num_frames = entries.size();
+  // Differences of the number of references to earlier slots that span each
+  // frame, a reference of frame j to a slot saved by frame p spans (p, j].
+  std::vector<int64_t> num_spanning_delta(num_frames + 1, 0);
+  size_t last_saved[4] = {};
+  bool saved[4] = {};
+  for (size_t j = 0; j < num_frames; j++) {
+    for (size_t slot = 0; slot < 4; slot++) {
+      if ((entries[j].references & (1 << slot)) && saved[slot]) {
+        num_spanning_delta[last_saved[slot] + 1]++;
+        num_spanning_delta[j + 1]--;
+      }
+    }
+    for (size_t slot = 0; slot < 4; slot++) {
+      if (entries[j].saved_as & (1 << slot)) {
+        saved[slot] = true;
+        last_saved[slot] = j;
+      }
+    }
+  }
+  std::vector<size_t> indexed;
+  int64_t num_spanning = 0;
+  for (size_t i = 0; i < num_frames; i++) {
+    num_spanning += num_spanning_delta[i];
+    if (entries[i].to_be_indexed && num_spanning == 0) indexed.push_back(i);
+  }
+
+  jxl::PaddedBytes contents;
+  AppendFrameIndexVarint(indexed.size(), &contents);
+  AppendJxlpBoxCounter(tick_num, /*last=*/false, &contents);
+  AppendJxlpBoxCounter(tick_den, /*last=*/false, &contents);
+  for (size_t m = 0; m < indexed.size(); m++) {
+    const size_t begin = indexed[m];
+    const size_t end = m + 1 < indexed.size() ? indexed[m + 1] : num_frames;
+    uint64_t ticks = 0;
+    uint64_t num_displayed = 0;
+    for (size_t j = begin; j < end; j++) {
+      ticks += entries[j].duration;
+      // Frames without duration are displayed together with the next one.
+      if (entries[j].duration != 0 || j + 1 == num_frames) num_displayed++;
+    }
+    const uint64_t previous =
+        m == 0 ? 0 : entries[indexed[m - 1]].codestream_offset;
+    AppendFrameIndexVarint(entries[begin].codestream_offset - previous,
+                           &contents);
+    AppendFrameIndexVarint(ticks, &contents);
+    AppendFrameIndexVarint(num_displayed, &contents);
+  }
+  jxl::AppendBoxHeader(jxl::MakeBoxType("jxli"), contents.size(),
+                       /*unbounded=*/false, output);
+  output->append(contents);
+}
+
+// Bit mask of the reference slots that a frame with the given header and
+// extra channel blending is blended onto, as in FrameDecoder::References.
+uint8_t FrameReferences(const JxlFrameHeader& header,
+                        const std::vector<JxlBlendInfo>& ec_blend_info,
+                        int64_t xsize, int64_t ysize) {
+  const JxlLayerInfo& layer_info = header.layer_info;
+  uint8_t references = 0;
+  // A cropped frame leaves the rest of the image to its blending source.
+  const bool full_frame =
+      !layer_info.have_crop ||
+      (layer_info.crop_x0 <= 0 && layer_info.crop_y0 <= 0 &&
+       layer_info.crop_x0 + static_cast<int64_t>(layer_info.xsize) >= xsize &&
+       layer_info.crop_y0 + static_cast<int64_t>(layer_info.ysize) >= ysize);
+  if (layer_info.blend_info.blendmode != JXL_BLEND_REPLACE || !full_frame) {
+    references |= 1 << layer_info.blend_info.source;
+  }
+  for (const JxlBlendInfo& info : ec_blend_info) {
+    if (info.blendmode != JXL_BLEND_REPLACE) references |= 1 << info.source;
+  }
+  return references;
+}
+
+// Memory manager for the image buffers allocated while encoding, or nullptr
+// for the default allocator.
+const JxlMemoryManager* BufferMemoryManager(const JxlEncoder* enc) {
+  if (enc->use_buffer_pool) return enc->buffer_pool->memory_manager();
+  return jxl::MemoryManagerForBuffers(&enc->memory_manager);
+}
+
+JxlEncoderStatus QueueFrame(
     const JxlEncoderFrameSettings* frame_settings,
     jxl::MemoryManagerUniquePtr<jxl::JxlEncoderQueuedFrame>& frame) {
+  JxlEncoder* enc = frame_settings->enc;
+  if (enc->memory_stats.limit_exceeded.load(std::memory_order_relaxed)) {
+    return JXL_API_ERROR("memory limit exceeded");
+  }
+  const jxl::JxlEncoderFrameSettingsValues& values = frame->option_values;
+  jxl::JxlEncoderFrameIndexBox::Entry entry;
+  entry.to_be_indexed = values.frame_index_box;
+  entry.duration =
+      enc->metadata.m.have_animation ? values.header.duration : 0;
+  entry.references =
+      FrameReferences(values.header, values.extra_channel_blend_info,
+                      enc->metadata.size.xsize(), enc->metadata.size.ysize());
+  // Frames without duration are saved to slot 0 for the next frames to be
+  // blended onto, see FrameHeader::CanBeReferenced.
+  const uint32_t save_as_reference = values.header.layer_info.save_as_reference;
+  entry.saved_as = (entry.duration == 0 || save_as_reference != 0)
+                       ? 1 << save_as_reference
+                       : 0;
+  entry.codestream_offset = 0;
+  std::vector<jxl::JxlEncoderFrameIndexBox::Entry>& entries =
+      enc->frame_index_box.entries;
+  if (entry.to_be_indexed) {
+    if (!entries.empty() && !entries[0].to_be_indexed) {
+      return JXL_API_ERROR(
+          "the first frame must be indexed to index later frames");
+    }
+    // The frame must not depend on earlier frames and must start a new
+    // displayed frame.
+    if (entry.references != 0 ||
+        (!entries.empty() && entries.back().duration == 0)) {
+      return JXL_API_ERROR("only keyframes can be indexed");
+    }
+  }
+  entries.push_back(entry);
+
   if (frame_settings->values.lossless) {
     frame->option_values.cparams.SetLossless();
   }
@@ -64,6 +207,7 @@ void QueueFrame(
   queued_input.frame = std::move(frame);
   frame_settings->enc->input_queue.emplace_back(std::move(queued_input));
   frame_settings->enc->num_queued_frames++;
+  return JXL_ENC_SUCCESS;
 }
 
 void QueueBox(JxlEncoder* enc,
@@ -74,6 +218,303 @@ void QueueBox(JxlEncoder* enc,
   enc->num_queued_boxes++;
 }
 
+// Fills in the pixels of a frame added with
+// JxlEncoderAddImageFrameFromRowSource, one group row at a time, so that only a
+// single strip of input pixels needs to exist at any time.
+JxlEncoderStatus PullRowSource(jxl::JxlEncoderQueuedFrame* frame,
+                               jxl::ThreadPool* pool) {
+  const JxlPixelFormat& format = frame->row_source_format;
+  const size_t xsize = frame->frame.xsize();
+  const size_t ysize = frame->frame.ysize();
+  const size_t stride = jxl::ExternalRowStride(format, xsize);
+  const size_t strip_rows = std::min(jxl::kGroupDim, ysize);
+  std::vector<uint8_t> strip(stride * strip_rows);
+  for (size_t y0 = 0; y0 < ysize; y0 += strip_rows) {
+    const size_t num_rows = std::min(strip_rows, ysize - y0);
+    const size_t size = stride * num_rows;
+    if (!frame->row_source(frame->row_source_opaque, y0, num_rows,
+                           strip.data(), size)) {
+      return JXL_API_ERROR("row source callback failed at row %" PRIuS, y0);
+    }
+    if (!jxl::BufferToImageBundleRows(format, y0, num_rows, strip.data(), size,
+                                      pool, &frame->frame)) {
+      return JXL_ENC_ERROR;
+    }
+  }
+  frame->row_source = nullptr;
+  frame->frame.VerifyMetadata();
+  return JXL_ENC_SUCCESS;
+}
+
+// Whether a frame added with these settings and pixel format can be encoded
+// with the fast lossless encoder instead of EncodeFrame, which is the case for
+// lossless frames at effort 1 that only use what its fixed frame header
+// supports.
+bool CanUseFastLossless(const JxlEncoderFrameSettings* frame_settings,
+                        const JxlPixelFormat& pixel_format) {
+  const jxl::JxlEncoderFrameSettingsValues& values = frame_settings->values;
+  const jxl::CompressParams& cparams = values.cparams;
+  const jxl::ImageMetadata& metadata = frame_settings->enc->metadata.m;
+  if (!values.lossless || cparams.speed_tier != jxl::SpeedTier::kLightning) {
+    return false;
+  }
+  if (metadata.xyb_encoded || metadata.have_animation ||
+      metadata.bit_depth.floating_point_sample ||
+      metadata.bit_depth.bits_per_sample > 12) {
+    return false;
+  }
+  if (pixel_format.data_type != JXL_TYPE_UINT16 &&
+      (pixel_format.data_type != JXL_TYPE_UINT8 ||
+       metadata.bit_depth.bits_per_sample != 8)) {
+    return false;
+  }
+  const bool has_interleaved_alpha =
+      pixel_format.num_channels == 2 || pixel_format.num_channels == 4;
+  if ((pixel_format.num_channels < 3) != metadata.color_encoding.IsGray() ||
+      metadata.num_extra_channels != (has_interleaved_alpha ? 1u : 0u)) {
+    return false;
+  }
+  if (has_interleaved_alpha) {
+    const jxl::ExtraChannelInfo& alpha = metadata.extra_channel_info[0];
+    if (alpha.type != jxl::ExtraChannel::kAlpha || alpha.dim_shift != 0 ||
+        alpha.bit_depth.floating_point_sample ||
+        alpha.bit_depth.bits_per_sample != metadata.bit_depth.bits_per_sample) {
+      return false;
+    }
+  }
+  const JxlLayerInfo& layer_info = values.header.layer_info;
+  if (layer_info.have_crop || layer_info.save_as_reference != 0 ||
+      layer_info.blend_info.blendmode != JXL_BLEND_REPLACE ||
+      !values.frame_name.empty()) {
+    return false;
+  }
+  return cparams.resampling <= 1 && cparams.ec_resampling <= 1 &&
+         !cparams.already_downsampled && !cparams.progressive_mode &&
+         !cparams.qprogressive_mode && cparams.responsive <= 0 &&
+         cparams.modular_group_size_shift == 1;
+}
+
+void FastLosslessRunOnPool(void* runner_opaque, void* opaque,
+                           void fun(void*, size_t), size_t count) {
+  jxl::ThreadPool* pool = static_cast<jxl::ThreadPool*>(runner_opaque);
+  JXL_CHECK(jxl::RunOnPool(
+      pool, 0, count, jxl::ThreadPool::NoInit,
+      [&](const uint32_t i, size_t /* thread */) { fun(opaque, i); },
+      "FastLossless"));
+}
+
+// Encodes the input pixels stored in frame with the fast lossless encoder, as
+// a frame that is marked as the last one, and appends it to output.
+JxlEncoderStatus EncodeFastLossless(const jxl::JxlEncoderQueuedFrame& frame,
+                                    size_t bits_per_sample,
+                                    jxl::ThreadPool* pool,
+                                    jxl::PaddedBytes* output) {
+  const JxlPixelFormat& format = frame.fast_lossless_format;
+  const size_t xsize = frame.fast_lossless_xsize;
+  const size_t ysize = frame.fast_lossless_ysize;
+  const size_t num_channels = format.num_channels;
+  const uint8_t* pixels = frame.fast_lossless_input.data();
+  size_t stride = jxl::ExternalRowStride(format, xsize);
+  std::vector<uint8_t> rescaled;
+  if (format.data_type == JXL_TYPE_UINT16) {
+    // The fast lossless encoder takes samples with the image bit depth, as
+    // little endian 16-bit values if they don't fit in a byte.
+    const size_t bytes_per_sample = bits_per_sample <= 8 ? 1 : 2;
+    const uint32_t maxval = (1u << bits_per_sample) - 1;
+    const bool little_endian =
+        format.endianness == JXL_LITTLE_ENDIAN ||
+        (format.endianness == JXL_NATIVE_ENDIAN && IsLittleEndian());
+    const size_t samples_per_row = xsize * num_channels;
+    rescaled.resize(samples_per_row * bytes_per_sample * ysize);
+    for (size_t y = 0; y < ysize; y++) {
+      const uint8_t* row_in = pixels + y * stride;
+      uint8_t* row_out =
+          rescaled.data() + y * samples_per_row * bytes_per_sample;
+      for (size_t i = 0; i < samples_per_row; i++) {
+        uint32_t value = little_endian ? LoadLE16(row_in + 2 * i)
+                                       : LoadBE16(row_in + 2 * i);
+        value = (value * maxval + 32767) / 65535;
+        if (bytes_per_sample == 1) {
+          row_out[i] = value;
+        } else {
+          StoreLE16(value, row_out + 2 * i);
+        }
+      }
+    }
+    pixels = rescaled.data();
+    stride = samples_per_row * bytes_per_sample;
+  }
+  unsigned char* encoded = nullptr;
+  size_t encoded_size = JxlFastLosslessEncode(
+      pixels, xsize, stride, ysize, num_channels, bits_per_sample,
+      /*effort=*/2, /*frame_only=*/true, &encoded, pool,
+      &FastLosslessRunOnPool);
+  if (encoded_size == 0) {
+    free(encoded);
+    return JXL_API_ERROR("Fast lossless encoding failed");
+  }
+  output->append(encoded, encoded + encoded_size);
+  free(encoded);
+  return JXL_ENC_SUCCESS;
+}
+
+// Encodes a queued frame with EncodeFrame, after copying its frame settings to
+// the image bundle and frame info that EncodeFrame takes them from. If
+// special_frames_done is set, the DC frame of a progressive frame is passed to
+// it as soon as it is encoded, and is not in frame_chunks. The frame is the
+// concatenation of frame_chunks, whose sections are not copied together.
+JxlEncoderStatus EncodeQueuedFrame(
+    JxlEncoder* enc, jxl::JxlEncoderQueuedFrame* frame, bool last_frame,
+    jxl::ThreadPool* pool,
+    const std::function<jxl::Status(jxl::PaddedBytes&&)>& special_frames_done,
+    std::vector<jxl::PaddedBytes>* frame_chunks) {
+  // TODO(zond): If the input queue is empty and the frames_closed is true,
+  // then mark this frame as the last.
+
+  // TODO(zond): Handle progressive mode like EncodeFile does it.
+  // TODO(zond): Handle animation like EncodeFile does it, by checking if
+  //             JxlEncoderCloseFrames has been called and if the frame queue
+  //             is empty (to see if it's the last animation frame).
+
+  if (enc->metadata.m.xyb_encoded) {
+    frame->option_values.cparams.color_transform = jxl::ColorTransform::kXYB;
+  } else {
+    // TODO(zond): Figure out when to use kYCbCr instead.
+    frame->option_values.cparams.color_transform = jxl::ColorTransform::kNone;
+  }
+
+  // EncodeFrame creates jxl::FrameHeader object internally based on the
+  // FrameInfo, imagebundle, cparams and metadata. Copy the information to
+  // these.
+  jxl::ImageBundle& ib = frame->frame;
+  ib.name = frame->option_values.frame_name;
+  if (enc->metadata.m.have_animation) {
+    ib.duration = frame->option_values.header.duration;
+    ib.timecode = frame->option_values.header.timecode;
+  } else {
+    // If have_animation is false, the encoder should ignore the duration and
+    // timecode values. However, assigning them to ib will cause the encoder
+    // to write an invalid frame header that can't be decoded so ensure
+    // they're the default value of 0 here.
+    ib.duration = 0;
+    ib.timecode = 0;
+  }
+  ib.blendmode = static_cast<jxl::BlendMode>(
+      frame->option_values.header.layer_info.blend_info.blendmode);
+  ib.blend = frame->option_values.header.layer_info.blend_info.blendmode !=
+             JXL_BLEND_REPLACE;
+
+  size_t save_as_reference =
+      frame->option_values.header.layer_info.save_as_reference;
+  ib.use_for_next_frame = !!save_as_reference;
+
+  jxl::FrameInfo frame_info;
+  frame_info.is_last = last_frame;
+  frame_info.save_as_reference = save_as_reference;
+  frame_info.source = frame->option_values.header.layer_info.blend_info.source;
+  frame_info.clamp = frame->option_values.header.layer_info.blend_info.clamp;
+  frame_info.alpha_channel =
+      frame->option_values.header.layer_info.blend_info.alpha;
+  frame_info.extra_channel_blending_info.resize(
+      enc->metadata.m.num_extra_channels);
+  // If extra channel blend info has not been set, use the blend mode from the
+  // layer_info.
+  JxlBlendInfo default_blend_info =
+      frame->option_values.header.layer_info.blend_info;
+  for (size_t i = 0; i < enc->metadata.m.num_extra_channels; ++i) {
+    auto& to = frame_info.extra_channel_blending_info[i];
+    const auto& from = i < frame->option_values.extra_channel_blend_info.size()
+                           ? frame->option_values.extra_channel_blend_info[i]
+                           : default_blend_info;
+    to.mode = static_cast<jxl::BlendMode>(from.blendmode);
+    to.source = from.source;
+    to.alpha_channel = from.alpha;
+    to.clamp = (from.clamp != 0);
+  }
+
+  if (frame->option_values.header.layer_info.have_crop) {
+    ib.origin.x0 = frame->option_values.header.layer_info.crop_x0;
+    ib.origin.y0 = frame->option_values.header.layer_info.crop_y0;
+  }
+  jxl::BitWriter writer;
+  jxl::PassesEncoderState enc_state;
+  enc_state.counters = &enc->counters;
+  enc_state.progress = &enc->progress;
+  enc_state.special_frames_done = special_frames_done;
+  std::vector<jxl::PaddedBytes> sections;
+  if (!jxl::EncodeFrame(frame->option_values.cparams, frame_info,
+                        &enc->metadata, frame->frame, &enc_state, enc->cms,
+                        pool, &writer, /*aux_out=*/nullptr, &sections)) {
+    return JXL_ENC_ERROR;
+  }
+  frame_chunks->clear();
+  frame_chunks->emplace_back(std::move(writer).TakeBytes());
+  for (jxl::PaddedBytes& section : sections) {
+    frame_chunks->emplace_back(std::move(section));
+  }
+  return JXL_ENC_SUCCESS;
+}
+
+// Whether a queued frame can be encoded before the frames queued ahead of it:
+// it is not blended onto earlier frames nor saved for later frames to use, and
+// its pixels are all there.
+bool CanEncodeAhead(const JxlEncoder* enc,
+                    const jxl::JxlEncoderQueuedFrame& frame) {
+  const jxl::JxlEncoderFrameSettingsValues& values = frame.option_values;
+  if (values.header.layer_info.save_as_reference != 0 ||
+      FrameReferences(values.header, values.extra_channel_blend_info,
+                      enc->metadata.size.xsize(),
+                      enc->metadata.size.ysize()) != 0) {
+    return false;
+  }
+  if (frame.row_source || !frame.fast_lossless_input.empty() ||
+      frame.frame.IsJPEG()) {
+    return false;
+  }
+  for (uint8_t initialized : frame.ec_initialized) {
+    if (!initialized) return false;
+  }
+  return true;
+}
+
+// Encodes the run of frames at the start of the input queue that can be
+// encoded ahead, one frame per thread of the pool, so that animations of many
+// small frames keep all threads busy. The frames are still output in order by
+// RefillOutputByteQueue. Frames that fail here are encoded again there, which
+// reports the error.
+void EncodeFramesAhead(JxlEncoder* enc) {
+  std::vector<jxl::JxlEncoderQueuedFrame*> frames;
+  for (jxl::JxlEncoderQueuedInput& input : enc->input_queue) {
+    // Boxes are output in order anyway, so they don't end the run.
+    if (!input.frame) continue;
+    // Until the frames are closed, the frame queued last may turn out to be
+    // the last frame, which is marked in its header.
+    if (frames.size() + 1 == enc->num_queued_frames && !enc->frames_closed) {
+      break;
+    }
+    if (input.frame->encoded || !CanEncodeAhead(enc, *input.frame)) break;
+    frames.push_back(input.frame.get());
+  }
+  if (frames.size() < 2) return;
+  const size_t num_queued_frames = enc->num_queued_frames;
+  const auto encode_frame = [&](const uint32_t i, size_t /* thread */) {
+    jxl::JxlEncoderQueuedFrame* frame = frames[i];
+    const bool last_frame = i + 1 == num_queued_frames;
+    // Each frame is encoded single-threaded, the pool is busy with the others.
+    frame->encoded =
+        EncodeQueuedFrame(enc, frame, last_frame, /*pool=*/nullptr,
+                          /*special_frames_done=*/nullptr,
+                          &frame->encoded_chunks) == JXL_ENC_SUCCESS;
+    if (frame->encoded) {
+      // Frees the pixels, only the encoded frame is needed from now on.
+      frame->frame = jxl::ImageBundle(&enc->metadata.m);
+    }
+  };
+  (void)jxl::RunOnPool(enc->thread_pool.get(), 0, frames.size(),
+                       jxl::ThreadPool::NoInit, encode_frame,
+                       "EncodeFramesAhead");
+}
+
 // TODO(lode): share this code and the Brotli compression code in enc_jpeg_data
 JxlEncoderStatus BrotliCompress(int quality, const uint8_t* in, size_t in_size,
                                 jxl::PaddedBytes* out) {
@@ -261,17 +702,36 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
     bytes = std::move(writer).TakeBytes();
 
     if (MustUseContainer()) {
+      jxl::PaddedBytes header;
       // Add "JXL " and ftyp box.
-      output_byte_queue.insert(
-          output_byte_queue.end(), jxl::kContainerHeader,
-          jxl::kContainerHeader + sizeof(jxl::kContainerHeader));
+      header.append(jxl::kContainerHeader,
+                    jxl::kContainerHeader + sizeof(jxl::kContainerHeader));
       if (codestream_level != 5) {
         // Add jxll box directly after the ftyp box to indicate the codestream
         // level.
-        output_byte_queue.insert(
-            output_byte_queue.end(), jxl::kLevelBoxHeader,
-            jxl::kLevelBoxHeader + sizeof(jxl::kLevelBoxHeader));
-        output_byte_queue.push_back(codestream_level);
+        header.append(jxl::kLevelBoxHeader,
+                      jxl::kLevelBoxHeader + sizeof(jxl::kLevelBoxHeader));
+        header.push_back(codestream_level);
+      }
+      if (frame_index_box.IsUsed()) {
+        // The frame index box comes right after these boxes, hold back the
+        // rest of the output until it is known after the last frame.
+        QueueOutputChunk(std::move(header));
+        if (output_callback && output_patch_callback && frames_closed) {
+          // Unless its space can be reserved: only the codestream offsets of
+          // the frames, 0 here, are not known yet. They take at most 10 bytes
+          // each instead of 1, and 8 more bytes leave room for a free box.
+          jxl::PaddedBytes index_box;
+          AppendFrameIndexBox(frame_index_box,
+                              metadata.m.animation.tps_denominator,
+                              metadata.m.animation.tps_numerator, &index_box);
+          frame_index_box_reserved =
+              index_box.size() + 9 * frame_index_box.entries.size() + 8;
+          frame_index_box_position = output_callback_position;
+          QueueOutputChunk(jxl::PaddedBytes(frame_index_box_reserved, 0));
+        } else {
+          hold_output = true;
+        }
       }
 
       // Whether to write the basic info and color profile header of the
@@ -284,20 +744,19 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
 
       if (partial_header) {
         jxl::AppendBoxHeader(jxl::MakeBoxType("jxlp"), bytes.size() + 4,
-                             /*unbounded=*/false, &output_byte_queue);
-        AppendJxlpBoxCounter(jxlp_counter++, /*last=*/false,
-                             &output_byte_queue);
-        output_byte_queue.insert(output_byte_queue.end(), bytes.data(),
-                                 bytes.data() + bytes.size());
-        bytes.clear();
+                             /*unbounded=*/false, &header);
+        AppendJxlpBoxCounter(jxlp_counter++, /*last=*/false, &header);
+        QueueOutputChunk(std::move(header));
+        // This leaves bytes empty for the frame bytes.
+        QueueOutputChunk(std::move(bytes));
       }
 
       if (store_jpeg_metadata && !jpeg_metadata.empty()) {
         jxl::AppendBoxHeader(jxl::MakeBoxType("jbrd"), jpeg_metadata.size(),
-                             false, &output_byte_queue);
-        output_byte_queue.insert(output_byte_queue.end(), jpeg_metadata.begin(),
-                                 jpeg_metadata.end());
+                             false, &header);
+        header.append(jpeg_metadata);
       }
+      QueueOutputChunk(std::move(header));
     }
     wrote_bytes = true;
   }
@@ -305,6 +764,7 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
   // Choose frame or box processing: exactly one of the two unique pointers (box
   // or frame) in the input queue item is non-null.
   if (input.frame) {
+    if (thread_pool && !input.frame->encoded) EncodeFramesAhead(this);
     jxl::MemoryManagerUniquePtr<jxl::JxlEncoderQueuedFrame> input_frame =
         std::move(input.frame);
     input_queue.erase(input_queue.begin());
@@ -314,117 +774,106 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
         return JXL_API_ERROR("Extra channel %u is not initialized", idx);
       }
     }
-
-    // TODO(zond): If the input queue is empty and the frames_closed is true,
-    // then mark this frame as the last.
-
-    // TODO(zond): Handle progressive mode like EncodeFile does it.
-    // TODO(zond): Handle animation like EncodeFile does it, by checking if
-    //             JxlEncoderCloseFrames has been called and if the frame queue
-    //             is empty (to see if it's the last animation frame).
-
-    if (metadata.m.xyb_encoded) {
-      input_frame->option_values.cparams.color_transform =
-          jxl::ColorTransform::kXYB;
-    } else {
-      // TODO(zond): Figure out when to use kYCbCr instead.
-      input_frame->option_values.cparams.color_transform =
-          jxl::ColorTransform::kNone;
+    if (input_frame->row_source &&
+        PullRowSource(input_frame.get(), thread_pool.get()) !=
+            JXL_ENC_SUCCESS) {
+      return JXL_API_ERROR("Failed to get pixels from the row source");
     }
-
-    jxl::BitWriter writer;
-    jxl::PassesEncoderState enc_state;
-
-    // EncodeFrame creates jxl::FrameHeader object internally based on the
-    // FrameInfo, imagebundle, cparams and metadata. Copy the information to
-    // these.
-    jxl::ImageBundle& ib = input_frame->frame;
-    ib.name = input_frame->option_values.frame_name;
-    if (metadata.m.have_animation) {
-      ib.duration = input_frame->option_values.header.duration;
-      ib.timecode = input_frame->option_values.header.timecode;
-    } else {
-      // If have_animation is false, the encoder should ignore the duration and
-      // timecode values. However, assigning them to ib will cause the encoder
-      // to write an invalid frame header that can't be decoded so ensure
-      // they're the default value of 0 here.
-      ib.duration = 0;
-      ib.timecode = 0;
-    }
-    ib.blendmode = static_cast<jxl::BlendMode>(
-        input_frame->option_values.header.layer_info.blend_info.blendmode);
-    ib.blend =
-        input_frame->option_values.header.layer_info.blend_info.blendmode !=
-        JXL_BLEND_REPLACE;
-
-    size_t save_as_reference =
-        input_frame->option_values.header.layer_info.save_as_reference;
-    ib.use_for_next_frame = !!save_as_reference;
-
-    jxl::FrameInfo frame_info;
     bool last_frame = frames_closed && !num_queued_frames;
-    frame_info.is_last = last_frame;
-    frame_info.save_as_reference = save_as_reference;
-    frame_info.source =
-        input_frame->option_values.header.layer_info.blend_info.source;
-    frame_info.clamp =
-        input_frame->option_values.header.layer_info.blend_info.clamp;
-    frame_info.alpha_channel =
-        input_frame->option_values.header.layer_info.blend_info.alpha;
-    frame_info.extra_channel_blending_info.resize(
-        metadata.m.num_extra_channels);
-    // If extra channel blend info has not been set, use the blend mode from the
-    // layer_info.
-    JxlBlendInfo default_blend_info =
-        input_frame->option_values.header.layer_info.blend_info;
-    for (size_t i = 0; i < metadata.m.num_extra_channels; ++i) {
-      auto& to = frame_info.extra_channel_blending_info[i];
-      const auto& from =
-          i < input_frame->option_values.extra_channel_blend_info.size()
-              ? input_frame->option_values.extra_channel_blend_info[i]
-              : default_blend_info;
-      to.mode = static_cast<jxl::BlendMode>(from.blendmode);
-      to.source = from.source;
-      to.alpha_channel = from.alpha;
-      to.clamp = (from.clamp != 0);
+    // The fast lossless encoder always marks its frame as the last one, so
+    // other frames that qualified for it go through EncodeFrame after all.
+    const bool use_fast_lossless =
+        !input_frame->fast_lossless_input.empty() && last_frame;
+    if (!input_frame->fast_lossless_input.empty() && !use_fast_lossless) {
+      const std::vector<uint8_t>& input = input_frame->fast_lossless_input;
+      if (!jxl::BufferToImageBundle(
+              input_frame->fast_lossless_format,
+              input_frame->fast_lossless_xsize,
+              input_frame->fast_lossless_ysize, input.data(), input.size(),
+              thread_pool.get(), input_frame->fast_lossless_color_encoding,
+              &input_frame->frame)) {
+        return JXL_API_ERROR("Failed to convert the input pixels");
+      }
+      input_frame->fast_lossless_input.clear();
     }
 
-    if (input_frame->option_values.header.layer_info.have_crop) {
-      ib.origin.x0 = input_frame->option_values.header.layer_info.crop_x0;
-      ib.origin.y0 = input_frame->option_values.header.layer_info.crop_y0;
+    std::vector<jxl::PaddedBytes> frame_chunks;
+    // With an output callback, the DC frame of a progressive frame is output
+    // while the AC of the frame is encoded, after the codestream header that
+    // may still be in bytes. Not when holding the output, the receiver would
+    // not get it any earlier.
+    size_t special_frames_size = 0;
+    std::function<jxl::Status(jxl::PaddedBytes&&)> special_frames_done;
+    if (output_callback && !hold_output) {
+      special_frames_done = [&](jxl::PaddedBytes&& special_frames) {
+        special_frames_size = special_frames.size();
+        bytes.append(special_frames);
+        QueueCodestreamBytes(std::move(bytes), /*last=*/false);
+        bytes.clear();
+        return true;
+      };
     }
-    JXL_ASSERT(writer.BitsWritten() == 0);
-    if (!jxl::EncodeFrame(input_frame->option_values.cparams, frame_info,
-                          &metadata, input_frame->frame, &enc_state, cms,
-                          thread_pool.get(), &writer,
-                          /*aux_out=*/nullptr)) {
+    if (input_frame->encoded) {
+      frame_chunks = std::move(input_frame->encoded_chunks);
+    } else if (use_fast_lossless) {
+      jxl::ScopedPhaseTimer timer(
+          counters.Timer(jxl::EncoderCounters::kModular));
+      frame_chunks.resize(1);
+      if (EncodeFastLossless(*input_frame, metadata.m.bit_depth.bits_per_sample,
+                             thread_pool.get(),
+                             &frame_chunks[0]) != JXL_ENC_SUCCESS) {
+        return JXL_API_ERROR("Failed to encode frame");
+      }
+    } else if (EncodeQueuedFrame(this, input_frame.get(), last_frame,
+                                 thread_pool.get(), special_frames_done,
+                                 &frame_chunks) != JXL_ENC_SUCCESS) {
       return JXL_API_ERROR("Failed to encode frame");
     }
+    size_t encoded_size = special_frames_size;
+    for (const jxl::PaddedBytes& chunk : frame_chunks) {
+      encoded_size += chunk.size();
+    }
+    counters.frames++;
+    counters.bytes += encoded_size;
     codestream_bytes_written_beginning_of_frame =
         codestream_bytes_written_end_of_frame;
-    codestream_bytes_written_end_of_frame +=
-        jxl::DivCeil(writer.BitsWritten(), 8);
+    codestream_bytes_written_end_of_frame += encoded_size;
+    if (frame_index_box.num_encoded < frame_index_box.entries.size()) {
+      frame_index_box.entries[frame_index_box.num_encoded++]
+          .codestream_offset = codestream_bytes_written_beginning_of_frame;
+    }
 
     // Possibly bytes already contains the codestream header: in case this is
     // the first frame, and the codestream header was not encoded as jxlp above.
-    bytes.append(std::move(writer).TakeBytes());
-    if (MustUseContainer()) {
-      if (last_frame && jxlp_counter == 0) {
-        // If this is the last frame and no jxlp boxes were used yet, it's
-        // slighly more efficient to write a jxlc box since it has 4 bytes less
-        // overhead.
-        jxl::AppendBoxHeader(jxl::MakeBoxType("jxlc"), bytes.size(),
-                             /*unbounded=*/false, &output_byte_queue);
+    frame_chunks.insert(frame_chunks.begin(), std::move(bytes));
+    bytes.clear();
+    QueueCodestreamChunks(std::move(frame_chunks), last_frame);
+
+    if (last_frame && frame_index_box.IsUsed()) {
+      jxl::PaddedBytes index_box;
+      AppendFrameIndexBox(frame_index_box,
+                          metadata.m.animation.tps_denominator,
+                          metadata.m.animation.tps_numerator, &index_box);
+      if (frame_index_box_reserved != 0) {
+        JXL_ASSERT(index_box.size() + 8 <= frame_index_box_reserved);
+        jxl::AppendBoxHeader(
+            jxl::MakeBoxType("free"),
+            frame_index_box_reserved - index_box.size() - 8,
+            /*unbounded=*/false, &index_box);
+        index_box.resize(frame_index_box_reserved, 0);
+        output_patch_callback(output_patch_callback_opaque,
+                              frame_index_box_position, index_box.data(),
+                              index_box.size());
       } else {
-        jxl::AppendBoxHeader(jxl::MakeBoxType("jxlp"), bytes.size() + 4,
-                             /*unbounded=*/false, &output_byte_queue);
-        AppendJxlpBoxCounter(jxlp_counter++, last_frame, &output_byte_queue);
+        hold_output = false;
+        QueueOutputChunk(std::move(index_box));
+        for (jxl::PaddedBytes& chunk : held_output_chunks) {
+          QueueOutputChunk(std::move(chunk));
+        }
+        held_output_chunks.clear();
       }
     }
 
-    output_byte_queue.insert(output_byte_queue.end(), bytes.data(),
-                             bytes.data() + bytes.size());
-
     last_used_cparams = input_frame->option_values.cparams;
   } else {
     // Not a frame, so is a box instead
@@ -445,21 +894,57 @@ JxlEncoderStatus JxlEncoderStruct::RefillOutputByteQueue() {
                          &compressed)) {
         return JXL_API_ERROR("Brotli compression for brob box failed");
       }
+      jxl::PaddedBytes box_header;
       jxl::AppendBoxHeader(jxl::MakeBoxType("brob"), compressed.size(), false,
-                           &output_byte_queue);
-      output_byte_queue.insert(output_byte_queue.end(), compressed.data(),
-                               compressed.data() + compressed.size());
+                           &box_header);
+      QueueOutputChunk(std::move(box_header));
+      QueueOutputChunk(std::move(compressed));
     } else {
+      jxl::PaddedBytes box_header;
       jxl::AppendBoxHeader(box->type, box->contents.size(), false,
-                           &output_byte_queue);
-      output_byte_queue.insert(output_byte_queue.end(), box->contents.data(),
-                               box->contents.data() + box->contents.size());
+                           &box_header);
+      QueueOutputChunk(std::move(box_header));
+      QueueOutputChunk(std::move(box->contents));
     }
   }
 
+  if (memory_stats.limit_exceeded.load(std::memory_order_relaxed)) {
+    return JXL_API_ERROR("memory limit exceeded");
+  }
   return JXL_ENC_SUCCESS;
 }
 
+void JxlEncoderStruct::QueueCodestreamBytes(jxl::PaddedBytes&& bytes,
+                                            bool last) {
+  std::vector<jxl::PaddedBytes> chunks;
+  chunks.emplace_back(std::move(bytes));
+  QueueCodestreamChunks(std::move(chunks), last);
+}
+
+void JxlEncoderStruct::QueueCodestreamChunks(
+    std::vector<jxl::PaddedBytes>&& chunks, bool last) {
+  size_t size = 0;
+  for (const jxl::PaddedBytes& chunk : chunks) size += chunk.size();
+  if (MustUseContainer()) {
+    jxl::PaddedBytes box_header;
+    if (last && jxlp_counter == 0) {
+      // If this is the last frame and no jxlp boxes were used yet, it's
+      // slighly more efficient to write a jxlc box since it has 4 bytes less
+      // overhead.
+      jxl::AppendBoxHeader(jxl::MakeBoxType("jxlc"), size,
+                           /*unbounded=*/false, &box_header);
+    } else {
+      jxl::AppendBoxHeader(jxl::MakeBoxType("jxlp"), size + 4,
+                           /*unbounded=*/false, &box_header);
+      AppendJxlpBoxCounter(jxlp_counter++, last, &box_header);
+    }
+    QueueOutputChunk(std::move(box_header));
+  }
+  for (jxl::PaddedBytes& chunk : chunks) {
+    QueueOutputChunk(std::move(chunk));
+  }
+}
+
 JxlEncoderStatus JxlEncoderSetColorEncoding(JxlEncoder* enc,
                                             const JxlColorEncoding* color) {
   if (enc->color_encoding_set) {
@@ -724,6 +1209,7 @@ JxlEncoderFrameSettings* JxlEncoderFrameSettingsCreate(
     opts->values = source->values;
   } else {
     opts->values.lossless = false;
+    opts->values.frame_index_box = false;
   }
   opts->values.cparams.level = enc->codestream_level;
   JxlEncoderFrameSettings* ret = opts.get();
@@ -870,6 +1356,7 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
       } else {
         return JXL_ENC_ERROR;
       }
+      frame_settings->values.cparams.explicit_vardct = value == 0;
       return JXL_ENC_SUCCESS;
     case JXL_ENC_FRAME_SETTING_KEEP_INVISIBLE:
       if (value < -1 || value > 1) return JXL_ENC_ERROR;
@@ -1004,6 +1491,41 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
         frame_settings->values.cparams.force_cfl_jpeg_recompression = value;
       }
       return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_INDEX_BOX:
+      if (value < 0 || value > 1) return JXL_ENC_ERROR;
+      frame_settings->values.frame_index_box = value;
+      return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_MODULAR_REUSE_TREE:
+      if (value < 0 || value > 1) return JXL_ENC_ERROR;
+      if (value == 0) {
+        frame_settings->values.cparams.modular_tree_cache.reset();
+      } else if (!frame_settings->values.cparams.modular_tree_cache) {
+        frame_settings->values.cparams.modular_tree_cache =
+            std::make_shared<jxl::ModularTreeCache>();
+      }
+      return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_JPEG_LOW_MEMORY:
+      if (value < 0 || value > 1) return JXL_ENC_ERROR;
+      frame_settings->values.cparams.jpeg_low_memory = value;
+      return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_LOW_MEMORY:
+      if (value < 0 || value > 1) return JXL_ENC_ERROR;
+      frame_settings->values.cparams.low_memory = value;
+      return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_TIME_BUDGET:
+      if (value < -1) return JXL_ENC_ERROR;
+      frame_settings->values.cparams.time_budget =
+          value == -1 ? 0.0 : value * 1e-3;
+      return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_CLASSIFY_CONTENT:
+      if (value < 0 || value > 1) return JXL_ENC_ERROR;
+      frame_settings->values.cparams.classify_content = value;
+      return JXL_ENC_SUCCESS;
+    case JXL_ENC_FRAME_SETTING_MAX_DECODE_CYCLES:
+      if (value < -1) return JXL_ENC_ERROR;
+      frame_settings->values.cparams.max_decode_cycles =
+          value == -1 ? 0.0f : value;
+      return JXL_ENC_SUCCESS;
     default:
       return JXL_ENC_ERROR;
   }
@@ -1035,15 +1557,26 @@ void JxlEncoderReset(JxlEncoder* enc) {
   enc->num_queued_frames = 0;
   enc->num_queued_boxes = 0;
   enc->encoder_options.clear();
-  enc->output_byte_queue.clear();
+  enc->output_chunks.clear();
+  enc->output_chunk_offset = 0;
+  enc->returned_output_chunk.clear();
   enc->codestream_bytes_written_beginning_of_frame = 0;
   enc->codestream_bytes_written_end_of_frame = 0;
+  enc->frame_index_box = jxl::JxlEncoderFrameIndexBox();
+  enc->hold_output = false;
+  enc->held_output_chunks.clear();
+  enc->output_callback_position = 0;
+  enc->frame_index_box_position = 0;
+  enc->frame_index_box_reserved = 0;
   enc->wrote_bytes = false;
   enc->jxlp_counter = 0;
   enc->metadata = jxl::CodecMetadata();
   enc->last_used_cparams = jxl::CompressParams();
   enc->frames_closed = false;
   enc->boxes_closed = false;
+  enc->memory_stats.limit_exceeded.store(false, std::memory_order_relaxed);
+  enc->counters.Clear();
+  enc->progress.Reset();
   enc->basic_info_set = false;
   enc->color_encoding_set = false;
   enc->intensity_target_set = false;
@@ -1097,6 +1630,84 @@ void JxlEncoderSetCms(JxlEncoder* enc, JxlCmsInterface cms) {
   enc->cms = cms;
 }
 
+void JxlEncoderGetMemoryStats(const JxlEncoder* enc, JxlMemoryStats* stats) {
+  const jxl::CacheAligned::Stats& s = enc->memory_stats;
+  stats->current_bytes = s.total_bytes.load(std::memory_order_relaxed);
+  stats->peak_bytes = s.peak_total_bytes.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < JXL_MEMORY_NUM_CATEGORIES; i++) {
+    stats->current_bytes_per_category[i] =
+        s.bytes[i].load(std::memory_order_relaxed);
+    stats->peak_bytes_per_category[i] =
+        s.peak_bytes[i].load(std::memory_order_relaxed);
+  }
+}
+
+void JxlEncoderSetMemoryLimit(JxlEncoder* enc, uint64_t max_bytes) {
+  enc->memory_stats.limit.store(max_bytes, std::memory_order_relaxed);
+}
+
+void JxlEncoderGetCounters(const JxlEncoder* enc,
+                           JxlEncoderCounters* counters) {
+  static_assert(JXL_ENC_NUM_PHASES == jxl::EncoderCounters::kNumPhases,
+                "Phases of the API and of EncoderCounters differ");
+  const jxl::EncoderCounters& c = enc->counters;
+  for (size_t i = 0; i < JXL_ENC_NUM_PHASES; i++) {
+    counters->nanoseconds[i] = c.nanoseconds[i].load(std::memory_order_relaxed);
+  }
+  counters->frames = c.frames.load(std::memory_order_relaxed);
+  counters->groups = c.groups.load(std::memory_order_relaxed);
+  counters->bytes = c.bytes.load(std::memory_order_relaxed);
+}
+
+void JxlEncoderGetDecodeCost(const JxlEncoder* enc,
+                             JxlEncoderDecodeCost* cost) {
+  static_assert(
+      JXL_ENC_NUM_DECODE_STAGES == jxl::EncoderCounters::kNumDecodeStages,
+      "Stages of the API and of EncoderCounters differ");
+  const jxl::EncoderCounters& c = enc->counters;
+  for (size_t i = 0; i < JXL_ENC_NUM_DECODE_STAGES; i++) {
+    cost->cycles[i] = c.decode_cycles[i].load(std::memory_order_relaxed);
+  }
+  cost->pixels = c.decode_pixels.load(std::memory_order_relaxed);
+}
+
+void JxlEncoderSetProgressCallback(JxlEncoder* enc,
+                                   JxlEncoderProgressCallback callback,
+                                   void* opaque) {
+  enc->progress.SetCallback(callback, opaque);
+}
+
+JxlEncoderStatus JxlEncoderSetOutputCallback(JxlEncoder* enc,
+                                             JxlEncoderOutputCallback callback,
+                                             void* opaque) {
+  if (enc->wrote_bytes) {
+    return JXL_API_ERROR("output callback must be set before encoding");
+  }
+  enc->output_callback = callback;
+  enc->output_callback_opaque = opaque;
+  return JXL_ENC_SUCCESS;
+}
+
+JxlEncoderStatus JxlEncoderSetOutputPatchCallback(
+    JxlEncoder* enc, JxlEncoderOutputPatchCallback callback, void* opaque) {
+  if (enc->wrote_bytes) {
+    return JXL_API_ERROR("output patch callback must be set before encoding");
+  }
+  enc->output_patch_callback = callback;
+  enc->output_patch_callback_opaque = opaque;
+  return JXL_ENC_SUCCESS;
+}
+
+void JxlEncoderSetBufferPool(JxlEncoder* enc, size_t max_kept_bytes) {
+  if (max_kept_bytes != 0 && !enc->buffer_pool) {
+    enc->buffer_pool.reset(
+        new jxl::BufferPool(enc->memory_manager, max_kept_bytes));
+  } else if (enc->buffer_pool) {
+    enc->buffer_pool->SetMaxKeptBytes(max_kept_bytes);
+  }
+  enc->use_buffer_pool = max_kept_bytes != 0;
+}
+
 JxlEncoderStatus JxlEncoderSetParallelRunner(JxlEncoder* enc,
                                              JxlParallelRunner parallel_runner,
                                              void* parallel_runner_opaque) {
@@ -1134,12 +1745,22 @@ JxlEncoderStatus GetCurrentDimensions(
 JxlEncoderStatus JxlEncoderAddJPEGFrame(
     const JxlEncoderFrameSettings* frame_settings, const uint8_t* buffer,
     size_t size) {
+  jxl::CacheAligned::ScopedMemoryManager scoped_memory_manager(
+      BufferMemoryManager(frame_settings->enc),
+      &frame_settings->enc->memory_stats);
+  jxl::CacheAligned::ScopedCategory scoped_category(
+      jxl::CacheAligned::Category::kInput);
+  jxl::ScopedPhaseTimer timer(
+      frame_settings->enc->counters.Timer(jxl::EncoderCounters::kInput));
   if (frame_settings->enc->frames_closed) {
     return JXL_ENC_ERROR;
   }
 
+  const bool low_memory = frame_settings->values.cparams.jpeg_low_memory;
   jxl::CodecInOut io;
-  if (!jxl::jpeg::DecodeImageJPG(jxl::Span<const uint8_t>(buffer, size), &io)) {
+  const jxl::Span<const uint8_t> bytes(buffer, size);
+  if (!(low_memory ? jxl::jpeg::DecodeImageJPGCoefficients(bytes, &io)
+                   : jxl::jpeg::DecodeImageJPG(bytes, &io))) {
     return JXL_ENC_ERROR;
   }
 
@@ -1189,9 +1810,17 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
                      io.blobs.jumbf.size(), /*compress_box=*/JXL_TRUE);
   }
   if (frame_settings->enc->store_jpeg_metadata) {
-    jxl::jpeg::JPEGData data_in = *io.Main().jpeg_data;
     jxl::PaddedBytes jpeg_data;
-    if (!jxl::jpeg::EncodeJPEGData(data_in, &jpeg_data,
+    // EncodeJPEGData only annotates the marker types, so in low-memory mode
+    // it is run on the parsed JPEG itself instead of on a copy of all its
+    // coefficients.
+    jxl::jpeg::JPEGData* data_in = io.Main().jpeg_data.get();
+    jxl::jpeg::JPEGData data_copy;
+    if (!low_memory) {
+      data_copy = *data_in;
+      data_in = &data_copy;
+    }
+    if (!jxl::jpeg::EncodeJPEGData(*data_in, &jpeg_data,
                                    frame_settings->values.cparams)) {
       return JXL_ENC_ERROR;
     }
@@ -1201,17 +1830,17 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
 
   auto queued_frame = jxl::MemoryManagerMakeUnique<jxl::JxlEncoderQueuedFrame>(
       &frame_settings->enc->memory_manager,
-      // JxlEncoderQueuedFrame is a struct with no constructors, so we use the
-      // default move constructor there.
-      jxl::JxlEncoderQueuedFrame{
-          frame_settings->values,
-          jxl::ImageBundle(&frame_settings->enc->metadata.m),
-          {}});
+      frame_settings->values,
+      jxl::ImageBundle(&frame_settings->enc->metadata.m));
   if (!queued_frame) {
     return JXL_ENC_ERROR;
   }
-  queued_frame->frame.SetFromImage(std::move(*io.Main().color()),
-                                   io.Main().c_current());
+  if (low_memory) {
+    queued_frame->frame.OverrideProfile(io.Main().c_current());
+  } else {
+    queued_frame->frame.SetFromImage(std::move(*io.Main().color()),
+                                     io.Main().c_current());
+  }
   size_t xsize, ysize;
   if (GetCurrentDimensions(frame_settings, xsize, ysize) != JXL_ENC_SUCCESS) {
     return JXL_API_ERROR("bad dimensions");
@@ -1220,6 +1849,7 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
       ysize != static_cast<size_t>(io.Main().jpeg_data->height)) {
     return JXL_API_ERROR("JPEG dimensions don't match frame dimensions");
   }
+  queued_frame->frame.jpeg_data = std::move(io.Main().jpeg_data);
   std::vector<jxl::ImageF> extra_channels(
       frame_settings->enc->metadata.m.num_extra_channels);
   for (auto& extra_channel : extra_channels) {
@@ -1227,17 +1857,21 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
     queued_frame->ec_initialized.push_back(0);
   }
   queued_frame->frame.SetExtraChannels(std::move(extra_channels));
-  queued_frame->frame.jpeg_data = std::move(io.Main().jpeg_data);
   queued_frame->frame.color_transform = io.Main().color_transform;
   queued_frame->frame.chroma_subsampling = io.Main().chroma_subsampling;
 
-  QueueFrame(frame_settings, queued_frame);
-  return JXL_ENC_SUCCESS;
+  return QueueFrame(frame_settings, queued_frame);
 }
 
-JxlEncoderStatus JxlEncoderAddImageFrame(
+namespace {
+// Creates the queued frame for JxlEncoderAddImageFrame and
+// JxlEncoderAddImageFrameFromRowSource, with the extra channels and layer
+// settings from frame_settings but without any pixels set yet.
+JxlEncoderStatus CreateImageFrame(
     const JxlEncoderFrameSettings* frame_settings,
-    const JxlPixelFormat* pixel_format, const void* buffer, size_t size) {
+    const JxlPixelFormat* pixel_format,
+    jxl::MemoryManagerUniquePtr<jxl::JxlEncoderQueuedFrame>* frame,
+    jxl::ColorEncoding* c_current, size_t* xsize, size_t* ysize) {
   if (!frame_settings->enc->basic_info_set ||
       (!frame_settings->enc->color_encoding_set &&
        !frame_settings->enc->metadata.m.xyb_encoded)) {
@@ -1253,28 +1887,23 @@ JxlEncoderStatus JxlEncoderAddImageFrame(
 
   auto queued_frame = jxl::MemoryManagerMakeUnique<jxl::JxlEncoderQueuedFrame>(
       &frame_settings->enc->memory_manager,
-      // JxlEncoderQueuedFrame is a struct with no constructors, so we use the
-      // default move constructor there.
-      jxl::JxlEncoderQueuedFrame{
-          frame_settings->values,
-          jxl::ImageBundle(&frame_settings->enc->metadata.m),
-          {}});
+      frame_settings->values,
+      jxl::ImageBundle(&frame_settings->enc->metadata.m));
 
   if (!queued_frame) {
     return JXL_ENC_ERROR;
   }
 
-  jxl::ColorEncoding c_current;
   if (!frame_settings->enc->color_encoding_set) {
     if ((pixel_format->data_type == JXL_TYPE_FLOAT) ||
         (pixel_format->data_type == JXL_TYPE_FLOAT16)) {
-      c_current =
+      *c_current =
           jxl::ColorEncoding::LinearSRGB(pixel_format->num_channels < 3);
     } else {
-      c_current = jxl::ColorEncoding::SRGB(pixel_format->num_channels < 3);
+      *c_current = jxl::ColorEncoding::SRGB(pixel_format->num_channels < 3);
     }
   } else {
-    c_current = frame_settings->enc->metadata.m.color_encoding;
+    *c_current = frame_settings->enc->metadata.m.color_encoding;
   }
   uint32_t num_channels = pixel_format->num_channels;
   size_t has_interleaved_alpha =
@@ -1283,14 +1912,13 @@ JxlEncoderStatus JxlEncoderAddImageFrame(
       frame_settings->enc->metadata.m.num_extra_channels) {
     return JXL_API_ERROR("number of extra channels mismatch");
   }
-  size_t xsize, ysize;
-  if (GetCurrentDimensions(frame_settings, xsize, ysize) != JXL_ENC_SUCCESS) {
+  if (GetCurrentDimensions(frame_settings, *xsize, *ysize) != JXL_ENC_SUCCESS) {
     return JXL_API_ERROR("bad dimensions");
   }
   std::vector<jxl::ImageF> extra_channels(
       frame_settings->enc->metadata.m.num_extra_channels);
   for (auto& extra_channel : extra_channels) {
-    extra_channel = jxl::ImageF(xsize, ysize);
+    extra_channel = jxl::ImageF(*xsize, *ysize);
   }
   queued_frame->frame.SetExtraChannels(std::move(extra_channels));
   for (auto& ec_info : frame_settings->enc->metadata.m.extra_channel_info) {
@@ -1315,21 +1943,143 @@ JxlEncoderStatus JxlEncoderAddImageFrame(
   queued_frame->frame.blend =
       frame_settings->values.header.layer_info.blend_info.source > 0;
 
-  if (!jxl::BufferToImageBundle(*pixel_format, xsize, ysize, buffer, size,
-                                frame_settings->enc->thread_pool.get(),
-                                c_current, &(queued_frame->frame))) {
-    return JXL_ENC_ERROR;
-  }
   if (frame_settings->values.lossless &&
       frame_settings->enc->metadata.m.xyb_encoded) {
     return JXL_API_ERROR("Set use_original_profile=true for lossless encoding");
   }
   queued_frame->option_values.cparams.level =
       frame_settings->enc->codestream_level;
-
-  QueueFrame(frame_settings, queued_frame);
+  *frame = std::move(queued_frame);
   return JXL_ENC_SUCCESS;
 }
+}  // namespace
+
+JxlEncoderStatus JxlEncoderAddImageFrame(
+    const JxlEncoderFrameSettings* frame_settings,
+    const JxlPixelFormat* pixel_format, const void* buffer, size_t size) {
+  jxl::CacheAligned::ScopedMemoryManager scoped_memory_manager(
+      BufferMemoryManager(frame_settings->enc),
+      &frame_settings->enc->memory_stats);
+  jxl::CacheAligned::ScopedCategory scoped_category(
+      jxl::CacheAligned::Category::kInput);
+  jxl::ScopedPhaseTimer timer(
+      frame_settings->enc->counters.Timer(jxl::EncoderCounters::kInput));
+  jxl::MemoryManagerUniquePtr<jxl::JxlEncoderQueuedFrame> queued_frame(
+      nullptr,
+      jxl::MemoryManagerDeleteHelper(&frame_settings->enc->memory_manager));
+  jxl::ColorEncoding c_current;
+  size_t xsize, ysize;
+  if (CreateImageFrame(frame_settings, pixel_format, &queued_frame, &c_current,
+                       &xsize, &ysize) != JXL_ENC_SUCCESS) {
+    return JXL_ENC_ERROR;
+  }
+
+  if (CanUseFastLossless(frame_settings, *pixel_format)) {
+    // Keep a copy of the pixels as they are, they only get converted once it
+    // is known whether this will be the last frame.
+    const size_t stride = jxl::ExternalRowStride(*pixel_format, xsize);
+    const size_t last_row_size =
+        xsize * pixel_format->num_channels *
+        (pixel_format->data_type == JXL_TYPE_UINT8 ? 1 : 2);
+    const size_t bytes_to_read = stride * (ysize - 1) + last_row_size;
+    if (size < bytes_to_read) {
+      return JXL_API_ERROR("buffer is too small for the image");
+    }
+    const uint8_t* bytes = static_cast<const uint8_t*>(buffer);
+    queued_frame->fast_lossless_input.assign(bytes, bytes + bytes_to_read);
+    queued_frame->fast_lossless_format = *pixel_format;
+    queued_frame->fast_lossless_xsize = xsize;
+    queued_frame->fast_lossless_ysize = ysize;
+    queued_frame->fast_lossless_color_encoding = c_current;
+  } else if (!jxl::BufferToImageBundle(*pixel_format, xsize, ysize, buffer,
+                                       size,
+                                       frame_settings->enc->thread_pool.get(),
+                                       c_current, &(queued_frame->frame))) {
+    return JXL_ENC_ERROR;
+  }
+
+  return QueueFrame(frame_settings, queued_frame);
+}
+
+JxlEncoderStatus JxlEncoderAddImageFrameFromRowSource(
+    const JxlEncoderFrameSettings* frame_settings,
+    const JxlPixelFormat* pixel_format, JxlEncoderRowSourceFunc func,
+    void* opaque) {
+  jxl::CacheAligned::ScopedMemoryManager scoped_memory_manager(
+      BufferMemoryManager(frame_settings->enc),
+      &frame_settings->enc->memory_stats);
+  jxl::CacheAligned::ScopedCategory scoped_category(
+      jxl::CacheAligned::Category::kInput);
+  jxl::ScopedPhaseTimer timer(
+      frame_settings->enc->counters.Timer(jxl::EncoderCounters::kInput));
+  if (func == nullptr) {
+    return JXL_API_ERROR("row source callback must be set");
+  }
+  if (jxl::ExternalRowStride(*pixel_format, 1) == 0) {
+    return JXL_API_ERROR("unsupported pixel format");
+  }
+  jxl::MemoryManagerUniquePtr<jxl::JxlEncoderQueuedFrame> queued_frame(
+      nullptr,
+      jxl::MemoryManagerDeleteHelper(&frame_settings->enc->memory_manager));
+  jxl::ColorEncoding c_current;
+  size_t xsize, ysize;
+  if (CreateImageFrame(frame_settings, pixel_format, &queued_frame, &c_current,
+                       &xsize, &ysize) != JXL_ENC_SUCCESS) {
+    return JXL_ENC_ERROR;
+  }
+
+  jxl::InitImageBundleForRows(*pixel_format, xsize, ysize, c_current,
+                              &queued_frame->frame);
+  queued_frame->row_source = func;
+  queued_frame->row_source_opaque = opaque;
+  queued_frame->row_source_format = *pixel_format;
+
+  return QueueFrame(frame_settings, queued_frame);
+}
+
+JxlEncoderStatus JxlEncoderAddYCbCrPlanarFrame(
+    const JxlEncoderFrameSettings* frame_settings,
+    const JxlYCbCrPlanarImage* image) {
+  jxl::CacheAligned::ScopedMemoryManager scoped_memory_manager(
+      BufferMemoryManager(frame_settings->enc),
+      &frame_settings->enc->memory_stats);
+  jxl::CacheAligned::ScopedCategory scoped_category(
+      jxl::CacheAligned::Category::kInput);
+  jxl::ScopedPhaseTimer timer(
+      frame_settings->enc->counters.Timer(jxl::EncoderCounters::kInput));
+  if (image->data_type != JXL_TYPE_UINT8 &&
+      image->data_type != JXL_TYPE_UINT16) {
+    return JXL_API_ERROR("YCbCr samples must be JXL_TYPE_UINT8 or UINT16");
+  }
+  if (frame_settings->enc->metadata.m.color_encoding.IsGray()) {
+    return JXL_API_ERROR("YCbCr input is not possible for grayscale images");
+  }
+  // The sRGB default for integer RGB input applies to YCbCr input too.
+  const JxlPixelFormat pixel_format = {3, image->data_type, JXL_NATIVE_ENDIAN,
+                                       0};
+  jxl::MemoryManagerUniquePtr<jxl::JxlEncoderQueuedFrame> queued_frame(
+      nullptr,
+      jxl::MemoryManagerDeleteHelper(&frame_settings->enc->memory_manager));
+  jxl::ColorEncoding c_current;
+  size_t xsize, ysize;
+  if (CreateImageFrame(frame_settings, &pixel_format, &queued_frame, &c_current,
+                       &xsize, &ysize) != JXL_ENC_SUCCESS) {
+    return JXL_ENC_ERROR;
+  }
+  const uint8_t* planes[3];
+  for (size_t c = 0; c < 3; c++) {
+    planes[c] = static_cast<const uint8_t*>(image->planes[c]);
+  }
+  if (!jxl::ConvertFromYCbCrPlanes(
+          planes, image->strides,
+          image->data_type == JXL_TYPE_UINT8 ? 8 : 16, image->chroma_shift_x,
+          image->chroma_shift_y, xsize, ysize, c_current,
+          frame_settings->enc->thread_pool.get(), &queued_frame->frame)) {
+    return JXL_API_ERROR("invalid YCbCr planes");
+  }
+
+  return QueueFrame(frame_settings, queued_frame);
+}
 
 JxlEncoderStatus JxlEncoderUseBoxes(JxlEncoder* enc) {
   if (enc->wrote_bytes) {
@@ -1375,6 +2125,13 @@ JxlEncoderStatus JxlEncoderAddBox(JxlEncoder* enc, const JxlBoxType type,
 JXL_EXPORT JxlEncoderStatus JxlEncoderSetExtraChannelBuffer(
     const JxlEncoderOptions* frame_settings, const JxlPixelFormat* pixel_format,
     const void* buffer, size_t size, uint32_t index) {
+  jxl::CacheAligned::ScopedMemoryManager scoped_memory_manager(
+      BufferMemoryManager(frame_settings->enc),
+      &frame_settings->enc->memory_stats);
+  jxl::CacheAligned::ScopedCategory scoped_category(
+      jxl::CacheAligned::Category::kInput);
+  jxl::ScopedPhaseTimer timer(
+      frame_settings->enc->counters.Timer(jxl::EncoderCounters::kInput));
   if (index >= frame_settings->enc->metadata.m.num_extra_channels) {
     return JXL_API_ERROR("Invalid value for the index of extra channel");
   }
@@ -1399,6 +2156,10 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderSetExtraChannelBuffer(
     return JXL_API_ERROR("Failed to set buffer for extra channel");
   }
   frame_settings->enc->input_queue.back().frame->ec_initialized[index] = 1;
+  if (frame_settings->enc->memory_stats.limit_exceeded.load(
+          std::memory_order_relaxed)) {
+    return JXL_API_ERROR("memory limit exceeded");
+  }
 
   return JXL_ENC_SUCCESS;
 }
@@ -1413,15 +2174,25 @@ void JxlEncoderCloseInput(JxlEncoder* enc) {
 }
 JxlEncoderStatus JxlEncoderProcessOutput(JxlEncoder* enc, uint8_t** next_out,
                                          size_t* avail_out) {
-  while (*avail_out > 0 &&
-         (!enc->output_byte_queue.empty() || !enc->input_queue.empty())) {
-    if (!enc->output_byte_queue.empty()) {
-      size_t to_copy = std::min(*avail_out, enc->output_byte_queue.size());
-      std::copy_n(enc->output_byte_queue.begin(), to_copy, *next_out);
+  jxl::CacheAligned::ScopedMemoryManager scoped_memory_manager(
+      BufferMemoryManager(enc), &enc->memory_stats);
+  enc->returned_output_chunk.clear();
+  // With an output callback, output_chunks stays empty and the output buffer
+  // is not used.
+  while ((*avail_out > 0 || enc->output_callback) &&
+         (!enc->output_chunks.empty() || !enc->input_queue.empty())) {
+    if (!enc->output_chunks.empty()) {
+      const jxl::PaddedBytes& chunk = enc->output_chunks.front();
+      size_t to_copy =
+          std::min(*avail_out, chunk.size() - enc->output_chunk_offset);
+      memcpy(*next_out, chunk.data() + enc->output_chunk_offset, to_copy);
       *next_out += to_copy;
       *avail_out -= to_copy;
-      enc->output_byte_queue.erase(enc->output_byte_queue.begin(),
-                                   enc->output_byte_queue.begin() + to_copy);
+      enc->output_chunk_offset += to_copy;
+      if (enc->output_chunk_offset == chunk.size()) {
+        enc->output_chunks.pop_front();
+        enc->output_chunk_offset = 0;
+      }
     } else if (!enc->input_queue.empty()) {
       if (enc->RefillOutputByteQueue() != JXL_ENC_SUCCESS) {
         return JXL_ENC_ERROR;
@@ -1429,12 +2200,38 @@ JxlEncoderStatus JxlEncoderProcessOutput(JxlEncoder* enc, uint8_t** next_out,
     }
   }
 
-  if (!enc->output_byte_queue.empty() || !enc->input_queue.empty()) {
+  if (!enc->output_chunks.empty() || !enc->input_queue.empty()) {
     return JXL_ENC_NEED_MORE_OUTPUT;
   }
   return JXL_ENC_SUCCESS;
 }
 
+JxlEncoderStatus JxlEncoderProcessOutputChunk(JxlEncoder* enc,
+                                              const uint8_t** chunk,
+                                              size_t* size) {
+  jxl::CacheAligned::ScopedMemoryManager scoped_memory_manager(
+      BufferMemoryManager(enc), &enc->memory_stats);
+  *chunk = nullptr;
+  *size = 0;
+  enc->returned_output_chunk.clear();
+  while (enc->output_chunks.empty() && !enc->input_queue.empty()) {
+    if (enc->RefillOutputByteQueue() != JXL_ENC_SUCCESS) {
+      return JXL_ENC_ERROR;
+    }
+  }
+  if (enc->output_chunks.empty()) {
+    return JXL_ENC_SUCCESS;
+  }
+  // Keep the chunk alive until the next call, so the caller can use it
+  // without copying.
+  enc->returned_output_chunk = std::move(enc->output_chunks.front());
+  enc->output_chunks.pop_front();
+  *chunk = enc->returned_output_chunk.data() + enc->output_chunk_offset;
+  *size = enc->returned_output_chunk.size() - enc->output_chunk_offset;
+  enc->output_chunk_offset = 0;
+  return JXL_ENC_NEED_MORE_OUTPUT;
+}
+
 JxlEncoderStatus JxlEncoderSetFrameHeader(JxlEncoderOptions* frame_settings,
                                           const JxlFrameHeader* frame_header) {
   if (frame_header->layer_info.blend_info.source > 3) {
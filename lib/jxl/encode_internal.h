@@ -8,15 +8,21 @@
 #define LIB_JXL_ENCODE_INTERNAL_H_
 
 #include <deque>
+#include <memory>
 #include <vector>
 
 #include "jxl/encode.h"
 #include "jxl/memory_manager.h"
 #include "jxl/parallel_runner.h"
 #include "jxl/types.h"
+#include "lib/jxl/base/cache_aligned.h"
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/padded_bytes.h"
+#include "lib/jxl/buffer_pool.h"
 #include "lib/jxl/enc_frame.h"
 #include "lib/jxl/memory_manager_internal.h"
+#include "lib/jxl/phase_counters.h"
+#include "lib/jxl/progress.h"
 
 namespace jxl {
 
@@ -26,6 +32,8 @@ typedef struct JxlEncoderFrameSettingsValuesStruct {
   // lossless is a separate setting from cparams because it is a combination
   // setting that overrides multiple settings inside of cparams.
   bool lossless;
+  // List the frame in the frame index box, see JXL_ENC_FRAME_INDEX_BOX.
+  bool frame_index_box;
   CompressParams cparams;
   JxlFrameHeader header;
   std::vector<JxlBlendInfo> extra_channel_blend_info;
@@ -50,17 +58,72 @@ constexpr unsigned char kContainerHeader[] = {
 constexpr unsigned char kLevelBoxHeader[] = {0, 0, 0, 0x9, 'j', 'x', 'l', 'l'};
 
 struct JxlEncoderQueuedFrame {
+  JxlEncoderQueuedFrame(const JxlEncoderFrameSettingsValues& option_values,
+                        ImageBundle&& frame)
+      : option_values(option_values),
+        frame(std::move(frame)),
+        row_source(nullptr),
+        row_source_opaque(nullptr),
+        row_source_format(),
+        fast_lossless_format(),
+        fast_lossless_xsize(0),
+        fast_lossless_ysize(0),
+        encoded(false) {}
+
   JxlEncoderFrameSettingsValues option_values;
   ImageBundle frame;
   std::vector<uint8_t> ec_initialized;
+  // If set, the color and alpha planes of frame are allocated but not filled
+  // in yet: they are pulled from this callback, one strip of rows at a time,
+  // right before the frame gets encoded.
+  JxlEncoderRowSourceFunc row_source;
+  void* row_source_opaque;
+  JxlPixelFormat row_source_format;
+  // If not empty, the frame can be encoded with the fast lossless encoder and
+  // the color and alpha planes of frame are not set: this holds a copy of the
+  // interleaved input pixels instead, which only get converted to frame if the
+  // fast lossless encoder ends up not being used.
+  std::vector<uint8_t> fast_lossless_input;
+  JxlPixelFormat fast_lossless_format;
+  size_t fast_lossless_xsize;
+  size_t fast_lossless_ysize;
+  ColorEncoding fast_lossless_color_encoding;
+  // Set if the frame was encoded ahead of the frames queued before it, in
+  // parallel with other such frames: encoded_chunks then hold the frame, and
+  // frame no longer holds the pixels.
+  bool encoded;
+  std::vector<PaddedBytes> encoded_chunks;
 };
 
 struct JxlEncoderQueuedBox {
   BoxType type;
-  std::vector<uint8_t> contents;
+  PaddedBytes contents;
   bool compress_box;
 };
 
+// The frames added to the encoder, in codestream order, for the frame index
+// box (jxli) that lists the frames at which decoding can start.
+struct JxlEncoderFrameIndexBox {
+  struct Entry {
+    // The frame was added with JXL_ENC_FRAME_INDEX_BOX set.
+    bool to_be_indexed;
+    uint32_t duration;
+    // Bit masks of the reference slots that the frame is blended onto and that
+    // it is saved to, as in FrameDecoder::References and SavedAs.
+    uint8_t references;
+    uint8_t saved_as;
+    // Position of the frame in the codestream, set once it is encoded.
+    uint64_t codestream_offset;
+  };
+
+  // Indexing frames requires the first frame to be indexed.
+  bool IsUsed() const { return !entries.empty() && entries[0].to_be_indexed; }
+
+  std::vector<Entry> entries;
+  // Number of entries whose frame was encoded.
+  size_t num_encoded = 0;
+};
+
 // Either a frame, or a box, not both.
 struct JxlEncoderQueuedInput {
   explicit JxlEncoderQueuedInput(const JxlMemoryManager& memory_manager)
@@ -107,6 +170,15 @@ void AppendBoxHeader(const jxl::BoxType& type, size_t size, bool unbounded,
 // JxlEncoderCreate.
 struct JxlEncoderStruct {
   JxlMemoryManager memory_manager;
+  // Counts the buffers allocated while encoding. Declared before everything
+  // that may own such buffers, since they refer to it until freed.
+  jxl::CacheAligned::Stats memory_stats;
+  // Created by the first JxlEncoderSetBufferPool call and kept until the
+  // encoder is destroyed, since queued frames may own buffers from it.
+  std::unique_ptr<jxl::BufferPool> buffer_pool;
+  bool use_buffer_pool = false;
+  jxl::EncoderCounters counters;
+  jxl::ProgressMonitor progress;
   jxl::MemoryManagerUniquePtr<jxl::ThreadPool> thread_pool{
       nullptr, jxl::MemoryManagerDeleteHelper(&memory_manager)};
   JxlCmsInterface cms;
@@ -116,7 +188,24 @@ struct JxlEncoderStruct {
   size_t num_queued_frames;
   size_t num_queued_boxes;
   std::vector<jxl::JxlEncoderQueuedInput> input_queue;
-  std::deque<uint8_t> output_byte_queue;
+  // Pending output, as owned chunks in output order, such as box headers and
+  // the encoded bytes of a frame. Chunks are moved in rather than copied. The
+  // first output_chunk_offset bytes of the first chunk were already output.
+  std::deque<jxl::PaddedBytes> output_chunks;
+  size_t output_chunk_offset;
+  // The chunk last handed out by JxlEncoderProcessOutputChunk, which must stay
+  // valid until the next call to the encoder.
+  jxl::PaddedBytes returned_output_chunk;
+  // If set, the chunks are passed to it as soon as they are final instead of
+  // being queued in output_chunks, see JxlEncoderSetOutputCallback.
+  JxlEncoderOutputCallback output_callback = nullptr;
+  void* output_callback_opaque = nullptr;
+  // If set, overwrites output that was passed to output_callback, see
+  // JxlEncoderSetOutputPatchCallback.
+  JxlEncoderOutputPatchCallback output_patch_callback = nullptr;
+  void* output_patch_callback_opaque = nullptr;
+  // Number of bytes passed to output_callback.
+  uint64_t output_callback_position = 0;
 
   // How many codestream bytes have been written, i.e.,
   // content of jxlc and jxlp boxes. Frame index box jxli
@@ -126,6 +215,16 @@ struct JxlEncoderStruct {
   // or accross multiple jxlp boxes.
   size_t codestream_bytes_written_beginning_of_frame;
   size_t codestream_bytes_written_end_of_frame;
+  jxl::JxlEncoderFrameIndexBox frame_index_box;
+  // While set, QueueOutputChunk holds the chunks back in held_output_chunks:
+  // the frame index box must come before the codestream, and is only known
+  // once the last frame is encoded.
+  bool hold_output;
+  std::vector<jxl::PaddedBytes> held_output_chunks;
+  // Instead of holding the output, the space of the frame index box may be
+  // reserved at this output position and patched after the last frame.
+  uint64_t frame_index_box_position = 0;
+  size_t frame_index_box_reserved = 0;
 
   // Force using the container even if not needed
   bool use_container;
@@ -159,18 +258,34 @@ struct JxlEncoderStruct {
   int brotli_effort = -1;
 
   // Takes the first frame in the input_queue, encodes it, and appends
-  // the bytes to the output_byte_queue.
+  // the bytes to the output_chunks.
   JxlEncoderStatus RefillOutputByteQueue();
 
+  // Appends chunk to the end of output_chunks, unless it is empty.
+  void QueueOutputChunk(jxl::PaddedBytes&& chunk) {
+    if (chunk.empty()) return;
+    if (hold_output) {
+      held_output_chunks.emplace_back(std::move(chunk));
+    } else if (output_callback) {
+      output_callback(output_callback_opaque, chunk.data(), chunk.size());
+      output_callback_position += chunk.size();
+    } else {
+      output_chunks.emplace_back(std::move(chunk));
+    }
+  }
+
+  // Queues codestream bytes, in a jxlc or jxlp box if the container is used.
+  // `last` is whether they end the codestream.
+  void QueueCodestreamBytes(jxl::PaddedBytes&& bytes, bool last);
+  // Same, for codestream bytes that are the concatenation of `chunks`.
+  void QueueCodestreamChunks(std::vector<jxl::PaddedBytes>&& chunks,
+                             bool last);
+
   bool MustUseContainer() const {
     return use_container || codestream_level != 5 || store_jpeg_metadata ||
-           use_boxes;
+           use_boxes || frame_index_box.IsUsed();
   }
 
-  // Appends the bytes of a JXL box header with the provided type and size to
-  // the end of the output_byte_queue. If unbounded is true, the size won't be
-  // added to the header and the box will be assumed to continue until EOF.
-  void AppendBoxHeader(const jxl::BoxType& type, size_t size, bool unbounded);
 };
 
 struct JxlEncoderFrameSettingsStruct {
@@ -5,14 +5,20 @@
 
 #include "jxl/encode.h"
 
+#include <stdlib.h>
+
+#include <algorithm>
+
 #include "enc_color_management.h"
 #include "gtest/gtest.h"
 #include "jxl/decode.h"
 #include "jxl/decode_cxx.h"
 #include "jxl/encode_cxx.h"
+#include "jxl/thread_parallel_runner_cxx.h"
 #include "lib/extras/codec.h"
 #include "lib/jxl/dec_file.h"
 #include "lib/jxl/enc_butteraugli_pnorm.h"
+#include "lib/jxl/enc_fast_lossless.h"
 #include "lib/jxl/encode_internal.h"
 #include "lib/jxl/jpeg/dec_jpeg_data.h"
 #include "lib/jxl/jpeg/dec_jpeg_data_writer.h"
@@ -240,6 +246,117 @@ TEST(EncodeTest, EncoderResetTest) {
                       JxlEncoderFrameSettingsCreate(enc.get(), nullptr));
 }
 
+TEST(EncodeTest, MemoryStatsTest) {
+  const size_t xsize = 157, ysize = 77;
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  VerifyFrameEncoding(xsize, ysize, enc.get(),
+                      JxlEncoderFrameSettingsCreate(enc.get(), nullptr));
+  JxlMemoryStats stats;
+  JxlEncoderGetMemoryStats(enc.get(), &stats);
+  EXPECT_LE(xsize * ysize * 3 * sizeof(float),
+            stats.peak_bytes_per_category[JXL_MEMORY_INPUT]);
+  EXPECT_LT(0u, stats.peak_bytes_per_category[JXL_MEMORY_COEFFICIENTS]);
+  EXPECT_LE(stats.current_bytes, stats.peak_bytes);
+  for (size_t i = 0; i < JXL_MEMORY_NUM_CATEGORIES; i++) {
+    EXPECT_LE(stats.current_bytes_per_category[i],
+              stats.peak_bytes_per_category[i]);
+    EXPECT_LE(stats.peak_bytes_per_category[i], stats.peak_bytes);
+  }
+
+  // Copying the input of the next frame exceeds the limit.
+  JxlEncoderReset(enc.get());
+  JxlEncoderSetMemoryLimit(enc.get(), stats.current_bytes + 1000);
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = false;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetCodestreamLevel(enc.get(), 10));
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  EXPECT_EQ(JXL_ENC_ERROR,
+            JxlEncoderAddImageFrame(
+                JxlEncoderFrameSettingsCreate(enc.get(), nullptr),
+                &pixel_format, pixels.data(), pixels.size()));
+}
+
+TEST(EncodeTest, CountersTest) {
+  const size_t xsize = 300, ysize = 77;
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  JxlEncoderCounters counters;
+  JxlEncoderGetCounters(enc.get(), &counters);
+  EXPECT_EQ(0u, counters.frames);
+  VerifyFrameEncoding(xsize, ysize, enc.get(),
+                      JxlEncoderFrameSettingsCreate(enc.get(), nullptr));
+  JxlEncoderGetCounters(enc.get(), &counters);
+  EXPECT_EQ(1u, counters.frames);
+  EXPECT_EQ(2u, counters.groups);
+  EXPECT_LT(0u, counters.bytes);
+  EXPECT_LT(0u, counters.nanoseconds[JXL_ENC_PHASE_INPUT]);
+  EXPECT_LT(0u, counters.nanoseconds[JXL_ENC_PHASE_TRANSFORM]);
+  EXPECT_LT(0u, counters.nanoseconds[JXL_ENC_PHASE_MODULAR]);
+  EXPECT_LT(0u, counters.nanoseconds[JXL_ENC_PHASE_WRITE]);
+
+  JxlEncoderReset(enc.get());
+  JxlEncoderGetCounters(enc.get(), &counters);
+  EXPECT_EQ(0u, counters.frames);
+  for (size_t i = 0; i < JXL_ENC_NUM_PHASES; i++) {
+    EXPECT_EQ(0u, counters.nanoseconds[i]);
+  }
+}
+
+TEST(EncodeTest, DecodeCostTest) {
+  const size_t xsize = 300, ysize = 77;
+  for (int max_cycles = 0; max_cycles < 2; max_cycles++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderDecodeCost cost;
+    JxlEncoderGetDecodeCost(enc.get(), &cost);
+    EXPECT_EQ(0u, cost.pixels);
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_MAX_DECODE_CYCLES, -2));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_MAX_DECODE_CYCLES,
+                  max_cycles));
+    VerifyFrameEncoding(xsize, ysize, enc.get(), frame_settings);
+    JxlEncoderGetDecodeCost(enc.get(), &cost);
+    EXPECT_EQ(xsize * ysize, cost.pixels);
+    EXPECT_LT(0u, cost.cycles[JXL_ENC_DECODE_STAGE_ENTROPY]);
+    EXPECT_LT(0u, cost.cycles[JXL_ENC_DECODE_STAGE_TRANSFORM]);
+    EXPECT_LT(0u, cost.cycles[JXL_ENC_DECODE_STAGE_COLOR]);
+    EXPECT_EQ(0u, cost.cycles[JXL_ENC_DECODE_STAGE_UPSAMPLING]);
+    if (max_cycles == 0) {
+      // The default distance 1 enables gaborish and one EPF iteration.
+      EXPECT_LT(0u, cost.cycles[JXL_ENC_DECODE_STAGE_GABORISH]);
+      EXPECT_LT(0u, cost.cycles[JXL_ENC_DECODE_STAGE_EPF]);
+    } else {
+      // An unreachable limit disables all the tools that can be.
+      EXPECT_EQ(0u, cost.cycles[JXL_ENC_DECODE_STAGE_GABORISH]);
+      EXPECT_EQ(0u, cost.cycles[JXL_ENC_DECODE_STAGE_EPF]);
+      EXPECT_EQ(0u, cost.cycles[JXL_ENC_DECODE_STAGE_PATCHES]);
+      EXPECT_EQ(0u, cost.cycles[JXL_ENC_DECODE_STAGE_NOISE]);
+    }
+
+    JxlEncoderReset(enc.get());
+    JxlEncoderGetDecodeCost(enc.get(), &cost);
+    EXPECT_EQ(0u, cost.pixels);
+    for (size_t i = 0; i < JXL_ENC_NUM_DECODE_STAGES; i++) {
+      EXPECT_EQ(0u, cost.cycles[i]);
+    }
+  }
+}
+
 TEST(EncodeTest, CmsTest) {
   JxlEncoderPtr enc = JxlEncoderMake(nullptr);
   EXPECT_NE(nullptr, enc.get());
@@ -877,6 +994,301 @@ static void ProcessEncoder(JxlEncoder* enc, std::vector<uint8_t>& compressed,
   EXPECT_EQ(JXL_ENC_SUCCESS, process_result);
 }
 
+TEST(EncodeTest, JXL_TRANSCODE_JPEG_TEST(JPEGLowMemoryTest)) {
+  const char* kJpegPaths[] = {"jxl/flower/flower.png.im_q85_420.jpg",
+                              "jxl/flower/flower_cropped.jpg"};
+  for (const char* jpeg_path : kJpegPaths) {
+    const jxl::PaddedBytes orig = jxl::ReadTestData(jpeg_path);
+    std::vector<uint8_t> compressed[2];
+    for (int low_memory = 0; low_memory < 2; low_memory++) {
+      JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+      JxlThreadParallelRunnerPtr runner =
+          JxlThreadParallelRunnerMake(nullptr, 4);
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner,
+                                            runner.get()));
+      JxlEncoderFrameSettings* frame_settings =
+          JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderFrameSettingsSetOption(
+                    frame_settings, JXL_ENC_FRAME_SETTING_JPEG_LOW_MEMORY,
+                    low_memory));
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderStoreJPEGMetadata(enc.get(), JXL_TRUE));
+      EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderAddJPEGFrame(
+                                     frame_settings, orig.data(), orig.size()));
+      JxlEncoderCloseInput(enc.get());
+      compressed[low_memory].resize(64);
+      uint8_t* next_out = compressed[low_memory].data();
+      size_t avail_out = compressed[low_memory].size();
+      ProcessEncoder(enc.get(), compressed[low_memory], next_out, avail_out);
+    }
+    // The low-memory mode must produce exactly the same file.
+    EXPECT_EQ(compressed[0], compressed[1]) << jpeg_path;
+  }
+}
+
+TEST(EncodeTest, LowMemoryTest) {
+  const size_t xsize = 600, ysize = 400;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  std::vector<uint8_t> compressed[2];
+  uint64_t peak_bytes[2];
+  for (int low_memory = 0; low_memory < 2; low_memory++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner,
+                                          runner.get()));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_LOW_MEMORY,
+                  low_memory));
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.uses_original_profile = false;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc.get());
+    compressed[low_memory].resize(64);
+    uint8_t* next_out = compressed[low_memory].data();
+    size_t avail_out = compressed[low_memory].size();
+    ProcessEncoder(enc.get(), compressed[low_memory], next_out, avail_out);
+    JxlMemoryStats stats;
+    JxlEncoderGetMemoryStats(enc.get(), &stats);
+    peak_bytes[low_memory] = stats.peak_bytes;
+  }
+  // The low-memory mode must produce exactly the same file.
+  EXPECT_EQ(compressed[0], compressed[1]);
+  EXPECT_LE(peak_bytes[1], peak_bytes[0]);
+}
+
+namespace {
+// Encodes a test image at `effort`, on a runner with `num_threads` threads, or
+// without a runner if it is 0.
+std::vector<uint8_t> EncodeWithThreads(size_t num_threads, bool lossless,
+                                       int effort) {
+  const size_t xsize = 600, ysize = 400;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlThreadParallelRunnerPtr runner;
+  if (num_threads != 0) {
+    runner = JxlThreadParallelRunnerMake(nullptr, num_threads);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner,
+                                          runner.get()));
+  }
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetFrameLossless(frame_settings, lossless));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderFrameSettingsSetOption(
+                frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, effort));
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = lossless;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(), pixels.size()));
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size();
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+  return compressed;
+}
+}  // namespace
+
+// The parallel steps (tokenization, histogram clustering, tree learning, the
+// choice of the RCTs, ...) must give the same codestream for any number of
+// threads, so that encoded files can be cached by the hash of their input.
+TEST(EncodeTest, JXL_TSAN_SLOW_TEST(ThreadCountDeterminismTest)) {
+  for (int lossless = 0; lossless < 2; lossless++) {
+    for (int effort : {3, 7, 9}) {
+      const std::vector<uint8_t> expected =
+          EncodeWithThreads(0, lossless, effort);
+      for (size_t num_threads : {1, 3, 8}) {
+        EXPECT_EQ(expected, EncodeWithThreads(num_threads, lossless, effort))
+            << "lossless " << lossless << " effort " << effort << " threads "
+            << num_threads;
+      }
+    }
+  }
+}
+
+TEST(EncodeTest, TimeBudgetTest) {
+  for (int lossless = 0; lossless < 2; lossless++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TIME_BUDGET, -2));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, 9));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameLossless(frame_settings, lossless));
+    // Far too short for effort 9: the slow stages are degraded or skipped,
+    // and the result must still be a valid codestream.
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TIME_BUDGET, 1));
+    VerifyFrameEncoding(300, 200, enc.get(), frame_settings);
+  }
+}
+
+TEST(EncodeTest, ClassifyContentTest) {
+  for (int lossless = 0; lossless < 2; lossless++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_CLASSIFY_CONTENT, 2));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_CLASSIFY_CONTENT, 1));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameLossless(frame_settings, lossless));
+    VerifyFrameEncoding(300, 200, enc.get(), frame_settings);
+  }
+}
+
+namespace {
+struct ProgressCallbackState {
+  uint64_t abort_at = 0;
+  uint64_t num_calls = 0;
+  uint64_t num_done = 0;
+  uint64_t num_total = 0;
+};
+
+JXL_BOOL ProgressCallback(void* opaque, uint64_t num_done,
+                          uint64_t num_total) {
+  ProgressCallbackState* state = static_cast<ProgressCallbackState*>(opaque);
+  state->num_calls++;
+  state->num_done = num_done;
+  state->num_total = num_total;
+  return num_done != state->abort_at;
+}
+}  // namespace
+
+TEST(EncodeTest, ProgressCallbackTest) {
+  const size_t xsize = 300, ysize = 200;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  for (int lossless = 0; lossless < 2; lossless++) {
+    ProgressCallbackState state;
+    state.abort_at = 1;
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    JxlEncoderSetProgressCallback(enc.get(), ProgressCallback, &state);
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameLossless(frame_settings, lossless));
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.uses_original_profile = lossless;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed(1 << 20);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out));
+    EXPECT_EQ(1u, state.num_calls);
+    EXPECT_LE(1u, state.num_total);
+
+    // The reset encoder encodes the whole image, with the same callback.
+    JxlEncoderReset(enc.get());
+    state = ProgressCallbackState();
+    frame_settings = JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameLossless(frame_settings, lossless));
+    VerifyFrameEncoding(xsize, ysize, enc.get(), frame_settings);
+    EXPECT_LT(1u, state.num_calls);
+    EXPECT_EQ(state.num_calls, state.num_done);
+    EXPECT_LE(state.num_done, state.num_total);
+  }
+}
+
+TEST(EncodeTest, BufferPoolTest) {
+  const size_t xsize = 300, ysize = 200;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  size_t num_allocs = 0;
+  JxlMemoryManager memory_manager;
+  memory_manager.opaque = &num_allocs;
+  memory_manager.alloc = [](void* opaque, size_t size) {
+    ++*static_cast<size_t*>(opaque);
+    return malloc(size);
+  };
+  memory_manager.free = [](void* opaque, void* address) { free(address); };
+  JxlEncoderPtr enc = JxlEncoderMake(&memory_manager);
+  JxlEncoderSetBufferPool(enc.get(), 1 << 28);
+  std::vector<uint8_t> compressed[3];
+  size_t round_allocs[3];
+  for (size_t round = 0; round < 3; round++) {
+    JxlEncoderReset(enc.get());
+    const size_t allocs_before = num_allocs;
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.uses_original_profile = false;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc.get());
+    compressed[round].resize(64);
+    uint8_t* next_out = compressed[round].data();
+    size_t avail_out = compressed[round].size();
+    ProcessEncoder(enc.get(), compressed[round], next_out, avail_out);
+    round_allocs[round] = num_allocs - allocs_before;
+  }
+  EXPECT_EQ(compressed[0], compressed[1]);
+  EXPECT_EQ(compressed[0], compressed[2]);
+  // The large buffers of the first image are reused for the next ones.
+  EXPECT_LT(round_allocs[2], round_allocs[0]);
+  // Disabling the pool frees the kept buffers.
+  JxlEncoderSetBufferPool(enc.get(), 0);
+}
+
 TEST(EncodeTest, BasicInfoTest) {
   JxlEncoderPtr enc = JxlEncoderMake(nullptr);
   EXPECT_NE(nullptr, enc.get());
@@ -1174,6 +1586,794 @@ TEST(EncodeTest, CroppedFrameTest) {
   EXPECT_EQ(true, seen_frame);
 }
 
+TEST(EncodeTest, FrameIndexBoxTest) {
+  const size_t xsize = 20;
+  const size_t ysize = 20;
+  const size_t kNumFrames = 4;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  basic_info.have_animation = JXL_TRUE;
+  basic_info.animation.tps_numerator = 1000;
+  basic_info.animation.tps_denominator = 1;
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  JxlFrameHeader header;
+  JxlEncoderInitFrameHeader(&header);
+  header.duration = 10;
+
+  {
+    // Frames blended onto earlier ones can't be indexed.
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(frame_settings,
+                                               JXL_ENC_FRAME_INDEX_BOX, 1));
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlFrameHeader blended_header = header;
+    blended_header.layer_info.blend_info.blendmode = JXL_BLEND_BLEND;
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameHeader(frame_settings, &blended_header));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+  }
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  JxlEncoderFrameSettingsSetOption(frame_settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                   1);
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetFrameHeader(frame_settings, &header));
+  std::vector<std::vector<uint8_t>> frames;
+  for (size_t i = 0; i < kNumFrames; i++) {
+    frames.push_back(jxl::test::GetSomeTestImage(xsize, ysize, 4, i));
+    // Index frames 0 and 2.
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_INDEX_BOX, i % 2 == 0));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      frames[i].data(), frames[i].size()));
+  }
+  JxlEncoderCloseFrames(enc.get());
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+  // The frame index box comes before the codestream.
+  {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BOX));
+    JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+    JxlDecoderCloseInput(dec.get());
+    std::vector<std::string> box_types;
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+      if (status == JXL_DEC_SUCCESS) break;
+      ASSERT_EQ(JXL_DEC_BOX, status);
+      JxlBoxType type;
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetBoxType(dec.get(), type, true));
+      box_types.emplace_back(type, type + 4);
+    }
+    ASSERT_GE(box_types.size(), 3u);
+    EXPECT_EQ("ftyp", box_types[0]);
+    EXPECT_EQ("jxli", box_types[1]);
+    EXPECT_EQ("jxlp", box_types[2]);
+  }
+
+  // Skipping to each frame, through the index or not, gives its pixels.
+  for (size_t skip = 0; skip < kNumFrames; skip++) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+    JxlDecoderCloseInput(dec.get());
+    JxlDecoderSkipFrames(dec.get(), skip);
+    std::vector<uint8_t> decoded(frames[0].size());
+    size_t num_frames = 0;
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+      if (status == JXL_DEC_SUCCESS) break;
+      if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                              decoded.data(), decoded.size()));
+        continue;
+      }
+      ASSERT_EQ(JXL_DEC_FULL_IMAGE, status);
+      const std::vector<uint8_t>& expected = frames[skip + num_frames];
+      EXPECT_EQ(0, memcmp(expected.data(), decoded.data(), expected.size()))
+          << "skip " << skip << " frame " << skip + num_frames;
+      num_frames++;
+    }
+    EXPECT_EQ(kNumFrames - skip, num_frames);
+  }
+}
+
+namespace {
+void AppendOutput(void* opaque, const uint8_t* data, size_t size) {
+  std::vector<uint8_t>* output = static_cast<std::vector<uint8_t>*>(opaque);
+  output->insert(output->end(), data, data + size);
+}
+
+void PatchOutput(void* opaque, uint64_t offset, const uint8_t* data,
+                 size_t size) {
+  std::vector<uint8_t>* output = static_cast<std::vector<uint8_t>*>(opaque);
+  ASSERT_LE(offset + size, output->size());
+  std::copy(data, data + size, output->begin() + offset);
+}
+
+// Returns the types of the boxes of the file, and the contents of its frame
+// index box.
+void GetBoxes(const std::vector<uint8_t>& file,
+              std::vector<std::string>* box_types,
+              std::vector<uint8_t>* index_box) {
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BOX));
+  JxlDecoderSetInput(dec.get(), file.data(), file.size());
+  JxlDecoderCloseInput(dec.get());
+  std::vector<uint8_t> contents(1024);
+  bool in_index_box = false;
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (in_index_box) {
+      const size_t remaining = JxlDecoderReleaseBoxBuffer(dec.get());
+      index_box->assign(contents.begin(), contents.end() - remaining);
+      in_index_box = false;
+    }
+    if (status == JXL_DEC_SUCCESS) break;
+    ASSERT_EQ(JXL_DEC_BOX, status);
+    JxlBoxType type;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetBoxType(dec.get(), type, true));
+    box_types->emplace_back(type, type + 4);
+    if (box_types->back() == "jxli") {
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetBoxBuffer(dec.get(),
+                                                        contents.data(),
+                                                        contents.size()));
+      in_index_box = true;
+    }
+  }
+}
+}  // namespace
+
+TEST(EncodeTest, FrameIndexBoxPatchTest) {
+  const size_t xsize = 20;
+  const size_t ysize = 20;
+  const size_t kNumFrames = 5;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  basic_info.have_animation = JXL_TRUE;
+  basic_info.animation.tps_numerator = 1000;
+  basic_info.animation.tps_denominator = 1;
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  JxlFrameHeader header;
+  JxlEncoderInitFrameHeader(&header);
+  header.duration = 10;
+  std::vector<std::vector<uint8_t>> frames;
+  for (size_t i = 0; i < kNumFrames; i++) {
+    frames.push_back(jxl::test::GetSomeTestImage(xsize, ysize, 4, i));
+  }
+
+  // Without patching, the output is held back until the index is known.
+  std::vector<uint8_t> compressed[2];
+  for (int patch = 0; patch < 2; patch++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetOutputCallback(enc.get(), AppendOutput,
+                                          &compressed[patch]));
+    if (patch) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetOutputPatchCallback(enc.get(), PatchOutput,
+                                                 &compressed[patch]));
+    }
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+    JxlEncoderFrameSettingsSetOption(frame_settings,
+                                     JXL_ENC_FRAME_SETTING_EFFORT, 1);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameHeader(frame_settings, &header));
+    for (size_t i = 0; i < kNumFrames; i++) {
+      // Index frames 0, 2 and 4.
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderFrameSettingsSetOption(
+                    frame_settings, JXL_ENC_FRAME_INDEX_BOX, i % 2 == 0));
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                        frames[i].data(), frames[i].size()));
+    }
+    JxlEncoderCloseInput(enc.get());
+    uint8_t* next_out = nullptr;
+    size_t avail_out = 0;
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out));
+    if (patch) {
+      EXPECT_EQ(JXL_ENC_ERROR,
+                JxlEncoderSetOutputPatchCallback(enc.get(), nullptr, nullptr));
+    }
+  }
+
+  // The patched frame index box is the same, followed by a free box.
+  std::vector<std::string> box_types[2];
+  std::vector<uint8_t> index_box[2];
+  for (int patch = 0; patch < 2; patch++) {
+    GetBoxes(compressed[patch], &box_types[patch], &index_box[patch]);
+    ASSERT_GE(box_types[patch].size(), 3u + patch);
+    EXPECT_EQ("ftyp", box_types[patch][0]);
+    EXPECT_EQ("jxli", box_types[patch][1]);
+  }
+  EXPECT_EQ("free", box_types[1][2]);
+  box_types[1].erase(box_types[1].begin() + 2);
+  EXPECT_EQ(box_types[0], box_types[1]);
+  EXPECT_FALSE(index_box[0].empty());
+  EXPECT_EQ(index_box[0], index_box[1]);
+
+  // Skipping to the last frame goes through the patched index.
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), compressed[1].data(), compressed[1].size());
+  JxlDecoderCloseInput(dec.get());
+  JxlDecoderSkipFrames(dec.get(), kNumFrames - 1);
+  std::vector<uint8_t> decoded(frames[0].size());
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                        decoded.data(), decoded.size()));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(frames.back(), decoded);
+}
+
+namespace {
+// Encodes an animation of the frames, with frame 2 saved as a reference frame,
+// with a multithreaded runner or not.
+std::vector<uint8_t> EncodeAnimation(
+    const std::vector<std::vector<uint8_t>>& frames, size_t xsize,
+    size_t ysize, const JxlPixelFormat& pixel_format, bool use_runner) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+  if (use_runner) {
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner,
+                                          runner.get()));
+  }
+  JxlPixelFormat format = pixel_format;
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  basic_info.have_animation = JXL_TRUE;
+  basic_info.animation.tps_numerator = 1000;
+  basic_info.animation.tps_denominator = 1;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  JxlEncoderFrameSettingsSetOption(frame_settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                   3);
+  for (size_t i = 0; i < frames.size(); i++) {
+    JxlFrameHeader header;
+    JxlEncoderInitFrameHeader(&header);
+    header.duration = 10;
+    if (i == 2) header.layer_info.save_as_reference = 1;
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameHeader(frame_settings, &header));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &format,
+                                      frames[i].data(), frames[i].size()));
+  }
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+  return compressed;
+}
+}  // namespace
+
+TEST(EncodeTest, ParallelFramesTest) {
+  const size_t xsize = 40;
+  const size_t ysize = 30;
+  const size_t kNumFrames = 6;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<std::vector<uint8_t>> frames;
+  for (size_t i = 0; i < kNumFrames; i++) {
+    frames.push_back(jxl::test::GetSomeTestImage(xsize, ysize, 3, i));
+  }
+  // The frames around the saved one are encoded ahead, in parallel, which
+  // gives the same codestream as encoding them one after the other.
+  std::vector<uint8_t> compressed =
+      EncodeAnimation(frames, xsize, ysize, pixel_format, /*use_runner=*/true);
+  EXPECT_EQ(EncodeAnimation(frames, xsize, ysize, pixel_format,
+                            /*use_runner=*/false),
+            compressed);
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  JxlDecoderCloseInput(dec.get());
+  std::vector<uint8_t> decoded(frames[0].size());
+  size_t num_frames = 0;
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_SUCCESS) break;
+    if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                            decoded.data(), decoded.size()));
+      continue;
+    }
+    ASSERT_EQ(JXL_DEC_FULL_IMAGE, status);
+    ASSERT_LT(num_frames, kNumFrames);
+    EXPECT_EQ(0, memcmp(frames[num_frames].data(), decoded.data(),
+                        decoded.size()))
+        << "frame " << num_frames;
+    num_frames++;
+  }
+  EXPECT_EQ(kNumFrames, num_frames);
+}
+
+namespace {
+struct RowSourceTestData {
+  const std::vector<uint8_t>* pixels;
+  size_t stride;
+  size_t next_row;
+};
+
+JXL_BOOL RowSourceTestFunc(void* opaque, size_t y0, size_t num_rows,
+                           void* buffer, size_t size) {
+  RowSourceTestData* data = static_cast<RowSourceTestData*>(opaque);
+  EXPECT_EQ(data->next_row, y0);
+  EXPECT_EQ(data->stride * num_rows, size);
+  memcpy(buffer, data->pixels->data() + y0 * data->stride, size);
+  data->next_row = y0 + num_rows;
+  return JXL_TRUE;
+}
+}  // namespace
+
+TEST(EncodeTest, RowSourceTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  size_t xsize = 150;
+  size_t ysize = 600;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  std::vector<uint8_t> pixels2(pixels.size());
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetCodestreamLevel(enc.get(), 10));
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  JxlEncoderFrameSettingsSetOption(frame_settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                   1);
+
+  RowSourceTestData data{&pixels, xsize * 8, 0};
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrameFromRowSource(
+                frame_settings, &pixel_format, RowSourceTestFunc, &data));
+  // The rows are only pulled once the encoder gets to the frame.
+  EXPECT_EQ(0u, data.next_row);
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(100);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+  EXPECT_EQ(ysize, data.next_row);
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_NE(nullptr, dec.get());
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  JxlDecoderCloseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                        pixels2.data(), pixels2.size()));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(0, memcmp(pixels.data(), pixels2.data(), pixels.size()));
+}
+
+namespace {
+// Returns the frame that JxlEncoderAddImageFrame is expected to output at
+// effort 1 for these samples, which are stored as for JxlFastLosslessEncode.
+std::vector<uint8_t> FastLosslessFrame(const std::vector<uint8_t>& samples,
+                                       size_t xsize, size_t ysize,
+                                       size_t num_channels, size_t bitdepth) {
+  const size_t stride = xsize * num_channels * (bitdepth <= 8 ? 1 : 2);
+  unsigned char* encoded = nullptr;
+  size_t encoded_size = JxlFastLosslessEncode(
+      samples.data(), xsize, stride, ysize, num_channels, bitdepth,
+      /*effort=*/2, /*frame_only=*/true, &encoded, nullptr, nullptr);
+  std::vector<uint8_t> frame(encoded, encoded + encoded_size);
+  free(encoded);
+  return frame;
+}
+
+bool ContainsBytes(const std::vector<uint8_t>& bytes,
+                   const std::vector<uint8_t>& part) {
+  return !part.empty() && std::search(bytes.begin(), bytes.end(),
+                                      part.begin(), part.end()) != bytes.end();
+}
+
+// Encodes the frames losslessly at effort 1, with `bits_per_sample` bits per
+// sample in the image and all of each frame buffer passed to the encoder.
+std::vector<uint8_t> EncodeFastLosslessTestImage(
+    const JxlPixelFormat& pixel_format, uint32_t bits_per_sample,
+    size_t xsize, size_t ysize, const std::vector<std::vector<uint8_t>>& frames,
+    bool use_container) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  if (use_container) {
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderUseContainer(enc.get(), true));
+  }
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.bits_per_sample = bits_per_sample;
+  if (basic_info.alpha_bits != 0) basic_info.alpha_bits = bits_per_sample;
+  basic_info.uses_original_profile = JXL_TRUE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding,
+                            /*is_gray=*/pixel_format.num_channels < 3);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  JxlEncoderFrameSettingsSetOption(frame_settings,
+                                   JXL_ENC_FRAME_SETTING_EFFORT, 1);
+  for (const std::vector<uint8_t>& frame : frames) {
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      frame.data(), frame.size()));
+  }
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(100);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+  return compressed;
+}
+
+// Decodes all frames of the image, without coalescing them.
+std::vector<std::vector<uint8_t>> DecodeFastLosslessTestImage(
+    const std::vector<uint8_t>& compressed, const JxlPixelFormat& pixel_format,
+    size_t frame_size) {
+  std::vector<std::vector<uint8_t>> frames;
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_NE(nullptr, dec.get());
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetCoalescing(dec.get(), JXL_FALSE));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  JxlDecoderCloseInput(dec.get());
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      frames.emplace_back(frame_size);
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                            frames.back().data(), frame_size));
+    } else if (status != JXL_DEC_FULL_IMAGE) {
+      EXPECT_EQ(JXL_DEC_SUCCESS, status);
+      break;
+    }
+  }
+  return frames;
+}
+}  // namespace
+
+TEST(EncodeTest, FastLosslessTest) {
+  // Lossless effort 1 uses the fast lossless encoder for such frames.
+  for (uint32_t num_channels = 1; num_channels <= 4; num_channels++) {
+    size_t xsize = 300;
+    size_t ysize = 270;
+    JxlPixelFormat pixel_format = {num_channels, JXL_TYPE_UINT8,
+                                   JXL_NATIVE_ENDIAN, 0};
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, num_channels, 0);
+    // GetSomeTestImage gives 16-bit samples, only keep enough for 8 bits.
+    pixels.resize(xsize * ysize * num_channels);
+    std::vector<uint8_t> compressed =
+        EncodeFastLosslessTestImage(pixel_format, 8, xsize, ysize, {pixels},
+                                    /*use_container=*/false);
+    EXPECT_TRUE(ContainsBytes(
+        compressed, FastLosslessFrame(pixels, xsize, ysize, num_channels, 8)));
+    std::vector<std::vector<uint8_t>> decoded =
+        DecodeFastLosslessTestImage(compressed, pixel_format, pixels.size());
+    ASSERT_EQ(1u, decoded.size());
+    EXPECT_EQ(pixels, decoded[0]);
+  }
+}
+
+TEST(EncodeTest, FastLosslessPaddedRowsTest) {
+  // Aligned rows, and more bytes than needed after the last one.
+  size_t xsize = 300;
+  size_t ysize = 270;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 64};
+  const size_t row_size = xsize * 3;
+  const size_t stride = jxl::DivCeil(row_size, 64) * 64;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  pixels.resize(row_size * ysize);
+  std::vector<uint8_t> padded(stride * ysize + 100, 0xAB);
+  for (size_t y = 0; y < ysize; y++) {
+    memcpy(&padded[y * stride], &pixels[y * row_size], row_size);
+  }
+  std::vector<uint8_t> compressed =
+      EncodeFastLosslessTestImage(pixel_format, 8, xsize, ysize, {padded},
+                                  /*use_container=*/false);
+  EXPECT_TRUE(ContainsBytes(compressed,
+                            FastLosslessFrame(pixels, xsize, ysize, 3, 8)));
+  pixel_format.align = 0;
+  std::vector<std::vector<uint8_t>> decoded =
+      DecodeFastLosslessTestImage(compressed, pixel_format, pixels.size());
+  ASSERT_EQ(1u, decoded.size());
+  EXPECT_EQ(pixels, decoded[0]);
+}
+
+TEST(EncodeTest, FastLosslessUint16Test) {
+  // 16-bit input is rescaled to the 10 bits per sample of the image.
+  size_t xsize = 300;
+  size_t ysize = 270;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  std::vector<uint8_t> samples(pixels.size());
+  for (size_t i = 0; i < pixels.size(); i += 2) {
+    uint32_t value = (pixels[i] << 8) | pixels[i + 1];
+    value = (value * 1023 + 32767) / 65535;
+    samples[i] = value & 0xFF;
+    samples[i + 1] = value >> 8;
+  }
+  std::vector<uint8_t> compressed =
+      EncodeFastLosslessTestImage(pixel_format, 10, xsize, ysize, {pixels},
+                                  /*use_container=*/false);
+  EXPECT_TRUE(ContainsBytes(compressed,
+                            FastLosslessFrame(samples, xsize, ysize, 4, 10)));
+  std::vector<std::vector<uint8_t>> decoded =
+      DecodeFastLosslessTestImage(compressed, pixel_format, pixels.size());
+  ASSERT_EQ(1u, decoded.size());
+  for (size_t i = 0; i < pixels.size(); i += 2) {
+    uint32_t value = (decoded[0][i] << 8) | decoded[0][i + 1];
+    value = (value * 1023 + 32767) / 65535;
+    ASSERT_EQ(static_cast<uint32_t>(samples[i] | (samples[i + 1] << 8)),
+              value);
+  }
+}
+
+TEST(EncodeTest, FastLosslessContainerTest) {
+  size_t xsize = 300;
+  size_t ysize = 270;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  pixels.resize(xsize * ysize * 3);
+  std::vector<uint8_t> compressed =
+      EncodeFastLosslessTestImage(pixel_format, 8, xsize, ysize, {pixels},
+                                  /*use_container=*/true);
+  ASSERT_GE(compressed.size(), 8u);
+  EXPECT_EQ(0, memcmp("JXL ", compressed.data() + 4, 4));
+  EXPECT_TRUE(ContainsBytes(compressed,
+                            FastLosslessFrame(pixels, xsize, ysize, 3, 8)));
+  std::vector<std::vector<uint8_t>> decoded =
+      DecodeFastLosslessTestImage(compressed, pixel_format, pixels.size());
+  ASSERT_EQ(1u, decoded.size());
+  EXPECT_EQ(pixels, decoded[0]);
+}
+
+TEST(EncodeTest, FastLosslessNonLastFrameTest) {
+  // Only the last frame can be encoded with the fast lossless encoder, the
+  // first one is converted and encoded with EncodeFrame.
+  size_t xsize = 300;
+  size_t ysize = 270;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<std::vector<uint8_t>> frames;
+  for (uint16_t seed = 0; seed < 2; seed++) {
+    frames.push_back(jxl::test::GetSomeTestImage(xsize, ysize, 3, seed));
+    frames.back().resize(xsize * ysize * 3);
+  }
+  std::vector<uint8_t> compressed =
+      EncodeFastLosslessTestImage(pixel_format, 8, xsize, ysize, frames,
+                                  /*use_container=*/false);
+  EXPECT_FALSE(ContainsBytes(compressed,
+                             FastLosslessFrame(frames[0], xsize, ysize, 3, 8)));
+  EXPECT_TRUE(ContainsBytes(compressed,
+                            FastLosslessFrame(frames[1], xsize, ysize, 3, 8)));
+  std::vector<std::vector<uint8_t>> decoded =
+      DecodeFastLosslessTestImage(compressed, pixel_format, frames[0].size());
+  ASSERT_EQ(2u, decoded.size());
+  EXPECT_EQ(frames[0], decoded[0]);
+  EXPECT_EQ(frames[1], decoded[1]);
+}
+
+namespace {
+// Sets up enc to encode a small lossless image followed by an Exif box.
+void SetupOutputChunkTestEncoder(JxlEncoder* enc,
+                                 const std::vector<uint8_t>& pixels,
+                                 size_t xsize, size_t ysize) {
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc, NULL);
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetCodestreamLevel(enc, 10));
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderUseBoxes(enc));
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc, &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetColorEncoding(enc, &color_encoding));
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(), pixels.size()));
+  const uint8_t exif[] = {0, 0, 0, 0, 'M', 'M', 0, 42};
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderAddBox(enc, "Exif", exif, sizeof(exif),
+                                              /*compress_box=*/JXL_FALSE));
+  JxlEncoderCloseInput(enc);
+}
+}  // namespace
+
+TEST(EncodeTest, ProcessOutputChunkTest) {
+  size_t xsize = 64;
+  size_t ysize = 48;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  SetupOutputChunkTestEncoder(enc.get(), pixels, xsize, ysize);
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+  JxlEncoderPtr enc2 = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc2.get());
+  SetupOutputChunkTestEncoder(enc2.get(), pixels, xsize, ysize);
+  std::vector<uint8_t> compressed2;
+  // Mix both APIs: the first few bytes are copied out, the rest is taken from
+  // the chunks.
+  compressed2.resize(3);
+  uint8_t* next_out2 = compressed2.data();
+  size_t avail_out2 = compressed2.size();
+  EXPECT_EQ(JXL_ENC_NEED_MORE_OUTPUT,
+            JxlEncoderProcessOutput(enc2.get(), &next_out2, &avail_out2));
+  JxlEncoderStatus status = JXL_ENC_NEED_MORE_OUTPUT;
+  size_t num_chunks = 0;
+  while (status == JXL_ENC_NEED_MORE_OUTPUT) {
+    const uint8_t* chunk;
+    size_t size;
+    status = JxlEncoderProcessOutputChunk(enc2.get(), &chunk, &size);
+    if (status == JXL_ENC_NEED_MORE_OUTPUT) {
+      EXPECT_NE(nullptr, chunk);
+      EXPECT_LT(0u, size);
+      compressed2.insert(compressed2.end(), chunk, chunk + size);
+      num_chunks++;
+    }
+  }
+  EXPECT_EQ(JXL_ENC_SUCCESS, status);
+  EXPECT_LT(1u, num_chunks);
+  EXPECT_EQ(compressed, compressed2);
+}
+
+namespace {
+struct OutputCallbackState {
+  const ProgressCallbackState* progress;
+  std::vector<uint8_t> output;
+  // Progress of the encoding at each call.
+  std::vector<uint64_t> num_done;
+};
+
+void OutputCallback(void* opaque, const uint8_t* data, size_t size) {
+  OutputCallbackState* state = static_cast<OutputCallbackState*>(opaque);
+  state->output.insert(state->output.end(), data, data + size);
+  state->num_done.push_back(state->progress->num_done);
+}
+}  // namespace
+
+TEST(EncodeTest, OutputCallbackTest) {
+  const size_t xsize = 300, ysize = 200;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  std::vector<uint8_t> compressed[2];
+  ProgressCallbackState progress;
+  OutputCallbackState state;
+  state.progress = &progress;
+  for (int use_callback = 0; use_callback < 2; use_callback++) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    JxlEncoderSetProgressCallback(enc.get(), ProgressCallback, &progress);
+    if (use_callback) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetOutputCallback(enc.get(), OutputCallback, &state));
+    }
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), NULL);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, 1));
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.uses_original_profile = false;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/false);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc.get());
+    compressed[use_callback].resize(1 << 20);
+    uint8_t* next_out = compressed[use_callback].data();
+    size_t avail_out = compressed[use_callback].size();
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out));
+    compressed[use_callback].resize(next_out -
+                                    compressed[use_callback].data());
+    if (use_callback) {
+      EXPECT_EQ(JXL_ENC_ERROR,
+                JxlEncoderSetOutputCallback(enc.get(), nullptr, nullptr));
+    }
+  }
+  // Nothing is copied to the output buffer with the callback, it gets the same
+  // bytes instead.
+  EXPECT_TRUE(compressed[1].empty());
+  EXPECT_EQ(compressed[0], state.output);
+  // The codestream header and the DC frame come out before the AC of the
+  // frame is encoded, and the sections of the frame after it.
+  ASSERT_LE(2u, state.num_done.size());
+  for (size_t i = 1; i < state.num_done.size(); i++) {
+    EXPECT_LT(state.num_done[0], state.num_done[i]);
+  }
+}
+
 TEST(EncodeTest, BoxTest) {
   // Test with uncompressed boxes and with brob boxes
   for (int compress_box = 0; compress_box <= 1; ++compress_box) {
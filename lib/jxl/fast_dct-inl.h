@@ -13,7 +13,9 @@
 #include <hwy/aligned_allocator.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/base/random.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/dct-inl.h"
 
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
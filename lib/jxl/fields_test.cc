@@ -277,6 +277,51 @@ TEST(FieldsTest, TestRoundtripFrame) {
   EXPECT_EQ(h.flags, h2.flags);
 }
 
+// Reads the bundle from each prefix of `bytes`: reading must fail with
+// kNotEnoughBytes exactly when Bundle::CanRead says more bytes are needed,
+// which lets the decoder read headers in a single pass.
+template <class T>
+void TestReadPrefixes(Span<const uint8_t> bytes, const T& initial) {
+  for (size_t size = 0; size <= bytes.size(); size++) {
+    Span<const uint8_t> span(bytes.data(), size);
+    T t1 = initial;
+    BitReader reader1(span);
+    const bool can_read = Bundle::CanRead(&reader1, &t1);
+    (void)reader1.AllReadsWithinBounds();
+    EXPECT_TRUE(reader1.Close());
+
+    T t2 = initial;
+    BitReader reader2(span);
+    const Status status = Bundle::Read(&reader2, &t2);
+    (void)reader2.AllReadsWithinBounds();
+    EXPECT_TRUE(reader2.Close());
+    EXPECT_EQ(!can_read, status.code() == StatusCode::kNotEnoughBytes) << size;
+    EXPECT_EQ(size == bytes.size(), !!status) << size;
+  }
+}
+
+TEST(FieldsTest, TestReadPrefixes) {
+  CodecMetadata metadata;
+  metadata.m.SetUintSamples(10);
+  metadata.m.SetAlphaBits(8);
+  metadata.m.have_animation = true;
+  BitWriter metadata_writer;
+  ASSERT_TRUE(Bundle::Write(metadata.m, &metadata_writer, 0, nullptr));
+  metadata_writer.ZeroPadToByte();
+  TestReadPrefixes(metadata_writer.GetSpan(), ImageMetadata());
+
+  FrameHeader h(&metadata);
+  h.name = "frame";
+  h.animation_frame.duration = 7;
+  h.upsampling = 2;
+  h.extra_channel_upsampling[0] = 4;
+  h.extensions = 0x800;
+  BitWriter frame_writer;
+  ASSERT_TRUE(WriteFrameHeader(h, &frame_writer, nullptr));
+  frame_writer.ZeroPadToByte();
+  TestReadPrefixes(frame_writer.GetSpan(), FrameHeader(&metadata));
+}
+
 #ifndef JXL_CRASH_ON_ERROR
 // Ensure out-of-bounds values cause an error.
 TEST(FieldsTest, TestOutOfRange) {
@@ -0,0 +1,60 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/base/file_io.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace jxl {
+namespace {
+
+std::string TempPath(const char* name) {
+  return testing::TempDir() + "/file_io_test_" + name;
+}
+
+TEST(FileIoTest, FileContentsMatchesReadFile) {
+  std::vector<uint8_t> bytes(100003);
+  for (size_t i = 0; i < bytes.size(); i++) {
+    bytes[i] = static_cast<uint8_t>(i * 7 + (i >> 8));
+  }
+  const std::string pathname = TempPath("contents");
+  ASSERT_TRUE(WriteFile(bytes, pathname));
+
+  FileContents contents;
+  ASSERT_TRUE(contents.Open(pathname));
+#ifndef _WIN32
+  EXPECT_TRUE(contents.mapped());
+#endif
+  std::vector<uint8_t> read;
+  ASSERT_TRUE(ReadFile(pathname, &read));
+  ASSERT_EQ(read.size(), contents.size());
+  EXPECT_EQ(read, std::vector<uint8_t>(contents.data(),
+                                       contents.data() + contents.size()));
+
+  // Opening another file releases the previous one.
+  const std::string empty_pathname = TempPath("empty");
+  ASSERT_TRUE(WriteFile(std::vector<uint8_t>(), empty_pathname));
+  ASSERT_TRUE(contents.Open(empty_pathname));
+  EXPECT_FALSE(contents.mapped());
+  EXPECT_TRUE(contents.empty());
+
+  remove(pathname.c_str());
+  remove(empty_pathname.c_str());
+}
+
+TEST(FileIoTest, FileContentsMissingFile) {
+  FileContents contents;
+  EXPECT_FALSE(contents.Open(TempPath("does_not_exist")));
+  EXPECT_TRUE(contents.empty());
+}
+
+}  // namespace
+}  // namespace jxl
@@ -15,7 +15,7 @@
 
 namespace jxl {
 
-void GaborishInverse(Image3F* in_out, float mul, ThreadPool* pool) {
+WeightsSymmetric5 GaborishInverseWeights(float mul) {
   JXL_ASSERT(mul >= 0.0f);
 
   // Only an approximation. One or even two 3x3, and rank-1 (separable) 5x5
@@ -51,6 +51,11 @@ void GaborishInverse(Image3F* in_out, float mul, ThreadPool* pool) {
     weights.D[i] *= normalize;
     weights.L[i] *= normalize;
   }
+  return weights;
+}
+
+void GaborishInverse(Image3F* in_out, float mul, ThreadPool* pool) {
+  const WeightsSymmetric5 weights = GaborishInverseWeights(mul);
 
   // Reduce memory footprint by only allocating a single plane and swapping it
   // into the output Image3F. Better still would be tiling.
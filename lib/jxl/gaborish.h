@@ -12,6 +12,7 @@
 
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/convolve.h"
 #include "lib/jxl/image.h"
 
 namespace jxl {
@@ -21,6 +22,9 @@ namespace jxl {
 // The input is typically in XYB space.
 void GaborishInverse(Image3F* in_out, float mul, ThreadPool* pool);
 
+// Returns the normalized 5x5 kernel applied by GaborishInverse.
+WeightsSymmetric5 GaborishInverseWeights(float mul);
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_GABORISH_H_
@@ -367,10 +367,10 @@ void VerticalStrip(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
   }
 }
 
-// Apply 1D vertical scan to multiple columns (one per vector lane).
-// Not yet parallelized.
+// Apply 1D vertical scan to multiple columns (one per vector lane). The
+// strips of columns are independent, each task scans one of them.
 void FastGaussianVertical(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
-                          const ImageF& in, ThreadPool* /*pool*/,
+                          const ImageF& in, ThreadPool* pool,
                           ImageF* JXL_RESTRICT out) {
   PROFILER_FUNC;
   JXL_CHECK(SameSize(in, *out));
@@ -379,13 +379,21 @@ void FastGaussianVertical(const hwy::AlignedUniquePtr<RecursiveGaussian>& rg,
   constexpr size_t kVN = MaxLanes(HWY_FULL(float)());
   constexpr size_t kCacheLineVectors = kCacheLineLanes / kVN;
 
-  size_t x = 0;
-  for (; x + kCacheLineLanes <= in.xsize(); x += kCacheLineLanes) {
-    VerticalStrip<kCacheLineVectors>(rg, in, x, out);
-  }
-  for (; x < in.xsize(); x += kVN) {
-    VerticalStrip<1>(rg, in, x, out);
-  }
+  // Full cache lines first, then single vectors for the remaining columns.
+  const size_t num_wide = in.xsize() / kCacheLineLanes;
+  const size_t x_narrow = num_wide * kCacheLineLanes;
+  const size_t num_narrow = DivCeil(in.xsize() - x_narrow, kVN);
+  JXL_CHECK(RunOnPool(
+      pool, 0, num_wide + num_narrow, ThreadPool::NoInit,
+      [&](const uint32_t task, size_t /*thread*/) {
+        if (task < num_wide) {
+          VerticalStrip<kCacheLineVectors>(rg, in, task * kCacheLineLanes,
+                                           out);
+        } else {
+          VerticalStrip<1>(rg, in, x_narrow + (task - num_wide) * kVN, out);
+        }
+      },
+      "FastGaussianVertical"));
 }
 
 // TODO(veluca): consider replacing with FastGaussian.
@@ -12,6 +12,7 @@
 #include "gtest/gtest.h"
 #include "lib/extras/time.h"
 #include "lib/jxl/base/printf_macros.h"
+#include "lib/jxl/base/thread_pool_internal.h"
 #include "lib/jxl/convolve.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/image_test_utils.h"
@@ -231,6 +232,24 @@ TEST(GaussBlurTest, TestRandom) {
   TestRandomForSizes(-6.0f, 6.0f, 7.0f);
 }
 
+// The strips of the vertical pass are independent, so the result does not
+// depend on the number of threads.
+TEST(GaussBlurTest, TestPool) {
+  ThreadPoolInternal pool(4);
+  for (size_t xsize : {1, 15, 17, 64, 201}) {
+    ImageF in(xsize, 77);
+    RandomFillImage(&in, -1.0f, 1.0f, 65537 + xsize);
+    const auto rg = CreateRecursiveGaussian(7.0);
+    ImageF temp(xsize, 77);
+    ImageF expected(xsize, 77);
+    ThreadPool* null_pool = nullptr;
+    FastGaussian(rg, in, null_pool, &temp, &expected);
+    ImageF out(xsize, 77);
+    FastGaussian(rg, in, &pool, &temp, &out);
+    VerifyEqual(expected, out);
+  }
+}
+
 TEST(GaussBlurTest, TestSign) {
   const size_t xsize = 500;
   const size_t ysize = 606;
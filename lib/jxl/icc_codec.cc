@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <vector>
@@ -304,6 +305,7 @@ Status ICCReader::Init(BitReader* reader, size_t output_limit) {
     JXL_RETURN_IF_ERROR(
         DecodeHistograms(reader, kNumICCContexts, &code_, &context_map_));
     ans_reader_ = ANSSymbolReader(&code_, reader);
+    ICCANSContextKinds(kinds1_, kinds2_);
     i_ = 0;
     decompressed_.resize(std::min<size_t>(i_ + 0x400, enc_size_));
     for (; i_ < std::min<size_t>(2, enc_size_); i_++) {
@@ -348,8 +350,9 @@ Status ICCReader::Process(BitReader* reader, PaddedBytes* icc) {
     }
     return Status(true);
   };
-  for (; i_ < enc_size_; i_++) {
-    if (i_ % ANSSymbolReader::kMaxCheckpointInterval == 0 && i_ > 0) {
+  constexpr size_t kInterval = ANSSymbolReader::kMaxCheckpointInterval;
+  while (i_ < enc_size_) {
+    if (i_ % kInterval == 0 && i_ > 0) {
       JXL_RETURN_IF_ERROR(check_and_restore());
       save();
       if ((i_ > 0) && (((i_ & 0xFFFF) == 0))) {
@@ -360,9 +363,13 @@ Status ICCReader::Process(BitReader* reader, PaddedBytes* icc) {
       decompressed_.resize(std::min<size_t>(i_ + 0x400, enc_size_));
     }
     JXL_DASSERT(i_ >= 2);
-    decompressed_[i_] = ans_reader_.ReadHybridUint(
-        ICCANSContext(i_, decompressed_[i_ - 1], decompressed_[i_ - 2]), reader,
-        context_map_);
+    const size_t end = std::min<size_t>(enc_size_, (i_ / kInterval + 1) *
+                                                       kInterval);
+    if (ans_reader_.UsesLZ77()) {
+      DecodeBytes</*uses_lz77=*/true>(reader, end);
+    } else {
+      DecodeBytes</*uses_lz77=*/false>(reader, end);
+    }
   }
   JXL_RETURN_IF_ERROR(check_and_restore());
   bits_to_skip_ = reader->TotalBitsConsumed() - used_bits_base_;
@@ -374,6 +381,32 @@ Status ICCReader::Process(BitReader* reader, PaddedBytes* icc) {
   return UnpredictICC(decompressed_.data(), decompressed_.size(), icc);
 }
 
+template <bool uses_lz77>
+void ICCReader::DecodeBytes(BitReader* reader, size_t end) {
+  uint8_t* JXL_RESTRICT bytes = decompressed_.data();
+  // Same contexts as ICCANSContext, from tables of the cluster of the first
+  // bytes and of the kinds of the previous bytes.
+  const size_t first_cluster = context_map_[0];
+  const uint8_t* JXL_RESTRICT context_map = context_map_.data();
+  uint32_t copied[ANSSymbolReader::kMaxCheckpointInterval];
+  while (i_ < end) {
+    if (uses_lz77) {
+      // LZ77 copies do not depend on the context.
+      const size_t num = ans_reader_.ReadCopiedValues(end - i_, copied);
+      for (size_t k = 0; k < num; k++) bytes[i_ + k] = copied[k];
+      i_ += num;
+      if (i_ == end) break;
+    }
+    const size_t cluster =
+        i_ <= 128 ? first_cluster
+                  : context_map[1 + kinds1_[bytes[i_ - 1]] +
+                                kinds2_[bytes[i_ - 2]]];
+    bytes[i_] =
+        ans_reader_.ReadHybridUintClusteredInlined<uses_lz77>(cluster, reader);
+    i_++;
+  }
+}
+
 Status ICCReader::CheckEOI(BitReader* reader) {
   if (reader->AllReadsWithinBounds()) return true;
   return JXL_STATUS(StatusCode::kNotEnoughBytes,
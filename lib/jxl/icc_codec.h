@@ -36,6 +36,9 @@ struct ICCReader {
 
  private:
   Status CheckEOI(BitReader* reader);
+  // Decodes the bytes up to `end`, within one checkpoint interval.
+  template <bool uses_lz77>
+  void DecodeBytes(BitReader* reader, size_t end);
   size_t i_ = 0;
   size_t bits_to_skip_ = 0;
   size_t used_bits_base_ = 0;
@@ -44,6 +47,9 @@ struct ICCReader {
   ANSCode code_;
   ANSSymbolReader ans_reader_;
   PaddedBytes decompressed_;
+  // Terms of ICCANSContext, see ICCANSContextKinds.
+  uint8_t kinds1_[256];
+  uint8_t kinds2_[256];
 };
 
 // `icc` may be empty afterwards - if so, call CreateProfile. Does not append,
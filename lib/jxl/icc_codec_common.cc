@@ -189,4 +189,11 @@ size_t ICCANSContext(size_t i, size_t b1, size_t b2) {
   return 1 + ByteKind1(b1) + ByteKind2(b2) * 8;
 }
 
+void ICCANSContextKinds(uint8_t kinds1[256], uint8_t kinds2[256]) {
+  for (size_t b = 0; b < 256; b++) {
+    kinds1[b] = ByteKind1(b);
+    kinds2[b] = ByteKind2(b) * 8;
+  }
+}
+
 }  // namespace jxl
@@ -100,6 +100,9 @@ void ICCPredictHeader(const uint8_t* icc, size_t size, uint8_t* header,
 uint8_t LinearPredictICCValue(const uint8_t* data, size_t start, size_t i,
                               size_t stride, size_t width, int order);
 size_t ICCANSContext(size_t i, size_t b1, size_t b2);
+// Fills the two terms of ICCANSContext for i > 128 in terms of the previous
+// bytes, which is then 1 + kinds1[b1] + kinds2[b2].
+void ICCANSContextKinds(uint8_t kinds1[256], uint8_t kinds2[256]);
 
 }  // namespace jxl
 
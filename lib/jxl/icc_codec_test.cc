@@ -189,6 +189,23 @@ static const unsigned char kEncodedTestProfile[] = {
 };
 
 // Tests that the decoded kEncodedTestProfile matches kTestProfile.
+// Large enough for many checkpoint intervals and LZ77, with the repetitive
+// content of the lookup tables of printer profiles.
+TEST(IccCodecTest, LargeProfile) {
+  PaddedBytes profile;
+  profile.append(kTestProfile, kTestProfile + sizeof(kTestProfile));
+  uint32_t state = 1;
+  for (size_t i = 0; profile.size() < 300000; i++) {
+    state = state * 1103515245 + 12345;
+    const uint8_t value = state >> 24;
+    const size_t run = (i % 7 == 0) ? 64 : 1;
+    for (size_t j = 0; j < run; j++) {
+      profile.push_back(j % 2 ? value : i & 0xFF);
+    }
+  }
+  TestProfile(profile);
+}
+
 TEST(IccCodecTest, EncodedIccProfile) {
   jxl::BitReader reader(jxl::Span<const uint8_t>(kEncodedTestProfile,
                                                  sizeof(kEncodedTestProfile)));
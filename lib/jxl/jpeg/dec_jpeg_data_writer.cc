@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h> /* for memset, memcpy */
 
+#include <algorithm>
 #include <deque>
 #include <string>
 #include <vector>
@@ -34,6 +35,10 @@ const int kJpegPrecision = 8;
 // JpegBitWriter: buffer size
 const size_t kJpegBitWriterChunkSize = 16384;
 
+// DoEncodeScan returns after an MCU row once this many chunks are queued, so
+// that they can be written out before the rest of the scan is encoded.
+const size_t kMaxQueuedScanChunks = 4;
+
 // DCTCodingState: maximum number of correction bits to buffer
 const int kJPEGMaxCorrectionBits = 1u << 16;
 
@@ -658,6 +663,125 @@ bool EncodeRefinementBits(const coeff_t* coeffs,
   return true;
 }
 
+// Restart intervals of a sequential scan are encoded in tasks of at least this
+// many MCUs, to bound the number of (partially filled) output chunks.
+const int kMinMCUsPerTask = 4096;
+
+// Encodes the restart intervals [first_interval, end_interval) of the
+// sequential scan, each but the first starting with its restart marker. The
+// entropy coder state is reset at each restart marker, so the ranges of
+// intervals are independent of each other as long as the padding bits are all
+// ones. Returns false on error.
+bool EncodeRestartIntervals(const JPEGData& jpg, const JPEGScanInfo& scan_info,
+                            const SerializationState& state,
+                            int restart_interval, int MCUs_per_row,
+                            int num_mcus, int first_interval,
+                            int end_interval,
+                            std::deque<OutputChunk>* output) {
+  const bool is_interleaved = (scan_info.num_components > 1);
+  int blocks_per_mcu = 0;
+  for (size_t i = 0; i < scan_info.num_components; ++i) {
+    const JPEGComponent& c = jpg.components[scan_info.components[i].comp_idx];
+    blocks_per_mcu +=
+        is_interleaved ? c.v_samp_factor * c.h_samp_factor : 1;
+  }
+  const int first_mcu = first_interval * restart_interval;
+  const int end_mcu = std::min(end_interval * restart_interval, num_mcus);
+  int block_scan_index = first_mcu * blocks_per_mcu;
+  const std::vector<JPEGScanInfo::ExtraZeroRunInfo>& extra_zero_runs =
+      scan_info.extra_zero_runs;
+  size_t extra_zero_runs_pos =
+      std::lower_bound(extra_zero_runs.begin(), extra_zero_runs.end(),
+                       block_scan_index,
+                       [](const JPEGScanInfo::ExtraZeroRunInfo& run, int idx) {
+                         return static_cast<int>(run.block_idx) < idx;
+                       }) -
+      extra_zero_runs.begin();
+  // Padding with ones.
+  const uint8_t* pad_bits = nullptr;
+
+  JpegBitWriter bw;
+  JpegBitWriterInit(&bw, output);
+  coeff_t last_dc_coeff[kMaxComponents];
+  for (int mcu = first_mcu; mcu < end_mcu; ++mcu) {
+    if (mcu % restart_interval == 0) {
+      const int interval = mcu / restart_interval;
+      if (interval > 0) EmitMarker(&bw, 0xD0 + ((interval - 1) & 0x7));
+      memset(last_dc_coeff, 0, sizeof(last_dc_coeff));
+    }
+    const int mcu_y = mcu / MCUs_per_row;
+    const int mcu_x = mcu % MCUs_per_row;
+    for (size_t i = 0; i < scan_info.num_components; ++i) {
+      const JPEGComponentScanInfo& si = scan_info.components[i];
+      const JPEGComponent& c = jpg.components[si.comp_idx];
+      const HuffmanCodeTable& dc_huff = state.dc_huff_table[si.dc_tbl_idx];
+      const HuffmanCodeTable& ac_huff = state.ac_huff_table[si.ac_tbl_idx];
+      int n_blocks_y = is_interleaved ? c.v_samp_factor : 1;
+      int n_blocks_x = is_interleaved ? c.h_samp_factor : 1;
+      for (int iy = 0; iy < n_blocks_y; ++iy) {
+        for (int ix = 0; ix < n_blocks_x; ++ix) {
+          int block_y = mcu_y * n_blocks_y + iy;
+          int block_x = mcu_x * n_blocks_x + ix;
+          int block_idx = block_y * c.width_in_blocks + block_x;
+          int num_zero_runs = 0;
+          if (extra_zero_runs_pos < extra_zero_runs.size() &&
+              static_cast<int>(extra_zero_runs[extra_zero_runs_pos]
+                                   .block_idx) == block_scan_index) {
+            num_zero_runs =
+                extra_zero_runs[extra_zero_runs_pos].num_extra_zero_runs;
+            ++extra_zero_runs_pos;
+          }
+          const coeff_t* coeffs = &c.coeffs[block_idx << 6];
+          if (!EncodeDCTBlockSequential(coeffs, dc_huff, ac_huff,
+                                        num_zero_runs,
+                                        last_dc_coeff + si.comp_idx, &bw)) {
+            return false;
+          }
+          ++block_scan_index;
+        }
+      }
+    }
+    if ((mcu + 1) % restart_interval == 0 || mcu + 1 == end_mcu) {
+      if (!JumpToByteBoundary(&bw, &pad_bits, nullptr)) return false;
+    }
+  }
+  JpegBitWriterFinish(&bw);
+  return bw.healthy;
+}
+
+// Encodes the MCUs of a sequential scan with restart intervals on the thread
+// pool, appending the output of each range of intervals in order.
+SerializationStatus EncodeRestartIntervalsParallel(
+    const JPEGData& jpg, const JPEGScanInfo& scan_info,
+    SerializationState* state, int restart_interval, int MCUs_per_row,
+    int num_mcus) {
+  const int num_intervals = DivCeil(num_mcus, restart_interval);
+  const int intervals_per_task =
+      std::max(1, kMinMCUsPerTask / restart_interval);
+  const int num_tasks = DivCeil(num_intervals, intervals_per_task);
+  std::vector<std::deque<OutputChunk>> outputs(num_tasks);
+  std::vector<char> ok(num_tasks, 0);
+  const auto encode = [&](const uint32_t task, size_t /* thread */) {
+    const int first_interval = task * intervals_per_task;
+    const int end_interval =
+        std::min(first_interval + intervals_per_task, num_intervals);
+    ok[task] = EncodeRestartIntervals(
+        jpg, scan_info, *state, restart_interval, MCUs_per_row, num_mcus,
+        first_interval, end_interval, &outputs[task]);
+  };
+  if (!RunOnPool(state->pool, 0, num_tasks, ThreadPool::NoInit, encode,
+                 "EncodeRestartIntervals")) {
+    return SerializationStatus::ERROR;
+  }
+  for (int task = 0; task < num_tasks; ++task) {
+    if (!ok[task]) return SerializationStatus::ERROR;
+    for (OutputChunk& chunk : outputs[task]) {
+      state->output_queue.emplace_back(std::move(chunk));
+    }
+  }
+  return SerializationStatus::DONE;
+}
+
 template <int kMode>
 SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
                                               SerializationState* state) {
@@ -685,6 +809,19 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
 
   if (ss.stage == EncodeScanState::HEAD) {
     if (!EncodeSOS(jpg, scan_info, state)) return SerializationStatus::ERROR;
+    int MCUs_per_row = 0;
+    int MCU_rows = 0;
+    jpg.CalculateMcuSize(scan_info, &MCUs_per_row, &MCU_rows);
+    const int num_mcus = MCUs_per_row * MCU_rows;
+    // The padding bits of each restart interval depend on the previous ones,
+    // unless they are all ones.
+    if (kMode == 0 && state->pool != nullptr && restart_interval > 0 &&
+        num_mcus > restart_interval && state->pad_bits == nullptr) {
+      SerializationStatus status = EncodeRestartIntervalsParallel(
+          jpg, scan_info, state, restart_interval, MCUs_per_row, num_mcus);
+      if (status == SerializationStatus::DONE) state->scan_index++;
+      return status;
+    }
     JpegBitWriterInit(&ss.bw, &state->output_queue);
     DCTCodingStateInit(&ss.coding_state);
     ss.restarts_to_go = restart_interval;
@@ -795,6 +932,12 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
       }
       --ss.restarts_to_go;
     }
+    if (state->output_queue.size() >= kMaxQueuedScanChunks &&
+        ss.mcu_y + 1 < last_mcu_y) {
+      // Continue with the next MCU row once the output is written.
+      ++ss.mcu_y;
+      return SerializationStatus::NEEDS_MORE_OUTPUT;
+    }
   }
   if (ss.mcu_y < MCU_rows) {
     if (!bw->healthy) return SerializationStatus::ERROR;
@@ -901,30 +1044,40 @@ SerializationStatus SerializeSection(uint8_t marker, SerializationState* state,
 
 }  // namespace
 
-// TODO(veluca): add streaming support again.
-Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out) {
+Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out,
+                 ThreadPool* pool) {
   SerializationState ss;
+  ss.pool = pool;
+  JXL_RETURN_IF_ERROR(ContinueWriteJpeg(jpg, out, &ss));
+  if (ss.stage != SerializationState::DONE) {
+    return StatusMessage(Status(StatusCode::kNotEnoughBytes),
+                         "Failed to write output");
+  }
+  return true;
+}
+
+Status ContinueWriteJpeg(const JPEGData& jpg, const JPEGOutput& out,
+                         SerializationState* state) {
+  SerializationState& ss = *state;
 
-  size_t written = 0;
-  const auto maybe_push_output = [&]() -> Status {
+  // Returns false if out didn't take all the queued output.
+  const auto maybe_push_output = [&]() -> bool {
     if (ss.stage != SerializationState::ERROR) {
       while (!ss.output_queue.empty()) {
         auto& chunk = ss.output_queue.front();
-        size_t num_written = out(chunk.next, chunk.len);
-        if (num_written == 0 && chunk.len > 0) {
-          return StatusMessage(Status(StatusCode::kNotEnoughBytes),
-                               "Failed to write output");
-        }
+        size_t num_written = chunk.len == 0 ? 0 : out(chunk.next, chunk.len);
+        chunk.next += num_written;
         chunk.len -= num_written;
-        written += num_written;
-        if (chunk.len == 0) {
-          ss.output_queue.pop_front();
-        }
+        if (chunk.len != 0) return false;
+        ss.output_queue.pop_front();
       }
     }
     return true;
   };
 
+  // Output left over from the previous call.
+  if (!maybe_push_output()) return true;
+
   while (true) {
     switch (ss.stage) {
       case SerializationState::INIT: {
@@ -944,8 +1097,8 @@ Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out) {
         }
 
         EncodeSOI(&ss);
-        JXL_QUIET_RETURN_IF_ERROR(maybe_push_output());
         ss.stage = SerializationState::SERIALIZE_SECTION;
+        if (!maybe_push_output()) return true;
         break;
       }
 
@@ -961,15 +1114,18 @@ Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out) {
           ss.stage = SerializationState::ERROR;
           break;
         }
-        JXL_QUIET_RETURN_IF_ERROR(maybe_push_output());
         if (status == SerializationStatus::NEEDS_MORE_INPUT) {
           return JXL_FAILURE("Incomplete serialization data");
-        } else if (status != SerializationStatus::DONE) {
+        } else if (status == SerializationStatus::DONE) {
+          ++ss.section_index;
+        } else if (status != SerializationStatus::NEEDS_MORE_OUTPUT) {
           JXL_DASSERT(false);
           ss.stage = SerializationState::ERROR;
           break;
         }
-        ++ss.section_index;
+        // A scan returns before its end to let its output be written, and is
+        // then continued.
+        if (!maybe_push_output()) return true;
         break;
       }
 
@@ -13,7 +13,9 @@
 
 #include <functional>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/codec_in_out.h"
+#include "lib/jxl/jpeg/dec_jpeg_serialization_state.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 
 namespace jxl {
@@ -23,7 +25,17 @@ namespace jpeg {
 // written.
 using JPEGOutput = std::function<size_t(const uint8_t* buf, size_t len)>;
 
-Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out);
+// If pool is not null, the restart intervals of sequential scans are encoded
+// in parallel on it.
+Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out,
+                 ThreadPool* pool = nullptr);
+
+// Writes the JPEG like WriteJpeg, but stops as soon as out takes fewer bytes
+// than given, and continues from there when called again with the same state.
+// The JPEG is fully written once state->stage is SerializationState::DONE.
+// jpg must be kept alive until then, the queued output may point into it.
+Status ContinueWriteJpeg(const JPEGData& jpg, const JPEGOutput& out,
+                         SerializationState* state);
 
 // Reconstructs the JPEG from the coefficients and metadata in CodecInOut.
 Status EncodeImageJPGCoefficients(const CodecInOut* io, PaddedBytes* bytes);
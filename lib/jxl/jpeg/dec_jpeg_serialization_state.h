@@ -9,6 +9,7 @@
 #include <deque>
 #include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/jpeg/dec_jpeg_output_chunk.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 
@@ -85,6 +86,8 @@ struct SerializationState {
   const uint8_t* pad_bits_end = nullptr;
   bool seen_dri_marker = false;
   bool is_progressive = false;
+  // Not owned, may be null.
+  ThreadPool* pool = nullptr;
 
   EncodeScanState scan_state;
 };
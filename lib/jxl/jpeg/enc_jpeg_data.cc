@@ -296,7 +296,8 @@ Status EncodeJPEGData(JPEGData& jpeg_data, PaddedBytes* bytes,
   return true;
 }
 
-Status DecodeImageJPG(const Span<const uint8_t> bytes, CodecInOut* io) {
+Status DecodeImageJPGCoefficients(const Span<const uint8_t> bytes,
+                                  CodecInOut* io) {
   if (!IsJPG(bytes)) return false;
   io->frames.clear();
   io->frames.reserve(1);
@@ -371,9 +372,17 @@ Status DecodeImageJPG(const Span<const uint8_t> bytes, CodecInOut* io) {
 
   io->metadata.m.SetIntensityTarget(kDefaultIntensityTarget);
   io->metadata.m.SetUintSamples(BITS_IN_JSAMPLE);
+  io->Main().OverrideProfile(io->metadata.m.color_encoding);
+  io->SetSize(jpeg_data->width, jpeg_data->height);
+  SetIntensityTarget(io);
+  return true;
+}
+
+Status DecodeImageJPG(const Span<const uint8_t> bytes, CodecInOut* io) {
+  JXL_RETURN_IF_ERROR(DecodeImageJPGCoefficients(bytes, io));
+  jpeg::JPEGData* jpeg_data = io->Main().jpeg_data.get();
   io->SetFromImage(Image3F(jpeg_data->width, jpeg_data->height),
                    io->metadata.m.color_encoding);
-  SetIntensityTarget(io);
   return true;
 }
 
@@ -25,6 +25,12 @@ Status SetColorEncodingFromJpegData(const jpeg::JPEGData& jpg,
  */
 Status DecodeImageJPG(Span<const uint8_t> bytes, CodecInOut* io);
 
+/**
+ * Same as DecodeImageJPG, but does not allocate the (unused) full-size color
+ * image of the main frame, only its color encoding is set.
+ */
+Status DecodeImageJPGCoefficients(Span<const uint8_t> bytes, CodecInOut* io);
+
 }  // namespace jpeg
 }  // namespace jxl
 
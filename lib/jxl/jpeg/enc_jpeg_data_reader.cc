@@ -12,6 +12,8 @@
 #include <string>
 #include <vector>
 
+#include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"
@@ -459,8 +461,27 @@ struct BitReaderState {
     return c;
   }
 
-  void FillBitWindow() {
+  // After this call at least 57 bits are available in the window, so a
+  // Huffman symbol (at most 16 bits) followed by its extra bits (at most 15
+  // bits) can always be read with a single refill.
+  JXL_INLINE void FillBitWindow() {
     if (bits_left_ <= 16) {
+      if (JXL_LIKELY(pos_ + 8 <= next_marker_pos_)) {
+        // Fast path: take the input bytes in one 64-bit load if none of them
+        // is 0xff, i.e. there is neither an escape sequence nor a marker.
+        const uint64_t word = LoadBE64(data_ + pos_);
+        const uint64_t inv = ~word;
+        if (((inv - 0x0101010101010101ULL) & ~inv & 0x8080808080808080ULL) ==
+            0) {
+          const int nbytes = (64 - bits_left_) >> 3;
+          val_ = nbytes == 8 ? word
+                             : (val_ << (nbytes * 8)) |
+                                   (word >> (64 - nbytes * 8));
+          pos_ += nbytes;
+          bits_left_ += nbytes * 8;
+          return;
+        }
+      }
       while (bits_left_ <= 56) {
         val_ <<= 8;
         val_ |= (uint64_t)GetNextByte();
@@ -471,6 +492,13 @@ struct BitReaderState {
 
   int ReadBits(int nbits) {
     FillBitWindow();
+    return ReadBitsNoRefill(nbits);
+  }
+
+  // Reads nbits without refilling the bit window; the caller must make sure
+  // that enough bits are available (see FillBitWindow).
+  JXL_INLINE int ReadBitsNoRefill(int nbits) {
+    JXL_DASSERT(nbits <= bits_left_);
     uint64_t val = (val_ >> (bits_left_ - nbits)) & ((1ULL << nbits) - 1);
     bits_left_ -= nbits;
     return val;
@@ -520,14 +548,17 @@ struct BitReaderState {
   size_t next_marker_pos_;
 };
 
-// Returns the next Huffman-coded symbol.
-int ReadSymbol(const HuffmanTableEntry* table, BitReaderState* br) {
+// Returns the next Huffman-coded symbol. At least 41 bits are left in the bit
+// window afterwards, enough for the extra bits of the symbol.
+JXL_INLINE int ReadSymbol(const HuffmanTableEntry* table, BitReaderState* br) {
   int nbits;
   br->FillBitWindow();
   int val = (br->val_ >> (br->bits_left_ - 8)) & 0xff;
   table += val;
   nbits = table->bits - 8;
-  if (nbits > 0) {
+  // Codes of length at most kJpegHuffmanRootTableBits, which cover the vast
+  // majority of symbols in practice, are resolved by the root table alone.
+  if (JXL_UNLIKELY(nbits > 0)) {
     br->bits_left_ -= 8;
     table += table->value;
     val = (br->val_ >> (br->bits_left_ - nbits)) & ((1 << nbits) - 1);
@@ -596,7 +627,7 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
     }
     int diff = 0;
     if (s > 0) {
-      int bits = br->ReadBits(s);
+      int bits = br->ReadBitsNoRefill(s);
       diff = HuffExtend(bits, s);
     }
     int coeff = diff + *last_dc_coeff;
@@ -642,7 +673,7 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
         jpg->error = JPEGReadError::NON_REPRESENTABLE_AC_COEFF;
         return false;
       }
-      int bits = br->ReadBits(s);
+      int bits = br->ReadBitsNoRefill(s);
       int coeff = HuffExtend(bits, s);
       coeffs[kJPEGNaturalOrder[k]] = coeff * Am;
       *num_zero_runs = 0;
@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <array>
 #include <string>
@@ -26,6 +27,7 @@
 #include "lib/jxl/color_management.h"
 #include "lib/jxl/dec_file.h"
 #include "lib/jxl/dec_params.h"
+#include "lib/jxl/enc_animation.h"
 #include "lib/jxl/enc_butteraugli_comparator.h"
 #include "lib/jxl/enc_butteraugli_pnorm.h"
 #include "lib/jxl/enc_cache.h"
@@ -97,6 +99,41 @@ TEST(JxlTest, RoundtripSinglePixel) {
   Roundtrip(&io, cparams, dparams, pool, &io2);
 }
 
+TEST(JxlTest, ClassifyContentKeepsExplicitVarDCT) {
+  Image3F image(256, 256);
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < image.ysize(); y++) {
+      float* JXL_RESTRICT row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < image.xsize(); x++) {
+        row[x] = (((x / 16) + (y / 16) * (c + 1)) % 4) / 3.0f;
+      }
+    }
+  }
+  CodecInOut io;
+  io.metadata.m.SetUintSamples(8);
+  io.metadata.m.color_encoding = ColorEncoding::SRGB();
+  io.SetFromImage(std::move(image), io.metadata.m.color_encoding);
+
+  CompressParams cparams;
+  cparams.classify_content = true;
+  DecompressParams dparams;
+  ThreadPool* pool = nullptr;
+  {
+    CodecInOut io2;
+    AuxOut aux_out;
+    Roundtrip(&io, cparams, dparams, pool, &io2, &aux_out);
+    EXPECT_TRUE(aux_out.content_classified);
+    EXPECT_EQ(ContentClass::kFewColors, aux_out.content.content_class);
+  }
+  {
+    cparams.explicit_vardct = true;
+    CodecInOut io2;
+    AuxOut aux_out;
+    Roundtrip(&io, cparams, dparams, pool, &io2, &aux_out);
+    EXPECT_FALSE(aux_out.content_classified);
+  }
+}
+
 // Changing serialized signature causes Decode to fail.
 #ifndef JXL_CRASH_ON_ERROR
 TEST(JxlTest, RoundtripMarker) {
@@ -495,6 +532,125 @@ TEST(JxlTest, RoundtripLargeConsistent) {
   EXPECT_EQ(dist2, dist3);
 }
 
+// Encoding at several distances with a shared analysis gives the same
+// codestreams as separate encodes.
+TEST(JxlTest, EncodeAtDistancesMatchesSeparateEncodes) {
+  ThreadPoolInternal pool(4);
+  const PaddedBytes orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io;
+  ASSERT_TRUE(SetFromBytes(Span<const uint8_t>(orig), &io, &pool));
+  io.ShrinkTo(200, 136);
+  const std::vector<float> distances = {1.0f, 2.5f, 6.0f};
+
+  // Kitten also reuses the linear image of the butteraugli search.
+  for (SpeedTier speed_tier : {SpeedTier::kSquirrel, SpeedTier::kKitten}) {
+    CompressParams cparams;
+    cparams.speed_tier = speed_tier;
+    std::vector<PaddedBytes> compressed;
+    ASSERT_TRUE(EncodeFileAtDistances(cparams, &io, distances, &compressed,
+                                      GetJxlCms(), &pool));
+    ASSERT_EQ(distances.size(), compressed.size());
+    for (size_t i = 0; i < distances.size(); i++) {
+      cparams.butteraugli_distance = distances[i];
+      PassesEncoderState enc_state;
+      PaddedBytes expected;
+      ASSERT_TRUE(EncodeFile(cparams, &io, &enc_state, &expected, GetJxlCms(),
+                             /*aux_out=*/nullptr, &pool));
+      ASSERT_EQ(expected.size(), compressed[i].size());
+      EXPECT_EQ(0, memcmp(expected.data(), compressed[i].data(),
+                          expected.size()));
+      if (i > 0) {
+        EXPECT_LT(compressed[i].size(), compressed[i - 1].size());
+      }
+    }
+  }
+}
+
+TEST(JxlTest, ImportanceMap) {
+  ThreadPoolInternal pool(4);
+  const PaddedBytes orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io;
+  ASSERT_TRUE(SetFromBytes(Span<const uint8_t>(orig), &io, &pool));
+  io.ShrinkTo(200, 136);
+
+  CompressParams cparams;
+  cparams.speed_tier = SpeedTier::kKitten;
+  PassesEncoderState enc_state;
+  PaddedBytes expected;
+  ASSERT_TRUE(EncodeFile(cparams, &io, &enc_state, &expected, GetJxlCms(),
+                         /*aux_out=*/nullptr, &pool));
+
+  // A map where every block is important does not change the encoding.
+  ImageF importance(DivCeil(io.xsize(), kBlockDim),
+                    DivCeil(io.ysize(), kBlockDim));
+  FillImage(1.0f, &importance);
+  cparams.importance_map = &importance;
+  PaddedBytes compressed;
+  ASSERT_TRUE(EncodeFile(cparams, &io, &enc_state, &compressed, GetJxlCms(),
+                         /*aux_out=*/nullptr, &pool));
+  ASSERT_EQ(expected.size(), compressed.size());
+  EXPECT_EQ(0, memcmp(expected.data(), compressed.data(), expected.size()));
+
+  // Without important blocks, there are only DCT8 blocks.
+  ZeroFillImage(&importance);
+  AuxOut aux_out;
+  ASSERT_TRUE(EncodeFile(cparams, &io, &enc_state, &compressed, GetJxlCms(),
+                         &aux_out, &pool));
+  EXPECT_EQ(importance.xsize() * importance.ysize(), aux_out.num_dct8_blocks);
+  DecompressParams dparams;
+  CodecInOut io2;
+  ASSERT_TRUE(DecodeFile(dparams, compressed, &io2, &pool));
+  EXPECT_LE(ButteraugliDistance(io, io2, cparams.ba_params, GetJxlCms(),
+                                /*distmap=*/nullptr, &pool),
+            2.5f);
+
+  // The map must have one value per block.
+  ImageF wrong_size(3, 3);
+  cparams.importance_map = &wrong_size;
+  EXPECT_FALSE(EncodeFile(cparams, &io, &enc_state, &compressed, GetJxlCms(),
+                          /*aux_out=*/nullptr, &pool));
+}
+
+TEST(JxlTest, EncodeAtSizes) {
+  ThreadPoolInternal pool(4);
+  const PaddedBytes orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io;
+  ASSERT_TRUE(SetFromBytes(Span<const uint8_t>(orig), &io, &pool));
+  io.ShrinkTo(200, 136);
+  const std::vector<size_t> xsizes = {200, 100, 37};
+
+  CompressParams cparams;
+  std::vector<PaddedBytes> compressed;
+  ASSERT_TRUE(EncodeFileAtSizes(cparams, &io, xsizes, &compressed, GetJxlCms(),
+                                &pool));
+  ASSERT_EQ(xsizes.size(), compressed.size());
+
+  // The full size is the same as a separate encode.
+  PassesEncoderState enc_state;
+  PaddedBytes expected;
+  ASSERT_TRUE(EncodeFile(cparams, &io, &enc_state, &expected, GetJxlCms(),
+                         /*aux_out=*/nullptr, &pool));
+  ASSERT_EQ(expected.size(), compressed[0].size());
+  EXPECT_EQ(0,
+            memcmp(expected.data(), compressed[0].data(), expected.size()));
+
+  const size_t ysizes[3] = {136, 68, 25};
+  for (size_t i = 0; i < xsizes.size(); i++) {
+    DecompressParams dparams;
+    CodecInOut io2;
+    ASSERT_TRUE(DecodeFile(dparams, compressed[i], &io2, &pool));
+    EXPECT_EQ(xsizes[i], io2.xsize());
+    EXPECT_EQ(ysizes[i], io2.ysize());
+    if (i > 0) {
+      EXPECT_LT(compressed[i].size(), compressed[i - 1].size());
+    }
+  }
+
+  // Sizes must not increase.
+  EXPECT_FALSE(EncodeFileAtSizes(cparams, &io, {100, 200}, &compressed,
+                                 GetJxlCms(), &pool));
+}
+
 #if JXL_TEST_NL
 
 TEST(JxlTest, RoundtripSmallNL) {
@@ -974,6 +1130,38 @@ TEST(JxlTest, RoundtripAlpha16) {
               IsSlightlyBelow(0.8));
 }
 
+TEST(JxlTest, RoundtripAlphaFewValues) {
+  ThreadPoolInternal pool(4);
+
+  // Wider than 512 pixels, so that the mask spans multiple groups.
+  size_t xsize = 600, ysize = 300;
+  Image3F color(xsize, ysize);
+  ImageF alpha(xsize, ysize);
+  for (size_t y = 0; y < ysize; y++) {
+    for (size_t x = 0; x < xsize; x++) {
+      color.PlaneRow(0, y)[x] = x * 1.0f / xsize;
+      color.PlaneRow(1, y)[x] = y * 1.0f / ysize;
+      color.PlaneRow(2, y)[x] = 0.5f;
+      const int dx = static_cast<int>(x) - 300, dy = static_cast<int>(y) - 150;
+      alpha.Row(y)[x] = dx * dx + dy * dy < 120 * 120 ? 1.0f : 0.0f;
+    }
+  }
+  CodecInOut io;
+  io.metadata.m.SetAlphaBits(8);
+  io.metadata.m.color_encoding = ColorEncoding::SRGB();
+  io.SetFromImage(std::move(color), io.metadata.m.color_encoding);
+  io.Main().SetAlpha(std::move(alpha), /*alpha_is_premultiplied=*/false);
+
+  CompressParams cparams;
+  cparams.butteraugli_distance = 1.0;
+  DecompressParams dparams;
+
+  CodecInOut io2;
+  Roundtrip(&io, cparams, dparams, &pool, &io2);
+  // Alpha with few values is encoded losslessly in VarDCT frames.
+  EXPECT_TRUE(SamePixels(*io.Main().alpha(), *io2.Main().alpha()));
+}
+
 namespace {
 CompressParams CParamsForLossless() {
   CompressParams cparams;
@@ -1069,6 +1257,25 @@ TEST(JxlTest, JXL_SLOW_TEST(RoundtripLosslessNoEncoderVeryFastPathGradient)) {
   EXPECT_EQ(ComputeDistance2(io.Main(), io3.Main(), GetJxlCms()), 0.0);
 }
 
+TEST(JxlTest, RoundtripLossless8StaticCodes) {
+  ThreadPoolInternal pool(8);
+  const PaddedBytes orig = ReadTestData(
+      "third_party/wesaturate/500px/tmshre_riaphotographs_srgb8.png");
+  CodecInOut io;
+  ASSERT_TRUE(SetFromBytes(Span<const uint8_t>(orig), &io, &pool));
+
+  for (SpeedTier speed_tier : {SpeedTier::kThunder, SpeedTier::kLightning}) {
+    CompressParams cparams = CParamsForLossless();
+    cparams.speed_tier = speed_tier;
+    cparams.static_codes = Override::kOn;
+    DecompressParams dparams;
+
+    CodecInOut io2;
+    EXPECT_LE(Roundtrip(&io, cparams, dparams, &pool, &io2), 3500000u);
+    EXPECT_EQ(ComputeDistance2(io.Main(), io2.Main(), GetJxlCms()), 0.0);
+  }
+}
+
 TEST(JxlTest, JXL_SLOW_TEST(RoundtripLossless8Falcon)) {
   ThreadPoolInternal pool(8);
   const PaddedBytes orig = ReadTestData(
@@ -1396,6 +1603,70 @@ TEST(JxlTest, RoundtripAnimationPatches) {
 
 #endif  // JPEGXL_ENABLE_GIF
 
+TEST(JxlTest, RoundtripCroppedAnimation) {
+  ThreadPool* pool = nullptr;
+  const size_t xsize = 80;
+  const size_t ysize = 60;
+  CodecInOut io;
+  io.metadata.m.SetUintSamples(8);
+  io.metadata.m.color_encoding = ColorEncoding::SRGB();
+  io.metadata.m.have_animation = true;
+  io.metadata.m.animation.tps_numerator = 10;
+  io.metadata.m.animation.tps_denominator = 1;
+  io.SetSize(xsize, ysize);
+  io.frames.clear();
+  // Frame 1 changes a small region of frame 0, frame 2 is the same as frame
+  // 1 and frame 3 changes everything.
+  std::vector<Image3F> expected;
+  for (size_t i = 0; i < 4; i++) {
+    Image3F color(xsize, ysize);
+    if (i == 0 || i == 3) {
+      for (size_t c = 0; c < 3; c++) {
+        for (size_t y = 0; y < ysize; y++) {
+          float* JXL_RESTRICT row = color.PlaneRow(c, y);
+          for (size_t x = 0; x < xsize; x++) {
+            row[x] = ((x * 7 + y * 13 + c * 31 + i * 101) % 256) / 255.0f;
+          }
+        }
+      }
+    } else {
+      color = CopyImage(expected.back());
+    }
+    if (i == 1) {
+      for (size_t y = 20; y < 26; y++) {
+        for (size_t x = 30; x < 41; x++) color.PlaneRow(1, y)[x] = 0.0f;
+      }
+    }
+    expected.push_back(CopyImage(color));
+    ImageBundle ib(&io.metadata.m);
+    ib.SetFromImage(std::move(color), io.metadata.m.color_encoding);
+    ib.duration = 1;
+    io.frames.push_back(std::move(ib));
+  }
+  ASSERT_TRUE(CropAnimationFrames(&io));
+  ASSERT_EQ(3u, io.frames.size());
+  EXPECT_TRUE(io.frames[0].use_for_next_frame);
+  EXPECT_EQ(30, io.frames[1].origin.x0);
+  EXPECT_EQ(20, io.frames[1].origin.y0);
+  EXPECT_EQ(11u, io.frames[1].xsize());
+  EXPECT_EQ(6u, io.frames[1].ysize());
+  EXPECT_EQ(2u, io.frames[1].duration);
+  EXPECT_EQ(xsize, io.frames[2].xsize());
+  EXPECT_EQ(ysize, io.frames[2].ysize());
+  expected.erase(expected.begin() + 2);
+
+  CompressParams cparams = CParamsForLossless();
+  DecompressParams dparams;
+  CodecInOut io2;
+  Roundtrip(&io, cparams, dparams, pool, &io2);
+  ASSERT_EQ(expected.size(), io2.frames.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(xsize, io2.frames[i].xsize());
+    EXPECT_EQ(ysize, io2.frames[i].ysize());
+    VerifyRelativeError(expected[i], *io2.frames[i].color(), 1e-5f, 0.0f);
+  }
+}
+
 namespace {
 
 jxl::Status DecompressJxlToJPEGForTest(
@@ -54,13 +54,16 @@ void ComputeLehmerCode(const PermutationT* JXL_RESTRICT permutation,
   }
 }
 
-// Decodes the Lehmer code in code[0..n) into permutation[0..n).
+// Decodes the first num_decoded elements of the permutation of n elements
+// whose Lehmer code starts with code[0..num_decoded) into permutation.
 // temp must have 1 << CeilLog2(n) elements but need not be initialized.
 template <typename PermutationT>
-void DecodeLehmerCode(const LehmerT* JXL_RESTRICT code,
-                      uint32_t* JXL_RESTRICT temp, size_t n,
-                      PermutationT* JXL_RESTRICT permutation) {
+void DecodeLehmerCodePrefix(const LehmerT* JXL_RESTRICT code,
+                            uint32_t* JXL_RESTRICT temp, size_t n,
+                            size_t num_decoded,
+                            PermutationT* JXL_RESTRICT permutation) {
   JXL_DASSERT(n != 0);
+  JXL_DASSERT(num_decoded <= n);
   const size_t log2n = CeilLog2Nonzero(n);
   const size_t padded_n = 1ull << log2n;
 
@@ -69,7 +72,7 @@ void DecodeLehmerCode(const LehmerT* JXL_RESTRICT code,
     temp[i] = static_cast<uint32_t>(ValueOfLowest1Bit(i1));
   }
 
-  for (size_t i = 0; i < n; i++) {
+  for (size_t i = 0; i < num_decoded; i++) {
     JXL_DASSERT(code[i] + i < n);
     uint32_t rank = code[i] + 1;
 
@@ -97,6 +100,44 @@ void DecodeLehmerCode(const LehmerT* JXL_RESTRICT code,
   }
 }
 
+// Decodes the Lehmer code in code[0..n) into permutation[0..n).
+// temp must have 1 << CeilLog2(n) elements but need not be initialized.
+template <typename PermutationT>
+void DecodeLehmerCode(const LehmerT* JXL_RESTRICT code,
+                      uint32_t* JXL_RESTRICT temp, size_t n,
+                      PermutationT* JXL_RESTRICT permutation) {
+  DecodeLehmerCodePrefix(code, temp, n, n, permutation);
+}
+
+// Same as above for a code that is zero outside of [skip..end), as in coded
+// coefficient orders: the first skip elements are then the identity, and
+// those from end on are the unused indices in increasing order. Only decodes
+// the elements in between with the order-statistics tree, which takes
+// (end - skip) * logN + N time. temp must have 1 << CeilLog2(n - skip)
+// elements but need not be initialized.
+template <typename PermutationT>
+void DecodeLehmerCode(const LehmerT* JXL_RESTRICT code,
+                      uint32_t* JXL_RESTRICT temp, size_t n, size_t skip,
+                      size_t end, PermutationT* JXL_RESTRICT permutation) {
+  JXL_DASSERT(skip <= end && end <= n);
+  for (size_t i = 0; i < skip; i++) permutation[i] = i;
+  if (end == skip) {
+    for (size_t i = skip; i < n; i++) permutation[i] = i;
+    return;
+  }
+  // The other elements are a permutation of [skip..n).
+  const size_t num = n - skip;
+  DecodeLehmerCodePrefix(code + skip, temp, num, end - skip,
+                         permutation + skip);
+  for (size_t i = 0; i < num; i++) temp[i] = 0;
+  for (size_t i = skip; i < end; i++) temp[permutation[i]] = 1;
+  size_t pos = end;
+  for (size_t i = 0; i < num; i++) {
+    if (!temp[i]) permutation[pos++] = i + skip;
+  }
+  for (size_t i = skip; i < end; i++) permutation[i] += skip;
+}
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_LEHMER_CODE_H_
@@ -63,6 +63,22 @@ void Roundtrip(size_t n, WorkingSet<PermutationT>* ws) {
       EXPECT_EQ(ws->permutation[i], ws->decoded[i]);
     }
   }
+
+  // Codes that are zero outside of [skip, end), as in coefficient orders.
+  for (size_t rep = 0; rep < 3; ++rep) {
+    const size_t skip = rng.UniformU(0, n + 1);
+    const size_t end = rng.UniformU(skip, n + 1);
+    for (size_t i = 0; i < n; ++i) {
+      ws->lehmer[i] = i >= skip && i < end ? rng.UniformU(0, n - i) : 0;
+    }
+    DecodeLehmerCode(ws->lehmer.data(), ws->temp.data(), n,
+                     ws->permutation.data());
+    DecodeLehmerCode(ws->lehmer.data(), ws->temp.data(), n, skip, end,
+                     ws->decoded.data());
+    for (size_t i = 0; i < n; ++i) {
+      EXPECT_EQ(ws->permutation[i], ws->decoded[i]);
+    }
+  }
 }
 
 // Preallocates arrays and tests n = [begin, end).
@@ -0,0 +1,138 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/memory_arena.h"
+
+#include <limits>
+
+#include "lib/jxl/base/status.h"
+
+namespace jxl {
+
+namespace {
+// Alignment of the allocations and of the headers.
+constexpr size_t kArenaAlignment = 16;
+
+size_t RoundUpToAlignment(size_t size) {
+  return (size + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+}
+}  // namespace
+
+// Avoids linker errors in pre-C++17 builds.
+constexpr size_t MemoryArena::kMaxPooledSize;
+constexpr size_t MemoryArena::kBlockSize;
+
+// Stored at the start of each block, followed by the allocations. Each
+// allocation is preceded by a pointer to its block, padded to the alignment.
+struct MemoryArena::Block {
+  size_t size;  // Including this header.
+  size_t used;  // Bytes carved so far, including this header.
+  size_t live;  // Number of allocations not freed yet.
+  bool dedicated;
+};
+
+const size_t MemoryArena::kBlockHeaderSize =
+    RoundUpToAlignment(sizeof(MemoryArena::Block));
+const size_t MemoryArena::kPrefixSize = RoundUpToAlignment(sizeof(void*));
+
+MemoryArena::MemoryArena(const JxlMemoryManager& parent) : parent_(parent) {
+  JXL_ASSERT(parent_.alloc != nullptr && parent_.free != nullptr);
+  memory_manager_.opaque = this;
+  memory_manager_.alloc = &MemoryArena::Alloc;
+  memory_manager_.free = &MemoryArena::Free;
+}
+
+MemoryArena::~MemoryArena() {
+  ReleaseUnused();
+  JXL_DASSERT(current_ == nullptr);
+}
+
+void* MemoryArena::Alloc(void* opaque, size_t size) {
+  return static_cast<MemoryArena*>(opaque)->Allocate(size);
+}
+
+void MemoryArena::Free(void* opaque, void* address) {
+  static_cast<MemoryArena*>(opaque)->Release(address);
+}
+
+MemoryArena::Block* MemoryArena::NewBlock(size_t size, bool dedicated) {
+  Block* block = static_cast<Block*>(parent_.alloc(parent_.opaque, size));
+  if (block == nullptr) return nullptr;
+  block->size = size;
+  block->used = kBlockHeaderSize;
+  block->live = 0;
+  block->dedicated = dedicated;
+  num_blocks_++;
+  return block;
+}
+
+void MemoryArena::FreeBlock(Block* block) {
+  num_blocks_--;
+  parent_.free(parent_.opaque, block);
+}
+
+void* MemoryArena::Allocate(size_t size) {
+  // Avoids overflow of the sizes below.
+  if (size > std::numeric_limits<size_t>::max() / 2) return nullptr;
+  const size_t needed = kPrefixSize + RoundUpToAlignment(size);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Block* block;
+  if (size > kMaxPooledSize) {
+    block = NewBlock(kBlockHeaderSize + needed, /*dedicated=*/true);
+    if (block == nullptr) return nullptr;
+  } else {
+    if (current_ == nullptr || current_->used + needed > current_->size) {
+      // The previous block goes to free_blocks_ when its last allocation is
+      // freed.
+      if (!free_blocks_.empty()) {
+        current_ = free_blocks_.back();
+        free_blocks_.pop_back();
+      } else {
+        current_ = NewBlock(kBlockSize, /*dedicated=*/false);
+        if (current_ == nullptr) return nullptr;
+      }
+    }
+    block = current_;
+  }
+  uint8_t* prefix = reinterpret_cast<uint8_t*>(block) + block->used;
+  block->used += needed;
+  block->live++;
+  *reinterpret_cast<Block**>(prefix) = block;
+  return prefix + kPrefixSize;
+}
+
+void MemoryArena::Release(void* address) {
+  if (address == nullptr) return;
+  Block* block =
+      *reinterpret_cast<Block**>(static_cast<uint8_t*>(address) - kPrefixSize);
+  std::lock_guard<std::mutex> lock(mutex_);
+  JXL_DASSERT(block->live > 0);
+  if (--block->live != 0) return;
+  if (block->dedicated) {
+    FreeBlock(block);
+  } else if (block == current_) {
+    block->used = kBlockHeaderSize;
+  } else {
+    block->used = kBlockHeaderSize;
+    free_blocks_.push_back(block);
+  }
+}
+
+void MemoryArena::ReleaseUnused() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (Block* block : free_blocks_) FreeBlock(block);
+  free_blocks_.clear();
+  if (current_ != nullptr && current_->live == 0) {
+    FreeBlock(current_);
+    current_ = nullptr;
+  }
+}
+
+size_t MemoryArena::NumBlocks() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_blocks_;
+}
+
+}  // namespace jxl
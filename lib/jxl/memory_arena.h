@@ -0,0 +1,74 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_MEMORY_ARENA_H_
+#define LIB_JXL_MEMORY_ARENA_H_
+
+// Arena allocator for the short-lived buffers of a frame.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <vector>
+
+#include "jxl/memory_manager.h"
+
+namespace jxl {
+
+// Memory manager that carves allocations out of large blocks obtained from a
+// parent memory manager. Each block counts its live allocations; once all of
+// them are freed, which for the per-frame buffers happens when the frame is
+// done, the whole block is recycled in one step instead of returning every
+// buffer to the parent. Large allocations get a block of their own. Thread
+// safe; the arena must outlive all the allocations made with it.
+class MemoryArena {
+ public:
+  // Allocations larger than this get a dedicated block.
+  static constexpr size_t kMaxPooledSize = 1 << 19;
+  static constexpr size_t kBlockSize = 1 << 22;
+
+  // The parent memory manager is copied, it must have non-null functions.
+  explicit MemoryArena(const JxlMemoryManager& parent);
+  ~MemoryArena();
+  MemoryArena(const MemoryArena&) = delete;
+  MemoryArena& operator=(const MemoryArena&) = delete;
+
+  // Memory manager allocating from this arena.
+  const JxlMemoryManager* memory_manager() const { return &memory_manager_; }
+
+  // Returns the recycled blocks that are not in use to the parent.
+  void ReleaseUnused();
+
+  // Number of blocks currently obtained from the parent, for tests.
+  size_t NumBlocks() const;
+
+ private:
+  struct Block;
+  static const size_t kBlockHeaderSize;
+  static const size_t kPrefixSize;
+
+  static void* Alloc(void* opaque, size_t size);
+  static void Free(void* opaque, void* address);
+
+  void* Allocate(size_t size);
+  void Release(void* address);
+  Block* NewBlock(size_t size, bool dedicated);
+  void FreeBlock(Block* block);
+
+  JxlMemoryManager parent_;
+  JxlMemoryManager memory_manager_;
+
+  mutable std::mutex mutex_;
+  // Block that pooled allocations are currently carved from, or nullptr.
+  Block* current_ = nullptr;
+  // Pooled blocks without live allocations, ready for reuse.
+  std::vector<Block*> free_blocks_;
+  size_t num_blocks_ = 0;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_MEMORY_ARENA_H_
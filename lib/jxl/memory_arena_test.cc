@@ -0,0 +1,136 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/memory_arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "lib/jxl/base/cache_aligned.h"
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/image.h"
+
+namespace jxl {
+namespace {
+
+struct Counters {
+  size_t allocs = 0;
+  size_t frees = 0;
+};
+
+JxlMemoryManager CountingMemoryManager(Counters* counters) {
+  JxlMemoryManager memory_manager;
+  memory_manager.opaque = counters;
+  memory_manager.alloc = [](void* opaque, size_t size) {
+    static_cast<Counters*>(opaque)->allocs++;
+    return malloc(size);
+  };
+  memory_manager.free = [](void* opaque, void* address) {
+    static_cast<Counters*>(opaque)->frees++;
+    free(address);
+  };
+  return memory_manager;
+}
+
+TEST(MemoryArenaTest, TestRecycleBlocks) {
+  Counters counters;
+  {
+    MemoryArena arena(CountingMemoryManager(&counters));
+    const JxlMemoryManager* mm = arena.memory_manager();
+    for (size_t frame = 0; frame < 10; frame++) {
+      std::vector<void*> buffers;
+      for (size_t i = 0; i < 100; i++) {
+        const size_t size = 1000 + 999 * i;
+        void* buffer = mm->alloc(mm->opaque, size);
+        ASSERT_NE(nullptr, buffer);
+        EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(buffer) % 16);
+        memset(buffer, frame, size);
+        buffers.push_back(buffer);
+      }
+      // One large buffer with its own block.
+      void* large = mm->alloc(mm->opaque, 3 * MemoryArena::kBlockSize);
+      ASSERT_NE(nullptr, large);
+      memset(large, 1, 3 * MemoryArena::kBlockSize);
+      mm->free(mm->opaque, large);
+      for (void* buffer : buffers) mm->free(mm->opaque, buffer);
+    }
+    // The pooled blocks of the first frame are reused for the next ones.
+    EXPECT_EQ(2u, arena.NumBlocks());
+    EXPECT_EQ(12u, counters.allocs);
+    arena.ReleaseUnused();
+    EXPECT_EQ(0u, arena.NumBlocks());
+  }
+  EXPECT_EQ(counters.allocs, counters.frees);
+}
+
+TEST(MemoryArenaTest, TestLongLivedAllocation) {
+  Counters counters;
+  {
+    MemoryArena arena(CountingMemoryManager(&counters));
+    const JxlMemoryManager* mm = arena.memory_manager();
+    void* kept = mm->alloc(mm->opaque, 100);
+    for (size_t i = 0; i < 100; i++) {
+      void* buffer = mm->alloc(mm->opaque, MemoryArena::kMaxPooledSize);
+      ASSERT_NE(nullptr, buffer);
+      mm->free(mm->opaque, buffer);
+    }
+    // The block of the kept allocation is retired once full, the next one is
+    // recycled after every allocation.
+    EXPECT_EQ(2u, arena.NumBlocks());
+    mm->free(mm->opaque, kept);
+  }
+  EXPECT_EQ(counters.allocs, counters.frees);
+}
+
+// CacheAligned allocations use the memory manager of the thread calling
+// RunOnPool, also on the worker threads, and are freed with it from any
+// thread.
+TEST(MemoryArenaTest, TestScopedMemoryManager) {
+  Counters counters;
+  JxlMemoryManager memory_manager = CountingMemoryManager(&counters);
+  MemoryArena arena(memory_manager);
+  ImageF outside(64, 64);
+  std::vector<ImageF> images(32);
+  {
+    CacheAligned::ScopedMemoryManager scoped(arena.memory_manager());
+    ASSERT_EQ(arena.memory_manager(), CacheAligned::CurrentMemoryManager());
+    const auto runner = [](void* runner_opaque, void* jpegxl_opaque,
+                           JxlParallelRunInit init, JxlParallelRunFunction func,
+                           uint32_t start_range, uint32_t end_range) {
+      if (init(jpegxl_opaque, 2) != 0) return -1;
+      std::thread other([&]() {
+        for (uint32_t i = start_range; i < end_range; i += 2) {
+          func(jpegxl_opaque, i, 1);
+        }
+      });
+      for (uint32_t i = start_range + 1; i < end_range; i += 2) {
+        func(jpegxl_opaque, i, 0);
+      }
+      other.join();
+      return 0;
+    };
+    ThreadPool pool(runner, nullptr);
+    ASSERT_TRUE(RunOnPool(
+        &pool, 0, images.size(), ThreadPool::NoInit,
+        [&images](const uint32_t task, size_t thread) {
+          images[task] = ImageF(100, 100);
+        },
+        "TestScopedMemoryManager"));
+  }
+  EXPECT_EQ(nullptr, CacheAligned::CurrentMemoryManager());
+  EXPECT_EQ(1u, arena.NumBlocks());
+  EXPECT_EQ(1u, counters.allocs);
+  images.clear();
+  arena.ReleaseUnused();
+  EXPECT_EQ(0u, arena.NumBlocks());
+  EXPECT_EQ(1u, counters.frees);
+}
+
+}  // namespace
+}  // namespace jxl
@@ -57,6 +57,16 @@ static JXL_INLINE void MemoryManagerFree(const JxlMemoryManager* memory_manager,
   return memory_manager->free(memory_manager->opaque, address);
 }
 
+// Returns the memory manager to pass to CacheAligned::ScopedMemoryManager for
+// the image buffers of an encoder or decoder, or nullptr if it uses the
+// default functions: CacheAligned then keeps using malloc directly.
+static JXL_INLINE const JxlMemoryManager* MemoryManagerForBuffers(
+    const JxlMemoryManager* memory_manager) {
+  return memory_manager->alloc == jxl::MemoryManagerDefaultAlloc
+             ? nullptr
+             : memory_manager;
+}
+
 // Helper class to be used as a deleter in a unique_ptr<T> call.
 class MemoryManagerDeleteHelper {
  public:
@@ -6,6 +6,8 @@
 #ifndef LIB_JXL_MODULAR_ENCODING_CONTEXT_PREDICT_H_
 #define LIB_JXL_MODULAR_ENCODING_CONTEXT_PREDICT_H_
 
+#include <algorithm>
+#include <limits>
 #include <utility>
 #include <vector>
 
@@ -324,6 +326,97 @@ class MATreeLookup {
   const FlatTree &nodes_;
 };
 
+// Table of the leaves of a small tree, indexed by the position of the value of
+// each property used by the tree among its split values. Looking up a context
+// takes a few comparisons per property without branches, instead of the
+// traversal of MATreeLookup.
+class MATreeTable {
+ public:
+  static constexpr size_t kMaxProperties = 3;
+  static constexpr size_t kMaxSplitsPerProperty = 16;
+  static constexpr size_t kMaxCells = 1024;
+
+  // Returns false if the tree uses too many properties or split values.
+  bool Init(const FlatTree &tree) {
+    num_properties_ = 0;
+    size_t num_props = kNumStaticProperties;
+    std::vector<PropertyVal> splits[kMaxProperties];
+    const auto add_split = [&](int32_t property, PropertyVal splitval) {
+      // Static properties are filtered out of the flat tree, so these are the
+      // dummy decisions above duplicated leaves.
+      if (property < static_cast<int32_t>(kNumStaticProperties)) return true;
+      if (splitval == std::numeric_limits<PropertyVal>::max()) return false;
+      size_t i = std::find(properties_, properties_ + num_properties_,
+                           static_cast<uint32_t>(property)) -
+                 properties_;
+      if (i == num_properties_) {
+        if (num_properties_ == kMaxProperties) return false;
+        properties_[num_properties_++] = property;
+      }
+      splits[i].push_back(splitval);
+      num_props = std::max<size_t>(num_props, property + 1);
+      return true;
+    };
+    for (const FlatDecisionNode &node : tree) {
+      if (node.property0 < 0) continue;
+      if (!add_split(node.property0, node.splitval0) ||
+          !add_split(node.properties[0], node.splitvals[0]) ||
+          !add_split(node.properties[1], node.splitvals[1])) {
+        return false;
+      }
+    }
+    size_t num_cells = 1;
+    for (size_t i = 0; i < num_properties_; i++) {
+      std::sort(splits[i].begin(), splits[i].end());
+      splits[i].erase(std::unique(splits[i].begin(), splits[i].end()),
+                      splits[i].end());
+      if (splits[i].size() > kMaxSplitsPerProperty) return false;
+      num_splits_[i] = splits[i].size();
+      std::copy(splits[i].begin(), splits[i].end(), splitvals_[i]);
+      strides_[i] = num_cells;
+      num_cells *= num_splits_[i] + 1;
+      if (num_cells > kMaxCells) return false;
+    }
+    // All the values of a property between two consecutive split values take
+    // the same branches, so one value per interval is enough.
+    MATreeLookup lookup(tree);
+    Properties properties(num_props);
+    cells_.resize(num_cells);
+    for (size_t cell = 0; cell < num_cells; cell++) {
+      for (size_t i = 0; i < num_properties_; i++) {
+        size_t bucket = cell / strides_[i] % (num_splits_[i] + 1);
+        properties[properties_[i]] = bucket == 0
+                                         ? splitvals_[i][0]
+                                         : splitvals_[i][bucket - 1] + 1;
+      }
+      cells_[cell] = lookup.Lookup(properties);
+    }
+    return true;
+  }
+
+  JXL_INLINE MATreeLookup::LookupResult Lookup(
+      const Properties &properties) const {
+    size_t cell = 0;
+    for (size_t i = 0; i < num_properties_; i++) {
+      const PropertyVal v = properties[properties_[i]];
+      size_t bucket = 0;
+      for (size_t j = 0; j < num_splits_[i]; j++) {
+        bucket += v > splitvals_[i][j];
+      }
+      cell += bucket * strides_[i];
+    }
+    return cells_[cell];
+  }
+
+ private:
+  size_t num_properties_ = 0;
+  uint32_t properties_[kMaxProperties];
+  size_t num_splits_[kMaxProperties];
+  PropertyVal splitvals_[kMaxProperties][kMaxSplitsPerProperty];
+  size_t strides_[kMaxProperties];
+  std::vector<MATreeLookup::LookupResult> cells_;
+};
+
 static constexpr size_t kExtraPropsPerChannel = 4;
 static constexpr size_t kNumNonrefProperties =
     kNumStaticProperties + 13 + weighted::kNumProperties;
@@ -461,11 +554,11 @@ JXL_INLINE pixel_type_w PredictOne(Predictor p, pixel_type_w left,
   }
 }
 
-template <int mode>
+template <int mode, typename Lookup>
 JXL_INLINE PredictionResult Predict(
     Properties *p, size_t w, const pixel_type *JXL_RESTRICT pp,
     const intptr_t onerow, const size_t x, const size_t y, Predictor predictor,
-    const MATreeLookup *lookup, const Channel *references,
+    const Lookup *lookup, const Channel *references,
     weighted::State *wp_state, pixel_type_w *predictions) {
   // We start in position 3 because of 2 static properties + y.
   size_t offset = 3;
@@ -543,7 +636,7 @@ inline PredictionResult PredictNoTreeNoWP(size_t w,
                                           const pixel_type *JXL_RESTRICT pp,
                                           const intptr_t onerow, const int x,
                                           const int y, Predictor predictor) {
-  return detail::Predict</*mode=*/0>(
+  return detail::Predict</*mode=*/0, MATreeLookup>(
       /*p=*/nullptr, w, pp, onerow, x, y, predictor, /*lookup=*/nullptr,
       /*references=*/nullptr, /*wp_state=*/nullptr, /*predictions=*/nullptr);
 }
@@ -553,36 +646,50 @@ inline PredictionResult PredictNoTreeWP(size_t w,
                                         const intptr_t onerow, const int x,
                                         const int y, Predictor predictor,
                                         weighted::State *wp_state) {
-  return detail::Predict<detail::kUseWP>(
+  return detail::Predict<detail::kUseWP, MATreeLookup>(
       /*p=*/nullptr, w, pp, onerow, x, y, predictor, /*lookup=*/nullptr,
       /*references=*/nullptr, wp_state, /*predictions=*/nullptr);
 }
 
+template <typename Lookup>
 inline PredictionResult PredictTreeNoWP(Properties *p, size_t w,
                                         const pixel_type *JXL_RESTRICT pp,
                                         const intptr_t onerow, const int x,
-                                        const int y,
-                                        const MATreeLookup &tree_lookup,
+                                        const int y, const Lookup &tree_lookup,
                                         const Channel &references) {
   return detail::Predict<detail::kUseTree>(
       p, w, pp, onerow, x, y, Predictor::Zero, &tree_lookup, &references,
       /*wp_state=*/nullptr, /*predictions=*/nullptr);
 }
 // Only use for y > 1, x > 1, x < w-2, and empty references
+template <typename Lookup>
 JXL_INLINE PredictionResult
 PredictTreeNoWPNEC(Properties *p, size_t w, const pixel_type *JXL_RESTRICT pp,
                    const intptr_t onerow, const int x, const int y,
-                   const MATreeLookup &tree_lookup, const Channel &references) {
+                   const Lookup &tree_lookup, const Channel &references) {
   return detail::Predict<detail::kUseTree | detail::kNoEdgeCases>(
       p, w, pp, onerow, x, y, Predictor::Zero, &tree_lookup, &references,
       /*wp_state=*/nullptr, /*predictions=*/nullptr);
 }
 
+// Only use for y > 1, x > 1, x < w-2, and empty references
+template <typename Lookup>
+JXL_INLINE PredictionResult
+PredictTreeWPNEC(Properties *p, size_t w, const pixel_type *JXL_RESTRICT pp,
+                 const intptr_t onerow, const int x, const int y,
+                 const Lookup &tree_lookup, const Channel &references,
+                 weighted::State *wp_state) {
+  return detail::Predict<detail::kUseTree | detail::kUseWP |
+                         detail::kNoEdgeCases>(
+      p, w, pp, onerow, x, y, Predictor::Zero, &tree_lookup, &references,
+      wp_state, /*predictions=*/nullptr);
+}
+
+template <typename Lookup>
 inline PredictionResult PredictTreeWP(Properties *p, size_t w,
                                       const pixel_type *JXL_RESTRICT pp,
                                       const intptr_t onerow, const int x,
-                                      const int y,
-                                      const MATreeLookup &tree_lookup,
+                                      const int y, const Lookup &tree_lookup,
                                       const Channel &references,
                                       weighted::State *wp_state) {
   return detail::Predict<detail::kUseTree | detail::kUseWP>(
@@ -596,7 +703,8 @@ inline PredictionResult PredictLearn(Properties *p, size_t w,
                                      const int y, Predictor predictor,
                                      const Channel &references,
                                      weighted::State *wp_state) {
-  return detail::Predict<detail::kForceComputeProperties | detail::kUseWP>(
+  return detail::Predict<detail::kForceComputeProperties | detail::kUseWP,
+                         MATreeLookup>(
       p, w, pp, onerow, x, y, predictor, /*lookup=*/nullptr, &references,
       wp_state, /*predictions=*/nullptr);
 }
@@ -608,7 +716,8 @@ inline void PredictLearnAll(Properties *p, size_t w,
                             weighted::State *wp_state,
                             pixel_type_w *predictions) {
   detail::Predict<detail::kForceComputeProperties | detail::kUseWP |
-                  detail::kAllPredictions>(
+                      detail::kAllPredictions,
+                  MATreeLookup>(
       p, w, pp, onerow, x, y, Predictor::Zero,
       /*lookup=*/nullptr, &references, wp_state, predictions);
 }
@@ -616,7 +725,7 @@ inline void PredictLearnAll(Properties *p, size_t w,
 inline void PredictAllNoWP(size_t w, const pixel_type *JXL_RESTRICT pp,
                            const intptr_t onerow, const int x, const int y,
                            pixel_type_w *predictions) {
-  detail::Predict<detail::kAllPredictions>(
+  detail::Predict<detail::kAllPredictions, MATreeLookup>(
       /*p=*/nullptr, w, pp, onerow, x, y, Predictor::Zero,
       /*lookup=*/nullptr,
       /*references=*/nullptr, /*wp_state=*/nullptr, predictions);
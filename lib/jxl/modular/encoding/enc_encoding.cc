@@ -104,12 +104,39 @@ void GatherTreeData(const Image &image, pixel_type chan, size_t group_id,
   Channel references(properties.size() - kNumNonrefProperties, channel.w);
   weighted::State wp_state(wp_header, channel.w, channel.h);
   tree_samples.PrepareForSamples(pixel_fraction * channel.h * channel.w + 64);
+  RowPredictions row_predictions;
+  const bool use_row_predictions = row_predictions.Init(channel);
+  const bool use_wp = tree_samples.UsesWP();
   for (size_t y = 0; y < channel.h; y++) {
     const pixel_type *JXL_RESTRICT p = channel.Row(y);
     PrecomputeReferences(channel, y, image, chan, &references);
     InitPropsRow(&properties, static_props, y);
-    // TODO(veluca): avoid computing WP if we don't use its property or
-    // predictions.
+    if (use_row_predictions) {
+      // Only the weighted predictor runs on every pixel, the other properties
+      // and predictions are only gathered for the sampled pixels.
+      row_predictions.ComputeRow(channel, y, references);
+      for (size_t x = 0; x < channel.w; x++) {
+        pixel_type_w pred[kNumModularPredictors];
+        if (use_wp) {
+          pred[static_cast<int>(Predictor::Weighted)] =
+              row_predictions.PredictWP(x, y, channel.w, &wp_state,
+                                        &properties);
+        }
+        (*total_pixels)++;
+        if (use_sample()) {
+          row_predictions.FillProperties(x, references, &properties);
+          for (size_t i = 0; i < tree_samples.NumPredictors(); i++) {
+            const Predictor predictor = tree_samples.PredictorFromIndex(i);
+            if (predictor == Predictor::Weighted) continue;
+            pred[static_cast<int>(predictor)] =
+                row_predictions.Prediction(predictor, x);
+          }
+          tree_samples.AddSample(p[x], properties, pred);
+        }
+        if (use_wp) wp_state.UpdateErrors(p[x], x, y, channel.w);
+      }
+      continue;
+    }
     for (size_t x = 0; x < channel.w; x++) {
       pixel_type_w pred[kNumModularPredictors];
       if (tree_samples.NumPredictors() != 1) {
@@ -134,7 +161,8 @@ void GatherTreeData(const Image &image, pixel_type chan, size_t group_id,
 Tree LearnTree(TreeSamples &&tree_samples, size_t total_pixels,
                const ModularOptions &options,
                const std::vector<ModularMultiplierInfo> &multiplier_info = {},
-               StaticPropRange static_prop_range = {}) {
+               StaticPropRange static_prop_range = {},
+               ThreadPool *pool = nullptr) {
   for (size_t i = 0; i < kNumStaticProperties; i++) {
     if (static_prop_range[i][1] == 0) {
       static_prop_range[i][1] = std::numeric_limits<uint32_t>::max();
@@ -156,7 +184,7 @@ Tree LearnTree(TreeSamples &&tree_samples, size_t total_pixels,
   ComputeBestTree(tree_samples,
                   options.splitting_heuristics_node_threshold * required_cost,
                   multiplier_info, static_prop_range,
-                  options.fast_decode_multiplier, &tree);
+                  options.fast_decode_multiplier, pool, &tree);
   return tree;
 }
 
@@ -187,6 +215,7 @@ Status EncodeModularChannelMAANS(const Image &image, pixel_type chan,
                              &is_wp_only, &is_gradient_only);
   Properties properties(num_props);
   MATreeLookup tree_lookup(tree);
+  RowPredictions row_predictions;
   JXL_DEBUG_V(3, "Encoding using a MA tree with %" PRIuS " nodes", tree.size());
 
   // Check if this tree is a WP-only tree with a small enough property value
@@ -307,6 +336,42 @@ Status EncodeModularChannelMAANS(const Image &image, pixel_type chan,
       }
     }
 
+  } else if (!skip_encoder_fast_path && row_predictions.Init(channel)) {
+    Channel references(properties.size() - kNumNonrefProperties, channel.w);
+    weighted::State wp_state(wp_header, channel.w, channel.h);
+    for (size_t y = 0; y < channel.h; y++) {
+      const pixel_type *JXL_RESTRICT p = channel.Row(y);
+      PrecomputeReferences(channel, y, image, chan, &references);
+      row_predictions.ComputeRow(channel, y, references);
+      float *pred_img_row[3];
+      if (kWantDebug) {
+        for (size_t c = 0; c < 3; c++) {
+          pred_img_row[c] = predictor_img.PlaneRow(c, y);
+        }
+      }
+      InitPropsRow(&properties, static_props, y);
+      for (size_t x = 0; x < channel.w; x++) {
+        pixel_type_w wp_pred = 0;
+        if (use_wp) {
+          wp_pred = row_predictions.PredictWP(x, y, channel.w, &wp_state,
+                                              &properties);
+        }
+        row_predictions.FillProperties(x, references, &properties);
+        MATreeLookup::LookupResult lr = tree_lookup.Lookup(properties);
+        if (kWantDebug) {
+          for (size_t i = 0; i < 3; i++) {
+            pred_img_row[i][x] = PredictorColor(lr.predictor)[i];
+          }
+        }
+        pixel_type_w guess = lr.predictor == Predictor::Weighted
+                                 ? wp_pred
+                                 : row_predictions.Prediction(lr.predictor, x);
+        pixel_type_w residual = p[x] - guess - lr.offset;
+        JXL_ASSERT(residual % lr.multiplier == 0);
+        *tokenp++ = Token(lr.context, PackSigned(residual / lr.multiplier));
+        if (use_wp) wp_state.UpdateErrors(p[x], x, y, channel.w);
+      }
+    }
   } else if (!use_wp && !skip_encoder_fast_path) {
     const intptr_t onerow = channel.plane.PixelsPerRow();
     Channel references(properties.size() - kNumNonrefProperties, channel.w);
@@ -556,4 +621,51 @@ Status ModularGenericCompress(Image &image, const ModularOptions &opts,
   return true;
 }
 
+Status ModularStreamingCompress(const Image &image, const ModularOptions &opts,
+                                const Tree &tree,
+                                const EntropyEncodingData &code,
+                                const std::vector<uint8_t> &context_map,
+                                BitWriter *writer, AuxOut *aux_out,
+                                size_t layer, size_t group_id) {
+  if (image.w == 0 || image.h == 0 || image.channel.empty()) return true;
+  if (image.error) return JXL_FAILURE("Invalid image");
+  // ANS would need all the tokens of the stream before writing any of them.
+  JXL_ASSERT(code.use_prefix_code);
+  ModularOptions options = opts;
+  if (options.predictor == static_cast<Predictor>(-1)) {
+    options.predictor = Predictor::Gradient;
+  }
+
+  GroupHeader header;
+  Bundle::Init(&header);
+  if (options.predictor == Predictor::Weighted) {
+    weighted::PredictorMode(options.wp_mode, &header.wp_header);
+  }
+  header.transforms = image.transform;
+  header.use_global_tree = true;
+  JXL_RETURN_IF_ERROR(Bundle::Write(header, writer, layer, aux_out));
+
+  // Holds the tokens of a single channel, at most a group.
+  std::vector<Token> tokens;
+  for (size_t i = 0; i < image.channel.size(); i++) {
+    const Channel &channel = image.channel[i];
+    if (!channel.w || !channel.h) {
+      continue;  // skip empty channels
+    }
+    if (i >= image.nb_meta_channels &&
+        (channel.w > options.max_chan_size ||
+         channel.h > options.max_chan_size)) {
+      break;
+    }
+    tokens.resize(channel.w * channel.h);
+    Token *tokenp = tokens.data();
+    JXL_RETURN_IF_ERROR(EncodeModularChannelMAANS(
+        image, i, header.wp_header, tree, &tokenp, aux_out, group_id,
+        options.skip_encoder_fast_path));
+    JXL_CHECK(tokenp == tokens.data() + tokens.size());
+    WriteTokens(tokens, code, context_map, writer, layer, aux_out);
+  }
+  return true;
+}
+
 }  // namespace jxl
@@ -31,7 +31,8 @@ namespace jxl {
 Tree LearnTree(TreeSamples &&tree_samples, size_t total_pixels,
                const ModularOptions &options,
                const std::vector<ModularMultiplierInfo> &multiplier_info = {},
-               StaticPropRange static_prop_range = {});
+               StaticPropRange static_prop_range = {},
+               ThreadPool *pool = nullptr);
 
 // TODO(veluca): make cleaner interfaces.
 
@@ -43,6 +44,16 @@ Status ModularGenericCompress(
     // For encoding with global tree.
     const Tree *tree = nullptr, GroupHeader *header = nullptr,
     std::vector<Token> *tokens = nullptr, size_t *widths = nullptr);
+
+// Encodes `image` with the global `tree`, writing its header and then the
+// tokens of each channel as soon as they are computed with the given prefix
+// `code`, instead of keeping them all as ModularGenericCompress does.
+Status ModularStreamingCompress(const Image &image, const ModularOptions &opts,
+                                const Tree &tree,
+                                const EntropyEncodingData &code,
+                                const std::vector<uint8_t> &context_map,
+                                BitWriter *writer, AuxOut *aux_out,
+                                size_t layer, size_t group_id);
 }  // namespace jxl
 
 #endif  // LIB_JXL_MODULAR_ENCODING_ENC_ENCODING_H_
@@ -11,6 +11,7 @@
 #include <queue>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 
 #include "lib/jxl/modular/encoding/ma_common.h"
 
@@ -22,6 +23,7 @@
 #include "lib/jxl/base/random.h"
 #include "lib/jxl/enc_ans.h"
 #include "lib/jxl/fast_math-inl.h"
+#include "lib/jxl/image_ops.h"
 #include "lib/jxl/modular/encoding/context_predict.h"
 #include "lib/jxl/modular/options.h"
 HWY_BEFORE_NAMESPACE();
@@ -163,315 +165,536 @@ void SplitTreeSamples(TreeSamples &tree_samples, size_t begin, size_t pos,
   }
 }
 
-void FindBestSplit(TreeSamples &tree_samples, float threshold,
-                   const std::vector<ModularMultiplierInfo> &mul_info,
-                   StaticPropRange initial_static_prop_range,
-                   float fast_decode_multiplier, Tree *tree) {
-  struct NodeInfo {
-    size_t pos;
-    size_t begin;
-    size_t end;
-    uint64_t used_properties;
-    StaticPropRange static_prop_range;
-  };
-  std::vector<NodeInfo> nodes;
-  nodes.push_back(NodeInfo{0, 0, tree_samples.NumDistinctSamples(), 0,
-                           initial_static_prop_range});
+struct SplitInfo {
+  size_t prop = 0;
+  uint32_t val = 0;
+  size_t pos = 0;
+  float lcost = std::numeric_limits<float>::max();
+  float rcost = std::numeric_limits<float>::max();
+  Predictor lpred = Predictor::Zero;
+  Predictor rpred = Predictor::Zero;
+  float Cost() const { return lcost + rcost; }
+};
 
-  size_t num_predictors = tree_samples.NumPredictors();
-  size_t num_properties = tree_samples.NumProperties();
+// Best split of each kind among the properties considered so far.
+struct BestSplits {
+  SplitInfo static_constant;
+  SplitInfo static_;
+  SplitInfo nonstatic;
+  SplitInfo nowp;
 
-  // TODO(veluca): consider parallelizing the search (processing multiple nodes
-  // at a time).
-  while (!nodes.empty()) {
-    size_t pos = nodes.back().pos;
-    size_t begin = nodes.back().begin;
-    size_t end = nodes.back().end;
-    uint64_t used_properties = nodes.back().used_properties;
-    StaticPropRange static_prop_range = nodes.back().static_prop_range;
-    nodes.pop_back();
-    if (begin == end) continue;
-
-    struct SplitInfo {
-      size_t prop = 0;
-      uint32_t val = 0;
-      size_t pos = 0;
-      float lcost = std::numeric_limits<float>::max();
-      float rcost = std::numeric_limits<float>::max();
-      Predictor lpred = Predictor::Zero;
-      Predictor rpred = Predictor::Zero;
-      float Cost() { return lcost + rcost; }
-    };
-
-    SplitInfo best_split_static_constant;
-    SplitInfo best_split_static;
-    SplitInfo best_split_nonstatic;
-    SplitInfo best_split_nowp;
-
-    JXL_DASSERT(begin <= end);
-    JXL_DASSERT(end <= tree_samples.NumDistinctSamples());
-
-    // Compute the maximum token in the range.
-    size_t max_symbols = 0;
-    for (size_t pred = 0; pred < num_predictors; pred++) {
-      for (size_t i = begin; i < end; i++) {
-        uint32_t tok = tree_samples.Token(pred, i);
-        max_symbols = max_symbols > tok + 1 ? max_symbols : tok + 1;
-      }
-    }
-    max_symbols = Padded(max_symbols);
-    std::vector<int32_t> rounded_counts(max_symbols);
-    std::vector<int32_t> counts(max_symbols * num_predictors);
-    std::vector<uint32_t> tot_extra_bits(num_predictors);
-    for (size_t pred = 0; pred < num_predictors; pred++) {
-      for (size_t i = begin; i < end; i++) {
-        counts[pred * max_symbols + tree_samples.Token(pred, i)] +=
-            tree_samples.Count(i);
-        tot_extra_bits[pred] +=
-            tree_samples.NBits(pred, i) * tree_samples.Count(i);
-      }
+  // Merges the splits found for a later property. Ties keep the splits of the
+  // earlier properties, as when iterating over all properties in order.
+  void Merge(const BestSplits &other) {
+    if (other.static_constant.Cost() < static_constant.Cost()) {
+      static_constant = other.static_constant;
     }
+    if (other.static_.Cost() < static_.Cost()) static_ = other.static_;
+    if (other.nonstatic.Cost() < nonstatic.Cost()) nonstatic = other.nonstatic;
+    if (other.nowp.Cost() < nowp.Cost()) nowp = other.nowp;
+  }
+};
 
-    float base_bits;
-    {
-      size_t pred = tree_samples.PredictorIndex((*tree)[pos].predictor);
-      base_bits = EstimateBits(counts.data() + pred * max_symbols,
-                               rounded_counts.data(), max_symbols) +
-                  tot_extra_bits[pred];
-    }
-
-    SplitInfo *best = &best_split_nonstatic;
-
-    SplitInfo forced_split;
-    // The multiplier ranges cut halfway through the current ranges of static
-    // properties. We do this even if the current node is not a leaf, to
-    // minimize the number of nodes in the resulting tree.
-    for (size_t i = 0; i < mul_info.size(); i++) {
-      uint32_t axis, val;
-      IntersectionType t =
-          BoxIntersects(static_prop_range, mul_info[i].range, axis, val);
-      if (t == IntersectionType::kNone) continue;
-      if (t == IntersectionType::kInside) {
-        (*tree)[pos].multiplier = mul_info[i].multiplier;
-        break;
+struct CostInfo {
+  float cost = std::numeric_limits<float>::max();
+  float extra_cost = 0;
+  float Cost() const { return cost + extra_cost; }
+  Predictor pred;  // will be uninitialized in some cases, but never used.
+};
+
+// Buffers used to evaluate the splits along one property, reused across
+// properties and nodes. count_increase and extra_bits_increase are all zeros
+// between uses.
+struct SplitScratch {
+  std::vector<int> prop_value_used_count;
+  std::vector<int> count_increase;
+  std::vector<size_t> extra_bits_increase;
+  std::vector<CostInfo> costs_l;
+  std::vector<CostInfo> costs_r;
+  std::vector<int32_t> counts_above;
+  std::vector<int32_t> counts_below;
+  std::vector<int32_t> rounded_counts;
+};
+
+// Node of the tree being learned, with the range of samples it contains.
+struct NodeInfo {
+  size_t begin;
+  size_t end;
+  uint64_t used_properties;
+  StaticPropRange static_prop_range;
+  Predictor predictor;
+};
+
+// Result of the search for the best split of a node.
+struct NodeSplit {
+  bool has_multiplier = false;
+  uint32_t multiplier = 1;
+  bool split = false;
+  uint32_t property = 0;
+  pixel_type splitval = 0;
+  Predictor lpred = Predictor::Zero;
+  Predictor rpred = Predictor::Zero;
+  // Nodes with the samples in [begin, pos) and [pos, end), and their indices.
+  NodeInfo child_nodes[2];
+  size_t children[2] = {0, 0};
+};
+
+// For each property, compute which of its values are used, and what tokens
+// correspond to those usages. Then, iterate through the values, and compute
+// the entropy of each side of the split (of the form `prop > threshold`).
+// Updates `best` with the splits along `prop` that minimize the cost.
+void FindBestPropertySplits(const TreeSamples &tree_samples,
+                            const NodeInfo &node, size_t prop,
+                            const std::vector<int32_t> &counts,
+                            const std::vector<uint32_t> &tot_extra_bits,
+                            size_t max_symbols, float change_pred_penalty,
+                            SplitScratch *scratch, BestSplits *best_splits) {
+  const size_t begin = node.begin;
+  const size_t end = node.end;
+  const size_t num_predictors = tree_samples.NumPredictors();
+  std::vector<int> &prop_value_used_count = scratch->prop_value_used_count;
+  std::vector<int> &count_increase = scratch->count_increase;
+  std::vector<size_t> &extra_bits_increase = scratch->extra_bits_increase;
+  std::vector<CostInfo> &costs_l = scratch->costs_l;
+  std::vector<CostInfo> &costs_r = scratch->costs_r;
+  std::vector<int32_t> &counts_above = scratch->counts_above;
+  std::vector<int32_t> &counts_below = scratch->counts_below;
+  std::vector<int32_t> &rounded_counts = scratch->rounded_counts;
+  counts_above.resize(max_symbols);
+  counts_below.resize(max_symbols);
+  rounded_counts.resize(max_symbols);
+
+  costs_l.clear();
+  costs_r.clear();
+  size_t prop_size = tree_samples.NumPropertyValues(prop);
+  if (count_increase.size() < prop_size * max_symbols) {
+    count_increase.resize(prop_size * max_symbols);
+  }
+  if (extra_bits_increase.size() < prop_size) {
+    extra_bits_increase.resize(prop_size);
+  }
+  // Clear prop_value_used_count (which cannot be cleared "on the go")
+  prop_value_used_count.clear();
+  prop_value_used_count.resize(prop_size);
+
+  size_t first_used = prop_size;
+  size_t last_used = 0;
+
+  // TODO(veluca): consider finding multiple splits along a single
+  // property at the same time, possibly with a bottom-up approach.
+  for (size_t i = begin; i < end; i++) {
+    size_t p = tree_samples.Property(prop, i);
+    prop_value_used_count[p]++;
+    last_used = std::max(last_used, p);
+    first_used = std::min(first_used, p);
+  }
+  costs_l.resize(last_used - first_used);
+  costs_r.resize(last_used - first_used);
+  // For all predictors, compute the right and left costs of each split.
+  for (size_t pred = 0; pred < num_predictors; pred++) {
+    // Compute cost and histogram increments for each property value.
+    for (size_t i = begin; i < end; i++) {
+      size_t p = tree_samples.Property(prop, i);
+      size_t cnt = tree_samples.Count(i);
+      size_t sym = tree_samples.Token(pred, i);
+      count_increase[p * max_symbols + sym] += cnt;
+      extra_bits_increase[p] += tree_samples.NBits(pred, i) * cnt;
+    }
+    memcpy(counts_above.data(), counts.data() + pred * max_symbols,
+           max_symbols * sizeof counts_above[0]);
+    memset(counts_below.data(), 0, max_symbols * sizeof counts_below[0]);
+    size_t extra_bits_below = 0;
+    // Exclude last used: this ensures neither counts_above nor
+    // counts_below is empty.
+    for (size_t i = first_used; i < last_used; i++) {
+      if (!prop_value_used_count[i]) continue;
+      extra_bits_below += extra_bits_increase[i];
+      // The increase for this property value has been used, and will not
+      // be used again: clear it. Also below.
+      extra_bits_increase[i] = 0;
+      for (size_t sym = 0; sym < max_symbols; sym++) {
+        counts_above[sym] -= count_increase[i * max_symbols + sym];
+        counts_below[sym] += count_increase[i * max_symbols + sym];
+        count_increase[i * max_symbols + sym] = 0;
       }
-      if (t == IntersectionType::kPartial) {
-        forced_split.val = tree_samples.QuantizeProperty(axis, val);
-        forced_split.prop = axis;
-        forced_split.lcost = forced_split.rcost = base_bits / 2 - threshold;
-        forced_split.lpred = forced_split.rpred = (*tree)[pos].predictor;
-        best = &forced_split;
-        best->pos = begin;
-        JXL_ASSERT(best->prop == tree_samples.PropertyFromIndex(best->prop));
-        for (size_t x = begin; x < end; x++) {
-          if (tree_samples.Property(best->prop, x) <= best->val) {
-            best->pos++;
-          }
-        }
-        break;
+      float rcost = EstimateBits(counts_above.data(), rounded_counts.data(),
+                                 max_symbols) +
+                    tot_extra_bits[pred] - extra_bits_below;
+      float lcost = EstimateBits(counts_below.data(), rounded_counts.data(),
+                                 max_symbols) +
+                    extra_bits_below;
+      JXL_DASSERT(extra_bits_below <= tot_extra_bits[pred]);
+      float penalty = 0;
+      // Never discourage moving away from the Weighted predictor.
+      if (tree_samples.PredictorFromIndex(pred) != node.predictor &&
+          node.predictor != Predictor::Weighted) {
+        penalty = change_pred_penalty;
+      }
+      // If everything else is equal, disfavour Weighted (slower) and
+      // favour Zero (faster if it's the only predictor used in a
+      // group+channel combination)
+      if (tree_samples.PredictorFromIndex(pred) == Predictor::Weighted) {
+        penalty += 1e-8;
+      }
+      if (tree_samples.PredictorFromIndex(pred) == Predictor::Zero) {
+        penalty -= 1e-8;
+      }
+      if (rcost + penalty < costs_r[i - first_used].Cost()) {
+        costs_r[i - first_used].cost = rcost;
+        costs_r[i - first_used].extra_cost = penalty;
+        costs_r[i - first_used].pred = tree_samples.PredictorFromIndex(pred);
+      }
+      if (lcost + penalty < costs_l[i - first_used].Cost()) {
+        costs_l[i - first_used].cost = lcost;
+        costs_l[i - first_used].extra_cost = penalty;
+        costs_l[i - first_used].pred = tree_samples.PredictorFromIndex(pred);
       }
     }
+  }
+  // Iterate through the possible splits and find the one with minimum sum
+  // of costs of the two sides.
+  size_t split = begin;
+  for (size_t i = first_used; i < last_used; i++) {
+    if (!prop_value_used_count[i]) continue;
+    split += prop_value_used_count[i];
+    float rcost = costs_r[i - first_used].cost;
+    float lcost = costs_l[i - first_used].cost;
+    // WP was not used + we would use the WP property or predictor
+    bool adds_wp =
+        (tree_samples.PropertyFromIndex(prop) == kWPProp &&
+         (node.used_properties & (1LU << prop)) == 0) ||
+        ((costs_l[i - first_used].pred == Predictor::Weighted ||
+          costs_r[i - first_used].pred == Predictor::Weighted) &&
+         node.predictor != Predictor::Weighted);
+    bool zero_entropy_side = rcost == 0 || lcost == 0;
 
-    if (best != &forced_split) {
-      std::vector<int> prop_value_used_count;
-      std::vector<int> count_increase;
-      std::vector<size_t> extra_bits_increase;
-      // For each property, compute which of its values are used, and what
-      // tokens correspond to those usages. Then, iterate through the values,
-      // and compute the entropy of each side of the split (of the form `prop >
-      // threshold`). Finally, find the split that minimizes the cost.
-      struct CostInfo {
-        float cost = std::numeric_limits<float>::max();
-        float extra_cost = 0;
-        float Cost() const { return cost + extra_cost; }
-        Predictor pred;  // will be uninitialized in some cases, but never used.
-      };
-      std::vector<CostInfo> costs_l;
-      std::vector<CostInfo> costs_r;
-
-      std::vector<int32_t> counts_above(max_symbols);
-      std::vector<int32_t> counts_below(max_symbols);
-
-      // The lower the threshold, the higher the expected noisiness of the
-      // estimate. Thus, discourage changing predictors.
-      float change_pred_penalty = 800.0f / (100.0f + threshold);
-      for (size_t prop = 0; prop < num_properties && base_bits > threshold;
-           prop++) {
-        costs_l.clear();
-        costs_r.clear();
-        size_t prop_size = tree_samples.NumPropertyValues(prop);
-        if (extra_bits_increase.size() < prop_size) {
-          count_increase.resize(prop_size * max_symbols);
-          extra_bits_increase.resize(prop_size);
-        }
-        // Clear prop_value_used_count (which cannot be cleared "on the go")
-        prop_value_used_count.clear();
-        prop_value_used_count.resize(prop_size);
-
-        size_t first_used = prop_size;
-        size_t last_used = 0;
-
-        // TODO(veluca): consider finding multiple splits along a single
-        // property at the same time, possibly with a bottom-up approach.
-        for (size_t i = begin; i < end; i++) {
-          size_t p = tree_samples.Property(prop, i);
-          prop_value_used_count[p]++;
-          last_used = std::max(last_used, p);
-          first_used = std::min(first_used, p);
-        }
-        costs_l.resize(last_used - first_used);
-        costs_r.resize(last_used - first_used);
-        // For all predictors, compute the right and left costs of each split.
-        for (size_t pred = 0; pred < num_predictors; pred++) {
-          // Compute cost and histogram increments for each property value.
-          for (size_t i = begin; i < end; i++) {
-            size_t p = tree_samples.Property(prop, i);
-            size_t cnt = tree_samples.Count(i);
-            size_t sym = tree_samples.Token(pred, i);
-            count_increase[p * max_symbols + sym] += cnt;
-            extra_bits_increase[p] += tree_samples.NBits(pred, i) * cnt;
-          }
-          memcpy(counts_above.data(), counts.data() + pred * max_symbols,
-                 max_symbols * sizeof counts_above[0]);
-          memset(counts_below.data(), 0, max_symbols * sizeof counts_below[0]);
-          size_t extra_bits_below = 0;
-          // Exclude last used: this ensures neither counts_above nor
-          // counts_below is empty.
-          for (size_t i = first_used; i < last_used; i++) {
-            if (!prop_value_used_count[i]) continue;
-            extra_bits_below += extra_bits_increase[i];
-            // The increase for this property value has been used, and will not
-            // be used again: clear it. Also below.
-            extra_bits_increase[i] = 0;
-            for (size_t sym = 0; sym < max_symbols; sym++) {
-              counts_above[sym] -= count_increase[i * max_symbols + sym];
-              counts_below[sym] += count_increase[i * max_symbols + sym];
-              count_increase[i * max_symbols + sym] = 0;
-            }
-            float rcost = EstimateBits(counts_above.data(),
-                                       rounded_counts.data(), max_symbols) +
-                          tot_extra_bits[pred] - extra_bits_below;
-            float lcost = EstimateBits(counts_below.data(),
-                                       rounded_counts.data(), max_symbols) +
-                          extra_bits_below;
-            JXL_DASSERT(extra_bits_below <= tot_extra_bits[pred]);
-            float penalty = 0;
-            // Never discourage moving away from the Weighted predictor.
-            if (tree_samples.PredictorFromIndex(pred) !=
-                    (*tree)[pos].predictor &&
-                (*tree)[pos].predictor != Predictor::Weighted) {
-              penalty = change_pred_penalty;
-            }
-            // If everything else is equal, disfavour Weighted (slower) and
-            // favour Zero (faster if it's the only predictor used in a
-            // group+channel combination)
-            if (tree_samples.PredictorFromIndex(pred) == Predictor::Weighted) {
-              penalty += 1e-8;
-            }
-            if (tree_samples.PredictorFromIndex(pred) == Predictor::Zero) {
-              penalty -= 1e-8;
-            }
-            if (rcost + penalty < costs_r[i - first_used].Cost()) {
-              costs_r[i - first_used].cost = rcost;
-              costs_r[i - first_used].extra_cost = penalty;
-              costs_r[i - first_used].pred =
-                  tree_samples.PredictorFromIndex(pred);
-            }
-            if (lcost + penalty < costs_l[i - first_used].Cost()) {
-              costs_l[i - first_used].cost = lcost;
-              costs_l[i - first_used].extra_cost = penalty;
-              costs_l[i - first_used].pred =
-                  tree_samples.PredictorFromIndex(pred);
-            }
-          }
-        }
-        // Iterate through the possible splits and find the one with minimum sum
-        // of costs of the two sides.
-        size_t split = begin;
-        for (size_t i = first_used; i < last_used; i++) {
-          if (!prop_value_used_count[i]) continue;
-          split += prop_value_used_count[i];
-          float rcost = costs_r[i - first_used].cost;
-          float lcost = costs_l[i - first_used].cost;
-          // WP was not used + we would use the WP property or predictor
-          bool adds_wp =
-              (tree_samples.PropertyFromIndex(prop) == kWPProp &&
-               (used_properties & (1LU << prop)) == 0) ||
-              ((costs_l[i - first_used].pred == Predictor::Weighted ||
-                costs_r[i - first_used].pred == Predictor::Weighted) &&
-               (*tree)[pos].predictor != Predictor::Weighted);
-          bool zero_entropy_side = rcost == 0 || lcost == 0;
-
-          SplitInfo &best =
-              prop < kNumStaticProperties
-                  ? (zero_entropy_side ? best_split_static_constant
-                                       : best_split_static)
-                  : (adds_wp ? best_split_nonstatic : best_split_nowp);
-          if (lcost + rcost < best.Cost()) {
-            best.prop = prop;
-            best.val = i;
-            best.pos = split;
-            best.lcost = lcost;
-            best.lpred = costs_l[i - first_used].pred;
-            best.rcost = rcost;
-            best.rpred = costs_r[i - first_used].pred;
-          }
-        }
-        // Clear extra_bits_increase and cost_increase for last_used.
-        extra_bits_increase[last_used] = 0;
-        for (size_t sym = 0; sym < max_symbols; sym++) {
-          count_increase[last_used * max_symbols + sym] = 0;
+    SplitInfo &best =
+        prop < kNumStaticProperties
+            ? (zero_entropy_side ? best_splits->static_constant
+                                 : best_splits->static_)
+            : (adds_wp ? best_splits->nonstatic : best_splits->nowp);
+    if (lcost + rcost < best.Cost()) {
+      best.prop = prop;
+      best.val = i;
+      best.pos = split;
+      best.lcost = lcost;
+      best.lpred = costs_l[i - first_used].pred;
+      best.rcost = rcost;
+      best.rpred = costs_r[i - first_used].pred;
+    }
+  }
+  // Clear extra_bits_increase and cost_increase for last_used.
+  extra_bits_increase[last_used] = 0;
+  for (size_t sym = 0; sym < max_symbols; sym++) {
+    count_increase[last_used * max_symbols + sym] = 0;
+  }
+}
+
+// Finds the best split of the node and, if there is one, sorts its samples
+// according to it. Only accesses the samples of the node, so nodes with
+// disjoint ranges can be processed concurrently. If pool is not null, the
+// properties are evaluated in parallel.
+void FindBestNodeSplit(TreeSamples &tree_samples, const NodeInfo &node,
+                       float threshold,
+                       const std::vector<ModularMultiplierInfo> &mul_info,
+                       float fast_decode_multiplier, ThreadPool *pool,
+                       SplitScratch *scratch, NodeSplit *result) {
+  const size_t begin = node.begin;
+  const size_t end = node.end;
+  if (begin == end) return;
+
+  size_t num_predictors = tree_samples.NumPredictors();
+  size_t num_properties = tree_samples.NumProperties();
+
+  JXL_DASSERT(begin <= end);
+  JXL_DASSERT(end <= tree_samples.NumDistinctSamples());
+
+  // Compute the maximum token in the range.
+  size_t max_symbols = 0;
+  for (size_t pred = 0; pred < num_predictors; pred++) {
+    for (size_t i = begin; i < end; i++) {
+      uint32_t tok = tree_samples.Token(pred, i);
+      max_symbols = max_symbols > tok + 1 ? max_symbols : tok + 1;
+    }
+  }
+  max_symbols = Padded(max_symbols);
+  std::vector<int32_t> rounded_counts(max_symbols);
+  std::vector<int32_t> counts(max_symbols * num_predictors);
+  std::vector<uint32_t> tot_extra_bits(num_predictors);
+  for (size_t pred = 0; pred < num_predictors; pred++) {
+    for (size_t i = begin; i < end; i++) {
+      counts[pred * max_symbols + tree_samples.Token(pred, i)] +=
+          tree_samples.Count(i);
+      tot_extra_bits[pred] +=
+          tree_samples.NBits(pred, i) * tree_samples.Count(i);
+    }
+  }
+
+  float base_bits;
+  {
+    size_t pred = tree_samples.PredictorIndex(node.predictor);
+    base_bits = EstimateBits(counts.data() + pred * max_symbols,
+                             rounded_counts.data(), max_symbols) +
+                tot_extra_bits[pred];
+  }
+
+  BestSplits best_splits;
+  SplitInfo *best = &best_splits.nonstatic;
+
+  SplitInfo forced_split;
+  // The multiplier ranges cut halfway through the current ranges of static
+  // properties. We do this even if the current node is not a leaf, to
+  // minimize the number of nodes in the resulting tree.
+  for (size_t i = 0; i < mul_info.size(); i++) {
+    uint32_t axis, val;
+    IntersectionType t =
+        BoxIntersects(node.static_prop_range, mul_info[i].range, axis, val);
+    if (t == IntersectionType::kNone) continue;
+    if (t == IntersectionType::kInside) {
+      result->has_multiplier = true;
+      result->multiplier = mul_info[i].multiplier;
+      break;
+    }
+    if (t == IntersectionType::kPartial) {
+      forced_split.val = tree_samples.QuantizeProperty(axis, val);
+      forced_split.prop = axis;
+      forced_split.lcost = forced_split.rcost = base_bits / 2 - threshold;
+      forced_split.lpred = forced_split.rpred = node.predictor;
+      best = &forced_split;
+      best->pos = begin;
+      JXL_ASSERT(best->prop == tree_samples.PropertyFromIndex(best->prop));
+      for (size_t x = begin; x < end; x++) {
+        if (tree_samples.Property(best->prop, x) <= best->val) {
+          best->pos++;
         }
       }
+      break;
+    }
+  }
 
-      // Try to avoid introducing WP.
-      if (best_split_nowp.Cost() + threshold < base_bits &&
-          best_split_nowp.Cost() <= fast_decode_multiplier * best->Cost()) {
-        best = &best_split_nowp;
+  if (best != &forced_split) {
+    // The lower the threshold, the higher the expected noisiness of the
+    // estimate. Thus, discourage changing predictors.
+    float change_pred_penalty = 800.0f / (100.0f + threshold);
+    if (base_bits > threshold && pool == nullptr) {
+      for (size_t prop = 0; prop < num_properties; prop++) {
+        FindBestPropertySplits(tree_samples, node, prop, counts,
+                               tot_extra_bits, max_symbols, change_pred_penalty,
+                               scratch, &best_splits);
       }
-      // Split along static props if possible and not significantly more
-      // expensive.
-      if (best_split_static.Cost() + threshold < base_bits &&
-          best_split_static.Cost() <= fast_decode_multiplier * best->Cost()) {
-        best = &best_split_static;
-      }
-      // Split along static props to create constant nodes if possible.
-      if (best_split_static_constant.Cost() + threshold < base_bits) {
-        best = &best_split_static_constant;
+    } else if (base_bits > threshold) {
+      std::vector<BestSplits> prop_splits(num_properties);
+      std::vector<SplitScratch> prop_scratch;
+      JXL_CHECK(RunOnPool(
+          pool, 0, num_properties,
+          [&](size_t num_threads) {
+            prop_scratch.resize(num_threads);
+            return true;
+          },
+          [&](const uint32_t prop, size_t thread) {
+            FindBestPropertySplits(tree_samples, node, prop, counts,
+                                   tot_extra_bits, max_symbols,
+                                   change_pred_penalty, &prop_scratch[thread],
+                                   &prop_splits[prop]);
+          },
+          "FindBestPropertySplits"));
+      for (const BestSplits &splits : prop_splits) {
+        best_splits.Merge(splits);
       }
     }
 
-    if (best->Cost() + threshold < base_bits) {
-      uint32_t p = tree_samples.PropertyFromIndex(best->prop);
-      pixel_type dequant =
-          tree_samples.UnquantizeProperty(best->prop, best->val);
-      // Split node and try to split children.
-      MakeSplitNode(pos, p, dequant, best->lpred, 0, best->rpred, 0, tree);
-      // "Sort" according to winning property
-      SplitTreeSamples(tree_samples, begin, best->pos, end, best->prop);
-      if (p >= kNumStaticProperties) {
-        used_properties |= 1 << best->prop;
-      }
-      auto new_sp_range = static_prop_range;
-      if (p < kNumStaticProperties) {
-        JXL_ASSERT(static_cast<uint32_t>(dequant + 1) <= new_sp_range[p][1]);
-        new_sp_range[p][1] = dequant + 1;
-        JXL_ASSERT(new_sp_range[p][0] < new_sp_range[p][1]);
+    // Try to avoid introducing WP.
+    if (best_splits.nowp.Cost() + threshold < base_bits &&
+        best_splits.nowp.Cost() <= fast_decode_multiplier * best->Cost()) {
+      best = &best_splits.nowp;
+    }
+    // Split along static props if possible and not significantly more
+    // expensive.
+    if (best_splits.static_.Cost() + threshold < base_bits &&
+        best_splits.static_.Cost() <= fast_decode_multiplier * best->Cost()) {
+      best = &best_splits.static_;
+    }
+    // Split along static props to create constant nodes if possible.
+    if (best_splits.static_constant.Cost() + threshold < base_bits) {
+      best = &best_splits.static_constant;
+    }
+  }
+
+  if (best->Cost() + threshold < base_bits) {
+    result->split = true;
+    result->property = tree_samples.PropertyFromIndex(best->prop);
+    result->splitval = tree_samples.UnquantizeProperty(best->prop, best->val);
+    result->lpred = best->lpred;
+    result->rpred = best->rpred;
+    // "Sort" according to winning property
+    SplitTreeSamples(tree_samples, begin, best->pos, end, best->prop);
+
+    uint32_t p = result->property;
+    pixel_type dequant = result->splitval;
+    uint64_t used_properties = node.used_properties;
+    if (p >= kNumStaticProperties) {
+      used_properties |= 1 << best->prop;
+    }
+    auto new_sp_range = node.static_prop_range;
+    if (p < kNumStaticProperties) {
+      JXL_ASSERT(static_cast<uint32_t>(dequant + 1) <= new_sp_range[p][1]);
+      new_sp_range[p][1] = dequant + 1;
+      JXL_ASSERT(new_sp_range[p][0] < new_sp_range[p][1]);
+    }
+    result->child_nodes[0] = NodeInfo{begin, best->pos, used_properties,
+                                      new_sp_range, best->lpred};
+    new_sp_range = node.static_prop_range;
+    if (p < kNumStaticProperties) {
+      JXL_ASSERT(new_sp_range[p][0] <= static_cast<uint32_t>(dequant + 1));
+      new_sp_range[p][0] = dequant + 1;
+      JXL_ASSERT(new_sp_range[p][0] < new_sp_range[p][1]);
+    }
+    result->child_nodes[1] = NodeInfo{best->pos, end, used_properties,
+                                      new_sp_range, best->rpred};
+  }
+}
+
+// Splits are searched one level of the tree at a time: the nodes of a level
+// have disjoint sample ranges, so they are processed in parallel, or, if the
+// level has a single node, its properties are. The resulting nodes are then
+// added to the tree in the order of a depth-first search, so that the tree is
+// the same for any number of threads.
+void FindBestSplit(TreeSamples &tree_samples, float threshold,
+                   const std::vector<ModularMultiplierInfo> &mul_info,
+                   StaticPropRange initial_static_prop_range,
+                   float fast_decode_multiplier, ThreadPool *pool, Tree *tree) {
+  std::vector<NodeInfo> nodes;
+  std::vector<NodeSplit> splits;
+  nodes.push_back(NodeInfo{0, tree_samples.NumDistinctSamples(), 0,
+                           initial_static_prop_range, (*tree)[0].predictor});
+
+  std::vector<SplitScratch> scratch(1);
+  size_t level_begin = 0;
+  while (level_begin < nodes.size()) {
+    const size_t level_end = nodes.size();
+    splits.resize(level_end);
+    if (pool == nullptr || level_end - level_begin == 1) {
+      for (size_t i = level_begin; i < level_end; i++) {
+        FindBestNodeSplit(tree_samples, nodes[i], threshold, mul_info,
+                          fast_decode_multiplier, pool, &scratch[0],
+                          &splits[i]);
       }
-      nodes.push_back(NodeInfo{(*tree)[pos].rchild, begin, best->pos,
-                               used_properties, new_sp_range});
-      new_sp_range = static_prop_range;
-      if (p < kNumStaticProperties) {
-        JXL_ASSERT(new_sp_range[p][0] <= static_cast<uint32_t>(dequant + 1));
-        new_sp_range[p][0] = dequant + 1;
-        JXL_ASSERT(new_sp_range[p][0] < new_sp_range[p][1]);
+    } else {
+      JXL_CHECK(RunOnPool(
+          pool, level_begin, level_end,
+          [&](size_t num_threads) {
+            if (scratch.size() < num_threads) scratch.resize(num_threads);
+            return true;
+          },
+          [&](const uint32_t i, size_t thread) {
+            FindBestNodeSplit(tree_samples, nodes[i], threshold, mul_info,
+                              fast_decode_multiplier, /*pool=*/nullptr,
+                              &scratch[thread], &splits[i]);
+          },
+          "FindBestSplit"));
+    }
+    for (size_t i = level_begin; i < level_end; i++) {
+      if (!splits[i].split) continue;
+      for (size_t c = 0; c < 2; c++) {
+        splits[i].children[c] = nodes.size();
+        nodes.push_back(splits[i].child_nodes[c]);
       }
-      nodes.push_back(NodeInfo{(*tree)[pos].lchild, best->pos, end,
-                               used_properties, new_sp_range});
     }
+    level_begin = level_end;
+  }
+
+  // Stack of (node, position in the tree).
+  std::vector<std::pair<size_t, size_t>> stack;
+  stack.emplace_back(0, 0);
+  while (!stack.empty()) {
+    size_t node = stack.back().first;
+    size_t pos = stack.back().second;
+    stack.pop_back();
+    const NodeSplit &split = splits[node];
+    if (split.has_multiplier) (*tree)[pos].multiplier = split.multiplier;
+    if (!split.split) continue;
+    // Split node and try to split children.
+    MakeSplitNode(pos, split.property, split.splitval, split.lpred, 0,
+                  split.rpred, 0, tree);
+    stack.emplace_back(split.children[0], (*tree)[pos].rchild);
+    stack.emplace_back(split.children[1], (*tree)[pos].lchild);
   }
 }
 
+// Computes the RowPredictions of the pixels [x0, x1) of row y of a channel
+// of width w, for y > 1, x0 > 1 and x1 + 2 <= w. Returns the end of the pixels
+// that were computed, the remaining ones are less than a vector.
+size_t ComputeRowPredictionsNEC(const pixel_type *JXL_RESTRICT row,
+                                const intptr_t onerow, size_t x0, size_t x1,
+                                pixel_type *JXL_RESTRICT *props,
+                                pixel_type *JXL_RESTRICT *preds) {
+  using V = decltype(Zero(di));
+  const V one = Set(di, 1);
+  const V fifteen = Set(di, 15);
+  // The divisions of the averages round towards zero.
+  const auto half = [&](const V v) {
+    return ShiftRight<1>(v + (ShiftRight<31>(v) & one));
+  };
+  const pixel_type *JXL_RESTRICT row_t = row - onerow;
+  const pixel_type *JXL_RESTRICT row_tt = row_t - onerow;
+  const auto pred_row = [&](Predictor p) {
+    return preds[static_cast<size_t>(p)];
+  };
+  const size_t N = Lanes(di);
+  size_t x = x0;
+  for (; x + N <= x1; x += N) {
+    const V left = LoadU(di, row + x - 1);
+    const V leftleft = LoadU(di, row + x - 2);
+    const V top = LoadU(di, row_t + x);
+    const V topleft = LoadU(di, row_t + x - 1);
+    const V topleftleft = LoadU(di, row_t + x - 2);
+    const V topright = LoadU(di, row_t + x + 1);
+    const V toprightright = LoadU(di, row_t + x + 2);
+    const V toptop = LoadU(di, row_tt + x);
+    const V grad = left + top - topleft;
+    // Local gradient of the previous pixel.
+    const V prev_grad = leftleft + topleft - topleftleft;
+
+    StoreU(Iota(di, static_cast<int32_t>(x)), di, props[0] + x);
+    StoreU(Abs(top), di, props[1] + x);
+    StoreU(Abs(left), di, props[2] + x);
+    StoreU(top, di, props[3] + x);
+    StoreU(left, di, props[4] + x);
+    StoreU(left - prev_grad, di, props[5] + x);
+    StoreU(grad, di, props[6] + x);
+    StoreU(left - topleft, di, props[7] + x);
+    StoreU(topleft - top, di, props[8] + x);
+    StoreU(top - topright, di, props[9] + x);
+    StoreU(top - toptop, di, props[10] + x);
+    StoreU(left - leftleft, di, props[11] + x);
+
+    StoreU(left, di, pred_row(Predictor::Left) + x);
+    StoreU(top, di, pred_row(Predictor::Top) + x);
+    StoreU(half(left + top), di, pred_row(Predictor::Average0) + x);
+    const V select_top = Abs(top - topleft);
+    const V select_left = Abs(left - topleft);
+    StoreU(IfThenElse(select_top < select_left, left, top), di,
+           pred_row(Predictor::Select) + x);
+    const V min = Min(left, top);
+    const V max = Max(left, top);
+    const V clamp_max = IfThenElse(topleft < min, max, grad);
+    StoreU(IfThenElse(topleft > max, min, clamp_max), di,
+           pred_row(Predictor::Gradient) + x);
+    StoreU(topright, di, pred_row(Predictor::TopRight) + x);
+    StoreU(topleft, di, pred_row(Predictor::TopLeft) + x);
+    StoreU(leftleft, di, pred_row(Predictor::LeftLeft) + x);
+    StoreU(half(left + topleft), di, pred_row(Predictor::Average1) + x);
+    StoreU(half(topleft + top), di, pred_row(Predictor::Average2) + x);
+    StoreU(half(top + topright), di, pred_row(Predictor::Average3) + x);
+    const V sum = Set(di, 6) * top - Set(di, 2) * toptop + Set(di, 7) * left +
+                  leftleft + toprightright + Set(di, 3) * topright +
+                  Set(di, 8);
+    StoreU(ShiftRight<4>(sum + (ShiftRight<31>(sum) & fifteen)), di,
+           pred_row(Predictor::Average4) + x);
+  }
+  return x;
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -481,11 +704,13 @@ HWY_AFTER_NAMESPACE();
 namespace jxl {
 
 HWY_EXPORT(FindBestSplit);  // Local function.
+HWY_EXPORT(ComputeRowPredictionsNEC);  // Local function.
 
 void ComputeBestTree(TreeSamples &tree_samples, float threshold,
                      const std::vector<ModularMultiplierInfo> &mul_info,
                      StaticPropRange static_prop_range,
-                     float fast_decode_multiplier, Tree *tree) {
+                     float fast_decode_multiplier, ThreadPool *pool,
+                     Tree *tree) {
   // TODO(veluca): take into account that different contexts can have different
   // uint configs.
   //
@@ -501,7 +726,67 @@ void ComputeBestTree(TreeSamples &tree_samples, float threshold,
              std::numeric_limits<uint32_t>::max());
   HWY_DYNAMIC_DISPATCH(FindBestSplit)
   (tree_samples, threshold, mul_info, static_prop_range, fast_decode_multiplier,
-   tree);
+   pool, tree);
+}
+
+constexpr size_t RowPredictions::kFirstProperty;
+constexpr size_t RowPredictions::kNumProperties;
+
+bool RowPredictions::Init(const Channel &channel) {
+  // The predictions add up to 20 times the values of the neighbours.
+  constexpr pixel_type kMaxValue = 1 << 26;
+  for (size_t y = 0; y < channel.h; y++) {
+    const pixel_type *JXL_RESTRICT row = channel.Row(y);
+    for (size_t x = 0; x < channel.w; x++) {
+      if (row[x] >= kMaxValue || row[x] <= -kMaxValue) return false;
+    }
+  }
+  props_ = ImageI(channel.w, kNumProperties);
+  preds_ = ImageI(channel.w, kNumModularPredictors);
+  // The weighted predictor and the zero one are never written.
+  ZeroFillImage(&preds_);
+  return true;
+}
+
+void RowPredictions::ComputeRow(const Channel &channel, size_t y,
+                                const Channel &references) {
+  const size_t w = channel.w;
+  const pixel_type *JXL_RESTRICT row = channel.Row(y);
+  const intptr_t onerow = channel.plane.PixelsPerRow();
+  pixel_type *JXL_RESTRICT props[kNumProperties];
+  for (size_t i = 0; i < kNumProperties; i++) props[i] = props_.Row(i);
+  pixel_type *JXL_RESTRICT preds[kNumModularPredictors];
+  for (size_t i = 0; i < kNumModularPredictors; i++) preds[i] = preds_.Row(i);
+
+  scratch_.resize(kNumNonrefProperties + references.w);
+  const auto compute_scalar = [&](size_t x) {
+    // The local gradient of the previous pixel, as left by InitPropsRow or by
+    // the previous call.
+    scratch_[kGradientProp] =
+        x == 0 ? 0 : props[kGradientProp - kFirstProperty][x - 1];
+    pixel_type_w predictions[kNumModularPredictors];
+    detail::Predict<detail::kForceComputeProperties | detail::kAllPredictions,
+                    MATreeLookup>(&scratch_, w, row + x, onerow, x, y,
+                                  Predictor::Zero, /*lookup=*/nullptr,
+                                  &references, /*wp_state=*/nullptr,
+                                  predictions);
+    for (size_t i = 0; i < kNumProperties; i++) {
+      props[i][x] = scratch_[kFirstProperty + i];
+    }
+    for (size_t i = 0; i < kNumModularPredictors; i++) {
+      preds[i][x] = predictions[i];
+    }
+  };
+
+  size_t simd_begin = 0;
+  size_t simd_end = 0;
+  if (y > 1 && w > 4) {
+    simd_begin = 2;
+    simd_end = HWY_DYNAMIC_DISPATCH(ComputeRowPredictionsNEC)(
+        row, onerow, simd_begin, w - 2, props, preds);
+  }
+  for (size_t x = 0; x < simd_begin; x++) compute_scalar(x);
+  for (size_t x = simd_end; x < w; x++) compute_scalar(x);
 }
 
 constexpr int TreeSamples::kPropertyRange;
@@ -562,6 +847,13 @@ Status TreeSamples::SetProperties(const std::vector<uint32_t> &properties,
   return true;
 }
 
+bool TreeSamples::UsesWP() const {
+  return std::find(predictors.begin(), predictors.end(),
+                   Predictor::Weighted) != predictors.end() ||
+         std::find(props_to_use.begin(), props_to_use.end(), kWPProp) !=
+             props_to_use.end();
+}
+
 void TreeSamples::InitTable(size_t size) {
   JXL_DASSERT((size & (size - 1)) == 0);
   if (dedup_table_.size() == size) return;
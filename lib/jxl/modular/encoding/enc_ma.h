@@ -8,8 +8,11 @@
 
 #include <numeric>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/enc_ans.h"
 #include "lib/jxl/entropy_coder.h"
+#include "lib/jxl/image.h"
+#include "lib/jxl/modular/encoding/context_predict.h"
 #include "lib/jxl/modular/encoding/dec_ma.h"
 #include "lib/jxl/modular/modular_image.h"
 #include "lib/jxl/modular/options.h"
@@ -67,6 +70,8 @@ struct TreeSamples {
   }
   size_t NumPredictors() const { return predictors.size(); }
   size_t NumProperties() const { return props_to_use.size(); }
+  // Whether the weighted predictor or its property are used.
+  bool UsesWP() const;
 
   // Preallocate data for a given number of samples. MUST be called before
   // adding any sample.
@@ -138,6 +143,60 @@ struct TreeSamples {
   void AddToTable(size_t a);
 };
 
+// Properties and predictions of all the pixels of a row of a channel, except
+// the ones of the weighted predictor. They are computed a vector at a time
+// away from the edges of the channel, and match the ones of detail::Predict.
+class RowPredictions {
+ public:
+  // The x position, the neighbours, the gradients and the FFV1 properties.
+  static constexpr size_t kFirstProperty = kNumStaticProperties + 1;
+  static constexpr size_t kNumProperties = kWPProp - kFirstProperty;
+
+  // Returns false if the channel has values large enough to overflow the 32
+  // bit computations, in which case RowPredictions must not be used for it.
+  bool Init(const Channel &channel);
+  // Computes row y of the channel passed to Init.
+  void ComputeRow(const Channel &channel, size_t y, const Channel &references);
+
+  JXL_INLINE pixel_type Property(size_t property, size_t x) const {
+    return props_.ConstRow(property - kFirstProperty)[x];
+  }
+  JXL_INLINE pixel_type Prediction(Predictor predictor, size_t x) const {
+    return preds_.ConstRow(static_cast<size_t>(predictor))[x];
+  }
+  // Writes all the non-static properties of pixel x except y and the weighted
+  // predictor one into *p.
+  JXL_INLINE void FillProperties(size_t x, const Channel &references,
+                                 Properties *p) const {
+    for (size_t i = 0; i < kNumProperties; i++) {
+      (*p)[kFirstProperty + i] = props_.ConstRow(i)[x];
+    }
+    const pixel_type *JXL_RESTRICT rp = references.Row(x);
+    for (size_t i = 0; i < references.w; i++) {
+      (*p)[kNumNonrefProperties + i] = rp[i];
+    }
+  }
+  // Runs the weighted predictor on pixel x of row y, which must be the last
+  // computed row, and writes its property into *p.
+  JXL_INLINE pixel_type_w PredictWP(size_t x, size_t y, size_t w,
+                                    weighted::State *wp_state,
+                                    Properties *p) const {
+    // Recovers the neighbours, with their edge cases, from the properties.
+    const pixel_type_w top = Property(6, x);
+    const pixel_type_w left = Property(7, x);
+    const pixel_type_w topleft = left - Property(10, x);
+    const pixel_type_w topright = top - Property(12, x);
+    const pixel_type_w toptop = top - Property(13, x);
+    return wp_state->Predict</*compute_properties=*/true>(
+        x, y, w, top, left, topright, topleft, toptop, p, kWPProp);
+  }
+
+ private:
+  ImageI props_;
+  ImageI preds_;
+  Properties scratch_;
+};
+
 void TokenizeTree(const Tree &tree, std::vector<Token> *tokens,
                   Tree *decoder_tree);
 
@@ -148,10 +207,13 @@ void CollectPixelSamples(const Image &image, const ModularOptions &options,
                          std::vector<pixel_type> &pixel_samples,
                          std::vector<pixel_type> &diff_samples);
 
+// The tree does not depend on the number of threads of the pool, which may be
+// null.
 void ComputeBestTree(TreeSamples &tree_samples, float threshold,
                      const std::vector<ModularMultiplierInfo> &mul_info,
                      StaticPropRange static_prop_range,
-                     float fast_decode_multiplier, Tree *tree);
+                     float fast_decode_multiplier, ThreadPool *pool,
+                     Tree *tree);
 
 }  // namespace jxl
 #endif  // LIB_JXL_MODULAR_ENCODING_ENC_MA_H_
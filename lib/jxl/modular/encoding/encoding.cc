@@ -125,6 +125,139 @@ FlatTree FilterTree(const Tree &global_tree,
   return output;
 }
 
+namespace {
+
+JXL_INLINE pixel_type MakePixel(uint64_t v, pixel_type multiplier,
+                                pixel_type_w offset) {
+  JXL_DASSERT((v & 0xFFFFFFFF) == v);
+  pixel_type_w val = UnpackSigned(v);
+  // if it overflows, it overflows, and we have a problem anyway
+  return val * multiplier + offset;
+}
+
+// Decodes a channel with a tree that does not use the weighted predictor or
+// its properties. Lookup is either MATreeLookup or MATreeTable.
+template <bool uses_lz77, typename Lookup>
+void DecodeChannelTreeNoWP(
+    BitReader *br, ANSSymbolReader *reader, const Lookup &tree_lookup,
+    size_t num_props,
+    const std::array<pixel_type, kNumStaticProperties> &static_props,
+    pixel_type chan, Image *image) {
+  Channel &channel = image->channel[chan];
+  Properties properties = Properties(num_props);
+  const intptr_t onerow = channel.plane.PixelsPerRow();
+  Channel references(properties.size() - kNumNonrefProperties, channel.w);
+  for (size_t y = 0; y < channel.h; y++) {
+    pixel_type *JXL_RESTRICT p = channel.Row(y);
+    PrecomputeReferences(channel, y, *image, chan, &references);
+    InitPropsRow(&properties, static_props, y);
+    if (y > 1 && channel.w > 8 && references.w == 0) {
+      for (size_t x = 0; x < 2; x++) {
+        PredictionResult res =
+            PredictTreeNoWP(&properties, channel.w, p + x, onerow, x, y,
+                            tree_lookup, references);
+        uint64_t v =
+            reader->ReadHybridUintClusteredInlined<uses_lz77>(res.context, br);
+        p[x] = MakePixel(v, res.multiplier, res.guess);
+      }
+      for (size_t x = 2; x < channel.w - 2; x++) {
+        PredictionResult res =
+            PredictTreeNoWPNEC(&properties, channel.w, p + x, onerow, x, y,
+                               tree_lookup, references);
+        uint64_t v =
+            reader->ReadHybridUintClusteredInlined<uses_lz77>(res.context, br);
+        p[x] = MakePixel(v, res.multiplier, res.guess);
+      }
+      for (size_t x = channel.w - 2; x < channel.w; x++) {
+        PredictionResult res =
+            PredictTreeNoWP(&properties, channel.w, p + x, onerow, x, y,
+                            tree_lookup, references);
+        uint64_t v =
+            reader->ReadHybridUintClusteredInlined<uses_lz77>(res.context, br);
+        p[x] = MakePixel(v, res.multiplier, res.guess);
+      }
+    } else {
+      for (size_t x = 0; x < channel.w; x++) {
+        PredictionResult res =
+            PredictTreeNoWP(&properties, channel.w, p + x, onerow, x, y,
+                            tree_lookup, references);
+        uint64_t v =
+            reader->ReadHybridUintClusteredInlined<uses_lz77>(res.context, br);
+        p[x] = MakePixel(v, res.multiplier, res.guess);
+      }
+    }
+  }
+}
+
+// Same as DecodeChannelTreeNoWP, for trees that use the weighted predictor.
+template <bool uses_lz77, typename Lookup>
+void DecodeChannelTreeWP(
+    BitReader *br, ANSSymbolReader *reader, const Lookup &tree_lookup,
+    size_t num_props,
+    const std::array<pixel_type, kNumStaticProperties> &static_props,
+    const weighted::Header &wp_header, pixel_type chan, Image *image) {
+  Channel &channel = image->channel[chan];
+  Properties properties = Properties(num_props);
+  const intptr_t onerow = channel.plane.PixelsPerRow();
+  Channel references(properties.size() - kNumNonrefProperties, channel.w);
+  weighted::State wp_state(wp_header, channel.w, channel.h);
+  for (size_t y = 0; y < channel.h; y++) {
+    pixel_type *JXL_RESTRICT p = channel.Row(y);
+    InitPropsRow(&properties, static_props, y);
+    PrecomputeReferences(channel, y, *image, chan, &references);
+    const auto decode_edge_pixel = [&](size_t x) {
+      PredictionResult res =
+          PredictTreeWP(&properties, channel.w, p + x, onerow, x, y,
+                        tree_lookup, references, &wp_state);
+      uint64_t v =
+          reader->ReadHybridUintClusteredInlined<uses_lz77>(res.context, br);
+      p[x] = MakePixel(v, res.multiplier, res.guess);
+      wp_state.UpdateErrors(p[x], x, y, channel.w);
+    };
+    if (y > 1 && channel.w > 8 && references.w == 0) {
+      // The weighted predictor makes each pixel depend on the previous one,
+      // so keep the edge checks of the neighbours out of the loop.
+      for (size_t x = 0; x < 2; x++) decode_edge_pixel(x);
+      for (size_t x = 2; x < channel.w - 2; x++) {
+        PredictionResult res =
+            PredictTreeWPNEC(&properties, channel.w, p + x, onerow, x, y,
+                             tree_lookup, references, &wp_state);
+        uint64_t v =
+            reader->ReadHybridUintClusteredInlined<uses_lz77>(res.context, br);
+        p[x] = MakePixel(v, res.multiplier, res.guess);
+        wp_state.UpdateErrors(p[x], x, y, channel.w);
+      }
+      for (size_t x = channel.w - 2; x < channel.w; x++) decode_edge_pixel(x);
+    } else {
+      for (size_t x = 0; x < channel.w; x++) decode_edge_pixel(x);
+    }
+  }
+}
+
+// Decodes the w values of a row whose pixels all use the *clustered* context
+// ctx. LZ77 copies are taken a block at a time; without LZ77, multi_symbol
+// decodes several short prefix codes per table lookup, which requires a
+// successful reader->PrepareMultiSymbolTable(ctx).
+template <bool uses_lz77>
+void ReadRowValues(BitReader *br, ANSSymbolReader *reader, size_t ctx,
+                   bool multi_symbol, size_t w, uint32_t *JXL_RESTRICT values) {
+  for (size_t x = 0; x < w;) {
+    size_t n = 0;
+    if (uses_lz77) {
+      n = reader->ReadCopiedValues(w - x, values + x);
+    } else if (multi_symbol) {
+      n = reader->ReadShortHuffmanValues(br, w - x, values + x);
+    }
+    if (n == 0) {
+      values[x] = reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx, br);
+      n = 1;
+    }
+    x += n;
+  }
+}
+
+// With uses_lz77 == false, the symbol reads skip all the LZ77 checks.
+template <bool uses_lz77>
 Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                                  const std::vector<uint8_t> &context_map,
                                  const Tree &global_tree,
@@ -159,14 +292,6 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
   JXL_DEBUG_V(3, "Decoded MA tree with %" PRIuS " nodes", tree.size());
 
   // MAANS decode
-  const auto make_pixel = [](uint64_t v, pixel_type multiplier,
-                             pixel_type_w offset) -> pixel_type {
-    JXL_DASSERT((v & 0xFFFFFFFF) == v);
-    pixel_type_w val = UnpackSigned(v);
-    // if it overflows, it overflows, and we have a problem anyway
-    return val * multiplier + offset;
-  };
-
   if (tree.size() == 1) {
     // special optimized case: no meta-adaptation, so no need
     // to compute properties.
@@ -174,6 +299,16 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
     int64_t offset = tree[0].predictor_offset;
     int32_t multiplier = tree[0].multiplier;
     size_t ctx_id = tree[0].childID;
+    // All the symbols of the channel use the same context, so they can be
+    // decoded one row ahead of the prediction: LZ77 copies a block at a time,
+    // or short prefix codes a few at a time. The prefix table is only worth
+    // building if the channel is larger than it.
+    const size_t num_pixels = channel.w * channel.h;
+    const bool multi_symbol = !uses_lz77 &&
+                              num_pixels > (1u << kHuffmanMultiTableBits) &&
+                              reader->PrepareMultiSymbolTable(ctx_id);
+    const bool rows_ahead = uses_lz77 || multi_symbol;
+    std::vector<uint32_t> row_values(rows_ahead ? channel.w : 0);
     if (predictor == Predictor::Zero) {
       uint32_t value;
       if (reader->IsSingleValueAndAdvance(ctx_id, &value,
@@ -181,18 +316,28 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
         // Special-case: histogram has a single symbol, with no extra bits, and
         // we use ANS mode.
         JXL_DEBUG_V(8, "Fastest track.");
-        pixel_type v = make_pixel(value, multiplier, offset);
+        pixel_type v = MakePixel(value, multiplier, offset);
         for (size_t y = 0; y < channel.h; y++) {
           pixel_type *JXL_RESTRICT r = channel.Row(y);
           std::fill(r, r + channel.w, v);
         }
       } else {
         JXL_DEBUG_V(8, "Fast track.");
-        if (multiplier == 1 && offset == 0) {
+        if (rows_ahead) {
           for (size_t y = 0; y < channel.h; y++) {
             pixel_type *JXL_RESTRICT r = channel.Row(y);
+            ReadRowValues<uses_lz77>(br, reader, ctx_id, multi_symbol,
+                                     channel.w, row_values.data());
             for (size_t x = 0; x < channel.w; x++) {
-              uint32_t v = reader->ReadHybridUintClustered(ctx_id, br);
+              r[x] = MakePixel(row_values[x], multiplier, offset);
+            }
+          }
+        } else if (multiplier == 1 && offset == 0) {
+          for (size_t y = 0; y < channel.h; y++) {
+            pixel_type *JXL_RESTRICT r = channel.Row(y);
+            for (size_t x = 0; x < channel.w; x++) {
+              uint32_t v =
+                  reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx_id, br);
               r[x] = UnpackSigned(v);
             }
           }
@@ -200,8 +345,9 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
           for (size_t y = 0; y < channel.h; y++) {
             pixel_type *JXL_RESTRICT r = channel.Row(y);
             for (size_t x = 0; x < channel.w; x++) {
-              uint32_t v = reader->ReadHybridUintClustered(ctx_id, br);
-              r[x] = make_pixel(v, multiplier, offset);
+              uint32_t v =
+                  reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx_id, br);
+              r[x] = MakePixel(v, multiplier, offset);
             }
           }
         }
@@ -212,30 +358,46 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
       uint32_t run = 0;
       uint32_t v = 0;
       pixel_type_w sv = 0;
+      // Consecutive literals are decoded a few at a time into `pending`, never
+      // more than the pixels left in the channel.
+      const bool multi_literals = num_pixels > (1u << kHuffmanMultiTableBits) &&
+                                  reader->PrepareMultiSymbolTable(ctx_id);
+      uint32_t pending[kMaxHuffmanMultiSymbols];
+      size_t num_pending = 0;
+      size_t next_pending = 0;
+      size_t pixels_left = num_pixels;
+      const auto next_residual = [&]() {
+        if (run == 0) {
+          if (multi_literals && next_pending == num_pending) {
+            num_pending =
+                reader->ReadShortHuffmanValues(br, pixels_left, pending);
+            next_pending = 0;
+          }
+          if (next_pending < num_pending) {
+            v = pending[next_pending++];
+          } else {
+            reader->ReadHybridUintClusteredHuffRleOnly(ctx_id, br, &v, &run);
+          }
+          sv = UnpackSigned(v);
+        } else {
+          run--;
+        }
+        pixels_left--;
+      };
       for (size_t y = 0; y < channel.h; y++) {
         pixel_type *JXL_RESTRICT r = channel.Row(y);
         const pixel_type *JXL_RESTRICT rtop = (y ? channel.Row(y - 1) : r - 1);
         const pixel_type *JXL_RESTRICT rtopleft =
             (y ? channel.Row(y - 1) - 1 : r - 1);
         pixel_type_w guess = (y ? rtop[0] : 0);
-        if (run == 0) {
-          reader->ReadHybridUintClusteredHuffRleOnly(ctx_id, br, &v, &run);
-          sv = UnpackSigned(v);
-        } else {
-          run--;
-        }
+        next_residual();
         r[0] = sv + guess;
         for (size_t x = 1; x < channel.w; x++) {
           pixel_type left = r[x - 1];
           pixel_type top = rtop[x];
           pixel_type topleft = rtopleft[x];
           pixel_type_w guess = ClampedGradient(top, left, topleft);
-          if (!run) {
-            reader->ReadHybridUintClusteredHuffRleOnly(ctx_id, br, &v, &run);
-            sv = UnpackSigned(v);
-          } else {
-            run--;
-          }
+          next_residual();
           r[x] = sv + guess;
         }
       }
@@ -245,13 +407,21 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
       const intptr_t onerow = channel.plane.PixelsPerRow();
       for (size_t y = 0; y < channel.h; y++) {
         pixel_type *JXL_RESTRICT r = channel.Row(y);
+        if (rows_ahead) {
+          ReadRowValues<uses_lz77>(br, reader, ctx_id, multi_symbol,
+                                   channel.w, row_values.data());
+        }
         for (size_t x = 0; x < channel.w; x++) {
           pixel_type left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
           pixel_type top = (y ? *(r + x - onerow) : left);
           pixel_type topleft = (x && y ? *(r + x - 1 - onerow) : left);
           pixel_type guess = ClampedGradient(top, left, topleft);
-          uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
-          r[x] = make_pixel(v, 1, guess);
+          uint64_t v =
+              rows_ahead
+                  ? row_values[x]
+                  : reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx_id,
+                                                                      br);
+          r[x] = MakePixel(v, 1, guess);
         }
       }
     } else if (predictor != Predictor::Weighted) {
@@ -260,13 +430,21 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
       const intptr_t onerow = channel.plane.PixelsPerRow();
       for (size_t y = 0; y < channel.h; y++) {
         pixel_type *JXL_RESTRICT r = channel.Row(y);
+        if (rows_ahead) {
+          ReadRowValues<uses_lz77>(br, reader, ctx_id, multi_symbol,
+                                   channel.w, row_values.data());
+        }
         for (size_t x = 0; x < channel.w; x++) {
           PredictionResult pred =
               PredictNoTreeNoWP(channel.w, r + x, onerow, x, y, predictor);
           pixel_type_w g = pred.guess + offset;
-          uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
+          uint64_t v =
+              rows_ahead
+                  ? row_values[x]
+                  : reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx_id,
+                                                                      br);
           // NOTE: pred.multiplier is unset.
-          r[x] = make_pixel(v, multiplier, g);
+          r[x] = MakePixel(v, multiplier, g);
         }
       }
     } else {
@@ -275,13 +453,21 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
       weighted::State wp_state(wp_header, channel.w, channel.h);
       for (size_t y = 0; y < channel.h; y++) {
         pixel_type *JXL_RESTRICT r = channel.Row(y);
+        if (rows_ahead) {
+          ReadRowValues<uses_lz77>(br, reader, ctx_id, multi_symbol,
+                                   channel.w, row_values.data());
+        }
         for (size_t x = 0; x < channel.w; x++) {
           pixel_type_w g = PredictNoTreeWP(channel.w, r + x, onerow, x, y,
                                            predictor, &wp_state)
                                .guess +
                            offset;
-          uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
-          r[x] = make_pixel(v, multiplier, g);
+          uint64_t v =
+              rows_ahead
+                  ? row_values[x]
+                  : reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx_id,
+                                                                      br);
+          r[x] = MakePixel(v, multiplier, g);
           wp_state.UpdateErrors(r[x], x, y, channel.w);
         }
       }
@@ -319,8 +505,9 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                 std::max<pixel_type_w>(-kPropRangeFast, top + left - topleft),
                 kPropRangeFast - 1);
         uint32_t ctx_id = context_lookup[pos];
-        uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
-        r[x] = make_pixel(v, multipliers[pos],
+        uint64_t v =
+            reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx_id, br);
+        r[x] = MakePixel(v, multipliers[pos],
                           static_cast<pixel_type_w>(offsets[pos]) + guess);
       }
     }
@@ -331,95 +518,91 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
     Properties properties(1);
     for (size_t y = 0; y < channel.h; y++) {
       pixel_type *JXL_RESTRICT r = channel.Row(y);
-      for (size_t x = 0; x < channel.w; x++) {
-        size_t offset = 0;
-        pixel_type_w left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
-        pixel_type_w top = (y ? *(r + x - onerow) : left);
-        pixel_type_w topleft = (x && y ? *(r + x - 1 - onerow) : left);
-        pixel_type_w topright =
-            (x + 1 < channel.w && y ? *(r + x + 1 - onerow) : top);
-        pixel_type_w toptop = (y > 1 ? *(r + x - onerow - onerow) : top);
+      const auto decode_pixel = [&](size_t x, pixel_type_w left,
+                                    pixel_type_w top, pixel_type_w topleft,
+                                    pixel_type_w topright,
+                                    pixel_type_w toptop) {
         int32_t guess = wp_state.Predict</*compute_properties=*/true>(
             x, y, channel.w, top, left, topright, topleft, toptop, &properties,
-            offset);
+            /*offset=*/0);
         uint32_t pos =
             kPropRangeFast + std::min(std::max(-kPropRangeFast, properties[0]),
                                       kPropRangeFast - 1);
         uint32_t ctx_id = context_lookup[pos];
-        uint64_t v = reader->ReadHybridUintClustered(ctx_id, br);
-        r[x] = make_pixel(v, multipliers[pos],
+        uint64_t v =
+            reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx_id, br);
+        r[x] = MakePixel(v, multipliers[pos],
                           static_cast<pixel_type_w>(offsets[pos]) + guess);
         wp_state.UpdateErrors(r[x], x, y, channel.w);
+      };
+      const auto decode_edge_pixel = [&](size_t x) {
+        pixel_type_w left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
+        pixel_type_w top = (y ? *(r + x - onerow) : left);
+        pixel_type_w topleft = (x && y ? *(r + x - 1 - onerow) : left);
+        pixel_type_w topright =
+            (x + 1 < channel.w && y ? *(r + x + 1 - onerow) : top);
+        pixel_type_w toptop = (y > 1 ? *(r + x - onerow - onerow) : top);
+        decode_pixel(x, left, top, topleft, topright, toptop);
+      };
+      if (y > 1 && channel.w > 2) {
+        // Each pixel depends on the previous one through the weighted
+        // predictor, so keep the edge checks out of the dependency chain.
+        decode_edge_pixel(0);
+        for (size_t x = 1; x + 1 < channel.w; x++) {
+          const pixel_type *JXL_RESTRICT rt = r + x - onerow;
+          decode_pixel(x, r[x - 1], rt[0], rt[-1], rt[1], rt[-onerow]);
+        }
+        decode_edge_pixel(channel.w - 1);
+      } else {
+        for (size_t x = 0; x < channel.w; x++) decode_edge_pixel(x);
       }
     }
   } else if (!tree_has_wp_prop_or_pred) {
     // special optimized case: the weighted predictor and its properties are not
     // used, so no need to compute weights and properties.
     JXL_DEBUG_V(8, "Slow track.");
-    MATreeLookup tree_lookup(tree);
-    Properties properties = Properties(num_props);
-    const intptr_t onerow = channel.plane.PixelsPerRow();
-    Channel references(properties.size() - kNumNonrefProperties, channel.w);
-    for (size_t y = 0; y < channel.h; y++) {
-      pixel_type *JXL_RESTRICT p = channel.Row(y);
-      PrecomputeReferences(channel, y, *image, chan, &references);
-      InitPropsRow(&properties, static_props, y);
-      if (y > 1 && channel.w > 8 && references.w == 0) {
-        for (size_t x = 0; x < 2; x++) {
-          PredictionResult res =
-              PredictTreeNoWP(&properties, channel.w, p + x, onerow, x, y,
-                              tree_lookup, references);
-          uint64_t v = reader->ReadHybridUintClustered(res.context, br);
-          p[x] = make_pixel(v, res.multiplier, res.guess);
-        }
-        for (size_t x = 2; x < channel.w - 2; x++) {
-          PredictionResult res =
-              PredictTreeNoWPNEC(&properties, channel.w, p + x, onerow, x, y,
-                                 tree_lookup, references);
-          uint64_t v = reader->ReadHybridUintClustered(res.context, br);
-          p[x] = make_pixel(v, res.multiplier, res.guess);
-        }
-        for (size_t x = channel.w - 2; x < channel.w; x++) {
-          PredictionResult res =
-              PredictTreeNoWP(&properties, channel.w, p + x, onerow, x, y,
-                              tree_lookup, references);
-          uint64_t v = reader->ReadHybridUintClustered(res.context, br);
-          p[x] = make_pixel(v, res.multiplier, res.guess);
-        }
-      } else {
-        for (size_t x = 0; x < channel.w; x++) {
-          PredictionResult res =
-              PredictTreeNoWP(&properties, channel.w, p + x, onerow, x, y,
-                              tree_lookup, references);
-          uint64_t v = reader->ReadHybridUintClustered(res.context, br);
-          p[x] = make_pixel(v, res.multiplier, res.guess);
-        }
-      }
+    MATreeTable tree_table;
+    if (channel.w * channel.h >= MATreeTable::kMaxCells &&
+        tree_table.Init(tree)) {
+      DecodeChannelTreeNoWP<uses_lz77>(br, reader, tree_table, num_props,
+                                       static_props, chan, image);
+    } else {
+      DecodeChannelTreeNoWP<uses_lz77>(br, reader, MATreeLookup(tree),
+                                       num_props, static_props, chan, image);
     }
   } else {
     JXL_DEBUG_V(8, "Slowest track.");
-    MATreeLookup tree_lookup(tree);
-    Properties properties = Properties(num_props);
-    const intptr_t onerow = channel.plane.PixelsPerRow();
-    Channel references(properties.size() - kNumNonrefProperties, channel.w);
-    weighted::State wp_state(wp_header, channel.w, channel.h);
-    for (size_t y = 0; y < channel.h; y++) {
-      pixel_type *JXL_RESTRICT p = channel.Row(y);
-      InitPropsRow(&properties, static_props, y);
-      PrecomputeReferences(channel, y, *image, chan, &references);
-      for (size_t x = 0; x < channel.w; x++) {
-        PredictionResult res =
-            PredictTreeWP(&properties, channel.w, p + x, onerow, x, y,
-                          tree_lookup, references, &wp_state);
-        uint64_t v = reader->ReadHybridUintClustered(res.context, br);
-        p[x] = make_pixel(v, res.multiplier, res.guess);
-        wp_state.UpdateErrors(p[x], x, y, channel.w);
-      }
+    MATreeTable tree_table;
+    if (channel.w * channel.h >= MATreeTable::kMaxCells &&
+        tree_table.Init(tree)) {
+      DecodeChannelTreeWP<uses_lz77>(br, reader, tree_table, num_props,
+                                     static_props, wp_header, chan, image);
+    } else {
+      DecodeChannelTreeWP<uses_lz77>(br, reader, MATreeLookup(tree),
+                                     num_props, static_props, wp_header, chan,
+                                     image);
     }
   }
   return true;
 }
 
+}  // namespace
+
+Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
+                                 const std::vector<uint8_t> &context_map,
+                                 const Tree &global_tree,
+                                 const weighted::Header &wp_header,
+                                 pixel_type chan, size_t group_id,
+                                 Image *image) {
+  if (reader->UsesLZ77()) {
+    return DecodeModularChannelMAANS</*uses_lz77=*/true>(
+        br, reader, context_map, global_tree, wp_header, chan, group_id,
+        image);
+  }
+  return DecodeModularChannelMAANS</*uses_lz77=*/false>(
+      br, reader, context_map, global_tree, wp_header, chan, group_id, image);
+}
+
 GroupHeader::GroupHeader() { Bundle::Init(this); }
 
 Status ValidateChannelDimensions(const Image &image,
@@ -22,8 +22,11 @@
 
 namespace jxl {
 
-typedef int32_t pixel_type;  // can use int16_t if it's only for 8-bit images.
-                             // Need some wiggle room for YCoCg / Squeeze etc
+// Sample values of modular channels. int16_t would hold 8-bit images, but
+// RCTs, Squeeze and Palette deltas widen the range of the channels, and the
+// header bit depth does not bound the values a decoder has to reconstruct
+// from the residuals: channels are int32_t regardless of the bit depth.
+typedef int32_t pixel_type;
 
 typedef int64_t pixel_type_w;
 
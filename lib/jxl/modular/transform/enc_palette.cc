@@ -5,11 +5,14 @@
 
 #include "lib/jxl/modular/transform/enc_palette.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <map>
-#include <set>
+#include <numeric>
 
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/modular/encoding/context_predict.h"
@@ -94,6 +97,79 @@ static int QuantizeColorToImplicitPaletteIndex(
   }
 }
 
+// Open-addressing hash set of the colors of `nb` channels, which keeps them in
+// insertion order and counts them. Ordered containers of std::vector allocate
+// for every color and compare the colors channel by channel on every lookup.
+class ColorSet {
+ public:
+  explicit ColorSet(size_t nb) : nb_(nb) { Rehash(64); }
+
+  size_t size() const { return counts_.size(); }
+  const pixel_type *Color(size_t i) const { return &colors_[i * nb_]; }
+  uint32_t &Count(size_t i) { return counts_[i]; }
+
+  // Returns the index of the color, adding it with a count of 0 if it is not
+  // in the set yet.
+  size_t Insert(const pixel_type *color) {
+    size_t slot = FindSlot(color);
+    if (slots_[slot] != 0) return slots_[slot] - 1;
+    if (2 * (size() + 1) > slots_.size()) {
+      Rehash(2 * slots_.size());
+      slot = FindSlot(color);
+    }
+    colors_.insert(colors_.end(), color, color + nb_);
+    counts_.push_back(0);
+    slots_[slot] = size();
+    return size() - 1;
+  }
+
+  // Returns the index of the color, or size() if it is not in the set.
+  size_t Find(const pixel_type *color) const {
+    const size_t slot = FindSlot(color);
+    return slots_[slot] == 0 ? size() : slots_[slot] - 1;
+  }
+
+  // Indices of the colors in lexicographic order.
+  std::vector<uint32_t> SortedIndices() const {
+    std::vector<uint32_t> indices(size());
+    std::iota(indices.begin(), indices.end(), 0);
+    std::sort(indices.begin(), indices.end(), [&](uint32_t a, uint32_t b) {
+      return std::lexicographical_compare(Color(a), Color(a) + nb_, Color(b),
+                                          Color(b) + nb_);
+    });
+    return indices;
+  }
+
+ private:
+  // Slot of the color, or the empty slot where it would be inserted.
+  size_t FindSlot(const pixel_type *color) const {
+    uint64_t hash = 0;
+    for (size_t c = 0; c < nb_; c++) {
+      hash = (hash ^ static_cast<uint32_t>(color[c])) * 0x9E3779B97F4A7C15ull;
+    }
+    const size_t mask = slots_.size() - 1;
+    for (size_t slot = (hash >> 32) & mask;; slot = (slot + 1) & mask) {
+      if (slots_[slot] == 0 ||
+          std::equal(color, color + nb_, Color(slots_[slot] - 1))) {
+        return slot;
+      }
+    }
+  }
+
+  void Rehash(size_t num_slots) {
+    slots_.assign(num_slots, 0);
+    for (size_t i = 0; i < size(); i++) {
+      slots_[FindSlot(Color(i))] = i + 1;
+    }
+  }
+
+  size_t nb_;
+  std::vector<pixel_type> colors_;
+  std::vector<uint32_t> counts_;
+  // Index of the color plus one, 0 for empty slots.
+  std::vector<uint32_t> slots_;
+};
+
 }  // namespace palette_internal
 
 int RoundInt(int value, int div) {  // symmetric rounding around 0
@@ -162,7 +238,8 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
                            uint32_t &nb_colors, uint32_t &nb_deltas,
                            bool ordered, bool lossy, Predictor &predictor,
                            const weighted::Header &wp_header,
-                           PaletteIterationData &palette_iteration_data) {
+                           PaletteIterationData &palette_iteration_data,
+                           ThreadPool *pool) {
   JXL_QUIET_RETURN_IF_ERROR(CheckEqualChannels(input, begin_c, end_c));
   JXL_ASSERT(begin_c >= input.nb_meta_channels);
   uint32_t nb = end_c - begin_c + 1;
@@ -230,9 +307,8 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
       begin_c, end_c, nb_colors);
   nb_deltas = 0;
   bool delta_used = false;
-  std::set<std::vector<pixel_type>>
-      candidate_palette;  // ordered lexicographically
-  std::vector<std::vector<pixel_type>> candidate_palette_imageorder;
+  // In image order.
+  palette_internal::ColorSet candidate_palette(nb);
   std::vector<pixel_type> color(nb);
   std::vector<float> color_with_error(nb);
   std::vector<const pixel_type *> p_in(nb);
@@ -242,7 +318,7 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
     nb_deltas = palette_iteration_data.frequent_deltas[0].size();
 
     // Count color frequency for colors that make a cross.
-    std::map<std::vector<pixel_type>, size_t> color_freq_map;
+    palette_internal::ColorSet cross_colors(nb);
     for (size_t y = 1; y + 1 < h; y++) {
       for (uint32_t c = 0; c < nb; c++) {
         p_in[c] = input.channel[begin_c + c].Row(y);
@@ -262,32 +338,68 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
             }
           }
         }
-        if (makes_cross) color_freq_map[color] += 1;
+        if (makes_cross) {
+          cross_colors.Count(cross_colors.Insert(color.data()))++;
+        }
       }
     }
     // Add colors satisfying frequency condition to the palette.
     constexpr float kImageFraction = 0.01f;
     size_t color_frequency_lower_bound = 5 + input.h * input.w * kImageFraction;
-    for (const auto &color_freq : color_freq_map) {
-      if (color_freq.second > color_frequency_lower_bound) {
-        candidate_palette.insert(color_freq.first);
-        candidate_palette_imageorder.push_back(color_freq.first);
+    for (uint32_t i : cross_colors.SortedIndices()) {
+      if (cross_colors.Count(i) > color_frequency_lower_bound) {
+        candidate_palette.Insert(cross_colors.Color(i));
       }
     }
-  }
 
-  for (size_t y = 0; y < h; y++) {
-    for (uint32_t c = 0; c < nb; c++) {
-      p_in[c] = input.channel[begin_c + c].Row(y);
-    }
-    for (size_t x = 0; x < w; x++) {
-      if (lossy && candidate_palette.size() >= nb_colors) break;
+    for (size_t y = 0; y < h; y++) {
       for (uint32_t c = 0; c < nb; c++) {
-        color[c] = p_in[c][x];
+        p_in[c] = input.channel[begin_c + c].Row(y);
       }
-      const bool new_color = candidate_palette.insert(color).second;
-      if (new_color) {
-        candidate_palette_imageorder.push_back(color);
+      for (size_t x = 0; x < w; x++) {
+        if (candidate_palette.size() >= nb_colors) break;
+        for (uint32_t c = 0; c < nb; c++) {
+          color[c] = p_in[c][x];
+        }
+        candidate_palette.Insert(color.data());
+      }
+    }
+  } else {
+    // Collects the colors of bands of rows in parallel, in image order within
+    // each band, and gives up as soon as one of them has too many colors.
+    const size_t rows_per_band = std::max<size_t>(1, (1 << 16) / w);
+    const size_t num_bands = DivCeil(h, rows_per_band);
+    std::vector<palette_internal::ColorSet> band_colors(
+        num_bands, palette_internal::ColorSet(nb));
+    std::atomic<bool> too_many_colors{false};
+    JXL_RETURN_IF_ERROR(RunOnPool(
+        pool, 0, num_bands, ThreadPool::NoInit,
+        [&](const uint32_t band, size_t /* thread */) {
+          palette_internal::ColorSet &colors = band_colors[band];
+          std::vector<pixel_type> band_color(nb);
+          std::vector<const pixel_type *> rows(nb);
+          const size_t y1 = std::min(h, (band + 1) * rows_per_band);
+          for (size_t y = band * rows_per_band; y < y1; y++) {
+            if (too_many_colors.load(std::memory_order_relaxed)) return;
+            for (uint32_t c = 0; c < nb; c++) {
+              rows[c] = input.channel[begin_c + c].Row(y);
+            }
+            for (size_t x = 0; x < w; x++) {
+              for (uint32_t c = 0; c < nb; c++) band_color[c] = rows[c][x];
+              colors.Insert(band_color.data());
+              if (colors.size() > nb_colors) {
+                too_many_colors.store(true, std::memory_order_relaxed);
+                return;
+              }
+            }
+          }
+        },
+        "FindPaletteColors"));
+    if (too_many_colors.load()) return false;
+    // Merging the bands in order keeps the colors in image order.
+    for (const palette_internal::ColorSet &colors : band_colors) {
+      for (size_t i = 0; i < colors.size(); i++) {
+        candidate_palette.Insert(colors.Color(i));
       }
       if (candidate_palette.size() > nb_colors) {
         return false;  // too many colors
@@ -315,28 +427,27 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
     }
   }
 
-  int x = 0;
+  // Position in the palette of each color of candidate_palette.
+  std::vector<uint32_t> palette_index(candidate_palette.size());
+  std::vector<uint32_t> palette_order;
   if (ordered) {
     JXL_DEBUG_V(7, "Palette of %i colors, using lexicographic order",
                 nb_colors);
-    for (auto pcol : candidate_palette) {
-      JXL_DEBUG_V(9, "  Color %i :  ", x);
-      for (size_t i = 0; i < nb; i++) {
-        p_palette[nb_deltas + i * onerow + x] = pcol[i];
-      }
-      for (size_t i = 0; i < nb; i++) {
-        JXL_DEBUG_V(9, "%i ", pcol[i]);
-      }
-      x++;
-    }
+    palette_order = candidate_palette.SortedIndices();
   } else {
     JXL_DEBUG_V(7, "Palette of %i colors, using image order", nb_colors);
-    for (auto pcol : candidate_palette_imageorder) {
-      JXL_DEBUG_V(9, "  Color %i :  ", x);
-      for (size_t i = 0; i < nb; i++)
-        p_palette[nb_deltas + i * onerow + x] = pcol[i];
-      for (size_t i = 0; i < nb; i++) JXL_DEBUG_V(9, "%i ", pcol[i]);
-      x++;
+    palette_order.resize(candidate_palette.size());
+    std::iota(palette_order.begin(), palette_order.end(), 0);
+  }
+  for (size_t x = 0; x < palette_order.size(); x++) {
+    const pixel_type *pcol = candidate_palette.Color(palette_order[x]);
+    palette_index[palette_order[x]] = nb_deltas + x;
+    JXL_DEBUG_V(9, "  Color %" PRIuS " :  ", x);
+    for (size_t i = 0; i < nb; i++) {
+      p_palette[nb_deltas + i * onerow + x] = pcol[i];
+    }
+    for (size_t i = 0; i < nb; i++) {
+      JXL_DEBUG_V(9, "%i ", pcol[i]);
     }
   }
   std::vector<weighted::State> wp_states;
@@ -367,16 +478,8 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
       if (!lossy) {
         for (size_t c = 0; c < nb; c++) color[c] = p_in[c][x];
         // Exact search.
-        for (index = 0; static_cast<uint32_t>(index) < nb_colors; index++) {
-          bool found = true;
-          for (size_t c = 0; c < nb; c++) {
-            if (color[c] != p_palette[c * onerow + index]) {
-              found = false;
-              break;
-            }
-          }
-          if (found) break;
-        }
+        const size_t i = candidate_palette.Find(color.data());
+        index = i < palette_index.size() ? palette_index[i] : nb_colors;
         if (index < static_cast<int>(nb_deltas)) {
           delta_used = true;
         }
@@ -548,7 +651,7 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
 Status FwdPalette(Image &input, uint32_t begin_c, uint32_t end_c,
                   uint32_t &nb_colors, uint32_t &nb_deltas, bool ordered,
                   bool lossy, Predictor &predictor,
-                  const weighted::Header &wp_header) {
+                  const weighted::Header &wp_header, ThreadPool *pool) {
   PaletteIterationData palette_iteration_data;
   uint32_t nb_colors_orig = nb_colors;
   uint32_t nb_deltas_orig = nb_deltas;
@@ -556,12 +659,12 @@ Status FwdPalette(Image &input, uint32_t begin_c, uint32_t end_c,
   if (lossy && input.bitdepth >= 8) {
     JXL_RETURN_IF_ERROR(FwdPaletteIteration(
         input, begin_c, end_c, nb_colors_orig, nb_deltas_orig, ordered, lossy,
-        predictor, wp_header, palette_iteration_data));
+        predictor, wp_header, palette_iteration_data, pool));
   }
   palette_iteration_data.final_run = true;
   return FwdPaletteIteration(input, begin_c, end_c, nb_colors, nb_deltas,
                              ordered, lossy, predictor, wp_header,
-                             palette_iteration_data);
+                             palette_iteration_data, pool);
 }
 
 }  // namespace jxl
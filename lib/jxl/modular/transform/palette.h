@@ -151,12 +151,11 @@ static Status InvPalette(Image &input, uint32_t begin_c, uint32_t nb_colors,
           [&](const uint32_t task, size_t /* thread */) {
             const size_t y = task;
             pixel_type *p = input.channel[c0].Row(y);
+            // Clamped indices are never implicit colors: this is a plain,
+            // branchless table lookup.
+            const pixel_type max_index = palette.w - 1;
             for (size_t x = 0; x < w; x++) {
-              const int index = Clamp1(p[x], 0, (pixel_type)palette.w - 1);
-              p[x] = palette_internal::GetPaletteValue(
-                  p_palette, index, /*c=*/0,
-                  /*palette_size=*/palette.w,
-                  /*onerow=*/onerow, /*bit_depth=*/bit_depth);
+              p[x] = p_palette[Clamp1(p[x], 0, max_index)];
             }
           },
           "UndoChannelPalette"));
@@ -169,6 +168,23 @@ static Status InvPalette(Image &input, uint32_t begin_c, uint32_t nb_colors,
             const pixel_type *p_index = input.channel[c0].Row(y);
             for (int c = 0; c < nb; c++)
               p_out[c] = input.channel[c0 + c].Row(y);
+            uint32_t max_index = 0;
+            for (size_t x = 0; x < w; x++) {
+              max_index = std::max(max_index, uint32_t(p_index[x]));
+            }
+            if (max_index < palette.w) {
+              // Only explicit colors (negative indices are above palette.w
+              // as unsigned values): the rows are plain table lookups. The
+              // indices are overwritten by the first channel, done last.
+              for (int c = nb - 1; c >= 0; c--) {
+                const pixel_type *JXL_RESTRICT p_color = p_palette + c * onerow;
+                pixel_type *p = p_out[c];
+                for (size_t x = 0; x < w; x++) {
+                  p[x] = p_color[p_index[x]];
+                }
+              }
+              return;
+            }
             for (size_t x = 0; x < w; x++) {
               const int index = p_index[x];
               for (int c = 0; c < nb; c++) {
@@ -7,6 +7,9 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/common.h"
@@ -82,37 +85,20 @@ JXL_INLINE void FastUnsqueeze(const pixel_type *JXL_RESTRICT p_residual,
 
 #endif
 
-Status InvHSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
-  JXL_ASSERT(c < input.channel.size());
-  JXL_ASSERT(rc < input.channel.size());
-  Channel &chin = input.channel[c];
-  const Channel &chin_residual = input.channel[rc];
-  // These must be valid since we ran MetaApply already.
-  JXL_ASSERT(chin.w == DivCeil(chin.w + chin_residual.w, 2));
-  JXL_ASSERT(chin.h == chin_residual.h);
-
-  if (chin_residual.w == 0) {
-    // Short-circuit: output channel has same dimensions as input.
-    input.channel[c].hshift--;
-    return true;
-  }
-
-  // Note: chin.w >= chin_residual.w and at most 1 different.
-  Channel chout(chin.w + chin_residual.w, chin.h, chin.hshift - 1, chin.vshift);
-  JXL_DEBUG_V(4,
-              "Undoing horizontal squeeze of channel %i using residuals in "
-              "channel %i (going from width %" PRIuS " to %" PRIuS ")",
-              c, rc, chin.w, chout.w);
-
-  if (chin_residual.h == 0) {
-    // Short-circuit: channel with no pixels.
-    input.channel[c] = std::move(chout);
-    return true;
-  }
-  auto unsqueeze_row = [&](size_t y, size_t x0) {
+// Rows of a horizontal unsqueeze task. Horizontal unsqueeze has horizontal
+// data dependencies, so it is done 8 rows at a time.
+static constexpr size_t kRowsPerTask = 8;
+// Columns of a vertical unsqueeze task.
+static constexpr size_t kColsPerTask = 64;
+
+// Undoes the horizontal squeeze of rows [task * kRowsPerTask, (task + 1) *
+// kRowsPerTask) of chin into chout.
+void InvHSqueezeRows(const Channel &chin, const Channel &chin_residual,
+                     Channel *chout, const uint32_t task) {
+  const auto unsqueeze_row = [&](size_t y, size_t x0) {
     const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y);
     const pixel_type *JXL_RESTRICT p_avg = chin.Row(y);
-    pixel_type *JXL_RESTRICT p_out = chout.Row(y);
+    pixel_type *JXL_RESTRICT p_out = chout->Row(y);
     for (size_t x = x0; x < chin_residual.w; x++) {
       pixel_type diff_minus_tendency = p_residual[x];
       pixel_type avg = p_avg[x];
@@ -125,87 +111,165 @@ Status InvHSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
       pixel_type B = A - diff;
       p_out[(x << 1) + 1] = B;
     }
-    if (chout.w & 1) p_out[chout.w - 1] = p_avg[chin.w - 1];
+    if (chout->w & 1) p_out[chout->w - 1] = p_avg[chin.w - 1];
   };
 
-  // somewhat complicated trickery just to be able to SIMD this.
-  // Horizontal unsqueeze has horizontal data dependencies, so we do
-  // 8 rows at a time and treat it as a vertical unsqueeze of a
-  // transposed 8x8 block (or 9x8 for one input).
-  static constexpr const size_t kRowsPerThread = 8;
-  const auto unsqueeze_span = [&](const uint32_t task, size_t /* thread */) {
-    const size_t y0 = task * kRowsPerThread;
-    const size_t rows = std::min(kRowsPerThread, chin.h - y0);
-    size_t x = 0;
+  const size_t y0 = task * kRowsPerTask;
+  const size_t rows = std::min(kRowsPerTask, chin.h - y0);
+  size_t x = 0;
 
 #if HWY_TARGET != HWY_SCALAR
-    intptr_t onerow_in = chin.plane.PixelsPerRow();
-    intptr_t onerow_inr = chin_residual.plane.PixelsPerRow();
-    intptr_t onerow_out = chout.plane.PixelsPerRow();
-    const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y0);
-    const pixel_type *JXL_RESTRICT p_avg = chin.Row(y0);
-    pixel_type *JXL_RESTRICT p_out = chout.Row(y0);
-    HWY_ALIGN pixel_type b_p_avg[9 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_residual[8 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_out_even[8 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_out_odd[8 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_out_evenT[8 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_out_oddT[8 * kRowsPerThread];
-    const HWY_CAPPED(pixel_type, 8) d;
-    const size_t N = Lanes(d);
-    if (chin_residual.w > 16 && rows == kRowsPerThread) {
-      for (; x < chin_residual.w - 9; x += 8) {
-        Transpose8x8Block(p_residual + x, b_p_residual, onerow_inr);
-        Transpose8x8Block(p_avg + x, b_p_avg, onerow_in);
-        for (size_t y = 0; y < kRowsPerThread; y++) {
-          b_p_avg[8 * 8 + y] = p_avg[x + 8 + onerow_in * y];
-        }
-        for (size_t i = 0; i < 8; i++) {
-          FastUnsqueeze(
-              b_p_residual + 8 * i, b_p_avg + 8 * i, b_p_avg + 8 * (i + 1),
-              (x + i ? b_p_out_odd + 8 * ((x + i - 1) & 7) : b_p_avg + 8 * i),
-              b_p_out_even + 8 * i, b_p_out_odd + 8 * i);
-        }
+  // somewhat complicated trickery just to be able to SIMD this: we treat 8
+  // rows as a vertical unsqueeze of a transposed 8x8 block (or 9x8 for one
+  // input).
+  intptr_t onerow_in = chin.plane.PixelsPerRow();
+  intptr_t onerow_inr = chin_residual.plane.PixelsPerRow();
+  intptr_t onerow_out = chout->plane.PixelsPerRow();
+  const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y0);
+  const pixel_type *JXL_RESTRICT p_avg = chin.Row(y0);
+  pixel_type *JXL_RESTRICT p_out = chout->Row(y0);
+  HWY_ALIGN pixel_type b_p_avg[9 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_residual[8 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_out_even[8 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_out_odd[8 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_out_evenT[8 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_out_oddT[8 * kRowsPerTask];
+  const HWY_CAPPED(pixel_type, 8) d;
+  const size_t N = Lanes(d);
+  if (chin_residual.w > 16 && rows == kRowsPerTask) {
+    for (; x < chin_residual.w - 9; x += 8) {
+      Transpose8x8Block(p_residual + x, b_p_residual, onerow_inr);
+      Transpose8x8Block(p_avg + x, b_p_avg, onerow_in);
+      for (size_t y = 0; y < kRowsPerTask; y++) {
+        b_p_avg[8 * 8 + y] = p_avg[x + 8 + onerow_in * y];
+      }
+      for (size_t i = 0; i < 8; i++) {
+        FastUnsqueeze(
+            b_p_residual + 8 * i, b_p_avg + 8 * i, b_p_avg + 8 * (i + 1),
+            (x + i ? b_p_out_odd + 8 * ((x + i - 1) & 7) : b_p_avg + 8 * i),
+            b_p_out_even + 8 * i, b_p_out_odd + 8 * i);
+      }
 
-        Transpose8x8Block(b_p_out_even, b_p_out_evenT, 8);
-        Transpose8x8Block(b_p_out_odd, b_p_out_oddT, 8);
-        for (size_t y = 0; y < kRowsPerThread; y++) {
-          for (size_t i = 0; i < kRowsPerThread; i += N) {
-            auto even = Load(d, b_p_out_evenT + 8 * y + i);
-            auto odd = Load(d, b_p_out_oddT + 8 * y + i);
-            StoreInterleaved(d, even, odd,
-                             p_out + ((x + i) << 1) + onerow_out * y);
-          }
+      Transpose8x8Block(b_p_out_even, b_p_out_evenT, 8);
+      Transpose8x8Block(b_p_out_odd, b_p_out_oddT, 8);
+      for (size_t y = 0; y < kRowsPerTask; y++) {
+        for (size_t i = 0; i < kRowsPerTask; i += N) {
+          auto even = Load(d, b_p_out_evenT + 8 * y + i);
+          auto odd = Load(d, b_p_out_oddT + 8 * y + i);
+          StoreInterleaved(d, even, odd,
+                           p_out + ((x + i) << 1) + onerow_out * y);
         }
       }
     }
+  }
 #endif
-    for (size_t y = 0; y < rows; y++) {
-      unsqueeze_row(y0 + y, x);
+  for (size_t y = 0; y < rows; y++) {
+    unsqueeze_row(y0 + y, x);
+  }
+}
+
+// Undoes the vertical squeeze of columns [task * kColsPerTask, (task + 1) *
+// kColsPerTask) of chin into chout.
+void InvVSqueezeColumns(const Channel &chin, const Channel &chin_residual,
+                        Channel *chout, const uint32_t task) {
+  const size_t x0 = task * kColsPerTask;
+  const size_t x1 = std::min((size_t)(task + 1) * kColsPerTask, chin.w);
+  const size_t w = x1 - x0;
+  // We only iterate up to std::min(chin_residual.h, chin.h) which is
+  // always chin_residual.h.
+  for (size_t y = 0; y < chin_residual.h; y++) {
+    const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y) + x0;
+    const pixel_type *JXL_RESTRICT p_avg = chin.Row(y) + x0;
+    const pixel_type *JXL_RESTRICT p_navg =
+        chin.Row(y + 1 < chin.h ? y + 1 : y) + x0;
+    pixel_type *JXL_RESTRICT p_out = chout->Row(y << 1) + x0;
+    pixel_type *JXL_RESTRICT p_nout = chout->Row((y << 1) + 1) + x0;
+    const pixel_type *p_pout = y > 0 ? chout->Row((y << 1) - 1) + x0 : p_avg;
+    size_t x = 0;
+#if HWY_TARGET != HWY_SCALAR
+    for (; x + 7 < w; x += 8) {
+      FastUnsqueeze(p_residual + x, p_avg + x, p_navg + x, p_pout + x,
+                    p_out + x, p_nout + x);
     }
-  };
-  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, DivCeil(chin.h, kRowsPerThread),
-                                ThreadPool::NoInit, unsqueeze_span,
-                                "InvHorizontalSqueeze"));
-  input.channel[c] = std::move(chout);
-  return true;
+#endif
+    for (; x < w; x++) {
+      pixel_type avg = p_avg[x];
+      pixel_type next_avg = p_navg[x];
+      pixel_type top = p_pout[x];
+      pixel_type tendency = SmoothTendency(top, avg, next_avg);
+      pixel_type diff_minus_tendency = p_residual[x];
+      pixel_type diff = diff_minus_tendency + tendency;
+      pixel_type out = avg + (diff / 2);
+      p_out[x] = out;
+      // If the chin_residual.h == chin.h, the output has an even number
+      // of rows so the next line is fine. Otherwise, this loop won't
+      // write to the last output row which is handled separately.
+      p_nout[x] = out - diff;
+    }
+  }
+
+  if (chout->h & 1) {
+    size_t y = chin.h - 1;
+    const pixel_type *p_avg = chin.Row(y) + x0;
+    pixel_type *p_out = chout->Row(y << 1) + x0;
+    for (size_t x = 0; x < w; x++) {
+      p_out[x] = p_avg[x];
+    }
+  }
 }
 
-Status InvVSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
-  JXL_ASSERT(c < input.channel.size());
-  JXL_ASSERT(rc < input.channel.size());
-  const Channel &chin = input.channel[c];
+// Inverse squeeze of one channel of a squeeze step.
+struct UnsqueezeChannel {
+  uint32_t c;
+  uint32_t rc;
+  Channel chout;
+  // First task of this channel among the ones of the step.
+  size_t first_task;
+};
+
+// Prepares the inverse squeeze of channel c with residuals in channel rc, or
+// updates channel c directly if there is nothing to compute.
+void PrepareUnsqueeze(Image &input, uint32_t c, uint32_t rc, bool horizontal,
+                      std::vector<UnsqueezeChannel> *channels,
+                      size_t *num_tasks) {
+  Channel &chin = input.channel[c];
   const Channel &chin_residual = input.channel[rc];
+  if (horizontal) {
+    // These must be valid since we ran MetaApply already.
+    JXL_ASSERT(chin.w == DivCeil(chin.w + chin_residual.w, 2));
+    JXL_ASSERT(chin.h == chin_residual.h);
+
+    if (chin_residual.w == 0) {
+      // Short-circuit: output channel has same dimensions as input.
+      chin.hshift--;
+      return;
+    }
+    // Note: chin.w >= chin_residual.w and at most 1 different.
+    Channel chout(chin.w + chin_residual.w, chin.h, chin.hshift - 1,
+                  chin.vshift);
+    JXL_DEBUG_V(4,
+                "Undoing horizontal squeeze of channel %i using residuals in "
+                "channel %i (going from width %" PRIuS " to %" PRIuS ")",
+                c, rc, chin.w, chout.w);
+    if (chin_residual.h == 0) {
+      // Short-circuit: channel with no pixels.
+      chin = std::move(chout);
+      return;
+    }
+    channels->push_back(UnsqueezeChannel{c, rc, std::move(chout), *num_tasks});
+    *num_tasks += DivCeil(chin.h, kRowsPerTask);
+    return;
+  }
+
   // These must be valid since we ran MetaApply already.
   JXL_ASSERT(chin.h == DivCeil(chin.h + chin_residual.h, 2));
   JXL_ASSERT(chin.w == chin_residual.w);
 
   if (chin_residual.h == 0) {
     // Short-circuit: output channel has same dimensions as input.
-    input.channel[c].vshift--;
-    return true;
+    chin.vshift--;
+    return;
   }
-
   // Note: chin.h >= chin_residual.h and at most 1 different.
   Channel chout(chin.w, chin.h + chin_residual.h, chin.hshift, chin.vshift - 1);
   JXL_DEBUG_V(
@@ -213,69 +277,18 @@ Status InvVSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
       "Undoing vertical squeeze of channel %i using residuals in channel "
       "%i (going from height %" PRIuS " to %" PRIuS ")",
       c, rc, chin.h, chout.h);
-
   if (chin_residual.w == 0) {
     // Short-circuit: channel with no pixels.
-    input.channel[c] = std::move(chout);
-    return true;
+    chin = std::move(chout);
+    return;
   }
-
-  static constexpr const int kColsPerThread = 64;
-  const auto unsqueeze_slice = [&](const uint32_t task, size_t /* thread */) {
-    const size_t x0 = task * kColsPerThread;
-    const size_t x1 = std::min((size_t)(task + 1) * kColsPerThread, chin.w);
-    const size_t w = x1 - x0;
-    // We only iterate up to std::min(chin_residual.h, chin.h) which is
-    // always chin_residual.h.
-    for (size_t y = 0; y < chin_residual.h; y++) {
-      const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y) + x0;
-      const pixel_type *JXL_RESTRICT p_avg = chin.Row(y) + x0;
-      const pixel_type *JXL_RESTRICT p_navg =
-          chin.Row(y + 1 < chin.h ? y + 1 : y) + x0;
-      pixel_type *JXL_RESTRICT p_out = chout.Row(y << 1) + x0;
-      pixel_type *JXL_RESTRICT p_nout = chout.Row((y << 1) + 1) + x0;
-      const pixel_type *p_pout = y > 0 ? chout.Row((y << 1) - 1) + x0 : p_avg;
-      size_t x = 0;
-#if HWY_TARGET != HWY_SCALAR
-      for (; x + 7 < w; x += 8) {
-        FastUnsqueeze(p_residual + x, p_avg + x, p_navg + x, p_pout + x,
-                      p_out + x, p_nout + x);
-      }
-#endif
-      for (; x < w; x++) {
-        pixel_type avg = p_avg[x];
-        pixel_type next_avg = p_navg[x];
-        pixel_type top = p_pout[x];
-        pixel_type tendency = SmoothTendency(top, avg, next_avg);
-        pixel_type diff_minus_tendency = p_residual[x];
-        pixel_type diff = diff_minus_tendency + tendency;
-        pixel_type out = avg + (diff / 2);
-        p_out[x] = out;
-        // If the chin_residual.h == chin.h, the output has an even number
-        // of rows so the next line is fine. Otherwise, this loop won't
-        // write to the last output row which is handled separately.
-        p_nout[x] = out - diff;
-      }
-    }
-  };
-  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, DivCeil(chin.w, kColsPerThread),
-                                ThreadPool::NoInit, unsqueeze_slice,
-                                "InvVertSqueeze"));
-
-  if (chout.h & 1) {
-    size_t y = chin.h - 1;
-    const pixel_type *p_avg = chin.Row(y);
-    pixel_type *p_out = chout.Row(y << 1);
-    for (size_t x = 0; x < chin.w; x++) {
-      p_out[x] = p_avg[x];
-    }
-  }
-  input.channel[c] = std::move(chout);
-  return true;
+  channels->push_back(UnsqueezeChannel{c, rc, std::move(chout), *num_tasks});
+  *num_tasks += DivCeil(chin.w, kColsPerTask);
 }
 
 Status InvSqueeze(Image &input, std::vector<SqueezeParams> parameters,
                   ThreadPool *pool) {
+  std::vector<UnsqueezeChannel> channels;
   for (int i = parameters.size() - 1; i >= 0; i--) {
     JXL_RETURN_IF_ERROR(
         CheckMetaSqueezeParams(parameters[i], input.channel.size()));
@@ -295,6 +308,11 @@ Status InvSqueeze(Image &input, std::vector<SqueezeParams> parameters,
       input.nb_meta_channels -= parameters[i].num_c;
     }
 
+    // The channels of a step are independent, so all of them are unsqueezed
+    // in a single pass over the pool: the last squeeze steps have many small
+    // channels, which would not have enough tasks for the threads otherwise.
+    channels.clear();
+    size_t num_tasks = 0;
     for (uint32_t c = beginc; c <= endc; c++) {
       uint32_t rc = offset + c - beginc;
       // MetaApply should imply that `rc` is within range, otherwise there's a
@@ -304,11 +322,28 @@ Status InvSqueeze(Image &input, std::vector<SqueezeParams> parameters,
           (input.channel[c].h < input.channel[rc].h)) {
         return JXL_FAILURE("Corrupted squeeze transform");
       }
+      PrepareUnsqueeze(input, c, rc, horizontal, &channels, &num_tasks);
+    }
+    const auto unsqueeze_task = [&](const uint32_t task, size_t /* thread */) {
+      auto it = std::upper_bound(
+          channels.begin(), channels.end(), task,
+          [](const uint32_t task, const UnsqueezeChannel &channel) {
+            return task < channel.first_task;
+          });
+      UnsqueezeChannel &channel = *(it - 1);
+      const Channel &chin = input.channel[channel.c];
+      const Channel &chin_residual = input.channel[channel.rc];
+      const uint32_t channel_task = task - channel.first_task;
       if (horizontal) {
-        JXL_RETURN_IF_ERROR(InvHSqueeze(input, c, rc, pool));
+        InvHSqueezeRows(chin, chin_residual, &channel.chout, channel_task);
       } else {
-        JXL_RETURN_IF_ERROR(InvVSqueeze(input, c, rc, pool));
+        InvVSqueezeColumns(chin, chin_residual, &channel.chout, channel_task);
       }
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_tasks, ThreadPool::NoInit,
+                                  unsqueeze_task, "InvSqueeze"));
+    for (UnsqueezeChannel &channel : channels) {
+      input.channel[channel.c] = std::move(channel.chout);
     }
     input.channel.erase(input.channel.begin() + offset,
                         input.channel.begin() + offset + (endc - beginc + 1));
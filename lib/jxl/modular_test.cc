@@ -5,8 +5,10 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <array>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -18,6 +20,7 @@
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/override.h"
 #include "lib/jxl/base/padded_bytes.h"
+#include "lib/jxl/base/random.h"
 #include "lib/jxl/base/thread_pool_internal.h"
 #include "lib/jxl/codec_in_out.h"
 #include "lib/jxl/color_encoding_internal.h"
@@ -29,12 +32,14 @@
 #include "lib/jxl/enc_cache.h"
 #include "lib/jxl/enc_color_management.h"
 #include "lib/jxl/enc_file.h"
+#include "lib/jxl/enc_modular.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/image_test_utils.h"
 #include "lib/jxl/modular/encoding/enc_encoding.h"
+#include "lib/jxl/modular/encoding/enc_ma.h"
 #include "lib/jxl/modular/encoding/encoding.h"
 #include "lib/jxl/test_utils.h"
 #include "lib/jxl/testdata.h"
@@ -75,6 +80,174 @@ TEST(ModularTest, JXL_TSAN_SLOW_TEST(RoundtripLosslessGroups1024)) {
   TestLosslessGroups(3);
 }
 
+// A frame that fits in one group is decoded on the calling thread, with the
+// pool only used for the transforms and the conversion of the decoded image.
+TEST(ModularTest, RoundtripLosslessSingleGroupThreads) {
+  const PaddedBytes orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io;
+  ASSERT_TRUE(SetFromBytes(Span<const uint8_t>(orig), &io));
+  io.ShrinkTo(io.xsize() / 4, io.ysize() / 4);
+  CompressParams cparams;
+  cparams.SetLossless();
+  cparams.modular_group_size_shift = 3;
+  DecompressParams dparams;
+
+  ThreadPoolInternal pool(4);
+  CodecInOut io_out;
+  Roundtrip(&io, cparams, dparams, &pool, &io_out);
+  EXPECT_LE(ButteraugliDistance(io, io_out, cparams.ba_params, GetJxlCms(),
+                                /*distmap=*/nullptr, &pool),
+            0.0);
+}
+
+// The tree is learned in parallel when there is a pool, and must not depend on
+// the number of threads.
+TEST(ModularTest, LosslessDoesNotDependOnThreads) {
+  const PaddedBytes orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io;
+  ASSERT_TRUE(SetFromBytes(Span<const uint8_t>(orig), &io));
+  io.ShrinkTo(io.xsize() / 4, io.ysize() / 4);
+  CompressParams cparams;
+  cparams.SetLossless();
+
+  PaddedBytes expected;
+  {
+    PassesEncoderState enc_state;
+    ASSERT_TRUE(EncodeFile(cparams, &io, &enc_state, &expected, GetJxlCms(),
+                           /*aux_out=*/nullptr, /*pool=*/nullptr));
+  }
+  for (size_t num_threads : {1, 3, 8}) {
+    ThreadPoolInternal pool(num_threads);
+    PassesEncoderState enc_state;
+    PaddedBytes compressed;
+    ASSERT_TRUE(EncodeFile(cparams, &io, &enc_state, &compressed, GetJxlCms(),
+                           /*aux_out=*/nullptr, &pool));
+    ASSERT_EQ(expected.size(), compressed.size());
+    EXPECT_EQ(0, memcmp(expected.data(), compressed.data(), expected.size()));
+  }
+}
+
+// A tree learned for one image is reused for later images of the same size
+// encoded with the same cache, which must stay lossless.
+TEST(ModularTest, RoundtripLosslessReusedTree) {
+  CompressParams cparams;
+  cparams.SetLossless();
+  cparams.modular_tree_cache = std::make_shared<ModularTreeCache>();
+  DecompressParams dparams;
+  size_t learned_tree_size = 0;
+  for (const char* path :
+       {"jxl/flower/flower.png",
+        "third_party/wesaturate/500px/u76c0g_bliznaca_srgb8.png"}) {
+    const PaddedBytes orig = ReadTestData(path);
+    CodecInOut io;
+    ASSERT_TRUE(SetFromBytes(Span<const uint8_t>(orig), &io));
+    io.ShrinkTo(100, 100);
+    CodecInOut io_out;
+    Roundtrip(&io, cparams, dparams, /*pool=*/nullptr, &io_out);
+    EXPECT_LE(ButteraugliDistance(io, io_out, cparams.ba_params, GetJxlCms(),
+                                  /*distmap=*/nullptr, /*pool=*/nullptr),
+              0.0);
+    const ModularTreeCache& cache = *cparams.modular_tree_cache;
+    ASSERT_FALSE(cache.tree.empty());
+    EXPECT_FALSE(cache.context_map.empty());
+    if (learned_tree_size == 0) learned_tree_size = cache.tree.size();
+    EXPECT_EQ(learned_tree_size, cache.tree.size());
+  }
+}
+
+// RowPredictions must match the per-pixel computation, including at the
+// edges of the channel.
+TEST(ModularTest, RowPredictionsMatchPredict) {
+  Rng rng(0);
+  for (size_t iter = 0; iter < 100; iter++) {
+    const size_t w = rng.UniformU(1, 70);
+    const size_t h = rng.UniformU(1, 6);
+    const int32_t range = iter % 2 ? 4 : (1 << 25);
+    Channel channel(w, h);
+    for (size_t y = 0; y < h; y++) {
+      for (size_t x = 0; x < w; x++) {
+        channel.Row(y)[x] = rng.UniformI(-range, range);
+      }
+    }
+    Channel references(kExtraPropsPerChannel, w);
+    ZeroFillImage(&references.plane);
+    RowPredictions row_predictions;
+    ASSERT_TRUE(row_predictions.Init(channel));
+    const std::array<pixel_type, kNumStaticProperties> static_props = {{0, 0}};
+    Properties expected(kNumNonrefProperties + references.w);
+    Properties actual(expected.size());
+    const intptr_t onerow = channel.plane.PixelsPerRow();
+    for (size_t y = 0; y < h; y++) {
+      InitPropsRow(&expected, static_props, y);
+      row_predictions.ComputeRow(channel, y, references);
+      for (size_t x = 0; x < w; x++) {
+        pixel_type_w predictions[kNumModularPredictors];
+        detail::Predict<detail::kForceComputeProperties |
+                            detail::kAllPredictions,
+                        MATreeLookup>(&expected, w, channel.Row(y) + x, onerow,
+                                      x, y, Predictor::Zero, nullptr,
+                                      &references, nullptr, predictions);
+        row_predictions.FillProperties(x, references, &actual);
+        for (size_t i = RowPredictions::kFirstProperty; i < kWPProp; i++) {
+          ASSERT_EQ(expected[i], actual[i]) << i << " " << x << " " << y;
+        }
+        for (size_t i = 0; i < kNumModularPredictors; i++) {
+          if (static_cast<Predictor>(i) == Predictor::Weighted) continue;
+          ASSERT_EQ(predictions[i],
+                    row_predictions.Prediction(static_cast<Predictor>(i), x))
+              << i << " " << x << " " << y;
+        }
+      }
+    }
+  }
+}
+
+// MATreeTable must give the same leaves as the traversal of the tree.
+TEST(ModularTest, TreeTableMatchesLookup) {
+  Rng rng(0);
+  const int kProps[] = {0, 2, 6, 9};
+  for (size_t iter = 0; iter < 50; iter++) {
+    Tree tree = {PropertyDecisionNode::Leaf(Predictor::Zero)};
+    std::vector<size_t> leaves = {0};
+    const size_t num_splits = rng.UniformU(1, 12);
+    for (size_t i = 0; i < num_splits; i++) {
+      size_t leaf = rng.UniformU(0, leaves.size());
+      size_t pos = leaves[leaf];
+      leaves[leaf] = tree.size();
+      leaves.push_back(tree.size() + 1);
+      tree[pos] = PropertyDecisionNode::Split(kProps[rng.UniformU(0, 4)],
+                                              rng.UniformI(-8, 8), tree.size());
+      for (size_t c = 0; c < 2; c++) {
+        tree.push_back(PropertyDecisionNode::Leaf(
+            static_cast<Predictor>(rng.UniformU(0, kNumModularPredictors)),
+            rng.UniformI(-3, 3), rng.UniformU(1, 4)));
+      }
+    }
+    for (size_t i = 0; i < leaves.size(); i++) tree[leaves[i]].lchild = i;
+
+    std::array<pixel_type, kNumStaticProperties> static_props = {{1, 0}};
+    size_t num_props;
+    bool use_wp, wp_only, gradient_only;
+    FlatTree flat = FilterTree(tree, static_props, &num_props, &use_wp,
+                               &wp_only, &gradient_only);
+    MATreeTable table;
+    ASSERT_TRUE(table.Init(flat));
+    MATreeLookup lookup(flat);
+    Properties properties(num_props);
+    properties[0] = static_props[0];
+    properties[1] = static_props[1];
+    for (size_t i = 0; i < 200; i++) {
+      for (int p : {2, 6, 9}) properties[p] = rng.UniformI(-10, 10);
+      MATreeLookup::LookupResult expected = lookup.Lookup(properties);
+      MATreeLookup::LookupResult actual = table.Lookup(properties);
+      EXPECT_EQ(expected.context, actual.context);
+      EXPECT_EQ(expected.predictor, actual.predictor);
+      EXPECT_EQ(expected.offset, actual.offset);
+      EXPECT_EQ(expected.multiplier, actual.multiplier);
+    }
+  }
+}
+
 TEST(ModularTest, RoundtripLosslessCustomWP_PermuteRCT) {
   ThreadPool* pool = nullptr;
   const PaddedBytes orig =
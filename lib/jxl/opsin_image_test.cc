@@ -12,9 +12,13 @@
 #include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/enc_color_management.h"
 #include "lib/jxl/enc_xyb.h"
+#include "lib/jxl/gaborish.h"
 #include "lib/jxl/image.h"
+#include "lib/jxl/image_ops.h"
+#include "lib/jxl/image_test_utils.h"
 #include "lib/jxl/linalg.h"
 #include "lib/jxl/opsin_params.h"
+#include "lib/jxl/thread_pool_internal.h"
 
 namespace jxl {
 namespace {
@@ -124,5 +128,37 @@ TEST(OpsinImageTest, VerifyGray) {
   }
 }
 
+// The fused conversion matches ToXYB followed by padding and GaborishInverse,
+// including at the image and strip borders.
+TEST(OpsinImageTest, ToXYBAndGaborishInverse) {
+  ThreadPoolInternal pool(4);
+  for (const bool linear : {false, true}) {
+    for (const size_t xsize : {1, 13, 67}) {
+      for (const size_t ysize : {2, 35, 70}) {
+        ImageMetadata metadata;
+        metadata.SetFloat32Samples();
+        metadata.color_encoding =
+            linear ? ColorEncoding::LinearSRGB() : ColorEncoding::SRGB();
+        Image3F color(xsize, ysize);
+        RandomFillImage(&color, 0.0f, 1.0f);
+        ImageBundle ib(&metadata);
+        ib.SetFromImage(std::move(color), metadata.color_encoding);
+
+        Image3F expected(RoundUpToBlockDim(xsize), RoundUpToBlockDim(ysize));
+        expected.ShrinkTo(xsize, ysize);
+        (void)ToXYB(ib, &pool, &expected, GetJxlCms());
+        PadImageToBlockMultipleInPlace(&expected);
+        GaborishInverse(&expected, 0.9908511000000001f, &pool);
+
+        Image3F actual(RoundUpToBlockDim(xsize), RoundUpToBlockDim(ysize));
+        actual.ShrinkTo(xsize, ysize);
+        ToXYBAndGaborishInverse(ib, 0.9908511000000001f, &pool, &actual,
+                                GetJxlCms());
+        VerifyRelativeError(expected, actual, 1e-6f, 1e-6f);
+      }
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jxl
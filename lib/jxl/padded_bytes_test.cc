@@ -122,5 +122,26 @@ TEST(PaddedBytesTest, TestAssignOutside) {
   }
 }
 
+// shrink_to_fit() keeps the data and BitWriter appending after it.
+TEST(PaddedBytesTest, TestShrinkToFit) {
+  PaddedBytes pb;
+  pb.resize(1000);
+  std::iota(pb.begin(), pb.end(), 1);
+  pb.resize(300);
+  pb.shrink_to_fit();
+  EXPECT_EQ(300u, pb.size());
+  EXPECT_EQ(300u, pb.capacity());
+  for (size_t i = 0; i < 300; ++i) {
+    EXPECT_EQ((i + 1) & 0xFF, pb[i]);
+  }
+  EXPECT_EQ(0, pb.data()[300]);
+
+  pb.clear();
+  pb.shrink_to_fit();
+  EXPECT_EQ(0u, pb.capacity());
+  pb.push_back(5);
+  EXPECT_EQ(5, pb[0]);
+}
+
 }  // namespace
 }  // namespace jxl
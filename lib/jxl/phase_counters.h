@@ -0,0 +1,105 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_PHASE_COUNTERS_H_
+#define LIB_JXL_PHASE_COUNTERS_H_
+
+// Always-on counters of the time spent in the phases of decoding and encoding.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+
+namespace jxl {
+
+// Adds the time until the end of its scope to a counter, if not null. Each
+// instance costs two clock reads, so these are only placed around whole
+// sections, groups or frames, not rows.
+class ScopedPhaseTimer {
+ public:
+  explicit ScopedPhaseTimer(std::atomic<uint64_t>* nanoseconds)
+      : nanoseconds_(nanoseconds) {
+    if (nanoseconds_ != nullptr) start_ = std::chrono::steady_clock::now();
+  }
+  ~ScopedPhaseTimer() { Stop(); }
+  ScopedPhaseTimer(const ScopedPhaseTimer&) = delete;
+  ScopedPhaseTimer& operator=(const ScopedPhaseTimer&) = delete;
+
+  // Adds the time so far, and nothing more at the end of the scope.
+  void Stop() {
+    if (nanoseconds_ == nullptr) return;
+    const auto end = std::chrono::steady_clock::now();
+    nanoseconds_->fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start_)
+            .count(),
+        std::memory_order_relaxed);
+    nanoseconds_ = nullptr;
+  }
+
+ private:
+  std::atomic<uint64_t>* nanoseconds_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Counters of a decoder, see JxlDecoderCounters. The times are summed over the
+// threads that run the phase, so that phases interleaved in the same tasks can
+// be told apart.
+struct DecoderCounters {
+  // Same order as JxlDecoderPhase.
+  enum Phase { kHeaders, kDC, kAC, kRender, kOutput, kNumPhases };
+
+  DecoderCounters() { Clear(); }
+
+  std::atomic<uint64_t>* Timer(Phase phase) { return &nanoseconds[phase]; }
+
+  void Clear() {
+    for (auto& n : nanoseconds) n.store(0, std::memory_order_relaxed);
+    frames.store(0, std::memory_order_relaxed);
+    dc_groups.store(0, std::memory_order_relaxed);
+    ac_groups.store(0, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> nanoseconds[kNumPhases];
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> dc_groups;
+  std::atomic<uint64_t> ac_groups;
+};
+
+// Counters of an encoder, see JxlEncoderCounters. Encoding phases run one
+// after the other, so their times are elapsed times on the calling thread, or
+// summed over the frames that are encoded in parallel. Also holds the decoding
+// costs estimated for the frames, see JxlEncoderDecodeCost.
+struct EncoderCounters {
+  // Same order as JxlEncoderPhase.
+  enum Phase { kInput, kTransform, kModular, kWrite, kNumPhases };
+  // Number of stages of DecodeCost.
+  static constexpr size_t kNumDecodeStages = 9;
+
+  EncoderCounters() { Clear(); }
+
+  std::atomic<uint64_t>* Timer(Phase phase) { return &nanoseconds[phase]; }
+
+  void Clear() {
+    for (auto& n : nanoseconds) n.store(0, std::memory_order_relaxed);
+    frames.store(0, std::memory_order_relaxed);
+    groups.store(0, std::memory_order_relaxed);
+    bytes.store(0, std::memory_order_relaxed);
+    for (auto& c : decode_cycles) c.store(0, std::memory_order_relaxed);
+    decode_pixels.store(0, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> nanoseconds[kNumPhases];
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> groups;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> decode_cycles[kNumDecodeStages];
+  std::atomic<uint64_t> decode_pixels;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_PHASE_COUNTERS_H_
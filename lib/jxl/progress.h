@@ -0,0 +1,100 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_PROGRESS_H_
+#define LIB_JXL_PROGRESS_H_
+
+// Progress reports and cancellation of encoding and decoding, see
+// JxlEncoderSetProgressCallback and JxlDecoderSetProgressCallback.
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "jxl/types.h"
+#include "lib/jxl/base/status.h"
+
+namespace jxl {
+
+// Calls a user callback as the tasks of the parallel loops over groups start,
+// and remembers when it asks to abort. Each loop announces its tasks with
+// AddWork before it starts, so the total grows as encoding or decoding reaches
+// later steps and frames.
+class ProgressMonitor {
+ public:
+  // Same as JxlEncoderProgressCallback and JxlDecoderProgressCallback.
+  typedef JXL_BOOL (*Callback)(void* opaque, uint64_t num_done,
+                               uint64_t num_total);
+
+  // Not thread-safe: only called between encoding or decoding calls.
+  void SetCallback(Callback callback, void* opaque) {
+    callback_ = callback;
+    opaque_ = opaque;
+  }
+
+  // Forgets the work counted so far and a previous abort, keeps the callback.
+  void Reset() {
+    num_done_ = 0;
+    num_total_ = 0;
+    aborted_.store(false, std::memory_order_relaxed);
+  }
+
+  void AddWork(uint64_t num_tasks) {
+    if (callback_ == nullptr) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_total_ += num_tasks;
+  }
+
+  // Called at the start of each task. Returns false, and the task should do
+  // nothing, if the callback asked to abort now or before. Thread-safe; the
+  // callback is called by one thread at a time.
+  bool Poll() {
+    if (aborted_.load(std::memory_order_relaxed)) return false;
+    if (callback_ == nullptr) return true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (aborted_.load(std::memory_order_relaxed)) return false;
+    num_done_++;
+    if (!callback_(opaque_, num_done_, num_total_)) {
+      aborted_.store(true, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+  bool Aborted() const { return aborted_.load(std::memory_order_relaxed); }
+
+  // To be returned after a loop whose tasks called Poll, since some of them
+  // may have been skipped.
+  Status Check() const {
+    if (Aborted()) return JXL_FAILURE("Aborted by the progress callback");
+    return true;
+  }
+
+ private:
+  Callback callback_ = nullptr;
+  void* opaque_ = nullptr;
+  std::mutex mutex_;
+  uint64_t num_done_ = 0;
+  uint64_t num_total_ = 0;
+  std::atomic<bool> aborted_{false};
+};
+
+// Helpers for the optional monitor of an encoder or frame decoder state, null
+// if they are not monitored.
+inline void AddProgressWork(ProgressMonitor* progress, uint64_t num_tasks) {
+  if (progress != nullptr) progress->AddWork(num_tasks);
+}
+inline bool PollProgress(ProgressMonitor* progress) {
+  return progress == nullptr || progress->Poll();
+}
+inline Status CheckProgress(const ProgressMonitor* progress) {
+  if (progress == nullptr) return true;
+  return progress->Check();
+}
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_PROGRESS_H_
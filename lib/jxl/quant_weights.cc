@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <cmath>
 #include <limits>
+#include <mutex>
 #include <utility>
 
 #include "lib/jxl/base/bits.h"
@@ -1175,14 +1176,20 @@ DequantMatrices::DequantMatrices() {
   }
 }
 
-Status DequantMatrices::EnsureComputed(uint32_t acs_mask) {
-  const QuantEncoding* library = Library();
-
-  if (!table_storage_) {
-    table_storage_ = hwy::AllocateAligned<float>(2 * kTotalTableSize);
+void DequantMatrices::ResetToDefault() {
+  hwy::AlignedFreeUniquePtr<float[]> table_storage = std::move(table_storage_);
+  *this = DequantMatrices();
+  table_storage_ = std::move(table_storage);
+  if (table_storage_) {
     table_ = table_storage_.get();
     inv_table_ = table_storage_.get() + kTotalTableSize;
   }
+}
+
+Status DequantMatrices::ComputeTables(
+    const std::vector<QuantEncoding>& encodings, uint32_t kind_mask,
+    float* storage) {
+  const QuantEncoding* library = Library();
 
   size_t offsets[kNum * 3 + 1];
   size_t pos = 0;
@@ -1196,35 +1203,78 @@ Status DequantMatrices::EnsureComputed(uint32_t acs_mask) {
   offsets[kNum * 3] = pos;
   JXL_ASSERT(pos == kTotalTableSize);
 
+  for (size_t table = 0; table < kNum; table++) {
+    if ((1 << table) & ~kind_mask) continue;
+    size_t pos = offsets[table * 3];
+    if (encodings[table].mode == QuantEncoding::kQuantModeLibrary) {
+      JXL_CHECK(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
+          library[table], storage, storage + kTotalTableSize, table,
+          QuantTable(table), &pos));
+    } else {
+      JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
+          encodings[table], storage, storage + kTotalTableSize, table,
+          QuantTable(table), &pos));
+    }
+    JXL_ASSERT(pos == offsets[table * 3 + 3]);
+  }
+  return true;
+}
+
+const float* DequantMatrices::DefaultTables(uint32_t kind_mask) {
+  // Never freed, like the other process-wide caches.
+  static std::mutex* mutex = new std::mutex();
+  static float* storage = nullptr;
+  static uint32_t computed_kind_mask = 0;
+  std::lock_guard<std::mutex> lock(*mutex);
+  if (storage == nullptr) {
+    storage = hwy::AllocateAligned<float>(2 * kTotalTableSize).release();
+  }
+  const uint32_t missing_kind_mask = kind_mask & ~computed_kind_mask;
+  if (missing_kind_mask != 0) {
+    const std::vector<QuantEncoding> encodings(kNum,
+                                               QuantEncoding::Library(0));
+    JXL_CHECK(ComputeTables(encodings, missing_kind_mask, storage));
+    computed_kind_mask |= missing_kind_mask;
+  }
+  return storage;
+}
+
+Status DequantMatrices::EnsureComputed(uint32_t acs_mask) {
   uint32_t kind_mask = 0;
   for (size_t i = 0; i < AcStrategy::kNumValidStrategies; i++) {
     if (acs_mask & (1u << i)) {
       kind_mask |= 1u << kQuantTable[i];
     }
   }
+
+  // The library tables are the same for all instances, which share them.
+  const bool all_library =
+      std::all_of(encodings_.begin(), encodings_.end(),
+                  [](const QuantEncoding& encoding) {
+                    return encoding.mode == QuantEncoding::kQuantModeLibrary;
+                  });
+  if (all_library) {
+    const float* storage = DefaultTables(kind_mask);
+    table_ = storage;
+    inv_table_ = storage + kTotalTableSize;
+    computed_mask_ |= acs_mask;
+    return true;
+  }
+
+  if (!table_storage_) {
+    table_storage_ = hwy::AllocateAligned<float>(2 * kTotalTableSize);
+  }
+  table_ = table_storage_.get();
+  inv_table_ = table_storage_.get() + kTotalTableSize;
+
   uint32_t computed_kind_mask = 0;
   for (size_t i = 0; i < AcStrategy::kNumValidStrategies; i++) {
     if (computed_mask_ & (1u << i)) {
       computed_kind_mask |= 1u << kQuantTable[i];
     }
   }
-  for (size_t table = 0; table < kNum; table++) {
-    if ((1 << table) & computed_kind_mask) continue;
-    if ((1 << table) & ~kind_mask) continue;
-    size_t pos = offsets[table * 3];
-    if (encodings_[table].mode == QuantEncoding::kQuantModeLibrary) {
-      JXL_CHECK(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
-          library[table], table_storage_.get(),
-          table_storage_.get() + kTotalTableSize, table, QuantTable(table),
-          &pos));
-    } else {
-      JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
-          encodings_[table], table_storage_.get(),
-          table_storage_.get() + kTotalTableSize, table, QuantTable(table),
-          &pos));
-    }
-    JXL_ASSERT(pos == offsets[table * 3 + 3]);
-  }
+  JXL_RETURN_IF_ERROR(ComputeTables(encodings_, kind_mask & ~computed_kind_mask,
+                                    table_storage_.get()));
   computed_mask_ |= acs_mask;
 
   return true;
@@ -365,6 +365,10 @@ class DequantMatrices {
 
   DequantMatrices();
 
+  // Restores the state of a newly constructed instance, but keeps the storage
+  // of the tables allocated.
+  void ResetToDefault();
+
   static const QuantEncoding* Library();
 
   typedef std::array<QuantEncodingInternal, kNumPredefinedTables * kNum>
@@ -433,8 +437,19 @@ class DequantMatrices {
   static constexpr size_t kTotalTableSize =
       ArraySum(required_size_) * kDCTBlockSize * 3;
 
+  // Computes the tables in kind_mask (bits of QuantTable) into storage, which
+  // holds kTotalTableSize entries followed by kTotalTableSize for inv_table.
+  static Status ComputeTables(const std::vector<QuantEncoding>& encodings,
+                              uint32_t kind_mask, float* storage);
+
+  // Returns the storage of the tables of the library encodings, shared by all
+  // instances; computes those in kind_mask on first use, thread-safely.
+  static const float* DefaultTables(uint32_t kind_mask);
+
   uint32_t computed_mask_ = 0;
-  // kTotalTableSize entries followed by kTotalTableSize for inv_table
+  // kTotalTableSize entries followed by kTotalTableSize for inv_table, only
+  // allocated for custom encodings; otherwise table_ and inv_table_ point to
+  // DefaultTables().
   hwy::AlignedFreeUniquePtr<float[]> table_storage_;
   const float* table_;
   const float* inv_table_;
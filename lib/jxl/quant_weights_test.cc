@@ -157,6 +157,37 @@ TEST(QuantWeightsTest, RAW) {
   RoundtripMatrices(encodings);
 }
 
+// Instances with the library encodings share their tables, the others compute
+// the same library tables in their own storage.
+TEST(QuantWeightsTest, SharedDefaultTables) {
+  DequantMatrices mat1;
+  DequantMatrices mat2;
+  ASSERT_TRUE(mat1.EnsureComputed(1u << AcStrategy::DCT));
+  ASSERT_TRUE(mat2.EnsureComputed(~0u));
+  ASSERT_TRUE(mat1.EnsureComputed(1u << AcStrategy::DCT16X16));
+  EXPECT_EQ(mat1.Matrix(AcStrategy::DCT, 0), mat2.Matrix(AcStrategy::DCT, 0));
+  EXPECT_EQ(mat1.InvMatrix(AcStrategy::DCT16X16, 2),
+            mat2.InvMatrix(AcStrategy::DCT16X16, 2));
+
+  std::vector<QuantEncoding> encodings(DequantMatrices::kNum,
+                                       QuantEncoding::Library(0));
+  std::vector<int> matrix(3 * 32 * 32, 3);
+  encodings[DequantMatrices::kQuantTable[AcStrategy::DCT32X32]] =
+      QuantEncoding::RAW(matrix, 2);
+  DequantMatrices custom;
+  custom.SetEncodings(encodings);
+  ASSERT_TRUE(custom.EnsureComputed(~0u));
+  EXPECT_NE(mat2.Matrix(AcStrategy::DCT, 0), custom.Matrix(AcStrategy::DCT, 0));
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t i = 0; i < kDCTBlockSize; i++) {
+      EXPECT_EQ(mat2.Matrix(AcStrategy::DCT, c)[i],
+                custom.Matrix(AcStrategy::DCT, c)[i]);
+      EXPECT_EQ(mat2.InvMatrix(AcStrategy::DCT, c)[i],
+                custom.InvMatrix(AcStrategy::DCT, c)[i]);
+    }
+  }
+}
+
 class QuantWeightsTargetTest : public hwy::TestWithParamTarget {};
 HWY_TARGET_INSTANTIATE_TEST_SUITE_P(QuantWeightsTargetTest);
 
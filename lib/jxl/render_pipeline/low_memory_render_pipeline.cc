@@ -13,6 +13,19 @@
 #include "lib/jxl/base/arch_macros.h"
 
 namespace jxl {
+namespace {
+// Maximum number of rows passed to a single ProcessRows call; the buffers
+// feeding the trailing stages grow by this many rows.
+constexpr size_t kMaxRowsPerBatch = 16;
+
+// Allocates the image unless it already has the given size.
+void EnsureImageSize(size_t xsize, size_t ysize, ImageF* image) {
+  if (image->xsize() != xsize || image->ysize() != ysize) {
+    *image = ImageF(xsize, ysize);
+  }
+}
+}  // namespace
+
 std::pair<size_t, size_t>
 LowMemoryRenderPipeline::ColorDimensionsToChannelDimensions(
     std::pair<size_t, size_t> in, size_t c, size_t stage) const {
@@ -203,6 +216,16 @@ void LowMemoryRenderPipeline::EnsureBordersStorage() {
   }
 }
 
+void LowMemoryRenderPipeline::ReuseBuffersFrom(RenderPipeline* previous) {
+  LowMemoryRenderPipeline* other =
+      static_cast<LowMemoryRenderPipeline*>(previous);
+  borders_horizontal_ = std::move(other->borders_horizontal_);
+  borders_vertical_ = std::move(other->borders_vertical_);
+  group_data_ = std::move(other->group_data_);
+  stage_data_ = std::move(other->stage_data_);
+  out_of_frame_data_ = std::move(other->out_of_frame_data_);
+}
+
 void LowMemoryRenderPipeline::Init() {
   group_border_ = {0, 0};
   base_color_shift_ = CeilLog2Nonzero(frame_dimensions_.xsize_upsampled_padded /
@@ -272,6 +295,13 @@ void LowMemoryRenderPipeline::Init() {
     }
   }
 
+  rows_per_batch_ = 1;
+  for (size_t i = first_trailing_stage_; i < stages_.size(); i++) {
+    if (stages_[i]->ProcessesMultipleRows()) {
+      rows_per_batch_ = kMaxRowsPerBatch;
+    }
+  }
+
   first_image_dim_stage_ = stages_.size();
   for (size_t i = 0; i < stages_.size(); i++) {
     std::vector<std::pair<size_t, size_t>> input_sizes(shifts.size());
@@ -363,15 +393,17 @@ void LowMemoryRenderPipeline::PrepareForThreadsInternal(size_t num,
 
   use_group_ids_ = use_group_ids;
   size_t num_buffers = use_group_ids_ ? frame_dimensions_.num_groups : num;
-  for (size_t t = group_data_.size(); t < num_buffers; t++) {
-    group_data_.emplace_back();
+  // Buffers may come from a previous call or a previous pipeline, only the
+  // ones that don't have the right size are allocated.
+  if (group_data_.size() < num_buffers) group_data_.resize(num_buffers);
+  for (size_t t = 0; t < group_data_.size(); t++) {
     group_data_[t].resize(shifts.size());
     for (size_t c = 0; c < shifts.size(); c++) {
-      group_data_[t][c] = ImageF(GroupInputXSize(c) + group_data_x_border_ * 2,
-                                 GroupInputYSize(c) + group_data_y_border_ * 2);
+      EnsureImageSize(GroupInputXSize(c) + group_data_x_border_ * 2,
+                      GroupInputYSize(c) + group_data_y_border_ * 2,
+                      &group_data_[t][c]);
     }
   }
-  // TODO(veluca): avoid reallocating buffers if not needed.
   stage_data_.resize(num);
   size_t upsampling = 1u << base_color_shift_;
   size_t group_dim = frame_dimensions_.group_dim * upsampling;
@@ -384,14 +416,23 @@ void LowMemoryRenderPipeline::PrepareForThreadsInternal(size_t num,
     for (size_t c = 0; c < shifts.size(); c++) {
       stage_data_[t][c].resize(stages_.size());
       size_t next_y_border = 0;
+      // The last kInOut stage of the channel produces the input of the
+      // trailing stages, which keep up to rows_per_batch_ of its rows before
+      // processing them.
+      size_t batch_rows = rows_per_batch_ - 1;
       for (size_t i = stages_.size(); i-- > 0;) {
         if (stages_[i]->GetChannelMode(c) ==
             RenderPipelineChannelMode::kInOut) {
-          size_t stage_buffer_ysize =
-              2 * next_y_border + (1 << stages_[i]->settings_.shift_y);
+          size_t stage_buffer_ysize = 2 * next_y_border +
+                                      (1 << stages_[i]->settings_.shift_y) +
+                                      batch_rows;
           stage_buffer_ysize = 1 << CeilLog2Nonzero(stage_buffer_ysize);
           next_y_border = stages_[i]->settings_.border_y;
-          stage_data_[t][c][i] = ImageF(stage_buffer_xsize, stage_buffer_ysize);
+          batch_rows = 0;
+          EnsureImageSize(stage_buffer_xsize, stage_buffer_ysize,
+                          &stage_data_[t][c][i]);
+        } else {
+          stage_data_[t][c][i] = ImageF();
         }
       }
     }
@@ -409,8 +450,11 @@ void LowMemoryRenderPipeline::PrepareForThreadsInternal(size_t num,
         padding +
         std::max(left_padding, std::max(middle_padding, right_padding));
     for (size_t t = 0; t < num; t++) {
-      out_of_frame_data_[t] = ImageF(out_of_frame_xsize, shifts.size());
+      EnsureImageSize(out_of_frame_xsize, shifts.size(),
+                      &out_of_frame_data_[t]);
     }
+  } else {
+    out_of_frame_data_.clear();
   }
 }
 
@@ -552,6 +596,11 @@ void LowMemoryRenderPipeline::RenderRect(size_t thread_id,
   }
   input_rows[first_trailing_stage_].resize(input_data.size(),
                                            std::vector<float*>(1));
+  // Rows waiting for the trailing stages.
+  RenderPipelineStage::RowInfo trailing_rows(
+      input_data.size(), std::vector<float*>(rows_per_batch_));
+  size_t num_trailing_rows = 0;
+  int trailing_y0 = 0;
 
   // Maximum possible shift is 3.
   RenderPipelineStage::RowInfo output_rows(input_data.size(),
@@ -566,6 +615,73 @@ void LowMemoryRenderPipeline::RenderRect(size_t thread_id,
   int num_extra_rows = *std::max_element(virtual_ypadding_for_output_.begin(),
                                          virtual_ypadding_for_output_.end());
 
+  // Runs trailing stage i on rows [0, num_rows) of trailing_rows.
+  auto process_trailing_stage = [&](size_t i, size_t num_rows, size_t xsize,
+                                    size_t xpos, size_t ypos) {
+    if (stages_[i]->ProcessesMultipleRows()) {
+      ProcessStageRows(i, trailing_rows, num_rows, xsize, xpos, ypos,
+                       thread_id);
+      return;
+    }
+    RenderPipelineStage::RowInfo& row = input_rows[first_trailing_stage_];
+    for (size_t r = 0; r < num_rows; r++) {
+      for (size_t c = 0; c < input_data.size(); c++) {
+        row[c][0] = trailing_rows[c][r];
+      }
+      ProcessStageRow(i, row, output_rows, /*xextra=*/0, xsize, xpos, ypos + r,
+                      thread_id);
+    }
+  };
+
+  // Process trailing stages, i.e. the final set of non-kInOut stages, on the
+  // rows collected in trailing_rows; they all have the same input buffer and
+  // no need to use any mirroring.
+  auto process_trailing_rows = [&]() {
+    const size_t num_rows = num_trailing_rows;
+    const int y0 = trailing_y0;
+    num_trailing_rows = 0;
+    for (size_t i = first_trailing_stage_; i < first_image_dim_stage_; i++) {
+      process_trailing_stage(i, num_rows, group_rect[i].xsize(),
+                             group_rect[i].x0(), group_rect[i].y0() + y0);
+    }
+
+    if (first_image_dim_stage_ == stages_.size()) return;
+
+    ssize_t full_image_y0 =
+        y0 + frame_origin_.y0 + group_rect[first_image_dim_stage_].y0();
+    ssize_t row_begin = std::max<ssize_t>(0, -full_image_y0);
+    ssize_t row_end = std::min<ssize_t>(
+        num_rows, ssize_t(full_image_ysize_) - full_image_y0);
+    if (row_end <= row_begin) return;
+
+    ssize_t full_image_x0 =
+        frame_origin_.x0 + group_rect[first_image_dim_stage_].x0();
+    size_t x_skip = 0;
+    if (full_image_x0 < 0) {
+      // Skip pixels.
+      x_skip = -full_image_x0;
+      full_image_x0 = 0;
+    }
+    ssize_t full_image_x1 = frame_origin_.x0 +
+                            group_rect[first_image_dim_stage_].x0() +
+                            group_rect[first_image_dim_stage_].xsize();
+    full_image_x1 = std::min<ssize_t>(full_image_x1, full_image_xsize_);
+
+    if (full_image_x1 <= full_image_x0) return;
+
+    // Only keep the rows inside the image.
+    for (size_t c = 0; c < input_data.size(); c++) {
+      for (ssize_t r = row_begin; r < row_end; r++) {
+        trailing_rows[c][r - row_begin] = trailing_rows[c][r] + x_skip;
+      }
+    }
+    for (size_t i = first_image_dim_stage_; i < stages_.size(); i++) {
+      process_trailing_stage(i, row_end - row_begin,
+                             full_image_x1 - full_image_x0, full_image_x0,
+                             full_image_y0 + row_begin);
+    }
+  };
+
   for (int vy = -num_extra_rows;
        vy < int(group_rect.back().ysize()) + num_extra_rows; vy++) {
     for (size_t i = 0; i < first_trailing_stage_; i++) {
@@ -627,61 +743,23 @@ void LowMemoryRenderPipeline::RenderRect(size_t thread_id,
         }
       }
       // Produce output rows.
-      stages_[i]->ProcessRow(input_rows[i], output_rows,
-                             xpadding_for_output_[i], group_rect[i].xsize(),
-                             group_rect[i].x0(), group_rect[i].y0() + y,
-                             thread_id);
+      ProcessStageRow(i, input_rows[i], output_rows, xpadding_for_output_[i],
+                      group_rect[i].xsize(), group_rect[i].x0(),
+                      group_rect[i].y0() + y, thread_id);
     }
 
-    // Process trailing stages, i.e. the final set of non-kInOut stages; they
-    // all have the same input buffer and no need to use any mirroring.
-
     int y = vy - num_extra_rows;
     if (y < 0 || y >= ssize_t(frame_dimensions_.ysize_upsampled)) continue;
 
+    if (num_trailing_rows == 0) trailing_y0 = y;
     for (size_t c = 0; c < input_data.size(); c++) {
-      input_rows[first_trailing_stage_][c][0] = get_row_buffer(
+      trailing_rows[c][num_trailing_rows] = get_row_buffer(
           stage_input_for_channel_[first_trailing_stage_][c], y, c);
     }
-
-    for (size_t i = first_trailing_stage_; i < first_image_dim_stage_; i++) {
-      stages_[i]->ProcessRow(input_rows[first_trailing_stage_], output_rows,
-                             /*xextra=*/0, group_rect[i].xsize(),
-                             group_rect[i].x0(), group_rect[i].y0() + y,
-                             thread_id);
-    }
-
-    if (first_image_dim_stage_ == stages_.size()) continue;
-
-    ssize_t full_image_y =
-        y + frame_origin_.y0 + group_rect[first_image_dim_stage_].y0();
-    if (full_image_y < 0 || full_image_y >= ssize_t(full_image_ysize_)) {
-      continue;
-    }
-
-    ssize_t full_image_x0 =
-        frame_origin_.x0 + group_rect[first_image_dim_stage_].x0();
-
-    if (full_image_x0 < 0) {
-      // Skip pixels.
-      for (size_t c = 0; c < input_data.size(); c++) {
-        input_rows[first_trailing_stage_][c][0] -= full_image_x0;
-      }
-      full_image_x0 = 0;
-    }
-    ssize_t full_image_x1 = frame_origin_.x0 +
-                            group_rect[first_image_dim_stage_].x0() +
-                            group_rect[first_image_dim_stage_].xsize();
-    full_image_x1 = std::min<ssize_t>(full_image_x1, full_image_xsize_);
-
-    if (full_image_x1 <= full_image_x0) continue;
-
-    for (size_t i = first_image_dim_stage_; i < stages_.size(); i++) {
-      stages_[i]->ProcessRow(input_rows[first_trailing_stage_], output_rows,
-                             /*xextra=*/0, full_image_x1 - full_image_x0,
-                             full_image_x0, full_image_y, thread_id);
-    }
+    if (++num_trailing_rows == rows_per_batch_) process_trailing_rows();
   }
+  if (num_trailing_rows != 0) process_trailing_rows();
+  for (const auto& stage : stages_) stage->FinishRect(thread_id);
 }
 
 void LowMemoryRenderPipeline::RenderPadding(size_t thread_id, Rect rect) {
@@ -698,11 +776,13 @@ void LowMemoryRenderPipeline::RenderPadding(size_t thread_id, Rect rect) {
     stages_[first_image_dim_stage_ - 1]->ProcessPaddingRow(
         input_rows, rect.xsize(), rect.x0(), rect.y0() + y);
     for (size_t i = first_image_dim_stage_; i < stages_.size(); i++) {
-      stages_[i]->ProcessRow(input_rows, output_rows,
-                             /*xextra=*/0, rect.xsize(), rect.x0(),
-                             rect.y0() + y, thread_id);
+      ProcessStageRow(i, input_rows, output_rows, /*xextra=*/0, rect.xsize(),
+                      rect.x0(), rect.y0() + y, thread_id);
     }
   }
+  for (size_t i = first_image_dim_stage_; i < stages_.size(); i++) {
+    stages_[i]->FinishRect(thread_id);
+  }
 }
 
 void LowMemoryRenderPipeline::ProcessBuffers(size_t group_id,
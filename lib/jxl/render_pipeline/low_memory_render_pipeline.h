@@ -28,6 +28,8 @@ class LowMemoryRenderPipeline final : public RenderPipeline {
 
   void Init() override;
 
+  void ReuseBuffersFrom(RenderPipeline* previous) override;
+
   void EnsureBordersStorage();
   size_t GroupInputXSize(size_t c) const;
   size_t GroupInputYSize(size_t c) const;
@@ -99,6 +101,10 @@ class LowMemoryRenderPipeline final : public RenderPipeline {
   // First stage that doesn't have any kInOut channel.
   size_t first_trailing_stage_;
 
+  // Number of rows that are collected before running the trailing stages on
+  // them, greater than 1 only if some of these stages implement ProcessRows.
+  size_t rows_per_batch_;
+
   // Origin and size of the frame after switching to image dimensions.
   FrameOrigin frame_origin_;
   size_t full_image_xsize_;
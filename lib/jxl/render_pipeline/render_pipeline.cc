@@ -6,7 +6,9 @@
 #include "lib/jxl/render_pipeline/render_pipeline.h"
 
 #include <algorithm>
+#include <chrono>
 
+#include "lib/jxl/base/cache_aligned.h"
 #include "lib/jxl/render_pipeline/low_memory_render_pipeline.h"
 #include "lib/jxl/render_pipeline/simple_render_pipeline.h"
 #include "lib/jxl/sanitizers.h"
@@ -19,7 +21,8 @@ void RenderPipeline::Builder::AddStage(
 }
 
 std::unique_ptr<RenderPipeline> RenderPipeline::Builder::Finalize(
-    FrameDimensions frame_dimensions) && {
+    FrameDimensions frame_dimensions,
+    std::unique_ptr<RenderPipeline> previous) && {
 #if JXL_ENABLE_ASSERT
   // Check that the last stage is not an kInOut stage for any channel, and that
   // there is at least one stage.
@@ -36,6 +39,7 @@ std::unique_ptr<RenderPipeline> RenderPipeline::Builder::Finalize(
   } else {
     res = jxl::make_unique<LowMemoryRenderPipeline>();
   }
+  res->simple_implementation_ = use_simple_implementation_;
 
   res->padding_.resize(stages_.size());
   for (size_t i = stages_.size(); i-- > 0;) {
@@ -87,7 +91,39 @@ std::unique_ptr<RenderPipeline> RenderPipeline::Builder::Finalize(
       }
     }
   }
+  if (stats_ != nullptr && !use_simple_implementation_) {
+    res->stats_ = stats_;
+    for (const auto& stage : stages_) {
+      res->stats_index_.push_back(stats_->StageIndex(stage->GetName()));
+      size_t rows_per_pixel = 0;
+      const size_t input_rows = 2 * stage->settings_.border_y + 1;
+      const size_t output_rows = size_t{1} << (stage->settings_.shift_x +
+                                                stage->settings_.shift_y);
+      for (size_t c = 0; c < num_c_; c++) {
+        switch (stage->GetChannelMode(c)) {
+          case RenderPipelineChannelMode::kIgnored:
+            break;
+          case RenderPipelineChannelMode::kInPlace:
+            rows_per_pixel += 2;
+            break;
+          case RenderPipelineChannelMode::kInput:
+            rows_per_pixel += input_rows;
+            break;
+          case RenderPipelineChannelMode::kInOut:
+            rows_per_pixel += input_rows + output_rows;
+            break;
+        }
+      }
+      res->stats_rows_per_pixel_.push_back(rows_per_pixel);
+    }
+  }
   res->stages_ = std::move(stages_);
+  if (previous != nullptr &&
+      previous->simple_implementation_ == use_simple_implementation_) {
+    res->ReuseBuffersFrom(previous.get());
+  }
+  CacheAligned::ScopedCategory scoped_category(
+      CacheAligned::Category::kPipeline);
   res->Init();
   return res;
 }
@@ -117,13 +153,49 @@ void RenderPipeline::InputReady(
 }
 
 Status RenderPipeline::PrepareForThreads(size_t num, bool use_group_ids) {
+  CacheAligned::ScopedCategory scoped_category(
+      CacheAligned::Category::kPipeline);
   for (const auto& stage : stages_) {
     JXL_RETURN_IF_ERROR(stage->PrepareForThreads(num));
   }
+  if (stats_ != nullptr) stats_->PrepareForThreads(num);
   PrepareForThreadsInternal(num, use_group_ids);
   return true;
 }
 
+void RenderPipeline::ProcessStageRowWithStats(
+    size_t i, const RenderPipelineStage::RowInfo& input_rows,
+    const RenderPipelineStage::RowInfo& output_rows, size_t xextra,
+    size_t xsize, size_t xpos, size_t ypos, size_t thread_id) const {
+  const auto start = std::chrono::steady_clock::now();
+  stages_[i]->ProcessRow(input_rows, output_rows, xextra, xsize, xpos, ypos,
+                         thread_id);
+  const auto end = std::chrono::steady_clock::now();
+  RenderPipelineStats::Counters& counters =
+      stats_->Get(stats_index_[i], thread_id);
+  counters.nanoseconds +=
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+          .count();
+  counters.rows++;
+  counters.bytes +=
+      stats_rows_per_pixel_[i] * (xsize + 2 * xextra) * sizeof(float);
+}
+
+void RenderPipeline::ProcessStageRowsWithStats(
+    size_t i, const RenderPipelineStage::RowInfo& rows, size_t num_rows,
+    size_t xsize, size_t xpos, size_t ypos, size_t thread_id) const {
+  const auto start = std::chrono::steady_clock::now();
+  stages_[i]->ProcessRows(rows, num_rows, xsize, xpos, ypos, thread_id);
+  const auto end = std::chrono::steady_clock::now();
+  RenderPipelineStats::Counters& counters =
+      stats_->Get(stats_index_[i], thread_id);
+  counters.nanoseconds +=
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+          .count();
+  counters.rows += num_rows;
+  counters.bytes += stats_rows_per_pixel_[i] * num_rows * xsize * sizeof(float);
+}
+
 void RenderPipelineInput::Done() {
   JXL_ASSERT(pipeline_);
   pipeline_->InputReady(group_id_, thread_id_, buffers_);
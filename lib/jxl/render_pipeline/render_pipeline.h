@@ -10,6 +10,7 @@
 
 #include "lib/jxl/image.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
+#include "lib/jxl/render_pipeline/render_pipeline_stats.h"
 
 namespace jxl {
 
@@ -47,6 +48,16 @@ class RenderPipelineInput {
   friend class RenderPipeline;
 };
 
+// Runs the stages of a frame on the groups provided through GetInputBuffers.
+// The implementations, chosen by Builder::Finalize, differ in how they store
+// the intermediate rows: SimpleRenderPipeline keeps full-frame images for
+// each stage, LowMemoryRenderPipeline only the rows of the group being
+// processed and the borders shared with neighbouring groups. An
+// implementation provides the input buffers of a group (PrepareBuffers),
+// runs the stages once they are filled (ProcessBuffers), and allocates its
+// per-thread or per-group storage (Init, PrepareForThreadsInternal). It must
+// run the stages in order on every pixel, including the padding they declare;
+// the final stages are the ones writing the output.
 class RenderPipeline {
  public:
   class Builder {
@@ -61,15 +72,25 @@ class RenderPipeline {
     // the pipeline.
     void UseSimpleImplementation() { use_simple_implementation_ = true; }
 
+    // Makes the pipeline record the time spent and data processed by each
+    // stage into `stats`, which must outlive it. Only the low-memory
+    // implementation records them.
+    void SetStats(RenderPipelineStats* stats) { stats_ = stats; }
+
     // Finalizes setup of the pipeline. Shifts for all channels should be 0 at
-    // this point.
+    // this point. If `previous` is given, e.g. the pipeline of the previous
+    // frame, the new pipeline keeps the buffers allocated by it that have the
+    // size it needs, so that frames with the same dimensions and stages don't
+    // allocate them again.
     std::unique_ptr<RenderPipeline> Finalize(
-        FrameDimensions frame_dimensions) &&;
+        FrameDimensions frame_dimensions,
+        std::unique_ptr<RenderPipeline> previous = nullptr) &&;
 
    private:
     std::vector<std::unique_ptr<RenderPipelineStage>> stages_;
     size_t num_c_;
     bool use_simple_implementation_ = false;
+    RenderPipelineStats* stats_ = nullptr;
   };
 
   friend class Builder;
@@ -115,6 +136,32 @@ class RenderPipeline {
 
   std::vector<uint8_t> group_completed_passes_;
 
+  // Calls ProcessRow of stage i, recording it in stats_ if set.
+  void ProcessStageRow(size_t i, const RenderPipelineStage::RowInfo& input_rows,
+                       const RenderPipelineStage::RowInfo& output_rows,
+                       size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                       size_t thread_id) const {
+    if (stats_ == nullptr) {
+      stages_[i]->ProcessRow(input_rows, output_rows, xextra, xsize, xpos, ypos,
+                             thread_id);
+    } else {
+      ProcessStageRowWithStats(i, input_rows, output_rows, xextra, xsize, xpos,
+                               ypos, thread_id);
+    }
+  }
+
+  // Calls ProcessRows of stage i, recording it in stats_ if set.
+  void ProcessStageRows(size_t i, const RenderPipelineStage::RowInfo& rows,
+                        size_t num_rows, size_t xsize, size_t xpos,
+                        size_t ypos, size_t thread_id) const {
+    if (stats_ == nullptr) {
+      stages_[i]->ProcessRows(rows, num_rows, xsize, xpos, ypos, thread_id);
+    } else {
+      ProcessStageRowsWithStats(i, rows, num_rows, xsize, xpos, ypos,
+                                thread_id);
+    }
+  }
+
   friend class RenderPipelineInput;
 
  private:
@@ -132,6 +179,28 @@ class RenderPipeline {
 
   // Called once frame dimensions and stages are known.
   virtual void Init() {}
+
+  // Takes the buffers of `previous`, which has the same implementation, for
+  // reuse by Init and PrepareForThreadsInternal. Called before Init.
+  virtual void ReuseBuffersFrom(RenderPipeline* previous) {}
+
+  void ProcessStageRowWithStats(size_t i,
+                                const RenderPipelineStage::RowInfo& input_rows,
+                                const RenderPipelineStage::RowInfo& output_rows,
+                                size_t xextra, size_t xsize, size_t xpos,
+                                size_t ypos, size_t thread_id) const;
+  void ProcessStageRowsWithStats(size_t i,
+                                 const RenderPipelineStage::RowInfo& rows,
+                                 size_t num_rows, size_t xsize, size_t xpos,
+                                 size_t ypos, size_t thread_id) const;
+
+  bool simple_implementation_ = false;
+
+  RenderPipelineStats* stats_ = nullptr;
+  // For each stage, its index in stats_ and the number of rows of floats it
+  // reads or writes per pixel of the row it processes.
+  std::vector<size_t> stats_index_;
+  std::vector<size_t> stats_rows_per_pixel_;
 };
 
 }  // namespace jxl
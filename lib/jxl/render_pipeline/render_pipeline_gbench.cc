@@ -0,0 +1,318 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/chroma_from_luma.h"
+#include "lib/jxl/dec_cache.h"
+#include "lib/jxl/dec_xyb.h"
+#include "lib/jxl/image.h"
+#include "lib/jxl/image_bundle.h"
+#include "lib/jxl/image_metadata.h"
+#include "lib/jxl/loop_filter.h"
+#include "lib/jxl/noise.h"
+#include "lib/jxl/render_pipeline/render_pipeline.h"
+#include "lib/jxl/render_pipeline/stage_blending.h"
+#include "lib/jxl/render_pipeline/stage_chroma_upsampling.h"
+#include "lib/jxl/render_pipeline/stage_epf.h"
+#include "lib/jxl/render_pipeline/stage_gaborish.h"
+#include "lib/jxl/render_pipeline/stage_noise.h"
+#include "lib/jxl/render_pipeline/stage_upsampling.h"
+#include "lib/jxl/render_pipeline/stage_write.h"
+#include "lib/jxl/render_pipeline/stage_xyb.h"
+#include "lib/jxl/render_pipeline/stage_ycbcr.h"
+#include "lib/jxl/render_pipeline/test_render_pipeline_stages.h"
+
+namespace jxl {
+namespace {
+
+// Benchmarks of the individual render pipeline stages. Each one renders frames
+// of state.range(0) x state.range(0) output pixels through a low-memory
+// pipeline made of the stages under test, followed by DiscardFinalStage
+// unless the last stage writes the output, one 256x256 group at a time on one
+// thread, as the decoder does. The items per second are output pixels per
+// second; BM_Baseline measures the pipeline without any stage, which the other
+// numbers include.
+
+struct PipelineConfig {
+  size_t num_c = 3;
+  // Passed to FrameDimensions::Set.
+  size_t max_hshift = 0;
+  size_t max_vshift = 0;
+  size_t upsampling = 1;
+  // Whether the stages end with one that has no output, e.g. a write stage.
+  bool has_final_stage = false;
+};
+
+FrameDimensions BenchmarkFrameDimensions(const benchmark::State& state,
+                                         const PipelineConfig& config) {
+  FrameDimensions frame_dim;
+  frame_dim.Set(state.range(0), state.range(0), /*group_size_shift=*/1,
+                config.max_hshift, config.max_vshift,
+                /*modular_mode=*/false, config.upsampling);
+  return frame_dim;
+}
+
+void RenderFrames(
+    benchmark::State& state, const PipelineConfig& config,
+    const std::function<void(RenderPipeline::Builder*)>& add_stages) {
+  const FrameDimensions frame_dim = BenchmarkFrameDimensions(state, config);
+  RenderPipeline::Builder builder(config.num_c);
+  add_stages(&builder);
+  if (!config.has_final_stage) {
+    builder.AddStage(jxl::make_unique<DiscardFinalStage>());
+  }
+  std::unique_ptr<RenderPipeline> pipeline =
+      std::move(builder).Finalize(frame_dim);
+  JXL_CHECK(pipeline->IsInitialized());
+  JXL_CHECK(pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+
+  // The input is copied into the group buffers for every frame, since stages
+  // operating in place modify them.
+  Rng rng(0);
+  std::vector<ImageF> input(config.num_c);
+  for (ImageF& plane : input) {
+    plane = ImageF(frame_dim.group_dim, frame_dim.group_dim);
+    for (size_t y = 0; y < plane.ysize(); y++) {
+      float* JXL_RESTRICT row = plane.Row(y);
+      for (size_t x = 0; x < plane.xsize(); x++) {
+        row[x] = rng.UniformF(0.0f, 1.0f);
+      }
+    }
+  }
+
+  for (auto _ : state) {
+    for (size_t g = 0; g < frame_dim.num_groups; g++) {
+      pipeline->ClearDone(g);
+    }
+    for (size_t g = 0; g < frame_dim.num_groups; g++) {
+      RenderPipelineInput input_buffers = pipeline->GetInputBuffers(g, 0);
+      for (size_t c = 0; c < config.num_c; c++) {
+        ImageF* buffer = input_buffers.GetBuffer(c).first;
+        const Rect rect = input_buffers.GetBuffer(c).second;
+        for (size_t y = 0; y < rect.ysize(); y++) {
+          memcpy(rect.Row(buffer, y), input[c].ConstRow(y),
+                 rect.xsize() * sizeof(float));
+        }
+      }
+      input_buffers.Done();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * frame_dim.xsize_upsampled *
+                          frame_dim.ysize_upsampled);
+}
+
+void BM_Baseline(benchmark::State& state) {
+  RenderFrames(state, PipelineConfig(), [](RenderPipeline::Builder*) {});
+}
+
+void BM_EPF(benchmark::State& state, size_t epf_stage) {
+  const PipelineConfig config;
+  const FrameDimensions frame_dim = BenchmarkFrameDimensions(state, config);
+  LoopFilter lf;
+  // Inverse sigma of moderately quantized blocks, above kMinSigma so that no
+  // block is skipped.
+  ImageF sigma(frame_dim.xsize_blocks + 2 * kSigmaPadding,
+               frame_dim.ysize_blocks + 2 * kSigmaPadding);
+  FillImage(-1.0f, &sigma);
+  RenderFrames(state, config, [&](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetEPFStage(lf, sigma, epf_stage));
+  });
+}
+
+void BM_Gaborish(benchmark::State& state) {
+  LoopFilter lf;
+  RenderFrames(state, PipelineConfig(), [&](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetGaborishStage(lf));
+  });
+}
+
+void BM_Upsampling(benchmark::State& state, size_t shift) {
+  PipelineConfig config;
+  config.upsampling = size_t{1} << shift;
+  CustomTransformData transform_data;
+  RenderFrames(state, config, [&](RenderPipeline::Builder* builder) {
+    for (size_t c = 0; c < 3; c++) {
+      builder->AddStage(GetUpsamplingStage(transform_data, c, shift));
+    }
+  });
+}
+
+// 4:2:0, with both chroma channels subsampled in both directions.
+void BM_ChromaUpsampling(benchmark::State& state) {
+  PipelineConfig config;
+  config.max_hshift = 1;
+  config.max_vshift = 1;
+  RenderFrames(state, config, [](RenderPipeline::Builder* builder) {
+    for (size_t c : {0, 2}) {
+      builder->AddStage(GetChromaUpsamplingStage(c, /*horizontal=*/true,
+                                                 /*vertical=*/true));
+    }
+  });
+}
+
+OutputEncodingInfo SRGBOutputEncodingInfo(const CodecMetadata& metadata) {
+  OutputEncodingInfo output_encoding_info;
+  JXL_CHECK(output_encoding_info.Set(metadata, ColorEncoding::SRGB()));
+  return output_encoding_info;
+}
+
+void BM_XYB(benchmark::State& state) {
+  CodecMetadata metadata;
+  const OutputEncodingInfo output_encoding_info =
+      SRGBOutputEncodingInfo(metadata);
+  RenderFrames(state, PipelineConfig(), [&](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetXYBStage(output_encoding_info));
+  });
+}
+
+void BM_YCbCr(benchmark::State& state) {
+  RenderFrames(state, PipelineConfig(), [](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetYCbCrStage());
+  });
+}
+
+// Convolution of the noise channels and addition to the color channels.
+void BM_Noise(benchmark::State& state) {
+  PipelineConfig config;
+  config.num_c = 6;
+  NoiseParams noise_params;
+  for (float& v : noise_params.lut) v = 0.1f;
+  ColorCorrelationMap cmap;
+  RenderFrames(state, config, [&](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetConvolveNoiseStage(/*noise_c_start=*/3));
+    builder->AddStage(GetAddNoiseStage(noise_params, cmap,
+                                       /*noise_c_start=*/3));
+  });
+}
+
+// Alpha blending of a frame with an alpha channel over a full background.
+void BM_Blending(benchmark::State& state) {
+  PipelineConfig config;
+  config.num_c = 4;
+  const size_t size = state.range(0);
+  CodecMetadata metadata;
+  JXL_CHECK(metadata.size.Set(size, size));
+  metadata.m.xyb_encoded = false;
+  metadata.m.SetAlphaBits(8);
+
+  PassesDecoderState dec_state;
+  PassesSharedState& shared = dec_state.shared_storage;
+  shared.metadata = &metadata;
+  shared.frame_header.nonserialized_metadata = &metadata;
+  shared.frame_header.blending_info.mode = BlendMode::kBlend;
+  shared.frame_header.blending_info.alpha_channel = 0;
+  shared.frame_header.blending_info.source = 0;
+  shared.frame_header.extra_channel_blending_info.resize(
+      1, shared.frame_header.blending_info);
+
+  Rng rng(1);
+  const auto random_plane = [&rng, size]() {
+    ImageF plane(size, size);
+    for (size_t y = 0; y < size; y++) {
+      float* JXL_RESTRICT row = plane.Row(y);
+      for (size_t x = 0; x < size; x++) row[x] = rng.UniformF(0.0f, 1.0f);
+    }
+    return plane;
+  };
+  ImageBundle& background = shared.reference_frames[0].storage;
+  background = ImageBundle(&metadata.m);
+  Image3F color(size, size);
+  for (size_t c = 0; c < 3; c++) color.Plane(c) = random_plane();
+  background.SetFromImage(std::move(color), ColorEncoding::SRGB());
+  std::vector<ImageF> extra_channels;
+  extra_channels.push_back(random_plane());
+  background.SetExtraChannels(std::move(extra_channels));
+
+  RenderFrames(state, config, [&](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetBlendingStage(&dec_state, ColorEncoding::SRGB()));
+  });
+}
+
+void BM_WriteToU8(benchmark::State& state) {
+  PipelineConfig config;
+  config.has_final_stage = true;
+  const size_t size = state.range(0);
+  std::vector<uint8_t> output(size * size * 3);
+  RenderFrames(state, config, [&](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetWriteToU8Stage(
+        output.data(), /*stride=*/size * 3, /*height=*/size, /*rgba=*/false,
+        /*has_alpha=*/false, /*alpha_c=*/0, /*premultiply=*/false));
+  });
+}
+
+void BM_WriteToImage3F(benchmark::State& state) {
+  PipelineConfig config;
+  config.has_final_stage = true;
+  Image3F output(state.range(0), state.range(0));
+  RenderFrames(state, config, [&](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetWriteToImage3FStage(&output));
+  });
+}
+
+// The XYB to sRGB conversion fused with the uint8 output.
+void BM_XYBWriteToU8(benchmark::State& state) {
+  PipelineConfig config;
+  config.has_final_stage = true;
+  const size_t size = state.range(0);
+  CodecMetadata metadata;
+  const OutputEncodingInfo output_encoding_info =
+      SRGBOutputEncodingInfo(metadata);
+  std::vector<uint8_t> output(size * size * 3);
+  RenderFrames(state, config, [&](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetXYBWriteToU8Stage(
+        output_encoding_info, output.data(), /*stride=*/size * 3,
+        /*height=*/size, /*rgba=*/false, /*has_alpha=*/false, /*alpha_c=*/0));
+  });
+}
+
+// The YCbCr to RGB conversion fused with the uint8 output.
+void BM_YCbCrWriteToU8(benchmark::State& state) {
+  PipelineConfig config;
+  config.has_final_stage = true;
+  const size_t size = state.range(0);
+  std::vector<uint8_t> output(size * size * 3);
+  RenderFrames(state, config, [&](RenderPipeline::Builder* builder) {
+    builder->AddStage(GetYCbCrWriteToU8Stage(
+        output.data(), /*stride=*/size * 3, /*height=*/size, /*rgba=*/false,
+        /*has_alpha=*/false, /*alpha_c=*/0));
+  });
+}
+
+// One group and a frame of 8x8 groups.
+void StageArgs(benchmark::internal::Benchmark* b) {
+  b->Arg(256)->Arg(2048)->Unit(benchmark::kMicrosecond);
+}
+
+BENCHMARK(BM_Baseline)->Apply(StageArgs);
+BENCHMARK_CAPTURE(BM_EPF, Stage0, 0)->Apply(StageArgs);
+BENCHMARK_CAPTURE(BM_EPF, Stage1, 1)->Apply(StageArgs);
+BENCHMARK_CAPTURE(BM_EPF, Stage2, 2)->Apply(StageArgs);
+BENCHMARK(BM_Gaborish)->Apply(StageArgs);
+BENCHMARK_CAPTURE(BM_Upsampling, 2x, 1)->Apply(StageArgs);
+BENCHMARK_CAPTURE(BM_Upsampling, 4x, 2)->Apply(StageArgs);
+BENCHMARK_CAPTURE(BM_Upsampling, 8x, 3)->Apply(StageArgs);
+BENCHMARK(BM_ChromaUpsampling)->Apply(StageArgs);
+BENCHMARK(BM_XYB)->Apply(StageArgs);
+BENCHMARK(BM_YCbCr)->Apply(StageArgs);
+BENCHMARK(BM_Noise)->Apply(StageArgs);
+BENCHMARK(BM_Blending)->Apply(StageArgs);
+BENCHMARK(BM_WriteToU8)->Apply(StageArgs);
+BENCHMARK(BM_WriteToImage3F)->Apply(StageArgs);
+BENCHMARK(BM_XYBWriteToU8)->Apply(StageArgs);
+BENCHMARK(BM_YCbCrWriteToU8)->Apply(StageArgs);
+
+}  // namespace
+}  // namespace jxl
@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #include "lib/jxl/base/arch_macros.h"
+#include "lib/jxl/base/status.h"
 #include "lib/jxl/frame_header.h"
 
 namespace jxl {
@@ -100,6 +101,25 @@ class RenderPipelineStage {
                           size_t xextra, size_t xsize, size_t xpos, size_t ypos,
                           size_t thread_id) const = 0;
 
+  // Whether the stage implements ProcessRows. Only stages without kInOut
+  // channels, which need no vertical context, may do so.
+  virtual bool ProcessesMultipleRows() const { return false; }
+
+  // Same as calling ProcessRow with `xextra` equal to 0 for the `num_rows`
+  // consecutive rows starting at `ypos`, saving the per-row call overhead and
+  // allowing the stage to process larger blocks at once. Row `r` of channel
+  // `c` is obtained with `GetRowOfBatch(rows, c, r)`. Only called if
+  // ProcessesMultipleRows returns true.
+  virtual void ProcessRows(const RowInfo& rows, size_t num_rows, size_t xsize,
+                           size_t xpos, size_t ypos, size_t thread_id) const {
+    JXL_ABORT("ProcessRows is not implemented by %s", GetName());
+  }
+
+  // Called by `thread_id` after it has given the stage all the rows of a
+  // rectangle of the image, which it does in order and without rows of other
+  // rectangles in between.
+  virtual void FinishRect(size_t thread_id) const {}
+
  protected:
   explicit RenderPipelineStage(Settings settings) : settings_(settings) {}
 
@@ -136,6 +156,12 @@ class RenderPipelineStage {
     JXL_DASSERT(offset <= 1ul << settings_.shift_y);
     return output_rows[c][offset] + kRenderPipelineXOffset;
   }
+  // Returns a pointer to row `r` of channel `c` of the rows passed to
+  // ProcessRows, with kRenderPipelineXOffset applied.
+  float* GetRowOfBatch(const RowInfo& rows, size_t c, size_t r) const {
+    JXL_DASSERT(GetChannelMode(c) != RenderPipelineChannelMode::kIgnored);
+    return rows[c][r] + kRenderPipelineXOffset;
+  }
 
   // Indicates whether, from this stage on, the pipeline will operate on an
   // image- rather than frame-sized buffer. Only one stage in the pipeline
@@ -0,0 +1,35 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/render_pipeline/render_pipeline_stats.h"
+
+#include <string.h>
+
+namespace jxl {
+
+size_t RenderPipelineStats::StageIndex(const char* name) {
+  for (size_t i = 0; i < names_.size(); i++) {
+    if (strcmp(names_[i], name) == 0) return i;
+  }
+  names_.push_back(name);
+  counters_.emplace_back(num_threads_);
+  return names_.size() - 1;
+}
+
+void RenderPipelineStats::PrepareForThreads(size_t num) {
+  if (num <= num_threads_) return;
+  num_threads_ = num;
+  for (std::vector<Counters>& counters : counters_) {
+    counters.resize(num_threads_);
+  }
+}
+
+void RenderPipelineStats::Clear() {
+  names_.clear();
+  counters_.clear();
+  num_threads_ = 0;
+}
+
+}  // namespace jxl
@@ -0,0 +1,61 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_RENDER_PIPELINE_RENDER_PIPELINE_STATS_H_
+#define LIB_JXL_RENDER_PIPELINE_RENDER_PIPELINE_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace jxl {
+
+// Time spent and data processed by each render pipeline stage and thread,
+// accumulated over all the pipelines that record to the same instance. Stages
+// are identified by their name, so e.g. the upsampling stages of all channels
+// share their counters.
+class RenderPipelineStats {
+ public:
+  struct Counters {
+    uint64_t nanoseconds = 0;
+    // Number of ProcessRow calls.
+    uint64_t rows = 0;
+    // Bytes of the input and output rows of these calls.
+    uint64_t bytes = 0;
+  };
+
+  // Returns the index of the stage with the given name, adding it if needed.
+  // The name must outlive this object. Not thread safe.
+  size_t StageIndex(const char* name);
+
+  // Makes room for the counters of threads [0, num). Not thread safe.
+  void PrepareForThreads(size_t num);
+
+  // Counters of a stage for a thread. Different threads may update their own
+  // counters concurrently.
+  Counters& Get(size_t stage, size_t thread) {
+    return counters_[stage][thread];
+  }
+  const Counters& Get(size_t stage, size_t thread) const {
+    return counters_[stage][thread];
+  }
+
+  size_t NumStages() const { return names_.size(); }
+  size_t NumThreads() const { return num_threads_; }
+  const char* Name(size_t stage) const { return names_[stage]; }
+
+  void Clear();
+
+ private:
+  std::vector<const char*> names_;
+  // Indexed by stage, then thread.
+  std::vector<std::vector<Counters>> counters_;
+  size_t num_threads_ = 0;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_RENDER_PIPELINE_RENDER_PIPELINE_STATS_H_
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <algorithm>
 #include <utility>
@@ -96,6 +97,168 @@ TEST(RenderPipelineTest, CallAllGroupsFast) {
   EXPECT_EQ(pipeline->PassesWithAllInput(), 1);
 }
 
+// Copies its input, so that the following stages read it from the buffer of
+// a kInOut stage instead of the input buffer.
+class CopyWithBorderStage : public RenderPipelineStage {
+ public:
+  CopyWithBorderStage()
+      : RenderPipelineStage(
+            RenderPipelineStage::Settings::SymmetricBorderOnly(1)) {}
+
+  void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                  size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                  size_t thread_id) const final {
+    for (size_t c = 0; c < input_rows.size(); c++) {
+      memcpy(GetOutputRow(output_rows, c, 0) - xextra,
+             GetInputRow(input_rows, c, 0) - xextra,
+             (xsize + 2 * xextra) * sizeof(float));
+    }
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return RenderPipelineChannelMode::kInOut;
+  }
+
+  const char* GetName() const override { return "TEST::CopyWithBorder"; }
+};
+
+// Checks that every pixel is equal to its y coordinate and negates it,
+// processing multiple rows at once.
+class NegateRowsStage : public RenderPipelineStage {
+ public:
+  NegateRowsStage() : RenderPipelineStage(RenderPipelineStage::Settings()) {}
+
+  void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                  size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                  size_t thread_id) const final {
+    for (size_t c = 0; c < input_rows.size(); c++) {
+      Negate(GetInputRow(input_rows, c, 0), xsize, ypos);
+    }
+  }
+
+  bool ProcessesMultipleRows() const final { return true; }
+
+  void ProcessRows(const RowInfo& rows, size_t num_rows, size_t xsize,
+                   size_t xpos, size_t ypos, size_t thread_id) const final {
+    for (size_t r = 0; r < num_rows; r++) {
+      for (size_t c = 0; c < rows.size(); c++) {
+        Negate(GetRowOfBatch(rows, c, r), xsize, ypos + r);
+      }
+    }
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return RenderPipelineChannelMode::kInPlace;
+  }
+
+  const char* GetName() const override { return "TEST::NegateRows"; }
+
+ private:
+  static void Negate(float* row, size_t xsize, size_t y) {
+    for (size_t x = 0; x < xsize; x++) {
+      JXL_CHECK(row[x] == y);
+      row[x] = -row[x];
+    }
+  }
+};
+
+// Checks that every pixel is equal to minus its y coordinate.
+class CheckNegatedStage : public RenderPipelineStage {
+ public:
+  CheckNegatedStage() : RenderPipelineStage(RenderPipelineStage::Settings()) {}
+
+  void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                  size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                  size_t thread_id) const final {
+    for (size_t c = 0; c < input_rows.size(); c++) {
+      const float* row = GetInputRow(input_rows, c, 0);
+      for (size_t x = 0; x < xsize; x++) {
+        JXL_CHECK(row[x] == -static_cast<float>(ypos));
+      }
+    }
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return RenderPipelineChannelMode::kInput;
+  }
+
+  const char* GetName() const override { return "TEST::CheckNegated"; }
+};
+
+std::unique_ptr<RenderPipeline> MakeNegateRowsPipeline(
+    const FrameDimensions& frame_dimensions, bool use_simple,
+    std::unique_ptr<RenderPipeline> previous = nullptr) {
+  RenderPipeline::Builder builder(/*num_c=*/2);
+  builder.AddStage(jxl::make_unique<CopyWithBorderStage>());
+  builder.AddStage(jxl::make_unique<NegateRowsStage>());
+  builder.AddStage(jxl::make_unique<CheckNegatedStage>());
+  if (use_simple) builder.UseSimpleImplementation();
+  return std::move(builder).Finalize(frame_dimensions, std::move(previous));
+}
+
+// Sets every input pixel to its y coordinate.
+void RunNegateRowsPipeline(const FrameDimensions& frame_dimensions,
+                           RenderPipeline* pipeline) {
+  ASSERT_TRUE(pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+  for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+    auto input_buffers = pipeline->GetInputBuffers(i, 0);
+    const size_t y0 =
+        i / frame_dimensions.xsize_groups * frame_dimensions.group_dim;
+    for (size_t c = 0; c < 2; c++) {
+      ImageF* image = input_buffers.GetBuffer(c).first;
+      const Rect rect = input_buffers.GetBuffer(c).second;
+      for (size_t y = 0; y < rect.ysize(); y++) {
+        float* JXL_RESTRICT row = rect.Row(image, y);
+        for (size_t x = 0; x < rect.xsize(); x++) {
+          row[x] = y0 + y;
+        }
+      }
+    }
+    input_buffers.Done();
+  }
+  EXPECT_EQ(pipeline->PassesWithAllInput(), 1);
+}
+
+// Mixes a stage processing multiple rows per call with stages processing one
+// row per call, after a kInOut stage whose output buffer holds the batches.
+TEST(RenderPipelineTest, MultipleRows) {
+  for (bool use_simple : {false, true}) {
+    FrameDimensions frame_dimensions;
+    frame_dimensions.Set(/*xsize=*/600, /*ysize=*/700, /*group_size_shift=*/1,
+                         /*max_hshift=*/0, /*max_vshift=*/0,
+                         /*modular_mode=*/false, /*upsampling=*/1);
+    auto pipeline = MakeNegateRowsPipeline(frame_dimensions, use_simple);
+    RunNegateRowsPipeline(frame_dimensions, pipeline.get());
+  }
+}
+
+// A pipeline built from the previous one keeps its buffers if the size is the
+// same, and still renders correctly if it is not.
+TEST(RenderPipelineTest, ReuseBuffers) {
+  FrameDimensions frame_dimensions;
+  frame_dimensions.Set(/*xsize=*/600, /*ysize=*/700, /*group_size_shift=*/1,
+                       /*max_hshift=*/0, /*max_vshift=*/0,
+                       /*modular_mode=*/false, /*upsampling=*/1);
+  auto pipeline = MakeNegateRowsPipeline(frame_dimensions, false);
+  RunNegateRowsPipeline(frame_dimensions, pipeline.get());
+  const float* group_row =
+      pipeline->GetInputBuffers(0, 0).GetBuffer(0).first->Row(0);
+
+  pipeline =
+      MakeNegateRowsPipeline(frame_dimensions, false, std::move(pipeline));
+  RunNegateRowsPipeline(frame_dimensions, pipeline.get());
+  EXPECT_EQ(group_row,
+            pipeline->GetInputBuffers(0, 0).GetBuffer(0).first->Row(0));
+
+  FrameDimensions other_dimensions;
+  other_dimensions.Set(/*xsize=*/300, /*ysize=*/900, /*group_size_shift=*/0,
+                       /*max_hshift=*/0, /*max_vshift=*/0,
+                       /*modular_mode=*/false, /*upsampling=*/1);
+  pipeline =
+      MakeNegateRowsPipeline(other_dimensions, false, std::move(pipeline));
+  RunNegateRowsPipeline(other_dimensions, pipeline.get());
+}
+
 struct RenderPipelineTestInputSettings {
   // Input image.
   std::string input_path;
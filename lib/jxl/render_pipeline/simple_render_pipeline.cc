@@ -185,6 +185,7 @@ void SimpleRenderPipeline::ProcessBuffers(size_t group_id, size_t thread_id) {
         stage->ProcessRow(input_rows, output_rows, /*xextra=*/0, xsize,
                           /*xpos=*/0, y, thread_id);
       }
+      stage->FinishRect(thread_id);
     }
 
     // Move new channels to current channels.
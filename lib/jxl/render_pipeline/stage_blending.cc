@@ -97,6 +97,29 @@ class BlendingStage : public RenderPipelineStage {
     for (size_t i = 0; i < ec_info.size(); i++) {
       make_blending(ec_info[i], &blending_info_[1 + i]);
     }
+
+    // Frames that replace the background leave the foreground in place.
+    all_replace_ = std::all_of(blending_info_.begin(), blending_info_.end(),
+                               [](const PatchBlending& pb) {
+                                 return pb.mode == PatchBlendMode::kReplace;
+                               });
+    // If all the channels are alpha-blended with the same alpha channel, runs
+    // of opaque pixels keep the foreground and runs of transparent pixels
+    // take the background, without doing the blending math.
+    const size_t alpha = blending_info_[0].alpha_channel;
+    alpha_runs_ =
+        blending_info_[0].mode == PatchBlendMode::kBlendAbove &&
+        alpha < extra_channel_info_->size() &&
+        (*extra_channel_info_)[alpha].type == ExtraChannel::kAlpha &&
+        std::all_of(blending_info_.begin() + 1, blending_info_.end(),
+                    [alpha](const PatchBlending& pb) {
+                      return pb.mode == PatchBlendMode::kBlendAbove &&
+                             pb.alpha_channel == alpha;
+                    });
+    // With premultiplied alpha, transparent foreground pixels are still added
+    // to the background.
+    transparent_runs_ =
+        alpha_runs_ && !(*extra_channel_info_)[alpha].alpha_associated;
   }
 
   Status IsInitialized() const override { return initialized_; }
@@ -106,6 +129,7 @@ class BlendingStage : public RenderPipelineStage {
                   size_t thread_id) const final {
     PROFILER_ZONE("Blend");
     JXL_ASSERT(initialized_);
+    if (all_replace_) return;
     const FrameOrigin& frame_origin = state_.frame_header.frame_origin;
     ssize_t bg_xpos = frame_origin.x0 + static_cast<ssize_t>(xpos);
     ssize_t bg_ypos = frame_origin.y0 + static_cast<ssize_t>(ypos);
@@ -147,9 +171,50 @@ class BlendingStage : public RenderPipelineStage {
                 : zeroes_.data();
       }
     }
-    PerformBlending(bg_row_ptrs_.data(), fg_row_ptrs_.data(),
-                    fg_row_ptrs_.data(), 0, xsize, blending_info_[0],
-                    blending_info_.data() + 1, *extra_channel_info_);
+    if (!alpha_runs_ || num_c != extra_channel_info_->size() + 3) {
+      PerformBlending(bg_row_ptrs_.data(), fg_row_ptrs_.data(),
+                      fg_row_ptrs_.data(), 0, xsize, blending_info_[0],
+                      blending_info_.data() + 1, *extra_channel_info_);
+      return;
+    }
+    // Splits the row in runs of constant alpha, which do not need blending,
+    // and runs of other pixels, which are blended together. Short constant
+    // runs are blended with their neighbours to avoid fragmenting the calls.
+    constexpr size_t kMinConstantRun = 16;
+    const size_t alpha = 3 + blending_info_[0].alpha_channel;
+    const float* JXL_RESTRICT fga = fg_row_ptrs_[alpha];
+    const auto is_constant = [this](float a) {
+      return a == 1.0f || (transparent_runs_ && a == 0.0f);
+    };
+    const auto blend = [&](size_t begin, size_t end) {
+      if (begin == end) return;
+      PerformBlending(bg_row_ptrs_.data(), fg_row_ptrs_.data(),
+                      fg_row_ptrs_.data(), begin, end - begin,
+                      blending_info_[0], blending_info_.data() + 1,
+                      *extra_channel_info_);
+    };
+    size_t blend_begin = 0;
+    size_t x = 0;
+    while (x < xsize) {
+      const float a = fga[x];
+      if (!is_constant(a)) {
+        x++;
+        continue;
+      }
+      size_t run_end = x + 1;
+      while (run_end < xsize && fga[run_end] == a) run_end++;
+      if (run_end - x >= kMinConstantRun) {
+        blend(blend_begin, x);
+        // Opaque pixels keep the foreground, which is already in place.
+        if (a == 0.0f) {
+          CopyBackground(bg_row_ptrs_.data(), fg_row_ptrs_.data(), alpha, x,
+                         run_end);
+        }
+        blend_begin = run_end;
+      }
+      x = run_end;
+    }
+    blend(blend_begin, xsize);
   }
 
   RenderPipelineChannelMode GetChannelMode(size_t c) const final {
@@ -197,6 +262,23 @@ class BlendingStage : public RenderPipelineStage {
   const char* GetName() const override { return "Blending"; }
 
  private:
+  // Result of non-premultiplied alpha blending of transparent foreground
+  // pixels in [begin, end): the background where it is not transparent too,
+  // zero otherwise, and the background alpha.
+  void CopyBackground(const float* const* bg, float* const* out, size_t alpha,
+                      size_t begin, size_t end) const {
+    const float* JXL_RESTRICT bga = bg[alpha];
+    for (size_t c = 0; c < extra_channel_info_->size() + 3; c++) {
+      if (c == alpha) continue;
+      const float* JXL_RESTRICT bg_row = bg[c];
+      float* JXL_RESTRICT out_row = out[c];
+      for (size_t x = begin; x < end; x++) {
+        out_row[x] = bga[x] > 0 ? bg_row[x] : 0.0f;
+      }
+    }
+    memcpy(out[alpha] + begin, bga + begin, (end - begin) * sizeof(float));
+  }
+
   const PassesSharedState& state_;
   BlendingInfo info_;
   ImageBundle* bg_;
@@ -206,6 +288,9 @@ class BlendingStage : public RenderPipelineStage {
   std::vector<PatchBlending> blending_info_;
   const std::vector<ExtraChannelInfo>* extra_channel_info_;
   std::vector<float> zeroes_;
+  bool all_replace_ = false;
+  bool alpha_runs_ = false;
+  bool transparent_runs_ = false;
 };
 
 std::unique_ptr<RenderPipelineStage> GetBlendingStage(
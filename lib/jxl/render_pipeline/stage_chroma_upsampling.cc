@@ -97,9 +97,70 @@ class VerticalChromaUpsamplingStage : public RenderPipelineStage {
   size_t c_;
 };
 
+// Same as HorizontalChromaUpsamplingStage followed by
+// VerticalChromaUpsamplingStage, without the row buffers in between.
+class ChromaUpsampling2x2Stage : public RenderPipelineStage {
+ public:
+  explicit ChromaUpsampling2x2Stage(size_t channel)
+      : RenderPipelineStage(RenderPipelineStage::Settings::Symmetric(
+            /*shift=*/1, /*border=*/1)),
+        c_(channel) {}
+
+  void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                  size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                  size_t thread_id) const final {
+    PROFILER_ZONE("ChromaUpsampling2x2");
+    HWY_FULL(float) df;
+    using V = hwy::HWY_NAMESPACE::Vec<HWY_FULL(float)>;
+    xextra = RoundUpTo(xextra, Lanes(df));
+    auto threefour = Set(df, 0.75f);
+    auto onefour = Set(df, 0.25f);
+    const float* row_top = GetInputRow(input_rows, c_, -1);
+    const float* row_mid = GetInputRow(input_rows, c_, 0);
+    const float* row_bot = GetInputRow(input_rows, c_, 1);
+    float* row_out0 = GetOutputRow(output_rows, c_, 0);
+    float* row_out1 = GetOutputRow(output_rows, c_, 1);
+    const auto horizontal = [&](const float* row, ssize_t x, V* left,
+                                V* right) {
+      auto current = LoadU(df, row + x) * threefour;
+      *left = MulAdd(onefour, LoadU(df, row + x - 1), current);
+      *right = MulAdd(onefour, LoadU(df, row + x + 1), current);
+    };
+    for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
+         x += Lanes(df)) {
+      V top_left, top_right, mid_left, mid_right, bot_left, bot_right;
+      horizontal(row_top, x, &top_left, &top_right);
+      horizontal(row_mid, x, &mid_left, &mid_right);
+      horizontal(row_bot, x, &bot_left, &bot_right);
+      auto mid_left_scaled = mid_left * threefour;
+      auto mid_right_scaled = mid_right * threefour;
+      StoreInterleaved(df, MulAdd(top_left, onefour, mid_left_scaled),
+                       MulAdd(top_right, onefour, mid_right_scaled),
+                       row_out0 + x * 2);
+      StoreInterleaved(df, MulAdd(bot_left, onefour, mid_left_scaled),
+                       MulAdd(bot_right, onefour, mid_right_scaled),
+                       row_out1 + x * 2);
+    }
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return c == c_ ? RenderPipelineChannelMode::kInOut
+                   : RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "ChromaUps2x2"; }
+
+ private:
+  size_t c_;
+};
+
 std::unique_ptr<RenderPipelineStage> GetChromaUpsamplingStage(size_t channel,
-                                                              bool horizontal) {
-  if (horizontal) {
+                                                              bool horizontal,
+                                                              bool vertical) {
+  JXL_ASSERT(horizontal || vertical);
+  if (horizontal && vertical) {
+    return jxl::make_unique<ChromaUpsampling2x2Stage>(channel);
+  } else if (horizontal) {
     return jxl::make_unique<HorizontalChromaUpsamplingStage>(channel);
   } else {
     return jxl::make_unique<VerticalChromaUpsamplingStage>(channel);
@@ -117,8 +178,10 @@ namespace jxl {
 HWY_EXPORT(GetChromaUpsamplingStage);
 
 std::unique_ptr<RenderPipelineStage> GetChromaUpsamplingStage(size_t channel,
-                                                              bool horizontal) {
-  return HWY_DYNAMIC_DISPATCH(GetChromaUpsamplingStage)(channel, horizontal);
+                                                              bool horizontal,
+                                                              bool vertical) {
+  return HWY_DYNAMIC_DISPATCH(GetChromaUpsamplingStage)(channel, horizontal,
+                                                        vertical);
 }
 
 }  // namespace jxl
@@ -18,10 +18,11 @@
 
 namespace jxl {
 
-// Applies simple upsampling, either horizontal or vertical, to the given
-// channel.
+// Applies simple upsampling, horizontal, vertical or both, to the given
+// channel. Both directions are done in one pass.
 std::unique_ptr<RenderPipelineStage> GetChromaUpsamplingStage(size_t channel,
-                                                              bool horizontal);
+                                                              bool horizontal,
+                                                              bool vertical);
 }  // namespace jxl
 
 #endif  // LIB_JXL_RENDER_PIPELINE_STAGE_CHROMA_UPSAMPLING_H_
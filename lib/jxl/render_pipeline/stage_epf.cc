@@ -5,6 +5,8 @@
 
 #include "lib/jxl/render_pipeline/stage_epf.h"
 
+#include <string.h>
+
 #include "lib/jxl/epf.h"
 #include "lib/jxl/sanitizers.h"
 
@@ -16,18 +18,71 @@
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
-// TODO(veluca): In principle, vectors could be not capped, if we want to deal
-// with having two different sigma values in a single vector.
-using DF = HWY_CAPPED(float, 8);
+// Vectors may span blocks with different sigmas; they are capped so that
+// rounding xextra up to a whole vector stays within the row padding.
+using DF = HWY_CAPPED(float, kRenderPipelineXOffset / 2);
 
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Vec;
 
+// Rows of pixels are only aligned to a block, wider vectors need unaligned
+// loads.
+JXL_INLINE Vec<DF> LoadPixels(const float* JXL_RESTRICT p) {
+  return MaxLanes(DF()) <= kBlockDim ? Load(DF(), p) : LoadU(DF(), p);
+}
+
+// Returns the sigmas of the blocks of the pixels of the vector at x, and
+// stores in `inv_sigma` their inverse scaled by the SAD multiplier of each
+// pixel.
+JXL_INLINE Vec<DF> LoadSigma(const float* JXL_RESTRICT row_sigma,
+                             const float* JXL_RESTRICT sad_mul, ssize_t x,
+                             size_t xpos, Vec<DF>* JXL_RESTRICT inv_sigma) {
+  const DF df;
+  const size_t px = x + xpos + kSigmaPadding * kBlockDim;
+  if (Lanes(df) <= kBlockDim) {
+    const auto sigma = Set(df, row_sigma[px / kBlockDim]);
+    *inv_sigma = sigma * Load(df, sad_mul + px % kBlockDim);
+    return sigma;
+  }
+  HWY_ALIGN float sigma_lanes[MaxLanes(df)];
+  HWY_ALIGN float inv_sigma_lanes[MaxLanes(df)];
+  if (px % kBlockDim == 0) {
+    const HWY_CAPPED(float, kBlockDim) d8;
+    const auto sm = Load(d8, sad_mul);
+    for (size_t i = 0; i < Lanes(df); i += Lanes(d8)) {
+      const auto sigma = Set(d8, row_sigma[(px + i) / kBlockDim]);
+      Store(sigma, d8, sigma_lanes + i);
+      Store(sigma * sm, d8, inv_sigma_lanes + i);
+    }
+  } else {
+    for (size_t i = 0; i < Lanes(df); i++) {
+      sigma_lanes[i] = row_sigma[(px + i) / kBlockDim];
+      inv_sigma_lanes[i] = sigma_lanes[i] * sad_mul[(px + i) % kBlockDim];
+    }
+  }
+  *inv_sigma = Load(df, inv_sigma_lanes);
+  return Load(df, sigma_lanes);
+}
+
 JXL_INLINE Vec<DF> Weight(Vec<DF> sad, Vec<DF> inv_sigma, Vec<DF> thres) {
   auto v = MulAdd(sad, inv_sigma, Set(DF(), 1.0f));
   return ZeroIfNegative(v);
 }
 
+// Returns true if all the blocks covering the xsize + 2 * xextra pixels of the
+// row have a sigma for which the filter leaves pixels unchanged, in which case
+// the whole row can be copied through.
+JXL_INLINE bool AllBlocksInactive(const float* JXL_RESTRICT row_sigma,
+                                  size_t xextra, size_t xsize, size_t xpos) {
+  const size_t bx0 = (xpos + kSigmaPadding * kBlockDim - xextra) / kBlockDim;
+  const size_t bx1 =
+      (xpos + kSigmaPadding * kBlockDim + xsize + xextra - 1) / kBlockDim;
+  for (size_t bx = bx0; bx <= bx1; bx++) {
+    if (!(row_sigma[bx] < kMinSigma)) return false;
+  }
+  return true;
+}
+
 // 5x5 plus-shaped kernel with 5 SADs per pixel (3x3 plus-shaped). So this makes
 // this filter a 7x7 filter.
 class EPF0Stage : public RenderPipelineStage {
@@ -44,11 +99,11 @@ class EPF0Stage : public RenderPipelineStage {
                            Vec<DF>* JXL_RESTRICT X, Vec<DF>* JXL_RESTRICT Y,
                            Vec<DF>* JXL_RESTRICT B,
                            Vec<DF>* JXL_RESTRICT w) const {
-    auto cx = aligned ? Load(DF(), rows[0][3 + row] + x)
+    auto cx = aligned ? LoadPixels(rows[0][3 + row] + x)
                       : LoadU(DF(), rows[0][3 + row] + x);
-    auto cy = aligned ? Load(DF(), rows[1][3 + row] + x)
+    auto cy = aligned ? LoadPixels(rows[1][3 + row] + x)
                       : LoadU(DF(), rows[1][3 + row] + x);
-    auto cb = aligned ? Load(DF(), rows[2][3 + row] + x)
+    auto cb = aligned ? LoadPixels(rows[2][3 + row] + x)
                       : LoadU(DF(), rows[2][3 + row] + x);
 
     auto weight = Weight(sad, inv_sigma, Set(DF(), lf_.epf_pass1_zeroflush));
@@ -80,6 +135,14 @@ class EPF0Stage : public RenderPipelineStage {
       }
     }
 
+    if (AllBlocksInactive(row_sigma, xextra, xsize, xpos)) {
+      for (size_t c = 0; c < 3; c++) {
+        memcpy(GetOutputRow(output_rows, c, 0) - xextra, rows[c][3] - xextra,
+               RoundUpTo(xsize + 2 * xextra, Lanes(df)) * sizeof(float));
+      }
+      return;
+    }
+
     const float* sad_mul =
         (ypos % kBlockDim == 0 || ypos % kBlockDim == kBlockDim - 1)
             ? sad_mul_border
@@ -87,20 +150,18 @@ class EPF0Stage : public RenderPipelineStage {
 
     for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
          x += Lanes(df)) {
-      size_t bx = (x + xpos + kSigmaPadding * kBlockDim) / kBlockDim;
-      size_t ix = (x + xpos) % kBlockDim;
-
-      if (row_sigma[bx] < kMinSigma) {
+      auto inv_sigma = Zero(df);
+      const auto sigma = LoadSigma(row_sigma, sad_mul, x, xpos, &inv_sigma);
+      // The filter leaves the pixels of blocks with a low sigma unchanged.
+      const auto inactive = sigma < Set(df, kMinSigma);
+      if (AllTrue(df, inactive)) {
         for (size_t c = 0; c < 3; c++) {
-          auto px = Load(df, rows[c][3 + 0] + x);
+          auto px = LoadPixels(rows[c][3 + 0] + x);
           Store(px, df, GetOutputRow(output_rows, c, 0) + x);
         }
         continue;
       }
 
-      const auto sm = Load(df, sad_mul + ix);
-      const auto inv_sigma = Set(df, row_sigma[bx]) * sm;
-
       decltype(Zero(df)) sads[12];
       for (size_t i = 0; i < 12; i++) sads[i] = Zero(df);
       constexpr std::array<int, 2> sads_off[12] = {
@@ -127,9 +188,9 @@ class EPF0Stage : public RenderPipelineStage {
           sads[i] = MulAdd(sad, scale, sads[i]);
         }
       }
-      const auto x_cc = Load(df, rows[0][3 + 0] + x);
-      const auto y_cc = Load(df, rows[1][3 + 0] + x);
-      const auto b_cc = Load(df, rows[2][3 + 0] + x);
+      const auto x_cc = LoadPixels(rows[0][3 + 0] + x);
+      const auto y_cc = LoadPixels(rows[1][3 + 0] + x);
+      const auto b_cc = LoadPixels(rows[2][3 + 0] + x);
 
       auto w = Set(df, 1);
       auto X = x_cc;
@@ -146,9 +207,12 @@ class EPF0Stage : public RenderPipelineStage {
 #else
       auto inv_w = ApproximateReciprocal(w);
 #endif
-      Store(X * inv_w, df, GetOutputRow(output_rows, 0, 0) + x);
-      Store(Y * inv_w, df, GetOutputRow(output_rows, 1, 0) + x);
-      Store(B * inv_w, df, GetOutputRow(output_rows, 2, 0) + x);
+      Store(IfThenElse(inactive, x_cc, X * inv_w), df,
+            GetOutputRow(output_rows, 0, 0) + x);
+      Store(IfThenElse(inactive, y_cc, Y * inv_w), df,
+            GetOutputRow(output_rows, 1, 0) + x);
+      Store(IfThenElse(inactive, b_cc, B * inv_w), df,
+            GetOutputRow(output_rows, 2, 0) + x);
     }
   }
 
@@ -180,11 +244,11 @@ class EPF1Stage : public RenderPipelineStage {
                            Vec<DF>* JXL_RESTRICT X, Vec<DF>* JXL_RESTRICT Y,
                            Vec<DF>* JXL_RESTRICT B,
                            Vec<DF>* JXL_RESTRICT w) const {
-    auto cx = aligned ? Load(DF(), rows[0][2 + row] + x)
+    auto cx = aligned ? LoadPixels(rows[0][2 + row] + x)
                       : LoadU(DF(), rows[0][2 + row] + x);
-    auto cy = aligned ? Load(DF(), rows[1][2 + row] + x)
+    auto cy = aligned ? LoadPixels(rows[1][2 + row] + x)
                       : LoadU(DF(), rows[1][2 + row] + x);
-    auto cb = aligned ? Load(DF(), rows[2][2 + row] + x)
+    auto cb = aligned ? LoadPixels(rows[2][2 + row] + x)
                       : LoadU(DF(), rows[2][2 + row] + x);
 
     auto weight = Weight(sad, inv_sigma, Set(DF(), lf_.epf_pass1_zeroflush));
@@ -217,6 +281,14 @@ class EPF1Stage : public RenderPipelineStage {
       }
     }
 
+    if (AllBlocksInactive(row_sigma, xextra, xsize, xpos)) {
+      for (size_t c = 0; c < 3; c++) {
+        memcpy(GetOutputRow(output_rows, c, 0) - xextra, rows[c][2] - xextra,
+               RoundUpTo(xsize + 2 * xextra, Lanes(df)) * sizeof(float));
+      }
+      return;
+    }
+
     const float* sad_mul =
         (ypos % kBlockDim == 0 || ypos % kBlockDim == kBlockDim - 1)
             ? sad_mul_border
@@ -224,19 +296,17 @@ class EPF1Stage : public RenderPipelineStage {
 
     for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
          x += Lanes(df)) {
-      size_t bx = (x + xpos + kSigmaPadding * kBlockDim) / kBlockDim;
-      size_t ix = (x + xpos) % kBlockDim;
-
-      if (row_sigma[bx] < kMinSigma) {
+      auto inv_sigma = Zero(df);
+      const auto sigma = LoadSigma(row_sigma, sad_mul, x, xpos, &inv_sigma);
+      // The filter leaves the pixels of blocks with a low sigma unchanged.
+      const auto inactive = sigma < Set(df, kMinSigma);
+      if (AllTrue(df, inactive)) {
         for (size_t c = 0; c < 3; c++) {
-          auto px = Load(df, rows[c][2 + 0] + x);
+          auto px = LoadPixels(rows[c][2 + 0] + x);
           Store(px, df, GetOutputRow(output_rows, c, 0) + x);
         }
         continue;
       }
-
-      const auto sm = Load(df, sad_mul + ix);
-      const auto inv_sigma = Set(df, row_sigma[bx]) * sm;
       auto sad0 = Zero(df);
       auto sad1 = Zero(df);
       auto sad2 = Zero(df);
@@ -247,8 +317,8 @@ class EPF1Stage : public RenderPipelineStage {
         // center px = 22, px above = 21
         auto t = Undefined(df);
 
-        const auto p20 = Load(df, rows[c][2 + -2] + x);
-        const auto p21 = Load(df, rows[c][2 + -1] + x);
+        const auto p20 = LoadPixels(rows[c][2 + -2] + x);
+        const auto p21 = LoadPixels(rows[c][2 + -1] + x);
         auto sad0c = AbsDiff(p20, p21);  // SAD 2, 1
 
         const auto p11 = LoadU(df, rows[c][2 + -1] + x - 1);
@@ -282,7 +352,7 @@ class EPF1Stage : public RenderPipelineStage {
         const auto p13 = LoadU(df, rows[c][2 + 1] + x - 1);
         sad3c += AbsDiff(p13, p12);  // SAD 2, 3
 
-        const auto p23 = Load(df, rows[c][2 + 1] + x);
+        const auto p23 = LoadPixels(rows[c][2 + 1] + x);
         t = AbsDiff(p22, p23);
         sad0c += t;                  // SAD 2, 1
         sad3c += t;                  // SAD 2, 3
@@ -292,7 +362,7 @@ class EPF1Stage : public RenderPipelineStage {
         sad2c += AbsDiff(p33, p23);  // SAD 3, 2
         sad3c += AbsDiff(p33, p32);  // SAD 2, 3
 
-        const auto p24 = Load(df, rows[c][2 + 2] + x);
+        const auto p24 = LoadPixels(rows[c][2 + 2] + x);
         sad3c += AbsDiff(p24, p23);  // SAD 2, 3
 
         auto scale = Set(df, lf_.epf_channel_scale[c]);
@@ -301,9 +371,9 @@ class EPF1Stage : public RenderPipelineStage {
         sad2 = MulAdd(sad2c, scale, sad2);
         sad3 = MulAdd(sad3c, scale, sad3);
       }
-      const auto x_cc = Load(df, rows[0][2 + 0] + x);
-      const auto y_cc = Load(df, rows[1][2 + 0] + x);
-      const auto b_cc = Load(df, rows[2][2 + 0] + x);
+      const auto x_cc = LoadPixels(rows[0][2 + 0] + x);
+      const auto y_cc = LoadPixels(rows[1][2 + 0] + x);
+      const auto b_cc = LoadPixels(rows[2][2 + 0] + x);
 
       auto w = Set(df, 1);
       auto X = x_cc;
@@ -326,9 +396,12 @@ class EPF1Stage : public RenderPipelineStage {
 #else
       auto inv_w = ApproximateReciprocal(w);
 #endif
-      Store(X * inv_w, df, GetOutputRow(output_rows, 0, 0) + x);
-      Store(Y * inv_w, df, GetOutputRow(output_rows, 1, 0) + x);
-      Store(B * inv_w, df, GetOutputRow(output_rows, 2, 0) + x);
+      Store(IfThenElse(inactive, x_cc, X * inv_w), df,
+            GetOutputRow(output_rows, 0, 0) + x);
+      Store(IfThenElse(inactive, y_cc, Y * inv_w), df,
+            GetOutputRow(output_rows, 1, 0) + x);
+      Store(IfThenElse(inactive, b_cc, B * inv_w), df,
+            GetOutputRow(output_rows, 2, 0) + x);
     }
   }
 
@@ -360,11 +433,11 @@ class EPF2Stage : public RenderPipelineStage {
                            Vec<DF> inv_sigma, Vec<DF>* JXL_RESTRICT X,
                            Vec<DF>* JXL_RESTRICT Y, Vec<DF>* JXL_RESTRICT B,
                            Vec<DF>* JXL_RESTRICT w) const {
-    auto cx = aligned ? Load(DF(), rows[0][1 + row] + x)
+    auto cx = aligned ? LoadPixels(rows[0][1 + row] + x)
                       : LoadU(DF(), rows[0][1 + row] + x);
-    auto cy = aligned ? Load(DF(), rows[1][1 + row] + x)
+    auto cy = aligned ? LoadPixels(rows[1][1 + row] + x)
                       : LoadU(DF(), rows[1][1 + row] + x);
-    auto cb = aligned ? Load(DF(), rows[2][1 + row] + x)
+    auto cb = aligned ? LoadPixels(rows[2][1 + row] + x)
                       : LoadU(DF(), rows[2][1 + row] + x);
 
     auto sad = AbsDiff(cx, rx) * Set(DF(), lf_.epf_channel_scale[0]);
@@ -402,6 +475,14 @@ class EPF2Stage : public RenderPipelineStage {
       }
     }
 
+    if (AllBlocksInactive(row_sigma, xextra, xsize, xpos)) {
+      for (size_t c = 0; c < 3; c++) {
+        memcpy(GetOutputRow(output_rows, c, 0) - xextra, rows[c][1] - xextra,
+               RoundUpTo(xsize + 2 * xextra, Lanes(df)) * sizeof(float));
+      }
+      return;
+    }
+
     const float* sad_mul =
         (ypos % kBlockDim == 0 || ypos % kBlockDim == kBlockDim - 1)
             ? sad_mul_border
@@ -409,23 +490,21 @@ class EPF2Stage : public RenderPipelineStage {
 
     for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
          x += Lanes(df)) {
-      size_t bx = (x + xpos + kSigmaPadding * kBlockDim) / kBlockDim;
-      size_t ix = (x + xpos) % kBlockDim;
-
-      if (row_sigma[bx] < kMinSigma) {
+      auto inv_sigma = Zero(df);
+      const auto sigma = LoadSigma(row_sigma, sad_mul, x, xpos, &inv_sigma);
+      // The filter leaves the pixels of blocks with a low sigma unchanged.
+      const auto inactive = sigma < Set(df, kMinSigma);
+      if (AllTrue(df, inactive)) {
         for (size_t c = 0; c < 3; c++) {
-          auto px = Load(df, rows[c][1 + 0] + x);
+          auto px = LoadPixels(rows[c][1 + 0] + x);
           Store(px, df, GetOutputRow(output_rows, c, 0) + x);
         }
         continue;
       }
 
-      const auto sm = Load(df, sad_mul + ix);
-      const auto inv_sigma = Set(df, row_sigma[bx]) * sm;
-
-      const auto x_cc = Load(df, rows[0][1 + 0] + x);
-      const auto y_cc = Load(df, rows[1][1 + 0] + x);
-      const auto b_cc = Load(df, rows[2][1 + 0] + x);
+      const auto x_cc = LoadPixels(rows[0][1 + 0] + x);
+      const auto y_cc = LoadPixels(rows[1][1 + 0] + x);
+      const auto b_cc = LoadPixels(rows[2][1 + 0] + x);
 
       auto w = Set(df, 1);
       auto X = x_cc;
@@ -448,9 +527,12 @@ class EPF2Stage : public RenderPipelineStage {
 #else
       auto inv_w = ApproximateReciprocal(w);
 #endif
-      Store(X * inv_w, df, GetOutputRow(output_rows, 0, 0) + x);
-      Store(Y * inv_w, df, GetOutputRow(output_rows, 1, 0) + x);
-      Store(B * inv_w, df, GetOutputRow(output_rows, 2, 0) + x);
+      Store(IfThenElse(inactive, x_cc, X * inv_w), df,
+            GetOutputRow(output_rows, 0, 0) + x);
+      Store(IfThenElse(inactive, y_cc, Y * inv_w), df,
+            GetOutputRow(output_rows, 1, 0) + x);
+      Store(IfThenElse(inactive, b_cc, B * inv_w), df,
+            GetOutputRow(output_rows, 2, 0) + x);
     }
   }
 
@@ -5,6 +5,8 @@
 
 #include "lib/jxl/render_pipeline/stage_noise.h"
 
+#include <algorithm>
+
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/render_pipeline/stage_noise.cc"
 #include <hwy/foreach_target.h>
@@ -234,29 +236,43 @@ class ConvolveNoiseStage : public RenderPipelineStage {
     PROFILER_ZONE("Noise convolve");
 
     const HWY_FULL(float) d;
+    const size_t N = Lanes(d);
+    // Multiple of any vector size.
+    constexpr size_t kChunkSize = 256;
+    const ssize_t x_begin = -RoundUpTo(xextra, N);
+    const ssize_t x_end = xsize + xextra;
+    // The 5x5 box is summed as 5 columns of the vertical sums of the rows, so
+    // that each input pixel is loaded once per row instead of 24 times. Each
+    // chunk also needs the 2 columns on each side.
+    HWY_ALIGN float column_sums[kChunkSize + 4];
     for (size_t c = first_c_; c < first_c_ + 3; c++) {
       float* JXL_RESTRICT rows[5];
       for (size_t i = 0; i < 5; i++) {
         rows[i] = GetInputRow(input_rows, c, i - 2);
       }
       float* JXL_RESTRICT row_out = GetOutputRow(output_rows, c, 0);
-      for (ssize_t x = -RoundUpTo(xextra, Lanes(d));
-           x < (ssize_t)(xsize + xextra); x += Lanes(d)) {
-        const auto p00 = Load(d, rows[2] + x);
-        auto others = Zero(d);
-        for (ssize_t i = -2; i <= 2; i++) {
-          others += LoadU(d, rows[0] + x + i);
-          others += LoadU(d, rows[1] + x + i);
-          others += LoadU(d, rows[3] + x + i);
-          others += LoadU(d, rows[4] + x + i);
+      for (ssize_t x0 = x_begin; x0 < x_end; x0 += kChunkSize) {
+        const size_t num = std::min<size_t>(kChunkSize, x_end - x0);
+        const size_t num_columns = RoundUpTo(num, N) + 4;
+        for (size_t i = 0; i < num_columns; i += N) {
+          // The last vector may overlap the previous one instead of reading
+          // past the border.
+          const ssize_t x = x0 - 2 + std::min(i, num_columns - N);
+          const auto sum = LoadU(d, rows[0] + x) + LoadU(d, rows[1] + x) +
+                           LoadU(d, rows[2] + x) + LoadU(d, rows[3] + x) +
+                           LoadU(d, rows[4] + x);
+          StoreU(sum, d, column_sums + (x - x0 + 2));
+        }
+        for (size_t i = 0; i < num; i += N) {
+          const auto p00 = Load(d, rows[2] + x0 + i);
+          const float* JXL_RESTRICT columns = column_sums + i;
+          const auto box = LoadU(d, columns) + LoadU(d, columns + 1) +
+                           LoadU(d, columns + 2) + LoadU(d, columns + 3) +
+                           LoadU(d, columns + 4);
+          // 4 * (1 - box kernel), i.e. 0.16 * (box - p00) - 3.84 * p00.
+          auto pixels = MulAdd(box, Set(d, 0.16f), p00 * Set(d, -4.0f));
+          Store(pixels, d, row_out + x0 + i);
         }
-        others += LoadU(d, rows[2] + x - 2);
-        others += LoadU(d, rows[2] + x - 1);
-        others += LoadU(d, rows[2] + x + 1);
-        others += LoadU(d, rows[2] + x + 2);
-        // 4 * (1 - box kernel)
-        auto pixels = MulAdd(others, Set(d, 0.16), p00 * Set(d, -3.84));
-        Store(pixels, d, row_out + x);
       }
     }
   }
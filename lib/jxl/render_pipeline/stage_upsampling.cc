@@ -36,6 +36,20 @@ class UpsamplingStage : public RenderPipelineStage {
             weights[5 * N * y - y * (y - 1) / 2 + x - y];
       }
     }
+    // Expands the kernels of the top-left quarter to all the output pixels,
+    // so that ProcessRowImpl does not mirror the indices.
+    for (size_t oy = 0; oy < 2 * N; oy++) {
+      for (size_t ox = 0; ox < 2 * N; ox++) {
+        for (ssize_t iy = -2; iy <= 2; iy++) {
+          for (ssize_t ix = -2; ix <= 2; ix++) {
+            float* out = &output_kernel_[oy][ox][(iy + 2) * 5 + ix + 2];
+            *out = shift == 1   ? Kernel<2>(ox, oy, ix, iy)
+                   : shift == 2 ? Kernel<4>(ox, oy, ix, iy)
+                                : Kernel<8>(ox, oy, ix, iy);
+          }
+        }
+      }
+    }
   }
 
   void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
@@ -101,21 +115,38 @@ class UpsamplingStage : public RenderPipelineStage {
   void ProcessRowImpl(const RowInfo& input_rows, const RowInfo& output_rows,
                       ssize_t x0, ssize_t x1) const {
     static HWY_FULL(float) df;
+    using V = hwy::HWY_NAMESPACE::Vec<HWY_FULL(float)>;
+    const float* JXL_RESTRICT src_rows[5];
+    for (ssize_t iy = -2; iy <= 2; iy++) {
+      src_rows[iy + 2] = GetInputRow(input_rows, c_, iy);
+    }
+    float* JXL_RESTRICT dst_rows[N];
     for (size_t oy = 0; oy < N; oy++) {
-      float* dst_row = GetOutputRow(output_rows, c_, oy);
-      for (ssize_t x = x0; x < x1; x += Lanes(df)) {
-        hwy::HWY_NAMESPACE::Vec<HWY_FULL(float)> ups[8];
+      dst_rows[oy] = GetOutputRow(output_rows, c_, oy);
+    }
+    for (ssize_t x = x0; x < x1; x += Lanes(df)) {
+      // The 5x5 neighborhood and its range are shared by all the N x N
+      // output pixels of each input pixel.
+      V v[25];
+      for (size_t iy = 0; iy < 5; iy++) {
+        for (size_t ix = 0; ix < 5; ix++) {
+          v[iy * 5 + ix] = LoadU(df, src_rows[iy] + x + ix - 2);
+        }
+      }
+      V min = v[0];
+      V max = v[0];
+      for (size_t i = 1; i < 25; i++) {
+        min = Min(v[i], min);
+        max = Max(v[i], max);
+      }
+      for (size_t oy = 0; oy < N; oy++) {
+        float* dst_row = dst_rows[oy];
+        V ups[8];
         for (size_t ox = 0; ox < N; ox++) {
+          const float* JXL_RESTRICT kernel = output_kernel_[oy][ox];
           auto result = Zero(df);
-          auto min = LoadU(df, GetInputRow(input_rows, c_, 0) + x);
-          auto max = min;
-          for (ssize_t iy = -2; iy <= 2; iy++) {
-            for (ssize_t ix = -2; ix <= 2; ix++) {
-              auto v = LoadU(df, GetInputRow(input_rows, c_, iy) + x + ix);
-              result = MulAdd(Set(df, Kernel<N>(ox, oy, ix, iy)), v, result);
-              min = Min(v, min);
-              max = Max(v, max);
-            }
+          for (size_t i = 0; i < 25; i++) {
+            result = MulAdd(Set(df, kernel[i]), v[i], result);
           }
           // Avoid overshooting.
           ups[ox] = Clamp(result, min, max);
@@ -136,6 +167,8 @@ class UpsamplingStage : public RenderPipelineStage {
 
   size_t c_;
   float kernel_[4][4][5][5];
+  // Row-major 5x5 kernel of each output pixel of an 8x8 (or smaller) cell.
+  float output_kernel_[8][8][25];
 };
 
 std::unique_ptr<RenderPipelineStage> GetUpsamplingStage(
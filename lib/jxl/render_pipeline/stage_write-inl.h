@@ -0,0 +1,110 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Helpers to store interleaved uint8 pixels, shared by the stages writing to
+// a uint8 buffer.
+
+#if defined(LIB_JXL_RENDER_PIPELINE_STAGE_WRITE_INL_H_) == \
+    defined(HWY_TARGET_TOGGLE)
+#ifdef LIB_JXL_RENDER_PIPELINE_STAGE_WRITE_INL_H_
+#undef LIB_JXL_RENDER_PIPELINE_STAGE_WRITE_INL_H_
+#else
+#define LIB_JXL_RENDER_PIPELINE_STAGE_WRITE_INL_H_
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <hwy/highway.h>
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// Stores the first n lanes of r, g, b (and a if alpha) interleaved to buf.
+// extra is the number of pixels that may be written from buf on, at least n.
+// At most 16 lanes are supported.
+template <typename D, typename V>
+void StoreRGBA(D d, V r, V g, V b, V a, bool alpha, size_t n, size_t extra,
+               uint8_t* buf) {
+#if HWY_TARGET == HWY_SCALAR
+  buf[0] = r.raw;
+  buf[1] = g.raw;
+  buf[2] = b.raw;
+  if (alpha) {
+    buf[3] = a.raw;
+  }
+#elif HWY_TARGET == HWY_NEON
+  if (alpha) {
+    uint8x8x4_t data = {r.raw, g.raw, b.raw, a.raw};
+    if (extra >= 8) {
+      vst4_u8(buf, data);
+    } else {
+      uint8_t tmp[8 * 4];
+      vst4_u8(tmp, data);
+      memcpy(buf, tmp, n * 4);
+    }
+  } else {
+    uint8x8x3_t data = {r.raw, g.raw, b.raw};
+    if (extra >= 8) {
+      vst3_u8(buf, data);
+    } else {
+      uint8_t tmp[8 * 3];
+      vst3_u8(tmp, data);
+      memcpy(buf, tmp, n * 3);
+    }
+  }
+#else
+  // TODO(veluca): implement this for x86.
+  size_t mul = alpha ? 4 : 3;
+  HWY_ALIGN uint8_t bytes[16];
+  Store(r, d, bytes);
+  for (size_t i = 0; i < n; i++) {
+    buf[mul * i] = bytes[i];
+  }
+  Store(g, d, bytes);
+  for (size_t i = 0; i < n; i++) {
+    buf[mul * i + 1] = bytes[i];
+  }
+  Store(b, d, bytes);
+  for (size_t i = 0; i < n; i++) {
+    buf[mul * i + 2] = bytes[i];
+  }
+  if (alpha) {
+    Store(a, d, bytes);
+    for (size_t i = 0; i < n; i++) {
+      buf[4 * i + 3] = bytes[i];
+    }
+  }
+#endif
+}
+
+// Converts the first n lanes of r, g, b (and a if alpha) from [0, 1] floats to
+// uint8 and stores them interleaved to buf, see StoreRGBA.
+template <typename D, typename V>
+void StoreRGBAFromFloat(D d, V r, V g, V b, V a, bool alpha, size_t n,
+                        size_t extra, uint8_t* buf) {
+  const hwy::HWY_NAMESPACE::Rebind<uint32_t, D> du;
+  const hwy::HWY_NAMESPACE::Rebind<uint8_t, D> d8;
+  const auto zero = Zero(d);
+  const auto one = Set(d, 1.0f);
+  const auto mul = Set(d, 255.0f);
+  const auto rf = Clamp(zero, r, one) * mul;
+  const auto gf = Clamp(zero, g, one) * mul;
+  const auto bf = Clamp(zero, b, one) * mul;
+  const auto af = Clamp(zero, a, one) * mul;
+  const auto r8 = U8FromU32(BitCast(du, NearestInt(rf)));
+  const auto g8 = U8FromU32(BitCast(du, NearestInt(gf)));
+  const auto b8 = U8FromU32(BitCast(du, NearestInt(bf)));
+  const auto a8 = U8FromU32(BitCast(du, NearestInt(af)));
+  StoreRGBA(d8, r8, g8, b8, a8, alpha, n, extra, buf);
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#endif  // LIB_JXL_RENDER_PIPELINE_STAGE_WRITE_INL_H_
@@ -5,6 +5,9 @@
 
 #include "lib/jxl/render_pipeline/stage_write.h"
 
+#include <algorithm>
+#include <cmath>
+
 #include "lib/jxl/common.h"
 #include "lib/jxl/dec_cache.h"
 #include "lib/jxl/image_bundle.h"
@@ -15,95 +18,66 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/render_pipeline/stage_write-inl.h"
+
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
 
-template <typename D, typename V>
-void StoreRGBA(D d, V r, V g, V b, V a, bool alpha, size_t n, size_t extra,
-               uint8_t* buf) {
-#if HWY_TARGET == HWY_SCALAR
-  buf[0] = r.raw;
-  buf[1] = g.raw;
-  buf[2] = b.raw;
-  if (alpha) {
-    buf[3] = a.raw;
-  }
-#elif HWY_TARGET == HWY_NEON
-  if (alpha) {
-    uint8x8x4_t data = {r.raw, g.raw, b.raw, a.raw};
-    if (extra >= 8) {
-      vst4_u8(buf, data);
-    } else {
-      uint8_t tmp[8 * 4];
-      vst4_u8(tmp, data);
-      memcpy(buf, tmp, n * 4);
-    }
-  } else {
-    uint8x8x3_t data = {r.raw, g.raw, b.raw};
-    if (extra >= 8) {
-      vst3_u8(buf, data);
-    } else {
-      uint8_t tmp[8 * 3];
-      vst3_u8(tmp, data);
-      memcpy(buf, tmp, n * 3);
-    }
-  }
-#else
-  // TODO(veluca): implement this for x86.
-  size_t mul = alpha ? 4 : 3;
-  HWY_ALIGN uint8_t bytes[16];
-  Store(r, d, bytes);
-  for (size_t i = 0; i < n; i++) {
-    buf[mul * i] = bytes[i];
-  }
-  Store(g, d, bytes);
-  for (size_t i = 0; i < n; i++) {
-    buf[mul * i + 1] = bytes[i];
-  }
-  Store(b, d, bytes);
-  for (size_t i = 0; i < n; i++) {
-    buf[mul * i + 2] = bytes[i];
-  }
-  if (alpha) {
-    Store(a, d, bytes);
-    for (size_t i = 0; i < n; i++) {
-      buf[4 * i + 3] = bytes[i];
-    }
-  }
-#endif
-}
-
 class WriteToU8Stage : public RenderPipelineStage {
  public:
   WriteToU8Stage(uint8_t* rgb, size_t stride, size_t height, bool rgba,
-                 bool has_alpha, size_t alpha_c)
+                 bool has_alpha, size_t alpha_c, bool premultiply)
       : RenderPipelineStage(RenderPipelineStage::Settings()),
         rgb_(rgb),
         stride_(stride),
         height_(height),
         rgba_(rgba),
         has_alpha_(has_alpha),
-        alpha_c_(alpha_c) {}
+        alpha_c_(alpha_c),
+        premultiply_(premultiply && has_alpha) {}
 
   void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
                   size_t xextra, size_t xsize, size_t xpos, size_t ypos,
                   size_t thread_id) const final {
-    if (ypos >= height_) return;
     JXL_DASSERT(xextra == 0);
+    WriteRow(GetInputRow(input_rows, 0, 0), GetInputRow(input_rows, 1, 0),
+             GetInputRow(input_rows, 2, 0),
+             has_alpha_ ? GetInputRow(input_rows, alpha_c_, 0) : nullptr,
+             xsize, xpos, ypos);
+  }
+
+  bool ProcessesMultipleRows() const final { return true; }
+
+  void ProcessRows(const RowInfo& rows, size_t num_rows, size_t xsize,
+                   size_t xpos, size_t ypos, size_t thread_id) const final {
+    for (size_t r = 0; r < num_rows; r++) {
+      WriteRow(GetRowOfBatch(rows, 0, r), GetRowOfBatch(rows, 1, r),
+               GetRowOfBatch(rows, 2, r),
+               has_alpha_ ? GetRowOfBatch(rows, alpha_c_, r) : nullptr, xsize,
+               xpos, ypos + r);
+    }
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return c < 3 || (has_alpha_ && c == alpha_c_)
+               ? RenderPipelineChannelMode::kInput
+               : RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "WriteToU8"; }
+
+ private:
+  void WriteRow(const float* JXL_RESTRICT row_in_r,
+                const float* JXL_RESTRICT row_in_g,
+                const float* JXL_RESTRICT row_in_b,
+                const float* JXL_RESTRICT row_in_a, size_t xsize, size_t xpos,
+                size_t ypos) const {
+    if (ypos >= height_) return;
     size_t bytes = rgba_ ? 4 : 3;
-    const float* JXL_RESTRICT row_in_r = GetInputRow(input_rows, 0, 0);
-    const float* JXL_RESTRICT row_in_g = GetInputRow(input_rows, 1, 0);
-    const float* JXL_RESTRICT row_in_b = GetInputRow(input_rows, 2, 0);
-    const float* JXL_RESTRICT row_in_a =
-        has_alpha_ ? GetInputRow(input_rows, alpha_c_, 0) : nullptr;
-    size_t base_ptr = ypos * stride_ + bytes * (xpos - xextra);
+    size_t base_ptr = ypos * stride_ + bytes * xpos;
     using D = HWY_CAPPED(float, 4);
     const D d;
-    D::Rebind<uint32_t> du;
-    auto zero = Zero(d);
-    auto one = Set(d, 1.0f);
-    auto mul = Set(d, 255.0f);
 
     ssize_t x1 = RoundUpTo(xsize, Lanes(d));
 
@@ -115,51 +89,38 @@ class WriteToU8Stage : public RenderPipelineStage {
     }
 
     for (ssize_t x = 0; x < x1; x += Lanes(d)) {
-      auto rf = Clamp(zero, Load(d, row_in_r + x), one) * mul;
-      auto gf = Clamp(zero, Load(d, row_in_g + x), one) * mul;
-      auto bf = Clamp(zero, Load(d, row_in_b + x), one) * mul;
-      auto af = row_in_a ? Clamp(zero, Load(d, row_in_a + x), one) * mul
-                         : Set(d, 255.0f);
-      auto r8 = U8FromU32(BitCast(du, NearestInt(rf)));
-      auto g8 = U8FromU32(BitCast(du, NearestInt(gf)));
-      auto b8 = U8FromU32(BitCast(du, NearestInt(bf)));
-      auto a8 = U8FromU32(BitCast(du, NearestInt(af)));
-      size_t n = xsize - x;
-      if (JXL_LIKELY(n >= Lanes(d))) {
-        StoreRGBA(D::Rebind<uint8_t>(), r8, g8, b8, a8, rgba_, Lanes(d), n,
-                  rgb_ + base_ptr + bytes * x);
-      } else {
-        StoreRGBA(D::Rebind<uint8_t>(), r8, g8, b8, a8, rgba_, n, n,
-                  rgb_ + base_ptr + bytes * x);
+      auto rf = Load(d, row_in_r + x);
+      auto gf = Load(d, row_in_g + x);
+      auto bf = Load(d, row_in_b + x);
+      auto af = row_in_a ? Load(d, row_in_a + x) : Set(d, 1.0f);
+      if (premultiply_) {
+        rf = rf * af;
+        gf = gf * af;
+        bf = bf * af;
       }
+      size_t n = xsize - x;
+      StoreRGBAFromFloat(d, rf, gf, bf, af, rgba_,
+                         JXL_LIKELY(n >= Lanes(d)) ? Lanes(d) : n, n,
+                         rgb_ + base_ptr + bytes * x);
     }
   }
 
-  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
-    return c < 3 || (has_alpha_ && c == alpha_c_)
-               ? RenderPipelineChannelMode::kInput
-               : RenderPipelineChannelMode::kIgnored;
-  }
-
-  const char* GetName() const override { return "WriteToU8"; }
-
- private:
   uint8_t* rgb_;
   size_t stride_;
   size_t height_;
   bool rgba_;
   bool has_alpha_;
   size_t alpha_c_;
+  // Whether the color channels are multiplied by alpha before being written.
+  bool premultiply_;
   std::vector<float> opaque_alpha_;
 };
 
-std::unique_ptr<RenderPipelineStage> GetWriteToU8Stage(uint8_t* rgb,
-                                                       size_t stride,
-                                                       size_t height, bool rgba,
-                                                       bool has_alpha,
-                                                       size_t alpha_c) {
+std::unique_ptr<RenderPipelineStage> GetWriteToU8Stage(
+    uint8_t* rgb, size_t stride, size_t height, bool rgba, bool has_alpha,
+    size_t alpha_c, bool premultiply) {
   return jxl::make_unique<WriteToU8Stage>(rgb, stride, height, rgba, has_alpha,
-                                          alpha_c);
+                                          alpha_c, premultiply);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -272,7 +233,7 @@ class WriteToPixelCallbackStage : public RenderPipelineStage {
  public:
   WriteToPixelCallbackStage(const PixelCallback& pixel_callback, size_t width,
                             size_t height, bool rgba, bool has_alpha,
-                            size_t alpha_c)
+                            size_t alpha_c, bool premultiply)
       : RenderPipelineStage(RenderPipelineStage::Settings()),
         pixel_callback_(pixel_callback),
         width_(width),
@@ -280,6 +241,7 @@ class WriteToPixelCallbackStage : public RenderPipelineStage {
         rgba_(rgba),
         has_alpha_(has_alpha),
         alpha_c_(alpha_c),
+        premultiply_(premultiply && has_alpha),
         opaque_alpha_(kMaxPixelsPerCall, 1.0f) {}
 
   WriteToPixelCallbackStage(const WriteToPixelCallbackStage&) = delete;
@@ -299,6 +261,13 @@ class WriteToPixelCallbackStage : public RenderPipelineStage {
                   size_t thread_id) const final {
     JXL_DASSERT(run_opaque_);
     if (ypos >= height_) return;
+    if (pixel_callback_.HasTiles()) {
+      if (xpos < width_) {
+        AddTileRow(input_rows, std::min(xsize, width_ - xpos), xpos, ypos,
+                   thread_id);
+      }
+      return;
+    }
     const float* line_buffers[4];
     for (size_t c = 0; c < 3; c++) {
       line_buffers[c] = GetInputRow(input_rows, c, 0) - xextra;
@@ -317,9 +286,10 @@ class WriteToPixelCallbackStage : public RenderPipelineStage {
       float* JXL_RESTRICT temp =
           reinterpret_cast<float*>(temp_[thread_id].get());
       for (; ix < kMaxPixelsPerCall && ssize_t(ix) + x0 < limit; ix++) {
-        temp[j++] = line_buffers[0][ix];
-        temp[j++] = line_buffers[1][ix];
-        temp[j++] = line_buffers[2][ix];
+        const float mul = premultiply_ ? line_buffers[3][ix] : 1.0f;
+        temp[j++] = line_buffers[0][ix] * mul;
+        temp[j++] = line_buffers[1][ix] * mul;
+        temp[j++] = line_buffers[2][ix] * mul;
         if (rgba_) {
           temp[j++] = line_buffers[3][ix];
         }
@@ -336,21 +306,83 @@ class WriteToPixelCallbackStage : public RenderPipelineStage {
                : RenderPipelineChannelMode::kIgnored;
   }
 
+  void FinishRect(size_t thread_id) const final {
+    if (pixel_callback_.HasTiles()) FlushTile(thread_id);
+  }
+
   const char* GetName() const override { return "WritePixelCB"; }
 
  private:
+  // The rows given to a tile callback are gathered in a per-thread tile of at
+  // most TilePixels() pixels, which is passed on at the end of each rectangle
+  // or once a row does not extend it.
+  struct Tile {
+    size_t x0 = 0;
+    size_t y0 = 0;
+    size_t xsize = 0;
+    size_t ysize = 0;
+  };
+
+  size_t TilePixels() const {
+    return width_ > kMaxTilePixels ? width_ : kMaxTilePixels;
+  }
+
+  void AddTileRow(const RowInfo& input_rows, size_t xsize, size_t xpos,
+                  size_t ypos, size_t thread_id) const {
+    Tile& tile = tiles_[thread_id];
+    if (tile.ysize != 0 &&
+        (xpos != tile.x0 || xsize != tile.xsize ||
+         ypos != tile.y0 + tile.ysize ||
+         (tile.ysize + 1) * xsize > TilePixels())) {
+      FlushTile(thread_id);
+    }
+    if (tile.ysize == 0) {
+      tile.x0 = xpos;
+      tile.y0 = ypos;
+      tile.xsize = xsize;
+    }
+    const float* JXL_RESTRICT row_r = GetInputRow(input_rows, 0, 0);
+    const float* JXL_RESTRICT row_g = GetInputRow(input_rows, 1, 0);
+    const float* JXL_RESTRICT row_b = GetInputRow(input_rows, 2, 0);
+    const float* JXL_RESTRICT row_a =
+        has_alpha_ ? GetInputRow(input_rows, alpha_c_, 0) : nullptr;
+    float* JXL_RESTRICT out = reinterpret_cast<float*>(temp_[thread_id].get()) +
+                              tile.ysize * xsize * (rgba_ ? 4 : 3);
+    for (size_t x = 0; x < xsize; x++) {
+      const float alpha = row_a ? row_a[x] : 1.0f;
+      const float mul = premultiply_ ? alpha : 1.0f;
+      *out++ = row_r[x] * mul;
+      *out++ = row_g[x] * mul;
+      *out++ = row_b[x] * mul;
+      if (rgba_) *out++ = alpha;
+    }
+    tile.ysize++;
+  }
+
+  void FlushTile(size_t thread_id) const {
+    Tile& tile = tiles_[thread_id];
+    if (tile.ysize == 0) return;
+    pixel_callback_.run_tile(run_opaque_, thread_id, tile.x0, tile.y0,
+                             tile.xsize, tile.ysize, temp_[thread_id].get(),
+                             sizeof(float) * tile.xsize * (rgba_ ? 4 : 3));
+    tile.ysize = 0;
+  }
+
   Status PrepareForThreads(size_t num_threads) override {
-    run_opaque_ =
-        pixel_callback_.Init(num_threads, /*num_pixels=*/kMaxPixelsPerCall);
+    const size_t num_pixels =
+        pixel_callback_.HasTiles() ? TilePixels() : kMaxPixelsPerCall;
+    run_opaque_ = pixel_callback_.Init(num_threads, num_pixels);
     JXL_RETURN_IF_ERROR(run_opaque_ != nullptr);
     temp_.resize(num_threads);
     for (CacheAlignedUniquePtr& temp : temp_) {
-      temp = AllocateArray(sizeof(float) * kMaxPixelsPerCall * (rgba_ ? 4 : 3));
+      temp = AllocateArray(sizeof(float) * num_pixels * (rgba_ ? 4 : 3));
     }
+    tiles_.assign(num_threads, Tile());
     return true;
   }
 
   static constexpr size_t kMaxPixelsPerCall = 1024;
+  static constexpr size_t kMaxTilePixels = 1 << 16;
   PixelCallback pixel_callback_;
   void* run_opaque_ = nullptr;
   size_t width_;
@@ -358,8 +390,85 @@ class WriteToPixelCallbackStage : public RenderPipelineStage {
   bool rgba_;
   bool has_alpha_;
   size_t alpha_c_;
+  bool premultiply_;
   std::vector<float> opaque_alpha_;
   std::vector<CacheAlignedUniquePtr> temp_;
+  // Only accessed by their own thread.
+  mutable std::vector<Tile> tiles_;
+};
+
+class WriteToPlanarCallbackStage : public RenderPipelineStage {
+ public:
+  WriteToPlanarCallbackStage(const PlanarCallback& planar_callback, size_t c,
+                             uint32_t plane, size_t width, size_t height,
+                             bool in_out)
+      : RenderPipelineStage(RenderPipelineStage::Settings()),
+        planar_callback_(planar_callback),
+        c_(c),
+        plane_(plane),
+        width_(width),
+        height_(height),
+        in_out_(in_out) {}
+
+  void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                  size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                  size_t thread_id) const final {
+    const float* JXL_RESTRICT row_in = GetInputRow(input_rows, c_, 0);
+    if (in_out_) {
+      memcpy(GetOutputRow(output_rows, c_, 0) - xextra, row_in - xextra,
+             sizeof(float) * (xsize + 2 * xextra));
+    }
+    if (ypos >= height_ || xpos >= width_) return;
+    const size_t limit = std::min(xsize, width_ - xpos);
+    // The channels are centered around zero, as in the JPEG YCbCr to RGB
+    // conversion before the level shift.
+    const float offset = 128.0f / 255;
+    for (size_t x0 = 0; x0 < limit; x0 += kMaxPixelsPerCall) {
+      const size_t num = std::min(kMaxPixelsPerCall, limit - x0);
+      if (planar_callback_.data_type == JXL_TYPE_UINT8) {
+        uint8_t* JXL_RESTRICT temp = temp_[thread_id].get();
+        for (size_t x = 0; x < num; x++) {
+          float v = (row_in[x0 + x] + offset) * 255.0f;
+          temp[x] = static_cast<uint8_t>(
+              std::lround(std::min(255.0f, std::max(0.0f, v))));
+        }
+      } else {
+        float* JXL_RESTRICT temp =
+            reinterpret_cast<float*>(temp_[thread_id].get());
+        for (size_t x = 0; x < num; x++) {
+          temp[x] = row_in[x0 + x] + offset;
+        }
+      }
+      planar_callback_.callback(planar_callback_.opaque, plane_, xpos + x0,
+                                ypos, num, temp_[thread_id].get());
+    }
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    if (c != c_) return RenderPipelineChannelMode::kIgnored;
+    return in_out_ ? RenderPipelineChannelMode::kInOut
+                   : RenderPipelineChannelMode::kInput;
+  }
+
+  const char* GetName() const override { return "WritePlanarCB"; }
+
+ private:
+  Status PrepareForThreads(size_t num_threads) override {
+    temp_.resize(num_threads);
+    for (CacheAlignedUniquePtr& temp : temp_) {
+      temp = AllocateArray(sizeof(float) * kMaxPixelsPerCall);
+    }
+    return true;
+  }
+
+  static constexpr size_t kMaxPixelsPerCall = 1024;
+  PlanarCallback planar_callback_;
+  size_t c_;
+  uint32_t plane_;
+  size_t width_;
+  size_t height_;
+  bool in_out_;
+  std::vector<CacheAlignedUniquePtr> temp_;
 };
 
 }  // namespace
@@ -374,20 +483,25 @@ std::unique_ptr<RenderPipelineStage> GetWriteToImage3FStage(Image3F* image) {
   return jxl::make_unique<WriteToImage3FStage>(image);
 }
 
-std::unique_ptr<RenderPipelineStage> GetWriteToU8Stage(uint8_t* rgb,
-                                                       size_t stride,
-                                                       size_t height, bool rgba,
-                                                       bool has_alpha,
-                                                       size_t alpha_c) {
-  return HWY_DYNAMIC_DISPATCH(GetWriteToU8Stage)(rgb, stride, height, rgba,
-                                                 has_alpha, alpha_c);
+std::unique_ptr<RenderPipelineStage> GetWriteToU8Stage(
+    uint8_t* rgb, size_t stride, size_t height, bool rgba, bool has_alpha,
+    size_t alpha_c, bool premultiply) {
+  return HWY_DYNAMIC_DISPATCH(GetWriteToU8Stage)(
+      rgb, stride, height, rgba, has_alpha, alpha_c, premultiply);
 }
 
 std::unique_ptr<RenderPipelineStage> GetWriteToPixelCallbackStage(
     const PixelCallback& pixel_callback, size_t width, size_t height, bool rgba,
-    bool has_alpha, size_t alpha_c) {
+    bool has_alpha, size_t alpha_c, bool premultiply) {
   return jxl::make_unique<WriteToPixelCallbackStage>(
-      pixel_callback, width, height, rgba, has_alpha, alpha_c);
+      pixel_callback, width, height, rgba, has_alpha, alpha_c, premultiply);
+}
+
+std::unique_ptr<RenderPipelineStage> GetWriteToPlanarCallbackStage(
+    const PlanarCallback& planar_callback, size_t c, uint32_t plane,
+    size_t width, size_t height, bool in_out) {
+  return jxl::make_unique<WriteToPlanarCallbackStage>(
+      planar_callback, c, plane, width, height, in_out);
 }
 
 }  // namespace jxl
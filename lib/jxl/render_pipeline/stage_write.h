@@ -20,17 +20,23 @@ std::unique_ptr<RenderPipelineStage> GetWriteToImageBundleStage(
 // Gets a stage to write color channels to an Image3F.
 std::unique_ptr<RenderPipelineStage> GetWriteToImage3FStage(Image3F* image);
 
-// Gets a stage to write to a uint8 buffer.
-std::unique_ptr<RenderPipelineStage> GetWriteToU8Stage(uint8_t* rgb,
-                                                       size_t stride,
-                                                       size_t height, bool rgba,
-                                                       bool has_alpha,
-                                                       size_t alpha_c);
-
-// Gets a stage to write to a pixel callback.
+// Gets a stage to write to a uint8 buffer. If premultiply and has_alpha, the
+// color channels are multiplied by the alpha channel `alpha_c`.
+std::unique_ptr<RenderPipelineStage> GetWriteToU8Stage(
+    uint8_t* rgb, size_t stride, size_t height, bool rgba, bool has_alpha,
+    size_t alpha_c, bool premultiply);
+
+// Gets a stage to write to a pixel callback. premultiply is as above.
 std::unique_ptr<RenderPipelineStage> GetWriteToPixelCallbackStage(
     const PixelCallback& pixel_callback, size_t width, size_t height, bool rgba,
-    bool has_alpha, size_t alpha_c);
+    bool has_alpha, size_t alpha_c, bool premultiply);
+
+// Gets a stage to write channel `c`, of size `width` x `height`, as plane
+// number `plane` of a planar callback. If `in_out`, the stage also copies its
+// input to its output so that it can be followed by stages of other channels.
+std::unique_ptr<RenderPipelineStage> GetWriteToPlanarCallbackStage(
+    const PlanarCallback& planar_callback, size_t c, uint32_t plane,
+    size_t width, size_t height, bool in_out);
 
 }  // namespace jxl
 
@@ -5,6 +5,11 @@
 
 #include "lib/jxl/render_pipeline/stage_xyb.h"
 
+#include <string.h>
+
+#include <type_traits>
+#include <utility>
+
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/render_pipeline/stage_xyb.cc"
 #include <hwy/foreach_target.h>
@@ -12,7 +17,9 @@
 
 #include "lib/jxl/dec_xyb-inl.h"
 #include "lib/jxl/fast_math-inl.h"
+#include "lib/jxl/render_pipeline/stage_write-inl.h"
 #include "lib/jxl/sanitizers.h"
+#include "lib/jxl/tone_mapping-inl.h"
 #include "lib/jxl/transfer_functions-inl.h"
 
 HWY_BEFORE_NAMESPACE();
@@ -61,9 +68,68 @@ struct OpPq {
   }
 };
 
+struct Op709 {
+  template <typename D, typename T>
+  T Transform(D d, const T& linear) const {
+    return TF_709().EncodedFromDisplay(d, linear);
+  }
+};
+
+// Tables of transfer functions for integer outputs, indexed by the float bits
+// of linear values in [2^kLutMinExponent, 1]: the exponent and the top
+// kLutMantissaBits of the mantissa. Values are linearly interpolated between
+// entries; the maximum error, dominated by clamping the smaller values in PQ,
+// is below 0.05 of a uint8 step.
+constexpr int kLutMantissaBits = 4;
+constexpr int kLutMinExponent = -32;
+constexpr int kLutShift = 23 - kLutMantissaBits;
+constexpr int32_t kLutMinBits = (127 + kLutMinExponent) << 23;
+// One entry past the index of 1, to interpolate there.
+constexpr size_t kLutSize =
+    (static_cast<size_t>(-kLutMinExponent) << kLutMantissaBits) + 2;
+
+// Returns the table of TF, computed on first use.
+template <typename TF>
+const float* GetTransferFunctionLut() {
+  static const std::vector<float>* lut = [] {
+    const HWY_CAPPED(float, 1) d;
+    std::vector<float>* lut = new std::vector<float>(kLutSize);
+    for (size_t i = 0; i < kLutSize; i++) {
+      const int32_t bits = kLutMinBits + (static_cast<int32_t>(i) << kLutShift);
+      float linear;
+      memcpy(&linear, &bits, sizeof(linear));
+      const auto v = Set(d, std::min(linear, 1.0f));
+      (*lut)[i] = GetLane(TF().EncodedFromDisplay(d, v));
+    }
+    return lut;
+  }();
+  return lut->data();
+}
+
+struct OpLut {
+  explicit OpLut(const float* lut) : lut(lut) {}
+  template <typename D, typename T>
+  T Transform(D d, const T& linear) const {
+    const Rebind<int32_t, D> di;
+    const auto min = BitCast(d, Set(di, kLutMinBits));
+    const auto bits =
+        BitCast(di, Min(Max(linear, min), Set(d, 1.0f))) - Set(di, kLutMinBits);
+    const auto idx = ShiftRight<kLutShift>(bits);
+    const auto frac = ConvertTo(d, bits & Set(di, (1 << kLutShift) - 1)) *
+                      Set(d, 1.0f / (1 << kLutShift));
+    const auto lo = GatherIndex(d, lut, idx);
+    const auto hi = GatherIndex(d, lut + 1, idx);
+    return MulAdd(hi - lo, frac, lo);
+  }
+
+  const float* lut;
+};
+
 struct OpHlg {
-  explicit OpHlg(const float luminances[3], const float intensity_target)
-      : luminances(luminances), exponent(1.0f) {
+  // lut, if not null, is the table of the HLG OETF for integer outputs.
+  explicit OpHlg(const float luminances[3], const float intensity_target,
+                 const float* lut = nullptr)
+      : luminances(luminances), exponent(1.0f), lut(lut) {
     if (295 <= intensity_target && intensity_target <= 305) {
       apply_inverse_ootf = false;
       return;
@@ -83,6 +149,10 @@ struct OpHlg {
       *g *= ratio;
       *b *= ratio;
     }
+    if (lut != nullptr) {
+      MakePerChannelOp(OpLut(lut)).Transform(d, r, g, b);
+      return;
+    }
     *r = TF_HLG().EncodedFromDisplay(d, *r);
     *g = TF_HLG().EncodedFromDisplay(d, *g);
     *b = TF_HLG().EncodedFromDisplay(d, *b);
@@ -90,13 +160,7 @@ struct OpHlg {
   bool apply_inverse_ootf = true;
   const float* luminances;
   float exponent;
-};
-
-struct Op709 {
-  template <typename D, typename T>
-  T Transform(D d, const T& linear) const {
-    return TF_709().EncodedFromDisplay(d, linear);
-  }
+  const float* lut;
 };
 
 struct OpGamma {
@@ -108,6 +172,19 @@ struct OpGamma {
   }
 };
 
+// Tone maps the linear values before the conversion of Op.
+template <typename Op>
+struct ToneMappedOp {
+  template <typename D, typename T>
+  void Transform(D d, T* r, T* g, T* b) const {
+    tone_mapper.ToneMap(d, r, g, b);
+    op.Transform(d, r, g, b);
+  }
+
+  Rec2390ToneMapper tone_mapper;
+  Op op;
+};
+
 template <typename Op>
 class XYBStage : public RenderPipelineStage {
  public:
@@ -120,12 +197,33 @@ class XYBStage : public RenderPipelineStage {
                   size_t xextra, size_t xsize, size_t xpos, size_t ypos,
                   size_t thread_id) const final {
     PROFILER_ZONE("UndoXYB");
+    UndoXYB(GetInputRow(input_rows, 0, 0), GetInputRow(input_rows, 1, 0),
+            GetInputRow(input_rows, 2, 0), xextra, xsize);
+  }
+
+  bool ProcessesMultipleRows() const final { return true; }
+
+  void ProcessRows(const RowInfo& rows, size_t num_rows, size_t xsize,
+                   size_t xpos, size_t ypos, size_t thread_id) const final {
+    PROFILER_ZONE("UndoXYB");
+    for (size_t r = 0; r < num_rows; r++) {
+      UndoXYB(GetRowOfBatch(rows, 0, r), GetRowOfBatch(rows, 1, r),
+              GetRowOfBatch(rows, 2, r), /*xextra=*/0, xsize);
+    }
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return c < 3 ? RenderPipelineChannelMode::kInPlace
+                 : RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "XYB"; }
 
+ private:
+  void UndoXYB(float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
+               float* JXL_RESTRICT row2, size_t xextra, size_t xsize) const {
     const HWY_FULL(float) d;
     const size_t xsize_v = RoundUpTo(xsize, Lanes(d));
-    float* JXL_RESTRICT row0 = GetInputRow(input_rows, 0, 0);
-    float* JXL_RESTRICT row1 = GetInputRow(input_rows, 1, 0);
-    float* JXL_RESTRICT row2 = GetInputRow(input_rows, 2, 0);
     // All calculations are lane-wise, still some might require
     // value-dependent behaviour (e.g. NearestInt). Temporary unpoison last
     // vector tail.
@@ -151,53 +249,227 @@ class XYBStage : public RenderPipelineStage {
     msan::PoisonMemory(row2 + xsize, sizeof(float) * (xsize_v - xsize));
   }
 
+  OpsinParams opsin_params_;
+  Op op_;
+};
+
+// Same as XYBStage followed by the stage writing to a uint8 buffer, without
+// storing the converted float values in between.
+template <typename Op>
+class XYBWriteToU8Stage : public RenderPipelineStage {
+ public:
+  XYBWriteToU8Stage(OpsinParams opsin_params, Op op, uint8_t* rgb,
+                    size_t stride, size_t height, bool rgba, bool has_alpha,
+                    size_t alpha_c)
+      : RenderPipelineStage(RenderPipelineStage::Settings()),
+        opsin_params_(opsin_params),
+        op_(op),
+        rgb_(rgb),
+        stride_(stride),
+        height_(height),
+        rgba_(rgba),
+        has_alpha_(has_alpha),
+        alpha_c_(alpha_c) {}
+
+  void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                  size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                  size_t thread_id) const final {
+    PROFILER_ZONE("UndoXYBWriteToU8");
+    JXL_DASSERT(xextra == 0);
+    WriteRow(GetInputRow(input_rows, 0, 0), GetInputRow(input_rows, 1, 0),
+             GetInputRow(input_rows, 2, 0),
+             has_alpha_ ? GetInputRow(input_rows, alpha_c_, 0) : nullptr,
+             xsize, xpos, ypos);
+  }
+
+  bool ProcessesMultipleRows() const final { return true; }
+
+  void ProcessRows(const RowInfo& rows, size_t num_rows, size_t xsize,
+                   size_t xpos, size_t ypos, size_t thread_id) const final {
+    PROFILER_ZONE("UndoXYBWriteToU8");
+    for (size_t r = 0; r < num_rows; r++) {
+      WriteRow(GetRowOfBatch(rows, 0, r), GetRowOfBatch(rows, 1, r),
+               GetRowOfBatch(rows, 2, r),
+               has_alpha_ ? GetRowOfBatch(rows, alpha_c_, r) : nullptr, xsize,
+               xpos, ypos + r);
+    }
+  }
+
   RenderPipelineChannelMode GetChannelMode(size_t c) const final {
-    return c < 3 ? RenderPipelineChannelMode::kInPlace
-                 : RenderPipelineChannelMode::kIgnored;
+    return c < 3 || (has_alpha_ && c == alpha_c_)
+               ? RenderPipelineChannelMode::kInput
+               : RenderPipelineChannelMode::kIgnored;
   }
 
-  const char* GetName() const override { return "XYB"; }
+  const char* GetName() const override { return "XYBWriteToU8"; }
 
  private:
+  void WriteRow(const float* JXL_RESTRICT row0, const float* JXL_RESTRICT row1,
+                const float* JXL_RESTRICT row2,
+                const float* JXL_RESTRICT row_a, size_t xsize, size_t xpos,
+                size_t ypos) const {
+    if (ypos >= height_) return;
+    const size_t bytes = rgba_ ? 4 : 3;
+    uint8_t* JXL_RESTRICT out = rgb_ + ypos * stride_ + bytes * xpos;
+    // StoreRGBA handles at most 16 lanes.
+    using D = HWY_CAPPED(float, 16);
+    const D d;
+    const size_t xsize_v = RoundUpTo(xsize, Lanes(d));
+    msan::UnpoisonMemory(row0 + xsize, sizeof(float) * (xsize_v - xsize));
+    msan::UnpoisonMemory(row1 + xsize, sizeof(float) * (xsize_v - xsize));
+    msan::UnpoisonMemory(row2 + xsize, sizeof(float) * (xsize_v - xsize));
+    if (row_a) {
+      msan::UnpoisonMemory(row_a + xsize, sizeof(float) * (xsize_v - xsize));
+    }
+    for (size_t x = 0; x < xsize_v; x += Lanes(d)) {
+      auto r = Undefined(d);
+      auto g = Undefined(d);
+      auto b = Undefined(d);
+      XybToRgb(d, Load(d, row0 + x), Load(d, row1 + x), Load(d, row2 + x),
+               opsin_params_, &r, &g, &b);
+      op_.Transform(d, &r, &g, &b);
+      const auto a = row_a ? Load(d, row_a + x) : Set(d, 1.0f);
+      const size_t n = xsize - x;
+      StoreRGBAFromFloat(d, r, g, b, a, rgba_, std::min(n, Lanes(d)), n,
+                         out + bytes * x);
+    }
+    msan::PoisonMemory(row0 + xsize, sizeof(float) * (xsize_v - xsize));
+    msan::PoisonMemory(row1 + xsize, sizeof(float) * (xsize_v - xsize));
+    msan::PoisonMemory(row2 + xsize, sizeof(float) * (xsize_v - xsize));
+    if (row_a) {
+      msan::PoisonMemory(row_a + xsize, sizeof(float) * (xsize_v - xsize));
+    }
+  }
+
   OpsinParams opsin_params_;
   Op op_;
+  uint8_t* rgb_;
+  size_t stride_;
+  size_t height_;
+  bool rgba_;
+  bool has_alpha_;
+  size_t alpha_c_;
 };
 
-template <typename Op>
-std::unique_ptr<XYBStage<Op>> MakeXYBStage(const OpsinParams& opsin_params,
-                                           Op&& op) {
-  return jxl::make_unique<XYBStage<Op>>(opsin_params, std::forward<Op>(op));
-}
+struct MakeXYBStage {
+  template <typename Op>
+  std::unique_ptr<RenderPipelineStage> operator()(Op&& op) const {
+    return jxl::make_unique<XYBStage<Op>>(opsin_params, std::forward<Op>(op));
+  }
+  const OpsinParams& opsin_params;
+};
 
-std::unique_ptr<RenderPipelineStage> GetXYBStage(
-    const OutputEncodingInfo& output_encoding_info) {
-  if (output_encoding_info.color_encoding.tf.IsLinear()) {
-    return MakeXYBStage(output_encoding_info.opsin_params,
-                        MakePerChannelOp(OpLinear()));
-  } else if (output_encoding_info.color_encoding.tf.IsSRGB()) {
-    return MakeXYBStage(output_encoding_info.opsin_params,
-                        MakePerChannelOp(OpRgb()));
-  } else if (output_encoding_info.color_encoding.tf.IsPQ()) {
-    return MakeXYBStage(output_encoding_info.opsin_params,
-                        MakePerChannelOp(OpPq()));
-  } else if (output_encoding_info.color_encoding.tf.IsHLG()) {
-    return MakeXYBStage(output_encoding_info.opsin_params,
-                        OpHlg(output_encoding_info.luminances,
-                              output_encoding_info.intensity_target));
-  } else if (output_encoding_info.color_encoding.tf.Is709()) {
-    return MakeXYBStage(output_encoding_info.opsin_params,
-                        MakePerChannelOp(Op709()));
-  } else if (output_encoding_info.color_encoding.tf.IsGamma() ||
-             output_encoding_info.color_encoding.tf.IsDCI()) {
-    return MakeXYBStage(
-        output_encoding_info.opsin_params,
-        MakePerChannelOp(OpGamma{output_encoding_info.inverse_gamma}));
+struct MakeXYBWriteToU8Stage {
+  template <typename Op>
+  std::unique_ptr<RenderPipelineStage> operator()(Op&& op) const {
+    return jxl::make_unique<XYBWriteToU8Stage<Op>>(
+        opsin_params, std::forward<Op>(op), rgb, stride, height, rgba,
+        has_alpha, alpha_c);
+  }
+  const OpsinParams& opsin_params;
+  uint8_t* rgb;
+  size_t stride;
+  size_t height;
+  bool rgba;
+  bool has_alpha;
+  size_t alpha_c;
+};
+
+// Calls make with the op converting linear values to the transfer function of
+// the output encoding, with intensity_target nits as the luminance of the
+// linear 1 for the HLG inverse OOTF. If the output is quantized to integers,
+// the sRGB, PQ, HLG and BT.709 curves are interpolated in tables.
+template <typename MakeStage>
+std::unique_ptr<RenderPipelineStage> MakeStageForTransferFunction(
+    const OutputEncodingInfo& output_encoding_info, float intensity_target,
+    bool integer_output, const MakeStage& make) {
+  const CustomTransferFunction& tf = output_encoding_info.color_encoding.tf;
+  if (tf.IsLinear()) {
+    return make(MakePerChannelOp(OpLinear()));
+  } else if (tf.IsSRGB()) {
+    if (integer_output) {
+      return make(MakePerChannelOp(OpLut(GetTransferFunctionLut<TF_SRGB>())));
+    }
+    return make(MakePerChannelOp(OpRgb()));
+  } else if (tf.IsPQ()) {
+    if (integer_output) {
+      return make(MakePerChannelOp(OpLut(GetTransferFunctionLut<TF_PQ>())));
+    }
+    return make(MakePerChannelOp(OpPq()));
+  } else if (tf.IsHLG()) {
+    return make(OpHlg(output_encoding_info.luminances, intensity_target,
+                      integer_output ? GetTransferFunctionLut<TF_HLG>()
+                                     : nullptr));
+  } else if (tf.Is709()) {
+    if (integer_output) {
+      return make(MakePerChannelOp(OpLut(GetTransferFunctionLut<TF_709>())));
+    }
+    return make(MakePerChannelOp(Op709()));
+  } else if (tf.IsGamma() || tf.IsDCI()) {
+    return make(MakePerChannelOp(OpGamma{output_encoding_info.inverse_gamma}));
   } else {
     // This is a programming error.
     JXL_ABORT("Invalid target encoding");
   }
 }
 
+// Wraps the ops given to MakeStage in a ToneMappedOp.
+template <typename MakeStage>
+struct MakeToneMappedStage {
+  template <typename Op>
+  std::unique_ptr<RenderPipelineStage> operator()(Op&& op) const {
+    using PlainOp = typename std::decay<Op>::type;
+    return make(ToneMappedOp<PlainOp>{tone_mapper, std::forward<Op>(op)});
+  }
+  const MakeStage& make;
+  const Rec2390ToneMapper& tone_mapper;
+};
+
+// Same as MakeStageForTransferFunction, and tone maps the linear values first
+// if a lower intensity target is desired. This is done in the same pass as
+// the conversion from XYB, instead of as a separate stage.
+template <typename MakeStage>
+std::unique_ptr<RenderPipelineStage> MakeStageForOutputEncoding(
+    const OutputEncodingInfo& output_encoding_info, bool integer_output,
+    const MakeStage& make) {
+  const float intensity_target = output_encoding_info.intensity_target;
+  if (!output_encoding_info.ToneMapsXYB()) {
+    return MakeStageForTransferFunction(output_encoding_info, intensity_target,
+                                        integer_output, make);
+  }
+  // The linear 1 is intensity_target nits before the tone mapping. After it,
+  // it is the desired intensity target, except for PQ whose values are
+  // absolute.
+  const float output_nits = output_encoding_info.color_encoding.tf.IsPQ()
+                                ? intensity_target
+                                : output_encoding_info.desired_intensity_target;
+  const Rec2390ToneMapper tone_mapper(
+      {output_encoding_info.orig_min_nits,
+       output_encoding_info.orig_intensity_target},
+      {0.0f, output_encoding_info.desired_intensity_target},
+      output_encoding_info.luminances, /*input_nits=*/intensity_target,
+      output_nits);
+  return MakeStageForTransferFunction(
+      output_encoding_info, output_nits, integer_output,
+      MakeToneMappedStage<MakeStage>{make, tone_mapper});
+}
+
+std::unique_ptr<RenderPipelineStage> GetXYBStage(
+    const OutputEncodingInfo& output_encoding_info, bool integer_output) {
+  return MakeStageForOutputEncoding(
+      output_encoding_info, integer_output,
+      MakeXYBStage{output_encoding_info.opsin_params});
+}
+
+std::unique_ptr<RenderPipelineStage> GetXYBWriteToU8Stage(
+    const OutputEncodingInfo& output_encoding_info, uint8_t* rgb,
+    size_t stride, size_t height, bool rgba, bool has_alpha, size_t alpha_c) {
+  return MakeStageForOutputEncoding(
+      output_encoding_info, /*integer_output=*/true,
+      MakeXYBWriteToU8Stage{output_encoding_info.opsin_params, rgb, stride,
+                            height, rgba, has_alpha, alpha_c});
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -209,8 +481,18 @@ namespace jxl {
 HWY_EXPORT(GetXYBStage);
 
 std::unique_ptr<RenderPipelineStage> GetXYBStage(
-    const OutputEncodingInfo& output_encoding_info) {
-  return HWY_DYNAMIC_DISPATCH(GetXYBStage)(output_encoding_info);
+    const OutputEncodingInfo& output_encoding_info, bool integer_output) {
+  return HWY_DYNAMIC_DISPATCH(GetXYBStage)(output_encoding_info,
+                                           integer_output);
+}
+
+HWY_EXPORT(GetXYBWriteToU8Stage);
+
+std::unique_ptr<RenderPipelineStage> GetXYBWriteToU8Stage(
+    const OutputEncodingInfo& output_encoding_info, uint8_t* rgb,
+    size_t stride, size_t height, bool rgba, bool has_alpha, size_t alpha_c) {
+  return HWY_DYNAMIC_DISPATCH(GetXYBWriteToU8Stage)(
+      output_encoding_info, rgb, stride, height, rgba, has_alpha, alpha_c);
 }
 
 namespace {
@@ -18,9 +18,19 @@
 
 namespace jxl {
 
-// Converts the color channels from XYB to the specified output encoding.
+// Converts the color channels from XYB to the specified output encoding. If
+// integer_output, the values are only used to write integers, which allows
+// cheaper approximations of the transfer function.
 std::unique_ptr<RenderPipelineStage> GetXYBStage(
-    const OutputEncodingInfo& output_encoding_info);
+    const OutputEncodingInfo& output_encoding_info,
+    bool integer_output = false);
+
+// Gets a stage that converts the color channels from XYB to the specified
+// output encoding and writes them to a uint8 buffer in one pass. Equivalent to
+// GetXYBStage followed by GetWriteToU8Stage.
+std::unique_ptr<RenderPipelineStage> GetXYBWriteToU8Stage(
+    const OutputEncodingInfo& output_encoding_info, uint8_t* rgb,
+    size_t stride, size_t height, bool rgba, bool has_alpha, size_t alpha_c);
 
 // Gets a stage to convert with fixed point arithmetic from XYB to sRGB8 and
 // write to a uint8 buffer.
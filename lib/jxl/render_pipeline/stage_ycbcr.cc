@@ -10,10 +10,28 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/render_pipeline/stage_write-inl.h"
+#include "lib/jxl/sanitizers.h"
+
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
 
+// Full-range BT.601 as defined by JFIF Clause 7:
+// https://www.itu.int/rec/T-REC-T.871-201105-I/en
+template <typename D, typename V>
+void YCbCrToRGB(D d, V cb, V y, V cr, V* r, V* g, V* b) {
+  const auto c128 = Set(d, 128.0f / 255);
+  const auto crcr = Set(d, 1.402f);
+  const auto cgcb = Set(d, -0.114f * 1.772f / 0.587f);
+  const auto cgcr = Set(d, -0.299f * 1.402f / 0.587f);
+  const auto cbcb = Set(d, 1.772f);
+  const auto y_vec = y + c128;
+  *r = crcr * cr + y_vec;
+  *g = cgcr * cr + cgcb * cb + y_vec;
+  *b = cbcb * cb + y_vec;
+}
+
 class kYCbCrStage : public RenderPipelineStage {
  public:
   kYCbCrStage() : RenderPipelineStage(RenderPipelineStage::Settings()) {}
@@ -22,45 +40,148 @@ class kYCbCrStage : public RenderPipelineStage {
                   size_t xextra, size_t xsize, size_t xpos, size_t ypos,
                   size_t thread_id) const final {
     PROFILER_ZONE("UndoYCbCr");
+    UndoYCbCr(GetInputRow(input_rows, 0, 0), GetInputRow(input_rows, 1, 0),
+              GetInputRow(input_rows, 2, 0), xsize);
+  }
+
+  bool ProcessesMultipleRows() const final { return true; }
 
+  void ProcessRows(const RowInfo& rows, size_t num_rows, size_t xsize,
+                   size_t xpos, size_t ypos, size_t thread_id) const final {
+    PROFILER_ZONE("UndoYCbCr");
+    for (size_t r = 0; r < num_rows; r++) {
+      UndoYCbCr(GetRowOfBatch(rows, 0, r), GetRowOfBatch(rows, 1, r),
+                GetRowOfBatch(rows, 2, r), xsize);
+    }
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return c < 3 ? RenderPipelineChannelMode::kInPlace
+                 : RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "YCbCr"; }
+
+ private:
+  static void UndoYCbCr(float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
+                        float* JXL_RESTRICT row2, size_t xsize) {
     const HWY_FULL(float) df;
 
-    // Full-range BT.601 as defined by JFIF Clause 7:
-    // https://www.itu.int/rec/T-REC-T.871-201105-I/en
-    const auto c128 = Set(df, 128.0f / 255);
-    const auto crcr = Set(df, 1.402f);
-    const auto cgcb = Set(df, -0.114f * 1.772f / 0.587f);
-    const auto cgcr = Set(df, -0.299f * 1.402f / 0.587f);
-    const auto cbcb = Set(df, 1.772f);
-
-    float* JXL_RESTRICT row0 = GetInputRow(input_rows, 0, 0);
-    float* JXL_RESTRICT row1 = GetInputRow(input_rows, 1, 0);
-    float* JXL_RESTRICT row2 = GetInputRow(input_rows, 2, 0);
     for (size_t x = 0; x < xsize; x += Lanes(df)) {
-      const auto y_vec = Load(df, row1 + x) + c128;
-      const auto cb_vec = Load(df, row0 + x);
-      const auto cr_vec = Load(df, row2 + x);
-      const auto r_vec = crcr * cr_vec + y_vec;
-      const auto g_vec = cgcr * cr_vec + cgcb * cb_vec + y_vec;
-      const auto b_vec = cbcb * cb_vec + y_vec;
+      auto r_vec = Undefined(df);
+      auto g_vec = Undefined(df);
+      auto b_vec = Undefined(df);
+      YCbCrToRGB(df, Load(df, row0 + x), Load(df, row1 + x),
+                 Load(df, row2 + x), &r_vec, &g_vec, &b_vec);
       Store(r_vec, df, row0 + x);
       Store(g_vec, df, row1 + x);
       Store(b_vec, df, row2 + x);
     }
   }
+};
+
+// Same as kYCbCrStage followed by the stage writing to a uint8 buffer, without
+// storing the converted float values in between.
+class YCbCrWriteToU8Stage : public RenderPipelineStage {
+ public:
+  YCbCrWriteToU8Stage(uint8_t* rgb, size_t stride, size_t height, bool rgba,
+                      bool has_alpha, size_t alpha_c)
+      : RenderPipelineStage(RenderPipelineStage::Settings()),
+        rgb_(rgb),
+        stride_(stride),
+        height_(height),
+        rgba_(rgba),
+        has_alpha_(has_alpha),
+        alpha_c_(alpha_c) {}
+
+  void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                  size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                  size_t thread_id) const final {
+    PROFILER_ZONE("UndoYCbCrWriteToU8");
+    JXL_DASSERT(xextra == 0);
+    WriteRow(GetInputRow(input_rows, 0, 0), GetInputRow(input_rows, 1, 0),
+             GetInputRow(input_rows, 2, 0),
+             has_alpha_ ? GetInputRow(input_rows, alpha_c_, 0) : nullptr,
+             xsize, xpos, ypos);
+  }
+
+  bool ProcessesMultipleRows() const final { return true; }
+
+  void ProcessRows(const RowInfo& rows, size_t num_rows, size_t xsize,
+                   size_t xpos, size_t ypos, size_t thread_id) const final {
+    PROFILER_ZONE("UndoYCbCrWriteToU8");
+    for (size_t r = 0; r < num_rows; r++) {
+      WriteRow(GetRowOfBatch(rows, 0, r), GetRowOfBatch(rows, 1, r),
+               GetRowOfBatch(rows, 2, r),
+               has_alpha_ ? GetRowOfBatch(rows, alpha_c_, r) : nullptr, xsize,
+               xpos, ypos + r);
+    }
+  }
 
   RenderPipelineChannelMode GetChannelMode(size_t c) const final {
-    return c < 3 ? RenderPipelineChannelMode::kInPlace
-                 : RenderPipelineChannelMode::kIgnored;
+    return c < 3 || (has_alpha_ && c == alpha_c_)
+               ? RenderPipelineChannelMode::kInput
+               : RenderPipelineChannelMode::kIgnored;
   }
 
-  const char* GetName() const override { return "YCbCr"; }
+  const char* GetName() const override { return "YCbCrWriteToU8"; }
+
+ private:
+  void WriteRow(const float* JXL_RESTRICT row0, const float* JXL_RESTRICT row1,
+                const float* JXL_RESTRICT row2,
+                const float* JXL_RESTRICT row_a, size_t xsize, size_t xpos,
+                size_t ypos) const {
+    if (ypos >= height_) return;
+    const size_t bytes = rgba_ ? 4 : 3;
+    uint8_t* JXL_RESTRICT out = rgb_ + ypos * stride_ + bytes * xpos;
+    // StoreRGBA handles at most 16 lanes.
+    using D = HWY_CAPPED(float, 16);
+    const D d;
+    const size_t xsize_v = RoundUpTo(xsize, Lanes(d));
+    msan::UnpoisonMemory(row0 + xsize, sizeof(float) * (xsize_v - xsize));
+    msan::UnpoisonMemory(row1 + xsize, sizeof(float) * (xsize_v - xsize));
+    msan::UnpoisonMemory(row2 + xsize, sizeof(float) * (xsize_v - xsize));
+    if (row_a) {
+      msan::UnpoisonMemory(row_a + xsize, sizeof(float) * (xsize_v - xsize));
+    }
+    for (size_t x = 0; x < xsize_v; x += Lanes(d)) {
+      auto r = Undefined(d);
+      auto g = Undefined(d);
+      auto b = Undefined(d);
+      YCbCrToRGB(d, Load(d, row0 + x), Load(d, row1 + x), Load(d, row2 + x),
+                 &r, &g, &b);
+      const auto a = row_a ? Load(d, row_a + x) : Set(d, 1.0f);
+      const size_t n = xsize - x;
+      StoreRGBAFromFloat(d, r, g, b, a, rgba_, std::min(n, Lanes(d)), n,
+                         out + bytes * x);
+    }
+    msan::PoisonMemory(row0 + xsize, sizeof(float) * (xsize_v - xsize));
+    msan::PoisonMemory(row1 + xsize, sizeof(float) * (xsize_v - xsize));
+    msan::PoisonMemory(row2 + xsize, sizeof(float) * (xsize_v - xsize));
+    if (row_a) {
+      msan::PoisonMemory(row_a + xsize, sizeof(float) * (xsize_v - xsize));
+    }
+  }
+
+  uint8_t* rgb_;
+  size_t stride_;
+  size_t height_;
+  bool rgba_;
+  bool has_alpha_;
+  size_t alpha_c_;
 };
 
 std::unique_ptr<RenderPipelineStage> GetYCbCrStage() {
   return jxl::make_unique<kYCbCrStage>();
 }
 
+std::unique_ptr<RenderPipelineStage> GetYCbCrWriteToU8Stage(
+    uint8_t* rgb, size_t stride, size_t height, bool rgba, bool has_alpha,
+    size_t alpha_c) {
+  return jxl::make_unique<YCbCrWriteToU8Stage>(rgb, stride, height, rgba,
+                                               has_alpha, alpha_c);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -75,5 +196,14 @@ std::unique_ptr<RenderPipelineStage> GetYCbCrStage() {
   return HWY_DYNAMIC_DISPATCH(GetYCbCrStage)();
 }
 
+HWY_EXPORT(GetYCbCrWriteToU8Stage);
+
+std::unique_ptr<RenderPipelineStage> GetYCbCrWriteToU8Stage(
+    uint8_t* rgb, size_t stride, size_t height, bool rgba, bool has_alpha,
+    size_t alpha_c) {
+  return HWY_DYNAMIC_DISPATCH(GetYCbCrWriteToU8Stage)(rgb, stride, height, rgba,
+                                                      has_alpha, alpha_c);
+}
+
 }  // namespace jxl
 #endif
@@ -20,6 +20,13 @@ namespace jxl {
 
 // Converts the color channels from YCbCr to RGB.
 std::unique_ptr<RenderPipelineStage> GetYCbCrStage();
+
+// Gets a stage that converts the color channels from YCbCr and writes them to
+// a uint8 buffer in one pass. Equivalent to GetYCbCrStage followed by
+// GetWriteToU8Stage without premultiplication.
+std::unique_ptr<RenderPipelineStage> GetYCbCrWriteToU8Stage(
+    uint8_t* rgb, size_t stride, size_t height, bool rgba, bool has_alpha,
+    size_t alpha_c);
 }  // namespace jxl
 
 #endif  // LIB_JXL_RENDER_PIPELINE_STAGE_YCBCR_H_
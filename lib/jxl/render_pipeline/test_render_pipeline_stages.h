@@ -98,4 +98,20 @@ class Check0FinalStage : public RenderPipelineStage {
   const char* GetName() const override { return "TEST::Check0FinalStage"; }
 };
 
+// Only reads its input, to end pipelines whose stages of interest are not
+// final, e.g. in benchmarks.
+class DiscardFinalStage : public RenderPipelineStage {
+ public:
+  DiscardFinalStage() : RenderPipelineStage(RenderPipelineStage::Settings()) {}
+
+  void ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                  size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                  size_t thread_id) const final {}
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return RenderPipelineChannelMode::kInput;
+  }
+  const char* GetName() const override { return "TEST::DiscardFinalStage"; }
+};
+
 }  // namespace jxl
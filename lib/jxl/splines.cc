@@ -83,11 +83,10 @@ void DrawSegment(DF df, const SplineSegment& segment, const bool add,
 
 void DrawSegment(const SplineSegment& segment, const bool add, const size_t y,
                  const ssize_t x0, ssize_t x1, float* JXL_RESTRICT rows[3]) {
-  ssize_t x =
-      std::max<ssize_t>(x0, segment.center_x - segment.maximum_distance + 0.5f);
+  const float half_width = segment.HalfWidthAtRow(y);
+  ssize_t x = std::max<ssize_t>(x0, segment.center_x - half_width + 0.5f);
   // one-past-the-end
-  x1 =
-      std::min<ssize_t>(x1, segment.center_x + segment.maximum_distance + 1.5f);
+  x1 = std::min<ssize_t>(x1, segment.center_x + half_width + 1.5f);
   HWY_FULL(float) df;
   for (; x + static_cast<ssize_t>(Lanes(df)) <= x1; x += Lanes(df)) {
     DrawSegment(df, segment, add, y, x, rows);
@@ -160,15 +159,29 @@ void DrawSegments(float* JXL_RESTRICT row_x, float* JXL_RESTRICT row_y,
                   float* JXL_RESTRICT row_b, const Rect& image_rect,
                   const bool add, const SplineSegment* segments,
                   const size_t* segment_indices,
-                  const size_t* segment_y_start) {
+                  const size_t* segment_cell_start,
+                  const size_t num_cells_x, const size_t cell_dim) {
   JXL_ASSERT(image_rect.ysize() == 1);
   float* JXL_RESTRICT rows[3] = {row_x - image_rect.x0(),
                                  row_y - image_rect.x0(),
                                  row_b - image_rect.x0()};
-  size_t y = image_rect.y0();
-  for (size_t i = segment_y_start[y]; i < segment_y_start[y + 1]; i++) {
-    DrawSegment(segments[segment_indices[i]], add, y, image_rect.x0(),
-                image_rect.x0() + image_rect.xsize(), rows);
+  const size_t y = image_rect.y0();
+  const size_t x0 = image_rect.x0();
+  const size_t x1 = image_rect.x0() + image_rect.xsize();
+  // Each pixel is drawn by the segments of the cell it belongs to, in the
+  // same order as without the cells. The last cell also covers any pixel to
+  // the right of the image.
+  for (size_t cx = std::min(x0 / cell_dim, num_cells_x - 1);
+       cx < num_cells_x && cx * cell_dim < x1; cx++) {
+    const size_t cell_x0 = std::max(x0, cx * cell_dim);
+    const size_t cell_x1 =
+        cx + 1 == num_cells_x ? x1 : std::min(x1, (cx + 1) * cell_dim);
+    const size_t cell = y * num_cells_x + cx;
+    for (size_t i = segment_cell_start[cell]; i < segment_cell_start[cell + 1];
+         i++) {
+      DrawSegment(segments[segment_indices[i]], add, y, cell_x0, cell_x1,
+                  rows);
+    }
   }
 }
 
@@ -521,7 +534,7 @@ void Splines::Clear() {
   starting_points_.clear();
   segments_.clear();
   segment_indices_.clear();
-  segment_y_start_.clear();
+  segment_cell_start_.clear();
 }
 
 Status Splines::Decode(jxl::BitReader* br, const size_t num_pixels) {
@@ -582,7 +595,7 @@ Status Splines::InitializeDrawCache(const size_t image_xsize,
   // boundaries.
   segments_.clear();
   segment_indices_.clear();
-  segment_y_start_.clear();
+  segment_cell_start_.clear();
   std::vector<std::pair<size_t, size_t>> segments_by_y;
   Spline spline;
   // TODO(eustas): not in the spec; limit spline pixels with image area.
@@ -629,19 +642,45 @@ Status Splines::InitializeDrawCache(const size_t image_xsize,
       return JXL_FAILURE("Too many pixels covered with splines");
     }
   }
-  // TODO(eustas): consider linear sorting here.
-  std::sort(segments_by_y.begin(), segments_by_y.end());
-  segment_indices_.resize(segments_by_y.size());
-  segment_y_start_.resize(image_ysize + 1);
-  for (size_t i = 0; i < segments_by_y.size(); i++) {
-    segment_indices_[i] = segments_by_y[i].second;
-    size_t y = segments_by_y[i].first;
-    if (y < image_ysize) {
-      segment_y_start_[y + 1]++;
+  // Each segment is listed in the cells of all the columns it may draw to.
+  // The number of cells is limited so that the index size stays proportional
+  // to the number of segment rows also for very wide images.
+  num_cells_x_ = std::max<size_t>(
+      1, std::min(DivCeil(image_xsize, kMinSplineCellDim),
+                  1 + segments_by_y.size() / std::max<size_t>(1, image_ysize)));
+  cell_dim_ = std::max<size_t>(1, DivCeil(image_xsize, num_cells_x_));
+  std::vector<std::pair<size_t, size_t>> segments_by_cell;
+  segments_by_cell.reserve(segments_by_y.size());
+  for (const auto& y_segment : segments_by_y) {
+    const size_t y = y_segment.first;
+    if (y >= image_ysize) continue;
+    const SplineSegment& segment = segments_[y_segment.second];
+    // Same range as in DrawSegment.
+    const float half_width = segment.HalfWidthAtRow(y);
+    const ssize_t x0 =
+        std::max<ssize_t>(0, segment.center_x - half_width + 0.5f);
+    // one-past-the-end
+    const ssize_t x1 = segment.center_x + half_width + 1.5f;
+    if (x1 <= x0) continue;
+    const size_t cx0 = std::min<size_t>(x0 / cell_dim_, num_cells_x_ - 1);
+    const size_t cx1 =
+        std::min<size_t>((x1 - 1) / cell_dim_, num_cells_x_ - 1);
+    for (size_t cx = cx0; cx <= cx1; cx++) {
+      segments_by_cell.emplace_back(y * num_cells_x_ + cx, y_segment.second);
     }
   }
-  for (size_t y = 0; y < image_ysize; y++) {
-    segment_y_start_[y + 1] += segment_y_start_[y];
+  std::vector<std::pair<size_t, size_t>>().swap(segments_by_y);
+  // TODO(eustas): consider linear sorting here.
+  std::sort(segments_by_cell.begin(), segments_by_cell.end());
+  const size_t num_cells = image_ysize * num_cells_x_;
+  segment_indices_.resize(segments_by_cell.size());
+  segment_cell_start_.resize(num_cells + 1);
+  for (size_t i = 0; i < segments_by_cell.size(); i++) {
+    segment_indices_[i] = segments_by_cell[i].second;
+    segment_cell_start_[segments_by_cell[i].first + 1]++;
+  }
+  for (size_t cell = 0; cell < num_cells; cell++) {
+    segment_cell_start_[cell + 1] += segment_cell_start_[cell];
   }
   return true;
 }
@@ -655,7 +694,8 @@ void Splines::ApplyToRow(float* JXL_RESTRICT row_x, float* JXL_RESTRICT row_y,
   for (size_t iy = 0; iy < image_row.ysize(); iy++) {
     HWY_DYNAMIC_DISPATCH(DrawSegments)
     (row_x, row_y, row_b, image_row.Line(iy), add, segments_.data(),
-     segment_indices_.data(), segment_y_start_.data());
+     segment_indices_.data(), segment_cell_start_.data(), num_cells_x_,
+     cell_dim_);
   }
 }
 
@@ -9,6 +9,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <cmath>
 #include <utility>
 #include <vector>
 
@@ -26,6 +28,10 @@ namespace jxl {
 
 static constexpr float kDesiredRenderingDistance = 1.f;
 
+// Minimum width of the columns of cells in which spline segments are indexed,
+// so that drawing a row segment only visits the spline segments close to it.
+static constexpr size_t kMinSplineCellDim = 256;
+
 enum SplineEntropyContexts : size_t {
   kQuantizationAdjustmentContext = 0,
   kStartingPositionContext,
@@ -89,6 +95,14 @@ struct SplineSegment {
   float inv_sigma;
   float sigma_over_4_times_intensity;
   float color[3];
+
+  // Half of the width of the disc of radius maximum_distance at row `y`,
+  // outside of which the segment is not drawn.
+  float HalfWidthAtRow(const size_t y) const {
+    const float dy = static_cast<float>(y) - center_y;
+    return std::sqrt(
+        std::max(0.0f, maximum_distance * maximum_distance - dy * dy));
+  }
 };
 
 class Splines {
@@ -140,8 +154,14 @@ class Splines {
   std::vector<QuantizedSpline> splines_;
   std::vector<Spline::Point> starting_points_;
   std::vector<SplineSegment> segments_;
+  // Indices of the segments to draw, sorted by row and cell column. Those of
+  // the cell at column cx of row y are in [segment_cell_start_[cell],
+  // segment_cell_start_[cell + 1]), with cell = y * num_cells_x_ + cx. Cells
+  // are cell_dim_ pixels wide.
   std::vector<size_t> segment_indices_;
-  std::vector<size_t> segment_y_start_;
+  std::vector<size_t> segment_cell_start_;
+  size_t num_cells_x_ = 0;
+  size_t cell_dim_ = kMinSplineCellDim;
 };
 
 }  // namespace jxl
@@ -4,6 +4,7 @@
 // license that can be found in the LICENSE file.
 
 #include "benchmark/benchmark.h"
+#include "lib/jxl/base/random.h"
 #include "lib/jxl/splines.h"
 
 namespace jxl {
@@ -46,7 +47,51 @@ void BM_Splines(benchmark::State& state) {
   state.SetItemsProcessed(n * state.iterations());
 }
 
+// Many thin strokes of a few control points each, scattered over a larger
+// image, as drawn by an encoder for hair or grass. Most segments are far
+// from any given pixel.
+void BM_ManySplines(benchmark::State& state) {
+  const size_t num_splines = state.range();
+  constexpr size_t kImageDim = 1024;
+
+  Rng rng(0);
+  std::vector<QuantizedSpline> quantized_splines;
+  std::vector<Spline::Point> starting_points;
+  for (size_t i = 0; i < num_splines; ++i) {
+    Spline spline{};
+    float x = rng.UniformF(0, kImageDim);
+    float y = rng.UniformF(0, kImageDim);
+    const size_t num_points = 3 + rng.UniformU(0, 4);
+    for (size_t p = 0; p < num_points; ++p) {
+      spline.control_points.push_back({x, y});
+      x += rng.UniformF(-40, 40);
+      y += rng.UniformF(8, 40);
+    }
+    for (size_t c = 0; c < 3; ++c) {
+      spline.color_dct[c][0] = rng.UniformF(-0.5f, 0.5f);
+      spline.color_dct[c][1] = rng.UniformF(-0.1f, 0.1f);
+    }
+    spline.sigma_dct[0] = rng.UniformF(0.5f, 2.0f);
+    quantized_splines.emplace_back(spline, kQuantizationAdjustment, kYToX,
+                                   kYToB);
+    starting_points.push_back(spline.control_points.front());
+  }
+  Splines splines(kQuantizationAdjustment, std::move(quantized_splines),
+                  std::move(starting_points));
+
+  Image3F drawing_area(kImageDim, kImageDim);
+  ZeroFillImage(&drawing_area);
+  for (auto _ : state) {
+    JXL_CHECK(splines.InitializeDrawCache(drawing_area.xsize(),
+                                          drawing_area.ysize(), *cmap));
+    splines.AddTo(&drawing_area, Rect(drawing_area), Rect(drawing_area));
+  }
+
+  state.SetItemsProcessed(num_splines * state.iterations());
+}
+
 BENCHMARK(BM_Splines)->Range(1, 1 << 10);
+BENCHMARK(BM_ManySplines)->Range(64, 4096);
 
 }  // namespace
 }  // namespace jxl
@@ -0,0 +1,108 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "jxl/ssimulacra.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "jxl/ssimulacra_cxx.h"
+#include "jxl/thread_parallel_runner.h"
+#include "jxl/thread_parallel_runner_cxx.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/test_utils.h"
+
+namespace {
+
+// Big endian uint16 samples: perturbs the high bytes by at most `amplitude`.
+std::vector<uint8_t> AddNoise(const std::vector<uint8_t>& pixels,
+                              int amplitude) {
+  std::vector<uint8_t> noisy = pixels;
+  jxl::Rng rng(0);
+  for (size_t i = 0; i < noisy.size(); i += 2) {
+    const int value = noisy[i] - amplitude +
+                      static_cast<int>(rng.UniformU(0, 2 * amplitude + 1));
+    noisy[i] = std::min(std::max(value, 0), 255);
+  }
+  return noisy;
+}
+
+float Score(const JxlSsimulacraApi* api, uint32_t xsize, uint32_t ysize,
+            const std::vector<uint8_t>& orig_pixels,
+            const std::vector<uint8_t>& dist_pixels) {
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  float score = -1.0f;
+  EXPECT_TRUE(JxlSsimulacraCompute(api, xsize, ysize, &pixel_format,
+                                   orig_pixels.data(), orig_pixels.size(),
+                                   &pixel_format, dist_pixels.data(),
+                                   dist_pixels.size(), &score));
+  return score;
+}
+
+TEST(SsimulacraTest, Lossless) {
+  uint32_t xsize = 171;
+  uint32_t ysize = 219;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+
+  JxlSsimulacraApiPtr api(JxlSsimulacraApiCreate(nullptr));
+  EXPECT_EQ(0.0f, Score(api.get(), xsize, ysize, pixels, pixels));
+  JxlSsimulacraApiSetSimple(api.get(), JXL_TRUE);
+  EXPECT_EQ(0.0f, Score(api.get(), xsize, ysize, pixels, pixels));
+}
+
+TEST(SsimulacraTest, Distorted) {
+  uint32_t xsize = 171;
+  uint32_t ysize = 219;
+  std::vector<uint8_t> orig_pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+
+  JxlSsimulacraApiPtr api(JxlSsimulacraApiCreate(nullptr));
+  const float score1 =
+      Score(api.get(), xsize, ysize, orig_pixels, AddNoise(orig_pixels, 1));
+  const float score8 =
+      Score(api.get(), xsize, ysize, orig_pixels, AddNoise(orig_pixels, 8));
+  EXPECT_GT(score1, 0.0f);
+  EXPECT_GT(score8, score1);
+  EXPECT_LE(score8, 1.0f);
+
+  JxlSsimulacraApiSetSimple(api.get(), JXL_TRUE);
+  EXPECT_GT(
+      Score(api.get(), xsize, ysize, orig_pixels, AddNoise(orig_pixels, 8)),
+      0.0f);
+}
+
+// The row sums are combined in order, so the score does not depend on the
+// threads.
+TEST(SsimulacraTest, ParallelRunner) {
+  uint32_t xsize = 171;
+  uint32_t ysize = 219;
+  std::vector<uint8_t> orig_pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  std::vector<uint8_t> dist_pixels = AddNoise(orig_pixels, 4);
+
+  JxlSsimulacraApiPtr api(JxlSsimulacraApiCreate(nullptr));
+  const float score = Score(api.get(), xsize, ysize, orig_pixels, dist_pixels);
+
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+  JxlSsimulacraApiSetParallelRunner(api.get(), JxlThreadParallelRunner,
+                                    runner.get());
+  EXPECT_EQ(score, Score(api.get(), xsize, ysize, orig_pixels, dist_pixels));
+}
+
+TEST(SsimulacraTest, TooSmall) {
+  uint32_t xsize = 7;
+  uint32_t ysize = 16;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  JxlSsimulacraApiPtr api(JxlSsimulacraApiCreate(nullptr));
+  float score;
+  EXPECT_FALSE(JxlSsimulacraCompute(api.get(), xsize, ysize, &pixel_format,
+                                    pixels.data(), pixels.size(), &pixel_format,
+                                    pixels.data(), pixels.size(), &score));
+}
+
+}  // namespace
@@ -0,0 +1,137 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <memory>
+
+#include "jxl/parallel_runner.h"
+#include "jxl/ssimulacra.h"
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/common.h"
+#include "lib/jxl/enc_color_management.h"
+#include "lib/jxl/enc_external_image.h"
+#include "lib/jxl/enc_ssimulacra.h"
+#include "lib/jxl/image_bundle.h"
+#include "lib/jxl/memory_manager_internal.h"
+
+namespace {
+
+void SetMetadataFromPixelFormat(const JxlPixelFormat* pixel_format,
+                                jxl::ImageMetadata* metadata) {
+  uint32_t potential_alpha_bits = 0;
+  switch (pixel_format->data_type) {
+    case JXL_TYPE_FLOAT:
+      metadata->SetFloat32Samples();
+      potential_alpha_bits = 16;
+      break;
+    case JXL_TYPE_FLOAT16:
+      metadata->SetFloat16Samples();
+      potential_alpha_bits = 16;
+      break;
+    case JXL_TYPE_UINT16:
+      metadata->SetUintSamples(16);
+      potential_alpha_bits = 16;
+      break;
+    case JXL_TYPE_UINT8:
+      metadata->SetUintSamples(8);
+      potential_alpha_bits = 8;
+      break;
+    default:
+      JXL_ABORT("Unhandled JxlDataType");
+  }
+  if (pixel_format->num_channels == 2 || pixel_format->num_channels == 4) {
+    metadata->SetAlphaBits(potential_alpha_bits);
+  }
+}
+
+// Float pixels are linear sRGB, integer ones sRGB, as in the butteraugli API.
+jxl::Status ReadImage(const JxlPixelFormat* pixel_format, uint32_t xsize,
+                      uint32_t ysize, const void* buffer, size_t size,
+                      jxl::ThreadPool* pool, jxl::ImageBundle* ib) {
+  const bool is_gray = pixel_format->num_channels < 3;
+  const jxl::ColorEncoding c_current =
+      pixel_format->data_type == JXL_TYPE_FLOAT
+          ? jxl::ColorEncoding::LinearSRGB(is_gray)
+          : jxl::ColorEncoding::SRGB(is_gray);
+  return jxl::BufferToImageBundle(*pixel_format, xsize, ysize, buffer, size,
+                                  pool, c_current, ib);
+}
+
+}  // namespace
+
+struct JxlSsimulacraApiStruct {
+  // See jxl::ComputeSsimulacra.
+  bool simple = false;
+
+  JxlCmsInterface cms;
+  JxlMemoryManager memory_manager;
+  std::unique_ptr<jxl::ThreadPool> thread_pool{nullptr};
+};
+
+JxlSsimulacraApi* JxlSsimulacraApiCreate(
+    const JxlMemoryManager* memory_manager) {
+  JxlMemoryManager local_memory_manager;
+  if (!jxl::MemoryManagerInit(&local_memory_manager, memory_manager))
+    return nullptr;
+
+  void* alloc =
+      jxl::MemoryManagerAlloc(&local_memory_manager, sizeof(JxlSsimulacraApi));
+  if (!alloc) return nullptr;
+  // Placement new constructor on allocated memory
+  JxlSsimulacraApi* ret = new (alloc) JxlSsimulacraApi();
+  ret->cms = jxl::GetJxlCms();
+  ret->memory_manager = local_memory_manager;
+  return ret;
+}
+
+void JxlSsimulacraApiSetParallelRunner(JxlSsimulacraApi* api,
+                                       JxlParallelRunner parallel_runner,
+                                       void* parallel_runner_opaque) {
+  api->thread_pool = jxl::make_unique<jxl::ThreadPool>(parallel_runner,
+                                                       parallel_runner_opaque);
+}
+
+void JxlSsimulacraApiSetSimple(JxlSsimulacraApi* api, JXL_BOOL simple) {
+  api->simple = simple;
+}
+
+void JxlSsimulacraApiDestroy(JxlSsimulacraApi* api) {
+  if (api) {
+    JxlMemoryManager local_memory_manager = api->memory_manager;
+    // Call destructor directly since custom free function is used.
+    api->~JxlSsimulacraApi();
+    jxl::MemoryManagerFree(&local_memory_manager, api);
+  }
+}
+
+JXL_BOOL JxlSsimulacraCompute(const JxlSsimulacraApi* api, uint32_t xsize,
+                              uint32_t ysize,
+                              const JxlPixelFormat* pixel_format_orig,
+                              const void* buffer_orig, size_t size_orig,
+                              const JxlPixelFormat* pixel_format_dist,
+                              const void* buffer_dist, size_t size_dist,
+                              float* score) {
+  if (xsize < 8 || ysize < 8) return JXL_FALSE;
+  jxl::ThreadPool* pool = api->thread_pool.get();
+
+  jxl::ImageMetadata orig_metadata;
+  SetMetadataFromPixelFormat(pixel_format_orig, &orig_metadata);
+  jxl::ImageBundle orig_ib(&orig_metadata);
+  if (!ReadImage(pixel_format_orig, xsize, ysize, buffer_orig, size_orig, pool,
+                 &orig_ib)) {
+    return JXL_FALSE;
+  }
+
+  jxl::ImageMetadata dist_metadata;
+  SetMetadataFromPixelFormat(pixel_format_dist, &dist_metadata);
+  jxl::ImageBundle dist_ib(&dist_metadata);
+  if (!ReadImage(pixel_format_dist, xsize, ysize, buffer_dist, size_dist, pool,
+                 &dist_ib)) {
+    return JXL_FALSE;
+  }
+
+  *score = jxl::SsimulacraDistance(orig_ib, dist_ib, api->cms, api->simple,
+                                   pool);
+  return JXL_TRUE;
+}
@@ -5,6 +5,8 @@
 
 #include "lib/jxl/toc.h"
 
+#include <string.h>
+
 #include "gtest/gtest.h"
 #include "lib/jxl/aux_out_fwd.h"
 #include "lib/jxl/base/random.h"
@@ -77,6 +79,24 @@ void Roundtrip(size_t num_entries, bool permute, Rng* rng) {
     }
   }
   EXPECT_EQ(prefix_sum, total_size);
+
+  // Stitching the sections in id order gives the same frame as appending
+  // them in stored order.
+  std::vector<PaddedBytes> sections(num_entries);
+  for (size_t i = 0; i < num_entries; ++i) {
+    const Span<const uint8_t> span = group_codes[permutation[i]].GetSpan();
+    sections[i].append(span.data(), span.data() + span.size());
+  }
+  writer.AppendByteAligned(group_codes);
+  writer.ZeroPadToByte();
+  BitWriter stitched;
+  ASSERT_TRUE(WriteSectionsWithToc(sections,
+                                   permute ? &permutation : nullptr,
+                                   &stitched, &aux_out));
+  const Span<const uint8_t> expected = writer.GetSpan();
+  const Span<const uint8_t> actual = stitched.GetSpan();
+  ASSERT_EQ(expected.size(), actual.size());
+  EXPECT_EQ(0, memcmp(expected.data(), actual.data(), expected.size()));
 }
 
 TEST(TocTest, Test) {
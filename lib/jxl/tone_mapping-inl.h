@@ -0,0 +1,131 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Tone mapping of linear colors to a display of lower peak luminance.
+
+#if defined(LIB_JXL_TONE_MAPPING_INL_H_) == defined(HWY_TARGET_TOGGLE)
+#ifdef LIB_JXL_TONE_MAPPING_INL_H_
+#undef LIB_JXL_TONE_MAPPING_INL_H_
+#else
+#define LIB_JXL_TONE_MAPPING_INL_H_
+#endif
+
+#include <algorithm>
+#include <hwy/highway.h>
+#include <utility>
+
+#include "lib/jxl/transfer_functions-inl.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// Maps the luminance of the colors from the range of the source to that of
+// the target display, as described in Report ITU-R BT.2390-8, section 5.4
+// (pp. 23-25), and scales their components by the same ratio.
+// https://www.itu.int/pub/R-REP-BT.2390-8-2020
+class Rec2390ToneMapper {
+ public:
+  // The ranges are (min, max) luminances in nits. The input colors are in
+  // units of `input_nits` nits and the output ones in units of `output_nits`,
+  // e.g. the intensity targets of the source and of the display. `luminances`
+  // are those of the primaries of the colors, summing to 1.
+  Rec2390ToneMapper(std::pair<float, float> source_range,
+                    std::pair<float, float> target_range,
+                    const float luminances[3], float input_nits,
+                    float output_nits)
+      : input_nits_(input_nits),
+        inv_output_nits_(1.0f / output_nits),
+        target_max_nits_(target_range.second) {
+    std::copy(luminances, luminances + 3, luminances_);
+    pq_mastering_min_ = InvEOTF(source_range.first);
+    pq_mastering_range_ = InvEOTF(source_range.second) - pq_mastering_min_;
+    inv_pq_mastering_range_ = 1.0f / pq_mastering_range_;
+    min_lum_ = (InvEOTF(target_range.first) - pq_mastering_min_) *
+               inv_pq_mastering_range_;
+    max_lum_ = (InvEOTF(target_range.second) - pq_mastering_min_) *
+               inv_pq_mastering_range_;
+    ks_ = 1.5f * max_lum_ - 0.5f;
+    inv_one_minus_ks_ = 1.0f / std::max(1e-6f, 1.0f - ks_);
+  }
+
+  template <typename D, typename V>
+  void ToneMap(D d, V* red, V* green, V* blue) const {
+    const V luminance =
+        Set(d, input_nits_) *
+        MulAdd(Set(d, luminances_[0]), *red,
+               MulAdd(Set(d, luminances_[1]), *green,
+                      Set(d, luminances_[2]) * *blue));
+    const V pq_mastering_min = Set(d, pq_mastering_min_);
+    const V normalized_pq =
+        Min(Set(d, 1.0f), (InvEOTF(d, luminance) - pq_mastering_min) *
+                              Set(d, inv_pq_mastering_range_));
+    const V ks = Set(d, ks_);
+    const V e2 =
+        IfThenElse(normalized_pq < ks, normalized_pq, P(d, normalized_pq));
+    const V one_minus_e2 = Set(d, 1.0f) - e2;
+    const V one_minus_e2_2 = one_minus_e2 * one_minus_e2;
+    const V one_minus_e2_4 = one_minus_e2_2 * one_minus_e2_2;
+    const V e3 = MulAdd(Set(d, min_lum_), one_minus_e2_4, e2);
+    const V e4 = MulAdd(e3, Set(d, pq_mastering_range_), pq_mastering_min);
+    const V new_luminance =
+        Min(Set(d, target_max_nits_),
+            ZeroIfNegative(Set(d, 10000.0f) *
+                           TF_PQ().DisplayFromEncoded(d, e4)));
+
+    // Black pixels, whose ratio is not usable, become gray of the new
+    // luminance.
+    const auto is_black = luminance <= Set(d, 1e-6f);
+    const V gray = new_luminance * Set(d, inv_output_nits_);
+    const V factor =
+        new_luminance / luminance * Set(d, input_nits_ * inv_output_nits_);
+    for (V* const val : {red, green, blue}) {
+      *val = IfThenElse(is_black, gray, *val * factor);
+    }
+  }
+
+ private:
+  static float InvEOTF(float nits) {
+    return TF_PQ().EncodedFromDisplay(nits * (1.0f / 10000));
+  }
+  template <typename D, typename V>
+  static V InvEOTF(D d, V nits) {
+    return TF_PQ().EncodedFromDisplay(d, nits * Set(d, 1.0f / 10000));
+  }
+
+  // Hermite spline of the knee, for the values above ks.
+  template <typename D, typename V>
+  V P(D d, V b) const {
+    const V ks = Set(d, ks_);
+    const V t_b = (b - ks) * Set(d, inv_one_minus_ks_);
+    const V t_b_2 = t_b * t_b;
+    const V t_b_3 = t_b_2 * t_b;
+    return MulAdd(
+        MulAdd(Set(d, 2.0f), t_b_3, MulAdd(Set(d, -3.0f), t_b_2, Set(d, 1.0f))),
+        ks,
+        MulAdd(t_b_3 + MulAdd(Set(d, -2.0f), t_b_2, t_b), Set(d, 1.0f) - ks,
+               MulAdd(Set(d, -2.0f), t_b_3, Set(d, 3.0f) * t_b_2) *
+                   Set(d, max_lum_)));
+  }
+
+  float luminances_[3];
+  float input_nits_;
+  float inv_output_nits_;
+  float target_max_nits_;
+  float pq_mastering_min_;
+  float pq_mastering_range_;
+  float inv_pq_mastering_range_;
+  float min_lum_;
+  float max_lum_;
+  float ks_;
+  float inv_one_minus_ks_;
+};
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#endif  // LIB_JXL_TONE_MAPPING_INL_H_
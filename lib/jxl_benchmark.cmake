@@ -7,9 +7,12 @@
 # should be listed here.
 set(JPEGXL_INTERNAL_SOURCES_GBENCH
   extras/tone_mapping_gbench.cc
+  jxl/alpha_gbench.cc
+  jxl/dec_ans_gbench.cc
   jxl/dec_external_image_gbench.cc
   jxl/enc_external_image_gbench.cc
   jxl/gauss_blur_gbench.cc
+  jxl/render_pipeline/render_pipeline_gbench.cc
   jxl/splines_gbench.cc
   jxl/tf_gbench.cc
 )
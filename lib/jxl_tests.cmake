@@ -12,15 +12,19 @@ set(TEST_FILES
   jxl/bit_reader_test.cc
   jxl/bits_test.cc
   jxl/blending_test.cc
+  jxl/buffer_pool_test.cc
   jxl/butteraugli_test.cc
   jxl/byte_order_test.cc
   jxl/coeff_order_test.cc
   jxl/color_encoding_internal_test.cc
   jxl/color_management_test.cc
+  jxl/compressed_dc_test.cc
   jxl/convolve_test.cc
   jxl/data_parallel_test.cc
   jxl/dct_test.cc
   jxl/decode_test.cc
+  jxl/enc_content_classifier_test.cc
+  jxl/enc_decode_cost_test.cc
   jxl/enc_external_image_test.cc
   jxl/enc_photon_noise_test.cc
   jxl/encode_test.cc
@@ -28,6 +32,7 @@ set(TEST_FILES
   jxl/fast_dct_test.cc
   jxl/fast_math_test.cc
   jxl/fields_test.cc
+  jxl/file_io_test.cc
   jxl/gaborish_test.cc
   jxl/gamma_correct_test.cc
   jxl/gauss_blur_test.cc
@@ -39,6 +44,7 @@ set(TEST_FILES
   jxl/jxl_test.cc
   jxl/lehmer_code_test.cc
   jxl/linalg_test.cc
+  jxl/memory_arena_test.cc
   jxl/modular_test.cc
   jxl/opsin_image_test.cc
   jxl/opsin_inverse_test.cc
@@ -55,9 +61,13 @@ set(TEST_FILES
   jxl/simd_util_test.cc
   jxl/speed_tier_test.cc
   jxl/splines_test.cc
+  jxl/ssimulacra_test.cc
   jxl/toc_test.cc
   jxl/xorshift128plus_test.cc
+  threads/resizable_parallel_runner_test.cc
+  threads/shared_parallel_runner_test.cc
   threads/thread_parallel_runner_test.cc
+  threads/work_stealing_parallel_runner_test.cc
   ### Files before this line are handled by build_cleaner.py
   # TODO(deymo): Move this to tools/
   ../tools/box/box_test.cc
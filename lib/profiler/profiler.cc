@@ -13,10 +13,12 @@
 
 #include <algorithm>  // sort
 #include <atomic>
+#include <chrono>
 #include <cinttypes>  // PRIu64
 #include <hwy/cache_control.h>
 #include <limits>
 #include <new>
+#include <vector>
 
 // Optionally use SIMD in StreamCacheLine if available.
 #undef HWY_TARGET_INCLUDE
@@ -72,6 +74,12 @@ namespace {
 #define PROFILER_THREAD_STORAGE 32ULL
 #endif
 
+// Maximum number of zones recorded per thread for the trace, 32 bytes each.
+// Later zones are only counted in the totals.
+#ifndef PROFILER_MAX_TRACE_EVENTS
+#define PROFILER_MAX_TRACE_EVENTS (1ULL << 22)
+#endif
+
 #define PROFILER_PRINT_OVERHEAD 0
 
 // Upper bounds for fixed-size data structures (guarded via HWY_ASSERT):
@@ -93,6 +101,40 @@ struct ZoneTotals {
   uint64_t num_calls;
 };
 
+// One zone of the trace of a thread. POD.
+struct TraceEvent {
+  const char* name;
+  uint64_t entry_timestamp;
+  uint64_t exit_timestamp;
+  uint64_t depth;
+};
+
+// Path of the trace file to write, from the JXL_PROFILER_TRACE environment
+// variable, or nullptr if no trace is wanted.
+const char* TracePath() {
+  static const char* path = getenv("JXL_PROFILER_TRACE");
+  return path;
+}
+
+// Pairs a timestamp with the wall clock, to convert ticks to microseconds.
+struct TimePoint {
+  static TimePoint Now() {
+    TimePoint point;
+    point.ticks = TicksBefore();
+    point.time = std::chrono::steady_clock::now();
+    return point;
+  }
+
+  uint64_t ticks;
+  std::chrono::steady_clock::time_point time;
+};
+
+// Time when the first thread entered a zone.
+const TimePoint& StartTime() {
+  static const TimePoint start = TimePoint::Now();
+  return start;
+}
+
 template <typename T>
 inline T ClampedSubtract(const T minuend, const T subtrahend) {
   if (subtrahend > minuend) {
@@ -163,6 +205,15 @@ class Results {
       UpdateOrAdd(active.name, 1, self_duration);
       --depth_;
 
+      if (record_trace_) {
+        if (trace_.size() < PROFILER_MAX_TRACE_EVENTS) {
+          trace_.push_back(
+              {active.name, active.entry_timestamp, timestamp, depth_});
+        } else {
+          ++num_dropped_trace_events_;
+        }
+      }
+
       // "Deduct" the nested time from its parent's self_duration.
       if (depth_ != 0) {
         zone_stack_[depth_ - 1].child_total += duration + child_overhead_;
@@ -215,11 +266,49 @@ class Results {
     printf("Total clocks measured: %" PRIu64 "\n", total_visible_duration);
   }
 
+  // Keeps the entry and exit time of all later zones, for WriteTrace.
+  void EnableTrace() { record_trace_ = true; }
+
+  // Single-threaded. Writes the zones recorded since EnableTrace as Chrome
+  // trace events of the given thread, separated by commas, to `file`.
+  // Timestamps are converted to microseconds since `start`.
+  void WriteTrace(FILE* file, const size_t thread, const TimePoint& start,
+                  const double ticks_per_us, bool* first) const {
+    fprintf(file,
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%zu,\"args\":{\"name\":\"thread %zu\"}}",
+            *first ? "" : ",\n", thread, thread);
+    *first = false;
+    for (const TraceEvent& event : trace_) {
+      const double ts = (static_cast<int64_t>(event.entry_timestamp) -
+                         static_cast<int64_t>(start.ticks)) /
+                        ticks_per_us;
+      const double dur =
+          (event.exit_timestamp - event.entry_timestamp) / ticks_per_us;
+      fprintf(file, ",\n{\"name\":\"");
+      // Zone names are identifiers or literals, without control characters.
+      for (const char* c = event.name; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') fputc('\\', file);
+        fputc(*c, file);
+      }
+      fprintf(file,
+              "\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,"
+              "\"dur\":%.3f,\"args\":{\"depth\":%" PRIu64 "}}",
+              thread, ts, dur, event.depth);
+    }
+    if (num_dropped_trace_events_ != 0) {
+      fprintf(stderr, "Thread %zu: %" PRIu64 " zones not in the trace\n",
+              thread, num_dropped_trace_events_);
+    }
+  }
+
   // Single-threaded. Clears all results as if no zones had been recorded.
   void Reset() {
     analyze_elapsed_ = 0;
     HWY_ASSERT(depth_ == 0);
     num_zones_ = 0;
+    trace_.clear();
+    num_dropped_trace_events_ = 0;
     memset(zone_stack_, 0, sizeof(zone_stack_));
     memset(zones_, 0, sizeof(zones_));
   }
@@ -284,6 +373,10 @@ class Results {
   size_t depth_ = 0;      // Number of active zones <= kMaxDepth.
   size_t num_zones_ = 0;  // Number of unique zones <= kMaxZones.
 
+  bool record_trace_ = false;
+  std::vector<TraceEvent> trace_;
+  uint64_t num_dropped_trace_events_ = 0;
+
   // After other members to avoid large pointer offsets.
   alignas(64) ActiveZone zone_stack_[kMaxDepth];  // Last = newest
   alignas(64) ZoneTotals zones_[kMaxZones];       // Self-organizing list
@@ -505,16 +598,57 @@ ThreadSpecific* Zone::InitThreadSpecific() {
   GetThreadSpecific() = thread_specific;
 
   thread_specific->ComputeOverhead();
+  // After ComputeOverhead, whose zones are not real.
+  if (TracePath() != nullptr) {
+    StartTime();
+    thread_specific->GetResults().EnableTrace();
+  }
   return thread_specific;
 }
 
+namespace {
+
+// Single-threaded. Writes the zones of all threads to a JSON file in the
+// Chrome trace event format, which chrome://tracing and https://ui.perfetto.dev
+// can show as one timeline per thread.
+void WriteTrace(const char* path, ThreadSpecific* head) {
+  FILE* file = fopen(path, "w");
+  if (file == nullptr) {
+    fprintf(stderr, "Failed to open %s for writing the trace\n", path);
+    return;
+  }
+  const TimePoint& start = StartTime();
+  const TimePoint end = TimePoint::Now();
+  const double us = std::chrono::duration<double, std::micro>(
+                        end.time - start.time)
+                        .count();
+  const double ticks_per_us =
+      us > 0 && end.ticks > start.ticks ? (end.ticks - start.ticks) / us : 1.0;
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  bool first = true;
+  size_t thread = 0;
+  for (ThreadSpecific* p = head; p != nullptr; p = p->GetNext()) {
+    p->GetResults().WriteTrace(file, thread++, start, ticks_per_us, &first);
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+}
+
+}  // namespace
+
 // Single-threaded.
 /*static*/ void Zone::PrintResults() {
   ThreadSpecific* head = GetHead().load(std::memory_order_relaxed);
-  ThreadSpecific* p = head;
-  while (p) {
+  for (ThreadSpecific* p = head; p != nullptr; p = p->GetNext()) {
     p->AnalyzeRemainingPackets();
+  }
 
+  if (head != nullptr && TracePath() != nullptr) {
+    WriteTrace(TracePath(), head);
+  }
+
+  ThreadSpecific* p = head;
+  while (p) {
     // Combine all threads into a single Result.
     if (p != head) {
       head->GetResults().Assimilate(p->GetResults());
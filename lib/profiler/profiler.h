@@ -14,6 +14,12 @@
 // After all threads have exited any zones, invoke PROFILER_PRINT_RESULTS() to
 // print call counts and average durations [CPU cycles] to stdout, sorted in
 // descending order of total duration.
+//
+// If the JXL_PROFILER_TRACE environment variable is set to a path,
+// PROFILER_PRINT_RESULTS() also writes there the entry and exit time of every
+// zone as a Chrome trace JSON file, with one timeline per thread, which can be
+// opened with chrome://tracing or https://ui.perfetto.dev to see idle threads
+// and serial parts.
 
 // If zero, this file has no effect and no measurements will be recorded.
 #ifndef PROFILER_ENABLED
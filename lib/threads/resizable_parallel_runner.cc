@@ -62,15 +62,21 @@ struct ResizeableParallelRunner {
 
     {
       std::unique_lock<std::mutex> l(state_mutex_);
-      // Avoid waking up more workers than needed.
-      max_running_workers_ = end - start - 1;
+      // Only wakes up as many workers as there are tasks besides the one of
+      // the calling thread, so that small ranges, e.g. of the few groups of a
+      // small image or the channels of a group, do not pay for waking up all
+      // of them.
+      max_running_workers_ = num_workers - 1;
+      num_started_workers_ = 0;
       next_task_ = start;
       end_task_ = end;
       func_ = func;
       jxl_opaque_ = jxl_opaque;
       work_available_ = true;
       num_running_workers_++;
-      workers_can_proceed_.notify_all();
+      for (size_t i = 0; i < max_running_workers_; i++) {
+        workers_can_proceed_.notify_one();
+      }
     }
 
     DequeueTasks(0);
@@ -87,20 +93,24 @@ struct ResizeableParallelRunner {
  private:
   void WorkerBody(size_t worker_id) {
     while (true) {
+      size_t thread_id;
       {
         std::unique_lock<std::mutex> l(state_mutex_);
         // Worker pool was reduced, resize down.
         if (worker_id >= num_desired_workers_) {
           return;
         }
-        // Nothing to do this time.
-        if (!work_available_ || worker_id >= max_running_workers_) {
+        // Nothing to do this time, or enough workers took part already.
+        if (!work_available_ || num_started_workers_ >= max_running_workers_) {
           workers_can_proceed_.wait(l);
           continue;
         }
+        // Whichever workers wake up first take the thread ids, the calling
+        // thread has 0.
+        thread_id = ++num_started_workers_;
         num_running_workers_++;
       }
-      DequeueTasks(worker_id + 1);
+      DequeueTasks(thread_id);
     }
   }
 
@@ -122,8 +132,8 @@ struct ResizeableParallelRunner {
 
   // Checks when the worker has something to do, which can be one of:
   // - quitting (when worker_id >= num_desired_workers_)
-  // - having work available for them (work_available_ is true and worker_id >=
-  // max_running_workers_)
+  // - having work available for them (work_available_ is true and
+  // num_started_workers_ < max_running_workers_)
   std::condition_variable workers_can_proceed_;
 
   // Workers are done, and the main thread can proceed (num_running_workers_ ==
@@ -153,10 +163,13 @@ struct ResizeableParallelRunner {
   // present.
   // - max_running_workers_ represents the number of workers that should be
   // executing tasks.
+  // - num_started_workers_ represents the number of workers that joined the
+  // current Run() call.
   // - num_running_workers_ represents the number of workers that are executing
   // tasks.
   size_t num_desired_workers_ = 0;
   size_t max_running_workers_ = 0;
+  size_t num_started_workers_ = 0;
   size_t num_running_workers_ = 0;
   bool work_available_ = false;
 };
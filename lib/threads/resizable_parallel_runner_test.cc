@@ -0,0 +1,57 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "jxl/resizable_parallel_runner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "jxl/resizable_parallel_runner_cxx.h"
+#include "lib/jxl/base/data_parallel.h"
+
+namespace jpegxl {
+namespace {
+
+// Ensures every task in the range runs exactly once with a thread index below
+// the number of threads passed to init, also when the range is smaller than
+// the number of threads and after the number of threads changes.
+TEST(ResizableParallelRunnerTest, TestRanges) {
+  JxlResizableParallelRunnerPtr runner =
+      JxlResizableParallelRunnerMake(nullptr);
+  jxl::ThreadPool pool(JxlResizableParallelRunner, runner.get());
+  for (size_t num_threads : {0, 1, 2, 8, 3, 17}) {
+    JxlResizableParallelRunnerSetThreads(runner.get(), num_threads);
+    for (uint32_t num_tasks : {0u, 1u, 2u, 5u, 31u, 1000u}) {
+      for (int repeat = 0; repeat < 20; repeat++) {
+        std::vector<std::atomic<int>> calls(num_tasks);
+        for (auto& c : calls) c.store(0);
+        size_t init_threads = 0;
+        EXPECT_TRUE(RunOnPool(
+            &pool, 7, 7 + num_tasks,
+            [&init_threads](size_t threads) {
+              init_threads = threads;
+              return true;
+            },
+            [&](const uint32_t task, size_t thread) {
+              EXPECT_LT(thread, init_threads);
+              calls[task - 7].fetch_add(1, std::memory_order_relaxed);
+            },
+            "TestRanges"));
+        if (num_tasks > 1) {
+          EXPECT_LE(init_threads, num_tasks);
+          EXPECT_LE(init_threads, std::max<size_t>(num_threads, 1));
+        }
+        for (uint32_t i = 0; i < num_tasks; i++) {
+          EXPECT_EQ(1, calls[i].load()) << "task " << 7 + i;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace jpegxl
@@ -0,0 +1,215 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "jxl/shared_parallel_runner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace jpegxl {
+namespace {
+
+class SharedParallelRunner;
+
+struct Tenant {
+  SharedParallelRunner* pool;
+  std::atomic<uint32_t> priority;
+};
+
+// A fixed set of workers running the tasks of concurrent Run calls from any
+// number of tenants. Each Run call is a job in the list of active jobs. Workers
+// pick jobs with stride scheduling: every chunk of tasks taken from a job
+// advances its pass by kStride / priority, and the job with the smallest pass
+// goes next. The thread calling Run works on its own job without going through
+// the scheduler, so each call progresses even if the workers are busy.
+class SharedParallelRunner {
+ public:
+  explicit SharedParallelRunner(size_t num_worker_threads) {
+    workers_.reserve(num_worker_threads);
+    for (size_t i = 0; i < num_worker_threads; i++) {
+      workers_.emplace_back([this, i]() { WorkerBody(i + 1); });
+    }
+  }
+
+  ~SharedParallelRunner() {
+    {
+      std::unique_lock<std::mutex> l(state_mutex_);
+      exit_ = true;
+      workers_can_proceed_.notify_all();
+    }
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  JxlParallelRetCode Run(const Tenant* tenant, void* jxl_opaque,
+                         JxlParallelRunInit init, JxlParallelRunFunction func,
+                         uint32_t start, uint32_t end) {
+    if (start >= end) return 0;
+    // The calling thread is thread 0, worker i is thread i + 1 for all the
+    // jobs, so that a thread index is never used twice at once for one job.
+    const size_t num_threads =
+        workers_.empty() || start + 1 == end ? 1 : workers_.size() + 1;
+    JxlParallelRetCode ret = init(jxl_opaque, num_threads);
+    if (ret != 0) return ret;
+
+    if (num_threads == 1) {
+      for (uint32_t task = start; task < end; task++) {
+        func(jxl_opaque, task, 0);
+      }
+      return 0;
+    }
+
+    Job job;
+    job.func = func;
+    job.jxl_opaque = jxl_opaque;
+    job.next.store(start, std::memory_order_relaxed);
+    job.end = end;
+    job.chunk = std::max<uint32_t>(1, (end - start) / (4 * num_threads));
+    job.stride = kStride / std::max<uint32_t>(1, tenant->priority.load());
+    {
+      std::unique_lock<std::mutex> l(state_mutex_);
+      // Start at the current virtual time, so that a new job neither starves
+      // the others nor gets starved.
+      job.pass = virtual_time_;
+      jobs_.push_back(&job);
+      workers_can_proceed_.notify_all();
+    }
+
+    while (RunChunk(&job, 0)) {
+    }
+
+    std::unique_lock<std::mutex> l(state_mutex_);
+    RemoveJob(&job);
+    while (job.num_users != 0) {
+      job_done_.wait(l);
+    }
+    return 0;
+  }
+
+ private:
+  static constexpr uint64_t kStride = 1 << 20;
+
+  struct Job {
+    JxlParallelRunFunction func;
+    void* jxl_opaque;  // not owned
+    std::atomic<uint32_t> next;
+    uint32_t end;
+    uint32_t chunk;
+    uint64_t stride;
+    // Guarded by state_mutex_.
+    uint64_t pass;
+    size_t num_users = 0;
+  };
+
+  // Runs the next chunk of tasks of the job, returns false if there were none.
+  static bool RunChunk(Job* job, size_t thread) {
+    const uint32_t begin =
+        job->next.fetch_add(job->chunk, std::memory_order_relaxed);
+    if (begin >= job->end) {
+      // Prevent wrap-around of next with repeated calls.
+      job->next.store(job->end, std::memory_order_relaxed);
+      return false;
+    }
+    const uint32_t end = std::min<uint64_t>(
+        static_cast<uint64_t>(begin) + job->chunk, job->end);
+    for (uint32_t task = begin; task < end; task++) {
+      job->func(job->jxl_opaque, task, thread);
+    }
+    return true;
+  }
+
+  // Precondition: state_mutex_ is held.
+  void RemoveJob(Job* job) {
+    auto it = std::find(jobs_.begin(), jobs_.end(), job);
+    if (it != jobs_.end()) jobs_.erase(it);
+  }
+
+  void WorkerBody(size_t thread) {
+    std::unique_lock<std::mutex> l(state_mutex_);
+    while (true) {
+      while (!exit_ && jobs_.empty()) {
+        workers_can_proceed_.wait(l);
+      }
+      if (exit_) return;
+      Job* job = *std::min_element(
+          jobs_.begin(), jobs_.end(),
+          [](const Job* a, const Job* b) { return a->pass < b->pass; });
+      virtual_time_ = job->pass;
+      job->pass += job->stride;
+      job->num_users++;
+      l.unlock();
+      const bool ran = RunChunk(job, thread);
+      l.lock();
+      if (!ran) RemoveJob(job);
+      // Run may be waiting for the last user once all tasks are taken.
+      if (--job->num_users == 0 &&
+          job->next.load(std::memory_order_relaxed) >= job->end) {
+        job_done_.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers_;
+
+  // Workers can pick a job or exit (jobs_ not empty or exit_ set).
+  std::condition_variable workers_can_proceed_;
+  // The number of workers using some job dropped to zero after all its tasks
+  // were taken.
+  std::condition_variable job_done_;
+
+  // Protects all the remaining variables and the scheduling fields of the
+  // jobs.
+  std::mutex state_mutex_;
+  std::vector<Job*> jobs_;
+  uint64_t virtual_time_ = 0;
+  bool exit_ = false;
+};
+
+}  // namespace
+}  // namespace jpegxl
+
+extern "C" {
+JXL_THREADS_EXPORT JxlParallelRetCode JxlSharedParallelRunner(
+    void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
+    JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range) {
+  const jpegxl::Tenant* tenant =
+      static_cast<const jpegxl::Tenant*>(runner_opaque);
+  return tenant->pool->Run(tenant, jpegxl_opaque, init, func, start_range,
+                           end_range);
+}
+
+JXL_THREADS_EXPORT void* JxlSharedParallelRunnerCreate(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads) {
+  return new jpegxl::SharedParallelRunner(num_worker_threads);
+}
+
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerDestroy(void* pool) {
+  delete static_cast<jpegxl::SharedParallelRunner*>(pool);
+}
+
+JXL_THREADS_EXPORT void* JxlSharedParallelRunnerCreateTenant(
+    void* pool, uint32_t priority) {
+  if (priority == 0) return nullptr;
+  jpegxl::Tenant* tenant = new jpegxl::Tenant;
+  tenant->pool = static_cast<jpegxl::SharedParallelRunner*>(pool);
+  tenant->priority.store(priority);
+  return tenant;
+}
+
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerSetTenantPriority(
+    void* tenant, uint32_t priority) {
+  static_cast<jpegxl::Tenant*>(tenant)->priority.store(
+      std::max<uint32_t>(1, priority));
+}
+
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerDestroyTenant(void* tenant) {
+  delete static_cast<jpegxl::Tenant*>(tenant);
+}
+}
@@ -0,0 +1,99 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "jxl/shared_parallel_runner.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "jxl/shared_parallel_runner_cxx.h"
+#include "lib/jxl/base/data_parallel.h"
+
+namespace jpegxl {
+namespace {
+
+// Runs num_runs ranges on the tenant and checks that each task runs exactly
+// once, with a thread index below the number of threads passed to init.
+void RunAndCheck(void* tenant, uint32_t num_tasks, size_t num_runs) {
+  jxl::ThreadPool pool(JxlSharedParallelRunner, tenant);
+  for (size_t run = 0; run < num_runs; run++) {
+    std::vector<std::atomic<int>> calls(num_tasks);
+    for (auto& c : calls) c.store(0);
+    size_t init_threads = 0;
+    EXPECT_TRUE(RunOnPool(
+        &pool, 0, num_tasks,
+        [&init_threads](size_t threads) {
+          init_threads = threads;
+          return true;
+        },
+        [&](const uint32_t task, size_t thread) {
+          EXPECT_LT(task, num_tasks);
+          EXPECT_LT(thread, init_threads);
+          calls[task].fetch_add(1, std::memory_order_relaxed);
+        },
+        "RunAndCheck"));
+    for (uint32_t i = 0; i < num_tasks; i++) {
+      EXPECT_EQ(1, calls[i].load()) << "task " << i;
+    }
+  }
+}
+
+TEST(SharedParallelRunnerTest, TestSingleTenant) {
+  for (size_t num_threads : {0, 1, 4}) {
+    JxlSharedParallelRunnerPtr runner =
+        JxlSharedParallelRunnerMake(nullptr, num_threads);
+    JxlSharedParallelRunnerTenantPtr tenant =
+        JxlSharedParallelRunnerMakeTenant(runner.get(), 1);
+    for (uint32_t num_tasks : {0u, 1u, 3u, 100u, 10000u}) {
+      RunAndCheck(tenant.get(), num_tasks, 3);
+    }
+  }
+}
+
+// Many tenants with different priorities run concurrently on the same pool.
+TEST(SharedParallelRunnerTest, TestConcurrentTenants) {
+  JxlSharedParallelRunnerPtr runner = JxlSharedParallelRunnerMake(nullptr, 4);
+  const size_t kNumTenants = 8;
+  std::vector<JxlSharedParallelRunnerTenantPtr> tenants;
+  for (size_t i = 0; i < kNumTenants; i++) {
+    tenants.push_back(JxlSharedParallelRunnerMakeTenant(runner.get(), i + 1));
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumTenants; i++) {
+    void* tenant = tenants[i].get();
+    threads.emplace_back([tenant, i]() {
+      RunAndCheck(tenant, 500 + 300 * i, 20);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  JxlSharedParallelRunnerSetTenantPriority(tenants[0].get(), 5);
+  RunAndCheck(tenants[0].get(), 1000, 2);
+}
+
+TEST(SharedParallelRunnerTest, TestInvalidPriority) {
+  JxlSharedParallelRunnerPtr runner = JxlSharedParallelRunnerMake(nullptr, 2);
+  EXPECT_EQ(nullptr, JxlSharedParallelRunnerMakeTenant(runner.get(), 0));
+}
+
+// An error returned by init is propagated and no task runs.
+TEST(SharedParallelRunnerTest, TestInitError) {
+  JxlSharedParallelRunnerPtr runner = JxlSharedParallelRunnerMake(nullptr, 3);
+  JxlSharedParallelRunnerTenantPtr tenant =
+      JxlSharedParallelRunnerMakeTenant(runner.get(), 1);
+  jxl::ThreadPool pool(JxlSharedParallelRunner, tenant.get());
+  std::atomic<int> num_calls{0};
+  EXPECT_FALSE(RunOnPool(
+      &pool, 0, 100, [](size_t) { return false; },
+      [&num_calls](const uint32_t task, size_t thread) { num_calls++; },
+      "TestInitError"));
+  EXPECT_EQ(0, num_calls.load());
+}
+
+}  // namespace
+}  // namespace jpegxl
@@ -95,6 +95,37 @@ void JxlThreadParallelRunnerDestroy(void* runner_opaque) {
   }
 }
 
+JxlParallelRetCode JxlThreadParallelRunnerSetAffinity(void* runner_opaque,
+                                                      const size_t* cpus,
+                                                      const size_t* groups) {
+  jpegxl::ThreadParallelRunner* runner =
+      static_cast<jpegxl::ThreadParallelRunner*>(runner_opaque);
+  return runner->SetAffinity(cpus, groups) ? 0 : -1;
+}
+
+JxlParallelRetCode JxlThreadParallelRunnerSetNumaAffinity(void* runner_opaque) {
+  jpegxl::ThreadParallelRunner* runner =
+      static_cast<jpegxl::ThreadParallelRunner*>(runner_opaque);
+  return runner->SetNumaAffinity() ? 0 : -1;
+}
+
+void JxlThreadParallelRunnerSetSpinDuration(void* runner_opaque,
+                                            uint64_t nanoseconds) {
+  static_cast<jpegxl::ThreadParallelRunner*>(runner_opaque)
+      ->SetSpinDuration(nanoseconds);
+}
+
+void JxlThreadParallelRunnerGetWakeStats(
+    const void* runner_opaque, JxlThreadParallelRunnerWakeStats* stats) {
+  const jpegxl::ThreadParallelRunner::WakeStats wake_stats =
+      static_cast<const jpegxl::ThreadParallelRunner*>(runner_opaque)
+          ->GetWakeStats();
+  stats->num_wakeups = wake_stats.num_wakeups;
+  stats->num_parked_wakeups = wake_stats.num_parked_wakeups;
+  stats->total_nanoseconds = wake_stats.total_nanoseconds;
+  stats->max_nanoseconds = wake_stats.max_nanoseconds;
+}
+
 // Get default value for num_worker_threads parameter of
 // InitJxlThreadParallelRunner.
 size_t JxlThreadParallelRunnerDefaultNumWorkerThreads() {
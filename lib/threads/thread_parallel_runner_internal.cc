@@ -5,7 +5,20 @@
 
 #include "lib/threads/thread_parallel_runner_internal.h"
 
+#include <stdio.h>
+
 #include <algorithm>
+#include <chrono>
+#include <utility>
+
+#if defined(__linux__) && !defined(__ANDROID__)
+#define JXL_THREADS_HAVE_AFFINITY 1
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#else
+#define JXL_THREADS_HAVE_AFFINITY 0
+#endif
 
 #if defined(ADDRESS_SANITIZER) || defined(MEMORY_SANITIZER) || \
     defined(THREAD_SANITIZER)
@@ -48,6 +61,90 @@ bool Abort() {
   do {                        \
   } while (0)
 #endif
+
+// The runner and thread index of the worker running on this thread, if any,
+// to recognize the calls made by tasks.
+struct CurrentWorker {
+  const jpegxl::ThreadParallelRunner* runner;
+  int thread;
+};
+thread_local CurrentWorker current_worker = {nullptr, 0};
+
+// Long enough to cover the gaps between the many short Runner calls of the
+// render pipeline and the modular decoder, short enough to not waste a core
+// between frames or images.
+constexpr uint64_t kDefaultSpinNanoseconds = 20000;
+
+int64_t NowNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Tells the CPU that this is a spin loop, which saves power and leaves the
+// execution units to the other hyperthread.
+inline void CpuRelax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+#if JXL_THREADS_HAVE_AFFINITY
+// Appends the CPUs of a sysfs CPU list such as "0-3,8,10-11" to `cpus`.
+void ParseCpuList(const char* list, std::vector<size_t>* cpus) {
+  const char* pos = list;
+  for (;;) {
+    char* end;
+    const size_t first = strtoul(pos, &end, 10);
+    if (end == pos) return;
+    size_t last = first;
+    pos = end;
+    if (*pos == '-') {
+      last = strtoul(pos + 1, &end, 10);
+      if (end == pos + 1) return;
+      pos = end;
+    }
+    for (size_t cpu = first; cpu <= last; cpu++) cpus->push_back(cpu);
+    if (*pos != ',') return;
+    pos++;
+  }
+}
+
+// Returns the (NUMA node, CPU) pairs of the CPUs that this process may use,
+// sorted, or nothing if the topology is not known.
+std::vector<std::pair<size_t, size_t>> NumaCpus() {
+  std::vector<std::pair<size_t, size_t>> node_cpus;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return node_cpus;
+  DIR* dir = opendir("/sys/devices/system/node");
+  if (dir == nullptr) return node_cpus;
+  while (const dirent* entry = readdir(dir)) {
+    unsigned node;
+    char extra;
+    if (sscanf(entry->d_name, "node%u%c", &node, &extra) != 1) continue;
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+             node);
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) continue;
+    char list[4096];
+    std::vector<size_t> cpus;
+    if (fgets(list, sizeof(list), file) != nullptr) ParseCpuList(list, &cpus);
+    fclose(file);
+    for (size_t cpu : cpus) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+        node_cpus.emplace_back(node, cpu);
+      }
+    }
+  }
+  closedir(dir);
+  std::sort(node_cpus.begin(), node_cpus.end());
+  return node_cpus;
+}
+#endif  // JXL_THREADS_HAVE_AFFINITY
 }  // namespace
 
 namespace jpegxl {
@@ -74,8 +171,14 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
     return 0;
   }
 
+  if (current_worker.runner == self) {
+    self->RunNested(jpegxl_opaque, func, start_range, end_range,
+                    current_worker.thread);
+    return 0;
+  }
+
   if (self->depth_.fetch_add(1, std::memory_order_acq_rel) != 0) {
-    return -1;  // Must not re-enter.
+    return -1;  // Must not be called concurrently by other threads.
   }
 
   const WorkerCommand worker_command =
@@ -87,7 +190,11 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
 
   self->data_func_ = func;
   self->jpegxl_opaque_ = jpegxl_opaque;
-  self->num_reserved_.store(0, std::memory_order_relaxed);
+  self->SplitRange(start_range, end_range);
+  {
+    std::lock_guard<std::mutex> lock(self->nested_mutex_);
+    self->num_running_ = self->num_worker_threads_;
+  }
 
   self->StartWorkers(worker_command);
   self->WorkersReadyBarrier();
@@ -98,14 +205,40 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
   return 0;
 }
 
+void ThreadParallelRunner::SplitRange(const uint32_t begin,
+                                      const uint32_t end) {
+  const uint64_t num_tasks = end - begin;
+  uint32_t num_workers_before = 0;
+  for (uint32_t group = 0; group < num_groups_; group++) {
+    GroupRange& range = group_ranges_[group];
+    range.begin = begin + num_tasks * num_workers_before / num_worker_threads_;
+    num_workers_before += range.num_workers;
+    range.end = begin + num_tasks * num_workers_before / num_worker_threads_;
+    range.num_reserved.store(0, std::memory_order_relaxed);
+  }
+}
+
 // static
 void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
-                                    const WorkerCommand command,
                                     const int thread) {
-  const uint32_t begin = command >> 32;
-  const uint32_t end = command & 0xFFFFFFFF;
-  const uint32_t num_tasks = end - begin;
-  const uint32_t num_worker_threads = self->num_worker_threads_;
+  const uint32_t num_groups = self->num_groups_;
+  const uint32_t group = self->worker_groups_[thread];
+  RunGroupRange(self, &self->group_ranges_[group],
+                self->group_ranges_[group].num_workers, thread);
+  // Then helps the other groups, nearest first.
+  for (uint32_t i = 1; i < num_groups; i++) {
+    RunGroupRange(self, &self->group_ranges_[(group + i) % num_groups],
+                  self->num_worker_threads_, thread);
+  }
+}
+
+// static
+void ThreadParallelRunner::RunGroupRange(ThreadParallelRunner* self,
+                                         GroupRange* range,
+                                         const uint32_t num_workers,
+                                         const int thread) {
+  const uint32_t begin = range->begin;
+  const uint32_t num_tasks = range->end - begin;
 
   // OpenMP introduced several "schedule" strategies:
   // "single" (static assignment of exactly one chunk per thread): slower.
@@ -117,18 +250,20 @@ void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
   for (;;) {
 #if 0
       // dynamic
-      const uint32_t my_size = std::max(num_tasks / (num_worker_threads * 4), 1);
+      const uint32_t my_size = std::max(num_tasks / (num_workers * 4), 1);
 #else
     // guided
     const uint32_t num_reserved =
-        self->num_reserved_.load(std::memory_order_relaxed);
+        range->num_reserved.load(std::memory_order_relaxed);
     // It is possible that more tasks are reserved than ready to run.
     const uint32_t num_remaining =
         num_tasks - std::min(num_reserved, num_tasks);
-    const uint32_t my_size =
-        std::max(num_remaining / (num_worker_threads * 4), 1u);
+    // Stop before fetch_add when done, so that the helping workers of other
+    // groups do not keep growing num_reserved.
+    if (num_remaining == 0) break;
+    const uint32_t my_size = std::max(num_remaining / (num_workers * 4), 1u);
 #endif
-    const uint32_t my_begin = begin + self->num_reserved_.fetch_add(
+    const uint32_t my_begin = begin + range->num_reserved.fetch_add(
                                           my_size, std::memory_order_relaxed);
     const uint32_t my_end = std::min(my_begin + my_size, begin + num_tasks);
     // Another thread already reserved the last task.
@@ -141,32 +276,210 @@ void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
   }
 }
 
+void ThreadParallelRunner::RunNested(void* jpegxl_opaque,
+                                     JxlParallelRunFunction func,
+                                     uint32_t start_range, uint32_t end_range,
+                                     const int thread) {
+  NestedJob job;
+  job.func = func;
+  job.jpegxl_opaque = jpegxl_opaque;
+  job.next.store(start_range, std::memory_order_relaxed);
+  job.end = end_range;
+  job.chunk = std::max((end_range - start_range) / (num_worker_threads_ * 4),
+                       1u);
+  {
+    std::lock_guard<std::mutex> lock(nested_mutex_);
+    nested_jobs_.push_back(&job);
+  }
+  nested_cv_.notify_all();
+
+  // Only this job: its tasks may use per-thread storage of the outer call
+  // that the task calling Runner is still using.
+  while (RunNestedChunk(&job, thread)) {
+  }
+
+  std::unique_lock<std::mutex> lock(nested_mutex_);
+  nested_jobs_.erase(std::find(nested_jobs_.begin(), nested_jobs_.end(), &job));
+  while (job.num_users != 0) {
+    nested_cv_.wait(lock);
+  }
+}
+
+// static
+bool ThreadParallelRunner::RunNestedChunk(NestedJob* job, const int thread) {
+  const uint32_t begin =
+      job->next.fetch_add(job->chunk, std::memory_order_relaxed);
+  if (begin >= job->end) {
+    // Prevent wrap-around of next with repeated calls.
+    job->next.store(job->end, std::memory_order_relaxed);
+    return false;
+  }
+  const uint32_t end = std::min<uint64_t>(
+      static_cast<uint64_t>(begin) + job->chunk, job->end);
+  for (uint32_t task = begin; task < end; ++task) {
+    job->func(job->jpegxl_opaque, task, thread);
+  }
+  return true;
+}
+
+void ThreadParallelRunner::HelpNestedJobs(const int thread) {
+  std::unique_lock<std::mutex> lock(nested_mutex_);
+  if (--num_running_ == 0) nested_cv_.notify_all();
+  for (;;) {
+    NestedJob* job = nullptr;
+    for (NestedJob* candidate : nested_jobs_) {
+      if (candidate->next.load(std::memory_order_relaxed) < candidate->end) {
+        job = candidate;
+        break;
+      }
+    }
+    if (job != nullptr) {
+      job->num_users++;
+      lock.unlock();
+      RunNestedChunk(job, thread);
+      lock.lock();
+      if (--job->num_users == 0) nested_cv_.notify_all();
+      continue;
+    }
+    // The nested jobs are started and waited for by tasks of the range.
+    if (num_running_ == 0) return;
+    nested_cv_.wait(lock);
+  }
+}
+
+template <class Done>
+bool ThreadParallelRunner::SpinUntil(const Done& done) const {
+  const uint64_t spin_nanoseconds =
+      spin_nanoseconds_.load(std::memory_order_relaxed);
+  if (spin_nanoseconds == 0) return done();
+  const int64_t deadline = NowNanoseconds() + spin_nanoseconds;
+  for (;;) {
+    // Reading the clock costs more than checking `done`.
+    for (int i = 0; i < 64; i++) {
+      if (done()) return true;
+      CpuRelax();
+    }
+    if (NowNanoseconds() >= deadline) return done();
+  }
+}
+
+void ThreadParallelRunner::WorkersReadyBarrier() {
+  const uint32_t num_workers = threads_.size();
+  SpinUntil([this, num_workers] {
+    return workers_ready_.load(std::memory_order_acquire) == num_workers;
+  });
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Typically no iteration after spinning.
+  while (workers_ready_.load(std::memory_order_relaxed) != num_workers) {
+    main_parked_ = true;
+    workers_ready_cv_.wait(lock);
+  }
+  main_parked_ = false;
+  workers_ready_.store(0, std::memory_order_relaxed);
+
+  // Not a command until the next StartWorkers.
+  worker_start_command_ = kWorkerWait;
+}
+
+void ThreadParallelRunner::StartWorkers(const WorkerCommand worker_command) {
+  bool any_parked;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    worker_start_command_ = worker_command;
+    start_nanoseconds_.store(NowNanoseconds(), std::memory_order_relaxed);
+    command_generation_.fetch_add(1, std::memory_order_release);
+    any_parked = num_parked_ != 0;
+  }
+  // One notification for all the parked workers, none if they all spin.
+  // Workers will need the lock, so it is released before they wake up.
+  if (any_parked) worker_start_cv_.notify_all();
+}
+
+ThreadParallelRunner::WorkerCommand ThreadParallelRunner::WaitForCommand(
+    const uint64_t generation, const int thread) {
+  bool parked = false;
+  if (!SpinUntil([this, generation] {
+        return command_generation_.load(std::memory_order_acquire) !=
+               generation;
+      })) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (command_generation_.load(std::memory_order_relaxed) == generation) {
+      parked = true;
+      num_parked_++;
+      // Loops to safely handle spurious wakeups.
+      while (command_generation_.load(std::memory_order_relaxed) ==
+             generation) {
+        worker_start_cv_.wait(lock);
+      }
+      num_parked_--;
+    }
+  }
+
+  const uint64_t latency = std::max<int64_t>(
+      NowNanoseconds() - start_nanoseconds_.load(std::memory_order_relaxed),
+      0);
+  // Only written by this worker.
+  WorkerWakeStats& stats = wake_stats_[thread];
+  const auto add = [](std::atomic<uint64_t>* value, uint64_t amount) {
+    value->store(value->load(std::memory_order_relaxed) + amount,
+                 std::memory_order_relaxed);
+  };
+  add(&stats.num_wakeups, 1);
+  add(&stats.num_parked_wakeups, parked ? 1 : 0);
+  add(&stats.total_nanoseconds, latency);
+  if (latency > stats.max_nanoseconds.load(std::memory_order_relaxed)) {
+    stats.max_nanoseconds.store(latency, std::memory_order_relaxed);
+  }
+  return worker_start_command_;
+}
+
+ThreadParallelRunner::WakeStats ThreadParallelRunner::GetWakeStats() const {
+  WakeStats total;
+  for (uint32_t i = 0; i < num_worker_threads_; i++) {
+    const WorkerWakeStats& stats = wake_stats_[i];
+    total.num_wakeups += stats.num_wakeups.load(std::memory_order_relaxed);
+    total.num_parked_wakeups +=
+        stats.num_parked_wakeups.load(std::memory_order_relaxed);
+    total.total_nanoseconds +=
+        stats.total_nanoseconds.load(std::memory_order_relaxed);
+    total.max_nanoseconds = std::max<uint64_t>(
+        total.max_nanoseconds,
+        stats.max_nanoseconds.load(std::memory_order_relaxed));
+  }
+  return total;
+}
+
 // static
 void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
                                       const int thread) {
+  current_worker.runner = self;
+  current_worker.thread = thread;
+  // The generation of the last command, none yet: the main thread waits for
+  // all workers to be ready before sending the first one.
+  uint64_t generation = 0;
   // Until kWorkerExit command received:
   for (;;) {
-    std::unique_lock<std::mutex> lock(self->mutex_);
-    // Notify main thread that this thread is ready.
-    if (++self->workers_ready_ == self->num_threads_) {
-      self->workers_ready_cv_.notify_one();
+    {
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      // Notify main thread that this thread is ready.
+      if (self->workers_ready_.fetch_add(1, std::memory_order_release) + 1 ==
+              self->num_threads_ &&
+          self->main_parked_) {
+        self->workers_ready_cv_.notify_one();
+      }
     }
-  RESUME_WAIT:
-    // Wait for a command.
-    self->worker_start_cv_.wait(lock);
-    const WorkerCommand command = self->worker_start_command_;
+    const WorkerCommand command = self->WaitForCommand(generation, thread);
+    generation++;
+    JXL_ASSERT(command != kWorkerWait);
     switch (command) {
-      case kWorkerWait:    // spurious wakeup:
-        goto RESUME_WAIT;  // lock still held, avoid incrementing ready.
       case kWorkerOnce:
-        lock.unlock();
         self->data_func_(self->jpegxl_opaque_, thread, thread);
         break;
       case kWorkerExit:
         return;  // exits thread
       default:
-        lock.unlock();
-        RunRange(self, command, thread);
+        RunRange(self, thread);
+        self->HelpNestedJobs(thread);
         break;
     }
   }
@@ -185,11 +498,19 @@ ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
 
   threads_.reserve(num_worker_threads_);
 
-  // Suppress "unused-private-field" warning.
-  (void)padding1;
-  (void)padding2;
+  // Spinning only helps if the spinning workers and the main thread do not
+  // take the cores of each other.
+  spin_nanoseconds_.store(
+      std::thread::hardware_concurrency() > num_worker_threads_
+          ? kDefaultSpinNanoseconds
+          : 0,
+      std::memory_order_relaxed);
+  wake_stats_.reset(new WorkerWakeStats[num_worker_threads_]);
+  worker_groups_.assign(num_worker_threads_, 0);
+  group_ranges_.reset(new GroupRange[1]);
+  group_ranges_[0].num_workers = num_worker_threads_;
 
-  // Safely handle spurious worker wakeups.
+  // Not a command until the first StartWorkers.
   worker_start_command_ = kWorkerWait;
 
   for (uint32_t i = 0; i < num_worker_threads_; ++i) {
@@ -206,6 +527,70 @@ ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
       [](const int task, const int thread) { PROFILER_ZONE("@InitWorkers"); });
 }
 
+bool ThreadParallelRunner::SetAffinity(const size_t* cpus,
+                                       const size_t* groups) {
+  if (groups != nullptr) {
+    for (uint32_t i = 0; i < num_worker_threads_; i++) {
+      if (groups[i] >= num_worker_threads_) return false;
+    }
+  }
+  if (cpus != nullptr) {
+#if JXL_THREADS_HAVE_AFFINITY
+    for (uint32_t i = 0; i < num_worker_threads_; i++) {
+      if (cpus[i] >= CPU_SETSIZE) return false;
+    }
+    for (uint32_t i = 0; i < num_worker_threads_; i++) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[i], &set);
+      if (pthread_setaffinity_np(threads_[i].native_handle(), sizeof(set),
+                                 &set) != 0) {
+        return false;
+      }
+    }
+#else
+    return false;
+#endif
+  }
+
+  uint32_t num_groups = 1;
+  for (uint32_t i = 0; i < num_worker_threads_; i++) {
+    worker_groups_[i] = groups == nullptr ? 0 : groups[i];
+    num_groups = std::max<uint32_t>(num_groups, worker_groups_[i] + 1);
+  }
+  num_groups_ = num_groups;
+  group_ranges_.reset(new GroupRange[num_groups]);
+  for (uint32_t i = 0; i < num_worker_threads_; i++) {
+    group_ranges_[worker_groups_[i]].num_workers++;
+  }
+  return true;
+}
+
+bool ThreadParallelRunner::SetNumaAffinity() {
+#if JXL_THREADS_HAVE_AFFINITY
+  const std::vector<std::pair<size_t, size_t>> node_cpus = NumaCpus();
+  if (node_cpus.empty()) return false;
+  // Spreads the workers evenly over the CPUs, which are sorted by node, and
+  // numbers the groups of the nodes that get workers from 0.
+  std::vector<size_t> cpus(num_worker_threads_);
+  std::vector<size_t> groups(num_worker_threads_);
+  size_t group = 0;
+  size_t index_before = 0;
+  for (uint32_t i = 0; i < num_worker_threads_; i++) {
+    const size_t index =
+        static_cast<uint64_t>(i) * node_cpus.size() / num_worker_threads_;
+    const std::pair<size_t, size_t>& node_cpu = node_cpus[index];
+    if (i != 0 && node_cpu.first != node_cpus[index_before].first) group++;
+    index_before = index;
+    cpus[i] = node_cpu.second;
+    groups[i] = group;
+  }
+  return SetAffinity(cpus.data(), groups.data());
+#else
+  return false;
+#endif
+}
+
 ThreadParallelRunner::~ThreadParallelRunner() {
   if (num_worker_threads_ != 0) {
     StartWorkers(kWorkerExit);
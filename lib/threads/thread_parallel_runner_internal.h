@@ -24,6 +24,15 @@
 // 10-20x higher when using std::async, and ~200x for a queue-based thread
 // pool.
 //
+// The workers can be pinned to CPUs and grouped, e.g. by NUMA node, see
+// SetAffinity: each group then first takes the tasks of its own contiguous
+// part of the range, so that successive Runner calls over the same groups of
+// an image process each of them on the same node.
+//
+// A task may call Runner again, e.g. for an inner loop over the channels of a
+// group: the inner tasks are taken by the calling worker and by the workers
+// that ran out of tasks of the outer call, instead of running serially.
+//
 // Usage:
 //   ThreadParallelRunner runner;
 //   JxlDecode(
@@ -38,6 +47,7 @@
 
 #include <atomic>
 #include <condition_variable>  //NOLINT
+#include <memory>
 #include <mutex>               //NOLINT
 #include <thread>              //NOLINT
 #include <vector>
@@ -91,14 +101,44 @@ class ThreadParallelRunner {
     WorkersReadyBarrier();
   }
 
+  // Pins worker i to CPU cpus[i], unless cpus is null, and puts it in group
+  // groups[i] < NumWorkerThreads(), or all in one group if groups is null.
+  // Returns false, with the groups unchanged, if the platform cannot pin
+  // threads or an index is out of range. Not thread-safe: only called
+  // between Runner calls.
+  bool SetAffinity(const size_t* cpus, const size_t* groups);
+
+  // SetAffinity with the workers spread over the CPUs that the process may
+  // use and grouped by their NUMA node. Returns false if the topology is not
+  // known, e.g. on other platforms than Linux.
+  bool SetNumaAffinity();
+
+  // See JxlThreadParallelRunnerSetSpinDuration.
+  void SetSpinDuration(uint64_t nanoseconds) {
+    spin_nanoseconds_.store(nanoseconds, std::memory_order_relaxed);
+  }
+
+  // Wake-up latency of the workers since construction, see
+  // JxlThreadParallelRunnerWakeStats.
+  struct WakeStats {
+    uint64_t num_wakeups = 0;
+    uint64_t num_parked_wakeups = 0;
+    uint64_t total_nanoseconds = 0;
+    uint64_t max_nanoseconds = 0;
+  };
+  WakeStats GetWakeStats() const;
+
   JxlMemoryManager memory_manager;
 
  private:
   // After construction and between calls to Run, workers are "ready", i.e.
-  // waiting on worker_start_cv_. They are "started" by sending a "command"
-  // and notifying all worker_start_cv_ waiters. (That is why all workers
-  // must be ready/waiting - otherwise, the notification will not reach all of
-  // them and the main thread waits in vain for them to report readiness.)
+  // spinning on command_generation_ and then, after the spin duration,
+  // waiting on worker_start_cv_. They are "started" by sending a "command",
+  // incrementing command_generation_ and notifying all worker_start_cv_
+  // waiters, if any worker waits. (That is why all workers must be ready -
+  // otherwise, they could miss a command and the main thread waits in vain
+  // for them to report readiness.) The main thread likewise spins before
+  // waiting for the workers to be ready.
   using WorkerCommand = uint64_t;
 
   // Special values; all others encode the begin/end parameters. Note that all
@@ -115,31 +155,68 @@ class ThreadParallelRunner {
     (*reinterpret_cast<const Closure*>(f))(task, thread);
   }
 
-  void WorkersReadyBarrier() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    // Typically only a single iteration.
-    while (workers_ready_ != threads_.size()) {
-      workers_ready_cv_.wait(lock);
-    }
-    workers_ready_ = 0;
-
-    // Safely handle spurious worker wakeups.
-    worker_start_command_ = kWorkerWait;
-  }
+  void WorkersReadyBarrier();
 
   // Precondition: all workers are ready.
-  void StartWorkers(const WorkerCommand worker_command) {
-    mutex_.lock();
-    worker_start_command_ = worker_command;
-    // Workers will need this lock, so release it before they wake up.
-    mutex_.unlock();
-    worker_start_cv_.notify_all();
-  }
+  void StartWorkers(const WorkerCommand worker_command);
 
-  // Attempts to reserve and perform some work from the global range of tasks,
-  // which is encoded within "command". Returns after all tasks are reserved.
-  static void RunRange(ThreadParallelRunner* self, const WorkerCommand command,
-                       const int thread);
+  // Spins until `done` returns true or the spin duration elapses. Returns
+  // whether `done` returned true.
+  template <class Done>
+  bool SpinUntil(const Done& done) const;
+
+  // Waits for the command after command_generation_ == "generation", records
+  // the wake-up latency and returns the command.
+  WorkerCommand WaitForCommand(uint64_t generation, int thread);
+
+  // Contiguous part of the range of tasks of a Runner call, taken first by
+  // the workers of one group.
+  struct GroupRange {
+    std::atomic<uint32_t> num_reserved{0};
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    uint32_t num_workers = 0;
+    // Avoids false sharing of num_reserved between groups.
+    uint8_t padding[64];
+  };
+
+  // Splits [begin, end) between the groups in proportion to their number of
+  // workers. Called before starting the workers.
+  void SplitRange(uint32_t begin, uint32_t end);
+
+  // Attempts to reserve and perform some work from the range of the group of
+  // "thread", then from those of the other groups. Returns after all tasks
+  // are reserved.
+  static void RunRange(ThreadParallelRunner* self, const int thread);
+
+  // Same for the range of one group, with reservations sized for
+  // "num_workers" workers sharing it.
+  static void RunGroupRange(ThreadParallelRunner* self, GroupRange* range,
+                            uint32_t num_workers, const int thread);
+
+  // A Runner call made by a task running on a worker.
+  struct NestedJob {
+    JxlParallelRunFunction func;
+    void* jpegxl_opaque;
+    std::atomic<uint32_t> next;
+    uint32_t end;
+    uint32_t chunk;
+    // Guarded by nested_mutex_.
+    size_t num_users = 0;
+  };
+
+  // Runs the tasks of a nested Runner call on the calling worker "thread",
+  // helped by the idle workers, and returns once they are all done.
+  void RunNested(void* jpegxl_opaque, JxlParallelRunFunction func,
+                 uint32_t start_range, uint32_t end_range, int thread);
+
+  // Runs the next chunk of tasks of the job, returns false if there were none.
+  static bool RunNestedChunk(NestedJob* job, int thread);
+
+  // Called by each worker once it is out of tasks of the current range: helps
+  // with the nested jobs until all workers are out of tasks, after which no
+  // new nested job can start.
+  void HelpNestedJobs(int thread);
 
   static void ThreadFunc(ThreadParallelRunner* self, int thread);
 
@@ -153,18 +230,49 @@ class ThreadParallelRunner {
 
   std::mutex mutex_;  // guards both cv and their variables.
   std::condition_variable workers_ready_cv_;
-  uint32_t workers_ready_ = 0;
+  // Modified with mutex_ held, also read without it by the spinning main
+  // thread.
+  std::atomic<uint32_t> workers_ready_{0};
+  // Whether the main thread waits on workers_ready_cv_.
+  bool main_parked_ = false;
   std::condition_variable worker_start_cv_;
   WorkerCommand worker_start_command_;
+  // Incremented with mutex_ held after each new worker_start_command_, read
+  // without it by the spinning workers.
+  std::atomic<uint64_t> command_generation_{0};
+  // Number of workers waiting on worker_start_cv_.
+  uint32_t num_parked_ = 0;
+  // steady_clock time of the last StartWorkers, in nanoseconds.
+  std::atomic<int64_t> start_nanoseconds_{0};
+  std::atomic<uint64_t> spin_nanoseconds_;
+
+  // Per-worker WakeStats; padding avoids false sharing.
+  struct WorkerWakeStats {
+    std::atomic<uint64_t> num_wakeups{0};
+    std::atomic<uint64_t> num_parked_wakeups{0};
+    std::atomic<uint64_t> total_nanoseconds{0};
+    std::atomic<uint64_t> max_nanoseconds{0};
+    uint8_t padding[64];
+  };
+  std::unique_ptr<WorkerWakeStats[]> wake_stats_;
 
   // Written by main thread, read by workers (after mutex lock/unlock).
   JxlParallelRunFunction data_func_;
   void* jpegxl_opaque_;
 
-  // Updated by workers; padding avoids false sharing.
-  uint8_t padding1[64];
-  std::atomic<uint32_t> num_reserved_{0};
-  uint8_t padding2[64];
+  std::mutex nested_mutex_;  // guards the variables below and num_users.
+  // Notified when a nested job starts, when the number of users of a job or
+  // num_running_ drops to zero.
+  std::condition_variable nested_cv_;
+  std::vector<NestedJob*> nested_jobs_;
+  // Number of workers that may still run tasks of the current range.
+  uint32_t num_running_ = 0;
+
+  // Group of each worker, see SetAffinity.
+  std::vector<uint32_t> worker_groups_;
+  uint32_t num_groups_ = 1;
+  // num_groups_ entries, updated by workers.
+  std::unique_ptr<GroupRange[]> group_ranges_;
 };
 
 }  // namespace jpegxl
@@ -115,5 +115,91 @@ TEST(ThreadParallelRunnerTest, TestCounter) {
   EXPECT_EQ(expected, counters[0].counter);
 }
 
+// Tasks may run loops on the same pool: the inner tasks all run, also when
+// there are fewer outer tasks than threads, and the outer loops can still be
+// run again after them.
+TEST(ThreadParallelRunnerTest, TestNested) {
+  const int kNumThreads = 8;
+  jxl::ThreadPoolInternal pool(kNumThreads);
+  for (int num_outer = 1; num_outer <= 2 * kNumThreads; num_outer *= 2) {
+    const int kNumInner = 100;
+    std::vector<std::atomic<int>> counts(num_outer * kNumInner);
+    for (std::atomic<int>& count : counts) count.store(0);
+    EXPECT_TRUE(RunOnPool(
+        &pool, 0, num_outer, jxl::ThreadPool::NoInit,
+        [&](const int outer, const int thread) {
+          EXPECT_TRUE(RunOnPool(
+              &pool, 0, kNumInner,
+              [](size_t num_threads) { return num_threads <= kNumThreads; },
+              [&](const int inner, const int inner_thread) {
+                EXPECT_LT(inner_thread, kNumThreads);
+                counts[outer * kNumInner + inner].fetch_add(1);
+              },
+              "TestNestedInner"));
+        },
+        "TestNested"));
+    for (const std::atomic<int>& count : counts) {
+      EXPECT_EQ(1, count.load());
+    }
+  }
+}
+
+// With groups of workers and with the NUMA affinity, when the platform
+// supports it, every task still runs exactly once.
+TEST(ThreadParallelRunnerTest, TestGroups) {
+  const int kNumThreads = 6;
+  ThreadParallelRunner runner(kNumThreads);
+  jxl::ThreadPool pool(&ThreadParallelRunner::Runner, &runner);
+  const size_t kInvalidGroups[kNumThreads] = {0, 0, 1, 1, 2, kNumThreads};
+  EXPECT_FALSE(runner.SetAffinity(nullptr, kInvalidGroups));
+  // Group 2 has no workers, the other groups take its part.
+  const size_t kGroups[kNumThreads] = {0, 3, 3, 1, 1, 1};
+  const auto run_all = [&]() {
+    for (int num_tasks = 0; num_tasks < 40; ++num_tasks) {
+      std::vector<std::atomic<int>> counts(num_tasks);
+      for (std::atomic<int>& count : counts) count.store(0);
+      EXPECT_TRUE(RunOnPool(
+          &pool, 10, 10 + num_tasks, jxl::ThreadPool::NoInit,
+          [&](const int task, const int thread) {
+            EXPECT_LT(thread, kNumThreads);
+            counts[task - 10].fetch_add(1);
+          },
+          "TestGroups"));
+      for (const std::atomic<int>& count : counts) {
+        EXPECT_EQ(1, count.load());
+      }
+    }
+  };
+  EXPECT_TRUE(runner.SetAffinity(nullptr, kGroups));
+  run_all();
+  if (runner.SetNumaAffinity()) run_all();
+  EXPECT_TRUE(runner.SetAffinity(nullptr, nullptr));
+  run_all();
+}
+
+// Every worker wakes up once per call, whether it spins or sleeps.
+TEST(ThreadParallelRunnerTest, TestWakeStats) {
+  const int kNumThreads = 3;
+  for (uint64_t spin_nanoseconds : {0, 1000000}) {
+    ThreadParallelRunner runner(kNumThreads);
+    runner.SetSpinDuration(spin_nanoseconds);
+    jxl::ThreadPool pool(&ThreadParallelRunner::Runner, &runner);
+    const ThreadParallelRunner::WakeStats before = runner.GetWakeStats();
+    const int kNumCalls = 50;
+    std::atomic<int> num_tasks{0};
+    for (int i = 0; i < kNumCalls; i++) {
+      EXPECT_TRUE(RunOnPool(
+          &pool, 0, 10, jxl::ThreadPool::NoInit,
+          [&num_tasks](const int task, const int thread) { num_tasks++; },
+          "TestWakeStats"));
+    }
+    EXPECT_EQ(10 * kNumCalls, num_tasks.load());
+    const ThreadParallelRunner::WakeStats after = runner.GetWakeStats();
+    EXPECT_EQ(kNumThreads * kNumCalls, after.num_wakeups - before.num_wakeups);
+    EXPECT_LE(after.num_parked_wakeups, after.num_wakeups);
+    EXPECT_LE(after.max_nanoseconds, after.total_nanoseconds);
+  }
+}
+
 }  // namespace
 }  // namespace jpegxl
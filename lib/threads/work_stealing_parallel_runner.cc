@@ -0,0 +1,227 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "jxl/work_stealing_parallel_runner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace jpegxl {
+namespace {
+
+// A thread pool in which every participating thread owns a contiguous part of
+// the range of tasks. The owner takes tasks from the front of its part, in
+// chunks that get smaller as the part shrinks; threads without work steal the
+// back half of the part of another thread. Both only use a compare-exchange on
+// the 64-bit word holding the part, so there is no shared counter or lock on
+// the fast path.
+struct WorkStealingParallelRunner {
+  explicit WorkStealingParallelRunner(size_t num_worker_threads)
+      : parts_(new Part[num_worker_threads + 1]) {
+    workers_.reserve(num_worker_threads);
+    for (size_t i = 0; i < num_worker_threads; i++) {
+      workers_.emplace_back([this, i]() { WorkerBody(i + 1); });
+    }
+  }
+
+  ~WorkStealingParallelRunner() {
+    {
+      std::unique_lock<std::mutex> l(state_mutex_);
+      exit_ = true;
+      workers_can_proceed_.notify_all();
+    }
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  JxlParallelRetCode Run(void* jxl_opaque, JxlParallelRunInit init,
+                         JxlParallelRunFunction func, uint32_t start,
+                         uint32_t end) {
+    if (start >= end) return 0;
+    const size_t num_threads =
+        std::min<size_t>(workers_.size() + 1, end - start);
+    JxlParallelRetCode ret = init(jxl_opaque, num_threads);
+    if (ret != 0) return ret;
+
+    if (num_threads == 1) {
+      for (uint32_t task = start; task < end; task++) {
+        func(jxl_opaque, task, 0);
+      }
+      return 0;
+    }
+
+    // Split the range evenly between the participating threads.
+    const uint64_t num_tasks = end - start;
+    for (size_t i = 0; i < num_threads; i++) {
+      const uint32_t begin = start + num_tasks * i / num_threads;
+      const uint32_t part_end = start + num_tasks * (i + 1) / num_threads;
+      parts_[i].range.store(Pack(begin, part_end), std::memory_order_relaxed);
+    }
+
+    {
+      std::unique_lock<std::mutex> l(state_mutex_);
+      func_ = func;
+      jxl_opaque_ = jxl_opaque;
+      num_threads_ = num_threads;
+      num_running_workers_ = num_threads - 1;
+      generation_++;
+      workers_can_proceed_.notify_all();
+    }
+
+    RunTasks(0);
+
+    std::unique_lock<std::mutex> l(state_mutex_);
+    while (num_running_workers_ != 0) {
+      work_done_.wait(l);
+    }
+    return 0;
+  }
+
+ private:
+  // The range [begin, end) of a part, packed in one word so that it can be
+  // updated atomically by the owner and by thieves.
+  static uint64_t Pack(uint32_t begin, uint32_t end) {
+    return (static_cast<uint64_t>(begin) << 32) | end;
+  }
+  static uint32_t Begin(uint64_t range) { return range >> 32; }
+  static uint32_t End(uint64_t range) { return range & 0xFFFFFFFFu; }
+
+  // Part of the range owned by one thread; padding avoids false sharing.
+  struct Part {
+    std::atomic<uint64_t> range{0};
+    uint8_t padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  void WorkerBody(size_t thread) {
+    uint64_t seen_generation = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> l(state_mutex_);
+        while (!exit_ && (generation_ == seen_generation ||
+                          thread >= num_threads_)) {
+          // Also skip the runs that need fewer threads, without counting this
+          // worker as running.
+          seen_generation = generation_;
+          workers_can_proceed_.wait(l);
+        }
+        if (exit_) return;
+        seen_generation = generation_;
+      }
+      RunTasks(thread);
+      std::unique_lock<std::mutex> l(state_mutex_);
+      if (--num_running_workers_ == 0) {
+        work_done_.notify_all();
+      }
+    }
+  }
+
+  // Takes a chunk of tasks from the front of the own part. The chunk gets
+  // smaller as the part shrinks, so that there is something left to steal
+  // while the part is large, and the tail is balanced at a fine grain.
+  bool TakeOwn(Part* part, uint32_t* begin, uint32_t* end) {
+    uint64_t range = part->range.load(std::memory_order_acquire);
+    while (true) {
+      const uint32_t b = Begin(range);
+      const uint32_t e = End(range);
+      if (b >= e) return false;
+      const uint32_t chunk =
+          std::max<uint32_t>(1, (e - b) / (2 * num_threads_));
+      if (part->range.compare_exchange_weak(range, Pack(b + chunk, e),
+                                            std::memory_order_acq_rel)) {
+        *begin = b;
+        *end = b + chunk;
+        return true;
+      }
+    }
+  }
+
+  // Steals the back half of the part of another thread, rounded up so that a
+  // single remaining task can be stolen too.
+  bool Steal(Part* victim, uint32_t* begin, uint32_t* end) {
+    uint64_t range = victim->range.load(std::memory_order_acquire);
+    while (true) {
+      const uint32_t b = Begin(range);
+      const uint32_t e = End(range);
+      if (b >= e) return false;
+      const uint32_t mid = b + (e - b) / 2;
+      if (victim->range.compare_exchange_weak(range, Pack(b, mid),
+                                              std::memory_order_acq_rel)) {
+        *begin = mid;
+        *end = e;
+        return true;
+      }
+    }
+  }
+
+  void RunTasks(size_t thread) {
+    Part* own = &parts_[thread];
+    uint32_t begin, end;
+    while (true) {
+      while (TakeOwn(own, &begin, &end)) {
+        for (uint32_t task = begin; task < end; task++) {
+          func_(jxl_opaque_, task, thread);
+        }
+      }
+      // Out of work: look for a victim, starting with the next thread.
+      bool stole = false;
+      for (size_t i = 1; i < num_threads_ && !stole; i++) {
+        stole = Steal(&parts_[(thread + i) % num_threads_], &begin, &end);
+      }
+      // Nothing left anywhere; the tasks that others already took are
+      // finished by them.
+      if (!stole) return;
+      // Make the stolen tasks available to other thieves as well.
+      own->range.store(Pack(begin, end), std::memory_order_release);
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::unique_ptr<Part[]> parts_;
+
+  // Workers can start a new run or exit (generation_ or exit_ changed).
+  std::condition_variable workers_can_proceed_;
+  // All the workers of the current run are done (num_running_workers_ == 0).
+  std::condition_variable work_done_;
+
+  // Protects all the remaining variables, except for func_, jxl_opaque_ and
+  // num_threads_, for which only the write by the main thread is protected,
+  // and subsequent uses by workers happen-after it.
+  std::mutex state_mutex_;
+  uint64_t generation_ = 0;
+  bool exit_ = false;
+  size_t num_running_workers_ = 0;
+
+  JxlParallelRunFunction func_ = nullptr;
+  void* jxl_opaque_ = nullptr;  // not owned
+  size_t num_threads_ = 0;
+};
+
+}  // namespace
+}  // namespace jpegxl
+
+extern "C" {
+JXL_THREADS_EXPORT JxlParallelRetCode JxlWorkStealingParallelRunner(
+    void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
+    JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range) {
+  return static_cast<jpegxl::WorkStealingParallelRunner*>(runner_opaque)
+      ->Run(jpegxl_opaque, init, func, start_range, end_range);
+}
+
+JXL_THREADS_EXPORT void* JxlWorkStealingParallelRunnerCreate(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads) {
+  return new jpegxl::WorkStealingParallelRunner(num_worker_threads);
+}
+
+JXL_THREADS_EXPORT void JxlWorkStealingParallelRunnerDestroy(
+    void* runner_opaque) {
+  delete static_cast<jpegxl::WorkStealingParallelRunner*>(runner_opaque);
+}
+}
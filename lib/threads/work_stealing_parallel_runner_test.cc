@@ -0,0 +1,91 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "jxl/work_stealing_parallel_runner.h"
+
+#include <atomic>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "jxl/work_stealing_parallel_runner_cxx.h"
+#include "lib/jxl/base/data_parallel.h"
+
+namespace jpegxl {
+namespace {
+
+// Ensures every task in the range runs exactly once with a thread index below
+// the number of threads passed to init, for various pool and range sizes, and
+// that the runner can be reused and destroyed.
+TEST(WorkStealingParallelRunnerTest, TestRanges) {
+  for (size_t num_threads : {0, 1, 2, 3, 8, 17}) {
+    JxlWorkStealingParallelRunnerPtr runner =
+        JxlWorkStealingParallelRunnerMake(nullptr, num_threads);
+    jxl::ThreadPool pool(JxlWorkStealingParallelRunner, runner.get());
+    for (uint32_t num_tasks : {0u, 1u, 2u, 5u, 31u, 1000u, 100000u}) {
+      for (uint32_t begin : {0u, 7u}) {
+        std::vector<std::atomic<int>> calls(num_tasks);
+        for (auto& c : calls) c.store(0);
+        size_t init_threads = 0;
+        EXPECT_TRUE(RunOnPool(
+            &pool, begin, begin + num_tasks,
+            [&init_threads](size_t threads) {
+              init_threads = threads;
+              return true;
+            },
+            [&](const uint32_t task, size_t thread) {
+              EXPECT_GE(task, begin);
+              EXPECT_LT(task, begin + num_tasks);
+              EXPECT_LT(thread, init_threads);
+              calls[task - begin].fetch_add(1, std::memory_order_relaxed);
+            },
+            "TestRanges"));
+        for (uint32_t i = 0; i < num_tasks; i++) {
+          EXPECT_EQ(1, calls[i].load()) << "task " << begin + i;
+        }
+      }
+    }
+  }
+}
+
+// Tasks with very uneven costs: threads whose part finishes early have to
+// steal from the others for all of them to be processed.
+TEST(WorkStealingParallelRunnerTest, TestUnevenTasks) {
+  JxlWorkStealingParallelRunnerPtr runner =
+      JxlWorkStealingParallelRunnerMake(nullptr, 4);
+  jxl::ThreadPool pool(JxlWorkStealingParallelRunner, runner.get());
+  const uint32_t kNumTasks = 512;
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> mix{0};
+  EXPECT_TRUE(RunOnPool(
+      &pool, 0, kNumTasks, jxl::ThreadPool::NoInit,
+      [&sum, &mix](const uint32_t task, size_t thread) {
+        // The first tasks are much more expensive than the others.
+        uint64_t value = task;
+        const uint32_t iters = task < 16 ? 200000 : 10;
+        for (uint32_t i = 0; i < iters; i++) {
+          value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+        mix.fetch_xor(value, std::memory_order_relaxed);
+        sum.fetch_add(task, std::memory_order_relaxed);
+      },
+      "TestUnevenTasks"));
+  EXPECT_EQ(kNumTasks * (kNumTasks - 1) / 2, sum.load());
+}
+
+// An error returned by init is propagated and no task runs.
+TEST(WorkStealingParallelRunnerTest, TestInitError) {
+  JxlWorkStealingParallelRunnerPtr runner =
+      JxlWorkStealingParallelRunnerMake(nullptr, 3);
+  jxl::ThreadPool pool(JxlWorkStealingParallelRunner, runner.get());
+  std::atomic<int> num_calls{0};
+  EXPECT_FALSE(RunOnPool(
+      &pool, 0, 100, [](size_t) { return false; },
+      [&num_calls](const uint32_t task, size_t thread) { num_calls++; },
+      "TestInitError"));
+  EXPECT_EQ(0, num_calls.load());
+}
+
+}  // namespace
+}  // namespace jpegxl
@@ -44,11 +44,23 @@ struct _GdkPixbufJxlAnimation {
   JxlDecoder *decoder;
   JxlPixelFormat pixel_format;
 
+  // Input not consumed by the decoder yet. Until the downsampling factor is
+  // chosen, this is all the input, so that the decoder can be rewound.
+  GByteArray *input;
+  gboolean got_basic_info;
+  gboolean downsampling_chosen;
+
+  // Output of the decoder for the current frame, in `pixel_format`, converted
+  // to the frame pixbuf when the frame or a progressive step of it is ready.
+  gpointer out_buffer;
+  size_t out_buffer_size;
+
   // Decoding is `done` when JXL_DEC_SUCCESS is received; calling
   // load_increment afterwards gives an error.
   gboolean done;
 
-  // Image information.
+  // Image information; xsize and ysize are those of the decoded frames, after
+  // downsampling.
   size_t xsize;
   size_t ysize;
   gboolean alpha_premultiplied;
@@ -144,6 +156,10 @@ static void gdk_pixbuf_jxl_animation_finalize(GObject *obj) {
   }
   JxlResizableParallelRunnerDestroy(decoder_state->parallel_runner);
   JxlDecoderDestroy(decoder_state->decoder);
+  if (decoder_state->input != NULL) {
+    g_byte_array_free(decoder_state->input, /*free_segment=*/TRUE);
+  }
+  g_free(decoder_state->out_buffer);
   g_free(decoder_state->icc_buff);
 }
 
@@ -282,6 +298,8 @@ static gpointer begin_load(GdkPixbufModuleSizeFunc size_func,
     goto cleanup;
   }
 
+  decoder_state->input = g_byte_array_new();
+
   if (!(decoder_state->parallel_runner =
             JxlResizableParallelRunnerCreate(NULL))) {
     g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
@@ -305,13 +323,15 @@ static gpointer begin_load(GdkPixbufModuleSizeFunc size_func,
     goto cleanup;
   }
   if ((status = JxlDecoderSubscribeEvents(
-           decoder_state->decoder, JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING |
-                                       JXL_DEC_FULL_IMAGE | JXL_DEC_FRAME)) !=
-      JXL_DEC_SUCCESS) {
+           decoder_state->decoder,
+           JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_FULL_IMAGE |
+               JXL_DEC_FRAME | JXL_DEC_FRAME_PROGRESSION)) != JXL_DEC_SUCCESS) {
     g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
                 "JxlDecoderSubscribeEvents failed: %x", status);
     goto cleanup;
   }
+  // Show the image after the DC and after each pass.
+  JxlDecoderSetProgressiveDetail(decoder_state->decoder, 1);
 
   decoder_state->pixel_format.data_type = JXL_TYPE_FLOAT;
   decoder_state->pixel_format.endianness = JXL_NATIVE_ENDIAN;
@@ -329,9 +349,9 @@ static gboolean stop_load(gpointer context, GError **error) {
   return TRUE;
 }
 
-static void draw_pixels(void *context, size_t x, size_t y, size_t num_pixels,
-                        const void *pixels) {
-  GdkPixbufJxlAnimation *decoder_state = context;
+// Converts the decoded pixels of the current frame to its pixbuf, and reports
+// the update.
+static void update_frame(GdkPixbufJxlAnimation *decoder_state) {
   gboolean has_alpha = decoder_state->pixel_format.num_channels == 4;
 
   GdkPixbuf *output =
@@ -339,18 +359,41 @@ static void draw_pixels(void *context, size_t x, size_t y, size_t num_pixels,
                     decoder_state->frames->len - 1)
           .data;
 
-  guchar *dst = gdk_pixbuf_get_pixels(output) +
-                decoder_state->pixel_format.num_channels * x +
-                gdk_pixbuf_get_rowstride(output) * y;
-
-  skcms_Transform(
-      pixels,
-      has_alpha ? skcms_PixelFormat_RGBA_ffff : skcms_PixelFormat_RGB_fff,
-      decoder_state->alpha_premultiplied ? skcms_AlphaFormat_PremulAsEncoded
-                                         : skcms_AlphaFormat_Unpremul,
-      &decoder_state->icc, dst,
-      has_alpha ? skcms_PixelFormat_RGBA_8888 : skcms_PixelFormat_RGB_888,
-      skcms_AlphaFormat_Unpremul, skcms_sRGB_profile(), num_pixels);
+  size_t src_stride = decoder_state->xsize *
+                      decoder_state->pixel_format.num_channels * sizeof(float);
+  for (size_t y = 0; y < decoder_state->ysize; y++) {
+    const guchar *src = (const guchar *)decoder_state->out_buffer +
+                        src_stride * y;
+    guchar *dst =
+        gdk_pixbuf_get_pixels(output) + gdk_pixbuf_get_rowstride(output) * y;
+    skcms_Transform(
+        src,
+        has_alpha ? skcms_PixelFormat_RGBA_ffff : skcms_PixelFormat_RGB_fff,
+        decoder_state->alpha_premultiplied ? skcms_AlphaFormat_PremulAsEncoded
+                                           : skcms_AlphaFormat_Unpremul,
+        &decoder_state->icc, dst,
+        has_alpha ? skcms_PixelFormat_RGBA_8888 : skcms_PixelFormat_RGB_888,
+        skcms_AlphaFormat_Unpremul, skcms_sRGB_profile(), decoder_state->xsize);
+  }
+
+  if (decoder_state->area_updated_callback) {
+    decoder_state->area_updated_callback(
+        output, 0, 0, gdk_pixbuf_get_width(output),
+        gdk_pixbuf_get_height(output), decoder_state->user_data);
+  }
+}
+
+// Returns the largest downsampling factor that still decodes at least
+// `width` x `height` pixels; GdkPixbufLoader scales the result to the exact
+// size. For factor 8, only the DC of VarDCT frames is decoded.
+static uint32_t choose_downsampling(size_t xsize, size_t ysize, gint width,
+                                    gint height) {
+  uint32_t factor = 8;
+  while (factor > 1 && ((xsize + factor - 1) / factor < (size_t)width ||
+                        (ysize + factor - 1) / factor < (size_t)height)) {
+    factor /= 2;
+  }
+  return factor;
 }
 
 static gboolean load_increment(gpointer context, const guchar *buf, guint size,
@@ -364,7 +407,10 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
 
   JxlDecoderStatus status;
 
-  if ((status = JxlDecoderSetInput(decoder_state->decoder, buf, size)) !=
+  g_byte_array_append(decoder_state->input, buf, size);
+  if ((status = JxlDecoderSetInput(decoder_state->decoder,
+                                   decoder_state->input->data,
+                                   decoder_state->input->len)) !=
       JXL_DEC_SUCCESS) {
     // Should never happen if things are done properly.
     g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
@@ -376,11 +422,18 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
     status = JxlDecoderProcessInput(decoder_state->decoder);
     switch (status) {
       case JXL_DEC_NEED_MORE_INPUT: {
-        JxlDecoderReleaseInput(decoder_state->decoder);
+        size_t remaining = JxlDecoderReleaseInput(decoder_state->decoder);
+        if (decoder_state->downsampling_chosen) {
+          g_byte_array_remove_range(decoder_state->input, 0,
+                                    decoder_state->input->len - remaining);
+        }
         return TRUE;
       }
 
       case JXL_DEC_BASIC_INFO: {
+        // Seen again after rewinding for the downsampling.
+        if (decoder_state->got_basic_info) break;
+        decoder_state->got_basic_info = TRUE;
         JxlBasicInfo info;
         if (JxlDecoderGetBasicInfo(decoder_state->decoder, &info) !=
             JXL_DEC_SUCCESS) {
@@ -417,6 +470,28 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
         JxlResizableParallelRunnerSetThreads(
             decoder_state->parallel_runner,
             JxlResizableParallelRunnerSuggestThreads(info.xsize, info.ysize));
+
+        // The downsampling must be set before decoding starts, so the decoder
+        // is rewound to the start of the input, which was kept so far.
+        uint32_t factor =
+            choose_downsampling(info.xsize, info.ysize, width, height);
+        decoder_state->downsampling_chosen = TRUE;
+        if (factor > 1) {
+          JxlDecoderReleaseInput(decoder_state->decoder);
+          JxlDecoderRewind(decoder_state->decoder);
+          if (JxlDecoderSetDownsampling(decoder_state->decoder, factor) !=
+                  JXL_DEC_SUCCESS ||
+              JxlDecoderSetInput(decoder_state->decoder,
+                                 decoder_state->input->data,
+                                 decoder_state->input->len) !=
+                  JXL_DEC_SUCCESS) {
+            g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                        "JxlDecoderSetDownsampling failed");
+            return FALSE;
+          }
+          decoder_state->xsize = (info.xsize + factor - 1) / factor;
+          decoder_state->ysize = (info.ysize + factor - 1) / factor;
+        }
         break;
       }
 
@@ -455,7 +530,6 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
       }
 
       case JXL_DEC_FRAME: {
-        // TODO(veluca): support rescaling.
         JxlFrameHeader frame_header;
         if (JxlDecoderGetFrameHeader(decoder_state->decoder, &frame_header) !=
             JXL_DEC_SUCCESS) {
@@ -479,8 +553,6 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
                         "Failed to allocate output pixel buffer");
             return FALSE;
           }
-          decoder_state->pixel_format.align =
-              gdk_pixbuf_get_rowstride(frame.data);
           g_array_append_val(decoder_state->frames, frame);
         }
         if (decoder_state->pixbuf_prepared_callback &&
@@ -497,27 +569,50 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
       }
 
       case JXL_DEC_NEED_IMAGE_OUT_BUFFER: {
+        // An output buffer rather than a callback, so that progressive steps
+        // can be flushed to it.
+        size_t buffer_size;
         if (JXL_DEC_SUCCESS !=
-            JxlDecoderSetImageOutCallback(decoder_state->decoder,
-                                          &decoder_state->pixel_format,
-                                          draw_pixels, decoder_state)) {
+            JxlDecoderImageOutBufferSize(decoder_state->decoder,
+                                         &decoder_state->pixel_format,
+                                         &buffer_size)) {
           g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
-                      "JxlDecoderSetImageOutCallback failed");
+                      "JxlDecoderImageOutBufferSize failed");
+          return FALSE;
+        }
+        if (buffer_size != decoder_state->out_buffer_size) {
+          g_free(decoder_state->out_buffer);
+          decoder_state->out_buffer = g_try_malloc(buffer_size);
+          decoder_state->out_buffer_size = buffer_size;
+          if (decoder_state->out_buffer == NULL) {
+            decoder_state->out_buffer_size = 0;
+            g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                        "Failed to allocate decoder output buffer");
+            return FALSE;
+          }
+        }
+        if (JXL_DEC_SUCCESS !=
+            JxlDecoderSetImageOutBuffer(
+                decoder_state->decoder, &decoder_state->pixel_format,
+                decoder_state->out_buffer, decoder_state->out_buffer_size)) {
+          g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                      "JxlDecoderSetImageOutBuffer failed");
           return FALSE;
         }
         break;
       }
 
-      case JXL_DEC_FULL_IMAGE: {
-        // TODO(veluca): consider doing partial updates.
-        if (decoder_state->area_updated_callback) {
-          GdkPixbuf *output = g_array_index(decoder_state->frames,
-                                            GdkPixbufJxlAnimationFrame, 0)
-                                  .data;
-          decoder_state->area_updated_callback(
-              output, 0, 0, gdk_pixbuf_get_width(output),
-              gdk_pixbuf_get_height(output), decoder_state->user_data);
+      case JXL_DEC_FRAME_PROGRESSION: {
+        // Not being able to flush is not an error, the frame is then only
+        // shown once it is complete.
+        if (JxlDecoderFlushImage(decoder_state->decoder) == JXL_DEC_SUCCESS) {
+          update_frame(decoder_state);
         }
+        break;
+      }
+
+      case JXL_DEC_FULL_IMAGE: {
+        update_frame(decoder_state);
         g_array_index(decoder_state->frames, GdkPixbufJxlAnimationFrame,
                       decoder_state->frames->len - 1)
             .decoded = TRUE;
@@ -10,6 +10,7 @@ namespace jxl {
 JpegXlGimpProgress::JpegXlGimpProgress(const char *message) {
   cur_progress = 0;
   max_progress = 100;
+  codec_fraction = 0.0f;
 
   gimp_progress_init_printf("%s\n", message);
 }
@@ -19,6 +20,23 @@ void JpegXlGimpProgress::update() {
   return;
 }
 
+JXL_BOOL JpegXlGimpProgress::CodecCallback(void *opaque, uint64_t num_done,
+                                           uint64_t num_total) {
+  // Called by the threads of the parallel runner, but one at a time.
+  JpegXlGimpProgress *progress = static_cast<JpegXlGimpProgress *>(opaque);
+  if (num_total == 0) return JXL_TRUE;
+  float fraction = (float)num_done / (float)num_total;
+  if (fraction - progress->codec_fraction < 0.01f &&
+      fraction >= progress->codec_fraction) {
+    return JXL_TRUE;
+  }
+  progress->codec_fraction = fraction;
+  float done = progress->cur_progress +
+               fraction * (progress->max_progress - progress->cur_progress);
+  gimp_progress_update(done / (float)progress->max_progress);
+  return JXL_TRUE;
+}
+
 void JpegXlGimpProgress::finished() {
   gimp_progress_update(1.0);
   return;
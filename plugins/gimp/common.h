@@ -25,6 +25,7 @@
 
 #include "jxl/resizable_parallel_runner.h"
 #include "jxl/resizable_parallel_runner_cxx.h"
+#include "jxl/types.h"
 
 namespace jxl {
 
@@ -34,9 +35,16 @@ class JpegXlGimpProgress {
   void update();
   void finished();
 
+  // Progress callback of the encoder and decoder, with the JpegXlGimpProgress
+  // as opaque. Shows the progress of the codec within the current step.
+  static JXL_BOOL CodecCallback(void *opaque, uint64_t num_done,
+                                uint64_t num_total);
+
  private:
   int cur_progress;
   int max_progress;
+  // Last fraction shown by CodecCallback, to limit the number of updates.
+  float codec_fraction;
 
 };  // class JpegXlGimpProgress
 
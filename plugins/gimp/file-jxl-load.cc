@@ -11,6 +11,26 @@
 
 namespace jxl {
 
+namespace {
+
+// Layer being decoded, to which the decoder writes the pixels as they are
+// decoded, row stripe by row stripe, so that the frame is never held whole.
+struct LayerPixels {
+  GeglBuffer *buffer = nullptr;
+  const Babl *format = nullptr;
+};
+
+void SetLayerPixels(void *opaque, size_t x, size_t y, size_t num_pixels,
+                    const void *pixels) {
+  // Called concurrently by the threads of the parallel runner, on different
+  // pixels, which GEGL buffers support.
+  LayerPixels *layer = static_cast<LayerPixels *>(opaque);
+  gegl_buffer_set(layer->buffer, GEGL_RECTANGLE(x, y, num_pixels, 1), 0,
+                  layer->format, pixels, GEGL_AUTO_ROWSTRIDE);
+}
+
+}  // namespace
+
 bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
   std::vector<uint8_t> icc_profile;
   GimpColorProfile *profile_icc = nullptr;
@@ -18,10 +38,7 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
   bool is_linear = false;
 
   gint32 layer;
-
-  gpointer pixels_buffer_1 = nullptr;
-  gpointer pixels_buffer_2 = nullptr;
-  size_t buffer_size = 0;
+  LayerPixels layer_pixels;
 
   GimpImageBaseType image_type = GIMP_RGB;
   GimpImageType layer_type = GIMP_RGB_IMAGE;
@@ -66,6 +83,8 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
     g_printerr(LOAD_PROC " Error: JxlDecoderSetParallelRunner failed\n");
     return false;
   }
+  JxlDecoderSetProgressCallback(dec.get(), JpegXlGimpProgress::CodecCallback,
+                                &gimp_load_progress);
 
   // grand decode loop...
   JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
@@ -292,21 +311,6 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
         g_printerr(LOAD_PROC " Warning: No color profile.\n");
       }
     } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
-      // get image from decoder in FLOAT
-      format.data_type = JXL_TYPE_FLOAT;
-      if (JXL_DEC_SUCCESS !=
-          JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size)) {
-        g_printerr(LOAD_PROC " Error: JxlDecoderImageOutBufferSize failed\n");
-        return false;
-      }
-      pixels_buffer_1 = g_malloc(buffer_size);
-      if (JXL_DEC_SUCCESS != JxlDecoderSetImageOutBuffer(dec.get(), &format,
-                                                         pixels_buffer_1,
-                                                         buffer_size)) {
-        g_printerr(LOAD_PROC " Error: JxlDecoderSetImageOutBuffer failed\n");
-        return false;
-      }
-    } else if (status == JXL_DEC_FULL_IMAGE || status == JXL_DEC_FRAME) {
       // create and insert layer
       layer = gimp_layer_new(*image_id, "Background", info.xsize, info.ysize,
                              layer_type, /*opacity=*/100,
@@ -315,10 +319,6 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
       gimp_image_insert_layer(*image_id, layer, /*parent_id=*/-1,
                               /*position=*/0);
 
-      pixels_buffer_2 = g_malloc(buffer_size);
-      GeglBuffer *buffer = gimp_drawable_get_buffer(layer);
-      const Babl *destination_format = gegl_buffer_set_format(buffer, nullptr);
-
       std::string babl_format_str = "";
       if (is_gray) {
         babl_format_str += "Y'";
@@ -330,15 +330,19 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
       }
       babl_format_str += " float";
 
-      const Babl *source_format = babl_format(babl_format_str.c_str());
-
-      babl_process(babl_fish(source_format, destination_format),
-                   pixels_buffer_1, pixels_buffer_2, info.xsize * info.ysize);
-
-      gegl_buffer_set(buffer, GEGL_RECTANGLE(0, 0, info.xsize, info.ysize), 0,
-                      nullptr, pixels_buffer_2, GEGL_AUTO_ROWSTRIDE);
-
-      g_clear_object(&buffer);
+      // get image from decoder in FLOAT, GEGL converts it to the layer format
+      format.data_type = JXL_TYPE_FLOAT;
+      layer_pixels.buffer = gimp_drawable_get_buffer(layer);
+      layer_pixels.format = babl_format(babl_format_str.c_str());
+      if (JXL_DEC_SUCCESS != JxlDecoderSetImageOutCallback(dec.get(), &format,
+                                                           SetLayerPixels,
+                                                           &layer_pixels)) {
+        g_printerr(LOAD_PROC " Error: JxlDecoderSetImageOutCallback failed\n");
+        g_clear_object(&layer_pixels.buffer);
+        return false;
+      }
+    } else if (status == JXL_DEC_FULL_IMAGE || status == JXL_DEC_FRAME) {
+      g_clear_object(&layer_pixels.buffer);
     } else if (status == JXL_DEC_SUCCESS) {
       // All decoding successfully finished.
       // It's not required to call JxlDecoderReleaseInput(dec.get())
@@ -346,12 +350,15 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
       break;
     } else if (status == JXL_DEC_NEED_MORE_INPUT) {
       g_printerr(LOAD_PROC " Error: Already provided all input\n");
+      g_clear_object(&layer_pixels.buffer);
       return false;
     } else if (status == JXL_DEC_ERROR) {
       g_printerr(LOAD_PROC " Error: Decoder error\n");
+      g_clear_object(&layer_pixels.buffer);
       return false;
     } else {
       g_printerr(LOAD_PROC " Error: Unknown decoder status\n");
+      g_clear_object(&layer_pixels.buffer);
       return false;
     }
   }  // end grand decode loop
@@ -28,6 +28,28 @@ void g_clear_signal_handler(gulong* handler, gpointer instance) {
 }
 #endif  // g_clear_signal_handler
 
+// Pixels of a layer, given to the encoder a strip of rows at a time when it
+// encodes the frame, so that the layer is never copied whole.
+struct LayerRowSource {
+  GeglBuffer* buffer = nullptr;
+  const Babl* format = nullptr;
+  size_t xsize = 0;
+
+  ~LayerRowSource() { g_clear_object(&buffer); }
+};
+
+JXL_BOOL GetLayerRows(void* opaque, size_t y0, size_t num_rows, void* pixels,
+                      size_t size) {
+  LayerRowSource* source = static_cast<LayerRowSource*>(opaque);
+  // GEGL converts from the native format of the layer, which also fixes the
+  // gamma mismatch, see the choice of the format in SaveJpegXlImage.
+  gegl_buffer_get(source->buffer,
+                  GEGL_RECTANGLE(0, y0, source->xsize, num_rows), 1.0,
+                  source->format, pixels, GEGL_AUTO_ROWSTRIDE,
+                  GEGL_ABYSS_NONE);
+  return JXL_TRUE;
+}
+
 class JpegXlSaveOpts {
  public:
   float distance;
@@ -726,6 +748,8 @@ bool SaveJpegXlImage(const gint32 image_id, const gint32 drawable_id,
     g_printerr(SAVE_PROC " Error: JxlEncoderSetParallelRunner failed\n");
     return false;
   }
+  JxlEncoderSetProgressCallback(enc.get(), JpegXlGimpProgress::CodecCallback,
+                                &gimp_save_progress);
 
   // try to use ICC profile
   if (!icc.empty() && !jxl_save_opts.is_gray) {
@@ -802,34 +826,17 @@ bool SaveJpegXlImage(const gint32 image_id, const gint32 drawable_id,
     gimp_image_convert_precision(duplicate, GIMP_PRECISION_FLOAT_GAMMA);
   }
 
-  // process layers and compress into JXL
-  size_t buffer_size =
-      jxl_save_opts.basic_info.xsize * jxl_save_opts.basic_info.ysize *
-      jxl_save_opts.pixel_format.num_channels * 4;  // bytes per sample
-
+  // process layers and compress into JXL; the layers are read while the
+  // encoder processes the output
+  std::vector<LayerRowSource> sources(nlayers);
   for (int i = nlayers - 1; i >= 0; i--) {
     gimp_save_progress.update();
 
-    // copy image into buffer...
-    gpointer pixels_buffer_1;
-    gpointer pixels_buffer_2;
-    pixels_buffer_1 = g_malloc(buffer_size);
-    pixels_buffer_2 = g_malloc(buffer_size);
-
     gimp_layer_resize_to_image_size(layers[i]);
 
-    GeglBuffer* buffer = gimp_drawable_get_buffer(layers[i]);
-
-    // using gegl_buffer_set_format to get the format because
-    // gegl_buffer_get_format doesn't always get the original format
-    const Babl* native_format = gegl_buffer_set_format(buffer, nullptr);
-
-    gegl_buffer_get(buffer,
-                    GEGL_RECTANGLE(0, 0, jxl_save_opts.basic_info.xsize,
-                                   jxl_save_opts.basic_info.ysize),
-                    1.0, native_format, pixels_buffer_1, GEGL_AUTO_ROWSTRIDE,
-                    GEGL_ABYSS_NONE);
-    g_clear_object(&buffer);
+    LayerRowSource& source = sources[i];
+    source.buffer = gimp_drawable_get_buffer(layers[i]);
+    source.xsize = jxl_save_opts.basic_info.xsize;
 
     // use babl to fix gamma mismatch issues
     if (jxl_save_opts.icc_attached) {
@@ -839,21 +846,14 @@ bool SaveJpegXlImage(const gint32 image_id, const gint32 drawable_id,
     }
     jxl_save_opts.pixel_format.data_type = JXL_TYPE_FLOAT;
     jxl_save_opts.SetBablType("float");
-    const Babl* destination_format =
-        babl_format(jxl_save_opts.babl_format_str.c_str());
-
-    babl_process(
-        babl_fish(native_format, destination_format), pixels_buffer_1,
-        pixels_buffer_2,
-        jxl_save_opts.basic_info.xsize * jxl_save_opts.basic_info.ysize);
-
-    gimp_save_progress.update();
+    source.format = babl_format(jxl_save_opts.babl_format_str.c_str());
 
     // send layer to encoder
-    if (JXL_ENC_SUCCESS !=
-        JxlEncoderAddImageFrame(frame_settings, &jxl_save_opts.pixel_format,
-                                pixels_buffer_2, buffer_size)) {
-      g_printerr(SAVE_PROC " Error: JxlEncoderAddImageFrame failed\n");
+    if (JXL_ENC_SUCCESS != JxlEncoderAddImageFrameFromRowSource(
+                               frame_settings, &jxl_save_opts.pixel_format,
+                               GetLayerRows, &source)) {
+      g_printerr(SAVE_PROC " Error: JxlEncoderAddImageFrameFromRowSource "
+                 "failed\n");
       return false;
     }
   }
@@ -67,6 +67,11 @@ Status BenchmarkArgs::AddCommandLineOptions() {
           false);
   AddFlag(&print_details_csv, "print_details_csv",
           "When print_details is used, print as CSV.", false);
+  AddFlag(&print_details_json, "print_details_json",
+          "When print_details is used, print one JSON object per line, also "
+          "with the codec settings, the time of each encoding and decoding "
+          "phase, the peak memory and the decoding thread utilization.",
+          false);
   AddString(&extra_metrics, "extra_metrics",
             "Extra metrics to be computed. Only displayed with --print_details "
             "or --print_details_csv. Comma-separated list of NAME:COMMAND "
@@ -210,6 +215,24 @@ Status BenchmarkArgs::AddCommandLineOptions() {
       "Distance numbers and compression speeds shown in the table are invalid.",
       false);
 
+  AddFlag(&jpeg_recompression, "jpeg_recompression",
+          "If true, benchmarks lossless JPEG recompression instead: the input "
+          "JPEG files are read into memory, recompressed by each codec that "
+          "supports it and reconstructed again. Reports the JPEG bytes per "
+          "second in (recompression) and out (reconstruction), the size ratio "
+          "and the peak memory of each task. Tasks run one at a time, using "
+          "--inner_threads threads each.",
+          false);
+
+  AddFlag(&decode_throughput, "decode_throughput",
+          "If true, benchmarks decoding throughput instead: the input files, "
+          "which must be compressed with the given codec(s), are read into "
+          "memory once and each is decoded --decode_reps times by "
+          "--num_threads concurrent decoders, which share one parallel runner "
+          "with --inner_threads workers. Reports images/s, MP/s and the "
+          "p50/p99 latency of a decode.",
+          false);
+
   if (!AddCommandLineOptionsJxlCodec(this)) return false;
 #ifdef BENCHMARK_JPEG
   if (!AddCommandLineOptionsJPEGCodec(this)) return false;
@@ -257,7 +280,7 @@ Status BenchmarkArgs::ValidateArgs() {
 
   JXL_RETURN_IF_ERROR(ValidateArgsJxlCodec(this));
 
-  if (print_details_csv) print_details = true;
+  if (print_details_csv || print_details_json) print_details = true;
 
   if (override_bitdepth > 32) {
     return JXL_FAILURE("override_bitdepth must be <= 32");
@@ -103,6 +103,7 @@ struct BenchmarkArgs {
   std::string codec;
   bool print_details;
   bool print_details_csv;
+  bool print_details_json;
   bool print_more_stats;
   bool print_distance_percentiles;
   bool silent_errors;
@@ -114,6 +115,8 @@ struct BenchmarkArgs {
 
   bool decode_only;
   bool skip_butteraugli;
+  bool jpeg_recompression;
+  bool decode_throughput;
 
   float intensity_target;
 
@@ -10,6 +10,7 @@
 
 #include <deque>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "lib/jxl/aux_out.h"
@@ -69,13 +70,35 @@ class ImageCodec {
 
   virtual void GetMoreStats(BenchmarkStats* stats) {}
 
+  // Appends the effective encoder settings as name/value pairs, including the
+  // defaults of those not given in the parameters, for --print_details_json.
+  virtual void GetSettings(
+      std::vector<std::pair<std::string, std::string>>* settings) const {}
+
   virtual Status CanRecompressJpeg() const { return false; }
   virtual Status RecompressJpeg(const std::string& filename,
                                 const std::string& data,
+                                ThreadPoolInternal* pool,
                                 PaddedBytes* compressed,
                                 jpegxl::tools::SpeedStats* speed_stats) {
     return false;
   }
+  // Restores the original JPEG file from the output of RecompressJpeg.
+  virtual Status ReconstructJpeg(const std::string& filename,
+                                 const Span<const uint8_t> compressed,
+                                 ThreadPoolInternal* pool, PaddedBytes* jpeg,
+                                 jpegxl::tools::SpeedStats* speed_stats) {
+    return false;
+  }
+
+  // Decodes to a pixel buffer owned by the codec, without converting to an
+  // image bundle, with the given parallel runner. Sets *pixels to the number
+  // of pixels decoded. Used by --decode_throughput.
+  virtual Status DecodeToPixels(const Span<const uint8_t> compressed,
+                                JxlParallelRunner runner, void* runner_opaque,
+                                size_t* pixels) {
+    return false;
+  }
 
   virtual std::string GetErrorMessage() const { return error_message_; }
 
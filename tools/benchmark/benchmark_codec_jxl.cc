@@ -4,6 +4,7 @@
 // license that can be found in the LICENSE file.
 #include "tools/benchmark/benchmark_codec_jxl.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <functional>
@@ -13,13 +14,16 @@
 #include <vector>
 
 #include "jxl/decode_cxx.h"
+#include "jxl/encode_cxx.h"
 #include "jxl/thread_parallel_runner_cxx.h"
 #include "lib/extras/codec.h"
 #include "lib/extras/time.h"
 #include "lib/jxl/aux_out.h"
+#include "lib/jxl/base/cache_aligned.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/override.h"
 #include "lib/jxl/base/padded_bytes.h"
+#include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/codec_in_out.h"
 #include "lib/jxl/dec_file.h"
@@ -32,6 +36,7 @@
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
 #include "lib/jxl/modular/encoding/encoding.h"
+#include "lib/jxl/phase_counters.h"
 #include "tools/benchmark/benchmark_file_io.h"
 #include "tools/benchmark/benchmark_stats.h"
 #include "tools/cmdline.h"
@@ -193,6 +198,8 @@ class JxlCodec : public ImageCodec {
       if (cparams_.epf > 3) {
         return JXL_FAILURE("Invalid epf value");
       }
+    } else if (param == "jpeg_low_memory") {
+      cparams_.jpeg_low_memory = true;
     } else if (param.substr(0, 16) == "faster_decoding=") {
       cparams_.decoding_speed_tier =
           strtol(param.substr(16).c_str(), nullptr, 10);
@@ -254,10 +261,19 @@ class JxlCodec : public ImageCodec {
       passes_encoder_state.heuristics =
           jxl::make_unique<jxl::FastEncoderHeuristics>();
     }
-    JXL_RETURN_IF_ERROR(EncodeFile(cparams_, io, &passes_encoder_state,
-                                   compressed, GetJxlCms(), &cinfo_, pool));
+    enc_counters_.Clear();
+    passes_encoder_state.counters = &enc_counters_;
+    CacheAligned::Stats memory_stats;
+    {
+      CacheAligned::ScopedMemoryManager scoped_memory_manager(
+          CacheAligned::CurrentMemoryManager(), &memory_stats);
+      JXL_RETURN_IF_ERROR(EncodeFile(cparams_, io, &passes_encoder_state,
+                                     compressed, GetJxlCms(), &cinfo_, pool));
+    }
     const double end = Now();
     speed_stats->NotifyElapsed(end - start);
+    enc_buffer_bytes_ = memory_stats.peak_total_bytes.load();
+    has_enc_counters_ = true;
     return true;
   }
 
@@ -377,17 +393,227 @@ class JxlCodec : public ImageCodec {
                                static_cast<int>(status));
         }
       }
+      JxlDecoderGetCounters(dec.get(), &dec_counters_);
+      JxlMemoryStats memory_stats;
+      JxlDecoderGetMemoryStats(dec.get(), &memory_stats);
+      dec_buffer_bytes_ = memory_stats.peak_bytes;
+      has_dec_counters_ = true;
     }
     const double end = Now();
     speed_stats->NotifyElapsed(end - start - elapsed_convert_image);
     return true;
   }
 
+  Status CanRecompressJpeg() const override {
+    return args_.jpeg_recompression;
+  }
+
+  Status RecompressJpeg(const std::string& filename, const std::string& data,
+                        ThreadPoolInternal* pool, PaddedBytes* compressed,
+                        jpegxl::tools::SpeedStats* speed_stats) override {
+    const double start = Now();
+    auto runner = JxlThreadParallelRunnerMake(nullptr, pool->NumThreads());
+    auto enc = JxlEncoderMake(nullptr);
+    JXL_RETURN_IF_ERROR(JXL_ENC_SUCCESS ==
+                        JxlEncoderSetParallelRunner(enc.get(),
+                                                    JxlThreadParallelRunner,
+                                                    runner.get()));
+    JxlEncoderFrameSettings* settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    JXL_RETURN_IF_ERROR(
+        JXL_ENC_SUCCESS ==
+        JxlEncoderFrameSettingsSetOption(
+            settings, JXL_ENC_FRAME_SETTING_EFFORT,
+            10 - static_cast<int>(cparams_.speed_tier)));
+    if (cparams_.jpeg_low_memory) {
+      JXL_RETURN_IF_ERROR(JXL_ENC_SUCCESS ==
+                          JxlEncoderFrameSettingsSetOption(
+                              settings, JXL_ENC_FRAME_SETTING_JPEG_LOW_MEMORY,
+                              1));
+    }
+    JXL_RETURN_IF_ERROR(JXL_ENC_SUCCESS ==
+                        JxlEncoderStoreJPEGMetadata(enc.get(), JXL_TRUE));
+    JXL_RETURN_IF_ERROR(
+        JXL_ENC_SUCCESS ==
+        JxlEncoderAddJPEGFrame(settings,
+                               reinterpret_cast<const uint8_t*>(data.data()),
+                               data.size()));
+    JxlEncoderCloseInput(enc.get());
+
+    compressed->resize(std::max<size_t>(data.size() / 2, 4096));
+    uint8_t* next_out = compressed->data();
+    size_t avail_out = compressed->size();
+    JxlEncoderStatus status = JXL_ENC_NEED_MORE_OUTPUT;
+    while (status == JXL_ENC_NEED_MORE_OUTPUT) {
+      status = JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out);
+      if (status == JXL_ENC_NEED_MORE_OUTPUT) {
+        const size_t offset = next_out - compressed->data();
+        compressed->resize(compressed->size() * 2);
+        next_out = compressed->data() + offset;
+        avail_out = compressed->size() - offset;
+      }
+    }
+    JXL_RETURN_IF_ERROR(status == JXL_ENC_SUCCESS);
+    compressed->resize(next_out - compressed->data());
+    const double end = Now();
+    speed_stats->NotifyElapsed(end - start);
+    return true;
+  }
+
+  Status ReconstructJpeg(const std::string& filename,
+                         const Span<const uint8_t> compressed,
+                         ThreadPoolInternal* pool, PaddedBytes* jpeg,
+                         jpegxl::tools::SpeedStats* speed_stats) override {
+    const double start = Now();
+    auto runner = JxlThreadParallelRunnerMake(nullptr, pool->NumThreads());
+    auto dec = JxlDecoderMake(nullptr);
+    JXL_RETURN_IF_ERROR(JXL_DEC_SUCCESS ==
+                        JxlDecoderSetParallelRunner(dec.get(),
+                                                    JxlThreadParallelRunner,
+                                                    runner.get()));
+    JXL_RETURN_IF_ERROR(
+        JXL_DEC_SUCCESS ==
+        JxlDecoderSubscribeEvents(
+            dec.get(), JXL_DEC_JPEG_RECONSTRUCTION | JXL_DEC_FULL_IMAGE));
+    JXL_RETURN_IF_ERROR(
+        JXL_DEC_SUCCESS ==
+        JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+
+    // The reconstructed JPEG is usually a bit larger than the JXL file.
+    jpeg->resize(std::max<size_t>(compressed.size() * 3 / 2, 4096));
+    bool seen_jpeg_reconstruction = false;
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+      if (status == JXL_DEC_JPEG_RECONSTRUCTION) {
+        seen_jpeg_reconstruction = true;
+        JXL_RETURN_IF_ERROR(
+            JXL_DEC_SUCCESS ==
+            JxlDecoderSetJPEGBuffer(dec.get(), jpeg->data(), jpeg->size()));
+      } else if (status == JXL_DEC_JPEG_NEED_MORE_OUTPUT) {
+        const size_t used =
+            jpeg->size() - JxlDecoderReleaseJPEGBuffer(dec.get());
+        jpeg->resize(jpeg->size() * 2);
+        JXL_RETURN_IF_ERROR(JXL_DEC_SUCCESS ==
+                            JxlDecoderSetJPEGBuffer(dec.get(),
+                                                    jpeg->data() + used,
+                                                    jpeg->size() - used));
+      } else if (status == JXL_DEC_FULL_IMAGE) {
+        // The JPEG bytes are complete once the frame is decoded.
+        if (!seen_jpeg_reconstruction) {
+          return JXL_FAILURE("%s has no JPEG reconstruction data",
+                             filename.c_str());
+        }
+        jpeg->resize(jpeg->size() - JxlDecoderReleaseJPEGBuffer(dec.get()));
+        break;
+      } else {
+        return JXL_FAILURE("unexpected status %d", static_cast<int>(status));
+      }
+    }
+    const double end = Now();
+    speed_stats->NotifyElapsed(end - start);
+    return true;
+  }
+
+  Status DecodeToPixels(const Span<const uint8_t> compressed,
+                        JxlParallelRunner runner, void* runner_opaque,
+                        size_t* pixels) override {
+    auto dec = JxlDecoderMake(nullptr);
+    JXL_RETURN_IF_ERROR(
+        JXL_DEC_SUCCESS ==
+        JxlDecoderSetParallelRunner(dec.get(), runner, runner_opaque));
+    JXL_RETURN_IF_ERROR(
+        JXL_DEC_SUCCESS ==
+        JxlDecoderSubscribeEvents(dec.get(),
+                                  JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE));
+    JXL_RETURN_IF_ERROR(
+        JXL_DEC_SUCCESS ==
+        JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+
+    JxlBasicInfo info{};
+    JxlPixelFormat format = {/*num_channels=*/3,
+                             /*data_type=*/JXL_TYPE_FLOAT,
+                             /*endianness=*/JXL_NATIVE_ENDIAN,
+                             /*align=*/0};
+    if (uint8_) {
+      format.data_type = JXL_TYPE_UINT8;
+    }
+    *pixels = 0;
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+      if (status == JXL_DEC_SUCCESS) {
+        return true;
+      } else if (status == JXL_DEC_BASIC_INFO) {
+        JXL_RETURN_IF_ERROR(JXL_DEC_SUCCESS ==
+                            JxlDecoderGetBasicInfo(dec.get(), &info));
+        format.num_channels =
+            info.num_color_channels + (info.alpha_bits != 0 ? 1 : 0);
+      } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        size_t buffer_size;
+        JXL_RETURN_IF_ERROR(
+            JXL_DEC_SUCCESS ==
+            JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size));
+        // Reused by the following calls, as a server would.
+        pixel_buffer_.resize(buffer_size);
+        JXL_RETURN_IF_ERROR(JXL_DEC_SUCCESS ==
+                            JxlDecoderSetImageOutBuffer(dec.get(), &format,
+                                                        pixel_buffer_.data(),
+                                                        buffer_size));
+      } else if (status == JXL_DEC_FULL_IMAGE) {
+        *pixels += info.xsize * info.ysize;
+      } else {
+        return JXL_FAILURE("unexpected status %d", static_cast<int>(status));
+      }
+    }
+  }
+
   void GetMoreStats(BenchmarkStats* stats) override {
     JxlStats jxl_stats;
     jxl_stats.num_inputs = 1;
     jxl_stats.aux_out = cinfo_;
     stats->jxl_stats.Assimilate(jxl_stats);
+
+    // The input phase is only timed by the encoder API, which Compress does
+    // not use.
+    static const char* const kEncoderPhases[] = {"input", "transform",
+                                                 "modular", "write"};
+    static const char* const kDecoderPhases[] = {"headers", "dc", "ac",
+                                                 "render", "output"};
+    if (has_enc_counters_) {
+      for (size_t i = EncoderCounters::kTransform;
+           i < EncoderCounters::kNumPhases; i++) {
+        stats->phase_seconds[std::string("enc_") + kEncoderPhases[i]] +=
+            enc_counters_.nanoseconds[i].load() * 1E-9;
+      }
+      stats->max_buffers_encode =
+          std::max<size_t>(stats->max_buffers_encode, enc_buffer_bytes_);
+    }
+    if (has_dec_counters_) {
+      for (size_t i = 0; i < JXL_DEC_NUM_PHASES; i++) {
+        stats->phase_seconds[std::string("dec_") + kDecoderPhases[i]] +=
+            dec_counters_.nanoseconds[i] * 1E-9;
+      }
+      stats->max_buffers_decode =
+          std::max<size_t>(stats->max_buffers_decode, dec_buffer_bytes_);
+    }
+  }
+
+  void GetSettings(std::vector<std::pair<std::string, std::string>>* settings)
+      const override {
+    settings->emplace_back("speed_tier", SpeedTierName(cparams_.speed_tier));
+    settings->emplace_back("mode",
+                           cparams_.modular_mode ? "modular" : "vardct");
+    settings->emplace_back("distance",
+                           StringPrintf("%g", cparams_.butteraugli_distance));
+    settings->emplace_back("target_bitrate",
+                           StringPrintf("%g", cparams_.target_bitrate));
+    settings->emplace_back(
+        "decoding_speed_tier",
+        StringPrintf("%" PRIuS, cparams_.decoding_speed_tier));
+    settings->emplace_back("resampling",
+                           StringPrintf("%d", cparams_.resampling));
+    settings->emplace_back("uint8", uint8_ ? "true" : "false");
   }
 
  protected:
@@ -396,6 +622,15 @@ class JxlCodec : public ImageCodec {
   bool has_ctransform_ = false;
   DecompressParams dparams_;
   bool uint8_ = false;
+  // Counters and peak buffer bytes of the last Compress and of the last
+  // Decompress through the decoder API, for GetMoreStats.
+  EncoderCounters enc_counters_;
+  size_t enc_buffer_bytes_ = 0;
+  bool has_enc_counters_ = false;
+  JxlDecoderCounters dec_counters_ = {};
+  size_t dec_buffer_bytes_ = 0;
+  bool has_dec_counters_ = false;
+  std::vector<uint8_t> pixel_buffer_;  // for DecodeToPixels
 };
 
 ImageCodec* CreateNewJxlCodec(const BenchmarkArgs& args) {
@@ -161,6 +161,18 @@ void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
   for (size_t i = 0; i < victim.extra_metrics.size(); i++) {
     extra_metrics[i] += victim.extra_metrics[i];
   }
+  total_jpeg_size += victim.total_jpeg_size;
+  total_reconstructed_size += victim.total_reconstructed_size;
+  total_time_reconstruct += victim.total_time_reconstruct;
+  max_memory_encode = std::max(max_memory_encode, victim.max_memory_encode);
+  max_memory_reconstruct =
+      std::max(max_memory_reconstruct, victim.max_memory_reconstruct);
+  for (const auto& phase : victim.phase_seconds) {
+    phase_seconds[phase.first] += phase.second;
+  }
+  max_buffers_encode = std::max(max_buffers_encode, victim.max_buffers_encode);
+  max_buffers_decode = std::max(max_buffers_decode, victim.max_buffers_decode);
+  inner_threads = std::max(inner_threads, victim.inner_threads);
 }
 
 void BenchmarkStats::PrintMoreStats() const {
@@ -366,4 +378,67 @@ std::string PrintAggregate(
   return PrintFormattedEntries(num_extra_metrics, result);
 }
 
+std::string PrintJpegRecompressionHeader() {
+  const int name_width = ComputeLargestCodecName() + 1;
+  std::string out = StringPrintf(
+      "%-*s%6s%12s%12s%8s%10s%10s%10s%10s%6s\n", name_width, "Encoding",
+      "Files", "JPEG bytes", "Bytes", "Ratio", "E MB/s", "R MB/s", "E MB mem",
+      "R MB mem", "Bugs");
+  return out + std::string(out.size() - 1, '-') + "\n";
+}
+
+std::string BenchmarkStats::PrintJpegRecompressionLine(
+    const std::string& codec_desc) const {
+  // Throughput is in bytes of JPEG data, which is consumed by the encoder and
+  // produced by the reconstruction.
+  const double encode_speed =
+      total_time_encode == 0.0 ? 0.0
+                               : total_jpeg_size * 1E-6 / total_time_encode;
+  const double reconstruct_speed =
+      total_time_reconstruct == 0.0
+          ? 0.0
+          : total_reconstructed_size * 1E-6 / total_time_reconstruct;
+  const double ratio =
+      total_jpeg_size == 0 ? 0.0
+                           : 100.0 * total_compressed_size / total_jpeg_size;
+  return StringPrintf(
+      "%-*s%6" PRIuS "%12" PRIuS "%12" PRIuS "%7.2f%%%10.2f%10.2f%10.1f%10.1f"
+      "%6" PRIuS "\n",
+      static_cast<int>(ComputeLargestCodecName() + 1), codec_desc.c_str(),
+      total_input_files, total_jpeg_size, total_compressed_size, ratio,
+      encode_speed, reconstruct_speed, max_memory_encode * 1E-6,
+      max_memory_reconstruct * 1E-6, total_errors);
+}
+
+std::string PrintDecodeThroughputHeader() {
+  const int name_width = ComputeLargestCodecName() + 1;
+  std::string out =
+      StringPrintf("%-*s%9s%9s%10s%10s%10s%10s%6s\n", name_width, "Encoding",
+                   "Decodes", "Decoders", "Images/s", "MP/s", "p50 ms",
+                   "p99 ms", "Bugs");
+  return out + std::string(out.size() - 1, '-') + "\n";
+}
+
+std::string BenchmarkStats::PrintDecodeThroughputLine(
+    const std::string& codec_desc) const {
+  std::vector<double> sorted = decode_latencies;
+  std::sort(sorted.begin(), sorted.end());
+  // Nearest-rank percentile, in milliseconds.
+  const auto percentile = [&sorted](double p) {
+    if (sorted.empty()) return 0.0;
+    const size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::max<size_t>(rank, 1) - 1] * 1E3;
+  };
+  const double images_per_second =
+      total_time_decode == 0.0 ? 0.0 : sorted.size() / total_time_decode;
+  const double mps = total_time_decode == 0.0
+                         ? 0.0
+                         : total_input_pixels * 1E-6 / total_time_decode;
+  return StringPrintf(
+      "%-*s%9" PRIuS "%9" PRIuS "%10.2f%10.3f%10.3f%10.3f%6" PRIuS "\n",
+      static_cast<int>(ComputeLargestCodecName() + 1), codec_desc.c_str(),
+      sorted.size(), num_decoders, images_per_second, mps, percentile(0.5),
+      percentile(0.99), total_errors);
+}
+
 }  // namespace jxl
@@ -9,6 +9,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -52,6 +53,12 @@ struct BenchmarkStats {
 
   void PrintMoreStats() const;
 
+  // Row of the --jpeg_recompression table.
+  std::string PrintJpegRecompressionLine(const std::string& codec_desc) const;
+
+  // Row of the --decode_throughput table.
+  std::string PrintDecodeThroughputLine(const std::string& codec_desc) const;
+
   size_t total_input_files = 0;
   size_t total_input_pixels = 0;
   size_t total_compressed_size = 0;
@@ -67,10 +74,37 @@ struct BenchmarkStats {
   size_t total_errors = 0;
   JxlStats jxl_stats;
   std::vector<float> extra_metrics;
+  // Only used with --jpeg_recompression, except the peak resident bytes,
+  // which are also measured when the tasks run one at a time.
+  size_t total_jpeg_size = 0;
+  size_t total_reconstructed_size = 0;
+  double total_time_reconstruct = 0.0;
+  size_t max_memory_encode = 0;       // Peak resident bytes while encoding.
+  size_t max_memory_reconstruct = 0;  // Peak resident bytes while decoding.
+  // Only filled in by codecs that measure them (jxl), for the last encode and
+  // decode of each image: seconds per phase, keyed "enc_<phase>" and
+  // "dec_<phase>", with the decoding phases summed over the inner threads,
+  // and the peak bytes of the image buffers.
+  std::map<std::string, double> phase_seconds;
+  size_t max_buffers_encode = 0;
+  size_t max_buffers_decode = 0;
+  size_t inner_threads = 0;
+  // Elapsed seconds of each encode and decode rep of the last image; not
+  // assimilated, since reps of different images have different distributions.
+  std::vector<double> encode_samples;
+  std::vector<double> decode_samples;
+  // Only used with --decode_throughput, together with total_input_pixels,
+  // total_errors and total_time_decode (the elapsed time of all decodes).
+  std::vector<double> decode_latencies;  // Seconds, one per decode.
+  size_t num_decoders = 0;
 };
 
 std::string PrintHeader(const std::vector<std::string>& extra_metrics_names);
 
+std::string PrintJpegRecompressionHeader();
+
+std::string PrintDecodeThroughputHeader();
+
 // Given the rows of all printed statistics, print an aggregate row.
 std::string PrintAggregate(
     size_t num_extra_metrics,
@@ -88,3 +88,53 @@ Status RunCommand(const std::string& command,
 }  // namespace jxl
 
 #endif  // _MSC_VER
+
+#if defined(__linux__)
+#include <stdio.h>
+#include <string.h>
+#endif
+
+namespace jxl {
+
+#if defined(__linux__)
+namespace {
+
+// Returns the value of a "<key>: <value> kB" line of /proc/self/status in
+// bytes, or 0 if not found.
+size_t ReadProcStatusBytes(const char* key) {
+  FILE* file = fopen("/proc/self/status", "r");
+  if (file == nullptr) return 0;
+  const size_t key_size = strlen(key);
+  size_t kilobytes = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    if (strncmp(line, key, key_size) == 0 && line[key_size] == ':') {
+      if (sscanf(line + key_size + 1, "%zu", &kilobytes) != 1) kilobytes = 0;
+      break;
+    }
+  }
+  fclose(file);
+  return kilobytes * 1024;
+}
+
+}  // namespace
+
+size_t ResetPeakResidentMemory() {
+  // Writing 5 to clear_refs resets VmHWM to VmRSS (since Linux 4.0).
+  FILE* file = fopen("/proc/self/clear_refs", "w");
+  if (file == nullptr) return 0;
+  const bool ok = fputs("5", file) >= 0;
+  if (fclose(file) != 0 || !ok) return 0;
+  return ReadProcStatusBytes("VmRSS");
+}
+
+size_t PeakResidentMemory() { return ReadProcStatusBytes("VmHWM"); }
+
+#else
+
+size_t ResetPeakResidentMemory() { return 0; }
+size_t PeakResidentMemory() { return 0; }
+
+#endif  // __linux__
+
+}  // namespace jxl
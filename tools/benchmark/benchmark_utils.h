@@ -6,6 +6,8 @@
 #ifndef TOOLS_BENCHMARK_BENCHMARK_UTILS_H_
 #define TOOLS_BENCHMARK_BENCHMARK_UTILS_H_
 
+#include <stddef.h>
+
 #include <string>
 #include <vector>
 
@@ -30,6 +32,15 @@ class TemporaryFile final {
 Status RunCommand(const std::string& command,
                   const std::vector<std::string>& arguments);
 
+// Resets the peak resident memory of the process to its current resident
+// memory and returns the latter in bytes. Returns 0 if the resident memory
+// cannot be measured (only supported on Linux).
+size_t ResetPeakResidentMemory();
+
+// Returns the peak resident memory of the process in bytes since the last
+// ResetPeakResidentMemory, or 0 if it cannot be measured.
+size_t PeakResidentMemory();
+
 }  // namespace jxl
 
 #endif  // TOOLS_BENCHMARK_BENCHMARK_UTILS_H_
@@ -18,6 +18,8 @@
 #include <vector>
 
 #include "jxl/decode.h"
+#include "jxl/shared_parallel_runner.h"
+#include "jxl/shared_parallel_runner_cxx.h"
 #include "lib/extras/codec.h"
 #include "lib/extras/dec/color_hints.h"
 #include "lib/extras/time.h"
@@ -69,12 +71,56 @@ Status ReadPNG(const std::string& filename, Image3F* image) {
   return true;
 }
 
+// Returns s as a quoted JSON string.
+std::string JsonString(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      out += StringPrintf("\\u%04x", c);
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+// Returns v as a JSON number, or null if it is not finite.
+std::string JsonNumber(double v) {
+  return std::isfinite(v) ? StringPrintf("%.8g", v) : "null";
+}
+
+// Returns the latency percentiles, standard deviation and samples of the reps
+// as a JSON object.
+std::string JsonLatency(const std::vector<double>& samples) {
+  jpegxl::tools::SpeedStats speed_stats;
+  for (double t : samples) speed_stats.NotifyElapsed(t);
+  jpegxl::tools::SpeedStats::Summary summary;
+  if (!speed_stats.GetSummary(&summary)) return "null";
+  std::string out = "{\"p50\":" + JsonNumber(summary.p50) +
+                    ",\"p90\":" + JsonNumber(summary.p90) +
+                    ",\"p99\":" + JsonNumber(summary.p99) +
+                    ",\"stddev\":" + JsonNumber(summary.stddev) +
+                    ",\"samples\":[";
+  for (size_t i = 0; i < samples.size(); i++) {
+    out += (i == 0 ? "" : ",") + JsonNumber(samples[i]);
+  }
+  return out + "]}";
+}
+
+// measure_rss: if true, the peak resident memory of the process while
+// encoding and decoding is recorded; only meaningful if no other task runs
+// concurrently.
 void DoCompress(const std::string& filename, const CodecInOut& io,
                 const std::vector<std::string>& extra_metrics_commands,
                 ImageCodec* codec, ThreadPoolInternal* inner_pool,
-                PaddedBytes* compressed, BenchmarkStats* s) {
+                bool measure_rss, PaddedBytes* compressed,
+                BenchmarkStats* s) {
   PROFILER_FUNC;
   ++s->total_input_files;
+  s->inner_threads = inner_pool->NumThreads();
 
   if (io.frames.size() != 1) {
     // Multiple frames not supported (io.xsize() will checkfail)
@@ -103,11 +149,12 @@ void DoCompress(const std::string& filename, const CodecInOut& io,
   std::string ext = FileExtension(filename);
   if (valid && !Args()->decode_only) {
     for (size_t i = 0; i < Args()->encode_reps; ++i) {
+      const size_t rss = measure_rss ? ResetPeakResidentMemory() : 0;
       if (codec->CanRecompressJpeg() && (ext == ".jpg" || ext == ".jpeg")) {
         std::string data_in;
         JXL_CHECK(ReadFile(filename, &data_in));
-        JXL_CHECK(
-            codec->RecompressJpeg(filename, data_in, compressed, &speed_stats));
+        JXL_CHECK(codec->RecompressJpeg(filename, data_in, inner_pool,
+                                        compressed, &speed_stats));
       } else {
         Status status = codec->Compress(filename, &io, inner_pool, compressed,
                                         &speed_stats);
@@ -125,9 +172,14 @@ void DoCompress(const std::string& filename, const CodecInOut& io,
           }
         }
       }
+      if (measure_rss) {
+        s->max_memory_encode =
+            std::max(s->max_memory_encode, PeakResidentMemory() - rss);
+      }
     }
     JXL_CHECK(speed_stats.GetSummary(&summary));
     s->total_time_encode += summary.central_tendency;
+    s->encode_samples = speed_stats.Samples();
   }
 
   if (valid && Args()->decode_only) {
@@ -143,6 +195,7 @@ void DoCompress(const std::string& filename, const CodecInOut& io,
   if (valid) {
     speed_stats = jpegxl::tools::SpeedStats();
     for (size_t i = 0; i < Args()->decode_reps; ++i) {
+      const size_t rss = measure_rss ? ResetPeakResidentMemory() : 0;
       if (!codec->Decompress(filename, Span<const uint8_t>(*compressed),
                              inner_pool, &io2, &speed_stats)) {
         if (!Args()->silent_errors) {
@@ -153,6 +206,10 @@ void DoCompress(const std::string& filename, const CodecInOut& io,
         }
         valid = false;
       }
+      if (measure_rss) {
+        s->max_memory_reconstruct =
+            std::max(s->max_memory_reconstruct, PeakResidentMemory() - rss);
+      }
 
       // io2.dec_pixels increases each time, but the total should be independent
       // of decode_reps, so only take the value from the first iteration.
@@ -160,6 +217,7 @@ void DoCompress(const std::string& filename, const CodecInOut& io,
     }
     JXL_CHECK(speed_stats.GetSummary(&summary));
     s->total_time_decode += summary.central_tendency;
+    s->decode_samples = speed_stats.Samples();
   }
 
   std::string name = FileBaseName(filename);
@@ -626,6 +684,9 @@ struct StatPrinter {
         printf(",%.8f", m);
       }
       printf("\n");
+    } else if (Args()->print_details_json) {
+      PrintDetailsJson(t, pixels, enc_mps, dec_mps, comp_bpp, psnr, p_norm,
+                       bpp_p_norm, adj_comp_bpp);
     } else {
       printf("%s", (*methods_)[t.idx_method].c_str());
       for (size_t i = (*methods_)[t.idx_method].size(); i <= max_method_width_;
@@ -653,6 +714,78 @@ struct StatPrinter {
     fflush(stdout);
   }
 
+  // Prints the details of the task as one JSON object on one line.
+  void PrintDetailsJson(const Task& t, size_t pixels, double enc_mps,
+                        double dec_mps, double comp_bpp, double psnr,
+                        double p_norm, double bpp_p_norm,
+                        double adj_comp_bpp) {
+    const std::string& method = (*methods_)[t.idx_method];
+    std::string out = "{\"method\":" + JsonString(method);
+    out += ",\"image\":" + JsonString(FileBaseName((*fnames_)[t.idx_image]));
+    out += StringPrintf(",\"error\":%" PRIuS ",\"size\":%" PRIuS
+                        ",\"pixels\":%" PRIuS,
+                        t.stats.total_errors, t.stats.total_compressed_size,
+                        pixels);
+    const std::pair<const char*, double> metrics[] = {
+        {"enc_speed", enc_mps}, {"dec_speed", dec_mps},
+        {"bpp", comp_bpp},      {"dist", t.stats.max_distance},
+        {"psnr", psnr},         {"p", p_norm},
+        {"bppp", bpp_p_norm},   {"qabpp", adj_comp_bpp},
+        {"enc_seconds", t.stats.total_time_encode},
+        {"dec_seconds", t.stats.total_time_decode}};
+    for (const auto& metric : metrics) {
+      out += StringPrintf(",\"%s\":", metric.first) + JsonNumber(metric.second);
+    }
+    for (size_t i = 0; i < t.stats.extra_metrics.size(); i++) {
+      out += "," + JsonString((*extra_metrics_names_)[i]) + ":" +
+             JsonNumber(t.stats.extra_metrics[i]);
+    }
+
+    // All parameters of the codec description, then the effective settings.
+    out += ",\"params\":[";
+    std::vector<std::string> params = SplitString(method, ':');
+    for (size_t i = 1; i < params.size(); i++) {
+      out += (i == 1 ? "" : ",") + JsonString(params[i]);
+    }
+    out += "],\"settings\":{";
+    std::vector<std::pair<std::string, std::string>> settings;
+    t.codec->GetSettings(&settings);
+    for (size_t i = 0; i < settings.size(); i++) {
+      out += (i == 0 ? "" : ",") + JsonString(settings[i].first) + ":" +
+             JsonString(settings[i].second);
+    }
+
+    out += "},\"phase_seconds\":{";
+    double dec_busy = 0.0;
+    bool first = true;
+    for (const auto& phase : t.stats.phase_seconds) {
+      out += (first ? "" : ",") + JsonString(phase.first) + ":" +
+             JsonNumber(phase.second);
+      if (phase.first.compare(0, 4, "dec_") == 0) dec_busy += phase.second;
+      first = false;
+    }
+    out += "}";
+    // In seconds, the first rep is excluded from the percentiles as warm-up.
+    out += ",\"enc_latency\":" + JsonLatency(t.stats.encode_samples);
+    out += ",\"dec_latency\":" + JsonLatency(t.stats.decode_samples);
+    // Zero if not measured.
+    out += StringPrintf(",\"enc_buffer_bytes\":%" PRIuS
+                        ",\"dec_buffer_bytes\":%" PRIuS
+                        ",\"enc_peak_rss\":%" PRIuS ",\"dec_peak_rss\":%" PRIuS
+                        ",\"inner_threads\":%" PRIuS,
+                        t.stats.max_buffers_encode, t.stats.max_buffers_decode,
+                        t.stats.max_memory_encode,
+                        t.stats.max_memory_reconstruct, t.stats.inner_threads);
+    // Fraction of the decoding time during which the inner threads were busy
+    // in a decoding phase, if the codec reports phases.
+    if (dec_busy > 0.0) {
+      const size_t threads = std::max<size_t>(1, t.stats.inner_threads);
+      out += ",\"dec_thread_utilization\":" +
+             JsonNumber(dec_busy / (t.stats.total_time_decode * threads));
+    }
+    printf("%s}\n", out.c_str());
+  }
+
   void PrintStats(const std::string& method, size_t idx_method) {
     PROFILER_FUNC;
     // Assimilate all tasks with the same idx_method.
@@ -738,28 +871,12 @@ class Benchmark {
       PROFILER_FUNC;
 
       const StringVec methods = GetMethods();
-      const StringVec extra_metrics_names = GetExtraMetricsNames();
-      const StringVec extra_metrics_commands = GetExtraMetricsCommands();
-      const StringVec fnames = GetFilenames();
-      bool all_color_aware;
-      bool jpeg_transcoding_requested;
-      // (non-const because Task.stats are updated)
-      std::vector<Task> tasks = CreateTasks(methods, fnames, &all_color_aware,
-                                            &jpeg_transcoding_requested);
-
-      std::unique_ptr<ThreadPoolInternal> pool;
-      std::vector<std::unique_ptr<ThreadPoolInternal>> inner_pools;
-      InitThreads(static_cast<int>(tasks.size()), &pool, &inner_pools);
-
-      const std::vector<CodecInOut> loaded_images = LoadImages(
-          fnames, all_color_aware, jpeg_transcoding_requested, pool.get());
-
-      if (RunTasks(methods, extra_metrics_names, extra_metrics_commands, fnames,
-                   loaded_images, pool.get(), inner_pools, &tasks) != 0) {
-        ret = EXIT_FAILURE;
-        if (!Args()->silent_errors) {
-          fprintf(stderr, "There were error(s) in the benchmark.\n");
-        }
+      if (Args()->jpeg_recompression) {
+        ret = RunJpegRecompression(methods, GetFilenames());
+      } else if (Args()->decode_throughput) {
+        ret = RunDecodeThroughput(methods, GetFilenames());
+      } else {
+        ret = RunImageTasks(methods);
       }
     }
 
@@ -772,6 +889,221 @@ class Benchmark {
   }
 
  private:
+  static int RunImageTasks(const StringVec& methods) {
+    const StringVec extra_metrics_names = GetExtraMetricsNames();
+    const StringVec extra_metrics_commands = GetExtraMetricsCommands();
+    const StringVec fnames = GetFilenames();
+    bool all_color_aware;
+    bool jpeg_transcoding_requested;
+    // (non-const because Task.stats are updated)
+    std::vector<Task> tasks = CreateTasks(methods, fnames, &all_color_aware,
+                                          &jpeg_transcoding_requested);
+
+    std::unique_ptr<ThreadPoolInternal> pool;
+    std::vector<std::unique_ptr<ThreadPoolInternal>> inner_pools;
+    InitThreads(static_cast<int>(tasks.size()), &pool, &inner_pools);
+
+    const std::vector<CodecInOut> loaded_images = LoadImages(
+        fnames, all_color_aware, jpeg_transcoding_requested, pool.get());
+
+    if (RunTasks(methods, extra_metrics_names, extra_metrics_commands, fnames,
+                 loaded_images, pool.get(), inner_pools, &tasks) != 0) {
+      if (!Args()->silent_errors) {
+        fprintf(stderr, "There were error(s) in the benchmark.\n");
+      }
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // Benchmarks lossless JPEG recompression and reconstruction of the files in
+  // memory. The tasks run one at a time so that the peak memory of each can
+  // be measured; the inner pool gets all of the threads instead.
+  static int RunJpegRecompression(const StringVec& methods,
+                                  const StringVec& fnames) {
+    PROFILER_FUNC;
+    std::unique_ptr<ThreadPoolInternal> pool;
+    std::vector<std::unique_ptr<ThreadPoolInternal>> inner_pools;
+    InitThreads(/*num_tasks=*/1, &pool, &inner_pools);
+    ThreadPoolInternal* inner_pool = inner_pools[0].get();
+
+    std::vector<std::string> jpegs(fnames.size());
+    for (size_t i = 0; i < fnames.size(); ++i) {
+      if (!ReadFile(fnames[i], &jpegs[i])) {
+        JXL_ABORT("Failed to read %s", fnames[i].c_str());
+      }
+    }
+
+    size_t total_errors = 0;
+    printf("%s", PrintJpegRecompressionHeader().c_str());
+    for (const std::string& method : methods) {
+      ImageCodecPtr codec = CreateImageCodec(method);
+      if (!codec->CanRecompressJpeg()) {
+        fprintf(stderr, "Codec %s cannot recompress JPEG files\n",
+                method.c_str());
+        return EXIT_FAILURE;
+      }
+      BenchmarkStats method_stats;
+      for (size_t i = 0; i < fnames.size(); ++i) {
+        BenchmarkStats s;
+        DoJpegRecompression(fnames[i], jpegs[i], codec.get(), inner_pool,
+                            &s);
+        if (Args()->print_details) {
+          printf("%s",
+                 s.PrintJpegRecompressionLine(FileBaseName(fnames[i])).c_str());
+        }
+        method_stats.Assimilate(s);
+      }
+      printf("%s", method_stats.PrintJpegRecompressionLine(method).c_str());
+      fflush(stdout);
+      total_errors += method_stats.total_errors;
+    }
+    if (total_errors != 0) {
+      if (!Args()->silent_errors) {
+        fprintf(stderr, "There were error(s) in the benchmark.\n");
+      }
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  static void DoJpegRecompression(const std::string& filename,
+                                  const std::string& jpeg, ImageCodec* codec,
+                                  ThreadPoolInternal* inner_pool,
+                                  BenchmarkStats* s) {
+    s->total_input_files = 1;
+    s->total_jpeg_size = jpeg.size();
+
+    PaddedBytes compressed;
+    jpegxl::tools::SpeedStats encode_stats;
+    for (size_t i = 0; i < Args()->encode_reps; ++i) {
+      const size_t rss = ResetPeakResidentMemory();
+      if (!codec->RecompressJpeg(filename, jpeg, inner_pool, &compressed,
+                                 &encode_stats)) {
+        if (!Args()->silent_errors) {
+          fprintf(stderr, "Failed to recompress %s with %s\n",
+                  filename.c_str(), codec->description().c_str());
+        }
+        s->total_errors++;
+        return;
+      }
+      s->max_memory_encode =
+          std::max(s->max_memory_encode, PeakResidentMemory() - rss);
+    }
+    jpegxl::tools::SpeedStats::Summary summary;
+    JXL_CHECK(encode_stats.GetSummary(&summary));
+    s->total_time_encode = summary.central_tendency;
+    s->total_compressed_size = compressed.size();
+
+    PaddedBytes reconstructed;
+    jpegxl::tools::SpeedStats reconstruct_stats;
+    for (size_t i = 0; i < Args()->decode_reps; ++i) {
+      const size_t rss = ResetPeakResidentMemory();
+      if (!codec->ReconstructJpeg(filename, Span<const uint8_t>(compressed),
+                                  inner_pool, &reconstructed,
+                                  &reconstruct_stats)) {
+        if (!Args()->silent_errors) {
+          fprintf(stderr, "Failed to reconstruct %s with %s\n",
+                  filename.c_str(), codec->description().c_str());
+        }
+        s->total_errors++;
+        return;
+      }
+      s->max_memory_reconstruct =
+          std::max(s->max_memory_reconstruct, PeakResidentMemory() - rss);
+    }
+    JXL_CHECK(reconstruct_stats.GetSummary(&summary));
+    s->total_time_reconstruct = summary.central_tendency;
+    s->total_reconstructed_size = reconstructed.size();
+
+    if (reconstructed.size() != jpeg.size() ||
+        memcmp(reconstructed.data(), jpeg.data(), jpeg.size()) != 0) {
+      if (!Args()->silent_errors) {
+        fprintf(stderr, "Reconstruction of %s with %s is not bit-exact\n",
+                filename.c_str(), codec->description().c_str());
+      }
+      s->total_errors++;
+    }
+  }
+
+  // Benchmarks decoding of the already compressed files in memory, as a server
+  // would: concurrent decoders, each a tenant of one shared parallel runner,
+  // decode the files round-robin until each was decoded decode_reps times.
+  static int RunDecodeThroughput(const StringVec& methods,
+                                 const StringVec& fnames) {
+    PROFILER_FUNC;
+    std::vector<std::string> files(fnames.size());
+    for (size_t i = 0; i < fnames.size(); ++i) {
+      if (!ReadFile(fnames[i], &files[i])) {
+        JXL_ABORT("Failed to read %s", fnames[i].c_str());
+      }
+    }
+    const size_t num_decodes = fnames.size() * Args()->decode_reps;
+    const int num_hw_threads = std::thread::hardware_concurrency();
+    const int num_decoders = std::max(
+        1, NumOuterThreads(num_hw_threads, static_cast<int>(num_decodes)));
+    // The shared runner serves all decoders, so by default it gets all cores.
+    const int num_workers =
+        Args()->inner_threads < 0 ? num_hw_threads : Args()->inner_threads;
+    fprintf(stderr, "%d total threads, %d decoders, %d shared workers\n",
+            num_hw_threads, num_decoders, num_workers);
+    ThreadPoolInternal pool(num_decoders == 1 ? 0 : num_decoders);
+    JxlSharedParallelRunnerPtr runner =
+        JxlSharedParallelRunnerMake(nullptr, num_workers);
+
+    size_t total_errors = 0;
+    printf("%s", PrintDecodeThroughputHeader().c_str());
+    for (const std::string& method : methods) {
+      // Codecs are thread-compatible, so each decoder has its own.
+      std::vector<ImageCodecPtr> codecs;
+      std::vector<JxlSharedParallelRunnerTenantPtr> tenants;
+      for (size_t i = 0; i < pool.NumThreads(); ++i) {
+        codecs.push_back(CreateImageCodec(method));
+        tenants.push_back(JxlSharedParallelRunnerMakeTenant(runner.get(), 1));
+      }
+      BenchmarkStats s;
+      s.num_decoders = num_decoders;
+      s.decode_latencies.resize(num_decodes);
+      std::vector<size_t> pixels(num_decodes);
+      std::vector<uint8_t> failed(num_decodes);
+      const double start = Now();
+      JXL_CHECK(RunOnPool(
+          &pool, 0, num_decodes, ThreadPool::NoInit,
+          [&](const uint32_t i, const size_t thread) {
+            const std::string& file = files[i % files.size()];
+            const double start_decode = Now();
+            if (!codecs[thread]->DecodeToPixels(
+                    Span<const uint8_t>(
+                        reinterpret_cast<const uint8_t*>(file.data()),
+                        file.size()),
+                    JxlSharedParallelRunner, tenants[thread].get(),
+                    &pixels[i])) {
+              if (!Args()->silent_errors) {
+                fprintf(stderr, "Failed to decode %s with %s\n",
+                        fnames[i % files.size()].c_str(), method.c_str());
+              }
+              failed[i] = 1;
+            }
+            s.decode_latencies[i] = Now() - start_decode;
+          },
+          "Decode throughput"));
+      s.total_time_decode = Now() - start;
+      s.total_input_pixels =
+          std::accumulate(pixels.begin(), pixels.end(), size_t(0));
+      s.total_errors = std::accumulate(failed.begin(), failed.end(), size_t(0));
+      printf("%s", s.PrintDecodeThroughputLine(method).c_str());
+      fflush(stdout);
+      total_errors += s.total_errors;
+    }
+    if (total_errors != 0) {
+      if (!Args()->silent_errors) {
+        fprintf(stderr, "There were error(s) in the benchmark.\n");
+      }
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
   static int NumOuterThreads(const int num_hw_threads, const int num_tasks) {
     int num_threads = Args()->num_threads;
     // Default to #cores
@@ -1030,6 +1362,9 @@ class Benchmark {
       }
       printf("\n");
     }
+    // Resident memory is process-wide, so it is only attributed to a task when
+    // the tasks run one at a time.
+    const bool measure_rss = pool->NumWorkerThreads() == 0;
 
     std::vector<uint64_t> errors_thread;
     JXL_CHECK(RunOnPool(
@@ -1045,8 +1380,8 @@ class Benchmark {
           t.image = &image;
           PaddedBytes compressed;
           DoCompress(fnames[t.idx_image], image, extra_metrics_commands,
-                     t.codec.get(), inner_pools[thread].get(), &compressed,
-                     &t.stats);
+                     t.codec.get(), inner_pools[thread].get(), measure_rss,
+                     &compressed, &t.stats);
           printer.TaskDone(i, t);
           errors_thread[8 * thread] += t.stats.total_errors;
         },
@@ -0,0 +1,555 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Fixed set of encoding and decoding scenarios over images of the test data,
+// timed with several thread counts through the public API, written as a report
+// that can be compared with the report of an earlier build to find
+// regressions. See doc/benchmarking.md.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "jxl/decode.h"
+#include "jxl/decode_cxx.h"
+#include "jxl/encode.h"
+#include "jxl/encode_cxx.h"
+#include "jxl/thread_parallel_runner.h"
+#include "jxl/thread_parallel_runner_cxx.h"
+#include "lib/extras/dec/color_hints.h"
+#include "lib/extras/dec/decode.h"
+#include "lib/extras/packed_image.h"
+#include "lib/extras/time.h"
+#include "lib/jxl/base/file_io.h"
+#include "lib/jxl/base/span.h"
+#include "tools/args.h"
+#include "tools/benchmark/benchmark_utils.h"
+#include "tools/cmdline.h"
+#include "tools/speed_stats.h"
+
+#ifndef JPEGXL_PERF_SUITE_CORPUS
+#define JPEGXL_PERF_SUITE_CORPUS ""
+#endif
+
+namespace jpegxl {
+namespace tools {
+namespace {
+
+// Version of the scenarios and of the report format. The corpus is the test
+// data at the commit of its submodule; changing a scenario or one of its files
+// requires incrementing this, since reports of different versions are not
+// compared.
+constexpr int kSuiteVersion = 1;
+
+struct Scenario {
+  const char* name;
+  // Relative to the corpus directory.
+  const char* file;
+  // Recompresses the JPEG file instead of encoding its pixels.
+  bool jpeg;
+  bool lossless;
+  float distance;
+  int effort;
+};
+
+const Scenario kScenarios[] = {
+    {"photo_d1", "jxl/flower/flower.png", false, false, 1.0f, 7},
+    {"photo_d1_e3", "jxl/flower/flower.png", false, false, 1.0f, 3},
+    {"screenshot_d1", "jxl/grayscale_patches.png", false, false, 1.0f, 7},
+    {"alpha_d1", "jxl/flower/flower_alpha.png", false, false, 1.0f, 7},
+    {"animation_d1", "jxl/traffic_light.gif", false, false, 1.0f, 7},
+    // 16-bit linear wide-gamut camera image.
+    {"hdr_d1",
+     "third_party/raw.pixls/Google-Pixel2XL-16bit_acescg_g1_v4_krita.png",
+     false, false, 1.0f, 7},
+    {"jpeg_recompress", "jxl/flower/flower.png.im_q85_420.jpg", true, false,
+     0.0f, 7},
+    {"lossless16_e2", "third_party/raw.pixls/DJI-FC6310-16bit_709_v4_krita.png",
+     false, true, 0.0f, 2},
+    {"lossless16_e7", "third_party/raw.pixls/DJI-FC6310-16bit_709_v4_krita.png",
+     false, true, 0.0f, 7},
+};
+
+struct Args {
+  std::string corpus = JPEGXL_PERF_SUITE_CORPUS;
+  std::string output;
+  std::string baseline;
+  std::string threads = "1,4,16";
+  std::string filter;
+  size_t reps = 5;
+  float tolerance = 5.0f;
+};
+
+struct Input {
+  std::vector<uint8_t> bytes;
+  jxl::extras::PackedPixelFile ppf;
+};
+
+// One line of the report.
+struct Result {
+  std::string scenario;
+  std::string operation;
+  size_t threads = 0;
+  double megapixels = 0.0;
+  uint64_t bytes = 0;
+  double mp_per_s = 0.0;
+  double p50_ms = 0.0;
+  double p90_ms = 0.0;
+  double p99_ms = 0.0;
+  // Throughput relative to the first thread count.
+  double scaling = 0.0;
+  // Peak of JxlMemoryStats, and peak resident memory of the process over the
+  // footprint before the repetition, or 0 if it cannot be measured.
+  uint64_t peak_bytes = 0;
+  uint64_t peak_rss = 0;
+
+  std::string Key() const {
+    return scenario + "/" + operation + "/" + std::to_string(threads);
+  }
+};
+
+const char kReportHeader[] =
+    "scenario\toperation\tthreads\tmegapixels\tbytes\tmp_per_s\tp50_ms\t"
+    "p90_ms\tp99_ms\tscaling\tpeak_bytes\tpeak_rss";
+
+bool ParseThreads(const std::string& list, std::vector<size_t>* threads) {
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    size_t value;
+    if (!ParseUnsigned(item.c_str(), &value) || value == 0) return false;
+    threads->push_back(value);
+  }
+  return !threads->empty();
+}
+
+bool LoadInput(const Scenario& scenario, const std::string& corpus,
+               Input* input) {
+  const std::string path = corpus + "/" + scenario.file;
+  if (!jxl::ReadFile(path, &input->bytes)) {
+    fprintf(stderr, "Failed to read %s\n", path.c_str());
+    return false;
+  }
+  if (scenario.jpeg) return true;
+  if (!jxl::extras::DecodeBytes(jxl::Span<const uint8_t>(input->bytes),
+                                jxl::extras::ColorHints(),
+                                jxl::SizeConstraints(), &input->ppf)) {
+    fprintf(stderr, "Failed to decode %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool AddFrames(const Scenario& scenario, const Input& input, JxlEncoder* enc,
+               JxlEncoderFrameSettings* settings) {
+  if (scenario.jpeg) {
+    return JxlEncoderAddJPEGFrame(settings, input.bytes.data(),
+                                  input.bytes.size()) == JXL_ENC_SUCCESS;
+  }
+  const jxl::extras::PackedPixelFile& ppf = input.ppf;
+  JxlBasicInfo basic_info = ppf.info;
+  basic_info.num_extra_channels = ppf.info.alpha_bits > 0 ? 1 : 0;
+  basic_info.uses_original_profile = scenario.lossless;
+  if (JxlEncoderSetBasicInfo(enc, &basic_info) != JXL_ENC_SUCCESS) {
+    return false;
+  }
+  if (basic_info.num_extra_channels > 0) {
+    JxlExtraChannelInfo extra_channel_info;
+    JxlEncoderInitExtraChannelInfo(JXL_CHANNEL_ALPHA, &extra_channel_info);
+    extra_channel_info.bits_per_sample = ppf.info.alpha_bits;
+    if (JxlEncoderSetExtraChannelInfo(enc, 0, &extra_channel_info) !=
+        JXL_ENC_SUCCESS) {
+      return false;
+    }
+  }
+  const JxlEncoderStatus color_status =
+      ppf.icc.empty()
+          ? JxlEncoderSetColorEncoding(enc, &ppf.color_encoding)
+          : JxlEncoderSetICCProfile(enc, ppf.icc.data(), ppf.icc.size());
+  if (color_status != JXL_ENC_SUCCESS) return false;
+  for (const jxl::extras::PackedFrame& frame : ppf.frames) {
+    if (JxlEncoderSetFrameHeader(settings, &frame.frame_info) !=
+            JXL_ENC_SUCCESS ||
+        JxlEncoderAddImageFrame(settings, &frame.color.format,
+                                frame.color.pixels(),
+                                frame.color.pixels_size) != JXL_ENC_SUCCESS) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Encode(const Scenario& scenario, const Input& input, void* runner,
+            std::vector<uint8_t>* compressed, uint64_t* peak_bytes) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  if (JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner,
+                                  runner) != JXL_ENC_SUCCESS) {
+    return false;
+  }
+  JxlEncoderFrameSettings* settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  if (JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                       scenario.effort) != JXL_ENC_SUCCESS) {
+    return false;
+  }
+  if (scenario.lossless) {
+    if (JxlEncoderSetFrameLossless(settings, JXL_TRUE) != JXL_ENC_SUCCESS) {
+      return false;
+    }
+  } else if (!scenario.jpeg) {
+    if (JxlEncoderSetFrameDistance(settings, scenario.distance) !=
+        JXL_ENC_SUCCESS) {
+      return false;
+    }
+  }
+  if (!AddFrames(scenario, input, enc.get(), settings)) return false;
+  JxlEncoderCloseInput(enc.get());
+
+  compressed->resize(std::max<size_t>(compressed->size(), 1 << 16));
+  uint8_t* next_out = compressed->data();
+  size_t avail_out = compressed->size();
+  JxlEncoderStatus status = JXL_ENC_NEED_MORE_OUTPUT;
+  while (status == JXL_ENC_NEED_MORE_OUTPUT) {
+    status = JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out);
+    if (status == JXL_ENC_NEED_MORE_OUTPUT) {
+      const size_t offset = next_out - compressed->data();
+      compressed->resize(compressed->size() * 2);
+      next_out = compressed->data() + offset;
+      avail_out = compressed->size() - offset;
+    }
+  }
+  if (status != JXL_ENC_SUCCESS) return false;
+  compressed->resize(next_out - compressed->data());
+  JxlMemoryStats stats;
+  JxlEncoderGetMemoryStats(enc.get(), &stats);
+  *peak_bytes = stats.peak_bytes;
+  return true;
+}
+
+// Decodes all the frames to 8 or 16 bit pixels, reusing `pixels` as the
+// output buffer.
+bool Decode(const std::vector<uint8_t>& compressed, void* runner,
+            std::vector<uint8_t>* pixels, size_t* num_pixels,
+            uint64_t* peak_bytes) {
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  if (JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO |
+                                               JXL_DEC_FULL_IMAGE) !=
+          JXL_DEC_SUCCESS ||
+      JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                  runner) != JXL_DEC_SUCCESS ||
+      JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size()) !=
+          JXL_DEC_SUCCESS) {
+    return false;
+  }
+  JxlDecoderCloseInput(dec.get());
+  JxlBasicInfo info;
+  JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  *num_pixels = 0;
+  for (;;) {
+    const JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_BASIC_INFO) {
+      if (JxlDecoderGetBasicInfo(dec.get(), &info) != JXL_DEC_SUCCESS) {
+        return false;
+      }
+      format.num_channels = info.num_color_channels + (info.alpha_bits ? 1 : 0);
+      format.data_type =
+          info.bits_per_sample > 8 ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8;
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      size_t size;
+      if (JxlDecoderImageOutBufferSize(dec.get(), &format, &size) !=
+          JXL_DEC_SUCCESS) {
+        return false;
+      }
+      pixels->resize(size);
+      if (JxlDecoderSetImageOutBuffer(dec.get(), &format, pixels->data(),
+                                      pixels->size()) != JXL_DEC_SUCCESS) {
+        return false;
+      }
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+      *num_pixels += static_cast<size_t>(info.xsize) * info.ysize;
+    } else if (status == JXL_DEC_SUCCESS) {
+      break;
+    } else {
+      return false;
+    }
+  }
+  JxlMemoryStats stats;
+  JxlDecoderGetMemoryStats(dec.get(), &stats);
+  *peak_bytes = stats.peak_bytes;
+  return true;
+}
+
+void Summarize(const SpeedStats& stats, Result* result) {
+  SpeedStats::Summary summary;
+  JXL_CHECK(stats.GetSummary(&summary));
+  result->p50_ms = summary.p50 * 1e3;
+  result->p90_ms = summary.p90 * 1e3;
+  result->p99_ms = summary.p99 * 1e3;
+  result->mp_per_s = summary.p50 > 0 ? result->megapixels / summary.p50 : 0.0;
+}
+
+// Appends the encode and decode results of `scenario` with `threads` threads.
+bool RunScenario(const Scenario& scenario, const Input& input, size_t threads,
+                 size_t reps, std::vector<Result>* results) {
+  JxlThreadParallelRunnerPtr runner =
+      JxlThreadParallelRunnerMake(nullptr, threads);
+  Result encode, decode;
+  encode.scenario = decode.scenario = scenario.name;
+  encode.operation = "encode";
+  decode.operation = "decode";
+  encode.threads = decode.threads = threads;
+
+  std::vector<uint8_t> compressed;
+  SpeedStats encode_stats;
+  for (size_t i = 0; i < reps; i++) {
+    const size_t rss = jxl::ResetPeakResidentMemory();
+    uint64_t peak_bytes;
+    const double start = jxl::Now();
+    if (!Encode(scenario, input, runner.get(), &compressed, &peak_bytes)) {
+      fprintf(stderr, "Failed to encode %s\n", scenario.name);
+      return false;
+    }
+    encode_stats.NotifyElapsed(jxl::Now() - start);
+    encode.peak_bytes = std::max(encode.peak_bytes, peak_bytes);
+    if (rss != 0) {
+      encode.peak_rss = std::max<uint64_t>(encode.peak_rss,
+                                           jxl::PeakResidentMemory() - rss);
+    }
+  }
+
+  std::vector<uint8_t> pixels;
+  size_t num_pixels = 0;
+  SpeedStats decode_stats;
+  for (size_t i = 0; i < reps; i++) {
+    const size_t rss = jxl::ResetPeakResidentMemory();
+    uint64_t peak_bytes;
+    const double start = jxl::Now();
+    if (!Decode(compressed, runner.get(), &pixels, &num_pixels,
+                &peak_bytes)) {
+      fprintf(stderr, "Failed to decode %s\n", scenario.name);
+      return false;
+    }
+    decode_stats.NotifyElapsed(jxl::Now() - start);
+    decode.peak_bytes = std::max(decode.peak_bytes, peak_bytes);
+    if (rss != 0) {
+      decode.peak_rss = std::max<uint64_t>(decode.peak_rss,
+                                           jxl::PeakResidentMemory() - rss);
+    }
+  }
+
+  encode.megapixels = decode.megapixels = num_pixels * 1e-6;
+  encode.bytes = decode.bytes = compressed.size();
+  Summarize(encode_stats, &encode);
+  Summarize(decode_stats, &decode);
+  results->push_back(encode);
+  results->push_back(decode);
+  return true;
+}
+
+std::string FormatResult(const Result& r) {
+  char line[512];
+  snprintf(line, sizeof(line),
+           "%s\t%s\t%zu\t%.3f\t%llu\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%llu\t%llu",
+           r.scenario.c_str(), r.operation.c_str(), r.threads, r.megapixels,
+           static_cast<unsigned long long>(r.bytes), r.mp_per_s, r.p50_ms,
+           r.p90_ms, r.p99_ms, r.scaling,
+           static_cast<unsigned long long>(r.peak_bytes),
+           static_cast<unsigned long long>(r.peak_rss));
+  return line;
+}
+
+bool WriteReport(const std::vector<Result>& results, const std::string& path) {
+  std::ofstream out(path);
+  out << "# jxl_perf_suite " << kSuiteVersion << "\n" << kReportHeader << "\n";
+  for (const Result& r : results) out << FormatResult(r) << "\n";
+  return static_cast<bool>(out);
+}
+
+bool ReadReport(const std::string& path, std::map<std::string, Result>* out) {
+  std::ifstream in(path);
+  std::string line;
+  if (!std::getline(in, line) ||
+      line != "# jxl_perf_suite " + std::to_string(kSuiteVersion)) {
+    fprintf(stderr, "%s is not a report of version %d of the suite\n",
+            path.c_str(), kSuiteVersion);
+    return false;
+  }
+  if (!std::getline(in, line) || line != kReportHeader) return false;
+  while (std::getline(in, line)) {
+    std::stringstream fields(line);
+    Result r;
+    unsigned long long bytes, peak_bytes, peak_rss;
+    if (!std::getline(fields, r.scenario, '\t') ||
+        !std::getline(fields, r.operation, '\t') ||
+        !(fields >> r.threads >> r.megapixels >> bytes >> r.mp_per_s >>
+          r.p50_ms >> r.p90_ms >> r.p99_ms >> r.scaling >> peak_bytes >>
+          peak_rss)) {
+      fprintf(stderr, "Invalid line in %s: %s\n", path.c_str(), line.c_str());
+      return false;
+    }
+    r.bytes = bytes;
+    r.peak_bytes = peak_bytes;
+    r.peak_rss = peak_rss;
+    (*out)[r.Key()] = r;
+  }
+  return true;
+}
+
+// Prints the metrics of `results` that are worse than in `baseline` by more
+// than `tolerance` percent, and returns how many there are. Missing results
+// count as regressions.
+size_t CompareWithBaseline(const std::vector<Result>& results,
+                           const std::map<std::string, Result>& baseline,
+                           float tolerance) {
+  const double ratio = 1.0 + tolerance * 0.01;
+  size_t num_regressions = 0;
+  const auto check = [&](const Result& r, const char* metric, double value,
+                         double base, bool higher_is_better) {
+    const bool regressed =
+        higher_is_better ? value * ratio < base : value > base * ratio;
+    if (!regressed) return;
+    num_regressions++;
+    printf("REGRESSION %s %s: %.3f, baseline %.3f (%+.1f%%)\n",
+           r.Key().c_str(), metric, value, base,
+           base != 0 ? (value / base - 1.0) * 100.0 : 0.0);
+  };
+  for (const Result& r : results) {
+    const auto it = baseline.find(r.Key());
+    if (it == baseline.end()) continue;
+    const Result& base = it->second;
+    check(r, "mp_per_s", r.mp_per_s, base.mp_per_s, true);
+    check(r, "p99_ms", r.p99_ms, base.p99_ms, false);
+    check(r, "peak_bytes", r.peak_bytes, base.peak_bytes, false);
+    check(r, "bytes", r.bytes, base.bytes, false);
+  }
+  for (const auto& entry : baseline) {
+    const bool found =
+        std::any_of(results.begin(), results.end(), [&](const Result& r) {
+          return r.Key() == entry.first;
+        });
+    if (!found) {
+      num_regressions++;
+      printf("REGRESSION %s: missing\n", entry.first.c_str());
+    }
+  }
+  return num_regressions;
+}
+
+int Run(int argc, const char** argv) {
+  Args args;
+  CommandLineParser parser;
+  parser.AddOptionValue('\0', "corpus", "DIR",
+                        "directory of the test data with the input images",
+                        &args.corpus, &ParseString);
+  parser.AddOptionValue('o', "output", "FILE",
+                        "write the report to this file", &args.output,
+                        &ParseString);
+  parser.AddOptionValue('b', "baseline", "FILE",
+                        "report of an earlier run to compare with; the exit "
+                        "code is 1 if a metric regressed",
+                        &args.baseline, &ParseString);
+  parser.AddOptionValue('\0', "threads", "N,N,...",
+                        "comma-separated thread counts, default 1,4,16",
+                        &args.threads, &ParseString);
+  parser.AddOptionValue('\0', "filter", "NAME",
+                        "only run the scenarios whose name contains this",
+                        &args.filter, &ParseString);
+  parser.AddOptionValue('\0', "reps", "N",
+                        "repetitions of each operation, the first excluded "
+                        "from the statistics, default 5",
+                        &args.reps, &ParseUnsigned);
+  parser.AddOptionValue('\0', "tolerance", "PERCENT",
+                        "how much worse than the baseline a metric may be, "
+                        "default 5",
+                        &args.tolerance, &ParseFloat);
+
+  if (!parser.Parse(argc, argv)) {
+    fprintf(stderr, "See -h for help.\n");
+    return EXIT_FAILURE;
+  }
+  if (parser.HelpFlagPassed()) {
+    parser.PrintHelp();
+    return EXIT_SUCCESS;
+  }
+  std::vector<size_t> threads;
+  if (!ParseThreads(args.threads, &threads)) {
+    fprintf(stderr, "Invalid --threads %s\n", args.threads.c_str());
+    return EXIT_FAILURE;
+  }
+  if (args.corpus.empty() || args.reps == 0) {
+    fprintf(stderr, "Missing --corpus or --reps.\nSee -h for help.\n");
+    return EXIT_FAILURE;
+  }
+  std::map<std::string, Result> baseline;
+  if (!args.baseline.empty() && !ReadReport(args.baseline, &baseline)) {
+    return EXIT_FAILURE;
+  }
+  if (!args.filter.empty()) {
+    for (auto it = baseline.begin(); it != baseline.end();) {
+      it = it->first.find(args.filter) == std::string::npos
+               ? baseline.erase(it)
+               : std::next(it);
+    }
+  }
+
+  std::vector<Result> results;
+  bool ok = true;
+  printf("%s\n", kReportHeader);
+  for (const Scenario& scenario : kScenarios) {
+    if (std::string(scenario.name).find(args.filter) == std::string::npos) {
+      continue;
+    }
+    Input input;
+    if (!LoadInput(scenario, args.corpus, &input)) {
+      ok = false;
+      continue;
+    }
+    const size_t first = results.size();
+    for (size_t num_threads : threads) {
+      if (!RunScenario(scenario, input, num_threads, args.reps, &results)) {
+        ok = false;
+        break;
+      }
+    }
+    // Encode and decode results alternate, starting with the first thread
+    // count.
+    for (size_t i = first; i < results.size(); i++) {
+      const Result& reference = results[first + (i - first) % 2];
+      results[i].scaling = reference.mp_per_s > 0
+                               ? results[i].mp_per_s / reference.mp_per_s
+                               : 0.0;
+      printf("%s\n", FormatResult(results[i]).c_str());
+    }
+  }
+
+  if (!args.output.empty() && !WriteReport(results, args.output)) {
+    fprintf(stderr, "Failed to write %s\n", args.output.c_str());
+    ok = false;
+  }
+  if (!args.baseline.empty()) {
+    const size_t num_regressions =
+        CompareWithBaseline(results, baseline, args.tolerance);
+    printf("%zu regressions compared with %s\n", num_regressions,
+           args.baseline.c_str());
+    if (num_regressions != 0) ok = false;
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}  // namespace
+}  // namespace tools
+}  // namespace jpegxl
+
+int main(int argc, const char** argv) {
+  return jpegxl::tools::Run(argc, argv);
+}
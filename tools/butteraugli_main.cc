@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <string>
 #include <vector>
@@ -43,7 +44,7 @@ Status WriteImage(Image3F&& image, const std::string& filename) {
 Status RunButteraugli(const char* pathname1, const char* pathname2,
                       const std::string& distmap_filename,
                       const std::string& colorspace_hint, double p,
-                      float intensity_target) {
+                      float intensity_target, size_t band_ysize) {
   extras::ColorHints color_hints;
   if (!colorspace_hint.empty()) {
     color_hints.Add("color_space", colorspace_hint);
@@ -78,6 +79,7 @@ Status RunButteraugli(const char* pathname1, const char* pathname2,
   ba_params.hf_asymmetry = 0.8f;
   ba_params.xmul = 1.0f;
   ba_params.intensity_target = intensity_target;
+  ba_params.band_ysize = band_ysize;
   const float distance = ButteraugliDistance(io1.Main(), io2.Main(), ba_params,
                                              GetJxlCms(), &distmap, &pool);
   printf("%.10f\n", distance);
@@ -102,12 +104,14 @@ int main(int argc, char** argv) {
     fprintf(stderr,
             "Usage: %s <reference> <distorted> [--distmap <distmap>] "
             "[--intensity_target <intensity_target>]\n"
-            "[--colorspace <colorspace_hint>]\n"
+            "[--colorspace <colorspace_hint>] [--band_ysize <rows>]\n"
             "NOTE: images get converted to linear sRGB for butteraugli. Images"
             " without attached profiles (such as ppm or pfm) are interpreted"
             " as nonlinear sRGB. The hint format is RGB_D65_SRG_Rel_Lin for"
             " linear sRGB. Intensity target is viewing conditions screen nits"
-            ", defaults to 80.\n",
+            ", defaults to 80. A nonzero band_ysize computes the distmap in"
+            " bands of that many rows, which uses much less memory on large"
+            " images.\n",
             argv[0]);
     return 1;
   }
@@ -115,6 +119,7 @@ int main(int argc, char** argv) {
   std::string colorspace;
   double p = 3;
   float intensity_target = 80.0;  // sRGB intensity target.
+  size_t band_ysize = 0;
   for (int i = 3; i < argc; i++) {
     if (std::string(argv[i]) == "--distmap" && i + 1 < argc) {
       distmap = argv[++i];
@@ -122,6 +127,13 @@ int main(int argc, char** argv) {
       colorspace = argv[++i];
     } else if (std::string(argv[i]) == "--intensity_target" && i + 1 < argc) {
       intensity_target = std::stof(std::string(argv[i + 1]));
+    } else if (std::string(argv[i]) == "--band_ysize" && i + 1 < argc) {
+      char* end;
+      band_ysize = strtoul(argv[++i], &end, 10);
+      if (end == argv[i]) {
+        fprintf(stderr, "Failed to parse band_ysize \"%s\".\n", argv[i]);
+        return 1;
+      }
     } else if (std::string(argv[i]) == "--pnorm" && i + 1 < argc) {
       char* end;
       p = strtod(argv[++i], &end);
@@ -136,7 +148,7 @@ int main(int argc, char** argv) {
   }
 
   return jxl::RunButteraugli(argv[1], argv[2], distmap, colorspace, p,
-                             intensity_target)
+                             intensity_target, band_ysize)
              ? 0
              : 1;
 }
@@ -28,6 +28,7 @@
 #include "lib/jxl/base/thread_pool_internal.h"
 #include "lib/jxl/codec_in_out.h"
 #include "lib/jxl/common.h"
+#include "lib/jxl/enc_animation.h"
 #include "lib/jxl/enc_cache.h"
 #include "lib/jxl/enc_color_management.h"
 #include "lib/jxl/enc_file.h"
@@ -104,11 +105,18 @@ void SetParametersForSizeOrBitrate(jxl::ThreadPoolInternal* pool,
     return;
   }
 
+  // The candidates only differ in the distance, so they share the analysis of
+  // the image that does not depend on it.
+  jxl::PassesEncoderState search_state;
+  search_state.reuse_analysis = true;
+  if (s.params.use_new_heuristics) {
+    search_state.heuristics = jxl::make_unique<jxl::FastEncoderHeuristics>();
+  }
   for (int i = 0; i < 7; ++i) {
     s.params.butteraugli_distance = static_cast<float>(dist);
     jxl::PaddedBytes candidate;
-    bool ok =
-        CompressJxl(io, decode_mps, pool, s, &candidate, /*print_stats=*/false);
+    bool ok = EncodeFile(s.params, &io, &search_state, &candidate,
+                         jxl::GetJxlCms(), /*aux_out=*/nullptr, pool);
     if (!ok) {
       printf(
           "Compression error occurred during the search for best size. "
@@ -286,6 +294,11 @@ void CompressArgs::AddCommandLineOptions(CommandLineParser* cmdline) {
   cmdline->AddOptionFlag('\0', "premultiply",
                          "Force premultiplied (associated) alpha.",
                          &force_premultiplied, &SetBooleanTrue, 1);
+  cmdline->AddOptionFlag('\0', "crop_animation_frames",
+                         "For animations, only encode the region of each frame "
+                         "that changed since the previous frame, and merge "
+                         "unchanged frames into the previous one.",
+                         &crop_animation_frames, &SetBooleanTrue, 1);
   cmdline->AddOptionValue('\0', "keep_invisible", "0|1",
                           "force disable/enable preserving color of invisible "
                           "pixels (default: 1 if lossless, 0 if lossy).",
@@ -334,6 +347,10 @@ void CompressArgs::AddCommandLineOptions(CommandLineParser* cmdline) {
                           &num_threads, &ParseUnsigned, 1);
   cmdline->AddOptionValue('\0', "num_reps", "N", "how many times to compress.",
                           &num_reps, &ParseUnsigned, 1);
+  cmdline->AddOptionValue('\0', "warmup_reps", "N",
+                          "how many of the first compressions to exclude from "
+                          "the latency percentiles (default: 1).",
+                          &warmup_reps, &ParseUnsigned, 1);
 
   cmdline->AddOptionValue('\0', "noise", "0|1",
                           "force disable/enable noise generation.",
@@ -650,17 +667,18 @@ jxl::Status LoadAll(CompressArgs& args, jxl::ThreadPoolInternal* pool,
                     jxl::CodecInOut* io, double* decode_mps) {
   const double t0 = jxl::Now();
 
-  jxl::PaddedBytes encoded;
-  JXL_RETURN_IF_ERROR(jxl::ReadFile(args.params.file_in, &encoded));
+  jxl::FileContents input;
+  JXL_RETURN_IF_ERROR(input.Open(args.params.file_in));
+  const jxl::Span<const uint8_t> encoded(input);
   jxl::extras::Codec input_codec;
   bool ok;
   if (args.jpeg_transcode && encoded.size() >= 2 && encoded[0] == 0xFF &&
       encoded[1] == 0xD8) {
     input_codec = jxl::extras::Codec::kJPG;
-    ok = jxl::jpeg::DecodeImageJPG(jxl::Span<const uint8_t>(encoded), io);
+    ok = jxl::jpeg::DecodeImageJPG(encoded, io);
   } else {
-    ok = jxl::SetFromBytes(jxl::Span<const uint8_t>(encoded), args.color_hints,
-                           io, nullptr, &input_codec);
+    ok = jxl::SetFromBytes(encoded, args.color_hints, io, nullptr,
+                           &input_codec);
   }
   if (!ok) {
     fprintf(stderr, "Failed to read image %s.\n", args.params.file_in);
@@ -701,6 +719,12 @@ jxl::Status LoadAll(CompressArgs& args, jxl::ThreadPoolInternal* pool,
   const size_t pixels = io->xsize() * io->ysize();
   *decode_mps = pixels * io->frames.size() * 1E-6 / (t1 - t0);
 
+  // Done after measuring the decoding speed, which counts the input frames.
+  if (args.crop_animation_frames && !jxl::CropAnimationFrames(io)) {
+    fprintf(stderr, "Failed to crop the animation frames.\n");
+    return false;
+  }
+
   return true;
 }
 
@@ -724,6 +748,7 @@ jxl::Status CompressJxl(jxl::CodecInOut& io, double decode_mps,
     aux_out.SetInspectorImage3F(args.inspector_image3f);
   }
   SpeedStats stats;
+  stats.SetWarmupReps(args.warmup_reps);
   jxl::PassesEncoderState passes_encoder_state;
   if (args.params.use_new_heuristics) {
     passes_encoder_state.heuristics =
@@ -731,6 +756,7 @@ jxl::Status CompressJxl(jxl::CodecInOut& io, double decode_mps,
   }
   for (size_t i = 0; i < args.num_reps; ++i) {
     const double t0 = jxl::Now();
+    const double cpu0 = jxl::CpuTime();
     jxl::Status ok = false;
     if (io.Main().IsJPEG()) {
       // TODO(lode): automate this in the encoder. The encoder must in the
@@ -746,7 +772,7 @@ jxl::Status CompressJxl(jxl::CodecInOut& io, double decode_mps,
       return false;
     }
     const double t1 = jxl::Now();
-    stats.NotifyElapsed(t1 - t0);
+    stats.NotifyElapsed(t1 - t0, jxl::CpuTime() - cpu0);
     stats.SetImageSize(io.xsize(), io.ysize());
   }
 
@@ -63,6 +63,7 @@ struct CompressArgs {
   jxl::CompressParams params;
   size_t num_threads = std::thread::hardware_concurrency();
   size_t num_reps = 1;
+  size_t warmup_reps = 1;
   float intensity_target = 0;
 
   // Filename for the user provided saliency-map.
@@ -80,6 +81,7 @@ struct CompressArgs {
   bool progressive = false;
   bool default_settings = true;
   bool force_premultiplied = false;
+  bool crop_animation_frames = false;
 
   // Will get passed on to AuxOut.
   jxl::InspectorImage3F inspector_image3f;
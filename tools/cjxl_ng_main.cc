@@ -12,11 +12,14 @@
 // that this minimizes the size of libjxl.
 
 #include <stdint.h>
+#include <stdio.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -25,6 +28,8 @@
 #include "jxl/codestream_header.h"
 #include "jxl/encode.h"
 #include "jxl/encode_cxx.h"
+#include "jxl/resizable_parallel_runner.h"
+#include "jxl/resizable_parallel_runner_cxx.h"
 #include "jxl/thread_parallel_runner.h"
 #include "jxl/thread_parallel_runner_cxx.h"
 #include "jxl/types.h"
@@ -38,6 +43,7 @@
 #include "lib/jxl/base/file_io.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/size_constraints.h"
+#include "tools/file_batch.h"
 
 DECLARE_bool(help);
 DECLARE_bool(helpshort);
@@ -102,6 +108,11 @@ DEFINE_bool(patches, false,
             "Force disable/enable patches generation. "
             "(not provided = default, 0 = disable, 1 = enable).");
 
+DEFINE_bool(classify_content, false,
+            "Choose between modular and VarDCT with or without patches for "
+            "lossy frames from a quick analysis of their pixels. Explicit "
+            "--modular and --patches take precedence.");
+
 DEFINE_bool(gaborish, false,
             "Force disable/enable the gaborish filter. "
             "(not provided = default, 0 = disable, 1 = enable).");
@@ -163,6 +174,18 @@ DEFINE_int64(num_threads, -1,
              "Number of worker threads (-1 == use machine default, "
              "0 == do not use multithreading).");
 
+DEFINE_bool(batch, false,
+            "Encode many files with one encoder and thread pool: the input is "
+            "a directory, or a text file listing one input per line, and the "
+            "output is the directory to write the .jxl files to, named after "
+            "the inputs. Prints the aggregate throughput, in which the pixels "
+            "of losslessly transcoded JPEGs are not counted.");
+
+DEFINE_bool(stream_input, true,
+            "Read PPM, PGM, PAM and PFM inputs a strip of rows at a time while "
+            "encoding, instead of loading the whole file first. Not used by "
+            "--batch.");
+
 DEFINE_int64(num_reps, 1, "How many times to compress. (For benchmarking).");
 
 DEFINE_int32(modular_group_size, -1,
@@ -240,6 +263,17 @@ DEFINE_int32(brotli_effort, 9,
              "Brotli effort setting. Range: 0 .. 11.\n"
              "    Default: 9. Higher number is more effort (slower).");
 
+DEFINE_int32(time_budget_ms, 0,
+             "Wall-clock budget for encoding each frame, in milliseconds. The "
+             "encoder lowers the effort of its slower stages when it falls "
+             "behind. 0 = no budget.");
+
+DEFINE_int32(max_decode_cycles, 0,
+             "Maximum estimated decoding cost of each frame, in cycles per "
+             "pixel. The encoder disables decoding tools, such as the "
+             "edge-preserving filter and noise, until the estimate fits. "
+             "0 = no limit.");
+
 DEFINE_string(frame_indexing, "",
               // TODO(tfish): Add a more convenient vanilla alternative.
               "If non-empty, a string matching '^[01]*$'. If this string has a "
@@ -325,7 +359,7 @@ void SetDistanceFromFlags(JxlEncoderFrameSettings* jxl_encoder_frame_settings,
 
 typedef std::function<std::string(int32_t)> flag_check_fn;
 
-bool IsJPG(const jxl::PaddedBytes& image_data) {
+bool IsJPG(const jxl::Span<const uint8_t> image_data) {
   return (image_data.size() >= 2 && image_data[0] == 0xFF &&
           image_data[1] == 0xD8);
 }
@@ -361,14 +395,14 @@ void SetCodestreamLevel(JxlEncoder* jxl_encoder, bool for_lossless_jpeg) {
 
 // TODO(tfish): Replace with non-C-API library function.
 // Implementation is in extras/.
-jxl::Status GetPixeldata(const jxl::PaddedBytes& image_data,
+jxl::Status GetPixeldata(const jxl::Span<const uint8_t> image_data,
                          jxl::extras::PackedPixelFile& ppf,
                          jxl::extras::Codec& codec) {
   // Any valid encoding is larger (ensures codecs can read the first few bytes).
   constexpr size_t kMinBytes = 9;
 
   if (image_data.size() < kMinBytes) return JXL_FAILURE("Input too small.");
-  jxl::Span<const uint8_t> encoded(image_data);
+  const jxl::Span<const uint8_t> encoded = image_data;
 
   ppf.info.orientation = JXL_ORIENT_IDENTITY;
   jxl::extras::ColorHints color_hints;
@@ -431,6 +465,511 @@ void set_usage_message_and_version(const char* argv0) {
                            std::to_string(version % 1000));
 }
 
+// Sets the encoder options from the flags and adds the input to the encoder:
+// `image_data` if it is a JPEG to transcode losslessly, and its pixels in `ppf`
+// otherwise. `ensure_image_loaded` is called once the flags are validated and
+// must load the input. If it returns a PNMRowReader, the pixels of the single
+// frame of `ppf` are read from it while encoding instead. Exits if a flag is
+// invalid. `image_data` is only set once the input is loaded.
+int AddInputToEncoder(
+    JxlEncoder* jxl_encoder,
+    const std::function<jxl::extras::PNMRowReader*()>& ensure_image_loaded,
+    const jxl::Span<const uint8_t>& image_data,
+    const jxl::extras::PackedPixelFile& ppf,
+    const jxl::extras::Codec& codec) {
+  JxlEncoderFrameSettings* jxl_encoder_frame_settings =
+      JxlEncoderFrameSettingsCreate(jxl_encoder, nullptr);
+
+  auto process_flag = [&jxl_encoder_frame_settings](
+                          const char* flag_name, int32_t flag_value,
+                          JxlEncoderFrameSettingId encoder_option,
+                          flag_check_fn flag_check) {
+    gflags::CommandLineFlagInfo flag_info =
+        gflags::GetCommandLineFlagInfoOrDie(flag_name);
+    if (!flag_info.is_default) {
+      std::string error = flag_check(flag_value);
+      if (!error.empty()) {
+        std::cerr << "Invalid flag value for --" << flag_name << ": " << error
+                  << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      SetFlagFrameOptionOrDie(flag_name, flag_value,
+                              jxl_encoder_frame_settings, encoder_option);
+    }
+  };
+
+  auto process_bool_flag = [&process_flag](
+                               const char* flag_name, int32_t flag_value,
+                               JxlEncoderFrameSettingId encoder_option) {
+    process_flag(flag_name, static_cast<int32_t>(flag_value), encoder_option,
+                 [](int32_t x) { return ""; });
+  };
+
+  {  // Processing tuning flags.
+    bool use_container = FLAGS_container;
+    // TODO(tfish): Set use_container according to need of encoded data.
+    // This will likely require moving this piece out of flags-processing.
+    if (FLAGS_strip) {
+      use_container = false;
+    }
+    JxlEncoderUseContainer(jxl_encoder, use_container);
+
+    process_bool_flag("modular", FLAGS_modular,
+                      JXL_ENC_FRAME_SETTING_MODULAR);
+    process_bool_flag("keep_invisible", FLAGS_keep_invisible,
+                      JXL_ENC_FRAME_SETTING_KEEP_INVISIBLE);
+    process_bool_flag("dots", FLAGS_dots, JXL_ENC_FRAME_SETTING_DOTS);
+    process_bool_flag("patches", FLAGS_patches,
+                      JXL_ENC_FRAME_SETTING_PATCHES);
+    process_bool_flag("classify_content", FLAGS_classify_content,
+                      JXL_ENC_FRAME_SETTING_CLASSIFY_CONTENT);
+    process_bool_flag("gaborish", FLAGS_gaborish,
+                      JXL_ENC_FRAME_SETTING_GABORISH);
+    process_bool_flag("group_order", FLAGS_group_order,
+                      JXL_ENC_FRAME_SETTING_GROUP_ORDER);
+
+    if (!FLAGS_frame_indexing.empty()) {
+      bool must_be_all_zeros = FLAGS_frame_indexing[0] != '1';
+      for (char c : FLAGS_frame_indexing) {
+        if (c == '1') {
+          if (must_be_all_zeros) {
+            std::cerr
+                << "Invalid --frame_indexing. If the first character is "
+                   "'0', all must be '0'."
+                << std::endl;
+            return EXIT_FAILURE;
+          }
+        } else if (c != '0') {
+          std::cerr << "Invalid --frame_indexing. Must match the pattern "
+                       "'^(0*|1[01]*)$'."
+                    << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    }
+
+    process_flag(
+        "effort", FLAGS_effort, JXL_ENC_FRAME_SETTING_EFFORT,
+        [](int32_t x) -> std::string {
+          return (1 <= x && x <= 9) ? "" : "Valid range is {1, 2, ..., 9}.";
+        });
+    process_flag("time_budget_ms", FLAGS_time_budget_ms,
+                 JXL_ENC_FRAME_SETTING_TIME_BUDGET,
+                 [](int32_t x) -> std::string {
+                   return x >= 0 ? "" : "Must be non-negative.";
+                 });
+    process_flag("max_decode_cycles", FLAGS_max_decode_cycles,
+                 JXL_ENC_FRAME_SETTING_MAX_DECODE_CYCLES,
+                 [](int32_t x) -> std::string {
+                   return x >= 0 ? "" : "Must be non-negative.";
+                 });
+    process_flag(
+        "brotli_effort", FLAGS_brotli_effort,
+        JXL_ENC_FRAME_SETTING_BROTLI_EFFORT, [](int32_t x) -> std::string {
+          return (-1 <= x && x <= 11) ? ""
+                                      : "Valid range is {-1, 0, 1, ..., 11}.";
+        });
+    process_flag("epf", FLAGS_epf, JXL_ENC_FRAME_SETTING_EPF,
+                 [](int32_t x) -> std::string {
+                   return (-1 <= x && x <= 3)
+                              ? ""
+                              : "Valid range is {-1, 0, 1, 2, 3}.\n";
+                 });
+    process_flag(
+        "faster_decoding", FLAGS_faster_decoding,
+        JXL_ENC_FRAME_SETTING_DECODING_SPEED, [](int32_t x) -> std::string {
+          return (0 <= x && x <= 4) ? ""
+                                    : "Valid range is {0, 1, 2, 3, 4}.\n";
+        });
+    process_flag("resampling", FLAGS_resampling,
+                 JXL_ENC_FRAME_SETTING_RESAMPLING,
+                 [](int32_t x) -> std::string {
+                   return (x == -1 || x == 1 || x == 4 || x == 8)
+                              ? ""
+                              : "Valid values are {-1, 1, 2, 4, 8}.\n";
+                 });
+    process_flag("ec_resampling", FLAGS_ec_resampling,
+                 JXL_ENC_FRAME_SETTING_EXTRA_CHANNEL_RESAMPLING,
+                 [](int32_t x) -> std::string {
+                   return (x == -1 || x == 1 || x == 4 || x == 8)
+                              ? ""
+                              : "Valid values are {-1, 1, 2, 4, 8}.\n";
+                 });
+    process_flag("photon_noise_iso", FLAGS_photon_noise_iso,
+                 JXL_ENC_FRAME_SETTING_PHOTON_NOISE,
+                 [](int32_t x) -> std::string {
+                   return x >= 0 ? "" : "Must be >= 0.";
+                 });
+    process_bool_flag("already_downsampled", FLAGS_already_downsampled,
+                      JXL_ENC_FRAME_SETTING_ALREADY_DOWNSAMPLED);
+    SetDistanceFromFlags(jxl_encoder_frame_settings, codec);
+
+    if (!FLAGS_group_order &&
+        (FLAGS_center_x != -1 || FLAGS_center_y != -1)) {
+      std::cerr
+          << "Invalid flag combination. Setting --center_x or --center_y "
+          << "requires setting --group_order=1" << std::endl;
+      return EXIT_FAILURE;
+    }
+    process_flag("center_x", FLAGS_center_x,
+                 JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_X,
+                 [](int32_t x) -> std::string {
+                   if (x < -1) {
+                     return "Valid values are: -1 or [0 .. xsize).";
+                   }
+                   return "";
+                 });
+    process_flag("center_y", FLAGS_center_y,
+                 JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_Y,
+                 [](int32_t x) -> std::string {
+                   if (x < -1) {
+                     return "Valid values are: -1 or [0 .. ysize).";
+                   }
+                   return "";
+                 });
+  }
+  {  // Progressive/responsive mode settings.
+    bool qprogressive_ac_set =
+        !gflags::GetCommandLineFlagInfoOrDie("qprogressive_ac").is_default;
+    int32_t qprogressive_ac = FLAGS_qprogressive_ac ? 1 : 0;
+    bool responsive_set =
+        !gflags::GetCommandLineFlagInfoOrDie("responsive").is_default;
+    int32_t responsive = FLAGS_responsive ? 1 : 0;
+
+    process_flag(
+        "progressive_dc", FLAGS_progressive_dc,
+        JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, [](int32_t x) -> std::string {
+          return (-1 <= x && x <= 2) ? "" : "Valid range is {-1, 0, 1, 2}.\n";
+        });
+    process_bool_flag("progressive_ac", FLAGS_progressive_ac,
+                      JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC);
+
+    if (FLAGS_progressive) {
+      qprogressive_ac = 1;
+      qprogressive_ac_set = true;
+      responsive = 1;
+      responsive_set = true;
+    }
+    if (responsive_set) {
+      SetFlagFrameOptionOrDie("responsive", responsive,
+                              jxl_encoder_frame_settings,
+                              JXL_ENC_FRAME_SETTING_RESPONSIVE);
+    }
+    if (qprogressive_ac_set) {
+      SetFlagFrameOptionOrDie("qprogressive_ac", qprogressive_ac,
+                              jxl_encoder_frame_settings,
+                              JXL_ENC_FRAME_SETTING_QPROGRESSIVE_AC);
+    }
+  }
+  {  // Modular mode related.
+    process_flag("modular_group_size", FLAGS_modular_group_size,
+                 JXL_ENC_FRAME_SETTING_MODULAR_GROUP_SIZE,
+                 [](int32_t x) -> std::string {
+                   return (-1 <= x && x <= 3)
+                              ? ""
+                              : "Invalid --modular_group_size. Valid "
+                                "range is {-1, 0, 1, 2, 3}.\n";
+                 });
+    process_flag("modular_predictor", FLAGS_modular_predictor,
+                 JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR,
+                 [](int32_t x) -> std::string {
+                   return (0 <= x && x <= 15)
+                              ? ""
+                              : "Invalid --modular_predictor. Valid "
+                                "range is {-1, 0, 1, ..., 15}.\n";
+                 });
+    process_flag(
+        "modular_colorspace", FLAGS_modular_colorspace,
+        JXL_ENC_FRAME_SETTING_MODULAR_COLOR_SPACE,
+        [](int32_t x) -> std::string {
+          return (0 <= x && x <= 15)
+                     ? ""
+                     : "Invalid --modular_colorspace. Valid range is "
+                       "{-1, 0, 1, ..., 37}.\n";
+        });
+    process_flag("modular_ma_tree_learning_percent",
+                 FLAGS_modular_ma_tree_learning_percent,
+                 JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_PERCENT,
+                 [](int32_t x) -> std::string {
+                   return (-1 <= x && x <= 100)
+                              ? ""
+                              : "Invalid --modular_ma_tree_learning_percent. "
+                                "Valid range is {-1, 0, 1, ..., 100}.\n";
+                 });
+    process_flag("modular_nb_prev_channels", FLAGS_modular_nb_prev_channels,
+                 JXL_ENC_FRAME_SETTING_MODULAR_NB_PREV_CHANNELS,
+                 [](int32_t x) -> std::string {
+                   return (-1 <= x && x <= 11)
+                              ? ""
+                              : "Invalid --modular_nb_prev_channels. Valid "
+                                "range is {-1, 0, 1, ..., 11}.\n";
+                 });
+    process_bool_flag("modular_lossy_palette", FLAGS_modular_lossy_palette,
+                      JXL_ENC_FRAME_SETTING_LOSSY_PALETTE);
+    process_flag("modular_palette_colors", FLAGS_modular_palette_colors,
+                 JXL_ENC_FRAME_SETTING_PALETTE_COLORS,
+                 [](int32_t x) -> std::string { return ""; });
+    process_flag(
+        "modular_channel_colors_global_percent",
+        FLAGS_modular_channel_colors_global_percent,
+        JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GLOBAL_PERCENT,
+        [](int32_t x) -> std::string {
+          return (-1 <= x && x <= 100)
+                     ? ""
+                     : "Invalid --modular_channel_colors_global_percent. "
+                       "Valid "
+                       "range is {-1, 0, 1, ..., 100}.\n";
+        });
+    process_flag(
+        "modular_channel_colors_group_percent",
+        FLAGS_modular_channel_colors_group_percent,
+        JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GROUP_PERCENT,
+        [](int32_t x) -> std::string {
+          return (-1 <= x && x <= 100)
+                     ? ""
+                     : "Invalid --modular_channel_colors_group_percent. "
+                       "Valid "
+                       "range is {-1, 0, 1, ..., 100}.\n";
+        });
+  }
+  jxl::extras::PNMRowReader* pnm_reader = ensure_image_loaded();
+  if (FLAGS_lossless_jpeg && IsJPG(image_data)) {
+    if (gflags::GetCommandLineFlagInfoOrDie("lossless_jpeg").is_default) {
+      std::cerr << "Note: Implicit-default for JPEG is lossless-transcoding. "
+                << "To silence this message, set --lossless_jpeg=(1|0)."
+                << std::endl;
+    }
+    if (FLAGS_jpeg_store_metadata) {
+      if (JXL_ENC_SUCCESS != JxlEncoderStoreJPEGMetadata(jxl_encoder, true)) {
+        std::cerr << "Storing JPEG metadata failed. " << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    process_bool_flag("jpeg_reconstruction_cfl",
+                      FLAGS_jpeg_reconstruction_cfl,
+                      JXL_ENC_FRAME_SETTING_JPEG_RECON_CFL);
+    SetCodestreamLevel(jxl_encoder, /*for_lossless_jpeg=*/true);
+    if (JXL_ENC_SUCCESS != JxlEncoderAddJPEGFrame(jxl_encoder_frame_settings,
+                                                  image_data.data(),
+                                                  image_data.size())) {
+      std::cerr << "JxlEncoderAddJPEGFrame() failed." << std::endl;
+      return EXIT_FAILURE;
+    }
+  } else {                          // Do JxlEncoderAddImageFrame().
+    size_t num_alpha_channels = 0;  // Adjusted below.
+    {
+      JxlBasicInfo basic_info = ppf.info;
+      if (basic_info.alpha_bits > 0) num_alpha_channels = 1;
+      basic_info.intensity_target =
+          static_cast<float>(FLAGS_intensity_target);
+      basic_info.num_extra_channels = num_alpha_channels;
+      basic_info.num_color_channels = ppf.info.num_color_channels;
+      basic_info.uses_original_profile = JXL_FALSE;
+      if (JXL_ENC_SUCCESS !=
+          JxlEncoderSetBasicInfo(jxl_encoder, &basic_info)) {
+        std::cerr << "JxlEncoderSetBasicInfo() failed." << std::endl;
+        return EXIT_FAILURE;
+      }
+      SetCodestreamLevel(jxl_encoder, /*for_lossless_jpeg=*/false);
+    }
+
+    if (!ppf.icc.empty()) {
+      JxlEncoderSetICCProfile(jxl_encoder, ppf.icc.data(), ppf.icc.size());
+      if (JXL_ENC_SUCCESS != JxlEncoderSetICCProfile(jxl_encoder,
+                                                     ppf.icc.data(),
+                                                     ppf.icc.size())) {
+        std::cerr << "JxlEncoderSetICCProfile() failed." << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else {
+      if (JXL_ENC_SUCCESS !=
+          JxlEncoderSetColorEncoding(jxl_encoder, &ppf.color_encoding)) {
+        std::cerr << "JxlEncoderSetColorEncoding() failed." << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    for (size_t num_frame = 0; num_frame < ppf.frames.size(); ++num_frame) {
+      const jxl::extras::PackedFrame& pframe = ppf.frames[num_frame];
+      const jxl::extras::PackedImage& pimage = pframe.color;
+      JxlPixelFormat ppixelformat = pimage.format;
+      {
+        if (JXL_ENC_SUCCESS !=
+            JxlEncoderSetFrameHeader(jxl_encoder_frame_settings,
+                                     &pframe.frame_info)) {
+          std::cerr << "JxlEncoderSetFrameHeader() failed." << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+      if (num_frame < FLAGS_frame_indexing.size() &&
+          FLAGS_frame_indexing[num_frame] == '1') {
+        if (JXL_ENC_SUCCESS !=
+            JxlEncoderFrameSettingsSetOption(jxl_encoder_frame_settings,
+                                             JXL_ENC_FRAME_INDEX_BOX, 1)) {
+          std::cerr << "Setting option JXL_ENC_FRAME_INDEX_BOX failed."
+                    << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+      jxl::Status enc_status(true);
+      {
+        if (num_alpha_channels > 0) {
+          JxlExtraChannelInfo extra_channel_info;
+          JxlEncoderInitExtraChannelInfo(JXL_CHANNEL_ALPHA,
+                                         &extra_channel_info);
+          enc_status = JxlEncoderSetExtraChannelInfo(jxl_encoder, 0,
+                                                     &extra_channel_info);
+          if (JXL_ENC_SUCCESS != enc_status) {
+            std::cerr << "JxlEncoderSetExtraChannelInfo() failed."
+                      << std::endl;
+            return EXIT_FAILURE;
+          }
+          if (FLAGS_premultiply != -1) {
+            if (!(FLAGS_premultiply == 0 || FLAGS_premultiply == 1)) {
+              std::cerr << "Flag --premultiply must be one of: -1, 0, 1."
+                        << std::endl;
+              return EXIT_FAILURE;
+            }
+            extra_channel_info.alpha_premultiplied = FLAGS_premultiply;
+          }
+          // We take the extra channel blend info frame_info, but don't do
+          // clamping.
+          JxlBlendInfo extra_channel_blend_info =
+              pframe.frame_info.layer_info.blend_info;
+          extra_channel_blend_info.clamp = JXL_FALSE;
+          JxlEncoderSetExtraChannelBlendInfo(jxl_encoder_frame_settings, 0,
+                                             &extra_channel_blend_info);
+        }
+        if (pnm_reader != nullptr) {
+          enc_status = JxlEncoderAddImageFrameFromRowSource(
+              jxl_encoder_frame_settings, &ppixelformat,
+              jxl::extras::PNMRowReader::ReadRowsCallback, pnm_reader);
+        } else {
+          enc_status = JxlEncoderAddImageFrame(
+              jxl_encoder_frame_settings, &ppixelformat, pimage.pixels(),
+              pimage.pixels_size);
+        }
+        if (JXL_ENC_SUCCESS != enc_status) {
+          std::cerr << "JxlEncoderAddImageFrame() failed." << std::endl;
+          return EXIT_FAILURE;
+        }
+        // Only set extra channel buffer if is is provided non-interleaved.
+        if (!pframe.extra_channels.empty()) {
+          enc_status = JxlEncoderSetExtraChannelBuffer(
+              jxl_encoder_frame_settings, &ppixelformat,
+              pframe.extra_channels[0].pixels(),
+              pframe.extra_channels[0].stride *
+                  pframe.extra_channels[0].ysize,
+              0);
+          if (JXL_ENC_SUCCESS != enc_status) {
+            std::cerr << "JxlEncoderSetExtraChannelBuffer() failed."
+                      << std::endl;
+            return EXIT_FAILURE;
+          }
+        }
+      }
+    }
+  }
+  JxlEncoderCloseInput(jxl_encoder);
+  return EXIT_SUCCESS;
+}
+
+// Runs the encoder and returns its output in `compressed`.
+int ProcessOutput(JxlEncoder* jxl_encoder, std::vector<uint8_t>* compressed) {
+  compressed->resize(4096);
+  uint8_t* next_out = compressed->data();
+  size_t avail_out = compressed->size() - (next_out - compressed->data());
+  JxlEncoderStatus process_result = JXL_ENC_NEED_MORE_OUTPUT;
+  while (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
+    process_result =
+        JxlEncoderProcessOutput(jxl_encoder, &next_out, &avail_out);
+    if (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
+      size_t offset = next_out - compressed->data();
+      compressed->resize(compressed->size() * 2);
+      next_out = compressed->data() + offset;
+      avail_out = compressed->size() - offset;
+    }
+  }
+  compressed->resize(next_out - compressed->data());
+  if (JXL_ENC_SUCCESS != process_result) {
+    std::cerr << "JxlEncoderProcessOutput failed." << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Large buffers the encoder keeps between the inputs of --batch, which often
+// have similar dimensions, instead of allocating them again for each one.
+constexpr size_t kBatchBufferPoolBytes = size_t{256} << 20;
+
+// Encodes every input of --batch with one encoder and one runner, writing the
+// outputs to `output_dir`.
+int CompressBatch(const char* input, const char* output_dir) {
+  std::vector<std::string> inputs;
+  if (!jpegxl::tools::ListBatchInputs(input, &inputs)) {
+    std::cerr << "Listing the inputs in " << input << " failed." << std::endl;
+    return EXIT_FAILURE;
+  }
+  JxlEncoderPtr enc = JxlEncoderMake(/*memory_manager=*/nullptr);
+  JxlEncoder* jxl_encoder = enc.get();
+  JxlEncoderSetBufferPool(jxl_encoder, kBatchBufferPoolBytes);
+  // The number of threads is set for each input from its dimensions.
+  JxlResizableParallelRunnerPtr runner;
+  size_t max_threads = 0;
+  if (FLAGS_num_threads != 0) {
+    runner = JxlResizableParallelRunnerMake(/*memory_manager=*/nullptr);
+    max_threads = FLAGS_num_threads == -1
+                      ? JxlThreadParallelRunnerDefaultNumWorkerThreads()
+                      : FLAGS_num_threads;
+  }
+
+  const jpegxl::tools::BatchStats stats = jpegxl::tools::RunBatch(
+      inputs, [&](const std::string& filename_in,
+                  const std::vector<uint8_t>& bytes,
+                  std::vector<jpegxl::tools::BatchOutputFile>* files,
+                  size_t* pixels) {
+        const jxl::Span<const uint8_t> image_data(bytes);
+        jxl::extras::PackedPixelFile ppf;
+        jxl::extras::Codec codec = jxl::extras::Codec::kUnknown;
+        if (!(FLAGS_lossless_jpeg && IsJPG(image_data))) {
+          if (!GetPixeldata(image_data, ppf, codec) || ppf.frames.empty()) {
+            return false;
+          }
+          *pixels = static_cast<size_t>(ppf.info.xsize) * ppf.info.ysize *
+                    ppf.frames.size();
+        }
+        JxlEncoderReset(jxl_encoder);
+        if (runner != nullptr) {
+          size_t num_threads = max_threads;
+          if (ppf.info.xsize != 0) {
+            num_threads = std::min<size_t>(
+                num_threads, JxlResizableParallelRunnerSuggestThreads(
+                                 ppf.info.xsize, ppf.info.ysize));
+          }
+          JxlResizableParallelRunnerSetThreads(runner.get(), num_threads);
+          if (JXL_ENC_SUCCESS !=
+              JxlEncoderSetParallelRunner(
+                  jxl_encoder, JxlResizableParallelRunner, runner.get())) {
+            std::cerr << "JxlEncoderSetParallelRunner failed." << std::endl;
+            return false;
+          }
+        }
+        // The input is already loaded.
+        if (AddInputToEncoder(
+                jxl_encoder,
+                []() -> jxl::extras::PNMRowReader* { return nullptr; },
+                image_data, ppf, codec) != EXIT_SUCCESS) {
+          return false;
+        }
+        files->resize(1);
+        (*files)[0].filename =
+            jpegxl::tools::BatchOutputPath(output_dir, filename_in, ".jxl");
+        return ProcessOutput(jxl_encoder, &(*files)[0].bytes) == EXIT_SUCCESS;
+      });
+  stats.Print();
+  return stats.num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -453,6 +992,7 @@ int main(int argc, char** argv) {
   }
   const char* filename_in = argv[1];
   const char* filename_out = argv[2];
+  if (FLAGS_batch) return CompressBatch(filename_in, filename_out);
 
   // Loading the input.
   // Depending on flags-settings, we want to either load a JPEG and
@@ -462,17 +1002,44 @@ int main(int argc, char** argv) {
   // not get reloaded as part of that.
   // Since we do not want to load the input before we decided that
   // flag-settings are valid, we need a mechanism to lazy-load the image.
+  // PNM inputs are instead read while encoding with --stream_input, so that
+  // large images are not held in memory in their file format as well.
+  // Other inputs are memory-mapped when possible, and `image_data` points to
+  // them once loaded.
   bool input_image_loaded = false;
-  jxl::PaddedBytes image_data;
+  jxl::FileContents input_contents;
+  jxl::Span<const uint8_t> image_data;
   jxl::extras::PackedPixelFile ppf;
   jxl::extras::Codec codec = jxl::extras::Codec::kUnknown;
-  auto ensure_image_loaded = [&filename_in, &input_image_loaded, &image_data,
-                              &ppf, &codec]() {
-    if (input_image_loaded) return;
-    if (!ReadFile(filename_in, &image_data)) {
+  std::unique_ptr<FILE, int (*)(FILE*)> input_file(nullptr, fclose);
+  jxl::extras::PNMRowReader pnm_reader;
+  auto ensure_image_loaded = [&filename_in, &input_image_loaded,
+                              &input_contents, &image_data, &ppf, &codec,
+                              &input_file,
+                              &pnm_reader]() -> jxl::extras::PNMRowReader* {
+    if (input_image_loaded) {
+      return input_file != nullptr ? &pnm_reader : nullptr;
+    }
+    if (FLAGS_stream_input) {
+      input_file.reset(fopen(filename_in, "rb"));
+      if (input_file != nullptr &&
+          pnm_reader.Init(input_file.get(), jxl::extras::ColorHints(),
+                          jxl::SizeConstraints(), &ppf)) {
+        codec = jxl::extras::Codec::kPNM;
+        // The frame has no pixels, only the default header and the format.
+        ppf.frames.emplace_back(ppf.info.xsize, /*ysize=*/0,
+                                pnm_reader.format());
+        input_image_loaded = true;
+        return &pnm_reader;
+      }
+      input_file.reset();
+      ppf = jxl::extras::PackedPixelFile();
+    }
+    if (!input_contents.Open(filename_in)) {
       std::cerr << "Reading image data failed." << std::endl;
       exit(EXIT_FAILURE);
     }
+    image_data = jxl::Span<const uint8_t>(input_contents);
     if (!(FLAGS_lossless_jpeg && IsJPG(image_data))) {
       jxl::Status status = GetPixeldata(image_data, ppf, codec);
       if (!status) {
@@ -485,6 +1052,7 @@ int main(int argc, char** argv) {
       }
     }
     input_image_loaded = true;
+    return nullptr;
   };
 
   JxlEncoderPtr enc = JxlEncoderMake(/*memory_manager=*/nullptr);
@@ -513,402 +1081,14 @@ int main(int argc, char** argv) {
       }
     }
 
-    JxlEncoderFrameSettings* jxl_encoder_frame_settings =
-        JxlEncoderFrameSettingsCreate(jxl_encoder, nullptr);
-
-    auto process_flag = [&jxl_encoder_frame_settings](
-                            const char* flag_name, int32_t flag_value,
-                            JxlEncoderFrameSettingId encoder_option,
-                            flag_check_fn flag_check) {
-      gflags::CommandLineFlagInfo flag_info =
-          gflags::GetCommandLineFlagInfoOrDie(flag_name);
-      if (!flag_info.is_default) {
-        std::string error = flag_check(flag_value);
-        if (!error.empty()) {
-          std::cerr << "Invalid flag value for --" << flag_name << ": " << error
-                    << std::endl;
-          exit(EXIT_FAILURE);
-        }
-        SetFlagFrameOptionOrDie(flag_name, flag_value,
-                                jxl_encoder_frame_settings, encoder_option);
-      }
-    };
-
-    auto process_bool_flag = [&process_flag](
-                                 const char* flag_name, int32_t flag_value,
-                                 JxlEncoderFrameSettingId encoder_option) {
-      process_flag(flag_name, static_cast<int32_t>(flag_value), encoder_option,
-                   [](int32_t x) { return ""; });
-    };
-
-    {  // Processing tuning flags.
-      bool use_container = FLAGS_container;
-      // TODO(tfish): Set use_container according to need of encoded data.
-      // This will likely require moving this piece out of flags-processing.
-      if (FLAGS_strip) {
-        use_container = false;
-      }
-      JxlEncoderUseContainer(jxl_encoder, use_container);
-
-      process_bool_flag("modular", FLAGS_modular,
-                        JXL_ENC_FRAME_SETTING_MODULAR);
-      process_bool_flag("keep_invisible", FLAGS_keep_invisible,
-                        JXL_ENC_FRAME_SETTING_KEEP_INVISIBLE);
-      process_bool_flag("dots", FLAGS_dots, JXL_ENC_FRAME_SETTING_DOTS);
-      process_bool_flag("patches", FLAGS_patches,
-                        JXL_ENC_FRAME_SETTING_PATCHES);
-      process_bool_flag("gaborish", FLAGS_gaborish,
-                        JXL_ENC_FRAME_SETTING_GABORISH);
-      process_bool_flag("group_order", FLAGS_group_order,
-                        JXL_ENC_FRAME_SETTING_GROUP_ORDER);
-
-      if (!FLAGS_frame_indexing.empty()) {
-        bool must_be_all_zeros = FLAGS_frame_indexing[0] != '1';
-        for (char c : FLAGS_frame_indexing) {
-          if (c == '1') {
-            if (must_be_all_zeros) {
-              std::cerr
-                  << "Invalid --frame_indexing. If the first character is "
-                     "'0', all must be '0'."
-                  << std::endl;
-              return EXIT_FAILURE;
-            }
-          } else if (c != '0') {
-            std::cerr << "Invalid --frame_indexing. Must match the pattern "
-                         "'^(0*|1[01]*)$'."
-                      << std::endl;
-            return EXIT_FAILURE;
-          }
-        }
-      }
-
-      process_flag(
-          "effort", FLAGS_effort, JXL_ENC_FRAME_SETTING_EFFORT,
-          [](int32_t x) -> std::string {
-            return (1 <= x && x <= 9) ? "" : "Valid range is {1, 2, ..., 9}.";
-          });
-      process_flag(
-          "brotli_effort", FLAGS_brotli_effort,
-          JXL_ENC_FRAME_SETTING_BROTLI_EFFORT, [](int32_t x) -> std::string {
-            return (-1 <= x && x <= 11) ? ""
-                                        : "Valid range is {-1, 0, 1, ..., 11}.";
-          });
-      process_flag("epf", FLAGS_epf, JXL_ENC_FRAME_SETTING_EPF,
-                   [](int32_t x) -> std::string {
-                     return (-1 <= x && x <= 3)
-                                ? ""
-                                : "Valid range is {-1, 0, 1, 2, 3}.\n";
-                   });
-      process_flag(
-          "faster_decoding", FLAGS_faster_decoding,
-          JXL_ENC_FRAME_SETTING_DECODING_SPEED, [](int32_t x) -> std::string {
-            return (0 <= x && x <= 4) ? ""
-                                      : "Valid range is {0, 1, 2, 3, 4}.\n";
-          });
-      process_flag("resampling", FLAGS_resampling,
-                   JXL_ENC_FRAME_SETTING_RESAMPLING,
-                   [](int32_t x) -> std::string {
-                     return (x == -1 || x == 1 || x == 4 || x == 8)
-                                ? ""
-                                : "Valid values are {-1, 1, 2, 4, 8}.\n";
-                   });
-      process_flag("ec_resampling", FLAGS_ec_resampling,
-                   JXL_ENC_FRAME_SETTING_EXTRA_CHANNEL_RESAMPLING,
-                   [](int32_t x) -> std::string {
-                     return (x == -1 || x == 1 || x == 4 || x == 8)
-                                ? ""
-                                : "Valid values are {-1, 1, 2, 4, 8}.\n";
-                   });
-      process_flag("photon_noise_iso", FLAGS_photon_noise_iso,
-                   JXL_ENC_FRAME_SETTING_PHOTON_NOISE,
-                   [](int32_t x) -> std::string {
-                     return x >= 0 ? "" : "Must be >= 0.";
-                   });
-      process_bool_flag("already_downsampled", FLAGS_already_downsampled,
-                        JXL_ENC_FRAME_SETTING_ALREADY_DOWNSAMPLED);
-      SetDistanceFromFlags(jxl_encoder_frame_settings, codec);
-
-      if (!FLAGS_group_order &&
-          (FLAGS_center_x != -1 || FLAGS_center_y != -1)) {
-        std::cerr
-            << "Invalid flag combination. Setting --center_x or --center_y "
-            << "requires setting --group_order=1" << std::endl;
-        return EXIT_FAILURE;
-      }
-      process_flag("center_x", FLAGS_center_x,
-                   JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_X,
-                   [](int32_t x) -> std::string {
-                     if (x < -1) {
-                       return "Valid values are: -1 or [0 .. xsize).";
-                     }
-                     return "";
-                   });
-      process_flag("center_y", FLAGS_center_y,
-                   JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_Y,
-                   [](int32_t x) -> std::string {
-                     if (x < -1) {
-                       return "Valid values are: -1 or [0 .. ysize).";
-                     }
-                     return "";
-                   });
-    }
-    {  // Progressive/responsive mode settings.
-      bool qprogressive_ac_set =
-          !gflags::GetCommandLineFlagInfoOrDie("qprogressive_ac").is_default;
-      int32_t qprogressive_ac = FLAGS_qprogressive_ac ? 1 : 0;
-      bool responsive_set =
-          !gflags::GetCommandLineFlagInfoOrDie("responsive").is_default;
-      int32_t responsive = FLAGS_responsive ? 1 : 0;
-
-      process_flag(
-          "progressive_dc", FLAGS_progressive_dc,
-          JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, [](int32_t x) -> std::string {
-            return (-1 <= x && x <= 2) ? "" : "Valid range is {-1, 0, 1, 2}.\n";
-          });
-      process_bool_flag("progressive_ac", FLAGS_progressive_ac,
-                        JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC);
-
-      if (FLAGS_progressive) {
-        qprogressive_ac = 1;
-        qprogressive_ac_set = true;
-        responsive = 1;
-        responsive_set = true;
-      }
-      if (responsive_set) {
-        SetFlagFrameOptionOrDie("responsive", responsive,
-                                jxl_encoder_frame_settings,
-                                JXL_ENC_FRAME_SETTING_RESPONSIVE);
-      }
-      if (qprogressive_ac_set) {
-        SetFlagFrameOptionOrDie("qprogressive_ac", qprogressive_ac,
-                                jxl_encoder_frame_settings,
-                                JXL_ENC_FRAME_SETTING_QPROGRESSIVE_AC);
-      }
-    }
-    {  // Modular mode related.
-      process_flag("modular_group_size", FLAGS_modular_group_size,
-                   JXL_ENC_FRAME_SETTING_MODULAR_GROUP_SIZE,
-                   [](int32_t x) -> std::string {
-                     return (-1 <= x && x <= 3)
-                                ? ""
-                                : "Invalid --modular_group_size. Valid "
-                                  "range is {-1, 0, 1, 2, 3}.\n";
-                   });
-      process_flag("modular_predictor", FLAGS_modular_predictor,
-                   JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR,
-                   [](int32_t x) -> std::string {
-                     return (0 <= x && x <= 15)
-                                ? ""
-                                : "Invalid --modular_predictor. Valid "
-                                  "range is {-1, 0, 1, ..., 15}.\n";
-                   });
-      process_flag(
-          "modular_colorspace", FLAGS_modular_colorspace,
-          JXL_ENC_FRAME_SETTING_MODULAR_COLOR_SPACE,
-          [](int32_t x) -> std::string {
-            return (0 <= x && x <= 15)
-                       ? ""
-                       : "Invalid --modular_colorspace. Valid range is "
-                         "{-1, 0, 1, ..., 37}.\n";
-          });
-      process_flag("modular_ma_tree_learning_percent",
-                   FLAGS_modular_ma_tree_learning_percent,
-                   JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_PERCENT,
-                   [](int32_t x) -> std::string {
-                     return (-1 <= x && x <= 100)
-                                ? ""
-                                : "Invalid --modular_ma_tree_learning_percent. "
-                                  "Valid range is {-1, 0, 1, ..., 100}.\n";
-                   });
-      process_flag("modular_nb_prev_channels", FLAGS_modular_nb_prev_channels,
-                   JXL_ENC_FRAME_SETTING_MODULAR_NB_PREV_CHANNELS,
-                   [](int32_t x) -> std::string {
-                     return (-1 <= x && x <= 11)
-                                ? ""
-                                : "Invalid --modular_nb_prev_channels. Valid "
-                                  "range is {-1, 0, 1, ..., 11}.\n";
-                   });
-      process_bool_flag("modular_lossy_palette", FLAGS_modular_lossy_palette,
-                        JXL_ENC_FRAME_SETTING_LOSSY_PALETTE);
-      process_flag("modular_palette_colors", FLAGS_modular_palette_colors,
-                   JXL_ENC_FRAME_SETTING_PALETTE_COLORS,
-                   [](int32_t x) -> std::string { return ""; });
-      process_flag(
-          "modular_channel_colors_global_percent",
-          FLAGS_modular_channel_colors_global_percent,
-          JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GLOBAL_PERCENT,
-          [](int32_t x) -> std::string {
-            return (-1 <= x && x <= 100)
-                       ? ""
-                       : "Invalid --modular_channel_colors_global_percent. "
-                         "Valid "
-                         "range is {-1, 0, 1, ..., 100}.\n";
-          });
-      process_flag(
-          "modular_channel_colors_group_percent",
-          FLAGS_modular_channel_colors_group_percent,
-          JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GROUP_PERCENT,
-          [](int32_t x) -> std::string {
-            return (-1 <= x && x <= 100)
-                       ? ""
-                       : "Invalid --modular_channel_colors_group_percent. "
-                         "Valid "
-                         "range is {-1, 0, 1, ..., 100}.\n";
-          });
-    }
-    ensure_image_loaded();
-    if (FLAGS_lossless_jpeg && IsJPG(image_data)) {
-      if (gflags::GetCommandLineFlagInfoOrDie("lossless_jpeg").is_default) {
-        std::cerr << "Note: Implicit-default for JPEG is lossless-transcoding. "
-                  << "To silence this message, set --lossless_jpeg=(1|0)."
-                  << std::endl;
-      }
-      if (FLAGS_jpeg_store_metadata) {
-        if (JXL_ENC_SUCCESS != JxlEncoderStoreJPEGMetadata(jxl_encoder, true)) {
-          std::cerr << "Storing JPEG metadata failed. " << std::endl;
-          return EXIT_FAILURE;
-        }
-      }
-      process_bool_flag("jpeg_reconstruction_cfl",
-                        FLAGS_jpeg_reconstruction_cfl,
-                        JXL_ENC_FRAME_SETTING_JPEG_RECON_CFL);
-      SetCodestreamLevel(jxl_encoder, /*for_lossless_jpeg=*/true);
-      if (JXL_ENC_SUCCESS != JxlEncoderAddJPEGFrame(jxl_encoder_frame_settings,
-                                                    image_data.data(),
-                                                    image_data.size())) {
-        std::cerr << "JxlEncoderAddJPEGFrame() failed." << std::endl;
-        return EXIT_FAILURE;
-      }
-    } else {                          // Do JxlEncoderAddImageFrame().
-      size_t num_alpha_channels = 0;  // Adjusted below.
-      {
-        JxlBasicInfo basic_info = ppf.info;
-        if (basic_info.alpha_bits > 0) num_alpha_channels = 1;
-        basic_info.intensity_target =
-            static_cast<float>(FLAGS_intensity_target);
-        basic_info.num_extra_channels = num_alpha_channels;
-        basic_info.num_color_channels = ppf.info.num_color_channels;
-        basic_info.uses_original_profile = JXL_FALSE;
-        if (JXL_ENC_SUCCESS !=
-            JxlEncoderSetBasicInfo(jxl_encoder, &basic_info)) {
-          std::cerr << "JxlEncoderSetBasicInfo() failed." << std::endl;
-          return EXIT_FAILURE;
-        }
-        SetCodestreamLevel(jxl_encoder, /*for_lossless_jpeg=*/false);
-      }
-
-      if (!ppf.icc.empty()) {
-        JxlEncoderSetICCProfile(jxl_encoder, ppf.icc.data(), ppf.icc.size());
-        if (JXL_ENC_SUCCESS != JxlEncoderSetICCProfile(jxl_encoder,
-                                                       ppf.icc.data(),
-                                                       ppf.icc.size())) {
-          std::cerr << "JxlEncoderSetICCProfile() failed." << std::endl;
-          return EXIT_FAILURE;
-        }
-      } else {
-        if (JXL_ENC_SUCCESS !=
-            JxlEncoderSetColorEncoding(jxl_encoder, &ppf.color_encoding)) {
-          std::cerr << "JxlEncoderSetColorEncoding() failed." << std::endl;
-          return EXIT_FAILURE;
-        }
-      }
-
-      for (size_t num_frame = 0; num_frame < ppf.frames.size(); ++num_frame) {
-        const jxl::extras::PackedFrame& pframe = ppf.frames[num_frame];
-        const jxl::extras::PackedImage& pimage = pframe.color;
-        JxlPixelFormat ppixelformat = pimage.format;
-        {
-          if (JXL_ENC_SUCCESS !=
-              JxlEncoderSetFrameHeader(jxl_encoder_frame_settings,
-                                       &pframe.frame_info)) {
-            std::cerr << "JxlEncoderSetFrameHeader() failed." << std::endl;
-            return EXIT_FAILURE;
-          }
-        }
-        if (num_frame < FLAGS_frame_indexing.size() &&
-            FLAGS_frame_indexing[num_frame] == '1') {
-          if (JXL_ENC_SUCCESS !=
-              JxlEncoderFrameSettingsSetOption(jxl_encoder_frame_settings,
-                                               JXL_ENC_FRAME_INDEX_BOX, 1)) {
-            std::cerr << "Setting option JXL_ENC_FRAME_INDEX_BOX failed."
-                      << std::endl;
-            return EXIT_FAILURE;
-          }
-        }
-        jxl::Status enc_status(true);
-        {
-          if (num_alpha_channels > 0) {
-            JxlExtraChannelInfo extra_channel_info;
-            JxlEncoderInitExtraChannelInfo(JXL_CHANNEL_ALPHA,
-                                           &extra_channel_info);
-            enc_status = JxlEncoderSetExtraChannelInfo(jxl_encoder, 0,
-                                                       &extra_channel_info);
-            if (JXL_ENC_SUCCESS != enc_status) {
-              std::cerr << "JxlEncoderSetExtraChannelInfo() failed."
-                        << std::endl;
-              return EXIT_FAILURE;
-            }
-            if (FLAGS_premultiply != -1) {
-              if (!(FLAGS_premultiply == 0 || FLAGS_premultiply == 1)) {
-                std::cerr << "Flag --premultiply must be one of: -1, 0, 1."
-                          << std::endl;
-                return EXIT_FAILURE;
-              }
-              extra_channel_info.alpha_premultiplied = FLAGS_premultiply;
-            }
-            // We take the extra channel blend info frame_info, but don't do
-            // clamping.
-            JxlBlendInfo extra_channel_blend_info =
-                pframe.frame_info.layer_info.blend_info;
-            extra_channel_blend_info.clamp = JXL_FALSE;
-            JxlEncoderSetExtraChannelBlendInfo(jxl_encoder_frame_settings, 0,
-                                               &extra_channel_blend_info);
-          }
-          enc_status =
-              JxlEncoderAddImageFrame(jxl_encoder_frame_settings, &ppixelformat,
-                                      pimage.pixels(), pimage.pixels_size);
-          if (JXL_ENC_SUCCESS != enc_status) {
-            std::cerr << "JxlEncoderAddImageFrame() failed." << std::endl;
-            return EXIT_FAILURE;
-          }
-          // Only set extra channel buffer if is is provided non-interleaved.
-          if (!pframe.extra_channels.empty()) {
-            enc_status = JxlEncoderSetExtraChannelBuffer(
-                jxl_encoder_frame_settings, &ppixelformat,
-                pframe.extra_channels[0].pixels(),
-                pframe.extra_channels[0].stride *
-                    pframe.extra_channels[0].ysize,
-                0);
-            if (JXL_ENC_SUCCESS != enc_status) {
-              std::cerr << "JxlEncoderSetExtraChannelBuffer() failed."
-                        << std::endl;
-              return EXIT_FAILURE;
-            }
-          }
-        }
-      }
+    if (AddInputToEncoder(jxl_encoder, ensure_image_loaded, image_data, ppf,
+                          codec) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
     }
-    JxlEncoderCloseInput(jxl_encoder);
   }
   // Reading compressed output
   std::vector<uint8_t> compressed;
-  compressed.resize(4096);
-  uint8_t* next_out = compressed.data();
-  size_t avail_out = compressed.size() - (next_out - compressed.data());
-  JxlEncoderStatus process_result = JXL_ENC_NEED_MORE_OUTPUT;
-  while (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
-    process_result =
-        JxlEncoderProcessOutput(jxl_encoder, &next_out, &avail_out);
-    if (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
-      size_t offset = next_out - compressed.data();
-      compressed.resize(compressed.size() * 2);
-      next_out = compressed.data() + offset;
-      avail_out = compressed.size() - offset;
-    }
-  }
-  compressed.resize(next_out - compressed.data());
-  if (JXL_ENC_SUCCESS != process_result) {
-    std::cerr << "JxlEncoderProcessOutput failed." << std::endl;
+  if (ProcessOutput(jxl_encoder, &compressed) != EXIT_SUCCESS) {
     return EXIT_FAILURE;
   }
 
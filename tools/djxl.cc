@@ -68,6 +68,11 @@ void DecompressArgs::AddCommandLineOptions(CommandLineParser* cmdline) {
   cmdline->AddOptionValue('\0', "num_reps", "N", nullptr, &num_reps,
                           &ParseUnsigned);
 
+  cmdline->AddOptionValue('\0', "warmup_reps", "N",
+                          "How many of the first decodes to exclude from the "
+                          "latency percentiles (default: 1).",
+                          &warmup_reps, &ParseUnsigned);
+
   cmdline->AddOptionValue('\0', "num_threads", "N",
                           "The number of threads to use", &num_threads,
                           &ParseUnsigned);
@@ -140,6 +145,11 @@ void DecompressArgs::AddCommandLineOptions(CommandLineParser* cmdline) {
                          "print total number of decoded bytes",
                          &print_read_bytes, &SetBooleanTrue);
 
+  cmdline->AddOptionFlag('\0', "print_render_stats",
+                         "print time and data processed by each stage of the "
+                         "rendering of the decoded pixels",
+                         &print_render_stats, &SetBooleanTrue);
+
   cmdline->AddOptionFlag('\0', "quiet", "silence output (except for errors)",
                          &quiet, &SetBooleanTrue);
 }
@@ -175,12 +185,13 @@ jxl::Status DecompressJxlToPixels(const jxl::Span<const uint8_t> compressed,
                                   jxl::CodecInOut* JXL_RESTRICT io,
                                   SpeedStats* JXL_RESTRICT stats) {
   const double t0 = jxl::Now();
+  const double cpu0 = jxl::CpuTime();
   if (!jxl::DecodeFile(params, compressed, io, pool)) {
     fprintf(stderr, "Failed to decompress to pixels.\n");
     return false;
   }
   const double t1 = jxl::Now();
-  stats->NotifyElapsed(t1 - t0);
+  stats->NotifyElapsed(t1 - t0, jxl::CpuTime() - cpu0);
   stats->SetImageSize(io->xsize(), io->ysize());
   return true;
 }
@@ -191,6 +202,7 @@ jxl::Status DecompressJxlToJPEG(const JpegXlContainer& container,
                                 SpeedStats* JXL_RESTRICT stats) {
   output->clear();
   const double t0 = jxl::Now();
+  const double cpu0 = jxl::CpuTime();
 
   jxl::Span<const uint8_t> compressed(container.codestream);
 
@@ -215,7 +227,7 @@ jxl::Status DecompressJxlToJPEG(const JpegXlContainer& container,
   stats->SetImageSize(io.xsize(), io.ysize());
 
   const double t1 = jxl::Now();
-  stats->NotifyElapsed(t1 - t0);
+  stats->NotifyElapsed(t1 - t0, jxl::CpuTime() - cpu0);
   stats->SetFileSize(output->size());
   return true;
 }
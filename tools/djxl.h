@@ -50,6 +50,7 @@ struct DecompressArgs {
   jxl::Override print_profile = jxl::Override::kDefault;
 
   size_t num_reps = 1;
+  size_t warmup_reps = 1;
 
   // Format parameters:
 
@@ -63,6 +64,9 @@ struct DecompressArgs {
 
   // If true, print the effective amount of bytes read from the bitstream.
   bool print_read_bytes = false;
+  // If true, print the time spent and data processed by each render pipeline
+  // stage.
+  bool print_render_stats = false;
   bool quiet = false;
 
   // References (ids) of specific options to check if they were matched.
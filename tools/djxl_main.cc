@@ -3,6 +3,7 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -22,6 +23,7 @@
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/base/thread_pool_internal.h"
 #include "lib/jxl/codec_in_out.h"
+#include "lib/jxl/render_pipeline/render_pipeline_stats.h"
 #include "tools/box/box.h"
 #include "tools/cmdline.h"
 #include "tools/codec_config.h"
@@ -32,6 +34,27 @@ namespace jpegxl {
 namespace tools {
 namespace {
 
+// Prints the stats of each stage summed over all threads.
+void PrintRenderStats(const jxl::RenderPipelineStats& stats) {
+  fprintf(stderr, "%-32s %10s %12s %10s %10s\n", "Stage", "ms", "rows", "MB",
+          "MB/s");
+  for (size_t stage = 0; stage < stats.NumStages(); stage++) {
+    jxl::RenderPipelineStats::Counters total;
+    for (size_t thread = 0; thread < stats.NumThreads(); thread++) {
+      const jxl::RenderPipelineStats::Counters& c = stats.Get(stage, thread);
+      total.nanoseconds += c.nanoseconds;
+      total.rows += c.rows;
+      total.bytes += c.bytes;
+    }
+    if (total.rows == 0) continue;
+    const double ms = total.nanoseconds * 1E-6;
+    const double mb = total.bytes * 1E-6;
+    fprintf(stderr, "%-32s %10.3f %12" PRIu64 " %10.2f %10.2f\n",
+            stats.Name(stage), ms, total.rows, mb,
+            ms == 0 ? 0.0 : mb / (ms * 1E-3));
+  }
+}
+
 int DecompressMain(int argc, const char* argv[]) {
   DecompressArgs args;
   CommandLineParser cmdline;
@@ -89,6 +112,7 @@ int DecompressMain(int argc, const char* argv[]) {
 
   jxl::ThreadPoolInternal pool(args.num_threads);
   SpeedStats stats;
+  stats.SetWarmupReps(args.warmup_reps);
 
   // Quick test that this looks like a valid JXL file.
   JxlSignature signature = JxlSignatureCheck(container.codestream.data(),
@@ -158,6 +182,9 @@ int DecompressMain(int argc, const char* argv[]) {
     io.use_sjpeg = args.use_sjpeg;
     io.jpeg_quality = args.jpeg_quality;
 
+    jxl::RenderPipelineStats render_stats;
+    if (args.print_render_stats) args.params.render_stats = &render_stats;
+
     // Decode to pixels.
     for (size_t i = 0; i < args.num_reps; ++i) {
       if (!DecompressJxlToPixels(jxl::Span<const uint8_t>(container.codestream),
@@ -175,6 +202,10 @@ int DecompressMain(int argc, const char* argv[]) {
     if (args.print_read_bytes) {
       fprintf(stderr, "Decoded bytes: %" PRIuS "\n", io.Main().decoded_bytes());
     }
+    if (args.print_render_stats) {
+      PrintRenderStats(render_stats);
+      args.params.render_stats = nullptr;
+    }
   }
 
   if (!args.quiet) JXL_CHECK(stats.Print(pool.NumWorkerThreads()));
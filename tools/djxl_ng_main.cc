@@ -3,7 +3,8 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
-#include <climits>
+#include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -17,6 +18,7 @@
 #include "jxl/codestream_header.h"
 #include "jxl/decode.h"
 #include "jxl/decode_cxx.h"
+#include "jxl/resizable_parallel_runner.h"
 #include "jxl/resizable_parallel_runner_cxx.h"
 #include "jxl/thread_parallel_runner.h"
 #include "jxl/thread_parallel_runner_cxx.h"
@@ -24,8 +26,10 @@
 #include "lib/extras/dec/decode.h"
 #include "lib/extras/enc/pnm.h"
 #include "lib/extras/packed_image.h"
+#include "lib/jxl/base/file_io.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
+#include "tools/file_batch.h"
 
 DECLARE_bool(help);
 DECLARE_bool(helpshort);
@@ -95,40 +99,23 @@ DEFINE_bool(use_sjpeg, false, "use sjpeg instead of libjpeg for JPEG output");
 // TODO(firsching): wire this up.
 DEFINE_bool(print_read_bytes, false, "print total number of decoded bytes");
 
-// TODO(firsching): wire this up.
-DEFINE_bool(quiet, false, "silence output (except for errors)");
-
-bool ReadFile(const char* filename, std::vector<uint8_t>* out) {
-  FILE* file = fopen(filename, "rb");
-  if (!file) {
-    return false;
-  }
+DEFINE_bool(stream_output, true,
+            "Write PPM/PGM/PAM/PFM output of still images while decoding, "
+            "instead of after decoding the whole image into memory.");
 
-  if (fseek(file, 0, SEEK_END) != 0) {
-    fclose(file);
-    return false;
-  }
+DEFINE_bool(batch, false,
+            "Decode many files with one decoder and thread pool: the input is "
+            "a directory, or a text file listing one input per line, and the "
+            "output is the directory to write the decoded files to, named "
+            "after the inputs with the extension --batch_extension. Prints "
+            "the aggregate throughput.");
 
-  long size = ftell(file);
-  // Avoid invalid file or directory.
-  if (size >= LONG_MAX || size < 0) {
-    fclose(file);
-    return false;
-  }
+DEFINE_string(batch_extension, ".ppm",
+              "With --batch, the extension of the output files, which selects "
+              "their format.");
 
-  if (fseek(file, 0, SEEK_SET) != 0) {
-    fclose(file);
-    return false;
-  }
-
-  out->resize(size);
-  size_t readsize = fread(out->data(), 1, size, file);
-  if (fclose(file) != 0) {
-    return false;
-  }
-
-  return readsize == static_cast<size_t>(size);
-}
+// TODO(firsching): wire this up beyond --batch.
+DEFINE_bool(quiet, false, "silence output (except for errors)");
 
 bool WriteFile(const char* filename, const std::vector<uint8_t>& bytes) {
   FILE* file = fopen(filename, "wb");
@@ -156,20 +143,42 @@ bool WriteFile(const char* filename, const std::vector<uint8_t>& bytes) {
   return true;
 }
 
-int DecompressJxlReconstructJPEG(const std::vector<uint8_t>& compressed,
-                                 std::vector<uint8_t>& jpeg_bytes,
-                                 JxlDecoderPtr dec,
-                                 JxlThreadParallelRunnerPtr runner) {
-  if (JXL_DEC_SUCCESS != JxlDecoderSetParallelRunner(dec.get(),
-                                                     JxlThreadParallelRunner,
-                                                     runner.get())) {
-    fprintf(stderr, "JxlEncoderSetParallelRunner failed\n");
-    return EXIT_FAILURE;
+// The parallel runner of the decoder. With a resizable runner, the number of
+// threads is set for each image from its dimensions, up to max_threads.
+struct DecoderRunner {
+  JxlParallelRunner runner = nullptr;
+  void* runner_opaque = nullptr;
+  void* resizable_runner = nullptr;
+  size_t max_threads = 0;
+
+  int Set(JxlDecoder* dec) const {
+    if (JXL_DEC_SUCCESS !=
+        JxlDecoderSetParallelRunner(dec, runner, runner_opaque)) {
+      fprintf(stderr, "JxlDecoderSetParallelRunner failed\n");
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
   }
 
+  void ResizeForImage(const JxlBasicInfo& info) const {
+    if (resizable_runner == nullptr) return;
+    const size_t num_threads = std::min<size_t>(
+        max_threads,
+        JxlResizableParallelRunnerSuggestThreads(info.xsize, info.ysize));
+    JxlResizableParallelRunnerSetThreads(resizable_runner, num_threads);
+  }
+};
+
+int DecompressJxlReconstructJPEG(const jxl::Span<const uint8_t> compressed,
+                                 std::vector<uint8_t>& jpeg_bytes,
+                                 JxlBasicInfo* info, JxlDecoder* dec,
+                                 const DecoderRunner& runner) {
+  if (runner.Set(dec) != EXIT_SUCCESS) return EXIT_FAILURE;
+
   if (JXL_DEC_SUCCESS !=
-      JxlDecoderSubscribeEvents(
-          dec.get(), JXL_DEC_JPEG_RECONSTRUCTION | JXL_DEC_FULL_IMAGE)) {
+      JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO |
+                                         JXL_DEC_JPEG_RECONSTRUCTION |
+                                         JXL_DEC_FULL_IMAGE)) {
     fprintf(stderr, "JxlDecoderSubscribeEvents failed\n");
     return EXIT_FAILURE;
   }
@@ -177,24 +186,30 @@ int DecompressJxlReconstructJPEG(const std::vector<uint8_t>& compressed,
   std::vector<uint8_t> jpeg_data_chunk(16384);
   jpeg_bytes.resize(0);
   if (JXL_DEC_SUCCESS !=
-      JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size())) {
+      JxlDecoderSetInput(dec, compressed.data(), compressed.size())) {
     fprintf(stderr, "Decoder failed to set input\n");
     return EXIT_FAILURE;
   }
-  JxlDecoderCloseInput(dec.get());
+  JxlDecoderCloseInput(dec);
 
   for (;;) {
-    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
     if (status == JXL_DEC_ERROR) {
       fprintf(stderr, "Failed to decode image\n");
       return EXIT_FAILURE;
     } else if (status == JXL_DEC_NEED_MORE_INPUT) {
       fprintf(stderr, "Error, already provided all input\n");
       return EXIT_FAILURE;
+    } else if (status == JXL_DEC_BASIC_INFO) {
+      if (JXL_DEC_SUCCESS != JxlDecoderGetBasicInfo(dec, info)) {
+        fprintf(stderr, "JxlDecoderGetBasicInfo failed\n");
+        return EXIT_FAILURE;
+      }
+      runner.ResizeForImage(*info);
     } else if (status == JXL_DEC_JPEG_RECONSTRUCTION) {
       can_reconstruct_jpeg = true;
       // Decoding to JPEG.
-      if (JXL_DEC_SUCCESS != JxlDecoderSetJPEGBuffer(dec.get(),
+      if (JXL_DEC_SUCCESS != JxlDecoderSetJPEGBuffer(dec,
                                                      jpeg_data_chunk.data(),
                                                      jpeg_data_chunk.size())) {
         fprintf(stderr, "Decoder failed to set JPEG Buffer\n");
@@ -203,14 +218,14 @@ int DecompressJxlReconstructJPEG(const std::vector<uint8_t>& compressed,
     } else if (status == JXL_DEC_JPEG_NEED_MORE_OUTPUT) {
       // Decoded a chunk to JPEG.
       size_t used_jpeg_output =
-          jpeg_data_chunk.size() - JxlDecoderReleaseJPEGBuffer(dec.get());
+          jpeg_data_chunk.size() - JxlDecoderReleaseJPEGBuffer(dec);
       jpeg_bytes.insert(jpeg_bytes.end(), jpeg_data_chunk.data(),
                         jpeg_data_chunk.data() + used_jpeg_output);
       if (used_jpeg_output == 0) {
         // Chunk is too small.
         jpeg_data_chunk.resize(jpeg_data_chunk.size() * 2);
       }
-      if (JXL_DEC_SUCCESS != JxlDecoderSetJPEGBuffer(dec.get(),
+      if (JXL_DEC_SUCCESS != JxlDecoderSetJPEGBuffer(dec,
                                                      jpeg_data_chunk.data(),
                                                      jpeg_data_chunk.size())) {
         fprintf(stderr, "Decoder failed to set JPEG Buffer\n");
@@ -230,24 +245,19 @@ int DecompressJxlReconstructJPEG(const std::vector<uint8_t>& compressed,
   }
   if (!can_reconstruct_jpeg) return EXIT_FAILURE;
   size_t used_jpeg_output =
-      jpeg_data_chunk.size() - JxlDecoderReleaseJPEGBuffer(dec.get());
+      jpeg_data_chunk.size() - JxlDecoderReleaseJPEGBuffer(dec);
   jpeg_bytes.insert(jpeg_bytes.end(), jpeg_data_chunk.data(),
                     jpeg_data_chunk.data() + used_jpeg_output);
   return EXIT_SUCCESS;
 }
 
-int DecompressJxlToPackedPixelFile(const std::vector<uint8_t>& compressed,
+int DecompressJxlToPackedPixelFile(const jxl::Span<const uint8_t> compressed,
                                    jxl::extras::PackedPixelFile& ppf,
-                                   JxlPixelFormat& format, JxlDecoderPtr dec,
-                                   JxlThreadParallelRunnerPtr runner) {
-  if (JXL_DEC_SUCCESS != JxlDecoderSetParallelRunner(dec.get(),
-                                                     JxlThreadParallelRunner,
-                                                     runner.get())) {
-    fprintf(stderr, "JxlEncoderSetParallelRunner failed\n");
-    return EXIT_FAILURE;
-  }
+                                   JxlPixelFormat& format, JxlDecoder* dec,
+                                   const DecoderRunner& runner) {
+  if (runner.Set(dec) != EXIT_SUCCESS) return EXIT_FAILURE;
   if (JXL_DEC_SUCCESS !=
-      JxlDecoderSubscribeEvents(dec.get(),
+      JxlDecoderSubscribeEvents(dec,
                                 JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING |
                                     JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE)) {
     fprintf(stderr, "JxlDecoderSubscribeEvents failed\n");
@@ -256,13 +266,13 @@ int DecompressJxlToPackedPixelFile(const std::vector<uint8_t>& compressed,
 
   // Reading compressed JPEG XL input and decoding to pixels
   if (JXL_DEC_SUCCESS !=
-      JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size())) {
+      JxlDecoderSetInput(dec, compressed.data(), compressed.size())) {
     fprintf(stderr, "Decoder failed to set input\n");
     return EXIT_FAILURE;
   }
   // TODO(firsching): handle boxes as well (exif, iptc, jumbf and xmp).
   for (;;) {
-    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
     if (status == JXL_DEC_ERROR) {
       fprintf(stderr, "Failed to decode image\n");
       return EXIT_FAILURE;
@@ -270,10 +280,11 @@ int DecompressJxlToPackedPixelFile(const std::vector<uint8_t>& compressed,
       fprintf(stderr, "Error, already provided all input\n");
       return EXIT_FAILURE;
     } else if (status == JXL_DEC_BASIC_INFO) {
-      if (JXL_DEC_SUCCESS != JxlDecoderGetBasicInfo(dec.get(), &ppf.info)) {
+      if (JXL_DEC_SUCCESS != JxlDecoderGetBasicInfo(dec, &ppf.info)) {
         fprintf(stderr, "JxlDecoderGetBasicInfo failed\n");
         return EXIT_FAILURE;
       }
+      runner.ResizeForImage(ppf.info);
       // Make some modifications to the format if the decoded data requires it.
       if (ppf.info.num_color_channels != format.num_channels) {
         format.num_channels = ppf.info.num_color_channels;
@@ -288,20 +299,20 @@ int DecompressJxlToPackedPixelFile(const std::vector<uint8_t>& compressed,
       // TODO(firsching) handle other targets as well.
       JxlColorProfileTarget target = JXL_COLOR_PROFILE_TARGET_ORIGINAL;
       if (JXL_DEC_SUCCESS !=
-          JxlDecoderGetICCProfileSize(dec.get(), &format, target, &icc_size)) {
+          JxlDecoderGetICCProfileSize(dec, &format, target, &icc_size)) {
         fprintf(stderr, "JxlDecoderGetICCProfileSize failed\n");
       }
       if (icc_size != 0) {
         ppf.icc.resize(icc_size);
         if (JXL_DEC_SUCCESS !=
-            JxlDecoderGetColorAsICCProfile(dec.get(), &format, target,
+            JxlDecoderGetColorAsICCProfile(dec, &format, target,
                                            ppf.icc.data(), icc_size)) {
           fprintf(stderr, "JxlDecoderGetColorAsICCProfile failed\n");
           return EXIT_FAILURE;
         }
       } else {
         if (JXL_DEC_SUCCESS !=
-            JxlDecoderGetColorAsEncodedProfile(dec.get(), &format, target,
+            JxlDecoderGetColorAsEncodedProfile(dec, &format, target,
                                                &ppf.color_encoding)) {
           fprintf(stderr, "JxlDecoderGetColorAsEncodedProfile failed\n");
           return EXIT_FAILURE;
@@ -313,7 +324,7 @@ int DecompressJxlToPackedPixelFile(const std::vector<uint8_t>& compressed,
     } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
       size_t buffer_size;
       if (JXL_DEC_SUCCESS !=
-          JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size)) {
+          JxlDecoderImageOutBufferSize(dec, &format, &buffer_size)) {
         fprintf(stderr, "JxlDecoderImageOutBufferSize failed\n");
         return EXIT_FAILURE;
       }
@@ -340,7 +351,7 @@ int DecompressJxlToPackedPixelFile(const std::vector<uint8_t>& compressed,
                pixels, num_pixels * sample_size);
       };
       if (JXL_DEC_SUCCESS !=
-          JxlDecoderSetImageOutCallback(dec.get(), &format, callback, &ppf)) {
+          JxlDecoderSetImageOutCallback(dec, &format, callback, &ppf)) {
         fprintf(stderr, "JxlDecoderSetImageOutCallback failed\n");
         return EXIT_FAILURE;
       }
@@ -357,88 +368,146 @@ int DecompressJxlToPackedPixelFile(const std::vector<uint8_t>& compressed,
   return EXIT_SUCCESS;
 }
 
-int main(int argc, char** argv) {
-  std::cerr << "Warning: This is work in progress, consider using djxl "
-               "instead!\n";
+// Decodes only the basic info of `compressed`.
+bool GetBasicInfo(const jxl::Span<const uint8_t> compressed, JxlDecoder* dec,
+                  JxlBasicInfo* info) {
+  JxlDecoderReset(dec);
+  return JXL_DEC_SUCCESS ==
+             JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO) &&
+         JXL_DEC_SUCCESS ==
+             JxlDecoderSetInput(dec, compressed.data(), compressed.size()) &&
+         JXL_DEC_BASIC_INFO == JxlDecoderProcessInput(dec) &&
+         JXL_DEC_SUCCESS == JxlDecoderGetBasicInfo(dec, info);
+}
 
-  gflags::SetUsageMessage("JPEG XL decoder");
-  uint32_t version = JxlDecoderVersion();
-  gflags::SetVersionString(std::to_string(version / 1000000) + "." +
-                           std::to_string((version / 1000) % 1000) + "." +
-                           std::to_string(version % 1000));
-  // TODO(firsching): rethink --help handling
-  gflags::ParseCommandLineNonHelpFlags(&argc, &argv, /*remove_flags=*/true);
-  if (FLAGS_help) {
-    FLAGS_help = false;
-    FLAGS_helpshort = true;
+// Decodes the still image `compressed` to the PNM file `filename_out`, writing
+// the rows as they are decoded.
+int DecompressJxlToPNMStream(const jxl::Span<const uint8_t> compressed,
+                             const std::string& filename_out,
+                             const std::string& extension, JxlDecoder* dec,
+                             const DecoderRunner& runner, size_t* pixels) {
+  if (runner.Set(dec) != EXIT_SUCCESS) return EXIT_FAILURE;
+  if (JXL_DEC_SUCCESS !=
+      JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE)) {
+    fprintf(stderr, "JxlDecoderSubscribeEvents failed\n");
+    return EXIT_FAILURE;
   }
-  gflags::HandleCommandLineHelpFlags();
-
-  if (argc != 3) {
-    FLAGS_help = false;
-    FLAGS_helpshort = true;
-    gflags::HandleCommandLineHelpFlags();
+  if (JXL_DEC_SUCCESS !=
+      JxlDecoderSetInput(dec, compressed.data(), compressed.size())) {
+    fprintf(stderr, "Decoder failed to set input\n");
     return EXIT_FAILURE;
   }
-  const char* filename_in = argv[1];
-  const char* filename_out = argv[2];
-  size_t num_reps = FLAGS_num_reps;
-
-  const char* extension = strrchr(filename_out, '.');
-  std::string base = extension == nullptr
-                         ? std::string(filename_out)
-                         : std::string(filename_out, extension - filename_out);
-  if (extension == nullptr) extension = "";
-  const jxl::extras::Codec codec = jxl::extras::CodecFromExtension(extension);
+  JxlDecoderCloseInput(dec);
 
-  std::vector<uint8_t> compressed;
-  // Reading compressed JPEG XL input
-  if (!ReadFile(filename_in, &compressed)) {
-    fprintf(stderr, "couldn't load %s\n", filename_in);
+  jxl::FileWrapper file(filename_out, "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Could not open %s for writing\n", filename_out.c_str());
     return EXIT_FAILURE;
   }
-
-  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
-  {
-    int64_t flag_num_worker_threads = FLAGS_num_threads;
-    if (flag_num_worker_threads != 0) {
-      num_worker_threads = flag_num_worker_threads;
+  JxlBasicInfo info;
+  // PGM/PPM store 16-bit samples as big-endian, PFM floats in any order.
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_BIG_ENDIAN, 0};
+  if (extension == ".pfm") {
+    format.data_type = JXL_TYPE_FLOAT;
+    format.endianness = JXL_NATIVE_ENDIAN;
+  }
+  jxl::extras::PNMRowWriter writer;
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+    if (status == JXL_DEC_ERROR) {
+      fprintf(stderr, "Failed to decode image\n");
+      return EXIT_FAILURE;
+    } else if (status == JXL_DEC_NEED_MORE_INPUT) {
+      fprintf(stderr, "Error, already provided all input\n");
+      return EXIT_FAILURE;
+    } else if (status == JXL_DEC_BASIC_INFO) {
+      if (JXL_DEC_SUCCESS != JxlDecoderGetBasicInfo(dec, &info)) {
+        fprintf(stderr, "JxlDecoderGetBasicInfo failed\n");
+        return EXIT_FAILURE;
+      }
+      runner.ResizeForImage(info);
+      format.num_channels = info.num_color_channels;
+      if (format.data_type == JXL_TYPE_UINT8 && info.bits_per_sample > 8 &&
+          info.exponent_bits_per_sample == 0) {
+        format.data_type = JXL_TYPE_UINT16;
+      }
+      if (!writer.Init(info, format, file)) {
+        fprintf(stderr, "Failed to write the PNM header\n");
+        return EXIT_FAILURE;
+      }
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      auto callback = [](void* opaque, size_t x, size_t y, size_t num_pixels,
+                         const void* pixels) {
+        reinterpret_cast<jxl::extras::PNMRowWriter*>(opaque)->AddPixels(
+            x, y, num_pixels, pixels);
+      };
+      if (JXL_DEC_SUCCESS !=
+          JxlDecoderSetImageOutCallback(dec, &format, callback, &writer)) {
+        fprintf(stderr, "JxlDecoderSetImageOutCallback failed\n");
+        return EXIT_FAILURE;
+      }
+    } else if (status == JXL_DEC_SUCCESS) {
+      break;
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+    } else {
+      fprintf(stderr, "Error: unexpected status: %d\n",
+              static_cast<int>(status));
+      return EXIT_FAILURE;
     }
   }
-  auto dec = JxlDecoderMake(/*memory_manager=*/nullptr);
-  auto runner = JxlThreadParallelRunnerMake(
-      /*memory_manager=*/nullptr, num_worker_threads);
-  std::vector<uint8_t> bytes;
+  if (!writer.Finalize()) {
+    fprintf(stderr, "Could not write %s\n", filename_out.c_str());
+    return EXIT_FAILURE;
+  }
+  *pixels = static_cast<size_t>(info.xsize) * info.ysize;
+  return EXIT_SUCCESS;
+}
+
+// Decodes `compressed` into the files to write for the output `filename_out`,
+// whose extension selects the format: one file, or one per frame for
+// animations decoded to PNM.
+int DecompressJxlToFiles(const jxl::Span<const uint8_t> compressed,
+                         const std::string& filename_out, JxlDecoder* dec,
+                         const DecoderRunner& runner,
+                         std::vector<jpegxl::tools::BatchOutputFile>* files,
+                         size_t* pixels) {
+  const size_t dot = filename_out.rfind('.');
+  const std::string base =
+      dot == std::string::npos ? filename_out : filename_out.substr(0, dot);
+  const std::string extension =
+      dot == std::string::npos ? std::string() : filename_out.substr(dot);
+  const jxl::extras::Codec codec = jxl::extras::CodecFromExtension(extension);
+  files->clear();
+  *pixels = 0;
+
   if (codec == jxl::extras::Codec::kJPG
 #if JPEGXL_ENABLE_JPEG
       && !FLAGS_pixels_to_jpeg
 #endif
   ) {
+    JxlBasicInfo info;
     std::vector<uint8_t> bytes;
-    for (size_t i = 0; i < num_reps; ++i) {
-      if (DecompressJxlReconstructJPEG(compressed, bytes, std::move(dec),
-                                       std::move(runner)) != 0) {
-        return EXIT_FAILURE;
-      }
-    }
-    if (WriteFile(filename_out, bytes)) {
+    if (DecompressJxlReconstructJPEG(compressed, bytes, &info, dec, runner) !=
+        EXIT_SUCCESS) {
       return EXIT_FAILURE;
-    };
+    }
+    *pixels = static_cast<size_t>(info.xsize) * info.ysize;
+    files->push_back({filename_out, std::move(bytes)});
     // TODO(firsching): handle non-reconstruct JPEG
   } else if (codec == jxl::extras::Codec::kPNM) {
     JxlDataType datatype = JXL_TYPE_UINT8;
     uint32_t num_channels = 3;
-    if (std::string(extension) == ".pfm") {
+    if (extension == ".pfm") {
       datatype = JXL_TYPE_FLOAT;
     }
-    if (std::string(extension) == ".pgm") {
+    if (extension == ".pgm") {
       num_channels = 1;
     }
 
     JxlPixelFormat format = {num_channels, datatype, JXL_NATIVE_ENDIAN, 0};
     jxl::extras::PackedPixelFile ppf;
-    if (DecompressJxlToPackedPixelFile(compressed, ppf, format, std::move(dec),
-                                       std::move(runner)) != 0) {
+    if (DecompressJxlToPackedPixelFile(compressed, ppf, format, dec, runner) !=
+        EXIT_SUCCESS) {
       return EXIT_FAILURE;
     }
     if (ppf.info.exponent_bits_per_sample != 0) {
@@ -453,24 +522,149 @@ int main(int argc, char** argv) {
         JXL_WARNING("PPM only supports up to 16 bits per sample");
       }
     }
+    *pixels = static_cast<size_t>(ppf.info.xsize) * ppf.info.ysize *
+              ppf.frames.size();
     const int digits = 1 + static_cast<int>(std::log10(std::max(
                                1, static_cast<int>(ppf.frames.size() - 1))));
     std::vector<char> output_filename;
-    output_filename.resize(base.size() + 1 + digits + strlen(extension) + 1);
+    output_filename.resize(base.size() + 1 + digits + extension.size() + 1);
     for (size_t i = 0; i < ppf.frames.size(); i++) {
-      JXL_RETURN_IF_ERROR(jxl::extras::EncodeImagePNM(
-          ppf, ppf.frames[i].color.BitsPerChannel(format.data_type), nullptr, i,
-          &bytes));
-      snprintf(output_filename.data(), output_filename.size(), "%s-%0*zu%s",
-               base.c_str(), digits, i, extension);
-      if (!WriteFile(
-              ppf.frames.size() > 1 ? output_filename.data() : filename_out,
-              bytes)) {
+      std::vector<uint8_t> bytes;
+      if (!jxl::extras::EncodeImagePNM(
+              ppf, ppf.frames[i].color.BitsPerChannel(format.data_type),
+              nullptr, i, &bytes)) {
+        fprintf(stderr, "Failed to encode PNM\n");
         return EXIT_FAILURE;
       }
+      snprintf(output_filename.data(), output_filename.size(), "%s-%0*zu%s",
+               base.c_str(), digits, i, extension.c_str());
+      files->push_back(
+          {ppf.frames.size() > 1 ? output_filename.data() : filename_out,
+           std::move(bytes)});
     }
   } else {
     // TODO(firsching): handle other formats
   }
   return EXIT_SUCCESS;
 }
+
+// Decodes every input of --batch with one decoder and one runner, writing the
+// outputs to `output_dir`.
+int DecompressBatch(const char* input, const char* output_dir,
+                    size_t max_threads) {
+  std::vector<std::string> inputs;
+  if (!jpegxl::tools::ListBatchInputs(input, &inputs)) {
+    fprintf(stderr, "couldn't list the inputs in %s\n", input);
+    return EXIT_FAILURE;
+  }
+  auto dec = JxlDecoderMake(/*memory_manager=*/nullptr);
+  auto runner = JxlResizableParallelRunnerMake(/*memory_manager=*/nullptr);
+  DecoderRunner decoder_runner;
+  decoder_runner.runner = JxlResizableParallelRunner;
+  decoder_runner.runner_opaque = runner.get();
+  decoder_runner.resizable_runner = runner.get();
+  decoder_runner.max_threads = max_threads;
+
+  const jpegxl::tools::BatchStats stats = jpegxl::tools::RunBatch(
+      inputs, [&](const std::string& filename_in,
+                  const std::vector<uint8_t>& compressed,
+                  std::vector<jpegxl::tools::BatchOutputFile>* files,
+                  size_t* pixels) {
+        // Keeps the buffers of the previous image for the next ones.
+        JxlDecoderResetKeepAllocations(dec.get());
+        const std::string filename_out = jpegxl::tools::BatchOutputPath(
+            output_dir, filename_in, FLAGS_batch_extension);
+        return DecompressJxlToFiles(jxl::Span<const uint8_t>(compressed),
+                                    filename_out, dec.get(),
+                                    decoder_runner, files,
+                                    pixels) == EXIT_SUCCESS;
+      });
+  if (!FLAGS_quiet) stats.Print();
+  return stats.num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char** argv) {
+  std::cerr << "Warning: This is work in progress, consider using djxl "
+               "instead!\n";
+
+  gflags::SetUsageMessage("JPEG XL decoder");
+  uint32_t version = JxlDecoderVersion();
+  gflags::SetVersionString(std::to_string(version / 1000000) + "." +
+                           std::to_string((version / 1000) % 1000) + "." +
+                           std::to_string(version % 1000));
+  // TODO(firsching): rethink --help handling
+  gflags::ParseCommandLineNonHelpFlags(&argc, &argv, /*remove_flags=*/true);
+  if (FLAGS_help) {
+    FLAGS_help = false;
+    FLAGS_helpshort = true;
+  }
+  gflags::HandleCommandLineHelpFlags();
+
+  if (argc != 3) {
+    FLAGS_help = false;
+    FLAGS_helpshort = true;
+    gflags::HandleCommandLineHelpFlags();
+    return EXIT_FAILURE;
+  }
+  const char* filename_in = argv[1];
+  const char* filename_out = argv[2];
+  size_t num_reps = FLAGS_num_reps;
+
+  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
+  {
+    int64_t flag_num_worker_threads = FLAGS_num_threads;
+    if (flag_num_worker_threads != 0) {
+      num_worker_threads = flag_num_worker_threads;
+    }
+  }
+  if (FLAGS_batch) {
+    return DecompressBatch(filename_in, filename_out, num_worker_threads);
+  }
+
+  // Reading compressed JPEG XL input, memory-mapped when possible so that the
+  // decoder reads it from the page cache without a copy.
+  jxl::FileContents input;
+  if (!input.Open(filename_in)) {
+    fprintf(stderr, "couldn't load %s\n", filename_in);
+    return EXIT_FAILURE;
+  }
+  const jxl::Span<const uint8_t> compressed(input);
+
+  auto dec = JxlDecoderMake(/*memory_manager=*/nullptr);
+  auto runner = JxlThreadParallelRunnerMake(
+      /*memory_manager=*/nullptr, num_worker_threads);
+  DecoderRunner decoder_runner;
+  decoder_runner.runner = JxlThreadParallelRunner;
+  decoder_runner.runner_opaque = runner.get();
+  std::vector<jpegxl::tools::BatchOutputFile> files;
+  size_t pixels;
+  const char* extension = strrchr(filename_out, '.');
+  JxlBasicInfo info;
+  if (FLAGS_stream_output && extension != nullptr &&
+      jxl::extras::CodecFromExtension(extension) == jxl::extras::Codec::kPNM &&
+      GetBasicInfo(compressed, dec.get(), &info) && !info.have_animation) {
+    for (size_t i = 0; i < num_reps; ++i) {
+      JxlDecoderReset(dec.get());
+      if (DecompressJxlToPNMStream(compressed, filename_out, extension,
+                                   dec.get(), decoder_runner,
+                                   &pixels) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+      }
+    }
+    return EXIT_SUCCESS;
+  }
+  for (size_t i = 0; i < num_reps; ++i) {
+    JxlDecoderReset(dec.get());
+    if (DecompressJxlToFiles(compressed, filename_out, dec.get(),
+                             decoder_runner, &files,
+                             &pixels) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  }
+  for (const jpegxl::tools::BatchOutputFile& file : files) {
+    if (!WriteFile(file.filename.c_str(), file.bytes)) {
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "tools/file_batch.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <utility>
+
+#include "lib/jxl/base/file_io.h"
+#include "lib/jxl/base/printf_macros.h"
+#include "tools/benchmark/benchmark_file_io.h"
+
+namespace jpegxl {
+namespace tools {
+
+namespace {
+
+double Seconds(std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end) {
+  return std::chrono::duration<double>(end - start).count();
+}
+
+struct ReadResult {
+  bool ok = false;
+  std::vector<uint8_t> bytes;
+};
+
+ReadResult ReadInput(const std::string& filename) {
+  ReadResult result;
+  result.ok = static_cast<bool>(jxl::ReadFile(filename, &result.bytes));
+  return result;
+}
+
+// Returns the number of files that could not be written.
+size_t WriteOutputs(const std::vector<BatchOutputFile>& outputs) {
+  size_t num_failed = 0;
+  for (const BatchOutputFile& output : outputs) {
+    if (!jxl::WriteFile(output.bytes, output.filename)) {
+      fprintf(stderr, "Failed to write %s\n", output.filename.c_str());
+      num_failed++;
+    }
+  }
+  return num_failed;
+}
+
+}  // namespace
+
+jxl::Status ListBatchInputs(const std::string& path,
+                            std::vector<std::string>* inputs) {
+  if (jxl::IsDirectory(path)) {
+    std::vector<std::string> entries;
+    JXL_RETURN_IF_ERROR(jxl::MatchFiles(jxl::JoinPath(path, "*"), &entries));
+    for (const std::string& entry : entries) {
+      if (jxl::IsRegularFile(entry)) inputs->push_back(entry);
+    }
+    std::sort(inputs->begin(), inputs->end());
+    return true;
+  }
+  std::string list;
+  JXL_RETURN_IF_ERROR(jxl::ReadFile(path, &list));
+  size_t begin = 0;
+  while (begin < list.size()) {
+    size_t end = list.find('\n', begin);
+    if (end == std::string::npos) end = list.size();
+    std::string line = list.substr(begin, end - begin);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (!line.empty()) inputs->push_back(line);
+    begin = end + 1;
+  }
+  return true;
+}
+
+std::string BatchOutputPath(const std::string& output_dir,
+                            const std::string& input,
+                            const std::string& extension) {
+  std::string name = jxl::FileBaseName(input);
+  const size_t dot = name.rfind('.');
+  if (dot != std::string::npos && dot != 0) name.resize(dot);
+  return jxl::JoinPath(output_dir, name + extension);
+}
+
+void BatchStats::Print() const {
+  const double mpixels = pixels * 1E-6;
+  fprintf(stderr,
+          "Processed %" PRIuS " files (%" PRIuS
+          " failed), %.2f MP, %.3f MB in, %.3f MB out, in %.3f s (%.3f s in "
+          "the codec): %.2f files/s, %.2f MP/s\n",
+          num_files, num_failed, mpixels, input_bytes * 1E-6,
+          output_bytes * 1E-6, elapsed_seconds, process_seconds,
+          elapsed_seconds > 0 ? num_files / elapsed_seconds : 0.0,
+          elapsed_seconds > 0 ? mpixels / elapsed_seconds : 0.0);
+}
+
+BatchStats RunBatch(const std::vector<std::string>& inputs,
+                    const BatchProcessFunc& process) {
+  BatchStats stats;
+  const auto start = std::chrono::steady_clock::now();
+  std::future<ReadResult> next_read;
+  if (!inputs.empty()) {
+    next_read = std::async(std::launch::async, ReadInput, inputs[0]);
+  }
+  std::future<size_t> pending_write;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    const ReadResult read = next_read.get();
+    if (i + 1 < inputs.size()) {
+      next_read = std::async(std::launch::async, ReadInput, inputs[i + 1]);
+    }
+    stats.num_files++;
+    if (!read.ok) {
+      fprintf(stderr, "Failed to read %s\n", inputs[i].c_str());
+      stats.num_failed++;
+      continue;
+    }
+    stats.input_bytes += read.bytes.size();
+
+    std::vector<BatchOutputFile> outputs;
+    size_t pixels = 0;
+    const auto process_start = std::chrono::steady_clock::now();
+    const bool ok = process(inputs[i], read.bytes, &outputs, &pixels);
+    stats.process_seconds +=
+        Seconds(process_start, std::chrono::steady_clock::now());
+    if (!ok) {
+      fprintf(stderr, "Failed to process %s\n", inputs[i].c_str());
+      stats.num_failed++;
+      continue;
+    }
+    stats.pixels += pixels;
+    for (const BatchOutputFile& output : outputs) {
+      stats.output_bytes += output.bytes.size();
+    }
+
+    // At most one write is in flight, so that slow storage makes the batch
+    // wait instead of holding the outputs of many files in memory.
+    if (pending_write.valid() && pending_write.get() != 0) {
+      stats.num_failed++;
+    }
+    pending_write =
+        std::async(std::launch::async, WriteOutputs, std::move(outputs));
+  }
+  if (pending_write.valid() && pending_write.get() != 0) {
+    stats.num_failed++;
+  }
+  stats.elapsed_seconds = Seconds(start, std::chrono::steady_clock::now());
+  return stats;
+}
+
+}  // namespace tools
+}  // namespace jpegxl
@@ -0,0 +1,71 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Batch processing of many files by one process, for cjxl_ng and djxl_ng.
+
+#ifndef TOOLS_FILE_BATCH_H_
+#define TOOLS_FILE_BATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "lib/jxl/base/status.h"
+
+namespace jpegxl {
+namespace tools {
+
+// Lists the inputs of a batch: the regular files in `path`, sorted, if it is a
+// directory, or the non-empty lines of `path` otherwise.
+jxl::Status ListBatchInputs(const std::string& path,
+                            std::vector<std::string>* inputs);
+
+// Returns the path in `output_dir` of the output for `input`: its file name
+// with the extension replaced by `extension`, e.g. ".jxl".
+std::string BatchOutputPath(const std::string& output_dir,
+                            const std::string& input,
+                            const std::string& extension);
+
+struct BatchOutputFile {
+  std::string filename;
+  std::vector<uint8_t> bytes;
+};
+
+// Converts the contents of one input into the files to write and the number
+// of pixels processed. Returns false if the input could not be converted.
+using BatchProcessFunc = std::function<bool(
+    const std::string& input, const std::vector<uint8_t>& bytes,
+    std::vector<BatchOutputFile>* outputs, size_t* pixels)>;
+
+struct BatchStats {
+  size_t num_files = 0;
+  size_t num_failed = 0;
+  uint64_t input_bytes = 0;
+  uint64_t output_bytes = 0;
+  uint64_t pixels = 0;
+  // Wall time of the whole batch, including the I/O not hidden by the
+  // pipelining.
+  double elapsed_seconds = 0.0;
+  // Time spent in BatchProcessFunc.
+  double process_seconds = 0.0;
+
+  // Prints the aggregate throughput to stderr.
+  void Print() const;
+};
+
+// Runs `process` on each input in turn. The next input is read and the outputs
+// of the previous one are written on other threads while `process` runs, so
+// that the file I/O overlaps with the codec work. A failure to read, convert or
+// write one input is reported and counted, and the batch continues.
+BatchStats RunBatch(const std::vector<std::string>& inputs,
+                    const BatchProcessFunc& process);
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_FILE_BATCH_H_
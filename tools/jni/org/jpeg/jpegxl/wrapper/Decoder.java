@@ -8,14 +8,91 @@ package org.jpeg.jpegxl.wrapper;
 import java.nio.Buffer;
 import java.nio.ByteBuffer;
 
-/** JPEG XL JNI decoder wrapper. */
-public class Decoder {
-  /** Utility library, disable object construction. */
-  private Decoder() {}
+/**
+ * JPEG XL JNI decoder wrapper.
+ *
+ * An instance keeps a native decoder and its threads, which are reused for the
+ * following images after {@link #reset}; it must be closed to free them. The
+ * stream can be fed in chunks: a call that returns {@link Status#NOT_ENOUGH_INPUT}
+ * is repeated with the next chunk, in a direct buffer of exactly its size, and
+ * the same output buffers. Pixels are decoded directly into the caller buffer.
+ *
+ * Instances are not thread-safe.
+ */
+public class Decoder implements AutoCloseable {
+  private long handle;
+  // Referenced while the native decoder may write to them, across calls.
+  private Buffer pixels;
+  private Buffer icc;
+
+  /** Create a decoder using {@code numThreads} threads, 0 to use only the calling thread. */
+  public Decoder(int numThreads) {
+    handle = DecoderJni.create(numThreads);
+    if (handle == 0) {
+      throw new IllegalStateException("Failed to create decoder");
+    }
+  }
+
+  private long checkHandle() {
+    if (handle == 0) {
+      throw new IllegalStateException("Decoder is closed");
+    }
+    return handle;
+  }
+
+  /**
+   * Feed the next chunk of the stream, or null, until the stream information
+   * is known. With a pixel format, the sizes of the pixels and ICC buffers for
+   * {@link #decodePixels} are known as well.
+   */
+  public StreamInfo decodeInfo(Buffer data, PixelFormat pixelFormat) {
+    return DecoderJni.getBasicInfo(checkHandle(), data, pixelFormat);
+  }
+
+  /**
+   * Feed the next chunk of the stream, or null, until the pixels are decoded
+   * into {@code pixels} and the ICC profile into {@code icc}. Both are direct
+   * buffers of at least the sizes reported by {@link #decodeInfo}.
+   */
+  public Status decodePixels(Buffer data, Buffer pixels, Buffer icc, PixelFormat pixelFormat) {
+    this.pixels = pixels;
+    this.icc = icc;
+    return DecoderJni.getPixels(checkHandle(), data, pixels, icc, pixelFormat);
+  }
+
+  /** Start decoding another image, keeping the native decoder and threads. */
+  public void reset() {
+    pixels = null;
+    icc = null;
+    if (DecoderJni.reset(checkHandle()) != Status.OK) {
+      throw new IllegalStateException("Failed to reset decoder");
+    }
+  }
+
+  @Override
+  public void close() {
+    if (handle != 0) {
+      DecoderJni.destroy(handle);
+      handle = 0;
+    }
+    pixels = null;
+    icc = null;
+  }
 
   /** One-shot decoding. */
   public static ImageData decode(Buffer data, PixelFormat pixelFormat) {
-    StreamInfo basicInfo = DecoderJni.getBasicInfo(data, pixelFormat);
+    try (Decoder decoder = new Decoder(0)) {
+      return decoder.decode(data, pixelFormat, null);
+    }
+  }
+
+  /**
+   * Decoding of a whole stream with this decoder, into {@code pixels} if it is
+   * not null and large enough, or into a new buffer otherwise.
+   */
+  public ImageData decode(Buffer data, PixelFormat pixelFormat, Buffer pixels) {
+    reset();
+    StreamInfo basicInfo = decodeInfo(data, pixelFormat);
     if (basicInfo.status != Status.OK) {
       throw new IllegalStateException("Decoding failed");
     }
@@ -23,17 +100,22 @@ public class Decoder {
         || basicInfo.iccSize < 0) {
       throw new IllegalStateException("JNI has returned negative size");
     }
-    Buffer pixels = ByteBuffer.allocateDirect(basicInfo.pixelsSize);
+    if (pixels == null || pixels.capacity() < basicInfo.pixelsSize) {
+      pixels = ByteBuffer.allocateDirect(basicInfo.pixelsSize);
+    }
     Buffer icc = ByteBuffer.allocateDirect(basicInfo.iccSize);
-    Status status = DecoderJni.getPixels(data, pixels, icc, pixelFormat);
+    Status status = decodePixels(null, pixels, icc, pixelFormat);
     if (status != Status.OK) {
       throw new IllegalStateException("Decoding failed");
     }
+    pixels.limit(basicInfo.pixelsSize);
     return new ImageData(basicInfo.width, basicInfo.height, pixels, icc, pixelFormat);
   }
 
   // TODO(eustas): accept byte-array as input.
   public static StreamInfo decodeInfo(Buffer data) {
-    return DecoderJni.getBasicInfo(data, null);
+    try (Decoder decoder = new Decoder(0)) {
+      return decoder.decodeInfo(data, null);
+    }
   }
 }
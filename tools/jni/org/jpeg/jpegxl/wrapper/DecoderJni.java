@@ -13,8 +13,11 @@ import java.nio.Buffer;
  * This class is package-private, should be only be used by high level wrapper.
  */
 class DecoderJni {
-  private static native void nativeGetBasicInfo(int[] context, Buffer data);
-  private static native void nativeGetPixels(int[] context, Buffer data, Buffer pixels, Buffer icc);
+  private static native long nativeCreate(int numThreads);
+  private static native void nativeDestroy(long handle);
+  private static native int nativeReset(long handle);
+  private static native void nativeProcess(
+      long handle, int[] context, Buffer data, Buffer pixels, Buffer icc);
 
   static Status makeStatus(int statusCode) {
     switch (statusCode) {
@@ -40,31 +43,49 @@ class DecoderJni {
     return result;
   }
 
-  /** Decode stream information. */
-  static StreamInfo getBasicInfo(Buffer data, PixelFormat pixelFormat) {
-    if (!data.isDirect()) {
-      throw new IllegalArgumentException("data must be direct buffer");
+  static void checkDirect(Buffer buffer, String name) {
+    if (buffer != null && !buffer.isDirect()) {
+      throw new IllegalArgumentException(name + " must be direct buffer");
     }
+  }
+
+  /** Create a native decoder; returns 0 on failure. */
+  static long create(int numThreads) {
+    if (numThreads < 0) {
+      throw new IllegalArgumentException("numThreads must not be negative");
+    }
+    return nativeCreate(numThreads);
+  }
+
+  static void destroy(long handle) {
+    nativeDestroy(handle);
+  }
+
+  /** Prepare the native decoder for the next image. */
+  static Status reset(long handle) {
+    return makeStatus(nativeReset(handle));
+  }
+
+  /** Feed the next part of the stream, and decode stream information. */
+  static StreamInfo getBasicInfo(long handle, Buffer data, PixelFormat pixelFormat) {
+    checkDirect(data, "data");
     int[] context = new int[6];
     context[0] = (pixelFormat == null) ? -1 : pixelFormat.ordinal();
-    nativeGetBasicInfo(context, data);
+    context[1] = 0;
+    nativeProcess(handle, context, data, null, null);
     return makeStreamInfo(context);
   }
 
-  /** One-shot decoding. */
-  static Status getPixels(Buffer data, Buffer pixels, Buffer icc, PixelFormat pixelFormat) {
-    if (!data.isDirect()) {
-      throw new IllegalArgumentException("data must be direct buffer");
-    }
-    if (!pixels.isDirect()) {
-      throw new IllegalArgumentException("pixels must be direct buffer");
-    }
-    if (!icc.isDirect()) {
-      throw new IllegalArgumentException("icc must be direct buffer");
-    }
-    int[] context = new int[1];
+  /** Feed the next part of the stream, and decode the pixels. */
+  static Status getPixels(
+      long handle, Buffer data, Buffer pixels, Buffer icc, PixelFormat pixelFormat) {
+    checkDirect(data, "data");
+    checkDirect(pixels, "pixels");
+    checkDirect(icc, "icc");
+    int[] context = new int[6];
     context[0] = pixelFormat.ordinal();
-    nativeGetPixels(context, data, pixels, icc);
+    context[1] = 1;
+    nativeProcess(handle, context, data, pixels, icc);
     return makeStatus(context[0]);
   }
 
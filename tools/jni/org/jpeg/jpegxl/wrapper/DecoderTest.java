@@ -5,6 +5,7 @@
 
 package org.jpeg.jpegxl.wrapper;
 
+import java.nio.Buffer;
 import java.nio.ByteBuffer;
 
 public class DecoderTest {
@@ -114,6 +115,61 @@ public class DecoderTest {
     }
   }
 
+  static void testReuseDecoder() {
+    try (Decoder decoder = new Decoder(2)) {
+      ImageData first = decoder.decode(makeSimpleImage(), PixelFormat.RGBA_8888, null);
+      checkSimpleImageData(first);
+      ImageData second = decoder.decode(makeSimpleImage(), PixelFormat.RGBA_8888, first.pixels);
+      checkSimpleImageData(second);
+      if (second.pixels != first.pixels) {
+        throw new IllegalStateException("Expected the pixels buffer to be reused");
+      }
+      decoder.reset();
+      StreamInfo streamInfo =
+          decoder.decodeInfo(makeByteBuffer(PIXEL_IMAGE_BYTES, PIXEL_IMAGE_BYTES.length), null);
+      if (streamInfo.status != Status.OK || streamInfo.width != PIXEL_IMAGE_DIM
+          || streamInfo.alphaBits != 8) {
+        throw new IllegalStateException("Unexpected info after reset");
+      }
+    }
+  }
+
+  static void testChunkedInput() {
+    try (Decoder decoder = new Decoder(0)) {
+      StreamInfo streamInfo = null;
+      ImageData imageData = null;
+      Buffer pixels = null;
+      Buffer icc = null;
+      for (int i = 0; i < SIMPLE_IMAGE_BYTES.length; ++i) {
+        ByteBuffer chunk = ByteBuffer.allocateDirect(1);
+        chunk.put(SIMPLE_IMAGE_BYTES[i]);
+        Status status;
+        if (pixels == null) {
+          streamInfo = decoder.decodeInfo(chunk, PixelFormat.RGBA_8888);
+          status = streamInfo.status;
+          if (status == Status.OK) {
+            pixels = ByteBuffer.allocateDirect(streamInfo.pixelsSize);
+            icc = ByteBuffer.allocateDirect(streamInfo.iccSize);
+            status = decoder.decodePixels(null, pixels, icc, PixelFormat.RGBA_8888);
+          }
+        } else {
+          status = decoder.decodePixels(chunk, pixels, icc, PixelFormat.RGBA_8888);
+        }
+        if (status == Status.OK) {
+          imageData = new ImageData(
+              streamInfo.width, streamInfo.height, pixels, icc, PixelFormat.RGBA_8888);
+          break;
+        } else if (status != Status.NOT_ENOUGH_INPUT) {
+          throw new IllegalStateException("Unexpected status " + status + " " + i);
+        }
+      }
+      if (imageData == null) {
+        throw new IllegalStateException("Image was not decoded");
+      }
+      checkSimpleImageData(imageData);
+    }
+  }
+
   // Simple executable to avoid extra dependencies.
   public static void main(String[] args) {
     testRgba();
@@ -123,5 +179,7 @@ public class DecoderTest {
     testGetInfoNoAlpha();
     testGetInfoAlpha();
     testNotEnoughInput();
+    testReuseDecoder();
+    testChunkedInput();
   }
 }
@@ -7,7 +7,9 @@
 
 #include <jni.h>
 
+#include <cstdint>
 #include <cstdlib>
+#include <vector>
 
 #include "jxl/decode.h"
 #include "jxl/thread_parallel_runner.h"
@@ -64,117 +66,143 @@ JxlPixelFormat ToPixelFormat(size_t pixel_format) {
   }
 }
 
-jxl::Status DoDecode(JNIEnv* env, jobject data_buffer, size_t* info_pixels_size,
-                     size_t* info_icc_size, JxlBasicInfo* info,
-                     size_t pixel_format, jobject pixels_buffer,
-                     jobject icc_buffer) {
-  if (data_buffer == nullptr) return JXL_FAILURE("No data buffer");
+// Native state behind a Java Decoder handle. The decoder and the runner are
+// kept across images, so only the first image pays for their setup.
+struct DecoderState {
+  JxlDecoder* dec = nullptr;
+  void* runner = nullptr;
+  // Input not consumed by the decoder yet. Empty while the decoder reads the
+  // caller buffer directly, which is only valid during one native call.
+  std::vector<uint8_t> pending;
+  JxlBasicInfo info = {};
+  bool have_info = false;
+  bool have_color = false;
+  bool have_icc = false;
+  bool done = false;
+};
+
+jxl::Status SetUpDecoder(DecoderState* state) {
+  if (JxlDecoderSetParallelRunner(state->dec, JxlThreadParallelRunner,
+                                  state->runner) != JXL_DEC_SUCCESS) {
+    return JXL_FAILURE("Failed to set parallel runner");
+  }
+  if (JxlDecoderSubscribeEvents(state->dec, JXL_DEC_BASIC_INFO |
+                                                JXL_DEC_COLOR_ENCODING |
+                                                JXL_DEC_FULL_IMAGE) !=
+      JXL_DEC_SUCCESS) {
+    return JXL_FAILURE("Failed to subscribe for events");
+  }
+  state->pending.clear();
+  state->info = {};
+  state->have_info = false;
+  state->have_color = false;
+  state->have_icc = false;
+  state->done = false;
+  return true;
+}
 
+jxl::Status CopyIcc(DecoderState* state, size_t pixel_format, uint8_t* icc,
+                    size_t icc_size) {
+  if (state->have_icc || icc == nullptr || icc_size == 0) return true;
+  JxlPixelFormat format = ToPixelFormat(pixel_format);
+  if (JxlDecoderGetColorAsICCProfile(state->dec, &format,
+                                     JXL_COLOR_PROFILE_TARGET_DATA, icc,
+                                     icc_size) != JXL_DEC_SUCCESS) {
+    return JXL_FAILURE("Failed to get ICC");
+  }
+  state->have_icc = true;
+  return true;
+}
+
+// Runs the decoder on `data` appended to the pending input, until the color
+// encoding is known, or until the full image is in `pixels` if `want_pixels`.
+// Returns kNotEnoughBytes if more input is needed; the caller then passes the
+// next bytes of the stream, and the same output buffers.
+jxl::Status Process(JNIEnv* env, DecoderState* state, jobject data_buffer,
+                    size_t pixel_format, bool want_pixels,
+                    jobject pixels_buffer, jobject icc_buffer) {
   uint8_t* data = nullptr;
   size_t data_size = 0;
   if (!BufferToSpan(env, data_buffer, &data, &data_size)) {
     return JXL_FAILURE("Failed to access data buffer");
   }
-
   uint8_t* pixels = nullptr;
   size_t pixels_size = 0;
   if (!BufferToSpan(env, pixels_buffer, &pixels, &pixels_size)) {
     return JXL_FAILURE("Failed to access pixels buffer");
   }
-
   uint8_t* icc = nullptr;
   size_t icc_size = 0;
   if (!BufferToSpan(env, icc_buffer, &icc, &icc_size)) {
     return JXL_FAILURE("Failed to access ICC buffer");
   }
 
-  JxlDecoder* dec = JxlDecoderCreate(NULL);
-
-  constexpr size_t kNumThreads = 0;  // Do everything in this thread.
-  void* runner = JxlThreadParallelRunnerCreate(NULL, kNumThreads);
-
-  struct Defer {
-    JxlDecoder* dec;
-    void* runner;
-    ~Defer() {
-      JxlThreadParallelRunnerDestroy(runner);
-      JxlDecoderDestroy(dec);
-    }
-  } defer{dec, runner};
-
-  auto status =
-      JxlDecoderSetParallelRunner(dec, JxlThreadParallelRunner, runner);
-  if (status != JXL_DEC_SUCCESS) {
-    return JXL_FAILURE("Failed to set parallel runner");
+  if (!state->pending.empty() || (state->have_color && !want_pixels)) {
+    state->pending.insert(state->pending.end(), data, data + data_size);
+    data = state->pending.data();
+    data_size = state->pending.size();
   }
-  status = JxlDecoderSubscribeEvents(
-      dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE | JXL_DEC_COLOR_ENCODING);
-  if (status != JXL_DEC_SUCCESS) {
-    return JXL_FAILURE("Failed to subscribe for events");
+  if (state->done || (state->have_color && !want_pixels)) {
+    if (!state->have_color) return true;
+    return CopyIcc(state, pixel_format, icc, icc_size);
   }
-  status = JxlDecoderSetInput(dec, data, data_size);
-  if (status != JXL_DEC_SUCCESS) {
+
+  JxlDecoder* dec = state->dec;
+  if (JxlDecoderSetInput(dec, data, data_size) != JXL_DEC_SUCCESS) {
     return JXL_FAILURE("Failed to set input");
   }
-  status = JxlDecoderProcessInput(dec);
-  if (status == JXL_DEC_NEED_MORE_INPUT) {
-    return JXL_STATUS(jxl::StatusCode::kNotEnoughBytes, "Not enough input");
-  }
-  if (status != JXL_DEC_BASIC_INFO) {
-    return JXL_FAILURE("Unexpected notification (want: basic info)");
-  }
-  if (info_pixels_size) {
-    JxlPixelFormat format = ToPixelFormat(pixel_format);
-    status = JxlDecoderImageOutBufferSize(dec, &format, info_pixels_size);
-    if (status != JXL_DEC_SUCCESS) {
-      return JXL_FAILURE("Failed to get pixels size");
-    }
-  }
-  if (info) {
-    status = JxlDecoderGetBasicInfo(dec, info);
-    if (status != JXL_DEC_SUCCESS) {
-      return JXL_FAILURE("Failed to get basic info");
+  jxl::Status result = true;
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+    if (status == JXL_DEC_BASIC_INFO) {
+      if (JxlDecoderGetBasicInfo(dec, &state->info) != JXL_DEC_SUCCESS) {
+        result = JXL_FAILURE("Failed to get basic info");
+        break;
+      }
+      state->have_info = true;
+    } else if (status == JXL_DEC_COLOR_ENCODING) {
+      state->have_color = true;
+      if (!want_pixels) break;
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      if (pixels == nullptr) {
+        result = JXL_FAILURE("No pixels buffer");
+        break;
+      }
+      JxlPixelFormat format = ToPixelFormat(pixel_format);
+      if (JxlDecoderSetImageOutBuffer(dec, &format, pixels, pixels_size) !=
+          JXL_DEC_SUCCESS) {
+        result = JXL_FAILURE("Failed to set out buffer");
+        break;
+      }
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+      state->done = true;
+      break;
+    } else if (status == JXL_DEC_NEED_MORE_INPUT) {
+      result = JXL_STATUS(jxl::StatusCode::kNotEnoughBytes, "Not enough input");
+      break;
+    } else {
+      result = JXL_FAILURE("Unexpected notification");
+      break;
     }
   }
-  status = JxlDecoderProcessInput(dec);
-  if (status != JXL_DEC_COLOR_ENCODING) {
-    return JXL_FAILURE("Unexpected notification (want: color encoding)");
-  }
-  if (info_icc_size) {
-    JxlPixelFormat format = ToPixelFormat(pixel_format);
-    status = JxlDecoderGetICCProfileSize(
-        dec, &format, JXL_COLOR_PROFILE_TARGET_DATA, info_icc_size);
-    if (status != JXL_DEC_SUCCESS) *info_icc_size = 0;
-  }
-  if (icc && icc_size > 0) {
-    JxlPixelFormat format = ToPixelFormat(pixel_format);
-    status = JxlDecoderGetColorAsICCProfile(
-        dec, &format, JXL_COLOR_PROFILE_TARGET_DATA, icc, icc_size);
-    if (status != JXL_DEC_SUCCESS) {
-      return JXL_FAILURE("Failed to get ICC");
-    }
+  if (result && state->have_color) {
+    result = CopyIcc(state, pixel_format, icc, icc_size);
   }
-  if (pixels) {
-    JxlPixelFormat format = ToPixelFormat(pixel_format);
-    status = JxlDecoderProcessInput(dec);
-    if (status != JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
-      return JXL_FAILURE("Unexpected notification (want: need out buffer)");
-    }
-    status = JxlDecoderSetImageOutBuffer(dec, &format, pixels, pixels_size);
-    if (status != JXL_DEC_SUCCESS) {
-      return JXL_FAILURE("Failed to set out buffer");
-    }
-    status = JxlDecoderProcessInput(dec);
-    if (status != JXL_DEC_FULL_IMAGE) {
-      return JXL_FAILURE("Unexpected notification (want: full image)");
-    }
-    status = JxlDecoderProcessInput(dec);
-    if (status != JXL_DEC_SUCCESS) {
-      return JXL_FAILURE("Unexpected notification (want: success)");
-    }
+
+  // Keep the bytes the decoder has not consumed, since the caller buffer may
+  // be reused for the next chunk.
+  const size_t remaining = JxlDecoderReleaseInput(dec);
+  if (state->pending.empty()) {
+    state->pending.assign(data + data_size - remaining, data + data_size);
+  } else {
+    state->pending.erase(state->pending.begin(),
+                         state->pending.end() - remaining);
   }
+  return result;
+}
 
-  return true;
+DecoderState* ToState(jlong handle) {
+  return reinterpret_cast<DecoderState*>(static_cast<uintptr_t>(handle));
 }
 
 #undef FAILURE
@@ -185,92 +213,91 @@ jxl::Status DoDecode(JNIEnv* env, jobject data_buffer, size_t* info_pixels_size,
 extern "C" {
 #endif
 
-JNIEXPORT void JNICALL
-Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeGetBasicInfo(
-    JNIEnv* env, jobject /*jobj*/, jintArray ctx, jobject data_buffer) {
-  jint context[6] = {0};
-  env->GetIntArrayRegion(ctx, 0, 1, context);
+JNIEXPORT jlong JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeCreate(
+    JNIEnv* /*env*/, jobject /*jobj*/, jint num_threads) {
+  size_t threads;
+  if (!StaticCast(num_threads, &threads)) return 0;
+  DecoderState* state = new DecoderState();
+  state->dec = JxlDecoderCreate(nullptr);
+  // Without threads, the runner does everything on the calling thread.
+  state->runner = JxlThreadParallelRunnerCreate(nullptr, threads);
+  if (state->dec == nullptr || state->runner == nullptr ||
+      !SetUpDecoder(state)) {
+    if (state->runner) JxlThreadParallelRunnerDestroy(state->runner);
+    if (state->dec) JxlDecoderDestroy(state->dec);
+    delete state;
+    return 0;
+  }
+  return static_cast<jlong>(reinterpret_cast<uintptr_t>(state));
+}
 
-  JxlBasicInfo info = {};
-  size_t pixels_size = 0;
-  size_t icc_size = 0;
-  size_t pixel_format = 0;
+JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeDestroy(
+    JNIEnv* /*env*/, jobject /*jobj*/, jlong handle) {
+  DecoderState* state = ToState(handle);
+  if (state == nullptr) return;
+  JxlThreadParallelRunnerDestroy(state->runner);
+  JxlDecoderDestroy(state->dec);
+  delete state;
+}
+
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeReset(
+    JNIEnv* /*env*/, jobject /*jobj*/, jlong handle) {
+  DecoderState* state = ToState(handle);
+  JxlDecoderResetKeepAllocations(state->dec);
+  return ToStatusCode(SetUpDecoder(state));
+}
+
+JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeProcess(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jintArray ctx,
+    jobject data_buffer, jobject pixels_buffer, jobject icc_buffer) {
+  jint context[6] = {0};
+  env->GetIntArrayRegion(ctx, 0, 2, context);
+  DecoderState* state = ToState(handle);
 
+  size_t pixel_format = context[0];
+  const bool want_pixels = context[1] != 0;
   jxl::Status status = true;
+  if (pixel_format == kNoPixelFormat && !want_pixels) {
+    // OK
+  } else if (pixel_format > kLastPixelFormat) {
+    status = JXL_FAILURE("Unrecognized pixel format");
+  }
 
   if (status) {
-    pixel_format = context[0];
-    if (pixel_format == kNoPixelFormat) {
-      // OK
-    } else if (pixel_format > kLastPixelFormat) {
-      status = JXL_FAILURE("Unrecognized pixel format");
-    }
+    status = Process(env, state, data_buffer, pixel_format, want_pixels,
+                     pixels_buffer, icc_buffer);
   }
 
-  if (status) {
-    bool want_output_size = (pixel_format != kNoPixelFormat);
-    if (want_output_size) {
-      status = DoDecode(
-          env, data_buffer, &pixels_size, &icc_size, &info, pixel_format,
-          /* pixels_buffer= */ nullptr, /* icc_buffer= */ nullptr);
-    } else {
-      status =
-          DoDecode(env, data_buffer, /* info_pixels_size= */ nullptr,
-                   /* info_icc_size= */ nullptr, &info, pixel_format,
-                   /* pixels_buffer= */ nullptr, /* icc_buffer= */ nullptr);
+  size_t pixels_size = 0;
+  size_t icc_size = 0;
+  if (status && state->have_info && pixel_format != kNoPixelFormat) {
+    JxlPixelFormat format = ToPixelFormat(pixel_format);
+    if (JxlDecoderImageOutBufferSize(state->dec, &format, &pixels_size) !=
+        JXL_DEC_SUCCESS) {
+      status = JXL_FAILURE("Failed to get pixels size");
+    }
+    if (status && state->have_color &&
+        JxlDecoderGetICCProfileSize(state->dec, &format,
+                                    JXL_COLOR_PROFILE_TARGET_DATA,
+                                    &icc_size) != JXL_DEC_SUCCESS) {
+      icc_size = 0;
     }
   }
 
   if (status) {
     bool ok = true;
-    ok &= StaticCast(info.xsize, context + 1);
-    ok &= StaticCast(info.ysize, context + 2);
+    ok &= StaticCast(state->info.xsize, context + 1);
+    ok &= StaticCast(state->info.ysize, context + 2);
     ok &= StaticCast(pixels_size, context + 3);
     ok &= StaticCast(icc_size, context + 4);
-    ok &= StaticCast(info.alpha_bits, context + 5);
+    ok &= StaticCast(state->info.alpha_bits, context + 5);
     if (!ok) status = JXL_FAILURE("Invalid value");
   }
 
   context[0] = ToStatusCode(status);
-
   env->SetIntArrayRegion(ctx, 0, 6, context);
 }
 
-/**
- * Get image pixel data.
- *
- * @param ctx {out_status} tuple
- * @param data [in] Buffer with encoded JXL stream
- * @param pixels [out] Buffer to place pixels to
- */
-JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeGetPixels(
-    JNIEnv* env, jobject /* jobj */, jintArray ctx, jobject data_buffer,
-    jobject pixels_buffer, jobject icc_buffer) {
-  jint context[1] = {0};
-  env->GetIntArrayRegion(ctx, 0, 1, context);
-
-  size_t pixel_format = 0;
-
-  jxl::Status status = true;
-
-  if (status) {
-    // Unlike getBasicInfo, "no-pixel-format" is not supported.
-    pixel_format = context[0];
-    if (pixel_format > kLastPixelFormat) {
-      status = JXL_FAILURE("Unrecognized pixel format");
-    }
-  }
-
-  if (status) {
-    status = DoDecode(env, data_buffer, /* info_pixels_size= */ nullptr,
-                      /* info_icc_size= */ nullptr, /* info= */ nullptr,
-                      pixel_format, pixels_buffer, icc_buffer);
-  }
-
-  context[0] = ToStatusCode(status);
-  env->SetIntArrayRegion(ctx, 0, 1, context);
-}
-
 #ifdef __cplusplus
 }
 #endif
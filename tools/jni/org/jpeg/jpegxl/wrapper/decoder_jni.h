@@ -13,28 +13,46 @@ extern "C" {
 #endif
 
 /**
- * Get basic image information (size, etc.)
+ * Create a decoder, kept until nativeDestroy.
  *
- * @param ctx {in_pixel_format_out_status, out_width, out_height, pixels_size,
- *             icc_size} tuple
- * @param data [in] Buffer with encoded JXL stream
+ * @param num_threads [in] number of threads to decode with, 0 for the calling
+ *                    thread only
+ * @return handle of the decoder, 0 on failure
  */
-JNIEXPORT void JNICALL
-Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeGetBasicInfo(JNIEnv* env,
-                                                           jobject /*jobj*/,
-                                                           jintArray ctx,
-                                                           jobject data_buffer);
+JNIEXPORT jlong JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeCreate(
+    JNIEnv* env, jobject /*jobj*/, jint num_threads);
 
 /**
- * Get image pixel data.
+ * Destroy a decoder created by nativeCreate.
  *
- * @param ctx {in_pixel_format_out_status} tuple
- * @param data [in] Buffer with encoded JXL stream
- * @param pixels [out] Buffer to place pixels to
+ * @param handle [in] decoder handle
  */
-JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeGetPixels(
-    JNIEnv* env, jobject /*jobj*/, jintArray ctx, jobject data_buffer,
-    jobject pixels_buffer, jobject icc_buffer);
+JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeDestroy(
+    JNIEnv* env, jobject /*jobj*/, jlong handle);
+
+/**
+ * Prepare the decoder for the next image, keeping its allocations.
+ *
+ * @param handle [in] decoder handle
+ * @return status
+ */
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeReset(
+    JNIEnv* env, jobject /*jobj*/, jlong handle);
+
+/**
+ * Feed the next bytes of the JXL stream, and decode the basic image
+ * information, or also the pixels.
+ *
+ * @param handle [in] decoder handle
+ * @param ctx {in_pixel_format_out_status, in_want_pixels_out_width,
+ *             out_height, pixels_size, icc_size, alpha_bits} tuple
+ * @param data [in] Buffer with the next bytes of encoded JXL stream, or null
+ * @param pixels [out] Buffer to place pixels to, or null
+ * @param icc [out] Buffer to place the ICC profile to, or null
+ */
+JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeProcess(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jintArray ctx,
+    jobject data_buffer, jobject pixels_buffer, jobject icc_buffer);
 
 #ifdef __cplusplus
 }
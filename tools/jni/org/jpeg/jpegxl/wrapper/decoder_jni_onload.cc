@@ -11,21 +11,27 @@
 extern "C" {
 #endif
 
-static char* kGetBasicInfoName = const_cast<char*>("nativeGetBasicInfo");
-static char* kGetBasicInfoSig = const_cast<char*>("([ILjava/nio/Buffer;)V");
-static char* kGetPixelsName = const_cast<char*>("nativeGetPixels");
-static char* kGetPixelsInfoSig = const_cast<char*>(
-    "([ILjava/nio/Buffer;Ljava/nio/Buffer;Ljava/nio/Buffer;)V");
+static char* kCreateName = const_cast<char*>("nativeCreate");
+static char* kCreateSig = const_cast<char*>("(I)J");
+static char* kDestroyName = const_cast<char*>("nativeDestroy");
+static char* kDestroySig = const_cast<char*>("(J)V");
+static char* kResetName = const_cast<char*>("nativeReset");
+static char* kResetSig = const_cast<char*>("(J)I");
+static char* kProcessName = const_cast<char*>("nativeProcess");
+static char* kProcessSig = const_cast<char*>(
+    "(J[ILjava/nio/Buffer;Ljava/nio/Buffer;Ljava/nio/Buffer;)V");
 
 #define JXL_JNI_METHOD(NAME) \
   (reinterpret_cast<void*>(  \
       Java_org_jpeg_jpegxl_wrapper_DecoderJni_native##NAME))
 
 static const JNINativeMethod kDecoderMethods[] = {
-    {kGetBasicInfoName, kGetBasicInfoSig, JXL_JNI_METHOD(GetBasicInfo)},
-    {kGetPixelsName, kGetPixelsInfoSig, JXL_JNI_METHOD(GetPixels)}};
+    {kCreateName, kCreateSig, JXL_JNI_METHOD(Create)},
+    {kDestroyName, kDestroySig, JXL_JNI_METHOD(Destroy)},
+    {kResetName, kResetSig, JXL_JNI_METHOD(Reset)},
+    {kProcessName, kProcessSig, JXL_JNI_METHOD(Process)}};
 
-static const size_t kNumDecoderMethods = 2;
+static const size_t kNumDecoderMethods = 4;
 
 #undef JXL_JNI_METHOD
 
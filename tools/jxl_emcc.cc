@@ -4,7 +4,10 @@
 // license that can be found in the LICENSE file.
 
 #include <cstring>
+#include <vector>
 
+#include "jxl/decode.h"
+#include "jxl/thread_parallel_runner.h"
 #include "lib/extras/codec.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/codec_in_out.h"
@@ -63,4 +66,128 @@ uint8_t* jxlDecompress(const uint8_t* data, size_t size) {
   return result;
 }
 
+/* Streaming decoder of the public JxlDecoder API to RGBA8 pixels. */
+
+struct JxlStreamDecoder {
+  JxlDecoder* dec = nullptr;
+  void* runner = nullptr;
+  /* Input not consumed yet by the decoder, kept across jxlStreamPush. */
+  std::vector<uint8_t> input;
+  std::vector<uint8_t> pixels;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  bool frame_started = false;
+};
+
+enum JxlStreamStatus {
+  kJxlStreamError = -1,
+  kJxlStreamNeedMoreInput = 0,
+  /* The pixels hold a progressive step of the image; more input is needed. */
+  kJxlStreamProgressive = 1,
+  /* The pixels hold the full first frame; later input is ignored. */
+  kJxlStreamDone = 2,
+};
+
+/** Result: decoder for jxlStreamPush, null on failure. With `num_threads`
+ * above 0 the decoding runs on that many threads, which requires a build
+ * with threads (ENABLE_WASM_THREADS=1 in ci.sh); 0 decodes on the calling
+ * thread. */
+JxlStreamDecoder* jxlStreamCreate(size_t num_threads) {
+  JxlStreamDecoder* stream = new JxlStreamDecoder();
+  stream->dec = JxlDecoderCreate(nullptr);
+  bool ok = stream->dec != nullptr;
+  if (ok && num_threads > 0) {
+    stream->runner = JxlThreadParallelRunnerCreate(nullptr, num_threads);
+    ok = stream->runner != nullptr &&
+         JxlDecoderSetParallelRunner(stream->dec, JxlThreadParallelRunner,
+                                     stream->runner) == JXL_DEC_SUCCESS;
+  }
+  ok = ok && JxlDecoderSubscribeEvents(stream->dec, JXL_DEC_BASIC_INFO |
+                                                        JXL_DEC_FRAME |
+                                                        JXL_DEC_FULL_IMAGE) ==
+                 JXL_DEC_SUCCESS;
+  if (!ok) {
+    if (stream->runner) JxlThreadParallelRunnerDestroy(stream->runner);
+    if (stream->dec) JxlDecoderDestroy(stream->dec);
+    delete stream;
+    return nullptr;
+  }
+  return stream;
+}
+
+/** Feeds the next `size` bytes of the file, `is_last` for the final chunk.
+ * Result: a JxlStreamStatus. After kJxlStreamProgressive and kJxlStreamDone,
+ * jxlStreamPixels holds width * height RGBA8 pixels, row by row. */
+int jxlStreamPush(JxlStreamDecoder* stream, const uint8_t* data, size_t size,
+                  int is_last) {
+  stream->input.insert(stream->input.end(), data, data + size);
+  JxlDecoder* dec = stream->dec;
+  if (JxlDecoderSetInput(dec, stream->input.data(), stream->input.size()) !=
+      JXL_DEC_SUCCESS) {
+    return kJxlStreamError;
+  }
+  if (is_last) JxlDecoderCloseInput(dec);
+  const JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  int result = kJxlStreamError;
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+    if (status == JXL_DEC_BASIC_INFO) {
+      JxlBasicInfo info;
+      if (JxlDecoderGetBasicInfo(dec, &info) != JXL_DEC_SUCCESS) break;
+      stream->width = info.xsize;
+      stream->height = info.ysize;
+    } else if (status == JXL_DEC_FRAME) {
+      stream->frame_started = true;
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      size_t buffer_size;
+      if (JxlDecoderImageOutBufferSize(dec, &format, &buffer_size) !=
+          JXL_DEC_SUCCESS) {
+        break;
+      }
+      stream->pixels.resize(buffer_size);
+      if (JxlDecoderSetImageOutBuffer(dec, &format, stream->pixels.data(),
+                                      stream->pixels.size()) !=
+          JXL_DEC_SUCCESS) {
+        break;
+      }
+    } else if (status == JXL_DEC_FULL_IMAGE || status == JXL_DEC_SUCCESS) {
+      result = stream->pixels.empty() ? kJxlStreamError : kJxlStreamDone;
+      break;
+    } else if (status == JXL_DEC_NEED_MORE_INPUT) {
+      if (is_last) break;
+      result = kJxlStreamNeedMoreInput;
+      if (stream->frame_started && !stream->pixels.empty() &&
+          JxlDecoderFlushImage(dec) == JXL_DEC_SUCCESS) {
+        result = kJxlStreamProgressive;
+      }
+      break;
+    } else {
+      break;
+    }
+  }
+  const size_t remaining = JxlDecoderReleaseInput(dec);
+  stream->input.erase(stream->input.begin(),
+                      stream->input.end() - remaining);
+  return result;
+}
+
+uint32_t jxlStreamWidth(const JxlStreamDecoder* stream) {
+  return stream->width;
+}
+
+uint32_t jxlStreamHeight(const JxlStreamDecoder* stream) {
+  return stream->height;
+}
+
+const uint8_t* jxlStreamPixels(const JxlStreamDecoder* stream) {
+  return stream->pixels.data();
+}
+
+void jxlStreamDestroy(JxlStreamDecoder* stream) {
+  if (stream == nullptr) return;
+  if (stream->runner) JxlThreadParallelRunnerDestroy(stream->runner);
+  JxlDecoderDestroy(stream->dec);
+  delete stream;
+}
+
 }  // extern "C"
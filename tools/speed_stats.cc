@@ -21,11 +21,53 @@ void SpeedStats::NotifyElapsed(double elapsed_seconds) {
   elapsed_.push_back(elapsed_seconds);
 }
 
-jxl::Status SpeedStats::GetSummary(SpeedStats::Summary* s) {
+void SpeedStats::NotifyElapsed(double elapsed_seconds, double cpu_seconds) {
+  NotifyElapsed(elapsed_seconds);
+  cpu_.push_back(cpu_seconds);
+}
+
+namespace {
+
+// Sets the fields of s that describe the distribution of the measured reps.
+void SummarizeMeasured(const std::vector<double>& elapsed,
+                       const std::vector<double>& cpu, size_t warmup_reps,
+                       SpeedStats::Summary* s) {
+  const size_t skip = std::min(warmup_reps, elapsed.size() - 1);
+  std::vector<double> measured(elapsed.begin() + skip, elapsed.end());
+  std::sort(measured.begin(), measured.end());
+  const size_t n = measured.size();
+  s->num_measured = n;
+  const auto percentile = [&measured, n](double p) {
+    const size_t rank = static_cast<size_t>(ceil(p * n));
+    return measured[std::max<size_t>(rank, 1) - 1];
+  };
+  s->p50 = percentile(0.50);
+  s->p90 = percentile(0.90);
+  s->p99 = percentile(0.99);
+
+  double sum = 0.0;
+  for (double t : measured) sum += t;
+  const double mean = sum / n;
+  double sum_squares = 0.0;
+  for (double t : measured) sum_squares += (t - mean) * (t - mean);
+  s->stddev = n > 1 ? sqrt(sum_squares / (n - 1)) : 0.0;
+
+  s->cpu = 0.0;
+  // Only if every rep recorded its CPU time.
+  if (cpu.size() == elapsed.size()) {
+    for (size_t i = skip; i < cpu.size(); ++i) s->cpu += cpu[i];
+    s->cpu /= n;
+  }
+}
+
+}  // namespace
+
+jxl::Status SpeedStats::GetSummary(SpeedStats::Summary* s) const {
   if (elapsed_.empty()) return JXL_FAILURE("Didn't call NotifyElapsed");
 
   s->min = *std::min_element(elapsed_.begin(), elapsed_.end());
   s->max = *std::max_element(elapsed_.begin(), elapsed_.end());
+  SummarizeMeasured(elapsed_, cpu_, warmup_reps_, s);
 
   // Single rep
   if (elapsed_.size() == 1) {
@@ -57,11 +99,12 @@ jxl::Status SpeedStats::GetSummary(SpeedStats::Summary* s) {
   }
 
   // Else: median
-  std::sort(elapsed_.begin(), elapsed_.end());
-  s->central_tendency = elapsed_.data()[elapsed_.size() / 2];
-  std::vector<double> deviations(elapsed_.size());
-  for (size_t i = 0; i < elapsed_.size(); i++) {
-    deviations[i] = fabs(elapsed_[i] - s->central_tendency);
+  std::vector<double> sorted = elapsed_;
+  std::sort(sorted.begin(), sorted.end());
+  s->central_tendency = sorted[sorted.size() / 2];
+  std::vector<double> deviations(sorted.size());
+  for (size_t i = 0; i < sorted.size(); i++) {
+    deviations[i] = fabs(sorted[i] - s->central_tendency);
   }
   std::nth_element(deviations.begin(),
                    deviations.begin() + deviations.size() / 2,
@@ -110,6 +153,20 @@ jxl::Status SpeedStats::Print(size_t worker_threads) {
           mps_stats.c_str(), mbs_stats.c_str(), variability,
           static_cast<uint64_t>(elapsed_.size()),
           static_cast<uint64_t>(worker_threads));
+  // The distribution is only meaningful with a few measured reps.
+  if (s.num_measured >= 3) {
+    fprintf(stderr,
+            "Latency of %" PRIu64 " reps: p50 %.3f ms, p90 %.3f ms, "
+            "p99 %.3f ms, stddev %.3f ms",
+            static_cast<uint64_t>(s.num_measured), s.p50 * 1E3, s.p90 * 1E3,
+            s.p99 * 1E3, s.stddev * 1E3);
+  }
+  if (s.cpu != 0.0) {
+    fprintf(stderr, "%sCPU %.3f ms (%.2fx wall).\n",
+            s.num_measured >= 3 ? ", " : "", s.cpu * 1E3, s.cpu / s.p50);
+  } else if (s.num_measured >= 3) {
+    fprintf(stderr, ".\n");
+  }
   return true;
 }
 
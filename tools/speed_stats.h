@@ -19,6 +19,9 @@ namespace tools {
 class SpeedStats {
  public:
   void NotifyElapsed(double elapsed_seconds);
+  // Also records the CPU time of the process during the repetition, see
+  // jxl::CpuTime.
+  void NotifyElapsed(double elapsed_seconds, double cpu_seconds);
 
   struct Summary {
     // How central_tendency was computed - depends on number of reps.
@@ -29,10 +32,27 @@ class SpeedStats {
     double min;
     double max;
     double variability;
+
+    // Distribution of the elapsed time of the repetitions after the warm-up
+    // ones: nearest-rank percentiles and standard deviation.
+    size_t num_measured;
+    double p50;
+    double p90;
+    double p99;
+    double stddev;
+    // Mean CPU time of the measured repetitions, or 0 if not recorded.
+    double cpu;
   };
 
-  // Non-const, may sort elapsed_.
-  jxl::Status GetSummary(Summary* summary);
+  jxl::Status GetSummary(Summary* summary) const;
+
+  // Sets how many of the first repetitions are excluded from the percentiles,
+  // standard deviation and CPU time, as they are slowed down by cold caches.
+  // At least one repetition is always measured. The default is 1.
+  void SetWarmupReps(size_t warmup_reps) { warmup_reps_ = warmup_reps; }
+
+  // Elapsed time of each repetition, in order, including the warm-up ones.
+  const std::vector<double>& Samples() const { return elapsed_; }
 
   // Sets the image size to allow computing MP/s values.
   void SetImageSize(size_t xsize, size_t ysize) {
@@ -49,6 +69,8 @@ class SpeedStats {
 
  private:
   std::vector<double> elapsed_;
+  std::vector<double> cpu_;  // Same size as elapsed_ if recorded, else empty.
+  size_t warmup_reps_ = 1;
   size_t xsize_ = 0;
   size_t ysize_ = 0;
 
@@ -4,11 +4,13 @@
 // license that can be found in the LICENSE file.
 
 #include <stdio.h>
+#include <string.h>
 
 #include "lib/extras/codec.h"
+#include "lib/jxl/base/thread_pool_internal.h"
 #include "lib/jxl/color_management.h"
 #include "lib/jxl/enc_color_management.h"
-#include "tools/ssimulacra.h"
+#include "lib/jxl/enc_ssimulacra.h"
 
 namespace ssimulacra {
 namespace {
@@ -33,14 +35,17 @@ int Run(int argc, char** argv) {
   }
   if (argc < input_arg + 2) return PrintUsage(argv);
 
+  jxl::ThreadPoolInternal pool(4);
   jxl::CodecInOut io1;
   jxl::CodecInOut io2;
-  JXL_CHECK(SetFromFile(argv[input_arg], jxl::extras::ColorHints(), &io1));
-  JXL_CHECK(SetFromFile(argv[input_arg + 1], jxl::extras::ColorHints(), &io2));
+  JXL_CHECK(SetFromFile(argv[input_arg], jxl::extras::ColorHints(), &io1,
+                        &pool));
+  JXL_CHECK(SetFromFile(argv[input_arg + 1], jxl::extras::ColorHints(), &io2,
+                        &pool));
   JXL_CHECK(io1.TransformTo(jxl::ColorEncoding::LinearSRGB(io1.Main().IsGray()),
-                            jxl::GetJxlCms()));
+                            jxl::GetJxlCms(), &pool));
   JXL_CHECK(io2.TransformTo(jxl::ColorEncoding::LinearSRGB(io2.Main().IsGray()),
-                            jxl::GetJxlCms()));
+                            jxl::GetJxlCms(), &pool));
 
   if (io1.xsize() != io2.xsize() || io1.ysize() != io2.ysize()) {
     fprintf(stderr, "Image size mismatch\n");
@@ -51,8 +56,8 @@ int Run(int argc, char** argv) {
     return 1;
   }
 
-  Ssimulacra ssimulacra =
-      ComputeDiff(*io1.Main().color(), *io2.Main().color(), simple);
+  const jxl::Ssimulacra ssimulacra = jxl::ComputeSsimulacra(
+      *io1.Main().color(), *io2.Main().color(), simple, &pool);
 
   if (verbose) {
     ssimulacra.PrintDetails();
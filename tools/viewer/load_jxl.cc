@@ -7,6 +7,8 @@
 
 #include <stdint.h>
 
+#include <vector>
+
 #include <QElapsedTimer>
 #include <QFile>
 
@@ -41,10 +43,64 @@ using CmsTransformUniquePtr =
     std::unique_ptr<std::remove_pointer<cmsHTRANSFORM>::type,
                     CmsTransformDeleter>;
 
+// Returns the largest downsampling factor supported by the decoder with which
+// `region` still covers `target` in at least one dimension, so that it can be
+// shown at `target` without upscaling.
+int chooseDownsampling(const QSize& region, const QSize& target) {
+  if (target.isEmpty()) return 1;
+  for (const int factor : {8, 4, 2}) {
+    if (factor * target.width() <= region.width() ||
+        factor * target.height() <= region.height()) {
+      return factor;
+    }
+  }
+  return 1;
+}
+
+QImage toQImage(const std::vector<uint16_t>& pixels, const int xsize,
+                const int ysize, const bool premultiplied) {
+  QImage result(xsize, ysize,
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+                premultiplied ? QImage::Format_RGBA64_Premultiplied
+                              : QImage::Format_RGBA64
+#else
+                premultiplied ? QImage::Format_ARGB32_Premultiplied
+                              : QImage::Format_ARGB32
+#endif
+  );
+
+  for (int y = 0; y < result.height(); ++y) {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    QRgba64* const row = reinterpret_cast<QRgba64*>(result.scanLine(y));
+#else
+    QRgb* const row = reinterpret_cast<QRgb*>(result.scanLine(y));
+#endif
+    const uint16_t* const data = pixels.data() + result.width() * y * 4;
+    for (int x = 0; x < result.width(); ++x) {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 6, 0)
+      row[x] = qRgba64(data[4 * x + 0], data[4 * x + 1], data[4 * x + 2],
+                       data[4 * x + 3])
+#if QT_VERSION < QT_VERSION_CHECK(5, 12, 0)
+                   .toArgb32()
+#endif
+          ;
+#else
+      // Qt version older than 5.6 doesn't have a qRgba64.
+      row[x] = qRgba(data[4 * x + 0] * (255.f / 65535) + .5f,
+                     data[4 * x + 1] * (255.f / 65535) + .5f,
+                     data[4 * x + 2] * (255.f / 65535) + .5f,
+                     data[4 * x + 3] * (255.f / 65535) + .5f);
+#endif
+    }
+  }
+  return result;
+}
+
 }  // namespace
 
 QImage loadJxlImage(const QString& filename, const QByteArray& targetIccProfile,
-                    qint64* elapsed_ns, bool* usedRequestedProfile) {
+                    qint64* elapsed_ns, bool* usedRequestedProfile,
+                    const JxlLoadOptions& options, JxlLoadInfo* loadInfo) {
   auto runner = JxlThreadParallelRunnerMake(
       nullptr, JxlThreadParallelRunnerDefaultNumWorkerThreads());
 
@@ -68,10 +124,17 @@ QImage loadJxlImage(const QString& filename, const QByteArray& targetIccProfile,
     }                                                                 \
   } while (false)
 
+  int events =
+      JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_FULL_IMAGE;
+  if (options.onProgress) {
+    events |= JXL_DEC_FRAME_PROGRESSION;
+    // Also after each pass, not only after the DC.
+    JxlDecoderSetProgressiveDetail(dec.get(), 1);
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSubscribeEvents(dec.get(), events));
   EXPECT_EQ(JXL_DEC_SUCCESS,
-            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO |
-                                                     JXL_DEC_COLOR_ENCODING |
-                                                     JXL_DEC_FULL_IMAGE));
+            JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                        runner.get()));
   QFile jpegXlFile(filename);
   if (!jpegXlFile.open(QIODevice::ReadOnly)) {
     return QImage();
@@ -83,13 +146,44 @@ QImage loadJxlImage(const QString& filename, const QByteArray& targetIccProfile,
 
   QElapsedTimer timer;
   timer.start();
+  // Time spent in options.onProgress, not counted as decoding time.
+  qint64 progress_ns = 0;
   const uint8_t* jxl_data = reinterpret_cast<const uint8_t*>(jpegXlData.data());
   size_t jxl_size = jpegXlData.size();
   JxlDecoderSetInput(dec.get(), jxl_data, jxl_size);
   EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec.get()));
   JxlBasicInfo info;
   EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetBasicInfo(dec.get(), &info));
-  size_t pixel_count = info.xsize * info.ysize;
+
+  const QRect imageRect(0, 0, info.xsize, info.ysize);
+  const QRect region = options.region.isNull()
+                           ? imageRect
+                           : options.region.intersected(imageRect);
+  EXPECT_TRUE(!region.isEmpty());
+  const int downsampling =
+      chooseDownsampling(region.size(), options.targetSize);
+  if (region != imageRect || downsampling != 1) {
+    // The crop region and the downsampling must be set before decoding
+    // starts, and the image size is only known now.
+    JxlDecoderRewind(dec.get());
+    if (region != imageRect) {
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetCropRegion(dec.get(), region.x(), region.y(),
+                                        region.width(), region.height()));
+    }
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetDownsampling(dec.get(), downsampling));
+    JxlDecoderSetInput(dec.get(), jxl_data, jxl_size);
+    EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec.get()));
+  }
+  if (loadInfo != nullptr) {
+    loadInfo->imageSize = imageRect.size();
+    loadInfo->region = region;
+    loadInfo->downsampling = downsampling;
+  }
+  const int xsize = (region.width() + downsampling - 1) / downsampling;
+  const int ysize = (region.height() + downsampling - 1) / downsampling;
+  const size_t pixel_count = static_cast<size_t>(xsize) * ysize;
 
   EXPECT_EQ(JXL_DEC_COLOR_ENCODING, JxlDecoderProcessInput(dec.get()));
   static const JxlPixelFormat format = {4, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN,
@@ -104,14 +198,6 @@ QImage loadJxlImage(const QString& filename, const QByteArray& targetIccProfile,
                 dec.get(), &format, JXL_COLOR_PROFILE_TARGET_DATA,
                 icc_profile.data(), icc_profile.size()));
 
-  std::vector<float> float_pixels(pixel_count * 4);
-  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
-  EXPECT_EQ(JXL_DEC_SUCCESS,
-            JxlDecoderSetImageOutBuffer(dec.get(), &format, float_pixels.data(),
-                                        pixel_count * 4 * sizeof(float)));
-  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
-
-  std::vector<uint16_t> uint16_pixels(pixel_count * 4);
   const thread_local cmsContext context = cmsCreateContext(nullptr, nullptr);
   EXPECT_TRUE(context != nullptr);
   const CmsProfileUniquePtr jxl_profile(cmsOpenProfileFromMemTHR(
@@ -130,45 +216,38 @@ QImage loadJxlImage(const QString& filename, const QByteArray& targetIccProfile,
       context, jxl_profile.get(), TYPE_RGBA_FLT, target_profile.get(),
       TYPE_RGBA_16, INTENT_RELATIVE_COLORIMETRIC, cmsFLAGS_COPY_ALPHA));
   EXPECT_TRUE(transform != nullptr);
-  cmsDoTransform(transform.get(), float_pixels.data(), uint16_pixels.data(),
-                 pixel_count);
-  if (elapsed_ns != nullptr) *elapsed_ns = timer.nsecsElapsed();
-
-  QImage result(info.xsize, info.ysize,
-#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
-                info.alpha_premultiplied ? QImage::Format_RGBA64_Premultiplied
-                                         : QImage::Format_RGBA64
-#else
-                info.alpha_premultiplied ? QImage::Format_ARGB32_Premultiplied
-                                         : QImage::Format_ARGB32
-#endif
-  );
 
-  for (int y = 0; y < result.height(); ++y) {
-#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
-    QRgba64* const row = reinterpret_cast<QRgba64*>(result.scanLine(y));
-#else
-    QRgb* const row = reinterpret_cast<QRgb*>(result.scanLine(y));
-#endif
-    const uint16_t* const data = uint16_pixels.data() + result.width() * y * 4;
-    for (int x = 0; x < result.width(); ++x) {
-#if QT_VERSION >= QT_VERSION_CHECK(5, 6, 0)
-      row[x] = qRgba64(data[4 * x + 0], data[4 * x + 1], data[4 * x + 2],
-                       data[4 * x + 3])
-#if QT_VERSION < QT_VERSION_CHECK(5, 12, 0)
-                   .toArgb32()
-#endif
-          ;
-#else
-      // Qt version older than 5.6 doesn't have a qRgba64.
-      row[x] = qRgba(data[4 * x + 0] * (255.f / 65535) + .5f,
-                     data[4 * x + 1] * (255.f / 65535) + .5f,
-                     data[4 * x + 2] * (255.f / 65535) + .5f,
-                     data[4 * x + 3] * (255.f / 65535) + .5f);
-#endif
+  std::vector<float> float_pixels(pixel_count * 4);
+  std::vector<uint16_t> uint16_pixels(pixel_count * 4);
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size));
+  EXPECT_TRUE(buffer_size == pixel_count * 4 * sizeof(float));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &format, float_pixels.data(),
+                                        buffer_size));
+  for (;;) {
+    const JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_FULL_IMAGE) break;
+    EXPECT_EQ(JXL_DEC_FRAME_PROGRESSION, status);
+    // Shows what is decoded so far, upsampled from the DC or the passes.
+    if (JxlDecoderFlushImage(dec.get()) == JXL_DEC_SUCCESS) {
+      QElapsedTimer progress_timer;
+      progress_timer.start();
+      cmsDoTransform(transform.get(), float_pixels.data(),
+                     uint16_pixels.data(), pixel_count);
+      options.onProgress(toQImage(uint16_pixels, xsize, ysize,
+                                  info.alpha_premultiplied));
+      progress_ns += progress_timer.nsecsElapsed();
     }
   }
-  return result;
+
+  cmsDoTransform(transform.get(), float_pixels.data(), uint16_pixels.data(),
+                 pixel_count);
+  if (elapsed_ns != nullptr) *elapsed_ns = timer.nsecsElapsed() - progress_ns;
+
+  return toQImage(uint16_pixels, xsize, ysize, info.alpha_premultiplied);
 }
 
 }  // namespace jxl
@@ -6,14 +6,41 @@
 #ifndef TOOLS_VIEWER_LOAD_JXL_H_
 #define TOOLS_VIEWER_LOAD_JXL_H_
 
+#include <functional>
+
 #include <QByteArray>
 #include <QImage>
+#include <QRect>
+#include <QSize>
 #include <QString>
 
 namespace jxl {
 
+struct JxlLoadOptions {
+  // Size at which the image is shown, in device pixels. The image is decoded
+  // downsampled by the largest factor, up to 8, that still keeps it at least
+  // as large as it is shown. Empty to decode at full resolution.
+  QSize targetSize;
+  // Region of the image to decode, in full resolution pixels, or null for the
+  // whole image. It is clipped to the image.
+  QRect region;
+  // If set, called with the image decoded so far after its DC and after each
+  // progressive pass, before the final image is returned.
+  std::function<void(const QImage& image)> onProgress;
+};
+
+struct JxlLoadInfo {
+  // Full resolution size of the image.
+  QSize imageSize;
+  // Region of the image that was decoded, in full resolution pixels.
+  QRect region;
+  int downsampling = 1;
+};
+
 QImage loadJxlImage(const QString& filename, const QByteArray& targetIccProfile,
-                    qint64* elapsed, bool* usedRequestedProfile = nullptr);
+                    qint64* elapsed, bool* usedRequestedProfile = nullptr,
+                    const JxlLoadOptions& options = JxlLoadOptions(),
+                    JxlLoadInfo* loadInfo = nullptr);
 
 }  // namespace jxl
 
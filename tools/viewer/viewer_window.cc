@@ -5,6 +5,8 @@
 
 #include "tools/viewer/viewer_window.h"
 
+#include <algorithm>
+
 #include <QElapsedTimer>
 #include <QFileDialog>
 #include <QFileInfo>
@@ -19,6 +21,9 @@ namespace jxl {
 
 namespace {
 
+// Zooming in stops at regions this small, in image pixels.
+constexpr int kMinZoomedSize = 16;
+
 template <typename Output>
 void recursivelyAddSubEntries(const QFileInfo& info,
                               QSet<QString>* const visited,
@@ -44,6 +49,8 @@ ViewerWindow::ViewerWindow(QWidget* const parent)
   ui_.setupUi(this);
   ui_.actionOpen->setShortcut(QKeySequence::Open);
   ui_.actionExit->setShortcut(QKeySequence::Quit);
+  ui_.actionZoomIn->setShortcut(QKeySequence::ZoomIn);
+  ui_.actionZoomOut->setShortcut(QKeySequence::ZoomOut);
 }
 
 void ViewerWindow::loadFilesAndDirectories(QStringList entries) {
@@ -58,6 +65,7 @@ void ViewerWindow::loadFilesAndDirectories(QStringList entries) {
   ui_.actionNextImage->setEnabled(several);
 
   currentFileIndex_ = 0;
+  zoomRegion_ = QRect();
   refreshImage();
 }
 
@@ -73,25 +81,87 @@ void ViewerWindow::on_actionOpen_triggered() {
 void ViewerWindow::on_actionPreviousImage_triggered() {
   currentFileIndex_ =
       (currentFileIndex_ - 1 + filenames_.size()) % filenames_.size();
+  zoomRegion_ = QRect();
   refreshImage();
 }
 
 void ViewerWindow::on_actionNextImage_triggered() {
   currentFileIndex_ = (currentFileIndex_ + 1) % filenames_.size();
+  zoomRegion_ = QRect();
+  refreshImage();
+}
+
+void ViewerWindow::on_actionZoomIn_triggered() {
+  if (imageSize_.isEmpty()) return;
+  const QRect current =
+      zoomRegion_.isNull() ? QRect(QPoint(0, 0), imageSize_) : zoomRegion_;
+  if (current.width() <= kMinZoomedSize || current.height() <= kMinZoomedSize) {
+    return;
+  }
+  QRect zoomed(0, 0, current.width() / 2, current.height() / 2);
+  zoomed.moveCenter(current.center());
+  zoomRegion_ = zoomed;
   refreshImage();
 }
 
+void ViewerWindow::on_actionZoomOut_triggered() {
+  if (zoomRegion_.isNull()) return;
+  const QRect imageRect(QPoint(0, 0), imageSize_);
+  QRect zoomed(0, 0, zoomRegion_.width() * 2, zoomRegion_.height() * 2);
+  zoomed.moveCenter(zoomRegion_.center());
+  if (zoomed.contains(imageRect)) {
+    zoomRegion_ = QRect();
+  } else {
+    // Keeps the region inside the image rather than centered.
+    zoomed.moveLeft(std::max(
+        0, std::min(zoomed.left(), imageRect.width() - zoomed.width())));
+    zoomed.moveTop(std::max(
+        0, std::min(zoomed.top(), imageRect.height() - zoomed.height())));
+    zoomRegion_ = zoomed.intersected(imageRect);
+  }
+  refreshImage();
+}
+
+QSize ViewerWindow::viewportSize() const {
+  return ui_.scrollArea->viewport()->size() * devicePixelRatio();
+}
+
+void ViewerWindow::showImage(const QImage& image) {
+  const QSize target = viewportSize();
+  QPixmap pixmap = QPixmap::fromImage(image);
+  // Zoomed-in regions are magnified to fill the window, whole images are only
+  // shrunk to fit.
+  if (!zoomRegion_.isNull() || image.width() > target.width() ||
+      image.height() > target.height()) {
+    pixmap =
+        pixmap.scaled(target, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+  }
+  pixmap.setDevicePixelRatio(devicePixelRatio());
+  ui_.image->setPixmap(pixmap);
+}
+
 void ViewerWindow::refreshImage() {
   if (currentFileIndex_ < 0 || currentFileIndex_ >= filenames_.size()) {
     return;
   }
 
+  // Decodes only what is shown, at about the resolution of the window, and
+  // shows the progressive passes as they are decoded.
+  JxlLoadOptions options;
+  options.targetSize = viewportSize();
+  options.region = zoomRegion_;
+  options.onProgress = [this](const QImage& image) {
+    showImage(image);
+    ui_.image->repaint();
+  };
   qint64 elapsed_ns;
   bool usedRequestedProfile;
+  JxlLoadInfo loadInfo;
   const QImage image =
       loadJxlImage(filenames_[currentFileIndex_], monitorProfile_, &elapsed_ns,
-                   &usedRequestedProfile);
+                   &usedRequestedProfile, options, &loadInfo);
   if (image.isNull()) {
+    imageSize_ = QSize();
     const QString message =
         tr("Failed to load \"%1\".").arg(filenames_[currentFileIndex_]);
     ui_.image->clear();
@@ -104,16 +174,28 @@ void ViewerWindow::refreshImage() {
     return;
   }
 
-  ui_.image->setPixmap(QPixmap::fromImage(image));
-  ui_.statusBar->showMessage(
+  imageSize_ = loadInfo.imageSize;
+  showImage(image);
+  QString message =
       tr("Loaded image %L1/%L2 (%3, %4×%5) in %L6ms (%L7 fps)")
           .arg(currentFileIndex_ + 1)
           .arg(filenames_.size())
           .arg(filenames_[currentFileIndex_])
-          .arg(image.width())
-          .arg(image.height())
+          .arg(imageSize_.width())
+          .arg(imageSize_.height())
           .arg(elapsed_ns / 1e6)
-          .arg(1e9 / elapsed_ns));
+          .arg(1e9 / elapsed_ns);
+  if (!zoomRegion_.isNull()) {
+    message += tr(", region %1×%2 at (%3, %4)")
+                   .arg(loadInfo.region.width())
+                   .arg(loadInfo.region.height())
+                   .arg(loadInfo.region.x())
+                   .arg(loadInfo.region.y());
+  }
+  if (loadInfo.downsampling != 1) {
+    message += tr(", downsampled 1:%1").arg(loadInfo.downsampling);
+  }
+  ui_.statusBar->showMessage(message);
 
   if (!usedRequestedProfile && !hasWarnedAboutMonitorProfile_) {
     hasWarnedAboutMonitorProfile_ = true;
@@ -7,7 +7,10 @@
 #define TOOLS_VIEWER_VIEWER_WINDOW_H_
 
 #include <QByteArray>
+#include <QImage>
 #include <QMainWindow>
+#include <QRect>
+#include <QSize>
 #include <QStringList>
 
 #include "tools/viewer/ui_viewer_window.h"
@@ -26,13 +29,23 @@ class ViewerWindow : public QMainWindow {
   void on_actionOpen_triggered();
   void on_actionPreviousImage_triggered();
   void on_actionNextImage_triggered();
+  void on_actionZoomIn_triggered();
+  void on_actionZoomOut_triggered();
   void refreshImage();
 
  private:
+  // Size of the image area in device pixels.
+  QSize viewportSize() const;
+  void showImage(const QImage& image);
+
   const QByteArray monitorProfile_;
   Ui::ViewerWindow ui_;
   QStringList filenames_;
   int currentFileIndex_ = 0;
+  // Full resolution size of the current image.
+  QSize imageSize_;
+  // Region of the current image shown in the window, null for all of it.
+  QRect zoomRegion_;
   bool hasWarnedAboutMonitorProfile_ = false;
 };
 